@@ -1,8 +1,8 @@
-packages:=boost openssl libevent zeromq
+packages:=boost openssl libevent zeromq zlib
 native_packages := native_ccache
 
 qt_native_packages = native_protobuf
-qt_packages = qrencode protobuf zlib
+qt_packages = qrencode protobuf
 
 qt_x86_64_linux_packages:=qt expat dbus libxcb xcb_proto libXau xproto freetype fontconfig libX11 xextproto libXext xtrans
 qt_i686_linux_packages:=$(qt_x86_64_linux_packages)
@@ -0,0 +1,203 @@
+#!/usr/bin/env python2
+# Copyright (c) 2019 The Dystem developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Performance regression run against regtest.
+#
+# Three wallets send bursts of transactions to each other; with the mempool
+# full, a block template is built, then the block is mined and its connect
+# time read from getblocktraces. An RPC mix that goes through the masternode,
+# payment and budget code is timed on the way, and a wallet rescan closes
+# the run. The results are compared against a stored baseline: a metric that
+# got worse by more than the threshold fails the run.
+#
+# Timings depend on the machine, so a baseline is only meaningful on the
+# machine that wrote it. Record one with --writebaseline.
+#
+
+from test_framework import BitcoinTestFramework
+from bitcoinrpc.authproxy import AuthServiceProxy, JSONRPCException
+from util import *
+import json
+import os
+import random
+import time
+
+# Whether a larger value of each metric is better, and its unit
+METRICS = {
+    "tx_accept_rate"      : (True,  "tx/s"),
+    "block_template_ms"   : (False, "ms"),
+    "connect_block_ms"    : (False, "ms"),
+    "rpc_p50_ms"          : (False, "ms"),
+    "rpc_p99_ms"          : (False, "ms"),
+    "rescan_ms"           : (False, "ms"),
+}
+
+# Calls timed for the RPC percentiles
+RPC_MIX = [
+    ("getblockcount", []),
+    ("getrawmempool", []),
+    ("getmempoolinfo", []),
+    ("getinfo", []),
+    ("getmasternodecount", []),
+    ("getmasternodewinners", []),
+    ("getbudgetinfo", []),
+    ("mnsync", ["status"]),
+]
+
+def percentile(values, p):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p / 100.0))]
+
+def median(values):
+    return percentile(values, 50)
+
+def timed_ms(func, *args):
+    start = time.time()
+    result = func(*args)
+    return (result, (time.time() - start) * 1000.0)
+
+class PerfRegressionTest(BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--baseline", dest="baseline",
+                          default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "perf_baseline.json"),
+                          help="Baseline to compare against (default: %default)")
+        parser.add_option("--writebaseline", dest="writebaseline", default=False, action="store_true",
+                          help="Store the results as the new baseline instead of comparing")
+        parser.add_option("--threshold", dest="threshold", type="float", default=25.0,
+                          help="Percent a metric may get worse than the baseline (default: %default)")
+        parser.add_option("--txcount", dest="txcount", type="int", default=100,
+                          help="Transactions each wallet sends per burst (default: %default)")
+        parser.add_option("--rounds", dest="rounds", type="int", default=5,
+                          help="Bursts, each followed by a block (default: %default)")
+        parser.add_option("--rpccalls", dest="rpccalls", type="int", default=400,
+                          help="Calls timed for the RPC percentiles (default: %default)")
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 3)
+
+    def setup_network(self):
+        args = ["-blocktraces=64"]
+        self.nodes = start_nodes(3, self.options.tmpdir, [args, args, args])
+        connect_nodes_bi(self.nodes, 0, 1)
+        connect_nodes_bi(self.nodes, 1, 2)
+        connect_nodes_bi(self.nodes, 0, 2)
+        self.is_network_split = False
+        self.sync_all()
+
+    def fund_wallets(self):
+        # Regtest mines proof of work blocks up to height 200 only, so the
+        # run has to fit in that: 20 blocks each, then enough on top to
+        # mature them, leaves room for the bursts.
+        for node in self.nodes:
+            node.setgenerate(True, 20)
+            self.sync_all()
+        self.nodes[0].setgenerate(True, 20)
+        self.sync_all()
+        assert(self.nodes[0].getblockcount() + self.options.rounds < 200)
+
+    def send_burst(self, addresses):
+        sent = 0
+        elapsed = 0.0
+        for node in self.nodes:
+            for i in range(self.options.txcount):
+                amount = Decimal(random.randint(1, 100)) / 100
+                try:
+                    (txid, ms) = timed_ms(node.sendtoaddress, random.choice(addresses), amount)
+                except JSONRPCException:
+                    # out of coins the wallet considers spendable
+                    break
+                sent += 1
+                elapsed += ms
+        return (sent, elapsed)
+
+    def time_rpc_mix(self, samples):
+        node = self.nodes[1]
+        for i in range(self.options.rpccalls):
+            (method, params) = RPC_MIX[i % len(RPC_MIX)]
+            (result, ms) = timed_ms(getattr(node, method), *params)
+            samples.append(ms)
+
+    def connect_times(self, hashes):
+        durations = []
+        for trace in self.nodes[0].getblocktraces(64):
+            if trace["hash"] not in hashes:
+                continue
+            for span in trace["spans"]:
+                if span["phase"] == "connectblock":
+                    durations.append(span["duration"] / 1000.0)
+        return durations
+
+    def run_test(self):
+        self.fund_wallets()
+        addresses = [node.getnewaddress() for node in self.nodes for i in range(10)]
+
+        sent = 0
+        send_ms = 0.0
+        template_ms = []
+        rpc_ms = []
+        mined = []
+        for r in range(self.options.rounds):
+            (n, ms) = self.send_burst(addresses)
+            sent += n
+            send_ms += ms
+            self.sync_all()
+            print("Round %d: %d transactions, mempool %d" % (r, n, len(self.nodes[0].getrawmempool())))
+
+            self.time_rpc_mix(rpc_ms)
+            for i in range(5):
+                (template, ms) = timed_ms(self.nodes[0].getblocktemplate)
+                template_ms.append(ms)
+
+            mined.extend(self.nodes[0].setgenerate(True, 1))
+            self.sync_all()
+
+        connect_ms = self.connect_times(set(mined))
+        assert(len(connect_ms) > 0)
+
+        # Rescan the whole chain for a key the wallet did not have
+        key = self.nodes[0].dumpprivkey(self.nodes[0].getnewaddress())
+        (result, rescan_ms) = timed_ms(self.nodes[2].importprivkey, key, "perf", True)
+
+        results = {
+            "tx_accept_rate"    : sent / (send_ms / 1000.0) if send_ms > 0 else 0,
+            "block_template_ms" : median(template_ms),
+            "connect_block_ms"  : median(connect_ms),
+            "rpc_p50_ms"        : percentile(rpc_ms, 50),
+            "rpc_p99_ms"        : percentile(rpc_ms, 99),
+            "rescan_ms"         : rescan_ms,
+        }
+        for name in sorted(results):
+            print("%-20s %12.3f %s" % (name, results[name], METRICS[name][1]))
+
+        if self.options.writebaseline:
+            with open(self.options.baseline, "w") as f:
+                json.dump(results, f, indent=4, sort_keys=True)
+            print("Baseline written to "+self.options.baseline)
+            return
+
+        if not os.path.isfile(self.options.baseline):
+            print("No baseline at %s, nothing to compare against" % self.options.baseline)
+            return
+
+        with open(self.options.baseline) as f:
+            baseline = json.load(f)
+        regressions = []
+        for name in sorted(results):
+            if name not in baseline or baseline[name] <= 0:
+                continue
+            (higher_is_better, unit) = METRICS[name]
+            change = (results[name] - baseline[name]) * 100.0 / baseline[name]
+            worse = -change if higher_is_better else change
+            print("%-20s %+8.1f%% against %.3f %s" % (name, change, baseline[name], unit))
+            if worse > self.options.threshold:
+                regressions.append(name)
+        if regressions:
+            raise AssertionError("Regressed by more than %.0f%%: %s" % (self.options.threshold, ", ".join(regressions)))
+
+if __name__ == '__main__':
+    PerfRegressionTest().main()
@@ -183,12 +183,17 @@ bool CActiveMasternode::SendMasternodePing(std::string& errorMessage)
         }
 
         pmn->lastPing = mnp;
-        mnodeman.mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
+        mnodeman.AddSeenPing(mnp);
 
         //mnodeman.mapSeenMasternodeBroadcast.lastPing is probably outdated, so we'll update it
         CMasternodeBroadcast mnb(*pmn);
         uint256 hash = mnb.GetHash();
-        if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) mnodeman.mapSeenMasternodeBroadcast[hash].lastPing = mnp;
+        CMasternodeBroadcast* pmnbSeen = mnodeman.mapSeenMasternodeBroadcast.Get(hash);
+        if (pmnbSeen) {
+            pmnbSeen->lastPing = mnp;
+            mnodeman.mapSeenMasternodeBroadcast.Refresh(hash, *pmnbSeen);
+            relayCache.Erase(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
+        }
 
         mnp.Relay();
 
@@ -203,6 +208,16 @@ bool CActiveMasternode::SendMasternodePing(std::string& errorMessage)
 }
 
 bool CActiveMasternode::Register(std::string strService, std::string strKeyMasternode, std::string strTxHash, std::string strOutputIndex, std::string& errorMessage)
+{
+    return RegisterEntry(strService, strKeyMasternode, strTxHash, strOutputIndex, NULL, NULL, errorMessage);
+}
+
+bool CActiveMasternode::Register(std::string strService, std::string strKeyMasternode, std::string strTxHash, std::string strOutputIndex, const MasternodeCollateralMap& mapCollaterals, std::vector<CInv>& vInvRelay, std::string& errorMessage)
+{
+    return RegisterEntry(strService, strKeyMasternode, strTxHash, strOutputIndex, &mapCollaterals, &vInvRelay, errorMessage);
+}
+
+bool CActiveMasternode::RegisterEntry(std::string strService, std::string strKeyMasternode, std::string strTxHash, std::string strOutputIndex, const MasternodeCollateralMap* pmapCollaterals, std::vector<CInv>* pvInvRelay, std::string& errorMessage)
 {
     CTxIn vin;
     CPubKey pubKeyCollateralAddress;
@@ -223,7 +238,9 @@ bool CActiveMasternode::Register(std::string strService, std::string strKeyMaste
         return false;
     }
 
-    if (!GetMasterNodeVin(vin, pubKeyCollateralAddress, keyCollateralAddress, strTxHash, strOutputIndex)) {
+    bool fCollateral = pmapCollaterals ? pwalletMain->GetMasternodeVinAndKeys(vin, pubKeyCollateralAddress, keyCollateralAddress, *pmapCollaterals, strTxHash, strOutputIndex) :
+                                         GetMasterNodeVin(vin, pubKeyCollateralAddress, keyCollateralAddress, strTxHash, strOutputIndex);
+    if (!fCollateral) {
         errorMessage = strprintf("Could not allocate vin %s:%s for masternode %s", strTxHash, strOutputIndex, strService);
         LogPrintf("CActiveMasternode::Register() - %s\n", errorMessage);
         return false;
@@ -237,10 +254,10 @@ bool CActiveMasternode::Register(std::string strService, std::string strKeyMaste
 
     addrman.Add(CAddress(service), CNetAddr("127.0.0.1"), 2 * 60 * 60);
 
-    return Register(vin, CService(strService), keyCollateralAddress, pubKeyCollateralAddress, keyMasternode, pubKeyMasternode, errorMessage);
+    return Register(vin, CService(strService), keyCollateralAddress, pubKeyCollateralAddress, keyMasternode, pubKeyMasternode, errorMessage, pvInvRelay);
 }
 
-bool CActiveMasternode::Register(CTxIn vin, CService service, CKey keyCollateralAddress, CPubKey pubKeyCollateralAddress, CKey keyMasternode, CPubKey pubKeyMasternode, std::string& errorMessage)
+bool CActiveMasternode::Register(CTxIn vin, CService service, CKey keyCollateralAddress, CPubKey pubKeyCollateralAddress, CKey keyMasternode, CPubKey pubKeyMasternode, std::string& errorMessage, std::vector<CInv>* pvInvRelay)
 {
     CMasternodeBroadcast mnb;
     CMasternodePing mnp(vin);
@@ -249,7 +266,7 @@ bool CActiveMasternode::Register(CTxIn vin, CService service, CKey keyCollateral
         LogPrintf("CActiveMasternode::Register() -  %s\n", errorMessage);
         return false;
     }
-    mnodeman.mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
+    mnodeman.AddSeenPing(mnp);
 
     LogPrintf("CActiveMasternode::Register() - Adding to Masternode list\n    service: %s\n    vin: %s\n", service.ToString(), vin.ToString());
     mnb = CMasternodeBroadcast(service, vin, pubKeyCollateralAddress, pubKeyMasternode, PROTOCOL_VERSION);
@@ -259,7 +276,7 @@ bool CActiveMasternode::Register(CTxIn vin, CService service, CKey keyCollateral
         LogPrintf("CActiveMasternode::Register() - %s\n", errorMessage);
         return false;
     }
-    mnodeman.mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
+    mnodeman.mapSeenMasternodeBroadcast.Insert(mnb.GetHash(), mnb);
     masternodeSync.AddedMasternodeList(mnb.GetHash());
 
     CMasternode* pmn = mnodeman.Find(vin);
@@ -267,12 +284,15 @@ bool CActiveMasternode::Register(CTxIn vin, CService service, CKey keyCollateral
         CMasternode mn(mnb);
         mnodeman.Add(mn);
     } else {
-        pmn->UpdateFromNewBroadcast(mnb);
+        mnodeman.UpdateFromNewBroadcast(pmn, mnb);
     }
 
     //send to all peers
     LogPrintf("CActiveMasternode::Register() - RelayElectionEntry vin = %s\n", vin.ToString());
-    mnb.Relay();
+    if (pvInvRelay)
+        pvInvRelay->push_back(CInv(MSG_MASTERNODE_ANNOUNCE, mnb.GetHash()));
+    else
+        mnb.Relay();
 
     return true;
 }
@@ -29,8 +29,11 @@ private:
     /// Ping Masternode
     bool SendMasternodePing(std::string& errorMessage);
 
-    /// Register any Masternode
-    bool Register(CTxIn vin, CService service, CKey key, CPubKey pubKey, CKey keyMasternode, CPubKey pubKeyMasternode, std::string& errorMessage);
+    /// Register any Masternode, its broadcast queued to *pvInvRelay instead of relayed when given
+    bool Register(CTxIn vin, CService service, CKey key, CPubKey pubKey, CKey keyMasternode, CPubKey pubKeyMasternode, std::string& errorMessage, std::vector<CInv>* pvInvRelay = NULL);
+
+    /// Register remote Masternode, with the collateral from *pmapCollaterals and the broadcast queued to *pvInvRelay when given
+    bool RegisterEntry(std::string strService, std::string strKey, std::string strTxHash, std::string strOutputIndex, const MasternodeCollateralMap* pmapCollaterals, std::vector<CInv>* pvInvRelay, std::string& errorMessage);
 
     /// Get 5000 DTEM input that can be used for the Masternode
     bool GetMasterNodeVin(CTxIn& vin, CPubKey& pubkey, CKey& secretKey, std::string strTxHash, std::string strOutputIndex);
@@ -59,6 +62,8 @@ public:
 
     /// Register remote Masternode
     bool Register(std::string strService, std::string strKey, std::string strTxHash, std::string strOutputIndex, std::string& errorMessage);
+    /// The same for many of them: the collateral is looked up in mapCollaterals, under cs_wallet, and the broadcast queued to vInvRelay
+    bool Register(std::string strService, std::string strKey, std::string strTxHash, std::string strOutputIndex, const MasternodeCollateralMap& mapCollaterals, std::vector<CInv>& vInvRelay, std::string& errorMessage);
 
     /// Get 5000 DTEM input that can be used for the Masternode
     bool GetMasterNodeVin(CTxIn& vin, CPubKey& pubkey, CKey& secretKey);
@@ -0,0 +1,261 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ADDRESSINDEX_H
+#define BITCOIN_ADDRESSINDEX_H
+
+#include "amount.h"
+#include "crypto/common.h"
+#include "script/script.h"
+#include "serialize.h"
+#include "uint256.h"
+
+/**
+ * Keys and values of the optional explorer indexes in the block tree database
+ * (-addressindex, -spentindex, -timestampindex). Numbers that keys sort by are
+ * serialized big-endian, so that LevelDB iterates them in order.
+ */
+
+/** Address types in the address index, the numbers are also used in RPC results */
+enum AddressIndexType {
+    ADDRESS_INDEX_NONE = 0,
+    ADDRESS_INDEX_PUBKEYHASH = 1,
+    ADDRESS_INDEX_SCRIPTHASH = 2,
+};
+
+template <typename Stream>
+inline void WriteIndexBE32(Stream& s, uint32_t n)
+{
+    unsigned char vch[4];
+    WriteBE32(vch, n);
+    s.write((const char*)vch, sizeof(vch));
+}
+
+template <typename Stream>
+inline uint32_t ReadIndexBE32(Stream& s)
+{
+    unsigned char vch[4];
+    s.read((char*)vch, sizeof(vch));
+    return ReadBE32(vch);
+}
+
+/** Prefix of the address index keys of one address, from a given height on if nBlockHeight is set */
+struct CAddressIndexIteratorKey {
+    unsigned char type;
+    uint160 hashBytes;
+    bool fHeight;
+    int nBlockHeight;
+
+    CAddressIndexIteratorKey(unsigned char typeIn, const uint160& hashBytesIn) : type(typeIn), hashBytes(hashBytesIn), fHeight(false), nBlockHeight(0) {}
+    CAddressIndexIteratorKey(unsigned char typeIn, const uint160& hashBytesIn, int nBlockHeightIn) : type(typeIn), hashBytes(hashBytesIn), fHeight(true), nBlockHeight(nBlockHeightIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 21 + (fHeight ? 4 : 0);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, type, nType, nVersion);
+        ::Serialize(s, hashBytes, nType, nVersion);
+        if (fHeight)
+            WriteIndexBE32(s, nBlockHeight);
+    }
+};
+
+/** Address index entry: an output paid to the address, or an input spending one of its outputs */
+struct CAddressIndexKey {
+    unsigned char type;
+    uint160 hashBytes;
+    int nBlockHeight;
+    unsigned int nTxIndex;
+    uint256 txhash;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CAddressIndexKey() : type(ADDRESS_INDEX_NONE), nBlockHeight(0), nTxIndex(0), nIndex(0), fSpending(false) {}
+    CAddressIndexKey(unsigned char typeIn, const uint160& hashBytesIn, int nBlockHeightIn, unsigned int nTxIndexIn, const uint256& txhashIn, unsigned int nIndexIn, bool fSpendingIn)
+        : type(typeIn), hashBytes(hashBytesIn), nBlockHeight(nBlockHeightIn), nTxIndex(nTxIndexIn), txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + 4 + 4 + 32 + 4 + 1;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, type, nType, nVersion);
+        ::Serialize(s, hashBytes, nType, nVersion);
+        WriteIndexBE32(s, nBlockHeight);
+        WriteIndexBE32(s, nTxIndex);
+        ::Serialize(s, txhash, nType, nVersion);
+        WriteIndexBE32(s, nIndex);
+        ::Serialize(s, fSpending, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, type, nType, nVersion);
+        ::Unserialize(s, hashBytes, nType, nVersion);
+        nBlockHeight = ReadIndexBE32(s);
+        nTxIndex = ReadIndexBE32(s);
+        ::Unserialize(s, txhash, nType, nVersion);
+        nIndex = ReadIndexBE32(s);
+        ::Unserialize(s, fSpending, nType, nVersion);
+    }
+};
+
+/** Address unspent index key: an unspent output paid to the address */
+struct CAddressUnspentKey {
+    unsigned char type;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    CAddressUnspentKey() : type(ADDRESS_INDEX_NONE), nIndex(0) {}
+    CAddressUnspentKey(unsigned char typeIn, const uint160& hashBytesIn, const uint256& txhashIn, unsigned int nIndexIn)
+        : type(typeIn), hashBytes(hashBytesIn), txhash(txhashIn), nIndex(nIndexIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 20 + 32 + 4;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, type, nType, nVersion);
+        ::Serialize(s, hashBytes, nType, nVersion);
+        ::Serialize(s, txhash, nType, nVersion);
+        WriteIndexBE32(s, nIndex);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, type, nType, nVersion);
+        ::Unserialize(s, hashBytes, nType, nVersion);
+        ::Unserialize(s, txhash, nType, nVersion);
+        nIndex = ReadIndexBE32(s);
+    }
+};
+
+/** Address unspent index value. A null value erases the entry. */
+struct CAddressUnspentValue {
+    CAmount nValue;
+    CScript script;
+    int nBlockHeight;
+
+    CAddressUnspentValue() { SetNull(); }
+    CAddressUnspentValue(CAmount nValueIn, const CScript& scriptIn, int nBlockHeightIn) : nValue(nValueIn), script(scriptIn), nBlockHeight(nBlockHeightIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nValue);
+        READWRITE(script);
+        READWRITE(nBlockHeight);
+    }
+
+    void SetNull()
+    {
+        nValue = -1;
+        script.clear();
+        nBlockHeight = 0;
+    }
+
+    bool IsNull() const { return nValue == -1; }
+};
+
+/** Spent index key: an output */
+struct CSpentIndexKey {
+    uint256 txid;
+    unsigned int nOutputIndex;
+
+    CSpentIndexKey() : nOutputIndex(0) {}
+    CSpentIndexKey(const uint256& txidIn, unsigned int nOutputIndexIn) : txid(txidIn), nOutputIndex(nOutputIndexIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txid);
+        READWRITE(nOutputIndex);
+    }
+};
+
+/** Spent index value: the input that spent the output. A null value erases the entry. */
+struct CSpentIndexValue {
+    uint256 txid;
+    unsigned int nInputIndex;
+    int nBlockHeight;
+    CAmount nValue;
+    int addressType;
+    uint160 addressHash;
+
+    CSpentIndexValue() { SetNull(); }
+    CSpentIndexValue(const uint256& txidIn, unsigned int nInputIndexIn, int nBlockHeightIn, CAmount nValueIn, int addressTypeIn, const uint160& addressHashIn)
+        : txid(txidIn), nInputIndex(nInputIndexIn), nBlockHeight(nBlockHeightIn), nValue(nValueIn), addressType(addressTypeIn), addressHash(addressHashIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(txid);
+        READWRITE(nInputIndex);
+        READWRITE(nBlockHeight);
+        READWRITE(nValue);
+        READWRITE(addressType);
+        READWRITE(addressHash);
+    }
+
+    void SetNull()
+    {
+        txid = 0;
+        nInputIndex = 0;
+        nBlockHeight = 0;
+        nValue = 0;
+        addressType = ADDRESS_INDEX_NONE;
+        addressHash = 0;
+    }
+
+    bool IsNull() const { return txid == 0; }
+};
+
+/** Timestamp index key: a block by its time */
+struct CTimestampIndexKey {
+    unsigned int nTimestamp;
+    uint256 blockHash;
+
+    CTimestampIndexKey() : nTimestamp(0) {}
+    CTimestampIndexKey(unsigned int nTimestampIn, const uint256& blockHashIn) : nTimestamp(nTimestampIn), blockHash(blockHashIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 4 + 32;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteIndexBE32(s, nTimestamp);
+        ::Serialize(s, blockHash, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        nTimestamp = ReadIndexBE32(s);
+        ::Unserialize(s, blockHash, nType, nVersion);
+    }
+};
+
+#endif // BITCOIN_ADDRESSINDEX_H
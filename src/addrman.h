@@ -5,6 +5,7 @@
 #ifndef BITCOIN_ADDRMAN_H
 #define BITCOIN_ADDRMAN_H
 
+#include "hash.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -12,11 +13,14 @@
 #include "timedata.h"
 #include "util.h"
 
+#include <limits>
 #include <map>
 #include <set>
 #include <stdint.h>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 /** 
  * Extended statistics about a CAddress 
  */
@@ -162,6 +166,28 @@ public:
 //! the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+/**
+ * Salted SipHash of the IP of a CNetAddr, so that peers cannot pick addresses
+ * that collide in the reverse index of CAddrMan
+ */
+class CNetAddrHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CNetAddrHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+    size_t operator()(const CNetAddr& addr) const
+    {
+        uint256 val;
+        unsigned char* p = val.begin();
+        for (int i = 0; i < 16; i++)
+            p[i] = addr.GetByte(15 - i);
+        return SipHashUint256(k0, k1, val);
+    }
+};
+
 /** 
  * Stochastical (IP) address manager 
  */
@@ -174,14 +200,14 @@ private:
     //! secret key to randomize bucket select with
     uint256 nKey;
 
-    //! last used nId
-    int nIdCount;
+    //! table with information about all nIds, indexed by nId (free entries have nRandomPos -1)
+    std::vector<CAddrInfo> vInfo;
 
-    //! table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    //! nIds of the free entries of vInfo, reused before it grows
+    std::vector<int> vFreeIds;
 
     //! find an nId based on its network address
-    std::map<CNetAddr, int> mapAddr;
+    boost::unordered_map<CNetAddr, int, CNetAddrHasher> mapAddr;
 
     //! randomly-ordered vector of all nIds
     std::vector<int> vRandom;
@@ -198,7 +224,23 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! the occupied positions (bucket * ADDRMAN_BUCKET_SIZE + position) of vvTried and vvNew, packed, so that Select_ draws from them directly
+    std::vector<int> vTriedUsed;
+    std::vector<int> vNewUsed;
+
+    //! where each position of vvTried and vvNew is in vTriedUsed and vNewUsed, or -1 if it is empty
+    int vvTriedUsedPos[ADDRMAN_TRIED_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+    int vvNewUsedPos[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+
 protected:
+    //! Whether nId is an entry of vInfo in use.
+    bool IsUsed(int nId) const { return nId >= 0 && (size_t)nId < vInfo.size() && vInfo[nId].nRandomPos != -1; }
+
+    //! Set a position of a bucket table, nId -1 clearing it, and keep the packed list of its occupied positions.
+    static void SetPosition(int* pTable, int* pUsedPos, std::vector<int>& vUsed, int nPos, int nId);
+    void SetTried(int nBucket, int nBucketPos, int nId) { SetPosition(&vvTried[0][0], &vvTriedUsedPos[0][0], vTriedUsed, nBucket * ADDRMAN_BUCKET_SIZE + nBucketPos, nId); }
+    void SetNew(int nBucket, int nBucketPos, int nId) { SetPosition(&vvNew[0][0], &vvNewUsedPos[0][0], vNewUsed, nBucket * ADDRMAN_BUCKET_SIZE + nBucketPos, nId); }
+
     //! Find an entry.
     CAddrInfo* Find(const CNetAddr& addr, int* pnId = NULL);
 
@@ -286,20 +328,20 @@ public:
 
         int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT ^ (1 << 30);
         s << nUBuckets;
-        std::map<int, int> mapUnkIds;
+        std::vector<int> vUnkIds(vInfo.size(), -1);
         int nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            mapUnkIds[(*it).first] = nIds;
-            const CAddrInfo& info = (*it).second;
+        for (size_t nId = 0; nId < vInfo.size(); nId++) {
+            const CAddrInfo& info = vInfo[nId];
             if (info.nRefCount) {
                 assert(nIds != nNew); // this means nNew was wrong, oh ow
+                vUnkIds[nId] = nIds;
                 s << info;
                 nIds++;
             }
         }
         nIds = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
-            const CAddrInfo& info = (*it).second;
+        for (size_t nId = 0; nId < vInfo.size(); nId++) {
+            const CAddrInfo& info = vInfo[nId];
             if (info.fInTried) {
                 assert(nIds != nTried); // this means nTried was wrong, oh ow
                 s << info;
@@ -315,7 +357,7 @@ public:
             s << nSize;
             for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
                 if (vvNew[bucket][i] != -1) {
-                    int nIndex = mapUnkIds[vvNew[bucket][i]];
+                    int nIndex = vUnkIds[vvNew[bucket][i]];
                     s << nIndex;
                 }
             }
@@ -345,7 +387,8 @@ public:
 
         // Deserialize entries from the new table.
         for (int n = 0; n < nNew; n++) {
-            CAddrInfo& info = mapInfo[n];
+            vInfo.push_back(CAddrInfo());
+            CAddrInfo& info = vInfo.back();
             s >> info;
             mapAddr[info] = n;
             info.nRandomPos = vRandom.size();
@@ -356,12 +399,11 @@ public:
                 int nUBucket = info.GetNewBucket(nKey);
                 int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
                 if (vvNew[nUBucket][nUBucketPos] == -1) {
-                    vvNew[nUBucket][nUBucketPos] = n;
+                    SetNew(nUBucket, nUBucketPos, n);
                     info.nRefCount++;
                 }
             }
         }
-        nIdCount = nNew;
 
         // Deserialize entries from the tried table.
         int nLost = 0;
@@ -371,13 +413,13 @@ public:
             int nKBucket = info.GetTriedBucket(nKey);
             int nKBucketPos = info.GetBucketPosition(nKey, false, nKBucket);
             if (vvTried[nKBucket][nKBucketPos] == -1) {
+                int nId = vInfo.size();
                 info.nRandomPos = vRandom.size();
                 info.fInTried = true;
-                vRandom.push_back(nIdCount);
-                mapInfo[nIdCount] = info;
-                mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
-                nIdCount++;
+                vRandom.push_back(nId);
+                vInfo.push_back(info);
+                mapAddr[info] = nId;
+                SetTried(nKBucket, nKBucketPos, nId);
             } else {
                 nLost++;
             }
@@ -392,11 +434,11 @@ public:
                 int nIndex = 0;
                 s >> nIndex;
                 if (nIndex >= 0 && nIndex < nNew) {
-                    CAddrInfo& info = mapInfo[nIndex];
+                    CAddrInfo& info = vInfo[nIndex];
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
-                        vvNew[bucket][nUBucketPos] = nIndex;
+                        SetNew(bucket, nUBucketPos, nIndex);
                     }
                 }
             }
@@ -404,13 +446,10 @@ public:
 
         // Prune new entries with refcount 0 (as a result of collisions).
         int nLostUnk = 0;
-        for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end();) {
-            if (it->second.fInTried == false && it->second.nRefCount == 0) {
-                std::map<int, CAddrInfo>::const_iterator itCopy = it++;
-                Delete(itCopy->first);
+        for (int nId = 0; nId < nNew; nId++) {
+            if (IsUsed(nId) && vInfo[nId].fInTried == false && vInfo[nId].nRefCount == 0) {
+                Delete(nId);
                 nLostUnk++;
-            } else {
-                it++;
             }
         }
         if (nLost + nLostUnk > 0) {
@@ -427,20 +466,27 @@ public:
 
     void Clear()
     {
+        LOCK(cs);
         std::vector<int>().swap(vRandom);
+        std::vector<CAddrInfo>().swap(vInfo);
+        std::vector<int>().swap(vFreeIds);
+        mapAddr.clear();
         nKey = GetRandHash();
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvNew[bucket][entry] = -1;
+                vvNewUsedPos[bucket][entry] = -1;
             }
         }
         for (size_t bucket = 0; bucket < ADDRMAN_TRIED_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
                 vvTried[bucket][entry] = -1;
+                vvTriedUsedPos[bucket][entry] = -1;
             }
         }
+        std::vector<int>().swap(vNewUsed);
+        std::vector<int>().swap(vTriedUsed);
 
-        nIdCount = 0;
         nTried = 0;
         nNew = 0;
     }
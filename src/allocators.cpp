@@ -21,11 +21,14 @@
 #else
 #include <limits.h> // for PAGESIZE
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <unistd.h> // for sysconf
 #endif
 
-LockedPageManager* LockedPageManager::_instance = NULL;
-boost::once_flag LockedPageManager::init_flag = BOOST_ONCE_INIT;
+#include <limits>
+
+LockedPool* LockedPool::_instance = NULL;
+boost::once_flag LockedPool::init_flag = BOOST_ONCE_INIT;
 
 /** Determine system page size in bytes */
 static inline size_t GetSystemPageSize()
@@ -43,24 +46,52 @@ static inline size_t GetSystemPageSize()
     return page_size;
 }
 
-bool MemoryPageLocker::Lock(const void* addr, size_t len)
+void* LockedPageAllocator::AllocateLocked(size_t len, bool& fLocked)
 {
 #ifdef WIN32
-    return VirtualLock(const_cast<void*>(addr), len) != 0;
+    void* addr = VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (addr == NULL)
+        return NULL;
+    fLocked = VirtualLock(addr, len) != 0;
 #else
-    return mlock(addr, len) == 0;
+    void* addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    fLocked = mlock(addr, len) == 0;
+#ifdef MADV_DONTDUMP
+    // Keep the secrets out of core dumps too
+    madvise(addr, len, MADV_DONTDUMP);
+#endif
 #endif
+    return addr;
 }
 
-bool MemoryPageLocker::Unlock(const void* addr, size_t len)
+void LockedPageAllocator::FreeLocked(void* addr, size_t len, bool fLocked)
 {
+    OPENSSL_cleanse(addr, len);
 #ifdef WIN32
-    return VirtualUnlock(const_cast<void*>(addr), len) != 0;
+    if (fLocked)
+        VirtualUnlock(addr, len);
+    VirtualFree(addr, 0, MEM_RELEASE);
 #else
-    return munlock(addr, len) == 0;
+    if (fLocked)
+        munlock(addr, len);
+    munmap(addr, len);
+#endif
+}
+
+size_t LockedPageAllocator::GetLimit()
+{
+#ifndef WIN32
+#ifdef RLIMIT_MEMLOCK
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_MEMLOCK, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY)
+        return rlim.rlim_cur;
+#endif
 #endif
+    return std::numeric_limits<size_t>::max();
 }
 
-LockedPageManager::LockedPageManager() : LockedPageManagerBase<MemoryPageLocker>(GetSystemPageSize())
+LockedPool::LockedPool() : LockedPoolBase<LockedPageAllocator>(GetSystemPageSize())
 {
 }
@@ -6,7 +6,10 @@
 #ifndef BITCOIN_ALLOCATORS_H
 #define BITCOIN_ALLOCATORS_H
 
+#include <algorithm>
+#include <assert.h>
 #include <map>
+#include <new>
 #include <string.h>
 #include <string>
 #include <vector>
@@ -17,169 +20,257 @@
 #include <openssl/crypto.h> // for OPENSSL_cleanse()
 
 /**
- * Thread-safe class to keep track of locked (ie, non-swappable) memory pages.
+ * Thread-safe pool of locked (ie, non-swappable) memory for keys and other
+ * secrets.
  *
- * Memory locks do not stack, that is, pages which have been locked several times by calls to mlock()
- * will be unlocked by a single call to munlock(). This can result in keying material ending up in swap when
- * those functions are used naively. This class simulates stacking memory locks by keeping a counter per page.
+ * Locking memory page by page as objects come and go costs a system call and
+ * a map update per object, and memory locks do not stack, so pages shared by
+ * several objects need counting. Instead the pool locks whole arenas of
+ * ARENA_SIZE once and carves blocks out of them, the size of each rounded up
+ * to a power of two from MIN_BLOCK. Freed blocks are wiped and kept on one
+ * free list per size for the next allocation of that size; arenas stay
+ * locked until the pool is destroyed. Allocations larger than MAX_BLOCK get
+ * a locked region of their own.
  *
- * @note By using a map from each page base address to lock count, this class is optimized for
- * small objects that span up to a few pages, mostly smaller than a page. To support large allocations,
- * something like an interval tree would be the preferred data structure.
+ * The first arena is no larger than the system lets a process lock
+ * (RLIMIT_MEMLOCK), so the first secrets are locked even with a small limit.
+ * Arenas the system refuses to lock are still used, see Stats::locked.
+ *
+ * PageAllocator is a policy class to make stubbing for tests possible.
  */
-template <class Locker>
-class LockedPageManagerBase
+template <class PageAllocator>
+class LockedPoolBase
 {
 public:
-    LockedPageManagerBase(size_t page_size) : page_size(page_size)
+    static const size_t ARENA_SIZE = 256 * 1024;
+    //! Smallest block and the alignment of all blocks
+    static const size_t MIN_BLOCK = 16;
+    static const size_t MAX_BLOCK = 64 * 1024;
+
+    struct Stats {
+        //! Bytes of the blocks in use, and of the free ones and the unused space of the arenas
+        size_t used;
+        size_t free;
+        //! Bytes of the locked regions, and how many of them the system locked
+        size_t total;
+        size_t locked;
+        size_t chunks_used;
+        size_t chunks_free;
+    };
+
+    LockedPoolBase(size_t page_size) : page_size(page_size), pchAvail(NULL), pchEnd(NULL), nUsed(0), nChunksUsed(0), nFreeBytes(0), nChunksFree(0)
     {
-        // Determine bitmask for extracting page from address
         assert(!(page_size & (page_size - 1))); // size must be power of two
-        page_mask = ~(page_size - 1);
+        for (size_t i = 0; i < NUM_CLASSES; i++)
+            vFreeLists[i] = NULL;
     }
 
-    ~LockedPageManagerBase()
+    ~LockedPoolBase()
     {
+        for (size_t i = 0; i < vRegions.size(); i++)
+            allocator.FreeLocked(vRegions[i].pch, vRegions[i].nSize, vRegions[i].fLocked);
+        for (typename std::map<void*, Region>::iterator it = mapLarge.begin(); it != mapLarge.end(); ++it)
+            allocator.FreeLocked(it->second.pch, it->second.nSize, it->second.fLocked);
     }
 
+    //! NULL if the system has no memory left
+    void* Allocate(size_t size)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        if (size == 0)
+            size = 1;
+        if (size > MAX_BLOCK) {
+            Region region;
+            region.nSize = RoundToPages(size);
+            region.pch = static_cast<char*>(allocator.AllocateLocked(region.nSize, region.fLocked));
+            if (region.pch == NULL)
+                return NULL;
+            mapLarge[region.pch] = region;
+            nUsed += region.nSize;
+            nChunksUsed++;
+            return region.pch;
+        }
+
+        size_t nClass = SizeClass(size);
+        size_t nBlock = MIN_BLOCK << nClass;
+        void* p = vFreeLists[nClass];
+        if (p != NULL) {
+            vFreeLists[nClass] = *static_cast<void**>(p);
+            *static_cast<void**>(p) = NULL;
+            nFreeBytes -= nBlock;
+            nChunksFree--;
+        } else {
+            if ((size_t)(pchEnd - pchAvail) < nBlock && !NewArena(nBlock))
+                return NULL;
+            p = pchAvail;
+            pchAvail += nBlock;
+        }
+        nUsed += nBlock;
+        nChunksUsed++;
+        return p;
+    }
 
-    // For all pages in affected range, increase lock count
-    void LockRange(void* p, size_t size)
+    //! Wipe and free a block of Allocate(size)
+    void Free(void* p, size_t size)
     {
+        if (p == NULL)
+            return;
+        OPENSSL_cleanse(p, size);
         boost::mutex::scoped_lock lock(mutex);
-        if (!size)
+        if (size > MAX_BLOCK) {
+            typename std::map<void*, Region>::iterator it = mapLarge.find(p);
+            assert(it != mapLarge.end()); // Cannot free what was not allocated here
+            nUsed -= it->second.nSize;
+            nChunksUsed--;
+            allocator.FreeLocked(it->second.pch, it->second.nSize, it->second.fLocked);
+            mapLarge.erase(it);
             return;
-        const size_t base_addr = reinterpret_cast<size_t>(p);
-        const size_t start_page = base_addr & page_mask;
-        const size_t end_page = (base_addr + size - 1) & page_mask;
-        for (size_t page = start_page; page <= end_page; page += page_size) {
-            Histogram::iterator it = histogram.find(page);
-            if (it == histogram.end()) // Newly locked page
-            {
-                locker.Lock(reinterpret_cast<void*>(page), page_size);
-                histogram.insert(std::make_pair(page, 1));
-            } else // Page was already locked; increase counter
-            {
-                it->second += 1;
-            }
         }
+        if (size == 0)
+            size = 1;
+        size_t nClass = SizeClass(size);
+        size_t nBlock = MIN_BLOCK << nClass;
+        *static_cast<void**>(p) = vFreeLists[nClass];
+        vFreeLists[nClass] = p;
+        nUsed -= nBlock;
+        nChunksUsed--;
+        nFreeBytes += nBlock;
+        nChunksFree++;
     }
 
-    // For all pages in affected range, decrease lock count
-    void UnlockRange(void* p, size_t size)
+    Stats GetStats()
     {
         boost::mutex::scoped_lock lock(mutex);
-        if (!size)
-            return;
-        const size_t base_addr = reinterpret_cast<size_t>(p);
-        const size_t start_page = base_addr & page_mask;
-        const size_t end_page = (base_addr + size - 1) & page_mask;
-        for (size_t page = start_page; page <= end_page; page += page_size) {
-            Histogram::iterator it = histogram.find(page);
-            assert(it != histogram.end()); // Cannot unlock an area that was not locked
-            // Decrease counter for page, when it is zero, the page will be unlocked
-            it->second -= 1;
-            if (it->second == 0) // Nothing on the page anymore that keeps it locked
-            {
-                // Unlock page and remove the count from histogram
-                locker.Unlock(reinterpret_cast<void*>(page), page_size);
-                histogram.erase(it);
-            }
+        Stats stats;
+        stats.used = nUsed;
+        stats.free = nFreeBytes + (pchEnd - pchAvail);
+        stats.total = 0;
+        stats.locked = 0;
+        for (size_t i = 0; i < vRegions.size(); i++) {
+            stats.total += vRegions[i].nSize;
+            if (vRegions[i].fLocked)
+                stats.locked += vRegions[i].nSize;
+        }
+        for (typename std::map<void*, Region>::const_iterator it = mapLarge.begin(); it != mapLarge.end(); ++it) {
+            stats.total += it->second.nSize;
+            if (it->second.fLocked)
+                stats.locked += it->second.nSize;
         }
+        stats.chunks_used = nChunksUsed;
+        stats.chunks_free = nChunksFree;
+        return stats;
     }
 
-    // Get number of locked pages for diagnostics
-    int GetLockedPageCount()
+    //! Number of arenas, for diagnostics
+    size_t GetArenaCount()
     {
         boost::mutex::scoped_lock lock(mutex);
-        return histogram.size();
+        return vRegions.size();
     }
 
 private:
-    Locker locker;
+    struct Region {
+        char* pch;
+        size_t nSize;
+        bool fLocked;
+    };
+
+    //! Block sizes MIN_BLOCK, 2 * MIN_BLOCK, ... MAX_BLOCK
+    static const size_t NUM_CLASSES = 13;
+    static_assert((MIN_BLOCK << (NUM_CLASSES - 1)) == MAX_BLOCK, "the size classes must end at MAX_BLOCK");
+
+    PageAllocator allocator;
     boost::mutex mutex;
-    size_t page_size, page_mask;
-    // map of page base address to lock count
-    typedef std::map<size_t, int> Histogram;
-    Histogram histogram;
-};
+    size_t page_size;
+    std::vector<Region> vRegions;
+    std::map<void*, Region> mapLarge;
+    void* vFreeLists[NUM_CLASSES];
+    char* pchAvail;
+    char* pchEnd;
+    size_t nUsed, nChunksUsed, nFreeBytes, nChunksFree;
 
+    static size_t SizeClass(size_t size)
+    {
+        size_t nClass = 0;
+        while ((MIN_BLOCK << nClass) < size)
+            nClass++;
+        return nClass;
+    }
+
+    size_t RoundToPages(size_t size) const { return (size + page_size - 1) & ~(page_size - 1); }
+
+    bool NewArena(size_t nBlock)
+    {
+        size_t nSize = ARENA_SIZE;
+        if (vRegions.empty())
+            nSize = std::min(nSize, allocator.GetLimit() & ~(page_size - 1));
+        nSize = std::max(nSize, RoundToPages(nBlock));
+        Region region;
+        region.nSize = nSize;
+        region.pch = static_cast<char*>(allocator.AllocateLocked(nSize, region.fLocked));
+        if (region.pch == NULL)
+            return false;
+        vRegions.push_back(region);
+        // The tail of the old arena is too small for this block and stays unused
+        pchAvail = region.pch;
+        pchEnd = region.pch + nSize;
+        return true;
+    }
+};
 
 /**
- * OS-dependent memory page locking/unlocking.
+ * OS-dependent allocation of locked memory pages.
  * Defined as policy class to make stubbing for test possible.
  */
-class MemoryPageLocker
+class LockedPageAllocator
 {
 public:
-    /** Lock memory pages.
-     * addr and len must be a multiple of the system page size
-     */
-    bool Lock(const void* addr, size_t len);
-    /** Unlock memory pages.
-     * addr and len must be a multiple of the system page size
-     */
-    bool Unlock(const void* addr, size_t len);
+    /** Allocate len bytes of pages and lock them; fLocked tells whether locking worked */
+    void* AllocateLocked(size_t len, bool& fLocked);
+    /** Unlock and free pages of AllocateLocked */
+    void FreeLocked(void* addr, size_t len, bool fLocked);
+    /** The bytes a process may lock, or the largest size_t if there is no limit */
+    size_t GetLimit();
 };
 
 /**
- * Singleton class to keep track of locked (ie, non-swappable) memory pages, for use in
- * std::allocator templates.
+ * Singleton pool of locked memory for secure_allocator.
  *
  * Some implementations of the STL allocate memory in some constructors (i.e., see
  * MSVC's vector<T> implementation where it allocates 1 byte of memory in the allocator.)
  * Due to the unpredictable order of static initializers, we have to make sure the
- * LockedPageManager instance exists before any other STL-based objects that use
- * secure_allocator are created. So instead of having LockedPageManager also be
+ * LockedPool instance exists before any other STL-based objects that use
+ * secure_allocator are created. So instead of having LockedPool also be
  * static-initialized, it is created on demand.
  */
-class LockedPageManager : public LockedPageManagerBase<MemoryPageLocker>
+class LockedPool : public LockedPoolBase<LockedPageAllocator>
 {
 public:
-    static LockedPageManager& Instance()
+    static LockedPool& Instance()
     {
-        boost::call_once(LockedPageManager::CreateInstance, LockedPageManager::init_flag);
-        return *LockedPageManager::_instance;
+        boost::call_once(LockedPool::CreateInstance, LockedPool::init_flag);
+        return *LockedPool::_instance;
     }
 
 private:
-    LockedPageManager();
+    LockedPool();
 
     static void CreateInstance()
     {
         // Using a local static instance guarantees that the object is initialized
         // when it's first needed and also deinitialized after all objects that use
-        // it are done with it.  I can think of one unlikely scenario where we may
-        // have a static deinitialization order/problem, but the check in
-        // LockedPageManagerBase's destructor helps us detect if that ever happens.
-        static LockedPageManager instance;
-        LockedPageManager::_instance = &instance;
+        // it are done with it.
+        static LockedPool instance;
+        LockedPool::_instance = &instance;
     }
 
-    static LockedPageManager* _instance;
+    static LockedPool* _instance;
     static boost::once_flag init_flag;
 };
 
 //
-// Functions for directly locking/unlocking memory objects.
-// Intended for non-dynamically allocated structures.
-//
-template <typename T>
-void LockObject(const T& t)
-{
-    LockedPageManager::Instance().LockRange((void*)(&t), sizeof(T));
-}
-
-template <typename T>
-void UnlockObject(const T& t)
-{
-    OPENSSL_cleanse((void*)(&t), sizeof(T));
-    LockedPageManager::Instance().UnlockRange((void*)(&t), sizeof(T));
-}
-
-//
-// Allocator that locks its contents from being paged
-// out of memory and clears its contents before deletion.
+// Allocator that keeps its contents in the locked pool, out of swap,
+// and clears its contents before deletion.
 //
 template <typename T>
 struct secure_allocator : public std::allocator<T> {
@@ -206,20 +297,15 @@ struct secure_allocator : public std::allocator<T> {
 
     T* allocate(std::size_t n, const void* hint = 0)
     {
-        T* p;
-        p = std::allocator<T>::allocate(n, hint);
-        if (p != NULL)
-            LockedPageManager::Instance().LockRange(p, sizeof(T) * n);
+        T* p = static_cast<T*>(LockedPool::Instance().Allocate(sizeof(T) * n));
+        if (p == NULL)
+            throw std::bad_alloc();
         return p;
     }
 
     void deallocate(T* p, std::size_t n)
     {
-        if (p != NULL) {
-            OPENSSL_cleanse(p, sizeof(T) * n);
-            LockedPageManager::Instance().UnlockRange(p, sizeof(T) * n);
-        }
-        std::allocator<T>::deallocate(p, n);
+        LockedPool::Instance().Free(p, sizeof(T) * n);
     }
 };
 
@@ -19,6 +19,33 @@
 /** All alphanumeric characters except for "0", "I", "O", and "l" */
 static const char* pszBase58 = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
+/** The value of each base58 character, -1 for the others */
+static const int8_t mapBase58[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, -1, -1, -1, -1, -1, -1,
+    -1, 9, 10, 11, 12, 13, 14, 15, 16, -1, 17, 18, 19, 20, 21, -1,
+    22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, -1, -1, -1, -1, -1,
+    -1, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, -1, 44, 45, 46,
+    47, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/**
+ * The big number arithmetic works on words instead of digits: base 2^32 for
+ * the bytes and base 58^5, the largest power of 58 below 2^32, for the
+ * characters. A word times 58^5 or 2^32 plus a carry fits in 64 bits.
+ */
+static const uint32_t pow58[6] = {1, 58, 3364, 195112, 11316496, 656356768};
+
 bool DecodeBase58(const char* psz, std::vector<unsigned char>& vch)
 {
     // Skip leading spaces.
@@ -30,38 +57,54 @@ bool DecodeBase58(const char* psz, std::vector<unsigned char>& vch)
         zeroes++;
         psz++;
     }
-    // Allocate enough space in big-endian base256 representation.
-    std::vector<unsigned char> b256(strlen(psz) * 733 / 1000 + 1); // log(58) / log(256), rounded up.
-    // Process the characters.
-    while (*psz && !isspace(*psz)) {
-        // Decode base58 character
-        const char* ch = strchr(pszBase58, *psz);
-        if (ch == NULL)
-            return false;
-        // Apply "b256 = b256 * 58 + ch".
-        int carry = ch - pszBase58;
-        for (std::vector<unsigned char>::reverse_iterator it = b256.rbegin(); it != b256.rend(); it++) {
-            carry += 58 * (*it);
-            *it = carry % 256;
-            carry /= 256;
-        }
-        assert(carry == 0);
+    const char* pbegin = psz;
+    while (*psz && !isspace(*psz))
         psz++;
-    }
+    const char* pend = psz;
     // Skip trailing spaces.
     while (isspace(*psz))
         psz++;
     if (*psz != 0)
         return false;
-    // Skip leading zeroes in b256.
-    std::vector<unsigned char>::iterator it = b256.begin();
-    while (it != b256.end() && *it == 0)
-        it++;
-    // Copy result into output vector.
-    vch.reserve(zeroes + (b256.end() - it));
+
+    // Little-endian base 2^32 words, enough for log(58) / log(2^32) per character
+    std::vector<uint32_t> b32((pend - pbegin) * 184 / 1000 + 1);
+    size_t nWords = 0;
+    // Process the characters, five at a time ("b32 = b32 * 58^5 + chunk")
+    // except for the first chunk, which takes the remainder
+    size_t nChunk = (pend - pbegin) % 5;
+    if (nChunk == 0)
+        nChunk = 5;
+    for (const char* p = pbegin; p != pend; p += nChunk, nChunk = 5) {
+        uint64_t carry = 0;
+        for (size_t i = 0; i < nChunk; i++) {
+            int8_t n = mapBase58[(uint8_t)p[i]];
+            if (n == -1)
+                return false;
+            carry = carry * 58 + n;
+        }
+        for (size_t i = 0; i < nWords; i++) {
+            carry += (uint64_t)b32[i] * pow58[nChunk];
+            b32[i] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry)
+            b32[nWords++] = (uint32_t)carry;
+        assert(nWords <= b32.size());
+    }
+    // Copy the result into the output vector, big-endian and without leading zeroes.
+    vch.reserve(zeroes + nWords * 4);
     vch.assign(zeroes, 0x00);
-    while (it != b256.end())
-        vch.push_back(*(it++));
+    bool fLeading = true;
+    for (size_t i = nWords; i-- > 0;) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            unsigned char c = b32[i] >> shift;
+            if (fLeading && c == 0)
+                continue;
+            fLeading = false;
+            vch.push_back(c);
+        }
+    }
     return true;
 }
 
@@ -88,30 +131,48 @@ std::string EncodeBase58(const unsigned char* pbegin, const unsigned char* pend)
         pbegin++;
         zeroes++;
     }
-    // Allocate enough space in big-endian base58 representation.
-    std::vector<unsigned char> b58((pend - pbegin) * 138 / 100 + 1); // log(256) / log(58), rounded up.
-    // Process the bytes.
-    while (pbegin != pend) {
-        int carry = *pbegin;
-        // Apply "b58 = b58 * 256 + ch".
-        for (std::vector<unsigned char>::reverse_iterator it = b58.rbegin(); it != b58.rend(); it++) {
-            carry += 256 * (*it);
-            *it = carry % 58;
-            carry /= 58;
+    // Little-endian base 58^5 words, enough for log(256) / log(58^5) per byte
+    std::vector<uint32_t> b58((pend - pbegin) * 28 / 100 + 1);
+    size_t nWords = 0;
+    // Process the bytes, four at a time ("b58 = b58 * 2^32 + chunk") except
+    // for the first chunk, which takes the remainder
+    size_t nChunk = (pend - pbegin) % 4;
+    if (nChunk == 0)
+        nChunk = 4;
+    for (const unsigned char* p = pbegin; p != pend; p += nChunk, nChunk = 4) {
+        uint64_t carry = 0;
+        for (size_t i = 0; i < nChunk; i++)
+            carry = (carry << 8) | p[i];
+        for (size_t i = 0; i < nWords; i++) {
+            carry += (uint64_t)b58[i] << (8 * nChunk);
+            b58[i] = carry % pow58[5];
+            carry /= pow58[5];
         }
-        assert(carry == 0);
-        pbegin++;
+        while (carry) {
+            b58[nWords++] = carry % pow58[5];
+            carry /= pow58[5];
+        }
+        assert(nWords <= b58.size());
     }
-    // Skip leading zeroes in base58 result.
-    std::vector<unsigned char>::iterator it = b58.begin();
-    while (it != b58.end() && *it == 0)
-        it++;
-    // Translate the result into a string.
+    // Translate the result into a string, without leading zeroes.
     std::string str;
-    str.reserve(zeroes + (b58.end() - it));
+    str.reserve(zeroes + nWords * 5);
     str.assign(zeroes, '1');
-    while (it != b58.end())
-        str += pszBase58[*(it++)];
+    bool fLeading = true;
+    for (size_t i = nWords; i-- > 0;) {
+        char digits[5];
+        uint32_t n = b58[i];
+        for (int j = 4; j >= 0; j--) {
+            digits[j] = pszBase58[n % 58];
+            n /= 58;
+        }
+        for (int j = 0; j < 5; j++) {
+            if (fLeading && digits[j] == '1')
+                continue;
+            fLeading = false;
+            str += digits[j];
+        }
+    }
     return str;
 }
 
@@ -293,6 +354,18 @@ bool CBitcoinAddress::IsScript() const
     return IsValid() && vchVersion == Params().Base58Prefix(CChainParams::SCRIPT_ADDRESS);
 }
 
+const std::string& CBitcoinAddressCache::Get(const CTxDestination& dest)
+{
+    std::map<CTxDestination, std::string>::iterator it = mapAddress.find(dest);
+    if (it != mapAddress.end())
+        return it->second;
+    std::string& strAddress = mapAddress[dest];
+    CBitcoinAddress address;
+    if (address.Set(dest))
+        strAddress = address.ToString();
+    return strAddress;
+}
+
 void CBitcoinSecret::SetKey(const CKey& vchSecret)
 {
     assert(vchSecret.IsValid());
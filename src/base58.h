@@ -20,6 +20,7 @@
 #include "script/script.h"
 #include "script/standard.h"
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -125,6 +126,21 @@ public:
     bool IsScript() const;
 };
 
+/**
+ * Address strings of destinations, for listings that show the same few
+ * addresses on many rows. It keeps every string it made, so it is meant
+ * to live for one listing.
+ */
+class CBitcoinAddressCache
+{
+private:
+    std::map<CTxDestination, std::string> mapAddress;
+
+public:
+    //! The address of dest, or an empty string when it has none
+    const std::string& Get(const CTxDestination& dest);
+};
+
 /**
  * A base58-encoded secret key
  */
@@ -0,0 +1,43 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "base58.h"
+#include "random.h"
+
+#include <string>
+#include <vector>
+
+static void Base58Encode(benchmark::State& state)
+{
+    std::vector<unsigned char> vch(32);
+    GetRandBytes(&vch[0], vch.size());
+    std::string str;
+    while (state.KeepRunning())
+        str = EncodeBase58(vch);
+}
+
+static void Base58CheckEncode(benchmark::State& state)
+{
+    // A version byte and a key id, as in an address
+    std::vector<unsigned char> vch(21);
+    GetRandBytes(&vch[0], vch.size());
+    std::string str;
+    while (state.KeepRunning())
+        str = EncodeBase58Check(vch);
+}
+
+static void Base58Decode(benchmark::State& state)
+{
+    std::vector<unsigned char> vch(32);
+    GetRandBytes(&vch[0], vch.size());
+    std::string str = EncodeBase58(vch);
+    while (state.KeepRunning())
+        DecodeBase58(str, vch);
+}
+
+BENCHMARK(Base58Encode);
+BENCHMARK(Base58CheckEncode);
+BENCHMARK(Base58Decode);
@@ -0,0 +1,145 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include <univalue.h>
+#include "util.h"
+#include "utiltime.h"
+
+#include <limits>
+#include <stdio.h>
+
+namespace
+{
+double GetTimeSeconds()
+{
+    return GetTimeMicros() * 0.000001;
+}
+} // anon namespace
+
+namespace benchmark
+{
+State::State(const std::string& nameIn, uint64_t nWarmupIn, uint64_t nIterationsIn, double nMaxElapsedIn) : name(nameIn),
+                                                                                                           nWarmup(nWarmupIn),
+                                                                                                           nIterations(nIterationsIn),
+                                                                                                           nMaxElapsed(nMaxElapsedIn),
+                                                                                                           beginTime(0),
+                                                                                                           lastTime(0),
+                                                                                                           minTime(std::numeric_limits<double>::max()),
+                                                                                                           maxTime(0),
+                                                                                                           count(0),
+                                                                                                           countMask(0)
+{
+}
+
+bool State::KeepRunning()
+{
+    if (nWarmup > 0) {
+        nWarmup--;
+        return true;
+    }
+
+    // Only every countMask + 1 iterations look at the clock, so that timing
+    // does not dominate what is timed
+    if (count & countMask) {
+        ++count;
+        return true;
+    }
+
+    double now = GetTimeSeconds();
+    if (count == 0) {
+        beginTime = lastTime = now;
+        ++count;
+        return true;
+    }
+
+    double elapsed = now - lastTime;
+    double elapsedOne = elapsed / (countMask + 1);
+    if (elapsedOne < minTime)
+        minTime = elapsedOne;
+    if (elapsedOne > maxTime)
+        maxTime = elapsedOne;
+    lastTime = now;
+
+    if (nIterations) {
+        if (count >= nIterations)
+            return false;
+        ++count;
+        return true;
+    }
+
+    if (elapsed * 128 < nMaxElapsed) {
+        // Far too fast to measure: sample 8 times less often, and restart
+        // so that the samples taken so far, timing included, are dropped
+        countMask = ((countMask << 3) | 7) & ((1ULL << 60) - 1);
+        count = 0;
+        minTime = std::numeric_limits<double>::max();
+        maxTime = 0;
+        return true;
+    }
+    if (elapsed * 16 < nMaxElapsed) {
+        uint64_t newCountMask = ((countMask << 1) | 1) & ((1ULL << 60) - 1);
+        if ((count & newCountMask) == 0)
+            countMask = newCountMask;
+    }
+
+    if (now - beginTime < nMaxElapsed) {
+        ++count;
+        return true;
+    }
+    return false;
+}
+
+void State::Report(UniValue* pjson) const
+{
+    if (pjson) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("name", name));
+        obj.push_back(Pair("iterations", (int64_t)count));
+        obj.push_back(Pair("elapsed", GetElapsed()));
+        obj.push_back(Pair("min", minTime == std::numeric_limits<double>::max() ? 0 : minTime));
+        obj.push_back(Pair("max", maxTime));
+        obj.push_back(Pair("average", GetAverage()));
+        pjson->push_back(obj);
+        return;
+    }
+    printf("%s,%lu,%.9g,%.9g,%.9g\n", name.c_str(), (unsigned long)count,
+        minTime == std::numeric_limits<double>::max() ? 0 : minTime, maxTime, GetAverage());
+}
+
+BenchRunner::BenchmarkMap& BenchRunner::benchmarks()
+{
+    static BenchmarkMap benchmarks_map;
+    return benchmarks_map;
+}
+
+BenchRunner::BenchRunner(const std::string& name, BenchFunction func)
+{
+    benchmarks().insert(std::make_pair(name, func));
+}
+
+int BenchRunner::RunAll(const std::string& strFilter, UniValue* pjson)
+{
+    uint64_t nWarmup = std::max((int64_t)0, GetArg("-warmup", DEFAULT_WARMUP_ITERATIONS));
+    uint64_t nIterations = std::max((int64_t)0, GetArg("-iterations", 0));
+    double nMaxElapsed = DEFAULT_BENCH_TIME;
+    if (mapArgs.count("-time"))
+        nMaxElapsed = std::max(0.001, atof(mapArgs["-time"].c_str()));
+
+    if (!pjson)
+        printf("#Benchmark,count,min,max,average\n");
+
+    int nRun = 0;
+    for (BenchmarkMap::iterator it = benchmarks().begin(); it != benchmarks().end(); ++it) {
+        if (!strFilter.empty() && it->first.find(strFilter) == std::string::npos)
+            continue;
+        State state(it->first, nWarmup, nIterations, nMaxElapsed);
+        (*it->second)(state);
+        state.Report(pjson);
+        nRun++;
+    }
+    return nRun;
+}
+} // namespace benchmark
@@ -0,0 +1,99 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <map>
+#include <stdint.h>
+#include <string>
+
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+class UniValue;
+
+/**
+ * Microbenchmarks
+ *
+ * A benchmark is a function taking a State and doing the work to measure
+ * in a loop on it:
+ *
+ *     static void CODE_TO_TIME(benchmark::State& state)
+ *     {
+ *         ... setup, not timed ...
+ *         while (state.KeepRunning()) {
+ *             ... the code to time ...
+ *         }
+ *         ... cleanup, not timed ...
+ *     }
+ *
+ *     BENCHMARK(CODE_TO_TIME);
+ *
+ * The loop first runs a number of untimed warmup iterations, then either a
+ * fixed number of timed iterations, or as many as fit in the time budget,
+ * sampling the clock less often as the iterations prove to be short.
+ */
+namespace benchmark
+{
+//! Default for -warmup, iterations run before timing starts
+static const uint64_t DEFAULT_WARMUP_ITERATIONS = 10;
+//! Default for -time, seconds spent on each benchmark when -iterations is not given
+static const double DEFAULT_BENCH_TIME = 1.0;
+
+/** How long a benchmark runs, and what it measured */
+class State
+{
+    std::string name;
+    uint64_t nWarmup;
+    //! Timed iterations to run, 0 to run for nMaxElapsed seconds
+    uint64_t nIterations;
+    double nMaxElapsed;
+
+    double beginTime;
+    double lastTime, minTime, maxTime;
+    uint64_t count;
+    uint64_t countMask;
+
+public:
+    State(const std::string& nameIn, uint64_t nWarmupIn, uint64_t nIterationsIn, double nMaxElapsedIn);
+
+    /** True while the benchmark should do one more iteration */
+    bool KeepRunning();
+
+    const std::string& GetName() const { return name; }
+    uint64_t GetIterations() const { return count; }
+    double GetElapsed() const { return lastTime - beginTime; }
+    double GetMinTime() const { return minTime; }
+    double GetMaxTime() const { return maxTime; }
+    double GetAverage() const { return count ? GetElapsed() / count : 0; }
+
+    /** Print the results, or add them to a JSON array when pjson is not NULL */
+    void Report(UniValue* pjson) const;
+};
+
+typedef void (*BenchFunction)(State&);
+
+class BenchRunner
+{
+    typedef std::map<std::string, BenchFunction> BenchmarkMap;
+    static BenchmarkMap& benchmarks();
+
+public:
+    BenchRunner(const std::string& name, BenchFunction func);
+
+    /**
+     * Run the benchmarks whose name contains strFilter (all of them when
+     * empty), as set by -warmup, -iterations and -time. Returns the
+     * number of benchmarks run.
+     */
+    static int RunAll(const std::string& strFilter, UniValue* pjson);
+};
+} // namespace benchmark
+
+// BENCHMARK(foo) registers the benchmark foo
+#define BENCHMARK(n) \
+    benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif // BITCOIN_BENCH_BENCH_H
@@ -0,0 +1,64 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "crypto/sha256.h"
+#include "dbengine.h"
+#include "init.h"
+#include "key.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <stdio.h>
+
+#include <univalue.h>
+
+CClientUIInterface uiInterface;
+CWallet* pwalletMain;
+
+int main(int argc, char** argv)
+{
+    SetupEnvironment();
+    SHA256AutoDetect();
+    fPrintToDebugLog = false;
+    ParseParameters(argc, argv);
+
+    if (mapArgs.count("-?") || mapArgs.count("-help")) {
+        std::string strUsage = "Usage:\n  bench_dystem [options]\n\n";
+        strUsage += HelpMessageGroup("Options:");
+        strUsage += HelpMessageOpt("-?", "This help message");
+        strUsage += HelpMessageOpt("-filter=<str>", "Only run the benchmarks whose name contains <str>");
+        strUsage += HelpMessageOpt("-iterations=<n>", "Run each benchmark <n> times instead of for -time seconds");
+        strUsage += HelpMessageOpt("-time=<sec>", strprintf("Seconds to run each benchmark for (default: %g)", benchmark::DEFAULT_BENCH_TIME));
+        strUsage += HelpMessageOpt("-warmup=<n>", strprintf("Untimed iterations before each benchmark (default: %u)", (unsigned int)benchmark::DEFAULT_WARMUP_ITERATIONS));
+        strUsage += HelpMessageOpt("-json", "Print the results as JSON");
+        strUsage += HelpMessageOpt("-dbengine=<name>", strprintf("Key-value engine the DBEngine benchmarks run on (default: %s)", DEFAULT_DB_ENGINE));
+        strUsage += HelpMessageOpt("-testnet", "Use the test network parameters");
+        strUsage += HelpMessageOpt("-regtest", "Use the regression test parameters");
+        fprintf(stdout, "%s", strUsage.c_str());
+        return 0;
+    }
+
+    if (!SelectParamsFromCommandLine()) {
+        fprintf(stderr, "Error: Invalid combination of -regtest and -testnet.\n");
+        return 1;
+    }
+    if (!ECC_InitSanityCheck()) {
+        fprintf(stderr, "Error: elliptic curve cryptography sanity check failed.\n");
+        return 1;
+    }
+
+    bool fJSON = GetBoolArg("-json", false);
+    UniValue json(UniValue::VARR);
+    int nRun = benchmark::BenchRunner::RunAll(GetArg("-filter", ""), fJSON ? &json : NULL);
+    if (fJSON)
+        fprintf(stdout, "%s\n", json.write(2).c_str());
+    if (nRun == 0) {
+        fprintf(stderr, "Error: no benchmark matches -filter.\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
+
+#include <assert.h>
+#include <vector>
+
+//! Inputs of the transaction checked, enough for the signature hash cache to be used
+static const unsigned int CHECKINPUTS_INPUTS = 20;
+
+static void CheckInputsSigned(benchmark::State& state)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    CMutableTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFund.vout.resize(CHECKINPUTS_INPUTS);
+    for (unsigned int i = 0; i < CHECKINPUTS_INPUTS; i++) {
+        txFund.vout[i].nValue = 1000;
+        txFund.vout[i].scriptPubKey = scriptPubKey;
+    }
+    CTransaction txFrom(txFund);
+
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(CHECKINPUTS_INPUTS);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 1000 * CHECKINPUTS_INPUTS - 100;
+    txSpend.vout[0].scriptPubKey = scriptPubKey;
+    for (unsigned int i = 0; i < CHECKINPUTS_INPUTS; i++)
+        txSpend.vin[i].prevout = COutPoint(txFrom.GetHash(), i);
+    for (unsigned int i = 0; i < CHECKINPUTS_INPUTS; i++) {
+        bool fSigned = SignSignature(keystore, txFrom, txSpend, i);
+        assert(fSigned);
+    }
+    CTransaction tx(txSpend);
+
+    // CheckInputs looks up the height the inputs are spent at from the best block
+    CBlockIndex indexBest;
+    indexBest.nHeight = 1000;
+    uint256 hashBest = GetRandHash();
+    mapBlockIndex[hashBest] = &indexBest;
+
+    CCoinsView viewDummy;
+    CCoinsViewCache view(&viewDummy);
+    view.ModifyCoins(txFrom.GetHash())->FromTx(txFrom, 1);
+    view.SetBestBlock(hashBest);
+
+    while (state.KeepRunning()) {
+        CValidationState validationState;
+        bool fValid = CheckInputs(tx, validationState, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, false);
+        assert(fValid);
+    }
+
+    mapBlockIndex.erase(hashBest);
+}
+
+BENCHMARK(CheckInputsSigned);
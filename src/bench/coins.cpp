@@ -0,0 +1,85 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "script/script.h"
+
+#include <vector>
+
+//! Transactions whose outputs the caches hold
+static const size_t COINS_TXS = 1000;
+
+static std::vector<CTransaction> BuildTransactions()
+{
+    std::vector<CTransaction> vtx;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(2);
+    tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    tx.vout[1].scriptPubKey = tx.vout[0].scriptPubKey;
+    tx.vout[0].nValue = tx.vout[1].nValue = 1;
+    for (size_t i = 0; i < COINS_TXS; i++) {
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        vtx.push_back(tx);
+    }
+    return vtx;
+}
+
+static void CoinsCacheAdd(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx = BuildTransactions();
+    CCoinsView viewDummy;
+    while (state.KeepRunning()) {
+        CCoinsViewCache view(&viewDummy);
+        for (size_t i = 0; i < vtx.size(); i++)
+            view.ModifyCoins(vtx[i].GetHash())->FromTx(vtx[i], 1);
+    }
+}
+
+static void CoinsCacheAccess(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx = BuildTransactions();
+    CCoinsView viewDummy;
+    CCoinsViewCache view(&viewDummy);
+    for (size_t i = 0; i < vtx.size(); i++)
+        view.ModifyCoins(vtx[i].GetHash())->FromTx(vtx[i], 1);
+    uint256 hashMissing = GetRandHash();
+    size_t nFound = 0;
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vtx.size(); i++) {
+            if (view.AccessCoins(vtx[i].GetHash()))
+                nFound++;
+        }
+        if (view.HaveCoins(hashMissing))
+            nFound++;
+    }
+}
+
+static void CoinsCacheSpendFlush(benchmark::State& state)
+{
+    std::vector<CTransaction> vtx = BuildTransactions();
+    CCoinsView viewDummy;
+    CCoinsViewCache viewBase(&viewDummy);
+    for (size_t i = 0; i < vtx.size(); i++)
+        viewBase.ModifyCoins(vtx[i].GetHash())->FromTx(vtx[i], 1);
+    while (state.KeepRunning()) {
+        // Spend one output of each in a child cache, as connecting a block does
+        CCoinsViewCache view(&viewBase);
+        for (size_t i = 0; i < vtx.size(); i++) {
+            view.ModifyCoins(vtx[i].GetHash())->Spend(i & 1);
+        }
+        view.Flush();
+        // Give the outputs back for the next round
+        for (size_t i = 0; i < vtx.size(); i++)
+            viewBase.ModifyCoins(vtx[i].GetHash())->FromTx(vtx[i], 1);
+    }
+}
+
+BENCHMARK(CoinsCacheAdd);
+BENCHMARK(CoinsCacheAccess);
+BENCHMARK(CoinsCacheSpendFlush);
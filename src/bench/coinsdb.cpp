@@ -0,0 +1,133 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "leveldbwrapper.h"
+#include "random.h"
+#include "script/script.h"
+#include "txdb.h"
+
+#include <vector>
+
+//! Transactions in the chainstate, enough that it spreads over several tables
+static const size_t COINSDB_TXS = 50000;
+//! Transactions written per batch, about a block's worth
+static const size_t COINSDB_BATCH_TXS = 1000;
+//! Lookups timed per iteration
+static const size_t COINSDB_LOOKUPS = 1000;
+//! -dbcache share the chainstate gets with the defaults
+static const size_t COINSDB_CACHE = 8 << 20;
+
+static CCoins BenchCoins()
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = 1000;
+    coins.vout.resize(2);
+    coins.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    coins.vout[1].scriptPubKey = coins.vout[0].scriptPubKey;
+    coins.vout[0].nValue = coins.vout[1].nValue = 1;
+    return coins;
+}
+
+static std::vector<uint256> BenchTxids(size_t nTxs)
+{
+    std::vector<uint256> vTxids;
+    for (size_t i = 0; i < nTxs; i++)
+        vTxids.push_back(GetRandHash());
+    return vTxids;
+}
+
+/** The old layout, one CCoins record per transaction at 'c' + txid */
+static void FillPerTx(CLevelDBWrapper& db, const std::vector<uint256>& vTxids)
+{
+    CCoins coins = BenchCoins();
+    for (size_t i = 0; i < vTxids.size(); i += COINSDB_BATCH_TXS) {
+        CLevelDBBatch batch;
+        for (size_t j = i; j < i + COINSDB_BATCH_TXS && j < vTxids.size(); j++)
+            batch.Write(std::make_pair('c', vTxids[j]), coins);
+        db.WriteBatch(batch);
+    }
+}
+
+static void FillPerOutput(CCoinsViewDB& db, const std::vector<uint256>& vTxids)
+{
+    CCoins coins = BenchCoins();
+    for (size_t i = 0; i < vTxids.size(); i += COINSDB_BATCH_TXS) {
+        CCoinsMap mapCoins;
+        for (size_t j = i; j < i + COINSDB_BATCH_TXS && j < vTxids.size(); j++) {
+            CCoinsCacheEntry& entry = mapCoins[vTxids[j]];
+            entry.coins = coins;
+            entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+        }
+        db.BatchWrite(mapCoins, GetRandHash());
+    }
+}
+
+static void CoinsDBPerTxHit(benchmark::State& state)
+{
+    CLevelDBWrapper db("bench_coinsdb", COINSDB_CACHE, true, false, GetLevelDBProfile("chainstate"));
+    std::vector<uint256> vTxids = BenchTxids(COINSDB_TXS);
+    FillPerTx(db, vTxids);
+    CCoins coins;
+    size_t nFound = 0;
+    while (state.KeepRunning()) {
+        // the txids are random, so the first ones are spread over the tables
+        for (size_t i = 0; i < COINSDB_LOOKUPS; i++) {
+            if (db.Read(std::make_pair('c', vTxids[i]), coins))
+                nFound++;
+        }
+    }
+}
+
+static void CoinsDBPerTxMiss(benchmark::State& state)
+{
+    CLevelDBWrapper db("bench_coinsdb", COINSDB_CACHE, true, false, GetLevelDBProfile("chainstate"));
+    FillPerTx(db, BenchTxids(COINSDB_TXS));
+    std::vector<uint256> vMissing = BenchTxids(COINSDB_LOOKUPS);
+    size_t nFound = 0;
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vMissing.size(); i++) {
+            if (db.Exists(std::make_pair('c', vMissing[i])))
+                nFound++;
+        }
+    }
+}
+
+static void CoinsDBPerOutputHit(benchmark::State& state)
+{
+    CCoinsViewDB db(COINSDB_CACHE, true);
+    std::vector<uint256> vTxids = BenchTxids(COINSDB_TXS);
+    FillPerOutput(db, vTxids);
+    CCoins coins;
+    size_t nFound = 0;
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < COINSDB_LOOKUPS; i++) {
+            if (db.GetCoins(vTxids[i], coins))
+                nFound++;
+        }
+    }
+}
+
+static void CoinsDBPerOutputMiss(benchmark::State& state)
+{
+    CCoinsViewDB db(COINSDB_CACHE, true);
+    FillPerOutput(db, BenchTxids(COINSDB_TXS));
+    std::vector<uint256> vMissing = BenchTxids(COINSDB_LOOKUPS);
+    size_t nFound = 0;
+    while (state.KeepRunning()) {
+        // what AcceptToMemoryPool asks of every new transaction, and of inputs it does not know
+        for (size_t i = 0; i < vMissing.size(); i++) {
+            if (db.HaveCoins(vMissing[i]))
+                nFound++;
+        }
+    }
+}
+
+BENCHMARK(CoinsDBPerTxHit);
+BENCHMARK(CoinsDBPerTxMiss);
+BENCHMARK(CoinsDBPerOutputHit);
+BENCHMARK(CoinsDBPerOutputMiss);
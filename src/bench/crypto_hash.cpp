@@ -0,0 +1,48 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "hash.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <vector>
+
+//! A serialized block header, what the proof of work is computed over
+static const size_t HEADER_SIZE = 80;
+
+static void HashQuarkHeader(benchmark::State& state)
+{
+    std::vector<unsigned char> vchHeader(HEADER_SIZE);
+    GetRandBytes(&vchHeader[0], vchHeader.size());
+    uint256 hash;
+    while (state.KeepRunning()) {
+        hash = HashQuark(vchHeader.begin(), vchHeader.end());
+        // Chain the results so the compiler cannot hoist the work
+        memcpy(&vchHeader[0], hash.begin(), 32);
+    }
+}
+
+static void HashQuarkHeaderLanes(benchmark::State& state)
+{
+    std::vector<unsigned char> vchHeaders(HEADER_SIZE * QUARK_LANES);
+    GetRandBytes(&vchHeaders[0], vchHeaders.size());
+    uint256 vHash[QUARK_LANES];
+    while (state.KeepRunning()) {
+        HashQuarkLanes(&vchHeaders[0], HEADER_SIZE, HEADER_SIZE, QUARK_LANES, vHash);
+        memcpy(&vchHeaders[0], vHash[0].begin(), 32);
+    }
+}
+
+static void SHA256D_32b(benchmark::State& state)
+{
+    uint256 hash = GetRandHash();
+    while (state.KeepRunning())
+        hash = Hash(hash.begin(), hash.end());
+}
+
+BENCHMARK(HashQuarkHeader);
+BENCHMARK(HashQuarkHeaderLanes);
+BENCHMARK(SHA256D_32b);
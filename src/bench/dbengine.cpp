@@ -0,0 +1,95 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "leveldbwrapper.h"
+#include "random.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
+
+//! Records each round writes, about a block's worth of coins
+static const size_t DB_BENCH_RECORDS = 1000;
+//! -dbcache share a database gets with the defaults
+static const size_t DB_BENCH_CACHE = 8 << 20;
+
+//! The engine under test is picked the way -<db>engine picks it, in memory
+static CLevelDBProfile BenchProfile()
+{
+    CLevelDBProfile profile;
+    profile.strEngine = GetArg("-dbengine", DEFAULT_DB_ENGINE);
+    return profile;
+}
+
+static std::vector<uint256> BenchKeys()
+{
+    std::vector<uint256> vKeys;
+    for (size_t i = 0; i < DB_BENCH_RECORDS; i++)
+        vKeys.push_back(GetRandHash());
+    return vKeys;
+}
+
+static void DBEngineWriteBatch(benchmark::State& state)
+{
+    CLevelDBWrapper db("bench_dbengine", DB_BENCH_CACHE, true, false, BenchProfile());
+    std::vector<uint256> vKeys = BenchKeys();
+    std::vector<unsigned char> vchValue(40, 1);
+    while (state.KeepRunning()) {
+        CLevelDBBatch batch;
+        for (size_t i = 0; i < vKeys.size(); i++)
+            batch.Write(std::make_pair('o', vKeys[i]), vchValue);
+        db.WriteBatch(batch);
+        vKeys[GetRand(vKeys.size())] = GetRandHash();
+    }
+}
+
+static void DBEngineRead(benchmark::State& state)
+{
+    CLevelDBWrapper db("bench_dbengine", DB_BENCH_CACHE, true, false, BenchProfile());
+    std::vector<uint256> vKeys = BenchKeys();
+    std::vector<unsigned char> vchValue(40, 1);
+    CLevelDBBatch batch;
+    for (size_t i = 0; i < vKeys.size(); i++)
+        batch.Write(std::make_pair('o', vKeys[i]), vchValue);
+    db.WriteBatch(batch);
+    size_t nFound = 0;
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vKeys.size(); i++) {
+            if (db.Read(std::make_pair('o', vKeys[i]), vchValue))
+                nFound++;
+        }
+        // and one missing key, as most lookups of a new transaction's inputs are not
+        if (db.Exists(std::make_pair('o', GetRandHash())))
+            nFound++;
+    }
+}
+
+static void DBEngineScan(benchmark::State& state)
+{
+    CLevelDBWrapper db("bench_dbengine", DB_BENCH_CACHE, true, false, BenchProfile());
+    std::vector<uint256> vKeys = BenchKeys();
+    std::vector<unsigned char> vchValue(40, 1);
+    CLevelDBBatch batch;
+    for (size_t i = 0; i < vKeys.size(); i++)
+        batch.Write(std::make_pair('o', vKeys[i]), vchValue);
+    db.WriteBatch(batch);
+    size_t nBytes = 0;
+    while (state.KeepRunning()) {
+        const CDBSnapshot* snapshot = db.GetSnapshot();
+        {
+            boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator(snapshot));
+            for (pcursor->Seek("o"); pcursor->Valid(); pcursor->Next())
+                nBytes += pcursor->key().size() + pcursor->value().size();
+        }
+        db.ReleaseSnapshot(snapshot);
+    }
+}
+
+BENCHMARK(DBEngineWriteBatch);
+BENCHMARK(DBEngineRead);
+BENCHMARK(DBEngineScan);
@@ -0,0 +1,50 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "kernel.h"
+#include "random.h"
+#include "streams.h"
+#include "uint256.h"
+
+#include <limits>
+
+static void CheckStakeKernel(benchmark::State& state)
+{
+    // A kernel for a staked outpoint, tried against a target it never hits
+    CDataStream ssUniqueID(SER_GETHASH, 0);
+    ssUniqueID << GetRandHash() << (uint32_t)1;
+    uint64_t nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+    uint256 bnTarget;
+    bnTarget.SetCompact(0x1d00ffff);
+    unsigned int nTimeBlockFrom = 1546300800;
+    unsigned int nTimeTx = nTimeBlockFrom + 3600;
+    uint256 hashProofOfStake;
+    while (state.KeepRunning()) {
+        CheckStake(ssUniqueID, 1, nStakeModifier, bnTarget, nTimeBlockFrom, nTimeTx, hashProofOfStake);
+        nTimeTx++;
+    }
+}
+
+static void CheckStakeKernelMidstate(benchmark::State& state)
+{
+    // The same kernel, with the constant part hashed once as the stake search does
+    CDataStream ssUniqueID(SER_GETHASH, 0);
+    ssUniqueID << GetRandHash() << (uint32_t)1;
+    uint64_t nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+    uint256 bnTarget;
+    bnTarget.SetCompact(0x1d00ffff);
+    unsigned int nTimeBlockFrom = 1546300800;
+    unsigned int nTimeTx = nTimeBlockFrom + 3600;
+    CStakeKernelHasher hasher(nStakeModifier, nTimeBlockFrom, ssUniqueID);
+    uint256 hashProofOfStake;
+    while (state.KeepRunning()) {
+        CheckStake(hasher, 1, bnTarget, nTimeTx, hashProofOfStake);
+        nTimeTx++;
+    }
+}
+
+BENCHMARK(CheckStakeKernel);
+BENCHMARK(CheckStakeKernelMidstate);
@@ -0,0 +1,32 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "masternode.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <vector>
+
+//! About the size of the masternode list a payee election scores
+static const size_t MASTERNODE_COUNT = 1000;
+
+static void MasternodeCalculateScore(benchmark::State& state)
+{
+    std::vector<CMasternode> vMasternodes(MASTERNODE_COUNT);
+    for (size_t i = 0; i < vMasternodes.size(); i++)
+        vMasternodes[i].vin = CTxIn(GetRandHash(), i % 4);
+    uint256 hashBlock = GetRandHash();
+    uint256 hashBest;
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vMasternodes.size(); i++) {
+            uint256 nScore = vMasternodes[i].CalculateScore(hashBlock);
+            if (nScore > hashBest)
+                hashBest = nScore;
+        }
+    }
+}
+
+BENCHMARK(MasternodeCalculateScore);
@@ -0,0 +1,66 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "primitives/block.h"
+#include "random.h"
+#include "script/script.h"
+#include "streams.h"
+#include "version.h"
+
+//! Transactions in the block written and read
+static const size_t SERIALIZE_BLOCK_TXS = 500;
+
+static CBlock BuildBlock()
+{
+    CBlock block;
+    block.nVersion = 4;
+    block.nTime = 1546300800;
+    block.nBits = 0x1d00ffff;
+    CMutableTransaction tx;
+    tx.vin.resize(2);
+    tx.vout.resize(2);
+    for (size_t i = 0; i < tx.vin.size(); i++)
+        tx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+    for (size_t i = 0; i < tx.vout.size(); i++) {
+        tx.vout[i].nValue = 1000;
+        tx.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    for (size_t i = 0; i < SERIALIZE_BLOCK_TXS; i++) {
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vin[1].prevout = COutPoint(GetRandHash(), 1);
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void SerializeBlock(benchmark::State& state)
+{
+    CBlock block = BuildBlock();
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream.reserve(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    while (state.KeepRunning()) {
+        stream.clear();
+        stream << block;
+    }
+}
+
+static void DeserializeBlock(benchmark::State& state)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << BuildBlock();
+    size_t nSize = stream.size();
+    // One byte more, so that reading to the end does not clear the stream
+    stream.write("\0", 1);
+    while (state.KeepRunning()) {
+        CBlock block;
+        stream >> block;
+        stream.Rewind(nSize);
+    }
+}
+
+BENCHMARK(SerializeBlock);
+BENCHMARK(DeserializeBlock);
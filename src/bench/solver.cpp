@@ -0,0 +1,55 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "key.h"
+#include "script/standard.h"
+
+#include <vector>
+
+static void SolveScript(benchmark::State& state, const CScript& scriptPubKey)
+{
+    std::vector<std::vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    while (state.KeepRunning()) {
+        vSolutions.clear();
+        Solver(scriptPubKey, whichType, vSolutions);
+    }
+}
+
+static void SolverPubKeyHash(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    SolveScript(state, GetScriptForDestination(key.GetPubKey().GetID()));
+}
+
+static void SolverPubKey(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    SolveScript(state, CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG);
+}
+
+static void SolverMultisig(benchmark::State& state)
+{
+    std::vector<CPubKey> vKeys(3);
+    for (unsigned int i = 0; i < vKeys.size(); i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        vKeys[i] = key.GetPubKey();
+    }
+    SolveScript(state, GetScriptForMultisig(2, vKeys));
+}
+
+static void SolverNonstandard(benchmark::State& state)
+{
+    SolveScript(state, CScript() << OP_1 << OP_ADD << OP_2 << OP_EQUAL);
+}
+
+BENCHMARK(SolverPubKeyHash);
+BENCHMARK(SolverPubKey);
+BENCHMARK(SolverMultisig);
+BENCHMARK(SolverNonstandard);
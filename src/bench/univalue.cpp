@@ -0,0 +1,55 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "random.h"
+#include "uint256.h"
+
+#include <assert.h>
+#include <string>
+
+#include <univalue.h>
+
+//! Entries of the document, about a listtransactions reply
+static const int UNIVALUE_ENTRIES = 1000;
+
+static UniValue BuildDocument()
+{
+    UniValue result(UniValue::VARR);
+    for (int i = 0; i < UNIVALUE_ENTRIES; i++) {
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("account", ""));
+        entry.push_back(Pair("address", "D7VFR83SQbiezrW72hjcWJtcfip5krte2Z"));
+        entry.push_back(Pair("category", i % 2 ? "send" : "receive"));
+        entry.push_back(Pair("amount", 12.5 * (i + 1)));
+        entry.push_back(Pair("confirmations", i));
+        entry.push_back(Pair("bcconfirmed", i > 6));
+        entry.push_back(Pair("txid", GetRandHash().GetHex()));
+        entry.push_back(Pair("time", (int64_t)1546300800 + i));
+        result.push_back(entry);
+    }
+    return result;
+}
+
+static void UniValueWrite(benchmark::State& state)
+{
+    UniValue document = BuildDocument();
+    std::string strJSON;
+    while (state.KeepRunning())
+        strJSON = document.write();
+}
+
+static void UniValueParse(benchmark::State& state)
+{
+    std::string strJSON = BuildDocument().write();
+    while (state.KeepRunning()) {
+        UniValue document;
+        bool fRead = document.read(strJSON);
+        assert(fRead);
+    }
+}
+
+BENCHMARK(UniValueWrite);
+BENCHMARK(UniValueParse);
@@ -4,16 +4,22 @@
 
 #include "bip38.h"
 #include "base58.h"
+#include "crypto/scrypt.h"
 #include "hash.h"
 #include "pubkey.h"
 #include "util.h"
 #include "utilstrencodings.h"
 
 #include <openssl/aes.h>
+#include <openssl/crypto.h>
 #include <openssl/sha.h>
 #include <secp256k1.h>
 #include <string>
 
+#include <atomic>
+
+#include <boost/thread.hpp>
+
 
 /** 39 bytes - 78 characters
  * 1) Prefix - 2 bytes - 4 chars - strKey[0..3]
@@ -24,6 +30,69 @@
  * 6) Encrypted Part 2 - 16 bytes - 32 chars - strKey[46..77]
  */
 
+namespace
+{
+/** Runs every nStep-th of the p lanes of an scrypt hash */
+struct CScryptLanes {
+    uint8_t* B;
+    unsigned int N;
+    unsigned int r;
+    unsigned int p;
+    unsigned int nFirst;
+    unsigned int nStep;
+
+    void operator()() const
+    {
+        for (unsigned int i = nFirst; i < p; i += nStep)
+            scrypt_smix(B + 128 * r * i, r, N);
+    }
+};
+
+/** Decrypts the keys of a batch until none are left */
+struct CBIP38DecryptWorker {
+    const std::string* pstrPassphrase;
+    std::vector<CBIP38DecryptJob>* pvJobs;
+    std::atomic<size_t>* pnNext;
+
+    void operator()() const
+    {
+        for (size_t i = (*pnNext)++; i < pvJobs->size(); i = (*pnNext)++) {
+            CBIP38DecryptJob& job = (*pvJobs)[i];
+            job.fDecrypted = BIP38_Decrypt(*pstrPassphrase, job.strEncryptedKey, job.privKey, job.fCompressed);
+        }
+    }
+};
+
+unsigned int GetCores()
+{
+    return std::max(1u, boost::thread::hardware_concurrency());
+}
+
+/** scrypt_hash with the p lanes on as many threads as there are cores */
+void ScryptHashParallel(const char* pass, unsigned int pLen, const char* salt, unsigned int sLen, char* output, unsigned int N, unsigned int r, unsigned int p, unsigned int dkLen)
+{
+    std::vector<uint8_t> B(128 * r * p);
+    PBKDF2_SHA256((const uint8_t*)pass, pLen, (const uint8_t*)salt, sLen, 1, &B[0], B.size());
+
+    // Every lane takes 128 * r * N bytes, 16MB for the 16384, 8 of BIP38
+    CScryptLanes lanes;
+    lanes.B = &B[0];
+    lanes.N = N;
+    lanes.r = r;
+    lanes.p = p;
+    lanes.nStep = std::min(p, GetCores());
+    boost::thread_group threadGroup;
+    for (lanes.nFirst = 1; lanes.nFirst < lanes.nStep; lanes.nFirst++)
+        threadGroup.create_thread(lanes);
+    lanes.nFirst = 0;
+    lanes();
+    threadGroup.join_all();
+
+    PBKDF2_SHA256((const uint8_t*)pass, pLen, &B[0], B.size(), 1, (uint8_t*)output, dkLen);
+    OPENSSL_cleanse(&B[0], B.size());
+}
+} // anon namespace
+
 void DecryptAES(uint256 encryptedIn, uint256 decryptionKey, uint256& output)
 {
     AES_KEY key;
@@ -35,7 +104,7 @@ void ComputePreFactor(std::string strPassphrase, std::string strSalt, uint256& p
 {
     //passfactor is the scrypt hash of passphrase and ownersalt (NOTE this needs to handle alt cases too in the future)
     uint64_t s = uint256(ReverseEndianString(strSalt)).Get64();
-    scrypt_hash(strPassphrase.c_str(), strPassphrase.size(), BEGIN(s), strSalt.size() / 2, BEGIN(prefactor), 16384, 8, 8, 32);
+    ScryptHashParallel(strPassphrase.c_str(), strPassphrase.size(), BEGIN(s), strSalt.size() / 2, BEGIN(prefactor), 16384, 8, 8, 32);
 }
 
 void ComputePassfactor(std::string ownersalt, uint256 prefactor, uint256& passfactor)
@@ -58,7 +127,7 @@ void ComputeSeedBPass(CPubKey passpoint, std::string strAddressHash, std::string
     // Derive decryption key for seedb using scrypt with passpoint, addresshash, and ownerentropy
     string salt = ReverseEndianString(strAddressHash + strOwnerSalt);
     uint256 s2(salt);
-    scrypt_hash(BEGIN(passpoint), HexStr(passpoint).size() / 2, BEGIN(s2), salt.size() / 2, BEGIN(seedBPass), 1024, 1, 1, 64);
+    ScryptHashParallel(BEGIN(passpoint), HexStr(passpoint).size() / 2, BEGIN(s2), salt.size() / 2, BEGIN(seedBPass), 1024, 1, 1, 64);
 }
 
 void ComputeFactorB(uint256 seedB, uint256& factorB)
@@ -83,7 +152,7 @@ std::string BIP38_Encrypt(std::string strAddress, std::string strPassphrase, uin
 
     uint512 hashed;
     uint64_t salt = uint256(ReverseEndianString(strAddressHash)).Get64();
-    scrypt_hash(strPassphrase.c_str(), strPassphrase.size(), BEGIN(salt), strAddressHash.size() / 2, BEGIN(hashed), 16384, 8, 8, 64);
+    ScryptHashParallel(strPassphrase.c_str(), strPassphrase.size(), BEGIN(salt), strAddressHash.size() / 2, BEGIN(hashed), 16384, 8, 8, 64);
 
     uint256 derivedHalf1(hashed.ToString().substr(64, 64));
     uint256 derivedHalf2(hashed.ToString().substr(0, 64));
@@ -154,7 +223,7 @@ bool BIP38_Decrypt(std::string strPassphrase, std::string strEncryptedKey, uint2
         uint512 hashed;
         encryptedPart1 = uint256(ReverseEndianString(strKey.substr(14, 32)));
         uint64_t salt = uint256(ReverseEndianString(strAddressHash)).Get64();
-        scrypt_hash(strPassphrase.c_str(), strPassphrase.size(), BEGIN(salt), strAddressHash.size() / 2, BEGIN(hashed), 16384, 8, 8, 64);
+        ScryptHashParallel(strPassphrase.c_str(), strPassphrase.size(), BEGIN(salt), strAddressHash.size() / 2, BEGIN(hashed), 16384, 8, 8, 64);
 
         uint256 derivedHalf1(hashed.ToString().substr(64, 64));
         uint256 derivedHalf2(hashed.ToString().substr(0, 64));
@@ -239,3 +308,19 @@ bool BIP38_Decrypt(std::string strPassphrase, std::string strEncryptedKey, uint2
 
     return strAddressHash == AddressToBip38Hash(address);
 }
+
+void BIP38_DecryptBatch(const std::string& strPassphrase, std::vector<CBIP38DecryptJob>& vJobs)
+{
+    // Each decryption runs its 8 scrypt lanes on threads of its own
+    unsigned int nWorkers = std::max(1u, GetCores() / 8);
+    std::atomic<size_t> nNext(0);
+    CBIP38DecryptWorker worker;
+    worker.pstrPassphrase = &strPassphrase;
+    worker.pvJobs = &vJobs;
+    worker.pnNext = &nNext;
+    boost::thread_group threadGroup;
+    for (unsigned int i = 1; i < nWorkers; i++)
+        threadGroup.create_thread(worker);
+    worker();
+    threadGroup.join_all();
+}
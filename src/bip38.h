@@ -9,6 +9,7 @@
 #include "uint256.h"
 
 #include <string>
+#include <vector>
 
 
 /** 39 bytes - 78 characters
@@ -35,6 +36,21 @@ void ComputeFactorB(uint256 seedB, uint256& factorB);
 std::string BIP38_Encrypt(std::string strAddress, std::string strPassphrase, uint256 privKey, bool fCompressed);
 bool BIP38_Decrypt(std::string strPassphrase, std::string strEncryptedKey, uint256& privKey, bool& fCompressed);
 
+/** A key of a BIP38_DecryptBatch, with the results of BIP38_Decrypt */
+struct CBIP38DecryptJob {
+    std::string strEncryptedKey;
+    uint256 privKey;
+    bool fCompressed;
+    bool fDecrypted;
+
+    CBIP38DecryptJob() : fCompressed(false), fDecrypted(false) {}
+    explicit CBIP38DecryptJob(const std::string& strEncryptedKeyIn) : strEncryptedKey(strEncryptedKeyIn), fCompressed(false), fDecrypted(false) {}
+};
+
+/** BIP38_Decrypt every key of vJobs with the same passphrase, as many at a
+ *  time as the cores allow; for bulk imports of paper wallets. */
+void BIP38_DecryptBatch(const std::string& strPassphrase, std::vector<CBIP38DecryptJob>& vJobs);
+
 std::string AddressToBip38Hash(std::string address);
 
 #endif // BIP38_H
@@ -0,0 +1,290 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/dystem-config.h"
+#endif
+
+#include "blockcompress.h"
+
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#if ENABLE_BLOCK_COMPRESSION
+#include <zlib.h>
+#endif
+
+namespace
+{
+const char BLOCKFILE_FRAME_MAGIC[4] = {'b', 'l', 'z', '1'};
+const unsigned int BLOCKFILE_TRAILER_SIZE = sizeof(BLOCKFILE_FRAME_MAGIC) + sizeof(uint32_t);
+
+CCriticalSection cs_stats;
+CBlockDecompressionStats statsDecompression;
+} // anon namespace
+
+bool IsBlockCompressionAvailable()
+{
+#if ENABLE_BLOCK_COMPRESSION
+    return true;
+#else
+    return false;
+#endif
+}
+
+CBlockDecompressionStats GetBlockDecompressionStats()
+{
+    LOCK(cs_stats);
+    return statsDecompression;
+}
+
+CCompressedBlockFile::CCompressedBlockFile() : file(NULL), nCachedFrame(-1)
+{
+}
+
+CCompressedBlockFile::~CCompressedBlockFile()
+{
+    if (file)
+        fclose(file);
+}
+
+bool CCompressedBlockFile::Open(const boost::filesystem::path& path)
+{
+    LOCK(cs);
+    assert(!file);
+    file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return error("%s : unable to open %s", __func__, path.string());
+
+    try {
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+        file = NULL;
+        if (fseek(filein.Get(), -(long)BLOCKFILE_TRAILER_SIZE, SEEK_END) != 0)
+            return error("%s : %s is too short", __func__, path.string());
+        long nTrailerPos = ftell(filein.Get());
+        char pchTrailer[BLOCKFILE_TRAILER_SIZE];
+        filein.read(pchTrailer, sizeof(pchTrailer));
+        if (memcmp(pchTrailer, BLOCKFILE_FRAME_MAGIC, sizeof(BLOCKFILE_FRAME_MAGIC)) != 0)
+            return error("%s : %s is not a compressed block file", __func__, path.string());
+        uint32_t nIndexPos = ReadLE32((const unsigned char*)pchTrailer + sizeof(BLOCKFILE_FRAME_MAGIC));
+        if (nTrailerPos < 0 || nIndexPos > (unsigned long)nTrailerPos || fseek(filein.Get(), nIndexPos, SEEK_SET) != 0)
+            return error("%s : bad index position in %s", __func__, path.string());
+        filein >> index;
+
+        // Frames must be contiguous, in order, and cover the whole file
+        uint32_t nFramePos = 0;
+        for (unsigned int i = 0; i < index.vFrameEnd.size(); i++) {
+            if (index.vFrameEnd[i] < nFramePos || index.vFrameEnd[i] > nIndexPos)
+                return error("%s : bad frame %u in %s", __func__, i, path.string());
+            nFramePos = index.vFrameEnd[i];
+        }
+        if (index.nFrameSize == 0 || (uint64_t)index.vFrameEnd.size() * index.nFrameSize < index.nRawSize ||
+            (index.vFrameEnd.size() > 0 && (uint64_t)(index.vFrameEnd.size() - 1) * index.nFrameSize >= index.nRawSize))
+            return error("%s : frames do not match the size of %s", __func__, path.string());
+        file = filein.release();
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool CCompressedBlockFile::InflateFrame(int nFrame)
+{
+#if ENABLE_BLOCK_COMPRESSION
+    if (nFrame == nCachedFrame)
+        return true;
+
+    int64_t nTimeStart = GetTimeMicros();
+    uint32_t nBegin = nFrame == 0 ? 0 : index.vFrameEnd[nFrame - 1];
+    uint32_t nEnd = index.vFrameEnd[nFrame];
+    vCompressed.resize(nEnd - nBegin);
+    if (fseek(file, nBegin, SEEK_SET) != 0 || (vCompressed.size() && fread(&vCompressed[0], 1, vCompressed.size(), file) != vCompressed.size()))
+        return error("%s : unable to read frame %d", __func__, nFrame);
+
+    // An error leaves no frame cached
+    nCachedFrame = -1;
+    uLongf nRawSize = std::min<uint32_t>(index.nFrameSize, index.nRawSize - nFrame * index.nFrameSize);
+    uLongf nInflated = nRawSize;
+    vCachedFrame.resize(nRawSize);
+    if (uncompress((Bytef*)&vCachedFrame[0], &nInflated, (const Bytef*)&vCompressed[0], vCompressed.size()) != Z_OK || nInflated != nRawSize)
+        return error("%s : frame %d is corrupt", __func__, nFrame);
+    nCachedFrame = nFrame;
+
+    int64_t nTime = GetTimeMicros() - nTimeStart;
+    {
+        LOCK(cs_stats);
+        statsDecompression.nFrames++;
+        statsDecompression.nBytes += nRawSize;
+        statsDecompression.nTimeMicros += nTime;
+    }
+    LogPrint("bench", "      - Inflate block file frame %d: %.2fms\n", nFrame, nTime * 0.001);
+    return true;
+#else
+    return error("%s : compressed block files are not supported by this build", __func__);
+#endif
+}
+
+bool CCompressedBlockFile::Read(uint32_t nPos, char* pch, size_t nSize)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    if (nPos > index.nRawSize || nSize > index.nRawSize - nPos)
+        return error("%s : %u bytes at position %u are past the end", __func__, nSize, nPos);
+
+    while (nSize > 0) {
+        int nFrame = nPos / index.nFrameSize;
+        if (!InflateFrame(nFrame))
+            return false;
+        size_t nOffset = nPos - nFrame * index.nFrameSize;
+        size_t nCopy = std::min(nSize, vCachedFrame.size() - nOffset);
+        memcpy(pch, &vCachedFrame[nOffset], nCopy);
+        pch += nCopy;
+        nPos += nCopy;
+        nSize -= nCopy;
+    }
+    return true;
+}
+
+bool CompressBlockFile(const boost::filesystem::path& pathIn, const boost::filesystem::path& pathOut, int nLevel)
+{
+#if ENABLE_BLOCK_COMPRESSION
+    CAutoFile filein(fopen(pathIn.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : unable to open %s", __func__, pathIn.string());
+    CAutoFile fileout(fopen(pathOut.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : unable to create %s", __func__, pathOut.string());
+
+    CBlockFileFrameIndex index;
+    index.nFrameSize = BLOCKFILE_FRAME_SIZE;
+    CSHA256 hasher;
+    std::vector<char> vRaw(BLOCKFILE_FRAME_SIZE);
+    std::vector<char> vCompressed(compressBound(BLOCKFILE_FRAME_SIZE));
+    uint32_t nOutPos = 0;
+    try {
+        while (true) {
+            size_t nRead = fread(&vRaw[0], 1, vRaw.size(), filein.Get());
+            if (nRead == 0)
+                break;
+            if (index.nRawSize > std::numeric_limits<uint32_t>::max() - nRead)
+                return error("%s : %s is too large", __func__, pathIn.string());
+            hasher.Write((const unsigned char*)&vRaw[0], nRead);
+            index.nRawSize += nRead;
+
+            uLongf nCompressed = vCompressed.size();
+            if (compress2((Bytef*)&vCompressed[0], &nCompressed, (const Bytef*)&vRaw[0], nRead, nLevel) != Z_OK)
+                return error("%s : unable to compress %s", __func__, pathIn.string());
+            fileout.write(&vCompressed[0], nCompressed);
+            nOutPos += nCompressed;
+            index.vFrameEnd.push_back(nOutPos);
+            boost::this_thread::interruption_point();
+        }
+        if (ferror(filein.Get()))
+            return error("%s : unable to read %s", __func__, pathIn.string());
+        hasher.Finalize(index.hashRaw.begin());
+
+        char pchTrailer[BLOCKFILE_TRAILER_SIZE];
+        memcpy(pchTrailer, BLOCKFILE_FRAME_MAGIC, sizeof(BLOCKFILE_FRAME_MAGIC));
+        WriteLE32((unsigned char*)pchTrailer + sizeof(BLOCKFILE_FRAME_MAGIC), nOutPos);
+        fileout << index;
+        fileout.write(pchTrailer, sizeof(pchTrailer));
+    } catch (std::exception& e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+
+    // The original is deleted once this returns, so read everything back first
+    CCompressedBlockFile check;
+    if (!check.Open(pathOut))
+        return false;
+    CSHA256 hasherCheck;
+    for (uint32_t nPos = 0; nPos < index.nRawSize; nPos += vRaw.size()) {
+        size_t nSize = std::min<size_t>(vRaw.size(), index.nRawSize - nPos);
+        if (!check.Read(nPos, &vRaw[0], nSize))
+            return false;
+        hasherCheck.Write((const unsigned char*)&vRaw[0], nSize);
+        boost::this_thread::interruption_point();
+    }
+    uint256 hashCheck;
+    hasherCheck.Finalize(hashCheck.begin());
+    if (hashCheck != index.hashRaw)
+        return error("%s : %s does not read back correctly", __func__, pathOut.string());
+    return true;
+#else
+    return error("%s : compressed block files are not supported by this build", __func__);
+#endif
+}
+
+bool DecompressBlockFile(const boost::filesystem::path& pathIn, const boost::filesystem::path& pathOut)
+{
+    CCompressedBlockFile filein;
+    if (!filein.Open(pathIn))
+        return false;
+    CAutoFile fileout(fopen(pathOut.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : unable to create %s", __func__, pathOut.string());
+
+    uint32_t nRawSize = filein.GetRawSize();
+    std::vector<char> vRaw(BLOCKFILE_FRAME_SIZE);
+    CSHA256 hasher;
+    try {
+        for (uint32_t nPos = 0; nPos < nRawSize; nPos += vRaw.size()) {
+            size_t nSize = std::min<size_t>(vRaw.size(), nRawSize - nPos);
+            if (!filein.Read(nPos, &vRaw[0], nSize))
+                return false;
+            hasher.Write((const unsigned char*)&vRaw[0], nSize);
+            fileout.write(&vRaw[0], nSize);
+        }
+    } catch (std::exception& e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+    uint256 hash;
+    hasher.Finalize(hash.begin());
+    if (hash != filein.GetIndex().hashRaw)
+        return error("%s : checksum mismatch in %s", __func__, pathIn.string());
+    FileCommit(fileout.Get());
+    fileout.fclose();
+    return true;
+}
+
+bool DeflateBuffer(const char* pch, size_t nSize, int nLevel, std::vector<char>& vOut)
+{
+#if ENABLE_BLOCK_COMPRESSION
+    uLongf nCompressed = compressBound(nSize);
+    vOut.resize(nCompressed);
+    if (compress2((Bytef*)&vOut[0], &nCompressed, (const Bytef*)pch, nSize, nLevel) != Z_OK)
+        return error("%s : unable to compress %u bytes", __func__, nSize);
+    vOut.resize(nCompressed);
+    return true;
+#else
+    return error("%s : compression is not supported by this build", __func__);
+#endif
+}
+
+bool InflateBuffer(const char* pch, size_t nSize, size_t nRawSize, std::vector<char>& vOut)
+{
+#if ENABLE_BLOCK_COMPRESSION
+    uLongf nInflated = nRawSize;
+    vOut.resize(nRawSize);
+    if (nRawSize == 0)
+        return true;
+    if (uncompress((Bytef*)&vOut[0], &nInflated, (const Bytef*)pch, nSize) != Z_OK || nInflated != nRawSize)
+        return error("%s : %u compressed bytes are corrupt", __func__, nSize);
+    return true;
+#else
+    return error("%s : compression is not supported by this build", __func__);
+#endif
+}
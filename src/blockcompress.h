@@ -0,0 +1,108 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCOMPRESS_H
+#define BITCOIN_BLOCKCOMPRESS_H
+
+#include "serialize.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+
+/**
+ * Compressed block files (blz?????.dat).
+ *
+ * A finalized blk?????.dat file can be replaced by a blz file that holds the
+ * same bytes cut into frames of BLOCKFILE_FRAME_SIZE, each deflated on its own.
+ * Any range of the original file is read back by inflating only the frames
+ * that cover it, so CDiskBlockPos keeps addressing the uncompressed data.
+ *
+ * Layout: the frames, the serialized CBlockFileFrameIndex, and a trailer made
+ * of BLOCKFILE_FRAME_MAGIC and the position of the index (32 bit, little endian).
+ */
+
+/** Uncompressed size of a frame of a compressed block file */
+static const unsigned int BLOCKFILE_FRAME_SIZE = 256 * 1024;
+/** Default for -blockcompression, the zlib level finalized block files are compressed with (0 = off) */
+static const int DEFAULT_BLOCK_COMPRESSION = 0;
+
+class CBlockFileFrameIndex
+{
+public:
+    uint32_t nFrameSize;
+    uint32_t nRawSize;
+    //! SHA256 of the uncompressed data
+    uint256 hashRaw;
+    //! Offset just past each frame in the compressed file
+    std::vector<uint32_t> vFrameEnd;
+
+    CBlockFileFrameIndex() : nFrameSize(0), nRawSize(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nFrameSize);
+        READWRITE(nRawSize);
+        READWRITE(hashRaw);
+        READWRITE(vFrameEnd);
+    }
+};
+
+/** Random access to the uncompressed contents of a blz file */
+class CCompressedBlockFile : private boost::noncopyable
+{
+private:
+    CCriticalSection cs;
+    FILE* file;
+    CBlockFileFrameIndex index;
+    //! The frame inflated last, sequential reads mostly stay inside it
+    int nCachedFrame;
+    std::vector<char> vCachedFrame;
+    std::vector<char> vCompressed;
+
+    bool InflateFrame(int nFrame);
+
+public:
+    CCompressedBlockFile();
+    ~CCompressedBlockFile();
+
+    bool Open(const boost::filesystem::path& path);
+    uint32_t GetRawSize() const { return index.nRawSize; }
+    const CBlockFileFrameIndex& GetIndex() const { return index; }
+
+    /** Copy nSize bytes at position nPos of the uncompressed data to pch */
+    bool Read(uint32_t nPos, char* pch, size_t nSize);
+};
+
+/** Statistics of the frames inflated by all CCompressedBlockFile readers */
+struct CBlockDecompressionStats {
+    uint64_t nFrames;
+    uint64_t nBytes;
+    int64_t nTimeMicros;
+
+    CBlockDecompressionStats() : nFrames(0), nBytes(0), nTimeMicros(0) {}
+};
+
+/** Whether this build can read and write compressed block files */
+bool IsBlockCompressionAvailable();
+/** Write pathIn compressed at zlib level nLevel to pathOut, and check that it reads back identically */
+bool CompressBlockFile(const boost::filesystem::path& pathIn, const boost::filesystem::path& pathOut, int nLevel);
+/** Write the uncompressed contents of the blz file pathIn to pathOut */
+bool DecompressBlockFile(const boost::filesystem::path& pathIn, const boost::filesystem::path& pathOut);
+CBlockDecompressionStats GetBlockDecompressionStats();
+
+/** Deflate nSize bytes at pch at zlib level nLevel into vOut, for records kept compressed on their own */
+bool DeflateBuffer(const char* pch, size_t nSize, int nLevel, std::vector<char>& vOut);
+/** Inflate nSize bytes at pch into vOut, which must come out nRawSize bytes long */
+bool InflateBuffer(const char* pch, size_t nSize, size_t nRawSize, std::vector<char>& vOut);
+
+#endif // BITCOIN_BLOCKCOMPRESS_H
@@ -0,0 +1,183 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "swifttx.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <limits>
+
+#include <boost/unordered_map.hpp>
+
+//! Smallest serialized transaction, bounds the number of transactions a block can have
+static const unsigned int MIN_TRANSACTION_SIZE = 60;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+                                                                             header(block.GetBlockHeader()),
+                                                                             vchBlockSig(block.vchBlockSig)
+{
+    FillShortTxIDSelector();
+
+    // The coinbase and the coinstake are new to everyone
+    size_t nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    prefilledtxn.resize(std::min(nPrefilled, block.vtx.size()));
+    for (size_t i = 0; i < prefilledtxn.size(); i++) {
+        prefilledtxn[i].index = 0;
+        prefilledtxn[i].tx = block.vtx[i];
+    }
+    shorttxids.reserve(block.vtx.size() - prefilledtxn.size());
+    for (size_t i = prefilledtxn.size(); i < block.vtx.size(); i++)
+        shorttxids.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)&stream[0], stream.size()).Finalize(hash);
+    shorttxidk0 = ReadLE64(hash);
+    shorttxidk1 = ReadLE64(hash + 8);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    AssertLockHeld(cs_main);
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE_CURRENT / MIN_TRANSACTION_SIZE)
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.assign(cmpctblock.BlockTxCount(), CTransaction());
+    vAvailable.assign(cmpctblock.BlockTxCount(), false);
+    prefilled_count = 0;
+    mempool_count = 0;
+
+    int nLastPrefilled = -1;
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        const PrefilledTransaction& prefilled = cmpctblock.prefilledtxn[i];
+        if (prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        nLastPrefilled += prefilled.index + 1;
+        if (nLastPrefilled > std::numeric_limits<uint16_t>::max())
+            return READ_STATUS_INVALID;
+        // There must be a short id for every index skipped so far
+        if ((size_t)nLastPrefilled > cmpctblock.shorttxids.size() + i)
+            return READ_STATUS_INVALID;
+        txn_available[nLastPrefilled] = prefilled.tx;
+        vAvailable[nLastPrefilled] = true;
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // Where each short id goes, skipping the prefilled indexes
+    boost::unordered_map<uint64_t, uint16_t> mapShortIDs;
+    mapShortIDs.reserve(cmpctblock.shorttxids.size());
+    uint16_t nIndexOffset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (vAvailable[i + nIndexOffset])
+            nIndexOffset++;
+        mapShortIDs[cmpctblock.shorttxids[i]] = i + nIndexOffset;
+        // Two transactions of the block with the same short id: it is easier
+        // to download the whole block than to tell them apart
+        if (mapShortIDs.size() != i + 1)
+            return READ_STATUS_FAILED;
+    }
+
+    // A short id matched more than once is left for the peer to send
+    std::vector<bool> vMatched(vAvailable);
+    {
+        LOCK(mempool.cs);
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it) {
+            boost::unordered_map<uint64_t, uint16_t>::iterator itID = mapShortIDs.find(cmpctblock.GetShortID(it->GetTx().GetHash()));
+            if (itID == mapShortIDs.end())
+                continue;
+            if (!vMatched[itID->second]) {
+                txn_available[itID->second] = it->GetTx();
+                vAvailable[itID->second] = true;
+                vMatched[itID->second] = true;
+                mempool_count++;
+            } else if (vAvailable[itID->second]) {
+                vAvailable[itID->second] = false;
+                mempool_count--;
+            }
+        }
+    }
+
+    // Locked transactions are usually in the mempool too, a lock request
+    // that was not accepted there is only found here
+    {
+        LOCK(cs_swifttx);
+        for (TxLockReqMap::const_iterator it = mapTxLockReq.begin(); it != mapTxLockReq.end() && mempool_count < mapShortIDs.size(); ++it) {
+            boost::unordered_map<uint64_t, uint16_t>::iterator itID = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (itID == mapShortIDs.end() || vMatched[itID->second])
+                continue;
+            txn_available[itID->second] = it->second;
+            vAvailable[itID->second] = true;
+            vMatched[itID->second] = true;
+            mempool_count++;
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s, %u of %u txn available\n", header.GetHash().ToString(), prefilled_count + mempool_count, txn_available.size());
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < vAvailable.size());
+    return vAvailable[index];
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing)
+{
+    assert(!header.IsNull());
+    block = CBlock(header);
+    block.vchBlockSig = vchBlockSig;
+    block.vtx.resize(txn_available.size());
+
+    size_t nMissingOffset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (vAvailable[i]) {
+            block.vtx[i] = txn_available[i];
+        } else {
+            if (nMissingOffset >= vtx_missing.size())
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[nMissingOffset++];
+        }
+    }
+    // Can only be filled once
+    header.SetNull();
+    txn_available.clear();
+    vAvailable.clear();
+
+    if (vtx_missing.size() != nMissingOffset)
+        return READ_STATUS_INVALID;
+
+    // A short id that matched the wrong transaction shows up here; the block
+    // may still be fine, so it is downloaded whole rather than rejected
+    bool fMutated;
+    if (block.ComputeMerkleRoot(&fMutated) != block.hashMerkleRoot || fMutated)
+        return READ_STATUS_FAILED;
+    block.fCheckedMerkleRoot = true;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool and %lu txn requested\n", block.GetHash().ToString(), prefilled_count, mempool_count, vtx_missing.size());
+    return READ_STATUS_OK;
+}
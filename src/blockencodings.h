@@ -0,0 +1,201 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <limits>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Compact blocks
+ *
+ * A "cmpctblock" message carries the header and signature of a block, and a
+ * 6 byte short id for each of its transactions instead of the transaction,
+ * except for the coinbase and coinstake, which no peer can have seen yet and
+ * are sent in full. The receiver rebuilds the block from its mempool and the
+ * SwiftTX lock requests it knows, and fetches only the transactions it lacks
+ * with "getblocktxn", which is answered by "blocktxn".
+ *
+ * Short ids are SipHash-2-4 of the txid, keyed with the SHA256 of the header
+ * and a nonce picked by the sender, so they cannot be made to collide ahead
+ * of time. A collision is caught by the merkle root check and the block is
+ * then downloaded whole.
+ *
+ * Peers announce support with "sendcmpct"; when its flag is set the sender
+ * asks to be sent new blocks as "cmpctblock" right away (high-bandwidth
+ * mode), instead of an inv followed by a getdata for a MSG_CMPCT_BLOCK.
+ */
+
+//! Version of the compact block encoding negotiated with "sendcmpct"
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+//! Peers asked at most to announce new blocks with "cmpctblock" right away
+static const unsigned int MAX_CMPCTBLOCK_HIGH_BANDWIDTH_PEERS = 3;
+//! Blocks deeper than this are sent whole when asked for as compact blocks or for some transactions
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+
+/** A transaction sent in full with a compact block */
+class PrefilledTransaction
+{
+public:
+    //! Distance to the previous prefilled transaction, as encoded on the wire
+    uint16_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        uint64_t nIndex = index;
+        READWRITE(COMPACTSIZE(nIndex));
+        if (nIndex > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("index overflowed 16 bits");
+        index = nIndex;
+        READWRITE(tx);
+    }
+};
+
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+    //! Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(header);
+        READWRITE(vchBlockSig);
+        READWRITE(nonce);
+
+        uint64_t nShortIDs = shorttxids.size();
+        READWRITE(COMPACTSIZE(nShortIDs));
+        if (ser_action.ForRead()) {
+            if (nShortIDs > MAX_BLOCK_SIZE_CURRENT / 6)
+                throw std::ios_base::failure("too many short ids");
+            shorttxids.resize(nShortIDs);
+        }
+        for (size_t i = 0; i < nShortIDs; i++) {
+            // 6 bytes, the low 4 first
+            uint32_t nLow = (uint32_t)shorttxids[i];
+            uint16_t nHigh = (uint16_t)(shorttxids[i] >> 32);
+            READWRITE(nLow);
+            READWRITE(nHigh);
+            shorttxids[i] = ((uint64_t)nHigh << 32) | nLow;
+        }
+
+        READWRITE(prefilledtxn);
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/** The transactions of a block at the given indexes, asked for with "getblocktxn" */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    //! Absolute in memory, each as the distance to the previous one on the wire
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        uint64_t nIndexes = indexes.size();
+        READWRITE(COMPACTSIZE(nIndexes));
+        if (ser_action.ForRead()) {
+            if (nIndexes > std::numeric_limits<uint16_t>::max() + 1)
+                throw std::ios_base::failure("too many indexes");
+            indexes.resize(nIndexes);
+        }
+        uint64_t nNext = 0;
+        for (size_t i = 0; i < nIndexes; i++) {
+            uint64_t nDiff = indexes[i] - nNext;
+            READWRITE(COMPACTSIZE(nDiff));
+            if (nNext + nDiff > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("index overflowed 16 bits");
+            indexes[i] = nNext + nDiff;
+            nNext = indexes[i] + 1;
+        }
+    }
+};
+
+/** The answer to a BlockTransactionsRequest */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //!< Invalid object, peer is sending bogus data
+    READ_STATUS_FAILED,  //!< Failed to process object, e.g. a short id collision
+};
+
+/** A block being rebuilt from a compact block */
+class PartiallyDownloadedBlock
+{
+private:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vAvailable;
+    size_t prefilled_count;
+    size_t mempool_count;
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+public:
+    PartiallyDownloadedBlock() : prefilled_count(0), mempool_count(0) {}
+
+    /** Fill in what the mempool and the SwiftTX lock requests have. Requires cs_main. */
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    bool IsTxAvailable(size_t index) const;
+    size_t BlockTxCount() const { return txn_available.size(); }
+    /** Build the block with vtx_missing at the indexes that were not available, in order */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing);
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
@@ -0,0 +1,131 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/dystem-config.h"
+#endif
+
+#include "blocktrace.h"
+
+#include "main.h"
+#include "primitives/block.h"
+#include "sync.h"
+#include "utiltime.h"
+
+#include <atomic>
+#include <deque>
+
+#include <boost/thread/tss.hpp>
+
+#ifdef HAVE_SYS_SDT_H
+// Static tracepoints for perf, bpftrace and SystemTap, nops unless attached to
+#include <sys/sdt.h>
+#define BLOCKTRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(dystem, name, a, b, c)
+#else
+#define BLOCKTRACE_PROBE3(name, a, b, c)
+#endif
+
+static const char* ppszPhaseNames[BLOCKTRACE_PHASES] = {
+    "checkblock",
+    "acceptblock",
+    "writeblock",
+    "activatebestchain",
+    "connecttip",
+    "connectblock",
+    "blockvalue",
+    "blockpayee",
+    "flushstate",
+    "updatetip",
+    "syncwallets",
+};
+
+static std::atomic<unsigned int> nMaxBlockTraces(DEFAULT_BLOCK_TRACES);
+static CCriticalSection cs_blockTraces;
+static std::deque<CBlockTrace> dequeBlockTraces;
+
+// The trace lives on the stack of its CBlockTraceScope, never delete it here
+static void NoBlockTraceCleanup(CBlockTrace*) {}
+static boost::thread_specific_ptr<CBlockTrace> ptrBlockTrace(NoBlockTraceCleanup);
+
+const char* GetBlockTracePhaseName(BlockTracePhase phase)
+{
+    return ppszPhaseNames[phase];
+}
+
+CBlockTraceScope::CBlockTraceScope(const CBlock& block, int nPeer, int64_t nTimeReceived) : fActive(false)
+{
+    if (nMaxBlockTraces.load(std::memory_order_relaxed) == 0 || ptrBlockTrace.get() != NULL)
+        return;
+    trace.hash = block.GetHash();
+    trace.nPeer = nPeer;
+    trace.nTimeReceived = nTimeReceived;
+    trace.nStart = GetTimeMicros() - nTimeReceived;
+    ptrBlockTrace.reset(&trace);
+    fActive = true;
+}
+
+CBlockTraceScope::~CBlockTraceScope()
+{
+    if (!fActive)
+        return;
+    ptrBlockTrace.reset();
+    trace.nDuration = GetTimeMicros() - trace.nTimeReceived;
+    trace.fTip = GetChainTipSnapshot().hashBlock == trace.hash;
+    BLOCKTRACE_PROBE3(block_traced, trace.hash.begin(), trace.nHeight, trace.nDuration);
+
+    LOCK(cs_blockTraces);
+    dequeBlockTraces.push_front(trace);
+    while (dequeBlockTraces.size() > nMaxBlockTraces.load(std::memory_order_relaxed))
+        dequeBlockTraces.pop_back();
+}
+
+CBlockTracePhaseTimer::CBlockTracePhaseTimer(BlockTracePhase phase) : ptrace(ptrBlockTrace.get()), nIndex(0), nTimeStart(0)
+{
+    if (ptrace == NULL)
+        return;
+    if (ptrace->vSpans.size() >= MAX_BLOCK_TRACE_SPANS) {
+        ptrace->nSpansDropped++;
+        ptrace = NULL;
+        return;
+    }
+    nTimeStart = GetTimeMicros();
+    nIndex = ptrace->vSpans.size();
+    CBlockTraceSpan span;
+    span.phase = phase;
+    span.nDepth = ptrace->nDepth++;
+    span.nStart = nTimeStart - ptrace->nTimeReceived;
+    span.nDuration = 0;
+    ptrace->vSpans.push_back(span);
+}
+
+CBlockTracePhaseTimer::~CBlockTracePhaseTimer()
+{
+    if (ptrace == NULL)
+        return;
+    CBlockTraceSpan& span = ptrace->vSpans[nIndex];
+    span.nDuration = GetTimeMicros() - nTimeStart;
+    ptrace->nDepth--;
+    BLOCKTRACE_PROBE3(block_phase, (int)span.phase, span.nDepth, span.nDuration);
+}
+
+void SetBlockTraceHeight(const uint256& hash, int nHeight)
+{
+    CBlockTrace* ptrace = ptrBlockTrace.get();
+    if (ptrace != NULL && ptrace->hash == hash)
+        ptrace->nHeight = nHeight;
+}
+
+void SetBlockTraceLimit(unsigned int nLimit)
+{
+    nMaxBlockTraces.store(nLimit, std::memory_order_relaxed);
+    LOCK(cs_blockTraces);
+    while (dequeBlockTraces.size() > nLimit)
+        dequeBlockTraces.pop_back();
+}
+
+std::vector<CBlockTrace> GetBlockTraces()
+{
+    LOCK(cs_blockTraces);
+    return std::vector<CBlockTrace>(dequeBlockTraces.begin(), dequeBlockTraces.end());
+}
@@ -0,0 +1,111 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKTRACE_H
+#define BITCOIN_BLOCKTRACE_H
+
+#include "uint256.h"
+
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+
+//! -blocktraces default, the timelines of the last blocks kept for getblocktraces
+static const unsigned int DEFAULT_BLOCK_TRACES = 32;
+//! Spans kept for one block, a reorg connecting many blocks is cut short
+static const size_t MAX_BLOCK_TRACE_SPANS = 256;
+
+/** The parts of the block path that are timed */
+enum BlockTracePhase {
+    BLOCKTRACE_CHECK_BLOCK,
+    BLOCKTRACE_ACCEPT_BLOCK,
+    BLOCKTRACE_WRITE_BLOCK,
+    BLOCKTRACE_ACTIVATE_BEST_CHAIN,
+    BLOCKTRACE_CONNECT_TIP,
+    BLOCKTRACE_CONNECT_BLOCK,
+    BLOCKTRACE_BLOCK_VALUE,
+    BLOCKTRACE_BLOCK_PAYEE,
+    BLOCKTRACE_FLUSH_STATE,
+    BLOCKTRACE_UPDATE_TIP,
+    BLOCKTRACE_SYNC_WALLETS,
+    BLOCKTRACE_PHASES
+};
+
+const char* GetBlockTracePhaseName(BlockTracePhase phase);
+
+struct CBlockTraceSpan {
+    BlockTracePhase phase;
+    //! Spans open around this one when it started
+    int nDepth;
+    //! Microseconds after the block was received
+    int64_t nStart;
+    int64_t nDuration;
+};
+
+/** The timeline of one block, from its arrival until it was processed */
+struct CBlockTrace {
+    uint256 hash;
+    int nHeight;
+    //! The peer it came from, -1 when not from the network
+    int nPeer;
+    //! Microseconds since the epoch
+    int64_t nTimeReceived;
+    //! Microseconds after its arrival that processing started and ended
+    int64_t nStart;
+    int64_t nDuration;
+    //! Whether the block was the chain tip once processed
+    bool fTip;
+    std::vector<CBlockTraceSpan> vSpans;
+    size_t nSpansDropped;
+    int nDepth;
+
+    CBlockTrace() : nHeight(-1), nPeer(-1), nTimeReceived(0), nStart(0), nDuration(0), fTip(false), nSpansDropped(0), nDepth(0) {}
+};
+
+/**
+ * Traces the phases run on this thread while in scope, for the block given,
+ * and keeps the timeline for getblocktraces. Does nothing when a block is
+ * traced on this thread already, so nested calls add to the outer trace.
+ */
+class CBlockTraceScope
+{
+private:
+    CBlockTrace trace;
+    bool fActive;
+
+    CBlockTraceScope(const CBlockTraceScope&);
+    CBlockTraceScope& operator=(const CBlockTraceScope&);
+
+public:
+    CBlockTraceScope(const CBlock& block, int nPeer, int64_t nTimeReceived);
+    ~CBlockTraceScope();
+};
+
+/** Times a phase of the block traced on this thread, if there is one */
+class CBlockTracePhaseTimer
+{
+private:
+    CBlockTrace* ptrace;
+    size_t nIndex;
+    int64_t nTimeStart;
+
+    CBlockTracePhaseTimer(const CBlockTracePhaseTimer&);
+    CBlockTracePhaseTimer& operator=(const CBlockTracePhaseTimer&);
+
+public:
+    explicit CBlockTracePhaseTimer(BlockTracePhase phase);
+    ~CBlockTracePhaseTimer();
+};
+
+/** Set the height of the block traced on this thread, once it is known */
+void SetBlockTraceHeight(const uint256& hash, int nHeight);
+
+/** Number of timelines kept, 0 to stop tracing */
+void SetBlockTraceLimit(unsigned int nLimit);
+
+/** The timelines kept, newest first */
+std::vector<CBlockTrace> GetBlockTraces();
+
+#endif // BITCOIN_BLOCKTRACE_H
@@ -4,8 +4,10 @@
 
 #include "bloom.h"
 
+#include "crypto/common.h"
 #include "hash.h"
 #include "primitives/transaction.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "streams.h"
@@ -13,6 +15,9 @@
 #include <math.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <limits>
+
 #include <boost/foreach.hpp>
 
 #define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455
@@ -20,6 +25,45 @@
 
 using namespace std;
 
+static void PreparePushes(const CScript& script, std::vector<CMurmurHash3Prepared>& vPushes)
+{
+    CScript::const_iterator pc = script.begin();
+    vector<unsigned char> data;
+    while (pc < script.end()) {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, data))
+            break;
+        if (data.size() != 0)
+            vPushes.push_back(CMurmurHash3Prepared(data));
+    }
+}
+
+CBloomFilterTx::CBloomFilterTx(const CTransaction& tx) : hash(tx.GetHash()), txid(hash.begin(), hash.size())
+{
+    vout.resize(tx.vout.size());
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        const CScript& scriptPubKey = tx.vout[i].scriptPubKey;
+        PreparePushes(scriptPubKey, vout[i].vPushes);
+        vout[i].fPubKey = false;
+        if (!vout[i].vPushes.empty()) {
+            txnouttype type;
+            vector<vector<unsigned char> > vSolutions;
+            vout[i].fPubKey = Solver(scriptPubKey, type, vSolutions) && (type == TX_PUBKEY || type == TX_MULTISIG);
+        }
+    }
+
+    vin.resize(tx.vin.size());
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        // The outpoint as serialized: the txid, then the index in little endian
+        const COutPoint& prevout = tx.vin[i].prevout;
+        unsigned char vchOutPoint[36];
+        memcpy(vchOutPoint, prevout.hash.begin(), 32);
+        WriteLE32(vchOutPoint + 32, prevout.n);
+        vin[i].prevout.Set(vchOutPoint, sizeof(vchOutPoint));
+        PreparePushes(tx.vin[i].scriptSig, vin[i].vPushes);
+    }
+}
+
 CBloomFilter::CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweakIn, unsigned char nFlagsIn) :
  /**	
  * The ideal size for a bloom filter with a given number of elements and false positive rate is:
@@ -46,6 +90,36 @@ inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<
     return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
 }
 
+inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const CMurmurHash3Prepared& prepared) const
+{
+    return prepared.Hash(nHashNum * 0xFBA4C795 + nTweak) % (vData.size() * 8);
+}
+
+void CBloomFilter::insert(const CMurmurHash3Prepared& prepared)
+{
+    if (isFull)
+        return;
+    for (unsigned int i = 0; i < nHashFuncs; i++) {
+        unsigned int nIndex = Hash(i, prepared);
+        vData[nIndex >> 3] |= (1 << (7 & nIndex));
+    }
+    isEmpty = false;
+}
+
+bool CBloomFilter::contains(const CMurmurHash3Prepared& prepared) const
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    for (unsigned int i = 0; i < nHashFuncs; i++) {
+        unsigned int nIndex = Hash(i, prepared);
+        if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
+            return false;
+    }
+    return true;
+}
+
 void CBloomFilter::insert(const vector<unsigned char>& vKey)
 {
     if (isFull)
@@ -114,6 +188,15 @@ bool CBloomFilter::IsWithinSizeConstraints() const
 }
 
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(CBloomFilterTx(tx));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomFilterTx& txData)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -122,33 +205,21 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
         return true;
     if (isEmpty)
         return false;
-    const uint256& hash = tx.GetHash();
-    if (contains(hash))
+    if (contains(txData.txid))
         fFound = true;
 
-    for (unsigned int i = 0; i < tx.vout.size(); i++) {
-        const CTxOut& txout = tx.vout[i];
+    for (unsigned int i = 0; i < txData.vout.size(); i++) {
+        const CBloomFilterTx::Output& output = txData.vout[i];
         // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end()) {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data)) {
+        BOOST_FOREACH (const CMurmurHash3Prepared& push, output.vPushes) {
+            if (contains(push)) {
                 fFound = true;
-                if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
-                    insert(COutPoint(hash, i));
-                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY) {
-                    txnouttype type;
-                    vector<vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
-                        (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
-                }
+                if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL ||
+                    ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY && output.fPubKey))
+                    insert(COutPoint(txData.hash, i));
                 break;
             }
         }
@@ -157,21 +228,15 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx)
     if (fFound)
         return true;
 
-    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+    BOOST_FOREACH (const CBloomFilterTx::Input& input, txData.vin) {
         // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+        if (contains(input.prevout))
             return true;
 
         // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
-        while (pc < txin.scriptSig.end()) {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+        BOOST_FOREACH (const CMurmurHash3Prepared& push, input.vPushes)
+            if (contains(push))
                 return true;
-        }
     }
 
     return false;
@@ -188,3 +253,88 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    double logFpRate = log(fpRate);
+    // The optimal number of hash functions is log(fpRate) / log(0.5), kept within 1-50
+    nHashFuncs = std::max(1, std::min((int)round(logFpRate / log(0.5)), 50));
+    // Between 2 and 3 generations of nElements / 2 entries are held
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    // From fpRate = pow(1.0 - exp(-nHashFuncs * nMaxElements / nFilterBits), nHashFuncs)
+    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    data.clear();
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+void CRollingBloomFilter::insert(const CMurmurHash3Prepared& prepared)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        // Wipe the old entries that used this generation number
+        for (uint32_t p = 0; p < data.size(); p += 2) {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t h = prepared.Hash(n * 0xFBA4C795 + nTweak);
+        int bit = h & 0x3F;
+        // The lowest bit of pos is ignored: the even word holds the low bit of the generation, the odd one the high bit
+        uint32_t pos = (h >> 6) % data.size();
+        data[pos & ~1] = (data[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const CMurmurHash3Prepared& prepared) const
+{
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t h = prepared.Hash(n * 0xFBA4C795 + nTweak);
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % data.size();
+        // Set in no generation
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    insert(CMurmurHash3Prepared(vKey));
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    insert(CMurmurHash3Prepared(hash.begin(), hash.size()));
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    return contains(CMurmurHash3Prepared(vKey));
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    return contains(CMurmurHash3Prepared(hash.begin(), hash.size()));
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
@@ -5,6 +5,7 @@
 #ifndef BITCOIN_BLOOM_H
 #define BITCOIN_BLOOM_H
 
+#include "hash.h"
 #include "serialize.h"
 
 #include <vector>
@@ -29,6 +30,35 @@ enum bloomflags {
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that bloom filters are matched against,
+ * parsed out of its scripts and prepared for hashing once, so that matching
+ * the transaction against the filters of many peers only does the per-seed
+ * part of MurmurHash3.
+ */
+class CBloomFilterTx
+{
+public:
+    struct Output {
+        //! The data pushes of the scriptPubKey, empty ones left out
+        std::vector<CMurmurHash3Prepared> vPushes;
+        //! Pay-to-pubkey or pay-to-multisig, for BLOOM_UPDATE_P2PUBKEY_ONLY
+        bool fPubKey;
+    };
+    struct Input {
+        CMurmurHash3Prepared prevout;
+        //! The data pushes of the scriptSig, empty ones left out
+        std::vector<CMurmurHash3Prepared> vPushes;
+    };
+
+    uint256 hash;
+    CMurmurHash3Prepared txid;
+    std::vector<Output> vout;
+    std::vector<Input> vin;
+
+    explicit CBloomFilterTx(const CTransaction& tx);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we sends them.
@@ -51,6 +81,10 @@ private:
     unsigned char nFlags;
 
     unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    unsigned int Hash(unsigned int nHashNum, const CMurmurHash3Prepared& prepared) const;
+
+    void insert(const CMurmurHash3Prepared& prepared);
+    bool contains(const CMurmurHash3Prepared& prepared) const;
 
 public:
     /**
@@ -92,9 +126,53 @@ public:
 
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
+    //! The same with the data elements of the transaction already prepared
+    bool IsRelevantAndUpdate(const CBloomFilterTx& txData);
 
     //! Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive
+ * rate. Unlike CBloomFilter, it is never sent to peers and uses its own random
+ * tweak.
+ *
+ * The filter holds three generations of nElements / 2 entries each, as two
+ * bits per position. When a generation fills up, the oldest one is wiped, so
+ * contains() always returns true for the last nElements inserted and never
+ * for entries older than 1.5 * nElements insertions (false positives aside).
+ * The memory used is fixed at construction, and insert() and contains()
+ * cost nHashFuncs hashes of the key whatever the number of entries.
+ *
+ * Don't create global CRollingBloomFilter objects, as they call GetRand(),
+ * which may not be ready yet at static initialization.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    //! Forget everything, and pick a new tweak
+    void reset();
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    //! Position P is bit P & 63 of data[(P >> 6) * 2] (low bit of the generation) and data[(P >> 6) * 2 + 1] (high bit)
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
+
+    void insert(const CMurmurHash3Prepared& prepared);
+    bool contains(const CMurmurHash3Prepared& prepared) const;
+};
+
 #endif // BITCOIN_BLOOM_H
@@ -5,8 +5,36 @@
 
 #include "chain.h"
 
+#include "memusage.h"
+
 using namespace std;
 
+CBlockIndex* CBlockIndexArena::Allocate()
+{
+    if (nUsed == CHUNK_ENTRIES) {
+        vChunks.push_back(static_cast<CBlockIndex*>(::operator new(sizeof(CBlockIndex) * CHUNK_ENTRIES)));
+        nUsed = 0;
+    }
+    return vChunks.back() + nUsed++;
+}
+
+void CBlockIndexArena::Clear()
+{
+    for (size_t i = 0; i < vChunks.size(); i++) {
+        size_t nEntries = (i + 1 == vChunks.size()) ? nUsed : CHUNK_ENTRIES;
+        for (size_t j = 0; j < nEntries; j++)
+            vChunks[i][j].~CBlockIndex();
+        ::operator delete(vChunks[i]);
+    }
+    vChunks.clear();
+    nUsed = CHUNK_ENTRIES;
+}
+
+size_t CBlockIndexArena::DynamicMemoryUsage() const
+{
+    return memusage::MallocUsage(sizeof(CBlockIndex) * CHUNK_ENTRIES) * vChunks.size() + memusage::DynamicUsage(vChunks);
+}
+
 /**
  * CChain implementation
  */
@@ -13,6 +13,7 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <new>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -113,15 +114,9 @@ public:
     //! pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
-    //! pointer to the index of the next block
-    CBlockIndex* pnext;
-
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
-    //ppcoin: trust score of block chain
-    uint256 bnChainTrust;
-
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -162,7 +157,11 @@ public:
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
     COutPoint prevoutStake;
     unsigned int nStakeTime;
-    uint256 hashProofOfStake;
+
+    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
+    //! Kept here, between 4 byte fields, so it does not add padding
+    uint32_t nSequenceId;
+
     int64_t nMint;
     int64_t nMoneySupply;
 
@@ -173,9 +172,6 @@ public:
     unsigned int nBits;
     unsigned int nNonce;
 
-    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
-    uint32_t nSequenceId;
-    
     void SetNull()
     {
         phashBlock = NULL;
@@ -222,13 +218,11 @@ public:
         nNonce = block.nNonce;
 
         //Proof of Stake
-        bnChainTrust = uint256();
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
         nStakeModifier = 0;
         nStakeModifierChecksum = 0;
-        hashProofOfStake = uint256();
 
         if (block.IsProofOfStake()) {
             SetProofOfStake();
@@ -394,6 +388,7 @@ class CDiskBlockIndex : public CBlockIndex
 {
 public:
     uint256 hashPrev;
+    //! Never set, only kept for the on-disk format
     uint256 hashNext;
 
     CDiskBlockIndex()
@@ -436,7 +431,6 @@ public:
         } else {
             const_cast<CDiskBlockIndex*>(this)->prevoutStake.SetNull();
             const_cast<CDiskBlockIndex*>(this)->nStakeTime = 0;
-            const_cast<CDiskBlockIndex*>(this)->hashProofOfStake = uint256();
         }
 
         // block header
@@ -473,6 +467,38 @@ public:
     }
 };
 
+/**
+ * Allocates block index entries in chunks instead of one heap allocation
+ * each, which saves the allocator overhead of millions of small objects and
+ * keeps neighbouring blocks close in memory. Entries live until Clear(), the
+ * block index never frees a single one.
+ */
+class CBlockIndexArena
+{
+private:
+    std::vector<CBlockIndex*> vChunks;
+    //! Entries handed out from the last chunk
+    size_t nUsed;
+
+    CBlockIndex* Allocate();
+
+public:
+    //! Entries per chunk, about a megabyte
+    static const size_t CHUNK_ENTRIES = 4096;
+
+    CBlockIndexArena() : nUsed(CHUNK_ENTRIES) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* New() { return new (Allocate()) CBlockIndex(); }
+    CBlockIndex* New(const CBlock& block) { return new (Allocate()) CBlockIndex(block); }
+
+    //! Destroy all entries, invalidating every pointer handed out
+    void Clear();
+
+    //! Memory held by the chunks, used or not
+    size_t DynamicMemoryUsage() const;
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain
 {
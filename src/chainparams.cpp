@@ -13,6 +13,7 @@
 #include "utilstrencodings.h"
 
 #include <assert.h>
+#include <limits>
 
 #include <boost/assign/list_of.hpp>
 
@@ -112,6 +113,7 @@ public:
         /** Height or Time Based Activations **/
         nLastPOWBlock = 200;
         nModifierUpdateBlock = 1;
+        nDeterministicMasternodeHeight = std::numeric_limits<int>::max();
 
         //python genesis.py -a quark-hash -z "A slip-up by supermarket Asda in an online order saw a woman charged £930 for a single banana" -t 1524319765 -v 0 -p 04575f641084f76b9e94aae509ce78f6213ee4855d5c245b76d931fa190a1b453edf3ecf2b28288a338ac186d07eedc6d99256838cb57322406edc697f239a0a6e
         const char* pszTimestamp = "A slip-up by supermarket Asda in an online order saw a woman charged £930 for a single banana";
@@ -123,7 +125,7 @@ public:
         txNew.vout[0].scriptPubKey = CScript() << ParseHex("04575f641084f76b9e94aae509ce78f6213ee4855d5c245b76d931fa190a1b453edf3ecf2b28288a338ac186d07eedc6d99256838cb57322406edc697f239a0a6e") << OP_CHECKSIG;
         genesis.vtx.push_back(txNew);
         genesis.hashPrevBlock = 0;
-        genesis.hashMerkleRoot = genesis.BuildMerkleTree();
+        genesis.hashMerkleRoot = genesis.ComputeMerkleRoot();
         genesis.nVersion = 1;
         genesis.nTime = 1524319765;
         genesis.nBits = 0x1e0ffff0;
@@ -157,7 +159,7 @@ public:
         fMineBlocksOnDemand = false;
         fSkipProofOfWorkCheck = false;
         fTestnetToBeDeprecatedFieldRPC = false;
-        fHeadersFirstSyncingActive = false;
+        fHeadersFirstSyncingActive = true;
 
         nPoolMaxTransactions = 3;
         strSporkKey = "04575f641084f76b9e94aae509ce78f6213ee4855d5c245b76d931fa190a1b453edf3ecf2b28288a338ac186d07eedc6d99256838cb57322406edc697f239a0a6e";
@@ -200,6 +202,7 @@ public:
         nMaturity = 10;
         nMasternodeCountDrift = 4;
         nModifierUpdateBlock = 1; 
+        nDeterministicMasternodeHeight = std::numeric_limits<int>::max();
         nMaxMoneyOut = 21000000 * COIN;
 
         //! Modify the testnet genesis block so the timestamp is valid for a later start.
@@ -273,6 +276,7 @@ public:
         nMinerThreads = 1;
         nTargetTimespan = 24 * 60 * 60; // DYSTEM: 1 day
         nTargetSpacing = 1 * 60;        // DYSTEM: 1 minutes
+        nDeterministicMasternodeHeight = 300;
         bnProofOfWorkLimit = ~uint256(0) >> 1;
         genesis.nTime = 1524322115;
         genesis.nBits = 0x1e0ffff0;
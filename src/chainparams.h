@@ -15,9 +15,12 @@
 #include "protocol.h"
 #include "uint256.h"
 
+#include <map>
 #include <vector>
 
 typedef unsigned char MessageStartChars[MESSAGE_START_SIZE];
+//! hash_serialized of gettxoutsetinfo, by block hash
+typedef std::map<uint256, uint256> MapUTXOSnapshots;
 
 struct CDNSSeedData {
     std::string name, host;
@@ -89,6 +92,8 @@ public:
     const std::vector<unsigned char>& Base58Prefix(Base58Type type) const { return base58Prefixes[type]; }
     const std::vector<CAddress>& FixedSeeds() const { return vFixedSeeds; }
     virtual const Checkpoints::CCheckpointData& Checkpoints() const = 0;
+    /** UTXO sets -loadtxoutset accepts; any where blocks are mined on demand */
+    const MapUTXOSnapshots& UTXOSnapshots() const { return mapUTXOSnapshots; }
     int PoolMaxTransactions() const { return nPoolMaxTransactions; }
     std::string SporkKey() const { return strSporkKey; }
     int64_t StartMasternodePayments() const { return nStartMasternodePayments; }
@@ -99,6 +104,8 @@ public:
     /** Height or Time Based Activations **/
     int ModifierUpgradeBlock() const { return nModifierUpdateBlock; }
     int LAST_POW_BLOCK() const { return nLastPOWBlock; }
+    //! From this height on masternodes are paid from the list registered on chain, not the winner votes
+    int DeterministicMasternodeHeight() const { return nDeterministicMasternodeHeight; }
 
 protected:
     CChainParams() {}
@@ -120,6 +127,7 @@ protected:
     int nMasternodeCountDrift;
     int nMaturity;
     int nModifierUpdateBlock;
+    int nDeterministicMasternodeHeight;
     CAmount nMaxMoneyOut;
     int nMinerThreads;
     std::vector<CDNSSeedData> vSeeds;
@@ -128,6 +136,7 @@ protected:
     std::string strNetworkID;
     CBlock genesis;
     std::vector<CAddress> vFixedSeeds;
+    MapUTXOSnapshots mapUTXOSnapshots;
     bool fMiningRequiresPeers;
     bool fAllowMinDifficultyBlocks;
     bool fDefaultConsistencyChecks;
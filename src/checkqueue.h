@@ -1,207 +1,306 @@
 // Copyright (c) 2012-2014 The Bitcoin developers
+// Copyright (c) 2019 The Dystem developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #ifndef BITCOIN_CHECKQUEUE_H
 #define BITCOIN_CHECKQUEUE_H
 
+#include "utiltime.h"
+
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <vector>
 
-#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 
+//! Time a worker aims to spend on one batch of checks, long enough to make taking it cheap
+static const int64_t CHECKQUEUE_BATCH_TARGET_MICROS = 100;
+
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/**
  * Queue for verifications that have to be performed.
-  * The verifications are represented by a type T, which must provide an
-  * operator(), returning a bool.
-  *
-  * One thread (the master) is assumed to push batches of verifications
-  * onto the queue, where they are processed by N-1 worker threads. When
-  * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
-  */
+ * The verifications are represented by a type T, which must provide an
+ * operator(), returning a bool, and swap().
+ *
+ * Masters add checks through a CCheckQueueControl and join the workers when
+ * they wait for them, until the checks they added are done. Every worker has
+ * its own deque under its own mutex: Add() spreads the checks over the deques,
+ * a worker takes batches from the front of its deque and, once it is empty,
+ * steals half of the checks left at the back of another one, so the threads
+ * do not all contend on one lock.
+ *
+ * The size of a batch follows the average time a check takes, as measured by
+ * the workers, so a batch takes about CHECKQUEUE_BATCH_TARGET_MICROS: cheap
+ * checks are taken many at a time and expensive ones spread over the threads.
+ *
+ * Each control counts its own checks, so several controls may be in flight
+ * at once, e.g. the checks of consecutive blocks added before waiting for the
+ * first, or controls of different threads.
+ */
 template <typename T>
 class CCheckQueue
 {
+public:
+    /** The checks added through one CCheckQueueControl */
+    class CSession
+    {
+    private:
+        friend class CCheckQueue;
+
+        //! Checks added but not completed yet
+        std::atomic<unsigned int> nTodo;
+        //! Whether all checks completed so far passed, the others are skipped once one failed
+        std::atomic<bool> fAllOk;
+
+    public:
+        CSession() : nTodo(0), fAllOk(true) {}
+    };
+
 private:
-    //! Mutex to protect the inner state
+    struct CEntry {
+        T check;
+        CSession* psession;
+    };
+
+    struct CWorkerQueue {
+        boost::mutex mutex;
+        std::deque<CEntry> deque;
+    };
+
+    typedef std::vector<boost::shared_ptr<CWorkerQueue> > WorkerList;
+
+    //! Protects the registration of workers and the sleeping on the condition variables
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
     boost::condition_variable condWorker;
 
-    //! Master thread blocks on this when out of work
+    //! Masters block on this while the last checks of their session run elsewhere
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The deques, the first one shared by the masters. Replaced, never modified, when a worker starts.
+    boost::shared_ptr<const WorkerList> pworkers;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! Checks in the deques, raised before they are pushed and lowered after they are taken
+    std::atomic<int> nQueued;
 
-    //! The temporary evaluation result.
-    bool fAllOk;
+    //! The deque Add() starts spreading checks from
+    std::atomic<unsigned int> nNextQueue;
 
-    /**
-     * Number of verifications that haven't completed yet.
-     * This includes elements that are not anymore in queue, but still in
-     * worker's own batches.
-     */
-    unsigned int nTodo;
-
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! Running average of the time a check takes, in nanoseconds
+    std::atomic<int64_t> nCheckNanos;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
-    /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    unsigned int GetBatchSize() const
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
-            }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while (true);
+        int64_t nCost = nCheckNanos.load(std::memory_order_relaxed);
+        if (nCost <= 0)
+            return nBatchSize;
+        return std::max((int64_t)1, std::min((int64_t)nBatchSize, CHECKQUEUE_BATCH_TARGET_MICROS * 1000 / nCost));
     }
 
-public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    /** Move up to nMax checks from the front, or for a thief the back, of queue into vBatch */
+    unsigned int Take(CWorkerQueue& queue, bool fSteal, unsigned int nMax, std::vector<CEntry>& vBatch)
+    {
+        boost::unique_lock<boost::mutex> lock(queue.mutex);
+        unsigned int nNow = std::min(nMax, (unsigned int)(fSteal ? (queue.deque.size() + 1) / 2 : queue.deque.size()));
+        vBatch.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            // Swap instead of copying, to hold the lock as shortly as possible
+            CEntry& entry = fSteal ? queue.deque.back() : queue.deque.front();
+            vBatch[i].check.swap(entry.check);
+            vBatch[i].psession = entry.psession;
+            if (fSteal)
+                queue.deque.pop_back();
+            else
+                queue.deque.pop_front();
+        }
+        return nNow;
+    }
 
-    //! Worker thread
-    void Thread()
+    /** Take a batch from our own deque, or steal one from another deque */
+    bool TakeWork(size_t nOwn, const WorkerList& workers, std::vector<CEntry>& vBatch)
     {
-        Loop();
+        if (nQueued.load() <= 0)
+            return false;
+        unsigned int nMax = GetBatchSize();
+        unsigned int nNow = Take(*workers[nOwn], false, nMax, vBatch);
+        for (size_t i = 1; nNow == 0 && i < workers.size(); i++)
+            nNow = Take(*workers[(nOwn + i) % workers.size()], true, nMax, vBatch);
+        nQueued -= nNow;
+        return nNow > 0;
     }
 
-    //! Wait until execution finishes, and return whether all evaluations where successful.
-    bool Wait()
+    /** Run a batch, update the cost estimate and count the checks down in their sessions */
+    void RunBatch(std::vector<CEntry>& vBatch)
     {
-        return Loop(true);
+        int64_t nStart = GetTimeMicros();
+        unsigned int nRun = 0;
+        for (size_t i = 0; i < vBatch.size(); i++) {
+            CSession& session = *vBatch[i].psession;
+            if (session.fAllOk.load(std::memory_order_relaxed)) {
+                nRun++;
+                if (!vBatch[i].check())
+                    session.fAllOk = false;
+            }
+        }
+        if (nRun > 0) {
+            // Racy update of a hint, a lost sample does not matter
+            int64_t nSample = (GetTimeMicros() - nStart) * 1000 / nRun;
+            int64_t nCost = nCheckNanos.load(std::memory_order_relaxed);
+            nCheckNanos.store((7 * nCost + nSample) / 8, std::memory_order_relaxed);
+        }
+
+        // A session may be gone once its count reaches zero, so count down runs
+        // of the same session at once and never touch it afterwards
+        for (size_t i = 0; i < vBatch.size();) {
+            CSession* psession = vBatch[i].psession;
+            unsigned int nSame = 0;
+            while (i < vBatch.size() && vBatch[i].psession == psession) {
+                nSame++;
+                i++;
+            }
+            if (psession->nTodo.fetch_sub(nSame) == nSame) {
+                // We processed the last check of the session; wake its master
+                boost::unique_lock<boost::mutex> lock(mutex);
+                condMaster.notify_all();
+            }
+        }
+        vBatch.clear();
     }
 
     //! Add a batch of checks to the queue
-    void Add(std::vector<T>& vChecks)
+    void Add(std::vector<T>& vChecks, CSession& session)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        boost::shared_ptr<const WorkerList> workers = boost::atomic_load(&pworkers);
+        session.nTodo += vChecks.size();
+        nQueued += vChecks.size();
+
+        size_t nChunk = (vChecks.size() + workers->size() - 1) / workers->size();
+        unsigned int nQueue = nNextQueue++;
+        for (size_t i = 0; i < vChecks.size(); i += nChunk) {
+            CWorkerQueue& queue = *(*workers)[nQueue++ % workers->size()];
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            for (size_t j = i; j < std::min(i + nChunk, vChecks.size()); j++) {
+                queue.deque.push_back(CEntry());
+                queue.deque.back().check.swap(vChecks[j]);
+                queue.deque.back().psession = &session;
+            }
         }
-        nTodo += vChecks.size();
+
+        boost::unique_lock<boost::mutex> lock(mutex);
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
-    ~CCheckQueue()
+    //! Join the workers until the checks of session are done, and return whether they all passed
+    bool Wait(CSession& session)
     {
+        boost::shared_ptr<const WorkerList> workers = boost::atomic_load(&pworkers);
+        std::vector<CEntry> vBatch;
+        while (session.nTodo.load() > 0) {
+            if (TakeWork(0, *workers, vBatch)) {
+                RunBatch(vBatch);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (session.nTodo.load() > 0 && nQueued.load() <= 0)
+                condMaster.wait(lock);
+        }
+        bool fRet = session.fAllOk;
+        // reset the status for new work later
+        session.fAllOk = true;
+        return fRet;
     }
 
-    bool IsIdle()
+    friend class CCheckQueueControl<T>;
+
+public:
+    //! Create a new check queue
+    CCheckQueue(unsigned int nBatchSizeIn) : nQueued(0), nNextQueue(0), nCheckNanos(CHECKQUEUE_BATCH_TARGET_MICROS * 1000), nBatchSize(nBatchSizeIn)
+    {
+        boost::shared_ptr<WorkerList> workers = boost::make_shared<WorkerList>();
+        workers->push_back(boost::make_shared<CWorkerQueue>());
+        pworkers = workers;
+    }
+
+    //! Worker thread
+    void Thread()
+    {
+        size_t nOwn;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            boost::shared_ptr<WorkerList> workers = boost::make_shared<WorkerList>(*pworkers);
+            nOwn = workers->size();
+            workers->push_back(boost::make_shared<CWorkerQueue>());
+            boost::atomic_store(&pworkers, boost::shared_ptr<const WorkerList>(workers));
+        }
+
+        std::vector<CEntry> vBatch;
+        while (true) {
+            // Reloaded so workers started later get stolen from too
+            boost::shared_ptr<const WorkerList> workers = boost::atomic_load(&pworkers);
+            if (TakeWork(nOwn, *workers, vBatch)) {
+                RunBatch(vBatch);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (nQueued.load() <= 0)
+                condWorker.wait(lock);
+        }
+    }
+
+    ~CCheckQueue()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
     }
 };
 
-/** 
- * RAII-style controller object for a CCheckQueue that guarantees the passed
- * queue is finished before continuing.
+/**
+ * RAII-style controller object for a CCheckQueue that guarantees the checks
+ * added through it are finished before continuing.
  */
 template <typename T>
 class CCheckQueueControl
 {
 private:
     CCheckQueue<T>* pqueue;
+    typename CCheckQueue<T>::CSession session;
     bool fDone;
 
 public:
     CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
     {
-        // passed queue is supposed to be unused, or NULL
-        if (pqueue != NULL) {
-            bool isIdle = pqueue->IsIdle();
-            assert(isIdle);
-        }
     }
 
     bool Wait()
     {
         if (pqueue == NULL)
             return true;
-        bool fRet = pqueue->Wait();
+        bool fRet = pqueue->Wait(session);
         fDone = true;
         return fRet;
     }
 
     void Add(std::vector<T>& vChecks)
     {
-        if (pqueue != NULL)
-            pqueue->Add(vChecks);
+        if (pqueue != NULL) {
+            pqueue->Add(vChecks, session);
+            fDone = false;
+        }
     }
 
     ~CCheckQueueControl()
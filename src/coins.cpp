@@ -61,6 +61,13 @@ bool CCoins::Spend(int nPos)
 
 bool CCoinsView::GetCoins(const uint256& txid, CCoins& coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256& txid) const { return false; }
+void CCoinsView::GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const
+{
+    vCoins.assign(vTxids.size(), CCoins());
+    vFound.assign(vTxids.size(), false);
+    for (unsigned int i = 0; i < vTxids.size(); i++)
+        vFound[i] = GetCoins(vTxids[i], vCoins[i]);
+}
 uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
 bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
 bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
@@ -69,6 +76,7 @@ bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView* viewIn) : base(viewIn) {}
 bool CCoinsViewBacked::GetCoins(const uint256& txid, CCoins& coins) const { return base->GetCoins(txid, coins); }
 bool CCoinsViewBacked::HaveCoins(const uint256& txid) const { return base->HaveCoins(txid); }
+void CCoinsViewBacked::GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const { base->GetCoinsBatch(vTxids, vCoins, vFound); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView& viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
@@ -76,7 +84,10 @@ bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStat
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn, bool fLargePages) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0),
+    cacheCoinsPool(new CPoolResource(fLargePages)),
+    cacheCoins(0, CCoinsKeyHasher(), CCoinsMap::key_equal(), CCoinsMap::allocator_type(cacheCoinsPool.get())),
+    cachedCoinsUsage(0), nCacheLookups(0), nCacheHits(0) {}
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -85,19 +96,24 @@ CCoinsViewCache::~CCoinsViewCache()
 
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
 {
+    nCacheLookups++;
     CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        nCacheHits++;
         return it;
+    }
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
     tmp.swap(ret->second.coins);
+    ret->second.SetBaseUnspent();
     if (ret->second.coins.IsPruned()) {
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
+    cachedCoinsUsage += ret->second.DynamicMemoryUsage();
     return ret;
 }
 
@@ -115,19 +131,25 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
 {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    size_t cachedCoinUsage = 0;
     if (ret.second) {
         if (!base->GetCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
             ret.first->second.coins.Clear();
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
-        } else if (ret.first->second.coins.IsPruned()) {
-            // The parent view only has a pruned entry for this; mark it as fresh.
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
+        } else {
+            ret.first->second.SetBaseUnspent();
+            if (ret.first->second.coins.IsPruned()) {
+                // The parent view only has a pruned entry for this; mark it as fresh.
+                ret.first->second.flags = CCoinsCacheEntry::FRESH;
+            }
         }
+    } else {
+        cachedCoinUsage = ret.first->second.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
 const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
@@ -150,6 +172,44 @@ bool CCoinsViewCache::HaveCoins(const uint256& txid) const
     return (it != cacheCoins.end() && !it->second.coins.vout.empty());
 }
 
+void CCoinsViewCache::GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const
+{
+    vCoins.assign(vTxids.size(), CCoins());
+    vFound.assign(vTxids.size(), false);
+    std::vector<uint256> vMisses;
+    std::vector<unsigned int> vMissIndex;
+    for (unsigned int i = 0; i < vTxids.size(); i++) {
+        nCacheLookups++;
+        CCoinsMap::const_iterator it = cacheCoins.find(vTxids[i]);
+        if (it != cacheCoins.end()) {
+            nCacheHits++;
+            vCoins[i] = it->second.coins;
+            vFound[i] = true;
+        } else {
+            vMisses.push_back(vTxids[i]);
+            vMissIndex.push_back(i);
+        }
+    }
+    if (vMisses.empty())
+        return;
+
+    std::vector<CCoins> vCoinsBase;
+    std::vector<bool> vFoundBase;
+    base->GetCoinsBatch(vMisses, vCoinsBase, vFoundBase);
+    for (unsigned int i = 0; i < vMisses.size(); i++) {
+        if (vFoundBase[i]) {
+            vCoins[vMissIndex[i]].swap(vCoinsBase[i]);
+            vFound[vMissIndex[i]] = true;
+        }
+    }
+}
+
+bool CCoinsViewCache::HaveCoinsInCache(const uint256& txid) const
+{
+    CCoinsMap::const_iterator it = cacheCoins.find(txid);
+    return (it != cacheCoins.end() && !it->second.coins.vout.empty());
+}
+
 uint256 CCoinsViewCache::GetBestBlock() const
 {
     if (hashBlock == uint256(0))
@@ -177,6 +237,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     assert(it->second.flags & CCoinsCacheEntry::FRESH);
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
                     entry.coins.swap(it->second.coins);
+                    cachedCoinsUsage += entry.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
                 }
             } else {
@@ -184,10 +245,13 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
+                    cachedCoinsUsage -= itUs->second.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
+                    cachedCoinsUsage -= itUs->second.DynamicMemoryUsage();
                     itUs->second.coins.swap(it->second.coins);
+                    cachedCoinsUsage += itUs->second.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
                 }
             }
@@ -203,14 +267,81 @@ bool CCoinsViewCache::Flush()
 {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
+    cacheCoinsPool->Release();
+    cachedCoinsUsage = 0;
     return fOk;
 }
 
+bool CCoinsViewCache::FlushPartial(size_t nKeepUsage)
+{
+    assert(!hasModifier);
+    const size_t nNodeUsage = memusage::NodeUsage(cacheCoins);
+    size_t nKept = 0;
+    CCoinsMap mapWrite;
+    // Entries that stay are moved into a fresh pool, so the memory of dropped
+    // ones goes back to the system instead of sitting in free lists.
+    boost::scoped_ptr<CPoolResource> poolKept(new CPoolResource(cacheCoinsPool->UsesLargePages()));
+    CCoinsMap mapKept(0, cacheCoins.hash_function(), cacheCoins.key_eq(), CCoinsMap::allocator_type(poolKept.get()));
+    cachedCoinsUsage = 0;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        CCoinsCacheEntry& entry = it->second;
+        bool fKeep = false;
+        if (!entry.coins.IsPruned()) {
+            size_t nUsage = nNodeUsage + entry.DynamicMemoryUsage();
+            if (nKept + nUsage <= nKeepUsage) {
+                fKeep = true;
+                nKept += nUsage;
+            }
+        }
+        if (entry.flags & CCoinsCacheEntry::DIRTY) {
+            CCoinsCacheEntry& entryWrite = mapWrite[it->first];
+            entryWrite.flags = entry.flags;
+            if (fKeep) {
+                entryWrite.coins = entry.coins;
+                entryWrite.vBaseUnspent = entry.vBaseUnspent;
+            } else {
+                entryWrite.coins.swap(entry.coins);
+                entryWrite.vBaseUnspent.swap(entry.vBaseUnspent);
+            }
+        }
+        if (fKeep) {
+            // Once written, the base holds exactly what this entry does.
+            CCoinsCacheEntry& entryKept = mapKept[it->first];
+            entryKept.coins.swap(entry.coins);
+            entryKept.SetBaseUnspent();
+            cachedCoinsUsage += entryKept.DynamicMemoryUsage();
+        }
+    }
+    // The old entries end up in mapKept, which goes away before their pool.
+    cacheCoins.swap(mapKept);
+    cacheCoinsPool.swap(poolKept);
+    return base->BatchWrite(mapWrite, hashBlock);
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const
 {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+}
+
+void CCoinsViewCache::GetCachedTxids(std::vector<uint256>& vTxids, size_t nMax) const
+{
+    size_t nStart = vTxids.size();
+    for (int nPass = 0; nPass < 2; nPass++) {
+        bool fDirty = (nPass == 0);
+        for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); ++it) {
+            if (vTxids.size() - nStart >= nMax)
+                return;
+            if (((it->second.flags & CCoinsCacheEntry::DIRTY) != 0) == fDirty && !it->second.coins.IsPruned())
+                vTxids.push_back(it->first);
+        }
+    }
+}
+
 const CTxOut& CCoinsViewCache::GetOutputFor(const CTxIn& input) const
 {
     const CCoins* coins = AccessCoins(input.prevout.hash);
@@ -260,7 +391,7 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_)
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage)
 {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
@@ -271,7 +402,11 @@ CCoinsModifier::~CCoinsModifier()
     assert(cache.hasModifier);
     cache.hasModifier = false;
     it->second.coins.Cleanup();
+    cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
         cache.cacheCoins.erase(it);
+    } else {
+        // If the coin still exists after the modification, add the new usage
+        cache.cachedCoinsUsage += it->second.DynamicMemoryUsage();
     }
 }
@@ -7,6 +7,8 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "memusage.h"
+#include "poolresource.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -16,6 +18,7 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
 /** 
@@ -283,6 +286,15 @@ public:
                 return false;
         return true;
     }
+
+    size_t DynamicMemoryUsage() const
+    {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH (const CTxOut& out, vout) {
+            ret += memusage::DynamicUsage(*static_cast<const CScriptBase*>(&out.scriptPubKey));
+        }
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -307,6 +319,7 @@ public:
 struct CCoinsCacheEntry {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    std::vector<bool> vBaseUnspent; // Which outputs were unspent in the parent view when the entry was read from it.
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
@@ -314,9 +327,22 @@ struct CCoinsCacheEntry {
     };
 
     CCoinsCacheEntry() : coins(), flags(0) {}
+
+    void SetBaseUnspent()
+    {
+        vBaseUnspent.resize(coins.vout.size());
+        for (unsigned int i = 0; i < coins.vout.size(); i++)
+            vBaseUnspent[i] = !coins.vout[i].IsNull();
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return coins.DynamicMemoryUsage() + memusage::DynamicUsage(vBaseUnspent);
+    }
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher, std::equal_to<uint256>,
+    pool_allocator<std::pair<const uint256, CCoinsCacheEntry> > > CCoinsMap;
 
 struct CCoinsStats {
     int nHeight;
@@ -342,6 +368,10 @@ public:
     //! This may (but cannot always) return true for fully spent transactions
     virtual bool HaveCoins(const uint256& txid) const;
 
+    //! GetCoins() for each of vTxids: vCoins[i] and vFound[i] are for vTxids[i].
+    //! Views that read a database read it in key order with one iterator
+    virtual void GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const;
+
     //! Retrieve the block hash whose state this CCoinsView currently represents
     virtual uint256 GetBestBlock() const;
 
@@ -367,6 +397,7 @@ public:
     CCoinsViewBacked(CCoinsView* viewIn);
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
+    void GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView& viewIn);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
@@ -398,7 +429,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -419,19 +451,37 @@ protected:
      * declared as "const".  
      */
     mutable uint256 hashBlock;
+    /* The nodes of cacheCoins live here, and are given back at once on Flush(). */
+    boost::scoped_ptr<CPoolResource> cacheCoinsPool;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
+    /* Lookups of entries by txid, and how many of them were already in the cache. */
+    mutable uint64_t nCacheLookups;
+    mutable uint64_t nCacheHits;
+
 public:
-    CCoinsViewCache(CCoinsView* baseIn);
+    //! fLargePages puts the nodes and the buckets of a big cache on huge pages, see -largepages
+    CCoinsViewCache(CCoinsView* baseIn, bool fLargePages = false);
     ~CCoinsViewCache();
 
     // Standard CCoinsView methods
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
+    //! Without adding what it reads from the backing view, so that a bulk query does not push out the coins of validation
+    void GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256& hashBlock);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
 
+    /**
+     * Check if we have the given tx already loaded in this cache, without
+     * going to the backing view when it is not.
+     */
+    bool HaveCoinsInCache(const uint256& txid) const;
+
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
      * more efficient than GetCoins. Modifications to other cache entries are
@@ -453,9 +503,30 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, like Flush(),
+     * but keep unspent entries resident as clean copies of the base, up to
+     * nKeepUsage bytes of them. Spent entries and whatever does not fit are
+     * dropped.
+     */
+    bool FlushPartial(size_t nKeepUsage);
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
+    //! Lookups of entries since the cache was created, and those that did not go to the backing view
+    uint64_t GetCacheLookups() const { return nCacheLookups; }
+    uint64_t GetCacheHits() const { return nCacheHits; }
+
+    /**
+     * Append the txids of up to nMax unspent entries of the cache to vTxids,
+     * those modified since the last flush first.
+     */
+    void GetCachedTxids(std::vector<uint256>& vTxids, size_t nMax) const;
+
     /** 
      * Amount of dystem coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
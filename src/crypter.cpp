@@ -8,7 +8,10 @@
 #include "script/standard.h"
 #include "util.h"
 
+#include <atomic>
+
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 #include <openssl/aes.h>
 #include <openssl/evp.h>
 #include <string>
@@ -22,11 +25,11 @@ bool CCrypter::SetKeyFromPassphrase(const SecureString& strKeyData, const std::v
     int i = 0;
     if (nDerivationMethod == 0)
         i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha512(), &chSalt[0],
-            (unsigned char*)&strKeyData[0], strKeyData.size(), nRounds, chKey, chIV);
+            (unsigned char*)&strKeyData[0], strKeyData.size(), nRounds, vchKey.data(), vchIV.data());
 
     if (i != (int)WALLET_CRYPTO_KEY_SIZE) {
-        OPENSSL_cleanse(chKey, sizeof(chKey));
-        OPENSSL_cleanse(chIV, sizeof(chIV));
+        OPENSSL_cleanse(vchKey.data(), vchKey.size());
+        OPENSSL_cleanse(vchIV.data(), vchIV.size());
         return false;
     }
 
@@ -39,8 +42,8 @@ bool CCrypter::SetKey(const CKeyingMaterial& chNewKey, const std::vector<unsigne
     if (chNewKey.size() != WALLET_CRYPTO_KEY_SIZE || chNewIV.size() != WALLET_CRYPTO_KEY_SIZE)
         return false;
 
-    memcpy(&chKey[0], &chNewKey[0], sizeof chKey);
-    memcpy(&chIV[0], &chNewIV[0], sizeof chIV);
+    memcpy(vchKey.data(), &chNewKey[0], vchKey.size());
+    memcpy(vchIV.data(), &chNewIV[0], vchIV.size());
 
     fKeySet = true;
     return true;
@@ -60,7 +63,7 @@ bool CCrypter::Encrypt(const CKeyingMaterial& vchPlaintext, std::vector<unsigned
     bool fOk = true;
 
     EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (fOk) fOk = EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, chKey, chIV) != 0;
+    if (fOk) fOk = EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, vchKey.data(), vchIV.data()) != 0;
     if (fOk) fOk = EVP_EncryptUpdate(ctx, &vchCiphertext[0], &nCLen, &vchPlaintext[0], nLen) != 0;
     if (fOk) fOk = EVP_EncryptFinal_ex(ctx, (&vchCiphertext[0]) + nCLen, &nFLen) != 0;
     EVP_CIPHER_CTX_free(ctx);
@@ -85,7 +88,7 @@ bool CCrypter::Decrypt(const std::vector<unsigned char>& vchCiphertext, CKeyingM
     bool fOk = true;
 
     EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (fOk) fOk = EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, chKey, chIV) != 0;
+    if (fOk) fOk = EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, vchKey.data(), vchIV.data()) != 0;
     if (fOk) fOk = EVP_DecryptUpdate(ctx, &vchPlaintext[0], &nPLen, &vchCiphertext[0], nLen) != 0;
     if (fOk) fOk = EVP_DecryptFinal_ex(ctx, (&vchPlaintext[0]) + nPLen, &nFLen) != 0;
     EVP_CIPHER_CTX_free(ctx);
@@ -96,6 +99,44 @@ bool CCrypter::Decrypt(const std::vector<unsigned char>& vchCiphertext, CKeyingM
     return true;
 }
 
+bool CSecretDecrypter::SetKey(const CKeyingMaterial& vMasterKey)
+{
+    CleanKey();
+    if (vMasterKey.size() != WALLET_CRYPTO_KEY_SIZE)
+        return false;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+        return false;
+    if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, &vMasterKey[0], NULL)) {
+        CleanKey();
+        return false;
+    }
+    return true;
+}
+
+bool CSecretDecrypter::Decrypt(const std::vector<unsigned char>& vchCiphertext, const uint256& nIV, CKeyingMaterial& vchPlaintext)
+{
+    if (!ctx || vchCiphertext.empty())
+        return false;
+
+    int nLen = vchCiphertext.size();
+    int nPLen = nLen, nFLen = 0;
+
+    vchPlaintext = CKeyingMaterial(nPLen);
+
+    // Without a cipher and a key only the IV and the padding state are reset
+    bool fOk = true;
+    if (fOk) fOk = EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, (const unsigned char*)&nIV) != 0;
+    if (fOk) fOk = EVP_DecryptUpdate(ctx, &vchPlaintext[0], &nPLen, &vchCiphertext[0], nLen) != 0;
+    if (fOk) fOk = EVP_DecryptFinal_ex(ctx, (&vchPlaintext[0]) + nPLen, &nFLen) != 0;
+
+    if (!fOk) return false;
+
+    vchPlaintext.resize(nPLen + nFLen);
+    return true;
+}
+
 
 bool EncryptSecret(const CKeyingMaterial& vMasterKey, const CKeyingMaterial& vchPlaintext, const uint256& nIV, std::vector<unsigned char>& vchCiphertext)
 {
@@ -183,6 +224,50 @@ bool DecryptAES256(const SecureString& sKey, const std::string& sCiphertext, con
 }
 
 
+namespace
+{
+void KeyJobWorker(std::atomic<size_t>* pnNext, size_t nJobs, const boost::function<void(size_t)>* pjob)
+{
+    for (size_t i = (*pnNext)++; i < nJobs; i = (*pnNext)++)
+        (*pjob)(i);
+}
+
+/** Computes the public key and the encrypted secret of the keys of EncryptKeys */
+struct CEncryptKeyJob {
+    const CKeyingMaterial& vMasterKey;
+    const std::vector<const CKey*>& vKeys;
+    std::vector<CPubKey>& vPubKeys;
+    std::vector<std::vector<unsigned char> >& vCryptedSecrets;
+    std::vector<char>& vfSuccess;
+
+    CEncryptKeyJob(const CKeyingMaterial& vMasterKeyIn, const std::vector<const CKey*>& vKeysIn, std::vector<CPubKey>& vPubKeysIn,
+        std::vector<std::vector<unsigned char> >& vCryptedSecretsIn, std::vector<char>& vfSuccessIn)
+        : vMasterKey(vMasterKeyIn), vKeys(vKeysIn), vPubKeys(vPubKeysIn), vCryptedSecrets(vCryptedSecretsIn), vfSuccess(vfSuccessIn) {}
+
+    void operator()(size_t i)
+    {
+        vPubKeys[i] = vKeys[i]->GetPubKey();
+        CKeyingMaterial vchSecret(vKeys[i]->begin(), vKeys[i]->end());
+        vfSuccess[i] = EncryptSecret(vMasterKey, vchSecret, vPubKeys[i].GetHash(), vCryptedSecrets[i]);
+    }
+};
+} // anon namespace
+
+void ParallelKeyJobs(size_t nJobs, const boost::function<void(size_t)>& job)
+{
+    std::atomic<size_t> nNext(0);
+    size_t nThreads = std::min<size_t>(std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_KEY_THREADS)), nJobs);
+    if (nThreads <= 1) {
+        KeyJobWorker(&nNext, nJobs, &job);
+        return;
+    }
+    boost::thread_group threadGroup;
+    for (size_t i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&KeyJobWorker, &nNext, nJobs, &job));
+    KeyJobWorker(&nNext, nJobs, &job);
+    threadGroup.join_all();
+}
+
 bool CCryptoKeyStore::SetCrypted()
 {
     LOCK(cs_KeyStore);
@@ -203,6 +288,8 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        decrypter.CleanKey();
+        mapBatchKeys.clear();
     }
 
     NotifyStatusChanged(this);
@@ -216,6 +303,10 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         if (!SetCrypted())
             return false;
 
+        CSecretDecrypter keyCheck;
+        if (!keyCheck.SetKey(vMasterKeyIn))
+            return false;
+
         bool keyPass = false;
         bool keyFail = false;
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
@@ -223,7 +314,7 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
             const CPubKey& vchPubKey = (*mi).second.first;
             const std::vector<unsigned char>& vchCryptedSecret = (*mi).second.second;
             CKeyingMaterial vchSecret;
-            if (!DecryptSecret(vMasterKeyIn, vchCryptedSecret, vchPubKey.GetHash(), vchSecret)) {
+            if (!keyCheck.Decrypt(vchCryptedSecret, vchPubKey.GetHash(), vchSecret)) {
                 keyFail = true;
                 break;
             }
@@ -248,6 +339,7 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         if (keyFail || !keyPass)
             return false;
         vMasterKey = vMasterKeyIn;
+        decrypter.SetKey(vMasterKey);
         fDecryptionThoroughlyChecked = true;
     }
     NotifyStatusChanged(this);
@@ -288,27 +380,63 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey& vchPubKey, const std::vector<
     return true;
 }
 
+bool CCryptoKeyStore::DecryptKey(const CKeyID& address, CKey& keyOut) const
+{
+    AssertLockHeld(cs_KeyStore);
+    CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
+    if (mi == mapCryptedKeys.end())
+        return false;
+
+    const CPubKey& vchPubKey = (*mi).second.first;
+    const std::vector<unsigned char>& vchCryptedSecret = (*mi).second.second;
+    CKeyingMaterial vchSecret;
+    if (!decrypter.Decrypt(vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
+        return false;
+    if (vchSecret.size() != 32)
+        return false;
+    keyOut.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+    return true;
+}
+
 bool CCryptoKeyStore::GetKey(const CKeyID& address, CKey& keyOut) const
 {
-    {
-        LOCK(cs_KeyStore);
-        if (!IsCrypted())
-            return CBasicKeyStore::GetKey(address, keyOut);
+    LOCK(cs_KeyStore);
+    if (!IsCrypted())
+        return CBasicKeyStore::GetKey(address, keyOut);
 
-        CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
-        if (mi != mapCryptedKeys.end()) {
-            const CPubKey& vchPubKey = (*mi).second.first;
-            const std::vector<unsigned char>& vchCryptedSecret = (*mi).second.second;
-            CKeyingMaterial vchSecret;
-            if (!DecryptSecret(vMasterKey, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
-                return false;
-            if (vchSecret.size() != 32)
-                return false;
-            keyOut.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+    if (nKeyBatches > 0) {
+        KeyMap::const_iterator it = mapBatchKeys.find(address);
+        if (it != mapBatchKeys.end()) {
+            keyOut = it->second;
             return true;
         }
     }
-    return false;
+    return DecryptKey(address, keyOut);
+}
+
+void CCryptoKeyStore::BeginKeyBatch(const std::set<CKeyID>& setAddress)
+{
+    LOCK(cs_KeyStore);
+    nKeyBatches++;
+    if (!IsCrypted())
+        return;
+
+    BOOST_FOREACH (const CKeyID& address, setAddress) {
+        if (mapBatchKeys.count(address))
+            continue;
+        CKey key;
+        if (DecryptKey(address, key))
+            mapBatchKeys[address] = key;
+    }
+}
+
+void CCryptoKeyStore::EndKeyBatch()
+{
+    LOCK(cs_KeyStore);
+    assert(nKeyBatches > 0);
+    // Overlapping batches share the keys, they are wiped with the last one
+    if (--nKeyBatches == 0)
+        mapBatchKeys.clear();
 }
 
 bool CCryptoKeyStore::GetPubKey(const CKeyID& address, CPubKey& vchPubKeyOut) const
@@ -335,14 +463,20 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
             return false;
 
         fUseCrypto = true;
-        BOOST_FOREACH (KeyMap::value_type& mKey, mapKeys) {
-            const CKey& key = mKey.second;
-            CPubKey vchPubKey = key.GetPubKey();
-            CKeyingMaterial vchSecret(key.begin(), key.end());
-            std::vector<unsigned char> vchCryptedSecret;
-            if (!EncryptSecret(vMasterKeyIn, vchSecret, vchPubKey.GetHash(), vchCryptedSecret))
+        // Deriving the public keys is the expensive part, it runs on several threads
+        std::vector<const CKey*> vKeys;
+        vKeys.reserve(mapKeys.size());
+        BOOST_FOREACH (KeyMap::value_type& mKey, mapKeys)
+            vKeys.push_back(&mKey.second);
+        std::vector<CPubKey> vPubKeys(vKeys.size());
+        std::vector<std::vector<unsigned char> > vCryptedSecrets(vKeys.size());
+        std::vector<char> vfSuccess(vKeys.size(), false);
+        ParallelKeyJobs(vKeys.size(), CEncryptKeyJob(vMasterKeyIn, vKeys, vPubKeys, vCryptedSecrets, vfSuccess));
+
+        for (size_t i = 0; i < vKeys.size(); i++) {
+            if (!vfSuccess[i])
                 return false;
-            if (!AddCryptedKey(vchPubKey, vchCryptedSecret))
+            if (!AddCryptedKey(vPubKeys[i], vCryptedSecrets[i]))
                 return false;
         }
         mapKeys.clear();
@@ -9,10 +9,15 @@
 #include "keystore.h"
 #include "serialize.h"
 
+#include <boost/function.hpp>
+#include <openssl/evp.h>
+
 class uint256;
 
 const unsigned int WALLET_CRYPTO_KEY_SIZE = 32;
 const unsigned int WALLET_CRYPTO_SALT_SIZE = 8;
+//! Maximum number of threads generating or encrypting keys
+static const int MAX_KEY_THREADS = 8;
 
 /**
  * Private key encryption is done based on a CMasterKey,
@@ -71,8 +76,9 @@ typedef std::vector<unsigned char, secure_allocator<unsigned char> > CKeyingMate
 class CCrypter
 {
 private:
-    unsigned char chKey[WALLET_CRYPTO_KEY_SIZE];
-    unsigned char chIV[WALLET_CRYPTO_KEY_SIZE];
+    //! In the locked pool, out of swap
+    std::vector<unsigned char, secure_allocator<unsigned char> > vchKey;
+    std::vector<unsigned char, secure_allocator<unsigned char> > vchIV;
     bool fKeySet;
 
 public:
@@ -83,34 +89,55 @@ public:
 
     void CleanKey()
     {
-        OPENSSL_cleanse(chKey, sizeof(chKey));
-        OPENSSL_cleanse(chIV, sizeof(chIV));
+        OPENSSL_cleanse(vchKey.data(), vchKey.size());
+        OPENSSL_cleanse(vchIV.data(), vchIV.size());
         fKeySet = false;
     }
 
-    CCrypter()
+    CCrypter() : vchKey(WALLET_CRYPTO_KEY_SIZE), vchIV(WALLET_CRYPTO_KEY_SIZE)
     {
         fKeySet = false;
-
-        // Try to keep the key data out of swap (and be a bit over-careful to keep the IV that we don't even use out of swap)
-        // Note that this does nothing about suspend-to-disk (which will put all our key data on disk)
-        // Note as well that at no point in this program is any attempt made to prevent stealing of keys by reading the memory of the running process.
-        LockedPageManager::Instance().LockRange(&chKey[0], sizeof chKey);
-        LockedPageManager::Instance().LockRange(&chIV[0], sizeof chIV);
     }
 
     ~CCrypter()
     {
         CleanKey();
+    }
+};
+
+/**
+ * AES-256-CBC decryption of wallet secrets with the key schedule of the master
+ * key expanded once, and only the IV set again for each secret. OpenSSL runs
+ * it with AES-NI where the CPU has it. Freeing the context wipes the schedule.
+ */
+class CSecretDecrypter
+{
+private:
+    EVP_CIPHER_CTX* ctx;
 
-        LockedPageManager::Instance().UnlockRange(&chKey[0], sizeof chKey);
-        LockedPageManager::Instance().UnlockRange(&chIV[0], sizeof chIV);
+public:
+    CSecretDecrypter() : ctx(NULL) {}
+    ~CSecretDecrypter() { CleanKey(); }
+
+    bool SetKey(const CKeyingMaterial& vMasterKey);
+    bool IsKeySet() const { return ctx != NULL; }
+    bool Decrypt(const std::vector<unsigned char>& vchCiphertext, const uint256& nIV, CKeyingMaterial& vchPlaintext);
+
+    void CleanKey()
+    {
+        if (ctx) {
+            EVP_CIPHER_CTX_free(ctx);
+            ctx = NULL;
+        }
     }
 };
 
 bool EncryptSecret(const CKeyingMaterial& vMasterKey, const CKeyingMaterial& vchPlaintext, const uint256& nIV, std::vector<unsigned char>& vchCiphertext);
 bool DecryptSecret(const CKeyingMaterial& vMasterKey, const std::vector<unsigned char>& vchCiphertext, const uint256& nIV, CKeyingMaterial& vchPlaintext);
 
+/** Run job(0) to job(nJobs - 1) on up to MAX_KEY_THREADS threads and wait for all of them */
+void ParallelKeyJobs(size_t nJobs, const boost::function<void(size_t)>& job);
+
 bool EncryptAES256(const SecureString& sKey, const SecureString& sPlaintext, const std::string& sIV, std::string& sCiphertext);
 bool DecryptAES256(const SecureString& sKey, const std::string& sCiphertext, const std::string& sIV, SecureString& sPlaintext);
 
@@ -125,6 +152,13 @@ private:
 
     CKeyingMaterial vMasterKey;
 
+    //! key schedule of vMasterKey, kept while the wallet is unlocked
+    mutable CSecretDecrypter decrypter;
+
+    //! keys decrypted for the signing passes under way, see CKeyBatch
+    KeyMap mapBatchKeys;
+    int nKeyBatches;
+
     //! if fUseCrypto is true, mapKeys must be empty
     //! if fUseCrypto is false, vMasterKey must be empty
     bool fUseCrypto;
@@ -140,8 +174,11 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    //! decrypt the key of address with the cached key schedule, requires cs_KeyStore
+    bool DecryptKey(const CKeyID& address, CKey& keyOut) const;
+
 public:
-    CCryptoKeyStore() : fUseCrypto(false), fDecryptionThoroughlyChecked(false)
+    CCryptoKeyStore() : nKeyBatches(0), fUseCrypto(false), fDecryptionThoroughlyChecked(false)
     {
     }
 
@@ -178,6 +215,15 @@ public:
     }
     bool GetKey(const CKeyID& address, CKey& keyOut) const;
     bool GetPubKey(const CKeyID& address, CPubKey& vchPubKeyOut) const;
+
+    /**
+     * Decrypt the keys of setAddress in one pass, GetKey then returns them
+     * without decrypting again until the matching EndKeyBatch or Lock.
+     * Addresses without a key are skipped. Use CKeyBatch rather than these.
+     */
+    void BeginKeyBatch(const std::set<CKeyID>& setAddress);
+    void EndKeyBatch();
+
     void GetKeys(std::set<CKeyID>& setAddress) const
     {
         if (!IsCrypted()) {
@@ -199,4 +245,22 @@ public:
     boost::signals2::signal<void(CCryptoKeyStore* wallet)> NotifyStatusChanged;
 };
 
+/** Keeps the keys of a signing pass decrypted for as long as it lives */
+class CKeyBatch
+{
+private:
+    CCryptoKeyStore& keystore;
+
+public:
+    CKeyBatch(CCryptoKeyStore& keystoreIn, const std::set<CKeyID>& setAddress) : keystore(keystoreIn)
+    {
+        keystore.BeginKeyBatch(setAddress);
+    }
+
+    ~CKeyBatch()
+    {
+        keystore.EndKeyBatch();
+    }
+};
+
 #endif // BITCOIN_CRYPTER_H
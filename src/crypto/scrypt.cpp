@@ -36,6 +36,10 @@
 #include <string.h>
 #include <stdint.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifndef __FreeBSD__
 static inline void be32enc(void *pp, uint32_t x)
 {
@@ -216,6 +220,98 @@ blkxor(void * dest, const void * src, size_t len)
         D[i] ^= S[i];
 }
 
+#ifdef __SSE2__
+/**
+ * salsa20_8(X0, X1, X2, X3):
+ * Apply the salsa20/8 core to the block in X0..X3, kept in the diagonal
+ * order of SALSA_POS so that each quarter round is one vector operation.
+ */
+static inline void
+salsa20_8(__m128i& X0, __m128i& X1, __m128i& X2, __m128i& X3)
+{
+    __m128i Y0 = X0, Y1 = X1, Y2 = X2, Y3 = X3;
+    __m128i T;
+    size_t i;
+
+    for (i = 0; i < 8; i += 2) {
+#define R(x,a,b) _mm_xor_si128(x, _mm_xor_si128(_mm_slli_epi32(a, b), _mm_srli_epi32(a, 32 - (b))))
+        /* Operate on columns. */
+        T = _mm_add_epi32(Y0, Y3);
+        Y1 = R(Y1, T, 7);
+        T = _mm_add_epi32(Y1, Y0);
+        Y2 = R(Y2, T, 9);
+        T = _mm_add_epi32(Y2, Y1);
+        Y3 = R(Y3, T, 13);
+        T = _mm_add_epi32(Y3, Y2);
+        Y0 = R(Y0, T, 18);
+
+        /* Rearrange data. */
+        Y1 = _mm_shuffle_epi32(Y1, 0x93);
+        Y2 = _mm_shuffle_epi32(Y2, 0x4E);
+        Y3 = _mm_shuffle_epi32(Y3, 0x39);
+
+        /* Operate on rows. */
+        T = _mm_add_epi32(Y0, Y1);
+        Y3 = R(Y3, T, 7);
+        T = _mm_add_epi32(Y3, Y0);
+        Y2 = R(Y2, T, 9);
+        T = _mm_add_epi32(Y2, Y3);
+        Y1 = R(Y1, T, 13);
+        T = _mm_add_epi32(Y1, Y2);
+        Y0 = R(Y0, T, 18);
+
+        /* Rearrange data. */
+        Y1 = _mm_shuffle_epi32(Y1, 0x39);
+        Y2 = _mm_shuffle_epi32(Y2, 0x4E);
+        Y3 = _mm_shuffle_epi32(Y3, 0x93);
+#undef R
+    }
+    X0 = _mm_add_epi32(X0, Y0);
+    X1 = _mm_add_epi32(X1, Y1);
+    X2 = _mm_add_epi32(X2, Y2);
+    X3 = _mm_add_epi32(X3, Y3);
+}
+
+/**
+ * blockmix_salsa8(Bin, Bout, X, r):
+ * Compute Bout = BlockMix_{salsa20/8, r}(Bin) like the portable version,
+ * with X kept in registers; the temporary space X is not used.
+ */
+static void
+blockmix_salsa8(const uint32_t * Bin, uint32_t * Bout, uint32_t * X, size_t r)
+{
+    const __m128i* BinV = (const __m128i*)Bin;
+    __m128i* BoutV = (__m128i*)Bout;
+    size_t i;
+
+    /* 1: X <-- B_{2r - 1} */
+    __m128i X0 = BinV[(2 * r - 1) * 4];
+    __m128i X1 = BinV[(2 * r - 1) * 4 + 1];
+    __m128i X2 = BinV[(2 * r - 1) * 4 + 2];
+    __m128i X3 = BinV[(2 * r - 1) * 4 + 3];
+
+    /* 2: for i = 0 to 2r - 1 do */
+    for (i = 0; i < 2 * r; i++) {
+        /* 3: X <-- H(X \xor B_i) */
+        X0 = _mm_xor_si128(X0, BinV[i * 4]);
+        X1 = _mm_xor_si128(X1, BinV[i * 4 + 1]);
+        X2 = _mm_xor_si128(X2, BinV[i * 4 + 2]);
+        X3 = _mm_xor_si128(X3, BinV[i * 4 + 3]);
+        salsa20_8(X0, X1, X2, X3);
+
+        /* 4: Y_i <-- X */
+        /* 6: B' <-- (Y_0, Y_2 ... Y_{2r-2}, Y_1, Y_3 ... Y_{2r-1}) */
+        __m128i* Y = &BoutV[((i & 1) * r + i / 2) * 4];
+        Y[0] = X0;
+        Y[1] = X1;
+        Y[2] = X2;
+        Y[3] = X3;
+    }
+}
+
+/** Word i of each 64-byte block is stored at word SALSA_POS(i) */
+#define SALSA_POS(i) (((i) & ~15) | ((i) * 13 % 16))
+#else
 /**
  * salsa20_8(B):
  * Apply the salsa20/8 core to the provided block.
@@ -294,6 +390,9 @@ blockmix_salsa8(const uint32_t * Bin, uint32_t * Bout, uint32_t * X, size_t r)
     }
 }
 
+#define SALSA_POS(i) (i)
+#endif
+
 /**
  * integerify(B, r):
  * Return the result of parsing B_{2r-1} as a little-endian integer.
@@ -303,7 +402,7 @@ integerify(const void * B, size_t r)
 {
     const uint32_t * X = (const uint32_t*)((uintptr_t)(B) + (2 * r - 1) * 64);
 
-    return (((uint64_t)(X[1]) << 32) + X[0]);
+    return (((uint64_t)(X[SALSA_POS(1)]) << 32) + X[SALSA_POS(0)]);
 }
 
 void SMix(uint8_t *B, unsigned int r, unsigned int N, void* _V, void* XY)
@@ -318,7 +417,7 @@ void SMix(uint8_t *B, unsigned int r, unsigned int N, void* _V, void* XY)
 
     /* 1: X <-- B */
     for (k = 0; k < 32 * r; k++)
-        X[k] = le32dec_2(&B[4 * k]);
+        X[SALSA_POS(k)] = le32dec_2(&B[4 * k]);
 
     /* 2: for i = 0 to N - 1 do */
     for (unsigned int i = 0; i < N; i += 2)
@@ -356,7 +455,20 @@ void SMix(uint8_t *B, unsigned int r, unsigned int N, void* _V, void* XY)
 
     /* 10: B' <-- X */
     for (k = 0; k < 32 * r; k++)
-        le32enc_2(&B[4 * k], X[k]);
+        le32enc_2(&B[4 * k], X[SALSA_POS(k)]);
+}
+
+void scrypt_smix(uint8_t* B, unsigned int r, unsigned int N)
+{
+    void* V0 = malloc(128 * r * N + 63);
+    void* XY0 = malloc(256 * r + 64 + 63);
+    uint32_t* V = (uint32_t *)(((uintptr_t)(V0) + 63) & ~ (uintptr_t)(63));
+    uint32_t* XY = (uint32_t *)(((uintptr_t)(XY0) + 63) & ~ (uintptr_t)(63));
+
+    SMix(B, r, N, V, XY);
+
+    free(V0);
+    free(XY0);
 }
 
 void scrypt(const char* pass, unsigned int pLen, const char* salt, unsigned int sLen, char *output, unsigned int N, unsigned int r, unsigned int p, unsigned int dkLen)
@@ -4,6 +4,16 @@
 #include <stdint.h>
 #include <string>
 
+/** PBKDF2 with HMAC-SHA256, the first and last steps of scrypt */
+void PBKDF2_SHA256(const uint8_t* passwd, size_t passwdlen, const uint8_t* salt, size_t saltlen, uint64_t c, uint8_t* buf, size_t dkLen);
+
+/**
+ * The SMix of one of the p lanes of scrypt, over its 128 * r bytes of the
+ * first PBKDF2 output. The lanes are independent, to run them on separate
+ * threads; each takes 128 * r * N bytes.
+ */
+void scrypt_smix(uint8_t* B, unsigned int r, unsigned int N);
+
 void scrypt(const char* pass, unsigned int pLen, const char* salt, unsigned int sLen, char *output, unsigned int N, unsigned int r, unsigned int p, unsigned int dkLen);
 
 #endif
@@ -8,6 +8,32 @@
 
 #include <string.h>
 
+#if (defined(__x86_64__) || defined(__amd64__) || defined(__i386__)) && (defined(ENABLE_SSE41) || defined(ENABLE_AVX2) || defined(ENABLE_SHANI))
+#include <cpuid.h>
+#define HAVE_SHA256_DISPATCH 1
+#endif
+
+#ifdef ENABLE_SSE41
+namespace sha256d64_sse41
+{
+void Transform_4way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
+#ifdef ENABLE_AVX2
+namespace sha256d64_avx2
+{
+void Transform_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
+#ifdef ENABLE_SHANI
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
+}
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -44,7 +70,7 @@ void inline Initialize(uint32_t* s)
 }
 
 /** Perform one SHA-256 transformation, processing a 64-byte chunk. */
-void Transform(uint32_t* s, const unsigned char* chunk)
+void inline TransformBlock(uint32_t* s, const unsigned char* chunk)
 {
     uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
     uint32_t w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
@@ -127,7 +153,91 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[7] += h;
 }
 
+/** Perform as many SHA-256 transformations as there are consecutive 64-byte chunks. */
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    while (blocks--) {
+        TransformBlock(s, chunk);
+        chunk += 64;
+    }
+}
+
 } // namespace sha256
+
+typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
+typedef void (*TransformD64Type)(unsigned char*, const unsigned char*);
+
+//! The implementations picked by SHA256AutoDetect
+TransformType Transform = sha256::Transform;
+TransformD64Type TransformD64_4way = NULL;
+TransformD64Type TransformD64_8way = NULL;
+
+/** Double SHA-256 of one 64-byte input, with the padding blocks spelled out */
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    // The padding of a 64-byte message, then that of a 32-byte one after the first hash
+    static const unsigned char padding1[64] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0};
+    unsigned char buffer2[64] = {0};
+    buffer2[32] = 0x80;
+    buffer2[62] = 0x01;
+
+    uint32_t s[8];
+    sha256::Initialize(s);
+    Transform(s, in, 1);
+    Transform(s, padding1, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buffer2 + 4 * i, s[i]);
+    sha256::Initialize(s);
+    Transform(s, buffer2, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
+#ifdef HAVE_SHA256_DISPATCH
+/** XCR0, the state the OS saves on context switches */
+uint64_t inline GetXCR0()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return ((uint64_t)d << 32) | a;
+}
+
+/** Check the picked implementations against the portable one */
+bool SelfTest()
+{
+    unsigned char in[8 * 64];
+    for (size_t i = 0; i < sizeof(in); i++)
+        in[i] = (unsigned char)(i * 7 + 3);
+
+    unsigned char expected[8 * 32];
+    TransformType picked = Transform;
+    Transform = sha256::Transform;
+    for (int n = 0; n < 8; n++)
+        TransformD64(expected + 32 * n, in + 64 * n);
+    Transform = picked;
+
+    unsigned char out[8 * 32];
+    for (int n = 0; n < 8; n++)
+        TransformD64(out + 32 * n, in + 64 * n);
+    if (memcmp(out, expected, sizeof(out)) != 0)
+        return false;
+    if (TransformD64_4way) {
+        TransformD64_4way(out, in);
+        TransformD64_4way(out + 128, in + 256);
+        if (memcmp(out, expected, sizeof(out)) != 0)
+            return false;
+    }
+    if (TransformD64_8way) {
+        TransformD64_8way(out, in);
+        if (memcmp(out, expected, sizeof(out)) != 0)
+            return false;
+    }
+    return true;
+}
+#endif
 } // namespace
 
 
@@ -147,14 +257,15 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        sha256::Transform(s, buf);
+        Transform(s, buf, 1);
         bufsize = 0;
     }
-    while (end >= data + 64) {
+    if (end - data >= 64) {
         // Process full chunks directly from the source.
-        sha256::Transform(s, data);
-        bytes += 64;
-        data += 64;
+        size_t blocks = (end - data) / 64;
+        Transform(s, data, blocks);
+        bytes += 64 * blocks;
+        data += 64 * blocks;
     }
     if (end > data) {
         // Fill the buffer with what remains.
@@ -187,3 +298,87 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+std::string SHA256AutoDetect()
+{
+    std::string ret = "standard";
+#ifdef HAVE_SHA256_DISPATCH
+    uint32_t eax, ebx, ecx, edx;
+    __cpuid(1, eax, ebx, ecx, edx);
+    bool have_sse41 = (ecx >> 19) & 1;
+    bool have_xsave = (ecx >> 27) & 1;
+    bool have_avx = (ecx >> 28) & 1;
+    bool have_avx2 = false;
+    bool have_shani = false;
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        have_avx2 = (ebx >> 5) & 1;
+        have_shani = (ebx >> 29) & 1;
+    }
+    // AVX registers are only usable when the OS saves them
+    if (have_xsave && have_avx)
+        have_avx = (GetXCR0() & 6) == 6;
+    else
+        have_avx = false;
+    (void)have_sse41;
+    (void)have_avx2;
+    (void)have_shani;
+    Transform = sha256::Transform;
+    TransformD64_4way = NULL;
+    TransformD64_8way = NULL;
+
+#ifdef ENABLE_SHANI
+    if (have_shani && have_sse41) {
+        Transform = sha256_shani::Transform;
+        ret = "shani";
+    }
+#endif
+#ifdef ENABLE_SSE41
+    // 4-way is slower than the SHA instructions one block at a time, 8-way is not
+    if (have_sse41 && Transform == sha256::Transform) {
+        TransformD64_4way = sha256d64_sse41::Transform_4way;
+        ret += ",sse41(4way)";
+    }
+#endif
+#ifdef ENABLE_AVX2
+    if (have_avx && have_avx2) {
+        TransformD64_8way = sha256d64_avx2::Transform_8way;
+        ret += ",avx2(8way)";
+    }
+#endif
+
+    if (!SelfTest()) {
+        Transform = sha256::Transform;
+        TransformD64_4way = NULL;
+        TransformD64_8way = NULL;
+        ret = "standard";
+    }
+#endif
+    return ret;
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    if (TransformD64_8way) {
+        while (blocks >= 8) {
+            TransformD64_8way(out, in);
+            out += 256;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (TransformD64_4way) {
+        while (blocks >= 4) {
+            TransformD64_4way(out, in);
+            out += 128;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        TransformD64(out, in);
+        out += 32;
+        in += 64;
+        --blocks;
+    }
+}
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,14 @@ public:
     CSHA256& Reset();
 };
 
+/** Pick the fastest SHA-256 implementations the CPU supports, and return
+ *  their names. Call once at startup, before any other thread hashes. */
+std::string SHA256AutoDetect();
+
+/** Compute the double SHA-256 of each of the blocks consecutive 64-byte
+ *  inputs, into blocks consecutive 32-byte outputs, as Hash() would. A
+ *  merkle tree level is hashed in one call, several inputs at a time. The
+ *  output may be the input, to hash a level over itself. */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
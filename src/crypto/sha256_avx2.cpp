@@ -0,0 +1,148 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// 8-way double SHA-256 of 64-byte inputs with AVX2, built with -mavx -mavx2.
+
+#ifdef ENABLE_AVX2
+
+#include "crypto/common.h"
+
+#include <immintrin.h>
+#include <stdint.h>
+
+namespace
+{
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+//! One 32-bit word from each of the 8 inputs
+typedef __m256i vec;
+
+vec inline Word(uint32_t x) { return _mm256_set1_epi32(x); }
+vec inline Add(vec x, vec y) { return _mm256_add_epi32(x, y); }
+vec inline Xor(vec x, vec y) { return _mm256_xor_si256(x, y); }
+vec inline Or(vec x, vec y) { return _mm256_or_si256(x, y); }
+vec inline And(vec x, vec y) { return _mm256_and_si256(x, y); }
+vec inline Rotr(vec x, int n) { return Or(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+
+vec inline Ch(vec x, vec y, vec z) { return Xor(z, And(x, Xor(y, z))); }
+vec inline Maj(vec x, vec y, vec z) { return Or(And(x, y), And(z, Or(x, y))); }
+vec inline Sigma0(vec x) { return Xor(Xor(Rotr(x, 2), Rotr(x, 13)), Rotr(x, 22)); }
+vec inline Sigma1(vec x) { return Xor(Xor(Rotr(x, 6), Rotr(x, 11)), Rotr(x, 25)); }
+vec inline sigma0(vec x) { return Xor(Xor(Rotr(x, 7), Rotr(x, 18)), _mm256_srli_epi32(x, 3)); }
+vec inline sigma1(vec x) { return Xor(Xor(Rotr(x, 17), Rotr(x, 19)), _mm256_srli_epi32(x, 10)); }
+
+/** Initialize SHA-256 state. */
+void inline Initialize(vec* s)
+{
+    s[0] = Word(0x6a09e667ul);
+    s[1] = Word(0xbb67ae85ul);
+    s[2] = Word(0x3c6ef372ul);
+    s[3] = Word(0xa54ff53aul);
+    s[4] = Word(0x510e527ful);
+    s[5] = Word(0x9b05688cul);
+    s[6] = Word(0x1f83d9abul);
+    s[7] = Word(0x5be0cd19ul);
+}
+
+/** One SHA-256 transformation of each lane, the message schedule is overwritten */
+void inline Transform(vec* s, vec* w)
+{
+    vec a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16)
+            w[i & 15] = Add(Add(w[i & 15], sigma1(w[(i + 14) & 15])), Add(w[(i + 9) & 15], sigma0(w[(i + 1) & 15])));
+        vec t1 = Add(Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), Word(K[i]))), w[i & 15]);
+        vec t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = Add(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = Add(t1, t2);
+    }
+    s[0] = Add(s[0], a);
+    s[1] = Add(s[1], b);
+    s[2] = Add(s[2], c);
+    s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e);
+    s[5] = Add(s[5], f);
+    s[6] = Add(s[6], g);
+    s[7] = Add(s[7], h);
+}
+
+/** Word number n of each of the 8 consecutive 64-byte inputs */
+vec inline Read(const unsigned char* in, int n)
+{
+    return _mm256_set_epi32(ReadBE32(in + 448 + 4 * n), ReadBE32(in + 384 + 4 * n), ReadBE32(in + 320 + 4 * n), ReadBE32(in + 256 + 4 * n), ReadBE32(in + 192 + 4 * n), ReadBE32(in + 128 + 4 * n), ReadBE32(in + 64 + 4 * n), ReadBE32(in + 4 * n));
+}
+
+/** Store lane i of the state as the i-th 32-byte output */
+void inline Write(unsigned char* out, const vec* s)
+{
+    for (int n = 0; n < 8; n++) {
+        WriteBE32(out + 4 * n, _mm256_extract_epi32(s[n], 0));
+        WriteBE32(out + 32 + 4 * n, _mm256_extract_epi32(s[n], 1));
+        WriteBE32(out + 64 + 4 * n, _mm256_extract_epi32(s[n], 2));
+        WriteBE32(out + 96 + 4 * n, _mm256_extract_epi32(s[n], 3));
+        WriteBE32(out + 128 + 4 * n, _mm256_extract_epi32(s[n], 4));
+        WriteBE32(out + 160 + 4 * n, _mm256_extract_epi32(s[n], 5));
+        WriteBE32(out + 192 + 4 * n, _mm256_extract_epi32(s[n], 6));
+        WriteBE32(out + 224 + 4 * n, _mm256_extract_epi32(s[n], 7));
+    }
+}
+} // anon namespace
+
+namespace sha256d64_avx2
+{
+void Transform_8way(unsigned char* out, const unsigned char* in)
+{
+    vec s[8], w[16];
+
+    // The inputs
+    Initialize(s);
+    for (int n = 0; n < 16; n++)
+        w[n] = Read(in, n);
+    Transform(s, w);
+
+    // Their padding, for 64 bytes
+    w[0] = Word(0x80000000ul);
+    for (int n = 1; n < 15; n++)
+        w[n] = Word(0);
+    w[15] = Word(0x200);
+    Transform(s, w);
+
+    // The second hash, of the 32-byte first one
+    for (int n = 0; n < 8; n++)
+        w[n] = s[n];
+    w[8] = Word(0x80000000ul);
+    for (int n = 9; n < 15; n++)
+        w[n] = Word(0);
+    w[15] = Word(0x100);
+    Initialize(s);
+    Transform(s, w);
+
+    Write(out, s);
+}
+} // namespace sha256d64_avx2
+
+#endif // ENABLE_AVX2
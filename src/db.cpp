@@ -147,6 +147,10 @@ CDBEnv::VerifyResult CDBEnv::Verify(std::string strFile, bool (*recoverFunc)(CDB
     LOCK(cs_db);
     assert(mapFileUseCount.count(strFile) == 0);
 
+    // A log structured file drops a torn tail itself when it is opened
+    if (!fMockDb && CWalletLogFile::IsLogFile(boost::filesystem::path(strPath) / strFile))
+        return VERIFY_OK;
+
     Db db(&dbenv, 0);
     int result = db.verify(strFile.c_str(), NULL, NULL, 0);
     if (result == 0)
@@ -164,6 +168,11 @@ bool CDBEnv::Salvage(std::string strFile, bool fAggressive, std::vector<CDBEnv::
     LOCK(cs_db);
     assert(mapFileUseCount.count(strFile) == 0);
 
+    if (!fMockDb && CWalletLogFile::IsLogFile(boost::filesystem::path(strPath) / strFile)) {
+        LogPrintf("CDBEnv::Salvage : %s is a log structured file, there is nothing to salvage.\n", strFile);
+        return false;
+    }
+
     u_int32_t flags = DB_SALVAGE;
     if (fAggressive)
         flags |= DB_AGGRESSIVE;
@@ -212,13 +221,20 @@ bool CDBEnv::Salvage(std::string strFile, bool fAggressive, std::vector<CDBEnv::
 void CDBEnv::CheckpointLSN(const std::string& strFile)
 {
     dbenv.txn_checkpoint(0, 0, 0);
-    if (fMockDb)
+    if (fMockDb || IsLogFile(strFile))
         return;
     dbenv.lsn_reset(strFile.c_str(), 0);
 }
 
+bool CDBEnv::IsLogFile(const std::string& strFile)
+{
+    LOCK(cs_db);
+    std::map<std::string, CWalletLogFile*>::const_iterator it = mapLogFile.find(strFile);
+    return it != mapLogFile.end() && it->second != NULL;
+}
+
 
-CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), plog(NULL), activeTxn(NULL), fLogTxn(false)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -237,6 +253,32 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
 
         strFile = strFilename;
         ++bitdb.mapFileUseCount[strFile];
+        plog = bitdb.mapLogFile[strFile];
+        if (plog == NULL && !bitdb.IsMock()) {
+            boost::filesystem::path pathFile = GetDataDir() / strFile;
+            bool fExists = boost::filesystem::exists(pathFile);
+            if ((fExists && CWalletLogFile::IsLogFile(pathFile)) ||
+                (!fExists && fCreate && GetArg("-walletbackend", DEFAULT_WALLET_BACKEND) == "log")) {
+                plog = new CWalletLogFile();
+                if (!plog->Open(pathFile, fCreate)) {
+                    delete plog;
+                    plog = NULL;
+                    --bitdb.mapFileUseCount[strFile];
+                    throw runtime_error(strprintf("CDB : Can't open log structured database %s", strFile));
+                }
+                bitdb.mapLogFile[strFile] = plog;
+
+                if (fCreate && !Exists(string("version"))) {
+                    bool fTmp = fReadOnly;
+                    fReadOnly = false;
+                    WriteVersion(CLIENT_VERSION);
+                    fReadOnly = fTmp;
+                }
+            }
+        }
+        if (plog != NULL)
+            return;
+
         pdb = bitdb.mapDb[strFile];
         if (pdb == NULL) {
             pdb = new Db(&bitdb.dbenv, 0);
@@ -276,6 +318,85 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
     }
 }
 
+bool CDB::ReadLog(const CDataStream& ssKey, CSerializeData& vchValue)
+{
+    std::string strKey(ssKey.begin(), ssKey.end());
+    if (fLogTxn) {
+        CWalletLogBatch::const_iterator it = logTxn.find(strKey);
+        if (it != logTxn.end()) {
+            if (it->second.fErase)
+                return false;
+            vchValue = it->second.value;
+            return true;
+        }
+    }
+    return plog->Read(strKey, vchValue);
+}
+
+bool CDB::WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite && ExistsLog(ssKey))
+        return false;
+
+    CWalletLogBatch batch;
+    CWalletLogBatch& writes = fLogTxn ? logTxn : batch;
+    CWalletLogWrite& write = writes[std::string(ssKey.begin(), ssKey.end())];
+    write.fErase = false;
+    write.value.assign(ssValue.begin(), ssValue.end());
+    return fLogTxn || plog->Commit(batch);
+}
+
+bool CDB::EraseLog(const CDataStream& ssKey)
+{
+    CWalletLogBatch batch;
+    CWalletLogBatch& writes = fLogTxn ? logTxn : batch;
+    CWalletLogWrite& write = writes[std::string(ssKey.begin(), ssKey.end())];
+    write.fErase = true;
+    write.value.clear();
+    return fLogTxn || plog->Commit(batch);
+}
+
+bool CDB::ExistsLog(const CDataStream& ssKey)
+{
+    std::string strKey(ssKey.begin(), ssKey.end());
+    if (fLogTxn) {
+        CWalletLogBatch::const_iterator it = logTxn.find(strKey);
+        if (it != logTxn.end())
+            return !it->second.fErase;
+    }
+    return plog->Exists(strKey);
+}
+
+int CDB::ReadLogAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    // Cursors only see committed records, like the BerkeleyDB cursors opened outside a transaction
+    bool fInclusive;
+    if (fFlags == DB_SET_RANGE) {
+        pcursor->strKey.assign(ssKey.begin(), ssKey.end());
+        fInclusive = true;
+    } else if (fFlags == DB_NEXT) {
+        fInclusive = !pcursor->fStarted;
+    } else {
+        return EINVAL;
+    }
+
+    std::string strKeyRet;
+    CSerializeData vchValue;
+    if (!plog->Next(pcursor->strKey, fInclusive, strKeyRet, vchValue))
+        return DB_NOTFOUND;
+    pcursor->strKey = strKeyRet;
+    pcursor->fStarted = true;
+
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write(strKeyRet.data(), strKeyRet.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    if (!vchValue.empty())
+        ssValue.write(&vchValue[0], vchValue.size());
+    return 0;
+}
+
 void CDB::Flush()
 {
     if (activeTxn)
@@ -291,14 +412,20 @@ void CDB::Flush()
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pdb && !plog)
         return;
     if (activeTxn)
         activeTxn->abort();
     activeTxn = NULL;
+    fLogTxn = false;
+    logTxn.clear();
     pdb = NULL;
 
-    Flush();
+    // Log structured files are made durable by CDBEnv::CloseDb
+    if (plog)
+        plog = NULL;
+    else
+        Flush();
 
     {
         LOCK(bitdb.cs_db);
@@ -310,6 +437,13 @@ void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
+        if (mapLogFile[strFile] != NULL) {
+            // Opening a log structured file reads it whole, so it stays open
+            CWalletLogFile* plog = mapLogFile[strFile];
+            plog->Flush();
+            if (plog->NeedsCompaction())
+                plog->Compact();
+        }
         if (mapDb[strFile] != NULL) {
             // Close the database handle
             Db* pdb = mapDb[strFile];
@@ -325,6 +459,11 @@ bool CDBEnv::RemoveDb(const string& strFile)
     this->CloseDb(strFile);
 
     LOCK(cs_db);
+    if (mapLogFile[strFile] != NULL) {
+        delete mapLogFile[strFile];
+        mapLogFile.erase(strFile);
+        return boost::filesystem::remove(GetDataDir() / strFile);
+    }
     int rc = dbenv.dbremove(NULL, strFile.c_str(), NULL, DB_AUTO_COMMIT);
     return (rc == 0);
 }
@@ -335,6 +474,20 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
         {
             LOCK(bitdb.cs_db);
             if (!bitdb.mapFileUseCount.count(strFile) || bitdb.mapFileUseCount[strFile] == 0) {
+                if (bitdb.IsLogFile(strFile) || CWalletLogFile::IsLogFile(GetDataDir() / strFile)) {
+                    LogPrintf("CDB::Rewrite : Compacting %s...\n", strFile);
+                    bool fSuccess;
+                    {
+                        CDB db(strFile.c_str(), "r+");
+                        fSuccess = db.WriteVersion(CLIENT_VERSION);
+                    }
+                    bitdb.mapFileUseCount.erase(strFile);
+                    fSuccess = fSuccess && bitdb.mapLogFile[strFile]->Compact(pszSkip);
+                    if (!fSuccess)
+                        LogPrintf("CDB::Rewrite : Failed to compact %s\n", strFile);
+                    return fSuccess;
+                }
+
                 // Flush log data to the dat file
                 bitdb.CloseDb(strFile);
                 bitdb.CheckpointLSN(strFile);
@@ -358,7 +511,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
@@ -433,7 +586,7 @@ void CDBEnv::Flush(bool fShutdown)
                 LogPrint("db", "CDBEnv::Flush : %s checkpoint\n", strFile);
                 dbenv.txn_checkpoint(0, 0, 0);
                 LogPrint("db", "CDBEnv::Flush : %s detach\n", strFile);
-                if (!fMockDb)
+                if (!fMockDb && !IsLogFile(strFile))
                     dbenv.lsn_reset(strFile.c_str(), 0);
                 LogPrint("db", "CDBEnv::Flush : %s closed\n", strFile);
                 mapFileUseCount.erase(mi++);
@@ -444,6 +597,9 @@ void CDBEnv::Flush(bool fShutdown)
         if (fShutdown) {
             char** listp;
             if (mapFileUseCount.empty()) {
+                for (map<string, CWalletLogFile*>::iterator it = mapLogFile.begin(); it != mapLogFile.end(); ++it)
+                    delete it->second;
+                mapLogFile.clear();
                 dbenv.log_archive(&listp, DB_ARCH_REMOVE);
                 Close();
                 if (!fMockDb)
@@ -11,6 +11,7 @@
 #include "streams.h"
 #include "sync.h"
 #include "version.h"
+#include "walletlog.h"
 
 #include <map>
 #include <string>
@@ -25,6 +26,8 @@ class COutPoint;
 
 struct CBlockLocator;
 
+static const char* const DEFAULT_WALLET_BACKEND = "bdb";
+
 extern unsigned int nWalletDBUpdated;
 
 void ThreadFlushWalletDB(const std::string& strWalletFile);
@@ -46,6 +49,8 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    //! Open log structured wallet files, which stay open until shutdown
+    std::map<std::string, CWalletLogFile*> mapLogFile;
 
     CDBEnv();
     ~CDBEnv();
@@ -76,6 +81,7 @@ public:
     void Close();
     void Flush(bool fShutdown);
     void CheckpointLSN(const std::string& strFile);
+    bool IsLogFile(const std::string& strFile);
 
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
@@ -93,14 +99,38 @@ public:
 extern CDBEnv bitdb;
 
 
+/** A cursor on a BerkeleyDB or a log structured database, close() frees it */
+class CDBCursor
+{
+public:
+    Dbc* pcursor;
+    //! Key the cursor of a log structured file is at
+    std::string strKey;
+    bool fStarted;
+
+    explicit CDBCursor(Dbc* pcursorIn) : pcursor(pcursorIn), fStarted(false) {}
+
+    void close()
+    {
+        if (pcursor)
+            pcursor->close();
+        delete this;
+    }
+};
+
+
 /** RAII class that provides access to a Berkeley database */
 class CDB
 {
 protected:
     Db* pdb;
+    CWalletLogFile* plog;
     std::string strFile;
     DbTxn* activeTxn;
     bool fReadOnly;
+    //! Writes of the open transaction on a log structured file
+    bool fLogTxn;
+    CWalletLogBatch logTxn;
 
     explicit CDB(const std::string& strFilename, const char* pszMode = "r+");
     ~CDB() { Close(); }
@@ -113,17 +143,36 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    bool ReadLog(const CDataStream& ssKey, CSerializeData& vchValue);
+    bool WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool EraseLog(const CDataStream& ssKey);
+    bool ExistsLog(const CDataStream& ssKey);
+    int ReadLogAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags);
+
 protected:
     template <typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plog) {
+            CSerializeData vchValue;
+            if (!ReadLog(ssKey, vchValue))
+                return false;
+            try {
+                CDataStream ssValue(vchValue.begin(), vchValue.end(), SER_DISK, CLIENT_VERSION);
+                ssValue >> value;
+            } catch (const std::exception&) {
+                return false;
+            }
+            return true;
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -151,7 +200,7 @@ protected:
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -166,6 +215,8 @@ protected:
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+        if (plog)
+            return WriteLog(ssKey, ssValue, fOverwrite);
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -180,7 +231,7 @@ protected:
     template <typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -189,6 +240,8 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plog)
+            return EraseLog(ssKey);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -202,13 +255,15 @@ protected:
     template <typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plog)
+            return ExistsLog(ssKey);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -219,19 +274,25 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
+    CDBCursor* GetCursor()
     {
+        if (plog)
+            return new CDBCursor(NULL);
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
             return NULL;
-        return pcursor;
+        return new CDBCursor(pcursor);
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursorIn, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
     {
+        if (!pcursorIn->pcursor)
+            return ReadLogAtCursor(pcursorIn, ssKey, ssValue, fFlags);
+        Dbc* pcursor = pcursorIn->pcursor;
+
         // Read at cursor
         Dbt datKey;
         if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
@@ -270,6 +331,12 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (plog) {
+            if (fLogTxn)
+                return false;
+            fLogTxn = true;
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -281,6 +348,14 @@ public:
 
     bool TxnCommit()
     {
+        if (plog) {
+            if (!fLogTxn)
+                return false;
+            fLogTxn = false;
+            bool fSuccess = plog->Commit(logTxn);
+            logTxn.clear();
+            return fSuccess;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -290,6 +365,13 @@ public:
 
     bool TxnAbort()
     {
+        if (plog) {
+            if (!fLogTxn)
+                return false;
+            fLogTxn = false;
+            logTxn.clear();
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -0,0 +1,113 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "dbengine.h"
+
+#include "crypto/common.h"
+
+#include <map>
+
+#include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
+
+static const char BATCH_PUT = 1;
+static const char BATCH_DELETE = 2;
+
+void CDBWriteBatch::Append(const CDBSlice& slice)
+{
+    unsigned char pchSize[4];
+    WriteLE32(pchSize, slice.size());
+    rep.append((const char*)pchSize, sizeof(pchSize));
+    rep.append(slice.data(), slice.size());
+}
+
+void CDBWriteBatch::Put(const CDBSlice& key, const CDBSlice& value)
+{
+    rep.push_back(BATCH_PUT);
+    Append(key);
+    Append(value);
+    nCount++;
+}
+
+void CDBWriteBatch::Delete(const CDBSlice& key)
+{
+    rep.push_back(BATCH_DELETE);
+    Append(key);
+    nCount++;
+}
+
+void CDBWriteBatch::Clear()
+{
+    rep.clear();
+    nCount = 0;
+}
+
+static CDBSlice ReadSlice(const std::string& rep, size_t& nPos)
+{
+    size_t nSize = ReadLE32((const unsigned char*)rep.data() + nPos);
+    CDBSlice slice(rep.data() + nPos + 4, nSize);
+    nPos += 4 + nSize;
+    return slice;
+}
+
+void CDBWriteBatch::Iterate(Handler& handler) const
+{
+    size_t nPos = 0;
+    while (nPos < rep.size()) {
+        char chTag = rep[nPos++];
+        CDBSlice key = ReadSlice(rep, nPos);
+        if (chTag == BATCH_PUT) {
+            CDBSlice value = ReadSlice(rep, nPos);
+            handler.Put(key, value);
+        } else {
+            handler.Delete(key);
+        }
+    }
+}
+
+static boost::mutex csEngines;
+
+static std::map<std::string, DBEngineFactory>& GetEngines()
+{
+    static std::map<std::string, DBEngineFactory> mapEngines;
+    if (mapEngines.empty())
+        mapEngines["leveldb"] = OpenLevelDBEngine;
+    return mapEngines;
+}
+
+void RegisterDBEngine(const std::string& strName, DBEngineFactory factory)
+{
+    boost::mutex::scoped_lock lock(csEngines);
+    GetEngines()[strName] = factory;
+}
+
+bool IsDBEngineAvailable(const std::string& strName)
+{
+    boost::mutex::scoped_lock lock(csEngines);
+    return GetEngines().count(strName) > 0;
+}
+
+std::vector<std::string> GetDBEngineNames()
+{
+    boost::mutex::scoped_lock lock(csEngines);
+    std::vector<std::string> vNames;
+    typedef std::pair<const std::string, DBEngineFactory> Entry;
+    BOOST_FOREACH (const Entry& entry, GetEngines())
+        vNames.push_back(entry.first);
+    return vNames;
+}
+
+CDBEngine* OpenDBEngine(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBProfile& profile) throw(leveldb_error)
+{
+    DBEngineFactory factory = NULL;
+    {
+        boost::mutex::scoped_lock lock(csEngines);
+        std::map<std::string, DBEngineFactory>::const_iterator it = GetEngines().find(profile.strEngine);
+        if (it != GetEngines().end())
+            factory = it->second;
+    }
+    if (!factory)
+        throw leveldb_error("Unknown database engine " + profile.strEngine);
+    return factory(path, nCacheSize, fMemory, fWipe, profile);
+}
@@ -0,0 +1,175 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_DBENGINE_H
+#define BITCOIN_DBENGINE_H
+
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+class leveldb_error : public std::runtime_error
+{
+public:
+    leveldb_error(const std::string& msg) : std::runtime_error(msg) {}
+};
+
+//! -<db>engine default
+static const char* const DEFAULT_DB_ENGINE = "leveldb";
+//! -<db>bloombits default
+static const int DEFAULT_DB_BLOOM_BITS = 10;
+//! -<db>compression default
+static const bool DEFAULT_DB_COMPRESSION = false;
+//! -<db>maxopenfiles default
+static const int DEFAULT_DB_MAX_OPEN_FILES = 64;
+
+/** Engine and tuning of one database */
+struct CLevelDBProfile {
+    std::string strName;
+    std::string strEngine;   // key-value engine the database is stored with
+    int nBloomBits;          // bloom filter bits per key, 0 for no filter
+    bool fCompression;       // Snappy block compression, if leveldb was built with it
+    size_t nWriteBufferSize; // 0 for a quarter of the cache size
+    int nMaxOpenFiles;
+
+    CLevelDBProfile() : strEngine(DEFAULT_DB_ENGINE), nBloomBits(DEFAULT_DB_BLOOM_BITS), fCompression(DEFAULT_DB_COMPRESSION), nWriteBufferSize(0), nMaxOpenFiles(DEFAULT_DB_MAX_OPEN_FILES) {}
+};
+
+/** Bytes of a key or value, valid as long as what they point into */
+class CDBSlice
+{
+private:
+    const char* pdata;
+    size_t nSize;
+
+public:
+    CDBSlice() : pdata(""), nSize(0) {}
+    CDBSlice(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    CDBSlice(const std::string& str) : pdata(str.data()), nSize(str.size()) {}
+    CDBSlice(const char* psz) : pdata(psz), nSize(strlen(psz)) {}
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    char operator[](size_t n) const { return pdata[n]; }
+    std::string ToString() const { return std::string(pdata, nSize); }
+
+    //! Bytewise, the order every engine keeps its keys in
+    int compare(const CDBSlice& other) const
+    {
+        int r = memcmp(pdata, other.pdata, nSize < other.nSize ? nSize : other.nSize);
+        if (r == 0)
+            r = nSize < other.nSize ? -1 : (nSize > other.nSize ? 1 : 0);
+        return r;
+    }
+
+    bool starts_with(const CDBSlice& prefix) const
+    {
+        return nSize >= prefix.nSize && memcmp(pdata, prefix.pdata, prefix.nSize) == 0;
+    }
+};
+
+inline bool operator==(const CDBSlice& a, const CDBSlice& b)
+{
+    return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+inline bool operator!=(const CDBSlice& a, const CDBSlice& b)
+{
+    return !(a == b);
+}
+
+/** Puts and deletes an engine applies atomically, in the order they were queued */
+class CDBWriteBatch
+{
+private:
+    //! (tag, key size, key[, value size, value]) per operation
+    std::string rep;
+    size_t nCount;
+
+    void Append(const CDBSlice& slice);
+
+public:
+    /** What Iterate() hands every operation to */
+    class Handler
+    {
+    public:
+        virtual ~Handler() {}
+        virtual void Put(const CDBSlice& key, const CDBSlice& value) = 0;
+        virtual void Delete(const CDBSlice& key) = 0;
+    };
+
+    CDBWriteBatch() : nCount(0) {}
+
+    void Put(const CDBSlice& key, const CDBSlice& value);
+    void Delete(const CDBSlice& key);
+    void Clear();
+    size_t Count() const { return nCount; }
+    size_t GetSerializedSize() const { return rep.size(); }
+    void Iterate(Handler& handler) const;
+};
+
+/** Cursor over the keys of a database in bytewise order */
+class CDBIterator
+{
+public:
+    virtual ~CDBIterator() {}
+    virtual bool Valid() const = 0;
+    virtual void SeekToFirst() = 0;
+    //! To the first key at or after key
+    virtual void Seek(const CDBSlice& key) = 0;
+    virtual void Next() = 0;
+    //! Only while Valid(), and until the iterator moves
+    virtual CDBSlice key() const = 0;
+    virtual CDBSlice value() const = 0;
+    //! false if the iteration stopped on an error rather than at the end
+    virtual bool IsOk() const = 0;
+};
+
+/** Consistent read-only view of a database, owned by the engine that made it */
+class CDBSnapshot
+{
+public:
+    virtual ~CDBSnapshot() {}
+};
+
+/**
+ * A key-value store under a CLevelDBWrapper. Failures are thrown as
+ * leveldb_error whatever the engine, so callers handle them the same way.
+ */
+class CDBEngine
+{
+public:
+    virtual ~CDBEngine() {}
+
+    virtual const char* GetName() const = 0;
+    //! false if the key is missing
+    virtual bool Get(const CDBSlice& key, std::string& strValue) const = 0;
+    virtual void Write(const CDBWriteBatch& batch, bool fSync) = 0;
+    //! Over the current state, or over snapshot if not NULL. Scans do not fill the read cache.
+    virtual CDBIterator* NewIterator(const CDBSnapshot* snapshot) const = 0;
+    //! Must be given back with ReleaseSnapshot()
+    virtual const CDBSnapshot* GetSnapshot() const = 0;
+    virtual void ReleaseSnapshot(const CDBSnapshot* snapshot) const = 0;
+    //! Approximate bytes on disk of the keys in [begin, end)
+    virtual uint64_t GetApproximateSize(const CDBSlice& begin, const CDBSlice& end) const = 0;
+};
+
+//! Opens the database at path, creating it if missing and destroying it first if fWipe
+typedef CDBEngine* (*DBEngineFactory)(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBProfile& profile);
+
+/** Make an engine available to -<db>engine under strName, before any database is opened */
+void RegisterDBEngine(const std::string& strName, DBEngineFactory factory);
+bool IsDBEngineAvailable(const std::string& strName);
+std::vector<std::string> GetDBEngineNames();
+CDBEngine* OpenDBEngine(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBProfile& profile) throw(leveldb_error);
+
+//! The builtin engine, in leveldbwrapper.cpp
+CDBEngine* OpenLevelDBEngine(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBProfile& profile);
+
+#endif // BITCOIN_DBENGINE_H
@@ -13,9 +13,12 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
-#include <boost/filesystem/operations.hpp>
+#include <iostream>
 #include <stdio.h>
 
+#include <boost/filesystem/operations.hpp>
+#include <boost/foreach.hpp>
+
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/buffer.h>
@@ -28,6 +31,7 @@
 using namespace std;
 
 static const int DEFAULT_HTTP_CLIENT_TIMEOUT=900;
+static const int DEFAULT_CLI_BATCH_SIZE=100;
 
 std::string HelpMessageCli()
 {
@@ -45,6 +49,9 @@ std::string HelpMessageCli()
     strUsage += HelpMessageOpt("-rpcuser=<user>", _("Username for JSON-RPC connections"));
     strUsage += HelpMessageOpt("-rpcpassword=<pw>", _("Password for JSON-RPC connections"));
     strUsage += HelpMessageOpt("-rpcclienttimeout=<n>", strprintf(_("Timeout during HTTP requests (default: %d)"), DEFAULT_HTTP_CLIENT_TIMEOUT));
+    strUsage += HelpMessageOpt("-stdinbatch", _("Read commands from standard input, one per line with the arguments quoted as in a shell, and send them "
+                                                "over one connection in JSON-RPC batches. The results are printed in order, one line each, errors included"));
+    strUsage += HelpMessageOpt("-batchsize=<n>", strprintf(_("Commands sent in one batch with -stdinbatch, 1 sends each as soon as it is read (default: %d)"), DEFAULT_CLI_BATCH_SIZE));
 
     return strUsage;
 }
@@ -78,7 +85,8 @@ static bool AppInitRPC(int argc, char* argv[])
             strUsage += "\n" + _("Usage:") + "\n" +
                         "  dystem-cli [options] <command> [params]  " + _("Send command to DYSTEM Core") + "\n" +
                         "  dystem-cli [options] help                " + _("List commands") + "\n" +
-                        "  dystem-cli [options] help <command>      " + _("Get help for a command") + "\n";
+                        "  dystem-cli [options] help <command>      " + _("Get help for a command") + "\n" +
+                        "  dystem-cli [options] -stdinbatch         " + _("Send the commands read from standard input") + "\n";
 
             strUsage += "\n" + HelpMessageCli();
         }
@@ -113,6 +121,7 @@ static bool AppInitRPC(int argc, char* argv[])
 /** Reply structure for request_done to fill in */
 struct HTTPReply
 {
+    struct event_base *base;
     int status;
     std::string body;
 };
@@ -121,6 +130,9 @@ static void http_request_done(struct evhttp_request *req, void *ctx)
 {
     HTTPReply *reply = static_cast<HTTPReply*>(ctx);
 
+    // A connection kept alive leaves its events in the loop, return from it now
+    event_base_loopbreak(reply->base);
+
     if (req == NULL) {
         /* If req is NULL, it means an error occurred while connecting, but
          * I'm not sure how to find out which one. We also don't really care.
@@ -142,29 +154,33 @@ static void http_request_done(struct evhttp_request *req, void *ctx)
     }
 }
 
-UniValue CallRPC(const string& strMethod, const UniValue& params)
+/**
+ * The HTTP connection to the server. With fKeepAlive it is kept open for the
+ * next request, libevent connects again if the server closed it meanwhile.
+ */
+class CRPCConnection
 {
-    std::string host = GetArg("-rpcconnect", "127.0.0.1");
-    int port = GetArg("-rpcport", BaseParams().RPCPort());
+public:
+    explicit CRPCConnection(bool fKeepAliveIn);
+    ~CRPCConnection();
 
-    // Create event base
-    struct event_base *base = event_base_new(); // TODO RAII
-    if (!base)
-        throw runtime_error("cannot create event_base");
+    /** Post a JSON-RPC request, or a batch of them, and parse the reply */
+    UniValue Post(const std::string& strRequest);
 
-    // Synchronously look up hostname
-    struct evhttp_connection *evcon = evhttp_connection_base_new(base, NULL, host.c_str(), port); // TODO RAII
-    if (evcon == NULL)
-        throw runtime_error("create connection failed");
-    evhttp_connection_set_timeout(evcon, GetArg("-rpcclienttimeout", DEFAULT_HTTP_CLIENT_TIMEOUT));
+private:
+    std::string host;
+    std::string strRPCUserColonPass;
+    bool fKeepAlive;
+    struct event_base *base;
+    struct evhttp_connection *evcon;
+};
 
-    HTTPReply response;
-    struct evhttp_request *req = evhttp_request_new(http_request_done, (void*)&response); // TODO RAII
-    if (req == NULL)
-        throw runtime_error("create http request failed");
+CRPCConnection::CRPCConnection(bool fKeepAliveIn) : fKeepAlive(fKeepAliveIn), base(NULL), evcon(NULL)
+{
+    host = GetArg("-rpcconnect", "127.0.0.1");
+    int port = GetArg("-rpcport", BaseParams().RPCPort());
 
     // Get credentials
-    std::string strRPCUserColonPass;
     if (mapArgs["-rpcpassword"] == "") {
         // Try fall back to cookie-based authentication if no password is provided
         if (!GetAuthCookie(&strRPCUserColonPass)) {
@@ -177,28 +193,51 @@ UniValue CallRPC(const string& strMethod, const UniValue& params)
         strRPCUserColonPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
     }
 
+    // Create event base
+    base = event_base_new();
+    if (!base)
+        throw runtime_error("cannot create event_base");
+
+    // Synchronously look up hostname
+    evcon = evhttp_connection_base_new(base, NULL, host.c_str(), port);
+    if (evcon == NULL) {
+        event_base_free(base);
+        throw runtime_error("create connection failed");
+    }
+    evhttp_connection_set_timeout(evcon, GetArg("-rpcclienttimeout", DEFAULT_HTTP_CLIENT_TIMEOUT));
+}
+
+CRPCConnection::~CRPCConnection()
+{
+    evhttp_connection_free(evcon);
+    event_base_free(base);
+}
+
+UniValue CRPCConnection::Post(const std::string& strRequest)
+{
+    HTTPReply response;
+    response.base = base;
+    response.status = 0;
+    struct evhttp_request *req = evhttp_request_new(http_request_done, (void*)&response);
+    if (req == NULL)
+        throw runtime_error("create http request failed");
+
     struct evkeyvalq *output_headers = evhttp_request_get_output_headers(req);
     assert(output_headers);
     evhttp_add_header(output_headers, "Host", host.c_str());
-    evhttp_add_header(output_headers, "Connection", "close");
+    evhttp_add_header(output_headers, "Connection", fKeepAlive ? "keep-alive" : "close");
     evhttp_add_header(output_headers, "Authorization", (std::string("Basic ") + EncodeBase64(strRPCUserColonPass)).c_str());
 
     // Attach request data
-    std::string strRequest = JSONRPCRequest(strMethod, params, 1);
     struct evbuffer * output_buffer = evhttp_request_get_output_buffer(req);
     assert(output_buffer);
     evbuffer_add(output_buffer, strRequest.data(), strRequest.size());
 
     int r = evhttp_make_request(evcon, req, EVHTTP_REQ_POST, "/");
-    if (r != 0) {
-        evhttp_connection_free(evcon);
-        event_base_free(base);
+    if (r != 0)
         throw CConnectionFailed("send http request failed");
-    }
 
     event_base_dispatch(base);
-    evhttp_connection_free(evcon);
-    event_base_free(base);
 
     if (response.status == 0)
         throw CConnectionFailed("couldn't connect to server");
@@ -213,6 +252,13 @@ UniValue CallRPC(const string& strMethod, const UniValue& params)
     UniValue valReply(UniValue::VSTR);
     if (!valReply.read(response.body))
         throw runtime_error("couldn't parse reply from server");
+    return valReply;
+}
+
+UniValue CallRPC(const string& strMethod, const UniValue& params)
+{
+    CRPCConnection conn(false);
+    const UniValue valReply = conn.Post(JSONRPCRequest(strMethod, params, 1));
     const UniValue& reply = valReply.get_obj();
     if (reply.empty())
         throw runtime_error("expected reply to have result, error and id properties");
@@ -220,6 +266,28 @@ UniValue CallRPC(const string& strMethod, const UniValue& params)
     return reply;
 }
 
+/** The error code of a reply, 0 when it has a result */
+static int GetReplyError(const UniValue& reply)
+{
+    const UniValue& error = find_value(reply, "error");
+    return error.isNull() ? 0 : error["code"].get_int();
+}
+
+/** What is printed of a reply, results in JSON indented by nIndent */
+static std::string FormatReply(const UniValue& reply, unsigned int nIndent)
+{
+    const UniValue& result = find_value(reply, "result");
+    const UniValue& error = find_value(reply, "error");
+
+    if (!error.isNull())
+        return "error: " + error.write();
+    if (result.isNull())
+        return "";
+    if (result.isStr())
+        return result.get_str();
+    return result.write(nIndent);
+}
+
 int CommandLineRPC(int argc, char* argv[])
 {
     string strPrint;
@@ -246,26 +314,11 @@ int CommandLineRPC(int argc, char* argv[])
             try {
                 const UniValue reply = CallRPC(strMethod, params);
 
-                // Parse reply
-                const UniValue& result = find_value(reply, "result");
-                const UniValue& error = find_value(reply, "error");
-
-                if (!error.isNull()) {
-                    // Error
-                    int code = error["code"].get_int();
-                    if (fWait && code == RPC_IN_WARMUP)
-                        throw CConnectionFailed("server in warmup");
-                    strPrint = "error: " + error.write();
-                    nRet = abs(code);
-                } else {
-                    // Result
-                    if (result.isNull())
-                        strPrint = "";
-                    else if (result.isStr())
-                        strPrint = result.get_str();
-                    else
-                        strPrint = result.write(2);
-                }
+                int code = GetReplyError(reply);
+                if (fWait && code == RPC_IN_WARMUP)
+                    throw CConnectionFailed("server in warmup");
+                strPrint = FormatReply(reply, 2);
+                nRet = abs(code);
                 // Connection succeeded, no need to retry.
                 break;
             } catch (const CConnectionFailed& e) {
@@ -291,6 +344,115 @@ int CommandLineRPC(int argc, char* argv[])
     return nRet;
 }
 
+/**
+ * Send the batch and set vPrint[id] and vCodes[id] for each command of it, by
+ * the id of its reply. Returns false when -rpcwait should send it again.
+ */
+static bool SendBatch(CRPCConnection& conn, const std::string& strBatch, const std::vector<int>& vIds, std::vector<std::string>& vPrint, std::vector<int>& vCodes, bool fWait)
+{
+    const UniValue valReply = conn.Post(strBatch);
+    if (valReply.isObject()) {
+        // The server refused the batch as a whole
+        if (fWait && GetReplyError(valReply) == RPC_IN_WARMUP)
+            return false;
+        BOOST_FOREACH (int nId, vIds) {
+            vPrint[nId] = FormatReply(valReply, 0);
+            vCodes[nId] = abs(GetReplyError(valReply));
+        }
+        return true;
+    }
+
+    const UniValue& replies = valReply.get_array();
+    for (size_t i = 0; i < replies.size(); i++) {
+        if (fWait && GetReplyError(replies[i]) == RPC_IN_WARMUP)
+            return false;
+    }
+    BOOST_FOREACH (int nId, vIds) {
+        vPrint[nId] = "error: no reply from server";
+        vCodes[nId] = EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < replies.size(); i++) {
+        const UniValue& id = find_value(replies[i], "id");
+        if (id.isNum() && id.get_int() >= 0 && id.get_int() < (int)vPrint.size()) {
+            vPrint[id.get_int()] = FormatReply(replies[i], 0);
+            vCodes[id.get_int()] = abs(GetReplyError(replies[i]));
+        }
+    }
+    return true;
+}
+
+int BatchCommandLineRPC()
+{
+    int nRet = 0;
+    try {
+        const bool fWait = GetBoolArg("-rpcwait", false);
+        const int nBatchSize = std::max(1, (int)GetArg("-batchsize", DEFAULT_CLI_BATCH_SIZE));
+        CRPCConnection conn(true);
+
+        bool fEnd = false;
+        while (!fEnd) {
+            // Read the next commands, those that do not convert get their error right away
+            std::vector<std::string> vPrint;
+            std::vector<int> vCodes;
+            std::vector<int> vIds;
+            std::string strBatch;
+            std::string strLine;
+            while ((int)vPrint.size() < nBatchSize) {
+                if (!std::getline(std::cin, strLine)) {
+                    fEnd = true;
+                    break;
+                }
+                std::vector<std::string> vArgs = SplitCommandLine(strLine);
+                if (vArgs.empty())
+                    continue;
+
+                int nId = vPrint.size();
+                vPrint.push_back("");
+                vCodes.push_back(0);
+                try {
+                    std::vector<std::string> strParams(vArgs.begin() + 1, vArgs.end());
+                    UniValue params = RPCConvertValues(vArgs[0], strParams);
+                    strBatch += (vIds.empty() ? "" : ",") + JSONRPCRequest(vArgs[0], params, nId);
+                    vIds.push_back(nId);
+                } catch (std::exception& e) {
+                    vPrint[nId] = string("error: ") + e.what();
+                    vCodes[nId] = EXIT_FAILURE;
+                }
+            }
+
+            if (!vIds.empty()) {
+                while (true) {
+                    try {
+                        if (SendBatch(conn, "[" + strBatch + "]", vIds, vPrint, vCodes, fWait))
+                            break;
+                    } catch (const CConnectionFailed& e) {
+                        if (!fWait)
+                            throw;
+                    }
+                    MilliSleep(1000);
+                }
+            }
+
+            // The exit code is that of the first command failing
+            for (size_t i = 0; i < vPrint.size(); i++) {
+                if (nRet == 0)
+                    nRet = vCodes[i];
+                fprintf(stdout, "%s\n", vPrint[i].c_str());
+            }
+            fflush(stdout);
+        }
+    } catch (boost::thread_interrupted) {
+        throw;
+    } catch (std::exception& e) {
+        fprintf(stderr, "error: %s\n", e.what());
+        nRet = EXIT_FAILURE;
+    } catch (...) {
+        PrintExceptionContinue(NULL, "BatchCommandLineRPC()");
+        throw;
+    }
+    return nRet;
+}
+
 int main(int argc, char* argv[])
 {
     SetupEnvironment();
@@ -312,7 +474,10 @@ int main(int argc, char* argv[])
 
     int ret = EXIT_FAILURE;
     try {
-        ret = CommandLineRPC(argc, argv);
+        if (GetBoolArg("-stdinbatch", false))
+            ret = BatchCommandLineRPC();
+        else
+            ret = CommandLineRPC(argc, argv);
     } catch (std::exception& e) {
         PrintExceptionContinue(&e, "CommandLineRPC()");
     } catch (...) {
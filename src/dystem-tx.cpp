@@ -19,15 +19,18 @@
 #include "utilmoneystr.h"
 #include "utilstrencodings.h"
 
+#include <iostream>
 #include <stdio.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/assign/list_of.hpp>
+#include <boost/scoped_ptr.hpp>
 
 using namespace boost::assign;
 using namespace std;
 
 static bool fCreateBlank;
+static bool fStdinBatch;
 static map<string, UniValue> registers;
 CClientUIInterface uiInterface;
 
@@ -45,6 +48,7 @@ static bool AppInitRawTx(int argc, char* argv[])
     }
 
     fCreateBlank = GetBoolArg("-create", false);
+    fStdinBatch = GetBoolArg("-stdinbatch", false);
 
     if (argc < 2 || mapArgs.count("-?") || mapArgs.count("-help")) {
         // First part of help message is specific to this utility
@@ -52,6 +56,7 @@ static bool AppInitRawTx(int argc, char* argv[])
                                _("Usage:") + "\n" +
                                "  dystem-tx [options] <hex-tx> [commands]  " + _("Update hex-encoded dystem transaction") + "\n" +
                                "  dystem-tx [options] -create [commands]   " + _("Create hex-encoded dystem transaction") + "\n" +
+                               "  dystem-tx [options] -stdinbatch [registers] " + _("Create or update a transaction for each line of standard input") + "\n" +
                                "\n";
 
         fprintf(stdout, "%s", strUsage.c_str());
@@ -60,6 +65,9 @@ static bool AppInitRawTx(int argc, char* argv[])
         strUsage += HelpMessageOpt("-?", _("This help message"));
         strUsage += HelpMessageOpt("-create", _("Create new, empty TX."));
         strUsage += HelpMessageOpt("-json", _("Select JSON output"));
+        strUsage += HelpMessageOpt("-stdinbatch", _("Read a transaction from each line of standard input: its hex, unless -create is given, and the commands for it. "
+                                                    "The command line takes only register commands, set once for all lines, and the keys and previous outputs of sign "
+                                                    "are kept until a register changes. Each result is printed on one line, errors included"));
         strUsage += HelpMessageOpt("-txid", _("Output only the hex-encoded transaction id of the resultant transaction."));
         strUsage += HelpMessageOpt("-regtest", _("Enter regression test mode, which uses a special chain in which blocks can be solved instantly."));
         strUsage += HelpMessageOpt("-testnet", _("Use the test network"));
@@ -92,6 +100,16 @@ static bool AppInitRawTx(int argc, char* argv[])
     return true;
 }
 
+/** The keystore and the previous outputs of sign, kept until the registers they come from change */
+struct CSignContext {
+    CBasicKeyStore keystore;
+    CCoinsView viewDummy;
+    CCoinsViewCache view;
+
+    CSignContext() : view(&viewDummy) {}
+};
+static boost::scoped_ptr<CSignContext> signContext;
+
 static void RegisterSetJson(const string& key, const string& rawJson)
 {
     UniValue val;
@@ -101,6 +119,8 @@ static void RegisterSetJson(const string& key, const string& rawJson)
     }
 
     registers[key] = val;
+    if (key == "privatekeys" || key == "prevtxs")
+        signContext.reset();
 }
 
 static void RegisterSet(const string& strInput)
@@ -327,28 +347,18 @@ vector<unsigned char> ParseHexUO(map<string, UniValue>& o, string strKey)
     return ParseHexUV(o[strKey], strKey);
 }
 
-static void MutateTxSign(CMutableTransaction& tx, const string& flagStr)
+static const CSignContext& GetSignContext()
 {
-    int nHashType = SIGHASH_ALL;
+    if (signContext)
+        return *signContext;
 
-    if (flagStr.size() > 0)
-        if (!findSighashFlags(nHashType, flagStr))
-            throw runtime_error("unknown sighash flag/sign option");
-
-    vector<CTransaction> txVariants;
-    txVariants.push_back(tx);
-
-    // mergedTx will end up with all the signatures; it
-    // starts as a clone of the raw tx:
-    CMutableTransaction mergedTx(txVariants[0]);
-    bool fComplete = true;
-    CCoinsView viewDummy;
-    CCoinsViewCache view(&viewDummy);
+    boost::scoped_ptr<CSignContext> context(new CSignContext());
+    CBasicKeyStore& tempKeystore = context->keystore;
+    CCoinsViewCache& view = context->view;
 
     if (!registers.count("privatekeys"))
         throw runtime_error("privatekeys register variable must be set.");
     bool fGivenKeys = false;
-    CBasicKeyStore tempKeystore;
     UniValue keysObj = registers["privatekeys"];
     fGivenKeys = true;
 
@@ -413,7 +423,29 @@ static void MutateTxSign(CMutableTransaction& tx, const string& flagStr)
         }
     }
 
-    const CKeyStore& keystore = tempKeystore;
+    signContext.swap(context);
+    return *signContext;
+}
+
+static void MutateTxSign(CMutableTransaction& tx, const string& flagStr)
+{
+    int nHashType = SIGHASH_ALL;
+
+    if (flagStr.size() > 0)
+        if (!findSighashFlags(nHashType, flagStr))
+            throw runtime_error("unknown sighash flag/sign option");
+
+    vector<CTransaction> txVariants;
+    txVariants.push_back(tx);
+
+    // mergedTx will end up with all the signatures; it
+    // starts as a clone of the raw tx:
+    CMutableTransaction mergedTx(txVariants[0]);
+    bool fComplete = true;
+
+    const CSignContext& context = GetSignContext();
+    const CCoinsViewCache& view = context.view;
+    const CKeyStore& keystore = context.keystore;
 
     bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
 
@@ -485,7 +517,8 @@ static void OutputTxJSON(const CTransaction& tx)
     UniValue entry(UniValue::VOBJ);
     TxToUniv(tx, 0, entry);
 
-    string jsonOutput = entry.write(4);
+    // One line for each transaction of a batch
+    string jsonOutput = entry.write(fStdinBatch ? 0 : 4);
     fprintf(stdout, "%s\n", jsonOutput.c_str());
 }
 
@@ -513,6 +546,18 @@ static void OutputTx(const CTransaction& tx)
         OutputTxHex(tx);
 }
 
+/** Split a command argument into the command and its value */
+static void ParseCommand(const string& arg, string& key, string& value)
+{
+    size_t eqpos = arg.find('=');
+    if (eqpos == string::npos)
+        key = arg;
+    else {
+        key = arg.substr(0, eqpos);
+        value = arg.substr(eqpos + 1);
+    }
+}
+
 static string readStdin()
 {
     char buf[4096];
@@ -568,15 +613,8 @@ static int CommandLineRawTx(int argc, char* argv[])
         CMutableTransaction tx(txDecodeTmp);
 
         for (int i = startArg; i < argc; i++) {
-            string arg = argv[i];
             string key, value;
-            size_t eqpos = arg.find('=');
-            if (eqpos == string::npos)
-                key = arg;
-            else {
-                key = arg.substr(0, eqpos);
-                value = arg.substr(eqpos + 1);
-            }
+            ParseCommand(argv[i], key, value);
 
             MutateTx(tx, key, value);
         }
@@ -600,6 +638,71 @@ static int CommandLineRawTx(int argc, char* argv[])
     return nRet;
 }
 
+static int BatchRawTx(int argc, char* argv[])
+{
+    int nRet = 0;
+    try {
+        // Skip switches
+        while (argc > 1 && IsSwitchChar(argv[1][0])) {
+            argc--;
+            argv++;
+        }
+
+        // The registers of the command line are set once for all transactions
+        for (int i = 1; i < argc; i++) {
+            string key, value;
+            ParseCommand(argv[i], key, value);
+            if (key == "load")
+                RegisterLoad(value);
+            else if (key == "set")
+                RegisterSet(value);
+            else
+                throw runtime_error("only register commands are given on the command line with -stdinbatch");
+        }
+
+        string strLine;
+        while (std::getline(std::cin, strLine)) {
+            vector<string> vArgs = SplitCommandLine(strLine);
+            if (vArgs.empty())
+                continue;
+
+            try {
+                CTransaction txDecodeTmp;
+                size_t startArg = 0;
+                if (!fCreateBlank) {
+                    // first argument: hex-encoded dystem transaction
+                    if (!DecodeHexTx(txDecodeTmp, vArgs[0]))
+                        throw runtime_error("invalid transaction encoding");
+                    startArg = 1;
+                }
+
+                CMutableTransaction tx(txDecodeTmp);
+                for (size_t i = startArg; i < vArgs.size(); i++) {
+                    string key, value;
+                    ParseCommand(vArgs[i], key, value);
+
+                    MutateTx(tx, key, value);
+                }
+
+                OutputTx(tx);
+            } catch (std::exception& e) {
+                // The line of a failed transaction holds its error
+                fprintf(stdout, "error: %s\n", e.what());
+                nRet = EXIT_FAILURE;
+            }
+        }
+    } catch (boost::thread_interrupted) {
+        throw;
+    } catch (std::exception& e) {
+        fprintf(stderr, "error: %s\n", e.what());
+        nRet = EXIT_FAILURE;
+    } catch (...) {
+        PrintExceptionContinue(NULL, "BatchRawTx()");
+        throw;
+    }
+    return nRet;
+}
+
 int main(int argc, char* argv[])
 {
     SetupEnvironment();
@@ -617,7 +720,10 @@ int main(int argc, char* argv[])
 
     int ret = EXIT_FAILURE;
     try {
-        ret = CommandLineRawTx(argc, argv);
+        if (fStdinBatch)
+            ret = BatchRawTx(argc, argv);
+        else
+            ret = CommandLineRawTx(argc, argv);
     } catch (std::exception& e) {
         PrintExceptionContinue(&e, "CommandLineRawTx()");
     } catch (...) {
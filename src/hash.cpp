@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "crypto/common.h"
 #include "crypto/hmac_sha512.h"
 #include "crypto/scrypt.h"
 
@@ -69,6 +70,60 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
     return h1;
 }
 
+void CMurmurHash3Prepared::Set(const unsigned char* pdata, size_t nLen)
+{
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+
+    nSize = nLen;
+    vMixed.resize((nLen + 3) / 4);
+    size_t nBlocks = nLen / 4;
+    for (size_t i = 0; i < nBlocks; i++) {
+        uint32_t k1 = ReadLE32(pdata + i * 4);
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+        vMixed[i] = k1;
+    }
+
+    const unsigned char* tail = pdata + nBlocks * 4;
+    uint32_t k1 = 0;
+    switch (nLen & 3) {
+    case 3:
+        k1 ^= tail[2] << 16;
+    case 2:
+        k1 ^= tail[1] << 8;
+    case 1:
+        k1 ^= tail[0];
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+        vMixed[nBlocks] = k1;
+    }
+}
+
+unsigned int CMurmurHash3Prepared::Hash(unsigned int nHashSeed) const
+{
+    uint32_t h1 = nHashSeed;
+    size_t nBlocks = nSize / 4;
+    for (size_t i = 0; i < nBlocks; i++) {
+        h1 ^= vMixed[i];
+        h1 = ROTL32(h1, 13);
+        h1 = h1 * 5 + 0xe6546b64;
+    }
+    if (nSize & 3)
+        h1 ^= vMixed[nBlocks];
+
+    h1 ^= nSize;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+
+    return h1;
+}
+
 void BIP32Hash(const unsigned char chainCode[32], unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64])
 {
     unsigned char num[4];
@@ -79,7 +134,163 @@ void BIP32Hash(const unsigned char chainCode[32], unsigned int nChild, unsigned
     CHMAC_SHA512(chainCode, 32).Write(&header, 1).Write(data, 32).Write(num, 4).Finalize(output);
 }
 
+#define SIPROUND                          \
+    do {                                  \
+        v0 += v1;                         \
+        v1 = (v1 << 13) | (v1 >> 51);     \
+        v1 ^= v0;                         \
+        v0 = (v0 << 32) | (v0 >> 32);     \
+        v2 += v3;                         \
+        v3 = (v3 << 16) | (v3 >> 48);     \
+        v3 ^= v2;                         \
+        v0 += v3;                         \
+        v3 = (v3 << 21) | (v3 >> 43);     \
+        v3 ^= v0;                         \
+        v2 += v1;                         \
+        v1 = (v1 << 17) | (v1 >> 47);     \
+        v1 ^= v2;                         \
+        v2 = (v2 << 32) | (v2 >> 32);     \
+    } while (0)
+
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
+{
+    // SipHash-2-4 specialized for a 32 byte message, see https://131002.net/siphash/
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const unsigned char* p = val.begin();
+    for (int i = 0; i < 4; i++) {
+        uint64_t d = ReadLE64(p + 8 * i);
+        v3 ^= d;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= d;
+    }
+
+    // The final block only holds the message length
+    uint64_t d = ((uint64_t)32) << 56;
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+
 void scrypt_hash(const char* pass, unsigned int pLen, const char* salt, unsigned int sLen, char* output, unsigned int N, unsigned int r, unsigned int p, unsigned int dkLen)
 {
     scrypt(pass, pLen, salt, sLen, output, N, r, p, dkLen);
 }
+
+void HashQuarkLanes(const unsigned char* pdata, size_t nLen, size_t nStride, size_t nCount, uint256* pout)
+{
+    static const unsigned char pblank[1] = {};
+    const uint512 mask = 8;
+    const uint512 zero = 0;
+
+    sph_blake512_context ctx_blake;
+    sph_bmw512_context ctx_bmw;
+    sph_groestl512_context ctx_groestl;
+    sph_jh512_context ctx_jh;
+    sph_keccak512_context ctx_keccak;
+    sph_skein512_context ctx_skein;
+
+    uint512 hash[QUARK_LANES][9];
+
+    for (size_t nGroup = 0; nGroup < nCount; nGroup += QUARK_LANES) {
+        const unsigned int nLanes = std::min<size_t>(QUARK_LANES, nCount - nGroup);
+        const unsigned char* pgroup = pdata + nGroup * nStride;
+
+        for (unsigned int i = 0; i < nLanes; i++) {
+            sph_blake512_init(&ctx_blake);
+            sph_blake512(&ctx_blake, nLen ? static_cast<const void*>(pgroup + i * nStride) : pblank, nLen);
+            sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[i][0]));
+        }
+
+        for (unsigned int i = 0; i < nLanes; i++) {
+            sph_bmw512_init(&ctx_bmw);
+            sph_bmw512(&ctx_bmw, static_cast<const void*>(&hash[i][0]), 64);
+            sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[i][1]));
+        }
+
+        for (unsigned int i = 0; i < nLanes; i++) {
+            if ((hash[i][1] & mask) == zero)
+                continue;
+            sph_groestl512_init(&ctx_groestl);
+            sph_groestl512(&ctx_groestl, static_cast<const void*>(&hash[i][1]), 64);
+            sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[i][2]));
+        }
+        for (unsigned int i = 0; i < nLanes; i++) {
+            if ((hash[i][1] & mask) != zero)
+                continue;
+            sph_skein512_init(&ctx_skein);
+            sph_skein512(&ctx_skein, static_cast<const void*>(&hash[i][1]), 64);
+            sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[i][2]));
+        }
+
+        for (unsigned int i = 0; i < nLanes; i++) {
+            sph_groestl512_init(&ctx_groestl);
+            sph_groestl512(&ctx_groestl, static_cast<const void*>(&hash[i][2]), 64);
+            sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[i][3]));
+        }
+
+        for (unsigned int i = 0; i < nLanes; i++) {
+            sph_jh512_init(&ctx_jh);
+            sph_jh512(&ctx_jh, static_cast<const void*>(&hash[i][3]), 64);
+            sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[i][4]));
+        }
+
+        for (unsigned int i = 0; i < nLanes; i++) {
+            if ((hash[i][4] & mask) == zero)
+                continue;
+            sph_blake512_init(&ctx_blake);
+            sph_blake512(&ctx_blake, static_cast<const void*>(&hash[i][4]), 64);
+            sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[i][5]));
+        }
+        for (unsigned int i = 0; i < nLanes; i++) {
+            if ((hash[i][4] & mask) != zero)
+                continue;
+            sph_bmw512_init(&ctx_bmw);
+            sph_bmw512(&ctx_bmw, static_cast<const void*>(&hash[i][4]), 64);
+            sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[i][5]));
+        }
+
+        for (unsigned int i = 0; i < nLanes; i++) {
+            sph_keccak512_init(&ctx_keccak);
+            sph_keccak512(&ctx_keccak, static_cast<const void*>(&hash[i][5]), 64);
+            sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[i][6]));
+        }
+
+        for (unsigned int i = 0; i < nLanes; i++) {
+            sph_skein512_init(&ctx_skein);
+            sph_skein512(&ctx_skein, static_cast<const void*>(&hash[i][6]), 64);
+            sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[i][7]));
+        }
+
+        for (unsigned int i = 0; i < nLanes; i++) {
+            if ((hash[i][7] & mask) == zero)
+                continue;
+            sph_keccak512_init(&ctx_keccak);
+            sph_keccak512(&ctx_keccak, static_cast<const void*>(&hash[i][7]), 64);
+            sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[i][8]));
+        }
+        for (unsigned int i = 0; i < nLanes; i++) {
+            if ((hash[i][7] & mask) != zero)
+                continue;
+            sph_jh512_init(&ctx_jh);
+            sph_jh512(&ctx_jh, static_cast<const void*>(&hash[i][7]), 64);
+            sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[i][8]));
+        }
+
+        for (unsigned int i = 0; i < nLanes; i++)
+            pout[nGroup + i] = hash[i][8].trim256();
+    }
+}
@@ -217,6 +217,13 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+/** Compute the 160-bit hash of a prevector, such as a script. */
+template <unsigned int N>
+inline uint160 Hash160(const prevector<N, unsigned char>& vch)
+{
+    return Hash160(vch.begin(), vch.end());
+}
+
 /** A writer stream (for serialization) that computes a 256-bit hash. */
 class CHashWriter
 {
@@ -252,6 +259,88 @@ public:
     }
 };
 
+/** Writes data to an underlying stream, while hashing the written data. */
+template <typename Dest>
+class CHashingWriter
+{
+private:
+    Dest* dest;
+    CHash256 ctx;
+
+public:
+    int nType;
+    int nVersion;
+
+    CHashingWriter(Dest* destIn) : dest(destIn), nType(destIn->GetType()), nVersion(destIn->GetVersion()) {}
+
+    CHashingWriter<Dest>& write(const char* pch, size_t nSize)
+    {
+        dest->write(pch, nSize);
+        ctx.Write((const unsigned char*)pch, nSize);
+        return (*this);
+    }
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    // invalidates the object
+    uint256 GetHash()
+    {
+        uint256 result;
+        ctx.Finalize((unsigned char*)&result);
+        return result;
+    }
+
+    template <typename T>
+    CHashingWriter<Dest>& operator<<(const T& obj)
+    {
+        // Serialize to this stream
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+/** Reads data from an underlying stream, while hashing the read data. */
+template <typename Source>
+class CHashVerifier
+{
+private:
+    Source* source;
+    CHash256 ctx;
+
+public:
+    int nType;
+    int nVersion;
+
+    CHashVerifier(Source* sourceIn) : source(sourceIn), nType(sourceIn->GetType()), nVersion(sourceIn->GetVersion()) {}
+
+    CHashVerifier<Source>& read(char* pch, size_t nSize)
+    {
+        source->read(pch, nSize);
+        ctx.Write((const unsigned char*)pch, nSize);
+        return (*this);
+    }
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    // invalidates the object
+    uint256 GetHash()
+    {
+        uint256 result;
+        ctx.Finalize((unsigned char*)&result);
+        return result;
+    }
+
+    template <typename T>
+    CHashVerifier<Source>& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /** Compute the 256-bit hash of an object's serialization. */
 template <typename T>
 uint256 SerializeHash(const T& obj, int nType = SER_GETHASH, int nVersion = PROTOCOL_VERSION)
@@ -263,8 +352,34 @@ uint256 SerializeHash(const T& obj, int nType = SER_GETHASH, int nVersion = PROT
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/**
+ * Data prepared for MurmurHash3 with many seeds, as by the hash functions of
+ * a bloom filter: the mixing of each block of data does not depend on the
+ * seed and is done once here.
+ */
+class CMurmurHash3Prepared
+{
+private:
+    //! The mixed blocks, then the mixed tail if the size is not a multiple of 4
+    std::vector<uint32_t> vMixed;
+    uint32_t nSize;
+
+public:
+    CMurmurHash3Prepared() : nSize(0) {}
+    CMurmurHash3Prepared(const unsigned char* pdata, size_t nLen) { Set(pdata, nLen); }
+    explicit CMurmurHash3Prepared(const std::vector<unsigned char>& vData) { Set(vData.empty() ? NULL : &vData[0], vData.size()); }
+
+    void Set(const unsigned char* pdata, size_t nLen);
+
+    //! Same as MurmurHash3(nHashSeed, data)
+    unsigned int Hash(unsigned int nHashSeed) const;
+};
+
 void BIP32Hash(const unsigned char chainCode[32], unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
+/** SipHash-2-4 of a uint256 with the key (k0, k1), as used for the short ids of compact blocks */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 //int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
 //int HMAC_SHA512_Update(HMAC_SHA512_CTX *pctx, const void *pdata, size_t len);
 //int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx);
@@ -355,6 +470,19 @@ inline uint256 HashQuark(const T1 pbegin, const T1 pend)
     return hash[8].trim256();
 }
 
+/**
+ * Compute the Quark hash of nCount inputs of nLen bytes each, laid out nStride
+ * bytes apart starting at pdata, writing the results to pout[0..nCount).
+ *
+ * The inputs are processed in groups of QUARK_LANES. Within a group the chain
+ * is run one primitive at a time over every lane (all blake rounds, then all
+ * bmw rounds, ...) so each primitive's state and lookup tables stay hot in
+ * cache, and the data-dependent groestl/skein, blake/bmw and keccak/jh
+ * branches are resolved per lane. Results are identical to HashQuark().
+ */
+static const unsigned int QUARK_LANES = 8;
+void HashQuarkLanes(const unsigned char* pdata, size_t nLen, size_t nStride, size_t nCount, uint256* pout);
+
 void scrypt_hash(const char* pass, unsigned int pLen, const char* salt, unsigned int sLen, char* output, unsigned int N, unsigned int r, unsigned int p, unsigned int dkLen);
 
 #endif // BITCOIN_HASH_H
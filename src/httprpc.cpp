@@ -122,24 +122,27 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         if (!valRequest.read(req->ReadBody()))
             throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
-        std::string strReply;
         // singleton request
         if (valRequest.isObject()) {
             jreq.parse(valRequest);
 
             UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
 
-            // Send reply
-            strReply = JSONRPCReply(result, NullUniValue, jreq.id);
+            // Send reply, written straight into the request buffer as a big
+            // result would otherwise be copied into a reply object and a string
+            req->WriteHeader("Content-Type", "application/json");
+            HTTPReplySink sink(req);
+            JSONRPCWriteReply(sink, result, NullUniValue, jreq.id);
+            sink.Flush();
+            req->WriteReply(HTTP_OK);
 
         // array of requests
-        } else if (valRequest.isArray())
-            strReply = JSONRPCExecBatch(valRequest.get_array());
-        else
+        } else if (valRequest.isArray()) {
+            std::string strReply = JSONRPCExecBatch(valRequest.get_array());
+            req->WriteHeader("Content-Type", "application/json");
+            req->WriteReply(HTTP_OK, strReply);
+        } else
             throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
-
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strReply);
     } catch (const UniValue& objError) {
         JSONErrorReply(req, objError, jreq.id);
         return false;
@@ -174,6 +177,9 @@ bool StartHTTPRPC()
         return false;
 
     RegisterHTTPHandler("/", true, HTTPReq_JSONRPC);
+    // The same calls on their own queue, for wallet clients that should not
+    // wait behind other RPC users
+    RegisterHTTPHandler("/wallet", true, HTTPReq_JSONRPC, HTTP_WORK_WALLET);
 
     assert(EventBase());
     httpRPCTimerInterface = new HTTPRPCTimerInterface(EventBase());
@@ -190,6 +196,7 @@ void StopHTTPRPC()
 {
     LogPrint("rpc", "Stopping HTTP RPC server\n");
     UnregisterHTTPHandler("/", true);
+    UnregisterHTTPHandler("/wallet", true);
     if (httpRPCTimerInterface) {
         RPCUnregisterTimerInterface(httpRPCTimerInterface);
         delete httpRPCTimerInterface;
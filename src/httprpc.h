@@ -10,6 +10,9 @@
 
 class HTTPRequest;
 
+//! Default for -restcachesize, in megabytes
+static const int DEFAULT_REST_CACHE_SIZE = 16;
+
 /** Start HTTP RPC subsystem.
  * Precondition; HTTP and RPC has been started.
  */
@@ -11,6 +11,7 @@
 #include "rpcprotocol.h" // For HTTP status codes
 #include "sync.h"
 #include "ui_interface.h"
+#include "utilstrencodings.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,13 +35,25 @@
 #endif
 #endif
 
+#if ENABLE_BLOCK_COMPRESSION
+#include <zlib.h>
+#endif
+
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
 
 /** Maximum size of http request (request line + headers) */
 static const size_t MAX_HEADERS_SIZE = 8192;
 
+// Only Linux spreads the connections over the sockets that share a port
+#if defined(SO_REUSEPORT) && defined(__linux__)
+#define HTTP_USE_REUSEPORT 1
+#endif
+
 /** HTTP request work item */
 class HTTPWorkItem : public HTTPClosure
 {
@@ -62,20 +75,35 @@ private:
 };
 
 /** Simple work queue for distributing work over multiple threads.
- * Work items are simply callable objects.
+ * Work items are simply callable objects. Besides the total depth, the items
+ * one client has queued or running can be limited, and the time items spend
+ * in the queue is recorded.
  */
 template <typename WorkItem>
 class WorkQueue
 {
 private:
+    struct Entry {
+        WorkItem* item;
+        CNetAddr client;
+        int64_t nTimeQueued;
+    };
+
     /** Mutex protects entire object */
     CWaitableCriticalSection cs;
     CConditionVariable cond;
     /* XXX in C++11 we can use std::unique_ptr here and avoid manual cleanup */
-    std::deque<WorkItem*> queue;
+    std::deque<Entry> queue;
     bool running;
     size_t maxDepth;
+    //! Most items of one client queued or running, 0 for no limit
+    size_t maxClientItems;
+    std::map<CNetAddr, size_t> mapClientItems;
     int numThreads;
+    uint64_t nServed;
+    uint64_t nRejected;
+    int64_t nLatencyTotal;
+    int64_t nLatencyMax;
 
     /** RAII object to keep track of number of running worker threads */
     class ThreadCounter
@@ -96,9 +124,20 @@ private:
     };
 
 public:
-    WorkQueue(size_t maxDepth) : running(true),
-                                 maxDepth(maxDepth),
-                                 numThreads(0)
+    enum EnqueueResult {
+        ENQUEUED,
+        QUEUE_FULL,
+        CLIENT_LIMIT
+    };
+
+    WorkQueue(size_t maxDepth, size_t maxClientItems) : running(true),
+                                                        maxDepth(maxDepth),
+                                                        maxClientItems(maxClientItems),
+                                                        numThreads(0),
+                                                        nServed(0),
+                                                        nRejected(0),
+                                                        nLatencyTotal(0),
+                                                        nLatencyMax(0)
     {
     }
     /*( Precondition: worker threads have all stopped
@@ -107,38 +146,59 @@ public:
     ~WorkQueue()
     {
         while (!queue.empty()) {
-            delete queue.front();
+            delete queue.front().item;
             queue.pop_front();
         }
     }
-    /** Enqueue a work item */
-    bool Enqueue(WorkItem* item)
+    /** Enqueue a work item, on success the queue takes ownership of it */
+    EnqueueResult Enqueue(WorkItem* item, const CNetAddr& client)
     {
         boost::unique_lock<boost::mutex> lock(cs);
         if (queue.size() >= maxDepth) {
-            return false;
+            nRejected++;
+            return QUEUE_FULL;
         }
-        queue.push_back(item);
+        size_t& nClientItems = mapClientItems[client];
+        if (maxClientItems > 0 && nClientItems >= maxClientItems) {
+            nRejected++;
+            return CLIENT_LIMIT;
+        }
+        nClientItems++;
+        Entry entry;
+        entry.item = item;
+        entry.client = client;
+        entry.nTimeQueued = GetTimeMicros();
+        queue.push_back(entry);
         cond.notify_one();
-        return true;
+        return ENQUEUED;
     }
     /** Thread function */
     void Run()
     {
         ThreadCounter count(*this);
         while (running) {
-            WorkItem* i = 0;
+            Entry entry;
             {
                 boost::unique_lock<boost::mutex> lock(cs);
                 while (running && queue.empty())
                     cond.wait(lock);
                 if (!running)
                     break;
-                i = queue.front();
+                entry = queue.front();
                 queue.pop_front();
+                int64_t nLatency = GetTimeMicros() - entry.nTimeQueued;
+                nServed++;
+                nLatencyTotal += nLatency;
+                nLatencyMax = std::max(nLatencyMax, nLatency);
+            }
+            (*entry.item)();
+            delete entry.item;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                std::map<CNetAddr, size_t>::iterator it = mapClientItems.find(entry.client);
+                if (it != mapClientItems.end() && --it->second == 0)
+                    mapClientItems.erase(it);
             }
-            (*i)();
-            delete i;
         }
     }
     /** Interrupt and exit loops */
@@ -162,33 +222,70 @@ public:
         boost::unique_lock<boost::mutex> lock(cs);
         return queue.size();
     }
+
+    /** Fill in the counters of info */
+    void GetInfo(HTTPWorkQueueInfo& info)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        info.nThreads = numThreads;
+        info.nDepth = queue.size();
+        info.nMaxDepth = maxDepth;
+        info.nServed = nServed;
+        info.nRejected = nRejected;
+        info.nLatencyTotal = nLatencyTotal;
+        info.nLatencyMax = nLatencyMax;
+    }
 };
 
 struct HTTPPathHandler
 {
     HTTPPathHandler() {}
-    HTTPPathHandler(std::string prefix, bool exactMatch, HTTPRequestHandler handler):
-        prefix(prefix), exactMatch(exactMatch), handler(handler)
+    HTTPPathHandler(std::string prefix, bool exactMatch, HTTPRequestHandler handler, HTTPWorkClass workClass):
+        prefix(prefix), exactMatch(exactMatch), handler(handler), workClass(workClass)
     {
     }
     std::string prefix;
     bool exactMatch;
     HTTPRequestHandler handler;
+    HTTPWorkClass workClass;
+};
+
+/** Names and options of the work queues of the request classes */
+static const struct {
+    const char* name;
+    const char* threadsArg;
+    int defaultThreads;
+    const char* depthArg;
+    int defaultDepth;
+    const char* compressArg;
+} workClassParams[HTTP_WORK_CLASSES] = {
+    {"rpc", "-rpcthreads", DEFAULT_HTTP_THREADS, "-rpcworkqueue", DEFAULT_HTTP_WORKQUEUE, "-rpccompress"},
+    {"rest", "-restthreads", DEFAULT_HTTP_REST_THREADS, "-restworkqueue", DEFAULT_HTTP_REST_WORKQUEUE, "-restcompress"},
+    {"wallet", "-rpcwalletthreads", DEFAULT_HTTP_WALLET_THREADS, "-rpcwalletworkqueue", DEFAULT_HTTP_WALLET_WORKQUEUE, "-rpccompress"},
+};
+
+/** Event loop thread accepting, parsing and answering a share of the connections */
+struct HTTPEventLoop {
+    struct event_base* base;
+    struct evhttp* http;
+    std::vector<evhttp_bound_socket*> boundSockets;
+    boost::thread thread;
+
+    HTTPEventLoop() : base(0), http(0) {}
 };
 
 /** HTTP module state */
 
-//! libevent event loop
-static struct event_base* eventBase = 0;
-//! HTTP server
-struct evhttp* eventHTTP = 0;
+//! libevent event loops, the first one also runs the timers of EventBase()
+static std::vector<HTTPEventLoop*> eventLoops;
 //! List of subnets to allow RPC connections from
 static std::vector<CSubNet> rpc_allow_subnets;
-//! Work queue for handling longer requests off the event loop thread
-static WorkQueue<HTTPClosure>* workQueue = 0;
+//! Work queues for handling longer requests off the event loop thread, one per request class
+static WorkQueue<HTTPClosure>* workQueues[HTTP_WORK_CLASSES] = {0};
+//! zlib level the replies of each request class are compressed at, 0 for none
+static int compressLevels[HTTP_WORK_CLASSES] = {0};
 //! Handlers for (sub)paths
 std::vector<HTTPPathHandler> pathHandlers;
-std::vector<evhttp_bound_socket *> boundSockets;
 
 /** Check if a network address is allowed to access the HTTP server */
 static bool ClientAllowed(const CNetAddr& netaddr)
@@ -248,10 +345,43 @@ static std::string RequestMethodString(HTTPRequest::RequestMethod m)
     }
 }
 
+HTTPContentEncoding ChooseContentEncoding(const std::string& strAcceptEncoding)
+{
+    // q-values of gzip, deflate and *, negative where not listed
+    double qGzip = -1, qDeflate = -1, qAny = -1;
+    std::vector<std::string> vCodings;
+    boost::split(vCodings, strAcceptEncoding, boost::is_any_of(","));
+    BOOST_FOREACH (std::string strCoding, vCodings) {
+        double q = 1;
+        std::vector<std::string> vParams;
+        boost::split(vParams, strCoding, boost::is_any_of(";"));
+        for (unsigned int i = 1; i < vParams.size(); i++) {
+            std::string strParam = boost::trim_copy(vParams[i]);
+            if (strParam.size() > 2 && (strParam[0] == 'q' || strParam[0] == 'Q') && strParam[1] == '=' && !ParseDouble(strParam.substr(2), &q))
+                q = 0;
+        }
+        std::string strName = boost::trim_copy(vParams[0]);
+        boost::to_lower(strName);
+        if (strName == "gzip" || strName == "x-gzip")
+            qGzip = q;
+        else if (strName == "deflate")
+            qDeflate = q;
+        else if (strName == "*")
+            qAny = q;
+    }
+    if (qGzip < 0)
+        qGzip = qAny;
+    if (qDeflate < 0)
+        qDeflate = qAny;
+    if (qGzip <= 0 && qDeflate <= 0)
+        return HTTP_ENCODING_IDENTITY;
+    return qGzip >= qDeflate ? HTTP_ENCODING_GZIP : HTTP_ENCODING_DEFLATE;
+}
+
 /** HTTP request callback */
 static void http_request_cb(struct evhttp_request* req, void* arg)
 {
-    std::unique_ptr<HTTPRequest> hreq(new HTTPRequest(req));
+    std::unique_ptr<HTTPRequest> hreq(new HTTPRequest(req, ((HTTPEventLoop*)arg)->base));
 
     LogPrint("http", "Received a %s request for %s from %s\n",
              RequestMethodString(hreq->GetRequestMethod()), hreq->GetURI(), hreq->GetPeer().ToString());
@@ -287,12 +417,23 @@ static void http_request_cb(struct evhttp_request* req, void* arg)
 
     // Dispatch to worker thread
     if (i != iend) {
+        if (compressLevels[i->workClass] > 0)
+            hreq->SetReplyEncoding(ChooseContentEncoding(hreq->GetHeader("Accept-Encoding").second), compressLevels[i->workClass]);
+        CNetAddr client = hreq->GetPeer();
         std::unique_ptr<HTTPWorkItem> item(new HTTPWorkItem(hreq.release(), path, i->handler));
+        WorkQueue<HTTPClosure>* workQueue = workQueues[i->workClass];
         assert(workQueue);
-        if (workQueue->Enqueue(item.get()))
-            item.release(); /* if true, queue took ownership */
-        else
+        switch (workQueue->Enqueue(item.get(), client)) {
+        case WorkQueue<HTTPClosure>::ENQUEUED:
+            item.release(); /* queue took ownership */
+            break;
+        case WorkQueue<HTTPClosure>::QUEUE_FULL:
             item->req->WriteReply(HTTP_INTERNAL, "Work queue depth exceeded");
+            break;
+        case WorkQueue<HTTPClosure>::CLIENT_LIMIT:
+            item->req->WriteReply(HTTP_SERVUNAVAIL, "Too many requests from this client");
+            break;
+        }
     } else {
         hreq->WriteReply(HTTP_NOTFOUND);
     }
@@ -305,7 +446,7 @@ static void http_reject_request_cb(struct evhttp_request* req, void*)
     evhttp_send_error(req, HTTP_SERVUNAVAIL, NULL);
 }
 /** Event dispatcher thread */
-static void ThreadHTTP(struct event_base* base, struct evhttp* http)
+static void ThreadHTTP(struct event_base* base)
 {
     RenameThread("bitcoin-http");
     LogPrint("http", "Entering http event loop\n");
@@ -314,8 +455,73 @@ static void ThreadHTTP(struct event_base* base, struct evhttp* http)
     LogPrint("http", "Exited http event loop\n");
 }
 
+#ifndef WIN32
+/** Bound, listening, non-blocking socket for addrBind, or -1 */
+static evutil_socket_t HTTPListenSocket(const CService& addrBind)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    if (!addrBind.GetSockAddr((struct sockaddr*)&sockaddr, &len))
+        return -1;
+    evutil_socket_t fd = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1)
+        return -1;
+    int nOne = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(nOne));
+#ifdef HTTP_USE_REUSEPORT
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&nOne, sizeof(nOne));
+#endif
+#ifdef IPV6_V6ONLY
+    // "::" and "0.0.0.0" are separate endpoints, each spread over all loops
+    if (addrBind.IsIPv6())
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (void*)&nOne, sizeof(nOne));
+#endif
+    if (bind(fd, (struct sockaddr*)&sockaddr, len) == -1 || listen(fd, SOMAXCONN) == -1 ||
+        evutil_make_socket_nonblocking(fd) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Listen on an endpoint with every event loop. With SO_REUSEPORT each loop
+ * has its own socket and the kernel spreads the connections over them;
+ * otherwise the loops take turns accepting on duplicates of one socket.
+ */
+static bool HTTPBindShared(const std::string& host, uint16_t port)
+{
+    CService addrBind;
+    if (!Lookup(host.empty() ? "0.0.0.0" : host.c_str(), addrBind, port, true))
+        return false;
+
+    bool fBound = false;
+    evutil_socket_t fdFirst = -1;
+    BOOST_FOREACH (HTTPEventLoop* loop, eventLoops) {
+#ifdef HTTP_USE_REUSEPORT
+        evutil_socket_t fd = HTTPListenSocket(addrBind);
+#else
+        evutil_socket_t fd = fdFirst == -1 ? HTTPListenSocket(addrBind) : dup(fdFirst);
+#endif
+        if (fd == -1)
+            break;
+        if (fdFirst == -1)
+            fdFirst = fd;
+        // The handle owns the socket and closes it when deleted
+        evhttp_bound_socket* bind_handle = evhttp_accept_socket_with_handle(loop->http, fd);
+        if (!bind_handle) {
+            close(fd);
+            break;
+        }
+        loop->boundSockets.push_back(bind_handle);
+        fBound = true;
+    }
+    return fBound;
+}
+#endif
+
 /** Bind HTTP server to specified addresses */
-static bool HTTPBindAddresses(struct evhttp* http)
+static bool HTTPBindAddresses()
 {
     int defaultPort = GetArg("-rpcport", BaseParams().RPCPort());
     std::vector<std::pair<std::string, uint16_t> > endpoints;
@@ -341,16 +547,27 @@ static bool HTTPBindAddresses(struct evhttp* http)
     }
 
     // Bind addresses
+    bool fBound = false;
     for (std::vector<std::pair<std::string, uint16_t> >::iterator i = endpoints.begin(); i != endpoints.end(); ++i) {
         LogPrint("http", "Binding RPC on address %s port %i\n", i->first, i->second);
-        evhttp_bound_socket *bind_handle = evhttp_bind_socket_with_handle(http, i->first.empty() ? NULL : i->first.c_str(), i->second);
-        if (bind_handle) {
-            boundSockets.push_back(bind_handle);
-        } else {
-            LogPrintf("Binding RPC on address %s port %i failed.\n", i->first, i->second);
+        bool fOk = false;
+        if (eventLoops.size() == 1) {
+            evhttp_bound_socket *bind_handle = evhttp_bind_socket_with_handle(eventLoops[0]->http, i->first.empty() ? NULL : i->first.c_str(), i->second);
+            if (bind_handle) {
+                eventLoops[0]->boundSockets.push_back(bind_handle);
+                fOk = true;
+            }
         }
+#ifndef WIN32
+        else
+            fOk = HTTPBindShared(i->first, i->second);
+#endif
+        if (fOk)
+            fBound = true;
+        else
+            LogPrintf("Binding RPC on address %s port %i failed.\n", i->first, i->second);
     }
-    return !boundSockets.empty();
+    return fBound;
 }
 
 /** Simple wrapper to set thread name and run work queue */
@@ -373,11 +590,21 @@ static void libevent_log_cb(int severity, const char *msg)
         LogPrint("libevent", "libevent: %s\n", msg);
 }
 
-bool InitHTTPServer()
+/** Free the evhttp and event_base of the event loops, whose threads have exited */
+static void FreeHTTPEventLoops()
 {
-    struct evhttp* http = 0;
-    struct event_base* base = 0;
+    BOOST_FOREACH (HTTPEventLoop* loop, eventLoops) {
+        if (loop->http)
+            evhttp_free(loop->http);
+        if (loop->base)
+            event_base_free(loop->base);
+        delete loop;
+    }
+    eventLoops.clear();
+}
 
+bool InitHTTPServer()
+{
     if (!InitHTTPAllowList())
         return false;
 
@@ -404,80 +631,113 @@ bool InitHTTPServer()
     evthread_use_pthreads();
 #endif
 
-    base = event_base_new(); // XXX RAII
-    if (!base) {
-        LogPrintf("Couldn't create an event_base: exiting\n");
-        return false;
+    int nEventThreads = std::max(std::min((int)GetArg("-rpceventthreads", DEFAULT_HTTP_EVENT_THREADS), MAX_HTTP_EVENT_THREADS), 1);
+#ifdef WIN32
+    if (nEventThreads > 1) {
+        LogPrintf("HTTP: -rpceventthreads is not supported on Windows, using one event thread\n");
+        nEventThreads = 1;
     }
+#endif
+    for (int i = 0; i < nEventThreads; i++) {
+        HTTPEventLoop* loop = new HTTPEventLoop();
+        eventLoops.push_back(loop);
+        loop->base = event_base_new();
+        if (!loop->base) {
+            LogPrintf("Couldn't create an event_base: exiting\n");
+            FreeHTTPEventLoops();
+            return false;
+        }
 
-    /* Create a new evhttp object to handle requests. */
-    http = evhttp_new(base); // XXX RAII
-    if (!http) {
-        LogPrintf("couldn't create evhttp. Exiting.\n");
-        event_base_free(base);
-        return false;
-    }
+        /* Create a new evhttp object to handle requests. */
+        loop->http = evhttp_new(loop->base);
+        if (!loop->http) {
+            LogPrintf("couldn't create evhttp. Exiting.\n");
+            FreeHTTPEventLoops();
+            return false;
+        }
 
-    evhttp_set_timeout(http, GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT));
-    evhttp_set_max_headers_size(http, MAX_HEADERS_SIZE);
-    evhttp_set_max_body_size(http, MAX_SIZE);
-    evhttp_set_gencb(http, http_request_cb, NULL);
+        evhttp_set_timeout(loop->http, GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT));
+        evhttp_set_max_headers_size(loop->http, MAX_HEADERS_SIZE);
+        evhttp_set_max_body_size(loop->http, MAX_SIZE);
+        evhttp_set_gencb(loop->http, http_request_cb, loop);
+    }
 
-    if (!HTTPBindAddresses(http)) {
+    if (!HTTPBindAddresses()) {
         LogPrintf("Unable to bind any endpoint for RPC server\n");
-        evhttp_free(http);
-        event_base_free(base);
+        FreeHTTPEventLoops();
         return false;
     }
 
     LogPrint("http", "Initialized HTTP server\n");
-    int workQueueDepth = std::max((long)GetArg("-rpcworkqueue", DEFAULT_HTTP_WORKQUEUE), 1L);
-    LogPrintf("HTTP: creating work queue of depth %d\n", workQueueDepth);
-
-    workQueue = new WorkQueue<HTTPClosure>(workQueueDepth);
-    eventBase = base;
-    eventHTTP = http;
+    int maxClientItems = std::max((long)GetArg("-rpcclientworkqueue", DEFAULT_HTTP_CLIENT_WORKQUEUE), 0L);
+    for (int c = 0; c < HTTP_WORK_CLASSES; c++) {
+        int workQueueDepth = std::max((long)GetArg(workClassParams[c].depthArg, workClassParams[c].defaultDepth), 1L);
+        LogPrintf("HTTP: creating %s work queue of depth %d\n", workClassParams[c].name, workQueueDepth);
+        workQueues[c] = new WorkQueue<HTTPClosure>(workQueueDepth, maxClientItems);
+        compressLevels[c] = std::max(std::min((int)GetArg(workClassParams[c].compressArg, DEFAULT_HTTP_COMPRESSION_LEVEL), 9), 0);
+#if !ENABLE_BLOCK_COMPRESSION
+        if (compressLevels[c] > 0 && mapArgs.count(workClassParams[c].compressArg))
+            LogPrintf("HTTP: %s is not supported without zlib, %s replies are not compressed\n", workClassParams[c].compressArg, workClassParams[c].name);
+        compressLevels[c] = 0;
+#endif
+    }
     return true;
 }
 
-boost::thread threadHTTP;
-
 bool StartHTTPServer()
 {
     LogPrint("http", "Starting HTTP server\n");
-    int rpcThreads = std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
-    LogPrintf("HTTP: starting %d worker threads\n", rpcThreads);
-    threadHTTP = boost::thread(boost::bind(&ThreadHTTP, eventBase, eventHTTP));
+    if (eventLoops.size() > 1)
+        LogPrintf("HTTP: starting %u event threads\n", eventLoops.size());
+    BOOST_FOREACH (HTTPEventLoop* loop, eventLoops)
+        loop->thread = boost::thread(boost::bind(&ThreadHTTP, loop->base));
 
-    for (int i = 0; i < rpcThreads; i++)
-        boost::thread(boost::bind(&HTTPWorkQueueRun, workQueue));
+    // Only start threads for the classes that have handlers, e.g. no REST
+    // workers without -rest
+    bool fUsed[HTTP_WORK_CLASSES] = {false};
+    BOOST_FOREACH (const HTTPPathHandler& handler, pathHandlers)
+        fUsed[handler.workClass] = true;
+    for (int c = 0; c < HTTP_WORK_CLASSES; c++) {
+        if (!fUsed[c])
+            continue;
+        int workThreads = std::max((long)GetArg(workClassParams[c].threadsArg, workClassParams[c].defaultThreads), 1L);
+        LogPrintf("HTTP: starting %d %s worker threads\n", workThreads, workClassParams[c].name);
+        for (int i = 0; i < workThreads; i++)
+            boost::thread(boost::bind(&HTTPWorkQueueRun, workQueues[c]));
+    }
     return true;
 }
 
 void InterruptHTTPServer()
 {
     LogPrint("http", "Interrupting HTTP server\n");
-    if (eventHTTP) {
-        BOOST_FOREACH (evhttp_bound_socket *socket, boundSockets) {
-            evhttp_del_accept_socket(eventHTTP, socket);
+    BOOST_FOREACH (HTTPEventLoop* loop, eventLoops) {
+        BOOST_FOREACH (evhttp_bound_socket *socket, loop->boundSockets) {
+            evhttp_del_accept_socket(loop->http, socket);
         }
-        evhttp_set_gencb(eventHTTP, http_reject_request_cb, NULL);
+        loop->boundSockets.clear();
+        evhttp_set_gencb(loop->http, http_reject_request_cb, NULL);
     }
-    if (workQueue)
-        workQueue->Interrupt();
+    for (int c = 0; c < HTTP_WORK_CLASSES; c++)
+        if (workQueues[c])
+            workQueues[c]->Interrupt();
 }
 
 void StopHTTPServer()
 {
     LogPrint("http", "Stopping HTTP server\n");
-    if (workQueue) {
-        LogPrint("http", "Waiting for HTTP worker threads to exit\n");
-        workQueue->WaitExit();
-        delete workQueue;
+    LogPrint("http", "Waiting for HTTP worker threads to exit\n");
+    for (int c = 0; c < HTTP_WORK_CLASSES; c++) {
+        if (workQueues[c]) {
+            workQueues[c]->WaitExit();
+            delete workQueues[c];
+            workQueues[c] = 0;
+        }
     }
     MilliSleep(500); // Avoid race condition while the last HTTP-thread is exiting
-    if (eventBase) {
-        LogPrint("http", "Waiting for HTTP event thread to exit\n");
+    if (!eventLoops.empty())
+        LogPrint("http", "Waiting for HTTP event threads to exit\n");
+    BOOST_FOREACH (HTTPEventLoop* loop, eventLoops) {
         // Give event loop a few seconds to exit (to send back last RPC responses), then break it
         // Before this was solved with event_base_loopexit, but that didn't work as expected in
         // at least libevent 2.0.21 and always introduced a delay. In libevent
@@ -485,29 +745,22 @@ void StopHTTPServer()
         // could be used again (if desirable).
         // (see discussion in https://github.com/bitcoin/bitcoin/pull/6990)
 #if BOOST_VERSION >= 105000
-        if (!threadHTTP.try_join_for(boost::chrono::milliseconds(2000))) {
+        if (!loop->thread.try_join_for(boost::chrono::milliseconds(2000))) {
 #else
-        if (!threadHTTP.timed_join(boost::posix_time::milliseconds(2000))) {
+        if (!loop->thread.timed_join(boost::posix_time::milliseconds(2000))) {
 #endif
             LogPrintf("HTTP event loop did not exit within allotted time, sending loopbreak\n");
-            event_base_loopbreak(eventBase);
-            threadHTTP.join();
+            event_base_loopbreak(loop->base);
+            loop->thread.join();
         }
     }
-    if (eventHTTP) {
-        evhttp_free(eventHTTP);
-        eventHTTP = 0;
-    }
-    if (eventBase) {
-        event_base_free(eventBase);
-        eventBase = 0;
-    }
+    FreeHTTPEventLoops();
     LogPrint("http", "Stopped HTTP server\n");
 }
 
 struct event_base* EventBase()
 {
-    return eventBase;
+    return eventLoops.empty() ? 0 : eventLoops[0]->base;
 }
 
 static void httpevent_callback_fn(evutil_socket_t, short, void* data)
@@ -536,8 +789,62 @@ void HTTPEvent::trigger(struct timeval* tv)
     else
         evtimer_add(ev, tv); // trigger after timeval passed
 }
-HTTPRequest::HTTPRequest(struct evhttp_request* req) : req(req),
-                                                       replySent(false)
+/** Streams the body of a reply through zlib into the output buffer of the request */
+class HTTPCompressor
+{
+#if ENABLE_BLOCK_COMPRESSION
+private:
+    z_stream stream;
+    bool fInit;
+
+public:
+    HTTPCompressor() : fInit(false)
+    {
+        memset(&stream, 0, sizeof(stream));
+    }
+    ~HTTPCompressor()
+    {
+        if (fInit)
+            deflateEnd(&stream);
+    }
+
+    bool Init(HTTPContentEncoding encoding, int nLevel)
+    {
+        // 16 more bits of window ask zlib for the gzip wrapper, deflate is the zlib format
+        int nWindowBits = encoding == HTTP_ENCODING_GZIP ? 15 + 16 : 15;
+        fInit = deflateInit2(&stream, nLevel, Z_DEFLATED, nWindowBits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        return fInit;
+    }
+
+    bool Write(struct evbuffer* evb, const char* pch, size_t nSize, bool fFinish)
+    {
+        unsigned char buf[16 * 1024];
+        stream.next_in = (Bytef*)pch;
+        stream.avail_in = nSize;
+        int ret;
+        do {
+            stream.next_out = buf;
+            stream.avail_out = sizeof(buf);
+            ret = deflate(&stream, fFinish ? Z_FINISH : Z_NO_FLUSH);
+            if (ret == Z_STREAM_ERROR)
+                return false;
+            evbuffer_add(evb, buf, sizeof(buf) - stream.avail_out);
+        } while (stream.avail_out == 0);
+        return !fFinish || ret == Z_STREAM_END;
+    }
+#else
+public:
+    bool Init(HTTPContentEncoding encoding, int nLevel) { return false; }
+    bool Write(struct evbuffer* evb, const char* pch, size_t nSize, bool fFinish) { return false; }
+#endif
+};
+
+HTTPRequest::HTTPRequest(struct evhttp_request* req, struct event_base* base) : req(req),
+                                                                                base(base),
+                                                                                replySent(false),
+                                                                                encoding(HTTP_ENCODING_IDENTITY),
+                                                                                nCompressLevel(0),
+                                                                                compressor(NULL)
 {
 }
 HTTPRequest::~HTTPRequest()
@@ -547,6 +854,7 @@ HTTPRequest::~HTTPRequest()
         LogPrintf("%s: Unhandled request\n", __func__);
         WriteReply(HTTP_INTERNAL, "Unhandled request");
     }
+    delete compressor;
     // evhttpd cleans up the request, as long as a reply was sent.
 }
 
@@ -588,23 +896,88 @@ void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
     evhttp_add_header(headers, hdr.c_str(), value.c_str());
 }
 
-/** Closure sent to main thread to request a reply to be sent to
- * a HTTP request.
- * Replies must be sent in the main loop in the main http thread,
+/** Closure sent to the event thread of the request to request a reply to
+ * be sent to a HTTP request.
+ * Replies must be sent in the event loop that owns the connection,
  * this cannot be done from worker threads.
  */
+void HTTPRequest::SetReplyEncoding(HTTPContentEncoding encodingIn, int nLevel)
+{
+    assert(!replySent && !compressor && strPending.empty());
+    encoding = encodingIn;
+    nCompressLevel = nLevel;
+}
+
+void HTTPRequest::WriteBody(const char* pch, size_t nSize, bool fFinish)
+{
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    assert(evb);
+    if (!compressor) {
+        if (encoding == HTTP_ENCODING_IDENTITY || nCompressLevel <= 0) {
+            evbuffer_add(evb, pch, nSize);
+            return;
+        }
+        strPending.append(pch, nSize);
+        if (strPending.size() < HTTP_COMPRESS_MIN_SIZE && !fFinish)
+            return;
+        compressor = new HTTPCompressor();
+        if (strPending.size() < HTTP_COMPRESS_MIN_SIZE || !compressor->Init(encoding, nCompressLevel)) {
+            delete compressor;
+            compressor = NULL;
+            encoding = HTTP_ENCODING_IDENTITY;
+            evbuffer_add(evb, strPending.data(), strPending.size());
+        } else if (!compressor->Write(evb, strPending.data(), strPending.size(), fFinish)) {
+            LogPrintf("%s: compressing the reply to %s failed\n", __func__, GetURI());
+        }
+        std::string().swap(strPending);
+        return;
+    }
+    if (!compressor->Write(evb, pch, nSize, fFinish))
+        LogPrintf("%s: compressing the reply to %s failed\n", __func__, GetURI());
+}
+
 void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
 {
     assert(!replySent && req);
+    WriteBody(strReply.data(), strReply.size(), true);
+    if (nCompressLevel > 0) {
+        // The coding depends on the request, so caches must tell requests apart by it
+        WriteHeader("Vary", "Accept-Encoding");
+        if (compressor)
+            WriteHeader("Content-Encoding", encoding == HTTP_ENCODING_GZIP ? "gzip" : "deflate");
+    }
+    delete compressor;
+    compressor = NULL;
     // Send event to main http thread to send reply message
-    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
-    assert(evb);
-    evbuffer_add(evb, strReply.data(), strReply.size());
-    HTTPEvent* ev = new HTTPEvent(eventBase, true,
+    HTTPEvent* ev = new HTTPEvent(base, true,
         boost::bind(evhttp_send_reply, req, nStatus, (const char*)NULL, (struct evbuffer *)NULL));
     ev->trigger(0);
     replySent = true;
-    req = 0; // transferred back to main thread
+    req = 0; // transferred back to the event thread
+}
+
+void HTTPRequest::WriteReplyData(const char* pch, size_t nSize)
+{
+    assert(!replySent && req);
+    WriteBody(pch, nSize, false);
+}
+
+HTTPReplySink::HTTPReplySink(HTTPRequest* reqIn) : req(reqIn)
+{
+    strBuffer.reserve(HTTP_REPLY_CHUNK_SIZE);
+}
+
+void HTTPReplySink::append(const char* data, size_t len)
+{
+    strBuffer.append(data, len);
+    if (strBuffer.size() >= HTTP_REPLY_CHUNK_SIZE)
+        Flush();
+}
+
+void HTTPReplySink::Flush()
+{
+    req->WriteReplyData(strBuffer.data(), strBuffer.size());
+    strBuffer.clear();
 }
 
 CService HTTPRequest::GetPeer()
@@ -647,10 +1020,24 @@ HTTPRequest::RequestMethod HTTPRequest::GetRequestMethod()
     }
 }
 
-void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler)
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler, HTTPWorkClass workClass)
 {
-    LogPrint("http", "Registering HTTP handler for %s (exactmatch %d)\n", prefix, exactMatch);
-    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler));
+    LogPrint("http", "Registering HTTP handler for %s (exactmatch %d, queue %s)\n", prefix, exactMatch, workClassParams[workClass].name);
+    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler, workClass));
+}
+
+std::vector<HTTPWorkQueueInfo> GetHTTPWorkQueueInfo()
+{
+    std::vector<HTTPWorkQueueInfo> vInfo;
+    for (int c = 0; c < HTTP_WORK_CLASSES; c++) {
+        if (!workQueues[c])
+            continue;
+        HTTPWorkQueueInfo info;
+        info.strName = workClassParams[c].name;
+        workQueues[c]->GetInfo(info);
+        vInfo.push_back(info);
+    }
+    return vInfo;
 }
 
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch)
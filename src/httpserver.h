@@ -6,20 +6,36 @@
 #define BITCOIN_HTTPSERVER_H
 
 #include <string>
+#include <vector>
 #include <stdint.h>
 #include <boost/thread.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/function.hpp>
 
+#include <univalue.h>
+
 static const int DEFAULT_HTTP_THREADS=4;
 static const int DEFAULT_HTTP_WORKQUEUE=16;
+static const int DEFAULT_HTTP_REST_THREADS=2;
+static const int DEFAULT_HTTP_REST_WORKQUEUE=16;
+static const int DEFAULT_HTTP_WALLET_THREADS=2;
+static const int DEFAULT_HTTP_WALLET_WORKQUEUE=16;
+static const int DEFAULT_HTTP_CLIENT_WORKQUEUE=0;
 static const int DEFAULT_HTTP_SERVER_TIMEOUT=30;
+static const int DEFAULT_HTTP_EVENT_THREADS=1;
+static const int MAX_HTTP_EVENT_THREADS=16;
+static const int DEFAULT_HTTP_COMPRESSION_LEVEL=6;
 
 struct evhttp_request;
 struct event_base;
 class CService;
 class HTTPRequest;
 
+//! Bytes of a JSON reply collected before they move to the output buffer of the request
+static const size_t HTTP_REPLY_CHUNK_SIZE = 64 * 1024;
+//! Replies shorter than this are sent as they are, they would not get smaller than a packet
+static const size_t HTTP_COMPRESS_MIN_SIZE = 1400;
+
 /** Initialize HTTP server.
  * Call this before RegisterHTTPHandler or EventBase().
  */
@@ -34,32 +50,84 @@ void InterruptHTTPServer();
 /** Stop HTTP server */
 void StopHTTPServer();
 
+/** Classes of HTTP requests. Each class has its own work queue and worker
+ * threads, so a flood of one kind of request does not delay the others.
+ */
+enum HTTPWorkClass {
+    HTTP_WORK_RPC,
+    HTTP_WORK_REST,
+    HTTP_WORK_WALLET,
+    HTTP_WORK_CLASSES
+};
+
+/** State of the work queue of a request class */
+struct HTTPWorkQueueInfo {
+    std::string strName;
+    int nThreads;
+    size_t nDepth;
+    size_t nMaxDepth;
+    uint64_t nServed;
+    uint64_t nRejected;
+    //! Microseconds the served requests waited in the queue, in total and at most
+    int64_t nLatencyTotal;
+    int64_t nLatencyMax;
+};
+
+/** Content codings of a reply body */
+enum HTTPContentEncoding {
+    HTTP_ENCODING_IDENTITY,
+    HTTP_ENCODING_GZIP,
+    HTTP_ENCODING_DEFLATE
+};
+
+/** The coding to send a reply in for the Accept-Encoding header of the request.
+ * The coding of the highest q-value wins, gzip on a tie, and codings of q=0 are
+ * never chosen.
+ */
+HTTPContentEncoding ChooseContentEncoding(const std::string& strAcceptEncoding);
+
 /** Handler for requests to a certain HTTP path */
 typedef boost::function<void(HTTPRequest* req, const std::string &)> HTTPRequestHandler;
-/** Register handler for prefix.
+/** Register handler for prefix, served from the work queue of workClass.
  * If multiple handlers match a prefix, the first-registered one will
  * be invoked.
  */
-void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler);
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler, HTTPWorkClass workClass = HTTP_WORK_RPC);
 /** Unregister handler for prefix */
 void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
 
-/** Return evhttp event base. This can be used by submodules to
- * queue timers or custom events.
+/** Return the state of the work queues */
+std::vector<HTTPWorkQueueInfo> GetHTTPWorkQueueInfo();
+
+/** Return the event base of the first event loop. This can be used by
+ * submodules to queue timers or custom events.
  */
 struct event_base* EventBase();
 
 /** In-flight HTTP request.
  * Thin C++ wrapper around evhttp_request.
  */
+class HTTPCompressor;
+
 class HTTPRequest
 {
 private:
     struct evhttp_request* req;
+    //! Event loop owning the connection, which sends the reply
+    struct event_base* base;
     bool replySent;
+    HTTPContentEncoding encoding;
+    //! zlib level of the compressed reply, 0 if the request class is not compressed
+    int nCompressLevel;
+    //! Compresses the body once it reaches HTTP_COMPRESS_MIN_SIZE, NULL before
+    HTTPCompressor* compressor;
+    //! Start of the body, kept until it is known whether it is compressed
+    std::string strPending;
+
+    void WriteBody(const char* pch, size_t nSize, bool fFinish);
 
 public:
-    HTTPRequest(struct evhttp_request* req);
+    HTTPRequest(struct evhttp_request* req, struct event_base* base);
     ~HTTPRequest();
 
     enum RequestMethod {
@@ -103,6 +171,21 @@ public:
      */
     void WriteHeader(const std::string& hdr, const std::string& value);
 
+    /**
+     * Send the reply body in encoding at zlib level nLevel, done by the
+     * thread writing the reply. A level of 0 sends it as it is.
+     *
+     * @note call this before writing any of the body.
+     */
+    void SetReplyEncoding(HTTPContentEncoding encodingIn, int nLevel);
+
+    /**
+     * Append data to the reply body sent by WriteReply.
+     *
+     * @note call this before WriteReply.
+     */
+    void WriteReplyData(const char* pch, size_t nSize);
+
     /**
      * Write HTTP reply.
      * nStatus is the HTTP status code to send.
@@ -114,6 +197,23 @@ public:
     void WriteReply(int nStatus, const std::string& strReply = "");
 };
 
+/** Writes JSON into the body of an HTTP reply in chunks of
+ * HTTP_REPLY_CHUNK_SIZE, so a large reply is never held in one string.
+ * Call Flush() before WriteReply.
+ */
+class HTTPReplySink : public UniValue::Sink
+{
+private:
+    HTTPRequest* req;
+    std::string strBuffer;
+
+public:
+    HTTPReplySink(HTTPRequest* reqIn);
+
+    void append(const char* data, size_t len);
+    void Flush();
+};
+
 /** Event handler closure.
  */
 class HTTPClosure
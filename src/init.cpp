@@ -15,20 +15,31 @@
 #include "activemasternode.h"
 #include "addrman.h"
 #include "amount.h"
+#include "blockcompress.h"
+#include "blocktrace.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
+#include "crypto/sha256.h"
+#include "dbengine.h"
 #include "httpserver.h"
 #include "httprpc.h"
+#include "rpcbinary.h"
 #include "key.h"
+#include "largepages.h"
 #include "main.h"
 #include "masternode-budget.h"
+#include "masternode-list.h"
 #include "masternode-payments.h"
+#include "masternode-sigcheck.h"
+#include "mempoolcheck.h"
 #include "masternodeconfig.h"
 #include "masternodeman.h"
 #include "masternode-helpers.h"
+#include "metrics.h"
 #include "miner.h"
 #include "net.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
 #include "scheduler.h"
 #include "txdb.h"
@@ -51,6 +62,7 @@
 #include <signal.h>
 #endif
 
+#include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -68,9 +80,23 @@ using namespace std;
 #ifdef ENABLE_WALLET
 CWallet* pwalletMain = NULL;
 int nWalletBackups = 10;
+
+/** The wallet read by ThreadLoadWalletFile, handed over to pwalletMain in step 8 */
+struct CWalletFileLoad {
+    CWallet* pwallet;
+    DBErrors nLoadRet;
+    bool fFirstRun;
+    bool fRescan;
+
+    CWalletFileLoad() : pwallet(NULL), nLoadRet(DB_LOAD_OK), fFirstRun(true), fRescan(false) {}
+};
+
+static CWalletFileLoad walletFileLoad;
 #endif
 volatile bool fFeeEstimatesInitialized = false;
 volatile bool fRestartRequested = false; // true: restart false: shutdown
+//! The threads of step 7, which fill objects that the shutdown writes out
+static std::vector<boost::thread*> vLoadThreads;
 extern std::list<uint256> listAccCheckpointsNoDB;
 
 #if ENABLE_ZMQ
@@ -156,16 +182,28 @@ public:
             abort();
         }
     }
+    void GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const
+    {
+        try {
+            CCoinsViewBacked::GetCoinsBatch(vTxids, vCoins, vFound);
+        } catch (const std::runtime_error& e) {
+            uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+            LogPrintf("Error reading from database: %s\n", e.what());
+            abort();
+        }
+    }
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB* pcoinsdbview = NULL;
+CCoinsViewDB* pcoinsdbview = NULL;
+CCoinsViewWriteBehind* pcoinswritebehind = NULL;
 static CCoinsViewErrorCatcher* pcoinscatcher = NULL;
 
 void Interrupt(boost::thread_group& threadGroup)
 {
     InterruptHTTPServer();
     InterruptHTTPRPC();
+    InterruptBinaryRPC();
     InterruptRPC();
     InterruptREST();
     InterruptTorControl();
@@ -188,9 +226,14 @@ void PrepareShutdown()
     /// Be sure that anything that writes files or flushes caches only does this if the respective
     /// module was initialized.
     RenameThread("dystem-shutoff");
+    BOOST_FOREACH (boost::thread* pthread, vLoadThreads)
+        pthread->join();
+    vLoadThreads.clear();
     mempool.AddTransactionsUpdated(1);
     StopHTTPRPC();
+    StopBinaryRPC();
     StopREST();
+    StopHTTPMetrics();
     StopRPC();
     StopHTTPServer();
 #ifdef ENABLE_WALLET
@@ -204,6 +247,12 @@ void PrepareShutdown()
     DumpMasternodePayments();
     UnregisterNodeSignals(GetNodeSignals());
 
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        DumpMempool();
+    // before the flush below empties the coins cache
+    if (GetBoolArg("-persistcoinscache", DEFAULT_PERSIST_COINS_CACHE))
+        DumpCoinsCache();
+
     if (fFeeEstimatesInitialized) {
         boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
         CAutoFile est_fileout(fopen(est_path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
@@ -226,11 +275,15 @@ void PrepareShutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinswritebehind;
+        pcoinswritebehind = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
         pblocktree = NULL;
     }
+    // The listeners see the last notifications, including the best chain just written
+    SyncWithValidationInterfaceQueue();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         bitdb.Flush(true);
@@ -273,8 +326,12 @@ void Shutdown()
 #ifdef ENABLE_WALLET
     delete pwalletMain;
     pwalletMain = NULL;
+    // Read while the initialization failed, before step 8
+    delete walletFileLoad.pwallet;
+    walletFileLoad.pwallet = NULL;
 #endif
     LogPrintf("%s: done\n", __func__);
+    StopLogWriter();
 }
 
 /**
@@ -326,6 +383,9 @@ void OnRPCPreCommand(const CRPCCommand& cmd)
 #ifdef ENABLE_WALLET
     if (cmd.reqWallet && !pwalletMain)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
+    // The wallet has seen the blocks and transactions accepted before the call
+    if (cmd.reqWallet)
+        SyncWithValidationInterfaceQueue();
 #endif
 
     // Observe safe mode
@@ -344,9 +404,12 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
     strUsage += HelpMessageOpt("-alerts", strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS));
+    strUsage += HelpMessageOpt("-assumevalid=<hex>", _("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script verification (0 to verify all, default: 0)"));
+    strUsage += HelpMessageOpt("-blockcompression=<n>", strprintf(_("Compress block files that are no longer written to, at this zlib level (0 to 9, 0 = off, default: %u)"), DEFAULT_BLOCK_COMPRESSION));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-blocksizenotify=<cmd>", _("Execute command when the best block changes and its size is over (%s in cmd is replaced by block hash, %d with the block size)"));
-    strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 500));
+    strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
+    strUsage += HelpMessageOpt("-compactundo", strprintf(_("Write new undo data in the compact encoding, which older versions cannot read (default: %u)"), DEFAULT_COMPACT_UNDO));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file (default: %s)"), "dystem.conf"));
     if (mode == HMM_BITCOIND) {
 #if !defined(WIN32)
@@ -356,12 +419,25 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-largepages=<mode>", _("Back the coins cache and the signature cache with huge pages: 0 for none, 1 or transparent for transparent huge pages, hugetlb for pages reserved with vm.nr_hugepages, falling back to transparent ones (default: 0)"));
+    strUsage += HelpMessageOpt("-loadtxoutset=<file>", _("Fill a new chainstate from a file of dumptxoutset, at a block the block index holds already") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxreorg=<n>", strprintf(_("Set the Maximum reorg depth (default: %u)"), Params(CBaseChainParams::MAIN).MaxReorganizationDepth()));
+    strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-monitor", strprintf(_("Run as a node that only watches the chain, masternodes, budgets and SwiftTX locks: prune to %u MiB, no wallet, "
+                                                     "-dbcache=%d, -maxmempool=%u and -maxconnections=%d unless set otherwise (default: %u)"),
+        MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024, MONITOR_DB_CACHE, MONITOR_MAX_MEMPOOL_SIZE, MONITOR_MAX_CONNECTIONS, DEFAULT_MONITOR));
+    strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (0 = auto, <0 = leave that many cores free, default: %d)"), DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-threadaffinity=<thread>:<cpus>[:<priority>]", _("Run the threads of a name (scriptch, blockch, msghand, net, httpworker, stakemint, scheduler, ...) on the CPUs <cpus>, a list like 0-3,8, node<n> for the CPUs of a NUMA node or * for any, at priority lowest, below, normal or above. Can be specified multiple times"));
+    strUsage += HelpMessageOpt("-persistcoinscache", strprintf(_("Whether to save the keys of the coins cache on shutdown and read them back into it on restart (default: %u)"), DEFAULT_PERSIST_COINS_CACHE));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "dystemd.pid"));
 #endif
+    strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode disables wallet rescans below the pruned blocks and marks the node as serving recent blocks only. "
+                                                       "Warning: Reverting this setting requires re-downloading the entire blockchain. "
+                                                       "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-reindexaccumulators", _("Reindex the accumulator database") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-reindexmoneysupply", _("Reindex the DTEM and zDTEM money supply statistics") + " " + _("on startup"));
@@ -370,6 +446,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-addressindex", strprintf(_("Maintain an index of the history and unspent outputs of each address, used by the getaddressbalance and getaddressutxos rpc calls (default: %u)"), DEFAULT_ADDRESSINDEX));
+    strUsage += HelpMessageOpt("-spentindex", strprintf(_("Maintain an index of the inputs spending each output, used by the getspentinfo rpc call (default: %u)"), DEFAULT_SPENTINDEX));
+    strUsage += HelpMessageOpt("-timestampindex", strprintf(_("Maintain an index of blocks by their time, used by the getblockhashes rpc call (default: %u)"), DEFAULT_TIMESTAMPINDEX));
+    strUsage += HelpMessageOpt("-undocompression=<n>", strprintf(_("Also deflate new compact undo data at this zlib level (0 to 9, 0 = off, default: %u)"), DEFAULT_UNDO_COMPRESSION));
+    strUsage += HelpMessageOpt("-verifyinbackground", strprintf(_("Check the last -checkblocks blocks after startup while the node is running, rather than before it starts (default: %u)"), DEFAULT_VERIFY_IN_BACKGROUND));
     strUsage += HelpMessageOpt("-forcestart", _("Attempt to force blockchain corruption recovery") + " " + _("on startup"));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
@@ -386,8 +467,10 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect)"));
     strUsage += HelpMessageOpt("-listenonion", strprintf(_("Automatically create Tor hidden service (default: %d)"), DEFAULT_LISTEN_ONION));
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
+    strUsage += HelpMessageOpt("-msghandlerthreads=<n>", strprintf(_("Number of threads that process peer messages, each serving a fixed share of the peers (1-%d, default: %d)"), MAX_MSGHANDLER_THREADS, DEFAULT_MSGHANDLER_THREADS));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
+    strUsage += HelpMessageOpt("-maxuploadtarget=<n>", strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d). Only serving old blocks to syncing peers stops at the target; enough for relaying every new block once is kept from it"), DEFAULT_MAX_UPLOAD_TARGET));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
@@ -430,6 +513,8 @@ std::string HelpMessage(HelpMessageMode mode)
         FormatMoney(maxTxFee)));
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), "wallet.dat"));
+    strUsage += HelpMessageOpt("-walletbackend=<format>", strprintf(_("File format of a new wallet file, bdb (BerkeleyDB) or log (log structured, append only) (default: %s)"), DEFAULT_WALLET_BACKEND));
+    strUsage += HelpMessageOpt("-walletlazyload", strprintf(_("Keep only the outputs of transactions at least %d blocks deep in memory and read the rest from the wallet file when needed (default: %u)"), WALLET_LAZY_LOAD_DEPTH, DEFAULT_WALLET_LAZY_LOAD));
     strUsage += HelpMessageOpt("-walletnotify=<cmd>", _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)"));
     if (mode == HMM_BITCOIN_QT)
         strUsage += HelpMessageOpt("-windowtitle=<name>", _("Wallet window title"));
@@ -445,13 +530,33 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-zmqpubrawblock=<address>", _("Enable publish raw block in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawtx=<address>", _("Enable publish raw transaction in <address>"));
     strUsage += HelpMessageOpt("-zmqpubrawtxlock=<address>", _("Enable publish raw transaction (locked via SwiftX) in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubrawmnb=<address>", _("Enable publish raw masternode broadcasts in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubrawmnw=<address>", _("Enable publish raw masternode payment winners in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubrawbudgetvote=<address>", _("Enable publish raw budget proposal votes in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubrawfinalbudget=<address>", _("Enable publish raw finalized budgets in <address>"));
+    strUsage += HelpMessageOpt("-zmqpubhashtxbatch=<address>", _("Enable publish hashes of transactions in batches in <address>"));
+    strUsage += HelpMessageOpt("-zmqtxbatchsize=<n>", strprintf(_("Publish at most <n> transaction hashes in one hashtxbatch message (default: %u)"), DEFAULT_ZMQ_TX_BATCH_SIZE));
+    strUsage += HelpMessageOpt("-zmqqueuesize=<n>", strprintf(_("Keep at most <n> notifications waiting to be published, later ones are dropped (default: %u)"), DEFAULT_ZMQ_QUEUE_SIZE));
+    strUsage += HelpMessageOpt("-zmqpubhwm=<n>", strprintf(_("Set the outbound message high water mark of the publish sockets (default: %u)"), DEFAULT_ZMQ_SNDHWM));
 #endif
 
     strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
     if (GetBoolArg("-help-debug", false)) {
+        strUsage += HelpMessageOpt("-blocktraces=<n>", strprintf("Keep the timelines of the last <n> blocks processed for getblocktraces, 0 to not trace blocks (default: %u)", DEFAULT_BLOCK_TRACES));
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
+        strUsage += HelpMessageOpt("-checkblockindexhashes", strprintf("Recompute every block index hash at startup instead of trusting stored hashes up to the last checkpoint (default: %u)", DEFAULT_CHECK_BLOCK_INDEX_HASHES));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkpoints", strprintf(_("Only accept block chain matching built-in checkpoints (default: %u)"), 1));
+        strUsage += HelpMessageOpt("-chainstateengine=<name>", strprintf("Key-value engine the chainstate database is stored with, one of: %s (default: %s)", boost::algorithm::join(GetDBEngineNames(), ", "), DEFAULT_DB_ENGINE));
+        strUsage += HelpMessageOpt("-chainstatebloombits=<n>", strprintf("Bloom filter bits per key for the chainstate database, 0 to disable (default: %u)", DEFAULT_DB_BLOOM_BITS));
+        strUsage += HelpMessageOpt("-chainstatecompression", strprintf("Compress chainstate database blocks with Snappy (default: %u)", DEFAULT_DB_COMPRESSION));
+        strUsage += HelpMessageOpt("-chainstatemaxopenfiles=<n>", strprintf("Maximum number of open chainstate database files (default: %u)", DEFAULT_DB_MAX_OPEN_FILES));
+        strUsage += HelpMessageOpt("-chainstatewritebuffer=<n>", "Chainstate database write buffer size in megabytes (default: a quarter of its cache)");
+        strUsage += HelpMessageOpt("-blockindexengine=<name>", strprintf("Key-value engine the block index database is stored with, one of: %s (default: %s)", boost::algorithm::join(GetDBEngineNames(), ", "), DEFAULT_DB_ENGINE));
+        strUsage += HelpMessageOpt("-blockindexbloombits=<n>", strprintf("Bloom filter bits per key for the block index database, 0 to disable (default: %u)", DEFAULT_DB_BLOOM_BITS));
+        strUsage += HelpMessageOpt("-blockindexcompression", strprintf("Compress block index database blocks with Snappy (default: %u)", DEFAULT_DB_COMPRESSION));
+        strUsage += HelpMessageOpt("-blockindexmaxopenfiles=<n>", strprintf("Maximum number of open block index database files (default: %u)", DEFAULT_DB_MAX_OPEN_FILES));
+        strUsage += HelpMessageOpt("-blockindexwritebuffer=<n>", "Block index database write buffer size in megabytes (default: a quarter of its cache)");
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf(_("Flush database activity from memory pool to disk log every <n> megabytes (default: %u)"), 100));
         strUsage += HelpMessageOpt("-disablesafemode", strprintf(_("Disable safemode, override a real safe mode event (default: %u)"), 0));
         strUsage += HelpMessageOpt("-testsafemode", strprintf(_("Force safe mode (default: %u)"), 0));
@@ -460,9 +565,11 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-flushwallet", strprintf(_("Run a thread to flush wallet periodically (default: %u)"), 1));
         strUsage += HelpMessageOpt("-maxreorg", strprintf(_("Use a custom max chain reorganization depth (default: %u)"), 100));
         strUsage += HelpMessageOpt("-stopafterblockimport", strprintf(_("Stop running after importing blocks from disk (default: %u)"), 0));
+        strUsage += HelpMessageOpt("-replayblocks=<file>", "Connect the blocks of an external blk000??.dat file on top of the chain state in the data directory, report the time each phase took, then stop");
+        strUsage += HelpMessageOpt("-replayreport=<file>", "Where -replayblocks writes its report, as CSV with times in microseconds (default: replay.csv in the data directory)");
         strUsage += HelpMessageOpt("-sporkkey=<privkey>", _("Enable spork administration functionality with the appropriate private key."));
     }
-    string debugCategories = "addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, tor, mempool, net, proxy, http, libevent, dystem, (obfuscation, swiftx, masternode, mnpayments, mnbudget, zero)"; // Don't translate these and qt below
+    string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, lock, rand, rpc, selectcoins, tor, mempool, net, proxy, prune, http, libevent, dystem, (obfuscation, swiftx, masternode, mnpayments, mnbudget, zero)"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         debugCategories += ", qt";
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -474,12 +581,16 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-genproclimit=<n>", strprintf(_("Set the number of threads for coin generation if enabled (-1 = all cores, default: %d)"), 1));
 #endif
     strUsage += HelpMessageOpt("-help-debug", _("Show all debugging options (usage: --help -help-debug)"));
+    strUsage += HelpMessageOpt("-logasync", strprintf(_("Write debug output from a background thread instead of the thread logging (default: %u)"), DEFAULT_LOGASYNC));
+    strUsage += HelpMessageOpt("-logbuffer=<n>", strprintf(_("With -logasync, drop debug output from a thread that has more than <n> messages waiting to be written (default: %u)"), DEFAULT_LOG_BUFFER));
     strUsage += HelpMessageOpt("-logips", strprintf(_("Include IP addresses in debug output (default: %u)"), 0));
     strUsage += HelpMessageOpt("-logtimestamps", strprintf(_("Prepend debug output with timestamp (default: %u)"), 1));
     if (GetBoolArg("-help-debug", false)) {
+        strUsage += HelpMessageOpt("-lockstats", strprintf("Record how long each lock site waits for and holds its lock, see getlockstats (default: %u)", DEFAULT_LOCKSTATS));
+        strUsage += HelpMessageOpt("-lockstatsinterval=<n>", strprintf("With -lockstats, log the busiest lock sites every <n> seconds, 0 to never (default: %u)", DEFAULT_LOCKSTATS_INTERVAL));
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf(_("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:%u)"), 15));
         strUsage += HelpMessageOpt("-relaypriority", strprintf(_("Require high priority for relaying free or low-fee transactions (default:%u)"), 1));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf(_("Limit size of signature cache to <n> entries (default: %u)"), 50000));
+        strUsage += HelpMessageOpt("-sigcachesize=<n>", strprintf(_("Limit size of signature cache to <n> MiB (at most %u, default: %u)"), MAX_SIG_CACHE_SIZE, DEFAULT_SIG_CACHE_SIZE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in DTEM/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-printtoconsole", strprintf(_("Send trace/debug info to console instead of debug.log file (default: %u)"), 0));
@@ -497,6 +608,7 @@ std::string HelpMessage(HelpMessageMode mode)
 #ifdef ENABLE_WALLET
     strUsage += HelpMessageGroup(_("Staking options:"));
     strUsage += HelpMessageOpt("-staking=<n>", strprintf(_("Enable staking functionality (0-1, default: %u)"), 1));
+    strUsage += HelpMessageOpt("-stakethreads=<n>", strprintf(_("Number of threads used to search for stake kernels (0 = one per core, default: %d)"), DEFAULT_STAKE_THREADS));
     strUsage += HelpMessageOpt("-reservebalance=<amt>", _("Keep the specified amount available for spending at all times (default: 0)"));
     if (GetBoolArg("-help-debug", false)) {
         strUsage += HelpMessageOpt("-printstakemodifier", _("Display the stake modifier calculations in the debug.log file."));
@@ -540,6 +652,8 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("RPC server options:"));
     strUsage += HelpMessageOpt("-server", _("Accept command line and JSON-RPC commands"));
     strUsage += HelpMessageOpt("-rest", strprintf(_("Accept public REST requests (default: %u)"), 0));
+    strUsage += HelpMessageOpt("-metrics", strprintf(_("Serve node metrics in the Prometheus text format on /metrics of the RPC port, without authentication (default: %u)"), DEFAULT_METRICS));
+    strUsage += HelpMessageOpt("-restcachesize=<n>", strprintf(_("Keep up to <n> MB of encoded REST replies for blocks, transactions and headers, 0 to disable (default: %u)"), DEFAULT_REST_CACHE_SIZE));
     strUsage += HelpMessageOpt("-rpcbind=<addr>", _("Bind to given address to listen for JSON-RPC connections. Use [host]:port notation for IPv6. This option can be specified multiple times (default: bind to all interfaces)"));
     strUsage += HelpMessageOpt("-rpccookiefile=<loc>", _("Location of the auth cookie (default: data dir)"));
     strUsage += HelpMessageOpt("-rpcuser=<user>", _("Username for JSON-RPC connections"));
@@ -547,8 +661,19 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-rpcport=<port>", strprintf(_("Listen for JSON-RPC connections on <port> (default: %u or testnet: %u)"), 65443, 65444));
     strUsage += HelpMessageOpt("-rpcallowip=<ip>", _("Allow JSON-RPC connections from specified source. Valid for <ip> are a single IP (e.g. 1.2.3.4), a network/netmask (e.g. 1.2.3.4/255.255.255.0) or a network/CIDR (e.g. 1.2.3.4/24). This option can be specified multiple times"));
     strUsage += HelpMessageOpt("-rpcthreads=<n>", strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_HTTP_THREADS));
+    strUsage += HelpMessageOpt("-rpcwalletthreads=<n>", strprintf(_("Set the number of threads to service RPC calls sent to /wallet (default: %d)"), DEFAULT_HTTP_WALLET_THREADS));
+    strUsage += HelpMessageOpt("-restthreads=<n>", strprintf(_("Set the number of threads to service REST requests (default: %d)"), DEFAULT_HTTP_REST_THREADS));
+    strUsage += HelpMessageOpt("-rpccompress=<n>", strprintf(_("Compress RPC replies at zlib level <n> (1-9) for clients that accept gzip or deflate, 0 to never compress (default: %d)"), DEFAULT_HTTP_COMPRESSION_LEVEL));
+    strUsage += HelpMessageOpt("-restcompress=<n>", strprintf(_("Compress REST replies at zlib level <n> (1-9) for clients that accept gzip or deflate, 0 to never compress (default: %d)"), DEFAULT_HTTP_COMPRESSION_LEVEL));
+    strUsage += HelpMessageOpt("-rpceventthreads=<n>", strprintf(_("Set the number of threads accepting, parsing and answering HTTP connections, at most %d (default: %d)"), MAX_HTTP_EVENT_THREADS, DEFAULT_HTTP_EVENT_THREADS));
+    strUsage += HelpMessageOpt("-rpcbinarysocket=<path>", _("Also accept RPC calls in binary framing on the Unix socket <path>, relative to the data directory unless absolute (default: off)"));
+    strUsage += HelpMessageOpt("-rpcbinaryconnections=<n>", strprintf(_("Maximum number of connections to the binary RPC socket (default: %d)"), DEFAULT_RPC_BINARY_CONNECTIONS));
+    strUsage += HelpMessageOpt("-rpcbatchthreads=<n>", strprintf(_("Set the number of threads to run the thread safe calls of a JSON-RPC batch, 1 runs them in order (default: %d)"), DEFAULT_RPC_BATCH_THREADS));
     if (GetBoolArg("-help-debug", false)) {
         strUsage += HelpMessageOpt("-rpcworkqueue=<n>", strprintf("Set the depth of the work queue to service RPC calls (default: %d)", DEFAULT_HTTP_WORKQUEUE));
+        strUsage += HelpMessageOpt("-rpcwalletworkqueue=<n>", strprintf("Set the depth of the work queue to service RPC calls sent to /wallet (default: %d)", DEFAULT_HTTP_WALLET_WORKQUEUE));
+        strUsage += HelpMessageOpt("-restworkqueue=<n>", strprintf("Set the depth of the work queue to service REST requests (default: %d)", DEFAULT_HTTP_REST_WORKQUEUE));
+        strUsage += HelpMessageOpt("-rpcclientworkqueue=<n>", strprintf("Set the number of requests one client may have waiting in a work queue, 0 for no limit (default: %d)", DEFAULT_HTTP_CLIENT_WORKQUEUE));
         strUsage += HelpMessageOpt("-rpcservertimeout=<n>", strprintf("Timeout during HTTP requests (default: %d)", DEFAULT_HTTP_SERVER_TIMEOUT));
     }
     return strUsage;
@@ -572,6 +697,41 @@ std::string LicenseInfo()
            "\n";
 }
 
+/**
+ * A -reindex in prune mode can only read the block files that are left from
+ * blk00000.dat on without a gap. Delete the others, and all the undo files,
+ * the blocks are downloaded again.
+ */
+static void CleanupBlockRevFiles()
+{
+    LogPrintf("Removing unusable blk?????.dat and rev?????.dat files for -reindex with -prune\n");
+    std::multimap<int, boost::filesystem::path> mapBlockFiles;
+    boost::filesystem::path blocksdir = GetDataDir() / "blocks";
+    for (boost::filesystem::directory_iterator it(blocksdir); it != boost::filesystem::directory_iterator(); it++) {
+        std::string strName = it->path().filename().string();
+        if (!boost::filesystem::is_regular_file(*it) || strName.length() != 12 || strName.substr(8, 4) != ".dat")
+            continue;
+        std::string strPrefix = strName.substr(0, 3);
+        if (strPrefix == "blk" || strPrefix == "blz")
+            mapBlockFiles.insert(std::make_pair(atoi(strName.substr(3, 5)), it->path()));
+        else if (strPrefix == "rev")
+            boost::filesystem::remove(it->path());
+    }
+
+    int nContigCounter = 0;
+    bool fGap = false;
+    for (std::multimap<int, boost::filesystem::path>::const_iterator it = mapBlockFiles.begin(); it != mapBlockFiles.end(); ++it) {
+        if (!fGap && it->first == nContigCounter - 1)
+            continue; // the blk and the blz file of the same number
+        if (!fGap && it->first == nContigCounter) {
+            nContigCounter++;
+            continue;
+        }
+        fGap = true;
+        boost::filesystem::remove(it->second);
+    }
+}
+
 static void BlockNotifyCallback(const uint256& hashNewTip)
 {
     std::string strCmd = GetArg("-blocknotify", "");
@@ -613,6 +773,8 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         int nFile = 0;
         while (true) {
             CDiskBlockPos pos(nFile, 0);
+            if (!RestoreBlockFile(pos))
+                break; // This error is logged in RestoreBlockFile
             if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
                 break; // No block files left to reindex
             FILE* file = OpenBlockFile(pos, true);
@@ -656,12 +818,94 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         }
     }
 
+    // -replayblocks=
+    if (mapArgs.count("-replayblocks")) {
+        boost::filesystem::path pathReport = GetArg("-replayreport", "replay.csv");
+        if (!pathReport.is_complete())
+            pathReport = GetDataDir() / pathReport;
+        FILE* file = fopen(mapArgs["-replayblocks"].c_str(), "rb");
+        FILE* fileReport = fopen(pathReport.string().c_str(), "w");
+        if (file && fileReport) {
+            CImportingNow imp;
+            LogPrintf("Replaying blocks file %s...\n", mapArgs["-replayblocks"]);
+            ReplayExternalBlockFile(file, fileReport);
+            LogPrintf("Replay report written to %s\n", pathReport.string());
+        } else {
+            LogPrintf("Warning: Could not open blocks file %s or report %s\n", mapArgs["-replayblocks"], pathReport.string());
+            if (file)
+                fclose(file);
+        }
+        if (fileReport)
+            fclose(fileReport);
+        StartShutdown();
+        return;
+    }
+
     if (GetBoolArg("-stopafterblockimport", false)) {
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        LoadMempool();
 }
 
+/** What the reads of the masternode caches found, for step 10 to report */
+struct CMasternodeCacheReads {
+    CMasternodeDB::ReadResult nMasternodes;
+    CBudgetDB::ReadResult nBudget;
+    CMasternodePaymentDB::ReadResult nPayments;
+};
+
+static CMasternodeCacheReads masternodeCacheReads;
+
+/**
+ * Step 7 loads what does not depend on the chain beside the block index, each
+ * on its own thread, and the step using it joins the thread first:
+ *
+ *   block index, chain state (init thread) ----> step 8: wallet chain state, rescan
+ *   wallet.dat (dystem-loadwallet) -----------/
+ *   mncache, budget, mnpayments (dystem-loadmncache) -> step 10: masternodes
+ *   peers.dat, banlist.dat (dystem-loadaddr) --------> step 11: StartNode
+ *
+ * Nothing reads the objects a thread fills before it is joined.
+ */
+void ThreadLoadMasternodeCaches()
+{
+    RenameThread("dystem-loadmncache");
+    int64_t nStart = GetTimeMillis();
+
+    CMasternodeDB mndb;
+    masternodeCacheReads.nMasternodes = mndb.Read(mnodeman);
+
+    CBudgetDB budgetdb;
+    masternodeCacheReads.nBudget = budgetdb.Read(budget);
+
+    CMasternodePaymentDB mnpayments;
+    masternodeCacheReads.nPayments = mnpayments.Read(masternodePayments);
+
+    LogPrintf(" masternode caches %11dms\n", GetTimeMillis() - nStart);
+}
+
+void ThreadLoadAddresses()
+{
+    RenameThread("dystem-loadaddr");
+    int64_t nStart = GetTimeMillis();
+    LoadAddresses();
+    LogPrintf(" addresses   %15dms\n", GetTimeMillis() - nStart);
+}
+
+#ifdef ENABLE_WALLET
+void ThreadLoadWalletFile(const std::string& strWalletFile)
+{
+    RenameThread("dystem-loadwallet");
+    int64_t nStart = GetTimeMillis();
+    walletFileLoad.pwallet = new CWallet(strWalletFile);
+    walletFileLoad.nLoadRet = walletFileLoad.pwallet->LoadWalletFile(walletFileLoad.fFirstRun, &walletFileLoad.fRescan);
+    LogPrintf(" wallet file %15dms\n", GetTimeMillis() - nStart);
+}
+#endif
+
 /** Sanity checks
  *  Ensure that DYSTEM is running in a usable environment with all
  *  necessary library support.
@@ -689,8 +933,12 @@ bool AppInitServers(boost::thread_group& threadGroup)
         return false;
     if (!StartHTTPRPC())
         return false;
+    if (!StartBinaryRPC())
+        return false;
     if (GetBoolArg("-rest", false) && !StartREST())
         return false;
+    if (GetBoolArg("-metrics", DEFAULT_METRICS) && !StartHTTPMetrics())
+        return false;
     if (!StartHTTPServer())
         return false;
     return true;
@@ -763,6 +1011,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
     fLogTimestamps = GetBoolArg("-logtimestamps", true);
     fLogIPs = GetBoolArg("-logips", false);
+    fLockStats = GetBoolArg("-lockstats", DEFAULT_LOCKSTATS);
+    SetBlockTraceLimit(std::max((int64_t)0, GetArg("-blocktraces", DEFAULT_BLOCK_TRACES)));
 
     if (mapArgs.count("-bind") || mapArgs.count("-whitebind")) {
         // when specifying an explicit binding address, you want to listen on it
@@ -825,6 +1075,36 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             LogPrintf("AppInit2 : parameter interaction: -enableswifttx=false -> setting -nSwiftTXDepth=0\n");
     }
 
+    if (GetBoolArg("-monitor", DEFAULT_MONITOR)) {
+        // a monitor keeps the chainstate to validate stakes, but only the recent blocks and no wallet
+        if (GetBoolArg("-masternode", false))
+            return InitError(_("A -monitor node cannot run a masternode."));
+        if (SoftSetArg("-prune", strprintf("%u", MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024)))
+            LogPrintf("AppInit2 : parameter interaction: -monitor=1 -> setting -prune=%u\n", MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024);
+        if (SoftSetArg("-blockcompression", "0"))
+            LogPrintf("AppInit2 : parameter interaction: -monitor=1 -> setting -blockcompression=0\n");
+        if (SoftSetBoolArg("-disablewallet", true))
+            LogPrintf("AppInit2 : parameter interaction: -monitor=1 -> setting -disablewallet=1\n");
+        if (SoftSetArg("-dbcache", strprintf("%d", MONITOR_DB_CACHE)))
+            LogPrintf("AppInit2 : parameter interaction: -monitor=1 -> setting -dbcache=%d\n", MONITOR_DB_CACHE);
+        if (SoftSetArg("-maxmempool", strprintf("%u", MONITOR_MAX_MEMPOOL_SIZE)))
+            LogPrintf("AppInit2 : parameter interaction: -monitor=1 -> setting -maxmempool=%u\n", MONITOR_MAX_MEMPOOL_SIZE);
+        if (SoftSetArg("-maxconnections", strprintf("%d", MONITOR_MAX_CONNECTIONS)))
+            LogPrintf("AppInit2 : parameter interaction: -monitor=1 -> setting -maxconnections=%d\n", MONITOR_MAX_CONNECTIONS);
+    }
+
+    if (mapArgs.count("-maxsigcachesize")) {
+        // -maxsigcachesize counted signatures, each takes a 32 byte slot of -sigcachesize
+        int64_t nLegacyEntries = std::min(std::max(GetArg("-maxsigcachesize", 0), (int64_t)0), (MAX_SIG_CACHE_SIZE << 20) / (int64_t)sizeof(uint256));
+        int64_t nSigCacheSize = (nLegacyEntries * (int64_t)sizeof(uint256) + (1 << 20) - 1) >> 20;
+        if (SoftSetArg("-sigcachesize", strprintf("%d", nSigCacheSize)))
+            InitWarning(strprintf(_("Warning: -maxsigcachesize is deprecated, its %d signatures are taken as -sigcachesize=%d MiB."), nLegacyEntries, nSigCacheSize));
+        else
+            InitWarning(_("Warning: -maxsigcachesize is deprecated and ignored, as -sigcachesize is set."));
+    }
+    if (GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE) > MAX_SIG_CACHE_SIZE)
+        InitWarning(strprintf(_("Warning: -sigcachesize is limited to %d MiB."), MAX_SIG_CACHE_SIZE));
+
     if (mapArgs.count("-reservebalance")) {
         if (!ParseMoney(mapArgs["-reservebalance"], nReserveBalance)) {
             InitError(_("Invalid amount for -reservebalance=<amount>"));
@@ -871,14 +1151,37 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     fCheckBlockIndex = GetBoolArg("-checkblockindex", Params().DefaultConsistencyChecks());
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
 
+    // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
+    int64_t nSignedPruneTarget = GetArg("-prune", 0) * 1024 * 1024;
+    if (nSignedPruneTarget < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    nPruneTarget = (uint64_t)nSignedPruneTarget;
+    if (nPruneTarget) {
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB.  Please use a higher number."), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+        if (GetArg("-blockcompression", DEFAULT_BLOCK_COMPRESSION) > 0)
+            return InitError(_("Prune mode is incompatible with -blockcompression."));
+        LogPrintf("Prune configured to target %uMiB on disk for block and undo files.\n", nPruneTarget / 1024 / 1024);
+        fPruneMode = true;
+    }
+
+    fCompactUndo = GetBoolArg("-compactundo", DEFAULT_COMPACT_UNDO);
+    nUndoCompression = std::max(0, std::min(9, (int)GetArg("-undocompression", DEFAULT_UNDO_COMPRESSION)));
+    if (nUndoCompression > 0 && !IsBlockCompressionAvailable()) {
+        InitWarning(_("Warning: -undocompression ignored, this build does not support compressed block files."));
+        nUndoCompression = 0;
+    }
+
+    hashAssumeValid = uint256S(GetArg("-assumevalid", "0"));
+    if (hashAssumeValid != 0)
+        LogPrintf("Assuming ancestors of block %s have valid signatures.\n", hashAssumeValid.GetHex());
+
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
     if (nScriptCheckThreads <= 0)
         nScriptCheckThreads += boost::thread::hardware_concurrency();
     if (nScriptCheckThreads <= 1)
         nScriptCheckThreads = 0;
-    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
-        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
     fServer = GetBoolArg("-server", false);
     setvbuf(stdout, NULL, _IOLBF, 0); /// ***TODO*** do we still need this after -printtoconsole is gone?
@@ -961,8 +1264,17 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
         nLocalServices |= NODE_BLOOM;
 
+    // A pruned node serves the recent blocks only
+    if (fPruneMode) {
+        nLocalServices &= ~NODE_NETWORK;
+        nLocalServices |= NODE_NETWORK_LIMITED;
+    }
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
+    // Before any thread hashes, and before the sanity checks hash with it
+    std::string strSHA256 = SHA256AutoDetect();
+
     // Sanity check
     if (!InitSanityCheck())
         return InitError(_("Initialization sanity check failed. DYSTEM Core is shutting down."));
@@ -988,9 +1300,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 #endif
     if (GetBoolArg("-shrinkdebugfile", !fDebug))
         ShrinkDebugFile();
+    if (GetBoolArg("-logasync", DEFAULT_LOGASYNC))
+        StartLogWriter(std::max((int64_t)1, GetArg("-logbuffer", DEFAULT_LOG_BUFFER)));
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("DYSTEM version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using the '%s' SHA256 implementation\n", strSHA256);
 #ifdef ENABLE_WALLET
     LogPrintf("Using BerkeleyDB version %s\n", DbEnv::version(0, 0, 0));
 #endif
@@ -1002,10 +1317,23 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
-    LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    std::string strPlacementError;
+    if (!InitThreadPlacement(strPlacementError))
+        return InitError(strPlacementError);
+    std::string strLargePagesError;
+    if (!InitLargePages(GetArg("-largepages", "0"), strLargePagesError))
+        return InitError(strLargePagesError);
+
+    LogPrintf("Using %u threads for script, block, transaction and masternode signature verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
         for (int i = 0; i < nScriptCheckThreads - 1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadBlockCheck);
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadMasternodeSigCheck);
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadMempoolCheck);
     }
 /*
     if (mapArgs.count("-sporkkey")) // spork priv key
@@ -1017,6 +1345,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Start the lightweight task scheduler thread
     CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
     threadGroup.create_thread(boost::bind(&TraceThread<CScheduler::Function>, "scheduler", serviceLoop));
+    StartPostTipTasks(scheduler);
+    StartValidationInterfaceQueue(threadGroup);
 
     /* Start the RPC server already.  It will be started in "warmup" mode
      * and not really process calls already (but it will signify connections
@@ -1128,6 +1458,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             }
         }
 
+        std::string strWalletBackend = GetArg("-walletbackend", DEFAULT_WALLET_BACKEND);
+        if (strWalletBackend != "bdb" && strWalletBackend != "log")
+            return InitError(strprintf(_("Unknown wallet file format -walletbackend=%s"), strWalletBackend));
+
         LogPrintf("Using wallet %s\n", strWalletFile);
         uiInterface.InitMessage(_("Verifying wallet..."));
 
@@ -1246,6 +1580,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     // see Step 2: parameter interactions for more information about these
+    if (mapArgs.count("-maxuploadtarget"))
+        CNode::SetMaxOutboundTarget(GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET) * 1024 * 1024);
+
     fListen = GetBoolArg("-listen", DEFAULT_LISTEN);
     fDiscover = GetBoolArg("-discover", true);
 
@@ -1325,6 +1662,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    const char* pszDatabases[] = {"chainstate", "blockindex"};
+    BOOST_FOREACH (const char* pszDatabase, pszDatabases) {
+        std::string strEngine = GetArg(std::string("-") + pszDatabase + "engine", DEFAULT_DB_ENGINE);
+        if (!IsDBEngineAvailable(strEngine))
+            return InitError(strprintf(_("Unknown database engine -%sengine=%s, available: %s"), pszDatabase, strEngine, boost::algorithm::join(GetDBEngineNames(), ", ")));
+    }
+
     // cache size calculations
     size_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
     if (nTotalCache < (nMinDbCache << 20))
@@ -1332,12 +1676,26 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     else if (nTotalCache > (nMaxDbCache << 20))
         nTotalCache = (nMaxDbCache << 20); // total cache cannot be greater than nMaxDbCache
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", true))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", true) && !GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) && !GetBoolArg("-spentindex", DEFAULT_SPENTINDEX))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest goes to the in-memory coins cache
+
+    // joined in steps 8, 10 and 11, or by PrepareShutdown() when the initialization fails before
+    boost::thread* pthreadLoadMasternodeCaches = threadGroup.create_thread(&ThreadLoadMasternodeCaches);
+    boost::thread* pthreadLoadAddresses = threadGroup.create_thread(&ThreadLoadAddresses);
+#ifdef ENABLE_WALLET
+    // -zapwallettxes rewrites wallet.dat before it is read
+    boost::thread* pthreadLoadWalletFile = NULL;
+    if (!fDisableWallet && !GetBoolArg("-zapwallettxes", false))
+        pthreadLoadWalletFile = threadGroup.create_thread(boost::bind(&ThreadLoadWalletFile, strWalletFile));
+    if (pthreadLoadWalletFile)
+        vLoadThreads.push_back(pthreadLoadWalletFile);
+#endif
+    vLoadThreads.push_back(pthreadLoadMasternodeCaches);
+    vLoadThreads.push_back(pthreadLoadAddresses);
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1351,17 +1709,54 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
                 delete pcoinscatcher;
+                delete pcoinswritebehind;
+                delete pcoinsdbview;
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
-                pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                pcoinswritebehind = new CCoinsViewWriteBehind(pcoinsdbview);
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinswritebehind);
+                pcoinsTip = new CCoinsViewCache(pcoinscatcher, LargePagesEnabled());
 
-                if (fReindex)
+                if (fReindex) {
                     pblocktree->WriteReindexing(true);
+                    if (fPruneMode)
+                        CleanupBlockRevFiles();
+                }
+
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
+                uint256 hashSnapshotBlock = 0;
+                if (mapArgs.count("-loadtxoutset") && !fReindex) {
+                    uint256 hashBest = pcoinsdbview->GetBestBlock();
+                    if (hashBest != 0 && hashBest != Params().HashGenesisBlock()) {
+                        LogPrintf("-loadtxoutset ignored, the chainstate is at block %s already\n", hashBest.ToString());
+                    } else {
+                        uiInterface.InitMessage(_("Loading UTXO snapshot..."));
+                        boost::filesystem::path pathSnapshot = GetArg("-loadtxoutset", "");
+                        if (!pathSnapshot.is_complete())
+                            pathSnapshot = GetDataDir() / pathSnapshot;
+                        FILE* file = fopen(pathSnapshot.string().c_str(), "rb");
+                        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+                        CCoinsStats stats;
+                        if (filein.IsNull() || !pcoinsdbview->LoadSnapshot(filein, stats)) {
+                            strLoadError = strprintf(_("Error loading UTXO snapshot %s"), pathSnapshot.string());
+                            break;
+                        }
+                        hashSnapshotBlock = stats.hashBlock;
+                        LogPrintf("Loaded %u unspent outputs at block %s (height %d) from %s\n",
+                            stats.nTransactionOutputs, stats.hashBlock.ToString(), stats.nHeight, pathSnapshot.string());
+                    }
+                }
+                if (pcoinsdbview->IsLoadingSnapshot()) {
+                    strLoadError = _("The chainstate holds a UTXO snapshot that did not finish loading");
+                    break;
+                }
 
                 uiInterface.InitMessage(_("Initializing..."));
 
@@ -1373,6 +1768,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
+                if (hashSnapshotBlock != 0 && (chainActive.Tip() == NULL || chainActive.Tip()->GetBlockHash() != hashSnapshotBlock)) {
+                    strLoadError = strprintf(_("The block index does not hold block %s of the UTXO snapshot"), hashSnapshotBlock.ToString());
+                    break;
+                }
+
                 // If the loaded chain has a wrong genesis, bail out immediately
                 // (we're likely using a testnet datadir, or the other way around).
                 if (!mapBlockIndex.empty() && mapBlockIndex.count(Params().HashGenesisBlock()) == 0)
@@ -1390,10 +1790,34 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
-                uiInterface.InitMessage(_("Verifying blocks..."));
+                // Check for changed -addressindex, -spentindex and -timestampindex state
+                if (fAddressIndex != GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addressindex");
+                    break;
+                }
+                if (fSpentIndex != GetBoolArg("-spentindex", DEFAULT_SPENTINDEX)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -spentindex");
+                    break;
+                }
+                if (fTimestampIndex != GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -timestampindex");
+                    break;
+                }
 
-                if (!CVerifyDB().VerifyDB(pcoinsdbview, GetArg("-checklevel", 4), GetArg("-checkblocks", 100))) {
-                    strLoadError = _("Corrupted block database detected");
+                // Otherwise ThreadVerifyDB checks the blocks once the node is serving
+                if (!GetBoolArg("-verifyinbackground", DEFAULT_VERIFY_IN_BACKGROUND)) {
+                    uiInterface.InitMessage(_("Verifying blocks..."));
+
+                    if (!CVerifyDB().VerifyDB(pcoinswritebehind, GetArg("-checklevel", DEFAULT_CHECKLEVEL), GetArg("-checkblocks", DEFAULT_CHECKBLOCKS))) {
+                        strLoadError = _("Corrupted block database detected");
+                        break;
+                    }
+                }
+
+                // who the blocks pay depends on it once the list decides the payee, see IsDeterministicMasternodeHeight,
+                // so it is loaded before any block is connected
+                if (!deterministicMasternodes.Load()) {
+                    strLoadError = _("Error loading the registered masternode list");
                     break;
                 }
             } catch (std::exception& e) {
@@ -1467,8 +1891,21 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
         nStart = GetTimeMillis();
         bool fFirstRun = true;
-        pwalletMain = new CWallet(strWalletFile);
-        DBErrors nLoadWalletRet = pwalletMain->LoadWallet(fFirstRun);
+        DBErrors nLoadWalletRet;
+        if (pthreadLoadWalletFile) {
+            pthreadLoadWalletFile->join();
+            pwalletMain = walletFileLoad.pwallet;
+            walletFileLoad.pwallet = NULL;
+            fFirstRun = walletFileLoad.fFirstRun;
+            if (walletFileLoad.fRescan)
+                SoftSetBoolArg("-rescan", true);
+            nLoadWalletRet = walletFileLoad.nLoadRet;
+            if (nLoadWalletRet == DB_LOAD_OK)
+                pwalletMain->LoadWalletChainState();
+        } else {
+            pwalletMain = new CWallet(strWalletFile);
+            nLoadWalletRet = pwalletMain->LoadWallet(fFirstRun);
+        }
         if (nLoadWalletRet != DB_LOAD_OK) {
             if (nLoadWalletRet == DB_CORRUPT)
                 strErrors << _("Error loading wallet.dat: Wallet corrupted") << "\n";
@@ -1530,6 +1967,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             else
                 pindexRescan = chainActive.Genesis();
         }
+        // The rescan cannot go below the blocks that were pruned
+        if (fPruneMode) {
+            CBlockIndex* block = chainActive.Tip();
+            while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA) && block->pprev->nTx > 0 && pindexRescan != block)
+                block = block->pprev;
+            if (pindexRescan != block)
+                return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole blockchain again in case of pruned node)"));
+        }
         if (chainActive.Tip() && chainActive.Tip() != pindexRescan) {
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
@@ -1559,6 +2004,13 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 }
             }
         }
+
+        // Resolve the anchors of the loaded transactions for the wallet RPCs
+        // that read depths without cs_main
+        {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            pwalletMain->UpdateChainView();
+        }
     }  // (!fDisableWallet)
 #else  // ENABLE_WALLET
     LogPrintf("No wallet compiled in!\n");
@@ -1582,6 +2034,18 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             vImportFiles.push_back(strFile);
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (GetBoolArg("-persistcoinscache", DEFAULT_PERSIST_COINS_CACHE))
+        threadGroup.create_thread(&ThreadLoadCoinsCache);
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL))
+        scheduler.scheduleEvery(&DumpMempool, DUMP_MEMPOOL_INTERVAL);
+    if (fLockStats && GetArg("-lockstatsinterval", DEFAULT_LOCKSTATS_INTERVAL) > 0)
+        scheduler.scheduleEvery(boost::bind(&LogLockStats, 20), GetArg("-lockstatsinterval", DEFAULT_LOCKSTATS_INTERVAL));
+    if (GetArg("-blockcompression", DEFAULT_BLOCK_COMPRESSION) > 0) {
+        if (IsBlockCompressionAvailable())
+            threadGroup.create_thread(&ThreadCompressBlockFiles);
+        else
+            InitWarning(_("Warning: -blockcompression ignored, this build does not support compressed block files."));
+    }
     if (chainActive.Tip() == NULL) {
         LogPrintf("Waiting for genesis block to be imported...\n");
         while (!fRequestShutdown && chainActive.Tip() == NULL)
@@ -1592,8 +2056,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     uiInterface.InitMessage(_("Loading masternode cache..."));
 
-    CMasternodeDB mndb;
-    CMasternodeDB::ReadResult readResult = mndb.Read(mnodeman);
+    pthreadLoadMasternodeCaches->join();
+
+    CMasternodeDB::ReadResult readResult = masternodeCacheReads.nMasternodes;
     if (readResult == CMasternodeDB::FileError)
         LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
     else if (readResult != CMasternodeDB::Ok) {
@@ -1603,11 +2068,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
+    // mark the collaterals of the list spent as it happens, not from the validation queue
+    RegisterValidationInterface(&mnodeman, false);
 
-    uiInterface.InitMessage(_("Loading budget cache..."));
-
-    CBudgetDB budgetdb;
-    CBudgetDB::ReadResult readResult2 = budgetdb.Read(budget);
+    CBudgetDB::ReadResult readResult2 = masternodeCacheReads.nBudget;
 
     if (readResult2 == CBudgetDB::FileError)
         LogPrintf("Missing budget cache - budget.dat, will try to recreate\n");
@@ -1624,10 +2088,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     budget.ClearSeen();
 
 
-    uiInterface.InitMessage(_("Loading masternode payment cache..."));
-
-    CMasternodePaymentDB mnpayments;
-    CMasternodePaymentDB::ReadResult readResult3 = mnpayments.Read(masternodePayments);
+    CMasternodePaymentDB::ReadResult readResult3 = masternodeCacheReads.nPayments;
 
     if (readResult3 == CMasternodePaymentDB::FileError)
         LogPrintf("Missing masternode payment cache - mnpayments.dat, will try to recreate\n");
@@ -1639,6 +2100,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
 
+    if (!masternodePayments.LoadPaymentHistory())
+        LogPrintf("Could not load the masternode payment history, last payments are taken from the winner votes\n");
+
     fMasterNode = GetBoolArg("-masternode", false);
 
     if ((fMasterNode || masternodeConfig.getCount() > -1) && fTxIndex == false) {
@@ -1732,8 +2196,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (GetBoolArg("-listenonion", DEFAULT_LISTEN_ONION))
         StartTorControl(threadGroup);
 
+    pthreadLoadAddresses->join();
     StartNode(threadGroup, scheduler);
 
+    if (GetBoolArg("-verifyinbackground", DEFAULT_VERIFY_IN_BACKGROUND))
+        threadGroup.create_thread(&ThreadVerifyDB);
+
 #ifdef ENABLE_WALLET
     // Generate coins in the background
     if (pwalletMain)
@@ -4,9 +4,15 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <atomic>
+#include <list>
+
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
+#include "crypto/common.h"
 #include "db.h"
 #include "kernel.h"
 #include "script/interpreter.h"
@@ -71,62 +77,128 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
-// select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(
-    vector<pair<int64_t, uint256> >& vSortedByTimestamp,
-    map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop,
-    uint64_t nStakeModifierPrev,
-    const CBlockIndex** pindexSelected)
+// A block of the stake modifier selection interval, ordered by timestamp
+// then hash as the candidates have always been sorted
+struct CModifierCandidate {
+    int64_t nTime;
+    uint256 hash;
+    const CBlockIndex* pindex;
+
+    explicit CModifierCandidate(const CBlockIndex* pindexIn) : nTime(pindexIn->GetBlockTime()), hash(pindexIn->GetBlockHash()), pindex(pindexIn) {}
+
+    bool operator<(const CModifierCandidate& other) const
+    {
+        return nTime < other.nTime || (nTime == other.nTime && hash < other.hash);
+    }
+};
+
+/**
+ * The candidate blocks of the last stake modifier computation, sorted. The
+ * selection interval of the next block is mostly the same blocks, so only
+ * those entering or leaving it are inserted or erased, instead of the whole
+ * interval being collected and sorted again. Guarded by cs_main.
+ */
+class CModifierCandidateWindow
 {
-    bool fModifierV2 = false;
-    bool fFirstRun = true;
-    bool fSelected = false;
-    uint256 hashBest = 0;
-    *pindexSelected = (const CBlockIndex*)0;
-    BOOST_FOREACH (const PAIRTYPE(int64_t, uint256) & item, vSortedByTimestamp) {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString().c_str());
+private:
+    std::vector<CModifierCandidate> vCandidates;
+    const CBlockIndex* pindexLast; // the newest block held, NULL when empty
+    int nHeightFirst;              // the height of the oldest block held
 
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
-            break;
+    void Insert(const CBlockIndex* pindex)
+    {
+        CModifierCandidate candidate(pindex);
+        vCandidates.insert(std::upper_bound(vCandidates.begin(), vCandidates.end(), candidate), candidate);
+    }
+
+public:
+    CModifierCandidateWindow() : pindexLast(NULL), nHeightFirst(0) {}
+
+    void Clear()
+    {
+        vCandidates.clear();
+        pindexLast = NULL;
+        nHeightFirst = 0;
+    }
+
+    /** Hold the blocks from pindexPrev back to, not including, the first
+     * with a timestamp before nSelectionIntervalStart, and return the height
+     * of the oldest */
+    int Update(const CBlockIndex* pindexPrev, int64_t nSelectionIntervalStart)
+    {
+        const CBlockIndex* pindex = pindexPrev;
+        while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
+            pindex = pindex->pprev;
+        int nHeightFirstNew = pindex ? (pindex->nHeight + 1) : 0;
+
+        // heights [nHeightKeptBegin, nHeightKeptEnd) are held already, as long
+        // as the newest block held is an ancestor of pindexPrev
+        int nHeightKeptBegin = pindexPrev->nHeight + 1;
+        int nHeightKeptEnd = pindexPrev->nHeight + 1;
+        if (pindexLast && pindexLast->nHeight <= pindexPrev->nHeight && pindexPrev->GetAncestor(pindexLast->nHeight) == pindexLast &&
+            pindexLast->nHeight >= nHeightFirstNew) {
+            nHeightKeptBegin = std::max(nHeightFirst, nHeightFirstNew);
+            nHeightKeptEnd = pindexLast->nHeight + 1;
+            // the blocks that left the interval, wherever their timestamps sorted them
+            std::vector<CModifierCandidate>::iterator itKeep = vCandidates.begin();
+            for (std::vector<CModifierCandidate>::iterator it = vCandidates.begin(); it != vCandidates.end(); ++it) {
+                if (it->pindex->nHeight >= nHeightKeptBegin)
+                    *itKeep++ = *it;
+            }
+            vCandidates.erase(itKeep, vCandidates.end());
+        } else {
+            vCandidates.clear();
+        }
 
-        //if the lowest block height (vSortedByTimestamp[0]) is >= switch height, use new modifier calc
-        if (fFirstRun){
-            fModifierV2 = pindex->nHeight >= Params().ModifierUpgradeBlock();
-            fFirstRun = false;
+        for (pindex = pindexPrev; pindex && pindex->nHeight >= nHeightKeptEnd; pindex = pindex->pprev)
+            Insert(pindex);
+        if (nHeightKeptBegin > nHeightFirstNew) {
+            for (pindex = pindexPrev->GetAncestor(nHeightKeptBegin - 1); pindex && pindex->nHeight >= nHeightFirstNew; pindex = pindex->pprev)
+                Insert(pindex);
         }
 
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
-            continue;
+        pindexLast = pindexPrev;
+        nHeightFirst = nHeightFirstNew;
+        return nHeightFirstNew;
+    }
 
-        // compute the selection hash by hashing an input that is unique to that block
-        uint256 hashProof;
-        if(fModifierV2)
-            hashProof = pindex->GetBlockHash();
-        else
-            hashProof = pindex->IsProofOfStake() ? 0 : pindex->GetBlockHash();
+    const std::vector<CModifierCandidate>& Get() const { return vCandidates; }
+};
 
-        CDataStream ss(SER_GETHASH, 0);
-        ss << hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
+static CModifierCandidateWindow modifierCandidates;
 
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
+void ClearStakeModifierCandidates()
+{
+    modifierCandidates.Clear();
+}
 
-        if (fSelected && hashSelection < hashBest) {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*)pindex;
+// select a block from the candidate blocks in vCandidates, excluding
+// already selected blocks in vSelected, and with timestamp up to
+// nSelectionIntervalStop. vHashSelection holds the selection hash of each
+// candidate, which is the same for all the rounds of a modifier.
+static bool SelectBlockFromCandidates(
+    const vector<CModifierCandidate>& vCandidates,
+    const vector<uint256>& vHashSelection,
+    const vector<bool>& vSelected,
+    int64_t nSelectionIntervalStop,
+    size_t& nSelected)
+{
+    bool fSelected = false;
+    uint256 hashBest = 0;
+    for (size_t i = 0; i < vCandidates.size(); i++) {
+        if (fSelected && vCandidates[i].nTime > nSelectionIntervalStop)
+            break;
+
+        if (vSelected[i])
+            continue;
+
+        if (fSelected && vHashSelection[i] < hashBest) {
+            hashBest = vHashSelection[i];
+            nSelected = i;
         } else if (!fSelected) {
             fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*)pindex;
+            hashBest = vHashSelection[i];
+            nSelected = i;
         }
     }
     if (GetBoolArg("-printstakemodifier", false))
@@ -174,39 +246,59 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     if (nModifierTime / getIntervalVersion(fTestNet) >= pindexPrev->GetBlockTime() / getIntervalVersion(fTestNet))
         return true;
 
-    // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
-    vSortedByTimestamp.reserve(64 * getIntervalVersion(fTestNet) / nStakeTargetSpacing);
+    // Candidate blocks, sorted by timestamp
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / getIntervalVersion(fTestNet)) * getIntervalVersion(fTestNet) - nSelectionInterval;
-    const CBlockIndex* pindex = pindexPrev;
+    int nHeightFirstCandidate = modifierCandidates.Update(pindexPrev, nSelectionIntervalStart);
+    const vector<CModifierCandidate>& vCandidates = modifierCandidates.Get();
+    const CBlockIndex* pindex = NULL;
+
+    // compute the selection hash of each candidate by hashing an input that
+    // is unique to that block
+    //if the lowest block height (vCandidates[0]) is >= switch height, use new modifier calc
+    bool fModifierV2 = !vCandidates.empty() && vCandidates[0].pindex->nHeight >= Params().ModifierUpgradeBlock();
+    vector<uint256> vHashSelection;
+    vHashSelection.reserve(vCandidates.size());
+    BOOST_FOREACH (const CModifierCandidate& candidate, vCandidates) {
+        uint256 hashProof;
+        if (fModifierV2)
+            hashProof = candidate.hash;
+        else
+            hashProof = candidate.pindex->IsProofOfStake() ? 0 : candidate.hash;
 
-    while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart) {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
-        pindex = pindex->pprev;
-    }
+        CDataStream ss(SER_GETHASH, 0);
+        ss << hashProof << nStakeModifier;
+        uint256 hashSelection = Hash(ss.begin(), ss.end());
 
-    int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
-    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
-    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (candidate.pindex->IsProofOfStake())
+            hashSelection >>= 32;
+        vHashSelection.push_back(hashSelection);
+    }
 
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
     int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
-    for (int nRound = 0; nRound < min(64, (int)vSortedByTimestamp.size()); nRound++) {
+    vector<bool> vSelected(vCandidates.size(), false);
+    vector<const CBlockIndex*> vSelectedBlocks;
+    for (int nRound = 0; nRound < min(64, (int)vCandidates.size()); nRound++) {
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
 
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        size_t nSelected = 0;
+        if (!SelectBlockFromCandidates(vCandidates, vHashSelection, vSelected, nSelectionIntervalStop, nSelected))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
+        pindex = vCandidates[nSelected].pindex;
 
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
 
         // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
+        vSelected[nSelected] = true;
+        vSelectedBlocks.push_back(pindex);
         if (fDebug || GetBoolArg("-printstakemodifier", false))
             LogPrintf("ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n",
                 nRound, DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nSelectionIntervalStop).c_str(), pindex->nHeight, pindex->GetStakeEntropyBit());
@@ -224,10 +316,10 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH (const PAIRTYPE(uint256, const CBlockIndex*) & item, mapSelectedBlocks) {
+        BOOST_FOREACH (const CBlockIndex* pindexSelected, vSelectedBlocks) {
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake() ? "S" : "W");
+            strSelectionMap.replace(pindexSelected->nHeight - nHeightFirstCandidate, 1, pindexSelected->IsProofOfStake() ? "S" : "W");
         }
         LogPrintf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap.c_str());
     }
@@ -240,11 +332,95 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+/**
+ * Results of GetKernelStakeModifier, shared by staking and block validation.
+ * An entry stays valid for as long as the last block its walk visited is in
+ * the active chain, since then every block the walk looked at still is.
+ */
+class CStakeModifierCache
+{
+private:
+    struct Entry {
+        uint64_t nStakeModifier;
+        int nStakeModifierHeight;
+        int64_t nStakeModifierTime;
+        const CBlockIndex* pindexEnd;
+        std::list<uint256>::iterator itLRU;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<uint256, Entry> mapEntries;
+    std::list<uint256> listLRU; // most recently used at the front
+    size_t nMaxEntries;
+
+public:
+    CStakeModifierCache(size_t nMaxEntriesIn) : nMaxEntries(nMaxEntriesIn) {}
+
+    bool Get(const uint256& hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime)
+    {
+        LOCK(cs);
+        std::map<uint256, Entry>::iterator it = mapEntries.find(hashBlockFrom);
+        if (it == mapEntries.end())
+            return false;
+        if (!chainActive.Contains(it->second.pindexEnd)) {
+            listLRU.erase(it->second.itLRU);
+            mapEntries.erase(it);
+            return false;
+        }
+        listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+        nStakeModifier = it->second.nStakeModifier;
+        nStakeModifierHeight = it->second.nStakeModifierHeight;
+        nStakeModifierTime = it->second.nStakeModifierTime;
+        return true;
+    }
+
+    void Put(const uint256& hashBlockFrom, uint64_t nStakeModifier, int nStakeModifierHeight, int64_t nStakeModifierTime, const CBlockIndex* pindexEnd)
+    {
+        LOCK(cs);
+        if (mapEntries.count(hashBlockFrom))
+            return;
+        if (mapEntries.size() >= nMaxEntries) {
+            mapEntries.erase(listLRU.back());
+            listLRU.pop_back();
+        }
+        listLRU.push_front(hashBlockFrom);
+        Entry& entry = mapEntries[hashBlockFrom];
+        entry.nStakeModifier = nStakeModifier;
+        entry.nStakeModifierHeight = nStakeModifierHeight;
+        entry.nStakeModifierTime = nStakeModifierTime;
+        entry.pindexEnd = pindexEnd;
+        entry.itLRU = listLRU.begin();
+    }
+
+    //! Drop every entry whose walk left the active chain
+    void Prune()
+    {
+        LOCK(cs);
+        for (std::map<uint256, Entry>::iterator it = mapEntries.begin(); it != mapEntries.end();) {
+            if (chainActive.Contains(it->second.pindexEnd)) {
+                ++it;
+                continue;
+            }
+            listLRU.erase(it->second.itLRU);
+            mapEntries.erase(it++);
+        }
+    }
+};
+
+static CStakeModifierCache stakeModifierCache(STAKE_MODIFIER_CACHE_SIZE);
+
+void PruneStakeModifierCache()
+{
+    stakeModifierCache.Prune();
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
+    if (stakeModifierCache.Get(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime))
+        return true;
     if (!mapBlockIndex.count(hashBlockFrom))
         return error("GetKernelStakeModifier() : block not indexed");
     const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
@@ -269,37 +445,54 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+    stakeModifierCache.Put(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, pindex);
     return true;
 }
 
-uint256 stakeHash(unsigned int nTimeTx, CDataStream ss, unsigned int prevoutIndex, uint256 prevoutHash, unsigned int nTimeBlockFrom)
-{
-    //DYSTEM will hash in the transaction hash and the index number in order to make sure each hash is unique
-    ss << nTimeBlockFrom << prevoutIndex << prevoutHash << nTimeTx;
-    return Hash(ss.begin(), ss.end());
-}
-
 //test hash vs target
 bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay)
 {
     //get the stake weight - weight is equal to coin amount
-    uint256 bnCoinDayWeight = uint256(nValueIn) / 100;
+    uint64_t nCoinDayWeight = (uint64_t)nValueIn / 100;
+
+    // Now check if proof-of-stake hash meets target protocol. The weight fits
+    // in 64 bits, so the product, truncated to 256 bits as before, takes one
+    // pass over the target instead of a full 256 bit multiplication
+    return hashProofOfStake < bnTargetPerCoinDay.MulU64(nCoinDayWeight);
+}
+
+CStakeKernelHasher::CStakeKernelHasher(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier << nTimeBlockFrom << ssUniqueID;
+    hasherPrefix.Write((const unsigned char*)&ss[0], ss.size());
+}
 
-    // Now check if proof-of-stake hash meets target protocol
-    return hashProofOfStake < (bnCoinDayWeight * bnTargetPerCoinDay);
+uint256 CStakeKernelHasher::GetHash(unsigned int nTimeTx) const
+{
+    // the hash of the stream nStakeModifier << nTimeBlockFrom << ssUniqueID << nTimeTx
+    unsigned char vchTime[4];
+    WriteLE32(vchTime, nTimeTx);
+    uint256 hash;
+    CHash256(hasherPrefix).Write(vchTime, sizeof(vchTime)).Finalize((unsigned char*)&hash);
+    return hash;
 }
 
 bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t nStakeModifier, const uint256& bnTarget,
                 unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
 {
-    CDataStream ss(SER_GETHASH, 0);
-    ss << nStakeModifier << nTimeBlockFrom << ssUniqueID << nTimeTx;
-    hashProofOfStake = Hash(ss.begin(), ss.end());
-    //LogPrintf("%s: modifier:%d nTimeBlockFrom:%d nTimeTx:%d hash:%s\n", __func__, nStakeModifier, nTimeBlockFrom, nTimeTx, hashProofOfStake.GetHex());
+    return CheckStake(CStakeKernelHasher(nStakeModifier, nTimeBlockFrom, ssUniqueID), nValueIn, bnTarget, nTimeTx, hashProofOfStake);
+}
 
+bool CheckStake(const CStakeKernelHasher& hasher, CAmount nValueIn, const uint256& bnTarget, unsigned int nTimeTx, uint256& hashProofOfStake)
+{
+    hashProofOfStake = hasher.GetHash(nTimeTx);
     return stakeTargetHit(hashProofOfStake, nValueIn, bnTarget);
 }
 
+//! Number of timestamps tried per kernel, counting down from nTimeTx + STAKE_HASH_DRIFT
+static const int STAKE_HASH_DRIFT = 30;
+
 bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake)
 {
     if (nTimeTx < nTimeBlockFrom)
@@ -321,8 +514,8 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
     bool fSuccess = false;
     unsigned int nTryTime = 0;
     int nHeightStart = chainActive.Height();
-    int nHashDrift = 30;
-    CDataStream ssUniqueID = stakeInput->GetUniqueness();
+    int nHashDrift = STAKE_HASH_DRIFT;
+    CStakeKernelHasher hasher(nStakeModifier, nTimeBlockFrom, stakeInput->GetUniqueness());
     CAmount nValueIn = stakeInput->GetValue();
     for (int i = 0; i < nHashDrift; i++) //iterate the hashing
     {
@@ -334,7 +527,7 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
         nTryTime = nTimeTx + nHashDrift - i;
 
         // if stake hash does not meet the target then continue to next iteration
-        if (!CheckStake(ssUniqueID, nValueIn, nStakeModifier, bnTargetPerCoinDay, nTimeBlockFrom, nTryTime, hashProofOfStake))
+        if (!CheckStake(hasher, nValueIn, bnTargetPerCoinDay, nTryTime, hashProofOfStake))
             continue;
 
         fSuccess = true; // if we make it this far then we have successfully created a stake hash
@@ -348,12 +541,110 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
     return fSuccess;
 }
 
+//! Bumped whenever running kernel searches should give up
+static std::atomic<unsigned int> nKernelSearchEpoch(0);
+
+void InterruptKernelSearch()
+{
+    nKernelSearchEpoch++;
+    WakeStakeMinter();
+}
+
+static boost::mutex cs_stakeMinterWake;
+static boost::condition_variable condStakeMinterWake;
+static unsigned int nStakeMinterEvents = 0;
+
+void WakeStakeMinter()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_stakeMinterWake);
+        nStakeMinterEvents++;
+    }
+    condStakeMinterWake.notify_all();
+}
+
+unsigned int GetStakeMinterEvents()
+{
+    boost::unique_lock<boost::mutex> lock(cs_stakeMinterWake);
+    return nStakeMinterEvents;
+}
+
+bool WaitForStakeMinterEvent(unsigned int nEvents, int64_t nWakeTime)
+{
+    boost::unique_lock<boost::mutex> lock(cs_stakeMinterWake);
+    while (nStakeMinterEvents == nEvents) {
+        int64_t nNow = GetTime();
+        if (nNow >= nWakeTime)
+            return false;
+        condStakeMinterWake.timed_wait(lock, boost::posix_time::seconds(nWakeTime - nNow));
+    }
+    return true;
+}
+
+static void KernelSearchWorker(const std::vector<CStakeKernelCandidate>* pvCandidates, const uint256* pbnTarget, unsigned int nTimeTx,
+                               unsigned int nEpoch, std::atomic<size_t>* pnNext, std::atomic<int>* pnFound,
+                               unsigned int* pnTimeFound, uint256* phashFound)
+{
+    const std::vector<CStakeKernelCandidate>& vCandidates = *pvCandidates;
+    while (*pnFound < 0 && nKernelSearchEpoch == nEpoch) {
+        size_t nIndex = (*pnNext)++;
+        if (nIndex >= vCandidates.size())
+            return;
+
+        const CStakeKernelCandidate& candidate = vCandidates[nIndex];
+        for (int i = 0; i < STAKE_HASH_DRIFT; i++) {
+            unsigned int nTryTime = nTimeTx + STAKE_HASH_DRIFT - i;
+            uint256 hashProofOfStake;
+            if (!CheckStake(candidate.hasher, candidate.nValue, *pbnTarget, nTryTime, hashProofOfStake))
+                continue;
+
+            // Only the first worker to hit publishes its result
+            int nNone = -1;
+            if (pnFound->compare_exchange_strong(nNone, (int)nIndex)) {
+                *pnTimeFound = nTryTime;
+                *phashFound = hashProofOfStake;
+            }
+            return;
+        }
+    }
+}
+
+int FindStakeKernel(const std::vector<CStakeKernelCandidate>& vCandidates, unsigned int nBits, unsigned int& nTimeTx, uint256& hashProofOfStake, int nThreads)
+{
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    if (nThreads <= 0)
+        nThreads = boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, (int)vCandidates.size()));
+
+    const unsigned int nEpoch = nKernelSearchEpoch;
+    std::atomic<size_t> nNext(0);
+    std::atomic<int> nFound(-1);
+    unsigned int nTimeFound = 0;
+    uint256 hashFound;
+
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&KernelSearchWorker, &vCandidates, &bnTargetPerCoinDay, nTimeTx, nEpoch, &nNext, &nFound, &nTimeFound, &hashFound));
+    KernelSearchWorker(&vCandidates, &bnTargetPerCoinDay, nTimeTx, nEpoch, &nNext, &nFound, &nTimeFound, &hashFound);
+    threadGroup.join_all();
+
+    mapHashedBlocks.clear();
+    mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
+
+    if (nFound < 0)
+        return -1;
+    nTimeTx = nTimeFound;
+    hashProofOfStake = hashFound;
+    return nFound;
+}
+
 //instead of looping outside and reinitializing variables many times, we will give a nTimeTx and also search interval so that we can do all the hashing here
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTransaction txPrev, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, CAmount nValueIn, const COutPoint& prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake)
 {
     //assign new variables to make it easier to read
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
+    unsigned int nTimeBlockFrom = pindexFrom->GetBlockTime();
 
     if (nTimeTx < nTimeBlockFrom) // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
@@ -369,18 +660,19 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
     uint64_t nStakeModifier = 0;
     int nStakeModifierHeight = 0;
     int64_t nStakeModifierTime = 0;
-    if (!GetKernelStakeModifier(blockFrom.GetHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake)) {
+    if (!GetKernelStakeModifier(pindexFrom->GetBlockHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake)) {
         LogPrintf("CheckStakeKernelHash(): failed to get kernel stake modifier \n");
         return false;
     }
 
-    //create data stream once instead of repeating it in the loop
-    CDataStream ss(SER_GETHASH, 0);
-    ss << nStakeModifier;
+    //DYSTEM will hash in the transaction hash and the index number in order to make sure each hash is unique
+    CDataStream ssUniqueID(SER_GETHASH, 0);
+    ssUniqueID << prevout.n << prevout.hash;
+    CStakeKernelHasher hasher(nStakeModifier, nTimeBlockFrom, ssUniqueID);
 
     //if wallet is simply checking to make sure a hash is valid
     if (fCheck) {
-        hashProofOfStake = stakeHash(nTimeTx, ss, prevout.n, prevout.hash, nTimeBlockFrom);
+        hashProofOfStake = hasher.GetHash(nTimeTx);
         return stakeTargetHit(hashProofOfStake, nValueIn, bnTargetPerCoinDay);
     }
 
@@ -396,7 +688,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
 
         //hash this iteration
         nTryTime = nTimeTx + nHashDrift - i;
-        hashProofOfStake = stakeHash(nTryTime, ss, prevout.n, prevout.hash, nTimeBlockFrom);
+        hashProofOfStake = hasher.GetHash(nTryTime);
 
         // if stake hash does not meet the target then continue to next iteration
         if (!stakeTargetHit(hashProofOfStake, nValueIn, bnTargetPerCoinDay))
@@ -409,8 +701,8 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
             LogPrint("net","CheckStakeKernelHash() : using modifier %s at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
                 boost::lexical_cast<std::string>(nStakeModifier).c_str(), nStakeModifierHeight,
                 DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nStakeModifierTime).c_str(),
-                mapBlockIndex[blockFrom.GetHash()]->nHeight,
-                DateTimeStrFormat("%Y-%m-%d %H:%M:%S", blockFrom.GetBlockTime()).c_str());
+                pindexFrom->nHeight,
+                DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexFrom->GetBlockTime()).c_str());
             LogPrint("net","CheckStakeKernelHash() : pass protocol=%s modifier=%s nTimeBlockFrom=%u prevoutHash=%s nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
                 "0.3",
                 boost::lexical_cast<std::string>(nStakeModifier).c_str(),
@@ -425,41 +717,58 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
     return fSuccess;
 }
 
+// The output a kernel spends and the block it is in. An unspent output comes
+// from the UTXO set, whose coins record their height on the active chain, so
+// no block has to be read; only a kernel already spent on the active chain,
+// as when checking a fork, takes the slow transaction lookup.
+static bool GetKernelPrevout(const COutPoint& prevout, CTxOut& txoutRet, const CBlockIndex*& pindexFromRet)
+{
+    {
+        LOCK(cs_main);
+        const CCoins* coins = pcoinsTip->AccessCoins(prevout.hash);
+        if (coins && coins->IsAvailable(prevout.n) && coins->nHeight > 0 && coins->nHeight <= chainActive.Height()) {
+            txoutRet = coins->vout[prevout.n];
+            pindexFromRet = chainActive[coins->nHeight];
+            return true;
+        }
+    }
+
+    CTransaction txPrev;
+    uint256 hashBlock;
+    if (!GetTransaction(prevout.hash, txPrev, hashBlock, true) || prevout.n >= txPrev.vout.size())
+        return false;
+
+    LOCK(cs_main);
+    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
+    if (it == mapBlockIndex.end())
+        return error("%s : block %s of kernel %s is not indexed", __func__, hashBlock.ToString(), prevout.ToString());
+    txoutRet = txPrev.vout[prevout.n];
+    pindexFromRet = it->second;
+    return true;
+}
+
 // Check kernel hash target and coinstake signature
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake)
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake)
 {
-    const CTransaction tx = block.vtx[1];
+    const CTransaction& tx = block.vtx[1];
     if (!tx.IsCoinStake())
         return error("CheckProofOfStake() : called on non-coinstake %s", tx.GetHash().ToString().c_str());
 
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // First try finding the previous transaction in database
-    uint256 hashBlock;
-    CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
+    CTxOut txoutPrev;
+    const CBlockIndex* pindexFrom = NULL;
+    if (!GetKernelPrevout(txin.prevout, txoutPrev, pindexFrom))
         return error("CheckProofOfStake() : INFO: read txPrev failed");
 
     //verify signature and script
-    if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
+    if (!VerifyScript(txin.scriptSig, txoutPrev.scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
         return error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString().c_str());
 
-    CBlockIndex* pindex = NULL;
-    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
-    if (it != mapBlockIndex.end())
-        pindex = it->second;
-    else
-        return error("CheckProofOfStake() : read block failed");
-
-    // Read block header
-    CBlock blockprev;
-    if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
-        return error("CheckProofOfStake(): INFO: failed to find block");
-
     unsigned int nInterval = 0;
     unsigned int nTime = block.nTime;
-    if (!CheckStakeKernelHash(block.nBits, blockprev, txPrev, txin.prevout, nTime, nInterval, true, hashProofOfStake, fDebug))
+    if (!CheckStakeKernelHash(block.nBits, pindexFrom, txoutPrev.nValue, txin.prevout, nTime, nInterval, true, hashProofOfStake, fDebug))
         return error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s \n", tx.GetHash().ToString().c_str(), hashProofOfStake.ToString().c_str()); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -473,14 +782,14 @@ bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx)
 }
 
 // Get stake modifier checksum
-unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex)
+unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex, const uint256& hashProofOfStake)
 {
     assert(pindex->pprev || pindex->GetBlockHash() == Params().HashGenesisBlock());
     // Hash previous checksum with flags, hashProofOfStake and nStakeModifier
     CDataStream ss(SER_GETHASH, 0);
     if (pindex->pprev)
         ss << pindex->pprev->nStakeModifierChecksum;
-    ss << pindex->nFlags << pindex->hashProofOfStake << pindex->nStakeModifier;
+    ss << pindex->nFlags << hashProofOfStake << pindex->nStakeModifier;
     uint256 hashChecksum = Hash(ss.begin(), ss.end());
     hashChecksum >>= (256 - 32);
     return hashChecksum.Get64();
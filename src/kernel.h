@@ -5,6 +5,7 @@
 #ifndef BITCOIN_KERNEL_H
 #define BITCOIN_KERNEL_H
 
+#include "hash.h"
 #include "main.h"
 #include "stakeinput.h"
 
@@ -19,23 +20,79 @@ extern unsigned int getIntervalVersion(bool fTestNet);
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+//! Number of GetKernelStakeModifier results kept in memory
+static const unsigned int STAKE_MODIFIER_CACHE_SIZE = 50000;
+
 // Compute the hash modifier for proof-of-stake
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake);
+// Forget cached kernel stake modifiers that no longer match the active chain
+void PruneStakeModifierCache();
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
+// Forget the modifier selection candidates kept from the last computation, before the block index is freed
+void ClearStakeModifierCandidates();
+
+/** The kernel hash of one stake input, for any nTimeTx. The modifier, the
+ * block time and the uniqueness never change between the timestamps tried,
+ * so they are written into the hasher once and each timestamp only finishes
+ * the hash from that midstate. */
+class CStakeKernelHasher
+{
+private:
+    CHash256 hasherPrefix;
+
+public:
+    CStakeKernelHasher(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const CDataStream& ssUniqueID);
+
+    uint256 GetHash(unsigned int nTimeTx) const;
+};
 
 bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t nStakeModifier, const uint256& bnTarget, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
+bool CheckStake(const CStakeKernelHasher& hasher, CAmount nValueIn, const uint256& bnTarget, unsigned int nTimeTx, uint256& hashProofOfStake);
 bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay);
 bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
 
+//! -stakethreads default (0 = one per core)
+static const int DEFAULT_STAKE_THREADS = 0;
+
+/** A stake input with everything the kernel hash needs resolved up front, so
+ * the search itself touches no chain state and can run on worker threads. */
+struct CStakeKernelCandidate {
+    CStakeInput* pinput;
+    uint64_t nStakeModifier;
+    unsigned int nTimeBlockFrom;
+    CAmount nValue;
+    CStakeKernelHasher hasher;
+
+    CStakeKernelCandidate(CStakeInput* pinputIn, uint64_t nStakeModifierIn, unsigned int nTimeBlockFromIn, CAmount nValueIn, const CDataStream& ssUniqueIDIn)
+        : pinput(pinputIn), nStakeModifier(nStakeModifierIn), nTimeBlockFrom(nTimeBlockFromIn), nValue(nValueIn), hasher(nStakeModifierIn, nTimeBlockFromIn, ssUniqueIDIn) {}
+};
+
+/** Search vCandidates for a stake kernel meeting nBits, trying the same hash
+ * drift window as Stake() for each candidate. The candidates are split over
+ * nThreads workers and the first hit stops the others.
+ * Returns the index of the winning candidate and sets nTimeTx and
+ * hashProofOfStake, or returns -1 if none hit or the search was interrupted. */
+int FindStakeKernel(const std::vector<CStakeKernelCandidate>& vCandidates, unsigned int nBits, unsigned int& nTimeTx, uint256& hashProofOfStake, int nThreads);
+
+/** Abort any running FindStakeKernel() search, e.g. because the tip changed. Wakes the stake minter. */
+void InterruptKernelSearch();
+
+/** Wake the stake minter from WaitForStakeMinterEvent(), e.g. because the wallet was unlocked. */
+void WakeStakeMinter();
+/** The wake-ups so far, for WaitForStakeMinterEvent() */
+unsigned int GetStakeMinterEvents();
+/** Sleep until a wake-up after GetStakeMinterEvents() returned nEvents, or until nWakeTime (GetTime()). Returns whether woken. */
+bool WaitForStakeMinterEvent(unsigned int nEvents, int64_t nWakeTime);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake, std::unique_ptr<CStakeInput>& stake);
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake);
 
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
 
 // Get stake modifier checksum
-unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex);
+unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex, const uint256& hashProofOfStake);
 
 // Check stake modifier hard checkpoints
 bool CheckStakeModifierCheckpoints(int nHeight, unsigned int nStakeModifierChecksum);
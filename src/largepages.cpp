@@ -0,0 +1,223 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/dystem-config.h"
+#endif
+
+#include "largepages.h"
+
+#include "sync.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <new>
+
+#ifdef __linux__
+#define ENABLE_LARGE_PAGES 1
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+enum LargePageKind {
+    LARGE_PAGE_HUGETLB,
+    LARGE_PAGE_TRANSPARENT,
+    LARGE_PAGE_FALLBACK
+};
+
+struct CLargePageRegion {
+    size_t nSize;
+    LargePageKind kind;
+};
+
+std::atomic<int> nLargePageMode(LARGE_PAGES_OFF);
+
+CCriticalSection cs_largepages;
+//! The large allocations by address, guarded by cs_largepages
+std::map<void*, CLargePageRegion> mapRegions;
+CLargePageStats statsLargePages;
+
+size_t RoundToLargePages(size_t nBytes)
+{
+    return (nBytes + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+}
+
+#ifdef ENABLE_LARGE_PAGES
+void* MapTransparent(size_t nSize)
+{
+    // Map one huge page more and trim the ends, so the range is aligned for the kernel to back it with huge pages
+    size_t nMapped = nSize + LARGE_PAGE_SIZE;
+    void* p = mmap(NULL, nMapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    uintptr_t nStart = (uintptr_t)p;
+    uintptr_t nAligned = (nStart + LARGE_PAGE_SIZE - 1) & ~(uintptr_t)(LARGE_PAGE_SIZE - 1);
+    if (nAligned > nStart)
+        munmap(p, nAligned - nStart);
+    if (nStart + nMapped > nAligned + nSize)
+        munmap((void*)(nAligned + nSize), nStart + nMapped - nAligned - nSize);
+    p = (void*)nAligned;
+#ifdef MADV_HUGEPAGE
+    madvise(p, nSize, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+void* MapHugeTLB(size_t nSize)
+{
+#ifdef MAP_HUGETLB
+    void* p = mmap(NULL, nSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+        return p;
+#endif
+    return NULL;
+}
+#endif // ENABLE_LARGE_PAGES
+} // anon namespace
+
+std::string LargePageModeName(LargePageMode mode)
+{
+    switch (mode) {
+    case LARGE_PAGES_TRANSPARENT:
+        return "transparent";
+    case LARGE_PAGES_HUGETLB:
+        return "hugetlb";
+    default:
+        return "off";
+    }
+}
+
+bool InitLargePages(const std::string& strMode, std::string& strError)
+{
+    LargePageMode mode;
+    if (strMode == "0" || strMode == "off")
+        mode = LARGE_PAGES_OFF;
+    else if (strMode == "" || strMode == "1" || strMode == "transparent")
+        mode = LARGE_PAGES_TRANSPARENT;
+    else if (strMode == "hugetlb")
+        mode = LARGE_PAGES_HUGETLB;
+    else {
+        strError = strprintf("Unknown -largepages mode '%s', expected 0, 1, transparent or hugetlb", strMode);
+        return false;
+    }
+#ifndef ENABLE_LARGE_PAGES
+    if (mode != LARGE_PAGES_OFF) {
+        LogPrintf("Huge pages are not supported on this platform, the caches use ordinary memory\n");
+        mode = LARGE_PAGES_OFF;
+    }
+#endif
+    if (mode != LARGE_PAGES_OFF)
+        LogPrintf("Backing the coins and signature caches with %s huge pages\n", LargePageModeName(mode));
+    nLargePageMode = mode;
+    return true;
+}
+
+bool LargePagesEnabled()
+{
+    return nLargePageMode != LARGE_PAGES_OFF;
+}
+
+void* LargePageAllocate(size_t nBytes)
+{
+    int mode = nLargePageMode;
+    if (mode == LARGE_PAGES_OFF || nBytes < LARGE_PAGE_SIZE)
+        return ::operator new(nBytes);
+
+    void* p = NULL;
+    CLargePageRegion region;
+    region.nSize = RoundToLargePages(nBytes);
+#ifdef ENABLE_LARGE_PAGES
+    if (mode == LARGE_PAGES_HUGETLB) {
+        p = MapHugeTLB(region.nSize);
+        region.kind = LARGE_PAGE_HUGETLB;
+    }
+    bool fHugeTLBFailed = mode == LARGE_PAGES_HUGETLB && p == NULL;
+    if (p == NULL) {
+        p = MapTransparent(region.nSize);
+        region.kind = LARGE_PAGE_TRANSPARENT;
+    }
+#else
+    bool fHugeTLBFailed = false;
+#endif
+    if (p == NULL) {
+        p = ::operator new(nBytes);
+        region.nSize = nBytes;
+        region.kind = LARGE_PAGE_FALLBACK;
+    }
+
+    LOCK(cs_largepages);
+    if (fHugeTLBFailed && statsLargePages.nHugeTLBFailures++ == 0)
+        LogPrintf("%s: no reserved huge pages left (vm.nr_hugepages), using transparent ones\n", __func__);
+    mapRegions[p] = region;
+    if (region.kind == LARGE_PAGE_HUGETLB)
+        statsLargePages.nHugeTLBBytes += region.nSize;
+    else if (region.kind == LARGE_PAGE_TRANSPARENT)
+        statsLargePages.nTransparentBytes += region.nSize;
+    else
+        statsLargePages.nFallbackBytes += region.nSize;
+    return p;
+}
+
+void LargePageFree(void* p, size_t nBytes)
+{
+    if (p == NULL)
+        return;
+    if (nBytes >= LARGE_PAGE_SIZE) {
+        CLargePageRegion region;
+        {
+            LOCK(cs_largepages);
+            std::map<void*, CLargePageRegion>::iterator it = mapRegions.find(p);
+            // also allocations from before the mode was set go by here
+            if (it != mapRegions.end()) {
+                region = it->second;
+                mapRegions.erase(it);
+                if (region.kind == LARGE_PAGE_HUGETLB)
+                    statsLargePages.nHugeTLBBytes -= region.nSize;
+                else if (region.kind == LARGE_PAGE_TRANSPARENT)
+                    statsLargePages.nTransparentBytes -= region.nSize;
+                else
+                    statsLargePages.nFallbackBytes -= region.nSize;
+            } else {
+                region.kind = LARGE_PAGE_FALLBACK;
+            }
+        }
+#ifdef ENABLE_LARGE_PAGES
+        if (region.kind != LARGE_PAGE_FALLBACK) {
+            munmap(p, region.nSize);
+            return;
+        }
+#endif
+    }
+    ::operator delete(p);
+}
+
+void GetLargePageStats(CLargePageStats& stats)
+{
+    {
+        LOCK(cs_largepages);
+        stats = statsLargePages;
+    }
+    stats.mode = (LargePageMode)(int)nLargePageMode;
+#ifdef ENABLE_LARGE_PAGES
+    std::ifstream fileSmaps("/proc/self/smaps_rollup");
+    std::string strLine;
+    while (std::getline(fileSmaps, strLine)) {
+        // AnonHugePages:    40960 kB
+        if (strLine.compare(0, 14, "AnonHugePages:") == 0) {
+            stats.nAnonHugePages = atoi64(strLine.substr(14)) * 1024;
+            break;
+        }
+    }
+    std::ifstream fileSetting("/sys/kernel/mm/transparent_hugepage/enabled");
+    if (std::getline(fileSetting, strLine)) {
+        size_t nOpen = strLine.find('['), nClose = strLine.find(']');
+        if (nOpen != std::string::npos && nClose != std::string::npos && nClose > nOpen)
+            stats.strTransparentSetting = strLine.substr(nOpen + 1, nClose - nOpen - 1);
+    }
+#endif
+}
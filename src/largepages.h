@@ -0,0 +1,112 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_LARGEPAGES_H
+#define BITCOIN_LARGEPAGES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//! Size of the huge pages asked for, the common one on x86-64 and arm64
+static const size_t LARGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+enum LargePageMode {
+    LARGE_PAGES_OFF,
+    //! Transparent huge pages, madvise(MADV_HUGEPAGE) on memory mapped for the purpose
+    LARGE_PAGES_TRANSPARENT,
+    //! Huge pages reserved in vm.nr_hugepages, transparent ones when they run out
+    LARGE_PAGES_HUGETLB
+};
+
+struct CLargePageStats {
+    LargePageMode mode;
+    //! Bytes mapped from reserved huge pages, and with MADV_HUGEPAGE
+    size_t nHugeTLBBytes;
+    size_t nTransparentBytes;
+    //! Bytes of large allocations that got ordinary memory instead
+    size_t nFallbackBytes;
+    uint64_t nHugeTLBFailures;
+    //! AnonHugePages of the process from /proc/self/smaps_rollup, -1 where unknown
+    int64_t nAnonHugePages;
+    //! The bracketed setting of /sys/kernel/mm/transparent_hugepage/enabled, empty where unknown
+    std::string strTransparentSetting;
+
+    CLargePageStats() : mode(LARGE_PAGES_OFF), nHugeTLBBytes(0), nTransparentBytes(0), nFallbackBytes(0), nHugeTLBFailures(0), nAnonHugePages(-1) {}
+};
+
+/**
+ * Set the mode from -largepages: 0, 1 or transparent, hugetlb. Call once
+ * before the caches are created; their memory keeps the mode it got.
+ */
+bool InitLargePages(const std::string& strMode, std::string& strError);
+bool LargePagesEnabled();
+std::string LargePageModeName(LargePageMode mode);
+
+/**
+ * nBytes of memory on huge pages when they are enabled and nBytes is at
+ * least LARGE_PAGE_SIZE, otherwise, or when the system has none to give,
+ * from operator new. Throws std::bad_alloc like operator new.
+ */
+void* LargePageAllocate(size_t nBytes);
+/** Free what LargePageAllocate returned, with the same nBytes */
+void LargePageFree(void* p, size_t nBytes);
+
+void GetLargePageStats(CLargePageStats& stats);
+
+/** Allocator of large arrays, such as the slots of a cache, through LargePageAllocate */
+template <typename T>
+struct large_page_allocator {
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    typedef std::true_type is_always_equal;
+    template <typename U>
+    struct rebind {
+        typedef large_page_allocator<U> other;
+    };
+
+    large_page_allocator() throw() {}
+    template <typename U>
+    large_page_allocator(const large_page_allocator<U>&) throw()
+    {
+    }
+
+    T* allocate(size_t n, const void* hint = 0) { return static_cast<T*>(LargePageAllocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) { LargePageFree(p, n * sizeof(T)); }
+    size_t max_size() const throw() { return size_t(-1) / sizeof(T); }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new ((void*)p) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    void destroy(U* p)
+    {
+        p->~U();
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const large_page_allocator<T>&, const large_page_allocator<U>&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const large_page_allocator<T>&, const large_page_allocator<U>&)
+{
+    return false;
+}
+
+#endif // BITCOIN_LARGEPAGES_H
@@ -6,14 +6,18 @@
 
 #include "util.h"
 
+#include <algorithm>
+
 #include <boost/filesystem.hpp>
 
 #include <leveldb/cache.h>
+#include <leveldb/db.h>
 #include <leveldb/env.h>
 #include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
 #include <memenv.h>
 
-void HandleError(const leveldb::Status& status) throw(leveldb_error)
+static void HandleError(const leveldb::Status& status) throw(leveldb_error)
 {
     if (status.ok())
         return;
@@ -27,14 +31,27 @@ void HandleError(const leveldb::Status& status) throw(leveldb_error)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+CLevelDBProfile GetLevelDBProfile(const std::string& strName)
+{
+    CLevelDBProfile profile;
+    profile.strName = strName;
+    profile.strEngine = GetArg("-" + strName + "engine", DEFAULT_DB_ENGINE);
+    profile.nBloomBits = std::max(0, (int)GetArg("-" + strName + "bloombits", DEFAULT_DB_BLOOM_BITS));
+    profile.fCompression = GetBoolArg("-" + strName + "compression", DEFAULT_DB_COMPRESSION);
+    profile.nWriteBufferSize = std::max((int64_t)0, GetArg("-" + strName + "writebuffer", 0)) << 20;
+    profile.nMaxOpenFiles = std::max(16, (int)GetArg("-" + strName + "maxopenfiles", DEFAULT_DB_MAX_OPEN_FILES));
+    return profile;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBProfile& profile)
 {
     leveldb::Options options;
     options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    // up to two write buffers may be held in memory simultaneously
+    options.write_buffer_size = profile.nWriteBufferSize ? profile.nWriteBufferSize : nCacheSize / 4;
+    options.filter_policy = profile.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(profile.nBloomBits) : NULL;
+    options.compression = profile.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = profile.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -43,46 +60,202 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+static leveldb::Slice ToLevelDB(const CDBSlice& slice)
+{
+    return leveldb::Slice(slice.data(), slice.size());
+}
+
+static CDBSlice FromLevelDB(const leveldb::Slice& slice)
+{
+    return CDBSlice(slice.data(), slice.size());
+}
+
+namespace
+{
+class CLevelDBIterator : public CDBIterator
+{
+private:
+    leveldb::Iterator* piter;
+
+public:
+    CLevelDBIterator(leveldb::Iterator* piterIn) : piter(piterIn) {}
+    ~CLevelDBIterator() { delete piter; }
+
+    bool Valid() const { return piter->Valid(); }
+    void SeekToFirst() { piter->SeekToFirst(); }
+    void Seek(const CDBSlice& key) { piter->Seek(ToLevelDB(key)); }
+    void Next() { piter->Next(); }
+    CDBSlice key() const { return FromLevelDB(piter->key()); }
+    CDBSlice value() const { return FromLevelDB(piter->value()); }
+    bool IsOk() const { return piter->status().ok(); }
+};
+
+class CLevelDBSnapshot : public CDBSnapshot
+{
+public:
+    const leveldb::Snapshot* psnapshot;
+
+    CLevelDBSnapshot(const leveldb::Snapshot* psnapshotIn) : psnapshot(psnapshotIn) {}
+};
+
+/** Replays a CDBWriteBatch into a leveldb::WriteBatch */
+class CLevelDBBatchBuilder : public CDBWriteBatch::Handler
+{
+public:
+    leveldb::WriteBatch batch;
+
+    void Put(const CDBSlice& key, const CDBSlice& value) { batch.Put(ToLevelDB(key), ToLevelDB(value)); }
+    void Delete(const CDBSlice& key) { batch.Delete(ToLevelDB(key)); }
+};
+
+class CLevelDBEngine : public CDBEngine
 {
-    penv = NULL;
-    readoptions.verify_checksums = true;
-    iteroptions.verify_checksums = true;
-    iteroptions.fill_cache = false;
-    syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
-    options.create_if_missing = true;
-    if (fMemory) {
-        penv = leveldb::NewMemEnv(leveldb::Env::Default());
-        options.env = penv;
-    } else {
-        if (fWipe) {
-            LogPrintf("Wiping LevelDB in %s\n", path.string());
-            leveldb::DestroyDB(path.string(), options);
+private:
+    //! custom environment this database is using (may be NULL in case of default environment)
+    leveldb::Env* penv;
+
+    //! database options used
+    leveldb::Options options;
+
+    //! options used when reading from the database
+    leveldb::ReadOptions readoptions;
+
+    //! options used when iterating over values of the database
+    leveldb::ReadOptions iteroptions;
+
+    //! options used when writing to the database
+    leveldb::WriteOptions writeoptions;
+
+    //! options used when sync writing to the database
+    leveldb::WriteOptions syncoptions;
+
+    //! the database itself
+    leveldb::DB* pdb;
+
+public:
+    CLevelDBEngine(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBProfile& profile)
+    {
+        penv = NULL;
+        readoptions.verify_checksums = true;
+        iteroptions.verify_checksums = true;
+        iteroptions.fill_cache = false;
+        syncoptions.sync = true;
+        options = GetOptions(nCacheSize, profile);
+        options.create_if_missing = true;
+        if (fMemory) {
+            penv = leveldb::NewMemEnv(leveldb::Env::Default());
+            options.env = penv;
+        } else {
+            if (fWipe) {
+                LogPrintf("Wiping LevelDB in %s\n", path.string());
+                leveldb::DestroyDB(path.string(), options);
+            }
+            TryCreateDirectory(path);
+            LogPrintf("Opening LevelDB in %s\n", path.string());
+        }
+        leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
+        if (!status.ok())
+            Free();
+        HandleError(status);
+        LogPrintf("Opened LevelDB successfully\n");
+        if (!profile.strName.empty())
+            LogPrintf("LevelDB %s: cache %uMiB, write buffer %uMiB, bloom filter %d bits/key, compression %s, max open files %d\n", profile.strName,
+                nCacheSize >> 20, options.write_buffer_size >> 20, profile.nBloomBits, profile.fCompression ? "on" : "off", profile.nMaxOpenFiles);
+    }
+
+    ~CLevelDBEngine()
+    {
+        delete pdb;
+        pdb = NULL;
+        Free();
+    }
+
+    void Free()
+    {
+        delete options.filter_policy;
+        options.filter_policy = NULL;
+        delete options.block_cache;
+        options.block_cache = NULL;
+        delete penv;
+        penv = NULL;
+        options.env = NULL;
+    }
+
+    const char* GetName() const { return "leveldb"; }
+
+    bool Get(const CDBSlice& key, std::string& strValue) const
+    {
+        leveldb::Status status = pdb->Get(readoptions, ToLevelDB(key), &strValue);
+        if (status.IsNotFound())
+            return false;
+        if (!status.ok()) {
+            LogPrintf("LevelDB read failure: %s\n", status.ToString());
+            HandleError(status);
         }
-        TryCreateDirectory(path);
-        LogPrintf("Opening LevelDB in %s\n", path.string());
+        return true;
+    }
+
+    void Write(const CDBWriteBatch& batch, bool fSync)
+    {
+        CLevelDBBatchBuilder builder;
+        batch.Iterate(builder);
+        leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &builder.batch);
+        HandleError(status);
     }
-    leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
-    HandleError(status);
-    LogPrintf("Opened LevelDB successfully\n");
+
+    CDBIterator* NewIterator(const CDBSnapshot* snapshot) const
+    {
+        leveldb::ReadOptions options = iteroptions;
+        if (snapshot)
+            options.snapshot = static_cast<const CLevelDBSnapshot*>(snapshot)->psnapshot;
+        return new CLevelDBIterator(pdb->NewIterator(options));
+    }
+
+    const CDBSnapshot* GetSnapshot() const
+    {
+        return new CLevelDBSnapshot(pdb->GetSnapshot());
+    }
+
+    void ReleaseSnapshot(const CDBSnapshot* snapshot) const
+    {
+        pdb->ReleaseSnapshot(static_cast<const CLevelDBSnapshot*>(snapshot)->psnapshot);
+        delete snapshot;
+    }
+
+    uint64_t GetApproximateSize(const CDBSlice& begin, const CDBSlice& end) const
+    {
+        leveldb::Range range(ToLevelDB(begin), ToLevelDB(end));
+        uint64_t nSize = 0;
+        pdb->GetApproximateSizes(&range, 1, &nSize);
+        return nSize;
+    }
+};
+} // namespace
+
+CDBEngine* OpenLevelDBEngine(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBProfile& profile)
+{
+    return new CLevelDBEngine(path, nCacheSize, fMemory, fWipe, profile);
+}
+
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSizeIn, bool fMemory, bool fWipe, const CLevelDBProfile& profileIn) : profile(profileIn), nCacheSize(nCacheSizeIn), nLookups(0), nLookupHits(0)
+{
+    pengine = OpenDBEngine(path, nCacheSize, fMemory, fWipe, profile);
 }
 
 CLevelDBWrapper::~CLevelDBWrapper()
 {
-    delete pdb;
-    pdb = NULL;
-    delete options.filter_policy;
-    options.filter_policy = NULL;
-    delete options.block_cache;
-    options.block_cache = NULL;
-    delete penv;
-    options.env = NULL;
+    delete pengine;
+    pengine = NULL;
+}
+
+uint64_t CLevelDBWrapper::GetApproximateSize() const
+{
+    // Every key we store starts with a type byte below 0xff.
+    return pengine->GetApproximateSize(CDBSlice(), CDBSlice("\xff", 1));
 }
 
 bool CLevelDBWrapper::WriteBatch(CLevelDBBatch& batch, bool fSync) throw(leveldb_error)
 {
-    leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
-    HandleError(status);
+    pengine->Write(batch.batch, fSync);
     return true;
 }
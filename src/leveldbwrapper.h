@@ -6,23 +6,23 @@
 #define BITCOIN_LEVELDBWRAPPER_H
 
 #include "clientversion.h"
+#include "dbengine.h"
 #include "serialize.h"
 #include "streams.h"
 #include "util.h"
 #include "version.h"
 
-#include <boost/filesystem/path.hpp>
-
-#include <leveldb/db.h>
-#include <leveldb/write_batch.h>
+#include <atomic>
+#include <string>
 
-class leveldb_error : public std::runtime_error
-{
-public:
-    leveldb_error(const std::string& msg) : std::runtime_error(msg) {}
-};
+#include <boost/filesystem/path.hpp>
 
-void HandleError(const leveldb::Status& status) throw(leveldb_error);
+/**
+ * Profile for the database called strName ("chainstate" or "blockindex"),
+ * from the -<strName>engine, -<strName>bloombits, -<strName>compression,
+ * -<strName>writebuffer and -<strName>maxopenfiles options.
+ */
+CLevelDBProfile GetLevelDBProfile(const std::string& strName);
 
 /** Batch of changes queued to be written to a CLevelDBWrapper */
 class CLevelDBBatch
@@ -30,7 +30,7 @@ class CLevelDBBatch
     friend class CLevelDBWrapper;
 
 private:
-    leveldb::WriteBatch batch;
+    CDBWriteBatch batch;
 
 public:
     template <typename K, typename V>
@@ -39,14 +39,12 @@ public:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(ssValue.GetSerializeSize(value));
         ssValue << value;
-        leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
-        batch.Put(slKey, slValue);
+        batch.Put(CDBSlice(&ssKey[0], ssKey.size()), CDBSlice(&ssValue[0], ssValue.size()));
     }
 
     template <typename K>
@@ -55,58 +53,62 @@ public:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
-        batch.Delete(slKey);
+        batch.Delete(CDBSlice(&ssKey[0], ssKey.size()));
     }
 };
 
+/**
+ * A database of the node, serialized keys and values over whichever
+ * CDBEngine its profile names.
+ */
 class CLevelDBWrapper
 {
 private:
-    //! custom environment this database is using (may be NULL in case of default environment)
-    leveldb::Env* penv;
-
-    //! database options used
-    leveldb::Options options;
-
-    //! options used when reading from the database
-    leveldb::ReadOptions readoptions;
+    CDBEngine* pengine;
 
-    //! options used when iterating over values of the database
-    leveldb::ReadOptions iteroptions;
+    //! tuning the database was opened with
+    CLevelDBProfile profile;
+    size_t nCacheSize;
 
-    //! options used when writing to the database
-    leveldb::WriteOptions writeoptions;
-
-    //! options used when sync writing to the database
-    leveldb::WriteOptions syncoptions;
-
-    //! the database itself
-    leveldb::DB* pdb;
+    //! point lookups, and how many of them found their key
+    mutable std::atomic<uint64_t> nLookups;
+    mutable std::atomic<uint64_t> nLookupHits;
 
 public:
-    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CLevelDBProfile& profileIn = CLevelDBProfile());
     ~CLevelDBWrapper();
 
+    const CLevelDBProfile& GetProfile() const { return profile; }
+    const char* GetEngineName() const { return pengine->GetName(); }
+    size_t GetCacheSize() const { return nCacheSize; }
+    uint64_t GetLookups() const { return nLookups; }
+    uint64_t GetLookupHits() const { return nLookupHits; }
+    //! Approximate size of the database on disk, in bytes
+    uint64_t GetApproximateSize() const;
+
+    //! Record the outcome of a lookup done outside Read() and Exists()
+    void CountLookup(bool fHit) const
+    {
+        nLookups.fetch_add(1, std::memory_order_relaxed);
+        if (fHit)
+            nLookupHits.fetch_add(1, std::memory_order_relaxed);
+    }
+
     template <typename K, typename V>
     bool Read(const K& key, V& value) const throw(leveldb_error)
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
-
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
-        if (!status.ok()) {
-            if (status.IsNotFound())
-                return false;
-            LogPrintf("LevelDB read failure: %s\n", status.ToString());
-            HandleError(status);
-        }
+        bool fFound = pengine->Get(CDBSlice(&ssKey[0], ssKey.size()), strValue);
+        CountLookup(fFound);
+        if (!fFound)
+            return false;
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            // Deserialized straight from the value the engine returned, without copying it again
+            CMemoryReader ssValue(strValue.data(), strValue.size(), SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         } catch (const std::exception&) {
             return false;
@@ -128,17 +130,10 @@ public:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
-        leveldb::Slice slKey(&ssKey[0], ssKey.size());
-
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
-        if (!status.ok()) {
-            if (status.IsNotFound())
-                return false;
-            LogPrintf("LevelDB read failure: %s\n", status.ToString());
-            HandleError(status);
-        }
-        return true;
+        bool fFound = pengine->Get(CDBSlice(&ssKey[0], ssKey.size()), strValue);
+        CountLookup(fFound);
+        return fFound;
     }
 
     template <typename K>
@@ -164,9 +159,26 @@ public:
     }
 
     // not exactly clean encapsulation, but it's easiest for now
-    leveldb::Iterator* NewIterator()
+    CDBIterator* NewIterator()
+    {
+        return pengine->NewIterator(NULL);
+    }
+
+    //! Iterator over the state of the database when snapshot was taken
+    CDBIterator* NewIterator(const CDBSnapshot* snapshot) const
+    {
+        return pengine->NewIterator(snapshot);
+    }
+
+    //! Consistent read-only view of the database; must be given back with ReleaseSnapshot()
+    const CDBSnapshot* GetSnapshot() const
+    {
+        return pengine->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const CDBSnapshot* snapshot) const
     {
-        return pdb->NewIterator(iteroptions);
+        pengine->ReleaseSnapshot(snapshot);
     }
 };
 
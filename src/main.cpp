@@ -10,17 +10,30 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockcompress.h"
+#include "blockencodings.h"
+#include "blocktrace.h"
+#include "bloom.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "core_memusage.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "init.h"
 #include "kernel.h"
+#include "memusage.h"
 #include "masternode-budget.h"
+#include "masternode-list.h"
 #include "masternode-payments.h"
+#include "masternode-sigcheck.h"
+#include "mempoolcheck.h"
 #include "masternodeman.h"
 #include "merkleblock.h"
+#include "metrics.h"
 #include "net.h"
 #include "pow.h"
+#include "scheduler.h"
 #include "swifttx.h"
 #include "txdb.h"
 #include "txmempool.h"
@@ -32,12 +45,19 @@
 #include "wallet.h"
 #endif
 
+#include <atomic>
 #include <sstream>
 
+#ifndef WIN32
+#include <sys/stat.h>
+#endif
+
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -58,10 +78,14 @@ using namespace std;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+//! Owns the entries of mapBlockIndex
+static CBlockIndexArena blockIndexArena;
 map<uint256, uint256> mapProofOfStake;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 map<unsigned int, unsigned int> mapHashedBlocks;
 CChain chainActive;
+//! Replaced as a whole on every tip change, so readers never see half of an update
+static boost::shared_ptr<const CChainTipSnapshot> pchainTipSnapshot(new CChainTipSnapshot());
 CBlockIndex* pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
@@ -70,9 +94,18 @@ int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
+bool fAddressIndex = DEFAULT_ADDRESSINDEX;
+bool fSpentIndex = DEFAULT_SPENTINDEX;
+bool fTimestampIndex = DEFAULT_TIMESTAMPINDEX;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
-unsigned int nCoinCacheSize = 5000;
+bool fPruneMode = false;
+bool fHavePruned = false;
+uint64_t nPruneTarget = 0;
+uint256 hashAssumeValid;
+bool fCompactUndo = DEFAULT_COMPACT_UNDO;
+int nUndoCompression = DEFAULT_UNDO_COMPRESSION;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -89,11 +122,26 @@ CTxMemPool mempool(::minRelayTxFee);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nSize;
 };
 map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+//! The orphans spending each outpoint
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
+//! Serialized bytes of the orphans kept from each peer, against MAX_ORPHAN_TX_PEER_BYTES
+map<NodeId, unsigned int> mapOrphanPeerBytes;
 map<uint256, int64_t> mapRejectedBlocks;
 
+/**
+ * Transactions turned down since the tip last changed, when they might have
+ * become valid, and those of the last blocks connected. AlreadyHave answers
+ * announcements of them from memory, so they are neither fetched and checked
+ * again nor looked up among the coins on disk. Both are under cs_main.
+ */
+boost::scoped_ptr<CRollingBloomFilter> recentRejects;
+uint256 hashRecentRejectsChainTip;
+boost::scoped_ptr<CRollingBloomFilter> recentConfirmed;
+
 void EraseOrphansFor(NodeId peer);
 
 static void CheckBlockIndex();
@@ -164,6 +212,7 @@ struct QueuedBlock {
     int64_t nTime;              //! Time of "getdata" request in microseconds.
     int nValidatedQueuedBefore; //! Number of blocks queued with validated headers (globally) at the time this one is requested.
     bool fValidatedHeaders;     //! Whether this block has validated headers at the time of request.
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock; //! Set while the missing transactions of a compact block are requested.
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -178,6 +227,9 @@ set<CBlockIndex*> setDirtyBlockIndex;
 
 /** Dirty block file entries. */
 set<int> setDirtyFileInfo;
+
+/** Set when a block file was started or grown, for the next flush to check the -prune target */
+bool fCheckForPruning = false;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -222,10 +274,16 @@ struct CNodeState {
     bool fSyncStarted;
     //! Since when we're stalling block download progress (in microseconds), or 0.
     int64_t nStallingSince;
+    //! When we sent the getheaders of the headers sync we wait on (in microseconds), or 0.
+    int64_t nHeadersRequested;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether the peer understands compact blocks, so we may ask it for MSG_CMPCT_BLOCK.
+    bool fProvidesHeaderAndIDs;
+    //! Whether the peer asked to be sent new blocks as "cmpctblock" right away.
+    bool fPreferHeaderAndIDs;
 
     CNodeState()
     {
@@ -237,14 +295,20 @@ struct CNodeState {
         pindexLastCommonBlock = NULL;
         fSyncStarted = false;
         nStallingSince = 0;
+        nHeadersRequested = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
     }
 };
 
 /** Map maintaining per-node state. Requires cs_main. */
 map<NodeId, CNodeState> mapNodeState;
 
+/** The peers we asked to announce new blocks with "cmpctblock", the one asked last at the back. Requires cs_main. */
+list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
 // Requires cs_main.
 CNodeState* State(NodeId pnode)
 {
@@ -299,7 +363,10 @@ void FinalizeNode(NodeId nodeid)
     BOOST_FOREACH (const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
+    mnsigcheckqueue.RemoveNode(nodeid);
+    mempoolcheckqueue.RemoveNode(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -319,7 +386,7 @@ void MarkBlockAsReceived(const uint256& hash)
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
+void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL, const boost::shared_ptr<PartiallyDownloadedBlock>& partialBlock = boost::shared_ptr<PartiallyDownloadedBlock>())
 {
     CNodeState* state = State(nodeid);
     assert(state != NULL);
@@ -327,7 +394,7 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
+    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL, partialBlock};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
@@ -369,6 +436,49 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256& hash)
     }
 }
 
+/** Whether blocks are synced from this peer headers first. */
+bool IsHeadersFirstPeer(const CNode* pnode)
+{
+    return Params().HeadersFirstSyncingActive() && pnode->nVersion >= HEADERS_FIRST_VERSION;
+}
+
+/** Ask a peer for the blocks we miss up to hashStop. Peers that sync headers first send the
+ *  headers, the blocks are then downloaded in parallel by SendMessages. Requires cs_main. */
+void PushGetBlocks(CNode* pnode, const uint256& hashStop)
+{
+    if (IsHeadersFirstPeer(pnode))
+        pnode->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashStop);
+    else
+        pnode->PushMessage("getblocks", chainActive.GetLocator(), hashStop);
+}
+
+/** Ask pfrom, which just gave us our new tip, to announce its next blocks with "cmpctblock" right
+ *  away, and tell the peer asked longest ago to stop once there are too many. Requires cs_main. */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom, const uint256& hashBlock)
+{
+    CNodeState* nodestate = State(pfrom->GetId());
+    if (!nodestate->fProvidesHeaderAndIDs || IsInitialBlockDownload() || chainActive.Tip()->GetBlockHash() != hashBlock)
+        return;
+
+    list<NodeId>::iterator it = find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), pfrom->GetId());
+    if (it != lNodesAnnouncingHeaderAndIDs.end()) {
+        lNodesAnnouncingHeaderAndIDs.splice(lNodesAnnouncingHeaderAndIDs.end(), lNodesAnnouncingHeaderAndIDs, it);
+        return;
+    }
+
+    LOCK(cs_vNodes);
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HIGH_BANDWIDTH_PEERS) {
+        NodeId nodeidOld = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->GetId() == nodeidOld)
+                pnode->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+    }
+    pfrom->PushMessage("sendcmpct", true, CMPCTBLOCKS_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+    LogPrint("cmpctblock", "Asked peer=%d to announce blocks with cmpctblock\n", pfrom->GetId());
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
@@ -551,12 +661,23 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    // A peer flooding us with orphans only ever displaces its own
+    unsigned int& nPeerBytes = mapOrphanPeerBytes[peer];
+    if (nPeerBytes + sz > MAX_ORPHAN_TX_PEER_BYTES) {
+        LogPrint("mempool", "ignoring orphan tx %s, peer=%d keeps %u bytes of orphans already\n", hash.ToString(), peer, nPeerBytes);
+        return false;
+    }
+    nPeerBytes += sz;
+
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nSize = sz;
     BOOST_FOREACH (const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
         mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
     return true;
 }
@@ -567,13 +688,19 @@ void static EraseOrphanTx(uint256 hash)
     if (it == mapOrphanTransactions.end())
         return;
     BOOST_FOREACH (const CTxIn& txin, it->second.tx.vin) {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
         itPrev->second.erase(hash);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    map<NodeId, unsigned int>::iterator itPeer = mapOrphanPeerBytes.find(it->second.fromPeer);
+    if (itPeer != mapOrphanPeerBytes.end()) {
+        itPeer->second -= it->second.nSize;
+        if (itPeer->second == 0)
+            mapOrphanPeerBytes.erase(itPeer);
+    }
     mapOrphanTransactions.erase(it);
 }
 
@@ -595,9 +722,33 @@ void EraseOrphansFor(NodeId peer)
 unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 {
     unsigned int nEvicted = 0;
+
+    // Drop the orphans whose parents did not show up in time, sweeping
+    // at most every ORPHAN_TX_EXPIRE_INTERVAL
+    static int64_t nNextSweep;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end()) {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nErased;
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweep again once the next orphan expires, give or take an interval
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0)
+            LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+    }
+
     while (mapOrphanTransactions.size() > nMaxOrphans) {
         // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
+        uint256 randomhash = GetFastRandomContext().rand256();
         map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
         if (it == mapOrphanTransactions.end())
             it = mapOrphanTransactions.begin();
@@ -607,6 +758,17 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
     return nEvicted;
 }
 
+/** Queue the orphans spending the outputs of tx for reprocessing by ProcessOrphanTx() */
+void static AddOrphanChildrenToWorkSet(const CTransaction& tx, set<uint256>& setWork)
+{
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        map<COutPoint, set<uint256> >::const_iterator itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+        if (itByPrev != mapOrphanTransactionsByPrev.end())
+            setWork.insert(itByPrev->second.begin(), itByPrev->second.end());
+    }
+}
+
 bool IsStandardTx(const CTransaction& tx, string& reason)
 {
     AssertLockHeld(cs_main);
@@ -695,12 +857,13 @@ bool IsStandardTx(const CTransaction& tx, string& reason)
 
 bool IsFinalTx(const CTransaction& tx, int nBlockHeight, int64_t nBlockTime)
 {
-    AssertLockHeld(cs_main);
     // Time based nLockTime implemented in 0.1.6
     if (tx.nLockTime == 0)
         return true;
-    if (nBlockHeight == 0)
+    if (nBlockHeight == 0) {
+        AssertLockHeld(cs_main);
         nBlockHeight = chainActive.Height();
+    }
     if (nBlockTime == 0)
         nBlockTime = GetAdjustedTime();
     if ((int64_t)tx.nLockTime < ((int64_t)tx.nLockTime < LOCKTIME_THRESHOLD ? (int64_t)nBlockHeight : nBlockTime))
@@ -802,6 +965,11 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
 
 int GetInputAge(CTxIn& vin)
 {
+    int nHeight;
+    if (inputHeightCache.Get(vin.prevout.hash, nHeight))
+        return (chainActive.Tip()->nHeight + 1) - nHeight;
+
+    uint64_t nGeneration = inputHeightCache.GetGeneration();
     CCoinsView viewDummy;
     CCoinsViewCache view(&viewDummy);
     {
@@ -813,12 +981,57 @@ int GetInputAge(CTxIn& vin)
 
         if (coins) {
             if (coins->nHeight < 0) return 0;
+            if ((unsigned int)coins->nHeight != MEMPOOL_HEIGHT)
+                inputHeightCache.Add(vin.prevout.hash, coins->nHeight, nGeneration);
             return (chainActive.Tip()->nHeight + 1) - coins->nHeight;
         } else
             return -1;
     }
 }
 
+CBlockIndex* GetUnspentOutputs(const std::vector<COutPoint>& vOutPoints, bool fMempool, std::vector<CUnspentOutput>& vOutputs)
+{
+    std::map<uint256, unsigned int> mapTxPos;
+    std::vector<uint256> vTxids;
+    BOOST_FOREACH (const COutPoint& outpoint, vOutPoints) {
+        if (mapTxPos.insert(std::make_pair(outpoint.hash, vTxids.size())).second)
+            vTxids.push_back(outpoint.hash);
+    }
+
+    LOCK(cs_main);
+    std::vector<CCoins> vCoins;
+    std::vector<bool> vFound;
+    if (fMempool) {
+        LOCK(mempool.cs);
+        CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
+        viewMempool.GetCoinsBatch(vTxids, vCoins, vFound);
+        for (unsigned int i = 0; i < vTxids.size(); i++) {
+            if (vFound[i])
+                mempool.pruneSpent(vTxids[i], vCoins[i]);
+        }
+    } else {
+        pcoinsTip->GetCoinsBatch(vTxids, vCoins, vFound);
+    }
+
+    vOutputs.assign(vOutPoints.size(), CUnspentOutput());
+    for (unsigned int i = 0; i < vOutPoints.size(); i++) {
+        unsigned int nTx = mapTxPos[vOutPoints[i].hash];
+        const CCoins& coins = vCoins[nTx];
+        if (!vFound[nTx] || !coins.IsAvailable(vOutPoints[i].n))
+            continue;
+        CUnspentOutput& output = vOutputs[i];
+        output.fFound = true;
+        output.out = coins.vout[vOutPoints[i].n];
+        output.nHeight = coins.nHeight;
+        output.nVersion = coins.nVersion;
+        output.fCoinBase = coins.fCoinBase;
+        output.fCoinStake = coins.fCoinStake;
+    }
+
+    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+    return it == mapBlockIndex.end() ? NULL : it->second;
+}
+
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
 {
     int sigs = 0;
@@ -826,9 +1039,12 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
     if (nResult < 0) nResult = 0;
 
     if (nResult < 6) {
-        std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-        if (i != mapTxLocks.end()) {
-            sigs = (*i).second.CountSignatures();
+        {
+            LOCK(cs_swifttx);
+            TxLockMap::iterator i = mapTxLocks.find(nTXHash);
+            if (i != mapTxLocks.end()) {
+                sigs = (*i).second.CountSignatures();
+            }
         }
         if (sigs >= SWIFTTX_SIGNATURES_REQUIRED) {
             return nSwiftTXDepth + nResult;
@@ -842,9 +1058,12 @@ int GetIXConfirmations(uint256 nTXHash)
 {
     int sigs = 0;
 
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-    if (i != mapTxLocks.end()) {
-        sigs = (*i).second.CountSignatures();
+    {
+        LOCK(cs_swifttx);
+        TxLockMap::iterator i = mapTxLocks.find(nTXHash);
+        if (i != mapTxLocks.end()) {
+            sigs = (*i).second.CountSignatures();
+        }
     }
     if (sigs >= SWIFTTX_SIGNATURES_REQUIRED) {
         return nSwiftTXDepth;
@@ -1023,7 +1242,27 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int nExpired = pool.Expire(GetTime() - age);
+    if (nExpired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", nExpired);
+
+    pool.TrimToSize(limit);
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectInsaneFee, ignoreFees);
+}
+
+/**
+ * Everything AcceptToMemoryPool checks but the scripts, leaving the inputs in
+ * view, backed by dummy, and the fees in nFeesRet. The free transaction rate
+ * limiter counts tx only with fCountFree, so that a transaction checked twice
+ * counts once.
+ */
+static bool AcceptToMemoryPoolPreChecks(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool fRejectInsaneFee, bool ignoreFees, bool fCountFree, bool* pfMissingInputs, CCoinsView& dummy, CCoinsViewCache& view, CAmount& nFeesRet)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1058,14 +1297,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
     // ----------- swiftTX transaction scanning -----------
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 hashLock;
+    if (FindConflictingLock(tx, hashLock)) {
+        return state.DoS(0,
+            error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
+            REJECT_INVALID, "tx-lock-conflict");
     }
 
     {
@@ -1081,9 +1317,6 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
 
     {
-        CCoinsView dummy;
-        CCoinsViewCache view(&dummy);
-
         CAmount nValueIn = 0;
         {
             LOCK(pool.cs);
@@ -1139,11 +1372,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
         CAmount nValueOut = tx.GetValueOut();
         CAmount nFees = nValueIn - nValueOut;
-        double dPriority = 0;
-        view.GetPriority(tx, chainActive.Height());
-
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
-        unsigned int nSize = entry.GetTxSize();
+        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
         if (!ignoreFees) {
             CAmount txMinFee = GetMinRelayFee(tx, nSize, true);
@@ -1152,6 +1381,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                                         hash.ToString(), nFees, txMinFee),
                     REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+            // While the pool is full or was recently trimmed it needs a
+            // higher fee rate than what it evicted
+            CAmount nMempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (nMempoolRejectFee > 0 && nFees < nMempoolRejectFee)
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                        hash.ToString(), nFees, nMempoolRejectFee),
+                    REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             // Require that free transactions have sufficient priority to be mined in the next block.
             if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1176,8 +1413,10 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 if (dFreeCount >= GetArg("-limitfreerelay", 30) * 10 * 1000)
                     return state.DoS(0, error("AcceptToMemoryPool : free transaction rejected by rate limiter"),
                         REJECT_INSUFFICIENTFEE, "rate limited free transaction");
-                LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount + nSize);
-                dFreeCount += nSize;
+                if (fCountFree) {
+                    LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount + nSize);
+                    dFreeCount += nSize;
+                }
             }
         }
 
@@ -1186,34 +1425,103 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 hash.ToString(),
                 nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
-        // Check against previous transactions
-        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
+        // The cheap checks of CheckInputs, which need mapBlockIndex
+        if (!CheckInputs(tx, state, view, false, STANDARD_SCRIPT_VERIFY_FLAGS, true))
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
-        }
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
-        //
-        // There is a similar check in CreateNewBlock() to prevent creating
-        // invalid blocks, however allowing such transactions into the mempool
-        // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
-            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
-        }
+        nFeesRet = nFees;
+    }
 
-        // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+    return true;
+}
+
+/** The script checks of AcceptToMemoryPool, against inputs resolved by the prechecks */
+static bool AcceptToMemoryPoolScriptChecks(CValidationState& state, const CTransaction& tx, const CCoinsViewCache& view)
+{
+    uint256 hash = tx.GetHash();
+
+    // Check against previous transactions
+    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+    if (!CheckInputScripts(tx, state, view, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
+        return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
+    }
+
+    // Check again against just the consensus-critical mandatory script
+    // verification flags, in case of bugs in the standard flags that cause
+    // transactions to pass as valid when they're actually invalid. For
+    // instance the STRICTENC flag was incorrectly allowing certain
+    // CHECKSIG NOT scripts to pass, even though they were invalid.
+    //
+    // There is a similar check in CreateNewBlock() to prevent creating
+    // invalid blocks, however allowing such transactions into the mempool
+    // can be exploited as a DoS attack.
+    if (!CheckInputScripts(tx, state, view, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
+        return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
     }
 
+    scriptCheckMemo.Add(hash, STANDARD_SCRIPT_VERIFY_FLAGS);
+    return true;
+}
+
+/** Store a transaction that passed all the checks, under cs_main */
+static bool AddToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, CAmount nFees, int64_t nAcceptTime)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = tx.GetHash();
+
+    // Store transaction in memory
+    CTxMemPoolEntry entry(tx, nFees, nAcceptTime, 0, chainActive.Height());
+    pool.addUnchecked(hash, entry);
+
+    // Trim the pool and check that the transaction survived
+    LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    if (!pool.exists(hash))
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+
     SyncWithWallets(tx, NULL);
 
     return true;
 }
 
+bool AcceptToMemoryPoolPreChecks(CTxMemPool& pool, CValidationState& state, CPendingMempoolTx& pending, bool* pfMissingInputs)
+{
+    CAmount nFees = 0;
+    return AcceptToMemoryPoolPreChecks(pool, state, pending.tx, pending.fLimitFree, pending.fRejectInsaneFee, pending.ignoreFees, false, pfMissingInputs, pending.viewDummy, pending.view, nFees);
+}
+
+bool AcceptToMemoryPoolScriptChecks(CValidationState& state, const CPendingMempoolTx& pending)
+{
+    return AcceptToMemoryPoolScriptChecks(state, pending.tx, pending.view);
+}
+
+bool AcceptToMemoryPoolFinish(CTxMemPool& pool, CValidationState& state, const CPendingMempoolTx& pending, bool* pfMissingInputs)
+{
+    // The scripts stay valid: the same outpoints are spent by the same
+    // scriptPubKeys whatever happened to the chain meanwhile
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    CAmount nFees = 0;
+    if (!AcceptToMemoryPoolPreChecks(pool, state, pending.tx, pending.fLimitFree, pending.fRejectInsaneFee, pending.ignoreFees, true, pfMissingInputs, dummy, view, nFees))
+        return false;
+
+    return AddToMemoryPool(pool, state, pending.tx, nFees, pending.nAcceptTime);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool ignoreFees)
+{
+    AssertLockHeld(cs_main);
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    CAmount nFees = 0;
+    if (!AcceptToMemoryPoolPreChecks(pool, state, tx, fLimitFree, fRejectInsaneFee, ignoreFees, true, pfMissingInputs, dummy, view, nFees))
+        return false;
+
+    if (!AcceptToMemoryPoolScriptChecks(state, tx, view))
+        return false;
+
+    return AddToMemoryPool(pool, state, tx, nFees, nAcceptTime);
+}
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
 {
     AssertLockHeld(cs_main);
@@ -1244,14 +1552,11 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
 
     // ----------- swiftTX transaction scanning -----------
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 hashLock;
+    if (FindConflictingLock(tx, hashLock)) {
+        return state.DoS(0,
+            error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
+            REJECT_INVALID, "tx-lock-conflict");
     }
 
     {
@@ -1400,6 +1705,273 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
     return true;
 }
 
+namespace
+{
+/** Size of the magic bytes and length that precede every record in a block or undo file */
+static const unsigned int DISK_RECORD_HEADER_SIZE = MESSAGE_START_SIZE + sizeof(unsigned int);
+
+bool CheckDiskRecordHeader(const char* pchHeader, const CDiskBlockPos& pos, const char* prefix, unsigned int& nSize)
+{
+    if (memcmp(pchHeader, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        return error("%s : no record at position %u of %s%05u.dat", __func__, pos.nPos, prefix, pos.nFile);
+    nSize = ReadLE32((const unsigned char*)pchHeader + MESSAGE_START_SIZE);
+    if (nSize > MAX_BLOCKFILE_SIZE)
+        return error("%s : bad record size %u at position %u of %s%05u.dat", __func__, nSize, pos.nPos, prefix, pos.nFile);
+    return true;
+}
+
+#ifndef WIN32
+/** Read-only descriptor of a block or undo file and its mapping if it has one, or the compressed file replacing it */
+class CBlockFileView : private boost::noncopyable
+{
+public:
+    int fd;
+    const char* pchMap;
+    size_t nMapSize;
+    boost::shared_ptr<CCompressedBlockFile> compressed;
+
+    CBlockFileView() : fd(-1), pchMap(NULL), nMapSize(0) {}
+    ~CBlockFileView()
+    {
+        if (pchMap)
+            munmap((void*)pchMap, nMapSize);
+        if (fd >= 0)
+            close(fd);
+    }
+};
+typedef boost::shared_ptr<CBlockFileView> CBlockFileViewRef;
+#endif
+
+/** One record of a block or undo file, either inside a file mapping or copied into vBuf */
+class CDiskRecord
+{
+public:
+#ifndef WIN32
+    //! Keeps the mapping that pch points into alive
+    CBlockFileViewRef view;
+#endif
+    std::vector<char> vBuf;
+    const char* pch;
+    size_t nSize;
+
+    CDiskRecord() : pch(NULL), nSize(0) {}
+};
+
+bool ReadCompressedRecord(CCompressedBlockFile& file, const CDiskBlockPos& pos, size_t nTrailer, CDiskRecord& record)
+{
+    char pchHeader[DISK_RECORD_HEADER_SIZE];
+    unsigned int nSize;
+    if (!file.Read(pos.nPos - DISK_RECORD_HEADER_SIZE, pchHeader, sizeof(pchHeader)))
+        return error("%s : unable to read position %u of blz%05u.dat", __func__, pos.nPos, pos.nFile);
+    if (!CheckDiskRecordHeader(pchHeader, pos, "blz", nSize))
+        return false;
+    record.vBuf.resize(nSize + nTrailer);
+    if (!file.Read(pos.nPos, &record.vBuf[0], record.vBuf.size()))
+        return error("%s : unable to read %u bytes at position %u of blz%05u.dat", __func__, record.vBuf.size(), pos.nPos, pos.nFile);
+    record.pch = &record.vBuf[0];
+    record.nSize = record.vBuf.size();
+    return true;
+}
+
+#ifndef WIN32
+bool PReadAll(int fd, char* pch, size_t nSize, off_t nOffset)
+{
+    while (nSize > 0) {
+        ssize_t nRead = pread(fd, pch, nSize, nOffset);
+        if (nRead < 0 && errno == EINTR)
+            continue;
+        if (nRead <= 0)
+            return false;
+        pch += nRead;
+        nSize -= nRead;
+        nOffset += nRead;
+    }
+    return true;
+}
+
+/**
+ * Read access to the block and undo files that does not open, seek and close
+ * a FILE for every read. Files before nLastBlockFile are finalized: block files
+ * never change again and undo files only grow, so they are mapped read-only
+ * once and records are deserialized straight from the mapping. The files still
+ * being written keep a cached descriptor that is read with pread. A block
+ * file that was replaced by a compressed blz file is read through that. At
+ * most MAX_BLOCKFILE_VIEWS files are kept open, the least recently used is
+ * dropped.
+ */
+class CBlockFileReader
+{
+private:
+    struct CEntry {
+        CBlockFileViewRef view;
+        uint64_t nLastUse;
+    };
+
+    CCriticalSection cs;
+    std::map<std::pair<unsigned int, bool>, CEntry> mapViews;
+    uint64_t nUseCount;
+
+    static CBlockFileViewRef Open(const CDiskBlockPos& pos, const char* prefix, bool fMap)
+    {
+        boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
+        CBlockFileViewRef view(new CBlockFileView());
+        view->fd = open(path.string().c_str(), O_RDONLY);
+        if (view->fd < 0 && errno == ENOENT && strcmp(prefix, "blk") == 0) {
+            boost::filesystem::path pathCompressed = GetBlockPosFilename(pos, "blz");
+            if (boost::filesystem::exists(pathCompressed)) {
+                view->compressed.reset(new CCompressedBlockFile());
+                if (!view->compressed->Open(pathCompressed))
+                    return CBlockFileViewRef();
+                return view;
+            }
+        }
+        if (view->fd < 0) {
+            LogPrintf("Unable to open file %s\n", path.string());
+            return CBlockFileViewRef();
+        }
+        struct stat st;
+        if (fMap && fstat(view->fd, &st) == 0 && st.st_size > 0) {
+            void* pMap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, view->fd, 0);
+            if (pMap != MAP_FAILED) {
+                view->pchMap = (const char*)pMap;
+                view->nMapSize = st.st_size;
+            } else {
+                LogPrintf("Unable to map file %s, reading it instead: %s\n", path.string(), strerror(errno));
+            }
+        }
+        return view;
+    }
+
+    //! Returns the view to read pos from; fRemap asks for a mapping that covers the current end of the file
+    CBlockFileViewRef GetView(const CDiskBlockPos& pos, bool fUndo, bool fRemap)
+    {
+        bool fFinal;
+        {
+            LOCK(cs_LastBlockFile);
+            fFinal = (int)pos.nFile < nLastBlockFile;
+        }
+
+        LOCK(cs);
+        std::pair<unsigned int, bool> key(pos.nFile, fUndo);
+        std::map<std::pair<unsigned int, bool>, CEntry>::iterator it = mapViews.find(key);
+        if (it != mapViews.end() && (fRemap || (fFinal && !it->second.view->pchMap && !it->second.view->compressed))) {
+            // Readers still holding the old view keep it alive until they are done
+            mapViews.erase(it);
+            it = mapViews.end();
+        }
+        if (it == mapViews.end()) {
+            CBlockFileViewRef view = Open(pos, fUndo ? "rev" : "blk", fFinal);
+            if (!view)
+                return view;
+            if (mapViews.size() >= MAX_BLOCKFILE_VIEWS) {
+                std::map<std::pair<unsigned int, bool>, CEntry>::iterator itOldest = mapViews.begin();
+                for (std::map<std::pair<unsigned int, bool>, CEntry>::iterator itView = mapViews.begin(); itView != mapViews.end(); ++itView)
+                    if (itView->second.nLastUse < itOldest->second.nLastUse)
+                        itOldest = itView;
+                mapViews.erase(itOldest);
+            }
+            it = mapViews.insert(std::make_pair(key, CEntry())).first;
+            it->second.view = view;
+        }
+        it->second.nLastUse = ++nUseCount;
+        return it->second.view;
+    }
+
+public:
+    CBlockFileReader() : nUseCount(0) {}
+
+    /** Read the record at pos, followed by nTrailer bytes that are not counted in its header */
+    bool Read(const CDiskBlockPos& pos, bool fUndo, size_t nTrailer, CDiskRecord& record)
+    {
+        const char* prefix = fUndo ? "rev" : "blk";
+        if (pos.IsNull() || pos.nPos < DISK_RECORD_HEADER_SIZE)
+            return error("%s : invalid position %u in %s%05u.dat", __func__, pos.nPos, prefix, pos.nFile);
+
+        for (int nTry = 0; nTry < 2; nTry++) {
+            CBlockFileViewRef view = GetView(pos, fUndo, nTry > 0);
+            if (!view)
+                return false;
+
+            if (view->compressed)
+                return ReadCompressedRecord(*view->compressed, pos, nTrailer, record);
+
+            unsigned int nSize;
+            if (view->pchMap) {
+                if (pos.nPos > view->nMapSize)
+                    continue;
+                if (!CheckDiskRecordHeader(view->pchMap + pos.nPos - DISK_RECORD_HEADER_SIZE, pos, prefix, nSize))
+                    return false;
+                // An undo file may have grown past the mapping since it was made
+                if (nSize + nTrailer > view->nMapSize - pos.nPos)
+                    continue;
+                record.view = view;
+                record.pch = view->pchMap + pos.nPos;
+                record.nSize = nSize + nTrailer;
+                return true;
+            }
+
+            char pchHeader[DISK_RECORD_HEADER_SIZE];
+            if (!PReadAll(view->fd, pchHeader, sizeof(pchHeader), pos.nPos - DISK_RECORD_HEADER_SIZE))
+                return error("%s : unable to read position %u of %s%05u.dat", __func__, pos.nPos, prefix, pos.nFile);
+            if (!CheckDiskRecordHeader(pchHeader, pos, prefix, nSize))
+                return false;
+            record.vBuf.resize(nSize + nTrailer);
+            if (!PReadAll(view->fd, &record.vBuf[0], record.vBuf.size(), pos.nPos))
+                return error("%s : unable to read %u bytes at position %u of %s%05u.dat", __func__, record.vBuf.size(), pos.nPos, prefix, pos.nFile);
+            record.pch = &record.vBuf[0];
+            record.nSize = record.vBuf.size();
+            return true;
+        }
+        return error("%s : position %u is past the end of %s%05u.dat", __func__, pos.nPos, prefix, pos.nFile);
+    }
+
+    /** Drop the views of a file, so that a file that was deleted releases its space */
+    void Forget(unsigned int nFile, bool fUndo)
+    {
+        LOCK(cs);
+        mapViews.erase(std::make_pair(nFile, fUndo));
+    }
+};
+
+CBlockFileReader blockFileReader;
+#endif
+
+/** Read the block or undo record at pos, followed by nTrailer bytes that are not counted in its header */
+bool ReadDiskRecord(const CDiskBlockPos& pos, bool fUndo, size_t nTrailer, CDiskRecord& record)
+{
+#ifndef WIN32
+    return blockFileReader.Read(pos, fUndo, nTrailer, record);
+#else
+    const char* prefix = fUndo ? "rev" : "blk";
+    if (pos.IsNull() || pos.nPos < DISK_RECORD_HEADER_SIZE)
+        return error("%s : invalid position %u in %s%05u.dat", __func__, pos.nPos, prefix, pos.nFile);
+    if (!fUndo && !boost::filesystem::exists(GetBlockPosFilename(pos, prefix)) && boost::filesystem::exists(GetBlockPosFilename(pos, "blz"))) {
+        CCompressedBlockFile file;
+        if (!file.Open(GetBlockPosFilename(pos, "blz")))
+            return false;
+        return ReadCompressedRecord(file, pos, nTrailer, record);
+    }
+    CAutoFile filein(OpenDiskFile(CDiskBlockPos(pos.nFile, pos.nPos - DISK_RECORD_HEADER_SIZE), prefix, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+    try {
+        char pchHeader[DISK_RECORD_HEADER_SIZE];
+        unsigned int nSize;
+        filein.read(pchHeader, sizeof(pchHeader));
+        if (!CheckDiskRecordHeader(pchHeader, pos, prefix, nSize))
+            return false;
+        record.vBuf.resize(nSize + nTrailer);
+        filein.read(&record.vBuf[0], record.vBuf.size());
+    } catch (std::exception& e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+    record.pch = &record.vBuf[0];
+    record.nSize = record.vBuf.size();
+    return true;
+#endif
+}
+} // anon namespace
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock, bool fAllowSlow)
 {
@@ -1415,13 +1987,14 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
+                CDiskRecord record;
+                if (!ReadDiskRecord(postx, false, 0, record))
+                    return error("%s: ReadDiskRecord failed", __func__);
                 CBlockHeader header;
                 try {
+                    CMemoryReader file(record.pch, record.nSize, SER_DISK, CLIENT_VERSION);
                     file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                    file.ignore(postx.nTxOffset);
                     file >> txOut;
                 } catch (std::exception& e) {
                     return error("%s : Deserialize or I/O error - %s", __func__, e.what());
@@ -1466,13 +2039,65 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
 }
 
 
+int GetAddressIndexType(const CScript& script, uint160& hashBytes)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(script, dest))
+        return ADDRESS_INDEX_NONE;
+    if (const CKeyID* keyID = boost::get<CKeyID>(&dest)) {
+        hashBytes = *keyID;
+        return ADDRESS_INDEX_PUBKEYHASH;
+    }
+    if (const CScriptID* scriptID = boost::get<CScriptID>(&dest)) {
+        hashBytes = *scriptID;
+        return ADDRESS_INDEX_SCRIPTHASH;
+    }
+    return ADDRESS_INDEX_NONE;
+}
+
+bool GetAddressIndex(const uint160& addressHash, int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex, int nStart, int nEnd)
+{
+    if (!fAddressIndex)
+        return error("%s : address index not enabled", __func__);
+    if (!pblocktree->ReadAddressIndex(type, addressHash, vAddressIndex, nStart, nEnd))
+        return error("%s : unable to read address index", __func__);
+    return true;
+}
+
+bool GetAddressUnspent(const uint160& addressHash, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent)
+{
+    if (!fAddressIndex)
+        return error("%s : address index not enabled", __func__);
+    if (!pblocktree->ReadAddressUnspentIndex(type, addressHash, vUnspent))
+        return error("%s : unable to read address unspent index", __func__);
+    return true;
+}
+
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    if (!fSpentIndex)
+        return false;
+    return pblocktree->ReadSpentIndex(key, value);
+}
+
+bool GetTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes)
+{
+    if (!fTimestampIndex)
+        return error("%s : timestamp index not enabled", __func__);
+    if (!pblocktree->ReadTimestampIndex(nHigh, nLow, vHashes))
+        return error("%s : unable to read timestamp index", __func__);
+    return true;
+}
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // CBlock and CBlockIndex
 //
 
-bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
+bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const char* pchRaw, unsigned int nRawSize)
 {
+    CBlockTracePhaseTimer tracePhase(BLOCKTRACE_WRITE_BLOCK);
     // Open history file to append
     CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
@@ -1487,7 +2112,10 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     if (fileOutPos < 0)
         return error("WriteBlockToDisk : ftell failed");
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    if (pchRaw != NULL && nRawSize == nSize)
+        fileout.write(pchRaw, nRawSize);
+    else
+        fileout << block;
 
     return true;
 }
@@ -1496,13 +2124,12 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
     // Read block
+    CDiskRecord record;
+    if (!ReadDiskRecord(pos, false, 0, record))
+        return error("ReadBlockFromDisk : ReadDiskRecord failed");
     try {
+        CMemoryReader filein(record.pch, record.nSize, SER_DISK, CLIENT_VERSION);
         filein >> block;
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
@@ -1517,6 +2144,15 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<char>& vchBlock, const CDiskBlockPos& pos)
+{
+    CDiskRecord record;
+    if (!ReadDiskRecord(pos, false, 0, record))
+        return error("%s : ReadDiskRecord failed", __func__);
+    vchBlock.assign(record.pch, record.pch + record.nSize);
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
     if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
@@ -1762,7 +2398,7 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
 bool CScriptCheck::operator()()
 {
     const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, pcache.get()), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
@@ -1828,47 +2464,262 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         // Skip ECDSA signature verification when connecting blocks
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
-        if (fScriptChecks) {
-            for (unsigned int i = 0; i < tx.vin.size(); i++) {
-                const COutPoint& prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
-
-                // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
-                if (pvChecks) {
-                    pvChecks->push_back(CScriptCheck());
-                    check.swap(pvChecks->back());
-                } else if (!check()) {
-                    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                        // Check whether the failure was caused by a
-                        // non-mandatory script verification check, such as
-                        // non-standard DER encodings or non-null dummy
-                        // arguments; if so, don't trigger DoS protection to
-                        // avoid splitting the network between upgraded and
-                        // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
-                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
-                        if (check())
-                            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
-                    }
-                    // Failures of other flags indicate a transaction that is
-                    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
-                    // such nodes as they are not following the protocol. That
-                    // said during an upgrade careful thought should be taken
-                    // as to the correct behavior - we may want to continue
-                    // peering with non-upgraded nodes even after a soft-fork
-                    // super-majority vote has passed.
-                    return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
-                }
+        if (fScriptChecks)
+            return CheckInputScripts(tx, state, inputs, flags, cacheStore, pvChecks);
+    }
+
+    return true;
+}
+
+bool CheckInputScripts(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks)
+{
+    if (tx.IsCoinBase())
+        return true;
+
+    // Each signature hash covers the whole transaction, what does not
+    // depend on the input is serialized and hashed once for all of them
+    boost::shared_ptr<const CSignatureHashCache> pcache;
+    if (tx.vin.size() >= MIN_SIGHASH_CACHE_INPUTS)
+        pcache.reset(new CSignatureHashCache(tx));
+
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const COutPoint& prevout = tx.vin[i].prevout;
+        const CCoins* coins = inputs.AccessCoins(prevout.hash);
+        assert(coins);
+
+        // Verify signature
+        CScriptCheck check(*coins, tx, i, flags, cacheStore, pcache);
+        if (pvChecks) {
+            pvChecks->push_back(CScriptCheck());
+            check.swap(pvChecks->back());
+        } else if (!check()) {
+            if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+                // Check whether the failure was caused by a
+                // non-mandatory script verification check, such as
+                // non-standard DER encodings or non-null dummy
+                // arguments; if so, don't trigger DoS protection to
+                // avoid splitting the network between upgraded and
+                // non-upgraded nodes.
+                CScriptCheck check(*coins, tx, i,
+                    flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, pcache);
+                if (check())
+                    return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
             }
+            // Failures of other flags indicate a transaction that is
+            // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
+            // such nodes as they are not following the protocol. That
+            // said during an upgrade careful thought should be taken
+            // as to the correct behavior - we may want to continue
+            // peering with non-upgraded nodes even after a soft-fork
+            // super-majority vote has passed.
+            return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
         }
     }
 
     return true;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+CScriptCheckMemo scriptCheckMemo(SCRIPT_CHECK_MEMO_SIZE);
+
+void CScriptCheckMemo::Add(const uint256& txid, unsigned int flags)
+{
+    LOCK(cs);
+    std::pair<std::map<uint256, unsigned int>::iterator, bool> ret = mapFlags.insert(std::make_pair(txid, flags));
+    if (!ret.second) {
+        ret.first->second = flags;
+        return;
+    }
+    queueAdded.push_back(txid);
+    while (queueAdded.size() > nMaxEntries) {
+        mapFlags.erase(queueAdded.front());
+        queueAdded.pop_front();
+    }
+}
+
+bool CScriptCheckMemo::IsChecked(const uint256& txid, unsigned int flags) const
+{
+    LOCK(cs);
+    std::map<uint256, unsigned int>::const_iterator it = mapFlags.find(txid);
+    return it != mapFlags.end() && (flags & ~it->second) == 0;
+}
+
+size_t CScriptCheckMemo::size() const
+{
+    LOCK(cs);
+    return mapFlags.size();
+}
+
+void CScriptCheckMemo::clear()
+{
+    LOCK(cs);
+    mapFlags.clear();
+    queueAdded.clear();
+}
+
+CInputHeightCache inputHeightCache(INPUT_HEIGHT_CACHE_SIZE);
+
+bool CInputHeightCache::Get(const uint256& txid, int& nHeight) const
+{
+    LOCK(cs);
+    boost::unordered_map<uint256, int, BlockHasher>::const_iterator it = mapHeights.find(txid);
+    if (it == mapHeights.end())
+        return false;
+    nHeight = it->second;
+    return true;
+}
+
+uint64_t CInputHeightCache::GetGeneration() const
+{
+    LOCK(cs);
+    return nGeneration;
+}
+
+void CInputHeightCache::Add(const uint256& txid, int nHeight, uint64_t nGenerationRead)
+{
+    LOCK(cs);
+    if (nGenerationRead != nGeneration)
+        return;
+    // The collaterals come back with the next lookups
+    if (mapHeights.size() >= nMaxEntries)
+        mapHeights.clear();
+    mapHeights[txid] = nHeight;
+}
+
+void CInputHeightCache::ConnectBlock(const CBlock& block, int nHeight)
+{
+    LOCK(cs);
+    nGeneration++;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        // Outputs that can never be spent are not kept in the chainstate
+        bool fSpendable = false;
+        BOOST_FOREACH (const CTxOut& txout, tx.vout) {
+            if (!txout.scriptPubKey.IsUnspendable()) {
+                fSpendable = true;
+                break;
+            }
+        }
+        if (fSpendable) {
+            if (mapHeights.size() >= nMaxEntries)
+                mapHeights.clear();
+            mapHeights[tx.GetHash()] = nHeight;
+        }
+        // Its last unspent output may be gone, the next lookup tells
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH (const CTxIn& txin, tx.vin)
+                mapHeights.erase(txin.prevout.hash);
+        }
+    }
+}
+
+void CInputHeightCache::DisconnectBlock(const CBlock& block)
+{
+    LOCK(cs);
+    nGeneration++;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        mapHeights.erase(tx.GetHash());
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH (const CTxIn& txin, tx.vin)
+                mapHeights.erase(txin.prevout.hash);
+        }
+    }
+}
+
+size_t CInputHeightCache::size() const
+{
+    LOCK(cs);
+    return mapHeights.size();
+}
+
+void CInputHeightCache::clear()
+{
+    LOCK(cs);
+    nGeneration++;
+    mapHeights.clear();
+}
+
+CRecentBlockCache recentBlocks(DEFAULT_RECENT_BLOCK_CACHE_BYTES);
+
+void CRecentBlockCache::EraseEntry(std::map<uint256, Entry>::iterator it)
+{
+    nBytes -= it->second.nBytes;
+    setByHeight.erase(std::make_pair(it->second.nHeight, it->first));
+    mapEntries.erase(it);
+}
+
+void CRecentBlockCache::Put(const CBlockIndex* pindex, const CBlock& block, CBlockUndo* pundo)
+{
+    BlockPtr pblockCopy(new CBlock(block));
+    size_t nEntryBytes = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    UndoPtr pundoCopy;
+    if (pundo) {
+        CBlockUndo* pundoNew = new CBlockUndo();
+        pundoNew->vtxundo.swap(pundo->vtxundo);
+        pundoCopy.reset(pundoNew);
+        nEntryBytes += ::GetSerializeSize(*pundoNew, SER_DISK, CLIENT_VERSION);
+    }
+    if (nEntryBytes > nMaxBytes)
+        return;
+
+    LOCK(cs);
+    const uint256 hash = pindex->GetBlockHash();
+    std::map<uint256, Entry>::iterator it = mapEntries.find(hash);
+    if (it != mapEntries.end()) {
+        // A block accepted on a side chain gets its undo data once connected
+        if (!pundoCopy)
+            return;
+        EraseEntry(it);
+    }
+    // The deepest blocks are the least likely to be disconnected
+    while (!setByHeight.empty() && nBytes + nEntryBytes > nMaxBytes)
+        EraseEntry(mapEntries.find(setByHeight.begin()->second));
+    Entry& entry = mapEntries[hash];
+    entry.pblock = pblockCopy;
+    entry.pundo = pundoCopy;
+    entry.nHeight = pindex->nHeight;
+    entry.nBytes = nEntryBytes;
+    setByHeight.insert(std::make_pair(entry.nHeight, hash));
+    nBytes += nEntryBytes;
+}
+
+CRecentBlockCache::BlockPtr CRecentBlockCache::GetBlock(const uint256& hash) const
+{
+    LOCK(cs);
+    std::map<uint256, Entry>::const_iterator it = mapEntries.find(hash);
+    if (it == mapEntries.end()) {
+        metricRecentBlockMisses.Add(1);
+        return BlockPtr();
+    }
+    metricRecentBlockHits.Add(1);
+    return it->second.pblock;
+}
+
+CRecentBlockCache::UndoPtr CRecentBlockCache::GetUndo(const uint256& hash) const
+{
+    LOCK(cs);
+    std::map<uint256, Entry>::const_iterator it = mapEntries.find(hash);
+    if (it == mapEntries.end() || !it->second.pundo) {
+        metricRecentBlockMisses.Add(1);
+        return UndoPtr();
+    }
+    metricRecentBlockHits.Add(1);
+    return it->second.pundo;
+}
+
+void CRecentBlockCache::Prune(int nTipHeight)
+{
+    LOCK(cs);
+    while (!setByHeight.empty() && setByHeight.begin()->first + RECENT_BLOCK_CACHE_DEPTH < nTipHeight)
+        EraseEntry(mapEntries.find(setByHeight.begin()->second));
+}
+
+size_t CRecentBlockCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // The serialized sizes stand in for the blocks and undo data
+    return memusage::DynamicUsage(mapEntries) + memusage::DynamicUsage(setByHeight) + nBytes;
+}
+
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, bool fJustCheck)
 {
     if (pindex->GetBlockHash() != view.GetBestBlock())
         LogPrintf("%s : pindex=%s view=%s\n", __func__, pindex->GetBlockHash().GetHex(), view.GetBestBlock().GetHex());
@@ -1879,22 +2730,41 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
     bool fClean = true;
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock() : no undo data available");
-    if (!blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock() : failure reading undo data");
+    CRecentBlockCache::UndoPtr pundoCached = recentBlocks.GetUndo(pindex->GetBlockHash());
+    CBlockUndo blockUndoRead;
+    if (!pundoCached) {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull())
+            return error("DisconnectBlock() : no undo data available");
+        if (!blockUndoRead.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock() : failure reading undo data");
+    }
+    const CBlockUndo& blockUndo = pundoCached ? *pundoCached : blockUndoRead;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    const bool fAddressIndexUpdate = fAddressIndex && !fJustCheck;
+    const bool fSpentIndexUpdate = fSpentIndex && !fJustCheck;
+    CIndexUpdate indexUpdate;
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction& tx = block.vtx[i];
 
         uint256 hash = tx.GetHash();
 
+        if (fAddressIndexUpdate) {
+            for (unsigned int k = tx.vout.size(); k-- > 0;) {
+                uint160 hashBytes;
+                int type = GetAddressIndexType(tx.vout[k].scriptPubKey, hashBytes);
+                if (type == ADDRESS_INDEX_NONE)
+                    continue;
+                indexUpdate.vAddressIndexErase.push_back(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, hash, k, false));
+                indexUpdate.vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, hash, k), CAddressUnspentValue()));
+            }
+        }
+
         // Check that all outputs are available and match the outputs in the block itself
         // exactly. Note that transactions with only provably unspendable outputs won't
         // have outputs available even in the block itself, so we handle that case
@@ -1943,10 +2813,34 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 if (coins->vout.size() < out.n + 1)
                     coins->vout.resize(out.n + 1);
                 coins->vout[out.n] = undo.txout;
+
+                if (fAddressIndexUpdate || fSpentIndexUpdate) {
+                    uint160 hashBytes;
+                    int type = GetAddressIndexType(undo.txout.scriptPubKey, hashBytes);
+                    if (fAddressIndexUpdate && type != ADDRESS_INDEX_NONE) {
+                        indexUpdate.vAddressIndexErase.push_back(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, hash, j, true));
+                        indexUpdate.vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, out.hash, out.n),
+                            CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, coins->nHeight)));
+                    }
+                    if (fSpentIndexUpdate)
+                        indexUpdate.vSpentIndex.push_back(std::make_pair(CSpentIndexKey(out.hash, out.n), CSpentIndexValue()));
+                }
             }
         }
     }
 
+    if (fTimestampIndex && !fJustCheck)
+        indexUpdate.vTimestampIndexErase.push_back(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash()));
+    if (!fJustCheck) {
+        indexUpdate.vPaymentIndex.push_back(std::make_pair(pindex->nHeight, CPaymentIndexValue()));
+        if (!deterministicMasternodes.DisconnectBlock(pindex, indexUpdate))
+            return state.Abort("Failed to undo the masternode list changes");
+    }
+    if (!indexUpdate.IsEmpty() && !pblocktree->WriteIndexUpdate(indexUpdate))
+        return state.Abort("Failed to write address, spent and timestamp indexes");
+    if (!fJustCheck)
+        masternodePayments.DisconnectBlockPayee(pindex->nHeight);
+
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
@@ -1991,17 +2885,148 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
-static int64_t nTimeVerify = 0;
-static int64_t nTimeConnect = 0;
-static int64_t nTimeIndex = 0;
-static int64_t nTimeCallbacks = 0;
-static int64_t nTimeTotal = 0;
+static CCheckQueue<CBlockCheck> blockcheckqueue(128);
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fAlreadyChecked)
+void ThreadBlockCheck()
+{
+    RenameThread("dystem-blockch");
+    blockcheckqueue.Thread();
+}
+
+bool CBlockCheck::operator()()
+{
+    if (ptx) {
+        CValidationState state;
+        *pnSigOps = GetLegacySigOpCount(*ptx);
+        return CheckTransaction(*ptx, state);
+    }
+    if (pblock) {
+        pblock->fCheckedSignature = pblock->CheckBlockSignature();
+        return true;
+    }
+    // The full pairs are hashed together, an odd node out with itself
+    unsigned int nFullEnd = std::min(nEnd, nLevelSize / 2);
+    if (nBegin < nFullEnd)
+        SHA256D64(pMerkleLevel[nLevelSize + nBegin].begin(), pMerkleLevel[2 * nBegin].begin(), nFullEnd - nBegin);
+    for (unsigned int n = std::max(nBegin, nFullEnd); n < nEnd; n++) {
+        unsigned int i = 2 * n;
+        pMerkleLevel[nLevelSize + n] = Hash(BEGIN(pMerkleLevel[i]), END(pMerkleLevel[i]),
+                                            BEGIN(pMerkleLevel[i]), END(pMerkleLevel[i]));
+    }
+    return true;
+}
+
+/** CBlock::BuildMerkleTree with the large levels hashed on blockcheckqueue */
+static uint256 BuildMerkleTreeParallel(const CBlock& block, bool* fMutated)
+{
+    // Same layout as BuildMerkleTree, sized up front so the checks can write their part of a level
+    std::vector<uint256>& vMerkleTree = block.vMerkleTree;
+    size_t nNodes = 1;
+    for (size_t nSize = block.vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        nNodes += nSize;
+    vMerkleTree.assign(nNodes, uint256());
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        vMerkleTree[i] = block.vtx[i].GetHash();
+
+    bool mutated = false;
+    size_t j = 0;
+    for (size_t nSize = block.vtx.size(); nSize > 1; nSize = (nSize + 1) / 2) {
+        // Two identical hashes at the end of the level, see CVE-2012-2459 in BuildMerkleTree
+        if (nSize % 2 == 0 && vMerkleTree[j + nSize - 2] == vMerkleTree[j + nSize - 1])
+            mutated = true;
+
+        unsigned int nPairs = (nSize + 1) / 2;
+        if (nPairs >= 2 * MERKLE_PAIRS_PER_CHECK) {
+            CCheckQueueControl<CBlockCheck> control(&blockcheckqueue);
+            std::vector<CBlockCheck> vChecks;
+            for (unsigned int n = 0; n < nPairs; n += MERKLE_PAIRS_PER_CHECK)
+                vChecks.push_back(CBlockCheck(&vMerkleTree[j], nSize, n, std::min(n + MERKLE_PAIRS_PER_CHECK, nPairs)));
+            control.Add(vChecks);
+            control.Wait();
+        } else {
+            CBlockCheck check(&vMerkleTree[j], nSize, 0, nPairs);
+            check();
+        }
+        j += nSize;
+    }
+    if (fMutated)
+        *fMutated = mutated;
+    return vMerkleTree.back();
+}
+
+CBlockConnectTimings blockConnectTimings;
+
+void CBlockConnectTimings::SetNull()
+{
+    nBlocks = nTransactions = nInputs = 0;
+    nReadFromDisk = nFetchInputs = nCheckInputs = nConnect = nBlockValue = nVerify = 0;
+    nUndo = nIndex = nCallbacks = nConnectTotal = nFlush = nChainState = nPostConnect = nTotal = 0;
+}
+
+CBlockConnectTimings CBlockConnectTimings::Since(const CBlockConnectTimings& start) const
+{
+    CBlockConnectTimings diff;
+    diff.nBlocks = nBlocks - start.nBlocks;
+    diff.nTransactions = nTransactions - start.nTransactions;
+    diff.nInputs = nInputs - start.nInputs;
+    diff.nReadFromDisk = nReadFromDisk - start.nReadFromDisk;
+    diff.nFetchInputs = nFetchInputs - start.nFetchInputs;
+    diff.nCheckInputs = nCheckInputs - start.nCheckInputs;
+    diff.nConnect = nConnect - start.nConnect;
+    diff.nBlockValue = nBlockValue - start.nBlockValue;
+    diff.nVerify = nVerify - start.nVerify;
+    diff.nUndo = nUndo - start.nUndo;
+    diff.nIndex = nIndex - start.nIndex;
+    diff.nCallbacks = nCallbacks - start.nCallbacks;
+    diff.nConnectTotal = nConnectTotal - start.nConnectTotal;
+    diff.nFlush = nFlush - start.nFlush;
+    diff.nChainState = nChainState - start.nChainState;
+    diff.nPostConnect = nPostConnect - start.nPostConnect;
+    diff.nTotal = nTotal - start.nTotal;
+    return diff;
+}
+
+/**
+ * Whether the scripts of a block can be skipped with -assumevalid: the block is an ancestor of the
+ * assumed valid block, that block is on our best header chain, and that chain is well ahead of the
+ * block, so a few forged headers can't make us skip the scripts of recent blocks. The coins and
+ * amounts of the block are checked either way.
+ */
+static bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    // Log when skipping starts and stops instead of once per block
+    static bool fSkipping = false;
+
+    bool fAssumed = false;
+    std::string strReason;
+    if (hashAssumeValid != 0 && pindexBestHeader) {
+        BlockMap::iterator it = mapBlockIndex.find(hashAssumeValid);
+        if (it == mapBlockIndex.end())
+            strReason = "assumed valid block not in the block index yet";
+        else if (it->second->GetAncestor(pindex->nHeight) != pindex)
+            strReason = "not an ancestor of the assumed valid block";
+        else if (pindexBestHeader->GetAncestor(it->second->nHeight) != it->second)
+            strReason = "assumed valid block not on the best header chain";
+        else if (pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() < ASSUMEVALID_MIN_AGE)
+            strReason = "too close to the best header";
+        else
+            fAssumed = true;
+    }
+
+    if (fAssumed && !fSkipping)
+        LogPrintf("%s: skipping script checks from height %d, ancestor of assumed valid block %s\n", __func__, pindex->nHeight, hashAssumeValid.ToString());
+    else if (!fAssumed && fSkipping)
+        LogPrintf("%s: checking scripts again from height %d, %s\n", __func__, pindex->nHeight, strReason);
+    fSkipping = fAssumed;
+    return fAssumed;
+}
+
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fAlreadyChecked, CBlockUndo* pblockundoOut)
 {
     AssertLockHeld(cs_main);
+    CBlockTracePhaseTimer tracePhase(BLOCKTRACE_CONNECT_BLOCK);
     // Check it again in case a previous version let a bad block in
-    if (!fAlreadyChecked && !CheckBlock(block, state, !fJustCheck, !fJustCheck))
+    if (!fAlreadyChecked && !CheckBlock(block, state, !fJustCheck, !fJustCheck, false))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2013,6 +3038,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == Params().HashGenesisBlock()) {
+        // the masternode list follows the chain from here when it starts empty
+        if (!fJustCheck) {
+            CIndexUpdate indexUpdate;
+            deterministicMasternodes.ConnectBlock(block, pindex, indexUpdate);
+        }
         view.SetBestBlock(pindex->GetBlockHash());
         return true;
     }
@@ -2026,6 +3056,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             REJECT_INVALID, "PoW-ended");
 
     bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    if (fScriptChecks && !fJustCheck)
+        fScriptChecks = !IsAssumedValid(pindex);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -2058,6 +3090,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
+    CIndexUpdate indexUpdate;
     CBlockUndo blockundo;
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     CAmount nValueOut = 0;
@@ -2072,7 +3105,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             return state.DoS(100, error("ConnectBlock() : too many sigops"), REJECT_INVALID, "bad-blk-sigops");
 
         if (!tx.IsCoinBase()) {
-            if (!view.HaveInputs(tx))
+            int64_t nTimeFetch = GetTimeMicros();
+            bool fHaveInputs = view.HaveInputs(tx);
+            blockConnectTimings.nFetchInputs += GetTimeMicros() - nTimeFetch;
+            if (!fHaveInputs)
                 return state.DoS(100, error("ConnectBlock() : inputs missing/spent"),
                     REJECT_INVALID, "bad-txns-inputs-missingorspent");
 
@@ -2089,19 +3125,59 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             std::vector<CScriptCheck> vChecks;
             unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            int64_t nTimeCheck = GetTimeMicros();
+            // The scripts of a transaction taken into the mempool were verified then
+            bool fCheckScripts = fScriptChecks;
+            if (fCheckScripts) {
+                metricScriptMemoLookups.Add();
+                if (scriptCheckMemo.IsChecked(tx.GetHash(), flags)) {
+                    metricScriptMemoHits.Add();
+                    fCheckScripts = false;
+                }
+            }
+            bool fInputsValid = CheckInputs(tx, state, view, fCheckScripts, flags, false, nScriptCheckThreads ? &vChecks : NULL);
+            blockConnectTimings.nCheckInputs += GetTimeMicros() - nTimeCheck;
+            if (!fInputsValid)
                 return false;
             control.Add(vChecks);
         }
         nValueOut += tx.GetValueOut();
 
+        const uint256 txhash = tx.GetHash();
+        if (!tx.IsCoinBase() && (fAddressIndex || fSpentIndex)) {
+            // The inputs are still unspent in the view until UpdateCoins
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const COutPoint& prevout = tx.vin[j].prevout;
+                const CTxOut& prevTxOut = view.AccessCoins(prevout.hash)->vout[prevout.n];
+                uint160 hashBytes;
+                int type = GetAddressIndexType(prevTxOut.scriptPubKey, hashBytes);
+                if (fAddressIndex && type != ADDRESS_INDEX_NONE) {
+                    indexUpdate.vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, txhash, j, true), -prevTxOut.nValue));
+                    indexUpdate.vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, prevout.hash, prevout.n), CAddressUnspentValue()));
+                }
+                if (fSpentIndex)
+                    indexUpdate.vSpentIndex.push_back(std::make_pair(CSpentIndexKey(prevout.hash, prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, prevTxOut.nValue, type, hashBytes)));
+            }
+        }
+        if (fAddressIndex) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut& out = tx.vout[k];
+                uint160 hashBytes;
+                int type = GetAddressIndexType(out.scriptPubKey, hashBytes);
+                if (type == ADDRESS_INDEX_NONE)
+                    continue;
+                indexUpdate.vAddressIndex.push_back(std::make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, txhash, k, false), out.nValue));
+                indexUpdate.vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(type, hashBytes, txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+            }
+        }
+
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
-        vPos.push_back(std::make_pair(tx.GetHash(), pos));
+        vPos.push_back(std::make_pair(txhash, pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
 
@@ -2111,8 +3187,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     pindex->nMint = pindex->nMoneySupply - nMoneySupplyPrev + nFees;
 
     int64_t nTime1 = GetTimeMicros();
-    nTimeConnect += nTime1 - nTimeStart;
-    LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime1 - nTimeStart) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime1 - nTimeStart) / (nInputs - 1), nTimeConnect * 0.000001);
+    blockConnectTimings.nConnect += nTime1 - nTimeStart;
+    LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime1 - nTimeStart) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime1 - nTimeStart) / (nInputs - 1), blockConnectTimings.nConnect * 0.000001);
 
     //PoW phase redistributed fees to miner. PoS stage destroys fees.
     CAmount nExpectedMint = GetBlockValue(pindex->pprev->nHeight);
@@ -2120,16 +3196,20 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         nExpectedMint += nFees;
 
     //Check that the block does not overmint
-    if (!IsBlockValueValid(block, nExpectedMint, pindex->nMint)) {
+    bool fBlockValueValid = IsBlockValueValid(block, nExpectedMint, pindex->nMint);
+    blockConnectTimings.nBlockValue += GetTimeMicros() - nTime1;
+    if (!fBlockValueValid) {
         return state.DoS(100, error("ConnectBlock() : reward pays too much (actual=%s vs limit=%s)",
                 FormatMoney(pindex->nMint), FormatMoney(nExpectedMint)), REJECT_INVALID, "bad-cb-amount");
     }
+    if (!CheckDeterministicMasternodePayee(block, pindex, state))
+        return false;
 
     if (!control.Wait())
         return state.DoS(100, false);
     int64_t nTime2 = GetTimeMicros();
-    nTimeVerify += nTime2 - nTimeStart;
-    LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs - 1), nTimeVerify * 0.000001);
+    blockConnectTimings.nVerify += nTime2 - nTimeStart;
+    LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs - 1), blockConnectTimings.nVerify * 0.000001);
 
     //IMPORTANT NOTE: Nothing before this point should actually store to disk (or even memory)
     if (fJustCheck)
@@ -2139,14 +3219,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
         if (pindex->GetUndoPos().IsNull()) {
             CDiskBlockPos pos;
-            if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+            std::vector<char> vchUndo = blockundo.GetDiskRecord(pindex->nHeight, fCompactUndo, nUndoCompression);
+            if (!FindUndoPos(state, pindex->nFile, pos, vchUndo.size() + 40))
                 return error("ConnectBlock() : FindUndoPos failed");
-            if (!blockundo.WriteToDisk(pos, pindex->pprev->GetBlockHash()))
+            if (!blockundo.WriteToDisk(pos, pindex->pprev->GetBlockHash(), vchUndo))
                 return state.Abort("Failed to write undo data");
 
             // update nUndoPos in block index
             pindex->nUndoPos = pos.nPos;
             pindex->nStatus |= BLOCK_HAVE_UNDO;
+            blockConnectTimings.nUndo += GetTimeMicros() - nTime2;
         }
 
         pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
@@ -2154,15 +3236,25 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     }
 
     if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
-            return state.Abort("Failed to write transaction index");
+        indexUpdate.vTxIndex.swap(vPos);
+    if (fTimestampIndex)
+        indexUpdate.vTimestampIndex.push_back(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash()));
+    // who the block paid, so last paid heights come from the chain rather than from the winner votes
+    CScript payee;
+    if (!GetBlockMasternodePayee(block, payee))
+        payee.clear();
+    indexUpdate.vPaymentIndex.push_back(std::make_pair(pindex->nHeight, CPaymentIndexValue(pindex->GetBlockHash(), payee)));
+    deterministicMasternodes.ConnectBlock(block, pindex, indexUpdate);
+    if (!indexUpdate.IsEmpty() && !pblocktree->WriteIndexUpdate(indexUpdate))
+        return state.Abort("Failed to write transaction indexes");
+    masternodePayments.ConnectBlockPayee(pindex->nHeight, payee);
 
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
     int64_t nTime3 = GetTimeMicros();
-    nTimeIndex += nTime3 - nTime2;
-    LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTime2), nTimeIndex * 0.000001);
+    blockConnectTimings.nIndex += nTime3 - nTime2;
+    LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTime2), blockConnectTimings.nIndex * 0.000001);
 
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
@@ -2170,12 +3262,107 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     hashPrevBestCoinBase = block.vtx[0].GetHash();
 
     int64_t nTime4 = GetTimeMicros();
-    nTimeCallbacks += nTime4 - nTime3;
-    LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime4 - nTime3), nTimeCallbacks * 0.000001);
+    blockConnectTimings.nCallbacks += nTime4 - nTime3;
+    blockConnectTimings.nTransactions += block.vtx.size();
+    blockConnectTimings.nInputs += nInputs;
+    LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime4 - nTime3), blockConnectTimings.nCallbacks * 0.000001);
 
+    if (pblockundoOut)
+        pblockundoOut->vtxundo.swap(blockundo.vtxundo);
     return true;
 }
 
+int GetPruneKeepDepth()
+{
+    int nDepth = std::max((int)MIN_BLOCKS_TO_KEEP, Params().MaxReorganizationDepth());
+    // payees read back from the blocks the payment index misses, proposals and budgets of the cycle
+    nDepth = std::max(nDepth, MNPAYMENTS_HISTORY_BLOCKS);
+    return std::max(nDepth, GetBudgetPaymentCycleBlocks());
+}
+
+uint64_t CalculateCurrentUsage()
+{
+    uint64_t nTotal = 0;
+    BOOST_FOREACH (const CBlockFileInfo& info, vinfoBlockFile)
+        nTotal += info.nSize + info.nUndoSize;
+    return nTotal;
+}
+
+void PruneOneBlockFile(int nFile)
+{
+    AssertLockHeld(cs_main);
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (!(pindex->nStatus & (BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO)) || pindex->nFile != nFile)
+            continue;
+        // nTx stays, so that the chain of the block is still known to have had all its data
+        pindex->nStatus &= ~(BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO);
+        pindex->nFile = 0;
+        pindex->nDataPos = 0;
+        pindex->nUndoPos = 0;
+        setDirtyBlockIndex.insert(pindex);
+
+        // A block downloaded again is linked or made a candidate again from scratch
+        std::pair<multimap<CBlockIndex*, CBlockIndex*>::iterator, multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+        while (range.first != range.second) {
+            if (range.first->second == pindex)
+                mapBlocksUnlinked.erase(range.first++);
+            else
+                range.first++;
+        }
+    }
+    vinfoBlockFile[nFile].SetNull();
+    setDirtyFileInfo.insert(nFile);
+}
+
+void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    BOOST_FOREACH (int nFile, setFilesToPrune) {
+        CDiskBlockPos pos(nFile, 0);
+        boost::system::error_code ec;
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"), ec);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"), ec);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blz"), ec);
+#ifndef WIN32
+        blockFileReader.Forget(nFile, false);
+        blockFileReader.Forget(nFile, true);
+#endif
+        LogPrintf("Prune: deleted blk/rev (%05u)\n", nFile);
+    }
+}
+
+/**
+ * Pick the oldest block files to delete until the block and undo files fit in
+ * nPruneTarget again, leaving the file being written and every file with a
+ * block within GetPruneKeepDepth() of the tip.
+ */
+static void FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0)
+        return;
+    int nLastBlockWeCanPrune = chainActive.Height() - GetPruneKeepDepth();
+    if (nLastBlockWeCanPrune <= 0)
+        return;
+
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    // the chunks the next block and undo data may take
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    int nCount = 0;
+    for (int nFile = 0; nFile < nLastBlockFile && nCurrentUsage + nBuffer >= nPruneTarget; nFile++) {
+        const CBlockFileInfo& info = vinfoBlockFile[nFile];
+        if (info.nSize == 0 || (int)info.nHeightLast > nLastBlockWeCanPrune)
+            continue;
+        nCurrentUsage -= info.nSize + info.nUndoSize;
+        PruneOneBlockFile(nFile);
+        setFilesToPrune.insert(nFile);
+        nCount++;
+    }
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+        nPruneTarget / 1024 / 1024, nCurrentUsage / 1024 / 1024,
+        ((int64_t)nPruneTarget - (int64_t)nCurrentUsage) / 1024 / 1024, nLastBlockWeCanPrune, nCount);
+}
+
 enum FlushStateMode {
     FLUSH_STATE_IF_NEEDED,
     FLUSH_STATE_PERIODIC,
@@ -2190,10 +3377,25 @@ enum FlushStateMode {
 bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 {
     LOCK(cs_main);
+    CBlockTracePhaseTimer tracePhase(BLOCKTRACE_FLUSH_STATE);
     static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+        if (fPruneMode && fCheckForPruning && !fReindex) {
+            FindFilesToPrune(setFilesToPrune);
+            fCheckForPruning = false;
+            if (!setFilesToPrune.empty()) {
+                fFlushForPrune = true;
+                if (!fHavePruned) {
+                    pblocktree->WriteFlag("prunedblockfiles", true);
+                    fHavePruned = true;
+                }
+            }
+        }
+        // The coins cache is over its memory budget.
+        bool fCacheLarge = (mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage;
+        if ((mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fFlushForPrune ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
@@ -2224,11 +3426,25 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             }
             pblocktree->Sync();
             // Finally flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            // Unspent coins stay cached so the next blocks do not start cold;
+            // a flush forced by the cache size also makes room for new ones.
+            size_t nKeepUsage = fCacheLarge ? nCoinCacheUsage / 100 * COINS_CACHE_KEEP_PERCENT : nCoinCacheUsage;
+            if (!pcoinsTip->FlushPartial(nKeepUsage))
                 return state.Abort("Failed to write to coin database");
+            metricCoinsCacheBytes.Set(pcoinsTip->DynamicMemoryUsage());
+            metricCoinsCacheEntries.Set(pcoinsTip->GetCacheSize());
+            metricCoinsCacheLookups.Set(pcoinsTip->GetCacheLookups());
+            metricCoinsCacheHits.Set(pcoinsTip->GetCacheHits());
+            // The coins are written behind validation, unless the caller needs
+            // them on disk or the pruned files may only go once they are
+            if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && pcoinswritebehind && !pcoinswritebehind->Sync())
+                return state.Abort("Failed to write to coin database");
+            // The block index and the chainstate no longer need the pruned files
+            if (fFlushForPrune)
+                UnlinkPrunedFiles(setFilesToPrune);
             // Update best block in wallet (so we can detect restored wallets).
             if (mode != FLUSH_STATE_IF_NEEDED) {
-                GetMainSignals().SetBestChain(chainActive.GetLocator());
+                SyncBestChain(chainActive.GetLocator());
             }
             nLastWrite = GetTimeMicros();
         }
@@ -2244,21 +3460,294 @@ void FlushStateToDisk()
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Set once mempool.dat has been read, so that a dump cannot overwrite it with a half loaded pool */
+static std::atomic<bool> fMempoolLoaded(false);
+
+static bool CompareMempoolEntryByAncestorCount(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b)
+{
+    return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+}
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    int64_t nNow = GetTime();
+    int nAccepted = 0, nFailed = 0, nExpired = 0;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            fMempoolLoaded = true;
+            return error("%s : unknown mempool file version %d", __func__, nVersion);
+        }
+
+        // Deltas go first, they decide whether a prioritised transaction pays enough fee
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t nCount;
+        file >> nCount;
+        std::vector<std::pair<CTransaction, int64_t> > vBatch;
+        vBatch.reserve(LOAD_MEMPOOL_BATCH_SIZE);
+        while (nCount > 0 || !vBatch.empty()) {
+            if (nCount > 0 && vBatch.size() < LOAD_MEMPOOL_BATCH_SIZE) {
+                CTransaction tx;
+                int64_t nTime;
+                file >> tx;
+                file >> nTime;
+                nCount--;
+                if (nTime + nExpiryTimeout > nNow)
+                    vBatch.push_back(std::make_pair(tx, nTime));
+                else
+                    nExpired++;
+                continue;
+            }
+
+            // Only hold cs_main for one batch at a time, so that the node keeps
+            // processing blocks and messages while the pool is refilled
+            {
+                LOCK(cs_main);
+                for (unsigned int i = 0; i < vBatch.size(); i++) {
+                    CValidationState state;
+                    if (AcceptToMemoryPoolWithTime(mempool, state, vBatch[i].first, true, NULL, vBatch[i].second))
+                        nAccepted++;
+                    else
+                        nFailed++;
+                }
+            }
+            vBatch.clear();
+            boost::this_thread::interruption_point();
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired (%dms)\n", nAccepted, nFailed, nExpired, GetTimeMillis() - nStart);
+    fMempoolLoaded = true;
+    return true;
+}
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMicros();
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<const CTxMemPoolEntry*> vEntries;
+    std::vector<std::pair<CTransaction, int64_t> > vInfo;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vEntries.reserve(mempool.mapTx.size());
+        BOOST_FOREACH (const CTxMemPoolEntry& entry, mempool.mapTx)
+            vEntries.push_back(&entry);
+        // Parents have fewer ancestors than their children, so they are written
+        // (and accepted again on load) first
+        std::stable_sort(vEntries.begin(), vEntries.end(), CompareMempoolEntryByAncestorCount);
+        vInfo.reserve(vEntries.size());
+        BOOST_FOREACH (const CTxMemPoolEntry* pentry, vEntries)
+            vInfo.push_back(std::make_pair(pentry->GetTx(), pentry->GetTime()));
+    }
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        if (!filestr)
+            return error("%s : unable to create %s", __func__, pathTmp.string());
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << (uint64_t)vInfo.size();
+        for (unsigned int i = 0; i < vInfo.size(); i++) {
+            file << vInfo[i].first;
+            file << vInfo[i].second;
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+            return error("%s : unable to rename %s", __func__, pathTmp.string());
+    } catch (const std::exception& e) {
+        return error("%s : failed to dump mempool - %s", __func__, e.what());
+    }
+    int64_t nLast = GetTimeMicros();
+    LogPrintf("Dumped mempool: %u transactions, %gs to copy, %gs to dump\n", vInfo.size(), (nMid - nStart) * 0.000001, (nLast - nMid) * 0.000001);
+    return true;
+}
+
+static const uint64_t COINS_CACHE_DUMP_VERSION = 1;
+/** Set once coinscache.dat has been read, so that a dump cannot replace it with the keys of a cold cache */
+static std::atomic<bool> fCoinsCacheLoaded(false);
+
+bool DumpCoinsCache()
+{
+    if (!fCoinsCacheLoaded)
+        return false;
+
+    // The collaterals go first: every masternode ping and payment vote looks them up.
+    // The list is taken before cs_main, as the masternode checks lock it from within mnodeman.cs
+    std::vector<uint256> vTxids;
+    std::set<uint256> setCollaterals;
+    BOOST_FOREACH (const CMasternode& mn, mnodeman.GetFullMasternodeVector()) {
+        if (setCollaterals.insert(mn.vin.prevout.hash).second)
+            vTxids.push_back(mn.vin.prevout.hash);
+    }
+    {
+        LOCK(cs_main);
+        if (pcoinsTip == NULL)
+            return false;
+        pcoinsTip->GetCachedTxids(vTxids, MAX_COINS_CACHE_DUMP);
+    }
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / "coinscache.dat.new";
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        if (!filestr)
+            return error("%s : unable to create %s", __func__, pathTmp.string());
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        file << COINS_CACHE_DUMP_VERSION;
+        file << vTxids;
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "coinscache.dat"))
+            return error("%s : unable to rename %s", __func__, pathTmp.string());
+    } catch (const std::exception& e) {
+        return error("%s : failed to dump coins cache - %s", __func__, e.what());
+    }
+    LogPrintf("Dumped coins cache: %u masternode collaterals and %u cached transactions\n", setCollaterals.size(), vTxids.size() - setCollaterals.size());
+    return true;
+}
+
+void ThreadLoadCoinsCache()
+{
+    RenameThread("dystem-loadcoins");
+    FILE* filestr = fopen((GetDataDir() / "coinscache.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open coins cache file from disk. Continuing anyway.\n");
+        fCoinsCacheLoaded = true;
+        return;
+    }
+
+    std::vector<uint256> vTxids;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != COINS_CACHE_DUMP_VERSION) {
+            fCoinsCacheLoaded = true;
+            error("%s : unknown coins cache file version %d", __func__, nVersion);
+            return;
+        }
+        file >> vTxids;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize coins cache data on disk: %s. Continuing anyway.\n", e.what());
+        fCoinsCacheLoaded = true;
+        return;
+    }
+    file.fclose();
+
+    // Stop well short of -dbcache, so that the warm-up itself does not make
+    // the next periodic flush drop what it read
+    size_t nMaxUsage = nCoinCacheUsage / 100 * COINS_CACHE_KEEP_PERCENT;
+    int64_t nStart = GetTimeMillis();
+    size_t nRead = 0, nFound = 0;
+    while (nRead < vTxids.size()) {
+        // Blocks and transactions arriving during the warm-up wait for one batch at most
+        {
+            LOCK(cs_main);
+            if (pcoinsTip->DynamicMemoryUsage() >= nMaxUsage)
+                break;
+            size_t nEnd = std::min(vTxids.size(), nRead + LOAD_COINS_CACHE_BATCH_SIZE);
+            for (; nRead < nEnd; nRead++) {
+                if (pcoinsTip->AccessCoins(vTxids[nRead]))
+                    nFound++;
+            }
+        }
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            return;
+    }
+
+    metricCoinsCacheWarmed.Add(nFound);
+    LogPrintf("Warmed the coins cache from disk: %u of %u transactions read, %u found (%dms)\n", nRead, vTxids.size(), nFound, GetTimeMillis() - nStart);
+    fCoinsCacheLoaded = true;
+}
+
 /** Update chainActive and related internal data structures. */
+void static PublishChainTip(const CBlockIndex* pindex)
+{
+    boost::shared_ptr<CChainTipSnapshot> psnapshot(new CChainTipSnapshot());
+    if (pindex) {
+        psnapshot->hashBlock = pindex->GetBlockHash();
+        psnapshot->nHeight = pindex->nHeight;
+        psnapshot->nTime = pindex->GetBlockTime();
+        psnapshot->nMedianTimePast = pindex->GetMedianTimePast();
+    }
+    boost::atomic_store(&pchainTipSnapshot, boost::shared_ptr<const CChainTipSnapshot>(psnapshot));
+}
+
+CChainTipSnapshot GetChainTipSnapshot()
+{
+    return *boost::atomic_load(&pchainTipSnapshot);
+}
+
+void GetChainstateMemoryUsage(std::map<std::string, size_t>& mapUsage)
+{
+    AssertLockHeld(cs_main);
+    mapUsage["mapBlockIndex"] = memusage::DynamicUsage(mapBlockIndex) + blockIndexArena.DynamicMemoryUsage();
+    mapUsage["pcoinsTip"] = pcoinsTip ? pcoinsTip->DynamicMemoryUsage() : 0;
+    mapUsage["recentBlocks"] = recentBlocks.DynamicMemoryUsage();
+
+    size_t nUsage = memusage::DynamicUsage(mapOrphanTransactions) + memusage::DynamicUsage(mapOrphanTransactionsByPrev);
+    for (map<uint256, COrphanTx>::const_iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+        nUsage += RecursiveDynamicUsage(it->second.tx);
+    for (map<COutPoint, set<uint256> >::const_iterator it = mapOrphanTransactionsByPrev.begin(); it != mapOrphanTransactionsByPrev.end(); ++it)
+        nUsage += memusage::DynamicUsage(it->second);
+    nUsage += memusage::DynamicUsage(mapOrphanPeerBytes);
+    mapUsage["mapOrphanTransactions"] = nUsage;
+
+    mapUsage["mapRejectedBlocks"] = memusage::DynamicUsage(mapRejectedBlocks);
+}
+
 void static UpdateTip(CBlockIndex* pindexNew)
 {
+    CBlockTracePhaseTimer tracePhase(BLOCKTRACE_UPDATE_TIP);
     chainActive.SetTip(pindexNew);
+    PublishChainTip(pindexNew);
 
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrint("net", "UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrint("net", "UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
+    metricCoinsCacheBytes.Set(pcoinsTip->DynamicMemoryUsage());
+    metricCoinsCacheEntries.Set(pcoinsTip->GetCacheSize());
+    metricCoinsCacheLookups.Set(pcoinsTip->GetCacheLookups());
+    metricCoinsCacheHits.Set(pcoinsTip->GetCacheHits());
 
     // Check the version of the last 100 blocks to see if we need to upgrade:
     static bool fWarned = false;
@@ -2281,15 +3770,53 @@ void static UpdateTip(CBlockIndex* pindexNew)
     }
 }
 
-/** Disconnect chainActive's tip. */
-bool static DisconnectTip(CValidationState& state)
+/**
+ * Put the transactions of the blocks a reorganization disconnected back into
+ * the mempool, in chain order so that parents come before their children,
+ * once per reorganization rather than once per block. Those that are not
+ * accepted, or all of them without fAddToMempool, take their descendants in
+ * the mempool with them.
+ */
+static void UpdateMempoolForReorg(CDisconnectedBlockTransactions& disconnectpool, bool fAddToMempool)
+{
+    AssertLockHeld(cs_main);
+    if (disconnectpool.empty())
+        return;
+
+    int64_t nStart = GetTimeMicros();
+    unsigned int nAccepted = 0;
+    BOOST_FOREACH (const CTransaction& tx, disconnectpool.GetQueued()) {
+        // ignore validation errors in resurrected transactions
+        list<CTransaction> removed;
+        CValidationState stateDummy;
+        if (fAddToMempool && AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+            nAccepted++;
+        else
+            mempool.remove(tx, removed, true);
+    }
+    LogPrint("mempool", "%s: %u of %u disconnected transactions back in the mempool in %.2fms\n", __func__,
+        nAccepted, disconnectpool.size(), (GetTimeMicros() - nStart) * 0.001);
+    disconnectpool.clear();
+
+    mempool.removeCoinbaseSpends(pcoinsTip, chainActive.Height() + 1);
+    mempool.check(pcoinsTip);
+}
+
+/**
+ * Disconnect chainActive's tip. Its transactions wait in disconnectpool for
+ * UpdateMempoolForReorg(), and the mempool may miss their descendants' inputs
+ * until then.
+ */
+bool static DisconnectTip(CValidationState& state, CDisconnectedBlockTransactions& disconnectpool)
 {
     CBlockIndex* pindexDelete = chainActive.Tip();
     assert(pindexDelete);
-    mempool.check(pcoinsTip);
-    // Read block from disk.
+    // Read block from disk, unless it is one of the last ones connected
     CBlock block;
-    if (!ReadBlockFromDisk(block, pindexDelete))
+    CRecentBlockCache::BlockPtr pblockCached = recentBlocks.GetBlock(pindexDelete->GetBlockHash());
+    if (pblockCached)
+        block = *pblockCached;
+    else if (!ReadBlockFromDisk(block, pindexDelete))
         return state.Abort("Failed to read block");
     // Apply the block atomically to the chain state.
     int64_t nStart = GetTimeMicros();
@@ -2299,44 +3826,47 @@ bool static DisconnectTip(CValidationState& state)
             return error("DisconnectTip() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         assert(view.Flush());
     }
+    inputHeightCache.DisconnectBlock(block);
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
-    // Write the chain state to disk, if necessary.
-    if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+    // Write the chain state to disk, if necessary. The database may stay at
+    // the disconnected block, whose data is kept, like for a connected one.
+    if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
-    // Resurrect mempool transactions from the disconnected block.
+    // Keep the transactions of the disconnected block for the mempool,
+    // and give up on the oldest ones of a very deep reorganization
+    disconnectpool.AddBlock(block.vtx);
+    list<CTransaction> vDropped;
+    disconnectpool.TrimToSize(MAX_DISCONNECTED_TX_POOL_SIZE, vDropped);
+    BOOST_FOREACH (const CTransaction& tx, vDropped) {
+        list<CTransaction> removed;
+        mempool.remove(tx, removed, true);
+    }
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
-        CValidationState stateDummy;
-        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || tx.IsCoinStake())
             mempool.remove(tx, removed, true);
     }
-    mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
-    mempool.check(pcoinsTip);
+    // Its transactions are unconfirmed again, and may come back to the mempool
+    recentConfirmed->reset();
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    PruneStakeModifierCache();
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        SyncWithWallets(tx, NULL);
-    }
+    SyncWithWallets(block.vtx, NULL);
     return true;
 }
 
-static int64_t nTimeReadFromDisk = 0;
-static int64_t nTimeConnectTotal = 0;
-static int64_t nTimeFlush = 0;
-static int64_t nTimeChainState = 0;
-static int64_t nTimePostConnect = 0;
-
 /**
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
  */
-bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock* pblock, bool fAlreadyChecked)
+bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock* pblock, bool fAlreadyChecked, CDisconnectedBlockTransactions& disconnectpool)
 {
+    CBlockTracePhaseTimer tracePhase(BLOCKTRACE_CONNECT_TIP);
     assert(pindexNew->pprev == chainActive.Tip());
-    mempool.check(pcoinsTip);
+    if (disconnectpool.empty())
+        mempool.check(pcoinsTip);
     CCoinsViewCache view(pcoinsTip);
 
     if (pblock == NULL)
@@ -2346,18 +3876,23 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
+        // A competing block of a shallow reorganization is still in memory
+        CRecentBlockCache::BlockPtr pblockCached = recentBlocks.GetBlock(pindexNew->GetBlockHash());
+        if (pblockCached)
+            block = *pblockCached;
+        else if (!ReadBlockFromDisk(block, pindexNew))
             return state.Abort("Failed to read block");
         pblock = &block;
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros();
-    nTimeReadFromDisk += nTime2 - nTime1;
+    blockConnectTimings.nReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
-    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, blockConnectTimings.nReadFromDisk * 0.000001);
     {
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked);
+        CBlockUndo blockundo;
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked, &blockundo);
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2365,14 +3900,17 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
             return error("ConnectTip() : ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(inv.hash);
+        recentBlocks.Put(pindexNew, *pblock, &blockundo);
+        recentBlocks.Prune(pindexNew->nHeight);
         nTime3 = GetTimeMicros();
-        nTimeConnectTotal += nTime3 - nTime2;
-        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
+        blockConnectTimings.nConnectTotal += nTime3 - nTime2;
+        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, blockConnectTimings.nConnectTotal * 0.000001);
         assert(view.Flush());
     }
+    inputHeightCache.ConnectBlock(*pblock, pindexNew->nHeight);
     int64_t nTime4 = GetTimeMicros();
-    nTimeFlush += nTime4 - nTime3;
-    LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
+    blockConnectTimings.nFlush += nTime4 - nTime3;
+    LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, blockConnectTimings.nFlush * 0.000001);
 
     // Write the chain state to disk, if necessary. Always write to disk if this is the first of a new file.
     FlushStateMode flushMode = FLUSH_STATE_IF_NEEDED;
@@ -2381,30 +3919,37 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     if (!FlushStateToDisk(state, flushMode))
         return false;
     int64_t nTime5 = GetTimeMicros();
-    nTimeChainState += nTime5 - nTime4;
-    LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
+    blockConnectTimings.nChainState += nTime5 - nTime4;
+    LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, blockConnectTimings.nChainState * 0.000001);
 
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted);
-    mempool.check(pcoinsTip);
+    disconnectpool.RemoveForBlock(pblock->vtx);
+    BOOST_FOREACH (const CTransaction& tx, pblock->vtx)
+        recentConfirmed->insert(tx.GetHash());
+    if (disconnectpool.empty())
+        mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
-    // Tell wallet about transactions that went from mempool
-    // to conflicted:
-    BOOST_FOREACH (const CTransaction& tx, txConflicted) {
-        SyncWithWallets(tx, NULL);
-    }
-    // ... and about transactions that got confirmed:
-    BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
-        SyncWithWallets(tx, pblock);
+    {
+        CBlockTracePhaseTimer tracePhaseWallets(BLOCKTRACE_SYNC_WALLETS);
+        // Tell wallet about transactions that went from mempool
+        // to conflicted:
+        SyncWithWallets(std::vector<CTransaction>(txConflicted.begin(), txConflicted.end()), NULL);
+        // ... and about transactions that got confirmed:
+        SyncWithWallets(pblock->vtx, pblock);
     }
 
     int64_t nTime6 = GetTimeMicros();
-    nTimePostConnect += nTime6 - nTime5;
-    nTimeTotal += nTime6 - nTime1;
-    LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, nTimePostConnect * 0.000001);
-    LogPrint("bench", "- Connect block: %.2fms [%.2fs]\n", (nTime6 - nTime1) * 0.001, nTimeTotal * 0.000001);
+    blockConnectTimings.nPostConnect += nTime6 - nTime5;
+    blockConnectTimings.nTotal += nTime6 - nTime1;
+    blockConnectTimings.nBlocks++;
+    metricBlocksConnected.Add();
+    metricBlockConnectTime.Add(nTime6 - nTime1);
+    metricBlockConnectLast.Set(nTime6 - nTime1);
+    LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, blockConnectTimings.nPostConnect * 0.000001);
+    LogPrint("bench", "- Connect block: %.2fms [%.2fs]\n", (nTime6 - nTime1) * 0.001, blockConnectTimings.nTotal * 0.000001);
     return true;
 }
 
@@ -2415,8 +3960,10 @@ bool DisconnectBlocksAndReprocess(int blocks)
     CValidationState state;
 
     LogPrintf("DisconnectBlocksAndReprocess: Got command to replay %d blocks\n", blocks);
+    CDisconnectedBlockTransactions disconnectpool;
     for (int i = 0; i <= blocks; i++)
-        DisconnectTip(state);
+        DisconnectTip(state, disconnectpool);
+    UpdateMempoolForReorg(disconnectpool, true);
 
     return true;
 }
@@ -2482,10 +4029,12 @@ bool DisconnectBlockAndInputs(CValidationState& state, CTransaction txLock)
 
     if (vDisconnect.size() > 0) {
         LogPrintf("REORGANIZE: Disconnect Conflicting Blocks %lli blocks; %s..\n", vDisconnect.size(), pindexNew->GetBlockHash().ToString());
+        CDisconnectedBlockTransactions disconnectpool;
         BOOST_FOREACH (CBlockIndex* pindex, vDisconnect) {
             LogPrintf(" -- disconnect %s\n", pindex->GetBlockHash().ToString());
-            DisconnectTip(state);
+            DisconnectTip(state, disconnectpool);
         }
+        UpdateMempoolForReorg(disconnectpool, true);
     }
 
     return true;
@@ -2578,9 +4127,12 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
     const CBlockIndex* pindexFork = chainActive.FindFork(pindexMostWork);
 
     // Disconnect active blocks which are no longer in the best chain.
+    CDisconnectedBlockTransactions disconnectpool;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state))
+        if (!DisconnectTip(state, disconnectpool)) {
+            UpdateMempoolForReorg(disconnectpool, false);
             return false;
+        }
     }
 
     // Build list of new blocks to connect.
@@ -2602,7 +4154,7 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
 
         // Connect new blocks.
         BOOST_REVERSE_FOREACH (CBlockIndex* pindexConnect, vpindexToConnect) {
-            if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, fAlreadyChecked)) {
+            if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, fAlreadyChecked, disconnectpool)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
                     if (!state.CorruptionPossible())
@@ -2613,6 +4165,7 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
                     break;
                 } else {
                     // A system error occurred (disk space, database error, ...).
+                    UpdateMempoolForReorg(disconnectpool, false);
                     return false;
                 }
             } else {
@@ -2626,6 +4179,9 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
         }
     }
 
+    // The transactions of the blocks left behind that the new ones did not confirm
+    UpdateMempoolForReorg(disconnectpool, true);
+
     // Callbacks/notifications for a new best chain.
     if (fInvalidFound)
         CheckForkWarningConditionsOnNewFork(vpindexToConnect.back());
@@ -2635,6 +4191,18 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
     return true;
 }
 
+/** Serialize obj once and keep it in the relay cache for the next peer asking for inv */
+template <typename T>
+CRelayCache::StreamPtr static SerializeForRelay(const CInv& inv, const T& obj)
+{
+    CDataStream* pss = new CDataStream(SER_NETWORK, PROTOCOL_VERSION);
+    CRelayCache::StreamPtr ptr(pss);
+    pss->reserve(::GetSerializeSize(obj, SER_NETWORK, PROTOCOL_VERSION));
+    *pss << obj;
+    relayCache.Put(inv, ptr);
+    return ptr;
+}
+
 /**
  * Make the best chain active, in multiple steps. The result is either failure
  * or an activated best chain. pblock is either NULL or a pointer to a block
@@ -2642,6 +4210,7 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
  */
 bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChecked)
 {
+    CBlockTracePhaseTimer tracePhase(BLOCKTRACE_ACTIVATE_BEST_CHAIN);
     CBlockIndex* pindexNewTip = NULL;
     CBlockIndex* pindexMostWork = NULL;
     do {
@@ -2676,15 +4245,33 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                LOCK2(cs_main, cs_vNodes);
+                CInv inv(MSG_BLOCK, hashNewTip);
+                // Peers in high-bandwidth mode get the block itself, as a compact block
+                CRelayCache::StreamPtr pssCmpctBlock;
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    CNodeState* nodestate = State(pnode->GetId());
+                    if (pblock && pblock->GetHash() == hashNewTip && nodestate && nodestate->fPreferHeaderAndIDs) {
+                        {
+                            LOCK(pnode->cs_inventory);
+                            if (pnode->filterInventoryKnown.contains(inv.GetKey()))
+                                continue;
+                        }
+                        if (!pssCmpctBlock)
+                            pssCmpctBlock = SerializeForRelay(CInv(MSG_CMPCT_BLOCK, hashNewTip), CBlockHeaderAndShortTxIDs(*pblock));
+                        pnode->PushMessage("cmpctblock", *pssCmpctBlock);
+                        pnode->AddInventoryKnown(inv);
+                    } else {
+                        pnode->PushInventory(inv);
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
             uiInterface.NotifyBlockTip(hashNewTip);
-            GetMainSignals().UpdatedBlockTip(pindexNewTip);
+            SyncUpdatedBlockTip(pindexNewTip);
 
             unsigned size = GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
             // If the size is over 1 MB notify external listeners, and it is within the last 5 minutes
@@ -2712,6 +4299,7 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex* pindex)
     setDirtyBlockIndex.insert(pindex);
     setBlockIndexCandidates.erase(pindex);
 
+    CDisconnectedBlockTransactions disconnectpool;
     while (chainActive.Contains(pindex)) {
         CBlockIndex* pindexWalk = chainActive.Tip();
         pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
@@ -2719,10 +4307,12 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex* pindex)
         setBlockIndexCandidates.erase(pindexWalk);
         // ActivateBestChain considers blocks already in chainActive
         // unconditionally valid already, so force disconnect away from it.
-        if (!DisconnectTip(state)) {
+        if (!DisconnectTip(state, disconnectpool)) {
+            UpdateMempoolForReorg(disconnectpool, false);
             return false;
         }
     }
+    UpdateMempoolForReorg(disconnectpool, true);
 
     // The resulting new best tip may not be in setBlockIndexCandidates anymore, so
     // add them again.
@@ -2781,8 +4371,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.New(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -2799,53 +4388,67 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
         pindexNew->BuildSkip();
-
-        //update previous block pointer
-        pindexNew->pprev->pnext = pindexNew;
-
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
-        // ppcoin: compute stake entropy bit for stake modifier
-        if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
-            LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
-
-        // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
-            if (!mapProofOfStake.count(hash))
-                LogPrint("net", "AddToBlockIndex() : hashProofOfStake not found in map \n");
-            pindexNew->hashProofOfStake = mapProofOfStake[hash];
-        }
-
-        // ppcoin: compute stake modifier
-        uint64_t nStakeModifier = 0;
-        bool fGeneratedStakeModifier = false;
-        if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
-            LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
-        pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-        pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-        if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
-            LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
     if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
         pindexBestHeader = pindexNew;
 
-    //update previous block pointer
-    if (pindexNew->nHeight)
-        pindexNew->pprev->pnext = pindexNew;
-
     setDirtyBlockIndex.insert(pindexNew);
 
     return pindexNew;
 }
 
+/**
+ * Compute the proof-of-stake fields of a block index. The stake modifier
+ * depends on the coinstakes of the blocks before it, which headers don't
+ * carry, so this runs once the block and all its ancestors have their data.
+ */
+static void ComputeBlockIndexStake(CBlockIndex* pindexNew)
+{
+    if (!pindexNew->pprev)
+        return;
+
+    uint256 hash = pindexNew->GetBlockHash();
+
+    // ppcoin: compute stake entropy bit for stake modifier
+    if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
+        LogPrintf("ComputeBlockIndexStake() : SetStakeEntropyBit() failed \n");
+
+    // ppcoin: proof-of-stake hash value, only needed for the checksum below so
+    // it stays out of the index and is dropped from the side table once used
+    uint256 hashProofOfStake;
+    if (pindexNew->IsProofOfStake()) {
+        map<uint256, uint256>::iterator it = mapProofOfStake.find(hash);
+        if (it == mapProofOfStake.end()) {
+            LogPrint("net", "ComputeBlockIndexStake() : hashProofOfStake not found in map \n");
+        } else {
+            hashProofOfStake = it->second;
+            mapProofOfStake.erase(it);
+        }
+    }
+
+    // ppcoin: compute stake modifier
+    uint64_t nStakeModifier = 0;
+    bool fGeneratedStakeModifier = false;
+    if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
+        LogPrintf("ComputeBlockIndexStake() : ComputeNextStakeModifier() failed \n");
+    pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+    pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew, hashProofOfStake);
+    if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+        LogPrintf("ComputeBlockIndexStake() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
+}
+
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBlockIndex* pindexNew, const CDiskBlockPos& pos)
 {
-    if (block.IsProofOfStake())
+    if (block.IsProofOfStake() && !pindexNew->IsProofOfStake()) {
+        // Indexed from its header, before the coinstake was known
         pindexNew->SetProofOfStake();
+        pindexNew->prevoutStake = block.vtx[1].vin[0].prevout;
+        pindexNew->nStakeTime = block.nTime;
+        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    }
     pindexNew->nTx = block.vtx.size();
     pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
@@ -2864,6 +4467,7 @@ bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBl
         while (!queue.empty()) {
             CBlockIndex* pindex = queue.front();
             queue.pop_front();
+            ComputeBlockIndexStake(pindex);
             pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
             {
                 LOCK(cs_nBlockSequenceId);
@@ -2922,6 +4526,8 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         unsigned int nNewChunks = (vinfoBlockFile[nFile].nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
+            if (fPruneMode)
+                fCheckForPruning = true;
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
                 FILE* file = OpenBlockFile(pos);
                 if (file) {
@@ -2952,6 +4558,8 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     if (nNewChunks > nOldChunks) {
+        if (fPruneMode)
+            fCheckForPruning = true;
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
             FILE* file = OpenUndoFile(pos);
             if (file) {
@@ -2966,7 +4574,7 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     return true;
 }
 
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
+bool CheckBlockHeader(const CBlock& block, CValidationState& state, bool fCheckPOW)
 {
     // Check proof of work matches claimed amount
     if (fCheckPOW && !CheckProofOfWork(block.GetHash(), block.nBits))
@@ -2978,6 +4586,7 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
 
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
 {
+    CBlockTracePhaseTimer tracePhase(BLOCKTRACE_CHECK_BLOCK);
     // These are checks that are independent of context.
 
     // Check that the header is valid (particularly PoW).  This is mostly
@@ -2992,10 +4601,13 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.Invalid(error("CheckBlock() : block timestamp too far in the future"),
             REJECT_INVALID, "time-too-new");
 
+    // Large blocks get their context-free checks done on the block check queue
+    bool fParallel = nScriptCheckThreads && block.vtx.size() >= MIN_PARALLEL_BLOCK_CHECK_TXS;
+
     // Check the merkle root.
-    if (fCheckMerkleRoot) {
+    if (fCheckMerkleRoot && !block.fCheckedMerkleRoot) {
         bool mutated;
-        uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
+        uint256 hashMerkleRoot2 = fParallel ? BuildMerkleTreeParallel(block, &mutated) : block.ComputeMerkleRoot(&mutated);
         if (block.hashMerkleRoot != hashMerkleRoot2)
             return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"),
                 REJECT_INVALID, "bad-txnmrklroot", true);
@@ -3040,20 +4652,41 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
                 return state.DoS(100, error("CheckBlock() : more than one coinstake"));
     }
 
+    // Check transactions, counting their legacy sigops on the way
+    std::vector<unsigned int> vSigOps(block.vtx.size(), 0);
+    bool fTransactionsChecked = false;
+    if (fParallel) {
+        CCheckQueueControl<CBlockCheck> control(&blockcheckqueue);
+        std::vector<CBlockCheck> vChecks;
+        vChecks.reserve(block.vtx.size() + 1);
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+            vChecks.push_back(CBlockCheck(block.vtx[i], &vSigOps[i]));
+        // ProcessNewBlock then finds the signature checked
+        if (fCheckSig && !block.fCheckedSignature)
+            vChecks.push_back(CBlockCheck(block));
+        control.Add(vChecks);
+        fTransactionsChecked = control.Wait();
+    }
+    // Serially, or again to report which transaction failed
+    if (!fTransactionsChecked) {
+        for (unsigned int i = 0; i < block.vtx.size(); i++) {
+            if (!CheckTransaction(block.vtx[i], state))
+                return error("CheckBlock() : CheckTransaction failed");
+            vSigOps[i] = GetLegacySigOpCount(block.vtx[i]);
+        }
+    }
+
     // ----------- swiftTX transaction scanning -----------
     {
         BOOST_FOREACH (const CTransaction& tx, block.vtx) {
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
-                BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                    if (mapLockedInputs.count(in.prevout)) {
-                        if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                            mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
-                            LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString(), tx.GetHash().ToString());
-                            return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
-                                REJECT_INVALID, "conflicting-tx-ix");
-                        }
-                    }
+                uint256 hashLock;
+                if (FindConflictingLock(tx, hashLock)) {
+                    mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
+                    LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", hashLock.ToString(), tx.GetHash().ToString());
+                    return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
+                        REJECT_INVALID, "conflicting-tx-ix");
                 }
             }
         }
@@ -3094,9 +4727,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     }
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        nSigOps += GetLegacySigOpCount(tx);
-    }
+    BOOST_FOREACH (unsigned int nTxSigOps, vSigOps)
+        nSigOps += nTxSigOps;
     if (nSigOps > MAX_BLOCK_SIGOPS_LEGACY)
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
             REJECT_INVALID, "bad-blk-sigops", true);
@@ -3104,7 +4736,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     return true;
 }
 
-bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
+bool CheckWork(const CBlock& block, CBlockIndex* const pindexPrev)
 {
     if (pindexPrev == NULL)
         return error("%s : null pindexPrev for block %s", __func__, block.GetHash().ToString().c_str());
@@ -3127,7 +4759,7 @@ bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
     return true;
 }
 
-bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* const pindexPrev)
+bool ContextualCheckBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex* const pindexPrev)
 {
     uint256 hash = block.GetHash();
 
@@ -3281,9 +4913,10 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     return true;
 }
 
-bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp, bool fAlreadyCheckedBlock)
+bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp, bool fAlreadyCheckedBlock, const char* pchRaw, unsigned int nRawSize)
 {
     AssertLockHeld(cs_main);
+    CBlockTracePhaseTimer tracePhase(BLOCKTRACE_ACCEPT_BLOCK);
 
     CBlockIndex*& pindex = *ppindex;
 
@@ -3315,12 +4948,16 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
 
     if (!AcceptBlockHeader(block, state, &pindex))
         return false;
+    SetBlockTraceHeight(pindex->GetBlockHash(), pindex->nHeight);
 
     if (pindex->nStatus & BLOCK_HAVE_DATA) {
         // TODO: deal better with duplicate blocks.
         // return state.DoS(20, error("AcceptBlock() : already have block %d %s", pindex->nHeight, pindex->GetBlockHash().ToString()), REJECT_DUPLICATE, "duplicate");
         return true;
     }
+    // A block processed before whose data was pruned is not stored again
+    if (pindex->nTx != 0 && fHavePruned && chainActive.Contains(pindex))
+        return true;
 
     if ((!fAlreadyCheckedBlock && !CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
@@ -3341,10 +4978,13 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         if (!FindBlockPos(state, blockPos, nBlockSize + 8, nHeight, block.GetBlockTime(), dbp != NULL))
             return error("AcceptBlock() : FindBlockPos failed");
         if (dbp == NULL)
-            if (!WriteBlockToDisk(block, blockPos))
+            if (!WriteBlockToDisk(block, blockPos, pchRaw, nRawSize))
                 return state.Abort("Failed to write block");
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("AcceptBlock() : ReceivedBlockTransactions failed");
+        // A competing block near the tip is connected again from memory if its chain wins
+        if (dbp == NULL && pindex->pprev != chainActive.Tip() && pindex->nHeight + RECENT_BLOCK_CACHE_DEPTH >= chainActive.Height())
+            recentBlocks.Put(pindex, block, NULL);
     } catch (std::runtime_error& e) {
         return state.Abort(std::string("System error: ") + e.what());
     }
@@ -3413,8 +5053,66 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
+static CScheduler* pschedulerPostTip = NULL;
+//! A run of RunPostTipTasks() is scheduled and has not started yet
+static std::atomic<bool> fPostTipTasksPending(false);
+//! The last height masternodePayments.ProcessBlock() was run for, scheduler thread only
+static int nPostTipPaymentsHeight = 0;
+
+void static RunPostTipTasks()
+{
+    // Cleared first, so that a block arriving meanwhile schedules another run
+    fPostTipTasksPending = false;
+    if (ShutdownRequested())
+        return;
+
+    int64_t nTime0 = GetTimeMicros();
+    if (!fLiteMode && masternodeSync.RequestedMasternodeAssets > MASTERNODE_SYNC_LIST) {
+        // Votes for each block this run covers, as far as they are still ahead
+        // of the tip; after a reorg to a lower height, for the new tip only
+        int nHeight = GetHeight();
+        int nFirst = nHeight;
+        if (nPostTipPaymentsHeight > 0 && nPostTipPaymentsHeight < nHeight)
+            nFirst = std::max(nPostTipPaymentsHeight + 1, nHeight - 9);
+        for (int nBlockHeight = nFirst; nBlockHeight <= nHeight; nBlockHeight++)
+            masternodePayments.ProcessBlock(nBlockHeight + 10);
+        nPostTipPaymentsHeight = nHeight;
+    }
+    int64_t nTime1 = GetTimeMicros();
+    metricPostTipPaymentsTime.Add(nTime1 - nTime0);
+
+    if (!fLiteMode && masternodeSync.RequestedMasternodeAssets > MASTERNODE_SYNC_LIST)
+        budget.NewBlock();
+    int64_t nTime2 = GetTimeMicros();
+    metricPostTipBudgetTime.Add(nTime2 - nTime1);
+
+    // If turned on MultiSend will send a transaction (or more) on the after maturity of a stake
+    if (pwalletMain && pwalletMain->isMultiSendEnabled())
+        pwalletMain->MultiSend();
+    int64_t nTime3 = GetTimeMicros();
+    metricPostTipMultiSendTime.Add(nTime3 - nTime2);
+
+    // If turned on Auto Combine will scan wallet for dust to combine
+    if (pwalletMain && pwalletMain->fCombineDust)
+        pwalletMain->AutoCombineDust();
+    int64_t nTime4 = GetTimeMicros();
+    metricPostTipCombineDustTime.Add(nTime4 - nTime3);
+
+    metricPostTipRuns.Add();
+    LogPrint("bench", "Post-tip tasks: payments %.2fms, budget %.2fms, multisend %.2fms, combine dust %.2fms\n",
+        (nTime1 - nTime0) * 0.001, (nTime2 - nTime1) * 0.001, (nTime3 - nTime2) * 0.001, (nTime4 - nTime3) * 0.001);
+}
+
+void StartPostTipTasks(CScheduler& scheduler)
+{
+    pschedulerPostTip = &scheduler;
+}
+
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp, const char* pchRaw, unsigned int nRawSize)
 {
+    // Blocks received in a message are traced from their arrival by ProcessMessage
+    CBlockTraceScope blockTrace(*pblock, pfrom ? pfrom->GetId() : -1, GetTimeMicros());
+
     // Preliminary checks
     int64_t nStartTime = GetTimeMillis();
     bool checked = CheckBlock(*pblock, state);
@@ -3426,14 +5124,15 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     //    return error("ProcessNewBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, pblock->GetHash().ToString().c_str());
 
     // NovaCoin: check proof-of-stake block signature
-    if (!pblock->CheckBlockSignature())
+    if (!pblock->fCheckedSignature && !pblock->CheckBlockSignature())
         return error("ProcessNewBlock() : bad proof-of-stake block signature");
 
     if (pblock->GetHash() != Params().HashGenesisBlock() && pfrom != NULL) {
         //if we get this far, check if the prev block is our prev block, if not then request sync and return false
         BlockMap::iterator mi = mapBlockIndex.find(pblock->hashPrevBlock);
         if (mi == mapBlockIndex.end()) {
-            pfrom->PushMessage("getblocks", chainActive.GetLocator(), uint256(0));
+            LOCK(cs_main);
+            PushGetBlocks(pfrom, uint256(0));
             return false;
         }
     }
@@ -3448,7 +5147,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
 
         // Store to disk
         CBlockIndex* pindex = NULL;
-        bool ret = AcceptBlock (*pblock, state, &pindex, dbp, checked);
+        bool ret = AcceptBlock (*pblock, state, &pindex, dbp, checked, pchRaw, nRawSize);
         if (pindex && pfrom) {
             mapBlockSource[pindex->GetBlockHash ()] = pfrom->GetId ();
         }
@@ -3460,22 +5159,12 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     if (!ActivateBestChain(state, pblock, checked))
         return error("%s : ActivateBestChain failed", __func__);
 
-    if (!fLiteMode) {
-        if (masternodeSync.RequestedMasternodeAssets > MASTERNODE_SYNC_LIST) {
-            masternodePayments.ProcessBlock(GetHeight() + 10);
-            budget.NewBlock();
-        }
-    }
-
-    if (pwalletMain) {
-        // If turned on MultiSend will send a transaction (or more) on the after maturity of a stake
-        if (pwalletMain->isMultiSendEnabled())
-            pwalletMain->MultiSend();
-
-        // If turned on Auto Combine will scan wallet for dust to combine
-        if (pwalletMain->fCombineDust)
-            pwalletMain->AutoCombineDust();
-    }
+    // The follow-ups wait until the block is relayed and built on; without
+    // the scheduler, as in the tests, they run right away
+    if (pschedulerPostTip == NULL)
+        RunPostTipTasks();
+    else if (!fPostTipTasksPending.exchange(true))
+        pschedulerPostTip->scheduleFromNow(&RunPostTipTasks, 0);
 
     LogPrint("net","%s : ACCEPTED in %ld milliseconds with size=%d\n", __func__, GetTimeMillis() - nStartTime,
               pblock->GetSerializeSize(SER_DISK, CLIENT_VERSION));
@@ -3568,6 +5257,86 @@ boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char
     return GetDataDir() / "blocks" / strprintf("%s%05u.dat", prefix, pos.nFile);
 }
 
+static bool CompressFinalizedBlockFile(const CDiskBlockPos& pos, int nLevel)
+{
+    boost::filesystem::path path = GetBlockPosFilename(pos, "blk");
+    boost::filesystem::path pathCompressed = GetBlockPosFilename(pos, "blz");
+    boost::filesystem::path pathTmp = pathCompressed.string() + ".tmp";
+
+    int64_t nTimeStart = GetTimeMillis();
+    bool fCompressed;
+    try {
+        fCompressed = CompressBlockFile(path, pathTmp, nLevel);
+    } catch (const boost::thread_interrupted&) {
+        boost::system::error_code ec;
+        boost::filesystem::remove(pathTmp, ec);
+        throw;
+    }
+    boost::system::error_code ec;
+    if (!fCompressed || !RenameOver(pathTmp, pathCompressed)) {
+        boost::filesystem::remove(pathTmp, ec);
+        return error("%s : unable to compress blk%05u.dat", __func__, pos.nFile);
+    }
+
+    uintmax_t nRawSize = boost::filesystem::file_size(path, ec);
+    uintmax_t nCompressedSize = boost::filesystem::file_size(pathCompressed, ec);
+    // Readers that already have the file open keep reading it until their view is dropped
+    boost::filesystem::remove(path, ec);
+    if (ec)
+        LogPrintf("%s : unable to remove blk%05u.dat: %s\n", __func__, pos.nFile, ec.message());
+#ifndef WIN32
+    blockFileReader.Forget(pos.nFile, false);
+#endif
+    LogPrintf("Compressed blk%05u.dat: %u to %u bytes (%.1f%%) in %dms\n", pos.nFile, nRawSize, nCompressedSize,
+        nRawSize ? 100.0 * nCompressedSize / nRawSize : 0.0, GetTimeMillis() - nTimeStart);
+    return true;
+}
+
+void ThreadCompressBlockFiles()
+{
+    RenameThread("dystem-blockzip");
+    int nLevel = std::max(1, std::min(9, (int)GetArg("-blockcompression", DEFAULT_BLOCK_COMPRESSION)));
+
+    unsigned int nNextFile = 0;
+    while (true) {
+        // Reindexing reads the raw block files and restores compressed ones
+        if (!fReindex && !fImporting) {
+            unsigned int nLastFile;
+            {
+                LOCK(cs_LastBlockFile);
+                nLastFile = nLastBlockFile;
+            }
+            for (; nNextFile < nLastFile; nNextFile++) {
+                CDiskBlockPos pos(nNextFile, 0);
+                if (boost::filesystem::exists(GetBlockPosFilename(pos, "blk")) && !boost::filesystem::exists(GetBlockPosFilename(pos, "blz")))
+                    CompressFinalizedBlockFile(pos, nLevel);
+            }
+        }
+        MilliSleep(60 * 1000);
+    }
+}
+
+bool RestoreBlockFile(const CDiskBlockPos& pos)
+{
+    boost::filesystem::path path = GetBlockPosFilename(pos, "blk");
+    boost::filesystem::path pathCompressed = GetBlockPosFilename(pos, "blz");
+    if (boost::filesystem::exists(path) || !boost::filesystem::exists(pathCompressed))
+        return true;
+
+    boost::filesystem::path pathTmp = path.string() + ".tmp";
+    boost::system::error_code ec;
+    if (!DecompressBlockFile(pathCompressed, pathTmp) || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp, ec);
+        return error("%s : unable to restore blk%05u.dat from blz%05u.dat", __func__, pos.nFile, pos.nFile);
+    }
+    boost::filesystem::remove(pathCompressed, ec);
+#ifndef WIN32
+    blockFileReader.Forget(pos.nFile, false);
+#endif
+    LogPrintf("Restored blk%05u.dat from blz%05u.dat\n", pos.nFile, pos.nFile);
+    return true;
+}
+
 CBlockIndex* InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -3579,9 +5348,7 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.New();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
     //mark as PoS seen
@@ -3593,67 +5360,153 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+namespace
+{
+/** What LoadBlockIndexDB does beside the chain work pass */
+struct CBlockIndexLoadSideWork {
+    const std::vector<CBlockIndex*>& vSortedByHeight;
+    int nLastBlockFile;
+    std::vector<CBlockFileInfo> vinfoBlockFile;
+    std::string strError;
+    int64_t nSkipTime;
+    int64_t nFileInfoTime;
+
+    CBlockIndexLoadSideWork(const std::vector<CBlockIndex*>& vSortedByHeightIn) : vSortedByHeight(vSortedByHeightIn), nLastBlockFile(0), nSkipTime(0), nFileInfoTime(0) {}
+
+    //! Only writes pskip, which the chain work pass does not read
+    void BuildSkips()
+    {
+        int64_t nStart = GetTimeMicros();
+        BOOST_FOREACH (CBlockIndex* pindex, vSortedByHeight) {
+            if (pindex->pprev)
+                pindex->BuildSkip();
+        }
+        nSkipTime = GetTimeMicros() - nStart;
+    }
+
+    void ReadFileInfo()
+    {
+        int64_t nStart = GetTimeMicros();
+        try {
+            pblocktree->ReadLastBlockFile(nLastBlockFile);
+            vinfoBlockFile.resize(nLastBlockFile + 1);
+            for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
+                pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
+            }
+            for (int nFile = nLastBlockFile + 1; true; nFile++) {
+                CBlockFileInfo info;
+                if (pblocktree->ReadBlockFileInfo(nFile, info)) {
+                    vinfoBlockFile.push_back(info);
+                } else {
+                    break;
+                }
+            }
+        } catch (const std::exception& e) {
+            strError = e.what();
+        }
+        nFileInfoTime = GetTimeMicros() - nStart;
+    }
+};
+
+/** Joins the side work threads however LoadBlockIndexDB leaves, before the side work goes */
+class CSideWorkJoiner
+{
+    boost::thread_group& threadGroup;
+    bool fJoined;
+
+public:
+    explicit CSideWorkJoiner(boost::thread_group& threadGroupIn) : threadGroup(threadGroupIn), fJoined(false) {}
+    ~CSideWorkJoiner() { Join(); }
+
+    void Join()
+    {
+        if (fJoined)
+            return;
+        boost::this_thread::disable_interruption noInterrupt;
+        threadGroup.join_all();
+        fJoined = true;
+    }
+};
+}
+
 bool static LoadBlockIndexDB(string& strError)
 {
+    int64_t nStart = GetTimeMicros();
     if (!pblocktree->LoadBlockIndexGuts())
         return false;
+    int64_t nTimeGuts = GetTimeMicros();
+    LogPrintf("LoadBlockIndexDB(): %u block index entries read in %dms\n", mapBlockIndex.size(), (nTimeGuts - nStart) / 1000);
 
     boost::this_thread::interruption_point();
 
+    // Order by height, a bucket per height as every height is small
+    int nMaxHeight = 0;
+    for (const BlockMap::value_type& item : mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    vector<size_t> vHeightStart(nMaxHeight + 2, 0);
+    for (const BlockMap::value_type& item : mapBlockIndex)
+        vHeightStart[item.second->nHeight + 1]++;
+    for (int nHeight = 1; nHeight <= nMaxHeight + 1; nHeight++)
+        vHeightStart[nHeight] += vHeightStart[nHeight - 1];
+    vector<CBlockIndex*> vSortedByHeight(mapBlockIndex.size());
+    for (const BlockMap::value_type& item : mapBlockIndex)
+        vSortedByHeight[vHeightStart[item.second->nHeight]++] = item.second;
+    int64_t nTimeSort = GetTimeMicros();
+
+    // Skip pointers and block file info are built beside the chain work pass
+    CBlockIndexLoadSideWork sidework(vSortedByHeight);
+    boost::thread_group threadGroup;
+    CSideWorkJoiner joiner(threadGroup);
+    threadGroup.create_thread(boost::bind(&CBlockIndexLoadSideWork::BuildSkips, &sidework));
+    threadGroup.create_thread(boost::bind(&CBlockIndexLoadSideWork::ReadFileInfo, &sidework));
+
     // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    for (const PAIRTYPE(uint256, CBlockIndex*) & item : mapBlockIndex) {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
-            if (pindex->pprev) {
-                if (pindex->pprev->nChainTx) {
-                    pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+    {
+        BOOST_FOREACH (CBlockIndex* pindex, vSortedByHeight) {
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+            // nTx stays set for blocks whose data was pruned
+            if (pindex->nTx > 0) {
+                if (pindex->pprev) {
+                    if (pindex->pprev->nChainTx) {
+                        pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+                    } else {
+                        pindex->nChainTx = 0;
+                        mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
+                    }
                 } else {
-                    pindex->nChainTx = 0;
-                    mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
+                    pindex->nChainTx = pindex->nTx;
                 }
-            } else {
-                pindex->nChainTx = pindex->nTx;
             }
+            if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
+                setBlockIndexCandidates.insert(pindex);
+            if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
+                pindexBestInvalid = pindex;
+            if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
+                pindexBestHeader = pindex;
         }
-        if (pindex->IsValid(BLOCK_VALID_TRANSACTIONS) && (pindex->nChainTx || pindex->pprev == NULL))
-            setBlockIndexCandidates.insert(pindex);
-        if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
-            pindexBestInvalid = pindex;
-        if (pindex->pprev)
-            pindex->BuildSkip();
-        if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
-            pindexBestHeader = pindex;
+        int64_t nTimeWork = GetTimeMicros();
+        joiner.Join();
+        LogPrintf("LoadBlockIndexDB(): sorted in %dms, chain work in %dms, skip pointers in %dms, block file info in %dms\n",
+            (nTimeSort - nTimeGuts) / 1000, (nTimeWork - nTimeSort) / 1000, sidework.nSkipTime / 1000, sidework.nFileInfoTime / 1000);
     }
+    if (!sidework.strError.empty())
+        return error("LoadBlockIndexDB() : failure reading block file info - %s", sidework.strError);
 
     // Load block file info
-    pblocktree->ReadLastBlockFile(nLastBlockFile);
-    vinfoBlockFile.resize(nLastBlockFile + 1);
+    nLastBlockFile = sidework.nLastBlockFile;
+    vinfoBlockFile.swap(sidework.vinfoBlockFile);
     LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
-    for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
-        pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
-    }
     LogPrintf("%s: last block file info: %s\n", __func__, vinfoBlockFile[nLastBlockFile].ToString());
-    for (int nFile = nLastBlockFile + 1; true; nFile++) {
-        CBlockFileInfo info;
-        if (pblocktree->ReadBlockFileInfo(nFile, info)) {
-            vinfoBlockFile.push_back(info);
-        } else {
-            break;
-        }
-    }
+
+    // Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
 
     // Check presence of blk files
     LogPrintf("Checking all blk files are present...\n");
     set<int> setBlkDataFiles;
-    for (const PAIRTYPE(uint256, CBlockIndex*) & item : mapBlockIndex) {
+    for (const BlockMap::value_type& item : mapBlockIndex) {
         CBlockIndex* pindex = item.second;
         if (pindex->nStatus & BLOCK_HAVE_DATA) {
             setBlkDataFiles.insert(pindex->nFile);
@@ -3661,6 +5514,8 @@ bool static LoadBlockIndexDB(string& strError)
     }
     for (std::set<int>::iterator it = setBlkDataFiles.begin(); it != setBlkDataFiles.end(); it++) {
         CDiskBlockPos pos(*it, 0);
+        if (boost::filesystem::exists(GetBlockPosFilename(pos, "blz")))
+            continue;
         if (CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION).IsNull()) {
             return false;
         }
@@ -3680,6 +5535,14 @@ bool static LoadBlockIndexDB(string& strError)
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have the explorer indexes
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    LogPrintf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("timestampindex", fTimestampIndex);
+    LogPrintf("LoadBlockIndexDB(): timestamp index %s\n", fTimestampIndex ? "enabled" : "disabled");
+
     // If this is written true before the next client init, then we know the shutdown process failed
     pblocktree->WriteFlag("shutdown", false);
 
@@ -3688,6 +5551,7 @@ bool static LoadBlockIndexDB(string& strError)
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    PublishChainTip(it->second);
 
     PruneBlockIndexCandidates();
 
@@ -3732,6 +5596,11 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height() - nCheckDepth)
             break;
+        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruning, only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3749,9 +5618,9 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
-            if (!DisconnectBlock(block, state, pindex, coins, &fClean))
+            if (!DisconnectBlock(block, state, pindex, coins, &fClean, true))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
             pindexState = pindex->pprev;
             if (!fClean) {
@@ -3786,12 +5655,186 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
     return true;
 }
 
+namespace
+{
+/** Where a block and its undo data are, copied under cs_main so they can be read without it */
+struct CVerifyBlockEntry {
+    int nHeight;
+    uint256 hashBlock;
+    uint256 hashPrev;
+    CDiskBlockPos pos;
+    CDiskBlockPos posUndo;
+};
+
+/**
+ * Checks levels 0 to 2 of VerifyDB (reading, CheckBlock and the undo data) of
+ * the blocks of a snapshot of the chain, with several threads each taking the
+ * blocks of one block file at a time. Only CheckBlock takes cs_main.
+ */
+class CBlockFilesVerifier
+{
+private:
+    const std::vector<std::vector<CVerifyBlockEntry> >& vFiles;
+    int nCheckLevel;
+    std::atomic<size_t> nNextFile;
+    std::atomic<int> nChecked;
+
+    CCriticalSection cs;
+    //! Lowest height of a block that failed, -1 if none did
+    int nFailedHeight;
+
+    void Fail(const CVerifyBlockEntry& entry, const std::string& strReason)
+    {
+        LogPrintf("VerifyDB() : *** %s at %d, hash=%s\n", strReason, entry.nHeight, entry.hashBlock.ToString());
+        LOCK(cs);
+        if (nFailedHeight < 0 || entry.nHeight < nFailedHeight)
+            nFailedHeight = entry.nHeight;
+    }
+
+    bool Verify(const CVerifyBlockEntry& entry)
+    {
+        CBlock block;
+        // check level 0: read from disk
+        if (!ReadBlockFromDisk(block, entry.pos) || block.GetHash() != entry.hashBlock) {
+            Fail(entry, "ReadBlockFromDisk failed");
+            return false;
+        }
+        // check level 1: verify block validity
+        if (nCheckLevel >= 1) {
+            CValidationState state;
+            LOCK(cs_main);
+            if (!CheckBlock(block, state)) {
+                Fail(entry, "found bad block");
+                return false;
+            }
+        }
+        // check level 2: verify undo validity
+        if (nCheckLevel >= 2 && !entry.posUndo.IsNull()) {
+            CBlockUndo undo;
+            if (!undo.ReadFromDisk(entry.posUndo, entry.hashPrev)) {
+                Fail(entry, "found bad undo data");
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    CBlockFilesVerifier(const std::vector<std::vector<CVerifyBlockEntry> >& vFilesIn, int nCheckLevelIn) : vFiles(vFilesIn), nCheckLevel(nCheckLevelIn), nNextFile(0), nChecked(0), nFailedHeight(-1) {}
+
+    void Run()
+    {
+        for (size_t nFile = nNextFile++; nFile < vFiles.size(); nFile = nNextFile++) {
+            BOOST_FOREACH (const CVerifyBlockEntry& entry, vFiles[nFile]) {
+                boost::this_thread::interruption_point();
+                if (ShutdownRequested())
+                    return;
+                // A failure in this file makes the rest of it suspect too
+                if (!Verify(entry))
+                    break;
+                nChecked++;
+            }
+        }
+    }
+
+    int GetChecked() const { return nChecked; }
+
+    int GetFailedHeight()
+    {
+        LOCK(cs);
+        return nFailedHeight;
+    }
+};
+} // anon namespace
+
+void ThreadVerifyDB()
+{
+    RenameThread("dystem-verifydb");
+    int nCheckLevel = std::max(0, std::min(4, (int)GetArg("-checklevel", DEFAULT_CHECKLEVEL)));
+    int nCheckDepth = GetArg("-checkblocks", DEFAULT_CHECKBLOCKS);
+
+    // Snapshot the blocks to check, grouped by the file they are in
+    std::vector<std::vector<CVerifyBlockEntry> > vFiles;
+    int nHeightTip;
+    {
+        LOCK(cs_main);
+        if (chainActive.Tip() == NULL || chainActive.Tip()->pprev == NULL)
+            return;
+        nHeightTip = chainActive.Height();
+        if (nCheckDepth <= 0 || nCheckDepth > nHeightTip)
+            nCheckDepth = nHeightTip;
+        std::map<int, size_t> mapFileSlot;
+        // as far back as there are blocks, when pruning
+        for (CBlockIndex* pindex = chainActive.Tip(); pindex->pprev && pindex->nHeight >= nHeightTip - nCheckDepth && (pindex->nStatus & BLOCK_HAVE_DATA); pindex = pindex->pprev) {
+            CVerifyBlockEntry entry;
+            entry.nHeight = pindex->nHeight;
+            entry.hashBlock = pindex->GetBlockHash();
+            entry.hashPrev = pindex->pprev->GetBlockHash();
+            entry.pos = pindex->GetBlockPos();
+            entry.posUndo = pindex->GetUndoPos();
+            std::map<int, size_t>::iterator it = mapFileSlot.find(entry.pos.nFile);
+            if (it == mapFileSlot.end()) {
+                it = mapFileSlot.insert(std::make_pair(entry.pos.nFile, vFiles.size())).first;
+                vFiles.push_back(std::vector<CVerifyBlockEntry>());
+            }
+            vFiles[it->second].push_back(entry);
+        }
+    }
+
+    int nThreads = std::max(1, std::min(std::min(MAX_VERIFY_THREADS, (int)boost::thread::hardware_concurrency()), (int)vFiles.size()));
+    LogPrintf("Verifying last %i blocks at level %i in the background, %i block files on %i threads\n", nCheckDepth, std::min(2, nCheckLevel), vFiles.size(), nThreads);
+    int64_t nStart = GetTimeMillis();
+
+    CBlockFilesVerifier verifier(vFiles, nCheckLevel);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CBlockFilesVerifier::Run, &verifier));
+    try {
+        threadGroup.join_all();
+    } catch (const boost::thread_interrupted&) {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
+    if (ShutdownRequested())
+        return;
+
+    int nFailedHeight = verifier.GetFailedHeight();
+    if (nFailedHeight < 0) {
+        LogPrintf("No block database inconsistencies in last %i blocks, checked in %dms\n", verifier.GetChecked(), GetTimeMillis() - nStart);
+        return;
+    }
+
+    // A block file may have been replaced while it was read, e.g. by the
+    // compressor, so confirm with the full check, coins included, before
+    // giving up on the database
+    LogPrintf("%s : block database check failed at height %d, running the full check\n", __func__, nFailedHeight);
+    bool fOk;
+    {
+        LOCK(cs_main);
+        fOk = CVerifyDB().VerifyDB(pcoinsTip, nCheckLevel, chainActive.Height() - nFailedHeight + 1);
+    }
+    if (!fOk && !ShutdownRequested())
+        AbortNode("Corrupted block database detected", _("Corrupted block database detected. Restart with -reindex to rebuild it."));
+}
+
 void UnloadBlockIndex()
 {
+    // The entries are freed now, nothing may point to them anymore
+    ClearStakeModifierCandidates();
+    deterministicMasternodes.Clear();
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     setBlockIndexCandidates.clear();
+    mapBlocksUnlinked.clear();
+    setDirtyBlockIndex.clear();
     chainActive.SetTip(NULL);
+    PublishChainTip(NULL);
     pindexBestInvalid = NULL;
+    pindexBestHeader = NULL;
+    recentRejects.reset();
+    inputHeightCache.clear();
+    recentConfirmed.reset();
 }
 
 bool LoadBlockIndex(string& strError)
@@ -3806,6 +5849,11 @@ bool LoadBlockIndex(string& strError)
 bool InitBlockIndex()
 {
     LOCK(cs_main);
+
+    // Whatever the chain, see AlreadyHave()
+    recentRejects.reset(new CRollingBloomFilter(RECENT_REJECTS_SIZE, 0.000001));
+    recentConfirmed.reset(new CRollingBloomFilter(RECENT_CONFIRMED_SIZE, 0.000001));
+
     // Check whether we're already initialized
     if (chainActive.Genesis() != NULL)
         return true;
@@ -3813,6 +5861,12 @@ bool InitBlockIndex()
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", true);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
+    fSpentIndex = GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
+    fTimestampIndex = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
+    pblocktree->WriteFlag("timestampindex", fTimestampIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3843,6 +5897,178 @@ bool InitBlockIndex()
 }
 
 
+namespace
+{
+/** A block on its way from a block file through the LoadExternalBlockFile pipeline */
+struct CBlockLoadJob {
+    uint64_t nBlockPos;
+    std::vector<char> vRaw;
+    CBlock block;
+    uint256 hash;
+    bool fDone;
+    bool fOk;
+
+    CBlockLoadJob() : nBlockPos(0), fDone(false), fOk(false) {}
+};
+typedef boost::shared_ptr<CBlockLoadJob> CBlockLoadJobRef;
+
+/**
+ * Pipeline behind LoadExternalBlockFile: one thread reads raw blocks from the
+ * file, a few workers deserialize them and do the context-free checks that
+ * are safe without cs_main (hashes, merkle root, block signature), and the
+ * caller connects them in file order. The queues between them are bounded
+ * by MAX_BLOCK_LOAD_QUEUE and MAX_BLOCK_LOAD_QUEUE_BYTES.
+ */
+class CBlockLoader
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condReader; // room in the queue
+    boost::condition_variable condWorker; // blocks to decode, or stopping
+    boost::condition_variable condDone;   // a block was decoded, or the reader finished
+    std::deque<CBlockLoadJobRef> queueOrdered; // every block read, in file order
+    std::deque<CBlockLoadJobRef> queueTodo;    // blocks no worker has taken yet
+    size_t nQueuedBytes;
+    bool fReaderDone;
+    bool fStop;
+    std::string strReadError;
+    boost::thread_group threadGroup;
+
+    void Reader(FILE* fileIn)
+    {
+        try {
+            // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+            CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
+            uint64_t nRewind = blkdat.GetPos();
+            while (!blkdat.eof()) {
+                blkdat.SetPos(nRewind);
+                nRewind++;         // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nRewind = blkdat.GetPos() + 1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                CBlockLoadJobRef job(new CBlockLoadJob());
+                try {
+                    // read block
+                    job->nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(job->nBlockPos + nSize);
+                    job->vRaw.resize(nSize);
+                    blkdat.read(&job->vRaw[0], nSize);
+                    nRewind = blkdat.GetPos();
+                } catch (const std::exception& e) {
+                    LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+                    continue;
+                }
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && !queueOrdered.empty() && (queueOrdered.size() >= MAX_BLOCK_LOAD_QUEUE || nQueuedBytes + nSize > MAX_BLOCK_LOAD_QUEUE_BYTES))
+                    condReader.wait(lock);
+                if (fStop)
+                    break;
+                queueOrdered.push_back(job);
+                queueTodo.push_back(job);
+                nQueuedBytes += nSize;
+                condWorker.notify_one();
+            }
+        } catch (const std::runtime_error& e) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            strReadError = e.what();
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReaderDone = true;
+        condWorker.notify_all();
+        condDone.notify_all();
+    }
+
+    void Worker()
+    {
+        while (true) {
+            CBlockLoadJobRef job;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && queueTodo.empty() && !fReaderDone)
+                    condWorker.wait(lock);
+                if (fStop || queueTodo.empty())
+                    return;
+                job = queueTodo.front();
+                queueTodo.pop_front();
+            }
+            try {
+                CMemoryReader reader(&job->vRaw[0], job->vRaw.size(), SER_DISK, CLIENT_VERSION);
+                reader >> job->block;
+                job->hash = job->block.GetHash();
+                // Only remember checks that passed; failures are reported by CheckBlock as usual.
+                bool fMutated = false;
+                job->block.fCheckedMerkleRoot = job->block.ComputeMerkleRoot(&fMutated) == job->block.hashMerkleRoot && !fMutated;
+                job->block.fCheckedSignature = job->block.CheckBlockSignature();
+                job->fOk = true;
+            } catch (const std::exception& e) {
+                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            job->fDone = true;
+            condDone.notify_all();
+        }
+    }
+
+public:
+    CBlockLoader(FILE* fileIn) : nQueuedBytes(0), fReaderDone(false), fStop(false)
+    {
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency() - 1, MAX_BLOCK_LOAD_THREADS));
+        threadGroup.create_thread(boost::bind(&CBlockLoader::Reader, this, fileIn));
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockLoader::Worker, this));
+    }
+
+    ~CBlockLoader()
+    {
+        boost::this_thread::disable_interruption di;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            condReader.notify_all();
+            condWorker.notify_all();
+        }
+        threadGroup.join_all();
+    }
+
+    //! Wait for the next block in file order; false at the end of the file.
+    bool Next(CBlockLoadJobRef& job)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!(queueOrdered.empty() ? fReaderDone : queueOrdered.front()->fDone))
+            condDone.wait(lock);
+        if (queueOrdered.empty())
+            return false;
+        job = queueOrdered.front();
+        queueOrdered.pop_front();
+        nQueuedBytes -= job->vRaw.size();
+        condReader.notify_one();
+        return true;
+    }
+
+    //! Error that stopped the reader, if any; only meaningful once Next() returned false.
+    std::string GetReadError()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return strReadError;
+    }
+};
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
@@ -3851,45 +6077,19 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 
     int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        CBlockLoader loader(fileIn);
+        CBlockLoadJobRef job;
+        while (loader.Next(job)) {
             boost::this_thread::interruption_point();
-
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
-            }
+            if (!job->fOk)
+                continue;
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
                 if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                    dbp->nPos = job->nBlockPos;
+                CBlock& block = job->block;
 
                 // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
+                uint256 hash = job->hash;
                 if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
                     LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                         block.hashPrevBlock.ToString());
@@ -3900,8 +6100,10 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 
                 // process in case the block isn't known yet
                 if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                    LimitValidationInterfaceQueue();
                     CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, dbp))
+                    // blocks imported from outside the data directory are written out as read
+                    if (ProcessNewBlock(state, NULL, &block, dbp, dbp ? NULL : &job->vRaw[0], job->vRaw.size()))
                         nLoaded++;
                     if (state.IsError())
                         break;
@@ -3931,16 +6133,104 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                         mapBlocksUnknownParent.erase(it);
                     }
                 }
-            } catch (std::exception& e) {
-                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+            } catch (std::exception& e) {
+                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+        }
+        std::string strReadError = loader.GetReadError();
+        if (!strReadError.empty())
+            throw std::runtime_error(strReadError);
+    } catch (std::runtime_error& e) {
+        AbortNode(std::string("System error: ") + e.what());
+    }
+    if (nLoaded > 0)
+        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    return nLoaded > 0;
+}
+
+static void WriteReplayRow(FILE* fileReport, const std::string& strBlock, int nHeight, int64_t nPayee, const CBlockConnectTimings& t)
+{
+    std::string strRow = strprintf("%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n", strBlock, nHeight,
+        t.nBlocks, t.nTransactions, t.nInputs, t.nReadFromDisk, t.nFetchInputs, t.nCheckInputs, t.nConnect, t.nBlockValue, nPayee,
+        t.nVerify, t.nUndo, t.nIndex, t.nCallbacks, t.nConnectTotal, t.nFlush, t.nChainState, t.nPostConnect, t.nTotal, nScriptCheckThreads);
+    fputs(strRow.c_str(), fileReport);
+}
+
+bool ReplayExternalBlockFile(FILE* fileIn, FILE* fileReport)
+{
+    int64_t nStart = GetTimeMillis();
+    fprintf(fileReport, "block,height,connected,txs,inputs,read_us,fetch_inputs_us,check_inputs_us,connect_us,block_value_us,payee_us,"
+                        "verify_us,undo_us,index_us,callbacks_us,connect_total_us,flush_us,chainstate_us,postconnect_us,total_us,par\n");
+
+    CBlockConnectTimings timingsStart;
+    {
+        LOCK(cs_main);
+        timingsStart = blockConnectTimings;
+    }
+    int64_t nPayeeTotal = 0;
+    int nReplayed = 0;
+    bool fOk = true;
+    try {
+        CBlockLoader loader(fileIn);
+        CBlockLoadJobRef job;
+        while (loader.Next(job)) {
+            boost::this_thread::interruption_point();
+            if (!job->fOk)
+                continue;
+            CBlock& block = job->block;
+            const uint256& hash = job->hash;
+
+            // The blocks are replayed in file order, on top of the chain state we start from
+            CBlockConnectTimings timingsBefore;
+            int64_t nPayee = 0;
+            {
+                LOCK(cs_main);
+                BlockMap::iterator mi = mapBlockIndex.find(hash);
+                if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                    continue;
+                if (chainActive.Tip() == NULL || block.hashPrevBlock != chainActive.Tip()->GetBlockHash()) {
+                    LogPrintf("%s: block %s does not extend the tip %s, stopping\n", __func__, hash.ToString(),
+                        chainActive.Tip() ? chainActive.Tip()->GetBlockHash().ToString() : "(none)");
+                    fOk = false;
+                    break;
+                }
+                // CheckBlock skips the masternode and budget payee checks while
+                // catching up, which replaying always is, so they are timed here
+                int64_t nTimePayee = GetTimeMicros();
+                IsBlockPayeeValid(block, chainActive.Height() + 1);
+                nPayee = GetTimeMicros() - nTimePayee;
+                timingsBefore = blockConnectTimings;
+            }
+
+            LimitValidationInterfaceQueue();
+            CValidationState state;
+            bool fProcessed = ProcessNewBlock(state, NULL, &block, NULL, &job->vRaw[0], job->vRaw.size());
+
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
+            int nHeight = mi == mapBlockIndex.end() ? -1 : mi->second->nHeight;
+            WriteReplayRow(fileReport, hash.ToString(), nHeight, nPayee, blockConnectTimings.Since(timingsBefore));
+            nPayeeTotal += nPayee;
+            nReplayed++;
+            if (!fProcessed || state.IsError() || chainActive.Tip()->GetBlockHash() != hash) {
+                LogPrintf("%s: block %s was not connected, stopping\n", __func__, hash.ToString());
+                fOk = false;
+                break;
             }
         }
+        std::string strReadError = loader.GetReadError();
+        if (!strReadError.empty())
+            throw std::runtime_error(strReadError);
     } catch (std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
+        fOk = false;
     }
-    if (nLoaded > 0)
-        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
+
+    LOCK(cs_main);
+    WriteReplayRow(fileReport, "total", chainActive.Height(), nPayeeTotal, blockConnectTimings.Since(timingsStart));
+    fflush(fileReport);
+    LogPrintf("Replayed %i blocks from external file in %dms\n", nReplayed, GetTimeMillis() - nStart);
+    return fOk;
 }
 
 void static CheckBlockIndex()
@@ -3979,6 +6269,7 @@ void static CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL;         // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL;         // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL;  // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL;    // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL;   // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
@@ -3986,6 +6277,7 @@ void static CheckBlockIndex()
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -3996,12 +6288,19 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); // Genesis block's hash must match.
             assert(pindex == chainActive.Genesis());                       // The current active chain's genesis block must be this block.
         }
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+        if (!fHavePruned) {
+            // If we've never pruned, then HAVE_DATA should be equivalent to nTx > 0
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else {
+            // If we have pruned, then we can only say that HAVE_DATA implies nTx > 0
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
         assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0); // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0));                                             // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // All parents having had data (at some point) is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0));                                      // nChainTx == 0 is used to signal that all parent block's transaction data is available.
         assert(pindex->nHeight == nHeight);                                                                          // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork);                            // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight)));                                // The pskip pointer must point back for all but the first 2 blocks.
@@ -4013,9 +6312,12 @@ void static CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
-                assert(setBlockIndexCandidates.count(pindex));
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            if (pindexFirstInvalid == NULL) {
+                // If this block sorts at least as good as the current tip and is valid and we have all data for its parents, it must be in setBlockIndexCandidates.
+                // chainActive.Tip() must also be there even if some data has been pruned.
+                if (pindexFirstMissing == NULL || pindex == chainActive.Tip())
+                    assert(setBlockIndexCandidates.count(pindex));
             }
         } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
             assert(setBlockIndexCandidates.count(pindex) == 0);
@@ -4031,12 +6333,22 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) assert(!foundInUnlinked); // Can't be in mapBlocksUnlinked if we don't HAVE_DATA
+        if (pindexFirstMissing == NULL) assert(!foundInUnlinked);           // We aren't missing data for any parent -- cannot be in mapBlocksUnlinked.
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
+            // We HAVE_DATA for this block, have received data for all parents at some point, but we're currently missing data for some parent.
+            assert(fHavePruned); // We must have pruned.
+            // This block may have entered mapBlocksUnlinked if it has a descendant that at some point had more work
+            // than the tip, and we tried switching to it while missing data for some block between chainActive and it.
+            // So if this block is itself better than chainActive.Tip() and it wasn't in setBlockIndexCandidates, then it must be in mapBlocksUnlinked.
+            if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && setBlockIndexCandidates.count(pindex) == 0) {
+                if (pindexFirstInvalid == NULL)
+                    assert(foundInUnlinked);
             }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
-            assert(!foundInUnlinked);
         }
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
@@ -4056,6 +6368,7 @@ void static CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -4144,22 +6457,43 @@ string GetWarnings(string strFor)
 //
 
 
+/** Whether txid was turned down since the tip last changed */
+static bool IsRecentlyRejected(const uint256& txid)
+{
+    AssertLockHeld(cs_main);
+    assert(recentRejects);
+    if (chainActive.Tip()->GetBlockHash() != hashRecentRejectsChainTip) {
+        // The new tip may have made them valid, by confirming the inputs
+        // they missed or by taking out what they double spent
+        hashRecentRejectsChainTip = chainActive.Tip()->GetBlockHash();
+        recentRejects->reset();
+    }
+    return recentRejects->contains(txid);
+}
+
 bool static AlreadyHave(const CInv& inv)
 {
     switch (inv.type) {
     case MSG_TX: {
-        bool txInMap = false;
-        txInMap = mempool.exists(inv.hash);
-        return txInMap || mapOrphanTransactions.count(inv.hash) ||
-               pcoinsTip->HaveCoins(inv.hash);
+        // A transaction confirmed longer ago is fetched again and turned down by
+        // AcceptToMemoryPool, which is rare enough not to go to disk for every inv
+        return IsRecentlyRejected(inv.hash) ||
+               mempool.exists(inv.hash) ||
+               mapOrphanTransactions.count(inv.hash) ||
+               recentConfirmed->contains(inv.hash) ||
+               pcoinsTip->HaveCoinsInCache(inv.hash);
     }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
-    case MSG_TXLOCK_REQUEST:
+    case MSG_TXLOCK_REQUEST: {
+        LOCK(cs_swifttx);
         return mapTxLockReq.count(inv.hash) ||
                mapTxLockReqRejected.count(inv.hash);
-    case MSG_TXLOCK_VOTE:
+    }
+    case MSG_TXLOCK_VOTE: {
+        LOCK(cs_swifttx);
         return mapTxLockVote.count(inv.hash);
+    }
     
     case MSG_SPORK:
         return 0;
@@ -4200,12 +6534,37 @@ bool static AlreadyHave(const CInv& inv)
         }
         return false;
     case MSG_MASTERNODE_PING:
-        return mnodeman.mapSeenMasternodePing.count(inv.hash);
+        return mnodeman.IsPingSeen(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
 }
 
+//! The bloom filter data of the last block sent filtered, as SPV peers mostly ask for the same new blocks
+static CCriticalSection cs_filteredBlockTxData;
+static uint256 hashFilteredBlockTxData;
+static boost::shared_ptr<const std::vector<CBloomFilterTx> > pfilteredBlockTxData;
+
+static boost::shared_ptr<const std::vector<CBloomFilterTx> > GetFilteredBlockTxData(const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    {
+        LOCK(cs_filteredBlockTxData);
+        if (pfilteredBlockTxData && hashFilteredBlockTxData == hash)
+            return pfilteredBlockTxData;
+    }
+
+    boost::shared_ptr<std::vector<CBloomFilterTx> > pTxData(new std::vector<CBloomFilterTx>());
+    pTxData->reserve(block.vtx.size());
+    BOOST_FOREACH (const CTransaction& tx, block.vtx)
+        pTxData->push_back(CBloomFilterTx(tx));
+
+    LOCK(cs_filteredBlockTxData);
+    hashFilteredBlockTxData = hash;
+    pfilteredBlockTxData = pTxData;
+    return pfilteredBlockTxData;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -4224,7 +6583,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -4241,19 +6600,57 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
+                // Historical blocks only as long as -maxuploadtarget allows, whitelisted peers excepted
+                if (send && !pfrom->fWhitelisted && CNode::OutboundTargetReached(true) &&
+                    mi->second->GetBlockTime() < chainActive.Tip()->GetBlockTime() - HISTORICAL_BLOCK_AGE) {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    // Blocks for a syncing peer go behind the fresh blocks and votes sent to it
+                    bool fBulk = mi->second->nHeight < chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    if (inv.type == MSG_BLOCK) {
+                        // Send block from the relay cache, or from disk
+                        CRelayCache::StreamPtr pss = relayCache.Get(inv);
+                        if (!pss) {
+                            CBlock block;
+                            if (!ReadBlockFromDisk(block, (*mi).second))
+                                assert(!"cannot load block from disk");
+                            pss = SerializeForRelay(inv, block);
+                        }
+                        if (fBulk)
+                            pfrom->PushBulkMessage("block", *pss);
+                        else
+                            pfrom->PushMessage("block", *pss);
+                    } else if (inv.type == MSG_CMPCT_BLOCK) {
+                        // The transactions of older blocks have mostly left the mempools, send those whole
+                        bool fWhole = fBulk;
+                        CInv invSend(fWhole ? MSG_BLOCK : MSG_CMPCT_BLOCK, inv.hash);
+                        CRelayCache::StreamPtr pss = relayCache.Get(invSend);
+                        if (!pss) {
+                            CBlock block;
+                            if (!ReadBlockFromDisk(block, (*mi).second))
+                                assert(!"cannot load block from disk");
+                            if (fWhole)
+                                pss = SerializeForRelay(invSend, block);
+                            else
+                                pss = SerializeForRelay(invSend, CBlockHeaderAndShortTxIDs(block));
+                        }
+                        if (fWhole)
+                            pfrom->PushBulkMessage("block", *pss);
+                        else
+                            pfrom->PushMessage("cmpctblock", *pss);
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
+                        boost::shared_ptr<const std::vector<CBloomFilterTx> > pTxData = GetFilteredBlockTxData(block);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                            CMerkleBlock merkleBlock(block, *pfrom->pfilter, *pTxData);
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
@@ -4262,9 +6659,15 @@ void static ProcessGetData(CNode* pfrom)
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                            BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn) {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second).GetKey());
+                                }
+                                if (!fKnown)
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
                         }
                         // else
                         // no response
@@ -4304,22 +6707,32 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
-                    if (mapTxLockVote.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockVote[inv.hash];
-                        pfrom->PushMessage("txlvote", ss);
-                        pushed = true;
+                    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    {
+                        LOCK(cs_swifttx);
+                        TxLockVoteMap::const_iterator it = mapTxLockVote.find(inv.hash);
+                        if (it != mapTxLockVote.end()) {
+                            ss.reserve(1000);
+                            ss << it->second;
+                            pushed = true;
+                        }
                     }
+                    if (pushed)
+                        pfrom->PushMessage("txlvote", ss);
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
-                    if (mapTxLockReq.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockReq[inv.hash];
-                        pfrom->PushMessage("ix", ss);
-                        pushed = true;
+                    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                    {
+                        LOCK(cs_swifttx);
+                        TxLockReqMap::const_iterator it = mapTxLockReq.find(inv.hash);
+                        if (it != mapTxLockReq.end()) {
+                            ss.reserve(1000);
+                            ss << it->second;
+                            pushed = true;
+                        }
                     }
+                    if (pushed)
+                        pfrom->PushMessage("ix", ss);
                 }
                 if (!pushed && inv.type == MSG_SPORK) {
                     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
@@ -4327,19 +6740,21 @@ void static ProcessGetData(CNode* pfrom)
                     pushed = true;
                 }
                 if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
-                    if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << masternodePayments.mapMasternodePayeeVotes[inv.hash];
-                        pfrom->PushMessage("mnw", ss);
+                    const CMasternodePaymentWinner* pwinner = masternodePayments.mapMasternodePayeeVotes.Get(inv.hash);
+                    if (pwinner) {
+                        CRelayCache::StreamPtr pss = relayCache.Get(inv);
+                        if (!pss)
+                            pss = SerializeForRelay(inv, *pwinner);
+                        pfrom->PushMessage("mnw", *pss);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_BUDGET_VOTE) {
-                    if (budget.mapSeenMasternodeBudgetVotes.count(inv.hash)) {
+                    const CRelayBytes<CBudgetVote>* pvote = budget.mapSeenMasternodeBudgetVotes.Get(inv.hash);
+                    if (pvote) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << budget.mapSeenMasternodeBudgetVotes[inv.hash];
+                        ss << *pvote;
                         pfrom->PushMessage("mvote", ss);
                         pushed = true;
                     }
@@ -4356,10 +6771,11 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_BUDGET_FINALIZED_VOTE) {
-                    if (budget.mapSeenFinalizedBudgetVotes.count(inv.hash)) {
+                    const CRelayBytes<CFinalizedBudgetVote>* pvote = budget.mapSeenFinalizedBudgetVotes.Get(inv.hash);
+                    if (pvote) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << budget.mapSeenFinalizedBudgetVotes[inv.hash];
+                        ss << *pvote;
                         pfrom->PushMessage("fbvote", ss);
                         pushed = true;
                     }
@@ -4376,20 +6792,22 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_ANNOUNCE) {
-                    if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodeBroadcast[inv.hash];
-                        pfrom->PushMessage("mnb", ss);
+                    const CMasternodeBroadcast* pmnb = mnodeman.mapSeenMasternodeBroadcast.Get(inv.hash);
+                    if (pmnb) {
+                        CRelayCache::StreamPtr pss = relayCache.Get(inv);
+                        if (!pss)
+                            pss = SerializeForRelay(inv, *pmnb);
+                        pfrom->PushMessage("mnb", *pss);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_PING) {
-                    if (mnodeman.mapSeenMasternodePing.count(inv.hash)) {
+                    const CRelayBytes<CMasternodePing>* pmnp = mnodeman.mapSeenMasternodePing.Get(inv.hash);
+                    if (pmnp) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodePing[inv.hash];
+                        ss << *pmnp;
                         pfrom->PushMessage("mnp", ss);
                         pushed = true;
                     }
@@ -4403,7 +6821,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4422,6 +6840,138 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Process a block rebuilt from a compact block like one received in a "block" message */
+void static ProcessReconstructedBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hashBlock = block.GetHash();
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", string("block"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hashBlock);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS, "invalid compact block");
+        }
+        return;
+    }
+    LOCK(cs_main);
+    MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom, hashBlock);
+}
+
+/**
+ * The end of processing a "tx" message, under cs_main: relay an accepted
+ * transaction and the orphans it unlocks, keep one missing inputs as an
+ * orphan, answer a rejected one.
+ */
+static void ProcessTxResult(CNode* pfrom, const CTransaction& tx, bool fAccepted, bool fMissingInputs, CValidationState& state)
+{
+    AssertLockHeld(cs_main);
+    CInv inv(MSG_TX, tx.GetHash());
+
+    if (fAccepted) {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
+                 pfrom->id, pfrom->cleanSubVer,
+                 tx.GetHash().ToString(),
+                 mempool.mapTx.size());
+
+        // The orphans that depended on this one are reprocessed one at a
+        // time by ProcessMessages(), between the messages of the peers
+        AddOrphanChildrenToWorkSet(tx, pfrom->setOrphanWorkSet);
+    } else if (fMissingInputs) {
+        AddOrphanTx(tx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else if (pfrom->fWhitelisted) {
+        // Always relay transactions received from whitelisted peers, even
+        // if they are already in the mempool (allowing the node to function
+        // as a gateway for nodes hidden behind it).
+
+        RelayTransaction(tx);
+    }
+
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS)) {
+        // not asked for again until the tip changes, unless its data may have been garbled
+        if (!fMissingInputs && !state.CorruptionPossible())
+            recentRejects->insert(tx.GetHash());
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", string("tx"), state.GetRejectCode(),
+            state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS, _("main::ProcessMessage::ln4872::DoS > 0"));
+    }
+}
+
+/**
+ * Reprocess the orphans of pfrom's work set until one of them is accepted or
+ * rejected, queueing the children of an accepted one in turn. Orphans still
+ * missing inputs are skipped.
+ */
+static void ProcessOrphanTx(CNode* pfrom)
+{
+    AssertLockHeld(cs_main);
+    set<uint256>& setWork = pfrom->setOrphanWorkSet;
+    while (!setWork.empty()) {
+        uint256 orphanHash = *setWork.begin();
+        setWork.erase(setWork.begin());
+
+        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(orphanHash);
+        if (it == mapOrphanTransactions.end())
+            continue;
+        const CTransaction& orphanTx = it->second.tx;
+        NodeId fromPeer = it->second.fromPeer;
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx);
+            AddOrphanChildrenToWorkSet(orphanTx, setWork);
+            EraseOrphanTx(orphanHash);
+            mempool.check(pcoinsTip);
+            break;
+        } else if (!fMissingInputs2) {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0) {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos, _("main::ProcessMessage::ln4834::DoS > 0"));
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            if (stateDummy.IsInvalid() && !stateDummy.CorruptionPossible())
+                recentRejects->insert(orphanHash);
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+            mempool.check(pcoinsTip);
+            break;
+        }
+    }
+}
+
+/** Called back by mempoolcheckqueue once the scripts of a transaction from pfrom were checked */
+static void FinishTxMessage(CNode* pfrom, const CPendingMempoolTx& pending, bool fValid, CValidationState& state)
+{
+    LOCK(cs_main);
+    bool fMissingInputs = false;
+    bool fAccepted = fValid && AcceptToMemoryPoolFinish(mempool, state, pending, &fMissingInputs);
+    ProcessTxResult(pfrom, pending.tx, fAccepted, fMissingInputs, state);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -4486,7 +7036,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         // Change version
         pfrom->PushMessage("verack");
-        pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->nSendVersion = min(pfrom->nVersion, PROTOCOL_VERSION);
 
         if (!pfrom->fInbound) {
             // Advertise our address
@@ -4554,6 +7104,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // We understand compact blocks; high-bandwidth mode is asked for later, from
+        // the peers that give us new blocks first
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+    }
+
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -4585,7 +7152,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnown filters of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -4647,9 +7214,30 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
-                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    if (IsHeadersFirstPeer(pfrom)) {
+                        // First request the headers preceding the announced block. In the normal fully-synced
+                        // case where a new block is announced that succeeds the current tip (no reorganization),
+                        // there are no such headers.
+                        // Secondly, and only when we are close to being synced, we request the announced block directly,
+                        // to avoid an extra round-trip. Note that we must *first* ask for the headers, so by the
+                        // time the block arrives, the header chain leading up to it is already validated. Not
+                        // doing this will result in the received block being rejected as an orphan in case it is
+                        // not a direct successor.
+                        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                        CNodeState* nodestate = State(pfrom->GetId());
+                        if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
+                            nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                            vToFetch.push_back(nodestate->fProvidesHeaderAndIDs ? CInv(MSG_CMPCT_BLOCK, inv.hash) : inv);
+                            // Mark block as in flight already, even though the actual "getdata" message only goes out
+                            // later (within the same cs_main lock, though).
+                            MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                        }
+                        LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    } else {
+                        // Add this to the list of blocks to request
+                        vToFetch.push_back(inv);
+                        LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    }
                 }
             }
 
@@ -4658,7 +7246,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
             if (pfrom->nSendSize > (SendBufferSize() * 2)) {
                 Misbehaving(pfrom->GetId(), 50, _("main::ProcessMessage::ln4675::nSendSize > SendBufferSize * 2"));
-                return error("send buffer size() = %u", pfrom->nSendSize);
+                return error("send buffer size() = %u", pfrom->nSendSize.load());
             }
         }
 
@@ -4686,7 +7274,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks" || (strCommand == "getheaders" && pfrom->nVersion < HEADERS_FIRST_VERSION)) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -4706,6 +7294,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            // If pruning, don't inv blocks unless we have them, nor ones that may be pruned before the peer asks for them
+            if (fPruneMode && (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nHeight <= chainActive.Height() - GetPruneKeepDepth() + 3600 / Params().TargetSpacing())) {
+                LogPrint("net", " getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0) {
                 // When this block is requested, we'll send an inv that'll make them
@@ -4718,7 +7311,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -4756,15 +7349,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
     else if (strCommand == "tx") {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         //masternode signed transaction
         bool ignoreFees = false;
-        CTxIn vin;
-        vector<unsigned char> vchSig;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
@@ -4772,90 +7361,35 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         LOCK(cs_main);
 
         bool fMissingInputs = false;
+        bool fAccepted = false;
+        bool fQueued = false;
         CValidationState state;
 
-        mapAlreadyAskedFor.erase(inv);
+        {
+            LOCK(cs_mapAlreadyAskedFor);
+            mapAlreadyAskedFor.erase(inv);
+        }
 
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
-                     pfrom->id, pfrom->cleanSubVer,
-                     tx.GetHash().ToString(),
-                     mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for(unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if(itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for(set<uint256>::iterator mi = itByPrev->second.begin();
-                    mi != itByPrev->second.end();
-                    ++mi) {
-                    const uint256 &orphanHash = *mi;
-                    const CTransaction &orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if(setMisbehaving.count(fromPeer))
-                        continue;
-                    if(AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    } else if(!fMissingInputs2) {
-                        int nDos = 0;
-                        if(stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos, _("main::ProcessMessage::ln4834::DoS > 0"));
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
+        // A transaction turned down since the tip changed is not checked again,
+        // another peer's copy waiting for its scripts is as good as in the pool
+        if (IsRecentlyRejected(inv.hash)) {
+            LogPrint("mempool", "%s from peer=%d was turned down already\n", inv.hash.ToString(), pfrom->id);
+            if (pfrom->fWhitelisted)
+                RelayTransaction(tx);
+            return true;
+        } else if (!mempoolcheckqueue.IsPending(inv.hash)) {
+            // The scripts are checked by the workers, without cs_main, and
+            // FinishTxMessage() adds the transaction to the pool after
+            CPendingMempoolTxRef ptx(new CPendingMempoolTx(tx, true, false, ignoreFees, GetTime()));
+            if (AcceptToMemoryPoolPreChecks(mempool, state, *ptx, &fMissingInputs)) {
+                fQueued = mempoolcheckqueue.Push(pfrom, ptx, &FinishTxMessage);
+                if (!fQueued)
+                    fAccepted = AcceptToMemoryPoolScriptChecks(state, *ptx) && AcceptToMemoryPoolFinish(mempool, state, *ptx, &fMissingInputs);
             }
-
-            BOOST_FOREACH (uint256 hash, vEraseQueue)EraseOrphanTx(hash);
-        } else if (fMissingInputs) {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
-            // Always relay transactions received from whitelisted peers, even
-            // if they are already in the mempool (allowing the node to function
-            // as a gateway for nodes hidden behind it).
-
-            RelayTransaction(tx);
-        }
-
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS)) {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS, _("main::ProcessMessage::ln4872::DoS > 0"));
         }
+
+        if (!fQueued)
+            ProcessTxResult(pfrom, tx, fAccepted, fMissingInputs, state);
     }
 
 
@@ -4875,30 +7409,36 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Hash the whole batch before taking cs_main
+        std::vector<uint256> vHeaderHashes;
+        GetBlockHeaderHashes(headers, vHeaderHashes);
+
         LOCK(cs_main);
 
+        State(pfrom->GetId())->nHeadersRequested = 0;
+
         if (nCount == 0) {
             // Nothing interesting. Stop asking this peers for more headers.
             return true;
         }
 
         CBlockIndex* pindexLast = NULL;
-        BOOST_FOREACH (const CBlockHeader& header, headers) {
+        for (unsigned int n = 0; n < headers.size(); n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+            if (n > 0 && header.hashPrevBlock != vHeaderHashes[n - 1]) {
                 Misbehaving(pfrom->GetId(), 20, _("main::ProcessMessage::ln4903::Previous block does not match"));
                 return error("non-continuous headers sequence");
             }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
+            // Without the block body the coinstake isn't known yet, the stake fields of the index are
+            // computed once the block and its ancestors arrive, see ComputeBlockIndexStake
             if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
                         Misbehaving(pfrom->GetId(), nDoS, _("main::ProcessMessage::ln4914::DoS > 0"));
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
+                    std::string strError = "invalid header received " + vHeaderHashes[n].ToString();
                     return error(strError.c_str());
                 }
             }
@@ -4913,6 +7453,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // from there instead.
             LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
             pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
+            State(pfrom->GetId())->nHeadersRequested = GetTimeMicros();
         }
 
         CheckBlockIndex();
@@ -4920,15 +7461,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
+        // Deserialize in place so the payload can go to disk without re-serializing
         CBlock block;
-        vRecv >> block;
+        const char* pchRaw = NULL;
+        unsigned int nRawSize = 0;
+        if (!vRecv.empty()) {
+            CMemoryReader reader(&vRecv[0], vRecv.size(), vRecv.GetType(), vRecv.GetVersion());
+            reader >> block;
+            pchRaw = reader.begin();
+            nRawSize = reader.GetReadPos();
+        } else {
+            vRecv >> block;
+        }
         uint256 hashBlock = block.GetHash();
         CInv inv(MSG_BLOCK, hashBlock);
         LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
 
         //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
         if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
+            if (IsHeadersFirstPeer(pfrom)) {
+                // Get the headers leading to it, the missing blocks are then downloaded like during sync
+                LOCK(cs_main);
+                PushGetBlocks(pfrom, hashBlock);
+            } else if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
                 //we already asked for this block, so lets work backwards and ask for the previous block
                 pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
                 pfrom->vBlockRequested.push_back(block.hashPrevBlock);
@@ -4942,15 +7497,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
             CValidationState state;
             if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+                // Peers will ask for it as soon as it is announced, serve them the bytes we got
+                if (pchRaw != NULL)
+                    relayCache.Put(inv, CRelayCache::StreamPtr(new CDataStream(pchRaw, pchRaw + nRawSize, SER_NETWORK, PROTOCOL_VERSION)));
+                CBlockTraceScope blockTrace(block, pfrom->GetId(), nTimeReceived);
+                ProcessNewBlock(state, pfrom, &block, NULL, pchRaw, nRawSize);
                 int nDoS;
                 if(state.IsInvalid(nDoS)) {
+                    relayCache.Erase(inv);
                     pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
                                        state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
                     if(nDoS > 0) {
                         TRY_LOCK(cs_main, lockMain);
                         if(lockMain) Misbehaving(pfrom->GetId(), nDoS, _("main::ProcessMessage::ln4966::DoS > 0"));
                     }
+                } else {
+                    LOCK(cs_main);
+                    MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom, hashBlock);
                 }
                 //disconnect this node if its old protocol version
                 pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
@@ -4961,6 +7524,161 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        LogPrint("cmpctblock", "received cmpctblock %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                // Get the headers leading to it, the missing blocks are then downloaded like during sync
+                if (!IsInitialBlockDownload())
+                    PushGetBlocks(pfrom, hashBlock);
+                return true;
+            }
+
+            CBlockIndex* pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(CBlock(cmpctblock.header), state, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS, "invalid cmpctblock header");
+                return true;
+            }
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+            UpdateBlockAvailability(pfrom->GetId(), hashBlock);
+            if (pindex->nStatus & BLOCK_HAVE_DATA)
+                return true;
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fInFlightElsewhere = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first != pfrom->GetId();
+            std::vector<CInv> vGetData(1, CInv(MSG_BLOCK, hashBlock));
+
+            // Only the block extending our tip is rebuilt, others are downloaded like during sync
+            if (pindex->pprev != chainActive.Tip()) {
+                if (!fInFlightElsewhere) {
+                    MarkBlockAsInFlight(pfrom->GetId(), hashBlock, pindex);
+                    pfrom->PushMessage("getdata", vGetData);
+                }
+                return true;
+            }
+
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock());
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100, "invalid cmpctblock");
+                return true;
+            }
+            if (status == READ_STATUS_FAILED) {
+                if (!fInFlightElsewhere) {
+                    MarkBlockAsInFlight(pfrom->GetId(), hashBlock, pindex);
+                    pfrom->PushMessage("getdata", vGetData);
+                }
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < partialBlock->BlockTxCount(); i++)
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+
+            if (req.indexes.empty()) {
+                std::vector<CTransaction> vDummy;
+                status = partialBlock->FillBlock(block, vDummy);
+                if (status == READ_STATUS_OK) {
+                    fBlockReconstructed = true;
+                } else if (!fInFlightElsewhere) {
+                    MarkBlockAsInFlight(pfrom->GetId(), hashBlock, pindex);
+                    pfrom->PushMessage("getdata", vGetData);
+                }
+            } else if (!fInFlightElsewhere) {
+                // Ask this peer for what we miss, the block arrives with "blocktxn"
+                req.blockhash = hashBlock;
+                MarkBlockAsInFlight(pfrom->GetId(), hashBlock, pindex, partialBlock);
+                pfrom->PushMessage("getblocktxn", req);
+                LogPrint("cmpctblock", "requesting %u of %u transactions of block %s from peer=%d\n", req.indexes.size(), partialBlock->BlockTxCount(), hashBlock.ToString(), pfrom->id);
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessReconstructedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+        if (mi->second->nHeight < chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+            // Only asked for the block just announced, answer like a getdata for it
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_CMPCTBLOCK_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100, "getblocktxn index out of bounds");
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+            if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId() || !itInFlight->second.second->partialBlock) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            QueuedBlock& queued = *itInFlight->second.second;
+            ReadStatus status = queued.partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100, "invalid blocktxn");
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // A short id collision, get the block whole
+                MarkBlockAsInFlight(pfrom->GetId(), resp.blockhash, queued.pindex);
+                pfrom->PushMessage("getdata", std::vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+            } else {
+                fBlockReconstructed = true;
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessReconstructedBlock(pfrom, block);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -5212,11 +7930,23 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    // Finish the masternode messages whose signatures were checked meanwhile
+    mnsigcheckqueue.ProcessCompleted(pfrom);
+    // and the transactions whose scripts were
+    mempoolcheckqueue.ProcessCompleted(pfrom);
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
+    if (!pfrom->setOrphanWorkSet.empty()) {
+        LOCK(cs_main);
+        ProcessOrphanTx(pfrom);
+    }
+
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
+    // and the orphans go before the transactions that came after them
+    if (!pfrom->setOrphanWorkSet.empty()) return fOk;
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
@@ -5268,8 +7998,12 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        // Listeners that fell behind catch up before more blocks and transactions come in
+        LimitValidationInterfaceQueue();
+
         // Process message
         bool fRet = false;
+        int64_t nTimeStart = GetTimeMicros();
         try {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
             boost::this_thread::interruption_point();
@@ -5292,6 +8026,8 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        pfrom->RecordMsgProcessed(strCommand, CMessageHeader::HEADER_SIZE + nMessageSize, GetTimeMicros() - nTimeStart);
+
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
 
@@ -5351,9 +8087,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
+                // Periodically clear addrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->addrKnown.reset();
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5365,12 +8101,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: addr
         //
-        if (fSendTrickle) {
+        int64_t nNow = GetTimeMicros();
+        if (fSendTrickle || pto->nNextAddrSend < nNow) {
+            pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->addrKnown.contains(addr.GetKey())) {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -5412,10 +8150,15 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (IsHeadersFirstPeer(pto)) {
+                    // Start one back so the reply isn't empty even if the peer's tip is our best header
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                    state.nHeadersRequested = GetTimeMicros();
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
@@ -5429,48 +8172,64 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: inventory
         //
+        // Announcements are batched on a Poisson timer per peer, so that a
+        // burst of transactions and masternode objects goes out in a few inv
+        // messages rather than one for each; urgent ones do not wait.
+        bool fSendBatch = fSendTrickle;
+        if (pto->nNextInvSend < nNow) {
+            fSendBatch = true;
+            pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> !pto->fInbound);
+        }
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle) {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait) {
+            if (fSendBatch || pto->fInventoryUrgent) {
+                vector<CInv> vInvWait;
+                vInv.reserve(pto->vInventoryToSend.size());
+                BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
+                    if (!fSendBatch && !inv.IsUrgent()) {
                         vInvWait.push_back(inv);
                         continue;
                     }
-                }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
+                    // Also drops the copies queued twice since the last batch
+                    std::vector<unsigned char> vKey = inv.GetKey();
+                    if (pto->filterInventoryKnown.contains(vKey))
+                        continue;
+                    pto->filterInventoryKnown.insert(vKey);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000) {
                         pto->PushMessage("inv", vInv);
                         vInv.clear();
                     }
                 }
+                pto->vInventoryToSend.swap(vInvWait);
+                pto->fInventoryUrgent = false;
+            }
+            if (fSendBatch && !pto->vPingAnnounceToSend.empty()) {
+                vector<CMasternodePingAnnounce> vAnnounce;
+                vAnnounce.reserve(pto->vPingAnnounceToSend.size());
+                for (std::vector<std::pair<uint256, CMasternodePingAnnounce> >::const_iterator it = pto->vPingAnnounceToSend.begin(); it != pto->vPingAnnounceToSend.end(); ++it) {
+                    std::vector<unsigned char> vKey = CInv(MSG_MASTERNODE_PING, it->first).GetKey();
+                    if (pto->filterInventoryKnown.contains(vKey))
+                        continue;
+                    pto->filterInventoryKnown.insert(vKey);
+                    vAnnounce.push_back(it->second);
+                    if (vAnnounce.size() >= 1000) {
+                        pto->PushMessage("mnpann", vAnnounce);
+                        vAnnounce.clear();
+                    }
+                }
+                pto->vPingAnnounceToSend.clear();
+                if (!vAnnounce.empty())
+                    pto->PushMessage("mnpann", vAnnounce);
             }
-            pto->vInventoryToSend = vInvWait;
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
+        nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -5478,6 +8237,16 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
             pto->fDisconnect = true;
         }
+        // The headers sync runs from a single peer until our best header is recent, one that
+        // stopped answering would hold back the whole sync
+        if (!pto->fDisconnect && state.nHeadersRequested && state.nHeadersRequested < nNow - 1000000 * HEADERS_RESPONSE_TIMEOUT) {
+            if (pindexBestHeader->GetBlockTime() < GetAdjustedTime() - 6 * 60 * 60) {
+                LogPrintf("Peer=%d did not answer getheaders, disconnecting\n", pto->id);
+                pto->fDisconnect = true;
+            } else {
+                state.nHeadersRequested = 0;
+            }
+        }
         // In case there is a block that has been in flight from this peer for (2 + 0.5 * N) times the block interval
         // (with N the number of validated blocks that were in flight at the time it was requested), disconnect due to
         // timeout. We compensate for in-flight blocks to prevent killing off peers due to our own downstream link
@@ -5499,7 +8268,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             BOOST_FOREACH (CBlockIndex* pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
-                LogPrintf("Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
+                LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
@@ -5533,7 +8302,146 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 }
 
 
-bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
+std::vector<char> CBlockUndo::GetDiskRecord(int nHeight, bool fCompact, int nCompressLevel) const
+{
+    // Depths below the block only exist for coins of the block or before it
+    std::map<CScript, unsigned int> mapScriptCount;
+    BOOST_FOREACH (const CTxUndo& txundo, vtxundo) {
+        BOOST_FOREACH (const CTxInUndo& undo, txundo.vprevout) {
+            if (undo.nHeight > (unsigned int)nHeight)
+                fCompact = false;
+            if (fCompact)
+                mapScriptCount[undo.txout.scriptPubKey]++;
+        }
+    }
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    if (!fCompact) {
+        ss << *this;
+        return std::vector<char>(ss.begin(), ss.end());
+    }
+
+    // The scripts spent more than once are listed in the order they are first spent
+    std::vector<CScript> vScripts;
+    std::map<CScript, unsigned int> mapScriptRef;
+    BOOST_FOREACH (const CTxUndo& txundo, vtxundo) {
+        BOOST_FOREACH (const CTxInUndo& undo, txundo.vprevout) {
+            if (mapScriptCount[undo.txout.scriptPubKey] > 1 && mapScriptRef.insert(std::make_pair(undo.txout.scriptPubKey, vScripts.size() + 1)).second)
+                vScripts.push_back(undo.txout.scriptPubKey);
+        }
+    }
+
+    CDataStream ssPayload(SER_DISK, CLIENT_VERSION);
+    ssPayload << VARINT(nHeight);
+    WriteCompactSize(ssPayload, vScripts.size());
+    BOOST_FOREACH (const CScript& script, vScripts)
+        ssPayload << CScriptCompressor(REF(script));
+    WriteCompactSize(ssPayload, vtxundo.size());
+    BOOST_FOREACH (const CTxUndo& txundo, vtxundo) {
+        WriteCompactSize(ssPayload, txundo.vprevout.size());
+        BOOST_FOREACH (const CTxInUndo& undo, txundo.vprevout) {
+            uint64_t nCode = (undo.fCoinBase ? 2 : 0) + (undo.fCoinStake ? 1 : 0);
+            if (undo.nHeight > 0)
+                nCode += 4 * ((uint64_t)(nHeight - undo.nHeight) + 1);
+            ssPayload << VARINT(nCode);
+            if (undo.nHeight > 0)
+                ssPayload << VARINT(undo.nVersion);
+            ssPayload << VARINT(CTxOutCompressor::CompressAmount(undo.txout.nValue));
+            std::map<CScript, unsigned int>::const_iterator it = mapScriptRef.find(undo.txout.scriptPubKey);
+            unsigned int nRef = it == mapScriptRef.end() ? 0 : it->second;
+            ssPayload << VARINT(nRef);
+            if (nRef == 0)
+                ssPayload << CScriptCompressor(REF(undo.txout.scriptPubKey));
+        }
+    }
+
+    std::vector<char> vDeflated;
+    unsigned char nFlags = 0;
+    if (nCompressLevel > 0 && DeflateBuffer(&ssPayload[0], ssPayload.size(), nCompressLevel, vDeflated) && vDeflated.size() + sizeof(uint32_t) < ssPayload.size())
+        nFlags |= UNDO_COMPACT_DEFLATED;
+    ss << UNDO_COMPACT_MARKER << UNDO_COMPACT_VERSION << nFlags;
+    if (nFlags & UNDO_COMPACT_DEFLATED) {
+        ss << VARINT((uint64_t)ssPayload.size());
+        ss.write(&vDeflated[0], vDeflated.size());
+    } else {
+        ss.write(&ssPayload[0], ssPayload.size());
+    }
+    return std::vector<char>(ss.begin(), ss.end());
+}
+
+bool CBlockUndo::SetDiskRecord(const char* pch, size_t nSize)
+{
+    vtxundo.clear();
+    try {
+        CMemoryReader filein(pch, nSize, SER_DISK, CLIENT_VERSION);
+        if (nSize == 0 || (unsigned char)pch[0] != UNDO_COMPACT_MARKER) {
+            filein >> *this;
+            return true;
+        }
+
+        unsigned char nMarker, nVersion, nFlags;
+        filein >> nMarker >> nVersion >> nFlags;
+        if (nVersion != UNDO_COMPACT_VERSION)
+            return error("%s : unknown undo record version %u", __func__, nVersion);
+        std::vector<char> vInflated;
+        const char* pchPayload = pch + filein.GetReadPos();
+        size_t nPayloadSize = filein.size();
+        if (nFlags & UNDO_COMPACT_DEFLATED) {
+            uint64_t nRawSize;
+            filein >> VARINT(nRawSize);
+            if (nRawSize > MAX_BLOCKFILE_SIZE)
+                return error("%s : bad undo record size %u", __func__, nRawSize);
+            if (!InflateBuffer(pch + filein.GetReadPos(), filein.size(), nRawSize, vInflated))
+                return false;
+            pchPayload = vInflated.empty() ? NULL : &vInflated[0];
+            nPayloadSize = vInflated.size();
+        }
+
+        // Decoded as it is read, nothing but the list of scripts is kept aside
+        CMemoryReader payload(pchPayload, nPayloadSize, SER_DISK, CLIENT_VERSION);
+        int nHeight;
+        payload >> VARINT(nHeight);
+        std::vector<CScript> vScripts;
+        for (uint64_t nScripts = ReadCompactSize(payload); nScripts > 0; nScripts--) {
+            vScripts.push_back(CScript());
+            payload >> REF(CScriptCompressor(vScripts.back()));
+        }
+        for (uint64_t nTx = ReadCompactSize(payload); nTx > 0; nTx--) {
+            vtxundo.push_back(CTxUndo());
+            CTxUndo& txundo = vtxundo.back();
+            for (uint64_t nIn = ReadCompactSize(payload); nIn > 0; nIn--) {
+                txundo.vprevout.push_back(CTxInUndo());
+                CTxInUndo& undo = txundo.vprevout.back();
+                uint64_t nCode, nAmount, nRef;
+                payload >> VARINT(nCode);
+                undo.fCoinBase = nCode & 2;
+                undo.fCoinStake = nCode & 1;
+                if (nCode >= 4) {
+                    uint64_t nDepth = (nCode >> 2) - 1;
+                    if (nDepth >= (uint64_t)nHeight)
+                        return error("%s : bad depth %u of a coin spent at height %d", __func__, nDepth, nHeight);
+                    undo.nHeight = nHeight - nDepth;
+                    payload >> VARINT(undo.nVersion);
+                }
+                payload >> VARINT(nAmount);
+                undo.txout.nValue = CTxOutCompressor::DecompressAmount(nAmount);
+                payload >> VARINT(nRef);
+                if (nRef == 0)
+                    payload >> REF(CScriptCompressor(undo.txout.scriptPubKey));
+                else if (nRef <= vScripts.size())
+                    undo.txout.scriptPubKey = vScripts[nRef - 1];
+                else
+                    return error("%s : bad script reference %u", __func__, nRef);
+            }
+        }
+        if (!payload.empty())
+            return error("%s : %u bytes past the end of the undo data", __func__, payload.size());
+    } catch (const std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock, const std::vector<char>& vchRecord)
 {
     // Open history file to append
     CAutoFile fileout(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
@@ -5541,7 +8449,7 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
         return error("CBlockUndo::WriteToDisk : OpenUndoFile failed");
 
     // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(*this);
+    unsigned int nSize = vchRecord.size();
     fileout << FLATDATA(Params().MessageStart()) << nSize;
 
     // Write undo data
@@ -5549,12 +8457,12 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
     if (fileOutPos < 0)
         return error("CBlockUndo::WriteToDisk : ftell failed");
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << *this;
+    fileout.write(&vchRecord[0], vchRecord.size());
 
-    // calculate & write checksum
+    // calculate & write checksum, for a legacy record the same as over the serialized undo data
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
     hasher << hashBlock;
-    hasher << *this;
+    hasher.write(&vchRecord[0], vchRecord.size());
     fileout << hasher.GetHash();
 
     return true;
@@ -5562,28 +8470,22 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
-
-    // Read block
+    // Read undo data and the checksum after it
+    CDiskRecord record;
+    if (!ReadDiskRecord(pos, true, sizeof(uint256), record))
+        return error("CBlockUndo::ReadFromDisk : ReadDiskRecord failed");
+    size_t nSize = record.nSize - sizeof(uint256);
     uint256 hashChecksum;
-    try {
-        filein >> *this;
-        filein >> hashChecksum;
-    } catch (std::exception& e) {
-        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-    }
+    memcpy(hashChecksum.begin(), record.pch + nSize, sizeof(uint256));
 
     // Verify checksum
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
     hasher << hashBlock;
-    hasher << *this;
+    hasher.write(record.pch, nSize);
     if (hashChecksum != hasher.GetHash())
         return error("CBlockUndo::ReadFromDisk : Checksum mismatch");
 
-    return true;
+    return SetDiskRecord(record.pch, nSize);
 }
 
 std::string CBlockFileInfo::ToString() const
@@ -5599,13 +8501,12 @@ public:
     ~CMainCleanup()
     {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanPeerBytes.clear();
     }
 } instance_of_cmaincleanup;
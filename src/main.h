@@ -14,6 +14,7 @@
 #endif
 
 #include "bignum.h"
+#include "addressindex.h"
 #include "amount.h"
 #include "chain.h"
 #include "chainparams.h"
@@ -33,6 +34,7 @@
 #include "masternode-sync.h"
 
 #include <algorithm>
+#include <deque>
 #include <exception>
 #include <map>
 #include <set>
@@ -41,6 +43,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
@@ -49,6 +53,7 @@ class CZerocoinDB;
 class CSporkDB;
 class CBloomFilter;
 class CInv;
+class CScheduler;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
@@ -73,22 +78,89 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_TX_SIGOPS_CURRENT = MAX_BLOCK_SIGOPS_CURRENT / 5;
 static const unsigned int MAX_TX_SIGOPS_LEGACY = MAX_BLOCK_SIGOPS_LEGACY / 5;
+/** Average delay between address broadcasts to a peer, in seconds */
+static const unsigned int AVG_ADDRESS_BROADCAST_INTERVAL = 30;
+/** Average delay between inventory batches to an inbound peer, in seconds; outbound peers get half.
+ *  Blocks, SwiftTX locks and sporks are announced at once. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Seconds an orphan transaction is kept waiting for its parents */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Transactions turned down since the tip last changed that AlreadyHave remembers */
+static const unsigned int RECENT_REJECTS_SIZE = 120000;
+/** Transactions of the blocks connected lately that AlreadyHave remembers */
+static const unsigned int RECENT_CONFIRMED_SIZE = 48000;
+/** Seconds between sweeps for expired orphan transactions */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Serialized bytes of orphan transactions a single peer may have kept at once */
+static const unsigned int MAX_ORPHAN_TX_PEER_BYTES = 100000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Blocks below the tip that -prune never deletes, on top of the masternode payment and budget lookbacks */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
+/** Smallest -prune target in bytes: what MIN_BLOCKS_TO_KEEP full blocks, their undo data and the file being written can take */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
+/** Default for -monitor */
+static const bool DEFAULT_MONITOR = false;
+/** -dbcache of a -monitor node, in megabytes */
+static const int64_t MONITOR_DB_CACHE = 16;
+/** -maxmempool of a -monitor node, in megabytes */
+static const unsigned int MONITOR_MAX_MEMPOOL_SIZE = 32;
+/** -maxconnections of a -monitor node */
+static const int MONITOR_MAX_CONNECTIONS = 16;
+/** Blocks this many seconds older than the tip are served only as -maxuploadtarget allows */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** Maximum number of block and undo files kept open or mapped for reading */
+static const unsigned int MAX_BLOCKFILE_VIEWS = sizeof(void*) >= 8 ? 256 : 16;
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 100;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
-/** Maximum number of script-checking threads allowed */
-static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Blocks with at least this many transactions get their context-free checks run on the block check queue */
+static const unsigned int MIN_PARALLEL_BLOCK_CHECK_TXS = 64;
+/** Pairs of hashes of a merkle tree level hashed by one block check */
+static const unsigned int MERKLE_PAIRS_PER_CHECK = 128;
+/** Transactions with at least this many inputs share a CSignatureHashCache between their script checks */
+static const unsigned int MIN_SIGHASH_CACHE_INPUTS = 4;
+/** Default for -addressindex */
+static const bool DEFAULT_ADDRESSINDEX = false;
+/** Default for -spentindex */
+static const bool DEFAULT_SPENTINDEX = false;
+/** Default for -timestampindex */
+static const bool DEFAULT_TIMESTAMPINDEX = false;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Seconds between writes of the mempool to mempool.dat while running */
+static const int DUMP_MEMPOOL_INTERVAL = 15 * 60;
+/** Transactions reloaded from mempool.dat per cs_main lock */
+static const unsigned int LOAD_MEMPOOL_BATCH_SIZE = 100;
+/** Default for -persistcoinscache */
+static const bool DEFAULT_PERSIST_COINS_CACHE = true;
+/** Most transactions whose coins are recorded in coinscache.dat at shutdown */
+static const unsigned int MAX_COINS_CACHE_DUMP = 250000;
+/** Transactions whose coins are read back into the coins cache per cs_main lock */
+static const unsigned int LOAD_COINS_CACHE_BATCH_SIZE = 1000;
+/** Maximum number of threads deserializing and pre-checking blocks read from block files */
+static const int MAX_BLOCK_LOAD_THREADS = 4;
+/** Maximum number of blocks read from a block file ahead of the one being connected */
+static const unsigned int MAX_BLOCK_LOAD_QUEUE = 256;
+/** Maximum size in bytes of the blocks read from a block file ahead of the one being connected */
+static const unsigned int MAX_BLOCK_LOAD_QUEUE_BYTES = 64 * 1024 * 1024;
+/** Default for -checkblocks */
+static const int DEFAULT_CHECKBLOCKS = 100;
+/** Default for -checklevel */
+static const int DEFAULT_CHECKLEVEL = 4;
+/** Default for -verifyinbackground */
+static const bool DEFAULT_VERIFY_IN_BACKGROUND = true;
+/** Maximum number of threads reading block files for the background startup verification */
+static const int MAX_VERIFY_THREADS = 4;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -96,6 +168,10 @@ static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached their tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Timeout in seconds during which the peer we sync headers from must answer a getheaders before being disconnected. */
+static const unsigned int HEADERS_RESPONSE_TIMEOUT = 120;
+/** Seconds of block times the best header must be ahead of a block for -assumevalid to skip its scripts. */
+static const int64_t ASSUMEVALID_MIN_AGE = 14 * 24 * 60 * 60;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -103,6 +179,8 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
+/** Percentage of the coins cache budget kept resident after a flush forced by its size */
+static const unsigned int COINS_CACHE_KEEP_PERCENT = 50;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 
@@ -138,9 +216,23 @@ extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
+extern bool fTimestampIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+/** Whether to delete old block and undo files (-prune), and whether any were deleted already */
+extern bool fPruneMode;
+extern bool fHavePruned;
+/** Bytes of block and undo files -prune tries to stay below */
+extern uint64_t nPruneTarget;
+/** Block whose ancestors don't get their scripts checked, set by -assumevalid, 0 if off */
+extern uint256 hashAssumeValid;
+/** Whether new undo records use the compact encoding (-compactundo) */
+extern bool fCompactUndo;
+/** zlib level new compact undo records are deflated at, 0 if off (-undocompression) */
+extern int nUndoCompression;
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
@@ -163,14 +255,16 @@ extern CBlockIndex* pindexBestHeader;
 /** Minimum disk space required - used in CheckDiskSpace() */
 static const uint64_t nMinDiskSpace = 52428800;
 
-/** Register a wallet to receive updates from core */
-void RegisterValidationInterface(CValidationInterface* pwalletIn);
+/** Register a wallet to receive updates from core, see validationinterface.h */
+void RegisterValidationInterface(CValidationInterface* pwalletIn, bool fQueued);
 /** Unregister a wallet from core */
 void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 /** Unregister all wallets from core */
 void UnregisterAllValidationInterfaces();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL);
+/** Push the updated transactions of a block (or the conflicts it caused) to all registered wallets at once */
+void SyncWithWallets(const std::vector<CTransaction>& vtx, const CBlock* pblock);
 
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
@@ -186,9 +280,17 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @param[in]   pfrom   The node which we are receiving the block from; it is added to mapBlockSource and may be penalised if the block is invalid.
  * @param[in]   pblock  The block we want to process.
  * @param[out]  dbp     If pblock is stored to disk (or already there), this will be set to its location.
+ * @param[in]   pchRaw  Optional serialization of pblock as received, written to disk as is instead of re-serializing.
+ * @param[in]   nRawSize Size of pchRaw.
  * @return True if state.IsValid()
  */
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL);
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp = NULL, const char* pchRaw = NULL, unsigned int nRawSize = 0);
+/**
+ * Run the masternode payment, budget, MultiSend and dust combining follow-ups
+ * of a new block on the scheduler thread from now on, instead of in
+ * ProcessNewBlock. Blocks arriving back to back share one run.
+ */
+void StartPostTipTasks(CScheduler& scheduler);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -199,6 +301,12 @@ FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
+/**
+ * Connect the blocks of an external file, in file order, on top of the chain
+ * state we have, and write the time each phase of connecting each of them
+ * took to fileReport as CSV. Blocks we already have are skipped.
+ */
+bool ReplayExternalBlockFile(FILE* fileIn, FILE* fileReport);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -213,11 +321,27 @@ bool ProcessMessages(CNode* pfrom);
  * Send queued protocol messages to be sent to a give node.
  *
  * @param[in]   pto             The node which we are sending messages to.
- * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
+ * @param[in]   fSendTrickle    When true send the addresses and inventory at once, otherwise on their Poisson timers.
  */
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the block check thread */
+void ThreadBlockCheck();
+/** Run an instance of the block file compressor, which replaces finalized block files by blz files (-blockcompression) */
+void ThreadCompressBlockFiles();
+/** Run the startup verification of the last -checkblocks blocks once the node is serving (-verifyinbackground) */
+void ThreadVerifyDB();
+/** Turn a compressed block file back into blk?????.dat, if it was compressed */
+bool RestoreBlockFile(const CDiskBlockPos& pos);
+/** Depth below the tip down to which -prune keeps the blocks */
+int GetPruneKeepDepth();
+/** Bytes taken by the block and undo files */
+uint64_t CalculateCurrentUsage();
+/** Forget the blocks of a file in the block index, for the file to be deleted after the next flush */
+void PruneOneBlockFile(int nFile);
+/** Delete the block and undo files of PruneOneBlockFile */
+void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune);
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -228,6 +352,16 @@ bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core */
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
+/** Type and hash of the address a script pays to for the address index, ADDRESS_INDEX_NONE if it has none */
+int GetAddressIndexType(const CScript& script, uint160& hashBytes);
+/** History of an address from the address index, optionally limited to the heights nStart to nEnd */
+bool GetAddressIndex(const uint160& addressHash, int type, std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex, int nStart = 0, int nEnd = 0);
+/** Unspent outputs of an address from the address index */
+bool GetAddressUnspent(const uint160& addressHash, int type, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent);
+/** The input spending an output, from the spent index */
+bool GetSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
+/** Hashes of the blocks with nLow <= time < nHigh, from the timestamp index */
+bool GetTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes);
 bool GetTransaction(const uint256& hash, CTransaction& tx, uint256& hashBlock, bool fAllowSlow = false);
 /** Find the best known block, and make it the tip of the block chain */
 
@@ -253,11 +387,90 @@ void Misbehaving(NodeId nodeid, int howmuch, const std::string& reason);
 void FlushStateToDisk();
 
 
+/** Expire transactions older than age seconds and trim the mempool to limit bytes */
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age);
+
+/**
+ * A loose transaction between the steps of AcceptToMemoryPool. The checks
+ * that need cs_main resolve its inputs into view, which no longer refers to
+ * the chain or the pool, so the scripts can be checked without the lock.
+ */
+class CPendingMempoolTx : private boost::noncopyable
+{
+public:
+    const CTransaction tx;
+    const bool fLimitFree;
+    const bool fRejectInsaneFee;
+    const bool ignoreFees;
+    const int64_t nAcceptTime;
+    //! The backend of view once the inputs are cached
+    CCoinsView viewDummy;
+    CCoinsViewCache view;
+
+    CPendingMempoolTx(const CTransaction& txIn, bool fLimitFreeIn, bool fRejectInsaneFeeIn, bool ignoreFeesIn, int64_t nAcceptTimeIn)
+        : tx(txIn), fLimitFree(fLimitFreeIn), fRejectInsaneFee(fRejectInsaneFeeIn), ignoreFees(ignoreFeesIn), nAcceptTime(nAcceptTimeIn), view(&viewDummy) {}
+};
+
+/** The checks of AcceptToMemoryPool before those of the scripts, under cs_main */
+bool AcceptToMemoryPoolPreChecks(CTxMemPool& pool, CValidationState& state, CPendingMempoolTx& pending, bool* pfMissingInputs);
+
+/** Check the scripts of a transaction that passed the prechecks, without any lock */
+bool AcceptToMemoryPoolScriptChecks(CValidationState& state, const CPendingMempoolTx& pending);
+
+/**
+ * Add a transaction whose scripts were checked to the pool, under cs_main.
+ * The chain and the pool may have changed since the prechecks, which are
+ * done again first against the inputs as they are now.
+ */
+bool AcceptToMemoryPoolFinish(CTxMemPool& pool, CValidationState& state, const CPendingMempoolTx& pending, bool* pfMissingInputs);
+
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
 
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee = false, bool ignoreFees = false);
+
+/** Write the memory pool to mempool.dat */
+bool DumpMempool();
+
+/** Load the memory pool from mempool.dat, in batches of LOAD_MEMPOOL_BATCH_SIZE transactions */
+bool LoadMempool();
+
+/** Write the txids of the masternode collaterals and of the coins cache entries to coinscache.dat */
+bool DumpCoinsCache();
+
+/**
+ * Read the coins of the transactions in coinscache.dat back into the coins
+ * cache, while it stays under COINS_CACHE_KEEP_PERCENT of -dbcache (-persistcoinscache)
+ */
+void ThreadLoadCoinsCache();
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
+/** Most outpoints gettxouts and /rest/getutxos look up at once */
+static const unsigned int MAX_UTXO_BATCH_SIZE = 10000;
+
+/** An output looked up by GetUnspentOutputs(), with the metadata of its transaction if it is unspent */
+struct CUnspentOutput {
+    bool fFound;
+    CTxOut out;
+    int nHeight; //!< MEMPOOL_HEIGHT for an output of the mempool
+    int nVersion;
+    bool fCoinBase;
+    bool fCoinStake;
+
+    CUnspentOutput() : fFound(false), nHeight(0), nVersion(0), fCoinBase(false), fCoinStake(false) {}
+};
+
+/**
+ * Look up the outputs vOutPoints under one hold of cs_main, and of the
+ * mempool if fMempool, in which case its outputs count and those it spends
+ * do not. Each transaction is read once, what the coins cache misses from
+ * the database in key order. vOutputs[i] is for vOutPoints[i]. Returns the
+ * block the outputs are unspent at.
+ */
+CBlockIndex* GetUnspentOutputs(const std::vector<COutPoint>& vOutPoints, bool fMempool, std::vector<CUnspentOutput>& vOutputs);
+
 int GetInputAge(CTxIn& vin);
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin);
 bool GetCoinAge(const CTransaction& tx, unsigned int nTxTime, uint64_t& nCoinAge);
@@ -345,6 +558,9 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
  */
 bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks = NULL);
 
+/** The script checks of CheckInputs, which need no lock: inputs must hold the coins tx spends */
+bool CheckInputScripts(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks = NULL);
+
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight);
 
@@ -367,7 +583,37 @@ bool IsStandardTx(const CTransaction& tx, std::string& reason);
 
 bool IsFinalTx(const CTransaction& tx, int nBlockHeight = 0, int64_t nBlockTime = 0);
 
-/** Undo information for a CBlock */
+/** Default for -compactundo */
+static const bool DEFAULT_COMPACT_UNDO = true;
+/** Default for -undocompression, the zlib level compact undo records are deflated at (0 = off) */
+static const int DEFAULT_UNDO_COMPRESSION = 0;
+/** First byte of a compact undo record, a legacy record never starts with it */
+static const unsigned char UNDO_COMPACT_MARKER = 0xff;
+/** Version of the compact undo encoding written */
+static const unsigned char UNDO_COMPACT_VERSION = 1;
+/** Flag of a compact undo record whose payload is deflated */
+static const unsigned char UNDO_COMPACT_DEFLATED = 1;
+
+/**
+ * Undo information for a CBlock
+ *
+ * A record of rev?????.dat is either the legacy serialization below or a
+ * compact record, followed by the hash of the previous block and of the
+ * bytes of the record:
+ *
+ *   UNDO_COMPACT_MARKER, the version, the flags; if UNDO_COMPACT_DEFLATED
+ *   VARINT(payload size) and the payload deflated, else the payload:
+ *     VARINT(block height)
+ *     the scripts spent more than once in the block (compressed)
+ *     for each transaction, for each input: VARINT(code), [VARINT(version)],
+ *     VARINT(compressed amount), VARINT(script reference), [script]
+ *
+ * The code holds the coinbase and coinstake flags and, if the input spent
+ * the last output, 1 + the depth of its transaction below the block. A
+ * script reference of 0 is followed by the script, n > 0 is script n - 1 of
+ * the list. Coinstakes and masternode payees paying the same script over
+ * and over, and wallets spending many coins of one address, store it once.
+ */
 class CBlockUndo
 {
 public:
@@ -381,10 +627,132 @@ public:
         READWRITE(vtxundo);
     }
 
-    bool WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock);
+    /** The record of this block at nHeight in rev?????.dat: compact if fCompact, deflated at nCompressLevel if that is smaller */
+    std::vector<char> GetDiskRecord(int nHeight, bool fCompact, int nCompressLevel) const;
+    /** Read a record of either encoding */
+    bool SetDiskRecord(const char* pch, size_t nSize);
+
+    bool WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock, const std::vector<char>& vchRecord);
     bool ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock);
 };
 
+/** Default memory budget of the recent block cache, in serialized bytes */
+static const size_t DEFAULT_RECENT_BLOCK_CACHE_BYTES = 64 * 1000 * 1000;
+/** Blocks this far below the tip are buried and leave the recent block cache */
+static const int RECENT_BLOCK_CACHE_DEPTH = 10;
+
+/**
+ * The blocks connected last with their undo data, and the competing blocks
+ * near the tip, so that a shallow reorganization disconnects and connects
+ * from memory instead of the block and undo files. Entries buried deeper
+ * than RECENT_BLOCK_CACHE_DEPTH are dropped, the lowest first once the byte
+ * budget is hit.
+ */
+class CRecentBlockCache
+{
+public:
+    typedef boost::shared_ptr<const CBlock> BlockPtr;
+    typedef boost::shared_ptr<const CBlockUndo> UndoPtr;
+
+private:
+    struct Entry {
+        BlockPtr pblock;
+        UndoPtr pundo;
+        int nHeight;
+        size_t nBytes;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<uint256, Entry> mapEntries;
+    std::set<std::pair<int, uint256> > setByHeight;
+    size_t nBytes;
+    size_t nMaxBytes;
+
+    void EraseEntry(std::map<uint256, Entry>::iterator it);
+
+public:
+    CRecentBlockCache(size_t nMaxBytesIn) : nBytes(0), nMaxBytes(nMaxBytesIn) {}
+
+    //! Keep a copy of the block of pindex, and the contents of *pundo if given (left empty)
+    void Put(const CBlockIndex* pindex, const CBlock& block, CBlockUndo* pundo);
+    //! The cached block or undo data, NULL if not cached
+    BlockPtr GetBlock(const uint256& hash) const;
+    UndoPtr GetUndo(const uint256& hash) const;
+    //! Drop what is buried below nTipHeight
+    void Prune(int nTipHeight);
+    //! Estimated heap memory of the entries and the blocks they hold
+    size_t DynamicMemoryUsage() const;
+};
+
+extern CRecentBlockCache recentBlocks;
+
+/** Transactions the script check memo remembers, the oldest are forgotten first */
+static const size_t SCRIPT_CHECK_MEMO_SIZE = 50000;
+
+/**
+ * Transactions whose scripts AcceptToMemoryPool verified, with the flags
+ * they passed under, so that ConnectBlock does not verify them again. The
+ * txid commits to the outpoints spent and so to the scriptPubKeys, which
+ * makes a verdict hold whatever the chain does meanwhile. Every script flag
+ * is a restriction: scripts that passed under some flags pass under any
+ * subset of them.
+ */
+class CScriptCheckMemo
+{
+private:
+    mutable CCriticalSection cs;
+    std::map<uint256, unsigned int> mapFlags;
+    std::deque<uint256> queueAdded; //!< The same txids, oldest first
+    size_t nMaxEntries;
+
+public:
+    CScriptCheckMemo(size_t nMaxEntriesIn) : nMaxEntries(nMaxEntriesIn) {}
+
+    //! Remember that the scripts of txid passed under flags
+    void Add(const uint256& txid, unsigned int flags);
+    //! Whether the scripts of txid passed under flags or stricter ones
+    bool IsChecked(const uint256& txid, unsigned int flags) const;
+    size_t size() const;
+    void clear();
+};
+
+extern CScriptCheckMemo scriptCheckMemo;
+
+/** Transactions CInputHeightCache remembers the height of before it starts over */
+static const size_t INPUT_HEIGHT_CACHE_SIZE = 100000;
+
+/**
+ * Heights of the blocks of transactions with unspent coins in the chainstate,
+ * for GetInputAge(): the masternode collaterals and the inputs of SwiftTX
+ * locks are looked up over and over. Connected blocks add their transactions
+ * and drop those they spend from, disconnected blocks drop both; anything
+ * else is added once it was read from pcoinsTip. Mempool transactions are not
+ * kept, their age is 0 until they are mined.
+ */
+class CInputHeightCache
+{
+private:
+    mutable CCriticalSection cs;
+    boost::unordered_map<uint256, int, BlockHasher> mapHeights;
+    size_t nMaxEntries;
+    //! Counts the block events, so that a height read before one is not added after it
+    uint64_t nGeneration;
+
+public:
+    CInputHeightCache(size_t nMaxEntriesIn) : nMaxEntries(nMaxEntriesIn), nGeneration(0) {}
+
+    bool Get(const uint256& txid, int& nHeight) const;
+    uint64_t GetGeneration() const;
+    //! Remember the height of txid read from the chainstate, unless a block came or went since nGenerationRead
+    void Add(const uint256& txid, int nHeight, uint64_t nGenerationRead);
+    void ConnectBlock(const CBlock& block, int nHeight);
+    void DisconnectBlock(const CBlock& block);
+    size_t size() const;
+    void clear();
+};
+
+extern CInputHeightCache inputHeightCache;
+
 
 /**
  * Closure representing one script verification
@@ -399,11 +767,13 @@ private:
     unsigned int nFlags;
     bool cacheStore;
     ScriptError error;
+    //! Shared by the checks of the inputs of ptxTo, may be NULL
+    boost::shared_ptr<const CSignatureHashCache> pcache;
 
 public:
     CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) : scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-                                                                                                                                ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, const boost::shared_ptr<const CSignatureHashCache>& pcacheIn = boost::shared_ptr<const CSignatureHashCache>()) : scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+                                                                                                                                ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), pcache(pcacheIn) {}
 
     bool operator()();
 
@@ -415,16 +785,57 @@ public:
         std::swap(nFlags, check.nFlags);
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
+        pcache.swap(check.pcache);
     }
 
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * A context-free check of a block, run on the block check queue by CheckBlock:
+ * CheckTransaction and the legacy sigop count of one transaction, the pairs
+ * [nBegin, nEnd) of one merkle tree level hashed into the level above it, or
+ * the block signature.
+ */
+class CBlockCheck
+{
+private:
+    const CTransaction* ptx;
+    unsigned int* pnSigOps;
+    uint256* pMerkleLevel;
+    unsigned int nLevelSize;
+    unsigned int nBegin;
+    unsigned int nEnd;
+    const CBlock* pblock;
+
+public:
+    CBlockCheck() : ptx(NULL), pnSigOps(NULL), pMerkleLevel(NULL), nLevelSize(0), nBegin(0), nEnd(0), pblock(NULL) {}
+    CBlockCheck(const CTransaction& txIn, unsigned int* pnSigOpsIn) : ptx(&txIn), pnSigOps(pnSigOpsIn), pMerkleLevel(NULL), nLevelSize(0), nBegin(0), nEnd(0), pblock(NULL) {}
+    CBlockCheck(uint256* pMerkleLevelIn, unsigned int nLevelSizeIn, unsigned int nBeginIn, unsigned int nEndIn) : ptx(NULL), pnSigOps(NULL), pMerkleLevel(pMerkleLevelIn), nLevelSize(nLevelSizeIn), nBegin(nBeginIn), nEnd(nEndIn), pblock(NULL) {}
+    //! Sets fCheckedSignature of the block, a bad signature is left to ProcessNewBlock
+    CBlockCheck(const CBlock& blockIn) : ptx(NULL), pnSigOps(NULL), pMerkleLevel(NULL), nLevelSize(0), nBegin(0), nEnd(0), pblock(&blockIn) {}
+
+    bool operator()();
+
+    void swap(CBlockCheck& check)
+    {
+        std::swap(ptx, check.ptx);
+        std::swap(pnSigOps, check.pnSigOps);
+        std::swap(pMerkleLevel, check.pMerkleLevel);
+        std::swap(nLevelSize, check.nLevelSize);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+        std::swap(pblock, check.pblock);
+    }
+};
 
-/** Functions for disk access for blocks */
-bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
+
+/** Functions for disk access for blocks. pchRaw, if given, must be the serialization of block */
+bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const char* pchRaw = NULL, unsigned int nRawSize = 0);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read the serialization of the block at pos as stored, without decoding it */
+bool ReadRawBlockFromDisk(std::vector<char>& vchBlock, const CDiskBlockPos& pos);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -432,30 +843,67 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified. With fJustCheck the address,
+ *  spent and timestamp indexes are left alone. */
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, bool fJustCheck = false);
 
 /** Reprocess a number of blocks to try and get on the correct chain again **/
 bool DisconnectBlocksAndReprocess(int blocks);
 
-/** Apply the effects of this block (with given index) on the UTXO set represented by coins */
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck, bool fAlreadyChecked = false);
+/**
+ * Time spent connecting blocks to the active chain, per phase, in microseconds,
+ * summed up since startup. Some phases are part of others: the inputs are
+ * fetched and checked while connecting the transactions, which is part of
+ * verifying them, and the undo data is written with the indexes.
+ */
+struct CBlockConnectTimings {
+    int64_t nBlocks;
+    int64_t nTransactions;
+    int64_t nInputs;
+    int64_t nReadFromDisk; //!< Loading the block, when it was not passed in
+    int64_t nFetchInputs;  //!< Bringing the coins spent into the view
+    int64_t nCheckInputs;  //!< CheckInputs, with the scripts when there are no script check threads
+    int64_t nConnect;      //!< Connecting the transactions to the view
+    int64_t nBlockValue;   //!< Checking the block value and budget payments
+    int64_t nVerify;       //!< Connecting the transactions and waiting for the script check threads
+    int64_t nUndo;         //!< Writing the undo data
+    int64_t nIndex;        //!< Writing the undo data and the indexes
+    int64_t nCallbacks;
+    int64_t nConnectTotal; //!< ConnectBlock as a whole
+    int64_t nFlush;        //!< Flushing the block's view into the coins tip
+    int64_t nChainState;   //!< Writing the chain state to disk, when needed
+    int64_t nPostConnect;  //!< Updating the mempool, the tip and the wallets
+    int64_t nTotal;
+
+    CBlockConnectTimings() { SetNull(); }
+
+    void SetNull();
+    /** The time spent since start was taken */
+    CBlockConnectTimings Since(const CBlockConnectTimings& start) const;
+};
+
+/** Requires cs_main */
+extern CBlockConnectTimings blockConnectTimings;
+
+/** Apply the effects of this block (with given index) on the UTXO set represented by coins.
+ *  pblockundoOut, if given, receives the undo data of a block fully connected. */
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck, bool fAlreadyChecked = false, CBlockUndo* pblockundoOut = NULL);
 
 /** Context-independent validity checks */
-bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
+bool CheckBlockHeader(const CBlock& block, CValidationState& state, bool fCheckPOW = true);
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true);
-bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev);
+bool CheckWork(const CBlock& block, CBlockIndex* const pindexPrev);
 
 /** Context-dependent validity checks */
-bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* pindexPrev);
+bool ContextualCheckBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex* pindexPrev);
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindexPrev);
 
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
-/** Store block on disk. If dbp is provided, the file is known to already reside on disk */
-bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** pindex, CDiskBlockPos* dbp = NULL, bool fAlreadyCheckedBlock = false);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex = NULL);
+/** Store block on disk. If dbp is provided, the file is known to already reside on disk. pchRaw is passed on to WriteBlockToDisk */
+bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** pindex, CDiskBlockPos* dbp = NULL, bool fAlreadyCheckedBlock = false, const char* pchRaw = NULL, unsigned int nRawSize = 0);
+bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex** ppindex = NULL);
 
 
 class CBlockFileInfo
@@ -610,6 +1058,22 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex);
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
+/** A few values of the chain tip, published whenever the tip changes */
+struct CChainTipSnapshot {
+    uint256 hashBlock;
+    int nHeight;
+    int64_t nTime;
+    int64_t nMedianTimePast;
+
+    CChainTipSnapshot() : hashBlock(0), nHeight(-1), nTime(0), nMedianTimePast(0) {}
+};
+
+/** The latest chain tip snapshot, read without taking cs_main */
+CChainTipSnapshot GetChainTipSnapshot();
+
+/** Estimated heap memory of the block index, the coins cache and the orphans, by name. Requires cs_main. */
+void GetChainstateMemoryUsage(std::map<std::string, size_t>& mapUsage);
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
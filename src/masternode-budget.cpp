@@ -8,12 +8,14 @@
 
 #include "activemasternode.h"
 #include "addrman.h"
+#include "core_memusage.h"
 #include "masternode-budget.h"
 #include "masternode-sync.h"
 #include "masternode-helpers.h"
 #include "masternodeconfig.h"
 #include "masternode.h"
 #include "masternodeman.h"
+#include "memusage.h"
 #include "util.h"
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
@@ -22,11 +24,55 @@ CBudgetManager budget;
 CCriticalSection cs_budget;
 
 std::map<uint256, int64_t> askedForSourceProposalOrBudget;
+// Time of the last "mnvsd" request we answered, by peer
+static std::map<NodeId, int64_t> mapSyncDigestRequests;
+
 std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
 std::vector<CFinalizedBudgetBroadcast> vecImmatureFinalizedBudgets;
 
 int nSubmittedFinalBudget;
 
+// Collateral transactions that passed IsBudgetCollateralValid, with the budget
+// hash they pay for and the block they are in
+static CCriticalSection cs_budgetCollateral;
+static std::map<uint256, std::pair<uint256, uint256> > mapVerifiedCollateral;
+
+template <typename T>
+static size_t VoteMapDynamicUsage(const std::map<uint256, T>& mapVotes)
+{
+    size_t nUsage = memusage::DynamicUsage(mapVotes);
+    for (typename std::map<uint256, T>::const_iterator it = mapVotes.begin(); it != mapVotes.end(); ++it)
+        nUsage += RecursiveDynamicUsage(it->second.vin) + memusage::DynamicUsage(it->second.vchSig);
+    return nUsage;
+}
+
+template <typename T, typename Expiry>
+static size_t VoteMapDynamicUsage(const CSeenCache<T, Expiry>& mapVotes)
+{
+    size_t nUsage = mapVotes.DynamicMemoryUsage();
+    for (typename CSeenCache<T, Expiry>::const_iterator it = mapVotes.begin(); it != mapVotes.end(); ++it)
+        nUsage += RecursiveDynamicUsage(it->second.value.vin) + memusage::DynamicUsage(it->second.value.vchSig);
+    return nUsage;
+}
+
+template <typename T, typename Expiry>
+static size_t VoteMapDynamicUsage(const CSeenCache<T, Expiry, CRelayBytes<T> >& mapVotes)
+{
+    size_t nUsage = mapVotes.DynamicMemoryUsage();
+    for (typename CSeenCache<T, Expiry, CRelayBytes<T> >::const_iterator it = mapVotes.begin(); it != mapVotes.end(); ++it)
+        nUsage += it->second.value.DynamicMemoryUsage();
+    return nUsage;
+}
+
+template <typename T>
+static size_t BudgetMapDynamicUsage(const std::map<uint256, T>& mapBudgets)
+{
+    size_t nUsage = memusage::DynamicUsage(mapBudgets);
+    for (typename std::map<uint256, T>::const_iterator it = mapBudgets.begin(); it != mapBudgets.end(); ++it)
+        nUsage += it->second.DynamicMemoryUsage();
+    return nUsage;
+}
+
 int GetBudgetPaymentCycleBlocks()
 {
     // Amount of blocks in a months period of time (using 1 minutes per) = (60*24*30)
@@ -38,33 +84,51 @@ int GetBudgetPaymentCycleBlocks()
 
 bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, std::string& strError, int64_t& nTime, int& nConf)
 {
-    CTransaction txCollateral;
     uint256 nBlockHash;
-    if (!GetTransaction(nTxCollateralHash, txCollateral, nBlockHash, true)) {
-        strError = strprintf("Can't find collateral tx %s", txCollateral.ToString());
-        LogPrint("masternode","CBudgetProposalBroadcast::IsBudgetCollateralValid - %s\n", strError);
-        return false;
+    bool fVerified = false;
+    {
+        // a collateral verified before only needs its confirmations counted, as long as its block is still active
+        LOCK(cs_budgetCollateral);
+        std::map<uint256, std::pair<uint256, uint256> >::iterator it = mapVerifiedCollateral.find(nTxCollateralHash);
+        if (it != mapVerifiedCollateral.end() && it->second.first == nExpectedHash) {
+            BlockMap::iterator mi = mapBlockIndex.find(it->second.second);
+            if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second)) {
+                nBlockHash = it->second.second;
+                fVerified = true;
+            } else {
+                mapVerifiedCollateral.erase(it);
+            }
+        }
     }
 
-    if (txCollateral.vout.size() < 1) return false;
-    if (txCollateral.nLockTime != 0) return false;
+    if (!fVerified) {
+        CTransaction txCollateral;
+        if (!GetTransaction(nTxCollateralHash, txCollateral, nBlockHash, true)) {
+            strError = strprintf("Can't find collateral tx %s", txCollateral.ToString());
+            LogPrint("masternode","CBudgetProposalBroadcast::IsBudgetCollateralValid - %s\n", strError);
+            return false;
+        }
+
+        if (txCollateral.vout.size() < 1) return false;
+        if (txCollateral.nLockTime != 0) return false;
 
-    CScript findScript;
-    findScript << OP_RETURN << ToByteVector(nExpectedHash);
+        CScript findScript;
+        findScript << OP_RETURN << ToByteVector(nExpectedHash);
 
-    bool foundOpReturn = false;
-    BOOST_FOREACH (const CTxOut o, txCollateral.vout) {
-        if (!o.scriptPubKey.IsNormalPaymentScript() && !o.scriptPubKey.IsUnspendable()) {
-            strError = strprintf("Invalid Script %s", txCollateral.ToString());
+        bool foundOpReturn = false;
+        BOOST_FOREACH (const CTxOut o, txCollateral.vout) {
+            if (!o.scriptPubKey.IsNormalPaymentScript() && !o.scriptPubKey.IsUnspendable()) {
+                strError = strprintf("Invalid Script %s", txCollateral.ToString());
+                LogPrint("masternode","CBudgetProposalBroadcast::IsBudgetCollateralValid - %s\n", strError);
+                return false;
+            }
+            if (o.scriptPubKey == findScript && o.nValue >= PROPOSAL_FEE_TX) foundOpReturn = true;
+        }
+        if (!foundOpReturn) {
+            strError = strprintf("Couldn't find opReturn %s in %s", nExpectedHash.ToString(), txCollateral.ToString());
             LogPrint("masternode","CBudgetProposalBroadcast::IsBudgetCollateralValid - %s\n", strError);
             return false;
         }
-        if (o.scriptPubKey == findScript && o.nValue >= PROPOSAL_FEE_TX) foundOpReturn = true;
-    }
-    if (!foundOpReturn) {
-        strError = strprintf("Couldn't find opReturn %s in %s", nExpectedHash.ToString(), txCollateral.ToString());
-        LogPrint("masternode","CBudgetProposalBroadcast::IsBudgetCollateralValid - %s\n", strError);
-        return false;
     }
 
     // RETRIEVE CONFIRMATIONS AND NTIME
@@ -81,6 +145,13 @@ bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, s
             if (chainActive.Contains(pindex)) {
                 conf += chainActive.Height() - pindex->nHeight + 1;
                 nTime = pindex->nTime;
+
+                if (!fVerified) {
+                    LOCK(cs_budgetCollateral);
+                    if (mapVerifiedCollateral.size() >= BUDGET_COLLATERAL_CACHE_MAX)
+                        mapVerifiedCollateral.erase(mapVerifiedCollateral.begin());
+                    mapVerifiedCollateral[nTxCollateralHash] = std::make_pair(nExpectedHash, nBlockHash);
+                }
             }
         }
     }
@@ -103,24 +174,27 @@ void CBudgetManager::CheckOrphanVotes()
 
 
     std::string strError = "";
-    std::map<uint256, CBudgetVote>::iterator it1 = mapOrphanMasternodeBudgetVotes.begin();
-    while (it1 != mapOrphanMasternodeBudgetVotes.end()) {
-        if (budget.UpdateProposal(((*it1).second), NULL, strError)) {
+    std::vector<uint256> vErase;
+    for (OrphanBudgetVoteCache::const_iterator it1 = mapOrphanMasternodeBudgetVotes.begin(); it1 != mapOrphanMasternodeBudgetVotes.end(); ++it1) {
+        CBudgetVote vote = it1->second.value;
+        if (budget.UpdateProposal(vote, NULL, strError)) {
             LogPrint("masternode","CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
-            mapOrphanMasternodeBudgetVotes.erase(it1++);
-        } else {
-            ++it1;
+            vErase.push_back(it1->first);
         }
     }
-    std::map<uint256, CFinalizedBudgetVote>::iterator it2 = mapOrphanFinalizedBudgetVotes.begin();
-    while (it2 != mapOrphanFinalizedBudgetVotes.end()) {
-        if (budget.UpdateFinalizedBudget(((*it2).second), NULL, strError)) {
+    BOOST_FOREACH (const uint256& hash, vErase)
+        mapOrphanMasternodeBudgetVotes.Erase(hash);
+
+    vErase.clear();
+    for (OrphanFinalizedBudgetVoteCache::const_iterator it2 = mapOrphanFinalizedBudgetVotes.begin(); it2 != mapOrphanFinalizedBudgetVotes.end(); ++it2) {
+        CFinalizedBudgetVote vote = it2->second.value;
+        if (budget.UpdateFinalizedBudget(vote, NULL, strError)) {
             LogPrint("masternode","CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
-            mapOrphanFinalizedBudgetVotes.erase(it2++);
-        } else {
-            ++it2;
+            vErase.push_back(it2->first);
         }
     }
+    BOOST_FOREACH (const uint256& hash, vErase)
+        mapOrphanFinalizedBudgetVotes.Erase(hash);
     LogPrint("masternode","CBudgetManager::CheckOrphanVotes - Done\n");
 }
 
@@ -243,157 +317,23 @@ void CBudgetManager::SubmitFinalBudget()
     LogPrint("masternode","CBudgetManager::SubmitFinalBudget - Done! %s\n", finalizedBudgetBroadcast.GetHash().ToString());
 }
 
-//
-// CBudgetDB
-//
-
-CBudgetDB::CBudgetDB()
-{
-    pathDB = GetDataDir() / "budget.dat";
-    strMagicMessage = "MasternodeBudget";
-}
-
-bool CBudgetDB::Write(const CBudgetManager& objToSave)
-{
-    LOCK(objToSave.cs);
-
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
-
-    return true;
-}
-
-CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
-{
-    LOCK(objToLoad.cs);
-
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-
-        // de-serialize data into CBudgetManager object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
-    }
-
-    LogPrint("masternode","Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Budget manager - cleaning....\n");
-        objToLoad.CheckAndRemove();
-        LogPrint("masternode","Budget manager - result:\n");
-        LogPrint("masternode","  %s\n", objToLoad.ToString());
-    }
-
-    return Ok;
-}
-
 void DumpBudgets()
 {
     int64_t nStart = GetTimeMillis();
 
-    CBudgetDB budgetdb;
-    CBudgetManager tempBudget;
+    CBudgetDB db;
 
     LogPrint("masternode","Verifying budget.dat format...\n");
-    CBudgetDB::ReadResult readResult = budgetdb.Read(tempBudget, true);
+    CBudgetDB::ReadResult readResult = db.Verify();
     // there was an error and it was not an error on file opening => do not proceed
     if (readResult == CBudgetDB::FileError)
         LogPrint("masternode","Missing budgets file - budget.dat, will try to recreate\n");
     else if (readResult != CBudgetDB::Ok) {
-        LogPrint("masternode","Error reading budget.dat: ");
-        if (readResult == CBudgetDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
+        LogPrint("masternode","Error reading budget.dat: file format is unknown or invalid, please fix it manually\n");
+        return;
     }
     LogPrint("masternode","Writting info to budget.dat...\n");
-    budgetdb.Write(budget);
+    db.Write(budget);
 
     LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
 }
@@ -408,6 +348,9 @@ bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
     }
 
     mapFinalizedBudgets.insert(make_pair(finalizedBudget.GetHash(), finalizedBudget));
+    InvalidateFinalizedBudgetCache();
+    // Published as the fbs message relays it
+    NotifyMasternodeMessage("rawfinalbudget", CFinalizedBudgetBroadcast(finalizedBudget));
     return true;
 }
 
@@ -425,6 +368,7 @@ bool CBudgetManager::AddProposal(CBudgetProposal& budgetProposal)
     }
 
     mapProposals.insert(make_pair(budgetProposal.GetHash(), budgetProposal));
+    InvalidateBudgetCache();
     LogPrint("masternode","CBudgetManager::AddProposal - proposal %s added\n", budgetProposal.GetName ().c_str ());
     return true;
 }
@@ -433,6 +377,17 @@ void CBudgetManager::CheckAndRemove()
 {
     LogPrint("mnbudget", "CBudgetManager::CheckAndRemove\n");
 
+    InvalidateBudgetCache();
+
+    {
+        LOCK(cs);
+        int64_t nNow = GetTime();
+        mapSeenMasternodeBudgetVotes.ExpireBefore(nNow);
+        mapSeenFinalizedBudgetVotes.ExpireBefore(nNow);
+        mapOrphanMasternodeBudgetVotes.ExpireBefore(nNow);
+        mapOrphanFinalizedBudgetVotes.ExpireBefore(nNow);
+    }
+
     // map<uint256, CFinalizedBudget> tmpMapFinalizedBudgets;
     // map<uint256, CBudgetProposal> tmpMapProposals;
 
@@ -593,19 +548,38 @@ CBudgetProposal* CBudgetManager::FindProposal(uint256 nHash)
 
 bool CBudgetManager::IsBudgetPaymentBlock(int nBlockHeight)
 {
+    LOCK(cs);
+
+    // every ConnectBlock asks, so keep what the answer is made of
     int nHighestCount = -1;
-    int nFivePercent = mnodeman.CountEnabled(ActiveProtocol()) / 20;
+    std::map<int, int>::const_iterator itCount = mapHighestVoteCounts.find(nBlockHeight);
+    if (itCount != mapHighestVoteCounts.end()) {
+        nHighestCount = itCount->second;
+    } else {
+        std::map<uint256, CFinalizedBudget>::iterator it = mapFinalizedBudgets.begin();
+        while (it != mapFinalizedBudgets.end()) {
+            CFinalizedBudget* pfinalizedBudget = &((*it).second);
+            if (pfinalizedBudget->GetVoteCount() > nHighestCount &&
+                nBlockHeight >= pfinalizedBudget->GetBlockStart() &&
+                nBlockHeight <= pfinalizedBudget->GetBlockEnd()) {
+                nHighestCount = pfinalizedBudget->GetVoteCount();
+            }
 
-    std::map<uint256, CFinalizedBudget>::iterator it = mapFinalizedBudgets.begin();
-    while (it != mapFinalizedBudgets.end()) {
-        CFinalizedBudget* pfinalizedBudget = &((*it).second);
-        if (pfinalizedBudget->GetVoteCount() > nHighestCount &&
-            nBlockHeight >= pfinalizedBudget->GetBlockStart() &&
-            nBlockHeight <= pfinalizedBudget->GetBlockEnd()) {
-            nHighestCount = pfinalizedBudget->GetVoteCount();
+            ++it;
         }
 
-        ++it;
+        if (mapHighestVoteCounts.size() >= BUDGET_PAYMENT_BLOCK_HEIGHTS)
+            mapHighestVoteCounts.erase(mapHighestVoteCounts.begin());
+        mapHighestVoteCounts[nBlockHeight] = nHighestCount;
+    }
+
+    CBlockIndex* pindexTip = chainActive.Tip();
+    uint256 hashTip = pindexTip ? pindexTip->GetBlockHash() : uint256(0);
+    unsigned int nListVersion = mnodeman.GetListVersion();
+    if (hashTip == 0 || hashTip != hashFivePercentTip || nListVersion != nFivePercentListVersion) {
+        nFivePercent = mnodeman.CountEnabled(ActiveProtocol()) / 20;
+        hashFivePercentTip = hashTip;
+        nFivePercentListVersion = nListVersion;
     }
 
     LogPrint("masternode","CBudgetManager::IsBudgetPaymentBlock() - nHighestCount: %lli, 5%% of Masternodes: %lli. Number of budgets: %lli\n", 
@@ -713,6 +687,13 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
 {
     LOCK(cs);
 
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    if (pindexPrev == NULL) return std::vector<CBudgetProposal*>();
+
+    unsigned int nListVersion = mnodeman.GetListVersion();
+    if (fBudgetCacheValid && hashBudgetCacheTip == pindexPrev->GetBlockHash() && nBudgetCacheListVersion == nListVersion)
+        return vBudgetCache;
+
     // ------- Sort budgets by Yes Count
 
     std::vector<std::pair<CBudgetProposal*, int> > vBudgetPorposalsSort;
@@ -731,8 +712,6 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
     std::vector<CBudgetProposal*> vBudgetProposalsRet;
 
     CAmount nBudgetAllocated = 0;
-    CBlockIndex* pindexPrev = chainActive.Tip();
-    if (pindexPrev == NULL) return vBudgetProposalsRet;
 
     int nBlockStart = pindexPrev->nHeight - pindexPrev->nHeight % GetBudgetPaymentCycleBlocks() + GetBudgetPaymentCycleBlocks();
     int nBlockEnd = nBlockStart + GetBudgetPaymentCycleBlocks() - 1;
@@ -775,6 +754,11 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
         ++it2;
     }
 
+    vBudgetCache = vBudgetProposalsRet;
+    fBudgetCacheValid = true;
+    hashBudgetCacheTip = pindexPrev->GetBlockHash();
+    nBudgetCacheListVersion = nListVersion;
+
     return vBudgetProposalsRet;
 }
 
@@ -896,15 +880,23 @@ void CBudgetManager::NewBlock()
     // incremental sync with our peers
     if (masternodeSync.IsSynced()) {
         LogPrint("masternode","CBudgetManager::NewBlock - incremental sync started\n");
-        if (chainActive.Height() % 1440 == rand() % 1440) {
+        bool fResync = (chainActive.Height() % 1440 == (int)GetInsecureRand(1440));
+        CSyncDigest digest;
+        if (fResync) {
+            // peers that understand digests send us what we miss, against what we had before forgetting it
+            GetSyncDigest(digest);
             ClearSeen();
             ResetSync();
         }
 
         LOCK(cs_vNodes);
-        BOOST_FOREACH (CNode* pnode, vNodes)
-            if (pnode->nVersion >= ActiveProtocol())
-                Sync(pnode, 0, true);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->nVersion < ActiveProtocol()) continue;
+
+            Sync(pnode, 0, true);
+            if (fResync && pnode->nVersion >= SYNC_DIGEST_VERSION)
+                pnode->PushMessage("mnvsd", uint256(0), digest);
+        }
 
         MarkSynced();
     }
@@ -924,6 +916,15 @@ void CBudgetManager::NewBlock()
         }
     }
 
+    std::map<NodeId, int64_t>::iterator itDigest = mapSyncDigestRequests.begin();
+    while (itDigest != mapSyncDigestRequests.end()) {
+        if ((*itDigest).second > GetTime() - BUDGET_SYNC_DIGEST_INTERVAL) {
+            ++itDigest;
+        } else {
+            mapSyncDigestRequests.erase(itDigest++);
+        }
+    }
+
     LogPrint("masternode","CBudgetManager::NewBlock - mapProposals cleanup - size: %d\n", mapProposals.size());
     std::map<uint256, CBudgetProposal>::iterator it2 = mapProposals.begin();
     while (it2 != mapProposals.end()) {
@@ -991,6 +992,78 @@ void CBudgetManager::NewBlock()
     LogPrint("masternode","CBudgetManager::NewBlock - PASSED\n");
 }
 
+/** Finishes a budget vote from a peer once its signature was checked */
+static void BudgetVoteChecked(CNode* pfrom, CBudgetVote& vote, bool fValid)
+{
+    if (!fValid) {
+        LogPrint("masternode","mvote - signature invalid\n");
+        if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20, _("masternode-budget::ProcessMessage::ln 1065::Masternode vote signature invalid"));
+        // it could just be a non-synced masternode
+        mnodeman.AskForMN(pfrom, vote.vin);
+        return;
+    }
+
+    LOCK(cs_budget);
+
+    std::string strError = "";
+    if (budget.UpdateProposal(vote, pfrom, strError)) {
+        vote.Relay();
+        masternodeSync.AddedBudgetItem(vote.GetHash());
+    }
+
+    LogPrint("masternode","mvote - new budget vote for budget %s - %s\n", vote.nProposalHash.ToString(),  vote.GetHash().ToString());
+}
+
+struct CBudgetVoteChecked {
+    CBudgetVote vote;
+    CPubKey pubKeyMasternode;
+
+    CBudgetVoteChecked(const CBudgetVote& voteIn, const CPubKey& pubKeyMasternodeIn) : vote(voteIn), pubKeyMasternode(pubKeyMasternodeIn) {}
+
+    void operator()(CNode* pfrom, bool fValid)
+    {
+        if (fValid) vote.pubKeyVerified = pubKeyMasternode;
+        BudgetVoteChecked(pfrom, vote, fValid);
+    }
+};
+
+/** Finishes a finalized budget vote from a peer once its signature was checked */
+static void FinalizedBudgetVoteChecked(CNode* pfrom, CFinalizedBudgetVote& vote, bool fValid)
+{
+    if (!fValid) {
+        LogPrint("masternode","fbvote - signature invalid\n");
+        if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20, _("masternode-budget::ProcessMessage::ln 1137::Masternode Vote invalid"));
+        // it could just be a non-synced masternode
+        mnodeman.AskForMN(pfrom, vote.vin);
+        return;
+    }
+
+    LOCK(cs_budget);
+
+    std::string strError = "";
+    if (budget.UpdateFinalizedBudget(vote, pfrom, strError)) {
+        vote.Relay();
+        masternodeSync.AddedBudgetItem(vote.GetHash());
+
+        LogPrint("masternode","fbvote - new finalized budget vote - %s\n", vote.GetHash().ToString());
+    } else {
+        LogPrint("masternode","fbvote - rejected finalized budget vote - %s - %s\n", vote.GetHash().ToString(), strError);
+    }
+}
+
+struct CFinalizedBudgetVoteChecked {
+    CFinalizedBudgetVote vote;
+    CPubKey pubKeyMasternode;
+
+    CFinalizedBudgetVoteChecked(const CFinalizedBudgetVote& voteIn, const CPubKey& pubKeyMasternodeIn) : vote(voteIn), pubKeyMasternode(pubKeyMasternodeIn) {}
+
+    void operator()(CNode* pfrom, bool fValid)
+    {
+        if (fValid) vote.pubKeyVerified = pubKeyMasternode;
+        FinalizedBudgetVoteChecked(pfrom, vote, fValid);
+    }
+};
+
 void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     // lite mode is not supported
@@ -1018,6 +1091,28 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         LogPrint("mnbudget", "mnvs - Sent Masternode votes to peer %i\n", pfrom->GetId());
     }
 
+    if (strCommand == "mnvsd") { //Masternode vote sync, against the digest of what the peer has
+        uint256 nProp;
+        CSyncDigest digest;
+        vRecv >> nProp >> digest;
+
+        if (!digest.IsValid()) {
+            LogPrint("masternode","mnvsd - invalid digest from peer %i\n", pfrom->GetId());
+            return;
+        }
+
+        // peers reconcile on sync and about once a day after, don't walk the budget for more
+        std::map<NodeId, int64_t>::iterator it = mapSyncDigestRequests.find(pfrom->GetId());
+        if (it != mapSyncDigestRequests.end() && (*it).second > GetTime() - BUDGET_SYNC_DIGEST_INTERVAL) {
+            LogPrint("masternode","mnvsd - peer %i asked again too soon\n", pfrom->GetId());
+            return;
+        }
+        mapSyncDigestRequests[pfrom->GetId()] = GetTime();
+
+        Sync(pfrom, nProp, false, &digest);
+        LogPrint("mnbudget", "mnvsd - Sent missing Masternode votes to peer %i\n", pfrom->GetId());
+    }
+
     if (strCommand == "mprop") { //Masternode Proposal
         CBudgetProposalBroadcast budgetProposalBroadcast;
         vRecv >> budgetProposalBroadcast;
@@ -1072,22 +1167,8 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
 
 
-        mapSeenMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote));
-        if (!vote.SignatureValid(true)) {
-            LogPrint("masternode","mvote - signature invalid\n");
-            if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20, _("masternode-budget::ProcessMessage::ln 1065::Masternode vote signature invalid"));
-            // it could just be a non-synced masternode
-            mnodeman.AskForMN(pfrom, vote.vin);
-            return;
-        }
-
-        std::string strError = "";
-        if (UpdateProposal(vote, pfrom, strError)) {
-            vote.Relay();
-            masternodeSync.AddedBudgetItem(vote.GetHash());
-        }
-
-        LogPrint("masternode","mvote - new budget vote for budget %s - %s\n", vote.nProposalHash.ToString(),  vote.GetHash().ToString());
+        mapSeenMasternodeBudgetVotes.Insert(vote.GetHash(), vote);
+        mnsigcheckqueue.Push(pfrom, vote.GetSignatureCheck(pmn->pubKeyMasternode), CBudgetVoteChecked(vote, pmn->pubKeyMasternode));
     }
 
     if (strCommand == "fbs") { //Finalized Budget Suggestion
@@ -1144,24 +1225,8 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             return;
         }
 
-        mapSeenFinalizedBudgetVotes.insert(make_pair(vote.GetHash(), vote));
-        if (!vote.SignatureValid(true)) {
-            LogPrint("masternode","fbvote - signature invalid\n");
-            if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20, _("masternode-budget::ProcessMessage::ln 1137::Masternode Vote invalid"));
-            // it could just be a non-synced masternode
-            mnodeman.AskForMN(pfrom, vote.vin);
-            return;
-        }
-
-        std::string strError = "";
-        if (UpdateFinalizedBudget(vote, pfrom, strError)) {
-            vote.Relay();
-            masternodeSync.AddedBudgetItem(vote.GetHash());
-
-            LogPrint("masternode","fbvote - new finalized budget vote - %s\n", vote.GetHash().ToString());
-        } else {
-            LogPrint("masternode","fbvote - rejected finalized budget vote - %s - %s\n", vote.GetHash().ToString(), strError);
-        }
+        mapSeenFinalizedBudgetVotes.Insert(vote.GetHash(), vote);
+        mnsigcheckqueue.Push(pfrom, vote.GetSignatureCheck(pmn->pubKeyMasternode), CFinalizedBudgetVoteChecked(vote, pmn->pubKeyMasternode));
     }
 }
 
@@ -1246,7 +1311,52 @@ void CBudgetManager::MarkSynced()
 }
 
 
-void CBudgetManager::Sync(CNode* pfrom, uint256 nProp, bool fPartial)
+void CBudgetManager::GetSyncDigest(CSyncDigest& digest)
+{
+    LOCK(cs);
+
+    std::map<uint256, CBudgetProposalBroadcast>::iterator it1 = mapSeenMasternodeBudgetProposals.begin();
+    while (it1 != mapSeenMasternodeBudgetProposals.end()) {
+        CBudgetProposal* pbudgetProposal = FindProposal((*it1).first);
+        if (pbudgetProposal && pbudgetProposal->fValid) {
+            digest.Add((*it1).second.GetHash());
+
+            std::map<uint256, CBudgetVote>::iterator it2 = pbudgetProposal->mapVotes.begin();
+            while (it2 != pbudgetProposal->mapVotes.end()) {
+                if ((*it2).second.fValid)
+                    digest.Add((*it2).second.GetHash());
+                ++it2;
+            }
+        }
+        ++it1;
+    }
+
+    std::map<uint256, CFinalizedBudgetBroadcast>::iterator it3 = mapSeenFinalizedBudgets.begin();
+    while (it3 != mapSeenFinalizedBudgets.end()) {
+        CFinalizedBudget* pfinalizedBudget = FindFinalizedBudget((*it3).first);
+        if (pfinalizedBudget && pfinalizedBudget->fValid) {
+            digest.Add((*it3).second.GetHash());
+
+            std::map<uint256, CFinalizedBudgetVote>::iterator it4 = pfinalizedBudget->mapVotes.begin();
+            while (it4 != pfinalizedBudget->mapVotes.end()) {
+                if ((*it4).second.fValid)
+                    digest.Add((*it4).second.GetHash());
+                ++it4;
+            }
+        }
+        ++it3;
+    }
+}
+
+void CBudgetManager::RequestSyncDigest(CNode* pnode)
+{
+    CSyncDigest digest;
+    GetSyncDigest(digest);
+    uint256 n = 0;
+    pnode->PushMessage("mnvsd", n, digest);
+}
+
+void CBudgetManager::Sync(CNode* pfrom, uint256 nProp, bool fPartial, const CSyncDigest* pdigest)
 {
     LOCK(cs);
 
@@ -1258,15 +1368,26 @@ void CBudgetManager::Sync(CNode* pfrom, uint256 nProp, bool fPartial)
         This code checks each of the hash maps for all known budget proposals and finalized budget proposals, then checks them against the
         budget object to see if they're OK. If all checks pass, we'll send it to the peer.
 
+        With the digest of a peer, only the items in the buckets where our digest differs get announced. The
+        counts still cover every item, as the peer's sync status expects.
+
     */
 
+    CSyncDigest digestLocal;
+    if (pdigest) GetSyncDigest(digestLocal);
+
     int nInvCount = 0;
+    int nInvSent = 0;
 
     std::map<uint256, CBudgetProposalBroadcast>::iterator it1 = mapSeenMasternodeBudgetProposals.begin();
     while (it1 != mapSeenMasternodeBudgetProposals.end()) {
         CBudgetProposal* pbudgetProposal = FindProposal((*it1).first);
         if (pbudgetProposal && pbudgetProposal->fValid && (nProp == 0 || (*it1).first == nProp)) {
-            pfrom->PushInventory(CInv(MSG_BUDGET_PROPOSAL, (*it1).second.GetHash()));
+            uint256 hash = (*it1).second.GetHash();
+            if (!pdigest || !digestLocal.BucketMatches(*pdigest, hash)) {
+                pfrom->PushInventory(CInv(MSG_BUDGET_PROPOSAL, hash));
+                nInvSent++;
+            }
             nInvCount++;
 
             //send votes
@@ -1274,7 +1395,11 @@ void CBudgetManager::Sync(CNode* pfrom, uint256 nProp, bool fPartial)
             while (it2 != pbudgetProposal->mapVotes.end()) {
                 if ((*it2).second.fValid) {
                     if ((fPartial && !(*it2).second.fSynced) || !fPartial) {
-                        pfrom->PushInventory(CInv(MSG_BUDGET_VOTE, (*it2).second.GetHash()));
+                        uint256 hashVote = (*it2).second.GetHash();
+                        if (!pdigest || !digestLocal.BucketMatches(*pdigest, hashVote)) {
+                            pfrom->PushInventory(CInv(MSG_BUDGET_VOTE, hashVote));
+                            nInvSent++;
+                        }
                         nInvCount++;
                     }
                 }
@@ -1286,15 +1411,20 @@ void CBudgetManager::Sync(CNode* pfrom, uint256 nProp, bool fPartial)
 
     pfrom->PushMessage("ssc", MASTERNODE_SYNC_BUDGET_PROP, nInvCount);
 
-    LogPrint("mnbudget", "CBudgetManager::Sync - sent %d items\n", nInvCount);
+    LogPrint("mnbudget", "CBudgetManager::Sync - sent %d of %d items\n", nInvSent, nInvCount);
 
     nInvCount = 0;
+    nInvSent = 0;
 
     std::map<uint256, CFinalizedBudgetBroadcast>::iterator it3 = mapSeenFinalizedBudgets.begin();
     while (it3 != mapSeenFinalizedBudgets.end()) {
         CFinalizedBudget* pfinalizedBudget = FindFinalizedBudget((*it3).first);
         if (pfinalizedBudget && pfinalizedBudget->fValid && (nProp == 0 || (*it3).first == nProp)) {
-            pfrom->PushInventory(CInv(MSG_BUDGET_FINALIZED, (*it3).second.GetHash()));
+            uint256 hash = (*it3).second.GetHash();
+            if (!pdigest || !digestLocal.BucketMatches(*pdigest, hash)) {
+                pfrom->PushInventory(CInv(MSG_BUDGET_FINALIZED, hash));
+                nInvSent++;
+            }
             nInvCount++;
 
             //send votes
@@ -1302,7 +1432,11 @@ void CBudgetManager::Sync(CNode* pfrom, uint256 nProp, bool fPartial)
             while (it4 != pfinalizedBudget->mapVotes.end()) {
                 if ((*it4).second.fValid) {
                     if ((fPartial && !(*it4).second.fSynced) || !fPartial) {
-                        pfrom->PushInventory(CInv(MSG_BUDGET_FINALIZED_VOTE, (*it4).second.GetHash()));
+                        uint256 hashVote = (*it4).second.GetHash();
+                        if (!pdigest || !digestLocal.BucketMatches(*pdigest, hashVote)) {
+                            pfrom->PushInventory(CInv(MSG_BUDGET_FINALIZED_VOTE, hashVote));
+                            nInvSent++;
+                        }
                         nInvCount++;
                     }
                 }
@@ -1313,7 +1447,7 @@ void CBudgetManager::Sync(CNode* pfrom, uint256 nProp, bool fPartial)
     }
 
     pfrom->PushMessage("ssc", MASTERNODE_SYNC_BUDGET_FIN, nInvCount);
-    LogPrint("mnbudget", "CBudgetManager::Sync - sent %d items\n", nInvCount);
+    LogPrint("mnbudget", "CBudgetManager::Sync - sent %d of %d items\n", nInvSent, nInvCount);
 }
 
 bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string& strError)
@@ -1327,7 +1461,8 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
             if (!masternodeSync.IsSynced()) return false;
 
             LogPrint("masternode","CBudgetManager::UpdateProposal - Unknown proposal %d, asking for source proposal\n", vote.nProposalHash.ToString());
-            mapOrphanMasternodeBudgetVotes[vote.nProposalHash] = vote;
+            mapOrphanMasternodeBudgetVotes.Erase(vote.nProposalHash);
+            mapOrphanMasternodeBudgetVotes.Insert(vote.nProposalHash, vote);
 
             if (!askedForSourceProposalOrBudget.count(vote.nProposalHash)) {
                 pfrom->PushMessage("mnvs", vote.nProposalHash);
@@ -1340,7 +1475,12 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
     }
 
 
-    return mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError);
+    if (!mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError))
+        return false;
+
+    InvalidateBudgetCache();
+    NotifyMasternodeMessage("rawbudgetvote", vote);
+    return true;
 }
 
 bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pfrom, std::string& strError)
@@ -1354,7 +1494,8 @@ bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pf
             if (!masternodeSync.IsSynced()) return false;
 
             LogPrint("masternode","CBudgetManager::UpdateFinalizedBudget - Unknown Finalized Proposal %s, asking for source budget\n", vote.nBudgetHash.ToString());
-            mapOrphanFinalizedBudgetVotes[vote.nBudgetHash] = vote;
+            mapOrphanFinalizedBudgetVotes.Erase(vote.nBudgetHash);
+            mapOrphanFinalizedBudgetVotes.Insert(vote.nBudgetHash, vote);
 
             if (!askedForSourceProposalOrBudget.count(vote.nBudgetHash)) {
                 pfrom->PushMessage("mnvs", vote.nBudgetHash);
@@ -1366,7 +1507,11 @@ bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pf
         return false;
     }
     LogPrint("masternode","CBudgetManager::UpdateFinalizedBudget - Finalized Proposal %s added\n", vote.nBudgetHash.ToString());
-    return mapFinalizedBudgets[vote.nBudgetHash].AddOrUpdateVote(vote, strError);
+    if (!mapFinalizedBudgets[vote.nBudgetHash].AddOrUpdateVote(vote, strError))
+        return false;
+
+    InvalidateFinalizedBudgetCache();
+    return true;
 }
 
 CBudgetProposal::CBudgetProposal()
@@ -1377,6 +1522,11 @@ CBudgetProposal::CBudgetProposal()
     nAmount = 0;
     nTime = 0;
     fValid = true;
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
+    fVotesCleaned = false;
+    nVotesCleanedListVersion = 0;
 }
 
 CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strURLIn, int nBlockStartIn, int nBlockEndIn, CScript addressIn, CAmount nAmountIn, uint256 nFeeTXHashIn)
@@ -1389,6 +1539,7 @@ CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strU
     nAmount = nAmountIn;
     nFeeTXHash = nFeeTXHashIn;
     fValid = true;
+    RecountVotes();
 }
 
 CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
@@ -1403,6 +1554,13 @@ CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
     nFeeTXHash = other.nFeeTXHash;
     mapVotes = other.mapVotes;
     fValid = true;
+    RecountVotes();
+}
+
+size_t CBudgetProposal::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return memusage::DynamicUsage(strProposalName) + memusage::DynamicUsage(strURL) + RecursiveDynamicUsage(address) + VoteMapDynamicUsage(mapVotes);
 }
 
 bool CBudgetProposal::IsValid(std::string& strError, bool fCheckCollateral)
@@ -1489,14 +1647,15 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
 
     uint256 hash = vote.vin.prevout.GetHash();
 
-    if (mapVotes.count(hash)) {
-        if (mapVotes[hash].nTime > vote.nTime) {
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.find(hash);
+    if (it != mapVotes.end()) {
+        if ((*it).second.nTime > vote.nTime) {
             strError = strprintf("new vote older than existing vote - %s\n", vote.GetHash().ToString());
             LogPrint("mnbudget", "CBudgetProposal::AddOrUpdateVote - %s\n", strError);
             return false;
         }
-        if (vote.nTime - mapVotes[hash].nTime < BUDGET_VOTE_UPDATE_MIN) {
-            strError = strprintf("time between votes is too soon - %s - %lli sec < %lli sec\n", vote.GetHash().ToString(), vote.nTime - mapVotes[hash].nTime,BUDGET_VOTE_UPDATE_MIN);
+        if (vote.nTime - (*it).second.nTime < BUDGET_VOTE_UPDATE_MIN) {
+            strError = strprintf("time between votes is too soon - %s - %lli sec < %lli sec\n", vote.GetHash().ToString(), vote.nTime - (*it).second.nTime,BUDGET_VOTE_UPDATE_MIN);
             LogPrint("mnbudget", "CBudgetProposal::AddOrUpdateVote - %s\n", strError);
             return false;
         }
@@ -1509,21 +1668,66 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
         return false;
     }
 
-    mapVotes[hash] = vote;
+    if (it != mapVotes.end()) {
+        CountVote((*it).second, -1);
+        (*it).second = vote;
+    } else {
+        it = mapVotes.insert(make_pair(hash, vote)).first;
+    }
+    CountVote((*it).second, 1);
     LogPrint("mnbudget", "CBudgetProposal::AddOrUpdateVote - %s %s\n", strAction.c_str(), vote.GetHash().ToString().c_str());
 
     return true;
 }
 
+void CBudgetProposal::CountVote(const CBudgetVote& vote, int nDelta)
+{
+    if (!vote.fValid) return;
+
+    if (vote.nVote == VOTE_YES) nYeas += nDelta;
+    if (vote.nVote == VOTE_NO) nNays += nDelta;
+    if (vote.nVote == VOTE_ABSTAIN) nAbstains += nDelta;
+}
+
+void CBudgetProposal::RecountVotes()
+{
+    LOCK(cs);
+
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
+    fVotesCleaned = false;
+
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
+    while (it != mapVotes.end()) {
+        CountVote((*it).second, 1);
+        ++it;
+    }
+}
+
 // If masternode voted for a proposal, but is now invalid -- remove the vote
 void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
 {
+    LOCK(cs);
+
+    // Without signature checks a vote only turns invalid when its masternode leaves the list
+    unsigned int nListVersion = mnodeman.GetListVersion();
+    if (!fSignatureCheck && fVotesCleaned && nVotesCleanedListVersion == nListVersion) return;
+
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
 
     while (it != mapVotes.end()) {
-        (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
+        bool fVoteValid = (*it).second.SignatureValid(fSignatureCheck);
+        if (fVoteValid != (*it).second.fValid) {
+            CountVote((*it).second, -1);
+            (*it).second.fValid = fVoteValid;
+            CountVote((*it).second, 1);
+        }
         ++it;
     }
+
+    fVotesCleaned = true;
+    nVotesCleanedListVersion = nListVersion;
 }
 
 double CBudgetProposal::GetRatio()
@@ -1546,41 +1750,20 @@ double CBudgetProposal::GetRatio()
 
 int CBudgetProposal::GetYeas()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    LOCK(cs);
+    return nYeas;
 }
 
 int CBudgetProposal::GetNays()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_NO && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    LOCK(cs);
+    return nNays;
 }
 
 int CBudgetProposal::GetAbstains()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_ABSTAIN && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    LOCK(cs);
+    return nAbstains;
 }
 
 int CBudgetProposal::GetBlockStartCycle()
@@ -1702,11 +1885,14 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
-bool CBudgetVote::SignatureValid(bool fSignatureCheck)
+CMasternodeSigCheck CBudgetVote::GetSignatureCheck(const CPubKey& pubKeyMasternode) const
 {
-    std::string errorMessage;
     std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    return CMasternodeSigCheck(pubKeyMasternode, vchSig, strMessage);
+}
 
+bool CBudgetVote::SignatureValid(bool fSignatureCheck)
+{
     CMasternode* pmn = mnodeman.Find(vin);
 
     if (pmn == NULL) {
@@ -1716,13 +1902,14 @@ bool CBudgetVote::SignatureValid(bool fSignatureCheck)
         return false;
     }
 
-    if (!fSignatureCheck) return true;
+    if (!fSignatureCheck || pmn->pubKeyMasternode == pubKeyVerified) return true;
 
-    if (!masternodeSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
+    if (!GetSignatureCheck(pmn->pubKeyMasternode)()) {
         LogPrint("masternode","CBudgetVote::SignatureValid() - Verify message failed\n");
         return false;
     }
 
+    pubKeyVerified = pmn->pubKeyMasternode;
     return true;
 }
 
@@ -1736,6 +1923,8 @@ CFinalizedBudget::CFinalizedBudget()
     nTime = 0;
     fValid = true;
     fAutoChecked = false;
+    fVotesCleaned = false;
+    nVotesCleanedListVersion = 0;
 }
 
 CFinalizedBudget::CFinalizedBudget(const CFinalizedBudget& other)
@@ -1748,6 +1937,17 @@ CFinalizedBudget::CFinalizedBudget(const CFinalizedBudget& other)
     nTime = other.nTime;
     fValid = true;
     fAutoChecked = false;
+    fVotesCleaned = false;
+    nVotesCleanedListVersion = 0;
+}
+
+size_t CFinalizedBudget::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    size_t nUsage = memusage::DynamicUsage(strBudgetName) + memusage::DynamicUsage(vecBudgetPayments) + VoteMapDynamicUsage(mapVotes);
+    BOOST_FOREACH (const CTxBudgetPayment& payment, vecBudgetPayments)
+        nUsage += RecursiveDynamicUsage(payment.payee);
+    return nUsage;
 }
 
 bool CFinalizedBudget::AddOrUpdateVote(CFinalizedBudgetVote& vote, std::string& strError)
@@ -1796,7 +1996,7 @@ void CFinalizedBudget::AutoCheck()
 
     //do this 1 in 4 blocks -- spread out the voting activity on mainnet
     // -- this function is only called every fourteenth block, so this is really 1 in 56 blocks
-    if (Params().NetworkID() == CBaseChainParams::MAIN && rand() % 4 != 0) {
+    if (Params().NetworkID() == CBaseChainParams::MAIN && GetInsecureRand(4) != 0) {
         LogPrint("masternode","CFinalizedBudget::AutoCheck - waiting\n");
         return;
     }
@@ -1863,12 +2063,20 @@ void CFinalizedBudget::AutoCheck()
 // If masternode voted for a proposal, but is now invalid -- remove the vote
 void CFinalizedBudget::CleanAndRemove(bool fSignatureCheck)
 {
+    LOCK(cs);
+
+    unsigned int nListVersion = mnodeman.GetListVersion();
+    if (!fSignatureCheck && fVotesCleaned && nVotesCleanedListVersion == nListVersion) return;
+
     std::map<uint256, CFinalizedBudgetVote>::iterator it = mapVotes.begin();
 
     while (it != mapVotes.end()) {
         (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
         ++it;
     }
+
+    fVotesCleaned = true;
+    nVotesCleanedListVersion = nListVersion;
 }
 
 
@@ -2105,7 +2313,7 @@ void CFinalizedBudget::SubmitVote()
     if (budget.UpdateFinalizedBudget(vote, NULL, strError)) {
         LogPrint("masternode","CFinalizedBudget::SubmitVote  - new finalized budget vote - %s\n", vote.GetHash().ToString());
 
-        budget.mapSeenFinalizedBudgetVotes.insert(make_pair(vote.GetHash(), vote));
+        budget.mapSeenFinalizedBudgetVotes.Insert(vote.GetHash(), vote);
         vote.Relay();
     } else {
         LogPrint("masternode","CFinalizedBudget::SubmitVote : Error submitting vote - %s\n", strError);
@@ -2196,26 +2404,31 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
-bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
+CMasternodeSigCheck CFinalizedBudgetVote::GetSignatureCheck(const CPubKey& pubKeyMasternode) const
 {
-    std::string errorMessage;
-
     std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    return CMasternodeSigCheck(pubKeyMasternode, vchSig, strMessage);
+}
 
+bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
+{
     CMasternode* pmn = mnodeman.Find(vin);
 
     if (pmn == NULL) {
-        LogPrint("masternode","CFinalizedBudgetVote::SignatureValid() - Unknown Masternode %s\n", strMessage);
+        LogPrint("masternode","CFinalizedBudgetVote::SignatureValid() - Unknown Masternode %s\n", vin.prevout.ToStringShort());
         return false;
     }
 
-    if (!fSignatureCheck) return true;
+    if (!fSignatureCheck || pmn->pubKeyMasternode == pubKeyVerified) return true;
 
-    if (!masternodeSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
-        LogPrint("masternode","CFinalizedBudgetVote::SignatureValid() - Verify message failed %s %s\n", strMessage, errorMessage);
+    CMasternodeSigCheck check = GetSignatureCheck(pmn->pubKeyMasternode);
+    if (!check()) {
+        LogPrint("masternode","CFinalizedBudgetVote::SignatureValid() - Verify message failed %s\n", check.strMessage);
         return false;
     }
 
+    pubKeyVerified = pmn->pubKeyMasternode;
+
     return true;
 }
 
@@ -2227,3 +2440,16 @@ std::string CBudgetManager::ToString() const
 
     return info.str();
 }
+
+void CBudgetManager::GetMemoryUsage(std::map<std::string, size_t>& mapUsage) const
+{
+    LOCK(cs);
+    mapUsage["mapProposals"] = BudgetMapDynamicUsage(mapProposals);
+    mapUsage["mapFinalizedBudgets"] = BudgetMapDynamicUsage(mapFinalizedBudgets);
+    mapUsage["mapSeenMasternodeBudgetProposals"] = BudgetMapDynamicUsage(mapSeenMasternodeBudgetProposals);
+    mapUsage["mapSeenMasternodeBudgetVotes"] = VoteMapDynamicUsage(mapSeenMasternodeBudgetVotes);
+    mapUsage["mapOrphanMasternodeBudgetVotes"] = VoteMapDynamicUsage(mapOrphanMasternodeBudgetVotes);
+    mapUsage["mapSeenFinalizedBudgets"] = BudgetMapDynamicUsage(mapSeenFinalizedBudgets);
+    mapUsage["mapSeenFinalizedBudgetVotes"] = VoteMapDynamicUsage(mapSeenFinalizedBudgetVotes);
+    mapUsage["mapOrphanFinalizedBudgetVotes"] = VoteMapDynamicUsage(mapOrphanFinalizedBudgetVotes);
+}
@@ -11,7 +11,10 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "masternode-db.h"
+#include "masternode-sigcheck.h"
 #include "net.h"
+#include "seencache.h"
 #include "sync.h"
 #include "util.h"
 #include <boost/lexical_cast.hpp>
@@ -31,6 +34,16 @@ class CTxBudgetPayment;
 #define VOTE_YES 1
 #define VOTE_NO 2
 
+// seen votes are kept for a month of vote times, orphan votes for a day
+#define BUDGET_VOTE_SEEN_SECONDS (30 * 24 * 60 * 60)
+#define BUDGET_VOTE_ORPHAN_SECONDS (24 * 60 * 60)
+#define BUDGET_VOTES_SEEN_MAX 200000
+#define BUDGET_VOTES_ORPHAN_MAX 10000
+// heights whose highest finalized budget vote count is kept for IsBudgetPaymentBlock
+#define BUDGET_PAYMENT_BLOCK_HEIGHTS 1000
+// collateral transactions whose verification is kept by IsBudgetCollateralValid
+#define BUDGET_COLLATERAL_CACHE_MAX 10000
+
 enum class TrxValidationStatus {
     InValid,        /** Transaction verification failed */
     Valid,          /** Transaction successfully verified */
@@ -41,6 +54,8 @@ enum class TrxValidationStatus {
 static const CAmount PROPOSAL_FEE_TX = (50 * COIN);
 static const CAmount BUDGET_FEE_TX = (50 * COIN);
 static const int64_t BUDGET_VOTE_UPDATE_MIN = 60 * 60;
+//! Minimum time between two "mnvsd" requests of a peer that get answered
+static const int64_t BUDGET_SYNC_DIGEST_INTERVAL = 60 * 60;
 static map<uint256, int> mapPayment_History;
 
 extern std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
@@ -64,6 +79,7 @@ class CBudgetVote
 public:
     bool fValid;  //if the vote is currently valid / counted
     bool fSynced; //if we've sent this to our peers
+    CPubKey pubKeyVerified; //masternode key the signature was verified with, not checked again for it
     CTxIn vin;
     uint256 nProposalHash;
     int nVote;
@@ -74,6 +90,7 @@ public:
     CBudgetVote(CTxIn vin, uint256 nProposalHash, int nVoteIn);
 
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
+    CMasternodeSigCheck GetSignatureCheck(const CPubKey& pubKeyMasternode) const;
     bool SignatureValid(bool fSignatureCheck);
     void Relay();
 
@@ -117,6 +134,7 @@ class CFinalizedBudgetVote
 public:
     bool fValid;  //if the vote is currently valid / counted
     bool fSynced; //if we've sent this to our peers
+    CPubKey pubKeyVerified; //masternode key the signature was verified with, not checked again for it
     CTxIn vin;
     uint256 nBudgetHash;
     int64_t nTime;
@@ -126,6 +144,7 @@ public:
     CFinalizedBudgetVote(CTxIn vinIn, uint256 nBudgetHashIn);
 
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
+    CMasternodeSigCheck GetSignatureCheck(const CPubKey& pubKeyMasternode) const;
     bool SignatureValid(bool fSignatureCheck);
     void Relay();
 
@@ -152,26 +171,20 @@ public:
 
 /** Save Budget Manager (budget.dat)
  */
-class CBudgetDB
-{
-private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
+template <typename T, int64_t nLifetime>
+struct CBudgetVoteExpiry {
+    int64_t operator()(const T& vote) const { return vote.nTime + nLifetime; }
+};
 
+typedef CSeenCache<CBudgetVote, CBudgetVoteExpiry<CBudgetVote, BUDGET_VOTE_SEEN_SECONDS>, CRelayBytes<CBudgetVote> > SeenBudgetVoteCache;
+typedef CSeenCache<CBudgetVote, CBudgetVoteExpiry<CBudgetVote, BUDGET_VOTE_ORPHAN_SECONDS> > OrphanBudgetVoteCache;
+typedef CSeenCache<CFinalizedBudgetVote, CBudgetVoteExpiry<CFinalizedBudgetVote, BUDGET_VOTE_SEEN_SECONDS>, CRelayBytes<CFinalizedBudgetVote> > SeenFinalizedBudgetVoteCache;
+typedef CSeenCache<CFinalizedBudgetVote, CBudgetVoteExpiry<CFinalizedBudgetVote, BUDGET_VOTE_ORPHAN_SECONDS> > OrphanFinalizedBudgetVoteCache;
+
+class CBudgetDB : public CMasternodeCacheDB<CBudgetManager>
+{
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
-    CBudgetDB();
-    bool Write(const CBudgetManager& objToSave);
-    ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
+    CBudgetDB() : CMasternodeCacheDB<CBudgetManager>("budget.dat", "MasternodeBudget") {}
 };
 
 
@@ -185,6 +198,19 @@ private:
     // XX42    map<uint256, CTransaction> mapCollateral;
     map<uint256, uint256> mapCollateralTxids;
 
+    // GetBudget() result, kept while the tip and the Masternode list stay the same and no proposal or vote changes
+    std::vector<CBudgetProposal*> vBudgetCache;
+    bool fBudgetCacheValid;
+    uint256 hashBudgetCacheTip;
+    unsigned int nBudgetCacheListVersion;
+
+    // IsBudgetPaymentBlock() inputs: the highest finalized budget vote count by height, kept while the
+    // finalized budgets and their votes stay the same, and 5% of the enabled Masternodes at a tip
+    std::map<int, int> mapHighestVoteCounts;
+    uint256 hashFivePercentTip;
+    unsigned int nFivePercentListVersion;
+    int nFivePercent;
+
 public:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -194,16 +220,36 @@ public:
     map<uint256, CFinalizedBudget> mapFinalizedBudgets;
 
     std::map<uint256, CBudgetProposalBroadcast> mapSeenMasternodeBudgetProposals;
-    std::map<uint256, CBudgetVote> mapSeenMasternodeBudgetVotes;
-    std::map<uint256, CBudgetVote> mapOrphanMasternodeBudgetVotes;
+    // only relayed from here, so only the bytes of the votes are kept
+    SeenBudgetVoteCache mapSeenMasternodeBudgetVotes;
+    // by the hash of the proposal they vote for
+    OrphanBudgetVoteCache mapOrphanMasternodeBudgetVotes;
     std::map<uint256, CFinalizedBudgetBroadcast> mapSeenFinalizedBudgets;
-    std::map<uint256, CFinalizedBudgetVote> mapSeenFinalizedBudgetVotes;
-    std::map<uint256, CFinalizedBudgetVote> mapOrphanFinalizedBudgetVotes;
+    SeenFinalizedBudgetVoteCache mapSeenFinalizedBudgetVotes;
+    OrphanFinalizedBudgetVoteCache mapOrphanFinalizedBudgetVotes;
 
-    CBudgetManager()
+    CBudgetManager() : mapSeenMasternodeBudgetVotes(BUDGET_VOTES_SEEN_MAX),
+                       mapOrphanMasternodeBudgetVotes(BUDGET_VOTES_ORPHAN_MAX),
+                       mapSeenFinalizedBudgetVotes(BUDGET_VOTES_SEEN_MAX),
+                       mapOrphanFinalizedBudgetVotes(BUDGET_VOTES_ORPHAN_MAX)
     {
         mapProposals.clear();
         mapFinalizedBudgets.clear();
+        fBudgetCacheValid = false;
+        hashFivePercentTip = 0;
+        nFivePercentListVersion = 0;
+        nFivePercent = 0;
+    }
+
+    void InvalidateBudgetCache()
+    {
+        fBudgetCacheValid = false;
+        InvalidateFinalizedBudgetCache();
+    }
+    void InvalidateFinalizedBudgetCache()
+    {
+        mapHighestVoteCounts.clear();
+        hashFivePercentTip = 0;
     }
 
     void ClearSeen()
@@ -219,7 +265,11 @@ public:
 
     void ResetSync();
     void MarkSynced();
-    void Sync(CNode* node, uint256 nProp, bool fPartial = false);
+    void Sync(CNode* node, uint256 nProp, bool fPartial = false, const CSyncDigest* pdigest = NULL);
+    /** Digest of the proposals, finalized budgets and votes Sync(node, 0) announces */
+    void GetSyncDigest(CSyncDigest& digest);
+    /** Ask a peer for the budget items we miss, by sending it our digest */
+    void RequestSyncDigest(CNode* pnode);
 
     void Calculate();
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
@@ -251,6 +301,7 @@ public:
         LOCK(cs);
 
         LogPrintf("Budget object cleared\n");
+        InvalidateBudgetCache();
         mapProposals.clear();
         mapFinalizedBudgets.clear();
         mapSeenMasternodeBudgetProposals.clear();
@@ -262,6 +313,8 @@ public:
     }
     void CheckAndRemove();
     std::string ToString() const;
+    /** Estimated heap memory of each map, by name */
+    void GetMemoryUsage(std::map<std::string, size_t>& mapUsage) const;
 
 
     ADD_SERIALIZE_METHODS;
@@ -269,6 +322,7 @@ public:
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
+        LOCK(cs);
         READWRITE(mapSeenMasternodeBudgetProposals);
         READWRITE(mapSeenMasternodeBudgetVotes);
         READWRITE(mapSeenFinalizedBudgets);
@@ -278,6 +332,8 @@ public:
 
         READWRITE(mapProposals);
         READWRITE(mapFinalizedBudgets);
+        if (ser_action.ForRead())
+            InvalidateBudgetCache();
     }
 };
 
@@ -318,6 +374,9 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
     bool fAutoChecked; //If it matches what we see, we'll auto vote for it (masternode only)
+    //Masternode list version CleanAndRemove last checked the votes against
+    bool fVotesCleaned;
+    unsigned int nVotesCleanedListVersion;
 
 public:
     bool fValid;
@@ -339,6 +398,8 @@ public:
     bool IsValid(std::string& strError, bool fCheckCollateral = true);
 
     std::string GetName() { return strBudgetName; }
+    //! Estimated heap memory of the payments and the votes
+    size_t DynamicMemoryUsage() const;
     std::string GetProposals();
     int GetBlockStart() { return nBlockStart; }
     int GetBlockEnd() { return nBlockStart + (int)(vecBudgetPayments.size() - 1); }
@@ -402,6 +463,8 @@ public:
         READWRITE(fAutoChecked);
 
         READWRITE(mapVotes);
+        if (ser_action.ForRead())
+            fVotesCleaned = false;
     }
 };
 
@@ -464,6 +527,18 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
     CAmount nAlloted;
+    //tallies of the valid votes in mapVotes
+    int nYeas;
+    int nNays;
+    int nAbstains;
+    //Masternode list version CleanAndRemove last checked the votes against
+    bool fVotesCleaned;
+    unsigned int nVotesCleanedListVersion;
+
+    void CountVote(const CBudgetVote& vote, int nDelta);
+
+protected:
+    void RecountVotes();
 
 public:
     bool fValid;
@@ -481,8 +556,8 @@ public:
     int64_t nTime;
     uint256 nFeeTXHash;
 
+    //only changed through AddOrUpdateVote and CleanAndRemove, which keep the tallies
     map<uint256, CBudgetVote> mapVotes;
-    //cache object
 
     CBudgetProposal();
     CBudgetProposal(const CBudgetProposal& other);
@@ -505,6 +580,8 @@ public:
     }
 
     std::string GetName() { return strProposalName; }
+    //! Estimated heap memory of the strings, the address and the votes
+    size_t DynamicMemoryUsage() const;
     std::string GetURL() { return strURL; }
     int GetBlockStart() { return nBlockStart; }
     int GetBlockEnd() { return nBlockEnd; }
@@ -556,6 +633,8 @@ public:
 
         //for saving to the serialized db
         READWRITE(mapVotes);
+        if (ser_action.ForRead())
+            RecountVotes();
     }
 };
 
@@ -584,6 +663,8 @@ public:
         swap(first.nTime, second.nTime);
         swap(first.nFeeTXHash, second.nFeeTXHash);
         first.mapVotes.swap(second.mapVotes);
+        first.RecountVotes();
+        second.RecountVotes();
     }
 
     CBudgetProposalBroadcast& operator=(CBudgetProposalBroadcast from)
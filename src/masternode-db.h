@@ -0,0 +1,216 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MASTERNODE_DB_H
+#define MASTERNODE_DB_H
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "streams.h"
+#include "sync.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+//! Size of the reads that hash a cache file when only its checksum is verified
+static const unsigned int MASTERNODE_DB_CHUNK_SIZE = 1 << 16;
+
+/**
+ * A masternode cache file: a magic message, the network magic number, the
+ * serialized object and the double SHA256 of everything before it.
+ *
+ * Read() unserializes the object straight from the file through a
+ * CHashVerifier, so the file is checked and loaded in one pass without a copy
+ * of it in memory. Write() serializes the object under its own lock only and
+ * writes a temporary file that replaces the old one once it is on disk, so a
+ * crash while dumping keeps the previous cache.
+ */
+template <typename T>
+class CMasternodeCacheDB
+{
+protected:
+    boost::filesystem::path pathDB;
+    std::string strMagicMessage;
+
+public:
+    enum ReadResult {
+        Ok,
+        FileError,
+        HashReadError,
+        IncorrectHash,
+        IncorrectMagicMessage,
+        IncorrectMagicNumber,
+        IncorrectFormat
+    };
+
+    CMasternodeCacheDB(const std::string& strFilename, const std::string& strMagicMessageIn) : pathDB(GetDataDir() / strFilename), strMagicMessage(strMagicMessageIn) {}
+
+    bool Write(const T& objToSave)
+    {
+        // the periodic dump may still run when the one at shutdown starts
+        static CCriticalSection cs_write;
+        LOCK(cs_write);
+
+        int64_t nStart = GetTimeMillis();
+
+        // serialize, checksum data up to that point, then append checksum
+        CDataStream ssObj(SER_DISK, CLIENT_VERSION);
+        ssObj << strMagicMessage;                   // cache file specific magic message
+        ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
+        ssObj << objToSave;
+        uint256 hash = Hash(ssObj.begin(), ssObj.end());
+        ssObj << hash;
+
+        boost::filesystem::path pathTmp = pathDB.string() + ".new";
+        FILE* file = fopen(pathTmp.string().c_str(), "wb");
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+        try {
+            fileout << ssObj;
+        } catch (std::exception& e) {
+            return error("%s : Serialize or I/O error - %s", __func__, e.what());
+        }
+        FileCommit(fileout.Get());
+        fileout.fclose();
+
+        if (!RenameOver(pathTmp, pathDB))
+            return error("%s : Failed to rename %s to %s", __func__, pathTmp.string(), pathDB.string());
+
+        LogPrint("masternode", "Written info to %s  %dms\n", pathDB.filename().string(), GetTimeMillis() - nStart);
+        return true;
+    }
+
+    ReadResult Read(T& objToLoad)
+    {
+        int64_t nStart = GetTimeMillis();
+
+        FILE* file = fopen(pathDB.string().c_str(), "rb");
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull()) {
+            error("%s : Failed to open file %s", __func__, pathDB.string());
+            return FileError;
+        }
+
+        CHashVerifier<CAutoFile> verifier(&filein);
+        uint64_t nDataSize;
+        ReadResult result = ReadHeader(verifier, nDataSize);
+        if (result != Ok)
+            return result;
+
+        try {
+            verifier >> objToLoad;
+        } catch (std::exception& e) {
+            objToLoad.Clear();
+            // A damaged file usually fails to unserialize before its checksum
+            // is reached, tell it apart from data in an unknown format
+            if (FinishHash(filein, verifier, nDataSize) != Ok) {
+                error("%s : Checksum mismatch, data corrupted", __func__);
+                return IncorrectHash;
+            }
+            error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return IncorrectFormat;
+        }
+
+        result = FinishHash(filein, verifier, nDataSize);
+        if (result != Ok) {
+            objToLoad.Clear();
+            error("%s : Checksum mismatch, data corrupted", __func__);
+            return result;
+        }
+
+        LogPrint("masternode", "Loaded info from %s  %dms\n", pathDB.filename().string(), GetTimeMillis() - nStart);
+        LogPrint("masternode", "  %s\n", objToLoad.ToString());
+        return Ok;
+    }
+
+    /** Check the magic and the checksum of the file without unserializing it */
+    ReadResult Verify()
+    {
+        FILE* file = fopen(pathDB.string().c_str(), "rb");
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return FileError;
+
+        CHashVerifier<CAutoFile> verifier(&filein);
+        uint64_t nDataSize;
+        ReadResult result = ReadHeader(verifier, nDataSize);
+        if (result != Ok)
+            return result;
+        return FinishHash(filein, verifier, nDataSize);
+    }
+
+private:
+    /** Check the magic message and network of the file */
+    ReadResult ReadHeader(CHashVerifier<CAutoFile>& verifier, uint64_t& nDataSize)
+    {
+        uint64_t nFileSize = boost::filesystem::file_size(pathDB);
+        if (nFileSize < sizeof(uint256)) {
+            error("%s : File %s is too small", __func__, pathDB.string());
+            return HashReadError;
+        }
+        nDataSize = nFileSize - sizeof(uint256);
+
+        unsigned char pchMsgTmp[4];
+        std::string strMagicMessageTmp;
+        try {
+            // de-serialize file header (cache file specific magic message) and ..
+            verifier >> strMagicMessageTmp;
+
+            // ... verify the message matches predefined one
+            if (strMagicMessage != strMagicMessageTmp) {
+                error("%s : Invalid %s magic message", __func__, pathDB.filename().string());
+                return IncorrectMagicMessage;
+            }
+
+            // de-serialize file header (network specific magic number) and ..
+            verifier >> FLATDATA(pchMsgTmp);
+
+            // ... verify the network matches ours
+            if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
+                error("%s : Invalid network magic number", __func__);
+                return IncorrectMagicNumber;
+            }
+        } catch (std::exception& e) {
+            error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return IncorrectMagicMessage;
+        }
+        return Ok;
+    }
+
+    /** Hash the data left before the checksum and compare it with the stored one */
+    ReadResult FinishHash(CAutoFile& filein, CHashVerifier<CAutoFile>& verifier, uint64_t nDataSize)
+    {
+        uint256 hashIn;
+        try {
+            long nPos = ftell(filein.Get());
+            if (nPos < 0 || (uint64_t)nPos > nDataSize)
+                return IncorrectHash;
+            std::vector<char> vchChunk(MASTERNODE_DB_CHUNK_SIZE);
+            uint64_t nLeft = nDataSize - nPos;
+            while (nLeft > 0) {
+                size_t nChunk = std::min((uint64_t)vchChunk.size(), nLeft);
+                verifier.read(&vchChunk[0], nChunk);
+                nLeft -= nChunk;
+            }
+            filein >> hashIn;
+        } catch (std::exception& e) {
+            error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return HashReadError;
+        }
+
+        if (hashIn != verifier.GetHash())
+            return IncorrectHash;
+        return Ok;
+    }
+};
+
+#endif
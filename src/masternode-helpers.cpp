@@ -8,6 +8,7 @@
 #include "main.h"
 #include "masternodeman.h"
 #include "activemasternode.h"
+#include "masternode-budget.h"
 #include "masternode-payments.h"
 #include "swifttx.h"
 
@@ -21,6 +22,13 @@ void ThreadMasternodePool()
     // Make this thread recognisable
     RenameThread("bitcoingreen-mnpool");
 
+    // Clean the caches loaded from disk here rather than in AppInit2, checking
+    // the input of every masternode and proposal takes a while on a big list
+    mnodeman.CheckAndRemove(true);
+    budget.CheckAndRemove();
+    masternodePayments.CleanPaymentList();
+    LogPrint("masternode", "Cleaned the loaded caches: %s, %s, %s\n", mnodeman.ToString(), budget.ToString(), masternodePayments.ToString());
+
     unsigned int c = 0;
 
     while (true) {
@@ -29,6 +37,11 @@ void ThreadMasternodePool()
         // try to sync from all available nodes, one step at a time
         masternodeSync.Process();
 
+        // count the masternodes for getmasternodecount once per block
+        int nTipHeight = GetChainTipSnapshot().nHeight;
+        if (mnodeman.GetCountSnapshot().nHeight != nTipHeight)
+            mnodeman.UpdateCountSnapshot(nTipHeight);
+
         if (masternodeSync.IsBlockchainSynced()) {
             c++;
 
@@ -42,6 +55,14 @@ void ThreadMasternodePool()
                 masternodePayments.CleanPaymentList();
                 CleanTransactionLocksList();
             }
+
+            // keep the caches on disk recent, so a node that did not shut
+            // down cleanly does not have to sync the lists again
+            if (c % MASTERNODE_DUMP_SECONDS == 0) {
+                DumpMasternodes();
+                DumpBudgets();
+                DumpMasternodePayments();
+            }
         }
     }
 }
@@ -0,0 +1,411 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode-list.h"
+
+#include "chainparams.h"
+#include "hash.h"
+#include "main.h"
+#include "script/standard.h"
+#include "txdb.h"
+#include "util.h"
+#include "utilmoneystr.h"
+#include "utiltime.h"
+
+#include <boost/foreach.hpp>
+
+CDeterministicMasternodeList deterministicMasternodes;
+
+//! Marks the OP_RETURN data of a registration
+static const unsigned char REGISTRATION_MAGIC[4] = {'d', 'm', 'n', 'r'};
+
+bool IsDeterministicMasternodeHeight(int nHeight)
+{
+    return nHeight >= Params().DeterministicMasternodeHeight();
+}
+
+/** The output of the masternode payment, where FillBlockPayee puts it */
+static bool GetMasternodePaymentOutput(const CBlock& block, CTxOut& out)
+{
+    if (block.IsProofOfStake()) {
+        const CTransaction& txCoinStake = block.vtx[1];
+        if (txCoinStake.vout.size() < 3) return false;
+        out = txCoinStake.vout.back();
+        return true;
+    }
+
+    const CTransaction& txCoinBase = block.vtx[0];
+    if (txCoinBase.vout.size() < 2) return false;
+    out = txCoinBase.vout[1];
+    return true;
+}
+
+CScript CMasternodeRegistration::GetScript() const
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.write((const char*)REGISTRATION_MAGIC, sizeof(REGISTRATION_MAGIC));
+    ss << *this;
+    return CScript() << OP_RETURN << std::vector<unsigned char>(ss.begin(), ss.end());
+}
+
+bool CMasternodeRegistration::FromTransaction(const CTransaction& tx, CMasternodeRegistration& reg, unsigned int& nCollateral)
+{
+    bool fFound = false;
+    BOOST_FOREACH (const CTxOut& out, tx.vout) {
+        CScript::const_iterator pc = out.scriptPubKey.begin();
+        opcodetype opcode;
+        std::vector<unsigned char> vch;
+        if (!out.scriptPubKey.GetOp(pc, opcode) || opcode != OP_RETURN)
+            continue;
+        if (!out.scriptPubKey.GetOp(pc, opcode, vch) || vch.size() <= sizeof(REGISTRATION_MAGIC) ||
+            !std::equal(REGISTRATION_MAGIC, REGISTRATION_MAGIC + sizeof(REGISTRATION_MAGIC), vch.begin()))
+            continue;
+        try {
+            CDataStream ss(std::vector<unsigned char>(vch.begin() + sizeof(REGISTRATION_MAGIC), vch.end()), SER_NETWORK, PROTOCOL_VERSION);
+            ss >> reg;
+            if (!ss.empty())
+                return false;
+        } catch (const std::exception&) {
+            return false;
+        }
+        fFound = true;
+        break;
+    }
+    if (!fFound || reg.nVersion != CURRENT_VERSION)
+        return false;
+
+    // paid to a key, so the collateral cannot be a script anyone may spend
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        if (tx.vout[i].nValue != MASTERNODE_COLLATERAL)
+            continue;
+        CTxDestination dest;
+        if (!ExtractDestination(tx.vout[i].scriptPubKey, dest) || boost::get<CKeyID>(&dest) == NULL)
+            return false;
+        nCollateral = i;
+        return true;
+    }
+    return false;
+}
+
+void CDeterministicMasternodeList::Add(const CDeterministicMasternode& mn)
+{
+    mapMasternodes[mn.collateral] = mn;
+    setPaymentQueue.insert(std::make_pair(mn.GetQueueHeight(), mn.collateral));
+    mapByService[mn.addr] = mn.collateral;
+    mapByOperator[mn.pubKeyOperator.GetID()] = mn.collateral;
+}
+
+void CDeterministicMasternodeList::Remove(const COutPoint& collateral)
+{
+    std::map<COutPoint, CDeterministicMasternode>::iterator it = mapMasternodes.find(collateral);
+    if (it == mapMasternodes.end())
+        return;
+    setPaymentQueue.erase(std::make_pair(it->second.GetQueueHeight(), collateral));
+    mapByService.erase(it->second.addr);
+    mapByOperator.erase(it->second.pubKeyOperator.GetID());
+    mapMasternodes.erase(it);
+}
+
+void CDeterministicMasternodeList::SetLastPaid(const COutPoint& collateral, int nHeight)
+{
+    std::map<COutPoint, CDeterministicMasternode>::iterator it = mapMasternodes.find(collateral);
+    if (it == mapMasternodes.end())
+        return;
+    setPaymentQueue.erase(std::make_pair(it->second.GetQueueHeight(), collateral));
+    it->second.nLastPaidHeight = nHeight;
+    setPaymentQueue.insert(std::make_pair(it->second.GetQueueHeight(), collateral));
+}
+
+bool CDeterministicMasternodeList::CanRegister(const CMasternodeRegistration& reg) const
+{
+    if (!reg.addr.IsValid() || !reg.pubKeyOperator.IsFullyValid())
+        return false;
+    if (Params().NetworkID() == CBaseChainParams::MAIN && !reg.addr.IsRoutable())
+        return false;
+    return !mapByService.count(reg.addr) && !mapByOperator.count(reg.pubKeyOperator.GetID());
+}
+
+void CDeterministicMasternodeList::ApplyBlock(const CBlock& block, int nHeight, CMasternodeListDiff& diff)
+{
+    LOCK(cs);
+    diff.hashBlock = block.GetHash();
+
+    // the block pays the first of the queue, as CheckDeterministicMasternodePayee made sure
+    CTxOut out;
+    if (!setPaymentQueue.empty() && GetMasternodePaymentOutput(block, out)) {
+        std::map<COutPoint, CDeterministicMasternode>::iterator it = mapMasternodes.find(setPaymentQueue.begin()->second);
+        if (it->second.payee == out.scriptPubKey) {
+            diff.paid = it->first;
+            diff.nPaidHeightBefore = it->second.nLastPaidHeight;
+            SetLastPaid(it->first, nHeight);
+        }
+    }
+
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                std::map<COutPoint, CDeterministicMasternode>::const_iterator it = mapMasternodes.find(txin.prevout);
+                if (it == mapMasternodes.end())
+                    continue;
+                diff.vChanges.push_back(std::make_pair(false, it->second));
+                Remove(txin.prevout);
+            }
+        }
+        if (tx.IsCoinBase() || tx.IsCoinStake())
+            continue;
+
+        CMasternodeRegistration reg;
+        unsigned int nCollateral;
+        if (!CMasternodeRegistration::FromTransaction(tx, reg, nCollateral) || !CanRegister(reg))
+            continue;
+        CDeterministicMasternode mn(COutPoint(tx.GetHash(), nCollateral), tx.vout[nCollateral].scriptPubKey, reg, nHeight);
+        Add(mn);
+        diff.vChanges.push_back(std::make_pair(true, mn));
+        LogPrint("masternode", "%s : masternode %s registered at %s\n", __func__, mn.collateral.ToString(), mn.addr.ToString());
+    }
+}
+
+void CDeterministicMasternodeList::UndoBlock(const CMasternodeListDiff& diff)
+{
+    LOCK(cs);
+    for (std::vector<std::pair<bool, CDeterministicMasternode> >::const_reverse_iterator it = diff.vChanges.rbegin(); it != diff.vChanges.rend(); ++it) {
+        if (it->first)
+            Remove(it->second.collateral);
+        else
+            Add(it->second);
+    }
+    if (!diff.paid.IsNull())
+        SetLastPaid(diff.paid, diff.nPaidHeightBefore);
+}
+
+bool CDeterministicMasternodeList::CheckPayee(const CBlock& block, int nHeight, std::string& strError) const
+{
+    CDeterministicMasternode mn;
+    if (!GetNextPayee(mn))
+        return true;
+
+    CAmount nPayment = GetMasternodePayment(nHeight - 1, GetBlockValue(nHeight - 1));
+    CTxOut out;
+    if (!GetMasternodePaymentOutput(block, out) || out.scriptPubKey != mn.payee || out.nValue < nPayment) {
+        strError = strprintf("block %s does not pay %s to masternode %s", block.GetHash().ToString(), FormatMoney(nPayment), mn.collateral.ToString());
+        return false;
+    }
+    return true;
+}
+
+void CDeterministicMasternodeList::Replay(const CMasternodeListDiff& diff, int nHeight)
+{
+    if (!diff.paid.IsNull())
+        SetLastPaid(diff.paid, nHeight);
+    for (std::vector<std::pair<bool, CDeterministicMasternode> >::const_iterator it = diff.vChanges.begin(); it != diff.vChanges.end(); ++it) {
+        if (it->first)
+            Add(it->second);
+        else
+            Remove(it->second.collateral);
+    }
+}
+
+bool CDeterministicMasternodeList::Load()
+{
+    int64_t nStart = GetTimeMillis();
+    LOCK2(cs_main, cs);
+    Clear();
+
+    // with no chain yet the list starts from the genesis block
+    CBlockIndex* pindexChainTip = chainActive.Tip();
+    if (pindexChainTip == NULL) {
+        fLoaded = true;
+        return true;
+    }
+
+    int nFirst = Params().DeterministicMasternodeHeight();
+    std::vector<std::pair<int, CMasternodeListDiff> > vDiffs;
+    if (nFirst <= pindexChainTip->nHeight && !pblocktree->ReadMasternodeListDiffs(nFirst, vDiffs))
+        return error("%s : cannot read the masternode list changes", __func__);
+
+    // once a block has no stored changes, or those of another block, the rest are made again from the blocks
+    CIndexUpdate indexUpdate;
+    std::vector<std::pair<int, CMasternodeListDiff> >::const_iterator itDiff = vDiffs.begin();
+    bool fFromBlocks = false;
+    for (int nHeight = nFirst; nHeight <= pindexChainTip->nHeight; nHeight++) {
+        const CBlockIndex* pindex = chainActive[nHeight];
+        while (itDiff != vDiffs.end() && itDiff->first < nHeight)
+            ++itDiff;
+        if (!fFromBlocks && itDiff != vDiffs.end() && itDiff->first == nHeight && itDiff->second.hashBlock == pindex->GetBlockHash()) {
+            Replay(itDiff->second, nHeight);
+            continue;
+        }
+        fFromBlocks = true;
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return error("%s : cannot read block %d", __func__, nHeight);
+        // the block may have been connected before the list could check it
+        std::string strError;
+        if (!CheckPayee(block, nHeight, strError))
+            return error("%s : %s", __func__, strError);
+        CMasternodeListDiff diff;
+        ApplyBlock(block, nHeight, diff);
+        indexUpdate.vMasternodeListDiff.push_back(std::make_pair(nHeight, diff));
+    }
+    if (!indexUpdate.IsEmpty() && !pblocktree->WriteIndexUpdate(indexUpdate))
+        return error("%s : cannot write the masternode list changes", __func__);
+    pindexTip = pindexChainTip;
+    fLoaded = true;
+
+    LogPrintf("Loaded %u registered masternodes at height %d, %u blocks read, %dms\n",
+        mapMasternodes.size(), pindexTip->nHeight, indexUpdate.vMasternodeListDiff.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+void CDeterministicMasternodeList::ConnectBlock(const CBlock& block, const CBlockIndex* pindex, CIndexUpdate& indexUpdate)
+{
+    LOCK(cs);
+    if (!fLoaded || pindexTip != pindex->pprev)
+        return;
+    pindexTip = pindex;
+    if (!IsDeterministicMasternodeHeight(pindex->nHeight))
+        return;
+
+    CMasternodeListDiff diff;
+    ApplyBlock(block, pindex->nHeight, diff);
+    indexUpdate.vMasternodeListDiff.push_back(std::make_pair(pindex->nHeight, diff));
+}
+
+bool CDeterministicMasternodeList::DisconnectBlock(const CBlockIndex* pindex, CIndexUpdate& indexUpdate)
+{
+    LOCK(cs);
+    if (!fLoaded || pindexTip != pindex)
+        return true;
+    if (IsDeterministicMasternodeHeight(pindex->nHeight)) {
+        CMasternodeListDiff diff;
+        if (!pblocktree->ReadMasternodeListDiff(pindex->nHeight, diff) || diff.hashBlock != pindex->GetBlockHash())
+            return error("%s : no masternode list changes for block %s", __func__, pindex->GetBlockHash().ToString());
+        UndoBlock(diff);
+        indexUpdate.vMasternodeListDiff.push_back(std::make_pair(pindex->nHeight, CMasternodeListDiff()));
+    }
+    pindexTip = pindex->pprev;
+    return true;
+}
+
+bool CDeterministicMasternodeList::IsAt(const CBlockIndex* pindexPrev) const
+{
+    LOCK(cs);
+    return fLoaded && pindexTip == pindexPrev;
+}
+
+bool CDeterministicMasternodeList::GetNextPayee(CDeterministicMasternode& mn) const
+{
+    LOCK(cs);
+    if (setPaymentQueue.empty())
+        return false;
+    mn = mapMasternodes.find(setPaymentQueue.begin()->second)->second;
+    return true;
+}
+
+bool CDeterministicMasternodeList::Get(const COutPoint& collateral, CDeterministicMasternode& mn) const
+{
+    LOCK(cs);
+    std::map<COutPoint, CDeterministicMasternode>::const_iterator it = mapMasternodes.find(collateral);
+    if (it == mapMasternodes.end())
+        return false;
+    mn = it->second;
+    return true;
+}
+
+bool CDeterministicMasternodeList::GetByOperator(const CKeyID& keyID, CDeterministicMasternode& mn) const
+{
+    LOCK(cs);
+    std::map<CKeyID, COutPoint>::const_iterator it = mapByOperator.find(keyID);
+    if (it == mapByOperator.end())
+        return false;
+    mn = mapMasternodes.find(it->second)->second;
+    return true;
+}
+
+std::vector<CDeterministicMasternode> CDeterministicMasternodeList::GetAll() const
+{
+    LOCK(cs);
+    std::vector<CDeterministicMasternode> vRet;
+    vRet.reserve(setPaymentQueue.size());
+    for (std::set<std::pair<int, COutPoint> >::const_iterator it = setPaymentQueue.begin(); it != setPaymentQueue.end(); ++it)
+        vRet.push_back(mapMasternodes.find(it->second)->second);
+    return vRet;
+}
+
+size_t CDeterministicMasternodeList::size() const
+{
+    LOCK(cs);
+    return mapMasternodes.size();
+}
+
+void CDeterministicMasternodeList::Clear()
+{
+    LOCK(cs);
+    mapMasternodes.clear();
+    setPaymentQueue.clear();
+    mapByService.clear();
+    mapByOperator.clear();
+    pindexTip = NULL;
+    fLoaded = false;
+}
+
+struct CompareRankScore {
+    bool operator()(const std::pair<uint256, CDeterministicMasternode>& a, const std::pair<uint256, CDeterministicMasternode>& b) const
+    {
+        return b.first < a.first;
+    }
+};
+
+void CDeterministicMasternodeList::GetRanks(const uint256& hashBlock, std::vector<std::pair<uint256, CDeterministicMasternode> >& vRanks) const
+{
+    LOCK(cs);
+    vRanks.clear();
+    vRanks.reserve(mapMasternodes.size());
+    for (std::map<COutPoint, CDeterministicMasternode>::const_iterator it = mapMasternodes.begin(); it != mapMasternodes.end(); ++it) {
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << hashBlock << it->first;
+        vRanks.push_back(std::make_pair(ss.GetHash(), it->second));
+    }
+    std::sort(vRanks.begin(), vRanks.end(), CompareRankScore());
+}
+
+int CDeterministicMasternodeList::GetRank(const COutPoint& collateral, const uint256& hashBlock) const
+{
+    std::vector<std::pair<uint256, CDeterministicMasternode> > vRanks;
+    GetRanks(hashBlock, vRanks);
+    for (unsigned int i = 0; i < vRanks.size(); i++) {
+        if (vRanks[i].second.collateral == collateral)
+            return i + 1;
+    }
+    return -1;
+}
+
+void CDeterministicMasternodeList::GetQuorum(const uint256& hashBlock, unsigned int nSize, std::vector<CDeterministicMasternode>& vMembers) const
+{
+    std::vector<std::pair<uint256, CDeterministicMasternode> > vRanks;
+    GetRanks(hashBlock, vRanks);
+    vMembers.clear();
+    for (unsigned int i = 0; i < vRanks.size() && i < nSize; i++)
+        vMembers.push_back(vRanks[i].second);
+}
+
+bool CheckDeterministicMasternodePayee(const CBlock& block, const CBlockIndex* pindex, CValidationState& state)
+{
+    if (!IsDeterministicMasternodeHeight(pindex->nHeight))
+        return true;
+
+    if (!deterministicMasternodes.IsAt(pindex->pprev)) {
+        // blocks of the active chain, as when verifying them again, were checked when they were connected
+        if (chainActive.Contains(pindex))
+            return true;
+        // not known to be invalid, so the block is left to be connected once the list is at its parent
+        LogPrintf("%s : the masternode list is not at the parent of block %s\n", __func__, block.GetHash().ToString());
+        return state.Error("masternode list behind");
+    }
+
+    std::string strError;
+    if (!deterministicMasternodes.CheckPayee(block, pindex->nHeight, strError))
+        return state.DoS(100, error("%s : %s", __func__, strError), REJECT_INVALID, "bad-cb-payee");
+    return true;
+}
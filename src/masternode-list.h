@@ -0,0 +1,199 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MASTERNODE_LIST_H
+#define BITCOIN_MASTERNODE_LIST_H
+
+#include "amount.h"
+#include "netbase.h"
+#include "primitives/transaction.h"
+#include "pubkey.h"
+#include "serialize.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+class CBlock;
+class CBlockIndex;
+class CIndexUpdate;
+class CValidationState;
+
+//! The output a registered masternode keeps unspent
+static const CAmount MASTERNODE_COLLATERAL = 5000 * COIN;
+//! Masternodes of the quorum GetQuorum gives by default
+static const unsigned int DEFAULT_MASTERNODE_QUORUM_SIZE = 10;
+
+/** Whether masternodes are paid from the registered list at nHeight, see CChainParams::DeterministicMasternodeHeight */
+bool IsDeterministicMasternodeHeight(int nHeight);
+
+/**
+ * The OP_RETURN output that registers a masternode. The collateral is the
+ * first output of the same transaction worth MASTERNODE_COLLATERAL, and the
+ * masternode is paid to its script until it is spent.
+ */
+class CMasternodeRegistration
+{
+public:
+    static const int CURRENT_VERSION = 1;
+
+    int nVersion;
+    //! Where the masternode is reached
+    CService addr;
+    //! The key the masternode signs its messages with, kept apart from the collateral
+    CPubKey pubKeyOperator;
+
+    CMasternodeRegistration() : nVersion(CURRENT_VERSION) {}
+    CMasternodeRegistration(const CService& addrIn, const CPubKey& pubKeyOperatorIn) : nVersion(CURRENT_VERSION), addr(addrIn), pubKeyOperator(pubKeyOperatorIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn)
+    {
+        unsigned char chVersion = nVersion;
+        READWRITE(chVersion);
+        nVersion = chVersion;
+        READWRITE(addr);
+        READWRITE(pubKeyOperator);
+    }
+
+    CScript GetScript() const;
+
+    /** The registration of tx and the index of its collateral, false if tx registers none */
+    static bool FromTransaction(const CTransaction& tx, CMasternodeRegistration& reg, unsigned int& nCollateral);
+};
+
+/** A masternode of the list, as its registration and the blocks made it */
+class CDeterministicMasternode
+{
+public:
+    COutPoint collateral;
+    CScript payee;
+    CService addr;
+    CPubKey pubKeyOperator;
+    int nRegisteredHeight;
+    //! Zero until the masternode is paid
+    int nLastPaidHeight;
+
+    CDeterministicMasternode() : nRegisteredHeight(0), nLastPaidHeight(0) {}
+    CDeterministicMasternode(const COutPoint& collateralIn, const CScript& payeeIn, const CMasternodeRegistration& reg, int nHeight)
+        : collateral(collateralIn), payee(payeeIn), addr(reg.addr), pubKeyOperator(reg.pubKeyOperator), nRegisteredHeight(nHeight), nLastPaidHeight(0) {}
+
+    //! The masternode longest unpaid, or registered, is paid next
+    int GetQueueHeight() const { return std::max(nRegisteredHeight, nLastPaidHeight); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(collateral);
+        READWRITE(payee);
+        READWRITE(addr);
+        READWRITE(pubKeyOperator);
+        READWRITE(nRegisteredHeight);
+        READWRITE(nLastPaidHeight);
+    }
+};
+
+/**
+ * What one block changed in the list, stored by height so disconnecting the
+ * block undoes it and a restart replays it without reading the block.
+ */
+class CMasternodeListDiff
+{
+public:
+    uint256 hashBlock;
+    //! In the order applied, true for a masternode registered, false for one whose collateral was spent
+    std::vector<std::pair<bool, CDeterministicMasternode> > vChanges;
+    //! The masternode the block paid, null if none
+    COutPoint paid;
+    int nPaidHeightBefore;
+
+    CMasternodeListDiff() : hashBlock(0), nPaidHeightBefore(0) {}
+
+    bool IsNull() const { return hashBlock == 0; }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(hashBlock);
+        READWRITE(vChanges);
+        READWRITE(paid);
+        READWRITE(nPaidHeightBefore);
+    }
+};
+
+/**
+ * The masternodes registered on chain, each paid in turn, derived from the
+ * blocks alone so every node agrees on it without the mnb/mnp/mnw gossip.
+ * It follows the active chain from ConnectBlock and DisconnectBlock once
+ * Load() has put it at the tip, from the genesis block on when the chain is
+ * empty.
+ */
+class CDeterministicMasternodeList
+{
+private:
+    mutable CCriticalSection cs;
+    std::map<COutPoint, CDeterministicMasternode> mapMasternodes;
+    //! (queue height, collateral), the first is paid next
+    std::set<std::pair<int, COutPoint> > setPaymentQueue;
+    std::map<CService, COutPoint> mapByService;
+    std::map<CKeyID, COutPoint> mapByOperator;
+    //! The block the list is at, NULL before the genesis block
+    const CBlockIndex* pindexTip;
+    //! Set by Load(), from then on the list follows the blocks connected
+    bool fLoaded;
+
+    void Add(const CDeterministicMasternode& mn);
+    void Remove(const COutPoint& collateral);
+    void SetLastPaid(const COutPoint& collateral, int nHeight);
+    bool CanRegister(const CMasternodeRegistration& reg) const;
+    void Replay(const CMasternodeListDiff& diff, int nHeight);
+
+public:
+    CDeterministicMasternodeList() : pindexTip(NULL), fLoaded(false) {}
+
+    /** Apply the block at nHeight on top of the list, with what it changed in diff */
+    void ApplyBlock(const CBlock& block, int nHeight, CMasternodeListDiff& diff);
+    /** Undo what ApplyBlock did, the block being the last applied */
+    void UndoBlock(const CMasternodeListDiff& diff);
+    /** Whether the block at nHeight, on top of the list, pays the masternode the list has next */
+    bool CheckPayee(const CBlock& block, int nHeight, std::string& strError) const;
+
+    /** Bring the list to the tip from the stored changes, and from the blocks where they are missing */
+    bool Load();
+    void ConnectBlock(const CBlock& block, const CBlockIndex* pindex, CIndexUpdate& indexUpdate);
+    bool DisconnectBlock(const CBlockIndex* pindex, CIndexUpdate& indexUpdate);
+    //! Whether the list is at pindexPrev, so it tells who the block after it pays
+    bool IsAt(const CBlockIndex* pindexPrev) const;
+
+    bool GetNextPayee(CDeterministicMasternode& mn) const;
+    bool Get(const COutPoint& collateral, CDeterministicMasternode& mn) const;
+    bool GetByOperator(const CKeyID& keyID, CDeterministicMasternode& mn) const;
+    //! In payment order
+    std::vector<CDeterministicMasternode> GetAll() const;
+    size_t size() const;
+    void Clear();
+
+    /** The masternodes by their score for the block, best first. Scores are Hash(hashBlock, collateral). */
+    void GetRanks(const uint256& hashBlock, std::vector<std::pair<uint256, CDeterministicMasternode> >& vRanks) const;
+    //! 1 for the best, -1 if the masternode is not in the list
+    int GetRank(const COutPoint& collateral, const uint256& hashBlock) const;
+    void GetQuorum(const uint256& hashBlock, unsigned int nSize, std::vector<CDeterministicMasternode>& vMembers) const;
+};
+
+extern CDeterministicMasternodeList deterministicMasternodes;
+
+/** Whether the block pays the masternode the list has next, once the list decides the payee */
+bool CheckDeterministicMasternodePayee(const CBlock& block, const CBlockIndex* pindex, CValidationState& state);
+
+#endif // BITCOIN_MASTERNODE_LIST_H
@@ -6,12 +6,17 @@
 #include "activemasternode.h"
 #include "masternode-payments.h"
 #include "addrman.h"
+#include "blocktrace.h"
+#include "core_memusage.h"
 #include "masternode-budget.h"
+#include "masternode-list.h"
 #include "masternode-sync.h"
 #include "masternodeman.h"
 #include "masternode-helpers.h"
 #include "masternodeconfig.h"
+#include "memusage.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include <boost/filesystem.hpp>
@@ -24,158 +29,30 @@ CCriticalSection cs_vecPayments;
 CCriticalSection cs_mapMasternodeBlocks;
 CCriticalSection cs_mapMasternodePayeeVotes;
 
-//
-// CMasternodePaymentDB
-//
-
-CMasternodePaymentDB::CMasternodePaymentDB()
-{
-    pathDB = GetDataDir() / "mnpayments.dat";
-    strMagicMessage = "MasternodePayments";
-}
-
-bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
-{
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
-
-    return true;
-}
-
-CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad, bool fDryRun)
-{
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode payement cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-
-        // de-serialize data into CMasternodePayments object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
-    }
-
-    LogPrint("masternode","Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode payments manager - cleaning....\n");
-        objToLoad.CleanPaymentList();
-        LogPrint("masternode","Masternode payments manager - result:\n");
-        LogPrint("masternode","  %s\n", objToLoad.ToString());
-    }
-
-    return Ok;
-}
-
 void DumpMasternodePayments()
 {
     int64_t nStart = GetTimeMillis();
 
-    CMasternodePaymentDB paymentdb;
-    CMasternodePayments tempPayments;
+    CMasternodePaymentDB db;
 
     LogPrint("masternode","Verifying mnpayments.dat format...\n");
-    CMasternodePaymentDB::ReadResult readResult = paymentdb.Read(tempPayments, true);
+    CMasternodePaymentDB::ReadResult readResult = db.Verify();
     // there was an error and it was not an error on file opening => do not proceed
     if (readResult == CMasternodePaymentDB::FileError)
-        LogPrint("masternode","Missing budgets file - mnpayments.dat, will try to recreate\n");
+        LogPrint("masternode","Missing masternode payments file - mnpayments.dat, will try to recreate\n");
     else if (readResult != CMasternodePaymentDB::Ok) {
-        LogPrint("masternode","Error reading mnpayments.dat: ");
-        if (readResult == CMasternodePaymentDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
+        LogPrint("masternode","Error reading mnpayments.dat: file format is unknown or invalid, please fix it manually\n");
+        return;
     }
     LogPrint("masternode","Writting info to mnpayments.dat...\n");
-    paymentdb.Write(masternodePayments);
+    db.Write(masternodePayments);
 
-    LogPrint("masternode","Budget dump finished  %dms\n", GetTimeMillis() - nStart);
+    LogPrint("masternode","Masternode payments dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMinted)
 {
+    CBlockTracePhaseTimer tracePhase(BLOCKTRACE_BLOCK_VALUE);
     CBlockIndex* pindexPrev = chainActive.Tip();
     if (pindexPrev == NULL) return true;
 
@@ -219,8 +96,13 @@ bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMin
 
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight)
 {
+    CBlockTracePhaseTimer tracePhase(BLOCKTRACE_BLOCK_PAYEE);
     TrxValidationStatus transactionStatus = TrxValidationStatus::InValid;
 
+    // ConnectBlock checks the payee against the registered list, see CheckDeterministicMasternodePayee
+    if (IsDeterministicMasternodeHeight(nBlockHeight))
+        return true;
+
     if (!masternodeSync.IsSynced()) { //there is no budget data to use to check anything -- find the longest chain
         LogPrint("mnpayments", "Client not synced, skipping block payee checks\n");
         return true;
@@ -259,9 +141,16 @@ void CMasternodePayments::FillBlockPayee(CMutableTransaction& txNew, int64_t nFe
 
     bool hasPayment = true;
     CScript payee;
+    CDeterministicMasternode mnNext;
 
-    //spork
-    if (!masternodePayments.GetBlockPayee(pindexPrev->nHeight + 1, payee)) {
+    if (IsDeterministicMasternodeHeight(pindexPrev->nHeight + 1)) {
+        if (deterministicMasternodes.GetNextPayee(mnNext)) {
+            payee = mnNext.payee;
+        } else {
+            LogPrint("masternode","CreateNewBlock: No registered masternode to pay\n");
+            hasPayment = false;
+        }
+    } else if (!masternodePayments.GetBlockPayee(pindexPrev->nHeight + 1, payee)) {
         //no masternode detected
         CMasternode* winningNode = mnodeman.GetCurrentMasterNode(1);
         if (winningNode) {
@@ -309,6 +198,34 @@ int CMasternodePayments::GetMinMasternodePaymentsProto()
     return MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT; // Also allow old peers as long as they are allowed to run
 }
 
+/** Finishes a winner from a peer once its signature was checked */
+static void MasternodeWinnerChecked(CNode* pfrom, CMasternodePaymentWinner& winner, bool fValid)
+{
+    if (!fValid) {
+        // LogPrint("masternode","mnw - invalid signature\n");
+        if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20, _("masternode-payments::ProcessMessageMasternodePayments::ln372::Masternode winning signiture invalid"));
+        // it could just be a non-synced masternode
+        mnodeman.AskForMN(pfrom, winner.vinMasternode);
+        return;
+    }
+
+    if (masternodePayments.AddWinningMasternode(winner)) {
+        winner.Relay();
+        masternodeSync.AddedMasternodeWinner(winner.GetHash());
+    }
+}
+
+struct CMasternodeWinnerChecked {
+    CMasternodePaymentWinner winner;
+
+    explicit CMasternodeWinnerChecked(const CMasternodePaymentWinner& winnerIn) : winner(winnerIn) {}
+
+    void operator()(CNode* pfrom, bool fValid)
+    {
+        MasternodeWinnerChecked(pfrom, winner, fValid);
+    }
+};
+
 void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (!masternodeSync.IsBlockchainSynced()) return;
@@ -333,6 +250,30 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
         pfrom->FulfilledRequest("mnget");
         masternodePayments.Sync(pfrom, nCountNeeded);
         LogPrint("mnpayments", "mnget - Sent Masternode winners to peer %i\n", pfrom->GetId());
+    } else if (strCommand == "mngetd") { //Masternode Payments Request Sync, against the digest of what the peer has
+        if (fLiteMode) return;   //disable all Masternode related functionality
+
+        int nCountNeeded;
+        CSyncDigest digest;
+        vRecv >> nCountNeeded >> digest;
+
+        if (!digest.IsValid()) {
+            LogPrint("masternode","mngetd - invalid digest from peer %i\n", pfrom->GetId());
+            return;
+        }
+
+        // it replaces "mnget" in the initial sync, so is only answered once as well
+        if (Params().NetworkID() == CBaseChainParams::MAIN) {
+            if (pfrom->HasFulfilledRequest("mnget")) {
+                LogPrint("masternode","mngetd - peer already asked me for the list\n");
+                Misbehaving(pfrom->GetId(), 20, _("masternode-payments:ProcessMessageMasternodePayments::ln325"));
+                return;
+            }
+        }
+
+        pfrom->FulfilledRequest("mnget");
+        masternodePayments.Sync(pfrom, nCountNeeded, &digest);
+        LogPrint("mnpayments", "mngetd - Sent missing Masternode winners to peer %i\n", pfrom->GetId());
     } else if (strCommand == "mnw") { //Masternode Payments Declare Winner
         //this is required in litemodef
         CMasternodePaymentWinner winner;
@@ -347,12 +288,21 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
             nHeight = chainActive.Tip()->nHeight;
         }
 
-        if (masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash())) {
+        bool fSeen;
+        {
+            LOCK(cs_mapMasternodePayeeVotes);
+            fSeen = masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash()) > 0;
+        }
+        if (fSeen) {
             LogPrint("mnpayments", "mnw - Already seen - %s bestHeight %d\n", winner.GetHash().ToString().c_str(), nHeight);
             masternodeSync.AddedMasternodeWinner(winner.GetHash());
             return;
         }
 
+        // the registered list pays these blocks, votes for them are not relayed
+        if (IsDeterministicMasternodeHeight(winner.nBlockHeight))
+            return;
+
         int nFirstBlock = nHeight - (mnodeman.CountEnabled() * 1.25);
         if (winner.nBlockHeight < nFirstBlock || winner.nBlockHeight > nHeight + 20) {
             LogPrint("mnpayments", "mnw - winner out of range - FirstBlock %d Height %d bestHeight %d\n", nFirstBlock, winner.nBlockHeight, nHeight);
@@ -370,24 +320,13 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
             return;
         }
 
-        if (!winner.SignatureValid()) {
-            // LogPrint("masternode","mnw - invalid signature\n");
-            if (masternodeSync.IsSynced()) Misbehaving(pfrom->GetId(), 20, _("masternode-payments::ProcessMessageMasternodePayments::ln372::Masternode winning signiture invalid"));
-            // it could just be a non-synced masternode
-            mnodeman.AskForMN(pfrom, winner.vinMasternode);
+        CMasternode* pmn = mnodeman.Find(winner.vinMasternode);
+        if (pmn == NULL) {
+            MasternodeWinnerChecked(pfrom, winner, false);
             return;
-        }  
-
-        CTxDestination address1;
-        ExtractDestination(winner.payee, address1);
-        CBitcoinAddress address2(address1);
-
-        //   LogPrint("mnpayments", "mnw - winning vote - Addr %s Height %d bestHeight %d - %s\n", address2.ToString().c_str(), winner.nBlockHeight, nHeight, winner.vinMasternode.prevout.ToStringShort());
-
-        if (masternodePayments.AddWinningMasternode(winner)) {
-            winner.Relay();
-            masternodeSync.AddedMasternodeWinner(winner.GetHash());
         }
+
+        mnsigcheckqueue.Push(pfrom, winner.GetSignatureCheck(pmn->pubKeyMasternode), CMasternodeWinnerChecked(winner));
     }
 }
 
@@ -422,35 +361,190 @@ bool CMasternodePayments::GetBlockPayee(int nBlockHeight, CScript& payee)
     return false;
 }
 
-// Is this masternode scheduled to get paid soon?
+void CMasternodePayments::IndexBlockPayees(int nBlockHeight, const CMasternodeBlockPayees& blockPayees)
+{
+    AssertLockHeld(cs_mapMasternodeBlocks);
+    LOCK(cs_vecPayments);
+    BOOST_FOREACH (const CMasternodePayee& payee, blockPayees.vecPayments) {
+        if (payee.nVotes >= 2)
+            mapPaidHeights[payee.scriptPubKey].insert(nBlockHeight);
+    }
+}
+
+void CMasternodePayments::UnindexBlockPayees(int nBlockHeight, const CMasternodeBlockPayees& blockPayees)
+{
+    AssertLockHeld(cs_mapMasternodeBlocks);
+    LOCK(cs_vecPayments);
+    BOOST_FOREACH (const CMasternodePayee& payee, blockPayees.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator it = mapPaidHeights.find(payee.scriptPubKey);
+        if (it == mapPaidHeights.end())
+            continue;
+        it->second.erase(nBlockHeight);
+        if (it->second.empty())
+            mapPaidHeights.erase(it);
+    }
+}
+
+bool GetBlockMasternodePayee(const CBlock& block, CScript& payee)
+{
+    if (block.IsProofOfStake()) {
+        // the payment is appended after the stake outputs, which all pay the staker
+        const CTransaction& txCoinStake = block.vtx[1];
+        if (txCoinStake.vout.size() < 3) return false;
+        payee = txCoinStake.vout.back().scriptPubKey;
+        return payee != txCoinStake.vout[1].scriptPubKey;
+    }
+
+    const CTransaction& txCoinBase = block.vtx[0];
+    if (txCoinBase.vout.size() < 2) return false;
+    payee = txCoinBase.vout[1].scriptPubKey;
+    return true;
+}
+
+void CMasternodePayments::ConnectBlockPayee(int nHeight, const CScript& payee)
+{
+    LOCK(cs_chainPayees);
+    DisconnectBlockPayee(nHeight);
+    if (!payee.empty()) {
+        mapChainPayees[nHeight] = payee;
+        mapChainPaidHeights[payee].insert(nHeight);
+    }
+
+    while (!mapChainPayees.empty() && mapChainPayees.begin()->first <= nHeight - MNPAYMENTS_HISTORY_BLOCKS)
+        DisconnectBlockPayee(mapChainPayees.begin()->first);
+}
+
+void CMasternodePayments::DisconnectBlockPayee(int nHeight)
+{
+    LOCK(cs_chainPayees);
+    std::map<int, CScript>::iterator it = mapChainPayees.find(nHeight);
+    if (it == mapChainPayees.end())
+        return;
+    std::map<CScript, std::set<int> >::iterator itPayee = mapChainPaidHeights.find(it->second);
+    if (itPayee != mapChainPaidHeights.end()) {
+        itPayee->second.erase(nHeight);
+        if (itPayee->second.empty())
+            mapChainPaidHeights.erase(itPayee);
+    }
+    mapChainPayees.erase(it);
+}
+
+bool CMasternodePayments::LoadPaymentHistory()
+{
+    int64_t nStart = GetTimeMillis();
+    LOCK(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == NULL) {
+        LOCK(cs_chainPayees);
+        fChainPayeesLoaded = true;
+        return true;
+    }
+
+    int nFirst = std::max(1, pindexTip->nHeight - MNPAYMENTS_HISTORY_BLOCKS + 1);
+    std::vector<std::pair<int, CPaymentIndexValue> > vPayees;
+    if (!pblocktree->ReadPaymentIndex(nFirst, vPayees))
+        return error("%s : cannot read the payment index", __func__);
+
+    // entries of blocks no longer in the active chain are indexed again, like the missing ones
+    std::map<int, CScript> mapPayees;
+    std::set<int> setIndexed;
+    for (std::vector<std::pair<int, CPaymentIndexValue> >::const_iterator it = vPayees.begin(); it != vPayees.end(); ++it) {
+        if (it->first > pindexTip->nHeight) break;
+        if (chainActive[it->first]->GetBlockHash() != it->second.hashBlock) continue;
+        setIndexed.insert(it->first);
+        if (!it->second.payee.empty())
+            mapPayees[it->first] = it->second.payee;
+    }
+
+    CIndexUpdate indexUpdate;
+    for (int nHeight = nFirst; nHeight <= pindexTip->nHeight; nHeight++) {
+        if (setIndexed.count(nHeight)) continue;
+        CBlock block;
+        if (!ReadBlockFromDisk(block, chainActive[nHeight]))
+            return error("%s : cannot read block %d", __func__, nHeight);
+        CScript payee;
+        if (GetBlockMasternodePayee(block, payee))
+            mapPayees[nHeight] = payee;
+        else
+            payee.clear();
+        indexUpdate.vPaymentIndex.push_back(std::make_pair(nHeight, CPaymentIndexValue(chainActive[nHeight]->GetBlockHash(), payee)));
+    }
+    if (!indexUpdate.IsEmpty() && !pblocktree->WriteIndexUpdate(indexUpdate))
+        return error("%s : cannot write the payment index", __func__);
+
+    {
+        LOCK(cs_chainPayees);
+        mapChainPayees.clear();
+        mapChainPaidHeights.clear();
+        for (std::map<int, CScript>::const_iterator it = mapPayees.begin(); it != mapPayees.end(); ++it)
+            ConnectBlockPayee(it->first, it->second);
+        fChainPayeesLoaded = true;
+    }
+
+    LogPrintf("Loaded %u masternode payments of the last %d blocks, %u blocks indexed, %dms\n",
+        mapPayees.size(), pindexTip->nHeight - nFirst + 1, indexUpdate.vPaymentIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nTipHeight, int nWindow)
+{
+    {
+        LOCK(cs_chainPayees);
+        if (fChainPayeesLoaded) {
+            std::map<CScript, std::set<int> >::const_iterator it = mapChainPaidHeights.find(payee);
+            if (it == mapChainPaidHeights.end())
+                return 0;
+            std::set<int>::const_iterator itHeight = it->second.upper_bound(nTipHeight);
+            if (itHeight == it->second.begin())
+                return 0;
+            --itHeight;
+            if (*itHeight <= nTipHeight - nWindow)
+                return 0;
+            return *itHeight;
+        }
+    }
+
+    LOCK(cs_mapMasternodeBlocks);
+    std::map<CScript, std::set<int> >::const_iterator it = mapPaidHeights.find(payee);
+    if (it == mapPaidHeights.end())
+        return 0;
+    std::set<int>::const_iterator itHeight = it->second.upper_bound(nTipHeight);
+    if (itHeight == it->second.begin())
+        return 0;
+    --itHeight;
+    if (*itHeight <= 0 || *itHeight <= nTipHeight - nWindow)
+        return 0;
+    return *itHeight;
+}
+
+// Who is scheduled to get paid soon?
 // -- Only look ahead up to 8 blocks to allow for propagation of the latest 2 winners
-bool CMasternodePayments::IsScheduled(CMasternode& mn, int nNotBlockHeight)
+void CMasternodePayments::GetScheduledPayees(int nNotBlockHeight, std::set<CScript>& setPayees)
 {
     LOCK(cs_mapMasternodeBlocks);
 
     int nHeight;
     {
         TRY_LOCK(cs_main, locked);
-        if (!locked || chainActive.Tip() == NULL) return false;
+        if (!locked || chainActive.Tip() == NULL) return;
         nHeight = chainActive.Tip()->nHeight;
     }
 
-    CScript mnpayee;
-    mnpayee = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-
     CScript payee;
     for (int64_t h = nHeight; h <= nHeight + 8; h++) {
         if (h == nNotBlockHeight) continue;
-        if (mapMasternodeBlocks.count(h)) {
-            if (mapMasternodeBlocks[h].GetPayee(payee)) {
-                if (mnpayee == payee) {
-                    return true;
-                }
-            }
-        }
+        std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(h);
+        if (it != mapMasternodeBlocks.end() && it->second.GetPayee(payee))
+            setPayees.insert(payee);
     }
+}
 
-    return false;
+// Is this masternode scheduled to get paid soon?
+bool CMasternodePayments::IsScheduled(CMasternode& mn, int nNotBlockHeight)
+{
+    std::set<CScript> setPayees;
+    GetScheduledPayees(nNotBlockHeight, setPayees);
+    return setPayees.count(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID())) > 0;
 }
 
 bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerIn)
@@ -467,16 +561,19 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
             return false;
         }
 
-        mapMasternodePayeeVotes[winnerIn.GetHash()] = winnerIn;
+        mapMasternodePayeeVotes.Insert(winnerIn.GetHash(), winnerIn);
 
         if (!mapMasternodeBlocks.count(winnerIn.nBlockHeight)) {
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
             mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
         }
-    }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+        CMasternodeBlockPayees& blockPayees = mapMasternodeBlocks[winnerIn.nBlockHeight];
+        blockPayees.AddPayee(winnerIn.payee, 1);
+        IndexBlockPayees(winnerIn.nBlockHeight, blockPayees);
+    }
 
+    NotifyMasternodeMessage("rawmnw", winnerIn);
     return true;
 }
 
@@ -595,17 +692,16 @@ void CMasternodePayments::CleanPaymentList()
     //keep up to five cycles for historical sake
     int nLimit = std::max(int(mnodeman.size() * 1.25), 1000);
 
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-
-        if (nHeight - winner.nBlockHeight > nLimit) {
-            LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
-            mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
-        } else {
-            ++it;
+    // the winners expire by height, only those below the limit are looked at
+    std::vector<std::pair<int64_t, uint256> > vErased;
+    mapMasternodePayeeVotes.ExpireBefore(nHeight - nLimit, &vErased);
+    for (std::vector<std::pair<int64_t, uint256> >::const_iterator it = vErased.begin(); it != vErased.end(); ++it) {
+        LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", it->first);
+        masternodeSync.mapSeenSyncMNW.erase(it->second);
+        std::map<int, CMasternodeBlockPayees>::iterator itBlock = mapMasternodeBlocks.find(it->first);
+        if (itBlock != mapMasternodeBlocks.end()) {
+            UnindexBlockPayees(itBlock->first, itBlock->second);
+            mapMasternodeBlocks.erase(itBlock);
         }
     }
 }
@@ -646,6 +742,7 @@ bool CMasternodePaymentWinner::IsValid(CNode* pnode, std::string& strError)
 bool CMasternodePayments::ProcessBlock(int nBlockHeight)
 {
     if (!fMasterNode) return false;
+    if (IsDeterministicMasternodeHeight(nBlockHeight)) return false;
 
     //reference node - hybrid mode
 
@@ -721,17 +818,21 @@ void CMasternodePaymentWinner::Relay()
     RelayInv(inv);
 }
 
+CMasternodeSigCheck CMasternodePaymentWinner::GetSignatureCheck(const CPubKey& pubKeyMasternode) const
+{
+    std::string strMessage = vinMasternode.prevout.ToStringShort() +
+                             boost::lexical_cast<std::string>(nBlockHeight) +
+                             payee.ToString();
+
+    return CMasternodeSigCheck(pubKeyMasternode, vchSig, strMessage);
+}
+
 bool CMasternodePaymentWinner::SignatureValid()
 {
     CMasternode* pmn = mnodeman.Find(vinMasternode);
 
     if (pmn != NULL) {
-        std::string strMessage = vinMasternode.prevout.ToStringShort() +
-                                 boost::lexical_cast<std::string>(nBlockHeight) +
-                                 payee.ToString();
-
-        std::string errorMessage = "";
-        if (!masternodeSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
+        if (!GetSignatureCheck(pmn->pubKeyMasternode)()) {
             return error("CMasternodePaymentWinner::SignatureValid() - Got bad Masternode address signature %s\n", vinMasternode.prevout.hash.ToString());
         }
 
@@ -741,10 +842,47 @@ bool CMasternodePaymentWinner::SignatureValid()
     return false;
 }
 
-void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
+bool CMasternodePayments::GetSyncDigest(int nCountNeeded, CSyncDigest& digest)
+{
+    LOCK(cs_mapMasternodePayeeVotes);
+
+    int nHeight;
+    {
+        TRY_LOCK(cs_main, locked);
+        if (!locked || chainActive.Tip() == NULL) return false;
+        nHeight = chainActive.Tip()->nHeight;
+    }
+
+    int nCount = (mnodeman.CountEnabled() * 1.25);
+    if (nCountNeeded > nCount) nCountNeeded = nCount;
+
+    for (SeenPaymentWinnerCache::const_iterator it = mapMasternodePayeeVotes.begin(); it != mapMasternodePayeeVotes.end(); ++it) {
+        const CMasternodePaymentWinner& winner = it->second.value;
+        if (winner.nBlockHeight >= nHeight - nCountNeeded && winner.nBlockHeight <= nHeight + 20)
+            digest.Add(it->first);
+    }
+
+    return true;
+}
+
+void CMasternodePayments::RequestSyncDigest(CNode* pnode, int nCountNeeded)
+{
+    CSyncDigest digest;
+    if (!GetSyncDigest(nCountNeeded, digest)) {
+        pnode->PushMessage("mnget", nCountNeeded);
+        return;
+    }
+    pnode->PushMessage("mngetd", nCountNeeded, digest);
+}
+
+void CMasternodePayments::Sync(CNode* node, int nCountNeeded, const CSyncDigest* pdigest)
 {
     LOCK(cs_mapMasternodePayeeVotes);
 
+    // with the digest of the peer, announce only the winners of the buckets where our digest differs
+    CSyncDigest digestLocal;
+    if (pdigest && !GetSyncDigest(nCountNeeded, digestLocal)) return;
+
     int nHeight;
     {
         TRY_LOCK(cs_main, locked);
@@ -756,14 +894,14 @@ void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
     if (nCountNeeded > nCount) nCountNeeded = nCount;
 
     int nInvCount = 0;
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
+    for (SeenPaymentWinnerCache::const_iterator it = mapMasternodePayeeVotes.begin(); it != mapMasternodePayeeVotes.end(); ++it) {
+        const CMasternodePaymentWinner& winner = it->second.value;
         if (winner.nBlockHeight >= nHeight - nCountNeeded && winner.nBlockHeight <= nHeight + 20) {
-            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
+            const uint256& hash = it->first;
+            if (!pdigest || !digestLocal.BucketMatches(*pdigest, hash))
+                node->PushInventory(CInv(MSG_MASTERNODE_WINNER, hash));
             nInvCount++;
         }
-        ++it;
     }
     node->PushMessage("ssc", MASTERNODE_SYNC_MNW, nInvCount);
 }
@@ -777,6 +915,26 @@ std::string CMasternodePayments::ToString() const
     return info.str();
 }
 
+void CMasternodePayments::GetMemoryUsage(std::map<std::string, size_t>& mapUsage)
+{
+    LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
+    size_t nUsage = mapMasternodePayeeVotes.DynamicMemoryUsage();
+    for (SeenPaymentWinnerCache::const_iterator it = mapMasternodePayeeVotes.begin(); it != mapMasternodePayeeVotes.end(); ++it) {
+        const CMasternodePaymentWinner& winner = it->second.value;
+        nUsage += RecursiveDynamicUsage(winner.vinMasternode) + RecursiveDynamicUsage(winner.payee) + memusage::DynamicUsage(winner.vchSig);
+    }
+    mapUsage["mapMasternodePayeeVotes"] = nUsage;
+
+    nUsage = memusage::DynamicUsage(mapMasternodeBlocks);
+    for (std::map<int, CMasternodeBlockPayees>::const_iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it) {
+        nUsage += memusage::DynamicUsage(it->second.vecPayments);
+        BOOST_FOREACH (const CMasternodePayee& payee, it->second.vecPayments)
+            nUsage += RecursiveDynamicUsage(payee.scriptPubKey);
+    }
+    mapUsage["mapMasternodeBlocks"] = nUsage;
+
+    mapUsage["mapMasternodesLastVote"] = memusage::DynamicUsage(mapMasternodesLastVote);
+}
 
 int CMasternodePayments::GetOldestBlock()
 {
@@ -9,6 +9,9 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "masternode-db.h"
+#include "masternode-sigcheck.h"
+#include "seencache.h"
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -23,8 +26,15 @@ class CMasternodeBlockPayees;
 
 extern CMasternodePayments masternodePayments;
 
+//! The payee of the masternode payment FillBlockPayee added to a block, false if it has none
+bool GetBlockMasternodePayee(const CBlock& block, CScript& payee);
+
 #define MNPAYMENTS_SIGNATURES_REQUIRED 6
 #define MNPAYMENTS_SIGNATURES_TOTAL 10
+// bound of the seen winners, CleanPaymentList keeps those of the last cycles well below it
+#define MNPAYMENTS_SEEN_MAX 100000
+// blocks of confirmed payments kept in memory from the payment index, more than a payment cycle
+#define MNPAYMENTS_HISTORY_BLOCKS 20000
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight);
@@ -36,26 +46,10 @@ void DumpMasternodePayments();
 
 /** Save Masternode Payment Data (mnpayments.dat)
  */
-class CMasternodePaymentDB
+class CMasternodePaymentDB : public CMasternodeCacheDB<CMasternodePayments>
 {
-private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
-
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
-    CMasternodePaymentDB();
-    bool Write(const CMasternodePayments& objToSave);
-    ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
+    CMasternodePaymentDB() : CMasternodeCacheDB<CMasternodePayments>("mnpayments.dat", "MasternodePayments") {}
 };
 
 class CMasternodePayee
@@ -194,6 +188,7 @@ public:
 
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool IsValid(CNode* pnode, std::string& strError);
+    CMasternodeSigCheck GetSignatureCheck(const CPubKey& pubKeyMasternode) const;
     bool SignatureValid();
     void Relay();
 
@@ -230,21 +225,42 @@ public:
 // Keeps track of who should get paid for which blocks
 //
 
+/** Winners are kept by the height they vote for, CleanPaymentList drops the old heights */
+struct CMasternodePaymentWinnerExpiry {
+    int64_t operator()(const CMasternodePaymentWinner& winner) const { return winner.nBlockHeight; }
+};
+
+typedef CSeenCache<CMasternodePaymentWinner, CMasternodePaymentWinnerExpiry> SeenPaymentWinnerCache;
+
 class CMasternodePayments
 {
 private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    //! Heights in mapMasternodeBlocks where each payee has two votes or more, guarded by cs_mapMasternodeBlocks
+    std::map<CScript, std::set<int> > mapPaidHeights;
+
+    void IndexBlockPayees(int nBlockHeight, const CMasternodeBlockPayees& blockPayees);
+    void UnindexBlockPayees(int nBlockHeight, const CMasternodeBlockPayees& blockPayees);
+
+    //! Payees of the masternode payments of the active chain over the last MNPAYMENTS_HISTORY_BLOCKS,
+    //! from the payment index; GetLastPaidHeight answers from them once they are loaded
+    CCriticalSection cs_chainPayees;
+    bool fChainPayeesLoaded;
+    std::map<int, CScript> mapChainPayees;
+    std::map<CScript, std::set<int> > mapChainPaidHeights;
+
 public:
-    std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
+    SeenPaymentWinnerCache mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
     std::map<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
 
-    CMasternodePayments()
+    CMasternodePayments() : mapMasternodePayeeVotes(MNPAYMENTS_SEEN_MAX)
     {
         nSyncedFromPeer = 0;
         nLastBlockHeight = 0;
+        fChainPayeesLoaded = false;
     }
 
     void Clear()
@@ -252,18 +268,36 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPaidHeights.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
     bool ProcessBlock(int nBlockHeight);
 
-    void Sync(CNode* node, int nCountNeeded);
+    void Sync(CNode* node, int nCountNeeded, const CSyncDigest* pdigest = NULL);
+    /** Digest of the winners Sync(node, nCountNeeded) announces */
+    bool GetSyncDigest(int nCountNeeded, CSyncDigest& digest);
+    /** Ask a peer for the winners we miss, by sending it our digest */
+    void RequestSyncDigest(CNode* pnode, int nCountNeeded);
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
 
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     bool IsScheduled(CMasternode& mn, int nNotBlockHeight);
+    /** Payees of the blocks from the tip up to 8 blocks ahead, not counting nNotBlockHeight */
+    void GetScheduledPayees(int nNotBlockHeight, std::set<CScript>& setPayees);
+    /**
+     * Last height in (nTipHeight - nWindow, nTipHeight] that paid payee: from the blocks once the
+     * payment history is loaded, before that the last with two votes or more. 0 if none.
+     */
+    int GetLastPaidHeight(const CScript& payee, int nTipHeight, int nWindow);
+
+    /** Load the payees of the recent blocks of the active chain from the payment index, indexing those it misses */
+    bool LoadPaymentHistory();
+    /** Called by ConnectBlock and DisconnectBlock as they write the payment index */
+    void ConnectBlockPayee(int nHeight, const CScript& payee);
+    void DisconnectBlockPayee(int nHeight);
 
     bool CanVote(COutPoint outMasternode, int nBlockHeight)
     {
@@ -287,14 +321,22 @@ public:
     std::string ToString() const;
     int GetOldestBlock();
     int GetNewestBlock();
+    /** Estimated heap memory of each map, by name */
+    void GetMemoryUsage(std::map<std::string, size_t>& mapUsage);
 
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
+        LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead()) {
+            mapPaidHeights.clear();
+            for (std::map<int, CMasternodeBlockPayees>::const_iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it)
+                IndexBlockPayees(it->first, it->second);
+        }
     }
 };
 
@@ -0,0 +1,107 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode-sigcheck.h"
+
+#include "hash.h"
+#include "main.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+CMasternodeSigCheckQueue mnsigcheckqueue;
+
+bool CMasternodeSigCheck::operator()() const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << strMessageMagic;
+    ss << strMessage;
+
+    CPubKey pubkeyRecovered;
+    if (!pubkeyRecovered.RecoverCompact(ss.GetHash(), vchSig))
+        return false;
+
+    return pubkeyRecovered.GetID() == pubkey.GetID();
+}
+
+void CMasternodeSigCheckQueue::Push(CNode* pfrom, const CMasternodeSigCheck& check, const MasternodeSigCheckCallback& callback)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nWorkers > 0 && queue.size() < MAX_MASTERNODE_SIGCHECK_QUEUE) {
+            CPendingCheck pending;
+            pending.nodeid = pfrom->GetId();
+            pending.check = check;
+            pending.callback = callback;
+            pending.fValid = false;
+            queue.push_back(pending);
+            mapNodeChecks[pending.nodeid].nInFlight++;
+            condWorker.notify_one();
+            return;
+        }
+    }
+
+    callback(pfrom, check());
+}
+
+void CMasternodeSigCheckQueue::ProcessCompleted(CNode* pfrom)
+{
+    std::vector<CPendingCheck> vDone;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<NodeId, CNodeChecks>::iterator it = mapNodeChecks.find(pfrom->GetId());
+        if (it == mapNodeChecks.end())
+            return;
+        vDone.swap(it->second.vDone);
+        if (it->second.nInFlight == 0)
+            mapNodeChecks.erase(it);
+    }
+
+    BOOST_FOREACH (CPendingCheck& pending, vDone)
+        pending.callback(pfrom, pending.fValid);
+}
+
+void CMasternodeSigCheckQueue::RemoveNode(NodeId nodeid)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    mapNodeChecks.erase(nodeid);
+}
+
+void CMasternodeSigCheckQueue::Thread()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWorkers++;
+    }
+
+    while (true) {
+        CPendingCheck pending;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queue.empty())
+                condWorker.wait(lock);
+            pending = queue.front();
+            queue.pop_front();
+        }
+
+        pending.fValid = pending.check();
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // The node may have disconnected while its check ran
+            std::map<NodeId, CNodeChecks>::iterator it = mapNodeChecks.find(pending.nodeid);
+            if (it == mapNodeChecks.end())
+                continue;
+            it->second.nInFlight--;
+            it->second.vDone.push_back(pending);
+        }
+        messageHandlerCondition.notify_all();
+    }
+}
+
+void ThreadMasternodeSigCheck()
+{
+    RenameThread("dystem-mnsigch");
+    mnsigcheckqueue.Thread();
+}
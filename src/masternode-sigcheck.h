@@ -0,0 +1,91 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MASTERNODE_SIGCHECK_H
+#define MASTERNODE_SIGCHECK_H
+
+#include "net.h"
+#include "pubkey.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+//! Pending checks above which new ones are verified on the message thread
+static const unsigned int MAX_MASTERNODE_SIGCHECK_QUEUE = 10000;
+
+/** The signature of a masternode network message, checked like CMasternodeSigner::VerifyMessage */
+class CMasternodeSigCheck
+{
+public:
+    CPubKey pubkey;
+    std::vector<unsigned char> vchSig;
+    std::string strMessage;
+
+    CMasternodeSigCheck() {}
+    CMasternodeSigCheck(const CPubKey& pubkeyIn, const std::vector<unsigned char>& vchSigIn, const std::string& strMessageIn) : pubkey(pubkeyIn), vchSig(vchSigIn), strMessage(strMessageIn) {}
+
+    bool operator()() const;
+};
+
+/** Finishes processing a message from pfrom once its signature was checked */
+typedef boost::function<void(CNode* pfrom, bool fValid)> MasternodeSigCheckCallback;
+
+/**
+ * Queue of masternode network signatures to check on worker threads.
+ *
+ * The message handler pushes the check of a vote or winner with the callback
+ * that finishes processing it, and moves on to the next message. The workers
+ * verify the signatures and wake the message handlers, which run the
+ * callbacks of a peer from ProcessMessages(), so the messages of a peer keep
+ * being handled by the thread that serves it. Without workers, or once
+ * MAX_MASTERNODE_SIGCHECK_QUEUE checks are pending, a check and its callback
+ * run right away.
+ */
+class CMasternodeSigCheckQueue
+{
+private:
+    struct CPendingCheck {
+        NodeId nodeid;
+        CMasternodeSigCheck check;
+        MasternodeSigCheckCallback callback;
+        bool fValid;
+    };
+
+    struct CNodeChecks {
+        //! Checks of the node that workers have not finished yet
+        int nInFlight;
+        std::vector<CPendingCheck> vDone;
+
+        CNodeChecks() : nInFlight(0) {}
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    std::deque<CPendingCheck> queue;
+    std::map<NodeId, CNodeChecks> mapNodeChecks;
+    int nWorkers;
+
+public:
+    CMasternodeSigCheckQueue() : nWorkers(0) {}
+
+    void Push(CNode* pfrom, const CMasternodeSigCheck& check, const MasternodeSigCheckCallback& callback);
+    /** Run the callbacks of the finished checks of pfrom */
+    void ProcessCompleted(CNode* pfrom);
+    /** Drop the checks of a disconnected node */
+    void RemoveNode(NodeId nodeid);
+    /** Worker thread loop */
+    void Thread();
+};
+
+extern CMasternodeSigCheckQueue mnsigcheckqueue;
+
+void ThreadMasternodeSigCheck();
+
+#endif
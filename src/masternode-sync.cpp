@@ -9,8 +9,10 @@
 #include "masternode-sync.h"
 #include "masternode-payments.h"
 #include "masternode-budget.h"
+#include "masternode-list.h"
 #include "masternode.h"
 #include "masternodeman.h"
+#include "metrics.h"
 #include "util.h"
 #include "addrman.h"
 // clang-format on
@@ -88,6 +90,9 @@ void CMasternodeSync::Reset()
     RequestedMasternodeAssets = MASTERNODE_SYNC_INITIAL;
     RequestedMasternodeAttempt = 0;
     nAssetSyncStarted = GetTime();
+    metricMasternodeSyncAsset.Set(RequestedMasternodeAssets);
+    LOCK(cs_peers);
+    mapSyncPeers.clear();
 }
 
 void CMasternodeSync::AddedMasternodeList(uint256 hash)
@@ -152,7 +157,11 @@ void CMasternodeSync::GetNextAsset()
         RequestedMasternodeAssets = MASTERNODE_SYNC_LIST;
         break;
     case (MASTERNODE_SYNC_LIST):
-        RequestedMasternodeAssets = MASTERNODE_SYNC_MNW;
+        // no winner votes are needed for blocks the registered list pays
+        if (IsDeterministicMasternodeHeight(chainActive.Height() + 1))
+            RequestedMasternodeAssets = MASTERNODE_SYNC_BUDGET;
+        else
+            RequestedMasternodeAssets = MASTERNODE_SYNC_MNW;
         break;
     case (MASTERNODE_SYNC_MNW):
         RequestedMasternodeAssets = MASTERNODE_SYNC_BUDGET;
@@ -163,6 +172,7 @@ void CMasternodeSync::GetNextAsset()
     }
     RequestedMasternodeAttempt = 0;
     nAssetSyncStarted = GetTime();
+    metricMasternodeSyncAsset.Set(RequestedMasternodeAssets);
 }
 
 std::string CMasternodeSync::GetSyncStatus()
@@ -203,11 +213,28 @@ void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
             }
             sumMasternodeList += nCount;
             countMasternodeList++;
+            {
+                LOCK(cs_peers);
+                mapSyncPeers[pfrom->GetId()].fListAnswered = true;
+            }
+            // the list hash to ask this peer for the changes since next time
+            if (!vRecv.empty()) {
+                uint256 hashList;
+                vRecv >> hashList;
+                mnodeman.SetPeerListHash(pfrom->addr, hashList);
+                // the peer has sent all that is new to us, which may be nothing
+                lastMasternodeList = GetTime();
+            }
             break;
         case (MASTERNODE_SYNC_MNW):
-            if (nItemID != RequestedMasternodeAssets) return;
+            // the winners are asked for while the list syncs too
+            if (RequestedMasternodeAssets != MASTERNODE_SYNC_LIST && RequestedMasternodeAssets != MASTERNODE_SYNC_MNW) return;
             sumMasternodeWinner += nCount;
             countMasternodeWinner++;
+            {
+                LOCK(cs_peers);
+                mapSyncPeers[pfrom->GetId()].fWinnersAnswered = true;
+            }
             break;
         case (MASTERNODE_SYNC_BUDGET_PROP):
             if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
@@ -218,10 +245,21 @@ void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
             if (RequestedMasternodeAssets != MASTERNODE_SYNC_BUDGET) return;
             sumBudgetItemFin += nCount;
             countBudgetItemFin++;
+            {
+                // sent after the proposals, the peer is done
+                LOCK(cs_peers);
+                mapSyncPeers[pfrom->GetId()].fBudgetAnswered = true;
+            }
             break;
         }
 
         LogPrint("masternode", "CMasternodeSync:ProcessMessage - ssc - got inventory count %d %d\n", nItemID, nCount);
+
+        // peers with nothing to send finish a stage right away; the budget stage is
+        // left to Process(), which activates our masternode once it is done
+        if ((RequestedMasternodeAssets == MASTERNODE_SYNC_LIST || RequestedMasternodeAssets == MASTERNODE_SYNC_MNW) &&
+            IsAssetDone(RequestedMasternodeAssets))
+            GetNextAsset();
     }
 }
 
@@ -237,11 +275,152 @@ void CMasternodeSync::ClearFulfilledRequest()
     }
 }
 
-void CMasternodeSync::Process()
+/** What pnode was asked for the asset and whether it answered */
+static void GetPeerAsset(CMasternodeSyncPeer& peer, int nAsset, int64_t*& pnAsked, bool*& pfAnswered)
+{
+    switch (nAsset) {
+    case MASTERNODE_SYNC_LIST:
+        pnAsked = &peer.nListAsked;
+        pfAnswered = &peer.fListAnswered;
+        break;
+    case MASTERNODE_SYNC_MNW:
+        pnAsked = &peer.nWinnersAsked;
+        pfAnswered = &peer.fWinnersAnswered;
+        break;
+    default:
+        pnAsked = &peer.nBudgetAsked;
+        pfAnswered = &peer.fBudgetAnswered;
+        break;
+    }
+}
+
+void CMasternodeSync::CountPeers(int nAsset, int& nAnswered, int& nPending)
+{
+    AssertLockHeld(cs_peers);
+    nAnswered = 0;
+    nPending = 0;
+    int64_t nNow = GetTime();
+    for (std::map<NodeId, CMasternodeSyncPeer>::iterator it = mapSyncPeers.begin(); it != mapSyncPeers.end(); ++it) {
+        // once the list is synced, only the winners asked for since count
+        if (nAsset == MASTERNODE_SYNC_MNW && IsMasternodeListSynced() && !it->second.fWinnersAfterList)
+            continue;
+        int64_t* pnAsked;
+        bool* pfAnswered;
+        GetPeerAsset(it->second, nAsset, pnAsked, pfAnswered);
+        if (*pfAnswered)
+            nAnswered++;
+        else if (*pnAsked > nNow - MASTERNODE_SYNC_TIMEOUT * 2)
+            nPending++; // asked recently, a slower peer is not waited for
+    }
+}
+
+bool CMasternodeSync::IsAssetDone(int nAsset)
+{
+    int64_t nLastItem;
+    int nSum;
+    switch (nAsset) {
+    case MASTERNODE_SYNC_LIST:
+        nLastItem = lastMasternodeList;
+        nSum = sumMasternodeList;
+        break;
+    case MASTERNODE_SYNC_MNW:
+        nLastItem = lastMasternodeWinner;
+        nSum = sumMasternodeWinner;
+        break;
+    case MASTERNODE_SYNC_BUDGET:
+        nLastItem = lastBudgetItem;
+        nSum = sumBudgetItemProp + sumBudgetItemFin;
+        break;
+    default:
+        return false;
+    }
+
+    int nAnswered, nPending;
+    {
+        LOCK(cs_peers);
+        CountPeers(nAsset, nAnswered, nPending);
+    }
+    int64_t nNow = GetTime();
+
+    // enough peers answered, and what they announced has come in
+    if (nAnswered >= MASTERNODE_SYNC_THRESHOLD && (nSum == 0 || (nLastItem > 0 && nLastItem < nNow - MASTERNODE_SYNC_QUIET)))
+        return true;
+
+    // items came in from fewer peers, and stopped
+    if (nLastItem > 0 && nLastItem < nNow - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD)
+        return true;
+
+    // nobody has anything, or nobody answers
+    if (nLastItem == 0 && (nNow - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5 ||
+                              (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 && nPending == 0)))
+        return true;
+
+    return false;
+}
+
+bool CMasternodeSync::RequestAsset(CNode* pnode, int nAsset)
 {
-    static int tick = 0;
+    if (nAsset == MASTERNODE_SYNC_BUDGET) {
+        if (pnode->nVersion < ActiveProtocol()) return false;
+    } else if (pnode->nVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
+        return false;
+    }
 
-    if (tick++ % MASTERNODE_SYNC_TIMEOUT != 0) return;
+    {
+        LOCK(cs_peers);
+        CMasternodeSyncPeer& peer = mapSyncPeers[pnode->GetId()];
+        int64_t* pnAsked;
+        bool* pfAnswered;
+        GetPeerAsset(peer, nAsset, pnAsked, pfAnswered);
+        if (*pnAsked > 0) return false; // peers are asked once, some punish asking again
+
+        // while the list syncs, the winners come from other peers
+        if (nAsset == MASTERNODE_SYNC_MNW && !IsMasternodeListSynced() && peer.nListAsked > 0) return false;
+
+        int nAnswered, nPending;
+        CountPeers(nAsset, nAnswered, nPending);
+        if (nAnswered + nPending >= MASTERNODE_SYNC_THRESHOLD) return false;
+
+        int nAsked = 0;
+        for (std::map<NodeId, CMasternodeSyncPeer>::iterator it = mapSyncPeers.begin(); it != mapSyncPeers.end(); ++it) {
+            int64_t* pnOtherAsked;
+            bool* pfOtherAnswered;
+            GetPeerAsset(it->second, nAsset, pnOtherAsked, pfOtherAnswered);
+            if (*pnOtherAsked > 0) nAsked++;
+        }
+        if (nAsked >= MASTERNODE_SYNC_THRESHOLD * 3) return false;
+
+        if (nAsset == MASTERNODE_SYNC_MNW) {
+            if (chainActive.Tip() == NULL) return false;
+            peer.fWinnersAfterList = IsMasternodeListSynced();
+        }
+        *pnAsked = GetTime();
+    }
+
+    if (nAsset == MASTERNODE_SYNC_LIST) {
+        mnodeman.DsegUpdate(pnode);
+    } else if (nAsset == MASTERNODE_SYNC_MNW) {
+        int nMnCount = mnodeman.CountEnabled();
+        if (pnode->nVersion >= SYNC_DIGEST_VERSION)
+            masternodePayments.RequestSyncDigest(pnode, nMnCount); //sync the payees we miss
+        else
+            pnode->PushMessage("mnget", nMnCount); //sync payees
+    } else {
+        if (pnode->nVersion >= SYNC_DIGEST_VERSION) {
+            budget.RequestSyncDigest(pnode); //sync the masternode votes we miss
+        } else {
+            uint256 n = 0;
+            pnode->PushMessage("mnvs", n); //sync masternode votes
+        }
+    }
+    LogPrint("masternode", "CMasternodeSync::RequestAsset - asked peer %i for asset %d\n", pnode->GetId(), nAsset);
+    return true;
+}
+
+void CMasternodeSync::Process()
+{
+    // The stage also changes to finished or failed in here, seen on the next run
+    metricMasternodeSyncAsset.Set(RequestedMasternodeAssets);
     
     if (IsSynced()) {
         /* 
@@ -271,8 +450,11 @@ void CMasternodeSync::Process()
     TRY_LOCK(cs_vNodes, lockRecv);
     if (!lockRecv) return;
 
-    BOOST_FOREACH (CNode* pnode, vNodes) {
-        if (Params().NetworkID() == CBaseChainParams::REGTEST) {
+    if (Params().NetworkID() == CBaseChainParams::REGTEST) {
+        static int tick = 0;
+        if (tick++ % MASTERNODE_SYNC_TIMEOUT != 0) return;
+
+        BOOST_FOREACH (CNode* pnode, vNodes) {
             if (RequestedMasternodeAttempt <= 2) {
                 mnodeman.DsegUpdate(pnode);
             } else if (RequestedMasternodeAttempt < 6) {
@@ -286,106 +468,45 @@ void CMasternodeSync::Process()
             RequestedMasternodeAttempt++;
             return;
         }
+        return;
+    }
 
-        //set to synced
-        if (RequestedMasternodeAssets == MASTERNODE_WARM_UP) {
-            GetNextAsset();
-            return;
-        }
-
-        if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto()) {
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST) {
-                if (lastMasternodeList > 0 && lastMasternodeList < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { //hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-                    return;
-                }
-
-                if (pnode->HasFulfilledRequest("mnsync")) {
-                    continue;
-                }
-
-                pnode->FulfilledRequest("mnsync");
-
-                // timeout
-                if (lastMasternodeList == 0 && (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    GetNextAsset();
-                    return;
-                }
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) {
-                    return;
-                }
-
-                mnodeman.DsegUpdate(pnode);
-                RequestedMasternodeAttempt++;
-                return;
-            }
-
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_MNW) {
-                if (lastMasternodeWinner > 0 && lastMasternodeWinner < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { //hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-                    return;
-                }
-
-                if (pnode->HasFulfilledRequest("mnwsync")) continue;
-                pnode->FulfilledRequest("mnwsync");
-
-                // timeout
-                if (lastMasternodeWinner == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    
-                    GetNextAsset();
-                    return;
-                }
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
-
-                CBlockIndex* pindexPrev = chainActive.Tip();
-                if (pindexPrev == NULL) return;
+    if (vNodes.empty()) return;
 
-                int nMnCount = mnodeman.CountEnabled();
-                pnode->PushMessage("mnget", nMnCount); //sync payees
-                RequestedMasternodeAttempt++;
+    //set to synced
+    if (RequestedMasternodeAssets == MASTERNODE_WARM_UP) {
+        GetNextAsset();
+        return;
+    }
 
-                return;
-            }
+    {
+        // forget the peers that are gone, the ones they held up are asked elsewhere
+        std::set<NodeId> setConnected;
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            setConnected.insert(pnode->GetId());
+        LOCK(cs_peers);
+        std::map<NodeId, CMasternodeSyncPeer>::iterator it = mapSyncPeers.begin();
+        while (it != mapSyncPeers.end()) {
+            if (!setConnected.count(it->first))
+                mapSyncPeers.erase(it++);
+            else
+                ++it;
         }
+    }
 
-        if (pnode->nVersion >= ActiveProtocol()) {
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_BUDGET) {
-                
-                // We'll start rejecting votes if we accidentally get set as synced too soon
-                if (lastBudgetItem > 0 && lastBudgetItem < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { 
-                    
-                    // Hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-
-                    // Try to activate our masternode if possible
-                    activeMasternode.ManageStatus();
-
-                    return;
-                }
-
-                // timeout
-                if (lastBudgetItem == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    // maybe there is no budgets at all, so just finish syncing
-                    GetNextAsset();
-                    activeMasternode.ManageStatus();
-                    return;
-                }
-
-                if (pnode->HasFulfilledRequest("busync")) continue;
-                pnode->FulfilledRequest("busync");
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
-
-                uint256 n = 0;
-                pnode->PushMessage("mnvs", n); //sync masternode votes
-                RequestedMasternodeAttempt++;
+    if (IsAssetDone(RequestedMasternodeAssets)) {
+        GetNextAsset();
+        // Try to activate our masternode if possible
+        if (RequestedMasternodeAssets == MASTERNODE_SYNC_FINISHED)
+            activeMasternode.ManageStatus();
+        return;
+    }
 
-                return;
-            }
-        }
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        if (pnode->fDisconnect) continue;
+        if (RequestAsset(pnode, RequestedMasternodeAssets))
+            RequestedMasternodeAttempt++;
+        else if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST)
+            RequestAsset(pnode, MASTERNODE_SYNC_MNW);
     }
 }
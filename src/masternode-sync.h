@@ -6,6 +6,15 @@
 #ifndef MASTERNODE_SYNC_H
 #define MASTERNODE_SYNC_H
 
+#include "net.h"
+#include "serialize.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <map>
+#include <stdint.h>
+#include <vector>
+
 #define MASTERNODE_SYNC_INITIAL 0
 #define MASTERNODE_WARM_UP 1
 #define MASTERNODE_SYNC_LIST 2
@@ -18,16 +27,94 @@
 
 #define MASTERNODE_SYNC_TIMEOUT 5
 #define MASTERNODE_SYNC_THRESHOLD 2
+// seconds without a new item after which the peers that answered are taken to have sent all
+#define MASTERNODE_SYNC_QUIET 2
+
+//! Buckets of a CSyncDigest
+static const unsigned int SYNC_DIGEST_BUCKETS = 128;
 
 class CMasternodeSync;
 extern CMasternodeSync masternodeSync;
 
+/**
+ * Compact summary of a set of inventory hashes, sent with "mnvsd" and
+ * "mngetd" in place of a full "mnvs"/"mnget" sync request.
+ *
+ * The hashes are spread over SYNC_DIGEST_BUCKETS buckets, each holding the
+ * XOR of 64 bits of the hashes in it. The peer builds the same digest of
+ * what it would sync and only announces the items of the buckets that
+ * differ, so a node that already has most of the state gets an inv for a
+ * few buckets' worth of items instead of every item.
+ */
+class CSyncDigest
+{
+public:
+    std::vector<uint64_t> vBuckets;
+
+    CSyncDigest() : vBuckets(SYNC_DIGEST_BUCKETS, 0) {}
+
+    static unsigned int GetBucket(const uint256& hash) { return hash.Get64(1) % SYNC_DIGEST_BUCKETS; }
+
+    void Add(const uint256& hash) { vBuckets[GetBucket(hash)] ^= hash.Get64(0); }
+
+    bool IsValid() const { return vBuckets.size() == SYNC_DIGEST_BUCKETS; }
+
+    /** Whether the bucket of hash holds the same items in both digests */
+    bool BucketMatches(const CSyncDigest& other, const uint256& hash) const
+    {
+        unsigned int nBucket = GetBucket(hash);
+        return vBuckets[nBucket] == other.vBuckets[nBucket];
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(vBuckets);
+    }
+};
+
+/** What one peer was asked for during the masternode sync, and what it answered */
+struct CMasternodeSyncPeer {
+    //! when each asset was asked for, 0 if it was not
+    int64_t nListAsked;
+    int64_t nWinnersAsked;
+    int64_t nBudgetAsked;
+    bool fListAnswered;
+    bool fWinnersAnswered;
+    bool fBudgetAnswered;
+    //! the winners were asked for with the masternode list synced, none were dropped for an unknown masternode
+    bool fWinnersAfterList;
+
+    CMasternodeSyncPeer() : nListAsked(0), nWinnersAsked(0), nBudgetAsked(0), fListAnswered(false), fWinnersAnswered(false), fBudgetAnswered(false), fWinnersAfterList(false) {}
+};
+
 //
 // CMasternodeSync : Sync masternode assets in stages
 //
+// The stages finish in order, but the winners are asked for while the list
+// is being synced, from other peers. A stage is done once enough peers have
+// answered and nothing new has come in for MASTERNODE_SYNC_QUIET seconds; a
+// peer that does not answer in time is replaced by another one, so a slow
+// peer does not hold the stage up. The timeouts are only for peers that send
+// nothing at all.
+//
 
 class CMasternodeSync
 {
+private:
+    // guards mapSyncPeers
+    CCriticalSection cs_peers;
+    std::map<NodeId, CMasternodeSyncPeer> mapSyncPeers;
+
+    /// Peers that answered for the asset, and peers asked that may still answer
+    void CountPeers(int nAsset, int& nAnswered, int& nPending);
+    /// Whether the stage has all it is going to get
+    bool IsAssetDone(int nAsset);
+    /// Ask pnode for the asset if it has not been asked and more answers are needed
+    bool RequestAsset(CNode* pnode, int nAsset);
+
 public:
     std::map<uint256, int> mapSeenSyncMNB;
     std::map<uint256, int> mapSeenSyncMNW;
@@ -5,10 +5,12 @@
 
 #include "masternode.h"
 #include "addrman.h"
+#include "crypto/sha256.h"
 #include "masternodeman.h"
 #include "masternode-payments.h"
 #include "masternode-helpers.h"
 #include "sync.h"
+#include "ui_interface.h"
 #include "util.h"
 #include "init.h"
 #include "wallet.h"
@@ -17,48 +19,26 @@
 
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasternodeScanningErrors;
-// cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
-
-//Get the last hash that matches the modulus given. Processed in reverse order
+//Get the hash of the block before nBlockHeight on the active chain (the tip's parent if nBlockHeight is 0)
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-    if (chainActive.Tip() == NULL) return false;
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == NULL) return false;
 
     if (nBlockHeight == 0)
-        nBlockHeight = chainActive.Tip()->nHeight;
-
-    if (mapCacheBlockHashes.count(nBlockHeight)) {
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
-
-    const CBlockIndex* BlockLastSolved = chainActive.Tip();
-    const CBlockIndex* BlockReading = chainActive.Tip();
-
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || chainActive.Tip()->nHeight + 1 < nBlockHeight) return false;
+        nBlockHeight = pindexTip->nHeight;
 
-    int nBlocksAgo = 0;
-    if (nBlockHeight > 0) nBlocksAgo = (chainActive.Tip()->nHeight + 1) - nBlockHeight;
-    assert(nBlocksAgo >= 0);
+    if (pindexTip->nHeight == 0 || pindexTip->nHeight + 1 < nBlockHeight) return false;
 
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nBlocksAgo) {
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
+    // negative heights have always meant the tip itself; the genesis block is never used
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexTip->nHeight;
+    if (nHeight <= 0) return false;
 
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
+    const CBlockIndex* pindex = pindexTip->GetAncestor(nHeight);
+    if (pindex == NULL) return false;
 
-    return false;
+    hash = pindex->GetBlockHash();
+    return true;
 }
 
 CMasternode::CMasternode()
@@ -152,7 +132,7 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
         int nDoS = 0;
         if (mnb.lastPing == CMasternodePing() || (mnb.lastPing != CMasternodePing() && mnb.lastPing.CheckAndUpdate(nDoS, false))) {
             lastPing = mnb.lastPing;
-            mnodeman.mapSeenMasternodePing.insert(make_pair(lastPing.GetHash(), lastPing));
+            mnodeman.AddSeenPing(lastPing);
         }
         return true;
     }
@@ -169,21 +149,29 @@ uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
     if (chainActive.Tip() == NULL) return 0;
 
     uint256 hash = 0;
-    uint256 aux = vin.prevout.hash + vin.prevout.n;
 
     if (!GetBlockHash(hash, nBlockHeight)) {
         LogPrint("masternode","CalculateScore ERROR - nHeight %d - Returned 0\n", nBlockHeight);
         return 0;
     }
 
+    return CalculateScore(hash);
+}
+
+uint256 CMasternode::CalculateScore(const uint256& hash) const
+{
+    uint256 aux = vin.prevout.hash + vin.prevout.n;
+
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     ss << hash;
     uint256 hash2 = ss.GetHash();
 
-    CHashWriter ss2(SER_GETHASH, PROTOCOL_VERSION);
-    ss2 << hash;
-    ss2 << aux;
-    uint256 hash3 = ss2.GetHash();
+    // Double SHA256 of hash || aux, as one 64-byte input
+    unsigned char vchInput[64];
+    memcpy(vchInput, hash.begin(), 32);
+    memcpy(vchInput + 32, aux.begin(), 32);
+    uint256 hash3;
+    SHA256D64(hash3.begin(), vchInput, 1);
 
     uint256 r = (hash3 > hash2 ? hash3 - hash2 : hash2 - hash3);
 
@@ -213,17 +201,31 @@ void CMasternode::Check(bool forceCheck)
     }
 
     if (!unitTest) {
-        CValidationState state;
-        CMutableTransaction tx = CMutableTransaction();
-        CTxOut vout = CTxOut((5000-0.01) * COIN, masternodeSigner.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
+        // A listed Masternode has its collateral looked up once, spends after that are
+        // seen by mnodeman as they happen
+        CollateralState collateral = mnodeman.GetCollateralState(vin.prevout);
+        if (collateral == COLLATERAL_SPENT) {
+            activeState = MASTERNODE_VIN_SPENT;
+            return;
+        }
+
+        if (collateral != COLLATERAL_UNSPENT) {
+            CValidationState state;
+            CMutableTransaction tx = CMutableTransaction();
+            CTxOut vout = CTxOut((5000-0.01) * COIN, masternodeSigner.collateralPubKey);
+            tx.vin.push_back(vin);
+            tx.vout.push_back(vout);
 
-        {
             TRY_LOCK(cs_main, lockMain);
-            if (!lockMain) return;
+            if (!lockMain) {
+                // look again on the next call, not MASTERNODE_CHECK_SECONDS later
+                lastTimeChecked = 0;
+                return;
+            }
 
-            if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
+            bool fSpent = !AcceptableInputs(mempool, state, CTransaction(tx), false, NULL);
+            mnodeman.SetCollateralChecked(vin.prevout, fSpent);
+            if (fSpent) {
                 activeState = MASTERNODE_VIN_SPENT;
                 return;
             }
@@ -235,10 +237,12 @@ void CMasternode::Check(bool forceCheck)
 
 int64_t CMasternode::SecondsSincePayment()
 {
-    CScript pubkeyScript;
-    pubkeyScript = GetScriptForDestination(pubKeyCollateralAddress.GetID());
+    return SecondsSincePayment(mnodeman.CountEnabled() * 1.25);
+}
 
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+int64_t CMasternode::SecondsSincePayment(int nLastPaidWindow)
+{
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nLastPaidWindow));
     int64_t month = 60 * 60 * 24 * 30;
     if (sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -253,11 +257,23 @@ int64_t CMasternode::SecondsSincePayment()
 
 int64_t CMasternode::GetLastPaid()
 {
-    CBlockIndex* pindexPrev = chainActive.Tip();
-    if (pindexPrev == NULL) return false;
+    return GetLastPaid(mnodeman.CountEnabled() * 1.25);
+}
 
-    CScript mnpayee;
-    mnpayee = GetScriptForDestination(pubKeyCollateralAddress.GetID());
+int64_t CMasternode::GetLastPaid(int nLastPaidWindow)
+{
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == NULL) return false;
+
+    /*
+        The last block of the window with this payee at two votes or more. This will aid in consensus
+        allowing the network to converge on the same payees quickly, then keep the same schedule.
+    */
+    CScript mnpayee = GetScriptForDestination(pubKeyCollateralAddress.GetID());
+    int nPaidHeight = masternodePayments.GetLastPaidHeight(mnpayee, pindexTip->nHeight, nLastPaidWindow);
+    if (nPaidHeight == 0) return 0;
+    const CBlockIndex* pindexPaid = pindexTip->GetAncestor(nPaidHeight);
+    if (pindexPaid == NULL) return 0;
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     ss << vin;
@@ -267,36 +283,7 @@ int64_t CMasternode::GetLastPaid()
     // use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150;
 
-    if (chainActive.Tip() == NULL) return false;
-
-    const CBlockIndex* BlockReading = chainActive.Tip();
-
-    int nMnCount = mnodeman.CountEnabled() * 1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nMnCount) {
-            return 0;
-        }
-        n++;
-
-        if (masternodePayments.mapMasternodeBlocks.count(BlockReading->nHeight)) {
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network 
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if (masternodePayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2)) {
-                return BlockReading->nTime + nOffset;
-            }
-        }
-
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
-
-    return 0;
+    return pindexPaid->nTime + nOffset;
 }
 
 std::string CMasternode::GetStatus()
@@ -389,7 +376,7 @@ CMasternodeBroadcast::CMasternodeBroadcast(const CMasternode& mn)
     nLastScanningErrorBlockHeight = mn.nLastScanningErrorBlockHeight;
 }
 
-bool CMasternodeBroadcast::Create(std::string strService, std::string strKeyMasternode, std::string strTxHash, std::string strOutputIndex, std::string& strErrorRet, CMasternodeBroadcast& mnbRet, bool fOffline)
+bool CMasternodeBroadcast::Create(std::string strService, std::string strKeyMasternode, std::string strTxHash, std::string strOutputIndex, std::string& strErrorRet, CMasternodeBroadcast& mnbRet, bool fOffline, const MasternodeCollateralMap* pmapCollaterals)
 {
     CTxIn txin;
     CPubKey pubKeyCollateralAddressNew;
@@ -410,7 +397,9 @@ bool CMasternodeBroadcast::Create(std::string strService, std::string strKeyMast
         return false;
     }
 
-    if (!pwalletMain->GetMasternodeVinAndKeys(txin, pubKeyCollateralAddressNew, keyCollateralAddressNew, strTxHash, strOutputIndex)) {
+    bool fCollateral = pmapCollaterals ? pwalletMain->GetMasternodeVinAndKeys(txin, pubKeyCollateralAddressNew, keyCollateralAddressNew, *pmapCollaterals, strTxHash, strOutputIndex) :
+                                         pwalletMain->GetMasternodeVinAndKeys(txin, pubKeyCollateralAddressNew, keyCollateralAddressNew, strTxHash, strOutputIndex);
+    if (!fCollateral) {
         strErrorRet = strprintf("Could not allocate txin %s:%s for masternode %s", strTxHash, strOutputIndex, strService);
         LogPrint("masternode","CMasternodeBroadcast::Create -- %s\n", strErrorRet);
         return false;
@@ -560,9 +549,10 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
     if (pmn->pubKeyCollateralAddress == pubKeyCollateralAddress && !pmn->IsBroadcastedWithin(MASTERNODE_MIN_MNB_SECONDS)) {
         //take the newest entry
         LogPrint("masternode","mnb - Got updated entry for %s\n", vin.prevout.hash.ToString());
-        if (pmn->UpdateFromNewBroadcast((*this))) {
+        if (mnodeman.UpdateFromNewBroadcast(pmn, *this)) {
             pmn->Check();
             if (pmn->IsEnabled()) Relay();
+            NotifyMasternodeMessage("rawmnb", *this);
         }
         masternodeSync.AddedMasternodeList(GetHash());
     }
@@ -598,7 +588,7 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
         TRY_LOCK(cs_main, lockMain);
         if (!lockMain) {
             // not mnb fault, let it to be checked again later
-            mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
+            mnodeman.mapSeenMasternodeBroadcast.Erase(GetHash());
             masternodeSync.mapSeenSyncMNB.erase(GetHash());
             return false;
         }
@@ -612,24 +602,22 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
 
     LogPrint("masternode", "mnb - Accepted Masternode entry\n");
 
-    if (GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS) {
+    int nInputAge = GetInputAge(vin);
+    if (nInputAge < MASTERNODE_MIN_CONFIRMATIONS) {
         LogPrint("masternode","mnb - Input must have at least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
         // maybe we miss few blocks, let this mnb to be checked again later
-        mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
+        mnodeman.mapSeenMasternodeBroadcast.Erase(GetHash());
         masternodeSync.mapSeenSyncMNB.erase(GetHash());
         return false;
     }
 
     // verify that sig time is legit in past
     // should be at least not earlier than block when 1000 DTEM tx got MASTERNODE_MIN_CONFIRMATIONS
-    uint256 hashBlock = 0;
-    CTransaction tx2;
-    GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi != mapBlockIndex.end() && (*mi).second) {
-        CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 1000 DYSTEM tx -> 1 confirmation
-        CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-        if (pConfIndex->GetBlockTime() > sigTime) {
+    // the height of the collateral comes from the coins, so neither -txindex nor the block data is needed
+    {
+        int nMNHeight = chainActive.Height() + 1 - nInputAge;                               // block for 1000 DYSTEM tx -> 1 confirmation
+        CBlockIndex* pConfIndex = chainActive[nMNHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+        if (pConfIndex && pConfIndex->GetBlockTime() > sigTime) {
             LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
                 sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
             return false;
@@ -638,7 +626,8 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
 
     LogPrint("masternode","mnb - Got NEW Masternode entry - %s - %lli \n", vin.prevout.hash.ToString(), sigTime);
     CMasternode mn(*this);
-    mnodeman.Add(mn);
+    if (mnodeman.Add(mn))
+        NotifyMasternodeMessage("rawmnb", *this);
 
     // if it matches our Masternode privkey, then we've been remotely activated
     if (pubKeyMasternode == activeMasternode.pubKeyMasternode && protocolVersion == PROTOCOL_VERSION) {
@@ -777,11 +766,15 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled)
             //mnodeman.mapSeenMasternodeBroadcast.lastPing is probably outdated, so we'll update it
             CMasternodeBroadcast mnb(*pmn);
             uint256 hash = mnb.GetHash();
-            if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
-                mnodeman.mapSeenMasternodeBroadcast[hash].lastPing = *this;
+            CMasternodeBroadcast* pmnbSeen = mnodeman.mapSeenMasternodeBroadcast.Get(hash);
+            if (pmnbSeen) {
+                pmnbSeen->lastPing = *this;
+                mnodeman.mapSeenMasternodeBroadcast.Refresh(hash, *pmnbSeen);
+                relayCache.Erase(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
             }
 
             pmn->Check(true);
+            uiInterface.NotifyMasternodeChanged(vin.prevout, CT_UPDATED);
             if (!pmn->IsEnabled()) return false;
 
             LogPrint("masternode", "CMasternodePing::CheckAndUpdate - Masternode ping accepted, vin: %s\n", vin.prevout.hash.ToString());
@@ -798,8 +791,28 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled)
     return false;
 }
 
+uint64_t GetMasternodeShortID(const COutPoint& collateral)
+{
+    return SerializeHash(collateral).GetLow64();
+}
+
 void CMasternodePing::Relay()
 {
     CInv inv(MSG_MASTERNODE_PING, GetHash());
-    RelayInv(inv);
+    // peers might not tell a short id shared by two masternodes apart
+    if (!mnodeman.HasUniqueShortID(vin)) {
+        RelayInv(inv);
+        return;
+    }
+
+    CMasternodePingAnnounce announce(GetMasternodeShortID(vin.prevout), sigTime);
+    LOCK(cs_vNodes);
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        if (pnode->nServices == NODE_BLOOM_WITHOUT_MN || pnode->nVersion < ActiveProtocol())
+            continue;
+        if (pnode->nVersion >= COMPACT_MNP_VERSION)
+            pnode->PushPingAnnounce(inv.hash, announce);
+        else
+            pnode->PushInventory(inv);
+    }
 }
@@ -11,8 +11,11 @@
 #include "main.h"
 #include "net.h"
 #include "sync.h"
+#include "streams.h"
 #include "timedata.h"
 #include "util.h"
+#include "validationinterface.h"
+#include "version.h"
 
 #define MASTERNODE_MIN_CONFIRMATIONS 15
 #define MASTERNODE_MIN_MNP_SECONDS (10 * 60)
@@ -21,16 +24,32 @@
 #define MASTERNODE_EXPIRATION_SECONDS (120 * 60)
 #define MASTERNODE_REMOVAL_SECONDS (130 * 60)
 #define MASTERNODE_CHECK_SECONDS 5
+#define MASTERNODE_DUMP_SECONDS (15 * 60)
 
 using namespace std;
 
 class CMasternode;
 class CMasternodeBroadcast;
 class CMasternodePing;
-extern map<int64_t, uint256> mapCacheBlockHashes;
+class COutput;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
+/** The id a masternode is known by in compact pings, the low bits of the hash of its collateral */
+uint64_t GetMasternodeShortID(const COutPoint& collateral);
+
+/** Hand obj, serialized as it is relayed, to the listeners of strTopic (rawmnb, rawmnw, ...) */
+template <typename T>
+void NotifyMasternodeMessage(const std::string& strTopic, const T& obj)
+{
+    // Nothing to serialize for when ZMQ is off
+    if (GetMainSignals().NotifyMasternodeMessage.empty())
+        return;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    GetMainSignals().NotifyMasternodeMessage(strTopic, &ss[0], ss.size());
+}
+
 
 //
 // The Masternode Ping Class : Contains a different serialize method for sending pings from masternodes throughout the network
@@ -63,7 +82,7 @@ public:
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     void Relay();
 
-    uint256 GetHash()
+    uint256 GetHash() const
     {
         CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
         ss << vin;
@@ -99,6 +118,35 @@ public:
     }
 };
 
+/**
+ * A masternode ping as "mnpc" sends it: the masternode stands as its short id and
+ * the block as its height, the peer making the vin and the block hash again from
+ * its list and its chain to check the signature.
+ */
+class CCompactMasternodePing
+{
+public:
+    uint64_t nShortID;
+    int nBlockHeight;
+    int64_t sigTime;
+    std::vector<unsigned char> vchSig;
+
+    CCompactMasternodePing() : nShortID(0), nBlockHeight(0), sigTime(0) {}
+    CCompactMasternodePing(uint64_t nShortIDIn, int nBlockHeightIn, const CMasternodePing& mnp)
+        : nShortID(nShortIDIn), nBlockHeight(nBlockHeightIn), sigTime(mnp.sigTime), vchSig(mnp.vchSig) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nShortID);
+        READWRITE(VARINT(nBlockHeight));
+        READWRITE(VARINT(sigTime));
+        READWRITE(vchSig);
+    }
+};
+
 //
 // The Masternode Class. For managing the Obfuscation process. It contains the input of the 5000 DTEM, signature to prove
 // it's the one who own that ip address and code for calculating the payment election.
@@ -191,6 +239,8 @@ public:
     }
 
     uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    /// Score against a known block hash, see CalculateScore
+    uint256 CalculateScore(const uint256& hashBlock) const;
 
     ADD_SERIALIZE_METHODS;
 
@@ -218,6 +268,8 @@ public:
     }
 
     int64_t SecondsSincePayment();
+    //! With the window GetLastPaid looks at, for callers that go through the whole list
+    int64_t SecondsSincePayment(int nLastPaidWindow);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -281,6 +333,8 @@ public:
     }
 
     int64_t GetLastPaid();
+    //! Time of the last payment in the last nLastPaidWindow blocks, 0 if none
+    int64_t GetLastPaid(int nLastPaidWindow);
     bool IsValidNetAddr();
 };
 
@@ -327,7 +381,8 @@ public:
 
     /// Create Masternode broadcast, needs to be relayed manually after that
     static bool Create(CTxIn vin, CService service, CKey keyCollateralAddressNew, CPubKey pubKeyCollateralAddressNew, CKey keyMasternodeNew, CPubKey pubKeyMasternodeNew, std::string& strErrorRet, CMasternodeBroadcast& mnbRet);
-    static bool Create(std::string strService, std::string strKey, std::string strTxHash, std::string strOutputIndex, std::string& strErrorRet, CMasternodeBroadcast& mnbRet, bool fOffline = false);
+    //! The collateral is looked up in *pmapCollaterals when given, see CWallet::GetMasternodeCollaterals
+    static bool Create(std::string strService, std::string strKey, std::string strTxHash, std::string strOutputIndex, std::string& strErrorRet, CMasternodeBroadcast& mnbRet, bool fOffline = false, const std::map<COutPoint, COutput>* pmapCollaterals = NULL);
     static bool CheckDefaultPort(std::string strService, std::string& strErrorRet, std::string strContext);
 };
 
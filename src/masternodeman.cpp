@@ -9,6 +9,9 @@
 #include "masternode-helpers.h"
 #include "addrman.h"
 #include "masternode.h"
+#include "core_memusage.h"
+#include "memusage.h"
+#include "ui_interface.h"
 #include "util.h"
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
@@ -26,192 +29,221 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
+// Highest score first; equal scores keep their order in the list
+struct CompareScoreIndex {
+    bool operator()(const pair<int64_t, size_t>& t1,
+        const pair<int64_t, size_t>& t2) const
     {
-        return t1.first < t2.first;
+        if (t1.first != t2.first)
+            return t1.first > t2.first;
+        return t1.second < t2.second;
     }
 };
 
-struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
+// Lowest rank first, the unranked ones after them in list order
+struct CompareListRank {
+    bool operator()(const pair<int, size_t>& t1,
+        const pair<int, size_t>& t2) const
     {
-        return t1.first < t2.first;
+        if ((t1.first == 0) != (t2.first == 0))
+            return t1.first != 0;
+        if (t1.first != t2.first)
+            return t1.first < t2.first;
+        return t1.second < t2.second;
     }
 };
 
-//
-// CMasternodeDB
-//
-
-CMasternodeDB::CMasternodeDB()
-{
-    pathMN = GetDataDir() / "mncache.dat";
-    strMagicMessage = "MasternodeCache";
-}
-
-bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
+void DumpMasternodes()
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
+    CMasternodeDB db;
 
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    LogPrint("masternode","Verifying mncache.dat format...\n");
+    CMasternodeDB::ReadResult readResult = db.Verify();
+    // there was an error and it was not an error on file opening => do not proceed
+    if (readResult == CMasternodeDB::FileError)
+        LogPrint("masternode","Missing masternode cache file - mncache.dat, will try to recreate\n");
+    else if (readResult != CMasternodeDB::Ok) {
+        LogPrint("masternode","Error reading mncache.dat: file format is unknown or invalid, please fix it manually\n");
+        return;
     }
-    //    FileCommit(fileout);
-    fileout.fclose();
-
-    LogPrint("masternode","Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", mnodemanToSave.ToString());
+    LogPrint("masternode","Writting info to mncache.dat...\n");
+    db.Write(mnodeman);
 
-    return true;
+    LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
-CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
+CMasternodeMan::CMasternodeMan() : filterSupersededPings(MNP_SUPERSEDED_MAX, 0.000001),
+                                   pcountSnapshot(new CMasternodeCountSnapshot()),
+                                   mapSeenMasternodeBroadcast(MNB_SEEN_MAX),
+                                   mapSeenMasternodePing(MNP_SEEN_MAX)
 {
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathMN.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
+    nListVersion = 0;
+    nChangeSeq = 0;
+    hashListSalt = 0;
+}
 
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
+bool CMasternodeMan::Add(CMasternode& mn)
+{
+    LOCK(cs);
 
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
+    if (!mn.IsEnabled())
+        return false;
 
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
+    CMasternode* pmn = Find(mn.vin);
+    if (pmn == NULL) {
+        LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
+        listMasternodes.push_back(mn);
+        IndexMasternode(&listMasternodes.back());
+        WatchCollateral(mn.vin.prevout);
+        MarkChanged(mn.vin.prevout);
+        nListVersion++;
+        uiInterface.NotifyMasternodeChanged(mn.vin.prevout, CT_NEW);
+        return true;
     }
 
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
+    return false;
+}
 
-        ssMasternodes >> strMagicMessageTmp;
+void CMasternodeMan::IndexMasternode(CMasternode* pmn)
+{
+    AssertLockHeld(cs);
+    mapMasternodesByVin.insert(std::make_pair(pmn->vin.prevout, pmn));
+    mapMasternodesByPayee.insert(std::make_pair(GetScriptForDestination(pmn->pubKeyCollateralAddress.GetID()), pmn));
+    mapMasternodesByPubKey.insert(std::make_pair(pmn->pubKeyMasternode, pmn));
+    mapMasternodesByShortID.insert(std::make_pair(GetMasternodeShortID(pmn->vin.prevout), pmn));
+}
 
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
+template <typename Map, typename Key>
+static void EraseIndexEntry(Map& map, const Key& key, CMasternode* pmn)
+{
+    std::pair<typename Map::iterator, typename Map::iterator> range = map.equal_range(key);
+    for (typename Map::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == pmn) {
+            map.erase(it);
+            return;
         }
+    }
+}
 
-        // de-serialize file header (network specific magic number) and ..
-        ssMasternodes >> FLATDATA(pchMsgTmp);
+void CMasternodeMan::UnindexMasternode(CMasternode* pmn)
+{
+    AssertLockHeld(cs);
+    EraseIndexEntry(mapMasternodesByVin, pmn->vin.prevout, pmn);
+    EraseIndexEntry(mapMasternodesByPayee, GetScriptForDestination(pmn->pubKeyCollateralAddress.GetID()), pmn);
+    EraseIndexEntry(mapMasternodesByPubKey, pmn->pubKeyMasternode, pmn);
+    EraseIndexEntry(mapMasternodesByShortID, GetMasternodeShortID(pmn->vin.prevout), pmn);
+}
 
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
-    } catch (std::exception& e) {
-        mnodemanToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
+void CMasternodeMan::RebuildIndexes()
+{
+    AssertLockHeld(cs);
+    mapMasternodesByVin.clear();
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+    mapMasternodesByShortID.clear();
+    {
+        LOCK(cs_collaterals);
+        mapCollaterals.clear();
     }
-
-    LogPrint("masternode","Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
-    if (!fDryRun) {
-        LogPrint("masternode","Masternode manager - cleaning....\n");
-        mnodemanToLoad.CheckAndRemove(true);
-        LogPrint("masternode","Masternode manager - result:\n");
-        LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
+    mapChangeSeq.clear();
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        IndexMasternode(&mn);
+        WatchCollateral(mn.vin.prevout);
+        MarkChanged(mn.vin.prevout);
     }
-
-    return Ok;
 }
 
-void DumpMasternodes()
+void CMasternodeMan::MarkChanged(const COutPoint& outpoint)
 {
-    int64_t nStart = GetTimeMillis();
+    AssertLockHeld(cs);
+    mapChangeSeq[outpoint] = ++nChangeSeq;
+}
 
-    CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
+uint256 CMasternodeMan::GetListSnapshot()
+{
+    AssertLockHeld(cs);
+    if (hashListSalt == 0)
+        hashListSalt = GetRandHash();
+
+    // salted, so a peer cannot make up the hash of a list it never got
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashListSalt << nChangeSeq;
+    uint256 hash = ss.GetHash();
+    if (mapListSnapshots.insert(std::make_pair(hash, nChangeSeq)).second) {
+        dequeListSnapshots.push_back(hash);
+        while (dequeListSnapshots.size() > MNLIST_SNAPSHOTS) {
+            mapListSnapshots.erase(dequeListSnapshots.front());
+            dequeListSnapshots.pop_front();
+        }
+    }
+    return hash;
+}
 
-    LogPrint("masternode","Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodeDB::FileError)
-        LogPrint("masternode","Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrint("masternode","Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrint("masternode","magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrint("masternode","file format is unknown or invalid, please fix it manually\n");
-            return;
+void CMasternodeMan::SetPeerListHash(const CNetAddr& addr, const uint256& hashList)
+{
+    LOCK(cs);
+    mapPeerListHashes[addr] = std::make_pair(hashList, GetTime());
+    while (mapPeerListHashes.size() > MNLIST_PEER_HASHES) {
+        std::map<CNetAddr, std::pair<uint256, int64_t> >::iterator itOldest = mapPeerListHashes.begin();
+        for (std::map<CNetAddr, std::pair<uint256, int64_t> >::iterator it = mapPeerListHashes.begin(); it != mapPeerListHashes.end(); ++it) {
+            if (it->second.second < itOldest->second.second)
+                itOldest = it;
         }
+        mapPeerListHashes.erase(itOldest);
     }
-    LogPrint("masternode","Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
+}
 
-    LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
+void CMasternodeMan::WatchCollateral(const COutPoint& outpoint)
+{
+    LOCK(cs_collaterals);
+    mapCollaterals.insert(std::make_pair(outpoint, COLLATERAL_UNCHECKED));
 }
 
-CMasternodeMan::CMasternodeMan()
+void CMasternodeMan::UnwatchCollateral(const COutPoint& outpoint)
 {
+    LOCK(cs_collaterals);
+    mapCollaterals.erase(outpoint);
 }
 
-bool CMasternodeMan::Add(CMasternode& mn)
+CollateralState CMasternodeMan::GetCollateralState(const COutPoint& outpoint) const
 {
-    LOCK(cs);
+    LOCK(cs_collaterals);
+    CollateralMap::const_iterator it = mapCollaterals.find(outpoint);
+    return it == mapCollaterals.end() ? COLLATERAL_UNKNOWN : it->second;
+}
 
-    if (!mn.IsEnabled())
-        return false;
+void CMasternodeMan::SetCollateralChecked(const COutPoint& outpoint, bool fSpent)
+{
+    LOCK(cs_collaterals);
+    CollateralMap::iterator it = mapCollaterals.find(outpoint);
+    if (it != mapCollaterals.end() && it->second == COLLATERAL_UNCHECKED)
+        it->second = fSpent ? COLLATERAL_SPENT : COLLATERAL_UNSPENT;
+}
 
-    CMasternode* pmn = Find(mn.vin);
-    if (pmn == NULL) {
-        LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
-        return true;
-    }
+void CMasternodeMan::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    SyncTransactions(std::vector<CTransaction>(1, tx), pblock);
+}
 
-    return false;
+// A spend in the mempool counts as much as one in a block, as AcceptableInputs had it
+void CMasternodeMan::SyncTransactions(const std::vector<CTransaction>& vtx, const CBlock* pblock)
+{
+    LOCK(cs_collaterals);
+    if (mapCollaterals.empty())
+        return;
+    BOOST_FOREACH (const CTransaction& tx, vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            CollateralMap::iterator it = mapCollaterals.find(txin.prevout);
+            if (it != mapCollaterals.end() && it->second != COLLATERAL_SPENT) {
+                LogPrint("masternode", "CMasternodeMan: Collateral %s spent by %s\n", txin.prevout.ToStringShort(), tx.GetHash().ToString());
+                it->second = COLLATERAL_SPENT;
+            }
+        }
+    }
 }
 
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn& vin)
@@ -234,8 +266,11 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        int nState = mn.activeState;
         mn.Check();
+        if (mn.activeState != nState)
+            uiInterface.NotifyMasternodeChanged(mn.vin.prevout, CT_UPDATED);
     }
 }
 
@@ -246,8 +281,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
@@ -257,14 +292,14 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             //erase all of the broadcasts we've seen from this vin
             // -- if we missed a few pings and the node was removed, this will allow is to get it back without them
             //    sending a brand new mnb
-            map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-            while (it3 != mapSeenMasternodeBroadcast.end()) {
-                if ((*it3).second.vin == (*it).vin) {
-                    masternodeSync.mapSeenSyncMNB.erase((*it3).first);
-                    mapSeenMasternodeBroadcast.erase(it3++);
-                } else {
-                    ++it3;
-                }
+            std::vector<uint256> vSeenErase;
+            for (SeenMasternodeBroadcastCache::const_iterator it3 = mapSeenMasternodeBroadcast.begin(); it3 != mapSeenMasternodeBroadcast.end(); ++it3) {
+                if (it3->second.value.vin == (*it).vin)
+                    vSeenErase.push_back(it3->first);
+            }
+            BOOST_FOREACH (const uint256& hash, vSeenErase) {
+                masternodeSync.mapSeenSyncMNB.erase(hash);
+                mapSeenMasternodeBroadcast.Erase(hash);
             }
 
             // allow us to ask for this masternode again if we see another ping
@@ -277,7 +312,12 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
-            it = vMasternodes.erase(it);
+            UnindexMasternode(&*it);
+            UnwatchCollateral((*it).vin.prevout);
+            mapChangeSeq.erase((*it).vin.prevout);
+            uiInterface.NotifyMasternodeChanged((*it).vin.prevout, CT_DELETED);
+            it = listMasternodes.erase(it);
+            nListVersion++;
         } else {
             ++it;
         }
@@ -313,37 +353,54 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
         }
     }
 
-    // remove expired mapSeenMasternodeBroadcast
-    map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-    while (it3 != mapSeenMasternodeBroadcast.end()) {
-        if ((*it3).second.lastPing.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
-            mapSeenMasternodeBroadcast.erase(it3++);
-            masternodeSync.mapSeenSyncMNB.erase((*it3).second.GetHash());
-        } else {
-            ++it3;
-        }
-    }
-
-    // remove expired mapSeenMasternodePing
-    map<uint256, CMasternodePing>::iterator it4 = mapSeenMasternodePing.begin();
-    while (it4 != mapSeenMasternodePing.end()) {
-        if ((*it4).second.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
-            mapSeenMasternodePing.erase(it4++);
-        } else {
+    // remove expired mapSeenMasternodeBroadcast and mapSeenMasternodePing, oldest first
+    std::vector<std::pair<int64_t, uint256> > vExpired;
+    mapSeenMasternodeBroadcast.ExpireBefore(GetTime(), &vExpired);
+    for (std::vector<std::pair<int64_t, uint256> >::const_iterator it3 = vExpired.begin(); it3 != vExpired.end(); ++it3)
+        masternodeSync.mapSeenSyncMNB.erase(it3->second);
+    mapSeenMasternodePing.ExpireBefore(GetTime());
+    boost::unordered_map<COutPoint, std::pair<int64_t, uint256>, CMasternodeOutPointHasher>::iterator it4 = mapLastSeenPing.begin();
+    while (it4 != mapLastSeenPing.end()) {
+        if (!mapSeenMasternodePing.count(it4->second.second))
+            it4 = mapLastSeenPing.erase(it4);
+        else
             ++it4;
-        }
+    }
+    std::map<uint64_t, std::pair<NodeId, int64_t> >::iterator it5 = mapCompactPingsAsked.begin();
+    while (it5 != mapCompactPingsAsked.end()) {
+        if (it5->second.second < GetTime() - MNP_COMPACT_REQUEST_SECONDS)
+            mapCompactPingsAsked.erase(it5++);
+        else
+            ++it5;
     }
 }
 
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    BOOST_FOREACH (const CMasternode& mn, listMasternodes)
+        uiInterface.NotifyMasternodeChanged(mn.vin.prevout, CT_DELETED);
+    listMasternodes.clear();
+    mapMasternodesByVin.clear();
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+    mapMasternodesByShortID.clear();
+    {
+        LOCK(cs_collaterals);
+        mapCollaterals.clear();
+    }
+    mapChangeSeq.clear();
+    // the list the peers' hashes stood for is gone
+    mapPeerListHashes.clear();
+    nListVersion++;
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
+    mapLastSeenPing.clear();
+    filterSupersededPings.reset();
+    mapCompactPingsAsked.clear();
 }
 
 int CMasternodeMan::stable_size ()
@@ -354,7 +411,7 @@ int CMasternodeMan::stable_size ()
 
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -369,12 +426,85 @@ int CMasternodeMan::stable_size ()
     return nStable_size;
 }
 
+void CMasternodeMan::UpdateCountSnapshot(int nHeight)
+{
+    boost::shared_ptr<CMasternodeCountSnapshot> psnapshot(new CMasternodeCountSnapshot());
+    psnapshot->nHeight = nHeight;
+    if (nHeight >= 0)
+        GetNextMasternodeInQueueForPayment(nHeight, true, psnapshot->nInQueue);
+    CountNetworks(ActiveProtocol(), psnapshot->nIPv4, psnapshot->nIPv6, psnapshot->nOnion);
+    psnapshot->nTotal = size();
+    psnapshot->nStable = stable_size();
+    psnapshot->nEnabled = CountEnabled();
+
+    boost::atomic_store(&pcountSnapshot, boost::shared_ptr<const CMasternodeCountSnapshot>(psnapshot));
+}
+
+CMasternodeCountSnapshot CMasternodeMan::GetCountSnapshot() const
+{
+    return *boost::atomic_load(&pcountSnapshot);
+}
+
+static size_t PingDynamicUsage(const CMasternodePing& mnp)
+{
+    return RecursiveDynamicUsage(mnp.vin) + memusage::DynamicUsage(mnp.vchSig);
+}
+
+static size_t MasternodeDynamicUsage(const CMasternode& mn)
+{
+    return RecursiveDynamicUsage(mn.vin) + memusage::DynamicUsage(mn.sig) + PingDynamicUsage(mn.lastPing);
+}
+
+void CMasternodeMan::GetMemoryUsage(std::map<std::string, size_t>& mapUsage)
+{
+    {
+        LOCK(cs);
+        size_t nUsage = memusage::DynamicUsage(listMasternodes);
+        BOOST_FOREACH (const CMasternode& mn, listMasternodes)
+            nUsage += MasternodeDynamicUsage(mn);
+        mapUsage["listMasternodes"] = nUsage;
+
+        nUsage = memusage::DynamicUsage(mapMasternodesByVin) + memusage::DynamicUsage(mapMasternodesByPayee) + memusage::DynamicUsage(mapMasternodesByPubKey);
+        for (std::multimap<CScript, CMasternode*>::const_iterator it = mapMasternodesByPayee.begin(); it != mapMasternodesByPayee.end(); ++it)
+            nUsage += memusage::DynamicUsage(it->first);
+        mapUsage["mapMasternodesBy"] = nUsage;
+
+        {
+            LOCK(cs_collaterals);
+            mapUsage["mapCollaterals"] = memusage::DynamicUsage(mapCollaterals);
+        }
+
+        nUsage = mapSeenMasternodeBroadcast.DynamicMemoryUsage();
+        for (SeenMasternodeBroadcastCache::const_iterator it = mapSeenMasternodeBroadcast.begin(); it != mapSeenMasternodeBroadcast.end(); ++it)
+            nUsage += MasternodeDynamicUsage(it->second.value);
+        mapUsage["mapSeenMasternodeBroadcast"] = nUsage;
+
+        nUsage = mapSeenMasternodePing.DynamicMemoryUsage();
+        for (SeenMasternodePingCache::const_iterator it = mapSeenMasternodePing.begin(); it != mapSeenMasternodePing.end(); ++it)
+            nUsage += it->second.value.DynamicMemoryUsage();
+        mapUsage["mapSeenMasternodePing"] = nUsage;
+
+        mapUsage["mapAsked"] = memusage::DynamicUsage(mAskedUsForMasternodeList) + memusage::DynamicUsage(mWeAskedForMasternodeList) + memusage::DynamicUsage(mWeAskedForMasternodeListEntry);
+        mapUsage["mapListChanges"] = memusage::DynamicUsage(mapChangeSeq) + memusage::DynamicUsage(mapListSnapshots) + memusage::DynamicUsage(dequeListSnapshots) + memusage::DynamicUsage(mapPeerListHashes);
+    }
+
+    LOCK(cs_scores);
+    size_t nUsage = memusage::DynamicUsage(mapScoreCache);
+    for (std::map<int64_t, CScoreCache>::const_iterator it = mapScoreCache.begin(); it != mapScoreCache.end(); ++it)
+    {
+        nUsage += memusage::DynamicUsage(it->second.mapScores) + memusage::DynamicUsage(it->second.mapRankTables);
+        for (std::map<std::pair<int, bool>, CRankTable>::const_iterator itTable = it->second.mapRankTables.begin(); itTable != it->second.mapRankTables.end(); ++itTable)
+            nUsage += memusage::DynamicUsage(itTable->second.mapRanks);
+    }
+    mapUsage["mapScoreCache"] = nUsage;
+}
+
 int CMasternodeMan::CountEnabled(int protocolVersion)
 {
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -387,7 +517,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         std::string strHost;
         int port;
@@ -424,7 +554,12 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
         }
     }
 
-    pnode->PushMessage("dseg", CTxIn());
+    // peers that do not know the list hash read the request as one for the full list
+    std::map<CNetAddr, std::pair<uint256, int64_t> >::const_iterator it = mapPeerListHashes.find(pnode->addr);
+    if (it != mapPeerListHashes.end())
+        pnode->PushMessage("dseg", CTxIn(), it->second.first);
+    else
+        pnode->PushMessage("dseg", CTxIn());
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
@@ -432,37 +567,128 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
-    }
-    return NULL;
+    std::multimap<CScript, CMasternode*>::const_iterator it = mapMasternodesByPayee.find(payee);
+    return it == mapMasternodesByPayee.end() ? NULL : it->second;
+}
+
+unsigned int CMasternodeMan::GetListVersion()
+{
+    LOCK(cs);
+    return nListVersion;
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    MasternodeByVinMap::const_iterator it = mapMasternodesByVin.find(vin.prevout);
+    return it == mapMasternodesByVin.end() ? NULL : it->second;
 }
 
 
+bool CMasternodeMan::Get(const CTxIn& vin, CMasternode& mnRet)
+{
+    LOCK(cs);
+    CMasternode* pmn = Find(vin);
+    if (pmn == NULL)
+        return false;
+    mnRet = *pmn;
+    return true;
+}
+
 CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
+    std::multimap<CPubKey, CMasternode*>::const_iterator it = mapMasternodesByPubKey.find(pubKeyMasternode);
+    return it == mapMasternodesByPubKey.end() ? NULL : it->second;
+}
+
+void CMasternodeMan::ProcessPing(CNode* pfrom, CMasternodePing& mnp, bool fCompact)
+{
+    uint256 hash = mnp.GetHash();
+    if (fCompact)
+        pfrom->AddInventoryKnown(CInv(MSG_MASTERNODE_PING, hash));
+    if (IsPingSeen(hash)) return; //seen
+
+    // the hash leaves out the signature, so only a ping that checks out may stand for it
+    int nDoS = 0;
+    if (mnp.CheckAndUpdate(nDoS)) {
+        AddSeenPing(mnp);
+        return;
     }
-    return NULL;
+
+    // a compact ping was asked for by a short id unique on both sides, so the peer answers for it as for mnp
+    if (nDoS > 0)
+        Misbehaving(pfrom->GetId(), nDoS, _("masternodeman::ProcessMessage::ln 755::Masternode DoS count greater than 0"));
+
+    // the Masternode of a compact ping is in the list already
+    if (fCompact) return;
+
+    if (nDoS == 0) {
+        // if nothing significant failed, search existing Masternode list
+        CMasternode* pmn = Find(mnp.vin);
+        // if it's known, don't ask for the mnb, just return
+        if (pmn != NULL) return;
+    }
+
+    // something significant is broken or mn is unknown,
+    // we might have to ask for a masternode entry once
+    AskForMN(pfrom, mnp.vin);
+}
+
+CMasternode* CMasternodeMan::FindByShortID(uint64_t nShortID)
+{
+    LOCK(cs);
+
+    std::pair<std::multimap<uint64_t, CMasternode*>::const_iterator, std::multimap<uint64_t, CMasternode*>::const_iterator> range = mapMasternodesByShortID.equal_range(nShortID);
+    if (range.first == range.second || ++std::multimap<uint64_t, CMasternode*>::const_iterator(range.first) != range.second)
+        return NULL;
+    return range.first->second;
+}
+
+bool CMasternodeMan::HasUniqueShortID(const CTxIn& vin)
+{
+    LOCK(cs);
+    return mapMasternodesByShortID.count(GetMasternodeShortID(vin.prevout)) == 1;
+}
+
+bool CMasternodeMan::IsPingSeen(const uint256& hash)
+{
+    LOCK(cs);
+    return mapSeenMasternodePing.count(hash) || filterSupersededPings.contains(hash);
+}
+
+void CMasternodeMan::AddSeenPing(const CMasternodePing& mnp)
+{
+    LOCK(cs);
+    uint256 hash = mnp.GetHash();
+    std::pair<int64_t, uint256>& last = mapLastSeenPing[mnp.vin.prevout];
+    if (last.second != 0 && last.first > mnp.sigTime) {
+        // an older ping arriving late, only its hash is worth keeping
+        filterSupersededPings.insert(hash);
+        return;
+    }
+    if (last.second != 0 && last.second != hash) {
+        mapSeenMasternodePing.Erase(last.second);
+        filterSupersededPings.insert(last.second);
+    }
+    last = std::make_pair(mnp.sigTime, hash);
+    mapSeenMasternodePing.Insert(hash, mnp);
+}
+
+void CMasternodeMan::IndexSeenPings()
+{
+    LOCK(cs);
+    mapLastSeenPing.clear();
+    std::vector<CMasternodePing> vPings;
+    vPings.reserve(mapSeenMasternodePing.size());
+    for (SeenMasternodePingCache::const_iterator it = mapSeenMasternodePing.begin(); it != mapSeenMasternodePing.end(); ++it)
+        vPings.push_back(it->second.value.Get());
+    mapSeenMasternodePing.clear();
+    BOOST_FOREACH (const CMasternodePing& mnp, vPings)
+        AddSeenPing(mnp);
 }
 
 //
@@ -480,15 +706,19 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    int nLastPaidWindow = nMnCount * 1.25;
+    int nMinProtocol = masternodePayments.GetMinMasternodePaymentsProto();
+    std::set<CScript> setScheduled;
+    masternodePayments.GetScheduledPayees(nBlockHeight, setScheduled);
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
         // //check protocol version
-        if (mn.protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) continue;
+        if (mn.protocolVersion < nMinProtocol) continue;
 
         //it's in the list (up to 8 entries ahead of current block to allow propagation) -- so let's skip it
-        if (masternodePayments.IsScheduled(mn, nBlockHeight)) continue;
+        if (setScheduled.count(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()))) continue;
 
         //it's too new, wait for a cycle
         if (fFilterSigTime && mn.sigTime + (nMnCount * 2.6 * 60) > GetAdjustedTime()) continue;
@@ -496,7 +726,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nLastPaidWindow), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -539,11 +769,11 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - nCountEnabled - vecToExclude.size() %d\n", nCountEnabled - vecToExclude.size());
     if (nCountEnabled - vecToExclude.size() < 1) return NULL;
 
-    int rand = GetRandInt(nCountEnabled - vecToExclude.size());
+    int rand = GetInsecureRandInt(nCountEnabled - vecToExclude.size());
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -567,7 +797,7 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     CMasternode* winner = NULL;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
 
@@ -585,19 +815,76 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+bool CMasternodeMan::GetScores(int64_t nBlockHeight, std::vector<int64_t>& vScores)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-    int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
+    //make sure we know about this block
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return false;
+
+    LOCK(cs_scores);
+    CScoreCache& cache = mapScoreCache[nBlockHeight];
+    if (cache.hashBlock != hash) {
+        // new height, or the block at this height changed
+        cache.hashBlock = hash;
+        cache.mapScores.clear();
+        cache.mapRankTables.clear();
+    }
 
-    int64_t nMasternode_Age = 0;
+    vScores.clear();
+    vScores.reserve(listMasternodes.size());
+    BOOST_FOREACH (const CMasternode& mn, listMasternodes) {
+        std::map<COutPoint, int64_t>::iterator it = cache.mapScores.find(mn.vin.prevout);
+        if (it == cache.mapScores.end())
+            it = cache.mapScores.insert(make_pair(mn.vin.prevout, (int64_t)mn.CalculateScore(hash).GetCompact(false))).first;
+        vScores.push_back(it->second);
+    }
+
+    // keep the most recent heights only
+    while (mapScoreCache.size() > MNSCORE_CACHE_HEIGHTS && mapScoreCache.begin()->first != nBlockHeight)
+        mapScoreCache.erase(mapScoreCache.begin());
+
+    return true;
+}
 
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
     //make sure we know about this block
     uint256 hash = 0;
     if (!GetBlockHash(hash, nBlockHeight)) return -1;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // every winner vote asks for the rank of its voter, answer those from the table of the height
+    {
+        LOCK(cs_scores);
+        std::map<int64_t, CScoreCache>::const_iterator it = mapScoreCache.find(nBlockHeight);
+        if (it != mapScoreCache.end() && it->second.hashBlock == hash) {
+            std::map<std::pair<int, bool>, CRankTable>::const_iterator itTable = it->second.mapRankTables.find(std::make_pair(minProtocol, fOnlyActive));
+            if (itTable != it->second.mapRankTables.end() && itTable->second.nListVersion == nListVersion &&
+                GetTime() - itTable->second.nTimeBuilt < MASTERNODE_CHECK_SECONDS) {
+                boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher>::const_iterator itRank = itTable->second.mapRanks.find(vin.prevout);
+                return itRank == itTable->second.mapRanks.end() ? -1 : itRank->second;
+            }
+        }
+    }
+
+    return GetRankFromTable(vin, nBlockHeight, minProtocol, fOnlyActive);
+}
+
+bool CMasternodeMan::BuildRankTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive, CRankTable& table)
+{
+    std::vector<int64_t> vScores;
+    if (!GetScores(nBlockHeight, vScores)) return false;
+
+    table.nListVersion = nListVersion;
+    table.nTimeBuilt = GetTime();
+
+    std::vector<pair<int64_t, size_t> > vecMasternodeScores;
+    std::vector<CMasternode*> vpmn;
+    vecMasternodeScores.reserve(listMasternodes.size());
+    vpmn.reserve(listMasternodes.size());
+    BOOST_FOREACH (CMasternode& mn, listMasternodes)
+        vpmn.push_back(&mn);
+    for (size_t i = 0; i < vpmn.size(); i++) {
+        CMasternode& mn = *vpmn[i];
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
@@ -607,57 +894,148 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+        vecMasternodeScores.push_back(make_pair(vScores[i], i));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    sort(vecMasternodeScores.begin(), vecMasternodeScores.end(), CompareScoreIndex());
+    table.mapRanks.clear();
+    table.mapRanks.reserve(vecMasternodeScores.size());
+    for (size_t i = 0; i < vecMasternodeScores.size(); i++)
+        table.mapRanks[vpmn[vecMasternodeScores[i].second]->vin.prevout] = i + 1;
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
+    LOCK(cs_scores);
+    std::map<int64_t, CScoreCache>::iterator it = mapScoreCache.find(nBlockHeight);
+    if (it != mapScoreCache.end())
+        it->second.mapRankTables[std::make_pair(minProtocol, fOnlyActive)] = table;
+    return true;
+}
+
+int CMasternodeMan::GetRankFromTable(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    CRankTable table;
+    if (!BuildRankTable(nBlockHeight, minProtocol, fOnlyActive, table)) return -1;
+
+    boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher>::const_iterator itRank = table.mapRanks.find(vin.prevout);
+    return itRank == table.mapRanks.end() ? -1 : itRank->second;
+}
+
+bool CMasternodeMan::GetRanks(int64_t nBlockHeight, int minProtocol, bool fOnlyActive, boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher>& mapRanksRet)
+{
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return false;
+
+    {
+        LOCK(cs_scores);
+        std::map<int64_t, CScoreCache>::const_iterator it = mapScoreCache.find(nBlockHeight);
+        if (it != mapScoreCache.end() && it->second.hashBlock == hash) {
+            std::map<std::pair<int, bool>, CRankTable>::const_iterator itTable = it->second.mapRankTables.find(std::make_pair(minProtocol, fOnlyActive));
+            if (itTable != it->second.mapRankTables.end() && itTable->second.nListVersion == nListVersion &&
+                GetTime() - itTable->second.nTimeBuilt < MASTERNODE_CHECK_SECONDS) {
+                mapRanksRet = itTable->second.mapRanks;
+                return true;
+            }
         }
     }
 
-    return -1;
+    CRankTable table;
+    if (!BuildRankTable(nBlockHeight, minProtocol, fOnlyActive, table)) return false;
+    mapRanksRet.swap(table.mapRanks);
+    return true;
+}
+
+size_t CMasternodeMan::GetMasternodeList(int64_t nBlockHeight, const CMasternodeListFilter& filter, size_t nSkip, size_t nCount, std::vector<CMasternodeListEntry>& vEntries)
+{
+    boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher> mapRanks;
+    GetRanks(nBlockHeight, 0, true, mapRanks);
+
+    LOCK(cs);
+    std::vector<CMasternode*> vpmn;
+    std::vector<std::pair<int, size_t> > vMatches;
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        mn.Check();
+        if (filter.nProtocol != 0 && mn.protocolVersion != filter.nProtocol)
+            continue;
+        if (filter.fPayee && mn.pubKeyCollateralAddress.GetID() != filter.payee)
+            continue;
+        std::string strStatus = mn.Status();
+        if (!filter.strStatus.empty() && strStatus != filter.strStatus)
+            continue;
+        if (!filter.strAddr.empty() && mn.addr.ToString().find(filter.strAddr) == std::string::npos)
+            continue;
+        if (!filter.strText.empty() && mn.vin.prevout.hash.ToString().find(filter.strText) == std::string::npos &&
+            strStatus.find(filter.strText) == std::string::npos &&
+            CBitcoinAddress(mn.pubKeyCollateralAddress.GetID()).ToString().find(filter.strText) == std::string::npos)
+            continue;
+
+        int nRank = 0;
+        if (mn.IsEnabled()) {
+            boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher>::const_iterator it = mapRanks.find(mn.vin.prevout);
+            if (it != mapRanks.end())
+                nRank = it->second;
+        }
+        vMatches.push_back(std::make_pair(nRank, vpmn.size()));
+        vpmn.push_back(&mn);
+    }
+    if (nSkip >= vMatches.size())
+        return vMatches.size();
+
+    // only the page asked for has to end up in order
+    size_t nEnd = nSkip + std::min(nCount, vMatches.size() - nSkip);
+    std::partial_sort(vMatches.begin(), vMatches.begin() + nEnd, vMatches.end(), CompareListRank());
+
+    int nLastPaidWindow = filter.fLastPaid ? CountEnabled() * 1.25 : 0;
+    vEntries.reserve(vEntries.size() + nEnd - nSkip);
+    for (size_t i = nSkip; i < nEnd; i++) {
+        CMasternode& mn = *vpmn[vMatches[i].second];
+        CMasternodeListEntry entry;
+        entry.nRank = vMatches[i].first;
+        entry.vin = mn.vin;
+        entry.strStatus = mn.Status();
+        entry.payee = mn.pubKeyCollateralAddress.GetID();
+        entry.addr = mn.addr;
+        entry.protocolVersion = mn.protocolVersion;
+        entry.nLastSeen = mn.lastPing.sigTime;
+        entry.nActiveTime = mn.lastPing.sigTime - mn.sigTime;
+        if (filter.fLastPaid)
+            entry.nLastPaid = mn.GetLastPaid(nLastPaidWindow);
+        vEntries.push_back(entry);
+    }
+    return vMatches.size();
 }
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
+    std::vector<pair<int64_t, size_t> > vecMasternodeScores;
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    std::vector<int64_t> vScores;
+    if (!GetScores(nBlockHeight, vScores)) return vecMasternodeRanks;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    std::vector<CMasternode*> vpmn;
+    vpmn.reserve(listMasternodes.size());
+    BOOST_FOREACH (CMasternode& mn, listMasternodes)
+        vpmn.push_back(&mn);
+    for (size_t i = 0; i < vpmn.size(); i++) {
+        CMasternode& mn = *vpmn[i];
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
 
         if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
+            vecMasternodeScores.push_back(make_pair(9999, i));
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
+        vecMasternodeScores.push_back(make_pair(vScores[i], i));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    sort(vecMasternodeScores.begin(), vecMasternodeScores.end(), CompareScoreIndex());
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
+    BOOST_FOREACH (PAIRTYPE(int64_t, size_t) & s, vecMasternodeScores) {
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        vecMasternodeRanks.push_back(make_pair(rank, *vpmn[s.second]));
     }
 
     return vecMasternodeRanks;
@@ -665,33 +1043,33 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    std::vector<pair<int64_t, size_t> > vecMasternodeScores;
+
+    std::vector<int64_t> vScores;
+    if (nRank < 1 || !GetScores(nBlockHeight, vScores)) return NULL;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    std::vector<CMasternode*> vpmn;
+    vpmn.reserve(listMasternodes.size());
+    BOOST_FOREACH (CMasternode& mn, listMasternodes)
+        vpmn.push_back(&mn);
+    for (size_t i = 0; i < vpmn.size(); i++) {
+        CMasternode& mn = *vpmn[i];
         if (mn.protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+        vecMasternodeScores.push_back(make_pair(vScores[i], i));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    if ((size_t)nRank > vecMasternodeScores.size())
+        return NULL;
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (rank == nRank) {
-            return Find(s.second);
-        }
-    }
-
-    return NULL;
+    // only the nRank-th entry has to end up in place
+    nth_element(vecMasternodeScores.begin(), vecMasternodeScores.begin() + (nRank - 1), vecMasternodeScores.end(), CompareScoreIndex());
+    return vpmn[vecMasternodeScores[nRank - 1].second];
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -724,7 +1102,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             masternodeSync.AddedMasternodeList(mnb.GetHash());
             return;
         }
-        mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
+        mapSeenMasternodeBroadcast.Insert(mnb.GetHash(), mnb);
 
         int nDoS = 0;
         if (!mnb.CheckAndUpdate(nDoS)) {
@@ -761,33 +1139,130 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         vRecv >> mnp;
 
         LogPrint("masternode", "mnp - Masternode ping, vin: %s\n", mnp.vin.prevout.hash.ToString());
+        ProcessPing(pfrom, mnp, false);
 
-        if (mapSeenMasternodePing.count(mnp.GetHash())) return; //seen
-        mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
+    } else if (strCommand == "mnpann") { //Masternode Pings announced by short id
+        std::vector<CMasternodePingAnnounce> vAnnounce;
+        vRecv >> vAnnounce;
+        if (vAnnounce.size() > MAX_INV_SZ) {
+            Misbehaving(pfrom->GetId(), 20, _("masternodeman::ProcessMessage::mnpann::Too many announcements"));
+            return;
+        }
 
-        int nDoS = 0;
-        if (mnp.CheckAndUpdate(nDoS)) return;
+        std::vector<uint64_t> vRequest;
+        int64_t nNow = GetAdjustedTime();
+        {
+            LOCK(cs);
+            BOOST_FOREACH (const CMasternodePingAnnounce& announce, vAnnounce) {
+                // pings of unknown Masternodes come with their broadcast in the list sync
+                CMasternode* pmn = FindByShortID(announce.nShortID);
+                if (pmn == NULL) continue;
+                CMasternodePing mnp;
+                mnp.vin = pmn->vin;
+                mnp.sigTime = announce.sigTime;
+                pfrom->AddInventoryKnown(CInv(MSG_MASTERNODE_PING, mnp.GetHash()));
+
+                // what CheckAndUpdate would turn down is not asked for
+                if (announce.sigTime > nNow + 60 * 60 || announce.sigTime <= nNow - 60 * 60) continue;
+                if (pmn->IsPingedWithin(MASTERNODE_MIN_MNP_SECONDS - 60, announce.sigTime)) continue;
+                std::map<uint64_t, std::pair<NodeId, int64_t> >::const_iterator it = mapCompactPingsAsked.find(announce.nShortID);
+                if (it != mapCompactPingsAsked.end() && it->second.second > GetTime() - MNP_COMPACT_REQUEST_SECONDS) continue;
+                mapCompactPingsAsked[announce.nShortID] = std::make_pair(pfrom->GetId(), GetTime());
+                vRequest.push_back(announce.nShortID);
+            }
+        }
+        if (!vRequest.empty())
+            pfrom->PushMessage("getmnpc", vRequest);
+
+    } else if (strCommand == "getmnpc") { //Compact Masternode Pings asked for
+        std::vector<uint64_t> vShortIDs;
+        vRecv >> vShortIDs;
+        if (vShortIDs.size() > MAX_INV_SZ) {
+            Misbehaving(pfrom->GetId(), 20, _("masternodeman::ProcessMessage::getmnpc::Too many short ids"));
+            return;
+        }
 
-        if (nDoS > 0) {
-            // if anything significant failed, mark that node
-            Misbehaving(pfrom->GetId(), nDoS, _("masternodeman::ProcessMessage::ln 755::Masternode DoS count greater than 0"));
-        } else {
-            // if nothing significant failed, search existing Masternode list
-            CMasternode* pmn = Find(mnp.vin);
-            // if it's known, don't ask for the mnb, just return
-            if (pmn != NULL) return;
+        std::vector<std::pair<uint64_t, CMasternodePing> > vPings;
+        {
+            LOCK(cs);
+            BOOST_FOREACH (uint64_t nShortID, vShortIDs) {
+                CMasternode* pmn = FindByShortID(nShortID);
+                if (pmn != NULL && pmn->lastPing != CMasternodePing())
+                    vPings.push_back(std::make_pair(nShortID, pmn->lastPing));
+            }
         }
 
-        // something significant is broken or mn is unknown,
-        // we might have to ask for a masternode entry once
-        AskForMN(pfrom, mnp.vin);
+        std::vector<CCompactMasternodePing> vCompact;
+        {
+            LOCK(cs_main);
+            for (std::vector<std::pair<uint64_t, CMasternodePing> >::const_iterator it = vPings.begin(); it != vPings.end(); ++it) {
+                BlockMap::const_iterator mi = mapBlockIndex.find(it->second.blockHash);
+                if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second)) continue;
+                vCompact.push_back(CCompactMasternodePing(it->first, mi->second->nHeight, it->second));
+            }
+        }
+        if (!vCompact.empty())
+            pfrom->PushMessage("mnpc", vCompact);
+
+    } else if (strCommand == "mnpc") { //Compact Masternode Pings
+        std::vector<CCompactMasternodePing> vCompact;
+        vRecv >> vCompact;
+        if (vCompact.size() > MAX_INV_SZ) {
+            Misbehaving(pfrom->GetId(), 20, _("masternodeman::ProcessMessage::mnpc::Too many pings"));
+            return;
+        }
+
+        // the vin from the list, then the block hash from the chain
+        std::vector<std::pair<int, CMasternodePing> > vPings;
+        {
+            LOCK(cs);
+            BOOST_FOREACH (const CCompactMasternodePing& compact, vCompact) {
+                // only the pings asked from this peer are taken, each once
+                std::map<uint64_t, std::pair<NodeId, int64_t> >::iterator itAsked = mapCompactPingsAsked.find(compact.nShortID);
+                if (itAsked == mapCompactPingsAsked.end() || itAsked->second.first != pfrom->GetId()) continue;
+                mapCompactPingsAsked.erase(itAsked);
+                CMasternode* pmn = FindByShortID(compact.nShortID);
+                if (pmn == NULL) continue;
+                CMasternodePing mnp;
+                mnp.vin = pmn->vin;
+                mnp.sigTime = compact.sigTime;
+                mnp.vchSig = compact.vchSig;
+                vPings.push_back(std::make_pair(compact.nBlockHeight, mnp));
+            }
+        }
+        {
+            LOCK(cs_main);
+            for (std::vector<std::pair<int, CMasternodePing> >::iterator it = vPings.begin(); it != vPings.end(); ++it) {
+                if (it->first >= 0 && it->first <= chainActive.Height())
+                    it->second.blockHash = chainActive[it->first]->GetBlockHash();
+            }
+        }
+        for (std::vector<std::pair<int, CMasternodePing> >::iterator it = vPings.begin(); it != vPings.end(); ++it) {
+            if (it->second.blockHash != 0)
+                ProcessPing(pfrom, it->second, true);
+        }
 
     } else if (strCommand == "dseg") { //Get Masternode list or specific entry
 
         CTxIn vin;
         vRecv >> vin;
+        // newer peers add the list hash we sent them last, to get only what changed since
+        uint256 hashKnownList = 0;
+        if (vin == CTxIn() && !vRecv.empty())
+            vRecv >> hashKnownList;
+
+        LOCK(cs);
+        bool fChanges = false;
+        uint64_t nSinceSeq = 0;
+        if (hashKnownList != 0) {
+            std::map<uint256, uint64_t>::const_iterator it = mapListSnapshots.find(hashKnownList);
+            if (it != mapListSnapshots.end()) {
+                fChanges = true;
+                nSinceSeq = it->second;
+            }
+        }
 
-        if (vin == CTxIn()) { //only should ask for this once
+        if (vin == CTxIn() && !fChanges) { //only should ask for the full list once
             //local network
             bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
 
@@ -808,8 +1283,9 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (CMasternode& mn, listMasternodes) {
             if (mn.addr.IsRFC1918()) continue; //local network
+            if (fChanges && mapChangeSeq[mn.vin.prevout] <= nSinceSeq) continue; //the peer has it already
 
             if (mn.IsEnabled()) {
                 LogPrint("masternode", "dseg - Sending Masternode entry - %s \n", mn.vin.prevout.hash.ToString());
@@ -819,7 +1295,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
                     nInvCount++;
 
-                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+                    mapSeenMasternodeBroadcast.Insert(hash, mnb);
 
                     if (vin == mn.vin) {
                         LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
@@ -830,8 +1306,9 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
 
         if (vin == CTxIn()) {
-            pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nInvCount);
-            LogPrint("masternode", "dseg - Sent %d Masternode entries to peer %i\n", nInvCount, pfrom->GetId());
+            // with the hash to ask for the changes since next time, older peers ignore it
+            pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nInvCount, GetListSnapshot());
+            LogPrint("masternode", "dseg - Sent %d %s to peer %i\n", nInvCount, fChanges ? "changed Masternode entries" : "Masternode entries", pfrom->GetId());
         }
     }
 }
@@ -840,22 +1317,42 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
+            UnindexMasternode(&*it);
+            UnwatchCollateral((*it).vin.prevout);
+            mapChangeSeq.erase((*it).vin.prevout);
+            uiInterface.NotifyMasternodeChanged((*it).vin.prevout, CT_DELETED);
+            listMasternodes.erase(it);
+            nListVersion++;
             break;
         }
         ++it;
     }
 }
 
+bool CMasternodeMan::UpdateFromNewBroadcast(CMasternode* pmn, CMasternodeBroadcast& mnb)
+{
+    LOCK(cs);
+
+    // the broadcast may bring new keys
+    UnindexMasternode(pmn);
+    bool fUpdated = pmn->UpdateFromNewBroadcast(mnb);
+    IndexMasternode(pmn);
+    if (fUpdated) {
+        MarkChanged(pmn->vin.prevout);
+        uiInterface.NotifyMasternodeChanged(pmn->vin.prevout, CT_UPDATED);
+    }
+    return fUpdated;
+}
+
 void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
 {
     LOCK(cs);
-    mapSeenMasternodePing.insert(std::make_pair(mnb.lastPing.GetHash(), mnb.lastPing));
-    mapSeenMasternodeBroadcast.insert(std::make_pair(mnb.GetHash(), mnb));
+    AddSeenPing(mnb.lastPing);
+    mapSeenMasternodeBroadcast.Insert(mnb.GetHash(), mnb);
 
     LogPrint("masternode","CMasternodeMan::UpdateMasternodeList -- masternode=%s\n", mnb.vin.prevout.ToStringShort());
 
@@ -864,9 +1361,11 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
         CMasternode mn(mnb);
         if (Add(mn)) {
             masternodeSync.AddedMasternodeList(mnb.GetHash());
+            ::NotifyMasternodeMessage("rawmnb", mnb);
         }
-    } else if (pmn->UpdateFromNewBroadcast(mnb)) {
+    } else if (UpdateFromNewBroadcast(pmn, mnb)) {
         masternodeSync.AddedMasternodeList(mnb.GetHash());
+        ::NotifyMasternodeMessage("rawmnb", mnb);
     }
 }
 
@@ -874,7 +1373,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size();
+    info << "Masternodes: " << (int)listMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size();
 
     return info.str();
 }
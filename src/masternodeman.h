@@ -10,12 +10,33 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "masternode-db.h"
 #include "net.h"
+#include "seencache.h"
 #include "sync.h"
 #include "util.h"
 
+#include <deque>
+#include <list>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+// heights whose Masternode scores and ranks are kept, enough for the winner votes around the tip
+#define MNSCORE_CACHE_HEIGHTS 64
+// list hashes handed out to peers that can still be answered with the changes since
+#define MNLIST_SNAPSHOTS 256
+// list hashes kept of the peers we synced the Masternode list from
+#define MNLIST_PEER_HASHES 64
+// bounds of the seen broadcast and ping caches, well above what a full list relays
+#define MNB_SEEN_MAX 20000
+#define MNP_SEEN_MAX 20000
+// pings replaced by a newer one of their Masternode, remembered by hash only
+#define MNP_SUPERSEDED_MAX 100000
+// seconds a compact ping asked for is not asked for again from another peer
+#define MNP_COMPACT_REQUEST_SECONDS 10
 
 using namespace std;
 
@@ -26,29 +47,92 @@ void DumpMasternodes();
 
 /** Access to the MN database (mncache.dat)
  */
-class CMasternodeDB
+class CMasternodeDB : public CMasternodeCacheDB<CMasternodeMan>
+{
+public:
+    CMasternodeDB() : CMasternodeCacheDB<CMasternodeMan>("mncache.dat", "MasternodeCache") {}
+};
+
+/** The counts reported by getmasternodecount at one chain height */
+struct CMasternodeCountSnapshot {
+    int nHeight;
+    int nTotal;
+    int nStable;
+    int nEnabled;
+    int nInQueue;
+    int nIPv4;
+    int nIPv6;
+    int nOnion;
+
+    CMasternodeCountSnapshot() : nHeight(-1), nTotal(0), nStable(0), nEnabled(0), nInQueue(0), nIPv4(0), nIPv6(0), nOnion(0) {}
+};
+
+/** Hashes collateral outpoints with the salted hash of their txid, the keys come from the network */
+class CMasternodeOutPointHasher
 {
 private:
-    boost::filesystem::path pathMN;
-    std::string strMagicMessage;
+    CCoinsKeyHasher hasher;
 
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return hasher(outpoint.hash) ^ outpoint.n;
+    }
+};
+
+/** What is known about the collateral of a listed Masternode */
+enum CollateralState {
+    COLLATERAL_UNKNOWN,   //! not in the list
+    COLLATERAL_UNCHECKED, //! not looked up yet, spends are seen from now on
+    COLLATERAL_UNSPENT,
+    COLLATERAL_SPENT
+};
+
+/** Seen broadcasts and pings are dropped once their ping is too old to matter */
+struct CMasternodeBroadcastExpiry {
+    int64_t operator()(const CMasternodeBroadcast& mnb) const { return mnb.lastPing.sigTime + MASTERNODE_REMOVAL_SECONDS * 2; }
+};
 
-    CMasternodeDB();
-    bool Write(const CMasternodeMan& mnodemanToSave);
-    ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+struct CMasternodePingExpiry {
+    int64_t operator()(const CMasternodePing& mnp) const { return mnp.sigTime + MASTERNODE_REMOVAL_SECONDS * 2; }
 };
 
-class CMasternodeMan
+typedef CSeenCache<CMasternodeBroadcast, CMasternodeBroadcastExpiry> SeenMasternodeBroadcastCache;
+typedef CSeenCache<CMasternodePing, CMasternodePingExpiry, CRelayBytes<CMasternodePing> > SeenMasternodePingCache;
+
+/** What a Masternode list query keeps of an entry, without its pings and signatures */
+struct CMasternodeListEntry {
+    //! Rank at the height of the query, 0 unless enabled
+    int nRank;
+    CTxIn vin;
+    std::string strStatus;
+    CKeyID payee;
+    CService addr;
+    int protocolVersion;
+    int64_t nLastSeen;
+    int64_t nActiveTime;
+    //! Only filled when the filter asks for it, finding it walks the payments
+    int64_t nLastPaid;
+
+    CMasternodeListEntry() : nRank(0), protocolVersion(0), nLastSeen(0), nActiveTime(0), nLastPaid(0) {}
+};
+
+/** Which Masternodes a list query returns, each field left empty matches all */
+struct CMasternodeListFilter {
+    std::string strStatus;
+    CKeyID payee;
+    bool fPayee;
+    //! Part of ip:port
+    std::string strAddr;
+    int nProtocol;
+    //! Part of the collateral txid, the status or the payee address, the old listmasternodes filter
+    std::string strText;
+    bool fLastPaid;
+
+    CMasternodeListFilter() : fPayee(false), nProtocol(0), fLastPaid(false) {}
+};
+
+class CMasternodeMan : public CValidationInterface
 {
 private:
     // critical section to protect the inner data structures
@@ -57,8 +141,61 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // list to hold all MNs, an entry stays where it is until it is removed
+    std::list<CMasternode> listMasternodes;
+    // changes whenever Masternodes are added to or removed from listMasternodes
+    unsigned int nListVersion;
+
+    // indexes into listMasternodes; several Masternodes may share a payee or a key,
+    // Find returns the one indexed first
+    typedef boost::unordered_map<COutPoint, CMasternode*, CMasternodeOutPointHasher> MasternodeByVinMap;
+    MasternodeByVinMap mapMasternodesByVin;
+    std::multimap<CScript, CMasternode*> mapMasternodesByPayee;
+    std::multimap<CPubKey, CMasternode*> mapMasternodesByPubKey;
+    std::multimap<uint64_t, CMasternode*> mapMasternodesByShortID;
+
+    void IndexMasternode(CMasternode* pmn);
+    void UnindexMasternode(CMasternode* pmn);
+    void RebuildIndexes();
+
+    // the collaterals of the listed Masternodes, marked spent by the transactions
+    // synced through the validation interface; cs_collaterals is taken last
+    typedef boost::unordered_map<COutPoint, CollateralState, CMasternodeOutPointHasher> CollateralMap;
+    mutable CCriticalSection cs_collaterals;
+    CollateralMap mapCollaterals;
+
+    void WatchCollateral(const COutPoint& outpoint);
+    void UnwatchCollateral(const COutPoint& outpoint);
+
+    // counts the entries added or replaced by a newer broadcast, each entry keeps the
+    // count of its last change so a peer can be sent only what changed since its list hash
+    uint64_t nChangeSeq;
+    boost::unordered_map<COutPoint, uint64_t, CMasternodeOutPointHasher> mapChangeSeq;
+    // the list hashes handed out to peers and the change count they stand for, gone on restart
+    uint256 hashListSalt;
+    std::map<uint256, uint64_t> mapListSnapshots;
+    std::deque<uint256> dequeListSnapshots;
+    // the last list hash of each peer we synced the list from, and when we got it
+    std::map<CNetAddr, std::pair<uint256, int64_t> > mapPeerListHashes;
+
+    void MarkChanged(const COutPoint& outpoint);
+
+    // the newest ping seen of each Masternode, (sigTime, hash); the bytes of older ones
+    // leave mapSeenMasternodePing and filterSupersededPings only keeps that they were seen
+    boost::unordered_map<COutPoint, std::pair<int64_t, uint256>, CMasternodeOutPointHasher> mapLastSeenPing;
+    CRollingBloomFilter filterSupersededPings;
+    // the short ids of the compact pings asked for, whom from and when
+    std::map<uint64_t, std::pair<NodeId, int64_t> > mapCompactPingsAsked;
+
+    void IndexSeenPings();
+    /// Check a ping from pfrom and relay it, as "mnp" or "mnpc" sent it
+    void ProcessPing(CNode* pfrom, CMasternodePing& mnp, bool fCompact);
+    /// The hash that stands for the list as it is now, remembered for the deltas asked later
+    uint256 GetListSnapshot();
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void SyncTransactions(const std::vector<CTransaction>& vtx, const CBlock* pblock);
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -66,11 +203,40 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    // ranks of the Masternodes at a height, for one minProtocol and fOnlyActive; built for a
+    // list version and trusted for as long as Check() keeps the states of the Masternodes
+    struct CRankTable {
+        unsigned int nListVersion;
+        int64_t nTimeBuilt;
+        boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher> mapRanks;
+    };
+
+    // compact scores and ranks by height, valid as long as the block at that height is hashBlock
+    struct CScoreCache {
+        uint256 hashBlock;
+        std::map<COutPoint, int64_t> mapScores;
+        std::map<std::pair<int, bool>, CRankTable> mapRankTables;
+    };
+    CCriticalSection cs_scores;
+    std::map<int64_t, CScoreCache> mapScoreCache;
+
+    /// Compact scores of all Masternodes for nBlockHeight, in listMasternodes order
+    bool GetScores(int64_t nBlockHeight, std::vector<int64_t>& vScores);
+    /// Build the rank table of nBlockHeight and keep it in the score cache
+    bool BuildRankTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive, CRankTable& table);
+    /// Rank of vin in the rank table of nBlockHeight, building the table on a miss; -1 if not ranked
+    int GetRankFromTable(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive);
+    /// All ranks of the rank table of nBlockHeight, building the table on a miss
+    bool GetRanks(int64_t nBlockHeight, int minProtocol, bool fOnlyActive, boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher>& mapRanksRet);
+
+    // replaced as a whole by UpdateCountSnapshot, read without any lock
+    boost::shared_ptr<const CMasternodeCountSnapshot> pcountSnapshot;
+
 public:
     // Keep track of all broadcasts I've seen
-    map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
-    // Keep track of all pings I've seen
-    map<uint256, CMasternodePing> mapSeenMasternodePing;
+    SeenMasternodeBroadcastCache mapSeenMasternodeBroadcast;
+    // Keep track of all pings I've seen, only their bytes as they are only relayed from here
+    SeenMasternodePingCache mapSeenMasternodePing;
 
     ADD_SERIALIZE_METHODS;
 
@@ -78,13 +244,25 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
+        // stored as the vector it always was
+        std::vector<CMasternode> vMasternodes;
+        if (!ser_action.ForRead())
+            vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
         READWRITE(vMasternodes);
+        if (ser_action.ForRead()) {
+            listMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+            RebuildIndexes();
+            nListVersion++;
+        }
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
 
         READWRITE(mapSeenMasternodeBroadcast);
         READWRITE(mapSeenMasternodePing);
+        READWRITE(mapPeerListHashes);
+        if (ser_action.ForRead())
+            IndexSeenPings();
     }
 
     CMasternodeMan();
@@ -109,12 +287,30 @@ public:
 
     void CountNetworks(int protocolVersion, int& ipv4, int& ipv6, int& onion);
 
+    /// Ask a peer for its Masternode list, or for what changed since the list hash it gave us
     void DsegUpdate(CNode* pnode);
 
+    /// Remember the list hash a peer sent with its list, to ask it for the changes next time
+    void SetPeerListHash(const CNetAddr& addr, const uint256& hashList);
+
+    /// Version of the Masternode list, to tell when an entry may have been added or removed
+    unsigned int GetListVersion();
+
     /// Find an entry
     CMasternode* Find(const CScript& payee);
     CMasternode* Find(const CTxIn& vin);
     CMasternode* Find(const CPubKey& pubKeyMasternode);
+    /// The Masternode of a compact ping, NULL unless exactly one has the short id
+    CMasternode* FindByShortID(uint64_t nShortID);
+    /// Whether no other Masternode shares the short id of vin, so it may be relayed by it
+    bool HasUniqueShortID(const CTxIn& vin);
+
+    /// Whether the ping was seen, as the newest of its Masternode or one it replaced
+    bool IsPingSeen(const uint256& hash);
+    /// Remember a ping, dropping the bytes of the one of the same Masternode it replaces
+    void AddSeenPing(const CMasternodePing& mnp);
+    /// Copy an entry, to read it without the list lock
+    bool Get(const CTxIn& vin, CMasternode& mnRet);
 
     /// Find an entry in the masternode list that is next to be paid
     CMasternode* GetNextMasternodeInQueueForPayment(int nBlockHeight, bool fFilterSigTime, int& nCount);
@@ -128,10 +324,17 @@ public:
     std::vector<CMasternode> GetFullMasternodeVector()
     {
         Check();
-        return vMasternodes;
+        LOCK(cs);
+        return std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end());
     }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
+    /**
+     * The Masternodes matching filter in rank order, the ones not enabled last, skipping
+     * the first nSkip matches and keeping at most nCount. Ranks come from the cached rank
+     * table of nBlockHeight and only the matches kept are copied. Returns the number of matches.
+     */
+    size_t GetMasternodeList(int64_t nBlockHeight, const CMasternodeListFilter& filter, size_t nSkip, size_t nCount, std::vector<CMasternodeListEntry>& vEntries);
     int GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
     CMasternode* GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
 
@@ -140,15 +343,31 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
 
+    /// Count the Masternodes again for the chain tip at nHeight and publish the counts
+    void UpdateCountSnapshot(int nHeight);
+    /// The counts last published by UpdateCountSnapshot
+    CMasternodeCountSnapshot GetCountSnapshot() const;
+
+    /// Estimated heap memory of the list and of each map, by name
+    void GetMemoryUsage(std::map<std::string, size_t>& mapUsage);
+
     std::string ToString() const;
 
     void Remove(CTxIn vin);
 
+    /// Whether the collateral of a listed Masternode is spent, as far as known
+    CollateralState GetCollateralState(const COutPoint& outpoint) const;
+    /// Record the result of looking the collateral up, unless a spend was seen meanwhile
+    void SetCollateralChecked(const COutPoint& outpoint, bool fSpent);
+
+    /// Update an entry from a newer broadcast, use instead of CMasternode::UpdateFromNewBroadcast to keep the indexes right
+    bool UpdateFromNewBroadcast(CMasternode* pmn, CMasternodeBroadcast& mnb);
+
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
 };
@@ -0,0 +1,106 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mempoolcheck.h"
+
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+CMempoolCheckQueue mempoolcheckqueue;
+
+bool CMempoolCheckQueue::Push(CNode* pfrom, const CPendingMempoolTxRef& ptx, const MempoolCheckCallback& callback)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (nWorkers == 0 || queue.size() >= MAX_MEMPOOL_CHECK_QUEUE)
+        return false;
+
+    CPendingCheck pending;
+    pending.nodeid = pfrom->GetId();
+    pending.ptx = ptx;
+    pending.callback = callback;
+    pending.fValid = false;
+    queue.push_back(pending);
+    mapNodeChecks[pending.nodeid].nInFlight++;
+    setPending.insert(ptx->tx.GetHash());
+    condWorker.notify_one();
+    return true;
+}
+
+bool CMempoolCheckQueue::IsPending(const uint256& hash)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return setPending.count(hash) > 0;
+}
+
+void CMempoolCheckQueue::ProcessCompleted(CNode* pfrom)
+{
+    std::vector<CPendingCheck> vDone;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<NodeId, CNodeChecks>::iterator it = mapNodeChecks.find(pfrom->GetId());
+        if (it == mapNodeChecks.end())
+            return;
+        vDone.swap(it->second.vDone);
+        if (it->second.nInFlight == 0)
+            mapNodeChecks.erase(it);
+        BOOST_FOREACH (const CPendingCheck& pending, vDone)
+            setPending.erase(setPending.find(pending.ptx->tx.GetHash()));
+    }
+
+    BOOST_FOREACH (CPendingCheck& pending, vDone)
+        pending.callback(pfrom, *pending.ptx, pending.fValid, pending.state);
+}
+
+void CMempoolCheckQueue::RemoveNode(NodeId nodeid)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<NodeId, CNodeChecks>::iterator it = mapNodeChecks.find(nodeid);
+    if (it == mapNodeChecks.end())
+        return;
+    // The checks in flight are forgotten by the workers when they finish
+    BOOST_FOREACH (const CPendingCheck& pending, it->second.vDone)
+        setPending.erase(setPending.find(pending.ptx->tx.GetHash()));
+    mapNodeChecks.erase(it);
+}
+
+void CMempoolCheckQueue::Thread()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWorkers++;
+    }
+
+    while (true) {
+        CPendingCheck pending;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queue.empty())
+                condWorker.wait(lock);
+            pending = queue.front();
+            queue.pop_front();
+        }
+
+        pending.fValid = AcceptToMemoryPoolScriptChecks(pending.state, *pending.ptx);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // The node may have disconnected while its check ran
+            std::map<NodeId, CNodeChecks>::iterator it = mapNodeChecks.find(pending.nodeid);
+            if (it == mapNodeChecks.end()) {
+                setPending.erase(setPending.find(pending.ptx->tx.GetHash()));
+                continue;
+            }
+            it->second.nInFlight--;
+            it->second.vDone.push_back(pending);
+        }
+        messageHandlerCondition.notify_all();
+    }
+}
+
+void ThreadMempoolCheck()
+{
+    RenameThread("dystem-txcheck");
+    mempoolcheckqueue.Thread();
+}
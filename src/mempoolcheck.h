@@ -0,0 +1,86 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MEMPOOLCHECK_H
+#define MEMPOOLCHECK_H
+
+#include "main.h"
+#include "net.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+//! Pending transactions above which new ones are checked on the message thread
+static const unsigned int MAX_MEMPOOL_CHECK_QUEUE = 5000;
+
+typedef boost::shared_ptr<CPendingMempoolTx> CPendingMempoolTxRef;
+
+/** Finishes processing a transaction from pfrom once its scripts were checked, with the result in state */
+typedef boost::function<void(CNode* pfrom, const CPendingMempoolTx& pending, bool fValid, CValidationState& state)> MempoolCheckCallback;
+
+/**
+ * Queue of loose transactions whose scripts are checked on worker threads.
+ *
+ * The message handler runs AcceptToMemoryPoolPreChecks() under cs_main and
+ * pushes the transaction with the callback that adds it to the pool, then
+ * moves on without waiting for the scripts. The workers check them without
+ * any lock and wake the message handlers, which run the callbacks of a peer
+ * from ProcessMessages() like CMasternodeSigCheckQueue does. Without
+ * workers, or once MAX_MEMPOOL_CHECK_QUEUE transactions are pending, Push()
+ * refuses the transaction and the caller checks it right away.
+ */
+class CMempoolCheckQueue
+{
+private:
+    struct CPendingCheck {
+        NodeId nodeid;
+        CPendingMempoolTxRef ptx;
+        MempoolCheckCallback callback;
+        CValidationState state;
+        bool fValid;
+    };
+
+    struct CNodeChecks {
+        //! Checks of the node that workers have not finished yet
+        int nInFlight;
+        std::vector<CPendingCheck> vDone;
+
+        CNodeChecks() : nInFlight(0) {}
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    std::deque<CPendingCheck> queue;
+    std::map<NodeId, CNodeChecks> mapNodeChecks;
+    //! Transactions pushed and not yet called back, whoever sent them
+    std::multiset<uint256> setPending;
+    int nWorkers;
+
+public:
+    CMempoolCheckQueue() : nWorkers(0) {}
+
+    bool Push(CNode* pfrom, const CPendingMempoolTxRef& ptx, const MempoolCheckCallback& callback);
+    /** Whether a transaction of that hash waits for its scripts, so that another copy need not be checked */
+    bool IsPending(const uint256& hash);
+    /** Run the callbacks of the finished checks of pfrom */
+    void ProcessCompleted(CNode* pfrom);
+    /** Drop the checks of a disconnected node */
+    void RemoveNode(NodeId nodeid);
+    /** Worker thread loop */
+    void Thread();
+};
+
+extern CMempoolCheckQueue mempoolcheckqueue;
+
+void ThreadMempoolCheck();
+
+#endif
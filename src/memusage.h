@@ -0,0 +1,161 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include "poolresource.h"
+#include "prevector.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+namespace memusage
+{
+/** Compute the total memory used by allocating alloc bytes. */
+static inline size_t MallocUsage(size_t alloc)
+{
+    // Measured on libc6 2.19 on Linux.
+    if (alloc == 0) {
+        return 0;
+    } else if (sizeof(void*) == 8) {
+        return ((alloc + 31) >> 4) << 4;
+    } else if (sizeof(void*) == 4) {
+        return ((alloc + 15) >> 3) << 3;
+    } else {
+        assert(0);
+    }
+}
+
+/**
+ * Compute the memory used for dynamically allocated but owned data structures.
+ * For generic data types, this is *not* recursive. DynamicUsage(vector<vector<int> >)
+ * will compute the memory used for the vector<int>'s, but not for the ints inside.
+ * This is for efficiency reasons, as these functions are intended to be fast. If
+ * application data structures require more accurate inner accounting, they should
+ * iterate themselves, or use more efficient caching + updating on modification.
+ */
+template <typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+static inline size_t DynamicUsage(const std::vector<bool>& v)
+{
+    return MallocUsage((v.capacity() + 7) / 8);
+}
+
+template <unsigned int N, typename X, typename S, typename D>
+static inline size_t DynamicUsage(const prevector<N, X, S, D>& v)
+{
+    return MallocUsage(v.allocated_memory());
+}
+
+template <typename X>
+struct stl_tree_node {
+private:
+    int color;
+    void* parent;
+    void* left;
+    void* right;
+    X x;
+};
+
+template <typename X, typename Y>
+static inline size_t DynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>)) * s.size();
+}
+
+/** Memory a set gains by one more element */
+template <typename X, typename Y>
+static inline size_t IncrementalDynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>));
+}
+
+template <typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+template <typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::multimap<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+template <typename X>
+struct stl_list_node {
+private:
+    void* next;
+    void* prev;
+    X x;
+};
+
+template <typename X>
+static inline size_t DynamicUsage(const std::list<X>& l)
+{
+    return MallocUsage(sizeof(stl_list_node<X>)) * l.size();
+}
+
+/** A deque keeps its elements in 512 byte blocks, plus the map of blocks. */
+template <typename X>
+static inline size_t DynamicUsage(const std::deque<X>& d)
+{
+    size_t nPerBlock = sizeof(X) < 512 ? 512 / sizeof(X) : 1;
+    size_t nBlocks = d.size() / nPerBlock + 1;
+    return MallocUsage(nPerBlock * sizeof(X)) * nBlocks + MallocUsage(sizeof(void*) * (nBlocks + 2));
+}
+
+static inline size_t DynamicUsage(const std::string& s)
+{
+    // short strings are stored inside the object
+    return s.capacity() < 16 ? 0 : MallocUsage(s.capacity() + 1);
+}
+
+// Boost data structures
+
+template <typename X>
+struct boost_unordered_node : private X {
+private:
+    void* ptr;
+};
+
+/** Memory used by a single node of a boost::unordered_map, excluding owned data. */
+template <typename X, typename Y, typename Z, typename E, typename A>
+static inline size_t NodeUsage(const boost::unordered_map<X, Y, Z, E, A>&)
+{
+    return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >));
+}
+
+template <typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
+{
+    return NodeUsage(m) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
+/** A map with its nodes in a CPoolResource uses the pool's chunks, live or not. */
+template <typename X, typename Y, typename Z, typename E>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, E, pool_allocator<std::pair<const X, Y> > >& m)
+{
+    const CPoolResource* pool = m.get_allocator().pool;
+    size_t nNodes = pool ? pool->GetChunkCount() * MallocUsage(pool->GetChunkSize()) : NodeUsage(m) * m.size();
+    return nNodes + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+}
+
+#endif // BITCOIN_MEMUSAGE_H
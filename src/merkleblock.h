@@ -139,6 +139,8 @@ public:
      * thus the filter will likely be modified.
      */
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
+    //! The same with the data elements of the transactions prepared, which can be shared by all peers
+    CMerkleBlock(const CBlock& block, CBloomFilter& filter, const std::vector<CBloomFilterTx>& vTxData);
 
     ADD_SERIALIZE_METHODS;
 
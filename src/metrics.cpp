@@ -0,0 +1,135 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "metrics.h"
+
+#include "httpserver.h"
+#include "main.h"
+#include "masternodeman.h"
+#include "rpcprotocol.h"
+#include "tinyformat.h"
+#include "util.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+CMetric metricBlocksConnected("dystem_blocks_connected_total", "Blocks connected to the active chain", CMetric::COUNTER);
+CMetric metricBlockConnectTime("dystem_block_connect_seconds_total", "Time spent connecting blocks to the active chain", CMetric::COUNTER, 1000000);
+CMetric metricBlockConnectLast("dystem_block_connect_last_seconds", "Time spent connecting the last block", CMetric::GAUGE, 1000000);
+CMetric metricCoinsCacheBytes("dystem_coins_cache_bytes", "Memory used by the coins cache", CMetric::GAUGE);
+CMetric metricCoinsCacheEntries("dystem_coins_cache_entries", "Transactions in the coins cache", CMetric::GAUGE);
+CMetric metricCoinsCacheLookups("dystem_coins_cache_lookups_total", "Transactions looked up in the coins cache", CMetric::COUNTER);
+CMetric metricCoinsCacheHits("dystem_coins_cache_hits_total", "Transactions found in the coins cache without reading the database", CMetric::COUNTER);
+CMetric metricCoinsCacheWarmed("dystem_coins_cache_warmed_total", "Transactions read into the coins cache from coinscache.dat at startup", CMetric::COUNTER);
+CMetric metricCoinsWriteTime("dystem_coins_write_seconds_total", "Time spent writing flushed coins to the database, behind validation", CMetric::COUNTER, 1000000);
+CMetric metricCoinsWriteWaitTime("dystem_coins_write_wait_seconds_total", "Time validation waited for coins still being written", CMetric::COUNTER, 1000000);
+CMetric metricRecentBlockHits("dystem_recent_block_hits_total", "Blocks and undo data of a reorganization found in memory", CMetric::COUNTER);
+CMetric metricRecentBlockMisses("dystem_recent_block_misses_total", "Blocks and undo data of a reorganization read from disk", CMetric::COUNTER);
+CMetric metricMempoolTransactions("dystem_mempool_transactions", "Transactions in the mempool", CMetric::GAUGE);
+CMetric metricMempoolBytes("dystem_mempool_bytes", "Serialized size of the transactions in the mempool", CMetric::GAUGE);
+CMetric metricSigCacheLookups("dystem_sigcache_lookups_total", "Signatures looked up in the signature cache", CMetric::COUNTER);
+CMetric metricSigCacheHits("dystem_sigcache_hits_total", "Signatures found in the signature cache", CMetric::COUNTER);
+CMetric metricScriptMemoLookups("dystem_script_memo_lookups_total", "Block transactions looked up in the script check memo", CMetric::COUNTER);
+CMetric metricScriptMemoHits("dystem_script_memo_hits_total", "Block transactions whose scripts were verified when they entered the mempool", CMetric::COUNTER);
+CMetric metricPeersInbound("dystem_peers_inbound", "Inbound peer connections", CMetric::GAUGE);
+CMetric metricPeersOutbound("dystem_peers_outbound", "Outbound peer connections", CMetric::GAUGE);
+CMetric metricMasternodeSyncAsset("dystem_masternode_sync_asset", "Masternode sync stage, as in mnsync status", CMetric::GAUGE);
+CMetric metricPostTipRuns("dystem_posttip_runs_total", "Runs of the follow-up tasks of new blocks", CMetric::COUNTER);
+CMetric metricPostTipPaymentsTime("dystem_posttip_payments_seconds_total", "Time spent on masternode payment votes after new blocks", CMetric::COUNTER, 1000000);
+CMetric metricPostTipBudgetTime("dystem_posttip_budget_seconds_total", "Time spent on budget updates after new blocks", CMetric::COUNTER, 1000000);
+CMetric metricPostTipMultiSendTime("dystem_posttip_multisend_seconds_total", "Time spent on MultiSend after new blocks", CMetric::COUNTER, 1000000);
+CMetric metricPostTipCombineDustTime("dystem_posttip_combinedust_seconds_total", "Time spent combining dust after new blocks", CMetric::COUNTER, 1000000);
+
+static const CMetric* const vMetrics[] = {
+    &metricBlocksConnected,
+    &metricBlockConnectTime,
+    &metricBlockConnectLast,
+    &metricCoinsCacheBytes,
+    &metricCoinsCacheEntries,
+    &metricCoinsCacheLookups,
+    &metricCoinsCacheHits,
+    &metricCoinsCacheWarmed,
+    &metricCoinsWriteTime,
+    &metricCoinsWriteWaitTime,
+    &metricRecentBlockHits,
+    &metricRecentBlockMisses,
+    &metricMempoolTransactions,
+    &metricMempoolBytes,
+    &metricSigCacheLookups,
+    &metricSigCacheHits,
+    &metricScriptMemoLookups,
+    &metricScriptMemoHits,
+    &metricPeersInbound,
+    &metricPeersOutbound,
+    &metricMasternodeSyncAsset,
+    &metricPostTipRuns,
+    &metricPostTipPaymentsTime,
+    &metricPostTipBudgetTime,
+    &metricPostTipMultiSendTime,
+    &metricPostTipCombineDustTime,
+};
+
+static void WriteMetricHeader(std::string& strReply, const char* pszName, const char* pszHelp, CMetric::Type type)
+{
+    strReply += strprintf("# HELP %s %s\n# TYPE %s %s\n", pszName, pszHelp, pszName, type == CMetric::COUNTER ? "counter" : "gauge");
+}
+
+static void WriteMetric(std::string& strReply, const char* pszName, const char* pszHelp, CMetric::Type type, int64_t nValue)
+{
+    WriteMetricHeader(strReply, pszName, pszHelp, type);
+    strReply += strprintf("%s %d\n", pszName, nValue);
+}
+
+static bool HTTPReq_Metrics(HTTPRequest* req, const std::string&)
+{
+    if (req->GetRequestMethod() != HTTPRequest::GET) {
+        req->WriteReply(HTTP_BAD_METHOD, "Only GET requests allowed");
+        return false;
+    }
+
+    std::string strReply;
+    for (unsigned int i = 0; i < ARRAYLEN(vMetrics); i++) {
+        const CMetric& metric = *vMetrics[i];
+        WriteMetricHeader(strReply, metric.pszName, metric.pszHelp, metric.type);
+        if (metric.nScale == 1)
+            strReply += strprintf("%s %d\n", metric.pszName, metric.Get());
+        else
+            strReply += strprintf("%s %.6f\n", metric.pszName, (double)metric.Get() / metric.nScale);
+    }
+
+    // Values other code already publishes for lock-free readers
+    CChainTipSnapshot tip = GetChainTipSnapshot();
+    WriteMetric(strReply, "dystem_tip_height", "Height of the active chain tip", CMetric::GAUGE, tip.nHeight);
+    WriteMetric(strReply, "dystem_tip_time_seconds", "Block time of the active chain tip", CMetric::GAUGE, tip.nTime);
+
+    CMasternodeCountSnapshot counts = mnodeman.GetCountSnapshot();
+    WriteMetric(strReply, "dystem_masternodes", "Masternodes in the list", CMetric::GAUGE, counts.nTotal);
+    WriteMetric(strReply, "dystem_masternodes_enabled", "Enabled masternodes in the list", CMetric::GAUGE, counts.nEnabled);
+
+    // Each queue is locked on its own for a moment, no request waits for this
+    std::vector<HTTPWorkQueueInfo> vQueues = GetHTTPWorkQueueInfo();
+    WriteMetricHeader(strReply, "dystem_http_work_queue_depth", "Requests waiting in the HTTP work queue", CMetric::GAUGE);
+    BOOST_FOREACH (const HTTPWorkQueueInfo& info, vQueues)
+        strReply += strprintf("dystem_http_work_queue_depth{queue=\"%s\"} %u\n", info.strName, info.nDepth);
+    WriteMetricHeader(strReply, "dystem_http_work_queue_rejected_total", "Requests rejected because the HTTP work queue was full", CMetric::COUNTER);
+    BOOST_FOREACH (const HTTPWorkQueueInfo& info, vQueues)
+        strReply += strprintf("dystem_http_work_queue_rejected_total{queue=\"%s\"} %u\n", info.strName, info.nRejected);
+
+    req->WriteHeader("Content-Type", "text/plain; version=0.0.4");
+    req->WriteReply(HTTP_OK, strReply);
+    return true;
+}
+
+bool StartHTTPMetrics()
+{
+    RegisterHTTPHandler("/metrics", true, HTTPReq_Metrics, HTTP_WORK_REST);
+    return true;
+}
+
+void StopHTTPMetrics()
+{
+    UnregisterHTTPHandler("/metrics", true);
+}
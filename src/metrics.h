@@ -0,0 +1,79 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_METRICS_H
+#define BITCOIN_METRICS_H
+
+#include <atomic>
+#include <stdint.h>
+
+//! -metrics default
+static const bool DEFAULT_METRICS = false;
+
+/**
+ * A value served on /metrics. It is stored where it changes, with a relaxed
+ * atomic write, so the endpoint reads it without taking any lock.
+ */
+class CMetric
+{
+public:
+    enum Type {
+        GAUGE,
+        COUNTER
+    };
+
+    const char* const pszName;
+    const char* const pszHelp;
+    const Type type;
+    //! The value is served divided by this, e.g. 1000000 for microseconds served as seconds
+    const int64_t nScale;
+
+    CMetric(const char* pszNameIn, const char* pszHelpIn, Type typeIn, int64_t nScaleIn = 1) : pszName(pszNameIn), pszHelp(pszHelpIn), type(typeIn), nScale(nScaleIn), nValue(0) {}
+
+    void Set(int64_t n) { nValue.store(n, std::memory_order_relaxed); }
+    void Add(int64_t n = 1) { nValue.fetch_add(n, std::memory_order_relaxed); }
+    int64_t Get() const { return nValue.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> nValue;
+
+    CMetric(const CMetric&);
+    CMetric& operator=(const CMetric&);
+};
+
+extern CMetric metricBlocksConnected;
+extern CMetric metricBlockConnectTime;
+extern CMetric metricBlockConnectLast;
+extern CMetric metricCoinsCacheBytes;
+extern CMetric metricCoinsCacheEntries;
+extern CMetric metricCoinsCacheLookups;
+extern CMetric metricCoinsCacheHits;
+extern CMetric metricCoinsCacheWarmed;
+extern CMetric metricCoinsWriteTime;
+extern CMetric metricCoinsWriteWaitTime;
+extern CMetric metricRecentBlockHits;
+extern CMetric metricRecentBlockMisses;
+extern CMetric metricMempoolTransactions;
+extern CMetric metricMempoolBytes;
+extern CMetric metricSigCacheLookups;
+extern CMetric metricSigCacheHits;
+extern CMetric metricScriptMemoLookups;
+extern CMetric metricScriptMemoHits;
+extern CMetric metricPeersInbound;
+extern CMetric metricPeersOutbound;
+extern CMetric metricMasternodeSyncAsset;
+extern CMetric metricPostTipRuns;
+extern CMetric metricPostTipPaymentsTime;
+extern CMetric metricPostTipBudgetTime;
+extern CMetric metricPostTipMultiSendTime;
+extern CMetric metricPostTipCombineDustTime;
+
+/** Serve the metrics in the Prometheus text format on /metrics.
+ * Precondition; HTTP has been started.
+ */
+bool StartHTTPMetrics();
+/** Stop serving /metrics */
+void StopHTTPMetrics();
+
+#endif // BITCOIN_METRICS_H
@@ -10,6 +10,7 @@
 
 #include "amount.h"
 #include "hash.h"
+#include "kernel.h"
 #include "main.h"
 #include "masternode-sync.h"
 #include "net.h"
@@ -25,7 +26,6 @@
 #include "masternode-payments.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -34,53 +34,412 @@ using namespace std;
 // DYSTEMMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
+namespace
 {
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+/**
+ * A mempool transaction some of whose ancestors are already in the block
+ * being assembled: its ancestor state, less those ancestors.
+ */
+struct CTxMemPoolModifiedEntry {
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry) : iter(entry), nSizeWithAncestors(entry->GetSizeWithAncestors()), nModFeesWithAncestors(entry->GetModFeesWithAncestors()) {}
+
+    const CTransaction& GetTx() const { return iter->GetTx(); }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+};
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
     {
+        return entry.iter;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash>,
+        // sorted by modified ancestor score
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareTxMemPoolEntryByAncestorScore> > >
+    indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+    void operator()(CTxMemPoolModifiedEntry& e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+    }
+
+private:
+    CTxMemPool::txiter iter;
+};
+
+/** Parents before children */
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+struct TxCoinAgePriorityCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByFeeRate()(*(b.second), *(a.second)); // Reverse order to make sort less than
+        return a.first < b.first;
+    }
+};
+
+/**
+ * The mempool transactions chosen for the last block template. Templates for
+ * the same tip are asked for over and over (getblocktemplate polls, the stake
+ * loop), and the selection only changes when the mempool does, so it is
+ * reused until then. The inputs checked with CheckInputs on top of the tip
+ * stay valid while the tip does, and are not checked again in a later
+ * selection either. Protected by cs_main.
+ */
+struct CBlockTemplateCache {
+    uint256 hashPrevBlock;
+    //! Inputs of these transactions passed CheckInputs on top of hashPrevBlock
+    std::set<uint256> setInputsChecked;
+
+    bool fValid;
+    unsigned int nTransactionsUpdated;
+    int64_t nTime;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    std::vector<CTransaction> vtx;
+    std::vector<CAmount> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    CAmount nFees;
+    uint64_t nBlockSize;
+
+    CBlockTemplateCache() : fValid(false), nTransactionsUpdated(0), nTime(0), nBlockMaxSize(0), nBlockPrioritySize(0), nBlockMinSize(0), nFees(0), nBlockSize(0) {}
+};
+
+//! Time locked transactions can become final without the mempool changing
+const int64_t MAX_TEMPLATE_CACHE_AGE = 30;
+
+CBlockTemplateCache templateCache;
+
+/**
+ * Fills a block template with mempool transactions. The high-priority area
+ * of the block is filled by coin age priority, the rest by walking the
+ * ancestor score index of the mempool, so that a transaction comes in
+ * together with the ancestors it needs. Transactions are still checked
+ * against a view of the new block, but only those that are chosen.
+ * cs_main and mempool.cs must be held.
+ */
+class CBlockAssembler
 {
-    bool byFee;
+private:
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+    CCoinsViewCache& view;
+    std::set<uint256>& setInputsChecked;
+    const int nHeight;
 
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    bool fPrintPriority;
+
+    CTxMemPool::setEntries inBlock;
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+public:
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+
+    CBlockAssembler(CBlockTemplate* pblocktemplateIn, CCoinsViewCache& viewIn, std::set<uint256>& setInputsCheckedIn, int nHeightIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn)
+        : pblocktemplate(pblocktemplateIn), pblock(&pblocktemplateIn->block), view(viewIn), setInputsChecked(setInputsCheckedIn), nHeight(nHeightIn),
+          nBlockMaxSize(nBlockMaxSizeIn), nBlockPrioritySize(nBlockPrioritySizeIn), nBlockMinSize(nBlockMinSizeIn),
+          nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0)
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+        fPrintPriority = GetBoolArg("-printpriority", false);
+    }
+
+    void AddPriorityTxs();
+    void AddPackageTxs();
+
+private:
+    bool TestForBlock(const CTransaction& tx, CCoinsViewCache& viewTx, unsigned int nSigOpsPending, unsigned int& nTxSigOps, CAmount& nTxFees) const;
+    void AddToBlock(CTxMemPool::txiter iter, unsigned int nTxSigOps, CAmount nTxFees, double dPriority);
+    bool ParentsInBlock(CTxMemPool::txiter iter) const;
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx) const;
+};
+
+bool CBlockAssembler::TestForBlock(const CTransaction& tx, CCoinsViewCache& viewTx, unsigned int nSigOpsPending, unsigned int& nTxSigOps, CAmount& nTxFees) const
+{
+    if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+        return false;
+
+    // Legacy limits on sigOps:
+    nTxSigOps = GetLegacySigOpCount(tx);
+    if (nBlockSigOps + nSigOpsPending + nTxSigOps >= MAX_BLOCK_SIGOPS_CURRENT)
+        return false;
+
+    if (!viewTx.HaveInputs(tx))
+        return false;
+
+    nTxFees = viewTx.GetValueIn(tx) - tx.GetValueOut();
+
+    nTxSigOps += GetP2SHSigOpCount(tx, viewTx);
+    if (nBlockSigOps + nSigOpsPending + nTxSigOps >= MAX_BLOCK_SIGOPS_CURRENT)
+        return false;
+
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    // The outputs a transaction spends never change, so the result holds
+    // as long as the height does.
+    CValidationState state;
+    if (!setInputsChecked.count(tx.GetHash())) {
+        if (!CheckInputs(tx, state, viewTx, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            return false;
+        setInputsChecked.insert(tx.GetHash());
+    }
+
+    CTxUndo txundo;
+    UpdateCoins(tx, state, viewTx, txundo, nHeight);
+    return true;
+}
+
+void CBlockAssembler::AddToBlock(CTxMemPool::txiter iter, unsigned int nTxSigOps, CAmount nTxFees, double dPriority)
+{
+    pblock->vtx.push_back(iter->GetTx());
+    pblocktemplate->vTxFees.push_back(nTxFees);
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += iter->GetTxSize();
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+    inBlock.insert(iter);
+
+    if (fPrintPriority) {
+        LogPrintf("priority %.1f fee %s txid %s\n",
+            dPriority, CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(), iter->GetTx().GetHash().ToString());
+    }
+}
+
+bool CBlockAssembler::ParentsInBlock(CTxMemPool::txiter iter) const
+{
+    BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+        if (!inBlock.count(parent))
+            return false;
+    }
+    return true;
+}
+
+void CBlockAssembler::AddPriorityTxs()
+{
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // Priority grows with the height at a different rate for every
+    // transaction, so it cannot be kept in an index; it is cheap to compute
+    // from the entry though.
+    std::vector<TxCoinAgePriority> vecPriority;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy = 0;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    TxCoinAgePriorityCompare comparer;
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+    // Transactions waiting for their mempool parents to get into the block
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    while (!vecPriority.empty()) {
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().first;
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        if (inBlock.count(iter))
+            continue;
+        if (!ParentsInBlock(iter)) {
+            waitPriMap.insert(std::make_pair(iter, dPriority));
+            continue;
+        }
+
+        // Prioritise by fee once past the priority size or we run out of high-priority
+        // transactions:
+        unsigned int nTxSize = iter->GetTxSize();
+        if (nBlockSize + nTxSize >= nBlockPrioritySize || !AllowFree(dPriority))
+            break;
+
+        // Size limits
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            continue;
+
+        CCoinsViewCache viewTx(&view);
+        unsigned int nTxSigOps = 0;
+        CAmount nTxFees = 0;
+        if (!TestForBlock(iter->GetTx(), viewTx, 0, nTxSigOps, nTxFees))
+            continue;
+        viewTx.Flush();
+        AddToBlock(iter, nTxSigOps, nTxFees, dPriority);
+
+        // Add transactions that depend on this one to the priority queue
+        BOOST_FOREACH (CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+            std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator wpiter = waitPriMap.find(child);
+            if (wpiter != waitPriMap.end() && ParentsInBlock(child)) {
+                vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                waitPriMap.erase(wpiter);
+            }
+        }
+    }
+}
+
+void CBlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx) const
+{
+    BOOST_FOREACH (CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        BOOST_FOREACH (CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                update_for_parent_inclusion update(it);
+                update(modEntry);
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+void CBlockAssembler::AddPackageTxs()
+{
+    // Packages whose ancestor state changed because some of their ancestors
+    // are in the block already; they are ranked by their remaining state.
+    indexed_modified_transaction_set mapModifiedTx;
+    // Packages that did not fit or were invalid
+    CTxMemPool::setEntries failedTx;
+
+    // Packages of the priority transactions
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+        // Skip entries that are in the block, failed already or are ranked
+        // through mapModifiedTx
+        if (mi != mempool.mapTx.get<ancestor_score>().end()) {
+            CTxMemPool::txiter it = mempool.mapTx.project<0>(mi);
+            if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it)) {
+                ++mi;
+                continue;
+            }
+        }
+
+        // Take the better of the next mapTx entry and the best modified entry
+        CTxMemPool::txiter iter;
+        bool fUsingModified = false;
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            iter = modit->iter;
+            fUsingModified = true;
         } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                CompareTxMemPoolEntryByAncestorScore()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                ++mi;
+            }
+        }
+        assert(!inBlock.count(iter));
+
+        uint64_t nPackageSize = fUsingModified ? modit->nSizeWithAncestors : iter->GetSizeWithAncestors();
+        CAmount nPackageFees = fUsingModified ? modit->nModFeesWithAncestors : iter->GetModFeesWithAncestors();
+
+        // Skip free transactions if we're past the minimum block size; the
+        // packages that follow pay even less
+        if (nPackageFees < ::minRelayTxFee.GetFee(nPackageSize) && nBlockSize >= nBlockMinSize)
+            return;
+
+        // Size limits
+        if (nBlockSize + nPackageSize >= nBlockMaxSize) {
+            if (fUsingModified)
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+            failedTx.insert(iter);
+            continue;
+        }
+
+        CTxMemPool::setEntries ancestors;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors);
+        std::vector<CTxMemPool::txiter> vPackage;
+        BOOST_FOREACH (CTxMemPool::txiter it, ancestors) {
+            if (!inBlock.count(it))
+                vPackage.push_back(it);
         }
+        vPackage.push_back(iter);
+        std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+
+        // The package goes in as a whole or not at all
+        CCoinsViewCache viewPackage(&view);
+        std::vector<unsigned int> vTxSigOps(vPackage.size());
+        std::vector<CAmount> vTxFees(vPackage.size());
+        unsigned int nPackageSigOps = 0;
+        bool fValid = true;
+        for (unsigned int i = 0; i < vPackage.size() && fValid; i++) {
+            fValid = TestForBlock(vPackage[i]->GetTx(), viewPackage, nPackageSigOps, vTxSigOps[i], vTxFees[i]);
+            nPackageSigOps += vTxSigOps[i];
+        }
+        if (!fValid) {
+            if (fUsingModified)
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+            failedTx.insert(iter);
+            continue;
+        }
+        viewPackage.Flush();
+
+        CTxMemPool::setEntries added;
+        for (unsigned int i = 0; i < vPackage.size(); i++) {
+            AddToBlock(vPackage[i], vTxSigOps[i], vTxFees[i], vPackage[i]->GetPriority(nHeight));
+            mapModifiedTx.erase(vPackage[i]);
+            added.insert(vPackage[i]);
+        }
+        UpdatePackagesForAdded(added, mapModifiedTx);
     }
-};
+}
+} // anon namespace
 
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
@@ -138,7 +497,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             if (pwallet->CreateCoinStake(*pwallet, pblock->nBits, nSearchTime - nLastCoinStakeSearchTime, txCoinStake, nTxNewTime)) {
                 pblock->nTime = nTxNewTime;
                 pblock->vtx[0].vout[0].SetEmpty();
-                pblock->vtx.push_back(CTransaction(txCoinStake));
+                pblock->vtx.push_back(CTransaction(std::move(txCoinStake)));
                 fStakeFound = true;
             }
             nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
@@ -170,180 +529,55 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
     {
         LOCK2(cs_main, mempool.cs);
 
+        int64_t nTimeStart = GetTimeMicros();
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            for (const CTxIn& txin : tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
 
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
+        if (templateCache.hashPrevBlock != pindexPrev->GetBlockHash()) {
+            templateCache.hashPrevBlock = pindexPrev->GetBlockHash();
+            templateCache.setInputsChecked.clear();
+            templateCache.fValid = false;
         }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        vector<CBigNum> vBlockSerials;
-        vector<CBigNum> vTxSerials;
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            for (const CBigNum bnSerial : vTxSerials)
-                vBlockSerials.emplace_back(bnSerial);
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+        bool fCached = templateCache.fValid &&
+                       templateCache.nTransactionsUpdated == mempool.GetTransactionsUpdated() &&
+                       GetTime() - templateCache.nTime < MAX_TEMPLATE_CACHE_AGE &&
+                       templateCache.nBlockMaxSize == nBlockMaxSize &&
+                       templateCache.nBlockPrioritySize == nBlockPrioritySize &&
+                       templateCache.nBlockMinSize == nBlockMinSize;
+
+        uint64_t nBlockTx;
+        uint64_t nBlockSize;
+        if (fCached) {
+            pblock->vtx.insert(pblock->vtx.end(), templateCache.vtx.begin(), templateCache.vtx.end());
+            pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), templateCache.vTxFees.begin(), templateCache.vTxFees.end());
+            pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), templateCache.vTxSigOps.begin(), templateCache.vTxSigOps.end());
+            nFees = templateCache.nFees;
+            nBlockTx = templateCache.vtx.size();
+            nBlockSize = templateCache.nBlockSize;
+        } else {
+            size_t nFirstTx = pblock->vtx.size();
+            CCoinsViewCache view(pcoinsTip);
+            CBlockAssembler assembler(pblocktemplate.get(), view, templateCache.setInputsChecked, nHeight, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+            assembler.AddPriorityTxs();
+            assembler.AddPackageTxs();
+            nFees = assembler.nFees;
+            nBlockTx = assembler.nBlockTx;
+            nBlockSize = assembler.nBlockSize;
+
+            templateCache.fValid = true;
+            templateCache.nTransactionsUpdated = mempool.GetTransactionsUpdated();
+            templateCache.nTime = GetTime();
+            templateCache.nBlockMaxSize = nBlockMaxSize;
+            templateCache.nBlockPrioritySize = nBlockPrioritySize;
+            templateCache.nBlockMinSize = nBlockMinSize;
+            templateCache.vtx.assign(pblock->vtx.begin() + nFirstTx, pblock->vtx.end());
+            templateCache.vTxFees.assign(pblocktemplate->vTxFees.begin() + nFirstTx, pblocktemplate->vTxFees.end());
+            templateCache.vTxSigOps.assign(pblocktemplate->vTxSigOps.begin() + nFirstTx, pblocktemplate->vTxSigOps.end());
+            templateCache.nFees = nFees;
+            templateCache.nBlockSize = nBlockSize;
         }
+        LogPrint("bench", "CreateNewBlock(): %u of %u mempool transactions selected in %.2fms%s\n",
+            nBlockTx, mempool.mapTx.size(), (GetTimeMicros() - nTimeStart) * 0.001, fCached ? " (cached)" : "");
 
         if (!fProofOfStake) {
             //Masternode and general budget payments
@@ -360,7 +594,10 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         LogPrint("net","CreateNewBlock(): total size %u\n", nBlockSize);
 
         // Compute final coinbase transaction.
-        pblock->vtx[0].vin[0].scriptSig = CScript() << nHeight << OP_0;
+        // Through a CMutableTransaction, which keeps the hash and size of vtx[0] right
+        CMutableTransaction txCoinbase(pblock->vtx[0]);
+        txCoinbase.vin[0].scriptSig = CScript() << nHeight << OP_0;
+        pblock->vtx[0] = CTransaction(std::move(txCoinbase));
         if (!fProofOfStake) {
             pblock->vtx[0] = txNew;
             pblocktemplate->vTxFees[0] = -nFees;
@@ -392,8 +629,8 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(txCoinbase.vin[0].scriptSig.size() <= 100);
 
-    pblock->vtx[0] = txCoinbase;
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->vtx[0] = CTransaction(std::move(txCoinbase));
+    pblock->hashMerkleRoot = pblock->ComputeMerkleRoot();
 }
 
 #ifdef ENABLE_WALLET
@@ -449,6 +686,19 @@ bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 
 bool fGenerateBitcoins = false;
 
+//! Seconds the stake minter sleeps when nothing it waits for has a known time
+static const int64_t STAKE_MINTER_IDLE_WAIT = 30;
+
+/** When the stake minter waiting for stakeable outputs should look again, as GetTime() */
+static int64_t NextStakeMinterWake(CWallet* pwallet)
+{
+    int64_t nWake = GetTime() + STAKE_MINTER_IDLE_WAIT;
+    int64_t nMature = pwallet->GetNextStakeMaturityTime();
+    if (nMature > 0)
+        nWake = std::min(nWake, GetTime() + nMature - GetAdjustedTime());
+    return nWake;
+}
+
 // ***TODO*** that part changed in bitcoin, we are using a mix with old one here for now
 
 void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
@@ -464,31 +714,38 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
     //control the amount of times the client will check for mintable coins
     static bool fMintableCoins = false;
     static int nMintableLastCheck = 0;
+    static unsigned int nMintableEvents = 0;
 
     while (fGenerateBitcoins || fProofOfStake) {
-        if (fProofOfStake && (GetTime() - nMintableLastCheck > 5 * 60)) // 5 minute check time
-        {
-            nMintableLastCheck = GetTime();
-            fMintableCoins = pwallet->MintableCoins();
-        }
+        // The stake minter sleeps until a new tip, an unlock, a maturing output or a new hash window
+        const unsigned int nStakeEvents = GetStakeMinterEvents();
 
         if (fProofOfStake) {
             if (chainActive.Tip()->nHeight < Params().LAST_POW_BLOCK()) {
-                MilliSleep(5000);
+                WaitForStakeMinterEvent(nStakeEvents, GetTime() + STAKE_MINTER_IDLE_WAIT);
                 continue;
             }
 
+            // look again on a wake-up, when waiting for outputs to mature, and every 5 minutes
+            if (!fMintableCoins || nStakeEvents != nMintableEvents || GetTime() - nMintableLastCheck > 5 * 60)
+            {
+                nMintableLastCheck = GetTime();
+                nMintableEvents = nStakeEvents;
+                fMintableCoins = pwallet->MintableCoins();
+            }
+
             if (chainActive.Tip()->nTime < Params().GenesisBlock().nTime || vNodes.empty() || pwallet->IsLocked() || !fMintableCoins || nReserveBalance >= pwallet->GetBalance()) {
                 nLastCoinStakeSearchInterval = 0;
-                MilliSleep(30000);
+                WaitForStakeMinterEvent(nStakeEvents, NextStakeMinterWake(pwallet));
                 continue;
             }
 
             if (mapHashedBlocks.count(chainActive.Tip()->nHeight)) //search our map of hashed blocks, see if bestblock has been hashed yet
             {
-                if (GetTime() - mapHashedBlocks[chainActive.Tip()->nHeight] < max(pwallet->nHashInterval, (unsigned int)1)) // wait half of the nHashDrift with max wait of 3 minutes
-                {
-                    MilliSleep(30000);
+                // the timestamps of the last search stay hashed until the next hash interval
+                int64_t nNextHash = mapHashedBlocks[chainActive.Tip()->nHeight] + max(pwallet->nHashInterval, (unsigned int)1);
+                if (GetTime() < nNextHash) {
+                    WaitForStakeMinterEvent(nStakeEvents, nNextHash);
                     continue;
                 }
             }
@@ -497,14 +754,20 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
         //
         // Create new block
         //
+        // The wallet must have seen the spends of the tip, its stake inputs come from it
+        SyncWithValidationInterfaceQueue();
         unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
         CBlockIndex* pindexPrev = chainActive.Tip();
         if (!pindexPrev)
             continue;
 
         unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, pwallet, fProofOfStake));
-        if (!pblocktemplate.get())
+        if (!pblocktemplate.get()) {
+            // No output could be hashed on this tip, nothing changes before the next wake-up
+            if (fProofOfStake && !mapHashedBlocks.count(chainActive.Tip()->nHeight))
+                WaitForStakeMinterEvent(nStakeEvents, NextStakeMinterWake(pwallet));
             continue;
+        }
 
         CBlock* pblock = &pblocktemplate->block;
         IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
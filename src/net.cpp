@@ -14,6 +14,8 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
+#include "memusage.h"
+#include "metrics.h"
 #include "miner.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
@@ -26,6 +28,12 @@
 #include <fcntl.h>
 #endif
 
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -33,7 +41,10 @@
 #include <miniupnpc/upnperrors.h>
 #endif
 
+#include <math.h>
+
 #include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
@@ -90,7 +101,9 @@ CCriticalSection cs_vNodes;
 map<CInv, CDataStream> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
+CRelayCache relayCache(DEFAULT_RELAY_CACHE_BYTES);
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+CCriticalSection cs_mapAlreadyAskedFor;
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -226,7 +239,7 @@ void AdvertizeLocal(CNode* pnode)
         // tells us that it sees us as in case it has a better idea of our
         // address than we do.
         if (IsPeerAddrLocalGood(pnode) && (!addrLocal.IsRoutable() ||
-                                              GetRand((GetnScore(addrLocal) > LOCAL_MANUAL) ? 8 : 2) == 0)) {
+                                              GetInsecureRand((GetnScore(addrLocal) > LOCAL_MANUAL) ? 8 : 2) == 0)) {
             addrLocal.SetIP(pnode->addrLocal);
         }
         if (addrLocal.IsRoutable()) {
@@ -338,8 +351,15 @@ void AddressCurrentlyConnected(const CService& addr)
 
 uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+CCriticalSection CNode::cs_totalMsgStats;
+mapMsgCmdStats CNode::mapTotalMsgStats;
+
+const std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -384,7 +404,7 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
-CNode* ConnectNode(CAddress addrConnect, const char* pszDest)
+CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool fConnectAsync)
 {
     if (pszDest == NULL) {
         // we clean masternode connections in CMasternodeMan::ProcessMasternodeConnections()
@@ -405,11 +425,21 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest)
         pszDest ? pszDest : addrConnect.ToString(),
         pszDest ? 0.0 : (double)(GetAdjustedTime() - addrConnect.nTime) / 3600.0);
 
-    // Connect
+    // Connect. A direct connection can complete in the socket handler, so that
+    // the attempts of the connection threads run side by side; names and proxies
+    // still block for the lookup and the SOCKS handshake.
     SOCKET hSocket;
     bool proxyConnectionFailed = false;
-    if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
-                  ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed)) {
+    bool fPending = false;
+    bool fConnected;
+    proxyType proxy;
+    if (fConnectAsync && !pszDest && !GetProxy(addrConnect.GetNetwork(), proxy))
+        fConnected = ConnectSocketStart(addrConnect, hSocket, fPending);
+    else if (pszDest)
+        fConnected = ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed);
+    else
+        fConnected = ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed);
+    if (fConnected) {
         if (!IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
@@ -419,7 +449,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest)
         addrman.Attempt(addrConnect);
 
         // Add node
-        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false, fPending);
         pnode->AddRef();
 
         {
@@ -679,6 +709,10 @@ void CNode::copyStats(CNodeStats& stats)
     X(nSendBytes);
     X(nRecvBytes);
     X(fWhitelisted);
+    {
+        LOCK(cs_msgStats);
+        X(mapMsgStats);
+    }
 
     // It is common for nodes with good ping times to suddenly become lagged,
     // due to a new block arriving or other large transfer.
@@ -731,7 +765,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            messageHandlerCondition.notify_all();
         }
     }
 
@@ -741,19 +775,20 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&hdrbuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
     // deserialize to CMessageHeader
     try {
-        hdrbuf >> hdr;
+        CMemoryReader reader(hdrbuf, CMessageHeader::HEADER_SIZE, vRecv.GetType(), vRecv.GetVersion());
+        reader >> hdr;
     } catch (const std::exception&) {
         return -1;
     }
@@ -778,32 +813,120 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
         vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // Nothing to copy if the bytes were received in place
+    if (pch != &vRecv[nDataPos])
+        memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+char* CNetMessage::prepareData(unsigned int& nSpace)
+{
+    assert(in_data && !complete());
+    if (vRecv.size() <= nDataPos)
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + 256 * 1024));
+    nSpace = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
+
+// requires LOCK(cs_vSend)
+static void TakeSendQueue(CNode* pnode)
+{
+    // The queue is newest first
+    CSendQueueEntry* pentry = pnode->pSendQueue.exchange(NULL);
+    CSendQueueEntry* pfirst = NULL;
+    while (pentry != NULL) {
+        CSendQueueEntry* pnext = pentry->pnext;
+        pentry->pnext = pfirst;
+        pfirst = pentry;
+        pentry = pnext;
+    }
+
+    std::deque<CSerializeData>& vSendMsg = pnode->vSendMsg;
+    while (pfirst != NULL) {
+        pentry = pfirst;
+        pfirst = pentry->pnext;
+
+        // The buffer on the wire stays first; priority buffers go behind it
+        // and the earlier priority ones, bulk buffers at the end
+        if (pnode->nSendOffset > 0)
+            pnode->nSendPriority = std::max(pnode->nSendPriority, (size_t)1);
+        size_t nLaneBegin = pentry->fPriority ? 0 : pnode->nSendPriority;
+        size_t nLaneEnd = pentry->fPriority ? pnode->nSendPriority : vSendMsg.size();
+
+        // Small messages share buffers, so that many of them cost one
+        // allocation and go out together
+        size_t nMessageSize = pentry->ssMsg.size();
+        if (nLaneEnd == nLaneBegin || vSendMsg[nLaneEnd - 1].size() + nMessageSize > SEND_COALESCE_SIZE) {
+            std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.begin() + nLaneEnd, CSerializeData());
+            if (nMessageSize < SEND_COALESCE_SIZE) {
+                it->swap(pnode->sendSpare);
+                it->reserve(SEND_COALESCE_SIZE);
+            }
+            nLaneEnd++;
+            if (pentry->fPriority)
+                pnode->nSendPriority++;
+        }
+        pentry->ssMsg.GetAndClear(vSendMsg[nLaneEnd - 1]);
+        delete pentry;
+    }
+}
 
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
+    if (pnode->fConnecting)
+        return;
+
+    TakeSendQueue(pnode);
     std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert(it->size() > pnode->nSendOffset);
+#ifdef WIN32
+        size_t nOffered = it->size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &(*it)[pnode->nSendOffset], nOffered, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand the kernel as many of the queued buffers as one call takes
+        struct iovec vIov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nOffered = 0;
+        for (std::deque<CSerializeData>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++itIov, ++nIov) {
+            size_t nOffset = nIov == 0 ? pnode->nSendOffset : 0;
+            vIov[nIov].iov_base = &(*itIov)[nOffset];
+            vIov[nIov].iov_len = itIov->size() - nOffset;
+            nOffered += vIov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vIov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nRemaining = it->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= it->size();
+                // Keep one coalescing buffer for the next messages rather than freeing it
+                if (pnode->sendSpare.capacity() == 0 && it->capacity() <= SEND_COALESCE_SIZE) {
+                    it->clear();
+                    pnode->sendSpare.swap(*it);
+                }
                 it++;
-            } else {
+            }
+            if ((size_t)nBytes < nOffered) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -819,20 +942,207 @@ void SocketSendData(CNode* pnode)
             // couldn't send anything at all
             break;
         }
+
+        // Messages pushed meanwhile go out in the same call
+        if (it == pnode->vSendMsg.end() && pnode->pSendQueue.load() != NULL) {
+            pnode->vSendMsg.clear();
+            pnode->nSendPriority = 0;
+            TakeSendQueue(pnode);
+            it = pnode->vSendMsg.begin();
+        }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (it == pnode->vSendMsg.end())
         assert(pnode->nSendOffset == 0);
-        assert(pnode->nSendSize == 0);
-    }
+    size_t nSent = it - pnode->vSendMsg.begin();
+    pnode->nSendPriority -= std::min(pnode->nSendPriority, nSent);
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static list<CNode*> vNodesDisconnected;
 
+namespace
+{
+/**
+ * Readiness notification for ThreadSocketHandler. With epoll or kqueue sockets
+ * are registered once and only a change of interest costs a system call; the
+ * select() fallback rebuilds its fd_sets from the interest given every round.
+ */
+class CSocketEvents
+{
+public:
+    enum {
+        SOCKET_RECV = 1,
+        SOCKET_SEND = 2,
+    };
+
+    std::set<SOCKET> setRecv;
+    std::set<SOCKET> setSend;
+    std::set<SOCKET> setError;
+
+    CSocketEvents() : fdPoll(-1)
+    {
+#if defined(HAVE_SYS_EPOLL_H)
+        fdPoll = epoll_create1(EPOLL_CLOEXEC);
+#elif defined(HAVE_SYS_EVENT_H)
+        fdPoll = kqueue();
+#endif
+        if (fdPoll == -1)
+            LogPrintf("Using select() for socket events\n");
+    }
+
+    ~CSocketEvents()
+    {
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+        if (fdPoll != -1)
+            close(fdPoll);
+#endif
+    }
+
+    /** Sockets above FD_SETSIZE can only be served by an event backend */
+    bool IsSupported(SOCKET hSocket) const
+    {
+        return fdPoll != -1 || IsSelectableSocket(hSocket);
+    }
+
+    /**
+     * Watch hSocket for nEvents. nRegistered holds what the poller currently
+     * knows about the socket (-1 if nothing) and is updated on success.
+     */
+    void Watch(SOCKET hSocket, int& nRegistered, int nEvents)
+    {
+        if (fdPoll == -1) {
+            mapSelect[hSocket] = nEvents;
+            return;
+        }
+        if (nRegistered == nEvents)
+            return;
+#if defined(HAVE_SYS_EPOLL_H)
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = ((nEvents & SOCKET_RECV) ? EPOLLIN : 0) | ((nEvents & SOCKET_SEND) ? EPOLLOUT : 0);
+        ev.data.fd = hSocket;
+        int nRet = epoll_ctl(fdPoll, nRegistered == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, hSocket, &ev);
+        if (nRet == -1 && errno == EEXIST)
+            nRet = epoll_ctl(fdPoll, EPOLL_CTL_MOD, hSocket, &ev);
+#elif defined(HAVE_SYS_EVENT_H)
+        struct kevent vChanges[2];
+        int nFlags = nRegistered == -1 ? EV_ADD : 0;
+        EV_SET(&vChanges[0], hSocket, EVFILT_READ, nFlags | ((nEvents & SOCKET_RECV) ? EV_ENABLE : EV_DISABLE), 0, 0, NULL);
+        EV_SET(&vChanges[1], hSocket, EVFILT_WRITE, nFlags | ((nEvents & SOCKET_SEND) ? EV_ENABLE : EV_DISABLE), 0, 0, NULL);
+        int nRet = kevent(fdPoll, vChanges, 2, NULL, 0, NULL);
+#else
+        int nRet = -1;
+#endif
+        if (nRet == -1) {
+            LogPrint("net", "socket event registration failed: %s\n", NetworkErrorString(errno));
+            return;
+        }
+        nRegistered = nEvents;
+    }
+
+    /** Wait up to nTimeoutMillis and collect the sockets that became ready */
+    void Wait(int nTimeoutMillis)
+    {
+        setRecv.clear();
+        setSend.clear();
+        setError.clear();
+        if (fdPoll == -1) {
+            WaitSelect(nTimeoutMillis);
+            return;
+        }
+#if defined(HAVE_SYS_EPOLL_H)
+        struct epoll_event vEvents[256];
+        int nEvents = epoll_wait(fdPoll, vEvents, ARRAYLEN(vEvents), nTimeoutMillis);
+        for (int i = 0; i < nEvents; i++) {
+            SOCKET hSocket = vEvents[i].data.fd;
+            if (vEvents[i].events & EPOLLIN)
+                setRecv.insert(hSocket);
+            if (vEvents[i].events & EPOLLOUT)
+                setSend.insert(hSocket);
+            if (vEvents[i].events & (EPOLLERR | EPOLLHUP))
+                setError.insert(hSocket);
+        }
+#elif defined(HAVE_SYS_EVENT_H)
+        struct kevent vEvents[256];
+        struct timespec timeout;
+        timeout.tv_sec = nTimeoutMillis / 1000;
+        timeout.tv_nsec = (nTimeoutMillis % 1000) * 1000000;
+        int nEvents = kevent(fdPoll, NULL, 0, vEvents, ARRAYLEN(vEvents), &timeout);
+        for (int i = 0; i < nEvents; i++) {
+            SOCKET hSocket = vEvents[i].ident;
+            if (vEvents[i].flags & (EV_ERROR | EV_EOF))
+                setError.insert(hSocket);
+            if (vEvents[i].filter == EVFILT_READ)
+                setRecv.insert(hSocket);
+            else if (vEvents[i].filter == EVFILT_WRITE)
+                setSend.insert(hSocket);
+        }
+#else
+        int nEvents = 0;
+#endif
+        if (nEvents == -1 && errno != EINTR) {
+            LogPrintf("socket poll error %s\n", NetworkErrorString(errno));
+            MilliSleep(nTimeoutMillis);
+        }
+    }
+
+private:
+    int fdPoll;
+    std::map<SOCKET, int> mapSelect;
+
+    void WaitSelect(int nTimeoutMillis)
+    {
+        struct timeval timeout = MillisToTimeval(nTimeoutMillis);
+
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        fd_set fdsetError;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        SOCKET hSocketMax = 0;
+
+        for (std::map<SOCKET, int>::const_iterator it = mapSelect.begin(); it != mapSelect.end(); ++it) {
+            FD_SET(it->first, &fdsetError);
+            if (it->second & SOCKET_RECV)
+                FD_SET(it->first, &fdsetRecv);
+            if (it->second & SOCKET_SEND)
+                FD_SET(it->first, &fdsetSend);
+            hSocketMax = max(hSocketMax, it->first);
+        }
+
+        int nSelect = select(mapSelect.empty() ? 0 : hSocketMax + 1,
+            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+
+        if (nSelect == SOCKET_ERROR) {
+            if (!mapSelect.empty()) {
+                int nErr = WSAGetLastError();
+                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+                for (std::map<SOCKET, int>::const_iterator it = mapSelect.begin(); it != mapSelect.end(); ++it)
+                    setRecv.insert(it->first);
+            }
+            MilliSleep(nTimeoutMillis);
+        } else {
+            for (std::map<SOCKET, int>::const_iterator it = mapSelect.begin(); it != mapSelect.end(); ++it) {
+                if (FD_ISSET(it->first, &fdsetRecv))
+                    setRecv.insert(it->first);
+                if (FD_ISSET(it->first, &fdsetSend))
+                    setSend.insert(it->first);
+                if (FD_ISSET(it->first, &fdsetError))
+                    setError.insert(it->first);
+            }
+        }
+        mapSelect.clear();
+    }
+};
+} // anon namespace
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    CSocketEvents events;
+    std::vector<int> vListenEvents(vhListenSocket.size(), -1);
     while (true) {
         //
         // Disconnect nodes
@@ -843,7 +1153,7 @@ void ThreadSocketHandler()
             vector<CNode*> vNodesCopy = vNodes;
             BOOST_FOREACH (CNode* pnode, vNodesCopy) {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0)) {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
@@ -886,10 +1196,17 @@ void ThreadSocketHandler()
             }
         }
         size_t vNodesSize;
+        size_t nInbound = 0;
         {
             LOCK(cs_vNodes);
             vNodesSize = vNodes.size();
+            BOOST_FOREACH (CNode* pnode, vNodes) {
+                if (pnode->fInbound)
+                    nInbound++;
+            }
         }
+        metricPeersInbound.Set(nInbound);
+        metricPeersOutbound.Set(vNodesSize - nInbound);
         if(vNodesSize != nPrevNodeCount) {
             nPrevNodeCount = vNodesSize;
             uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
@@ -898,33 +1215,14 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
+        for (unsigned int i = 0; i < vhListenSocket.size(); i++)
+            events.Watch(vhListenSocket[i].socket, vListenEvents[i], CSocketEvents::SOCKET_RECV);
 
         {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
 
                 // Implement the following logic:
                 // * If there is data to send, select() for sending data. As this only
@@ -941,43 +1239,30 @@ void ThreadSocketHandler()
                 // * We send some data.
                 // * We wait for data to be received (and disconnect after timeout).
                 // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
+                // Errors are always reported, whatever the interest.
+                int nEvents = 0;
+                if (pnode->fConnecting)
+                    nEvents = CSocketEvents::SOCKET_SEND;
+                if (nEvents == 0 && pnode->nSendSize > 0)
+                    nEvents = CSocketEvents::SOCKET_SEND;
+                if (nEvents == 0) {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                     if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
                                         pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                        nEvents = CSocketEvents::SOCKET_RECV;
                 }
+                events.Watch(pnode->hSocket, pnode->nSocketEvents, nEvents);
             }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        events.Wait(50); // frequency to poll pnode->vSend
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
-        }
-
         //
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
+            if (hListenSocket.socket != INVALID_SOCKET && events.setRecv.count(hListenSocket.socket)) {
                 struct sockaddr_storage sockaddr;
                 socklen_t len = sizeof(sockaddr);
                 SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
@@ -1000,7 +1285,7 @@ void ThreadSocketHandler()
                     int nErr = WSAGetLastError();
                     if (nErr != WSAEWOULDBLOCK)
                         LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
+                } else if (!events.IsSupported(hSocket)) {
                     LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
                     CloseSocket(hSocket);
                 } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
@@ -1036,19 +1321,46 @@ void ThreadSocketHandler()
             boost::this_thread::interruption_point();
 
             //
-            // Receive
+            // Complete a pending connection, writable once connect() is done
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            if (pnode->fConnecting) {
+                if (events.setSend.count(pnode->hSocket) || events.setError.count(pnode->hSocket)) {
+                    if (!ConnectSocketFinish(pnode->addr, pnode->hSocket)) {
+                        pnode->CloseSocketDisconnect();
+                        continue;
+                    }
+                    LOCK(pnode->cs_vSend);
+                    LogPrint("net", "connected to %s in %dms peer=%d\n", pnode->addrName,
+                        GetTimeMillis() - (pnode->nConnectDeadline - nConnectTimeout), pnode->id);
+                    pnode->fConnecting = false;
+                    pnode->nTimeConnected = GetTime();
+                    SocketSendData(pnode);
+                } else if (GetTimeMillis() > pnode->nConnectDeadline) {
+                    LogPrint("net", "connection to %s timeout\n", pnode->addrName);
+                    pnode->CloseSocketDisconnect();
+                }
+                continue;
+            }
+
+            //
+            // Receive
+            //
+            if (events.setRecv.count(pnode->hSocket) || events.setError.count(pnode->hSocket)) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv) {
                     {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        char* pchRecv = pchBuf;
+                        unsigned int nSpace = sizeof(pchBuf);
+                        // Once the header is known, receive the payload straight into the message
+                        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.back().in_data && !pnode->vRecvMsg.back().complete())
+                            pchRecv = pnode->vRecvMsg.back().prepareData(nSpace);
+                        int nBytes = recv(pnode->hSocket, pchRecv, nSpace, MSG_DONTWAIT);
                         if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (!pnode->ReceiveMsgBytes(pchRecv, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
@@ -1076,7 +1388,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            if (events.setSend.count(pnode->hSocket)) {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                     SocketSendData(pnode);
@@ -1220,6 +1532,38 @@ void MapPort(bool)
 #endif
 
 
+/** The DNS seed lookups ThreadDNSAddressSeed waits for */
+struct CDNSSeedLookups {
+    boost::mutex cs;
+    boost::condition_variable cond;
+    int nPending;
+    int nFound;
+
+    CDNSSeedLookups() : nPending(0), nFound(0) {}
+};
+
+static void ResolveDNSSeed(const CDNSSeedData seed, CDNSSeedLookups* lookups)
+{
+    vector<CNetAddr> vIPs;
+    vector<CAddress> vAdd;
+    if (LookupHost(seed.host.c_str(), vIPs)) {
+        BOOST_FOREACH (CNetAddr& ip, vIPs) {
+            int nOneDay = 24 * 3600;
+            CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
+            addr.nTime = GetTime() - 3 * nOneDay - GetInsecureRand(4 * nOneDay); // use a random age between 3 and 7 days old
+            vAdd.push_back(addr);
+        }
+    }
+    // Added as soon as the seed answers, for ThreadOpenConnections to pick from
+    addrman.Add(vAdd, CNetAddr(seed.name, true));
+    LogPrint("net", "%u addresses found from DNS seed %s\n", vAdd.size(), seed.host);
+
+    boost::unique_lock<boost::mutex> lock(lookups->cs);
+    lookups->nFound += vAdd.size();
+    lookups->nPending--;
+    lookups->cond.notify_all();
+}
+
 void ThreadDNSAddressSeed()
 {
     // goal: only query DNS seeds if address need is acute
@@ -1235,30 +1579,47 @@ void ThreadDNSAddressSeed()
     }
 
     const vector<CDNSSeedData>& vSeeds = Params().DNSSeeds();
-    int found = 0;
 
     LogPrintf("Loading addresses from DNS seeds (could take a while)\n");
 
-    BOOST_FOREACH (const CDNSSeedData& seed, vSeeds) {
-        if (HaveNameProxy()) {
+    if (HaveNameProxy()) {
+        BOOST_FOREACH (const CDNSSeedData& seed, vSeeds)
             AddOneShot(seed.host);
-        } else {
-            vector<CNetAddr> vIPs;
-            vector<CAddress> vAdd;
-            if (LookupHost(seed.host.c_str(), vIPs)) {
-                BOOST_FOREACH (CNetAddr& ip, vIPs) {
-                    int nOneDay = 24 * 3600;
-                    CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
-                    addr.nTime = GetTime() - 3 * nOneDay - GetRand(4 * nOneDay); // use a random age between 3 and 7 days old
-                    vAdd.push_back(addr);
-                    found++;
-                }
+        return;
+    }
+
+    // Every seed is looked up at once, so a slow or dead one holds back no other
+    CDNSSeedLookups lookups;
+    boost::thread_group threadGroup;
+    BOOST_FOREACH (const CDNSSeedData& seed, vSeeds) {
+        lookups.nPending++;
+        threadGroup.create_thread(boost::bind(&ResolveDNSSeed, seed, &lookups));
+    }
+
+    bool fInterrupted = false;
+    int nPending, nFound;
+    {
+        boost::unique_lock<boost::mutex> lock(lookups.cs);
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(DNS_SEED_TIMEOUT);
+        try {
+            while (lookups.nPending > 0 && lookups.cond.timed_wait(lock, deadline)) {
             }
-            addrman.Add(vAdd, CNetAddr(seed.name, true));
+        } catch (const boost::thread_interrupted&) {
+            fInterrupted = true;
         }
+        nPending = lookups.nPending;
+        nFound = lookups.nFound;
     }
 
-    LogPrintf("%d addresses found from DNS seeds\n", found);
+    // The lookups left stop at their next interruption point
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    if (fInterrupted)
+        throw boost::thread_interrupted();
+
+    if (nPending > 0)
+        LogPrintf("%d DNS seeds did not answer within %d seconds\n", nPending, DNS_SEED_TIMEOUT);
+    LogPrintf("%d addresses found from DNS seeds\n", nFound);
 }
 
 
@@ -1314,12 +1675,14 @@ void ThreadOpenConnections()
         }
     }
 
-    // Initiate network connections
+    // Initiate network connections. Direct connections complete in the socket
+    // handler, so the next attempt can start while the last one is pending.
     int64_t nStart = GetTime();
+    bool fStarted = false;
     while (true) {
         ProcessOneShot();
 
-        MilliSleep(500);
+        MilliSleep(fStarted ? 100 : 500);
 
         CSemaphoreGrant grant(*semOutbound);
         boost::this_thread::interruption_point();
@@ -1385,8 +1748,7 @@ void ThreadOpenConnections()
             break;
         }
 
-        if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+        fStarted = addrConnect.IsValid() && OpenNetworkConnection(addrConnect, &grant);
     }
 }
 
@@ -1472,7 +1834,7 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
     } else if (FindNode(pszDest))
         return false;
 
-    CNode* pnode = ConnectNode(addrConnect, pszDest);
+    CNode* pnode = ConnectNode(addrConnect, pszDest, true);
     boost::this_thread::interruption_point();
 
     if (!pnode)
@@ -1487,7 +1849,12 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
-void ThreadMessageHandler()
+/**
+ * Each handler thread owns the peers whose id maps to it, so a peer's messages
+ * are still handled in order by a single thread while a peer stuck waiting on
+ * cs_main doesn't hold up gossip from peers served by the other threads.
+ */
+void ThreadMessageHandler(int nThread, int nThreads)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1497,17 +1864,15 @@ void ThreadMessageHandler()
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            BOOST_FOREACH (CNode* pnode, vNodes) {
+                if (pnode->id % nThreads != nThread)
+                    continue;
+                vNodesCopy.push_back(pnode);
                 pnode->AddRef();
             }
         }
 
         // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
         bool fSleep = true;
 
         BOOST_FOREACH (CNode* pnode, vNodesCopy) {
@@ -1522,7 +1887,7 @@ void ThreadMessageHandler()
                         pnode->CloseSocketDisconnect();
 
                     if (pnode->nSendSize < SendBufferSize()) {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
+                        if (!pnode->vRecvGetData.empty() || !pnode->setOrphanWorkSet.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
                             fSleep = false;
                         }
                     }
@@ -1534,7 +1899,7 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                    g_signals.SendMessages(pnode, pnode->fWhitelisted);
             }
             boost::this_thread::interruption_point();
         }
@@ -1699,9 +2064,8 @@ void static Discover(boost::thread_group& threadGroup)
 #endif
 }
 
-void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
+void LoadAddresses()
 {
-    uiInterface.InitMessage(_("Loading addresses..."));
     // Load addresses for peers.dat
     int64_t nStart = GetTimeMillis();
     {
@@ -1725,6 +2089,14 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Loaded %i addresses from peers.dat  %dms\n",
         addrman.size(), GetTimeMillis() - nStart);
     fAddressesInitialized = true;
+}
+
+void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
+{
+    if (!fAddressesInitialized) {
+        uiInterface.InitMessage(_("Loading addresses..."));
+        LoadAddresses();
+    }
 
     if (semOutbound == NULL) {
         // initialize semaphore
@@ -1759,7 +2131,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMsgHandlerThreads = std::max(1, std::min((int)GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS), MAX_MSGHANDLER_THREADS));
+    for (int i = 0; i < nMsgHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i, nMsgHandlerThreads))));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -1852,17 +2226,101 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
         mapRelay.insert(std::make_pair(inv, ss));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
-    LOCK(cs_vNodes);
-    BOOST_FOREACH (CNode* pnode, vNodes) {
-        if (!pnode->fRelayTxes)
-            continue;
-        LOCK(pnode->cs_filter);
-        if (pnode->pfilter) {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx))
+
+    // The filters are matched without holding cs_vNodes, which every message
+    // handler and the socket thread need
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (!pnode->fRelayTxes)
+                continue;
+            pnode->AddRef();
+            vNodesCopy.push_back(pnode);
+        }
+    }
+
+    // Parsed once for all the peers that have a filter
+    boost::scoped_ptr<CBloomFilterTx> pTxData;
+    BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+        {
+            LOCK(pnode->cs_filter);
+            if (pnode->pfilter) {
+                if (!pTxData)
+                    pTxData.reset(new CBloomFilterTx(tx));
+                if (pnode->pfilter->IsRelevantAndUpdate(*pTxData))
+                    pnode->PushInventory(inv);
+            } else
                 pnode->PushInventory(inv);
-        } else
-            pnode->PushInventory(inv);
+        }
+        pnode->Release();
+    }
+}
+
+CRelayCache::StreamPtr CRelayCache::Get(const CInv& inv)
+{
+    LOCK(cs);
+    std::map<CInv, Entry>::iterator it = mapEntries.find(inv);
+    if (it == mapEntries.end())
+        return StreamPtr();
+    listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+    return it->second.pss;
+}
+
+void CRelayCache::Put(const CInv& inv, const StreamPtr& pss)
+{
+    if (pss->size() > nMaxBytes)
+        return;
+
+    LOCK(cs);
+    std::map<CInv, Entry>::iterator it = mapEntries.find(inv);
+    if (it != mapEntries.end()) {
+        nBytes -= it->second.pss->size();
+        listLRU.erase(it->second.itLRU);
+        mapEntries.erase(it);
+    }
+    while (!listLRU.empty() && nBytes + pss->size() > nMaxBytes) {
+        std::map<CInv, Entry>::iterator itOld = mapEntries.find(listLRU.back());
+        nBytes -= itOld->second.pss->size();
+        mapEntries.erase(itOld);
+        listLRU.pop_back();
+    }
+    listLRU.push_front(inv);
+    Entry& entry = mapEntries[inv];
+    entry.pss = pss;
+    entry.itLRU = listLRU.begin();
+    nBytes += pss->size();
+}
+
+void CRelayCache::Erase(const CInv& inv)
+{
+    LOCK(cs);
+    std::map<CInv, Entry>::iterator it = mapEntries.find(inv);
+    if (it == mapEntries.end())
+        return;
+    nBytes -= it->second.pss->size();
+    listLRU.erase(it->second.itLRU);
+    mapEntries.erase(it);
+}
+
+size_t CRelayCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Each message is a CDataStream behind a shared_ptr with its own control block
+    size_t nPerEntry = memusage::MallocUsage(sizeof(CDataStream)) + memusage::MallocUsage(2 * sizeof(void*) + 2 * sizeof(long));
+    return memusage::DynamicUsage(mapEntries) + memusage::DynamicUsage(listLRU) + nPerEntry * mapEntries.size() + nBytes;
+}
+
+void GetRelayMemoryUsage(std::map<std::string, size_t>& mapUsage)
+{
+    {
+        LOCK(cs_mapRelay);
+        size_t nUsage = memusage::DynamicUsage(mapRelay) + memusage::DynamicUsage(vRelayExpiration);
+        for (map<CInv, CDataStream>::const_iterator it = mapRelay.begin(); it != mapRelay.end(); ++it)
+            nUsage += memusage::MallocUsage(it->second.size());
+        mapUsage["mapRelay"] = nUsage;
     }
+    mapUsage["relayCache"] = relayCache.DynamicMemoryUsage();
 }
 
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
@@ -1889,6 +2347,27 @@ void RelayInv(CInv& inv)
     }
 }
 
+void RelayInvs(const std::vector<CInv>& vInv)
+{
+    if (vInv.empty())
+        return;
+    LOCK(cs_vNodes);
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        if (pnode->nVersion < ActiveProtocol())
+            continue;
+        BOOST_FOREACH (const CInv& inv, vInv) {
+            if (pnode->nServices == NODE_BLOOM_WITHOUT_MN && inv.IsMasterNodeType())
+                continue;
+            pnode->PushInventory(inv);
+        }
+    }
+}
+
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -1899,6 +2378,61 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t nNow = GetTime();
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME < nNow) {
+        // The cycle is over, count from zero
+        nMaxOutboundCycleStartTime = nNow;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t nLimit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = nLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    if (nMaxOutboundCycleStartTime == 0)
+        return MAX_UPLOAD_TIMEFRAME;
+
+    uint64_t nCycleEnd = nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME;
+    uint64_t nNow = GetTime();
+    return nCycleEnd < nNow ? 0 : nCycleEnd - nNow;
+}
+
+bool CNode::OutboundTargetReached(bool fHistoricalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (fHistoricalBlockServingLimit) {
+        // Keep enough to relay each block of the rest of the cycle once, at the maximum size
+        uint64_t nBuffer = GetMaxOutboundTimeLeftInCycle() / Params().TargetSpacing() * MAX_BLOCK_SIZE_CURRENT;
+        return nBuffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - nBuffer;
+    }
+    return nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    return nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -1913,7 +2447,60 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
-void CNode::Fuzz(int nChance)
+CNetMsgStats& CNode::MsgStatsFor(mapMsgCmdStats& mapStats, const std::string& strCommand)
+{
+    // Anyone can make up commands, only the known ones get an entry of their own
+    mapMsgCmdStats::iterator it = mapStats.find(strCommand);
+    if (it != mapStats.end())
+        return it->second;
+    if (!std::binary_search(GetAllNetMessageTypes().begin(), GetAllNetMessageTypes().end(), strCommand))
+        return mapStats[NET_MESSAGE_COMMAND_OTHER];
+    return mapStats[strCommand];
+}
+
+void CNode::RecordMsgSent(const std::string& strCommand, uint64_t nBytes)
+{
+    {
+        LOCK(cs_msgStats);
+        CNetMsgStats& stats = MsgStatsFor(mapMsgStats, strCommand);
+        stats.nMsgsSent++;
+        stats.nBytesSent += nBytes;
+    }
+    LOCK(cs_totalMsgStats);
+    CNetMsgStats& stats = MsgStatsFor(mapTotalMsgStats, strCommand);
+    stats.nMsgsSent++;
+    stats.nBytesSent += nBytes;
+}
+
+void CNode::RecordMsgProcessed(const std::string& strCommand, uint64_t nBytes, int64_t nProcessTime)
+{
+    {
+        LOCK(cs_msgStats);
+        CNetMsgStats& stats = MsgStatsFor(mapMsgStats, strCommand);
+        stats.nMsgsRecv++;
+        stats.nBytesRecv += nBytes;
+        stats.nProcessTime += nProcessTime;
+    }
+    LOCK(cs_totalMsgStats);
+    CNetMsgStats& stats = MsgStatsFor(mapTotalMsgStats, strCommand);
+    stats.nMsgsRecv++;
+    stats.nBytesRecv += nBytes;
+    stats.nProcessTime += nProcessTime;
+}
+
+void CNode::GetTotalMsgStats(mapMsgCmdStats& mapStats)
+{
+    LOCK(cs_totalMsgStats);
+    mapStats = mapTotalMsgStats;
+}
+
+void CNode::ResetTotalMsgStats()
+{
+    LOCK(cs_totalMsgStats);
+    mapTotalMsgStats.clear();
+}
+
+void CNode::Fuzz(CDataStream& ssMsg, int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
     if (GetRand(nChance) != 0) return;   // Fuzz 1 of every nChance messages
@@ -1921,30 +2508,30 @@ void CNode::Fuzz(int nChance)
     switch (GetRand(3)) {
     case 0:
         // xor a random byte with a random value:
-        if (!ssSend.empty()) {
-            CDataStream::size_type pos = GetRand(ssSend.size());
-            ssSend[pos] ^= (unsigned char)(GetRand(256));
+        if (!ssMsg.empty()) {
+            CDataStream::size_type pos = GetRand(ssMsg.size());
+            ssMsg[pos] ^= (unsigned char)(GetRand(256));
         }
         break;
     case 1:
         // delete a random byte:
-        if (!ssSend.empty()) {
-            CDataStream::size_type pos = GetRand(ssSend.size());
-            ssSend.erase(ssSend.begin() + pos);
+        if (!ssMsg.empty()) {
+            CDataStream::size_type pos = GetRand(ssMsg.size());
+            ssMsg.erase(ssMsg.begin() + pos);
         }
         break;
     case 2:
         // insert a random byte at a random position
         {
-            CDataStream::size_type pos = GetRand(ssSend.size());
+            CDataStream::size_type pos = GetRand(ssMsg.size());
             char ch = (char)GetRand(256);
-            ssSend.insert(ssSend.begin() + pos, ch);
+            ssMsg.insert(ssMsg.begin() + pos, ch);
         }
         break;
     }
     // Chance of more than one change half the time:
     // (more changes exponentially less likely):
-    Fuzz(2);
+    Fuzz(ssMsg, 2);
 }
 
 //
@@ -1963,29 +2550,29 @@ bool CAddrDB::Write(const CAddrMan& addr)
     GetRandBytes((unsigned char*)&randv, sizeof(randv));
     std::string tmpfn = strprintf("peers.dat.%04x", randv);
 
-    // serialize addresses, checksum data up to that point, then append csum
-    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
-    ssPeers << FLATDATA(Params().MessageStart());
-    ssPeers << addr;
-    uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
-    ssPeers << hash;
-
-    // open output file, and associate with CAutoFile
-    boost::filesystem::path pathAddr = GetDataDir() / "peers.dat";
-    FILE* file = fopen(pathAddr.string().c_str(), "wb");
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathAddr.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
-    // Write and commit header, data
+    // serialize addresses straight into the file, checksum data up to that point, then append csum
     try {
-        fileout << ssPeers;
+        CHashingWriter<CAutoFile> writer(&fileout);
+        writer << FLATDATA(Params().MessageStart());
+        writer << addr;
+        fileout << writer.GetHash();
     } catch (std::exception& e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
     FileCommit(fileout.Get());
     fileout.fclose();
 
+    // replace existing peers.dat, if any, with new peers.dat.XXXX
+    if (!RenameOver(pathTmp, pathAddr))
+        return error("%s : Rename-into-place failed", __func__);
+
     return true;
 }
 
@@ -1997,44 +2584,29 @@ bool CAddrDB::Read(CAddrMan& addr)
     if (filein.IsNull())
         return error("%s : Failed to open file %s", __func__, pathAddr.string());
 
-    // use file size to size memory buffer
-    uint64_t fileSize = boost::filesystem::file_size(pathAddr);
-    uint64_t dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (fileSize >= sizeof(uint256))
-        dataSize = fileSize - sizeof(uint256);
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-    }
-    filein.fclose();
-
-    CDataStream ssPeers(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssPeers.begin(), ssPeers.end());
-    if (hashIn != hashTmp)
-        return error("%s : Checksum mismatch, data corrupted", __func__);
-
+    // de-serialize straight from the file, hashing what is read for the checksum at the end
+    CHashVerifier<CAutoFile> verifier(&filein);
     unsigned char pchMsgTmp[4];
     try {
         // de-serialize file header (network specific magic number) and ..
-        ssPeers >> FLATDATA(pchMsgTmp);
+        verifier >> FLATDATA(pchMsgTmp);
 
         // ... verify the network matches ours
         if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
             return error("%s : Invalid network magic number", __func__);
 
         // de-serialize address data into one CAddrMan object
-        ssPeers >> addr;
+        verifier >> addr;
+
+        // verify stored checksum matches input data
+        uint256 hashIn;
+        filein >> hashIn;
+        if (hashIn != verifier.GetHash()) {
+            addr.Clear();
+            return error("%s : Checksum mismatch, data corrupted", __func__);
+        }
     } catch (std::exception& e) {
+        addr.Clear();
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
 
@@ -2044,11 +2616,14 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn, bool fConnectingIn) : addrKnown(5000, 0.001),
+                                                                                         filterInventoryKnown(SendBufferSize() / 1000, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
+    nSocketEvents = -1;
     nRecvVersion = INIT_PROTO_VERSION;
+    nSendVersion = INIT_PROTO_VERSION;
     nLastSend = 0;
     nLastRecv = 0;
     nSendBytes = 0;
@@ -2066,14 +2641,20 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fConnecting = fConnectingIn;
+    nConnectDeadline = fConnecting ? GetTimeMillis() + nConnectTimeout : 0;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendPriority = 0;
+    pSendQueue = NULL;
+    nNextAddrSend = 0;
+    nNextInvSend = 0;
+    fInventoryUrgent = false;
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
@@ -2090,7 +2671,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     else
         LogPrint("net", "Added connection peer=%d\n", id);
 
-    // Be shy and don't send version until we hear
+    // Be shy and don't send version until we hear; a pending connection
+    // sends it once it completes
     if (hSocket != INVALID_SOCKET && !fInbound)
         PushVersion();
 
@@ -2101,6 +2683,13 @@ CNode::~CNode()
 {
     CloseSocket(hSocket);
 
+    CSendQueueEntry* pentry = pSendQueue.exchange(NULL);
+    while (pentry != NULL) {
+        CSendQueueEntry* pnext = pentry->pnext;
+        delete pentry;
+        pentry = pnext;
+    }
+
     if (pfilter)
         delete pfilter;
 
@@ -2113,6 +2702,8 @@ void CNode::AskFor(const CInv& inv)
         return;
     // We're using mapAskFor as a priority queue,
     // the key is the earliest time the request can be sent
+    // the request times are shared by the peers of all message handler threads
+    LOCK(cs_mapAlreadyAskedFor);
     int64_t nRequestTime;
     limitedmap<CInv, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv);
     if (it != mapAlreadyAskedFor.end())
@@ -2137,61 +2728,82 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
-void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
+/** New blocks, SwiftTX locks and masternode payment votes must not wait behind a syncing peer's old blocks */
+static bool IsPriorityCommand(const char* pszCommand)
 {
-    ENTER_CRITICAL_SECTION(cs_vSend);
-    assert(ssSend.size() == 0);
-    ssSend << CMessageHeader(pszCommand, 0);
-    LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
+    static const char* ppszPriority[] = {"block", "cmpctblock", "blocktxn", "headers", "ix", "txlvote", "mnw"};
+    for (unsigned int i = 0; i < ARRAYLEN(ppszPriority); i++) {
+        if (strcmp(pszCommand, ppszPriority[i]) == 0)
+            return true;
+    }
+    return false;
 }
 
-void CNode::AbortMessage() UNLOCK_FUNCTION(cs_vSend)
+CSendQueueEntry* CNode::BeginMessage(const char* pszCommand)
 {
-    ssSend.clear();
-
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+    CSendQueueEntry* pentry = new CSendQueueEntry(nSendVersion);
+    pentry->fPriority = IsPriorityCommand(pszCommand);
+    pentry->ssMsg << CMessageHeader(pszCommand, 0);
+    return pentry;
+}
 
-    LogPrint("net", "(aborted)\n");
+void CNode::AbortMessage(CSendQueueEntry* pentry)
+{
+    LogPrint("net", "sending: (aborted) peer=%d\n", id);
+    delete pentry;
 }
 
-void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
+void CNode::EndMessage(CSendQueueEntry* pentry)
 {
+    CDataStream& ssMsg = pentry->ssMsg;
+
     // The -*messagestest options are intentionally not documented in the help message,
     // since they are only used during development to debug the networking code and are
     // not intended for end-users.
     if (mapArgs.count("-dropmessagestest") && GetRand(GetArg("-dropmessagestest", 2)) == 0) {
         LogPrint("net", "dropmessages DROPPING SEND MESSAGE\n");
-        AbortMessage();
+        AbortMessage(pentry);
         return;
     }
     if (mapArgs.count("-fuzzmessagestest"))
-        Fuzz(GetArg("-fuzzmessagestest", 10));
+        Fuzz(ssMsg, GetArg("-fuzzmessagestest", 10));
 
-    if (ssSend.size() == 0)
+    if (ssMsg.size() < CMessageHeader::HEADER_SIZE) {
+        delete pentry;
         return;
+    }
 
     // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+    unsigned int nSize = ssMsg.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ssMsg[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
 
     // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
+    uint256 hash = Hash(ssMsg.begin() + CMessageHeader::HEADER_SIZE, ssMsg.end());
     unsigned int nChecksum = 0;
     memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
-
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    assert(ssMsg.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ssMsg[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    const char* pchCommand = &ssMsg[MESSAGE_START_SIZE];
+    std::string strCommand(pchCommand, pchCommand + strnlen(pchCommand, CMessageHeader::COMMAND_SIZE));
+    LogPrint("net", "sending: %s (%d bytes) peer=%d\n", SanitizeString(strCommand), nSize, id);
+    size_t nMessageSize = ssMsg.size();
+    RecordMsgSent(strCommand, nMessageSize);
 
-    // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
-        SocketSendData(this);
+    // Counted before it is queued, so that SocketSendData never takes off
+    // more than was added
+    bool fQueueEmpty = (nSendSize.fetch_add(nMessageSize) == 0);
+    pentry->pnext = pSendQueue.load();
+    while (!pSendQueue.compare_exchange_weak(pentry->pnext, pentry)) {
+    }
 
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+    // If nothing else waited, attempt an "optimistic write", unless another
+    // thread sends to this peer already and takes the message along
+    if (fQueueEmpty) {
+        TRY_LOCK(cs_vSend, lockSend);
+        if (lockSend)
+            SocketSendData(this);
+    }
 }
 
 //
@@ -11,7 +11,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -20,7 +19,11 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
+#include <list>
+#include <map>
+#include <set>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -29,6 +32,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -51,6 +55,8 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
+/** Seconds the DNS seeds have to answer before the lookups still running are given up */
+static const int DNS_SEED_TIMEOUT = 30;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
 /** -upnp default */
@@ -59,8 +65,22 @@ static const bool DEFAULT_UPNP = USE_UPNP;
 #else
 static const bool DEFAULT_UPNP = false;
 #endif
+/** -msghandlerthreads default */
+static const int DEFAULT_MSGHANDLER_THREADS = 1;
+/** Maximum number of message handler threads. The SwiftTX state and AskFor are
+ *  guarded, but the masternode sync counters and the seen maps read by AlreadyHave
+ *  and ProcessGetData still rely on a single handler thread, so more are not allowed yet. */
+static const int MAX_MSGHANDLER_THREADS = 1;
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Messages are copied behind the last queued one while that buffer stays under this many bytes */
+static const size_t SEND_COALESCE_SIZE = 16 * 1024;
+/** Queued send buffers handed to the kernel by a single sendmsg() */
+static const int MAX_SEND_IOVECS = 64;
+/** -maxuploadtarget default, MiB a day; 0 is no limit */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The period -maxuploadtarget counts the bytes sent over, in seconds */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -72,11 +92,13 @@ CNode* FindNode(const CNetAddr& ip);
 CNode* FindNode(const CSubNet& subNet);
 CNode* FindNode(const std::string& addrName);
 CNode* FindNode(const CService& ip);
-CNode* ConnectNode(CAddress addrConnect, const char* pszDest = NULL);
+CNode* ConnectNode(CAddress addrConnect, const char* pszDest = NULL, bool fConnectAsync = false);
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOutbound = NULL, const char* strDest = NULL, bool fOneShot = false);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhitelisted = false);
+/** Read peers.dat and banlist.dat, unless done before StartNode */
+void LoadAddresses();
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode* pnode);
@@ -121,6 +143,44 @@ bool IsReachable(enum Network net);
 bool IsReachable(const CNetAddr& addr);
 CAddress GetLocalAddress(const CNetAddr* paddrPeer = NULL);
 
+/** Default memory budget of the serialized relay cache, in bytes */
+static const size_t DEFAULT_RELAY_CACHE_BYTES = 32 * 1000 * 1000;
+
+/**
+ * Serialized form of recently requested blocks and masternode messages, so a
+ * getdata from every peer does not read and serialize the same object again.
+ * Entries are evicted least recently used first once the byte budget is hit.
+ */
+class CRelayCache
+{
+public:
+    typedef boost::shared_ptr<const CDataStream> StreamPtr;
+
+private:
+    struct Entry {
+        StreamPtr pss;
+        std::list<CInv>::iterator itLRU;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<CInv, Entry> mapEntries;
+    std::list<CInv> listLRU; // most recently used at the front
+    size_t nBytes;
+    size_t nMaxBytes;
+
+public:
+    CRelayCache(size_t nMaxBytesIn) : nBytes(0), nMaxBytes(nMaxBytesIn) {}
+
+    //! Shared serialized message for inv, or NULL if it is not cached
+    StreamPtr Get(const CInv& inv);
+    //! Cache the serialized message pss for inv
+    void Put(const CInv& inv, const StreamPtr& pss);
+    //! Forget inv, for objects that changed since they were cached
+    void Erase(const CInv& inv);
+    //! Estimated heap memory of the entries and the messages they share
+    size_t DynamicMemoryUsage() const;
+};
+
 
 extern bool fDiscover;
 extern bool fListen;
@@ -134,7 +194,13 @@ extern CCriticalSection cs_vNodes;
 extern std::map<CInv, CDataStream> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
+extern CRelayCache relayCache;
+
+/** Estimated heap memory of mapRelay and the relay cache, by name */
+void GetRelayMemoryUsage(std::map<std::string, size_t>& mapUsage);
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
+//! Guards mapAlreadyAskedFor and the last request time CNode::AskFor hands out
+extern CCriticalSection cs_mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
@@ -142,6 +208,9 @@ extern CCriticalSection cs_vAddedNodes;
 extern NodeId nLastNodeId;
 extern CCriticalSection cs_nLastNodeId;
 
+//! Wakes the message handlers when there is new work for them
+extern boost::condition_variable messageHandlerCondition;
+
 struct LocalServiceInfo {
     int nScore;
     int nPort;
@@ -150,6 +219,22 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Traffic and processing time of the messages with one command */
+struct CNetMsgStats {
+    uint64_t nMsgsSent;
+    uint64_t nBytesSent;
+    uint64_t nMsgsRecv;
+    uint64_t nBytesRecv;
+    int64_t nProcessTime; //!< Microseconds spent in ProcessMessage
+
+    CNetMsgStats() : nMsgsSent(0), nBytesSent(0), nMsgsRecv(0), nBytesRecv(0), nProcessTime(0) {}
+};
+
+//! Commands that are not in GetAllNetMessageTypes() are counted together under this one
+extern const std::string NET_MESSAGE_COMMAND_OTHER;
+
+typedef std::map<std::string, CNetMsgStats> mapMsgCmdStats;
+
 class CNodeStats
 {
 public:
@@ -170,6 +255,7 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    mapMsgCmdStats mapMsgStats;
 };
 
 
@@ -178,8 +264,8 @@ class CNetMessage
 public:
     bool in_data; // parsing header (false) or data (true)
 
-    CDataStream hdrbuf; // partially received header
-    CMessageHeader hdr; // complete header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
+    CMessageHeader hdr;                        // complete header
     unsigned int nHdrPos;
 
     CDataStream vRecv; // received message data
@@ -187,9 +273,8 @@ public:
 
     int64_t nTime; // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn)
     {
-        hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
@@ -205,12 +290,15 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
+
+    // Make room for the next part of the payload and return where it goes, so
+    // it can be received in place; readData() then skips the copy.
+    char* prepareData(unsigned int& nSpace);
 };
 
 
@@ -275,6 +363,16 @@ public:
 
 typedef std::map<CSubNet, CBanEntry> banmap_t;
 
+/** A message PushMessage serialized, waiting in CNode::pSendQueue */
+struct CSendQueueEntry {
+    CDataStream ssMsg;
+    //! Goes out ahead of the bulk messages queued before it that are not on the wire yet
+    bool fPriority;
+    CSendQueueEntry* pnext;
+
+    explicit CSendQueueEntry(int nVersion) : ssMsg(SER_NETWORK, nVersion), fPriority(false), pnext(NULL) {}
+};
+
 
 /** Information about a peer */
 class CNode
@@ -283,15 +381,23 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream ssSend;
-    size_t nSendSize;   // total size of all vSendMsg entries
-    size_t nSendOffset; // offset inside the first vSendMsg already sent
+    int nSocketEvents; // events registered with the socket handler's poller, -1 if none (socket handler thread only)
+    std::atomic<int> nSendVersion;
+    std::atomic<size_t> nSendSize; // total size of the messages in pSendQueue and vSendMsg
+    size_t nSendOffset;            // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
+    // Messages are pushed here by any thread without a lock, newest first,
+    // and moved to vSendMsg by whoever sends under cs_vSend
+    std::atomic<CSendQueueEntry*> pSendQueue;
     std::deque<CSerializeData> vSendMsg;
+    size_t nSendPriority;     // buffers at the front of vSendMsg that the bulk ones wait behind
+    CSerializeData sendSpare; // a sent coalescing buffer, kept to queue the next messages in
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
+    //! Orphans whose parents this node's transactions provided, reprocessed one at a time
+    std::set<uint256> setOrphanWorkSet;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
@@ -316,6 +422,10 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // The socket still waits for its connect() to complete, the socket handler
+    // finishes it or gives up at nConnectDeadline (milliseconds); set under cs_vSend
+    bool fConnecting;
+    int64_t nConnectDeadline;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
@@ -348,7 +458,7 @@ protected:
     static CCriticalSection cs_vWhitelistedRange;
 
     // Basic fuzz-testing
-    void Fuzz(int nChance); // modifies ssSend
+    void Fuzz(CDataStream& ssMsg, int nChance);
 
 public:
     uint256 hashContinue;
@@ -356,13 +466,18 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
+    int64_t nNextAddrSend; // microseconds
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    bool fInventoryUrgent; // vInventoryToSend holds an inv that cannot wait for nNextInvSend
+    int64_t nNextInvSend;  // microseconds
+    // masternode pings for peers of COMPACT_MNP_VERSION, sent with the inventory batch as one "mnpann"
+    std::vector<std::pair<uint256, CMasternodePingAnnounce> > vPingAnnounceToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
     std::vector<uint256> vBlockRequested;
@@ -377,7 +492,7 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn = false);
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn = false, bool fConnectingIn = false);
     ~CNode();
 
 private:
@@ -387,6 +502,19 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // -maxuploadtarget, guarded by cs_totalBytesSent
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+
+    // Per command, for this peer and for all of them since startup
+    CCriticalSection cs_msgStats;
+    mapMsgCmdStats mapMsgStats;
+    static CCriticalSection cs_totalMsgStats;
+    static mapMsgCmdStats mapTotalMsgStats;
+
+    static CNetMsgStats& MsgStatsFor(mapMsgCmdStats& mapStats, const std::string& strCommand);
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -436,7 +564,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -444,7 +572,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -458,7 +586,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.GetKey());
         }
     }
 
@@ -466,190 +594,216 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.GetKey())) {
                 vInventoryToSend.push_back(inv);
+                if (inv.IsUrgent())
+                    fInventoryUrgent = true;
+            }
+        }
+    }
+
+    //! Announce a masternode ping by short id, hash being its MSG_MASTERNODE_PING inv hash
+    void PushPingAnnounce(const uint256& hash, const CMasternodePingAnnounce& announce)
+    {
+        {
+            LOCK(cs_inventory);
+            if (!filterInventoryKnown.contains(CInv(MSG_MASTERNODE_PING, hash).GetKey()))
+                vPingAnnounceToSend.push_back(std::make_pair(hash, announce));
         }
     }
 
     void AskFor(const CInv& inv);
 
-    // TODO: Document the postcondition of this function.  Is cs_vSend locked?
-    void BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend);
+    /**
+     * A message to pszCommand with its header written, for the caller to
+     * serialize the payload into without any lock held. It is queued by
+     * EndMessage() or freed by AbortMessage(). New blocks, SwiftTX locks and
+     * masternode payment votes take the priority lane.
+     */
+    CSendQueueEntry* BeginMessage(const char* pszCommand);
 
-    // TODO: Document the precondition of this function.  Is cs_vSend locked?
-    void AbortMessage() UNLOCK_FUNCTION(cs_vSend);
+    void AbortMessage(CSendQueueEntry* pentry);
 
-    // TODO: Document the precondition of this function.  Is cs_vSend locked?
-    void EndMessage() UNLOCK_FUNCTION(cs_vSend);
+    /** Finish the header and queue the message; sent right away if nothing else waits and cs_vSend is free */
+    void EndMessage(CSendQueueEntry* pentry);
 
     void PushVersion();
 
-
-    void PushMessage(const char* pszCommand)
+    /** PushMessage for bulk traffic, such as old blocks to a syncing peer, which the priority commands overtake */
+    template <typename T1>
+    void PushBulkMessage(const char* pszCommand, const T1& a1)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
+        pentry->fPriority = false;
         try {
-            BeginMessage(pszCommand);
-            EndMessage();
+            pentry->ssMsg << a1;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
+    }
+
+
+    void PushMessage(const char* pszCommand)
+    {
+        EndMessage(BeginMessage(pszCommand));
     }
 
     template <typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1;
-            EndMessage();
+            pentry->ssMsg << a1;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2;
-            EndMessage();
+            pentry->ssMsg << a1 << a2;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2, typename T3>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2 << a3;
-            EndMessage();
+            pentry->ssMsg << a1 << a2 << a3;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2, typename T3, typename T4>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2 << a3 << a4;
-            EndMessage();
+            pentry->ssMsg << a1 << a2 << a3 << a4;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2, typename T3, typename T4, typename T5>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2 << a3 << a4 << a5;
-            EndMessage();
+            pentry->ssMsg << a1 << a2 << a3 << a4 << a5;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2, typename T3, typename T4, typename T5, typename T6>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2 << a3 << a4 << a5 << a6;
-            EndMessage();
+            pentry->ssMsg << a1 << a2 << a3 << a4 << a5 << a6;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6, const T7& a7)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7;
-            EndMessage();
+            pentry->ssMsg << a1 << a2 << a3 << a4 << a5 << a6 << a7;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6, const T7& a7, const T8& a8)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
-            EndMessage();
+            pentry->ssMsg << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6, const T7& a7, const T8& a8, const T9& a9)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
-            EndMessage();
+            pentry->ssMsg << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9, typename T10>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6, const T7& a7, const T8& a8, const T9& a9, const T10& a10)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9 << a10;
-            EndMessage();
+            pentry->ssMsg << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9 << a10;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9, typename T10, typename T11>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6, const T7& a7, const T8& a8, const T9& a9, const T10& a10, const T11& a11)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9 << a10 << a11;
-            EndMessage();
+            pentry->ssMsg << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9 << a10 << a11;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     template <typename T1, typename T2, typename T3, typename T4, typename T5, typename T6, typename T7, typename T8, typename T9, typename T10, typename T11, typename T12>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2, const T3& a3, const T4& a4, const T5& a5, const T6& a6, const T7& a7, const T8& a8, const T9& a9, const T10& a10, const T11& a11, const T12& a12)
     {
+        CSendQueueEntry* pentry = BeginMessage(pszCommand);
         try {
-            BeginMessage(pszCommand);
-            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9 << a10 << a11 << a12;
-            EndMessage();
+            pentry->ssMsg << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9 << a10 << a11 << a12;
         } catch (...) {
-            AbortMessage();
+            AbortMessage(pentry);
             throw;
         }
+        EndMessage(pentry);
     }
 
     bool HasFulfilledRequest(std::string strRequest)
@@ -726,6 +880,25 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //! Bytes all peers may be sent in MAX_UPLOAD_TIMEFRAME, 0 for no limit
+    static void SetMaxOutboundTarget(uint64_t nLimit);
+    static uint64_t GetMaxOutboundTarget();
+    /**
+     * Whether the upload target is used up. For historical blocks, whether
+     * only what relaying every new block of the cycle once takes is left.
+     */
+    static bool OutboundTargetReached(bool fHistoricalBlockServingLimit);
+    static uint64_t GetOutboundTargetBytesLeft();
+    //! Seconds until the bytes sent are counted from zero again
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
+
+    //! A message was queued for sending, nBytes with its header
+    void RecordMsgSent(const std::string& strCommand, uint64_t nBytes);
+    //! A received message was handled, nBytes with its header, in nProcessTime microseconds
+    void RecordMsgProcessed(const std::string& strCommand, uint64_t nBytes, int64_t nProcessTime);
+    static void GetTotalMsgStats(mapMsgCmdStats& mapStats);
+    static void ResetTotalMsgStats();
 };
 
 class CExplicitNetCleanup
@@ -739,6 +912,11 @@ void RelayTransaction(const CTransaction& tx);
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
+//! RelayInv for many items, queued to each peer in one go
+void RelayInvs(const std::vector<CInv>& vInv);
+
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
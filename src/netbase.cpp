@@ -442,9 +442,10 @@ bool static Socks5(string strDest, int port, const ProxyCredentials *auth, SOCKE
     return true;
 }
 
-bool static ConnectSocketDirectly(const CService& addrConnect, SOCKET& hSocketRet, int nTimeout)
+bool ConnectSocketStart(const CService& addrConnect, SOCKET& hSocketRet, bool& fPendingRet)
 {
     hSocketRet = INVALID_SOCKET;
+    fPendingRet = false;
 
     struct sockaddr_storage sockaddr;
     socklen_t len = sizeof(sockaddr);
@@ -464,52 +465,76 @@ bool static ConnectSocketDirectly(const CService& addrConnect, SOCKET& hSocketRe
 #endif
 
     // Set to non-blocking
-    if (!SetSocketNonBlocking(hSocket, true))
-        return error("ConnectSocketDirectly: Setting socket to non-blocking failed, error %s\n", NetworkErrorString(WSAGetLastError()));
+    if (!SetSocketNonBlocking(hSocket, true)) {
+        CloseSocket(hSocket);
+        return error("ConnectSocketStart: Setting socket to non-blocking failed, error %s\n", NetworkErrorString(WSAGetLastError()));
+    }
 
     if (connect(hSocket, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR) {
         int nErr = WSAGetLastError();
         // WSAEINVAL is here because some legacy version of winsock uses it
-        if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL) {
-            struct timeval timeout = MillisToTimeval(nTimeout);
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
-            if (nRet == 0) {
-                LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
-                CloseSocket(hSocket);
-                return false;
-            }
-            if (nRet == SOCKET_ERROR) {
-                LogPrint("net","select() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
-                CloseSocket(hSocket);
-                return false;
-            }
-            socklen_t nRetSize = sizeof(nRet);
+        if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL)
+            fPendingRet = true;
 #ifdef WIN32
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+        else if (nErr != WSAEISCONN)
 #else
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+        else
 #endif
-            {
-                LogPrint("net","getsockopt() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
-                CloseSocket(hSocket);
-                return false;
-            }
-            if (nRet != 0) {
-                LogPrint("net","connect() to %s failed after select(): %s\n", addrConnect.ToString(), NetworkErrorString(nRet));
-                CloseSocket(hSocket);
-                return false;
-            }
+        {
+            LogPrint("net","connect() to %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(nErr));
+            CloseSocket(hSocket);
+            return false;
         }
+    }
+
+    hSocketRet = hSocket;
+    return true;
+}
+
+bool ConnectSocketFinish(const CService& addrConnect, SOCKET hSocket)
+{
+    int nRet = 0;
+    socklen_t nRetSize = sizeof(nRet);
 #ifdef WIN32
-        else if (WSAGetLastError() != WSAEISCONN)
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
 #else
-        else
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
 #endif
-        {
-            LogPrint("net","connect() to %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+    {
+        LogPrint("net","getsockopt() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+    if (nRet != 0) {
+        LogPrint("net","connect() to %s failed after select(): %s\n", addrConnect.ToString(), NetworkErrorString(nRet));
+        return false;
+    }
+    return true;
+}
+
+bool static ConnectSocketDirectly(const CService& addrConnect, SOCKET& hSocketRet, int nTimeout)
+{
+    SOCKET hSocket;
+    bool fPending;
+    if (!ConnectSocketStart(addrConnect, hSocket, fPending))
+        return false;
+
+    if (fPending) {
+        struct timeval timeout = MillisToTimeval(nTimeout);
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(hSocket, &fdset);
+        int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+        if (nRet == 0) {
+            LogPrint("net", "connection to %s timeout\n", addrConnect.ToString());
+            CloseSocket(hSocket);
+            return false;
+        }
+        if (nRet == SOCKET_ERROR) {
+            LogPrint("net","select() for %s failed: %s\n", addrConnect.ToString(), NetworkErrorString(WSAGetLastError()));
+            CloseSocket(hSocket);
+            return false;
+        }
+        if (!ConnectSocketFinish(addrConnect, hSocket)) {
             CloseSocket(hSocket);
             return false;
         }
@@ -212,6 +212,13 @@ bool Lookup(const char* pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char* pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService& addr, SOCKET& hSocketRet, int nTimeout, bool* outProxyConnectionFailed = 0);
 bool ConnectSocketByName(CService& addr, SOCKET& hSocketRet, const char* pszDest, int portDefault, int nTimeout, bool* outProxyConnectionFailed = 0);
+/**
+ * Start a direct non-blocking connection to addrConnect, without a proxy.
+ * fPendingRet tells whether it is still in progress: the socket becomes
+ * writable once it is done, and ConnectSocketFinish() tells how it went.
+ */
+bool ConnectSocketStart(const CService& addrConnect, SOCKET& hSocketRet, bool& fPendingRet);
+bool ConnectSocketFinish(const CService& addrConnect, SOCKET hSocket);
 /** Return readable error string for a network error code */
 std::string NetworkErrorString(int err);
 /** Close socket and set hSocket to INVALID_SOCKET */
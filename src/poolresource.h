@@ -0,0 +1,201 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_POOLRESOURCE_H
+#define BITCOIN_POOLRESOURCE_H
+
+#include "largepages.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+/**
+ * Memory pool for many small objects of a few fixed sizes, such as the nodes
+ * of a node based container.
+ *
+ * Blocks are carved out of large chunks and recycled through one free list
+ * per size. Nothing is returned to the system until Release(), which frees
+ * all chunks at once and must only be called once every block has been
+ * deallocated. This keeps the heap from fragmenting under a container that
+ * constantly inserts and erases, and makes the memory it uses easy to tell.
+ * A pool made for large pages takes chunks of one huge page each from
+ * LargePageAllocate.
+ */
+class CPoolResource : private boost::noncopyable
+{
+public:
+    //! Allocations are rounded up to a multiple of this; also their alignment
+    static const size_t ALIGN = sizeof(void*) > 8 ? sizeof(void*) : 8;
+    //! Largest block served from the pool, bigger ones go to operator new
+    static const size_t MAX_BLOCK_SIZE = 256;
+    //! Size of the chunks requested from the system, LARGE_PAGE_SIZE with huge pages
+    static const size_t CHUNK_SIZE = 256 * 1024;
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    std::vector<char*> vChunks;
+    FreeBlock* vFreeLists[MAX_BLOCK_SIZE / ALIGN + 1];
+    char* pchAvail;
+    char* pchEnd;
+    size_t nOutstanding;
+    const size_t nChunkSize;
+
+    static size_t Index(size_t nBytes) { return (nBytes + ALIGN - 1) / ALIGN; }
+
+public:
+    explicit CPoolResource(bool fLargePages = false) : pchAvail(NULL), pchEnd(NULL), nOutstanding(0), nChunkSize(fLargePages ? LARGE_PAGE_SIZE : CHUNK_SIZE)
+    {
+        for (size_t i = 0; i <= MAX_BLOCK_SIZE / ALIGN; i++)
+            vFreeLists[i] = NULL;
+    }
+
+    ~CPoolResource()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            LargePageFree(vChunks[i], nChunkSize);
+    }
+
+    static bool Serves(size_t nBytes, size_t nAlign) { return nBytes <= MAX_BLOCK_SIZE && nAlign <= ALIGN; }
+
+    void* Allocate(size_t nBytes)
+    {
+        assert(nBytes > 0 && nBytes <= MAX_BLOCK_SIZE);
+        size_t nIndex = Index(nBytes);
+        nOutstanding++;
+        if (vFreeLists[nIndex]) {
+            FreeBlock* block = vFreeLists[nIndex];
+            vFreeLists[nIndex] = block->next;
+            return block;
+        }
+        size_t nSize = nIndex * ALIGN;
+        if ((size_t)(pchEnd - pchAvail) < nSize) {
+            // The tail of the old chunk is too small for this size; it stays
+            // unused until Release(), which wastes less than one block.
+            vChunks.reserve(vChunks.size() + 1);
+            pchAvail = static_cast<char*>(LargePageAllocate(nChunkSize));
+            pchEnd = pchAvail + nChunkSize;
+            vChunks.push_back(pchAvail);
+        }
+        void* p = pchAvail;
+        pchAvail += nSize;
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nBytes)
+    {
+        assert(nOutstanding > 0);
+        size_t nIndex = Index(nBytes);
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+        block->next = vFreeLists[nIndex];
+        vFreeLists[nIndex] = block;
+        nOutstanding--;
+    }
+
+    //! Give all chunks back to the system. No block may be in use.
+    void Release()
+    {
+        assert(nOutstanding == 0);
+        for (size_t i = 0; i < vChunks.size(); i++)
+            LargePageFree(vChunks[i], nChunkSize);
+        std::vector<char*>().swap(vChunks);
+        for (size_t i = 0; i <= MAX_BLOCK_SIZE / ALIGN; i++)
+            vFreeLists[i] = NULL;
+        pchAvail = pchEnd = NULL;
+    }
+
+    size_t GetChunkCount() const { return vChunks.size(); }
+    size_t GetChunkSize() const { return nChunkSize; }
+    bool UsesLargePages() const { return nChunkSize == LARGE_PAGE_SIZE; }
+    size_t GetOutstanding() const { return nOutstanding; }
+};
+
+/**
+ * Allocator that takes single small objects from a CPoolResource and hands
+ * everything else (such as the bucket arrays of hash maps) to operator new,
+ * or to LargePageAllocate for a pool made for large pages. A default
+ * constructed allocator has no pool and always uses operator new.
+ */
+template <typename T>
+struct pool_allocator {
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    template <typename U>
+    struct rebind {
+        typedef pool_allocator<U> other;
+    };
+
+    CPoolResource* pool;
+
+    pool_allocator() throw() : pool(NULL) {}
+    explicit pool_allocator(CPoolResource* poolIn) throw() : pool(poolIn) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) throw() : pool(a.pool)
+    {
+    }
+
+    T* allocate(size_t n, const void* hint = 0)
+    {
+        if (pool && n == 1 && CPoolResource::Serves(sizeof(T), __alignof__(T)))
+            return static_cast<T*>(pool->Allocate(sizeof(T)));
+        if (pool && pool->UsesLargePages())
+            return static_cast<T*>(LargePageAllocate(n * sizeof(T)));
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if (pool && n == 1 && CPoolResource::Serves(sizeof(T), __alignof__(T)))
+            pool->Deallocate(p, sizeof(T));
+        else if (pool && pool->UsesLargePages())
+            LargePageFree(p, n * sizeof(T));
+        else
+            ::operator delete(p);
+    }
+
+    size_t max_size() const throw() { return size_t(-1) / sizeof(T); }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new ((void*)p) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    void destroy(U* p)
+    {
+        p->~U();
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const pool_allocator<T>& a, const pool_allocator<U>& b)
+{
+    return a.pool == b.pool;
+}
+
+template <typename T, typename U>
+bool operator!=(const pool_allocator<T>& a, const pool_allocator<U>& b)
+{
+    return a.pool != b.pool;
+}
+
+#endif // BITCOIN_POOLRESOURCE_H
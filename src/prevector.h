@@ -0,0 +1,311 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PREVECTOR_H
+#define BITCOIN_PREVECTOR_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+#include <new>
+
+#pragma pack(push, 1)
+/**
+ * A vector that stores up to N elements inline in the object, and only
+ * allocates on the heap beyond that. With N = 28 chars it takes 32 bytes,
+ * 8 more than an empty std::vector on 64-bit platforms, and the usual
+ * output scripts fit inline, so copying them does not allocate.
+ *
+ * The elements are moved around with memcpy and memmove, and are neither
+ * constructed nor destroyed, so T must be a trivially copyable type. The
+ * iterators are plain pointers, invalidated like those of std::vector, and
+ * also when the size crosses N, when the elements move between the inline
+ * buffer and the heap.
+ *
+ * The class is packed: the heap pointer is not aligned.
+ */
+template <unsigned int N, typename T, typename Size = uint32_t, typename Diff = int32_t>
+class prevector
+{
+public:
+    typedef Size size_type;
+    typedef Diff difference_type;
+    typedef T value_type;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef value_type* pointer;
+    typedef const value_type* const_pointer;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+private:
+    //! The size when the elements are inline (at most N), N + 1 + the size when they are on the heap
+    size_type _size;
+    union direct_or_indirect {
+        char direct[sizeof(T) * N];
+        struct {
+            size_type capacity;
+            char* indirect;
+        };
+    } _union;
+
+    T* direct_ptr(difference_type pos) { return reinterpret_cast<T*>(_union.direct) + pos; }
+    const T* direct_ptr(difference_type pos) const { return reinterpret_cast<const T*>(_union.direct) + pos; }
+    T* indirect_ptr(difference_type pos) { return reinterpret_cast<T*>(_union.indirect) + pos; }
+    const T* indirect_ptr(difference_type pos) const { return reinterpret_cast<const T*>(_union.indirect) + pos; }
+    bool is_direct() const { return _size <= N; }
+
+    T* item_ptr(difference_type pos) { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
+    const T* item_ptr(difference_type pos) const { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
+
+    void change_capacity(size_type new_capacity)
+    {
+        if (new_capacity <= N) {
+            if (!is_direct()) {
+                T* indirect = indirect_ptr(0);
+                T* src = indirect;
+                T* dst = direct_ptr(0);
+                memcpy(dst, src, size() * sizeof(T));
+                free(indirect);
+                _size -= N + 1;
+            }
+        } else {
+            if (!is_direct()) {
+                // realloc keeps the elements, and grows in place when it can
+                char* indirect = static_cast<char*>(realloc(_union.indirect, ((size_t)sizeof(T)) * new_capacity));
+                if (!indirect)
+                    throw std::bad_alloc();
+                _union.indirect = indirect;
+                _union.capacity = new_capacity;
+            } else {
+                char* indirect = static_cast<char*>(malloc(((size_t)sizeof(T)) * new_capacity));
+                if (!indirect)
+                    throw std::bad_alloc();
+                T* src = direct_ptr(0);
+                T* dst = reinterpret_cast<T*>(indirect);
+                memcpy(dst, src, size() * sizeof(T));
+                _union.indirect = indirect;
+                _union.capacity = new_capacity;
+                _size += N + 1;
+            }
+        }
+    }
+
+    //! Make room for nCount more elements, growing geometrically like std::vector
+    void grow(size_type nCount)
+    {
+        size_type nNeeded = size() + nCount;
+        if (capacity() < nNeeded)
+            change_capacity(std::max((size_t)nNeeded, capacity() + (capacity() >> 1)));
+    }
+
+    template <typename InputIterator>
+    void fill(T* dst, InputIterator first, InputIterator last)
+    {
+        while (first != last)
+            *dst++ = *first++;
+    }
+
+public:
+    prevector() : _size(0) {}
+
+    explicit prevector(size_type n) : _size(0) { resize(n); }
+
+    explicit prevector(size_type n, const T& val) : _size(0)
+    {
+        change_capacity(n);
+        _size += n;
+        for (size_type i = 0; i < n; i++)
+            *item_ptr(i) = val;
+    }
+
+    template <typename InputIterator>
+    prevector(InputIterator first, InputIterator last) : _size(0)
+    {
+        size_type n = std::distance(first, last);
+        change_capacity(n);
+        _size += n;
+        fill(item_ptr(0), first, last);
+    }
+
+    prevector(const prevector<N, T, Size, Diff>& other) : _size(0)
+    {
+        size_type n = other.size();
+        change_capacity(n);
+        _size += n;
+        memcpy(item_ptr(0), other.item_ptr(0), n * sizeof(T));
+    }
+
+    ~prevector()
+    {
+        if (!is_direct())
+            free(_union.indirect);
+    }
+
+    prevector& operator=(const prevector<N, T, Size, Diff>& other)
+    {
+        if (&other == this)
+            return *this;
+        assign(other.begin(), other.end());
+        return *this;
+    }
+
+    void assign(size_type n, const T& val)
+    {
+        clear();
+        if (capacity() < n)
+            change_capacity(n);
+        _size += n;
+        for (size_type i = 0; i < n; i++)
+            *item_ptr(i) = val;
+    }
+
+    template <typename InputIterator>
+    void assign(InputIterator first, InputIterator last)
+    {
+        size_type n = std::distance(first, last);
+        clear();
+        if (capacity() < n)
+            change_capacity(n);
+        _size += n;
+        fill(item_ptr(0), first, last);
+    }
+
+    size_type size() const { return is_direct() ? _size : _size - N - 1; }
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return is_direct() ? N : _union.capacity; }
+
+    iterator begin() { return item_ptr(0); }
+    const_iterator begin() const { return item_ptr(0); }
+    iterator end() { return item_ptr(size()); }
+    const_iterator end() const { return item_ptr(size()); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    T& operator[](size_type pos) { return *item_ptr(pos); }
+    const T& operator[](size_type pos) const { return *item_ptr(pos); }
+    T& front() { return *item_ptr(0); }
+    const T& front() const { return *item_ptr(0); }
+    T& back() { return *item_ptr(size() - 1); }
+    const T& back() const { return *item_ptr(size() - 1); }
+    T* data() { return item_ptr(0); }
+    const T* data() const { return item_ptr(0); }
+
+    void reserve(size_type new_capacity)
+    {
+        if (new_capacity > capacity())
+            change_capacity(new_capacity);
+    }
+
+    //! Give heap memory back when no longer needed, like std::vector::shrink_to_fit
+    void shrink_to_fit() { change_capacity(size()); }
+
+    void resize(size_type new_size)
+    {
+        size_type cur_size = size();
+        if (new_size == cur_size)
+            return;
+        if (new_size < cur_size) {
+            _size -= cur_size - new_size;
+            return;
+        }
+        if (new_size > capacity())
+            change_capacity(new_size);
+        _size += new_size - cur_size;
+        memset(item_ptr(cur_size), 0, (new_size - cur_size) * sizeof(T));
+    }
+
+    void clear() { resize(0); }
+
+    iterator insert(iterator pos, const T& value)
+    {
+        size_type p = pos - begin();
+        // value may be an element of this vector, which grow() moves
+        T copy = value;
+        grow(1);
+        memmove(item_ptr(p + 1), item_ptr(p), (size() - p) * sizeof(T));
+        *item_ptr(p) = copy;
+        _size++;
+        return item_ptr(p);
+    }
+
+    void insert(iterator pos, size_type count, const T& value)
+    {
+        size_type p = pos - begin();
+        T copy = value;
+        grow(count);
+        memmove(item_ptr(p + count), item_ptr(p), (size() - p) * sizeof(T));
+        for (size_type i = 0; i < count; i++)
+            *item_ptr(p + i) = copy;
+        _size += count;
+    }
+
+    template <typename InputIterator>
+    void insert(iterator pos, InputIterator first, InputIterator last)
+    {
+        size_type p = pos - begin();
+        difference_type count = std::distance(first, last);
+        if (count == 0)
+            return;
+        // The range must not come from this vector, as for std::vector
+        grow(count);
+        memmove(item_ptr(p + count), item_ptr(p), (size() - p) * sizeof(T));
+        fill(item_ptr(p), first, last);
+        _size += count;
+    }
+
+    iterator erase(iterator pos) { return erase(pos, pos + 1); }
+
+    iterator erase(iterator first, iterator last)
+    {
+        memmove(first, last, (end() - last) * sizeof(T));
+        _size -= last - first;
+        return first;
+    }
+
+    void push_back(const T& value)
+    {
+        T copy = value;
+        grow(1);
+        *item_ptr(size()) = copy;
+        _size++;
+    }
+
+    void pop_back() { _size--; }
+
+    void swap(prevector<N, T, Size, Diff>& other)
+    {
+        std::swap(_union, other._union);
+        std::swap(_size, other._size);
+    }
+
+    bool operator==(const prevector<N, T, Size, Diff>& other) const
+    {
+        return size() == other.size() && memcmp(item_ptr(0), other.item_ptr(0), size() * sizeof(T)) == 0;
+    }
+
+    bool operator!=(const prevector<N, T, Size, Diff>& other) const
+    {
+        return !(*this == other);
+    }
+
+    bool operator<(const prevector<N, T, Size, Diff>& other) const
+    {
+        return std::lexicographical_compare(begin(), end(), other.begin(), other.end());
+    }
+
+    //! Heap memory in use, for memusage
+    size_t allocated_memory() const { return is_direct() ? 0 : ((size_t)sizeof(T)) * _union.capacity; }
+};
+#pragma pack(pop)
+
+#endif // BITCOIN_PREVECTOR_H
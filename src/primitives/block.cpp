@@ -6,6 +6,8 @@
 
 #include "primitives/block.h"
 
+#include "crypto/sha256.h"
+#include "ecwrapper.h"
 #include "hash.h"
 #include "script/standard.h"
 #include "script/sign.h"
@@ -13,11 +15,113 @@
 #include "utilstrencodings.h"
 #include "util.h"
 
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
 uint256 CBlockHeader::GetHash() const
 {
     return HashQuark(BEGIN(nVersion), END(nNonce));
 }
 
+/** Guards the header and hash of every CBlockHashMemo, held for a compare or a copy only;
+ * made on first use, as blocks of the chain parameters are built during static initialization */
+static boost::mutex& BlockHashMemoMutex()
+{
+    static boost::mutex csBlockHashMemo;
+    return csBlockHashMemo;
+}
+
+static bool SameHeader(const CBlockHeader& a, const CBlockHeader& b)
+{
+    return memcmp(BEGIN(a.nVersion), BEGIN(b.nVersion), END(a.nNonce) - BEGIN(a.nVersion)) == 0;
+}
+
+CBlockHashMemo::CBlockHashMemo(const CBlockHashMemo& other)
+{
+    boost::lock_guard<boost::mutex> lock(BlockHashMemoMutex());
+    headerHashed = other.headerHashed;
+    hashCached = other.hashCached;
+}
+
+CBlockHashMemo& CBlockHashMemo::operator=(const CBlockHashMemo& other)
+{
+    if (this != &other) {
+        boost::lock_guard<boost::mutex> lock(BlockHashMemoMutex());
+        headerHashed = other.headerHashed;
+        hashCached = other.hashCached;
+    }
+    return *this;
+}
+
+bool CBlockHashMemo::Get(const CBlockHeader& header, uint256& hashRet) const
+{
+    boost::lock_guard<boost::mutex> lock(BlockHashMemoMutex());
+    if (headerHashed.IsNull() || !SameHeader(header, headerHashed))
+        return false;
+    hashRet = hashCached;
+    return true;
+}
+
+void CBlockHashMemo::Set(const CBlockHeader& header, const uint256& hashIn)
+{
+    boost::lock_guard<boost::mutex> lock(BlockHashMemoMutex());
+    headerHashed = header;
+    hashCached = hashIn;
+}
+
+void CBlockHashMemo::SetNull()
+{
+    boost::lock_guard<boost::mutex> lock(BlockHashMemoMutex());
+    headerHashed.SetNull();
+    hashCached.SetNull();
+}
+
+uint256 CBlock::GetHash() const
+{
+    // a null header is not kept by the memo, so null headers are hashed each time
+    CBlockHeader header = GetBlockHeader();
+    uint256 hash;
+    if (!hashMemo.Get(header, hash)) {
+        hash = header.GetHash();
+        hashMemo.Set(header, hash);
+    }
+    return hash;
+}
+
+/** Minimum number of headers handed to each hashing thread */
+static const size_t HEADER_HASH_THREAD_MIN = 256;
+
+static void HashHeaderRange(const CBlockHeader* pheaders, size_t nCount, uint256* pout)
+{
+    HashQuarkLanes((const unsigned char*)&pheaders[0].nVersion, END(pheaders[0].nNonce) - BEGIN(pheaders[0].nVersion),
+                   sizeof(CBlockHeader), nCount, pout);
+}
+
+void GetBlockHeaderHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes)
+{
+    vHashes.resize(vHeaders.size());
+    if (vHeaders.empty())
+        return;
+
+    size_t nThreads = std::min<size_t>(std::max(boost::thread::hardware_concurrency(), 1U), vHeaders.size() / HEADER_HASH_THREAD_MIN);
+    if (nThreads <= 1) {
+        HashHeaderRange(&vHeaders[0], vHeaders.size(), &vHashes[0]);
+        return;
+    }
+
+    // Keep every chunk a multiple of the lane width so no thread ends on a partial group
+    size_t nChunk = (vHeaders.size() + nThreads - 1) / nThreads;
+    nChunk = (nChunk + QUARK_LANES - 1) / QUARK_LANES * QUARK_LANES;
+
+    boost::thread_group threadGroup;
+    for (size_t nStart = nChunk; nStart < vHeaders.size(); nStart += nChunk) {
+        size_t nCount = std::min(nChunk, vHeaders.size() - nStart);
+        threadGroup.create_thread(boost::bind(&HashHeaderRange, &vHeaders[nStart], nCount, &vHashes[nStart]));
+    }
+    HashHeaderRange(&vHeaders[0], std::min(nChunk, vHeaders.size()), &vHashes[0]);
+    threadGroup.join_all();
+}
+
 uint256 CBlock::BuildMerkleTree(bool* fMutated) const
 {
     /* WARNING! If you're reading this because you're learning about crypto
@@ -63,15 +167,18 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     bool mutated = false;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        if (nSize % 2 == 0 && vMerkleTree[j+nSize-2] == vMerkleTree[j+nSize-1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
+        }
+        // The pairs of the level are consecutive 64-byte inputs, hashed together
+        size_t nNext = vMerkleTree.size();
+        vMerkleTree.resize(nNext + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[nNext].begin(), vMerkleTree[j].begin(), nSize / 2);
+        if (nSize % 2 == 1) {
+            // An odd node out is hashed with itself
+            vMerkleTree.back() = Hash(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                      BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
         }
         j += nSize;
     }
@@ -81,13 +188,45 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     return (vMerkleTree.empty() ? uint256() : vMerkleTree.back());
 }
 
+uint256 ComputeMerkleRoot(std::vector<uint256>& vHashes, bool* fMutated)
+{
+    // Each level is hashed over the previous one, as in BuildMerkleTree
+    bool mutated = false;
+    while (vHashes.size() > 1) {
+        if (vHashes.size() % 2 == 0 && vHashes[vHashes.size() - 2] == vHashes.back())
+            mutated = true;
+        if (vHashes.size() % 2 == 1)
+            vHashes.push_back(vHashes.back());
+        SHA256D64(vHashes[0].begin(), vHashes[0].begin(), vHashes.size() / 2);
+        vHashes.resize(vHashes.size() / 2);
+    }
+    if (fMutated)
+        *fMutated = mutated;
+    return vHashes.empty() ? uint256() : vHashes[0];
+}
+
+uint256 CBlock::ComputeMerkleRoot(bool* fMutated) const
+{
+    vMerkleTree.clear();
+    std::vector<uint256> vHashes;
+    vHashes.reserve(vtx.size() + 1);
+    for (std::vector<CTransaction>::const_iterator it(vtx.begin()); it != vtx.end(); ++it)
+        vHashes.push_back(it->GetHash());
+    return ::ComputeMerkleRoot(vHashes, fMutated);
+}
+
 std::vector<uint256> CBlock::GetMerkleBranch(int nIndex) const
 {
     if (vMerkleTree.empty())
         BuildMerkleTree();
+    return GetMerkleBranch(vMerkleTree, vtx.size(), nIndex);
+}
+
+std::vector<uint256> CBlock::GetMerkleBranch(const std::vector<uint256>& vMerkleTree, int nTx, int nIndex)
+{
     std::vector<uint256> vMerkleBranch;
     int j = 0;
-    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    for (int nSize = nTx; nSize > 1; nSize = (nSize + 1) / 2)
     {
         int i = std::min(nIndex^1, nSize-1);
         vMerkleBranch.push_back(vMerkleTree[j+i]);
@@ -215,6 +354,20 @@ bool CBlock::SignBlock(const CKeyStore& keystore)
     return false;
 }
 
+/**
+ * Block signatures are not held to strict DER the way script signatures are
+ * by SCRIPT_VERIFY_DERSIG, and the libsecp256k1 parser behind CPubKey::Verify
+ * accepts a different set of encodings than OpenSSL did. They are verified
+ * through OpenSSL as before, so nodes keep agreeing on which blocks are valid.
+ */
+static bool VerifyBlockSignature(const CPubKey& pubkey, const uint256& hash, const std::vector<unsigned char>& vchSig)
+{
+    CECKey key;
+    if (!key.SetPubKey(pubkey.begin(), pubkey.size()))
+        return false;
+    return key.Verify(hash, vchSig);
+}
+
 bool CBlock::CheckBlockSignature() const
 {
     if (IsProofOfWork())
@@ -238,7 +391,7 @@ bool CBlock::CheckBlockSignature() const
         if (vchBlockSig.empty())
             return false;
 
-        return pubkey.Verify(GetHash(), vchBlockSig);
+        return VerifyBlockSignature(pubkey, GetHash(), vchBlockSig);
     }
     else if(whichType == TX_PUBKEYHASH)
     {
@@ -253,7 +406,7 @@ bool CBlock::CheckBlockSignature() const
         if (vchBlockSig.empty())
             return false;
 
-        return pubkey.Verify(GetHash(), vchBlockSig);
+        return VerifyBlockSignature(pubkey, GetHash(), vchBlockSig);
 
     }
 
@@ -77,6 +77,28 @@ public:
 };
 
 
+/**
+ * A header and its hash, shared by the threads that hash the same const CBlock.
+ * Reads, writes and copies hold one lock for all memos; the hash itself is
+ * computed outside of it.
+ */
+class CBlockHashMemo
+{
+public:
+    CBlockHashMemo() { SetNull(); }
+    CBlockHashMemo(const CBlockHashMemo& other);
+    CBlockHashMemo& operator=(const CBlockHashMemo& other);
+
+    //! The hash of header if it is the one hashed last; the hash of a null header is never kept
+    bool Get(const CBlockHeader& header, uint256& hashRet) const;
+    void Set(const CBlockHeader& header, const uint256& hashIn);
+    void SetNull();
+
+private:
+    CBlockHeader headerHashed;
+    uint256 hashCached;
+};
+
 class CBlock : public CBlockHeader
 {
 public:
@@ -89,6 +111,12 @@ public:
     // memory only
     mutable CScript payee;
     mutable std::vector<uint256> vMerkleTree;
+    // context-free checks that already passed (set by the block file loader)
+    mutable bool fCheckedMerkleRoot;
+    mutable bool fCheckedSignature;
+    // the last hash of the header, kept for as long as the header still equals it;
+    // templates are changed in place, so the header is compared on every use
+    mutable CBlockHashMemo hashMemo;
 
     CBlock()
     {
@@ -118,8 +146,14 @@ public:
         vMerkleTree.clear();
         payee = CScript();
         vchBlockSig.clear();
+        fCheckedMerkleRoot = false;
+        fCheckedSignature = false;
+        hashMemo.SetNull();
     }
 
+    // CBlockHeader::GetHash(), computed again only when the header changed
+    uint256 GetHash() const;
+
     CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
@@ -157,13 +191,29 @@ public:
     // merkle root).
     uint256 BuildMerkleTree(bool* mutated = NULL) const;
 
+    // The same merkle root and mutation check, without keeping the tree; for
+    // checks and templates, which need no branches. Drops vMerkleTree, which
+    // may no longer match the transactions.
+    uint256 ComputeMerkleRoot(bool* mutated = NULL) const;
+
     std::vector<uint256> GetMerkleBranch(int nIndex) const;
+    //! The branch of leaf nIndex in vMerkleTree as BuildMerkleTree lays it out for nTx transactions
+    static std::vector<uint256> GetMerkleBranch(const std::vector<uint256>& vMerkleTree, int nTx, int nIndex);
     static uint256 CheckMerkleBranch(uint256 hash, const std::vector<uint256>& vMerkleBranch, int nIndex);
     std::string ToString() const;
     void print() const;
 };
 
 
+/** The merkle root of vHashes, which are overwritten by the tree levels as
+ * they are hashed. *mutated is set as by CBlock::BuildMerkleTree. */
+uint256 ComputeMerkleRoot(std::vector<uint256>& vHashes, bool* mutated = NULL);
+
+/** Compute GetHash() for every header in vHeaders, in order. Batches are run
+ * through HashQuarkLanes() and large batches are split across threads. */
+void GetBlockHeaderHashes(const std::vector<CBlockHeader>& vHeaders, std::vector<uint256>& vHashes);
+
+
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
@@ -109,23 +109,54 @@ std::string CMutableTransaction::ToString() const
     return str;
 }
 
+unsigned int CTransaction::ComputeSerializeSize() const
+{
+    CSizeComputer s(SER_NETWORK, PROTOCOL_VERSION);
+    NCONST_PTR(this)->SerializationOp(s, CSerActionSerialize(), SER_NETWORK, PROTOCOL_VERSION);
+    return s.size();
+}
+
 void CTransaction::UpdateHash() const
 {
     *const_cast<uint256*>(&hash) = SerializeHash(*this);
+    *const_cast<unsigned int*>(&nSize) = ComputeSerializeSize();
+}
+
+CTransaction::CTransaction() : hash(), nSize(0), nVersion(CTransaction::CURRENT_VERSION), vin(), vout(), nLockTime(0) {
+    *const_cast<unsigned int*>(&nSize) = ComputeSerializeSize();
 }
 
-CTransaction::CTransaction() : hash(), nVersion(CTransaction::CURRENT_VERSION), vin(), vout(), nLockTime(0) { }
+CTransaction::CTransaction(const CMutableTransaction &tx) : nSize(0), nVersion(tx.nVersion), vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime) {
+    UpdateHash();
+}
 
-CTransaction::CTransaction(const CMutableTransaction &tx) : nVersion(tx.nVersion), vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime) {
+CTransaction::CTransaction(CMutableTransaction &&tx) : nSize(0), nVersion(tx.nVersion), vin(std::move(tx.vin)), vout(std::move(tx.vout)), nLockTime(tx.nLockTime) {
     UpdateHash();
 }
 
+CTransaction::CTransaction(const CTransaction &tx) : hash(tx.hash), nSize(tx.nSize), nVersion(tx.nVersion), vin(tx.vin), vout(tx.vout), nLockTime(tx.nLockTime) { }
+
+// Moves keep vectors of transactions, such as CBlock::vtx, from copying every
+// input and output when they grow
+CTransaction::CTransaction(CTransaction &&tx) noexcept : hash(tx.hash), nSize(tx.nSize), nVersion(tx.nVersion), vin(std::move(tx.vin)), vout(std::move(tx.vout)), nLockTime(tx.nLockTime) { }
+
 CTransaction& CTransaction::operator=(const CTransaction &tx) {
     *const_cast<int*>(&nVersion) = tx.nVersion;
     *const_cast<std::vector<CTxIn>*>(&vin) = tx.vin;
     *const_cast<std::vector<CTxOut>*>(&vout) = tx.vout;
     *const_cast<unsigned int*>(&nLockTime) = tx.nLockTime;
     *const_cast<uint256*>(&hash) = tx.hash;
+    *const_cast<unsigned int*>(&nSize) = tx.nSize;
+    return *this;
+}
+
+CTransaction& CTransaction::operator=(CTransaction &&tx) noexcept {
+    *const_cast<int*>(&nVersion) = tx.nVersion;
+    vin = std::move(tx.vin);
+    vout = std::move(tx.vout);
+    *const_cast<unsigned int*>(&nLockTime) = tx.nLockTime;
+    *const_cast<uint256*>(&hash) = tx.hash;
+    *const_cast<unsigned int*>(&nSize) = tx.nSize;
     return *this;
 }
 
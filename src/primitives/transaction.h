@@ -193,6 +193,9 @@ class CTransaction
 private:
     /** Memory only. */
     const uint256 hash;
+    //! Serialized size, the same for every serialization type and version
+    const unsigned int nSize;
+    unsigned int ComputeSerializeSize() const;
     void UpdateHash() const;
 
 public:
@@ -214,10 +217,38 @@ public:
 
     /** Convert a CMutableTransaction into a CTransaction. */
     CTransaction(const CMutableTransaction &tx);
+    /** Take over the inputs and outputs of a CMutableTransaction that is no longer needed. */
+    CTransaction(CMutableTransaction &&tx);
+
+    CTransaction(const CTransaction &tx);
+    CTransaction(CTransaction &&tx) noexcept;
 
     CTransaction& operator=(const CTransaction& tx);
+    CTransaction& operator=(CTransaction&& tx) noexcept;
 
-    ADD_SERIALIZE_METHODS;
+    // Not ADD_SERIALIZE_METHODS: the size is kept with the hash, so neither
+    // GetSerializeSize() nor a CSizeComputer walk over the inputs and outputs
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        return nSize;
+    }
+
+    void Serialize(CSizeComputer& s, int nType, int nVersion) const
+    {
+        s.seek(nSize);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        NCONST_PTR(this)->SerializationOp(s, CSerActionSerialize(), nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        SerializationOp(s, CSerActionUnserialize(), nType, nVersion);
+    }
 
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
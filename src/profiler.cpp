@@ -0,0 +1,335 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/dystem-config.h"
+#endif
+
+#include "profiler.h"
+
+#include "sync.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include <boost/filesystem/fstream.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#if defined(HAVE_EXECINFO_H) && !defined(WIN32)
+#define ENABLE_PROFILER 1
+#include <cxxabi.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#endif
+
+//! Frames of the signal handler and the signal trampoline on top of every sample
+static const int PROFILE_SKIP_FRAMES = 2;
+//! Microseconds the sampler waits for a thread to take its sample
+static const int64_t PROFILE_SAMPLE_TIMEOUT = 5000;
+
+namespace
+{
+struct CProfiledThread {
+    std::string strName;
+    //! Among the threads registered under the same name
+    int nIndex;
+#ifdef ENABLE_PROFILER
+    pthread_t tid;
+#endif
+    //! Written by the thread itself, in the signal handler
+    void* vFrames[MAX_PROFILE_DEPTH + PROFILE_SKIP_FRAMES];
+    int nFrames;
+};
+
+typedef std::pair<std::pair<std::string, int>, std::vector<void*> > ProfileStackKey;
+
+CCriticalSection cs_profiler;
+std::vector<CProfiledThread*> vProfiledThreads;
+std::map<std::string, int> mapThreadNameCount;
+
+// Profile state, guarded by cs_profiler
+boost::thread* pthreadSampler = NULL;
+std::map<ProfileStackKey, uint64_t> mapProfileStacks;
+std::set<std::string> setProfileThreads;
+int64_t nProfileInterval = 0;
+int64_t nProfileStart = 0;
+uint64_t nProfileSamples = 0;
+uint64_t nProfileDropped = 0;
+
+void UnregisterProfilerThread(CProfiledThread* pthread)
+{
+    LOCK(cs_profiler);
+    vProfiledThreads.erase(std::remove(vProfiledThreads.begin(), vProfiledThreads.end(), pthread), vProfiledThreads.end());
+    delete pthread;
+}
+
+boost::thread_specific_ptr<CProfiledThread> ptrProfiledThread(UnregisterProfilerThread);
+
+#ifdef ENABLE_PROFILER
+//! The thread asked for a sample, cleared by its signal handler once taken
+std::atomic<CProfiledThread*> ptargetThread(NULL);
+//! The handler stays once installed, a late signal must never meet the default action
+bool fSignalHandlerInstalled = false;
+
+void ProfilerSignalHandler(int)
+{
+    int nSavedErrno = errno;
+    CProfiledThread* pthread = ptargetThread.load();
+    if (pthread != NULL && pthread_equal(pthread->tid, pthread_self())) {
+        pthread->nFrames = backtrace(pthread->vFrames, MAX_PROFILE_DEPTH + PROFILE_SKIP_FRAMES);
+        ptargetThread.store(NULL);
+    }
+    errno = nSavedErrno;
+}
+
+bool SampleThread(CProfiledThread* pthread)
+{
+    AssertLockHeld(cs_profiler);
+    ptargetThread.store(pthread);
+    if (pthread_kill(pthread->tid, SIGPROF) != 0) {
+        ptargetThread.store(NULL);
+        return false;
+    }
+    int64_t nDeadline = GetTimeMicros() + PROFILE_SAMPLE_TIMEOUT;
+    while (ptargetThread.load() != NULL) {
+        if (GetTimeMicros() > nDeadline) {
+            CProfiledThread* pexpected = pthread;
+            // The handler may still run, it finds no target then
+            if (ptargetThread.compare_exchange_strong(pexpected, NULL))
+                return false;
+            break;
+        }
+        boost::this_thread::yield();
+    }
+
+    int nFrames = pthread->nFrames;
+    if (nFrames <= PROFILE_SKIP_FRAMES)
+        return false;
+    ProfileStackKey key(std::make_pair(pthread->strName, pthread->nIndex), std::vector<void*>(pthread->vFrames + PROFILE_SKIP_FRAMES, pthread->vFrames + nFrames));
+    std::map<ProfileStackKey, uint64_t>::iterator it = mapProfileStacks.find(key);
+    if (it == mapProfileStacks.end()) {
+        if (mapProfileStacks.size() >= MAX_PROFILE_STACKS)
+            return false;
+        it = mapProfileStacks.insert(std::make_pair(key, 0)).first;
+    }
+    it->second++;
+    return true;
+}
+
+void ThreadProfileSampler()
+{
+    pthread_t tidSelf = pthread_self();
+    while (true) {
+        int64_t nNext = GetTimeMicros();
+        {
+            LOCK(cs_profiler);
+            nNext += nProfileInterval;
+            BOOST_FOREACH (CProfiledThread* pthread, vProfiledThreads) {
+                if (pthread_equal(pthread->tid, tidSelf))
+                    continue;
+                if (!setProfileThreads.empty() && !setProfileThreads.count(pthread->strName))
+                    continue;
+                if (SampleThread(pthread))
+                    nProfileSamples++;
+                else
+                    nProfileDropped++;
+            }
+        }
+        int64_t nNow = GetTimeMicros();
+        if (nNext > nNow)
+            MilliSleep((nNext - nNow) / 1000);
+        else
+            boost::this_thread::interruption_point();
+    }
+}
+
+/** "module(symbol+0x1f) [0x...]" as "symbol", demangled, or "module+0x1f" */
+std::string SymbolName(void* pc)
+{
+    char** ppsz = backtrace_symbols(&pc, 1);
+    if (ppsz == NULL)
+        return strprintf("%p", pc);
+    std::string str(ppsz[0]);
+    free(ppsz);
+
+    size_t nOpen = str.find('('), nPlus = str.find('+', nOpen), nClose = str.find(')', nOpen);
+    if (nOpen == std::string::npos || nClose == std::string::npos)
+        return str;
+    std::string strModule = str.substr(0, nOpen);
+    size_t nSlash = strModule.rfind('/');
+    if (nSlash != std::string::npos)
+        strModule = strModule.substr(nSlash + 1);
+    if (nPlus == std::string::npos || nPlus > nClose)
+        nPlus = nClose;
+    std::string strSymbol = str.substr(nOpen + 1, nPlus - nOpen - 1);
+    if (strSymbol.empty())
+        return strModule + str.substr(nPlus, nClose - nPlus);
+
+    int nStatus = 0;
+    char* pszDemangled = abi::__cxa_demangle(strSymbol.c_str(), NULL, NULL, &nStatus);
+    if (pszDemangled != NULL) {
+        if (nStatus == 0)
+            strSymbol = pszDemangled;
+        free(pszDemangled);
+    }
+    // ';' separates the frames of a collapsed stack
+    std::replace(strSymbol.begin(), strSymbol.end(), ';', ':');
+    return strSymbol;
+}
+#endif // ENABLE_PROFILER
+} // anon namespace
+
+void RegisterProfilerThread(const char* name)
+{
+    if (ptrProfiledThread.get() != NULL)
+        return;
+    std::string strName(name);
+    size_t nDash = strName.find('-');
+    if (nDash != std::string::npos)
+        strName = strName.substr(nDash + 1);
+
+    CProfiledThread* pthread = new CProfiledThread();
+    pthread->strName = strName;
+    pthread->nFrames = 0;
+#ifdef ENABLE_PROFILER
+    pthread->tid = pthread_self();
+#endif
+    {
+        LOCK(cs_profiler);
+        pthread->nIndex = mapThreadNameCount[strName]++;
+        vProfiledThreads.push_back(pthread);
+    }
+    ptrProfiledThread.reset(pthread);
+}
+
+bool ProfilerSupported()
+{
+#ifdef ENABLE_PROFILER
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool IsProfilerRunning()
+{
+    LOCK(cs_profiler);
+    return pthreadSampler != NULL;
+}
+
+bool StartProfiler(int nFrequency, const std::set<std::string>& setThreads, std::string& strError)
+{
+#ifdef ENABLE_PROFILER
+    if (nFrequency < 1 || nFrequency > MAX_PROFILE_FREQUENCY) {
+        strError = strprintf("frequency must be between 1 and %d", MAX_PROFILE_FREQUENCY);
+        return false;
+    }
+
+    LOCK(cs_profiler);
+    if (pthreadSampler != NULL) {
+        strError = "the profiler is running already";
+        return false;
+    }
+
+    // The first call loads the unwinder, which must not happen in a signal handler
+    void* pc;
+    backtrace(&pc, 1);
+
+    if (!fSignalHandlerInstalled) {
+        struct sigaction sa;
+        sa.sa_handler = ProfilerSignalHandler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        if (sigaction(SIGPROF, &sa, NULL) != 0) {
+            strError = "cannot install the SIGPROF handler";
+            return false;
+        }
+        fSignalHandlerInstalled = true;
+    }
+
+    mapProfileStacks.clear();
+    setProfileThreads = setThreads;
+    nProfileInterval = 1000000 / nFrequency;
+    nProfileStart = GetTimeMicros();
+    nProfileSamples = 0;
+    nProfileDropped = 0;
+    pthreadSampler = new boost::thread(&ThreadProfileSampler);
+    LogPrintf("Profiler started, %d samples a second\n", nFrequency);
+    return true;
+#else
+    strError = "the profiler is not supported on this platform";
+    return false;
+#endif
+}
+
+bool StopProfiler(const boost::filesystem::path& path, CProfileResult& result, std::string& strError)
+{
+#ifdef ENABLE_PROFILER
+    boost::thread* pthread;
+    {
+        LOCK(cs_profiler);
+        if (pthreadSampler == NULL) {
+            strError = "the profiler is not running";
+            return false;
+        }
+        pthread = pthreadSampler;
+    }
+    pthread->interrupt();
+    pthread->join();
+
+    LOCK(cs_profiler);
+    delete pthreadSampler;
+    pthreadSampler = NULL;
+
+    result.path = path;
+    result.nDuration = GetTimeMicros() - nProfileStart;
+    result.nSamples = nProfileSamples;
+    result.nDropped = nProfileDropped;
+
+    // Number the threads of a name only where the profile has several of them
+    std::map<std::string, std::set<int> > mapIndexes;
+    std::map<void*, std::string> mapSymbols;
+    for (std::map<ProfileStackKey, uint64_t>::const_iterator it = mapProfileStacks.begin(); it != mapProfileStacks.end(); ++it) {
+        mapIndexes[it->first.first.first].insert(it->first.first.second);
+        BOOST_FOREACH (void* pc, it->first.second)
+            mapSymbols[pc];
+    }
+    for (std::map<void*, std::string>::iterator it = mapSymbols.begin(); it != mapSymbols.end(); ++it)
+        it->second = SymbolName(it->first);
+
+    // Stacks that differ only in where inside the same functions they were become one line
+    std::map<std::string, uint64_t> mapLines;
+    for (std::map<ProfileStackKey, uint64_t>::const_iterator it = mapProfileStacks.begin(); it != mapProfileStacks.end(); ++it) {
+        const std::string& strName = it->first.first.first;
+        std::string strLine = mapIndexes[strName].size() > 1 ? strprintf("%s.%d", strName, it->first.first.second) : strName;
+        const std::vector<void*>& vFrames = it->first.second;
+        for (std::vector<void*>::const_reverse_iterator itFrame = vFrames.rbegin(); itFrame != vFrames.rend(); ++itFrame)
+            strLine += ";" + mapSymbols[*itFrame];
+        mapLines[strLine] += it->second;
+    }
+    mapProfileStacks.clear();
+    result.nStacks = mapLines.size();
+
+    boost::filesystem::ofstream file(path);
+    if (!file) {
+        strError = strprintf("cannot write %s", path.string());
+        return false;
+    }
+    for (std::map<std::string, uint64_t>::const_iterator it = mapLines.begin(); it != mapLines.end(); ++it)
+        file << it->first << " " << it->second << "\n";
+    LogPrintf("Profiler stopped, %u samples written to %s\n", result.nSamples, path.string());
+    return true;
+#else
+    strError = "the profiler is not supported on this platform";
+    return false;
+#endif
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PROFILER_H
+#define BITCOIN_PROFILER_H
+
+#include <set>
+#include <stdint.h>
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+
+//! startprofile default, samples per second and thread
+static const int DEFAULT_PROFILE_FREQUENCY = 99;
+static const int MAX_PROFILE_FREQUENCY = 1000;
+//! Frames kept of each sampled stack
+static const int MAX_PROFILE_DEPTH = 64;
+//! Distinct stacks kept in a profile, samples of further stacks are only counted
+static const size_t MAX_PROFILE_STACKS = 100000;
+
+struct CProfileResult {
+    boost::filesystem::path path;
+    int64_t nDuration;
+    uint64_t nSamples;
+    uint64_t nDropped;
+    size_t nStacks;
+
+    CProfileResult() : nDuration(0), nSamples(0), nDropped(0), nStacks(0) {}
+};
+
+/**
+ * Make the calling thread visible to the profiler under name, without the
+ * "dystem-" prefix. Threads sharing a name are told apart as name.0, name.1.
+ * Called by RenameThread; the thread is forgotten when it exits.
+ */
+void RegisterProfilerThread(const char* name);
+
+/** Whether the stacks of threads can be sampled on this platform */
+bool ProfilerSupported();
+
+/**
+ * Sample the stacks of the registered threads nFrequency times a second,
+ * only those of the given names (msghand, httpworker, ...) unless empty.
+ * Threads are sampled whether running or blocked, so a profile shows where
+ * they wait as well as where they spend CPU.
+ */
+bool StartProfiler(int nFrequency, const std::set<std::string>& setThreads, std::string& strError);
+
+/** Stop sampling and write the stacks in the collapsed format of flamegraph.pl */
+bool StopProfiler(const boost::filesystem::path& path, CProfileResult& result, std::string& strError);
+
+bool IsProfilerRunning();
+
+#endif // BITCOIN_PROFILER_H
@@ -6,6 +6,7 @@
 #include "protocol.h"
 
 #include "chainparams.h"
+#include "crypto/common.h"
 #include "util.h"
 #include "utilstrencodings.h"
 
@@ -30,7 +31,61 @@ static const char* ppszTypeName[] =
         "mn budget finalized vote",
         "mn quorum",
         "mn announce",
-        "mn ping"};
+        "mn ping",
+        "compact block"};
+
+static const char* ppszNetMessageTypes[] =
+    {
+        "addr",
+        "alert",
+        "block",
+        "blocktxn",
+        "cmpctblock",
+        "dseg",
+        "fbs",
+        "fbvote",
+        "filteradd",
+        "filterclear",
+        "filterload",
+        "getaddr",
+        "getblocks",
+        "getblocktxn",
+        "getdata",
+        "getheaders",
+        "getmnpc",
+        "headers",
+        "inv",
+        "ix",
+        "mempool",
+        "merkleblock",
+        "mnb",
+        "mnget",
+        "mngetd",
+        "mnp",
+        "mnpann",
+        "mnpc",
+        "mnvs",
+        "mnvsd",
+        "mnw",
+        "mprop",
+        "mvote",
+        "notfound",
+        "ping",
+        "pong",
+        "reject",
+        "sendcmpct",
+        "spork",
+        "ssc",
+        "tx",
+        "txlvote",
+        "verack",
+        "version"};
+static const std::vector<std::string> vAllNetMessageTypes(ppszNetMessageTypes, ppszNetMessageTypes + ARRAYLEN(ppszNetMessageTypes));
+
+const std::vector<std::string>& GetAllNetMessageTypes()
+{
+    return vAllNetMessageTypes;
+}
 
 CMessageHeader::CMessageHeader()
 {
@@ -136,7 +191,12 @@ bool CInv::IsKnownType() const
 }
 
 bool CInv::IsMasterNodeType() const{
- 	return (type >= 6);
+ 	return (type >= MSG_SPORK && type <= MSG_MASTERNODE_PING);
+}
+
+bool CInv::IsUrgent() const
+{
+    return type == MSG_BLOCK || type == MSG_TXLOCK_REQUEST || type == MSG_TXLOCK_VOTE || type == MSG_SPORK;
 }
 
 const char* CInv::GetCommand() const
@@ -151,3 +211,11 @@ std::string CInv::ToString() const
 {
     return strprintf("%s %s", GetCommand(), hash.ToString());
 }
+
+std::vector<unsigned char> CInv::GetKey() const
+{
+    std::vector<unsigned char> vKey(4 + hash.size());
+    WriteLE32(&vKey[0], type);
+    memcpy(&vKey[4], hash.begin(), hash.size());
+    return vKey;
+}
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -77,6 +78,10 @@ enum {
 
 	 NODE_BLOOM_WITHOUT_MN = (1 << 4),
 
+    // NODE_NETWORK_LIMITED means the node serves the blocks of at least the last
+    // MIN_BLOCKS_TO_KEEP, but not the whole chain (-prune), as in BIP 159.
+    NODE_NETWORK_LIMITED = (1 << 10),
+
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
     // bitcoin-development mailing list. Remember that service bits are just
@@ -143,8 +148,12 @@ public:
 
     bool IsKnownType() const;
     bool IsMasterNodeType() const;
+    //! Blocks, SwiftTX locks and sporks, announced at once rather than in the next inventory batch
+    bool IsUrgent() const;
     const char* GetCommand() const;
     std::string ToString() const;
+    //! The type and the hash as serialized, to match against bloom filters
+    std::vector<unsigned char> GetKey() const;
 
     // TODO: make private (improves encapsulation)
 public:
@@ -152,6 +161,32 @@ public:
     uint256 hash;
 };
 
+/**
+ * "mnpann" entry: a masternode ping announced to a peer by the short id of its
+ * masternode and its time, which is all the peer needs to tell whether it is newer.
+ */
+class CMasternodePingAnnounce
+{
+public:
+    uint64_t nShortID;
+    int64_t sigTime;
+
+    CMasternodePingAnnounce() : nShortID(0), sigTime(0) {}
+    CMasternodePingAnnounce(uint64_t nShortIDIn, int64_t sigTimeIn) : nShortID(nShortIDIn), sigTime(sigTimeIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nShortID);
+        READWRITE(VARINT(sigTime));
+    }
+};
+
+/** The commands of all the messages this node sends or handles, sorted */
+const std::vector<std::string>& GetAllNetMessageTypes();
+
 enum {
     MSG_TX = 1,
     MSG_BLOCK,
@@ -169,7 +204,9 @@ enum {
     MSG_BUDGET_FINALIZED_VOTE,
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
-    MSG_MASTERNODE_PING
+    MSG_MASTERNODE_PING,
+    // Only in getdata, asks for the block as a "cmpctblock" message
+    MSG_CMPCT_BLOCK
 };
 
 #endif // BITCOIN_PROTOCOL_H
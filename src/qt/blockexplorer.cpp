@@ -3,6 +3,7 @@
 #include "chainparams.h"
 #include "clientmodel.h"
 #include "core_io.h"
+#include "guiconstants.h"
 #include "guiutil.h"
 #include "main.h"
 #include "net.h"
@@ -14,8 +15,13 @@
 #include <QDateTime>
 #include <QKeyEvent>
 #include <QMessageBox>
+#include <QThread>
+#include <list>
+#include <map>
 #include <set>
 
+#include <boost/foreach.hpp>
+
 extern double GetDifficulty(const CBlockIndex* blockindex = NULL);
 
 inline std::string utostr(unsigned int n)
@@ -28,14 +34,19 @@ static std::string makeHRef(const std::string& Str)
     return "<a href=\"" + Str + "\">" + Str + "</a>";
 }
 
-static CAmount getTxIn(const CTransaction& tx)
+static CAmount getTxIn(const CTransaction& tx, const std::vector<CTxOut>& vPrevOuts)
 {
     if (tx.IsCoinBase())
         return 0;
+    if (vPrevOuts.size() != tx.vin.size())
+        return -1;
 
     CAmount Sum = 0;
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
-        Sum += getPrevOut(tx.vin[i].prevout).nValue;
+    BOOST_FOREACH (const CTxOut& PrevOut, vPrevOuts) {
+        if (PrevOut.nValue < 0)
+            return -1;
+        Sum += PrevOut.nValue;
+    }
     return Sum;
 }
 
@@ -96,7 +107,22 @@ static std::string makeHTMLTable(const std::string* pCells, int nRows, int nColu
     return Table;
 }
 
-static std::string TxToRow(const CTransaction& tx, const CScript& Highlight = CScript(), const std::string& Prepend = std::string(), int64_t* pSum = NULL)
+static std::string makePageLinks(const std::string& Target, int nPage, int nPages)
+{
+    if (nPages <= 1)
+        return "";
+
+    std::string Links = "<h3>";
+    if (nPage > 0)
+        Links += "<a class=\"nav\" href=\"" + Target + "/" + itostr(nPage) + "\">◄&nbsp;</a>";
+    Links += strprintf(_("Page %d of %d"), nPage + 1, nPages);
+    if (nPage + 1 < nPages)
+        Links += "<a class=\"nav\" href=\"" + Target + "/" + itostr(nPage + 2) + "\">&nbsp;►</a>";
+    Links += "</h3>";
+    return Links;
+}
+
+static std::string TxToRow(const CTransaction& tx, const std::vector<CTxOut>& vPrevOuts, const CScript& Highlight = CScript(), const std::string& Prepend = std::string(), int64_t* pSum = NULL)
 {
     std::string InAmounts, InAddresses, OutAmounts, OutAddresses;
     int64_t Delta = 0;
@@ -105,7 +131,7 @@ static std::string TxToRow(const CTransaction& tx, const CScript& Highlight = CS
             InAmounts += ValueToString(tx.GetValueOut());
             InAddresses += "coinbase";
         } else {
-            CTxOut PrevOut = getPrevOut(tx.vin[j].prevout);
+            CTxOut PrevOut = j < vPrevOuts.size() ? vPrevOuts[j] : CTxOut();
             InAmounts += ValueToString(PrevOut.nValue);
             InAddresses += ScriptToString(PrevOut.scriptPubKey, false, PrevOut.scriptPubKey == Highlight).c_str();
             if (PrevOut.scriptPubKey == Highlight)
@@ -152,50 +178,63 @@ static std::string TxToRow(const CTransaction& tx, const CScript& Highlight = CS
 
 CTxOut getPrevOut(const COutPoint& out)
 {
+    // The spent index has the value and address of a spent output without reading its transaction
+    CSpentIndexValue Spent;
+    if (GetSpentIndex(CSpentIndexKey(out.hash, out.n), Spent)) {
+        CScript Script;
+        if (Spent.addressType == ADDRESS_INDEX_PUBKEYHASH)
+            Script = GetScriptForDestination(CKeyID(Spent.addressHash));
+        else if (Spent.addressType == ADDRESS_INDEX_SCRIPTHASH)
+            Script = GetScriptForDestination(CScriptID(Spent.addressHash));
+        return CTxOut(Spent.nValue, Script);
+    }
+
     CTransaction tx;
     uint256 hashBlock;
-    if (GetTransaction(out.hash, tx, hashBlock, true))
+    if (GetTransaction(out.hash, tx, hashBlock, true) && out.n < tx.vout.size())
         return tx.vout[out.n];
     return CTxOut();
 }
 
-void getNextIn(const COutPoint& Out, uint256& Hash, unsigned int& n)
+bool getNextIn(const COutPoint& Out, uint256& Hash, unsigned int& n)
 {
-    // Hash = 0;
-    // n = 0;
-    // if (paddressmap)
-    //    paddressmap->ReadNextIn(Out, Hash, n);
+    CSpentIndexValue Spent;
+    if (!GetSpentIndex(CSpentIndexKey(Out.hash, Out.n), Spent))
+        return false;
+    Hash = Spent.txid;
+    n = Spent.nInputIndex;
+    return true;
 }
 
-const CBlockIndex* getexplorerBlockIndex(int64_t height)
+std::string BlockToString(CBlockIndex* pBlock, int nPage)
 {
-    std::string hex = getexplorerBlockHash(height);
-    uint256 hash = uint256S(hex);
-    return mapBlockIndex[hash];
-}
+    if (!pBlock)
+        return "";
 
-std::string getexplorerBlockHash(int64_t Height)
-{
-    std::string genesisblockhash = "0x00000f4fb42644a07735beea3647155995ab01cf49d05fdc082c08eb673433f9"; 
-    CBlockIndex* pindexBest = mapBlockIndex[chainActive.Tip()->GetBlockHash()];
-    if ((Height < 0) || (Height > pindexBest->nHeight)) {
-        return genesisblockhash;
+    CDiskBlockPos pos;
+    CDiskBlockPos posUndo;
+    uint256 hashPrev;
+    {
+        LOCK(cs_main);
+        pos = pBlock->GetBlockPos();
+        posUndo = pBlock->GetUndoPos();
+        if (pBlock->pprev)
+            hashPrev = pBlock->pprev->GetBlockHash();
     }
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[chainActive.Tip()->GetBlockHash()];
-    while (pblockindex->nHeight > Height)
-        pblockindex = pblockindex->pprev;
-    return pblockindex->GetBlockHash().GetHex(); // pblockindex->phashBlock->GetHex();
-}
+    if (pos.IsNull() || !ReadBlockFromDisk(block, pos) || block.GetHash() != pBlock->GetBlockHash())
+        return "";
 
-std::string BlockToString(CBlockIndex* pBlock)
-{
-    if (!pBlock)
+    int nPages = std::max(1, (int)(block.vtx.size() + EXPLORER_PAGE_SIZE - 1) / EXPLORER_PAGE_SIZE);
+    if (nPage >= nPages)
         return "";
+    unsigned int nFirst = nPage * EXPLORER_PAGE_SIZE;
+    unsigned int nLast = std::min((unsigned int)block.vtx.size(), nFirst + EXPLORER_PAGE_SIZE);
 
-    CBlock block;
-    ReadBlockFromDisk(block, pBlock);
+    // The undo data of a connected block has the outputs all of its inputs spent, in one read
+    CBlockUndo blockUndo;
+    bool fUndo = !posUndo.IsNull() && blockUndo.ReadFromDisk(posUndo, hashPrev) && blockUndo.vtxundo.size() + 1 == block.vtx.size();
 
     CAmount Fees = 0;
     CAmount OutVolume = 0;
@@ -206,9 +245,23 @@ std::string BlockToString(CBlockIndex* pBlock)
     std::string TxContent = table + makeHTMLTableRow(TxLabels, sizeof(TxLabels) / sizeof(std::string));
     for (unsigned int i = 0; i < block.vtx.size(); i++) {
         const CTransaction& tx = block.vtx[i];
-        TxContent += TxToRow(tx);
+        bool fShown = i >= nFirst && i < nLast;
+
+        // Without undo data only the shown transactions have their inputs looked up
+        std::vector<CTxOut> vPrevOuts;
+        if (!tx.IsCoinBase()) {
+            if (fUndo) {
+                BOOST_FOREACH (const CTxInUndo& undo, blockUndo.vtxundo[i - 1].vprevout)
+                    vPrevOuts.push_back(undo.txout);
+            } else if (fShown) {
+                BOOST_FOREACH (const CTxIn& txin, tx.vin)
+                    vPrevOuts.push_back(getPrevOut(txin.prevout));
+            }
+        }
+        if (fShown)
+            TxContent += TxToRow(tx, vPrevOuts);
 
-        CAmount In = getTxIn(tx);
+        CAmount In = getTxIn(tx, vPrevOuts);
         CAmount Out = tx.GetValueOut();
         if (tx.IsCoinBase())
             Reward += Out;
@@ -277,8 +330,11 @@ std::string BlockToString(CBlockIndex* pBlock)
         Content += "</br>";
     }
     */
+    std::string PageLinks = makePageLinks(pBlock->GetBlockHash().GetHex(), nPage, nPages);
     Content += "<h2>" + _("Transactions") + "</h2>";
+    Content += PageLinks;
     Content += TxContent;
+    Content += PageLinks;
 
     return Content;
 }
@@ -321,14 +377,13 @@ std::string TxToString(uint256 BlockHash, const CTransaction& tx)
     uint256 TxHash = tx.GetHash();
     for (unsigned int i = 0; i < tx.vout.size(); i++) {
         const CTxOut& Out = tx.vout[i];
-        uint256 HashNext = uint256S("0");
+        uint256 HashNext;
         unsigned int nNext = 0;
-        bool fAddrIndex = false;
-        getNextIn(COutPoint(TxHash, i), HashNext, nNext);
+        bool fSpent = getNextIn(COutPoint(TxHash, i), HashNext, nNext);
         std::string OutputsContentCells[] =
             {
                 itostr(i),
-                (HashNext == uint256S("0")) ? (fAddrIndex ? _("no") : _("unknown")) : "<span>" + makeHRef(HashNext.GetHex()) + ":" + itostr(nNext) + "</span>",
+                !fSpent ? (fSpentIndex ? _("no") : _("unknown")) : "<span>" + makeHRef(HashNext.GetHex()) + ":" + itostr(nNext) + "</span>",
                 ScriptToString(Out.scriptPubKey, true),
                 ValueToString(Out.nValue)};
         OutputsContent += makeHTMLTableRow(OutputsContentCells, sizeof(OutputsContentCells) / sizeof(std::string));
@@ -350,7 +405,7 @@ std::string TxToString(uint256 BlockHash, const CTransaction& tx)
             _("Hash"), "<pre>" + Hash + "</pre>",
         };
 
-    // std::map<uint256, CBlockIndex*>::iterator iter = mapBlockIndex.find(BlockHash);
+    LOCK(cs_main);
     BlockMap::iterator iter = mapBlockIndex.find(BlockHash);
     if (iter != mapBlockIndex.end()) {
         CBlockIndex* pIndex = iter->second;
@@ -371,33 +426,202 @@ std::string TxToString(uint256 BlockHash, const CTransaction& tx)
     return Content;
 }
 
-std::string AddressToString(const CBitcoinAddress& Address)
+std::string AddressToString(const CBitcoinAddress& Address, int nPage)
 {
+    std::string Content;
+    Content += "<h1>" + _("Transactions to/from") + "&nbsp;<span>" + Address.ToString() + "</span></h1>";
+
+    if (!fAddressIndex) {
+        Content += _("To view the transactions of an address you need to set addressindex=1 in the configuration file (dystem.conf).");
+        return Content;
+    }
+
+    uint160 hashBytes;
+    int type = GetAddressIndexType(GetScriptForDestination(Address.Get()), hashBytes);
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    if (type == ADDRESS_INDEX_NONE || !GetAddressIndex(hashBytes, type, vAddressIndex))
+        return "";
+
+    // The index is in block order, with the outputs and inputs of a transaction next to each other
+    std::vector<std::pair<const CAddressIndexKey*, CAmount> > vRows;
+    CAmount Balance = 0;
+    CAmount Received = 0;
+    for (unsigned int i = 0; i < vAddressIndex.size(); i++) {
+        const CAddressIndexKey& key = vAddressIndex[i].first;
+        if (vRows.empty() || vRows.back().first->txhash != key.txhash || vRows.back().first->nBlockHeight != key.nBlockHeight)
+            vRows.push_back(std::make_pair(&key, 0));
+        vRows.back().second += vAddressIndex[i].second;
+        if (vAddressIndex[i].second > 0)
+            Received += vAddressIndex[i].second;
+        Balance += vAddressIndex[i].second;
+    }
+
+    int nPages = std::max(1, (int)(vRows.size() + EXPLORER_PAGE_SIZE - 1) / EXPLORER_PAGE_SIZE);
+    if (nPage >= nPages)
+        return "";
+
+    std::string SummaryCells[] =
+        {
+            _("Balance"), ValueToString(Balance),
+            _("Received"), ValueToString(Received),
+            _("Number of Transactions"), itostr(vRows.size()),
+        };
+    Content += makeHTMLTable(SummaryCells, sizeof(SummaryCells) / (2 * sizeof(std::string)), 2);
+    Content += "</br>";
+
     std::string TxLabels[] =
         {
             _("Date"),
+            _("Block"),
             _("Hash"),
-            _("From"),
-            _("Amount"),
-            _("To"),
-            _("Amount"),
             _("Delta"),
             _("Balance")};
     std::string TxContent = table + makeHTMLTableRow(TxLabels, sizeof(TxLabels) / sizeof(std::string));
 
-    std::set<COutPoint> PrevOuts;
+    // Newest first, the balance after each transaction counted back from the current one
+    int nFirst = nPage * EXPLORER_PAGE_SIZE;
+    int nLast = std::min((int)vRows.size(), nFirst + EXPLORER_PAGE_SIZE);
+    for (int i = (int)vRows.size() - 1; i >= 0 && vRows.size() - i <= (unsigned int)nLast; i--) {
+        const CAddressIndexKey& key = *vRows[i].first;
+        CAmount Delta = vRows[i].second;
+        if (vRows.size() - i > (unsigned int)nFirst) {
+            std::string Time;
+            {
+                LOCK(cs_main);
+                CBlockIndex* pindex = chainActive[key.nBlockHeight];
+                if (pindex)
+                    Time = TimeToString(pindex->GetBlockTime());
+            }
+            std::string Row[] =
+                {
+                    Time,
+                    makeHRef(itostr(key.nBlockHeight)),
+                    makeHRef(key.txhash.GetHex()),
+                    std::string("<font color=\"") + ((Delta > 0) ? "green" : "red") + "\">" + ValueToString(Delta, true) + "</font>",
+                    ValueToString(Balance)};
+            TxContent += makeHTMLTableRow(Row, sizeof(Row) / sizeof(std::string));
+        }
+        Balance -= Delta;
+    }
     TxContent += "</table>";
 
-    std::string Content;
-    Content += "<h1>" + _("Transactions to/from") + "&nbsp;<span>" + Address.ToString() + "</span></h1>";
+    std::string PageLinks = makePageLinks(Address.ToString(), nPage, nPages);
+    Content += PageLinks;
     Content += TxContent;
+    Content += PageLinks;
+    return Content;
+}
+
+/** Object for running the explorer queries in a separate thread */
+class BlockExplorerWorker : public QObject
+{
+    Q_OBJECT
+
+public Q_SLOTS:
+    void request(const QString& query);
+
+Q_SIGNALS:
+    void reply(const QString& query, const QString& content, bool fFound);
+
+private:
+    typedef std::pair<uint256, int> BlockPageKey;
+    typedef std::list<std::pair<BlockPageKey, std::string> > BlockPageList;
+
+    //! Rendered block pages, which never change, the last shown first
+    BlockPageList listBlockPages;
+    std::map<BlockPageKey, BlockPageList::iterator> mapBlockPages;
+
+    std::string lookup(const QString& query);
+    std::string blockPage(CBlockIndex* pindex, int nPage);
+};
+
+#include "blockexplorer.moc"
+
+void BlockExplorerWorker::request(const QString& query)
+{
+    std::string Content;
+    try {
+        Content = lookup(query);
+    } catch (const std::exception& e) {
+        LogPrintf("BlockExplorerWorker::request : %s\n", e.what());
+    }
+    emit reply(query, QString::fromUtf8(Content.c_str()), !Content.empty());
+}
+
+std::string BlockExplorerWorker::lookup(const QString& query)
+{
+    // "<block>/<n>" and "<address>/<n>" ask for page n of the transactions
+    QString Target = query.trimmed();
+    int nPage = 0;
+    int nSlash = Target.indexOf('/');
+    if (nSlash >= 0) {
+        bool IsOk;
+        nPage = Target.mid(nSlash + 1).toInt(&IsOk) - 1;
+        if (!IsOk || nPage < 0)
+            return "";
+        Target = Target.left(nSlash);
+    }
+
+    bool IsOk;
+    int64_t AsInt = Target.toInt(&IsOk);
+    uint256 hash = uint256S(Target.toUtf8().constData());
+    CBlockIndex* pindex = NULL;
+    {
+        LOCK(cs_main);
+        // If query is integer, get the block at that height, else assume it is a block hash
+        if (IsOk)
+            pindex = chainActive[AsInt];
+        if (!pindex) {
+            BlockMap::iterator iter = mapBlockIndex.find(hash);
+            if (iter != mapBlockIndex.end())
+                pindex = iter->second;
+        }
+    }
+    if (pindex)
+        return blockPage(pindex, nPage);
+
+    // If the query is neither an integer nor a block hash, assume a transaction hash
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    if (nSlash < 0 && GetTransaction(hash, tx, hashBlock, true))
+        return TxToString(hashBlock, tx);
+
+    // If the query is not an integer, nor a block hash, nor a transaction hash, assume an address
+    CBitcoinAddress Address;
+    Address.SetString(Target.toUtf8().constData());
+    if (Address.IsValid())
+        return AddressToString(Address, nPage);
+
+    return "";
+}
+
+std::string BlockExplorerWorker::blockPage(CBlockIndex* pindex, int nPage)
+{
+    BlockPageKey key(pindex->GetBlockHash(), nPage);
+    std::map<BlockPageKey, BlockPageList::iterator>::iterator it = mapBlockPages.find(key);
+    if (it != mapBlockPages.end()) {
+        listBlockPages.splice(listBlockPages.begin(), listBlockPages, it->second);
+        return it->second->second;
+    }
+
+    std::string Content = BlockToString(pindex, nPage);
+    if (Content.empty())
+        return Content;
+
+    listBlockPages.push_front(std::make_pair(key, Content));
+    mapBlockPages[key] = listBlockPages.begin();
+    if (listBlockPages.size() > (size_t)EXPLORER_BLOCK_CACHE_SIZE) {
+        mapBlockPages.erase(listBlockPages.back().first);
+        listBlockPages.pop_back();
+    }
     return Content;
 }
 
 BlockExplorer::BlockExplorer(QWidget* parent) : QMainWindow(parent),
                                                 ui(new Ui::BlockExplorer),
                                                 m_NeverShown(true),
-                                                m_HistoryIndex(0)
+                                                m_HistoryIndex(0),
+                                                m_PendingHistory(false)
 {
     ui->setupUi(this);
 
@@ -407,13 +631,33 @@ BlockExplorer::BlockExplorer(QWidget* parent) : QMainWindow(parent),
     connect(ui->content, SIGNAL(linkActivated(const QString&)), this, SLOT(goTo(const QString&)));
     connect(ui->back, SIGNAL(released()), this, SLOT(back()));
     connect(ui->forward, SIGNAL(released()), this, SLOT(forward()));
+
+    startWorker();
 }
 
 BlockExplorer::~BlockExplorer()
 {
+    emit stopWorker();
     delete ui;
 }
 
+void BlockExplorer::startWorker()
+{
+    QThread* thread = new QThread;
+    BlockExplorerWorker* worker = new BlockExplorerWorker();
+    worker->moveToThread(thread);
+
+    connect(worker, SIGNAL(reply(QString, QString, bool)), this, SLOT(showResult(QString, QString, bool)));
+    connect(this, SIGNAL(explorerRequest(QString)), worker, SLOT(request(QString)));
+
+    // The worker is deleted in its thread, which then quits and is deleted in this one
+    connect(this, SIGNAL(stopWorker()), worker, SLOT(deleteLater()));
+    connect(this, SIGNAL(stopWorker()), thread, SLOT(quit()));
+    connect(thread, SIGNAL(finished()), thread, SLOT(deleteLater()));
+
+    thread->start();
+}
+
 void BlockExplorer::keyPressEvent(QKeyEvent* event)
 {
     switch ((Qt::Key)event->key()) {
@@ -432,13 +676,17 @@ void BlockExplorer::showEvent(QShowEvent*)
     if (m_NeverShown) {
         m_NeverShown = false;
 
-        CBlockIndex* pindexBest = mapBlockIndex[chainActive.Tip()->GetBlockHash()];
+        int nHeight;
+        {
+            LOCK(cs_main);
+            nHeight = chainActive.Height();
+        }
 
-        setBlock(pindexBest);
-        QString text = QString("%1").arg(pindexBest->nHeight);
+        QString text = QString("%1").arg(nHeight);
         ui->searchBox->setText(text);
         m_History.push_back(text);
         updateNavButtons();
+        switchTo(text, false);
 
         if (!GetBoolArg("-txindex", true)) {
             QString Warning = tr("Not all transactions will be shown. To view all transactions you need to set txindex=1 in the configuration file (dystem.conf).");
@@ -447,56 +695,24 @@ void BlockExplorer::showEvent(QShowEvent*)
     }
 }
 
-bool BlockExplorer::switchTo(const QString& query)
+void BlockExplorer::switchTo(const QString& query, bool fHistory)
 {
-    bool IsOk;
-    int64_t AsInt = query.toInt(&IsOk);
-    // If query is integer, get hash from height
-    if (IsOk && AsInt >= 0 && AsInt <= chainActive.Tip()->nHeight) {
-        std::string hex = getexplorerBlockHash(AsInt);
-        uint256 hash = uint256S(hex);
-        CBlockIndex* pIndex = mapBlockIndex[hash];
-        if (pIndex) {
-            setBlock(pIndex);
-            return true;
-        }
-    }
-
-    // If the query is not an integer, assume it is a block hash
-    uint256 hash = uint256S(query.toUtf8().constData());
-
-    // std::map<uint256, CBlockIndex*>::iterator iter = mapBlockIndex.find(hash);
-    BlockMap::iterator iter = mapBlockIndex.find(hash);
-    if (iter != mapBlockIndex.end()) {
-        setBlock(iter->second);
-        return true;
-    }
-
-    // If the query is neither an integer nor a block hash, assume a transaction hash
-    CTransaction tx;
-    uint256 hashBlock = 0;
-    if (GetTransaction(hash, tx, hashBlock, true)) {
-        setContent(TxToString(hashBlock, tx));
-        return true;
-    }
-
-    // If the query is not an integer, nor a block hash, nor a transaction hash, assume an address
-    CBitcoinAddress Address;
-    Address.SetString(query.toUtf8().constData());
-    if (Address.IsValid()) {
-        std::string Content = AddressToString(Address);
-        if (Content.empty())
-            return false;
-        setContent(Content);
-        return true;
-    }
-
-    return false;
+    // A reply to an earlier query still on its way is not shown
+    m_PendingQuery = query;
+    m_PendingHistory = fHistory;
+    emit explorerRequest(query);
 }
 
-void BlockExplorer::goTo(const QString& query)
+void BlockExplorer::showResult(const QString& query, const QString& content, bool fFound)
 {
-    if (switchTo(query)) {
+    if (query != m_PendingQuery)
+        return;
+    m_PendingQuery.clear();
+    if (!fFound)
+        return;
+
+    setContent(content.toUtf8().constData());
+    if (m_PendingHistory) {
         ui->searchBox->setText(query);
         while (m_History.size() > m_HistoryIndex + 1)
             m_History.pop_back();
@@ -506,14 +722,14 @@ void BlockExplorer::goTo(const QString& query)
     }
 }
 
-void BlockExplorer::onSearch()
+void BlockExplorer::goTo(const QString& query)
 {
-    goTo(ui->searchBox->text());
+    switchTo(query, true);
 }
 
-void BlockExplorer::setBlock(CBlockIndex* pBlock)
+void BlockExplorer::onSearch()
 {
-    setContent(BlockToString(pBlock));
+    goTo(ui->searchBox->text());
 }
 
 void BlockExplorer::setContent(const std::string& Content)
@@ -529,7 +745,7 @@ void BlockExplorer::back()
     if (0 <= NewIndex && NewIndex < m_History.size()) {
         m_HistoryIndex = NewIndex;
         ui->searchBox->setText(m_History[NewIndex]);
-        switchTo(m_History[NewIndex]);
+        switchTo(m_History[NewIndex], false);
         updateNavButtons();
     }
 }
@@ -540,7 +756,7 @@ void BlockExplorer::forward()
     if (0 <= NewIndex && NewIndex < m_History.size()) {
         m_HistoryIndex = NewIndex;
         ui->searchBox->setText(m_History[NewIndex]);
-        switchTo(m_History[NewIndex]);
+        switchTo(m_History[NewIndex], false);
         updateNavButtons();
     }
 }
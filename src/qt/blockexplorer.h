@@ -17,10 +17,8 @@ class CBlockIndex;
 class CTransaction;
 class CBlockTreeDB;
 
-std::string getexplorerBlockHash(int64_t);
-const CBlockIndex* getexplorerBlockIndex(int64_t);
 CTxOut getPrevOut(const COutPoint& out);
-void getNextIn(const COutPoint* Out, uint256* Hash, unsigned int n);
+bool getNextIn(const COutPoint& Out, uint256& Hash, unsigned int& n);
 
 class BlockExplorer : public QMainWindow
 {
@@ -30,6 +28,10 @@ public:
     explicit BlockExplorer(QWidget* parent = 0);
     ~BlockExplorer();
 
+Q_SIGNALS:
+    void explorerRequest(const QString& query);
+    void stopWorker();
+
 protected:
     void keyPressEvent(QKeyEvent* event);
     void showEvent(QShowEvent*);
@@ -39,15 +41,19 @@ private Q_SLOTS:
     void goTo(const QString& query);
     void back();
     void forward();
+    void showResult(const QString& query, const QString& content, bool fFound);
 
 private:
     Ui::BlockExplorer* ui;
     bool m_NeverShown;
     int m_HistoryIndex;
     QStringList m_History;
+    //! The query the worker is busy with, and whether its page goes in the history
+    QString m_PendingQuery;
+    bool m_PendingHistory;
 
-    void setBlock(CBlockIndex* pBlock);
-    bool switchTo(const QString& query);
+    void startWorker();
+    void switchTo(const QString& query, bool fHistory);
     void setContent(const std::string& content);
     void updateNavButtons();
 };
@@ -29,6 +29,7 @@
 #include <QIcon>
 #include <QSettings>
 #include <QString>
+#include <QTimer>
 #include <QTreeWidget>
 #include <QTreeWidgetItem>
 
@@ -37,6 +38,80 @@ QList<CAmount> CoinControlDialog::payAmounts;
 int CoinControlDialog::nSplitBlockDummy;
 CCoinControl* CoinControlDialog::coinControl = new CCoinControl();
 
+namespace
+{
+//! What a selected output adds to the totals of the labels
+struct CSelectedInput {
+    CAmount nValue;
+    //! Confirmations when looked up at nHeight, none for an unconfirmed output
+    int nDepth;
+    int nHeight;
+    unsigned int nBytes;
+    bool fUncompressed;
+};
+
+//! The selected outputs looked up so far; a change of the selection only looks up what it added
+std::map<COutPoint, CSelectedInput> mapSelectedInputs;
+
+int GetChainHeight()
+{
+    LOCK(cs_main);
+    return chainActive.Height();
+}
+
+/** Bring mapSelectedInputs in line with the selection of coinControl, unselecting the outputs spent meanwhile */
+void SyncSelectedInputs(WalletModel* model)
+{
+    vector<COutPoint> vSelected;
+    CoinControlDialog::coinControl->ListSelected(vSelected);
+
+    // both are ordered by outpoint
+    vector<COutPoint> vAdded;
+    std::map<COutPoint, CSelectedInput>::iterator it = mapSelectedInputs.begin();
+    BOOST_FOREACH (const COutPoint& outpt, vSelected) {
+        while (it != mapSelectedInputs.end() && it->first < outpt)
+            mapSelectedInputs.erase(it++);
+        if (it != mapSelectedInputs.end() && it->first == outpt)
+            ++it;
+        else
+            vAdded.push_back(outpt);
+    }
+    mapSelectedInputs.erase(it, mapSelectedInputs.end());
+    if (vAdded.empty())
+        return;
+
+    int nHeight = GetChainHeight();
+    vector<COutput> vOutputs;
+    model->getOutputs(vAdded, vOutputs);
+    BOOST_FOREACH (const COutput& out, vOutputs) {
+        // unselect already spent, very unlikely scenario, this could happen
+        // when selected are spent elsewhere, like rpc or another computer
+        COutPoint outpt(out.tx->GetHash(), out.i);
+        if (model->isSpent(outpt)) {
+            CoinControlDialog::coinControl->UnSelect(outpt);
+            continue;
+        }
+
+        CSelectedInput& input = mapSelectedInputs[outpt];
+        input.nValue = out.tx->vout[out.i].nValue;
+        input.nDepth = out.nDepth;
+        input.nHeight = nHeight;
+        input.nBytes = 148; // in all error cases, simply assume 148 here
+        input.fUncompressed = false;
+
+        CTxDestination address;
+        if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address)) {
+            CPubKey pubkey;
+            CKeyID* keyid = boost::get<CKeyID>(&address);
+            if (keyid && model->getPubKey(*keyid, pubkey)) {
+                input.nBytes = pubkey.IsCompressed() ? 148 : 180;
+                input.fUncompressed = !pubkey.IsCompressed();
+            }
+        }
+    }
+}
+} // anon namespace
+
 CoinControlDialog::CoinControlDialog(QWidget* parent, bool fMultisigEnabled) : QDialog(parent),
                                                         ui(new Ui::CoinControlDialog),
                                                         model(0)
@@ -109,6 +184,14 @@ CoinControlDialog::CoinControlDialog(QWidget* parent, bool fMultisigEnabled) : Q
     // click on checkbox
     connect(ui->treeWidget, SIGNAL(itemChanged(QTreeWidgetItem*, int)), this, SLOT(viewItemChanged(QTreeWidgetItem*, int)));
 
+    // the outputs of an address get their items when it is expanded
+    connect(ui->treeWidget, SIGNAL(itemExpanded(QTreeWidgetItem*)), this, SLOT(viewItemExpanded(QTreeWidgetItem*)));
+
+    // checkboxes changed together update the labels once
+    labelsTimer = new QTimer(this);
+    labelsTimer->setSingleShot(true);
+    connect(labelsTimer, SIGNAL(timeout()), this, SLOT(updateSelectionLabels()));
+
 // click on header
 #if QT_VERSION < 0x050000
     ui->treeWidget->header()->setClickable(true);
@@ -202,15 +285,16 @@ void CoinControlDialog::buttonSelectAllClicked()
             break;
         }
     }
-    ui->treeWidget->setEnabled(false);
-    for (int i = 0; i < ui->treeWidget->topLevelItemCount(); i++)
-        if (ui->treeWidget->topLevelItem(i)->checkState(COLUMN_CHECKBOX) != state)
-            ui->treeWidget->topLevelItem(i)->setCheckState(COLUMN_CHECKBOX, state);
-    ui->treeWidget->setEnabled(true);
+
+    // change the selection at once, then the checkboxes to match it
     if (state == Qt::Unchecked)
-        coinControl->UnSelectAll(); // just to be sure
-    CoinControlDialog::updateLabels(model, this);
-    updateDialogLabels();
+        coinControl->UnSelectAll();
+    else {
+        for (std::map<QString, std::vector<COutput> >::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
+            selectAddress(it->first, true);
+    }
+    refreshCheckStates();
+    updateSelectionLabels();
 }
 
 // Toggle lock state
@@ -220,6 +304,7 @@ void CoinControlDialog::buttonToggleLockClicked()
     // Works in list-mode only
     if (ui->radioListMode->isChecked()) {
         ui->treeWidget->setEnabled(false);
+        ui->treeWidget->blockSignals(true);
         for (int i = 0; i < ui->treeWidget->topLevelItemCount(); i++) {
             item = ui->treeWidget->topLevelItem(i);
 
@@ -227,20 +312,24 @@ void CoinControlDialog::buttonToggleLockClicked()
                 continue;
 
             COutPoint outpt(uint256(item->text(COLUMN_TXHASH).toStdString()), item->text(COLUMN_VOUT_INDEX).toUInt());
-            if (model->isLockedCoin(uint256(item->text(COLUMN_TXHASH).toStdString()), item->text(COLUMN_VOUT_INDEX).toUInt())) {
+            if (setLockedCoins.count(outpt)) {
                 model->unlockCoin(outpt);
+                setLockedCoins.erase(outpt);
                 item->setDisabled(false);
                 item->setIcon(COLUMN_CHECKBOX, QIcon());
             } else {
                 model->lockCoin(outpt);
+                setLockedCoins.insert(outpt);
+                coinControl->UnSelect(outpt);
+                item->setCheckState(COLUMN_CHECKBOX, Qt::Unchecked);
                 item->setDisabled(true);
                 item->setIcon(COLUMN_CHECKBOX, QIcon(":/icons/lock_closed"));
             }
-            updateLabelLocked();
         }
+        ui->treeWidget->blockSignals(false);
         ui->treeWidget->setEnabled(true);
-        CoinControlDialog::updateLabels(model, this);
-        updateDialogLabels();
+        updateLabelLocked();
+        updateSelectionLabels();
     } else {
         QMessageBox msgBox;
         msgBox.setObjectName("lockMessageBox");
@@ -261,7 +350,7 @@ void CoinControlDialog::showMenu(const QPoint& point)
         if (item->text(COLUMN_TXHASH).length() == 64) // transaction hash is 64 characters (this means its a child node, so its not a parent node in tree mode)
         {
             copyTransactionHashAction->setEnabled(true);
-            if (model->isLockedCoin(uint256(item->text(COLUMN_TXHASH).toStdString()), item->text(COLUMN_VOUT_INDEX).toUInt())) {
+            if (setLockedCoins.count(COutPoint(uint256(item->text(COLUMN_TXHASH).toStdString()), item->text(COLUMN_VOUT_INDEX).toUInt()))) {
                 lockAction->setEnabled(false);
                 unlockAction->setEnabled(true);
             } else {
@@ -318,6 +407,7 @@ void CoinControlDialog::lockCoin()
 
     COutPoint outpt(uint256(contextMenuItem->text(COLUMN_TXHASH).toStdString()), contextMenuItem->text(COLUMN_VOUT_INDEX).toUInt());
     model->lockCoin(outpt);
+    setLockedCoins.insert(outpt);
     contextMenuItem->setDisabled(true);
     contextMenuItem->setIcon(COLUMN_CHECKBOX, QIcon(":/icons/lock_closed"));
     updateLabelLocked();
@@ -328,6 +418,7 @@ void CoinControlDialog::unlockCoin()
 {
     COutPoint outpt(uint256(contextMenuItem->text(COLUMN_TXHASH).toStdString()), contextMenuItem->text(COLUMN_VOUT_INDEX).toUInt());
     model->unlockCoin(outpt);
+    setLockedCoins.erase(outpt);
     contextMenuItem->setDisabled(false);
     contextMenuItem->setIcon(COLUMN_CHECKBOX, QIcon());
     updateLabelLocked();
@@ -438,11 +529,17 @@ void CoinControlDialog::viewItemChanged(QTreeWidgetItem* item, int column)
         else
             coinControl->Select(outpt);
 
-        // selection changed -> update labels
-        if (ui->treeWidget->isEnabled()){ // do not update on every click for (un)select all
-            CoinControlDialog::updateLabels(model, this);
-            updateDialogLabels();
-        }
+        // selection changed -> update labels, once for all the children of a parent node
+        scheduleLabelsUpdate();
+    }
+    // a parent node whose outputs have no items yet selects them itself
+    else if (column == COLUMN_CHECKBOX && item->childCount() == 0) {
+        QString sWalletAddress = item->text(COLUMN_ADDRESS);
+        selectAddress(sWalletAddress, item->checkState(COLUMN_CHECKBOX) != Qt::Unchecked);
+        ui->treeWidget->blockSignals(true);
+        item->setCheckState(COLUMN_CHECKBOX, getAddressCheckState(sWalletAddress));
+        ui->treeWidget->blockSignals(false);
+        scheduleLabelsUpdate();
     }
 // todo: this is a temporary qt5 fix: when clicking a parent node in tree mode, the parent node
 //       including all childs are partially selected. But the parent node should be fully selected
@@ -456,6 +553,102 @@ void CoinControlDialog::viewItemChanged(QTreeWidgetItem* item, int column)
 #endif
 }
 
+// parent node expanded: make the items of its outputs
+void CoinControlDialog::viewItemExpanded(QTreeWidgetItem* item)
+{
+    if (item->parent() || item->childCount() > 0 || !model || !model->getOptionsModel())
+        return;
+
+    QString sWalletAddress = item->text(COLUMN_ADDRESS);
+    std::map<QString, std::vector<COutput> >::const_iterator it = mapCoins.find(sWalletAddress);
+    if (it == mapCoins.end())
+        return;
+
+    int nDisplayUnit = model->getOptionsModel()->getDisplayUnit();
+    double mempoolEstimatePriority = mempool.estimatePriority(nTxConfirmTarget);
+    QString sWalletLabel = item->text(COLUMN_LABEL);
+
+    QList<QTreeWidgetItem*> items;
+    BOOST_FOREACH (const COutput& out, it->second)
+        items.append(makeOutputItem(out, sWalletAddress, sWalletLabel, true, nDisplayUnit, mempoolEstimatePriority));
+
+    ui->treeWidget->blockSignals(true);
+    item->addChildren(items);
+    item->sortChildren(sortColumn, sortOrder);
+    ui->treeWidget->blockSignals(false);
+}
+
+// one update of the labels for the checkboxes changed in this pass of the event loop
+void CoinControlDialog::scheduleLabelsUpdate()
+{
+    labelsTimer->start(0);
+}
+
+void CoinControlDialog::updateSelectionLabels()
+{
+    labelsTimer->stop();
+    CoinControlDialog::updateLabels(model, this);
+    updateDialogLabels();
+}
+
+bool CoinControlDialog::isSelectable(const COutPoint& outpt) const
+{
+    return !setLockedCoins.count(outpt) && (fMultisigEnabled || !setMultiSigCoins.count(outpt));
+}
+
+// (un)select all the outputs of a wallet address without going through their items
+void CoinControlDialog::selectAddress(const QString& sWalletAddress, bool fSelect)
+{
+    std::map<QString, std::vector<COutput> >::const_iterator it = mapCoins.find(sWalletAddress);
+    if (it == mapCoins.end())
+        return;
+
+    BOOST_FOREACH (const COutput& out, it->second) {
+        COutPoint outpt(out.tx->GetHash(), out.i);
+        if (!fSelect)
+            coinControl->UnSelect(outpt);
+        else if (isSelectable(outpt))
+            coinControl->Select(outpt);
+    }
+}
+
+Qt::CheckState CoinControlDialog::getAddressCheckState(const QString& sWalletAddress) const
+{
+    std::map<QString, std::vector<COutput> >::const_iterator it = mapCoins.find(sWalletAddress);
+    if (it == mapCoins.end())
+        return Qt::Unchecked;
+
+    unsigned int nSelected = 0;
+    BOOST_FOREACH (const COutput& out, it->second)
+        if (coinControl->IsSelected(out.tx->GetHash(), out.i))
+            nSelected++;
+    if (nSelected == 0)
+        return Qt::Unchecked;
+    return nSelected == it->second.size() ? Qt::Checked : Qt::PartiallyChecked;
+}
+
+// checkboxes from the selection of coinControl
+void CoinControlDialog::refreshCheckStates()
+{
+    ui->treeWidget->blockSignals(true);
+    for (int i = 0; i < ui->treeWidget->topLevelItemCount(); i++) {
+        QTreeWidgetItem* item = ui->treeWidget->topLevelItem(i);
+        if (item->text(COLUMN_TXHASH).length() == 64) {
+            bool fSelected = coinControl->IsSelected(uint256(item->text(COLUMN_TXHASH).toStdString()), item->text(COLUMN_VOUT_INDEX).toUInt());
+            item->setCheckState(COLUMN_CHECKBOX, fSelected ? Qt::Checked : Qt::Unchecked);
+        } else if (item->childCount() == 0) {
+            item->setCheckState(COLUMN_CHECKBOX, getAddressCheckState(item->text(COLUMN_ADDRESS)));
+        } else {
+            for (int j = 0; j < item->childCount(); j++) {
+                QTreeWidgetItem* child = item->child(j);
+                bool fSelected = coinControl->IsSelected(uint256(child->text(COLUMN_TXHASH).toStdString()), child->text(COLUMN_VOUT_INDEX).toUInt());
+                child->setCheckState(COLUMN_CHECKBOX, fSelected ? Qt::Checked : Qt::Unchecked);
+            }
+        }
+    }
+    ui->treeWidget->blockSignals(false);
+}
+
 // return human readable label for priority number
 QString CoinControlDialog::getPriorityLabel(double dPriority, double mempoolEstimatePriority)
 {
@@ -504,28 +697,16 @@ void CoinControlDialog::updateDialogLabels()
         return;
     }
 
-    vector<COutPoint> vCoinControl;
-    vector<COutput> vOutputs;
-    coinControl->ListSelected(vCoinControl);
-    model->getOutputs(vCoinControl, vOutputs);
+    SyncSelectedInputs(model);
 
     CAmount nAmount = 0;
     unsigned int nQuantity = 0;
-    for (const COutput& out : vOutputs) {
-        // unselect already spent, very unlikely scenario, this could happen
-        // when selected are spent elsewhere, like rpc or another computer
-        uint256 txhash = out.tx->GetHash();
-        COutPoint outpt(txhash, out.i);
-        if(model->isSpent(outpt)) {
-            coinControl->UnSelect(outpt);
-            continue;
-        }
-
+    for (std::map<COutPoint, CSelectedInput>::const_iterator it = mapSelectedInputs.begin(); it != mapSelectedInputs.end(); ++it) {
         // Quantity
         nQuantity++;
 
         // Amount
-        nAmount += out.tx->vout[out.i].nValue;
+        nAmount += it->second.nValue;
     }
     MultisigDialog* multisigDialog = (MultisigDialog*)this->parentWidget();
 
@@ -565,43 +746,27 @@ void CoinControlDialog::updateLabels(WalletModel* model, QDialog* dialog)
     int nQuantityUncompressed = 0;
     bool fAllowFree = false;
 
-    vector<COutPoint> vCoinControl;
-    vector<COutput> vOutputs;
-    coinControl->ListSelected(vCoinControl);
-    model->getOutputs(vCoinControl, vOutputs);
+    // only the outputs selected since the last call are looked up in the wallet
+    SyncSelectedInputs(model);
+    int nHeight = GetChainHeight();
 
-    BOOST_FOREACH (const COutput& out, vOutputs) {
-        // unselect already spent, very unlikely scenario, this could happen
-        // when selected are spent elsewhere, like rpc or another computer
-        uint256 txhash = out.tx->GetHash();
-        COutPoint outpt(txhash, out.i);
-        if (model->isSpent(outpt)) {
-            coinControl->UnSelect(outpt);
-            continue;
-        }
+    for (std::map<COutPoint, CSelectedInput>::const_iterator it = mapSelectedInputs.begin(); it != mapSelectedInputs.end(); ++it) {
+        const CSelectedInput& input = it->second;
 
         // Quantity
         nQuantity++;
 
         // Amount
-        nAmount += out.tx->vout[out.i].nValue;
+        nAmount += input.nValue;
 
         // Priority
-        dPriorityInputs += (double)out.tx->vout[out.i].nValue * (out.nDepth + 1);
+        int nDepth = input.nDepth > 0 ? input.nDepth + nHeight - input.nHeight : input.nDepth;
+        dPriorityInputs += (double)input.nValue * (nDepth + 1);
 
         // Bytes
-        CTxDestination address;
-        if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address)) {
-            CPubKey pubkey;
-            CKeyID* keyid = boost::get<CKeyID>(&address);
-            if (keyid && model->getPubKey(*keyid, pubkey)) {
-                nBytesInputs += (pubkey.IsCompressed() ? 148 : 180);
-                if (!pubkey.IsCompressed())
-                    nQuantityUncompressed++;
-            } else
-                nBytesInputs += 148; // in all error cases, simply assume 148 here
-        } else
-            nBytesInputs += 148;
+        nBytesInputs += input.nBytes;
+        if (input.fUncompressed)
+            nQuantityUncompressed++;
     }
 
     // calculation
@@ -730,6 +895,100 @@ void CoinControlDialog::updateLabels(WalletModel* model, QDialog* dialog)
         label->setVisible(nChange < 0);
 }
 
+// extra bytes of an input from an uncompressed public key, over the 151 bytes priority leaves out
+int CoinControlDialog::getPriorityInputSize(const COutput& out) const
+{
+    CTxDestination outputAddress;
+    if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, outputAddress)) {
+        CPubKey pubkey;
+        CKeyID* keyid = boost::get<CKeyID>(&outputAddress);
+        if (keyid && model->getPubKey(*keyid, pubkey) && !pubkey.IsCompressed())
+            return 29; // 29 = 180 - 151 (public key is 180 bytes, priority free area is 151 bytes)
+    }
+    return 0;
+}
+
+QTreeWidgetItem* CoinControlDialog::makeOutputItem(const COutput& out, const QString& sWalletAddress, const QString& sWalletLabel, bool treeMode, int nDisplayUnit, double mempoolEstimatePriority)
+{
+    QTreeWidgetItem* itemOutput = new QTreeWidgetItem();
+    itemOutput->setFlags(Qt::ItemIsSelectable | Qt::ItemIsEnabled | Qt::ItemIsUserCheckable);
+    itemOutput->setCheckState(COLUMN_CHECKBOX, Qt::Unchecked);
+
+    uint256 txhash = out.tx->GetHash();
+    COutPoint outpt(txhash, out.i);
+
+    //MultiSig
+    if (setMultiSigCoins.count(outpt)) {
+        itemOutput->setText(COLUMN_TYPE, "MultiSig");
+
+        if (!fMultisigEnabled) {
+            itemOutput->setDisabled(true);
+            itemOutput->setIcon(COLUMN_CHECKBOX, QIcon(":/icons/lock_closed"));
+        }
+    } else {
+        itemOutput->setText(COLUMN_TYPE, "Personal");
+    }
+
+    // address
+    CTxDestination outputAddress;
+    QString sAddress = "";
+    if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, outputAddress)) {
+        sAddress = QString::fromStdString(CBitcoinAddress(outputAddress).ToString());
+
+        // if listMode or change => show DYSTEM address. In tree mode, address is not shown again for direct wallet address outputs
+        if (!treeMode || (!(sAddress == sWalletAddress)))
+            itemOutput->setText(COLUMN_ADDRESS, sAddress);
+
+        itemOutput->setToolTip(COLUMN_ADDRESS, sAddress);
+    }
+
+    // label
+    if (!(sAddress == sWalletAddress)) // change
+    {
+        // tooltip from where the change comes from
+        itemOutput->setToolTip(COLUMN_LABEL, tr("change from %1 (%2)").arg(sWalletLabel).arg(sWalletAddress));
+        itemOutput->setText(COLUMN_LABEL, tr("(change)"));
+    } else if (!treeMode) {
+        itemOutput->setText(COLUMN_LABEL, sWalletLabel);
+    }
+
+    // amount
+    itemOutput->setText(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, out.tx->vout[out.i].nValue));
+    itemOutput->setToolTip(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, out.tx->vout[out.i].nValue));
+    itemOutput->setText(COLUMN_AMOUNT_INT64, strPad(QString::number(out.tx->vout[out.i].nValue), 15, " ")); // padding so that sorting works correctly
+
+    // date
+    itemOutput->setText(COLUMN_DATE, GUIUtil::dateTimeStr(out.tx->GetTxTime()));
+    itemOutput->setToolTip(COLUMN_DATE, GUIUtil::dateTimeStr(out.tx->GetTxTime()));
+    itemOutput->setText(COLUMN_DATE_INT64, strPad(QString::number(out.tx->GetTxTime()), 20, " "));
+
+    // confirmations
+    itemOutput->setText(COLUMN_CONFIRMATIONS, strPad(QString::number(out.nDepth), 8, " "));
+
+    // priority
+    double dPriority = ((double)out.tx->vout[out.i].nValue / (getPriorityInputSize(out) + 78)) * (out.nDepth + 1); // 78 = 2 * 34 + 10
+    itemOutput->setText(COLUMN_PRIORITY, CoinControlDialog::getPriorityLabel(dPriority, mempoolEstimatePriority));
+    itemOutput->setText(COLUMN_PRIORITY_INT64, strPad(QString::number((int64_t)dPriority), 20, " "));
+
+    // transaction hash
+    itemOutput->setText(COLUMN_TXHASH, QString::fromStdString(txhash.GetHex()));
+
+    // vout index
+    itemOutput->setText(COLUMN_VOUT_INDEX, QString::number(out.i));
+
+    // disable locked coins
+    if (setLockedCoins.count(outpt)) {
+        itemOutput->setDisabled(true);
+        itemOutput->setIcon(COLUMN_CHECKBOX, QIcon(":/icons/lock_closed"));
+    }
+
+    // set checkbox
+    if (coinControl->IsSelected(txhash, out.i))
+        itemOutput->setCheckState(COLUMN_CHECKBOX, Qt::Checked);
+
+    return itemOutput;
+}
+
 void CoinControlDialog::updateView()
 {
     if (!model || !model->getOptionsModel() || !model->getAddressTableModel())
@@ -739,158 +998,97 @@ void CoinControlDialog::updateView()
 
     ui->treeWidget->clear();
     ui->treeWidget->setEnabled(false); // performance, otherwise updateLabels would be called for every checked checkbox
+    ui->treeWidget->setUpdatesEnabled(false);
+    ui->treeWidget->blockSignals(true);
     ui->treeWidget->setAlternatingRowColors(!treeMode);
-    QFlags<Qt::ItemFlag> flgCheckbox = Qt::ItemIsSelectable | Qt::ItemIsEnabled | Qt::ItemIsUserCheckable;
     QFlags<Qt::ItemFlag> flgTristate = Qt::ItemIsSelectable | Qt::ItemIsEnabled | Qt::ItemIsUserCheckable | Qt::ItemIsTristate;
 
     int nDisplayUnit = model->getOptionsModel()->getDisplayUnit();
     double mempoolEstimatePriority = mempool.estimatePriority(nTxConfirmTarget);
 
-    map<QString, vector<COutput>> mapCoins;
-    model->listCoins(mapCoins);
+    // the selection is looked up anew, its outputs may have been spent since
+    mapSelectedInputs.clear();
 
-    BOOST_FOREACH (PAIRTYPE(QString, vector<COutput>) coins, mapCoins) {
-        QTreeWidgetItem* itemWalletAddress = new QTreeWidgetItem();
-        itemWalletAddress->setCheckState(COLUMN_CHECKBOX, Qt::Unchecked);
-        QString sWalletAddress = coins.first;
-        QString sWalletLabel = model->getAddressTableModel()->labelForAddress(sWalletAddress);
-        if (sWalletLabel.isEmpty())
-            sWalletLabel = tr("(no label)");
+    vector<COutPoint> vLockedCoins;
+    model->listLockedCoins(vLockedCoins);
+    setLockedCoins = std::set<COutPoint>(vLockedCoins.begin(), vLockedCoins.end());
 
-        if (treeMode) {
-            // wallet address
-            ui->treeWidget->addTopLevelItem(itemWalletAddress);
+    map<QString, vector<COutput>> mapListed;
+    model->listCoins(mapListed);
 
-            itemWalletAddress->setFlags(flgTristate);
-            itemWalletAddress->setCheckState(COLUMN_CHECKBOX, Qt::Unchecked);
-
-            // label
-            itemWalletAddress->setText(COLUMN_LABEL, sWalletLabel);
-            itemWalletAddress->setToolTip(COLUMN_LABEL, sWalletLabel);
-
-            // address
-            itemWalletAddress->setText(COLUMN_ADDRESS, sWalletAddress);
-            itemWalletAddress->setToolTip(COLUMN_ADDRESS, sWalletAddress);
-        }
-
-        CAmount nSum = 0;
-        double dPrioritySum = 0;
-        int nChildren = 0;
-        int nInputSum = 0;
-        for(const COutput& out: coins.second) {
+    mapCoins.clear();
+    setMultiSigCoins.clear();
+    for (map<QString, vector<COutput> >::const_iterator it = mapListed.begin(); it != mapListed.end(); ++it) {
+        vector<COutput> vShown;
+        for (const COutput& out : it->second) {
             isminetype mine = pwalletMain->IsMine(out.tx->vout[out.i]);
             bool fMultiSigUTXO = (mine & ISMINE_MULTISIG);
             // when multisig is enabled, it will only display outputs from multisig addresses
             if (fMultisigEnabled && !fMultiSigUTXO)
                 continue;
-            int nInputSize = 0;
-            nSum += out.tx->vout[out.i].nValue;
-            nChildren++;
-
-            QTreeWidgetItem* itemOutput;
-            if (treeMode)
-                itemOutput = new QTreeWidgetItem(itemWalletAddress);
-            else
-                itemOutput = new QTreeWidgetItem(ui->treeWidget);
-            itemOutput->setFlags(flgCheckbox);
-            itemOutput->setCheckState(COLUMN_CHECKBOX, Qt::Unchecked);
-
-            //MultiSig
-            if (fMultiSigUTXO) {
-                itemOutput->setText(COLUMN_TYPE, "MultiSig");
-
-                if (!fMultisigEnabled) {
-                    COutPoint outpt(out.tx->GetHash(), out.i);
-                    coinControl->UnSelect(outpt); // just to be sure
-                    itemOutput->setDisabled(true);
-                    itemOutput->setIcon(COLUMN_CHECKBOX, QIcon(":/icons/lock_closed"));
-                }
-            } else {
-                itemOutput->setText(COLUMN_TYPE, "Personal");
-            }
 
-            // address
-            CTxDestination outputAddress;
-            QString sAddress = "";
-            if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, outputAddress)) {
-                sAddress = QString::fromStdString(CBitcoinAddress(outputAddress).ToString());
-
-                // if listMode or change => show DYSTEM address. In tree mode, address is not shown again for direct wallet address outputs
-                if (!treeMode || (!(sAddress == sWalletAddress)))
-                    itemOutput->setText(COLUMN_ADDRESS, sAddress);
-
-                itemOutput->setToolTip(COLUMN_ADDRESS, sAddress);
+            COutPoint outpt(out.tx->GetHash(), out.i);
+            if (fMultiSigUTXO)
+                setMultiSigCoins.insert(outpt);
+            if (!isSelectable(outpt))
+                coinControl->UnSelect(outpt); // just to be sure
+            vShown.push_back(out);
+        }
+        if (!vShown.empty())
+            mapCoins[it->first].swap(vShown);
+    }
 
-                CPubKey pubkey;
-                CKeyID* keyid = boost::get<CKeyID>(&outputAddress);
-                if (keyid && model->getPubKey(*keyid, pubkey) && !pubkey.IsCompressed())
-                    nInputSize = 29; // 29 = 180 - 151 (public key is 180 bytes, priority free area is 151 bytes)
-            }
+    QList<QTreeWidgetItem*> items;
+    for (std::map<QString, std::vector<COutput> >::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        QString sWalletAddress = it->first;
+        QString sWalletLabel = model->getAddressTableModel()->labelForAddress(sWalletAddress);
+        if (sWalletLabel.isEmpty())
+            sWalletLabel = tr("(no label)");
 
-            // label
-            if (!(sAddress == sWalletAddress)) // change
-            {
-                // tooltip from where the change comes from
-                itemOutput->setToolTip(COLUMN_LABEL, tr("change from %1 (%2)").arg(sWalletLabel).arg(sWalletAddress));
-                itemOutput->setText(COLUMN_LABEL, tr("(change)"));
-            } else if (!treeMode) {
-                QString sLabel = model->getAddressTableModel()->labelForAddress(sAddress);
-                if (sLabel.isEmpty())
-                    sLabel = tr("(no label)");
-                itemOutput->setText(COLUMN_LABEL, sLabel);
-            }
+        if (!treeMode) {
+            for (const COutput& out : it->second)
+                items.append(makeOutputItem(out, sWalletAddress, sWalletLabel, false, nDisplayUnit, mempoolEstimatePriority));
+            continue;
+        }
 
-            // amount
-            itemOutput->setText(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, out.tx->vout[out.i].nValue));
-            itemOutput->setToolTip(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, out.tx->vout[out.i].nValue));
-            itemOutput->setText(COLUMN_AMOUNT_INT64, strPad(QString::number(out.tx->vout[out.i].nValue), 15, " ")); // padding so that sorting works correctly
+        // wallet address, its outputs get their items when it is expanded
+        QTreeWidgetItem* itemWalletAddress = new QTreeWidgetItem();
+        itemWalletAddress->setFlags(flgTristate);
+        itemWalletAddress->setChildIndicatorPolicy(QTreeWidgetItem::ShowIndicator);
+        itemWalletAddress->setCheckState(COLUMN_CHECKBOX, getAddressCheckState(sWalletAddress));
 
-            // date
-            itemOutput->setText(COLUMN_DATE, GUIUtil::dateTimeStr(out.tx->GetTxTime()));
-            itemOutput->setToolTip(COLUMN_DATE, GUIUtil::dateTimeStr(out.tx->GetTxTime()));
-            itemOutput->setText(COLUMN_DATE_INT64, strPad(QString::number(out.tx->GetTxTime()), 20, " "));
+        // label
+        itemWalletAddress->setText(COLUMN_LABEL, sWalletLabel);
+        itemWalletAddress->setToolTip(COLUMN_LABEL, sWalletLabel);
 
-            // confirmations
-            itemOutput->setText(COLUMN_CONFIRMATIONS, strPad(QString::number(out.nDepth), 8, " "));
+        // address
+        itemWalletAddress->setText(COLUMN_ADDRESS, sWalletAddress);
+        itemWalletAddress->setToolTip(COLUMN_ADDRESS, sWalletAddress);
 
-            // priority
-            double dPriority = ((double)out.tx->vout[out.i].nValue / (nInputSize + 78)) * (out.nDepth + 1); // 78 = 2 * 34 + 10
-            itemOutput->setText(COLUMN_PRIORITY, CoinControlDialog::getPriorityLabel(dPriority, mempoolEstimatePriority));
-            itemOutput->setText(COLUMN_PRIORITY_INT64, strPad(QString::number((int64_t)dPriority), 20, " "));
+        CAmount nSum = 0;
+        double dPrioritySum = 0;
+        int nInputSum = 0;
+        for (const COutput& out : it->second) {
+            nSum += out.tx->vout[out.i].nValue;
             dPrioritySum += (double)out.tx->vout[out.i].nValue * (out.nDepth + 1);
-            nInputSum += nInputSize;
-
-            // transaction hash
-            uint256 txhash = out.tx->GetHash();
-            itemOutput->setText(COLUMN_TXHASH, QString::fromStdString(txhash.GetHex()));
-
-            // vout index
-            itemOutput->setText(COLUMN_VOUT_INDEX, QString::number(out.i));
-
-            // disable locked coins
-            if (model->isLockedCoin(txhash, out.i)) {
-                COutPoint outpt(txhash, out.i);
-                coinControl->UnSelect(outpt); // just to be sure
-                itemOutput->setDisabled(true);
-                itemOutput->setIcon(COLUMN_CHECKBOX, QIcon(":/icons/lock_closed"));
-            }
-
-            // set checkbox
-            if (coinControl->IsSelected(txhash, out.i))
-                itemOutput->setCheckState(COLUMN_CHECKBOX, Qt::Checked);
+            nInputSum += getPriorityInputSize(out);
         }
 
         // amount
-        if (treeMode) {
-            dPrioritySum = dPrioritySum / (nInputSum + 78);
-            itemWalletAddress->setText(COLUMN_CHECKBOX, "(" + QString::number(nChildren) + ")");
-            itemWalletAddress->setText(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, nSum));
-            itemWalletAddress->setToolTip(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, nSum));
-            itemWalletAddress->setText(COLUMN_AMOUNT_INT64, strPad(QString::number(nSum), 15, " "));
-            itemWalletAddress->setText(COLUMN_PRIORITY, CoinControlDialog::getPriorityLabel(dPrioritySum, mempoolEstimatePriority));
-            itemWalletAddress->setText(COLUMN_PRIORITY_INT64, strPad(QString::number((int64_t)dPrioritySum), 20, " "));
-        }
+        dPrioritySum = dPrioritySum / (nInputSum + 78);
+        itemWalletAddress->setText(COLUMN_CHECKBOX, "(" + QString::number(it->second.size()) + ")");
+        itemWalletAddress->setText(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, nSum));
+        itemWalletAddress->setToolTip(COLUMN_AMOUNT, BitcoinUnits::format(nDisplayUnit, nSum));
+        itemWalletAddress->setText(COLUMN_AMOUNT_INT64, strPad(QString::number(nSum), 15, " "));
+        itemWalletAddress->setText(COLUMN_PRIORITY, CoinControlDialog::getPriorityLabel(dPrioritySum, mempoolEstimatePriority));
+        itemWalletAddress->setText(COLUMN_PRIORITY_INT64, strPad(QString::number((int64_t)dPrioritySum), 20, " "));
+        items.append(itemWalletAddress);
     }
+    ui->treeWidget->addTopLevelItems(items);
+
+    // sort view
+    sortView(sortColumn, sortOrder);
+    ui->treeWidget->blockSignals(false);
 
     // expand all partially selected
     if (treeMode) {
@@ -899,7 +1097,6 @@ void CoinControlDialog::updateView()
                 ui->treeWidget->topLevelItem(i)->setExpanded(true);
     }
 
-    // sort view
-    sortView(sortColumn, sortOrder);
+    ui->treeWidget->setUpdatesEnabled(true);
     ui->treeWidget->setEnabled(true);
 }
@@ -6,6 +6,11 @@
 #define BITCOIN_QT_COINCONTROLDIALOG_H
 
 #include "amount.h"
+#include "wallet.h"
+
+#include <map>
+#include <set>
+#include <vector>
 
 #include <QAbstractButton>
 #include <QAction>
@@ -17,6 +22,7 @@
 #include <QTreeWidgetItem>
 
 class WalletModel;
+class QTimer;
 
 class MultisigDialog;
 class CCoinControl;
@@ -58,10 +64,24 @@ private:
     QAction* copyTransactionHashAction;
     QAction* lockAction;
     QAction* unlockAction;
+    QTimer* labelsTimer;
+
+    //! The outputs shown, by wallet address. In tree mode the items of the
+    //! outputs of an address are only made when it is first expanded.
+    std::map<QString, std::vector<COutput> > mapCoins;
+    std::set<COutPoint> setLockedCoins;
+    std::set<COutPoint> setMultiSigCoins;
 
     QString strPad(QString, int, QString);
     void sortView(int, Qt::SortOrder);
     void updateView();
+    QTreeWidgetItem* makeOutputItem(const COutput& out, const QString& sWalletAddress, const QString& sWalletLabel, bool treeMode, int nDisplayUnit, double mempoolEstimatePriority);
+    int getPriorityInputSize(const COutput& out) const;
+    bool isSelectable(const COutPoint& outpt) const;
+    void selectAddress(const QString& sWalletAddress, bool fSelect);
+    Qt::CheckState getAddressCheckState(const QString& sWalletAddress) const;
+    void refreshCheckStates();
+    void scheduleLabelsUpdate();
 
     enum {
         COLUMN_CHECKBOX,
@@ -120,6 +140,8 @@ private slots:
     void radioTreeMode(bool);
     void radioListMode(bool);
     void viewItemChanged(QTreeWidgetItem*, int);
+    void viewItemExpanded(QTreeWidgetItem*);
+    void updateSelectionLabels();
     void headerSectionClicked(int);
     void buttonBoxClicked(QAbstractButton*);
     void buttonSelectAllClicked();
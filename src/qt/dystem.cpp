@@ -231,6 +231,10 @@ public slots:
     void shutdownResult(int retval);
     /// Handle runaway exceptions. Shows a message box with the problem and quits the program.
     void handleRunawayException(const QString& message);
+#ifdef ENABLE_WALLET
+    /// Add the wallet views once the main window shows
+    void attachWallet();
+#endif
 
 signals:
     void requestedInitialize();
@@ -450,25 +454,12 @@ void BitcoinApplication::initializeResult(int retval)
     returnValue = retval ? 0 : 1;
     if (retval) {
 #ifdef ENABLE_WALLET
-        PaymentServer::LoadRootCAs();
         paymentServer->setOptionsModel(optionsModel);
 #endif
 
         clientModel = new ClientModel(optionsModel);
         window->setClientModel(clientModel);
 
-#ifdef ENABLE_WALLET
-        if (pwalletMain) {
-            walletModel = new WalletModel(pwalletMain, optionsModel);
-
-            window->addWallet(BitcoinGUI::DEFAULT_WALLET, walletModel);
-            window->setCurrentWallet(BitcoinGUI::DEFAULT_WALLET);
-
-            connect(walletModel, SIGNAL(coinsSent(CWallet*, SendCoinsRecipient, QByteArray)),
-                paymentServer, SLOT(fetchPaymentACK(CWallet*, const SendCoinsRecipient&, QByteArray)));
-        }
-#endif
-
         // If -min option passed, start window minimized.
         if (GetBoolArg("-min", false)) {
             window->showMinimized();
@@ -478,21 +469,45 @@ void BitcoinApplication::initializeResult(int retval)
         emit splashFinished(window);
 
 #ifdef ENABLE_WALLET
-        // Now that initialization/startup is done, process any command-line
-        // DYSTEM: URIs or payment requests:
-        connect(paymentServer, SIGNAL(receivedPaymentRequest(SendCoinsRecipient)),
-            window, SLOT(handlePaymentRequest(SendCoinsRecipient)));
-        connect(window, SIGNAL(receivedURI(QString)),
-            paymentServer, SLOT(handleURIOrFile(QString)));
-        connect(paymentServer, SIGNAL(message(QString, QString, unsigned int)),
-            window, SLOT(message(QString, QString, unsigned int)));
-        QTimer::singleShot(100, paymentServer, SLOT(uiReady()));
+        // The wallet views load their models, let the window paint first
+        QTimer::singleShot(0, this, SLOT(attachWallet()));
 #endif
     } else {
         quit(); // Exit main loop
     }
 }
 
+#ifdef ENABLE_WALLET
+void BitcoinApplication::attachWallet()
+{
+    // Shutdown requested before the window got to the wallet
+    if (!clientModel)
+        return;
+
+    PaymentServer::LoadRootCAs();
+
+    if (pwalletMain) {
+        walletModel = new WalletModel(pwalletMain, optionsModel);
+
+        window->addWallet(BitcoinGUI::DEFAULT_WALLET, walletModel);
+        window->setCurrentWallet(BitcoinGUI::DEFAULT_WALLET);
+
+        connect(walletModel, SIGNAL(coinsSent(CWallet*, SendCoinsRecipient, QByteArray)),
+            paymentServer, SLOT(fetchPaymentACK(CWallet*, const SendCoinsRecipient&, QByteArray)));
+    }
+
+    // Now that initialization/startup is done, process any command-line
+    // DYSTEM: URIs or payment requests:
+    connect(paymentServer, SIGNAL(receivedPaymentRequest(SendCoinsRecipient)),
+        window, SLOT(handlePaymentRequest(SendCoinsRecipient)));
+    connect(window, SIGNAL(receivedURI(QString)),
+        paymentServer, SLOT(handleURIOrFile(QString)));
+    connect(paymentServer, SIGNAL(message(QString, QString, unsigned int)),
+        window, SLOT(message(QString, QString, unsigned int)));
+    QTimer::singleShot(100, paymentServer, SLOT(uiReady()));
+}
+#endif
+
 void BitcoinApplication::shutdownResult(int retval)
 {
     qDebug() << __func__ << ": Shutdown result: " << retval;
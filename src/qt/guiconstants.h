@@ -10,6 +10,14 @@
 /* Milliseconds between model updates */
 static const int MODEL_UPDATE_DELAY = 250;
 
+/* Transaction list -- wallet transactions decomposed at a time while loading */
+static const int TRANSACTION_LOAD_BATCH = 500;
+
+/* Block explorer -- transactions shown on a page of a block or an address */
+static const int EXPLORER_PAGE_SIZE = 100;
+/* Block explorer -- rendered block pages kept for going back to them */
+static const int EXPLORER_BLOCK_CACHE_SIZE = 64;
+
 /* AskPassphraseDialog -- Maximum passphrase length */
 static const int MAX_PASSPHRASE_SIZE = 1024;
 
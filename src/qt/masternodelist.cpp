@@ -8,12 +8,14 @@
 #include "masternode-sync.h"
 #include "masternodeconfig.h"
 #include "masternodeman.h"
+#include "masternodetablemodel.h"
 #include "sync.h"
 #include "wallet.h"
 #include "walletmodel.h"
 #include "askpassphrasedialog.h"
 
 #include <QMessageBox>
+#include <QSortFilterProxyModel>
 #include <QTimer>
 
 CCriticalSection cs_masternodes;
@@ -34,20 +36,32 @@ MasternodeList::MasternodeList(QWidget* parent) : QWidget(parent),
     int columnActiveWidth = 130;
     int columnLastSeenWidth = 130;
 
-    ui->tableWidgetMyMasternodes->setAlternatingRowColors(true);
-    ui->tableWidgetMyMasternodes->setColumnWidth(0, columnAliasWidth);
-    ui->tableWidgetMyMasternodes->setColumnWidth(1, columnAddressWidth);
-    ui->tableWidgetMyMasternodes->setColumnWidth(2, columnProtocolWidth);
-    ui->tableWidgetMyMasternodes->setColumnWidth(3, columnStatusWidth);
-    ui->tableWidgetMyMasternodes->setColumnWidth(4, columnActiveWidth);
-    ui->tableWidgetMyMasternodes->setColumnWidth(5, columnLastSeenWidth);
-
-    ui->tableWidgetMyMasternodes->setContextMenuPolicy(Qt::CustomContextMenu);
+    // Rows are updated by the model as the masternode list changes
+    model = new MasternodeTableModel(this);
+    proxyModel = new QSortFilterProxyModel(this);
+    proxyModel->setSourceModel(model);
+    proxyModel->setSortRole(MasternodeTableModel::SortRole);
+    proxyModel->setDynamicSortFilter(true);
+    proxyModel->setSortCaseSensitivity(Qt::CaseInsensitive);
+    proxyModel->setFilterCaseSensitivity(Qt::CaseInsensitive);
+    ui->tableViewMyMasternodes->setModel(proxyModel);
+    ui->tableViewMyMasternodes->sortByColumn(MasternodeTableModel::Alias, Qt::AscendingOrder);
+
+    ui->tableViewMyMasternodes->setAlternatingRowColors(true);
+    ui->tableViewMyMasternodes->setColumnWidth(MasternodeTableModel::Alias, columnAliasWidth);
+    ui->tableViewMyMasternodes->setColumnWidth(MasternodeTableModel::Address, columnAddressWidth);
+    ui->tableViewMyMasternodes->setColumnWidth(MasternodeTableModel::Protocol, columnProtocolWidth);
+    ui->tableViewMyMasternodes->setColumnWidth(MasternodeTableModel::Status, columnStatusWidth);
+    ui->tableViewMyMasternodes->setColumnWidth(MasternodeTableModel::Active, columnActiveWidth);
+    ui->tableViewMyMasternodes->setColumnWidth(MasternodeTableModel::LastSeen, columnLastSeenWidth);
+
+    ui->tableViewMyMasternodes->setContextMenuPolicy(Qt::CustomContextMenu);
 
     QAction* startAliasAction = new QAction(tr("Start alias"), this);
     contextMenu = new QMenu();
     contextMenu->addAction(startAliasAction);
-    connect(ui->tableWidgetMyMasternodes, SIGNAL(customContextMenuRequested(const QPoint&)), this, SLOT(showContextMenu(const QPoint&)));
+    connect(ui->tableViewMyMasternodes, SIGNAL(customContextMenuRequested(const QPoint&)), this, SLOT(showContextMenu(const QPoint&)));
+    connect(ui->tableViewMyMasternodes->selectionModel(), SIGNAL(selectionChanged(QItemSelection, QItemSelection)), this, SLOT(selectionChanged()));
     connect(startAliasAction, SIGNAL(triggered()), this, SLOT(on_startButton_clicked()));
 
     timer = new QTimer(this);
@@ -76,8 +90,8 @@ void MasternodeList::setWalletModel(WalletModel* model)
 
 void MasternodeList::showContextMenu(const QPoint& point)
 {
-    QTableWidgetItem* item = ui->tableWidgetMyMasternodes->itemAt(point);
-    if (item) contextMenu->exec(QCursor::pos());
+    QModelIndex index = ui->tableViewMyMasternodes->indexAt(point);
+    if (index.isValid()) contextMenu->exec(QCursor::pos());
 }
 
 void MasternodeList::StartAlias(std::string strAlias)
@@ -117,29 +131,39 @@ void MasternodeList::StartAll(std::string strCommand)
     int nCountFailed = 0;
     std::string strFailedHtml;
 
-    BOOST_FOREACH (CMasternodeConfig::CMasternodeEntry mne, masternodeConfig.getEntries()) {
-        std::string strError;
-        CMasternodeBroadcast mnb;
+    // The collaterals are found with one pass over the wallet for all the
+    // entries, and the broadcasts are announced together at the end
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        MasternodeCollateralMap mapCollaterals;
+        pwalletMain->GetMasternodeCollaterals(mapCollaterals);
+        std::vector<CInv> vInvRelay;
+
+        BOOST_FOREACH (CMasternodeConfig::CMasternodeEntry mne, masternodeConfig.getEntries()) {
+            std::string strError;
+            CMasternodeBroadcast mnb;
 
-        int nIndex;
-        if(!mne.castOutputIndex(nIndex))
-            continue;
+            int nIndex;
+            if(!mne.castOutputIndex(nIndex))
+                continue;
 
-        CTxIn txin = CTxIn(uint256S(mne.getTxHash()), uint32_t(nIndex));
-        CMasternode* pmn = mnodeman.Find(txin);
+            CTxIn txin = CTxIn(uint256S(mne.getTxHash()), uint32_t(nIndex));
+            CMasternode* pmn = mnodeman.Find(txin);
 
-        if (strCommand == "start-missing" && pmn) continue;
+            if (strCommand == "start-missing" && pmn) continue;
 
-        bool fSuccess = CMasternodeBroadcast::Create(mne.getIp(), mne.getPrivKey(), mne.getTxHash(), mne.getOutputIndex(), strError, mnb);
+            bool fSuccess = CMasternodeBroadcast::Create(mne.getIp(), mne.getPrivKey(), mne.getTxHash(), mne.getOutputIndex(), strError, mnb, false, &mapCollaterals);
 
-        if (fSuccess) {
-            nCountSuccessful++;
-            mnodeman.UpdateMasternodeList(mnb);
-            mnb.Relay();
-        } else {
-            nCountFailed++;
-            strFailedHtml += "\nFailed to start " + mne.getAlias() + ". Error: " + strError;
+            if (fSuccess) {
+                nCountSuccessful++;
+                mnodeman.UpdateMasternodeList(mnb);
+                vInvRelay.push_back(CInv(MSG_MASTERNODE_ANNOUNCE, mnb.GetHash()));
+            } else {
+                nCountFailed++;
+                strFailedHtml += "\nFailed to start " + mne.getAlias() + ". Error: " + strError;
+            }
         }
+        RelayInvs(vInvRelay);
     }
     pwalletMain->Lock();
 
@@ -156,65 +180,19 @@ void MasternodeList::StartAll(std::string strCommand)
     updateMyNodeList(true);
 }
 
-void MasternodeList::updateMyMasternodeInfo(QString strAlias, QString strAddr, CMasternode* pmn)
-{
-    LOCK(cs_mnlistupdate);
-    bool fOldRowFound = false;
-    int nNewRow = 0;
-
-    for (int i = 0; i < ui->tableWidgetMyMasternodes->rowCount(); i++) {
-        if (ui->tableWidgetMyMasternodes->item(i, 0)->text() == strAlias) {
-            fOldRowFound = true;
-            nNewRow = i;
-            break;
-        }
-    }
-
-    if (nNewRow == 0 && !fOldRowFound) {
-        nNewRow = ui->tableWidgetMyMasternodes->rowCount();
-        ui->tableWidgetMyMasternodes->insertRow(nNewRow);
-    }
-
-    QTableWidgetItem* aliasItem = new QTableWidgetItem(strAlias);
-    QTableWidgetItem* addrItem = new QTableWidgetItem(pmn ? QString::fromStdString(pmn->addr.ToString()) : strAddr);
-    QTableWidgetItem* protocolItem = new QTableWidgetItem(QString::number(pmn ? pmn->protocolVersion : -1));
-    QTableWidgetItem* statusItem = new QTableWidgetItem(QString::fromStdString(pmn ? pmn->GetStatus() : "MISSING"));
-    GUIUtil::DHMSTableWidgetItem* activeSecondsItem = new GUIUtil::DHMSTableWidgetItem(pmn ? (pmn->lastPing.sigTime - pmn->sigTime) : 0);
-    QTableWidgetItem* lastSeenItem = new QTableWidgetItem(QString::fromStdString(DateTimeStrFormat("%Y-%m-%d %H:%M", pmn ? pmn->lastPing.sigTime : 0)));
-    QTableWidgetItem* pubkeyItem = new QTableWidgetItem(QString::fromStdString(pmn ? CBitcoinAddress(pmn->pubKeyCollateralAddress.GetID()).ToString() : ""));
-
-    ui->tableWidgetMyMasternodes->setItem(nNewRow, 0, aliasItem);
-    ui->tableWidgetMyMasternodes->setItem(nNewRow, 1, addrItem);
-    ui->tableWidgetMyMasternodes->setItem(nNewRow, 2, protocolItem);
-    ui->tableWidgetMyMasternodes->setItem(nNewRow, 3, statusItem);
-    ui->tableWidgetMyMasternodes->setItem(nNewRow, 4, activeSecondsItem);
-    ui->tableWidgetMyMasternodes->setItem(nNewRow, 5, lastSeenItem);
-    ui->tableWidgetMyMasternodes->setItem(nNewRow, 6, pubkeyItem);
-}
-
 void MasternodeList::updateMyNodeList(bool fForce)
 {
     static int64_t nTimeMyListUpdated = 0;
 
-    // automatically update my masternode list only once in MY_MASTERNODELIST_UPDATE_SECONDS seconds,
-    // this update still can be triggered manually at any time via button click
+    // the rows follow the changes the masternode list notifies, read them all again only
+    // once in MY_MASTERNODELIST_UPDATE_SECONDS seconds, or when the button is clicked
     int64_t nSecondsTillUpdate = nTimeMyListUpdated + MY_MASTERNODELIST_UPDATE_SECONDS - GetTime();
     ui->secondsLabel->setText(QString::number(nSecondsTillUpdate));
 
     if (nSecondsTillUpdate > 0 && !fForce) return;
     nTimeMyListUpdated = GetTime();
 
-    ui->tableWidgetMyMasternodes->setSortingEnabled(false);
-    BOOST_FOREACH (CMasternodeConfig::CMasternodeEntry mne, masternodeConfig.getEntries()) {
-        int nIndex;
-        if(!mne.castOutputIndex(nIndex))
-            continue;
-
-        CTxIn txin = CTxIn(uint256S(mne.getTxHash()), uint32_t(nIndex));
-        CMasternode* pmn = mnodeman.Find(txin);
-        updateMyMasternodeInfo(QString::fromStdString(mne.getAlias()), QString::fromStdString(mne.getIp()), pmn);
-    }
-    ui->tableWidgetMyMasternodes->setSortingEnabled(true);
+    model->refresh();
 
     // reset "timer"
     ui->secondsLabel->setText("0");
@@ -223,14 +201,12 @@ void MasternodeList::updateMyNodeList(bool fForce)
 void MasternodeList::on_startButton_clicked()
 {
     // Find selected node alias
-    QItemSelectionModel* selectionModel = ui->tableWidgetMyMasternodes->selectionModel();
-    QModelIndexList selected = selectionModel->selectedRows();
+    QItemSelectionModel* selectionModel = ui->tableViewMyMasternodes->selectionModel();
+    QModelIndexList selected = selectionModel->selectedRows(MasternodeTableModel::Alias);
 
     if (selected.count() == 0) return;
 
-    QModelIndex index = selected.at(0);
-    int nSelectedRow = index.row();
-    std::string strAlias = ui->tableWidgetMyMasternodes->item(nSelectedRow, 0)->text().toStdString();
+    std::string strAlias = selected.at(0).data().toString().toStdString();
 
     // Display message box
     QMessageBox::StandardButton retval = QMessageBox::question(this, tr("Confirm masternode start"),
@@ -309,9 +285,9 @@ void MasternodeList::on_startMissingButton_clicked()
     StartAll("start-missing");
 }
 
-void MasternodeList::on_tableWidgetMyMasternodes_itemSelectionChanged()
+void MasternodeList::selectionChanged()
 {
-    if (ui->tableWidgetMyMasternodes->selectedItems().count() > 0) {
+    if (ui->tableViewMyMasternodes->selectionModel()->hasSelection()) {
         ui->startButton->setEnabled(true);
     }
 }
@@ -20,10 +20,12 @@ class MasternodeList;
 }
 
 class ClientModel;
+class MasternodeTableModel;
 class WalletModel;
 
 QT_BEGIN_NAMESPACE
 class QModelIndex;
+class QSortFilterProxyModel;
 QT_END_NAMESPACE
 
 /** Masternode Manager page widget */
@@ -46,7 +48,6 @@ private:
     bool fFilterUpdated;
 
 public Q_SLOTS:
-    void updateMyMasternodeInfo(QString strAlias, QString strAddr, CMasternode* pmn);
     void updateMyNodeList(bool fForce = false);
 
 Q_SIGNALS:
@@ -56,7 +57,8 @@ private:
     Ui::MasternodeList* ui;
     ClientModel* clientModel;
     WalletModel* walletModel;
-    CCriticalSection cs_mnlistupdate;
+    MasternodeTableModel* model;
+    QSortFilterProxyModel* proxyModel;
     QString strCurrentFilter;
 
 private Q_SLOTS:
@@ -64,7 +66,7 @@ private Q_SLOTS:
     void on_startButton_clicked();
     void on_startAllButton_clicked();
     void on_startMissingButton_clicked();
-    void on_tableWidgetMyMasternodes_itemSelectionChanged();
+    void selectionChanged();
     void on_UpdateButton_clicked();
 };
 #endif // MASTERNODELIST_H
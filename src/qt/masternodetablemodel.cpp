@@ -0,0 +1,203 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternodetablemodel.h"
+
+#include "base58.h"
+#include "masternode.h"
+#include "masternodeconfig.h"
+#include "masternodeman.h"
+#include "ui_interface.h"
+#include "utiltime.h"
+
+#include <QDebug>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+bool MasternodeTableEntry::changedFrom(const MasternodeTableEntry& other) const
+{
+    return fListed != other.fListed || address != other.address || protocol != other.protocol ||
+           status != other.status || activeSeconds != other.activeSeconds || lastSeen != other.lastSeen ||
+           pubkey != other.pubkey;
+}
+
+MasternodeTableModel::MasternodeTableModel(QObject* parent) : QAbstractTableModel(parent)
+{
+    columns << tr("Alias") << tr("Address") << tr("Protocol") << tr("Status") << tr("Active") << tr("Last Seen (UTC)") << tr("Pubkey");
+
+    subscribeToCoreSignals();
+    refresh();
+}
+
+MasternodeTableModel::~MasternodeTableModel()
+{
+    unsubscribeFromCoreSignals();
+}
+
+int MasternodeTableModel::rowCount(const QModelIndex& parent) const
+{
+    Q_UNUSED(parent);
+    return entries.size();
+}
+
+int MasternodeTableModel::columnCount(const QModelIndex& parent) const
+{
+    Q_UNUSED(parent);
+    return columns.length();
+}
+
+QVariant MasternodeTableModel::data(const QModelIndex& index, int role) const
+{
+    if (!index.isValid() || index.row() >= entries.size())
+        return QVariant();
+    const MasternodeTableEntry& entry = entries[index.row()];
+
+    if (role == Qt::DisplayRole) {
+        switch (index.column()) {
+        case Alias:
+            return entry.alias;
+        case Address:
+            return entry.address;
+        case Protocol:
+            return QString::number(entry.protocol);
+        case Status:
+            return entry.status;
+        case Active:
+            return QString::fromStdString(DurationToDHMS(entry.activeSeconds));
+        case LastSeen:
+            return QString::fromStdString(DateTimeStrFormat("%Y-%m-%d %H:%M", entry.lastSeen));
+        case Pubkey:
+            return entry.pubkey;
+        }
+    } else if (role == SortRole) {
+        switch (index.column()) {
+        case Protocol:
+            return entry.protocol;
+        case Active:
+            return entry.activeSeconds;
+        case LastSeen:
+            return entry.lastSeen;
+        default:
+            return data(index, Qt::DisplayRole);
+        }
+    }
+    return QVariant();
+}
+
+QVariant MasternodeTableModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if (orientation == Qt::Horizontal && role == Qt::DisplayRole && section < columns.size())
+        return columns[section];
+    return QVariant();
+}
+
+bool MasternodeTableModel::isWatched(const COutPoint& outpoint)
+{
+    LOCK(cs_watched);
+    return setWatched.count(outpoint) > 0;
+}
+
+void MasternodeTableModel::readEntry(MasternodeTableEntry& entry) const
+{
+    CMasternode mn;
+    entry.fListed = mnodeman.Get(CTxIn(entry.outpoint), mn);
+    if (entry.fListed) {
+        entry.address = QString::fromStdString(mn.addr.ToString());
+        entry.protocol = mn.protocolVersion;
+        entry.status = QString::fromStdString(mn.GetStatus());
+        entry.activeSeconds = mn.lastPing.sigTime - mn.sigTime;
+        entry.lastSeen = mn.lastPing.sigTime;
+        entry.pubkey = QString::fromStdString(CBitcoinAddress(mn.pubKeyCollateralAddress.GetID()).ToString());
+    } else {
+        entry.address = entry.confAddress;
+        entry.protocol = -1;
+        entry.status = "MISSING";
+        entry.activeSeconds = 0;
+        entry.lastSeen = 0;
+        entry.pubkey = QString();
+    }
+}
+
+void MasternodeTableModel::updateRow(int row)
+{
+    MasternodeTableEntry entry = entries[row];
+    readEntry(entry);
+    if (!entry.changedFrom(entries[row]))
+        return;
+    entries[row] = entry;
+    emit dataChanged(index(row, 0), index(row, columns.length() - 1));
+}
+
+void MasternodeTableModel::refresh()
+{
+    QList<MasternodeTableEntry> newEntries;
+    BOOST_FOREACH (CMasternodeConfig::CMasternodeEntry mne, masternodeConfig.getEntries()) {
+        int nIndex;
+        if (!mne.castOutputIndex(nIndex))
+            continue;
+
+        MasternodeTableEntry entry;
+        entry.alias = QString::fromStdString(mne.getAlias());
+        entry.confAddress = QString::fromStdString(mne.getIp());
+        entry.outpoint = COutPoint(uint256S(mne.getTxHash()), uint32_t(nIndex));
+        newEntries.append(entry);
+    }
+
+    bool fSameRows = newEntries.size() == entries.size();
+    for (int i = 0; i < newEntries.size() && fSameRows; i++)
+        fSameRows = newEntries[i].alias == entries[i].alias && newEntries[i].outpoint == entries[i].outpoint;
+    if (fSameRows) {
+        for (int i = 0; i < entries.size(); i++)
+            updateRow(i);
+        return;
+    }
+
+    beginResetModel();
+    entries.clear();
+    mapRows.clear();
+    std::set<COutPoint> setNewWatched;
+    for (int i = 0; i < newEntries.size(); i++) {
+        readEntry(newEntries[i]);
+        entries.append(newEntries[i]);
+        mapRows[newEntries[i].outpoint] = i;
+        setNewWatched.insert(newEntries[i].outpoint);
+    }
+    {
+        LOCK(cs_watched);
+        setWatched.swap(setNewWatched);
+    }
+    endResetModel();
+}
+
+void MasternodeTableModel::updateMasternode(const QString& hash, int n, int status)
+{
+    std::map<COutPoint, int>::const_iterator it = mapRows.find(COutPoint(uint256S(hash.toStdString()), uint32_t(n)));
+    if (it == mapRows.end())
+        return;
+    qDebug() << "MasternodeTableModel::updateMasternode : " + hash + "-" + QString::number(n) + " status=" + QString::number(status);
+    updateRow(it->second);
+}
+
+// Handlers for core signals
+static void NotifyMasternodeChanged(MasternodeTableModel* model, const COutPoint& outpoint, ChangeType status)
+{
+    // Called for every masternode of the network, with the list locked
+    if (!model->isWatched(outpoint))
+        return;
+    QMetaObject::invokeMethod(model, "updateMasternode", Qt::QueuedConnection,
+        Q_ARG(QString, QString::fromStdString(outpoint.hash.GetHex())),
+        Q_ARG(int, outpoint.n),
+        Q_ARG(int, status));
+}
+
+void MasternodeTableModel::subscribeToCoreSignals()
+{
+    uiInterface.NotifyMasternodeChanged.connect(boost::bind(NotifyMasternodeChanged, this, _1, _2));
+}
+
+void MasternodeTableModel::unsubscribeFromCoreSignals()
+{
+    uiInterface.NotifyMasternodeChanged.disconnect(boost::bind(NotifyMasternodeChanged, this, _1, _2));
+}
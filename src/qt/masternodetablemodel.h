@@ -0,0 +1,99 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_QT_MASTERNODETABLEMODEL_H
+#define BITCOIN_QT_MASTERNODETABLEMODEL_H
+
+#include "primitives/transaction.h"
+#include "sync.h"
+
+#include <map>
+#include <set>
+
+#include <QAbstractTableModel>
+#include <QList>
+#include <QStringList>
+
+/** A masternode of masternode.conf, as the table shows it */
+struct MasternodeTableEntry {
+    QString alias;
+    //! Address in masternode.conf, shown while the masternode is not listed
+    QString confAddress;
+    COutPoint outpoint;
+
+    bool fListed;
+    QString address;
+    int protocol;
+    QString status;
+    qint64 activeSeconds;
+    qint64 lastSeen;
+    QString pubkey;
+
+    MasternodeTableEntry() : fListed(false), protocol(-1), activeSeconds(0), lastSeen(0) {}
+
+    /** Whether the shown state of the two differs */
+    bool changedFrom(const MasternodeTableEntry& other) const;
+};
+
+/**
+   Qt model of the masternodes in masternode.conf and their state in the
+   masternode list. A row is read again when the list notifies a change to
+   its masternode, and only the rows that changed are emitted.
+ */
+class MasternodeTableModel : public QAbstractTableModel
+{
+    Q_OBJECT
+
+public:
+    explicit MasternodeTableModel(QObject* parent = 0);
+    ~MasternodeTableModel();
+
+    enum ColumnIndex {
+        Alias = 0,
+        Address = 1,
+        Protocol = 2,
+        Status = 3,
+        Active = 4,
+        LastSeen = 5,
+        Pubkey = 6
+    };
+
+    enum RoleIndex {
+        /** Value to sort a column by, numbers for the numeric ones */
+        SortRole = Qt::UserRole
+    };
+
+    /** @name Methods overridden from QAbstractTableModel
+        @{*/
+    int rowCount(const QModelIndex& parent) const;
+    int columnCount(const QModelIndex& parent) const;
+    QVariant data(const QModelIndex& index, int role) const;
+    QVariant headerData(int section, Qt::Orientation orientation, int role) const;
+    /*@}*/
+
+    /** Whether outpoint is the collateral of one of the rows, called from the core threads */
+    bool isWatched(const COutPoint& outpoint);
+
+public slots:
+    /** Read the rows again, from masternode.conf if its masternodes changed */
+    void refresh();
+    /** The masternode of the collateral hash:n changed in the list */
+    void updateMasternode(const QString& hash, int n, int status);
+
+private:
+    QStringList columns;
+    QList<MasternodeTableEntry> entries;
+    std::map<COutPoint, int> mapRows;
+
+    CCriticalSection cs_watched;
+    std::set<COutPoint> setWatched;
+
+    void readEntry(MasternodeTableEntry& entry) const;
+    void updateRow(int row);
+
+    void subscribeToCoreSignals();
+    void unsubscribeFromCoreSignals();
+};
+
+#endif // BITCOIN_QT_MASTERNODETABLEMODEL_H
@@ -243,7 +243,7 @@ bool MultisigDialog::addMultisig(int m, vector<string> keys){
             throw runtime_error(error.data());
         }
 
-        if (::IsMine(*pwalletMain, redeem) == ISMINE_SPENDABLE){
+        if (pwalletMain->IsMine(redeem) == ISMINE_SPENDABLE){
             throw runtime_error("The wallet already contains this script");
         }
 
@@ -191,9 +191,14 @@ void OverviewPage::setBalance(const CAmount& balance, const CAmount& unconfirmed
     ui->labelWatchImmature->setVisible(showWatchOnlyImmature); // show watch-only immature balance
 
     static int cachedTxLocks = 0;
+    int nTxLocks;
+    {
+        LOCK(cs_swifttx);
+        nTxLocks = nCompleteTXLocks;
+    }
 
-    if (cachedTxLocks != nCompleteTXLocks) {
-        cachedTxLocks = nCompleteTXLocks;
+    if (cachedTxLocks != nTxLocks) {
+        cachedTxLocks = nTxLocks;
         ui->listTransactions->update();
     }
 }
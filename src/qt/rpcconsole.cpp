@@ -763,6 +763,27 @@ QString RPCConsole::FormatBytes(quint64 bytes)
     return QString(tr("%1 GB")).arg(bytes / 1024 / 1024 / 1024);
 }
 
+QString RPCConsole::FormatMsgStats(const mapMsgCmdStats& mapStats)
+{
+    static const size_t MAX_COMMANDS_SHOWN = 8;
+
+    std::vector<std::pair<uint64_t, std::string> > vCommands;
+    for (mapMsgCmdStats::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+        vCommands.push_back(std::make_pair(it->second.nBytesSent + it->second.nBytesRecv, it->first));
+    std::sort(vCommands.rbegin(), vCommands.rend());
+    if (vCommands.size() > MAX_COMMANDS_SHOWN)
+        vCommands.resize(MAX_COMMANDS_SHOWN);
+
+    QStringList lines;
+    for (size_t i = 0; i < vCommands.size(); i++) {
+        const CNetMsgStats& stats = mapStats.find(vCommands[i].second)->second;
+        lines << tr("%1: %2 sent (%3), %4 received (%5), %6 ms").arg(QString::fromStdString(vCommands[i].second)).arg(stats.nMsgsSent).arg(FormatBytes(stats.nBytesSent)).arg(stats.nMsgsRecv).arg(FormatBytes(stats.nBytesRecv)).arg(stats.nProcessTime / 1000);
+    }
+    if (lines.isEmpty())
+        return tr("None");
+    return lines.join("\n");
+}
+
 void RPCConsole::setTrafficGraphRange(int mins)
 {
     ui->trafficGraph->setGraphRangeMins(mins);
@@ -892,6 +913,7 @@ void RPCConsole::updateNodeDetail(const CNodeCombinedStats* stats)
     ui->peerLastRecv->setText(stats->nodeStats.nLastRecv ? GUIUtil::formatDurationStr(GetTime() - stats->nodeStats.nLastRecv) : tr("never"));
     ui->peerBytesSent->setText(FormatBytes(stats->nodeStats.nSendBytes));
     ui->peerBytesRecv->setText(FormatBytes(stats->nodeStats.nRecvBytes));
+    ui->peerMsgStats->setText(FormatMsgStats(stats->nodeStats.mapMsgStats));
     ui->peerConnTime->setText(GUIUtil::formatDurationStr(GetTime() - stats->nodeStats.nTimeConnected));
     ui->peerPingTime->setText(GUIUtil::formatPingTime(stats->nodeStats.dPingTime));
     ui->peerPingWait->setText(GUIUtil::formatPingTime(stats->nodeStats.dPingWait));
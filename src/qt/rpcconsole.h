@@ -129,6 +129,8 @@ signals:
 
 private:
     static QString FormatBytes(quint64 bytes);
+    /** The message commands with the most traffic, one per line */
+    static QString FormatMsgStats(const mapMsgCmdStats& mapStats);
     void startExecutor();
     void setTrafficGraphRange(int mins);
     /** Build parameter list for restart */
@@ -23,6 +23,11 @@
 #include <QDebug>
 #include <QIcon>
 #include <QList>
+#include <QThread>
+
+#include <atomic>
+
+Q_DECLARE_METATYPE(QList<TransactionRecord>)
 
 // Amount column is right-aligned it contains numbers
 static int column_alignments[] = {
@@ -50,12 +55,61 @@ struct TxLessThan {
     }
 };
 
+/* Object for decomposing the wallet into records in a separate thread. It
+ * goes through the wallet in the order of the hashes and a batch at a time,
+ * so the locks are held briefly and the list fills while it is shown.
+ */
+class TransactionTableLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit TransactionTableLoader(CWallet* wallet) : wallet(wallet), fInterrupted(false) {}
+
+    void interrupt() { fInterrupted = true; }
+
+public slots:
+    void load();
+
+signals:
+    void recordsLoaded(const QList<TransactionRecord>& records, const QString& bound, bool fDone);
+
+private:
+    CWallet* wallet;
+    std::atomic<bool> fInterrupted;
+};
+
+#include "transactiontablemodel.moc"
+
+void TransactionTableLoader::load()
+{
+    uint256 hashNext;
+    bool fDone = false;
+    while (!fDone && !fInterrupted) {
+        QList<TransactionRecord> records;
+        LOCK2(cs_main, wallet->cs_wallet);
+        std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.lower_bound(hashNext);
+        for (int n = 0; n < TRANSACTION_LOAD_BATCH && it != wallet->mapWallet.end(); ++n, ++it) {
+            if (TransactionRecord::showTransaction(it->second))
+                records.append(TransactionRecord::decomposeTransaction(wallet, it->second));
+        }
+        fDone = (it == wallet->mapWallet.end());
+        if (!fDone)
+            hashNext = it->first;
+        // Emitted under the wallet lock, so the notification of a change to the
+        // wallet reaches the model before this batch if the batch has the
+        // change, and after it otherwise
+        emit recordsLoaded(records, QString::fromStdString(hashNext.GetHex()), fDone);
+    }
+}
+
 // Private implementation
 class TransactionTablePriv
 {
 public:
     TransactionTablePriv(CWallet* wallet, TransactionTableModel* parent) : wallet(wallet),
-                                                                           parent(parent)
+                                                                           parent(parent),
+                                                                           fLoaded(false)
     {
     }
 
@@ -68,19 +122,30 @@ public:
      */
     QList<TransactionRecord> cachedWallet;
 
-    /* Query entire wallet anew from core.
+    /* Until the loader is done, cachedWallet only has the wallet transactions
+     * with hashes below hashLoadedTo, the others come with its next batches.
+     */
+    bool fLoaded;
+    uint256 hashLoadedTo;
+
+    /* Append a batch from the loader: the records of the wallet transactions
+       from the previous bound up to this one.
      */
-    void refreshWallet()
+    void appendRecords(const QList<TransactionRecord>& records, const QString& bound, bool fDone)
     {
-        qDebug() << "TransactionTablePriv::refreshWallet";
-        cachedWallet.clear();
-        {
-            LOCK2(cs_main, wallet->cs_wallet);
-            for (std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it) {
-                if (TransactionRecord::showTransaction(it->second))
-                    cachedWallet.append(TransactionRecord::decomposeTransaction(wallet, it->second));
-            }
+        if (!records.isEmpty()) {
+            // Loaded rather than new, no balloons for these
+            bool fProcessing = parent->fProcessingQueuedTransactions;
+            parent->fProcessingQueuedTransactions = true;
+            parent->beginInsertRows(QModelIndex(), cachedWallet.size(), cachedWallet.size() + records.size() - 1);
+            cachedWallet.append(records);
+            parent->endInsertRows();
+            parent->fProcessingQueuedTransactions = fProcessing;
         }
+        hashLoadedTo.SetHex(bound.toStdString());
+        fLoaded = fDone;
+        if (fDone)
+            qDebug() << "TransactionTablePriv::appendRecords : loaded " + QString::number(cachedWallet.size()) + " records";
     }
 
     /* Update our model of the wallet incrementally, to synchronize our model of the wallet
@@ -92,6 +157,10 @@ public:
     {
         qDebug() << "TransactionTablePriv::updateWallet : " + QString::fromStdString(hash.ToString()) + " " + QString::number(status);
 
+        // Not loaded yet, the loader reads its current state
+        if (!fLoaded && !(hash < hashLoadedTo))
+            return;
+
         // Find bounds of this transaction in model
         QList<TransactionRecord>::iterator lower = qLowerBound(
             cachedWallet.begin(), cachedWallet.end(), hash, TxLessThan());
@@ -152,8 +221,13 @@ public:
             parent->endRemoveRows();
             break;
         case CT_UPDATED:
-            // Miscellaneous updates -- nothing to do, status update will take care of this, and is only computed for
-            // visible transactions.
+            // Miscellaneous updates -- the status is recomputed when the rows are next looked at, and only for
+            // visible transactions. Have the views look again, updateConfirmations() may not for settled rows.
+            if (inModel) {
+                for (QList<TransactionRecord>::iterator it = lower; it != upper; ++it)
+                    it->status.cur_num_blocks = -1;
+                emit parent->dataChanged(parent->index(lowerIndex, 0), parent->index(upperIndex - 1, TransactionTableModel::Amount));
+            }
             break;
         }
     }
@@ -163,6 +237,15 @@ public:
         return cachedWallet.size();
     }
 
+    /* Whether the status of a row only changes in its number of confirmations
+       from now on, barring a reorg; the cached status is used, not updated.
+     */
+    bool isSettled(int idx)
+    {
+        const TransactionStatus& status = cachedWallet[idx].status;
+        return status.cur_num_blocks != -1 && status.status == TransactionStatus::Confirmed;
+    }
+
     TransactionRecord* index(int idx)
     {
         if (idx >= 0 && idx < cachedWallet.size()) {
@@ -208,22 +291,57 @@ TransactionTableModel::TransactionTableModel(CWallet* wallet, WalletModel* paren
                                                                                      wallet(wallet),
                                                                                      walletModel(parent),
                                                                                      priv(new TransactionTablePriv(wallet, this)),
-                                                                                     fProcessingQueuedTransactions(false)
+                                                                                     fProcessingQueuedTransactions(false),
+                                                                                     loader(0),
+                                                                                     loaderThread(0),
+                                                                                     pindexConfirmations(0)
 {
     columns << QString() << QString() << tr("Date") << tr("Type") << tr("Address") << BitcoinUnits::getAmountColumnTitle(walletModel->getOptionsModel()->getDisplayUnit());
-    priv->refreshWallet();
 
     connect(walletModel->getOptionsModel(), SIGNAL(displayUnitChanged(int)), this, SLOT(updateDisplayUnit()));
 
+    // Subscribe before loading, so no change to the wallet goes unnoticed
     subscribeToCoreSignals();
+    startLoader();
 }
 
 TransactionTableModel::~TransactionTableModel()
 {
     unsubscribeFromCoreSignals();
+    stopLoader();
     delete priv;
 }
 
+void TransactionTableModel::startLoader()
+{
+    qRegisterMetaType<QList<TransactionRecord> >("QList<TransactionRecord>");
+
+    loaderThread = new QThread(this);
+    loader = new TransactionTableLoader(wallet);
+    loader->moveToThread(loaderThread);
+
+    // Batches from the loader must go to this object
+    connect(loader, SIGNAL(recordsLoaded(QList<TransactionRecord>, QString, bool)), this, SLOT(appendLoadedRecords(QList<TransactionRecord>, QString, bool)));
+    connect(loaderThread, SIGNAL(started()), loader, SLOT(load()));
+    loaderThread->start();
+}
+
+void TransactionTableModel::stopLoader()
+{
+    loader->interrupt();
+    loaderThread->quit();
+    loaderThread->wait();
+    delete loader;
+    loader = 0;
+}
+
+void TransactionTableModel::appendLoadedRecords(const QList<TransactionRecord>& records, const QString& bound, bool fDone)
+{
+    priv->appendRecords(records, bound, fDone);
+    if (fDone)
+        loaderThread->quit();
+}
+
 /** Updates the column title to "Amount (DisplayUnit)" and emits headerDataChanged() signal for table headers to react. */
 void TransactionTableModel::updateAmountColumnTitle()
 {
@@ -243,10 +361,33 @@ void TransactionTableModel::updateConfirmations()
 {
     // Blocks came in since last poll.
     // Invalidate status (number of confirmations) and (possibly) description
-    //  for all rows. Qt is smart enough to only actually request the data for the
-    //  visible rows.
-    emit dataChanged(index(0, Status), index(priv->size() - 1, Status));
-    emit dataChanged(index(0, ToAddress), index(priv->size() - 1, ToAddress));
+    //  for the rows whose status can still change. Qt is smart enough to only
+    //  actually request the data for the visible rows, but the filter of a proxy
+    //  looks at every changed row. Settled rows only change in their number of
+    //  confirmations, which is recomputed whenever they are looked at, so they
+    //  are all invalidated only after a reorg.
+    bool fReorg;
+    {
+        LOCK(cs_main);
+        fReorg = pindexConfirmations && chainActive[pindexConfirmations->nHeight] != pindexConfirmations;
+        pindexConfirmations = chainActive.Tip();
+    }
+    if (fReorg) {
+        emit dataChanged(index(0, Status), index(priv->size() - 1, Status));
+        emit dataChanged(index(0, ToAddress), index(priv->size() - 1, ToAddress));
+        return;
+    }
+
+    int nFirst = -1;
+    for (int i = 0; i <= priv->size(); i++) {
+        bool fSettled = (i == priv->size() || priv->isSettled(i));
+        if (!fSettled && nFirst < 0) {
+            nFirst = i;
+        } else if (fSettled && nFirst >= 0) {
+            emit dataChanged(index(nFirst, Status), index(i - 1, ToAddress));
+            nFirst = -1;
+        }
+    }
 }
 
 int TransactionTableModel::rowCount(const QModelIndex& parent) const
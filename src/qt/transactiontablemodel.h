@@ -6,16 +6,23 @@
 #define BITCOIN_QT_TRANSACTIONTABLEMODEL_H
 
 #include "bitcoinunits.h"
+#include "transactionrecord.h"
 
 #include <QAbstractTableModel>
+#include <QList>
 #include <QStringList>
 
-class TransactionRecord;
+class TransactionTableLoader;
 class TransactionTablePriv;
 class WalletModel;
 
+class CBlockIndex;
 class CWallet;
 
+QT_BEGIN_NAMESPACE
+class QThread;
+QT_END_NAMESPACE
+
 /** UI model for the transaction table of a wallet.
  */
 class TransactionTableModel : public QAbstractTableModel
@@ -80,6 +87,14 @@ private:
     QStringList columns;
     TransactionTablePriv* priv;
     bool fProcessingQueuedTransactions;
+    /** Decomposes the wallet into records off the GUI thread */
+    TransactionTableLoader* loader;
+    QThread* loaderThread;
+    /** Tip at the last updateConfirmations, to tell a reorg from new blocks */
+    const CBlockIndex* pindexConfirmations;
+
+    void startLoader();
+    void stopLoader();
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
@@ -105,6 +120,8 @@ public slots:
     void updateAmountColumnTitle();
     /* Needed to update fProcessingQueuedTransactions through a QueuedConnection */
     void setProcessingQueuedTransactions(bool value) { fProcessingQueuedTransactions = value; }
+    /* Records of the wallet transactions up to (not including) bound, from the loader */
+    void appendLoadedRecords(const QList<TransactionRecord>& records, const QString& bound, bool fDone);
 
     friend class TransactionTablePriv;
 };
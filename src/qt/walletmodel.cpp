@@ -25,6 +25,8 @@
 #include <QSet>
 #include <QTimer>
 
+Q_DECLARE_METATYPE(CWalletBalanceShare)
+
 using namespace std;
 
 WalletModel::WalletModel(CWallet* wallet, OptionsModel* optionsModel, QObject* parent) : QObject(parent), wallet(wallet), optionsModel(optionsModel), addressTableModel(0),
@@ -32,22 +34,27 @@ WalletModel::WalletModel(CWallet* wallet, OptionsModel* optionsModel, QObject* p
                                                                                          recentRequestsTableModel(0),
                                                                                          cachedBalance(0), cachedUnconfirmedBalance(0), cachedImmatureBalance(0),
                                                                                          cachedEncryptionStatus(Unencrypted),
-                                                                                         cachedNumBlocks(0)
+                                                                                         fBalancesPending(false),
+                                                                                         fChainTipPending(false)
 {
+    qRegisterMetaType<CWalletBalanceShare>("CWalletBalanceShare");
+
     fHaveWatchOnly = wallet->HaveWatchOnly();
     fHaveMultiSig = wallet->HaveMultiSig();
-    fForceCheckBalanceChanged = false;
 
     addressTableModel = new AddressTableModel(wallet, this);
     transactionTableModel = new TransactionTableModel(wallet, this);
     recentRequestsTableModel = new RecentRequestsTableModel(wallet, this);
 
-    // This timer will be fired repeatedly to update the balance
-    pollTimer = new QTimer(this);
-    connect(pollTimer, SIGNAL(timeout()), this, SLOT(pollBalanceChanged()));
-    pollTimer->start(MODEL_UPDATE_DELAY);
+    // The balances are notified by the wallet when they change, this timer
+    // is started by the notifications to show them
+    updateTimer = new QTimer(this);
+    updateTimer->setSingleShot(true);
+    connect(updateTimer, SIGNAL(timeout()), this, SLOT(processPendingUpdates()));
 
     subscribeToCoreSignals();
+    // After subscribing, so that no change goes unnoticed
+    setBalances(wallet->GetBalances());
 }
 
 WalletModel::~WalletModel()
@@ -110,28 +117,42 @@ void WalletModel::updateStatus()
     }
 }
 
-void WalletModel::pollBalanceChanged()
+void WalletModel::scheduleUpdate()
 {
-    // Get required locks upfront. This avoids the GUI from getting stuck on
-    // periodical polls if the core is holding the locks for a longer time -
-    // for example, during a wallet rescan.
-    TRY_LOCK(cs_main, lockMain);
-    if (!lockMain)
-        return;
-    TRY_LOCK(wallet->cs_wallet, lockWallet);
-    if (!lockWallet)
-        return;
+    if (!updateTimer->isActive())
+        updateTimer->start(MODEL_UPDATE_DELAY);
+}
+
+void WalletModel::updateBalances(const CWalletBalanceShare& balances)
+{
+    notifiedBalances = balances;
+    fBalancesPending = true;
+    scheduleUpdate();
+}
 
-    if (fForceCheckBalanceChanged || chainActive.Height() != cachedNumBlocks || cachedTxLocks != nCompleteTXLocks) {
-        fForceCheckBalanceChanged = false;
+void WalletModel::updateChainTip()
+{
+    fChainTipPending = true;
+    scheduleUpdate();
+}
 
-        // Balance and number of transactions might have changed
-        cachedNumBlocks = chainActive.Height();
+void WalletModel::processPendingUpdates()
+{
+    if (fBalancesPending) {
+        fBalancesPending = false;
+        setBalances(notifiedBalances);
+    }
 
-        checkBalanceChanged();
-        if (transactionTableModel) {
-            transactionTableModel->updateConfirmations();
+    if (fChainTipPending && transactionTableModel) {
+        // Get the lock upfront. This avoids the GUI from getting stuck if the core
+        // is holding it for a longer time - for example, during a wallet rescan.
+        TRY_LOCK(cs_main, lockMain);
+        if (!lockMain) {
+            scheduleUpdate();
+            return;
         }
+        fChainTipPending = false;
+        transactionTableModel->updateConfirmations();
     }
 }
 
@@ -147,16 +168,23 @@ void WalletModel::checkBalanceChanged()
     TRY_LOCK(cs_main, lockMain);
     if (!lockMain) return;
 
-    CAmount newBalance = getBalance();
-    CAmount newUnconfirmedBalance = getUnconfirmedBalance();
-    CAmount newImmatureBalance = getImmatureBalance();
+    setBalances(wallet->GetBalances());
+}
+
+void WalletModel::setBalances(const CWalletBalanceShare& balances)
+{
+    notifiedBalances = balances;
+
+    CAmount newBalance = balances.n[BALANCE_TRUSTED];
+    CAmount newUnconfirmedBalance = balances.n[BALANCE_UNCONFIRMED];
+    CAmount newImmatureBalance = balances.n[BALANCE_IMMATURE];
     CAmount newWatchOnlyBalance = 0;
     CAmount newWatchUnconfBalance = 0;
     CAmount newWatchImmatureBalance = 0;
     if (haveWatchOnly()) {
-        newWatchOnlyBalance = getWatchBalance();
-        newWatchUnconfBalance = getWatchUnconfirmedBalance();
-        newWatchImmatureBalance = getWatchImmatureBalance();
+        newWatchOnlyBalance = balances.n[BALANCE_WATCH_TRUSTED];
+        newWatchUnconfBalance = balances.n[BALANCE_WATCH_UNCONFIRMED];
+        newWatchImmatureBalance = balances.n[BALANCE_WATCH_IMMATURE];
     }
 
     if (cachedBalance != newBalance || cachedUnconfirmedBalance != newUnconfirmedBalance || cachedImmatureBalance != newImmatureBalance ||
@@ -164,7 +192,6 @@ void WalletModel::checkBalanceChanged()
         cachedBalance = newBalance;
         cachedUnconfirmedBalance = newUnconfirmedBalance;
         cachedImmatureBalance = newImmatureBalance;
-        cachedTxLocks = nCompleteTXLocks;
         cachedWatchOnlyBalance = newWatchOnlyBalance;
         cachedWatchUnconfBalance = newWatchUnconfBalance;
         cachedWatchImmatureBalance = newWatchImmatureBalance;
@@ -172,11 +199,6 @@ void WalletModel::checkBalanceChanged()
     }
 }
 
-void WalletModel::updateTransaction()
-{
-    // Balance and number of transactions might have changed
-    fForceCheckBalanceChanged = true;
-}
 
 void WalletModel::updateAddressBook(const QString& address, const QString& label, bool isMine, const QString& purpose, int status)
 {
@@ -188,6 +210,9 @@ void WalletModel::updateWatchOnlyFlag(bool fHaveWatchonly)
 {
     fHaveWatchOnly = fHaveWatchonly;
     emit notifyWatchonlyChanged(fHaveWatchonly);
+    // The watch-only balances are shown from now on
+    fBalancesPending = true;
+    scheduleUpdate();
 }
 
 void WalletModel::updateMultiSigFlag(bool fHaveMultiSig)
@@ -357,7 +382,7 @@ WalletModel::SendCoinsReturn WalletModel::sendCoins(WalletModelTransaction& tran
         }
         emit coinsSent(wallet, rcp, transaction_array);
     }
-    checkBalanceChanged(); // update balance immediately, otherwise there could be a short noticeable delay until pollBalanceChanged hits
+    checkBalanceChanged(); // update balance immediately, otherwise there could be a short noticeable delay until the notification is shown
 
     return SendCoinsReturn(OK);
 }
@@ -476,22 +501,15 @@ static void NotifyAddressBookChanged(WalletModel* walletmodel, CWallet* wallet,
         Q_ARG(int, status));
 }
 
-// queue notifications to show a non freezing progress dialog e.g. for rescan
-static bool fQueueNotifications = false;
-static std::vector<std::pair<uint256, ChangeType> > vQueueNotifications;
-static void NotifyTransactionChanged(WalletModel* walletmodel, CWallet* wallet, const uint256& hash, ChangeType status)
+static void NotifyBalanceChanged(WalletModel* walletmodel, const CWalletBalanceShare& balances)
 {
-    if (fQueueNotifications) {
-        vQueueNotifications.push_back(make_pair(hash, status));
-        return;
-    }
-
-    QString strHash = QString::fromStdString(hash.GetHex());
+    QMetaObject::invokeMethod(walletmodel, "updateBalances", Qt::QueuedConnection,
+        Q_ARG(CWalletBalanceShare, balances));
+}
 
-    qDebug() << "NotifyTransactionChanged : " + strHash + " status= " + QString::number(status);
-    QMetaObject::invokeMethod(walletmodel, "updateTransaction", Qt::QueuedConnection /*,
-                              Q_ARG(QString, strHash),
-                              Q_ARG(int, status)*/);
+static void NotifyBlockTip(WalletModel* walletmodel, const uint256& hash)
+{
+    QMetaObject::invokeMethod(walletmodel, "updateChainTip", Qt::QueuedConnection);
 }
 
 static void ShowProgress(WalletModel* walletmodel, const std::string& title, int nProgress)
@@ -519,10 +537,11 @@ void WalletModel::subscribeToCoreSignals()
     // Connect signals to wallet
     wallet->NotifyStatusChanged.connect(boost::bind(&NotifyKeyStoreStatusChanged, this, _1));
     wallet->NotifyAddressBookChanged.connect(boost::bind(NotifyAddressBookChanged, this, _1, _2, _3, _4, _5, _6));
-    wallet->NotifyTransactionChanged.connect(boost::bind(NotifyTransactionChanged, this, _1, _2, _3));
+    wallet->NotifyBalanceChanged.connect(boost::bind(NotifyBalanceChanged, this, _1));
     wallet->ShowProgress.connect(boost::bind(ShowProgress, this, _1, _2));
     wallet->NotifyWatchonlyChanged.connect(boost::bind(NotifyWatchonlyChanged, this, _1));
     wallet->NotifyMultiSigChanged.connect(boost::bind(NotifyMultiSigChanged, this, _1));
+    uiInterface.NotifyBlockTip.connect(boost::bind(NotifyBlockTip, this, _1));
 }
 
 void WalletModel::unsubscribeFromCoreSignals()
@@ -530,10 +549,11 @@ void WalletModel::unsubscribeFromCoreSignals()
     // Disconnect signals from wallet
     wallet->NotifyStatusChanged.disconnect(boost::bind(&NotifyKeyStoreStatusChanged, this, _1));
     wallet->NotifyAddressBookChanged.disconnect(boost::bind(NotifyAddressBookChanged, this, _1, _2, _3, _4, _5, _6));
-    wallet->NotifyTransactionChanged.disconnect(boost::bind(NotifyTransactionChanged, this, _1, _2, _3));
+    wallet->NotifyBalanceChanged.disconnect(boost::bind(NotifyBalanceChanged, this, _1));
     wallet->ShowProgress.disconnect(boost::bind(ShowProgress, this, _1, _2));
     wallet->NotifyWatchonlyChanged.disconnect(boost::bind(NotifyWatchonlyChanged, this, _1));
     wallet->NotifyMultiSigChanged.disconnect(boost::bind(NotifyMultiSigChanged, this, _1));
+    uiInterface.NotifyBlockTip.disconnect(boost::bind(NotifyBlockTip, this, _1));
 }
 
 // WalletModel::UnlockContext implementation
@@ -655,6 +675,12 @@ void WalletModel::listLockedCoins(std::vector<COutPoint>& vOutpts)
     wallet->ListLockedCoins(vOutpts);
 }
 
+void WalletModel::abortRescan()
+{
+    // No locks, the rescan holds them while it runs
+    wallet->AbortRescan();
+}
+
 void WalletModel::loadReceiveRequests(std::vector<std::string>& vReceiveRequests)
 {
     LOCK(wallet->cs_wallet);
@@ -681,5 +707,5 @@ bool WalletModel::saveReceiveRequest(const std::string& sAddress, const int64_t
 
 bool WalletModel::isMine(CBitcoinAddress address)
 {
-    return IsMine(*wallet, address.Get());
+    return wallet->IsMine(address.Get());
 }
@@ -206,6 +206,8 @@ public:
     void lockCoin(COutPoint& output);
     void unlockCoin(COutPoint& output);
     void listLockedCoins(std::vector<COutPoint>& vOutpts);
+    //! Stop a running rescan of the wallet
+    void abortRescan();
 
     void loadReceiveRequests(std::vector<std::string>& vReceiveRequests);
     bool saveReceiveRequest(const std::string& sAddress, const int64_t nId, const std::string& sRequest);
@@ -214,7 +216,6 @@ private:
     CWallet* wallet;
     bool fHaveWatchOnly;
     bool fHaveMultiSig;
-    bool fForceCheckBalanceChanged;
 
     // Wallet has an options model for wallet-specific options
     // (transaction fee, for example)
@@ -232,13 +233,20 @@ private:
     CAmount cachedWatchUnconfBalance;
     CAmount cachedWatchImmatureBalance;
     EncryptionStatus cachedEncryptionStatus;
-    int cachedNumBlocks;
-    int cachedTxLocks;
 
-    QTimer* pollTimer;
+    // Balance totals of the last NotifyBalanceChanged, and whether they or a
+    // new tip are still to be shown
+    CWalletBalanceShare notifiedBalances;
+    bool fBalancesPending;
+    bool fChainTipPending;
+
+    // Coalesces the notifications to one update per MODEL_UPDATE_DELAY
+    QTimer* updateTimer;
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
+    void scheduleUpdate();
+    void setBalances(const CWalletBalanceShare& balances);
     Q_INVOKABLE void checkBalanceChanged();
 
 signals:
@@ -271,16 +279,18 @@ signals:
 public slots:
     /* Wallet status might have changed */
     void updateStatus();
-    /* New transaction, or transaction changed status */
-    void updateTransaction();
+    /* Balance totals of the wallet changed */
+    void updateBalances(const CWalletBalanceShare& balances);
+    /* New tip, confirmations changed */
+    void updateChainTip();
     /* New, updated or removed address book entry */
     void updateAddressBook(const QString& address, const QString& label, bool isMine, const QString& purpose, int status);
     /* Watch-only added */
     void updateWatchOnlyFlag(bool fHaveWatchonly);
     /* MultiSig added */
     void updateMultiSigFlag(bool fHaveMultiSig);
-    /* Current, immature or unconfirmed balance might have changed - emit 'balanceChanged' if so */
-    void pollBalanceChanged();
+    /* Show the balances and confirmations notified since the last update */
+    void processPendingUpdates();
 };
 
 #endif // BITCOIN_QT_WALLETMODEL_H
@@ -408,7 +408,13 @@ void WalletView::showProgress(const QString& title, int nProgress)
         progressDialog = new QProgressDialog(title, "", 0, 100);
         progressDialog->setWindowModality(Qt::ApplicationModal);
         progressDialog->setMinimumDuration(0);
-        progressDialog->setCancelButton(0);
+        // Only a rescan can be stopped half way
+        if (title == QString::fromStdString(_("Rescanning..."))) {
+            progressDialog->setCancelButtonText(tr("Cancel"));
+            connect(progressDialog, SIGNAL(canceled()), this, SLOT(abortRescan()));
+        } else {
+            progressDialog->setCancelButton(0);
+        }
         progressDialog->setAutoClose(false);
         progressDialog->setValue(0);
     } else if (nProgress == 100) {
@@ -420,6 +426,12 @@ void WalletView::showProgress(const QString& title, int nProgress)
         progressDialog->setValue(nProgress);
 }
 
+void WalletView::abortRescan()
+{
+    if (walletModel)
+        walletModel->abortRescan();
+}
+
 /** Update wallet with the sum of the selected transactions */
 void WalletView::trxAmount(QString amount)
 {
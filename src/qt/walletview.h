@@ -126,6 +126,8 @@ public slots:
 
     /** Show progress dialog e.g. for rescan */
     void showProgress(const QString& title, int nProgress);
+    /** Stop the rescan the progress dialog shows */
+    void abortRescan();
 
     /** Update selected DTEM amount from transactionview */
     void trxAmount(QString amount);
@@ -14,6 +14,8 @@
 
 #include <limits>
 
+#include <boost/thread/tss.hpp>
+
 #ifndef WIN32
 #include <sys/time.h>
 #endif
@@ -117,6 +119,57 @@ uint256 GetRandHash()
     return hash;
 }
 
+FastRandomContext::FastRandomContext(bool fDeterministicIn) : fDeterministic(fDeterministicIn), bytebuf_size(0), nOutput(0)
+{
+    if (fDeterministic) {
+        unsigned char key[32] = {0};
+        rng.SetKey(key, sizeof(key));
+    } else {
+        RandomSeed();
+    }
+}
+
+void FastRandomContext::RandomSeed()
+{
+    unsigned char key[32];
+    GetRandBytes(key, sizeof(key));
+    rng.SetKey(key, sizeof(key));
+    OPENSSL_cleanse(key, sizeof(key));
+    nOutput = 0;
+}
+
+uint256 FastRandomContext::rand256()
+{
+    uint256 ret;
+    unsigned char* p = (unsigned char*)&ret;
+    for (unsigned int i = 0; i < sizeof(ret); i += 8)
+        WriteLE64(p + i, rand64());
+    return ret;
+}
+
+// thread_specific_ptr deletes the context when its thread ends
+static boost::thread_specific_ptr<FastRandomContext> fastRandomContext;
+
+FastRandomContext& GetFastRandomContext()
+{
+    FastRandomContext* ctx = fastRandomContext.get();
+    if (!ctx) {
+        ctx = new FastRandomContext();
+        fastRandomContext.reset(ctx);
+    }
+    return *ctx;
+}
+
+uint64_t GetInsecureRand(uint64_t nMax)
+{
+    return GetFastRandomContext().randrange(nMax);
+}
+
+int GetInsecureRandInt(int nMax)
+{
+    return GetInsecureRand(nMax);
+}
+
 uint32_t insecure_rand_Rz = 11;
 uint32_t insecure_rand_Rw = 11;
 void seed_insecure_rand(bool fDeterministic)
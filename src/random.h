@@ -6,8 +6,11 @@
 #ifndef BITCOIN_RANDOM_H
 #define BITCOIN_RANDOM_H
 
+#include "crypto/chacha20.h"
+#include "crypto/common.h"
 #include "uint256.h"
 
+#include <limits>
 #include <stdint.h>
 
 /**
@@ -24,6 +27,77 @@ uint64_t GetRand(uint64_t nMax);
 int GetRandInt(int nMax);
 uint256 GetRandHash();
 
+//! Output of a FastRandomContext after which it is keyed again from GetRandBytes
+static const uint64_t FAST_RAND_RESEED_BYTES = 1 << 20;
+
+/**
+ * Fast randomness for choices that must only be hard to guess from outside:
+ * peer and address selection, coin selection, cache eviction. ChaCha20 keyed
+ * from GetRandBytes and keyed again every FAST_RAND_RESEED_BYTES, without the
+ * lock of the OpenSSL RNG and a system call per number. Not thread safe, so
+ * each thread uses its own, see GetFastRandomContext. Keys, salts and nonces
+ * keep coming from GetRandBytes.
+ */
+class FastRandomContext
+{
+private:
+    bool fDeterministic;
+    ChaCha20 rng;
+    unsigned char bytebuf[64];
+    int bytebuf_size;
+    uint64_t nOutput;
+
+    void RandomSeed();
+
+    void FillByteBuffer()
+    {
+        if (!fDeterministic && nOutput >= FAST_RAND_RESEED_BYTES)
+            RandomSeed();
+        rng.Output(bytebuf, sizeof(bytebuf));
+        bytebuf_size = sizeof(bytebuf);
+        nOutput += sizeof(bytebuf);
+    }
+
+public:
+    //! A deterministic context always gives the same numbers, for tests
+    explicit FastRandomContext(bool fDeterministicIn = false);
+
+    uint64_t rand64()
+    {
+        if (bytebuf_size < 8)
+            FillByteBuffer();
+        uint64_t ret = ReadLE64(bytebuf + sizeof(bytebuf) - bytebuf_size);
+        bytebuf_size -= 8;
+        return ret;
+    }
+
+    uint32_t rand32() { return rand64() >> 32; }
+
+    bool randbool() { return rand64() & 1; }
+
+    //! A number in [0, nMax), without modulo bias
+    uint64_t randrange(uint64_t nMax)
+    {
+        if (nMax == 0)
+            return 0;
+        uint64_t nRange = (std::numeric_limits<uint64_t>::max() / nMax) * nMax;
+        uint64_t nRand;
+        do {
+            nRand = rand64();
+        } while (nRand >= nRange);
+        return nRand % nMax;
+    }
+
+    uint256 rand256();
+};
+
+/** The FastRandomContext of the calling thread, made on first use */
+FastRandomContext& GetFastRandomContext();
+
+/** GetRand and GetRandInt from the FastRandomContext of the thread, for non-cryptographic uses */
+uint64_t GetInsecureRand(uint64_t nMax);
+int GetInsecureRandInt(int nMax);
+
 /**
  * Seed insecure_rand using the random pool.
  * @param Deterministic Use a deterministic seed
@@ -4,6 +4,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chain.h"
+#include "hash.h"
+#include "httprpc.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "main.h"
@@ -15,14 +17,21 @@
 #include "utilstrencodings.h"
 #include "version.h"
 
+#include <list>
+#include <map>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/dynamic_bitset.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include <univalue.h>
 
 using namespace std;
 
-static const size_t MAX_GETUTXOS_OUTPOINTS = 15; //allow a max of 15 outpoints to be queried at once
+static const size_t MAX_GETUTXOS_OUTPOINTS = MAX_UTXO_BATCH_SIZE; //outpoints queried at once, looked up in one batch
+static const long MAX_REST_BLOCKRANGE_COUNT = 1000; //blocks asked for at once from /rest/blockrange
+static const size_t MAX_REST_BLOCKRANGE_SIZE = 64 * 1024 * 1024; //bytes of blocks after which a range reply is cut short
+static const size_t REST_HEADERRANGE_BATCH = 2000; //headers collected per hold of cs_main
 
 enum RetFormat {
     RF_UNDEF,
@@ -64,6 +73,138 @@ extern UniValue mempoolToJSON(bool fVerbose = false);
 extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 extern UniValue blockheaderToJSON(const CBlockIndex* blockindex);
 
+/**
+ * Encoded replies for blocks, transactions and headers, least recently used
+ * first out once they take more than -restcachesize.
+ *
+ * A reply built from data that never changes for its hash, like the binary
+ * form of a block, is stored with a null tip. Replies that mention the chain
+ * around them (confirmations, the next block, the headers that follow) are
+ * stored with the tip they were built against and are only served while it
+ * is still the tip, so they go stale on every new block and on reorgs.
+ */
+class CRESTCache
+{
+public:
+    struct CReply {
+        std::string strContentType;
+        std::string strBody;
+        std::string strETag;
+        uint256 hashTip;
+    };
+    typedef boost::shared_ptr<const CReply> ReplyRef;
+
+private:
+    typedef std::list<std::pair<std::string, ReplyRef> > LRUList;
+
+    CCriticalSection cs;
+    //! Most recently used first
+    LRUList listLRU;
+    std::map<std::string, LRUList::iterator> mapReplies;
+    size_t nSize;
+    size_t nMaxSize;
+
+    static size_t Usage(const std::string& strKey, const CReply& reply)
+    {
+        return strKey.size() * 2 + reply.strContentType.size() + reply.strBody.size() + reply.strETag.size() + sizeof(CReply) + 64;
+    }
+
+    void Erase(std::map<std::string, LRUList::iterator>::iterator it)
+    {
+        nSize -= Usage(it->first, *it->second->second);
+        listLRU.erase(it->second);
+        mapReplies.erase(it);
+    }
+
+public:
+    CRESTCache() : nSize(0), nMaxSize(0) {}
+
+    void SetMaxSize(size_t nMaxSizeIn)
+    {
+        LOCK(cs);
+        nMaxSize = nMaxSizeIn;
+        while (nSize > nMaxSize)
+            Erase(mapReplies.find(listLRU.back().first));
+    }
+
+    ReplyRef Get(const std::string& strKey, const uint256& hashTip)
+    {
+        LOCK(cs);
+        std::map<std::string, LRUList::iterator>::iterator it = mapReplies.find(strKey);
+        if (it == mapReplies.end())
+            return ReplyRef();
+        ReplyRef reply = it->second->second;
+        if (!reply->hashTip.IsNull() && reply->hashTip != hashTip) {
+            Erase(it);
+            return ReplyRef();
+        }
+        listLRU.splice(listLRU.begin(), listLRU, it->second);
+        return reply;
+    }
+
+    void Put(const std::string& strKey, const ReplyRef& reply)
+    {
+        LOCK(cs);
+        size_t nUsage = Usage(strKey, *reply);
+        if (nUsage > nMaxSize)
+            return;
+        std::map<std::string, LRUList::iterator>::iterator it = mapReplies.find(strKey);
+        if (it != mapReplies.end())
+            Erase(it);
+        while (nSize + nUsage > nMaxSize)
+            Erase(mapReplies.find(listLRU.back().first));
+        listLRU.push_front(std::make_pair(strKey, reply));
+        mapReplies[strKey] = listLRU.begin();
+        nSize += nUsage;
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        listLRU.clear();
+        mapReplies.clear();
+        nSize = 0;
+    }
+};
+
+static CRESTCache restCache;
+
+/** Answer from the cache, or with 304 if the client has the same reply. Returns false on a miss. */
+static bool WriteCachedReply(HTTPRequest* req, const std::string& strKey, const uint256& hashTip)
+{
+    CRESTCache::ReplyRef reply = restCache.Get(strKey, hashTip);
+    if (!reply)
+        return false;
+
+    req->WriteHeader("ETag", reply->strETag);
+    req->WriteHeader("Cache-Control", reply->hashTip.IsNull() ? "public, max-age=31536000, immutable" : "no-cache");
+    std::pair<bool, std::string> ifNoneMatch = req->GetHeader("If-None-Match");
+    if (ifNoneMatch.first && ifNoneMatch.second == reply->strETag) {
+        req->WriteReply(HTTP_NOT_MODIFIED);
+        return true;
+    }
+    req->WriteHeader("Content-Type", reply->strContentType);
+    req->WriteReply(HTTP_OK, reply->strBody);
+    return true;
+}
+
+/** Send a reply and keep it for the next request of strKey */
+static void WriteReplyToCache(HTTPRequest* req, const std::string& strKey, const uint256& hashTip, const std::string& strContentType, const std::string& strBody)
+{
+    CRESTCache::CReply* reply = new CRESTCache::CReply();
+    CRESTCache::ReplyRef ref(reply);
+    reply->strContentType = strContentType;
+    reply->strBody = strBody;
+    reply->strETag = "\"" + Hash(strBody.begin(), strBody.end()).GetHex() + "\"";
+    reply->hashTip = hashTip;
+    restCache.Put(strKey, ref);
+
+    req->WriteHeader("ETag", reply->strETag);
+    req->WriteHeader("Cache-Control", hashTip.IsNull() ? "public, max-age=31536000, immutable" : "no-cache");
+    req->WriteHeader("Content-Type", strContentType);
+    req->WriteReply(HTTP_OK, strBody);
+}
+
 static bool RESTERR(HTTPRequest* req, enum HTTPStatusCode status, string message)
 {
     req->WriteHeader("Content-Type", "text/plain");
@@ -71,6 +212,17 @@ static bool RESTERR(HTTPRequest* req, enum HTTPStatusCode status, string message
     return false;
 }
 
+/** Send a large JSON value without building its text in one string */
+static void WriteJSONReply(HTTPRequest* req, const UniValue& val)
+{
+    req->WriteHeader("Content-Type", "application/json");
+    HTTPReplySink sink(req);
+    val.write(sink);
+    sink.append("\n", 1);
+    sink.Flush();
+    req->WriteReply(HTTP_OK);
+}
+
 static enum RetFormat ParseDataFormat(vector<string>& params, const string& strReq)
 {
     boost::split(params, strReq, boost::is_any_of("."));
@@ -138,6 +290,12 @@ static bool rest_headers(HTTPRequest* req,
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
+    // Which headers follow hash depends on the active chain
+    uint256 hashTip = GetChainTipSnapshot().hashBlock;
+    string strKey = strprintf("headers/%d/%s.%d", count, hash.GetHex(), rf);
+    if (rf != RF_UNDEF && WriteCachedReply(req, strKey, hashTip))
+        return true;
+
     std::vector<const CBlockIndex *> headers;
     headers.reserve(count);
     {
@@ -159,16 +317,12 @@ static bool rest_headers(HTTPRequest* req,
 
     switch (rf) {
     case RF_BINARY: {
-        string binaryHeader = ssHeader.str();
-        req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryHeader);
+        WriteReplyToCache(req, strKey, hashTip, "application/octet-stream", ssHeader.str());
         return true;
     }
 
     case RF_HEX: {
-        string strHex = HexStr(ssHeader.begin(), ssHeader.end()) + "\n";
-        req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
+        WriteReplyToCache(req, strKey, hashTip, "text/plain", HexStr(ssHeader.begin(), ssHeader.end()) + "\n");
         return true;
     }
     case RF_JSON: {
@@ -176,9 +330,7 @@ static bool rest_headers(HTTPRequest* req,
         BOOST_FOREACH(const CBlockIndex *pindex, headers) {
             jsonHeaders.push_back(blockheaderToJSON(pindex));
         }
-        string strJSON = jsonHeaders.write() + "\n";
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        WriteReplyToCache(req, strKey, hashTip, "application/json", jsonHeaders.write() + "\n");
         return true;
     }
     default: {
@@ -204,6 +356,12 @@ static bool rest_block(HTTPRequest* req,
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
+    // The bytes of a block never change, its JSON has the confirmations and the next block
+    uint256 hashTip = rf == RF_JSON ? GetChainTipSnapshot().hashBlock : uint256();
+    string strKey = strprintf("block/%s.%d.%d", hash.GetHex(), rf, showTxDetails);
+    if (rf != RF_UNDEF && WriteCachedReply(req, strKey, hashTip))
+        return true;
+
     CBlock block;
     CBlockIndex* pblockindex = NULL;
     {
@@ -224,24 +382,18 @@ static bool rest_block(HTTPRequest* req,
 
     switch (rf) {
     case RF_BINARY: {
-        string binaryBlock = ssBlock.str();
-        req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryBlock);
+        WriteReplyToCache(req, strKey, hashTip, "application/octet-stream", ssBlock.str());
         return true;
     }
 
     case RF_HEX: {
-        string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
-        req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
+        WriteReplyToCache(req, strKey, hashTip, "text/plain", HexStr(ssBlock.begin(), ssBlock.end()) + "\n");
         return true;
     }
 
     case RF_JSON: {
         UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
-        string strJSON = objBlock.write() + "\n";
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        WriteReplyToCache(req, strKey, hashTip, "application/json", objBlock.write() + "\n");
         return true;
     }
 
@@ -264,6 +416,178 @@ static bool rest_block_notxdetails(HTTPRequest* req, const std::string& strURIPa
     return rest_block(req, strURIPart, false);
 }
 
+/** Parse <height>/<count> of a range request */
+static bool ParseRange(HTTPRequest* req, const string& strPath, const char* strUsage, int& nHeight, long& nCount)
+{
+    vector<string> path;
+    boost::split(path, strPath, boost::is_any_of("/"));
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, string("No range specified. Use ") + strUsage + ".");
+
+    if (!ParseInt32(path[0], &nHeight) || nHeight < 0)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid height: " + path[0]);
+    int nCountIn;
+    if (!ParseInt32(path[1], &nCountIn) || nCountIn < 1)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid count: " + path[1]);
+    nCount = nCountIn;
+    return true;
+}
+
+/** Send the serialized data of reply as binary or hex, written in chunks as it comes */
+class CRangeReply
+{
+private:
+    HTTPRequest* req;
+    RetFormat rf;
+    HTTPReplySink sink;
+    std::string strHex;
+
+public:
+    CRangeReply(HTTPRequest* reqIn, RetFormat rfIn) : req(reqIn), rf(rfIn), sink(reqIn)
+    {
+        req->WriteHeader("Content-Type", rf == RF_BINARY ? "application/octet-stream" : "text/plain");
+    }
+
+    void Write(const char* pch, size_t nSize)
+    {
+        if (rf == RF_BINARY) {
+            sink.append(pch, nSize);
+        } else {
+            strHex = HexStr(pch, pch + nSize);
+            sink.append(strHex.data(), strHex.size());
+        }
+    }
+
+    void Finish(size_t nItems, const char* strCountHeader)
+    {
+        if (rf == RF_HEX)
+            sink.append("\n", 1);
+        sink.Flush();
+        req->WriteHeader(strCountHeader, strprintf("%u", nItems));
+        req->WriteReply(HTTP_OK);
+    }
+};
+
+/**
+ * Blocks of the active chain from a height, concatenated as stored in the
+ * block files. A reply stops after MAX_REST_BLOCKRANGE_SIZE bytes of blocks,
+ * X-Block-Count tells how many it holds.
+ */
+static bool rest_blockrange(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    if (rf != RF_BINARY && rf != RF_HEX)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: .bin, .hex)");
+
+    int nHeight;
+    long nCount;
+    if (!ParseRange(req, params[0], "/rest/blockrange/<height>/<count>.<ext>", nHeight, nCount))
+        return false;
+    if (nCount > MAX_REST_BLOCKRANGE_COUNT)
+        return RESTERR(req, HTTP_BAD_REQUEST, strprintf("Block count out of range, at most %d", MAX_REST_BLOCKRANGE_COUNT));
+
+    std::vector<CDiskBlockPos> vPos;
+    {
+        LOCK(cs_main);
+        if (nHeight > chainActive.Height())
+            return RESTERR(req, HTTP_NOT_FOUND, strprintf("Height %d is beyond the tip", nHeight));
+        for (int h = nHeight; h <= chainActive.Height() && vPos.size() < (size_t)nCount; h++) {
+            const CBlockIndex* pindex = chainActive[h];
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                break;
+            vPos.push_back(pindex->GetBlockPos());
+        }
+    }
+    if (vPos.empty())
+        return RESTERR(req, HTTP_NOT_FOUND, strprintf("Block %d not available", nHeight));
+
+    // The block files are read in order, outside cs_main, and each block is
+    // handed to the reply buffer as soon as it is read
+    CRangeReply reply(req, rf);
+    std::vector<char> vchBlock;
+    size_t nBlocks = 0, nBytes = 0;
+    BOOST_FOREACH (const CDiskBlockPos& pos, vPos) {
+        if (nBytes >= MAX_REST_BLOCKRANGE_SIZE)
+            break;
+        if (!ReadRawBlockFromDisk(vchBlock, pos))
+            break;
+        reply.Write(&vchBlock[0], vchBlock.size());
+        nBytes += vchBlock.size();
+        nBlocks++;
+    }
+    reply.Finish(nBlocks, "X-Block-Count");
+    return true;
+}
+
+/**
+ * Headers of the active chain from a height. Unlike /rest/headers/ there is
+ * no cap on the count, the reply ends at the tip. X-Header-Count tells how
+ * many it holds.
+ */
+static bool rest_headerrange(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    if (rf != RF_BINARY && rf != RF_HEX)
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: .bin, .hex)");
+
+    int nHeight;
+    long nCount;
+    if (!ParseRange(req, params[0], "/rest/headerrange/<height>/<count>.<ext>", nHeight, nCount))
+        return false;
+
+    {
+        LOCK(cs_main);
+        if (nHeight > chainActive.Height())
+            return RESTERR(req, HTTP_NOT_FOUND, strprintf("Height %d is beyond the tip", nHeight));
+    }
+
+    CRangeReply reply(req, rf);
+    std::vector<CBlockHeader> vHeaders;
+    vHeaders.reserve(REST_HEADERRANGE_BATCH);
+    const CBlockIndex* pindexLast = NULL;
+    size_t nHeaders = 0;
+    while (nHeaders < (size_t)nCount) {
+        // Collect a batch at a time so cs_main is not held while the reply
+        // is encoded. A batch continues from the last header sent, and the
+        // reply ends if a reorg took that header out of the active chain.
+        vHeaders.clear();
+        {
+            LOCK(cs_main);
+            const CBlockIndex* pindex;
+            if (pindexLast == NULL) {
+                if (nHeight > chainActive.Height())
+                    break;
+                pindex = chainActive[nHeight];
+            } else {
+                if (!chainActive.Contains(pindexLast))
+                    break;
+                pindex = chainActive.Next(pindexLast);
+            }
+            while (pindex != NULL && vHeaders.size() < REST_HEADERRANGE_BATCH && nHeaders + vHeaders.size() < (size_t)nCount) {
+                vHeaders.push_back(pindex->GetBlockHeader());
+                pindexLast = pindex;
+                pindex = chainActive.Next(pindex);
+            }
+        }
+        if (vHeaders.empty())
+            break;
+
+        CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+        BOOST_FOREACH (const CBlockHeader& header, vHeaders)
+            ssHeader << header;
+        reply.Write(&ssHeader[0], ssHeader.size());
+        nHeaders += vHeaders.size();
+    }
+    reply.Finish(nHeaders, "X-Header-Count");
+    return true;
+}
+
 static bool rest_chaininfo(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -325,9 +649,7 @@ static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPar
     case RF_JSON: {
         UniValue mempoolObject = mempoolToJSON(true);
 
-        string strJSON = mempoolObject.write() + "\n";
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        WriteJSONReply(req, mempoolObject);
         return true;
     }
     default: {
@@ -351,6 +673,12 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
+    // Likewise the JSON of a transaction has its block and confirmations
+    uint256 hashTip = rf == RF_JSON ? GetChainTipSnapshot().hashBlock : uint256();
+    string strKey = strprintf("tx/%s.%d", hash.GetHex(), rf);
+    if (rf != RF_UNDEF && WriteCachedReply(req, strKey, hashTip))
+        return true;
+
     CTransaction tx;
     uint256 hashBlock = uint256();
     if (!GetTransaction(hash, tx, hashBlock, true))
@@ -361,25 +689,19 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
 
     switch (rf) {
     case RF_BINARY: {
-        string binaryTx = ssTx.str();
-        req->WriteHeader("Content-Type", "application/octet-stream");
-        req->WriteReply(HTTP_OK, binaryTx);
+        WriteReplyToCache(req, strKey, hashTip, "application/octet-stream", ssTx.str());
         return true;
     }
 
     case RF_HEX: {
-        string strHex = HexStr(ssTx.begin(), ssTx.end()) + "\n";
-        req->WriteHeader("Content-Type", "text/plain");
-        req->WriteReply(HTTP_OK, strHex);
+        WriteReplyToCache(req, strKey, hashTip, "text/plain", HexStr(ssTx.begin(), ssTx.end()) + "\n");
         return true;
     }
 
     case RF_JSON: {
         UniValue objTx(UniValue::VOBJ);
         TxToJSON(tx, hashBlock, objTx);
-        string strJSON = objTx.write() + "\n";
-        req->WriteHeader("Content-Type", "application/json");
-        req->WriteReply(HTTP_OK, strJSON);
+        WriteReplyToCache(req, strKey, hashTip, "application/json", objTx.write() + "\n");
         return true;
     }
 
@@ -492,33 +814,18 @@ static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
     std::string bitmapStringRepresentation;
     boost::dynamic_bitset<unsigned char> hits(vOutPoints.size());
     {
-        LOCK2(cs_main, mempool.cs);
-
-        CCoinsView viewDummy;
-        CCoinsViewCache view(&viewDummy);
-
-        CCoinsViewCache& viewChain = *pcoinsTip;
-        CCoinsViewMemPool viewMempool(&viewChain, mempool);
-
-        if (fCheckMemPool)
-            view.SetBackend(viewMempool); // switch cache backend to db+mempool in case user likes to query mempool
+        std::vector<CUnspentOutput> vOutputs;
+        GetUnspentOutputs(vOutPoints, fCheckMemPool, vOutputs);
 
         for (size_t i = 0; i < vOutPoints.size(); i++) {
-            CCoins coins;
-            uint256 hash = vOutPoints[i].hash;
-            if (view.GetCoins(hash, coins)) {
-                mempool.pruneSpent(hash, coins);
-                if (coins.IsAvailable(vOutPoints[i].n)) {
-                    hits[i] = true;
-                    // Safe to index into vout here because IsAvailable checked if it's off the end of the array, or if
-                    // n is valid but points to an already spent output (IsNull).
-                    CCoin coin;
-                    coin.nTxVer = coins.nVersion;
-                    coin.nHeight = coins.nHeight;
-                    coin.out = coins.vout.at(vOutPoints[i].n);
-                    assert(!coin.out.IsNull());
-                    outs.push_back(coin);
-                }
+            if (vOutputs[i].fFound) {
+                hits[i] = true;
+                CCoin coin;
+                coin.nTxVer = vOutputs[i].nVersion;
+                coin.nHeight = vOutputs[i].nHeight;
+                coin.out = vOutputs[i].out;
+                assert(!coin.out.IsNull());
+                outs.push_back(coin);
             }
 
             bitmapStringRepresentation.append(hits[i] ? "1" : "0"); // form a binary string representation (human-readable for json output)
@@ -599,13 +906,16 @@ static const struct {
       {"/rest/mempool/info", rest_mempool_info},
       {"/rest/mempool/contents", rest_mempool_contents},
       {"/rest/headers/", rest_headers},
+      {"/rest/blockrange/", rest_blockrange},
+      {"/rest/headerrange/", rest_headerrange},
       {"/rest/getutxos", rest_getutxos},
 };
 
 bool StartREST()
 {
+    restCache.SetMaxSize(std::max((int64_t)GetArg("-restcachesize", DEFAULT_REST_CACHE_SIZE), (int64_t)0) << 20);
     for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++)
-        RegisterHTTPHandler(uri_prefixes[i].prefix, false, uri_prefixes[i].handler);
+        RegisterHTTPHandler(uri_prefixes[i].prefix, false, uri_prefixes[i].handler, HTTP_WORK_REST);
     return true;
 }
 
@@ -617,4 +927,5 @@ void StopREST()
 {
     for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++)
         UnregisterHTTPHandler(uri_prefixes[i].prefix, false);
+    restCache.Clear();
 }
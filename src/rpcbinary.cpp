@@ -0,0 +1,260 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcbinary.h"
+
+#include "clientversion.h"
+#include "compat.h"
+#include "crypto/common.h"
+#include "netbase.h"
+#include "rpcserver.h"
+#include "streams.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include <set>
+
+#ifndef WIN32
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include <univalue.h>
+
+CBinaryRPCReply ExecBinaryRPC(const CBinaryRPCRequest& req)
+{
+    CBinaryRPCReply reply;
+    reply.nId = req.nId;
+    try {
+        std::string strStatus;
+        if (RPCIsInWarmup(&strStatus))
+            throw JSONRPCError(RPC_IN_WARMUP, strStatus);
+
+        UniValue params(UniValue::VARR);
+        BOOST_FOREACH (const CBinaryRPCParam& param, req.vParams) {
+            if (param.nType == CBinaryRPCParam::RAW) {
+                params.push_back(HexStr(param.vch));
+            } else if (param.nType == CBinaryRPCParam::JSON) {
+                // Wrapped in an array so scalars parse too
+                UniValue val;
+                if (!val.read("[" + std::string(param.vch.begin(), param.vch.end()) + "]") || val.size() != 1)
+                    throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+                params.push_back(val[0]);
+            } else {
+                throw JSONRPCError(RPC_INVALID_REQUEST, "Unknown parameter type");
+            }
+        }
+
+        LogPrint("rpc", "Binary RPC method=%s\n", SanitizeString(req.strMethod));
+        UniValue result = tableRPC.execute(req.strMethod, params);
+        if (req.fRawResult && result.isStr() && IsHex(result.get_str())) {
+            reply.nType = CBinaryRPCParam::RAW;
+            reply.vch = ParseHex(result.get_str());
+        } else {
+            std::string strResult = result.write();
+            reply.vch.assign(strResult.begin(), strResult.end());
+        }
+    } catch (const UniValue& objError) {
+        reply.nStatus = CBinaryRPCReply::STATUS_ERROR;
+        std::string strError = objError.write();
+        reply.vch.assign(strError.begin(), strError.end());
+    } catch (const std::exception& e) {
+        reply.nStatus = CBinaryRPCReply::STATUS_ERROR;
+        std::string strError = JSONRPCError(RPC_PARSE_ERROR, e.what()).write();
+        reply.vch.assign(strError.begin(), strError.end());
+    }
+    return reply;
+}
+
+#ifndef WIN32
+
+static SOCKET hListenSocket = INVALID_SOCKET;
+static boost::filesystem::path pathSocket;
+static boost::thread threadListen;
+static boost::thread_group threadsConnection;
+static boost::mutex cs_connections;
+static std::set<SOCKET> setConnections;
+static bool fBinaryRPCStopping = false;
+
+static bool ReadAll(SOCKET hSocket, char* pch, size_t nSize)
+{
+    while (nSize > 0) {
+        ssize_t n = recv(hSocket, pch, nSize, 0);
+        if (n <= 0)
+            return false;
+        pch += n;
+        nSize -= n;
+    }
+    return true;
+}
+
+static bool WriteAll(SOCKET hSocket, const char* pch, size_t nSize)
+{
+    while (nSize > 0) {
+        ssize_t n = send(hSocket, pch, nSize, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        pch += n;
+        nSize -= n;
+    }
+    return true;
+}
+
+static void ThreadBinaryRPCConnection(SOCKET hSocket)
+{
+    CDataStream ssRequest(SER_NETWORK, CLIENT_VERSION);
+    CDataStream ssReply(SER_NETWORK, CLIENT_VERSION);
+    while (true) {
+        unsigned char pchSize[4];
+        if (!ReadAll(hSocket, (char*)pchSize, sizeof(pchSize)))
+            break;
+        uint32_t nSize = ReadLE32(pchSize);
+        if (nSize > MAX_RPC_BINARY_FRAME_SIZE) {
+            LogPrintf("Binary RPC request of %u bytes is too large, closing connection\n", nSize);
+            break;
+        }
+        ssRequest.clear();
+        ssRequest.resize(nSize);
+        if (nSize > 0 && !ReadAll(hSocket, &ssRequest[0], nSize))
+            break;
+
+        CBinaryRPCRequest req;
+        try {
+            ssRequest >> req;
+        } catch (const std::exception& e) {
+            LogPrintf("Malformed binary RPC request, closing connection: %s\n", e.what());
+            break;
+        }
+
+        CBinaryRPCReply reply = ExecBinaryRPC(req);
+
+        // Length first, patched in once the reply is serialized behind it
+        ssReply.clear();
+        ssReply << uint32_t(0) << reply;
+        WriteLE32((unsigned char*)&ssReply[0], ssReply.size() - 4);
+        if (!WriteAll(hSocket, &ssReply[0], ssReply.size()))
+            break;
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(cs_connections);
+        setConnections.erase(hSocket);
+    }
+    CloseSocket(hSocket);
+}
+
+static void ThreadBinaryRPCListen()
+{
+    RenameThread("dystem-rpcbin");
+    unsigned int nMaxConnections = std::max(1, (int)GetArg("-rpcbinaryconnections", DEFAULT_RPC_BINARY_CONNECTIONS));
+    while (true) {
+        SOCKET hSocket = accept(hListenSocket, NULL, NULL);
+        boost::unique_lock<boost::mutex> lock(cs_connections);
+        if (fBinaryRPCStopping) {
+            if (hSocket != INVALID_SOCKET)
+                CloseSocket(hSocket);
+            break;
+        }
+        if (hSocket == INVALID_SOCKET) {
+            if (WSAGetLastError() == WSAEINTR)
+                continue;
+            LogPrintf("Binary RPC accept failed: %s\n", NetworkErrorString(WSAGetLastError()));
+            break;
+        }
+        if (setConnections.size() >= nMaxConnections) {
+            LogPrint("rpc", "Binary RPC connection refused, %u open\n", setConnections.size());
+            CloseSocket(hSocket);
+            continue;
+        }
+        setConnections.insert(hSocket);
+        threadsConnection.create_thread(boost::bind(&ThreadBinaryRPCConnection, hSocket));
+    }
+}
+
+bool StartBinaryRPC()
+{
+    if (!mapArgs.count("-rpcbinarysocket"))
+        return true;
+
+    pathSocket = GetArg("-rpcbinarysocket", "");
+    if (!pathSocket.is_complete())
+        pathSocket = GetDataDir() / pathSocket;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (pathSocket.string().size() >= sizeof(addr.sun_path))
+        return error("%s : socket path %s is too long", __func__, pathSocket.string());
+    strncpy(addr.sun_path, pathSocket.string().c_str(), sizeof(addr.sun_path) - 1);
+
+    hListenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (hListenSocket == INVALID_SOCKET)
+        return error("%s : cannot create socket: %s", __func__, NetworkErrorString(WSAGetLastError()));
+
+    // A socket file left by a node that did not shut down cleanly
+    boost::filesystem::remove(pathSocket);
+
+    // Only the user running the node may connect
+    mode_t nOldMask = umask(077);
+    int nBind = bind(hListenSocket, (struct sockaddr*)&addr, sizeof(addr));
+    umask(nOldMask);
+    if (nBind == SOCKET_ERROR || listen(hListenSocket, SOMAXCONN) == SOCKET_ERROR) {
+        int nErr = WSAGetLastError();
+        CloseSocket(hListenSocket);
+        return error("%s : cannot listen on %s: %s", __func__, pathSocket.string(), NetworkErrorString(nErr));
+    }
+
+    LogPrintf("Binary RPC listening on %s\n", pathSocket.string());
+    fBinaryRPCStopping = false;
+    threadListen = boost::thread(&ThreadBinaryRPCListen);
+    return true;
+}
+
+void InterruptBinaryRPC()
+{
+    if (hListenSocket == INVALID_SOCKET)
+        return;
+    boost::unique_lock<boost::mutex> lock(cs_connections);
+    fBinaryRPCStopping = true;
+    // Wake accept() and the connections blocked reading their next request
+    shutdown(hListenSocket, SHUT_RDWR);
+    BOOST_FOREACH (SOCKET hSocket, setConnections)
+        shutdown(hSocket, SHUT_RDWR);
+}
+
+void StopBinaryRPC()
+{
+    if (hListenSocket == INVALID_SOCKET)
+        return;
+    InterruptBinaryRPC();
+    threadListen.join();
+    threadsConnection.join_all();
+    CloseSocket(hListenSocket);
+    boost::filesystem::remove(pathSocket);
+    LogPrint("rpc", "Binary RPC stopped\n");
+}
+
+#else
+
+bool StartBinaryRPC()
+{
+    if (mapArgs.count("-rpcbinarysocket"))
+        return error("%s : -rpcbinarysocket needs Unix domain sockets, not available on Windows", __func__);
+    return true;
+}
+
+void InterruptBinaryRPC()
+{
+}
+
+void StopBinaryRPC()
+{
+}
+
+#endif
@@ -0,0 +1,123 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RPCBINARY_H
+#define BITCOIN_RPCBINARY_H
+
+#include "serialize.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//! Largest request frame accepted, enough for a block in a raw parameter
+static const unsigned int MAX_RPC_BINARY_FRAME_SIZE = 32 * 1024 * 1024;
+//! Default for -rpcbinaryconnections
+static const int DEFAULT_RPC_BINARY_CONNECTIONS = 8;
+
+/**
+ * Binary RPC transport
+ *
+ * A local client connects to the Unix socket given by -rpcbinarysocket and
+ * sends requests, each framed as a 4 byte little endian length followed by a
+ * serialized CBinaryRPCRequest. Every request gets one CBinaryRPCReply,
+ * framed the same way, in order. Access is controlled by the permissions of
+ * the socket file, which only the user running the node can open, so there
+ * is no HTTP, authorization header or JSON request object to parse.
+ *
+ * Calls are dispatched through tableRPC like JSON-RPC ones. A raw parameter
+ * carries serialized data, e.g. a transaction for sendrawtransaction, and is
+ * passed to the method as the hex string it expects. With fRawResult, a
+ * result that is a hex string, e.g. from getrawtransaction, comes back as
+ * the bytes it encodes.
+ */
+
+/** A parameter of a binary RPC request */
+class CBinaryRPCParam
+{
+public:
+    enum Type {
+        JSON = 0, //!< JSON text of the value
+        RAW = 1,  //!< Bytes passed to the method hex encoded
+    };
+
+    uint8_t nType;
+    std::vector<unsigned char> vch;
+
+    CBinaryRPCParam() : nType(JSON) {}
+    CBinaryRPCParam(uint8_t nTypeIn, const std::vector<unsigned char>& vchIn) : nType(nTypeIn), vch(vchIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType_, int nVersion)
+    {
+        READWRITE(nType);
+        READWRITE(vch);
+    }
+};
+
+class CBinaryRPCRequest
+{
+public:
+    uint32_t nId;
+    std::string strMethod;
+    std::vector<CBinaryRPCParam> vParams;
+    bool fRawResult;
+
+    CBinaryRPCRequest() : nId(0), fRawResult(false) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nId);
+        READWRITE(strMethod);
+        READWRITE(vParams);
+        READWRITE(fRawResult);
+    }
+};
+
+class CBinaryRPCReply
+{
+public:
+    enum Status {
+        STATUS_OK = 0,
+        STATUS_ERROR = 1, //!< vch holds the JSON-RPC error object
+    };
+
+    uint32_t nId;
+    uint8_t nStatus;
+    //! A CBinaryRPCParam::Type
+    uint8_t nType;
+    std::vector<unsigned char> vch;
+
+    CBinaryRPCReply() : nId(0), nStatus(STATUS_OK), nType(CBinaryRPCParam::JSON) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType_, int nVersion)
+    {
+        READWRITE(nId);
+        READWRITE(nStatus);
+        READWRITE(nType);
+        READWRITE(vch);
+    }
+};
+
+/** Execute a binary RPC request */
+CBinaryRPCReply ExecBinaryRPC(const CBinaryRPCRequest& req);
+
+/** Start the binary RPC listener if -rpcbinarysocket is set.
+ * Precondition; RPC has been started.
+ */
+bool StartBinaryRPC();
+/** Stop accepting requests and wake the connection threads */
+void InterruptBinaryRPC();
+/** Wait for the connection threads and remove the socket file */
+void StopBinaryRPC();
+
+#endif // BITCOIN_RPCBINARY_H
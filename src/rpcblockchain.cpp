@@ -6,18 +6,25 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "base58.h"
+#include "blockcompress.h"
+#include "blocktrace.h"
 #include "checkpoints.h"
 #include "clientversion.h"
 #include "main.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "sync.h"
 #include "txdb.h"
 #include "util.h"
 #include "utilmoneystr.h"
 
+#include <limits>
 #include <stdint.h>
 #include <univalue.h>
 
+#include <boost/assign/list_of.hpp>
+#include <boost/filesystem.hpp>
+
 using namespace std;
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
@@ -126,8 +133,7 @@ UniValue getblockcount(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("getblockcount", "") + HelpExampleRpc("getblockcount", ""));
 
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetChainTipSnapshot().nHeight;
 }
 
 UniValue getbestblockhash(const UniValue& params, bool fHelp)
@@ -141,8 +147,7 @@ UniValue getbestblockhash(const UniValue& params, bool fHelp)
             "\nExamples\n" +
             HelpExampleCli("getbestblockhash", "") + HelpExampleRpc("getbestblockhash", ""));
 
-    LOCK(cs_main);
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    return GetChainTipSnapshot().hashBlock.GetHex();
 }
 
 UniValue getdifficulty(const UniValue& params, bool fHelp)
@@ -166,16 +171,19 @@ UniValue mempoolToJSON(bool fVerbose = false)
     if (fVerbose) {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH (const PAIRTYPE(uint256, CTxMemPoolEntry) & entry, mempool.mapTx) {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+        BOOST_FOREACH (const CTxMemPoolEntry& e, mempool.mapTx) {
+            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+            info.push_back(Pair("modifiedfee", ValueFromAmount(e.GetModifiedFee())));
             info.push_back(Pair("time", e.GetTime()));
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH (const CTxIn& txin, tx.vin) {
@@ -222,10 +230,14 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             "  \"transactionid\" : {       (json object)\n"
             "    \"size\" : n,             (numeric) transaction size in bytes\n"
             "    \"fee\" : n,              (numeric) transaction fee in dystem\n"
+            "    \"modifiedfee\" : n,      (numeric) transaction fee with fee deltas used for mining priority\n"
             "    \"time\" : n,             (numeric) local time transaction entered pool in seconds since 1 Jan 1970 GMT\n"
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) modified fees (see above) of in-mempool ancestors (including this one) in satoshis\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -266,6 +278,77 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
     return pblockindex->GetBlockHash().GetHex();
 }
 
+UniValue getblockhashes(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getblockhashes high low\n"
+            "\nReturns the hashes of the blocks with a time in [low, high) (requires -timestampindex).\n"
+            "\nArguments:\n"
+            "1. high         (numeric, required) The newer block timestamp, exclusive\n"
+            "2. low          (numeric, required) The older block timestamp, inclusive\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"hash\"       (string) The block hash\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getblockhashes", "1231614698 1231024505") + HelpExampleRpc("getblockhashes", "1231614698, 1231024505"));
+
+    int64_t nHigh = params[0].get_int64();
+    int64_t nLow = params[1].get_int64();
+    if (nLow < 0 || nHigh < nLow || nHigh > std::numeric_limits<unsigned int>::max())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Timestamps out of range");
+
+    std::vector<uint256> vHashes;
+    if (!GetTimestampIndex(nHigh, nLow, vHashes))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for block hashes");
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<uint256>::const_iterator it = vHashes.begin(); it != vHashes.end(); ++it)
+        result.push_back(it->GetHex());
+    return result;
+}
+
+UniValue getspentinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1 || !params[0].isObject())
+        throw runtime_error(
+            "getspentinfo {\"txid\": \"hash\", \"index\": n}\n"
+            "\nReturns the input that spent an output (requires -spentindex).\n"
+            "\nArguments:\n"
+            "1. {\n"
+            "     \"txid\": \"hash\"   (string, required) The transaction id of the output\n"
+            "     \"index\": n       (numeric, required) The index of the output\n"
+            "   }\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\": \"hash\",     (string) The id of the spending transaction\n"
+            "  \"index\": n,         (numeric) The index of the spending input\n"
+            "  \"height\": n         (numeric) The height of the block with the spending transaction\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getspentinfo", "'{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}'") +
+            HelpExampleRpc("getspentinfo", "{\"txid\": \"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", \"index\": 0}"));
+
+    UniValue txidValue = find_value(params[0].get_obj(), "txid");
+    UniValue indexValue = find_value(params[0].get_obj(), "index");
+    if (!txidValue.isStr() || !indexValue.isNum())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid txid or index");
+    int nIndex = indexValue.get_int();
+    if (nIndex < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid index");
+
+    CSpentIndexValue value;
+    if (!GetSpentIndex(CSpentIndexKey(uint256(txidValue.get_str()), nIndex), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("txid", value.txid.GetHex()));
+    result.push_back(Pair("index", (int)value.nInputIndex));
+    result.push_back(Pair("height", value.nBlockHeight));
+    return result;
+}
+
 UniValue getblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -316,6 +399,9 @@ UniValue getblock(const UniValue& params, bool fHelp)
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
     if (!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -375,13 +461,85 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
     return blockheaderToJSON(pblockindex);
 }
 
+UniValue getblocktraces(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getblocktraces ( count )\n"
+            "\nReturns where the time went while the last blocks were processed, from their arrival\n"
+            "until they were connected or rejected, as kept by -blocktraces.\n"
+            "\nArguments:\n"
+            "1. count          (numeric, optional) Return only the newest count blocks\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"hash\": \"hash\",       (string) The block hash\n"
+            "    \"height\": n,          (numeric) The block height, -1 if it was not accepted far enough to know\n"
+            "    \"peer\": n,            (numeric) The peer it came from, -1 if not from the network\n"
+            "    \"received\": n,        (numeric) When it arrived, in microseconds since epoch\n"
+            "    \"queued\": n,          (numeric) Microseconds it waited before it was processed\n"
+            "    \"duration\": n,        (numeric) Microseconds from its arrival until it was processed\n"
+            "    \"tip\": true|false,    (boolean) Whether it was the chain tip once processed\n"
+            "    \"spans\": [            (array) The timed phases, in the order they started\n"
+            "      {\n"
+            "        \"phase\": \"name\",  (string) checkblock, acceptblock, writeblock, activatebestchain, connecttip,\n"
+            "                            connectblock, blockvalue, blockpayee, flushstate, updatetip or syncwallets\n"
+            "        \"depth\": n,       (numeric) Phases it ran within\n"
+            "        \"start\": n,       (numeric) Microseconds after the arrival of the block it started\n"
+            "        \"duration\": n     (numeric) Microseconds it took\n"
+            "      }\n"
+            "      ,...\n"
+            "    ],\n"
+            "    \"spansdropped\": n     (numeric, optional) Phases not kept, when there were too many\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getblocktraces", "") + HelpExampleCli("getblocktraces", "1") + HelpExampleRpc("getblocktraces", "1"));
+
+    std::vector<CBlockTrace> vTraces = GetBlockTraces();
+    if (params.size() > 0) {
+        int nCount = params[0].get_int();
+        if (nCount < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+        if ((size_t)nCount < vTraces.size())
+            vTraces.resize(nCount);
+    }
+
+    UniValue ret(UniValue::VARR);
+    BOOST_FOREACH (const CBlockTrace& trace, vTraces) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("hash", trace.hash.GetHex()));
+        obj.push_back(Pair("height", trace.nHeight));
+        obj.push_back(Pair("peer", trace.nPeer));
+        obj.push_back(Pair("received", trace.nTimeReceived));
+        obj.push_back(Pair("queued", trace.nStart));
+        obj.push_back(Pair("duration", trace.nDuration));
+        obj.push_back(Pair("tip", trace.fTip));
+        UniValue spans(UniValue::VARR);
+        BOOST_FOREACH (const CBlockTraceSpan& span, trace.vSpans) {
+            UniValue entry(UniValue::VOBJ);
+            entry.push_back(Pair("phase", GetBlockTracePhaseName(span.phase)));
+            entry.push_back(Pair("depth", span.nDepth));
+            entry.push_back(Pair("start", span.nStart));
+            entry.push_back(Pair("duration", span.nDuration));
+            spans.push_back(entry);
+        }
+        obj.push_back(Pair("spans", spans));
+        if (trace.nSpansDropped > 0)
+            obj.push_back(Pair("spansdropped", (uint64_t)trace.nSpansDropped));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "gettxoutsetinfo\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "Note this call may take some time the first time it is called after a new block.\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
@@ -395,13 +553,13 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("gettxoutsetinfo", "") + HelpExampleRpc("gettxoutsetinfo", ""));
 
-    LOCK(cs_main);
-
     UniValue ret(UniValue::VOBJ);
 
     CCoinsStats stats;
     FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
+    // The statistics come from a snapshot of the chainstate database, and do
+    // not need cs_main; they are cached until the best block changes.
+    if (pcoinsdbview->GetStats(stats)) {
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
@@ -413,6 +571,127 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"filename\"\n"
+            "\nWrites the unspent transaction output set at the current tip to a file, for -loadtxoutset.\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The file to write, relative to the data directory unless absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coins_written\": n,         (numeric) The number of unspent outputs written\n"
+            "  \"base_hash\": \"hash\",      (string) The block the set is at\n"
+            "  \"base_height\": n,           (numeric) The height of that block\n"
+            "  \"hash_serialized\": \"hash\", (string) The hash gettxoutsetinfo gives for the set\n"
+            "  \"path\": \"path\"            (string) Where the set was written\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("dumptxoutset", "\"utxo.dat\"") + HelpExampleRpc("dumptxoutset", "\"utxo.dat\""));
+
+    boost::filesystem::path path(params[0].get_str());
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+    boost::filesystem::path pathTmp = path.string() + ".incomplete";
+
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot open " + pathTmp.string());
+
+    // As for gettxoutsetinfo, the set is read from a snapshot of the
+    // chainstate database and does not hold cs_main while written.
+    CCoinsStats stats;
+    FlushStateToDisk();
+    bool fOk = pcoinsdbview->WriteSnapshot(fileout, stats);
+    if (fOk)
+        FileCommit(fileout.Get());
+    fileout.fclose();
+    if (!fOk || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        throw JSONRPCError(RPC_MISC_ERROR, "Failed to write " + path.string());
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("coins_written", (int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("base_hash", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("base_height", (int64_t)stats.nHeight));
+    ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+    ret.push_back(Pair("path", path.string()));
+    return ret;
+}
+
+static UniValue dbInfoToJSON(const CLevelDBWrapper& db)
+{
+    const CLevelDBProfile& profile = db.GetProfile();
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("engine", db.GetEngineName()));
+    ret.push_back(Pair("cachesize", (uint64_t)db.GetCacheSize()));
+    ret.push_back(Pair("writebuffer", (uint64_t)(profile.nWriteBufferSize ? profile.nWriteBufferSize : db.GetCacheSize() / 4)));
+    ret.push_back(Pair("bloombits", profile.nBloomBits));
+    ret.push_back(Pair("compression", profile.fCompression));
+    ret.push_back(Pair("maxopenfiles", profile.nMaxOpenFiles));
+    ret.push_back(Pair("disksize", db.GetApproximateSize()));
+    uint64_t nLookups = db.GetLookups();
+    uint64_t nHits = db.GetLookupHits();
+    ret.push_back(Pair("lookups", nLookups));
+    ret.push_back(Pair("hits", nHits));
+    ret.push_back(Pair("hitrate", nLookups ? (double)nHits / nLookups : 0.0));
+    return ret;
+}
+
+UniValue getdbinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbinfo\n"
+            "\nReturns the tuning and usage of the chainstate and block index databases, and of compressed block files.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {          (json object) The chainstate database\n"
+            "    \"engine\": \"name\",      (string) Key-value engine it is stored with (-chainstateengine)\n"
+            "    \"cachesize\": n,        (numeric) Block cache size in bytes\n"
+            "    \"writebuffer\": n,      (numeric) Write buffer size in bytes\n"
+            "    \"bloombits\": n,        (numeric) Bloom filter bits per key, 0 if there is no filter\n"
+            "    \"compression\": true|false, (boolean) Whether blocks are compressed with Snappy\n"
+            "    \"maxopenfiles\": n,     (numeric) Maximum number of open files\n"
+            "    \"disksize\": n,         (numeric) Approximate size on disk in bytes\n"
+            "    \"lookups\": n,          (numeric) Point lookups since startup\n"
+            "    \"hits\": n,             (numeric) Lookups that found their key\n"
+            "    \"hitrate\": x.xxx       (numeric) hits / lookups\n"
+            "  },\n"
+            "  \"blockindex\": { ... }    (json object) The block index database, same fields\n"
+            "  \"blockfiles\": {          (json object) Compressed block files (-blockcompression)\n"
+            "    \"compression\": n,      (numeric) zlib level finalized block files are compressed with, 0 if they are not\n"
+            "    \"frames\": n,           (numeric) Frames inflated since startup\n"
+            "    \"bytes\": n,            (numeric) Bytes inflated since startup\n"
+            "    \"time_ms\": n           (numeric) Time spent inflating them in milliseconds\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getdbinfo", "") + HelpExampleRpc("getdbinfo", ""));
+
+    LOCK(cs_main);
+
+    UniValue ret(UniValue::VOBJ);
+    if (pcoinsdbview)
+        ret.push_back(Pair("chainstate", dbInfoToJSON(pcoinsdbview->GetDB())));
+    if (pblocktree)
+        ret.push_back(Pair("blockindex", dbInfoToJSON(*pblocktree)));
+
+    CBlockDecompressionStats stats = GetBlockDecompressionStats();
+    UniValue blockfiles(UniValue::VOBJ);
+    blockfiles.push_back(Pair("compression", IsBlockCompressionAvailable() ? GetArg("-blockcompression", DEFAULT_BLOCK_COMPRESSION) : 0));
+    blockfiles.push_back(Pair("frames", stats.nFrames));
+    blockfiles.push_back(Pair("bytes", stats.nBytes));
+    blockfiles.push_back(Pair("time_ms", stats.nTimeMicros / 1000));
+    ret.push_back(Pair("blockfiles", blockfiles));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -490,6 +769,99 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue gettxouts(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "gettxouts [{\"txid\":\"id\",\"vout\":n},...] ( includemempool )\n"
+            "\nReturns the unspent ones of many transaction outputs, looked up at once.\n"
+            "\nArguments:\n"
+            "1. \"outputs\"      (string, required) A json array of at most " + strprintf("%u", MAX_UTXO_BATCH_SIZE) + " outputs\n"
+            "     [\n"
+            "       {\n"
+            "         \"txid\":\"id\",  (string) The transaction id\n"
+            "         \"vout\":n        (numeric) The output number\n"
+            "       }\n"
+            "       ,...\n"
+            "     ]\n"
+            "2. includemempool  (boolean, optional, default=true) Whether to included the mem pool\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"bestblock\" : \"hash\",    (string) the block hash\n"
+            "  \"height\" : n,             (numeric) the block height\n"
+            "  \"outputs\" : [             (array) for each output in the order given, null if it is not unspent, or\n"
+            "    {\n"
+            "      \"value\" : x.xxx,           (numeric) The output value in btc\n"
+            "      \"scriptPubKey\" : \"hex\",  (string) The script, hex-encoded\n"
+            "      \"confirmations\" : n,       (numeric) The number of confirmations\n"
+            "      \"coinbase\" : true|false   (boolean) Coinbase or not\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("gettxouts", "\"[{\\\"txid\\\":\\\"a08e6907dbbd3d809776dbfc5d82e371b764ed838b5655e72f463568df1aadf0\\\",\\\"vout\\\":1}]\"") +
+            HelpExampleRpc("gettxouts", "[{\"txid\":\"a08e6907dbbd3d809776dbfc5d82e371b764ed838b5655e72f463568df1aadf0\",\"vout\":1}]"));
+
+    RPCTypeCheck(params, boost::assign::list_of(UniValue::VARR)(UniValue::VBOOL));
+
+    UniValue outputs = params[0].get_array();
+    if (outputs.size() > MAX_UTXO_BATCH_SIZE)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Invalid parameter, at most %u outputs", MAX_UTXO_BATCH_SIZE));
+    std::vector<COutPoint> vOutPoints;
+    vOutPoints.reserve(outputs.size());
+    for (unsigned int idx = 0; idx < outputs.size(); idx++) {
+        const UniValue& output = outputs[idx];
+        if (!output.isObject())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected object");
+        const UniValue& o = output.get_obj();
+
+        RPCTypeCheckObj(o, boost::assign::map_list_of("txid", UniValue::VSTR)("vout", UniValue::VNUM));
+
+        string txid = find_value(o, "txid").get_str();
+        if (!IsHex(txid))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, expected hex txid");
+
+        int nOutput = find_value(o, "vout").get_int();
+        if (nOutput < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, vout must be positive");
+
+        vOutPoints.push_back(COutPoint(uint256(txid), nOutput));
+    }
+    bool fMempool = true;
+    if (params.size() > 1)
+        fMempool = params[1].get_bool();
+
+    std::vector<CUnspentOutput> vOutputs;
+    CBlockIndex* pindex = GetUnspentOutputs(vOutPoints, fMempool, vOutputs);
+    if (pindex == NULL)
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Coins database has no best block");
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
+    ret.push_back(Pair("height", pindex->nHeight));
+    UniValue results(UniValue::VARR);
+    BOOST_FOREACH (const CUnspentOutput& output, vOutputs) {
+        if (!output.fFound) {
+            results.push_back(NullUniValue);
+            continue;
+        }
+        UniValue o(UniValue::VOBJ);
+        o.push_back(Pair("value", ValueFromAmount(output.out.nValue)));
+        o.push_back(Pair("scriptPubKey", HexStr(output.out.scriptPubKey.begin(), output.out.scriptPubKey.end())));
+        if ((unsigned int)output.nHeight == MEMPOOL_HEIGHT)
+            o.push_back(Pair("confirmations", 0));
+        else
+            o.push_back(Pair("confirmations", pindex->nHeight - output.nHeight + 1));
+        o.push_back(Pair("coinbase", output.fCoinBase));
+        results.push_back(o);
+    }
+    ret.push_back(Pair("outputs", results));
+
+    return ret;
+}
+
 UniValue verifychain(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -527,7 +899,9 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
-            "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainwork\": \"xxxx\",    (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
+            "  \"pruneheight\": xxxxxx,    (numeric) lowest-height complete block stored, only present if pruning is enabled\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getblockchaininfo", "") + HelpExampleRpc("getblockchaininfo", ""));
@@ -542,6 +916,13 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("pruned", fPruneMode));
+    if (fPruneMode) {
+        CBlockIndex* block = chainActive.Tip();
+        while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA))
+            block = block->pprev;
+        obj.push_back(Pair("pruneheight", block->nHeight));
+    }
     return obj;
 }
 
@@ -731,7 +1112,14 @@ UniValue mempoolInfoToJSON()
     UniValue ret(UniValue::VOBJ);
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
-    //ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+    size_t nSigCacheEntries, nSigCacheBytes;
+    GetSignatureCacheStats(nSigCacheEntries, nSigCacheBytes);
+    ret.push_back(Pair("sigcachesize", (int64_t) nSigCacheEntries));
+    ret.push_back(Pair("sigcachebytes", (int64_t) nSigCacheBytes));
 
     return ret;
 }
@@ -746,6 +1134,11 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee rate for a transaction to be accepted\n"
+            "  \"sigcachesize\": xxxxx        (numeric) Signatures in the signature cache\n"
+            "  \"sigcachebytes\": xxxxx       (numeric) Memory allocated for the signature cache\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getmempoolinfo", "") + HelpExampleRpc("getmempoolinfo", ""));
@@ -30,6 +30,9 @@ static const CRPCConvertParam vRPCConvertParams[] =
     {
         {"stop", 0},
         {"setmocktime", 0},
+        {"getlockstats", 0},
+        {"startprofile", 0},
+        {"getnetmsgstats", 0},
         {"getaddednodeinfo", 0},
         {"setgenerate", 0},
         {"setgenerate", 1},
@@ -49,6 +52,11 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"getbalance", 1},
         {"getbalance", 2},
         {"getblockhash", 0},
+        {"getblockhashes", 0},
+        {"getblockhashes", 1},
+        {"getspentinfo", 0},
+        {"getaddressbalance", 0},
+        {"getaddressutxos", 0},
         {"move", 2},
         {"move", 3},
         {"sendfrom", 2},
@@ -65,6 +73,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"listsinceblock", 2},
         {"sendmany", 1},
         {"sendmany", 2},
+        {"sendmany", 4},
         {"addmultisigaddress", 0},
         {"addmultisigaddress", 1},
         {"createmultisig", 0},
@@ -75,6 +84,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"listunspent", 3},
         {"getblock", 1},
         {"getblockheader", 1},
+        {"getblocktraces", 0},
         {"gettransaction", 1},
         {"getrawtransaction", 1},
         {"createrawtransaction", 0},
@@ -85,10 +95,14 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"sendrawtransaction", 2},
         {"gettxout", 1},
         {"gettxout", 2},
+        {"gettxouts", 0},
+        {"gettxouts", 1},
         {"lockunspent", 0},
         {"lockunspent", 1},
         {"importprivkey", 2},
         {"importaddress", 2},
+        {"importmulti", 0},
+        {"importmulti", 1},
         {"verifychain", 0},
         {"verifychain", 1},
         {"keypoolrefill", 0},
@@ -115,6 +129,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         //{"startmasternode", 1},
         {"mnvoteraw", 1},
         {"mnvoteraw", 4},
+        {"listmasternodes", 1},
         {"reservebalance", 0},
         {"reservebalance", 1},
         {"setstakesplitthreshold", 0},
@@ -17,6 +17,7 @@
 #include "wallet.h"
 
 #include <fstream>
+#include <limits>
 #include <secp256k1.h>
 #include <stdint.h>
 
@@ -96,32 +97,37 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
             "\nImport using a label and without rescan\n" + HelpExampleCli("importprivkey", "\"mykey\" \"testing\" false") +
             "\nAs a JSON-RPC call\n" + HelpExampleRpc("importprivkey", "\"mykey\", \"testing\", false"));
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
-    EnsureWalletIsUnlocked();
-
-    string strSecret = params[0].get_str();
-    string strLabel = "";
-    if (params.size() > 1)
-        strLabel = params[1].get_str();
-
     // Whether to perform rescan after import
     bool fRescan = true;
     if (params.size() > 2)
         fRescan = params[2].get_bool();
 
-    CBitcoinSecret vchSecret;
-    bool fGood = vchSecret.SetString(strSecret);
+    if (fRescan && pwalletMain->IsScanning())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
 
-    if (!fGood) throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key encoding");
+    CBlockIndex* pindexRescan = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    CKey key = vchSecret.GetKey();
-    if (!key.IsValid()) throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Private key outside allowed range");
+        EnsureWalletIsUnlocked();
+
+        string strSecret = params[0].get_str();
+        string strLabel = "";
+        if (params.size() > 1)
+            strLabel = params[1].get_str();
+
+        CBitcoinSecret vchSecret;
+        bool fGood = vchSecret.SetString(strSecret);
+
+        if (!fGood) throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key encoding");
+
+        CKey key = vchSecret.GetKey();
+        if (!key.IsValid()) throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Private key outside allowed range");
+
+        CPubKey pubkey = key.GetPubKey();
+        assert(key.VerifyPubKey(pubkey));
+        CKeyID vchAddress = pubkey.GetID();
 
-    CPubKey pubkey = key.GetPubKey();
-    assert(key.VerifyPubKey(pubkey));
-    CKeyID vchAddress = pubkey.GetID();
-    {
         pwalletMain->MarkDirty();
         pwalletMain->SetAddressBook(vchAddress, strLabel, "receive");
 
@@ -136,12 +142,13 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
 
         // whenever a key is imported, we need to scan the whole chain
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
-
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-        }
+        pindexRescan = chainActive.Genesis();
     }
 
+    // Without the locks held, the rescan only takes them for short batches
+    if (fRescan)
+        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+
     return NullUniValue;
 }
 
@@ -162,31 +169,35 @@ UniValue importaddress(const UniValue& params, bool fHelp)
             "\nImport using a label without rescan\n" + HelpExampleCli("importaddress", "\"myaddress\" \"testing\" false") +
             "\nAs a JSON-RPC call\n" + HelpExampleRpc("importaddress", "\"myaddress\", \"testing\", false"));
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
-    CScript script;
-
-    CBitcoinAddress address(params[0].get_str());
-    if (address.IsValid()) {
-        script = GetScriptForDestination(address.Get());
-    } else if (IsHex(params[0].get_str())) {
-        std::vector<unsigned char> data(ParseHex(params[0].get_str()));
-        script = CScript(data.begin(), data.end());
-    } else {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid DYSTEM address or script");
-    }
-
-    string strLabel = "";
-    if (params.size() > 1)
-        strLabel = params[1].get_str();
-
     // Whether to perform rescan after import
     bool fRescan = true;
     if (params.size() > 2)
         fRescan = params[2].get_bool();
 
+    if (fRescan && pwalletMain->IsScanning())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
+
+    CBlockIndex* pindexRescan = NULL;
     {
-        if (::IsMine(*pwalletMain, script) == ISMINE_SPENDABLE)
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        CScript script;
+
+        CBitcoinAddress address(params[0].get_str());
+        if (address.IsValid()) {
+            script = GetScriptForDestination(address.Get());
+        } else if (IsHex(params[0].get_str())) {
+            std::vector<unsigned char> data(ParseHex(params[0].get_str()));
+            script = CScript(data.begin(), data.end());
+        } else {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid DYSTEM address or script");
+        }
+
+        string strLabel = "";
+        if (params.size() > 1)
+            strLabel = params[1].get_str();
+
+        if (pwalletMain->IsMine(script) == ISMINE_SPENDABLE)
             throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this address or script");
 
         // add to address book or update label
@@ -201,16 +212,235 @@ UniValue importaddress(const UniValue& params, bool fHelp)
 
         if (!pwalletMain->AddWatchOnly(script))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding address to wallet");
+        pindexRescan = chainActive.Genesis();
+    }
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
-            pwalletMain->ReacceptWalletTransactions();
-        }
+    // Without the locks held, the rescan only takes them for short batches
+    if (fRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+        pwalletMain->ReacceptWalletTransactions();
     }
 
     return NullUniValue;
 }
 
+/** Blocks are scanned from this long before the earliest birth time, for block time variability */
+static const int64_t IMPORT_TIMESTAMP_WINDOW = 2 * 60 * 60;
+
+/** Import one request of importmulti, keeping in nLowestTimestamp the earliest birth time seen */
+static void ProcessImport(const UniValue& data, int64_t nNow, int64_t& nLowestTimestamp)
+{
+    AssertLockHeld(pwalletMain->cs_wallet);
+
+    const UniValue& scriptPubKey = find_value(data, "scriptPubKey");
+    const UniValue& timestamp = find_value(data, "timestamp");
+    const std::string strRedeemScript = data.exists("redeemscript") ? find_value(data, "redeemscript").get_str() : "";
+    const UniValue keys = data.exists("keys") ? find_value(data, "keys").get_array() : UniValue(UniValue::VARR);
+    const std::string strLabel = data.exists("label") ? find_value(data, "label").get_str() : "";
+    const bool fWatchOnly = data.exists("watchonly") ? find_value(data, "watchonly").get_bool() : false;
+
+    int64_t nTime;
+    if (timestamp.isNum())
+        nTime = timestamp.get_int64();
+    else if (timestamp.isStr() && timestamp.get_str() == "now")
+        nTime = nNow;
+    else
+        throw JSONRPCError(RPC_TYPE_ERROR, "Missing required timestamp field for key");
+
+    // The script is given as hex or through its address
+    CScript script;
+    CBitcoinAddress address;
+    if (scriptPubKey.isObject()) {
+        address.SetString(find_value(scriptPubKey, "address").get_str());
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        script = GetScriptForDestination(address.Get());
+    } else if (scriptPubKey.isStr() && IsHex(scriptPubKey.get_str())) {
+        std::vector<unsigned char> vData(ParseHex(scriptPubKey.get_str()));
+        script = CScript(vData.begin(), vData.end());
+        CTxDestination dest;
+        if (ExtractDestination(script, dest))
+            address.Set(dest);
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid scriptPubKey");
+    }
+
+    if (keys.size() > 0 && fWatchOnly)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Incompatibility found between watchonly and keys");
+    if (keys.size() == 0 && !fWatchOnly)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Watch-only addresses should set watchonly");
+
+    if (!strRedeemScript.empty()) {
+        if (!IsHex(strRedeemScript))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid redeem script");
+        std::vector<unsigned char> vData(ParseHex(strRedeemScript));
+        CScript redeemScript(vData.begin(), vData.end());
+        if (GetScriptForDestination(CScriptID(redeemScript)) != script)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "The redeem script does not match the scriptPubKey");
+        if (!pwalletMain->HaveCScript(CScriptID(redeemScript)) && !pwalletMain->AddCScript(redeemScript))
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding p2sh redeemScript to wallet");
+    } else if (keys.size() > 1) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "More than one key given without a redeem script");
+    }
+
+    for (unsigned int i = 0; i < keys.size(); i++) {
+        CBitcoinSecret vchSecret;
+        if (!vchSecret.SetString(keys[i].get_str()))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key encoding");
+        CKey key = vchSecret.GetKey();
+        if (!key.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Private key outside allowed range");
+        CPubKey pubkey = key.GetPubKey();
+        assert(key.VerifyPubKey(pubkey));
+        CKeyID keyid = pubkey.GetID();
+        if (strRedeemScript.empty() && GetScriptForDestination(keyid) != script)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "The key does not match the scriptPubKey");
+        if (pwalletMain->HaveKey(keyid))
+            continue;
+        pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
+        if (!pwalletMain->AddKeyPubKey(key, pubkey))
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+        if (!pwalletMain->nTimeFirstKey || nTime < pwalletMain->nTimeFirstKey)
+            pwalletMain->nTimeFirstKey = nTime;
+    }
+
+    if (fWatchOnly) {
+        if (pwalletMain->IsMine(script) == ISMINE_SPENDABLE)
+            throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this address or script");
+        if (!pwalletMain->HaveWatchOnly(script) && !pwalletMain->AddWatchOnly(script))
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding address to wallet");
+    }
+
+    if (address.IsValid())
+        pwalletMain->SetAddressBook(address.Get(), strLabel, "receive");
+
+    nLowestTimestamp = std::min(nLowestTimestamp, nTime);
+}
+
+UniValue importmulti(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "importmulti [{\"scriptPubKey\": \"script\" | {\"address\": \"address\"}, \"timestamp\": timestamp | \"now\", ...},...] ( {\"rescan\": true} )\n"
+            "\nImports addresses, scripts and private keys in one wallet database transaction,\n"
+            "then rescans once from the earliest timestamp given.\n"
+            "\nArguments:\n"
+            "1. requests     (array, required) Data to be imported\n"
+            "  [\n"
+            "    {\n"
+            "      \"scriptPubKey\": \"script\" | {\"address\": \"address\"}, (string or object, required) The script in hex or the address\n"
+            "      \"timestamp\": timestamp | \"now\",  (integer or string, required) Creation time of the key in seconds since epoch,\n"
+            "                                          \"now\" to skip scanning the chain for old transactions, 0 to scan it all\n"
+            "      \"redeemscript\": \"script\",      (string, optional) The redeem script in hex, for a P2SH scriptPubKey\n"
+            "      \"keys\": [\"privkey\",...],       (array, optional) Private keys of the script, one unless there is a redeem script\n"
+            "      \"watchonly\": true|false,       (boolean, optional, default=false) Watch the script without its keys\n"
+            "      \"label\": \"label\"               (string, optional, default=\"\") Label of the address\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "2. options      (object, optional)\n"
+            "  {\n"
+            "    \"rescan\": true|false           (boolean, optional, default=true) Rescan the chain after all imports\n"
+            "  }\n"
+            "\nResult:\n"
+            "[                      (array) One object per request, in order\n"
+            "  {\n"
+            "    \"success\": true|false,\n"
+            "    \"error\": {\"code\": n, \"message\": \"text\"} (object) Only when success is false\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nNote: This call can take minutes to complete if rescan is true.\n"
+            "\nExamples:\n" +
+            HelpExampleCli("importmulti", "'[{\"scriptPubKey\":{\"address\":\"myaddress\"},\"timestamp\":1455191478,\"watchonly\":true}]' '{\"rescan\":false}'") +
+            HelpExampleRpc("importmulti", "[{\"scriptPubKey\":{\"address\":\"myaddress\"},\"timestamp\":1455191478,\"watchonly\":true}], {\"rescan\":false}"));
+
+    const UniValue& requests = params[0].get_array();
+
+    // Whether to perform rescan after import
+    bool fRescan = true;
+    if (params.size() > 1) {
+        const UniValue& options = params[1].get_obj();
+        if (options.exists("rescan"))
+            fRescan = find_value(options, "rescan").get_bool();
+    }
+
+    if (fRescan && pwalletMain->IsScanning())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning. Abort existing rescan or wait.");
+
+    UniValue response(UniValue::VARR);
+    CBlockIndex* pindexRescan = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        for (unsigned int i = 0; i < requests.size(); i++) {
+            if (find_value(requests[i], "keys").isArray() && find_value(requests[i], "keys").size() > 0) {
+                EnsureWalletIsUnlocked();
+                break;
+            }
+        }
+
+        const int64_t nNow = chainActive.Tip() ? chainActive.Tip()->GetMedianTimePast() : 0;
+        int64_t nLowestTimestamp = std::numeric_limits<int64_t>::max();
+        bool fImported = false;
+        {
+            // All the imports are written in one database transaction
+            CWalletBatch batch(pwalletMain);
+            for (unsigned int i = 0; i < requests.size(); i++) {
+                UniValue result(UniValue::VOBJ);
+                try {
+                    ProcessImport(requests[i].get_obj(), nNow, nLowestTimestamp);
+                    result.push_back(Pair("success", true));
+                    fImported = true;
+                } catch (const UniValue& e) {
+                    result.push_back(Pair("success", false));
+                    result.push_back(Pair("error", e));
+                } catch (const std::exception& e) {
+                    result.push_back(Pair("success", false));
+                    result.push_back(Pair("error", JSONRPCError(RPC_MISC_ERROR, e.what())));
+                }
+                response.push_back(result);
+            }
+        }
+        pwalletMain->MarkDirty();
+
+        if (fImported && nLowestTimestamp < nNow) {
+            pindexRescan = chainActive.Tip();
+            while (pindexRescan && pindexRescan->pprev && pindexRescan->GetBlockTime() > nLowestTimestamp - IMPORT_TIMESTAMP_WINDOW)
+                pindexRescan = pindexRescan->pprev;
+        }
+    }
+
+    // One rescan for all the imports, without the locks held
+    if (fRescan && pindexRescan) {
+        LogPrintf("importmulti: rescanning last %i blocks\n", chainActive.Height() - pindexRescan->nHeight + 1);
+        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+        pwalletMain->ReacceptWalletTransactions();
+    }
+
+    return response;
+}
+
+UniValue abortrescan(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "\nStops the current wallet rescan triggered e.g. by an importprivkey call.\n"
+            "\nResult:\n"
+            "true|false        (boolean) Whether a rescan was running and has been asked to stop\n"
+            "\nExamples:\n"
+            "\nImport a private key\n" +
+            HelpExampleCli("importprivkey", "\"mykey\"") +
+            "\nAbort the running wallet rescan\n" + HelpExampleCli("abortrescan", "") +
+            "\nAs a JSON-RPC call\n" + HelpExampleRpc("abortrescan", ""));
+
+    if (!pwalletMain->IsScanning() || pwalletMain->IsAbortingRescan())
+        return false;
+    pwalletMain->AbortRescan();
+    return true;
+}
+
 UniValue importwallet(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -428,7 +428,7 @@ UniValue mnbudgetvote(const UniValue& params, bool fHelp)
             std::string strError = "";
             if (budget.UpdateProposal(vote, NULL, strError)) {
                 success++;
-                budget.mapSeenMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote));
+                budget.mapSeenMasternodeBudgetVotes.Insert(vote.GetHash(), vote);
                 vote.Relay();
                 statusObj.push_back(Pair("node", "local"));
                 statusObj.push_back(Pair("result", "success"));
@@ -451,6 +451,8 @@ UniValue mnbudgetvote(const UniValue& params, bool fHelp)
     }
 
     if (strCommand == "many") {
+        // Announced together once every entry voted
+        std::vector<CInv> vInvRelay;
         BOOST_FOREACH (CMasternodeConfig::CMasternodeEntry mne, masternodeConfig.getEntries()) {
             std::string errorMessage;
             std::vector<unsigned char> vchMasterNodeSignature;
@@ -494,8 +496,8 @@ UniValue mnbudgetvote(const UniValue& params, bool fHelp)
 
             std::string strError = "";
             if (budget.UpdateProposal(vote, NULL, strError)) {
-                budget.mapSeenMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote));
-                vote.Relay();
+                budget.mapSeenMasternodeBudgetVotes.Insert(vote.GetHash(), vote);
+                vInvRelay.push_back(CInv(MSG_BUDGET_VOTE, vote.GetHash()));
                 success++;
                 statusObj.push_back(Pair("node", mne.getAlias()));
                 statusObj.push_back(Pair("result", "success"));
@@ -509,6 +511,7 @@ UniValue mnbudgetvote(const UniValue& params, bool fHelp)
 
             resultsObj.push_back(statusObj);
         }
+        RelayInvs(vInvRelay);
 
         UniValue returnObj(UniValue::VOBJ);
         returnObj.push_back(Pair("overall", strprintf("Voted successfully %d time(s) and failed %d time(s).", success, failed)));
@@ -569,7 +572,7 @@ UniValue mnbudgetvote(const UniValue& params, bool fHelp)
 
             std::string strError = "";
             if(budget.UpdateProposal(vote, NULL, strError)) {
-                budget.mapSeenMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote));
+                budget.mapSeenMasternodeBudgetVotes.Insert(vote.GetHash(), vote);
                 vote.Relay();
                 success++;
                 statusObj.push_back(Pair("node", mne.getAlias()));
@@ -842,7 +845,7 @@ UniValue mnbudgetrawvote(const UniValue& params, bool fHelp)
 
     std::string strError = "";
     if (budget.UpdateProposal(vote, NULL, strError)) {
-        budget.mapSeenMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote));
+        budget.mapSeenMasternodeBudgetVotes.Insert(vote.GetHash(), vote);
         vote.Relay();
         return "Voted successfully";
     } else {
@@ -879,6 +882,8 @@ UniValue mnfinalbudget(const UniValue& params, bool fHelp)
 
         UniValue resultsObj(UniValue::VOBJ);
 
+        // Announced together once every entry voted
+        std::vector<CInv> vInvRelay;
         BOOST_FOREACH (CMasternodeConfig::CMasternodeEntry mne, masternodeConfig.getEntries()) {
             std::string errorMessage;
             std::vector<unsigned char> vchMasterNodeSignature;
@@ -920,8 +925,8 @@ UniValue mnfinalbudget(const UniValue& params, bool fHelp)
 
             std::string strError = "";
             if (budget.UpdateFinalizedBudget(vote, NULL, strError)) {
-                budget.mapSeenFinalizedBudgetVotes.insert(make_pair(vote.GetHash(), vote));
-                vote.Relay();
+                budget.mapSeenFinalizedBudgetVotes.Insert(vote.GetHash(), vote);
+                vInvRelay.push_back(CInv(MSG_BUDGET_FINALIZED_VOTE, vote.GetHash()));
                 success++;
                 statusObj.push_back(Pair("result", "success"));
             } else {
@@ -931,6 +936,7 @@ UniValue mnfinalbudget(const UniValue& params, bool fHelp)
 
             resultsObj.push_back(Pair(mne.getAlias(), statusObj));
         }
+        RelayInvs(vInvRelay);
 
         UniValue returnObj(UniValue::VOBJ);
         returnObj.push_back(Pair("overall", strprintf("Voted successfully %d time(s) and failed %d time(s).", success, failed)));
@@ -965,7 +971,7 @@ UniValue mnfinalbudget(const UniValue& params, bool fHelp)
 
         std::string strError = "";
         if (budget.UpdateFinalizedBudget(vote, NULL, strError)) {
-            budget.mapSeenFinalizedBudgetVotes.insert(make_pair(vote.GetHash(), vote));
+            budget.mapSeenFinalizedBudgetVotes.Insert(vote.GetHash(), vote);
             vote.Relay();
             return "success";
         } else {
@@ -8,6 +8,7 @@
 #include "init.h"
 #include "main.h"
 #include "masternode-budget.h"
+#include "masternode-list.h"
 #include "masternode-payments.h"
 #include "masternodeconfig.h"
 #include "masternodeman.h"
@@ -18,6 +19,8 @@
 
 #include <boost/tokenizer.hpp>
 #include <fstream>
+#include <limits>
+#include <set>
 
 
 void SendMoney(const CTxDestination& address, CAmount nValue, CWalletTx& wtxNew, AvailableCoinsType coin_type = ALL_COINS)
@@ -193,28 +196,39 @@ UniValue masternode(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+/** Fields of a listmasternodes entry, all of them unless options name some */
+static const char* const LIST_MASTERNODE_FIELDS[] = {"rank", "network", "txhash", "outidx", "status", "addr", "ip", "version", "lastseen", "activetime", "lastpaid"};
+
 UniValue listmasternodes(const UniValue& params, bool fHelp)
 {
-    std::string strFilter = "";
-
-    if (params.size() == 1) strFilter = params[0].get_str();
-
-    if (fHelp || (params.size() > 1))
+    if (fHelp || (params.size() > 2))
         throw runtime_error(
-            "listmasternodes ( \"filter\" )\n"
+            "listmasternodes ( \"filter\" {options} )\n"
             "\nGet a ranked list of masternodes\n"
 
             "\nArguments:\n"
             "1. \"filter\"    (string, optional) Filter search text. Partial match by txhash, status, or addr.\n"
+            "2. options     (object, optional) Applied before the list is built\n"
+            "  {\n"
+            "    \"status\": \"status\",    (string, optional) Only masternodes of this status (ENABLED/EXPIRED/...)\n"
+            "    \"payee\": \"addr\",       (string, optional) Only the masternode of this DTEM collateral address\n"
+            "    \"address\": \"ip\",       (string, optional) Only masternodes whose ip:port contains this\n"
+            "    \"protocol\": n,         (numeric, optional) Only masternodes of this protocol version\n"
+            "    \"fields\": [\"field\",...], (array, optional) Only these fields of each entry, all of them by default\n"
+            "    \"offset\": n,           (numeric, optional, default=0) Skip the first n matching masternodes\n"
+            "    \"count\": n             (numeric, optional) Return at most n masternodes\n"
+            "  }\n"
 
             "\nResult:\n"
             "[\n"
             "  {\n"
             "    \"rank\": n,           (numeric) Masternode Rank (or 0 if not enabled)\n"
+            "    \"network\": \"net\",    (string) Network of the masternode address (ipv4/ipv6/onion)\n"
             "    \"txhash\": \"hash\",    (string) Collateral transaction hash\n"
             "    \"outidx\": n,         (numeric) Collateral transaction output index\n"
             "    \"status\": s,         (string) Status (ENABLED/EXPIRED/REMOVE/etc)\n"
             "    \"addr\": \"addr\",      (string) Masternode DTEM address\n"
+            "    \"ip\": \"ip:port\",     (string) Masternode network address\n"
             "    \"version\": v,        (numeric) Masternode protocol version\n"
             "    \"lastseen\": ttt,     (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last seen\n"
             "    \"activetime\": ttt,   (numeric) The time in seconds since epoch (Jan 1 1970 GMT) masternode has been active\n"
@@ -223,7 +237,54 @@ UniValue listmasternodes(const UniValue& params, bool fHelp)
             "  ,...\n"
             "]\n"
             "\nExamples:\n" +
-            HelpExampleCli("masternodelist", "") + HelpExampleRpc("masternodelist", ""));
+            HelpExampleCli("listmasternodes", "") + HelpExampleCli("listmasternodes", "\"\" '{\"status\":\"ENABLED\",\"fields\":[\"txhash\",\"outidx\"],\"count\":100}'") +
+            HelpExampleRpc("listmasternodes", "\"\", {\"status\":\"ENABLED\",\"offset\":100,\"count\":100}"));
+
+    CMasternodeListFilter filter;
+    if (params.size() > 0)
+        filter.strText = params[0].get_str();
+
+    std::set<std::string> setFields(LIST_MASTERNODE_FIELDS, LIST_MASTERNODE_FIELDS + ARRAYLEN(LIST_MASTERNODE_FIELDS));
+    size_t nSkip = 0;
+    size_t nCount = std::numeric_limits<size_t>::max();
+    if (params.size() > 1) {
+        const UniValue& options = params[1].get_obj();
+        if (options.exists("status"))
+            filter.strStatus = find_value(options, "status").get_str();
+        if (options.exists("payee")) {
+            CBitcoinAddress address(find_value(options, "payee").get_str());
+            if (!address.GetKeyID(filter.payee))
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid payee address");
+            filter.fPayee = true;
+        }
+        if (options.exists("address"))
+            filter.strAddr = find_value(options, "address").get_str();
+        if (options.exists("protocol"))
+            filter.nProtocol = find_value(options, "protocol").get_int();
+        if (options.exists("fields")) {
+            const UniValue& fields = find_value(options, "fields").get_array();
+            std::set<std::string> setKnown;
+            setKnown.swap(setFields);
+            for (unsigned int i = 0; i < fields.size(); i++) {
+                if (!setKnown.count(fields[i].get_str()))
+                    throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown field " + fields[i].get_str());
+                setFields.insert(fields[i].get_str());
+            }
+        }
+        if (options.exists("offset")) {
+            int nOffset = find_value(options, "offset").get_int();
+            if (nOffset < 0)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative offset");
+            nSkip = nOffset;
+        }
+        if (options.exists("count")) {
+            int nCountIn = find_value(options, "count").get_int();
+            if (nCountIn < 0)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
+            nCount = nCountIn;
+        }
+    }
+    filter.fLastPaid = setFields.count("lastpaid");
 
     UniValue ret(UniValue::VARR);
     int nHeight;
@@ -233,40 +294,34 @@ UniValue listmasternodes(const UniValue& params, bool fHelp)
         if(!pindex) return 0;
         nHeight = pindex->nHeight;
     }
-    std::vector<pair<int, CMasternode> > vMasternodeRanks = mnodeman.GetMasternodeRanks(nHeight);
-    BOOST_FOREACH (PAIRTYPE(int, CMasternode) & s, vMasternodeRanks) {
+    std::vector<CMasternodeListEntry> vEntries;
+    mnodeman.GetMasternodeList(nHeight, filter, nSkip, nCount, vEntries);
+    BOOST_FOREACH (const CMasternodeListEntry& entry, vEntries) {
         UniValue obj(UniValue::VOBJ);
-        std::string strVin = s.second.vin.prevout.ToStringShort();
-        std::string strTxHash = s.second.vin.prevout.hash.ToString();
-        uint32_t oIdx = s.second.vin.prevout.n;
-
-        CMasternode* mn = mnodeman.Find(s.second.vin);
-
-        if (mn != NULL) {
-            if (strFilter != "" && strTxHash.find(strFilter) == string::npos &&
-                mn->Status().find(strFilter) == string::npos &&
-                CBitcoinAddress(mn->pubKeyCollateralAddress.GetID()).ToString().find(strFilter) == string::npos) continue;
-
-            std::string strStatus = mn->Status();
-            std::string strHost;
-            int port;
-            SplitHostPort(mn->addr.ToString(), port, strHost);
-            CNetAddr node = CNetAddr(strHost, false);
-            std::string strNetwork = GetNetworkName(node.GetNetwork());
-
-            obj.push_back(Pair("rank", (strStatus == "ENABLED" ? s.first : 0)));
-            obj.push_back(Pair("network", strNetwork));
-            obj.push_back(Pair("txhash", strTxHash));
-            obj.push_back(Pair("outidx", (uint64_t)oIdx));
-            obj.push_back(Pair("status", strStatus));
-            obj.push_back(Pair("addr", CBitcoinAddress(mn->pubKeyCollateralAddress.GetID()).ToString()));
-            obj.push_back(Pair("version", mn->protocolVersion));
-            obj.push_back(Pair("lastseen", (int64_t)mn->lastPing.sigTime));
-            obj.push_back(Pair("activetime", (int64_t)(mn->lastPing.sigTime - mn->sigTime)));
-            obj.push_back(Pair("lastpaid", (int64_t)mn->GetLastPaid()));
+        if (setFields.count("rank"))
+            obj.push_back(Pair("rank", entry.nRank));
+        if (setFields.count("network"))
+            obj.push_back(Pair("network", GetNetworkName(entry.addr.GetNetwork())));
+        if (setFields.count("txhash"))
+            obj.push_back(Pair("txhash", entry.vin.prevout.hash.ToString()));
+        if (setFields.count("outidx"))
+            obj.push_back(Pair("outidx", (uint64_t)entry.vin.prevout.n));
+        if (setFields.count("status"))
+            obj.push_back(Pair("status", entry.strStatus));
+        if (setFields.count("addr"))
+            obj.push_back(Pair("addr", CBitcoinAddress(entry.payee).ToString()));
+        if (setFields.count("ip"))
+            obj.push_back(Pair("ip", entry.addr.ToString()));
+        if (setFields.count("version"))
+            obj.push_back(Pair("version", entry.protocolVersion));
+        if (setFields.count("lastseen"))
+            obj.push_back(Pair("lastseen", entry.nLastSeen));
+        if (setFields.count("activetime"))
+            obj.push_back(Pair("activetime", entry.nActiveTime));
+        if (setFields.count("lastpaid"))
+            obj.push_back(Pair("lastpaid", entry.nLastPaid));
 
-            ret.push_back(obj);
-        }
+        ret.push_back(obj);
     }
 
     return ret;
@@ -315,22 +370,23 @@ UniValue getmasternodecount (const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("getmasternodecount", "") + HelpExampleRpc("getmasternodecount", ""));
 
-    UniValue obj(UniValue::VOBJ);
-    int nCount = 0;
-    int ipv4 = 0, ipv6 = 0, onion = 0;
-
-    if (chainActive.Tip())
-        mnodeman.GetNextMasternodeInQueueForPayment(chainActive.Tip()->nHeight, true, nCount);
-
-    mnodeman.CountNetworks(ActiveProtocol(), ipv4, ipv6, onion);
+    // The masternode thread counts again on every new block, only count here
+    // if this call came first
+    int nHeight = GetChainTipSnapshot().nHeight;
+    CMasternodeCountSnapshot counts = mnodeman.GetCountSnapshot();
+    if (counts.nHeight != nHeight) {
+        mnodeman.UpdateCountSnapshot(nHeight);
+        counts = mnodeman.GetCountSnapshot();
+    }
 
-    obj.push_back(Pair("total", mnodeman.size()));
-    obj.push_back(Pair("stable", mnodeman.stable_size()));
-    obj.push_back(Pair("enabled", mnodeman.CountEnabled()));
-    obj.push_back(Pair("inqueue", nCount));
-    obj.push_back(Pair("ipv4", ipv4));
-    obj.push_back(Pair("ipv6", ipv6));
-    obj.push_back(Pair("onion", onion));
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("total", counts.nTotal));
+    obj.push_back(Pair("stable", counts.nStable));
+    obj.push_back(Pair("enabled", counts.nEnabled));
+    obj.push_back(Pair("inqueue", counts.nInQueue));
+    obj.push_back(Pair("ipv4", counts.nIPv4));
+    obj.push_back(Pair("ipv6", counts.nIPv6));
+    obj.push_back(Pair("onion", counts.nOnion));
 
     return obj;
 }
@@ -384,7 +440,7 @@ UniValue masternodedebug (const UniValue& params, bool fHelp)
         return activeMasternode.GetStatus();
 
     CTxIn vin = CTxIn();
-    CPubKey pubkey = CScript();
+    CPubKey pubkey;
     CKey key;
     if (!activeMasternode.GetMasterNodeVin(vin, pubkey, key))
         throw runtime_error("Missing masternode input, please look at the documentation for instructions on masternode creation\n");
@@ -473,6 +529,13 @@ UniValue startmasternode (const UniValue& params, bool fHelp)
 
         UniValue resultsObj(UniValue::VARR);
 
+        // The collaterals are found with one pass over the wallet for all the
+        // entries, and the broadcasts are announced together at the end
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        MasternodeCollateralMap mapCollaterals;
+        pwalletMain->GetMasternodeCollaterals(mapCollaterals);
+        std::vector<CInv> vInvRelay;
+
         BOOST_FOREACH (CMasternodeConfig::CMasternodeEntry mne, masternodeConfig.getEntries()) {
             std::string errorMessage;
             int nIndex;
@@ -486,7 +549,7 @@ UniValue startmasternode (const UniValue& params, bool fHelp)
                 if (strCommand == "disabled" && pmn->IsEnabled()) continue;
             }
 
-            bool result = activeMasternode.Register(mne.getIp(), mne.getPrivKey(), mne.getTxHash(), mne.getOutputIndex(), errorMessage);
+            bool result = activeMasternode.Register(mne.getIp(), mne.getPrivKey(), mne.getTxHash(), mne.getOutputIndex(), mapCollaterals, vInvRelay, errorMessage);
 
             UniValue statusObj(UniValue::VOBJ);
             statusObj.push_back(Pair("alias", mne.getAlias()));
@@ -502,6 +565,7 @@ UniValue startmasternode (const UniValue& params, bool fHelp)
 
             resultsObj.push_back(statusObj);
         }
+        RelayInvs(vInvRelay);
         if (fLock)
             pwalletMain->Lock();
 
@@ -864,3 +928,116 @@ UniValue getmasternodescores (const UniValue& params, bool fHelp)
 
     return obj;
 }
+
+UniValue listregisteredmasternodes(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "listregisteredmasternodes\n"
+            "\nList the masternodes registered on chain, the next paid first\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"txhash\": \"xxxx\",         (string) collateral transaction hash\n"
+            "    \"outputidx\": n,           (numeric) collateral output index\n"
+            "    \"payee\": \"xxxx\",          (string) address the masternode is paid to\n"
+            "    \"addr\": \"xxxx\",           (string) where the masternode is reached\n"
+            "    \"operatorpubkey\": \"xxxx\", (string) key the masternode signs with\n"
+            "    \"registeredheight\": n,    (numeric) height of the registration\n"
+            "    \"lastpaidheight\": n,      (numeric) height last paid at, 0 if never\n"
+            "    \"rank\": n                 (numeric) rank by score for the tip\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("listregisteredmasternodes", "") + HelpExampleRpc("listregisteredmasternodes", ""));
+
+    uint256 hashTip;
+    {
+        LOCK(cs_main);
+        hashTip = chainActive.Tip()->GetBlockHash();
+    }
+    std::vector<std::pair<uint256, CDeterministicMasternode> > vRanks;
+    deterministicMasternodes.GetRanks(hashTip, vRanks);
+    std::map<COutPoint, int> mapRank;
+    for (unsigned int i = 0; i < vRanks.size(); i++)
+        mapRank[vRanks[i].second.collateral] = i + 1;
+
+    UniValue ret(UniValue::VARR);
+    BOOST_FOREACH (const CDeterministicMasternode& mn, deterministicMasternodes.GetAll()) {
+        CTxDestination dest;
+        ExtractDestination(mn.payee, dest);
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("txhash", mn.collateral.hash.ToString()));
+        obj.push_back(Pair("outputidx", (int)mn.collateral.n));
+        obj.push_back(Pair("payee", CBitcoinAddress(dest).ToString()));
+        obj.push_back(Pair("addr", mn.addr.ToString()));
+        obj.push_back(Pair("operatorpubkey", HexStr(mn.pubKeyOperator)));
+        obj.push_back(Pair("registeredheight", mn.nRegisteredHeight));
+        obj.push_back(Pair("lastpaidheight", mn.nLastPaidHeight));
+        obj.push_back(Pair("rank", mapRank[mn.collateral]));
+        ret.push_back(obj);
+    }
+
+    return ret;
+}
+
+UniValue registermasternode(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "registermasternode \"addr\" \"operatorpubkey\"\n"
+            "\nSend the collateral of a masternode to a new address of the wallet, registering it on chain.\n"
+            "Spending the collateral unregisters the masternode.\n"
+
+            "\nArguments:\n"
+            "1. \"addr\"            (string, required) IP:port the masternode is reached at\n"
+            "2. \"operatorpubkey\"  (string, required) hex public key the masternode signs with\n"
+
+            "\nResult:\n"
+            "\"transactionid\"      (string) the registration transaction id\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("registermasternode", "\"1.2.3.4:65444\" \"02ab...\"") + HelpExampleRpc("registermasternode", "\"1.2.3.4:65444\", \"02ab...\""));
+
+    CService addr;
+    if (!Lookup(params[0].get_str().c_str(), addr, Params().GetDefaultPort(), false) || !addr.IsValid())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid masternode address");
+    CPubKey pubKeyOperator(ParseHexV(params[1], "operatorpubkey"));
+    if (!pubKeyOperator.IsFullyValid())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid operator public key");
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    EnsureWalletIsUnlocked();
+
+    CDeterministicMasternode mnOther;
+    if (deterministicMasternodes.GetByOperator(pubKeyOperator.GetID(), mnOther))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "The operator key is registered already");
+
+    pwalletMain->TopUpKeyPool();
+    CPubKey newKey;
+    if (!pwalletMain->GetKeyFromPool(newKey))
+        throw JSONRPCError(RPC_WALLET_KEYPOOL_RAN_OUT, "Error: Keypool ran out, please call keypoolrefill first");
+    pwalletMain->SetAddressBook(newKey.GetID(), "masternode", "receive");
+
+    CMasternodeRegistration reg(addr, pubKeyOperator);
+    std::vector<std::pair<CScript, CAmount> > vecSend;
+    vecSend.push_back(std::make_pair(GetScriptForDestination(newKey.GetID()), MASTERNODE_COLLATERAL));
+    vecSend.push_back(std::make_pair(reg.GetScript(), 0));
+
+    CWalletTx wtx;
+    CReserveKey reservekey(pwalletMain);
+    CAmount nFeeRequired;
+    std::string strError;
+    if (!pwalletMain->CreateTransaction(vecSend, wtx, reservekey, nFeeRequired, strError))
+        throw JSONRPCError(RPC_WALLET_ERROR, strError);
+    unsigned int nCollateral;
+    if (!CMasternodeRegistration::FromTransaction(wtx, reg, nCollateral) || wtx.vout[nCollateral].scriptPubKey != vecSend[0].first)
+        throw JSONRPCError(RPC_WALLET_ERROR, "The transaction has change worth a collateral, send it to another address first");
+    if (!pwalletMain->CommitTransaction(wtx, reservekey))
+        throw JSONRPCError(RPC_WALLET_ERROR, "Error: The transaction was rejected!");
+
+    return wtx.GetHash().GetHex();
+}
@@ -8,20 +8,30 @@
 #include "base58.h"
 #include "clientversion.h"
 #include "init.h"
+#include "largepages.h"
 #include "main.h"
+#include "masternode-budget.h"
+#include "masternode-payments.h"
 #include "masternode-sync.h"
+#include "masternodeman.h"
 #include "net.h"
 #include "netbase.h"
+#include "profiler.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
+#include "swifttx.h"
 #include "timedata.h"
+#include "txmempool.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
 #include "walletdb.h"
 #endif
 
+#include <algorithm>
 #include <stdint.h>
 
+#include <boost/algorithm/string.hpp>
 #include <boost/assign/list_of.hpp>
 
 #include <univalue.h>
@@ -287,7 +297,7 @@ UniValue validateaddress(const UniValue& params, bool fHelp)
         string currentAddress = address.ToString();
         ret.push_back(Pair("address", currentAddress));
 #ifdef ENABLE_WALLET
-        isminetype mine = pwalletMain ? IsMine(*pwalletMain, dest) : ISMINE_NO;
+        isminetype mine = pwalletMain ? pwalletMain->IsMine(dest) : ISMINE_NO;
         ret.push_back(Pair("ismine", (mine & ISMINE_SPENDABLE) ? true : false));
         if (mine != ISMINE_NO) {
             ret.push_back(Pair("iswatchonly", (mine & ISMINE_WATCH_ONLY) ? true : false));
@@ -472,6 +482,388 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
     return NullUniValue;
 }
 
+UniValue getlockstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getlockstats ( reset )\n"
+            "\nReturns the wait and hold times recorded for each lock site with -lockstats, the longest total wait first.\n"
+            "\nArguments:\n"
+            "1. reset    (boolean, optional, default=false) Clear the recorded times after returning them\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,    (boolean) whether -lockstats is on\n"
+            "  \"sites\": [\n"
+            "    {\n"
+            "      \"lock\": \"name\",         (string) the lock, as named at the site\n"
+            "      \"site\": \"file:line\",    (string) where it is taken\n"
+            "      \"locks\": n,             (numeric) times it was taken\n"
+            "      \"contended\": n,         (numeric) times another thread held it\n"
+            "      \"tryfailed\": n,         (numeric) TRY_LOCKs that did not get it\n"
+            "      \"waittotal\": n,         (numeric) microseconds spent waiting for it\n"
+            "      \"waitmax\": n,           (numeric) longest wait in microseconds\n"
+            "      \"holdtotal\": n,         (numeric) microseconds it was held\n"
+            "      \"holdmax\": n            (numeric) longest hold in microseconds\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getlockstats", "") + HelpExampleCli("getlockstats", "true") + HelpExampleRpc("getlockstats", ""));
+
+    std::vector<CLockStats> vStats = GetLockStats();
+    if (params.size() > 0 && params[0].get_bool())
+        ResetLockStats();
+
+    UniValue sites(UniValue::VARR);
+    BOOST_FOREACH (const CLockStats& stats, vStats) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("lock", stats.strName));
+        obj.push_back(Pair("site", strprintf("%s:%d", stats.strFile, stats.nLine)));
+        obj.push_back(Pair("locks", stats.nLocks));
+        obj.push_back(Pair("contended", stats.nContended));
+        obj.push_back(Pair("tryfailed", stats.nTryFailed));
+        obj.push_back(Pair("waittotal", stats.nWaitTotal));
+        obj.push_back(Pair("waitmax", stats.nWaitMax));
+        obj.push_back(Pair("holdtotal", stats.nHoldTotal));
+        obj.push_back(Pair("holdmax", stats.nHoldMax));
+        sites.push_back(obj);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("enabled", fLockStats));
+    result.push_back(Pair("sites", sites));
+    return result;
+}
+
+UniValue startprofile(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "startprofile ( frequency \"threads\" )\n"
+            "\nStarts sampling the stacks of the node's threads, until stopprofile writes them out.\n"
+            "Threads are sampled whether running or waiting, so the profile shows where they block too.\n"
+            "\nArguments:\n"
+            "1. frequency    (numeric, optional, default=" + itostr(DEFAULT_PROFILE_FREQUENCY) + ") Samples a second of each thread, at most " + itostr(MAX_PROFILE_FREQUENCY) + "\n"
+            "2. \"threads\"    (string, optional) Comma separated thread names to sample, e.g. \"msghand,httpworker\", all when omitted\n"
+            "\nExamples:\n" +
+            HelpExampleCli("startprofile", "") + HelpExampleCli("startprofile", "199 \"msghand,scriptch\"") + HelpExampleRpc("startprofile", "99"));
+
+    int nFrequency = params.size() > 0 ? params[0].get_int() : DEFAULT_PROFILE_FREQUENCY;
+    std::set<std::string> setThreads;
+    if (params.size() > 1) {
+        std::vector<std::string> vThreads;
+        boost::split(vThreads, params[1].get_str(), boost::is_any_of(","));
+        BOOST_FOREACH (const std::string& strThread, vThreads) {
+            if (!strThread.empty())
+                setThreads.insert(strThread);
+        }
+    }
+
+    std::string strError;
+    if (!StartProfiler(nFrequency, setThreads, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot start the profiler: " + strError);
+    return NullUniValue;
+}
+
+UniValue stopprofile(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "stopprofile\n"
+            "\nStops the profiler started by startprofile and writes the sampled stacks to the data directory,\n"
+            "one line per stack in the collapsed format flamegraph.pl reads.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"file\": \"path\",     (string) where the stacks were written\n"
+            "  \"duration\": n,      (numeric) microseconds the profiler ran\n"
+            "  \"samples\": n,       (numeric) stacks sampled\n"
+            "  \"dropped\": n,       (numeric) samples lost, to threads that did not answer in time or too many distinct stacks\n"
+            "  \"stacks\": n         (numeric) distinct stacks written\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("stopprofile", "") + HelpExampleRpc("stopprofile", ""));
+
+    boost::filesystem::path path = GetDataDir() / strprintf("profile-%s.folded", DateTimeStrFormat("%Y%m%d-%H%M%S", GetTime()));
+    CProfileResult profile;
+    std::string strError;
+    if (!StopProfiler(path, profile, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot stop the profiler: " + strError);
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("file", profile.path.string()));
+    result.push_back(Pair("duration", profile.nDuration));
+    result.push_back(Pair("samples", profile.nSamples));
+    result.push_back(Pair("dropped", profile.nDropped));
+    result.push_back(Pair("stacks", (uint64_t)profile.nStacks));
+    return result;
+}
+
+/** Adds the sizes as a group of result, with their total, and returns the total */
+static size_t PushMemoryUsage(UniValue& result, const std::string& strGroup, const std::map<std::string, size_t>& mapUsage)
+{
+    UniValue group(UniValue::VOBJ);
+    size_t nTotal = 0;
+    for (std::map<std::string, size_t>::const_iterator it = mapUsage.begin(); it != mapUsage.end(); ++it) {
+        group.push_back(Pair(it->first, (uint64_t)it->second));
+        nTotal += it->second;
+    }
+    group.push_back(Pair("total", (uint64_t)nTotal));
+    result.push_back(Pair(strGroup, group));
+    return nTotal;
+}
+
+UniValue getmemoryinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmemoryinfo\n"
+            "\nReturns the estimated heap memory, in bytes, of the larger in-memory structures, by subsystem.\n"
+            "The estimates count the allocations of the containers and what their entries own, not allocator fragmentation.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {           (object) the block index, the coins cache and the orphan transactions\n"
+            "    \"mapBlockIndex\": n,     (numeric) bytes used by the structure\n"
+            "    ...\n"
+            "    \"total\": n              (numeric) bytes used by the subsystem\n"
+            "  },\n"
+            "  \"mempool\": {...},         (object) the transactions in the mempool\n"
+            "  \"sigcache\": {...},        (object) the signature cache\n"
+            "  \"relay\": {...},           (object) the messages kept to answer getdata\n"
+            "  \"masternodes\": {...},     (object) the masternode list and the broadcasts and pings seen\n"
+            "  \"payments\": {...},        (object) the masternode payment votes\n"
+            "  \"budget\": {...},          (object) the proposals, the finalized budgets and their votes\n"
+            "  \"swifttx\": {...},         (object) the transaction lock requests, votes and locks\n"
+            "  \"total\": n,               (numeric) bytes used by all of the above\n"
+            "  \"locked\": {              (object) the locked memory pool of keys and other secrets, not in total\n"
+            "    \"used\": n,             (numeric) bytes of the blocks in use\n"
+            "    \"free\": n,             (numeric) bytes free in the pool\n"
+            "    \"total\": n,            (numeric) bytes of the pool\n"
+            "    \"locked\": n,           (numeric) bytes of the pool the system locked, less than total if it refused to\n"
+            "    \"chunks_used\": n,      (numeric) blocks in use\n"
+            "    \"chunks_free\": n       (numeric) blocks free for reuse\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getmemoryinfo", "") + HelpExampleRpc("getmemoryinfo", ""));
+
+    // Each subsystem is measured under its own locks, one after the other
+    std::map<std::string, size_t> mapChainstate, mapSwiftTX;
+    {
+        LOCK(cs_main);
+        GetChainstateMemoryUsage(mapChainstate);
+        GetSwiftTXMemoryUsage(mapSwiftTX);
+    }
+
+    std::map<std::string, size_t> mapMempool;
+    mapMempool["mapTx"] = mempool.DynamicMemoryUsage();
+
+    std::map<std::string, size_t> mapSigCache;
+    size_t nEntries, nBytes;
+    GetSignatureCacheStats(nEntries, nBytes);
+    mapSigCache["CSignatureCache"] = nBytes;
+
+    std::map<std::string, size_t> mapRelay, mapMasternodes, mapPayments, mapBudget;
+    GetRelayMemoryUsage(mapRelay);
+    mnodeman.GetMemoryUsage(mapMasternodes);
+    masternodePayments.GetMemoryUsage(mapPayments);
+    budget.GetMemoryUsage(mapBudget);
+
+    UniValue result(UniValue::VOBJ);
+    size_t nTotal = PushMemoryUsage(result, "chainstate", mapChainstate);
+    nTotal += PushMemoryUsage(result, "mempool", mapMempool);
+    nTotal += PushMemoryUsage(result, "sigcache", mapSigCache);
+    nTotal += PushMemoryUsage(result, "relay", mapRelay);
+    nTotal += PushMemoryUsage(result, "masternodes", mapMasternodes);
+    nTotal += PushMemoryUsage(result, "payments", mapPayments);
+    nTotal += PushMemoryUsage(result, "budget", mapBudget);
+    nTotal += PushMemoryUsage(result, "swifttx", mapSwiftTX);
+    result.push_back(Pair("total", (uint64_t)nTotal));
+
+    LockedPool::Stats stats = LockedPool::Instance().GetStats();
+    UniValue locked(UniValue::VOBJ);
+    locked.push_back(Pair("used", (uint64_t)stats.used));
+    locked.push_back(Pair("free", (uint64_t)stats.free));
+    locked.push_back(Pair("total", (uint64_t)stats.total));
+    locked.push_back(Pair("locked", (uint64_t)stats.locked));
+    locked.push_back(Pair("chunks_used", (uint64_t)stats.chunks_used));
+    locked.push_back(Pair("chunks_free", (uint64_t)stats.chunks_free));
+    result.push_back(Pair("locked", locked));
+    return result;
+}
+
+UniValue getlargepageinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getlargepageinfo\n"
+            "\nReturns the huge pages the coins cache and the signature cache got with -largepages.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"mode\": \"xxx\",              (string) off, transparent or hugetlb\n"
+            "  \"hugetlb\": n,                 (numeric) bytes mapped from reserved huge pages\n"
+            "  \"transparent\": n,             (numeric) bytes mapped with MADV_HUGEPAGE, backed by huge pages as the kernel finds them\n"
+            "  \"fallback\": n,                (numeric) bytes of large allocations that got ordinary memory\n"
+            "  \"hugetlbfailures\": n,         (numeric) times no reserved huge page was left\n"
+            "  \"anonhugepages\": n,           (numeric, optional) bytes of the process on transparent huge pages, as the kernel reports them\n"
+            "  \"transparentsetting\": \"xxx\" (string, optional) the system setting of transparent huge pages\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getlargepageinfo", "") + HelpExampleRpc("getlargepageinfo", ""));
+
+    CLargePageStats stats;
+    GetLargePageStats(stats);
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("mode", LargePageModeName(stats.mode)));
+    result.push_back(Pair("hugetlb", (uint64_t)stats.nHugeTLBBytes));
+    result.push_back(Pair("transparent", (uint64_t)stats.nTransparentBytes));
+    result.push_back(Pair("fallback", (uint64_t)stats.nFallbackBytes));
+    result.push_back(Pair("hugetlbfailures", stats.nHugeTLBFailures));
+    if (stats.nAnonHugePages >= 0)
+        result.push_back(Pair("anonhugepages", stats.nAnonHugePages));
+    if (!stats.strTransparentSetting.empty())
+        result.push_back(Pair("transparentsetting", stats.strTransparentSetting));
+    return result;
+}
+
+static bool GetAddressIndexKey(const CBitcoinAddress& address, uint160& hashBytes, int& type)
+{
+    CTxDestination dest = address.Get();
+    if (const CKeyID* keyID = boost::get<CKeyID>(&dest)) {
+        hashBytes = *keyID;
+        type = ADDRESS_INDEX_PUBKEYHASH;
+        return true;
+    }
+    if (const CScriptID* scriptID = boost::get<CScriptID>(&dest)) {
+        hashBytes = *scriptID;
+        type = ADDRESS_INDEX_SCRIPTHASH;
+        return true;
+    }
+    return false;
+}
+
+static std::string GetAddressIndexString(int type, const uint160& hashBytes)
+{
+    if (type == ADDRESS_INDEX_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hashBytes)).ToString();
+    return CBitcoinAddress(CKeyID(hashBytes)).ToString();
+}
+
+/** The addresses of an RPC argument that is either an address or an object {"addresses": [...]} */
+static std::vector<std::pair<uint160, int> > ParseAddressIndexArgument(const UniValue& param)
+{
+    std::vector<UniValue> vValues;
+    if (param.isStr()) {
+        vValues.push_back(param);
+    } else if (param.isObject()) {
+        UniValue addresses = find_value(param.get_obj(), "addresses");
+        if (!addresses.isArray())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Addresses is expected to be an array");
+        vValues = addresses.getValues();
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an address or an object with addresses");
+    }
+
+    std::vector<std::pair<uint160, int> > vAddresses;
+    for (std::vector<UniValue>::const_iterator it = vValues.begin(); it != vValues.end(); ++it) {
+        uint160 hashBytes;
+        int type = ADDRESS_INDEX_NONE;
+        if (!it->isStr() || !GetAddressIndexKey(CBitcoinAddress(it->get_str()), hashBytes, type))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
+        vAddresses.push_back(std::make_pair(hashBytes, type));
+    }
+    return vAddresses;
+}
+
+UniValue getaddressbalance(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance \"address\"|{\"addresses\": [\"address\",...]}\n"
+            "\nReturns the balance of one or more addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"        (string) The address, or an object with an array of addresses\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\": n,     (numeric) The current balance in satoshis\n"
+            "  \"received\": n     (numeric) The total number of satoshis received, including change\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}'") +
+            HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}"));
+
+    std::vector<std::pair<uint160, int> > vAddresses = ParseAddressIndexArgument(params[0]);
+
+    CAmount nBalance = 0;
+    CAmount nReceived = 0;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); ++it) {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+        if (!GetAddressIndex(it->first, it->second, vAddressIndex))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator itIndex = vAddressIndex.begin(); itIndex != vAddressIndex.end(); ++itIndex) {
+            if (itIndex->second > 0)
+                nReceived += itIndex->second;
+            nBalance += itIndex->second;
+        }
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("balance", nBalance));
+    result.push_back(Pair("received", nReceived));
+    return result;
+}
+
+static bool CompareUnspentHeight(const std::pair<CAddressUnspentKey, CAddressUnspentValue>& a, const std::pair<CAddressUnspentKey, CAddressUnspentValue>& b)
+{
+    return a.second.nBlockHeight < b.second.nBlockHeight;
+}
+
+UniValue getaddressutxos(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos \"address\"|{\"addresses\": [\"address\",...]}\n"
+            "\nReturns the unspent outputs of one or more addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"        (string) The address, or an object with an array of addresses\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\": \"address\", (string) The address\n"
+            "    \"txid\": \"hash\",       (string) The transaction id\n"
+            "    \"outputIndex\": n,     (numeric) The index of the output\n"
+            "    \"script\": \"hex\",      (string) The script hex encoded\n"
+            "    \"satoshis\": n,        (numeric) The value of the output in satoshis\n"
+            "    \"height\": n           (numeric) The height of the block with the output\n"
+            "  },...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}'") +
+            HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"DMJRSsuU9zfyrvxVaAEFQqK4MxZg6vgeS6\"]}"));
+
+    std::vector<std::pair<uint160, int> > vAddresses = ParseAddressIndexArgument(params[0]);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    for (std::vector<std::pair<uint160, int> >::const_iterator it = vAddresses.begin(); it != vAddresses.end(); ++it) {
+        if (!GetAddressUnspent(it->first, it->second, vUnspent))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    }
+    std::stable_sort(vUnspent.begin(), vUnspent.end(), CompareUnspentHeight);
+
+    UniValue result(UniValue::VARR);
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = vUnspent.begin(); it != vUnspent.end(); ++it) {
+        UniValue output(UniValue::VOBJ);
+        output.push_back(Pair("address", GetAddressIndexString(it->first.type, it->first.hashBytes)));
+        output.push_back(Pair("txid", it->first.txhash.GetHex()));
+        output.push_back(Pair("outputIndex", (int)it->first.nIndex));
+        output.push_back(Pair("script", HexStr(it->second.script.begin(), it->second.script.end())));
+        output.push_back(Pair("satoshis", it->second.nValue));
+        output.push_back(Pair("height", it->second.nBlockHeight));
+        result.push_back(output);
+    }
+    return result;
+}
+
 #ifdef ENABLE_WALLET
 UniValue getstakingstatus(const UniValue& params, bool fHelp)
 {
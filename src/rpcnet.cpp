@@ -7,6 +7,7 @@
 #include "rpcserver.h"
 
 #include "clientversion.h"
+#include "httpserver.h"
 #include "main.h"
 #include "net.h"
 #include "netbase.h"
@@ -34,7 +35,7 @@ UniValue getconnectioncount(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("getconnectioncount", "") + HelpExampleRpc("getconnectioncount", ""));
 
-    LOCK2(cs_main, cs_vNodes);
+    LOCK(cs_vNodes);
 
     return (int)vNodes.size();
 }
@@ -73,6 +74,22 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static UniValue MsgStatsToJSON(const mapMsgCmdStats& mapStats)
+{
+    UniValue obj(UniValue::VOBJ);
+    for (mapMsgCmdStats::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        const CNetMsgStats& stats = it->second;
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("msgssent", stats.nMsgsSent));
+        entry.push_back(Pair("bytessent", stats.nBytesSent));
+        entry.push_back(Pair("msgsrecv", stats.nMsgsRecv));
+        entry.push_back(Pair("bytesrecv", stats.nBytesRecv));
+        entry.push_back(Pair("processtime", stats.nProcessTime));
+        obj.push_back(Pair(it->first, entry));
+    }
+    return obj;
+}
+
 UniValue getpeerinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -104,7 +121,12 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"msgstats\": {             (json object) Traffic per message command, as in getnetmsgstats\n"
+            "       \"command\": { ... },\n"
+            "       ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -154,6 +176,7 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             obj.push_back(Pair("inflight", heights));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("msgstats", MsgStatsToJSON(stats.mapMsgStats)));
 
         ret.push_back(obj);
     }
@@ -341,7 +364,15 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadtarget\": {\n"
+            "    \"timeframe\": n,               (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                  (numeric) Target in bytes\n"
+            "    \"target_reached\": true|false, (boolean) True if target is reached\n"
+            "    \"serve_historical_blocks\": true|false, (boolean) True if serving historical blocks\n"
+            "    \"bytes_left_in_cycle\": t,     (numeric) Bytes left in current time cycle\n"
+            "    \"time_left_in_cycle\": t       (numeric) Seconds left in current time cycle\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getnettotals", "") + HelpExampleRpc("getnettotals", ""));
@@ -350,9 +381,88 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    UniValue outboundLimit(UniValue::VOBJ);
+    outboundLimit.push_back(Pair("timeframe", MAX_UPLOAD_TIMEFRAME));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
     return obj;
 }
 
+UniValue getnetmsgstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getnetmsgstats ( reset )\n"
+            "\nReturns the messages sent and received for each message command, summed over all peers\n"
+            "since startup or the last reset. Commands this node does not know are counted as \"*other*\".\n"
+            "\nArguments:\n"
+            "1. reset    (boolean, optional, default=false) Clear the counters after returning them\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {\n"
+            "    \"msgssent\": n,      (numeric) Messages sent\n"
+            "    \"bytessent\": n,     (numeric) Bytes sent, headers included\n"
+            "    \"msgsrecv\": n,      (numeric) Messages received and processed\n"
+            "    \"bytesrecv\": n,     (numeric) Bytes received, headers included\n"
+            "    \"processtime\": n    (numeric) Time spent processing the received messages, in microseconds\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getnetmsgstats", "") + HelpExampleCli("getnetmsgstats", "true") + HelpExampleRpc("getnetmsgstats", ""));
+
+    mapMsgCmdStats mapStats;
+    CNode::GetTotalMsgStats(mapStats);
+    if (params.size() > 0 && params[0].get_bool())
+        CNode::ResetTotalMsgStats();
+    return MsgStatsToJSON(mapStats);
+}
+
+UniValue gethttpqueueinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "gethttpqueueinfo\n"
+            "\nReturns the state of the work queues of the HTTP server, one for each class of requests.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"name\": \"xxxx\",      (string) The class of requests served (rpc, rest or wallet)\n"
+            "    \"threads\": n,         (numeric) Worker threads serving the queue\n"
+            "    \"depth\": n,           (numeric) Requests waiting in the queue\n"
+            "    \"maxdepth\": n,        (numeric) Requests the queue holds before rejecting new ones\n"
+            "    \"served\": n,          (numeric) Requests served\n"
+            "    \"rejected\": n,        (numeric) Requests rejected because the queue or the client limit was full\n"
+            "    \"avglatency\": n,      (numeric) Average time the served requests waited in the queue, in microseconds\n"
+            "    \"maxlatency\": n       (numeric) Longest time a served request waited in the queue, in microseconds\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n" +
+            HelpExampleCli("gethttpqueueinfo", "") + HelpExampleRpc("gethttpqueueinfo", ""));
+
+    UniValue ret(UniValue::VARR);
+    std::vector<HTTPWorkQueueInfo> vInfo = GetHTTPWorkQueueInfo();
+    BOOST_FOREACH (const HTTPWorkQueueInfo& info, vInfo) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("name", info.strName));
+        obj.push_back(Pair("threads", info.nThreads));
+        obj.push_back(Pair("depth", (uint64_t)info.nDepth));
+        obj.push_back(Pair("maxdepth", (uint64_t)info.nMaxDepth));
+        obj.push_back(Pair("served", info.nServed));
+        obj.push_back(Pair("rejected", info.nRejected));
+        obj.push_back(Pair("avglatency", info.nServed ? info.nLatencyTotal / (int64_t)info.nServed : 0));
+        obj.push_back(Pair("maxlatency", info.nLatencyMax));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
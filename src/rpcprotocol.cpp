@@ -56,6 +56,25 @@ string JSONRPCReply(const UniValue& result, const UniValue& error, const UniValu
     return reply.write() + "\n";
 }
 
+void JSONRPCWriteReply(UniValue::Sink& sink, const UniValue& result, const UniValue& error, const UniValue& id)
+{
+    static const string strResult = "{\"result\":";
+    static const string strError = ",\"error\":";
+    static const string strId = ",\"id\":";
+    static const string strEnd = "}\n";
+
+    sink.append(strResult.data(), strResult.size());
+    if (!error.isNull())
+        NullUniValue.write(sink);
+    else
+        result.write(sink);
+    sink.append(strError.data(), strError.size());
+    error.write(sink);
+    sink.append(strId.data(), strId.size());
+    id.write(sink);
+    sink.append(strEnd.data(), strEnd.size());
+}
+
 UniValue JSONRPCError(int code, const string& message)
 {
     UniValue error(UniValue::VOBJ);
@@ -17,6 +17,7 @@
 //! HTTP status codes
 enum HTTPStatusCode {
     HTTP_OK                    = 200,
+    HTTP_NOT_MODIFIED          = 304,
     HTTP_BAD_REQUEST           = 400,
     HTTP_UNAUTHORIZED          = 401,
     HTTP_FORBIDDEN             = 403,
@@ -77,6 +78,8 @@ enum RPCErrorCode {
 std::string JSONRPCRequest(const std::string& strMethod, const UniValue& params, const UniValue& id);
 UniValue JSONRPCReplyObj(const UniValue& result, const UniValue& error, const UniValue& id);
 std::string JSONRPCReply(const UniValue& result, const UniValue& error, const UniValue& id);
+/** Write the text of JSONRPCReply() to sink without copying result into a reply object */
+void JSONRPCWriteReply(UniValue::Sink& sink, const UniValue& result, const UniValue& error, const UniValue& id);
 UniValue JSONRPCError(int code, const std::string& message);
 
 /** Get name of RPC authentication cookie file */
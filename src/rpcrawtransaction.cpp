@@ -24,9 +24,13 @@
 #include "wallet.h"
 #endif
 
+#include <atomic>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
 
 #include <univalue.h>
 
@@ -268,6 +272,7 @@ UniValue listunspent(const UniValue& params, bool fHelp)
     assert(pwalletMain != NULL);
     LOCK2(cs_main, pwalletMain->cs_wallet);
     pwalletMain->AvailableCoins(vecOutputs, false, NULL, false, ALL_COINS, false, nWatchonlyConfig);
+    CBitcoinAddressCache addressCache;
     BOOST_FOREACH (const COutput& out, vecOutputs) {
         if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
             continue;
@@ -288,7 +293,7 @@ UniValue listunspent(const UniValue& params, bool fHelp)
         entry.push_back(Pair("vout", out.i));
         CTxDestination address;
         if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address)) {
-            entry.push_back(Pair("address", CBitcoinAddress(address).ToString()));
+            entry.push_back(Pair("address", addressCache.Get(address)));
             if (pwalletMain->mapAddressBook.count(address))
                 entry.push_back(Pair("account", pwalletMain->mapAddressBook[address].name));
         }
@@ -343,13 +348,13 @@ UniValue createrawtransaction(const UniValue& params, bool fHelp)
             "\nExamples\n" +
             HelpExampleCli("createrawtransaction", "\"[{\\\"txid\\\":\\\"myid\\\",\\\"vout\\\":0}]\" \"{\\\"address\\\":0.01}\"") + HelpExampleRpc("createrawtransaction", "\"[{\\\"txid\\\":\\\"myid\\\",\\\"vout\\\":0}]\", \"{\\\"address\\\":0.01}\""));
 
-    LOCK(cs_main);
     RPCTypeCheck(params, boost::assign::list_of(UniValue::VARR)(UniValue::VOBJ));
 
-    UniValue inputs = params[0].get_array();
-    UniValue sendTo = params[1].get_obj();
+    const UniValue& inputs = params[0].get_array();
+    const UniValue& sendTo = params[1].get_obj();
 
     CMutableTransaction rawTx;
+    rawTx.vin.reserve(inputs.size());
 
     for (unsigned int idx = 0; idx < inputs.size(); idx++) {
         const UniValue& input = inputs[idx];
@@ -369,8 +374,11 @@ UniValue createrawtransaction(const UniValue& params, bool fHelp)
     }
 
     set<CBitcoinAddress> setAddress;
-    vector<string> addrList = sendTo.getKeys();
-    BOOST_FOREACH(const string& name_, addrList) {
+    const vector<string>& addrList = sendTo.getKeys();
+    const vector<UniValue>& amountList = sendTo.getValues();
+    rawTx.vout.reserve(addrList.size());
+    for (unsigned int idx = 0; idx < addrList.size(); idx++) {
+        const string& name_ = addrList[idx];
         CBitcoinAddress address(name_);
         if (!address.IsValid())
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid DTEM address: ")+name_);
@@ -380,7 +388,7 @@ UniValue createrawtransaction(const UniValue& params, bool fHelp)
         setAddress.insert(address);
 
         CScript scriptPubKey = GetScriptForDestination(address.Get());
-        CAmount nAmount = AmountFromValue(sendTo[name_]);
+        CAmount nAmount = AmountFromValue(amountList[idx]);
 
         CTxOut out(nAmount, scriptPubKey);
         rawTx.vout.push_back(out);
@@ -504,6 +512,56 @@ static void TxInErrorToJSON(const CTxIn& txin, UniValue& vErrorsRet, const std::
     vErrorsRet.push_back(entry);
 }
 
+namespace
+{
+/** Signs input i of signrawtransaction into vScriptSigs[i] and verifies it into vScriptErrors[i] */
+struct CSignInputJob {
+    const CKeyStore& keystore;
+    const CTransaction& txTo;
+    const std::vector<CMutableTransaction>& txVariants;
+    const std::vector<CScript>& vPrevPubKeys;
+    const std::vector<char>& vfFound;
+    int nHashType;
+    const CSignatureHashCache* pcache;
+    std::vector<CScript>& vScriptSigs;
+    std::vector<ScriptError>& vScriptErrors;
+
+    CSignInputJob(const CKeyStore& keystoreIn, const CTransaction& txToIn, const std::vector<CMutableTransaction>& txVariantsIn,
+        const std::vector<CScript>& vPrevPubKeysIn, const std::vector<char>& vfFoundIn, int nHashTypeIn, const CSignatureHashCache* pcacheIn,
+        std::vector<CScript>& vScriptSigsIn, std::vector<ScriptError>& vScriptErrorsIn)
+        : keystore(keystoreIn), txTo(txToIn), txVariants(txVariantsIn), vPrevPubKeys(vPrevPubKeysIn), vfFound(vfFoundIn), nHashType(nHashTypeIn),
+          pcache(pcacheIn), vScriptSigs(vScriptSigsIn), vScriptErrors(vScriptErrorsIn) {}
+
+    void operator()(unsigned int i) const
+    {
+        if (!vfFound[i])
+            return;
+        const CScript& prevPubKey = vPrevPubKeys[i];
+        CScript scriptSig;
+
+        // Only sign SIGHASH_SINGLE if there's a corresponding output:
+        bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
+        if (!fHashSingle || (i < txTo.vout.size()))
+            SignSignature(keystore, prevPubKey, txTo, i, nHashType, scriptSig, pcache);
+
+        // ... and merge in other signatures:
+        BOOST_FOREACH (const CMutableTransaction& txv, txVariants) {
+            scriptSig = CombineSignatures(prevPubKey, txTo, i, scriptSig, txv.vin[i].scriptSig);
+        }
+        ScriptError serror = SCRIPT_ERR_OK;
+        if (!VerifyScript(scriptSig, prevPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&txTo, i, pcache), &serror))
+            vScriptErrors[i] = serror;
+        vScriptSigs[i] = scriptSig;
+    }
+};
+
+void SignInputWorker(std::atomic<unsigned int>* pnNext, const CSignInputJob* pjob)
+{
+    for (unsigned int i = (*pnNext)++; i < pjob->txTo.vin.size(); i = (*pnNext)++)
+        (*pjob)(i);
+}
+} // anon namespace
+
 UniValue signrawtransaction(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 4)
@@ -562,11 +620,6 @@ UniValue signrawtransaction(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("signrawtransaction", "\"myhex\"") + HelpExampleRpc("signrawtransaction", "\"myhex\""));
 
-#ifdef ENABLE_WALLET
-    LOCK2(cs_main, pwalletMain ? &pwalletMain->cs_wallet : NULL);
-#else
-    LOCK(cs_main);
-#endif
     RPCTypeCheck(params, boost::assign::list_of(UniValue::VSTR)(UniValue::VARR)(UniValue::VARR)(UniValue::VSTR), true);
 
     vector<unsigned char> txData(ParseHexV(params[0], "argument 1"));
@@ -589,11 +642,11 @@ UniValue signrawtransaction(const UniValue& params, bool fHelp)
     // starts as a clone of the rawtx:
     CMutableTransaction mergedTx(txVariants[0]);
 
-    // Fetch previous transactions (inputs):
+    // Fetch previous transactions (inputs), the signing needs no locks after:
     CCoinsView viewDummy;
     CCoinsViewCache view(&viewDummy);
     {
-        LOCK(mempool.cs);
+        LOCK2(cs_main, mempool.cs);
         CCoinsViewCache& viewChain = *pcoinsTip;
         CCoinsViewMemPool viewMempool(&viewChain, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
@@ -695,34 +748,48 @@ UniValue signrawtransaction(const UniValue& params, bool fHelp)
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid sighash param");
     }
 
-    bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
+    // The previous outputs, then the inputs are signed with no locks held
+    const unsigned int nInputs = mergedTx.vin.size();
+    std::vector<CScript> vPrevPubKeys(nInputs);
+    std::vector<char> vfFound(nInputs, false);
+    for (unsigned int i = 0; i < nInputs; i++) {
+        const COutPoint& prevout = mergedTx.vin[i].prevout;
+        const CCoins* coins = view.AccessCoins(prevout.hash);
+        if (coins != NULL && coins->IsAvailable(prevout.n)) {
+            vPrevPubKeys[i] = coins->vout[prevout.n].scriptPubKey;
+            vfFound[i] = true;
+        }
+    }
+
+    // The signature hashes leave out the scriptSigs, so the inputs share one
+    // copy of the transaction and its signature hash cache
+    const CTransaction txToSign(mergedTx);
+    boost::scoped_ptr<CSignatureHashCache> pcache;
+    if (nInputs >= MIN_SIGHASH_CACHE_INPUTS)
+        pcache.reset(new CSignatureHashCache(txToSign));
+
+    std::vector<CScript> vScriptSigs(nInputs);
+    std::vector<ScriptError> vScriptErrors(nInputs, SCRIPT_ERR_OK);
+    CSignInputJob job(keystore, txToSign, txVariants, vPrevPubKeys, vfFound, nHashType, pcache.get(), vScriptSigs, vScriptErrors);
+    std::atomic<unsigned int> nNext(0);
+    int nThreads = nInputs < MIN_PARALLEL_SIGN_INPUTS ? 1 : std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_SIGN_THREADS));
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&SignInputWorker, &nNext, &job));
+    SignInputWorker(&nNext, &job);
+    threadGroup.join_all();
 
     // Script verification errors
     UniValue vErrors(UniValue::VARR);
-
-    // Sign what we can:
-    for (unsigned int i = 0; i < mergedTx.vin.size(); i++) {
+    for (unsigned int i = 0; i < nInputs; i++) {
         CTxIn& txin = mergedTx.vin[i];
-        const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-        if (coins == NULL || !coins->IsAvailable(txin.prevout.n)) {
+        if (!vfFound[i]) {
             TxInErrorToJSON(txin, vErrors, "Input not found or already spent");
             continue;
         }
-        const CScript& prevPubKey = coins->vout[txin.prevout.n].scriptPubKey;
-
-        txin.scriptSig.clear();
-        // Only sign SIGHASH_SINGLE if there's a corresponding output:
-        if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
-
-        // ... and merge in other signatures:
-        BOOST_FOREACH (const CMutableTransaction& txv, txVariants) {
-            txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, txv.vin[i].scriptSig);
-        }
-        ScriptError serror = SCRIPT_ERR_OK;
-        if (!VerifyScript(txin.scriptSig, prevPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, MutableTransactionSignatureChecker(&mergedTx, i), &serror)) {
-            TxInErrorToJSON(txin, vErrors, ScriptErrorString(serror));
-        }
+        txin.scriptSig = vScriptSigs[i];
+        if (vScriptErrors[i] != SCRIPT_ERR_OK)
+            TxInErrorToJSON(txin, vErrors, ScriptErrorString(vScriptErrors[i]));
     }
     bool fComplete = vErrors.empty();
 
@@ -780,7 +847,10 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
     if (!fHaveMempool && !fHaveChain) {
         // push to local node and sync with wallets
         if (fSwiftX) {
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            {
+                LOCK(cs_swifttx);
+                mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            }
             CreateNewLock(tx);
             RelayTransactionLockReq(tx, true);
         }
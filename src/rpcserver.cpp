@@ -26,6 +26,8 @@
 #include <boost/thread.hpp>
 #include <boost/algorithm/string/case_conv.hpp> // for to_upper()
 
+#include <atomic>
+
 #include <univalue.h>
 
 using namespace RPCServer;
@@ -280,8 +282,13 @@ static const CRPCCommand vRPCCommands[] =
         //  --------------------- ------------------------  -----------------------  ---------- ---------- ---------
         /* Overall control/query calls */
         {"control", "getinfo", &getinfo, true, false, false}, /* uses wallet if enabled */
+        {"control", "getlockstats", &getlockstats, true, true, false},
+        {"control", "getmemoryinfo", &getmemoryinfo, true, true, false},
+        {"control", "getlargepageinfo", &getlargepageinfo, true, true, false},
         {"control", "help", &help, true, true, false},
+        {"control", "startprofile", &startprofile, true, true, false},
         {"control", "stop", &stop, true, true, false},
+        {"control", "stopprofile", &stopprofile, true, true, false},
 
         /* P2P networking */
         {"network", "getnetworkinfo", &getnetworkinfo, true, false, false},
@@ -290,6 +297,8 @@ static const CRPCCommand vRPCCommands[] =
         {"network", "getaddednodeinfo", &getaddednodeinfo, true, true, false},
         {"network", "getconnectioncount", &getconnectioncount, true, false, false},
         {"network", "getnettotals", &getnettotals, true, true, false},
+        {"network", "getnetmsgstats", &getnetmsgstats, true, true, false},
+        {"network", "gethttpqueueinfo", &gethttpqueueinfo, true, true, false},
         {"network", "getpeerinfo", &getpeerinfo, true, false, false},
         {"network", "ping", &ping, true, false, false},
         {"network", "setban", &setban, true, false, false},
@@ -302,14 +311,20 @@ static const CRPCCommand vRPCCommands[] =
         {"blockchain", "getblockcount", &getblockcount, true, false, false},
         {"blockchain", "getblock", &getblock, true, false, false},
         {"blockchain", "getblockhash", &getblockhash, true, false, false},
+        {"blockchain", "getblockhashes", &getblockhashes, true, false, false},
         {"blockchain", "getblockheader", &getblockheader, false, false, false},
+        {"blockchain", "getblocktraces", &getblocktraces, true, true, false},
         {"blockchain", "getchaintips", &getchaintips, true, false, false},
+        {"blockchain", "getdbinfo", &getdbinfo, true, false, false},
         {"blockchain", "getdifficulty", &getdifficulty, true, false, false},
         {"blockchain", "getfeeinfo", &getfeeinfo, true, false, false},
         {"blockchain", "getmempoolinfo", &getmempoolinfo, true, true, false},
         {"blockchain", "getrawmempool", &getrawmempool, true, false, false},
+        {"blockchain", "getspentinfo", &getspentinfo, true, false, false},
         {"blockchain", "gettxout", &gettxout, true, false, false},
+        {"blockchain", "gettxouts", &gettxouts, true, false, false},
         {"blockchain", "gettxoutsetinfo", &gettxoutsetinfo, true, false, false},
+        {"blockchain", "dumptxoutset", &dumptxoutset, true, false, false},
         {"blockchain", "invalidateblock", &invalidateblock, true, true, false},
         {"blockchain", "reconsiderblock", &reconsiderblock, true, true, false},
         {"blockchain", "verifychain", &verifychain, true, false, false},
@@ -333,10 +348,14 @@ static const CRPCCommand vRPCCommands[] =
         {"rawtransactions", "createrawtransaction", &createrawtransaction, true, false, false},
         {"rawtransactions", "decoderawtransaction", &decoderawtransaction, true, false, false},
         {"rawtransactions", "decodescript", &decodescript, true, false, false},
-        {"rawtransactions", "getrawtransaction", &getrawtransaction, true, false, false},
+        {"rawtransactions", "getrawtransaction", &getrawtransaction, true, true, false},
         {"rawtransactions", "sendrawtransaction", &sendrawtransaction, false, false, false},
         {"rawtransactions", "signrawtransaction", &signrawtransaction, false, false, false}, /* uses wallet if enabled */
 
+        /* Address index */
+        {"addressindex", "getaddressbalance", &getaddressbalance, true, false, false},
+        {"addressindex", "getaddressutxos", &getaddressutxos, true, false, false},
+
         /* Utility functions */
         {"util", "createmultisig", &createmultisig, true, true, false},
         {"util", "validateaddress", &validateaddress, true, false, false}, /* uses wallet if enabled */
@@ -363,6 +382,8 @@ static const CRPCCommand vRPCCommands[] =
         {"dystem", "getmasternodestatus", &getmasternodestatus, true, true, false},
         {"dystem", "getmasternodewinners", &getmasternodewinners, true, true, false},
         {"dystem", "getmasternodescores", &getmasternodescores, true, true, false},
+        {"dystem", "listregisteredmasternodes", &listregisteredmasternodes, true, true, false},
+        {"dystem", "registermasternode", &registermasternode, false, false, true},
         {"dystem", "mnbudget", &mnbudget, true, true, false},
         {"dystem", "preparebudget", &preparebudget, true, true, false},
         {"dystem", "submitbudget", &submitbudget, true, true, false},
@@ -379,6 +400,7 @@ static const CRPCCommand vRPCCommands[] =
 #ifdef ENABLE_WALLET
 
         /* Wallet */
+        {"wallet", "abortrescan", &abortrescan, true, false, true},
         {"wallet", "addmultisigaddress", &addmultisigaddress, true, false, true},
         {"wallet", "autocombinerewards", &autocombinerewards, false, false, true},
         {"wallet", "backupwallet", &backupwallet, true, false, true},
@@ -397,12 +419,13 @@ static const CRPCCommand vRPCCommands[] =
         {"wallet", "getreceivedbyaddress", &getreceivedbyaddress, false, false, true},
         {"wallet", "getstakingstatus", &getstakingstatus, false, false, true},
         {"wallet", "getstakesplitthreshold", &getstakesplitthreshold, false, false, true},
-        {"wallet", "gettransaction", &gettransaction, false, false, true},
+        {"wallet", "gettransaction", &gettransaction, false, true, true},
         {"wallet", "getunconfirmedbalance", &getunconfirmedbalance, false, false, true},
         {"wallet", "getwalletinfo", &getwalletinfo, false, false, true},
         {"wallet", "importprivkey", &importprivkey, true, false, true},
         {"wallet", "importwallet", &importwallet, true, false, true},
         {"wallet", "importaddress", &importaddress, true, false, true},
+        {"wallet", "importmulti", &importmulti, true, false, true},
         {"wallet", "keypoolrefill", &keypoolrefill, true, false, true},
         {"wallet", "listaccounts", &listaccounts, false, false, true},
         {"wallet", "listaddressgroupings", &listaddressgroupings, false, false, true},
@@ -547,11 +570,68 @@ static UniValue JSONRPCExecOne(const UniValue& req)
     return rpc_result;
 }
 
+static bool IsThreadSafeRequest(const UniValue& req)
+{
+    if (!req.isObject())
+        return false;
+    const UniValue& valMethod = find_value(req, "method");
+    if (!valMethod.isStr())
+        return false;
+    const CRPCCommand* pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->threadSafe;
+}
+
+/** Runs the calls of a batch from *pnNext up to nEnd, along with the other workers */
+struct CRPCBatchWorker {
+    const UniValue* pvReq;
+    std::vector<UniValue>* pvReplies;
+    std::atomic<unsigned int>* pnNext;
+    unsigned int nEnd;
+
+    void operator()() const
+    {
+        unsigned int reqIdx;
+        while ((reqIdx = (*pnNext)++) < nEnd)
+            (*pvReplies)[reqIdx] = JSONRPCExecOne((*pvReq)[reqIdx]);
+    }
+};
+
 std::string JSONRPCExecBatch(const UniValue& vReq)
 {
+    unsigned int nThreads = std::max(1, (int)GetArg("-rpcbatchthreads", DEFAULT_RPC_BATCH_THREADS));
+    std::vector<UniValue> vReplies(vReq.size());
+
+    unsigned int reqIdx = 0;
+    while (reqIdx < vReq.size()) {
+        // A run of thread safe calls is executed by several threads, any
+        // other call waits for the ones before it to finish
+        unsigned int nEnd = reqIdx;
+        while (nEnd < vReq.size() && IsThreadSafeRequest(vReq[nEnd]))
+            nEnd++;
+
+        if (nThreads > 1 && nEnd - reqIdx > 1) {
+            std::atomic<unsigned int> nNext(reqIdx);
+            CRPCBatchWorker worker;
+            worker.pvReq = &vReq;
+            worker.pvReplies = &vReplies;
+            worker.pnNext = &nNext;
+            worker.nEnd = nEnd;
+
+            boost::thread_group threads;
+            for (unsigned int i = 1; i < std::min(nThreads, nEnd - reqIdx); i++)
+                threads.create_thread(worker);
+            worker();
+            threads.join_all();
+            reqIdx = nEnd;
+        } else {
+            vReplies[reqIdx] = JSONRPCExecOne(vReq[reqIdx]);
+            reqIdx++;
+        }
+    }
+
     UniValue ret(UniValue::VARR);
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    for (reqIdx = 0; reqIdx < vReplies.size(); reqIdx++)
+        ret.push_back(vReplies[reqIdx]);
 
     return ret.write() + "\n";
 }
@@ -22,6 +22,13 @@
 
 class CRPCCommand;
 
+//! Most threads that run the thread safe calls of one JSON-RPC batch together
+static const int DEFAULT_RPC_BATCH_THREADS = 4;
+//! Most threads signing the inputs of one signrawtransaction call
+static const int MAX_SIGN_THREADS = 8;
+//! signrawtransaction signs the inputs of smaller transactions on its own thread
+static const unsigned int MIN_PARALLEL_SIGN_INPUTS = 16;
+
 namespace RPCServer
 {
     void OnStarted(boost::function<void ()> slot);
@@ -184,6 +191,8 @@ extern UniValue addnode(const UniValue& params, bool fHelp);
 extern UniValue disconnectnode(const UniValue& params, bool fHelp);
 extern UniValue getaddednodeinfo(const UniValue& params, bool fHelp);
 extern UniValue getnettotals(const UniValue& params, bool fHelp);
+extern UniValue getnetmsgstats(const UniValue& params, bool fHelp);
+extern UniValue gethttpqueueinfo(const UniValue& params, bool fHelp);
 extern UniValue setban(const UniValue& params, bool fHelp);
 extern UniValue listbanned(const UniValue& params, bool fHelp);
 extern UniValue clearbanned(const UniValue& params, bool fHelp);
@@ -191,6 +200,8 @@ extern UniValue clearbanned(const UniValue& params, bool fHelp);
 extern UniValue dumpprivkey(const UniValue& params, bool fHelp); // in rpcdump.cpp
 extern UniValue importprivkey(const UniValue& params, bool fHelp);
 extern UniValue importaddress(const UniValue& params, bool fHelp);
+extern UniValue importmulti(const UniValue& params, bool fHelp);
+extern UniValue abortrescan(const UniValue& params, bool fHelp);
 extern UniValue dumpwallet(const UniValue& params, bool fHelp);
 extern UniValue importwallet(const UniValue& params, bool fHelp);
 extern UniValue bip38encrypt(const UniValue& params, bool fHelp);
@@ -264,11 +275,17 @@ extern UniValue settxfee(const UniValue& params, bool fHelp);
 extern UniValue getmempoolinfo(const UniValue& params, bool fHelp);
 extern UniValue getrawmempool(const UniValue& params, bool fHelp);
 extern UniValue getblockhash(const UniValue& params, bool fHelp);
+extern UniValue getblockhashes(const UniValue& params, bool fHelp);
 extern UniValue getblock(const UniValue& params, bool fHelp);
 extern UniValue getblockheader(const UniValue& params, bool fHelp);
+extern UniValue getblocktraces(const UniValue& params, bool fHelp);
 extern UniValue getfeeinfo(const UniValue& params, bool fHelp);
 extern UniValue gettxoutsetinfo(const UniValue& params, bool fHelp);
+extern UniValue dumptxoutset(const UniValue& params, bool fHelp);
+extern UniValue getdbinfo(const UniValue& params, bool fHelp);
 extern UniValue gettxout(const UniValue& params, bool fHelp);
+extern UniValue gettxouts(const UniValue& params, bool fHelp);
+extern UniValue getspentinfo(const UniValue& params, bool fHelp);
 extern UniValue verifychain(const UniValue& params, bool fHelp);
 extern UniValue getchaintips(const UniValue& params, bool fHelp);
 extern UniValue invalidateblock(const UniValue& params, bool fHelp);
@@ -288,6 +305,8 @@ extern UniValue listmasternodeconf(const UniValue& params, bool fHelp);
 extern UniValue getmasternodestatus(const UniValue& params, bool fHelp);
 extern UniValue getmasternodewinners(const UniValue& params, bool fHelp);
 extern UniValue getmasternodescores(const UniValue& params, bool fHelp);
+extern UniValue listregisteredmasternodes(const UniValue& params, bool fHelp);
+extern UniValue registermasternode(const UniValue& params, bool fHelp);
 
 extern UniValue mnbudget(const UniValue& params, bool fHelp); // in rpcmasternode-budget.cpp
 extern UniValue preparebudget(const UniValue& params, bool fHelp);
@@ -308,7 +327,14 @@ extern UniValue validateaddress(const UniValue& params, bool fHelp);
 extern UniValue createmultisig(const UniValue& params, bool fHelp);
 extern UniValue verifymessage(const UniValue& params, bool fHelp);
 extern UniValue setmocktime(const UniValue& params, bool fHelp);
+extern UniValue getlockstats(const UniValue& params, bool fHelp);
+extern UniValue getmemoryinfo(const UniValue& params, bool fHelp);
+extern UniValue getlargepageinfo(const UniValue& params, bool fHelp);
+extern UniValue startprofile(const UniValue& params, bool fHelp);
+extern UniValue stopprofile(const UniValue& params, bool fHelp);
 extern UniValue getstakingstatus(const UniValue& params, bool fHelp);
+extern UniValue getaddressbalance(const UniValue& params, bool fHelp);
+extern UniValue getaddressutxos(const UniValue& params, bool fHelp);
 
 bool StartRPC();
 void InterruptRPC();
@@ -225,7 +225,7 @@ UniValue setaccount(const UniValue& params, bool fHelp)
         strAccount = AccountFromValue(params[1]);
 
     // Only add the account if the address is yours.
-    if (IsMine(*pwalletMain, address.Get())) {
+    if (pwalletMain->IsMine(address.Get())) {
         // Detect when changing the account of an address that is the 'unused current key' of another account:
         if (pwalletMain->mapAddressBook.count(address.Get())) {
             string strOldAccount = pwalletMain->mapAddressBook[address.Get()].name;
@@ -283,7 +283,7 @@ UniValue getaddressesbyaccount(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("getaddressesbyaccount", "\"tabby\"") + HelpExampleRpc("getaddressesbyaccount", "\"tabby\""));
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    LOCK(pwalletMain->cs_wallet);
 
     string strAccount = AccountFromValue(params[0]);
 
@@ -439,7 +439,8 @@ UniValue listaddressgroupings(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("listaddressgroupings", "") + HelpExampleRpc("listaddressgroupings", ""));
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    // Wallet state only, see CWalletTx::GetCachedDepth
+    LOCK(pwalletMain->cs_wallet);
 
     UniValue jsonGroupings(UniValue::VARR);
     map<CTxDestination, CAmount> balances = pwalletMain->GetAddressBalances();
@@ -528,14 +529,14 @@ UniValue getreceivedbyaddress(const UniValue& params, bool fHelp)
             "\nThe amount with at least 6 confirmation, very safe\n" + HelpExampleCli("getreceivedbyaddress", "\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\" 6") +
             "\nAs a json rpc call\n" + HelpExampleRpc("getreceivedbyaddress", "\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\", 6"));
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    LOCK(pwalletMain->cs_wallet);
 
     // dystem address
     CBitcoinAddress address = CBitcoinAddress(params[0].get_str());
     if (!address.IsValid())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid DTEM address");
     CScript scriptPubKey = GetScriptForDestination(address.Get());
-    if (!IsMine(*pwalletMain, scriptPubKey))
+    if (!pwalletMain->IsMine(scriptPubKey))
         return (double)0.0;
 
     // Minimum confirmations
@@ -545,14 +546,14 @@ UniValue getreceivedbyaddress(const UniValue& params, bool fHelp)
 
     // Tally
     CAmount nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it) {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
+    BOOST_FOREACH (const CWalletTx* pwtx, pwalletMain->GetTransactionsPaying(address.Get())) {
+        const CWalletTx& wtx = *pwtx;
+        if (wtx.IsCoinBase() || !wtx.IsFinalCached())
             continue;
 
         BOOST_FOREACH (const CTxOut& txout, wtx.vout)
             if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
+                if (wtx.GetCachedDepth() >= nMinDepth)
                     nAmount += txout.nValue;
     }
 
@@ -578,7 +579,7 @@ UniValue getreceivedbyaccount(const UniValue& params, bool fHelp)
             "\nThe amount with at least 6 confirmation, very safe\n" + HelpExampleCli("getreceivedbyaccount", "\"tabby\" 6") +
             "\nAs a json rpc call\n" + HelpExampleRpc("getreceivedbyaccount", "\"tabby\", 6"));
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    LOCK(pwalletMain->cs_wallet);
 
     // Minimum confirmations
     int nMinDepth = 1;
@@ -589,18 +590,22 @@ UniValue getreceivedbyaccount(const UniValue& params, bool fHelp)
     string strAccount = AccountFromValue(params[0]);
     set<CTxDestination> setAddress = pwalletMain->GetAccountAddresses(strAccount);
 
-    // Tally
+    // Tally, the outputs to each address of the account
     CAmount nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it) {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
+    BOOST_FOREACH (const CTxDestination& dest, setAddress) {
+        if (!pwalletMain->IsMine(dest))
             continue;
+        BOOST_FOREACH (const CWalletTx* pwtx, pwalletMain->GetTransactionsPaying(dest)) {
+            const CWalletTx& wtx = *pwtx;
+            if (wtx.IsCoinBase() || !wtx.IsFinalCached())
+                continue;
 
-        BOOST_FOREACH (const CTxOut& txout, wtx.vout) {
-            CTxDestination address;
-            if (ExtractDestination(txout.scriptPubKey, address) && IsMine(*pwalletMain, address) && setAddress.count(address))
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
+            BOOST_FOREACH (const CTxOut& txout, wtx.vout) {
+                CTxDestination address;
+                if (ExtractDestination(txout.scriptPubKey, address) && address == dest)
+                    if (wtx.GetCachedDepth() >= nMinDepth)
+                        nAmount += txout.nValue;
+            }
         }
     }
 
@@ -608,36 +613,45 @@ UniValue getreceivedbyaccount(const UniValue& params, bool fHelp)
 }
 
 
-CAmount GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMinDepth, const isminefilter& filter)
+static void TallyAccountBalance(const CWalletTx& wtx, const string& strAccount, int nMinDepth, const isminefilter& filter, CAmount& nBalance)
 {
-    CAmount nBalance = 0;
+    if (!IsFinalTx(wtx) || wtx.GetBlocksToMaturity() > 0 || wtx.GetDepthInMainChain() < 0)
+        return;
 
-    // Tally wallet transactions
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it) {
-        const CWalletTx& wtx = (*it).second;
-        if (!IsFinalTx(wtx) || wtx.GetBlocksToMaturity() > 0 || wtx.GetDepthInMainChain() < 0)
-            continue;
+    CAmount nReceived, nSent, nFee;
+    wtx.GetAccountAmounts(strAccount, nReceived, nSent, nFee, filter);
 
-        CAmount nReceived, nSent, nFee;
-        wtx.GetAccountAmounts(strAccount, nReceived, nSent, nFee, filter);
+    if (nReceived != 0 && wtx.GetDepthInMainChain() >= nMinDepth)
+        nBalance += nReceived;
+    nBalance -= nSent + nFee;
+}
 
-        if (nReceived != 0 && wtx.GetDepthInMainChain() >= nMinDepth)
-            nBalance += nReceived;
-        nBalance -= nSent + nFee;
+CAmount GetAccountBalance(const string& strAccount, int nMinDepth, const isminefilter& filter)
+{
+    CAmount nBalance = 0;
+
+    // Tally wallet transactions. The default account receives what is paid
+    // to any address not in the address book, so it still needs all of them.
+    if (strAccount.empty()) {
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+            TallyAccountBalance((*it).second, strAccount, nMinDepth, filter, nBalance);
+    } else {
+        // Sent from the account or paid to one of its addresses, each once
+        set<const CWalletTx*> setTx(pwalletMain->GetTransactionsFromAccount(strAccount).begin(), pwalletMain->GetTransactionsFromAccount(strAccount).end());
+        BOOST_FOREACH (const CTxDestination& dest, pwalletMain->GetAccountAddresses(strAccount)) {
+            const CWallet::TxList& vwtx = pwalletMain->GetTransactionsPaying(dest);
+            setTx.insert(vwtx.begin(), vwtx.end());
+        }
+        BOOST_FOREACH (const CWalletTx* pwtx, setTx)
+            TallyAccountBalance(*pwtx, strAccount, nMinDepth, filter, nBalance);
     }
 
     // Tally internal accounting entries
-    nBalance += walletdb.GetAccountCreditDebit(strAccount);
+    nBalance += pwalletMain->GetAccountCreditDebit(strAccount);
 
     return nBalance;
 }
 
-CAmount GetAccountBalance(const string& strAccount, int nMinDepth, const isminefilter& filter)
-{
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-    return GetAccountBalance(walletdb, strAccount, nMinDepth, filter);
-}
-
 
 UniValue getbalance(const UniValue& params, bool fHelp)
 {
@@ -844,9 +858,9 @@ UniValue sendfrom(const UniValue& params, bool fHelp)
 
 UniValue sendmany(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() < 2 || params.size() > 4)
+    if (fHelp || params.size() < 2 || params.size() > 5)
         throw runtime_error(
-            "sendmany \"fromaccount\" {\"address\":amount,...} ( minconf \"comment\" )\n"
+            "sendmany \"fromaccount\" {\"address\":amount,...} ( minconf \"comment\" dryrun )\n"
             "\nSend multiple times. Amounts are double-precision floating point numbers." +
             HelpRequiringPassphrase() + "\n"
                                         "\nArguments:\n"
@@ -858,13 +872,22 @@ UniValue sendmany(const UniValue& params, bool fHelp)
                                         "    }\n"
                                         "3. minconf                 (numeric, optional, default=1) Only use the balance confirmed at least this many times.\n"
                                         "4. \"comment\"             (string, optional) A comment\n"
+                                        "5. dryrun                  (boolean, optional, default=false) Only work out the transaction, without signing or sending it\n"
                                         "\nResult:\n"
                                         "\"transactionid\"          (string) The transaction id for the send. Only 1 transaction is created regardless of \n"
                                         "                                    the number of addresses.\n"
+                                        "\nResult (with dryrun):\n"
+                                        "{\n"
+                                        "  \"fee\": x.xxx,             (numeric) The fee the transaction would pay in btc\n"
+                                        "  \"size\": n,                (numeric) Its size in bytes once signed, at most\n"
+                                        "  \"inputs\": n,              (numeric) The number of coins it would spend\n"
+                                        "  \"outputs\": n              (numeric) The number of its outputs, with the change\n"
+                                        "}\n"
                                         "\nExamples:\n"
                                         "\nSend two amounts to two different addresses:\n" +
             HelpExampleCli("sendmany", "\"tabby\" \"{\\\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\\\":0.01,\\\"XuQQkwA4FYkq2XERzMY2CiAZhJTEDAbtcg\\\":0.02}\"") +
             "\nSend two amounts to two different addresses setting the confirmation and comment:\n" + HelpExampleCli("sendmany", "\"tabby\" \"{\\\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\\\":0.01,\\\"XuQQkwA4FYkq2XERzMY2CiAZhJTEDAbtcg\\\":0.02}\" 6 \"testing\"") +
+            "\nWork out the fee of sending them, without sending:\n" + HelpExampleCli("sendmany", "\"tabby\" \"{\\\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\\\":0.01,\\\"XuQQkwA4FYkq2XERzMY2CiAZhJTEDAbtcg\\\":0.02}\" 1 \"\" true") +
             "\nAs a json rpc call\n" + HelpExampleRpc("sendmany", "\"tabby\", \"{\\\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\\\":0.01,\\\"XuQQkwA4FYkq2XERzMY2CiAZhJTEDAbtcg\\\":0.02}\", 6, \"testing\""));
 
     LOCK2(cs_main, pwalletMain->cs_wallet);
@@ -883,9 +906,16 @@ UniValue sendmany(const UniValue& params, bool fHelp)
     set<CBitcoinAddress> setAddress;
     vector<pair<CScript, CAmount> > vecSend;
 
+    bool fDryRun = false;
+    if (params.size() > 4)
+        fDryRun = params[4].get_bool();
+
     CAmount totalAmount = 0;
-    vector<string> keys = sendTo.getKeys();
-    BOOST_FOREACH(const string& name_, keys) {
+    const vector<string>& keys = sendTo.getKeys();
+    const vector<UniValue>& values = sendTo.getValues();
+    vecSend.reserve(keys.size());
+    for (unsigned int idx = 0; idx < keys.size(); idx++) {
+        const string& name_ = keys[idx];
         CBitcoinAddress address(name_);
         if (!address.IsValid())
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid DTEM address: ")+name_);
@@ -895,7 +925,7 @@ UniValue sendmany(const UniValue& params, bool fHelp)
         setAddress.insert(address);
 
         CScript scriptPubKey = GetScriptForDestination(address.Get());
-        CAmount nAmount = AmountFromValue(sendTo[name_]);
+        CAmount nAmount = AmountFromValue(values[idx]);
         totalAmount += nAmount;
 
         vecSend.push_back(make_pair(scriptPubKey, nAmount));
@@ -912,9 +942,18 @@ UniValue sendmany(const UniValue& params, bool fHelp)
     CReserveKey keyChange(pwalletMain);
     CAmount nFeeRequired = 0;
     string strFailReason;
-    bool fCreated = pwalletMain->CreateTransaction(vecSend, wtx, keyChange, nFeeRequired, strFailReason);
+    bool fCreated = pwalletMain->CreateTransaction(vecSend, wtx, keyChange, nFeeRequired, strFailReason, NULL, ALL_COINS, false, 0, COIN_SELECTION_BNB, !fDryRun);
     if (!fCreated)
         throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, strFailReason);
+    if (fDryRun) {
+        // keyChange gives the change key back to the pool
+        UniValue result(UniValue::VOBJ);
+        result.push_back(Pair("fee", ValueFromAmount(nFeeRequired)));
+        result.push_back(Pair("size", (int)::GetSerializeSize(*(CTransaction*)&wtx, SER_NETWORK, PROTOCOL_VERSION)));
+        result.push_back(Pair("inputs", (int)wtx.vin.size()));
+        result.push_back(Pair("outputs", (int)wtx.vout.size()));
+        return result;
+    }
     if (!pwalletMain->CommitTransaction(wtx, keyChange))
         throw JSONRPCError(RPC_WALLET_ERROR, "Transaction commit failed");
 
@@ -999,35 +1038,38 @@ UniValue ListReceived(const UniValue& params, bool fByAccounts)
         if (params[2].get_bool())
             filter = filter | ISMINE_WATCH_ONLY;
 
-    // Tally
+    // Tally, only the addresses of the address book are reported
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it) {
-        const CWalletTx& wtx = (*it).second;
-
-        if (wtx.IsCoinBase() || !IsFinalTx(wtx))
+    BOOST_FOREACH (const PAIRTYPE(CTxDestination, CAddressBookData) & entry, pwalletMain->mapAddressBook) {
+        const CTxDestination& dest = entry.first;
+        isminefilter mine = pwalletMain->IsMine(dest);
+        if (!(mine & filter))
             continue;
 
-        int nDepth = wtx.GetDepthInMainChain();
-        int nBCDepth = wtx.GetDepthInMainChain(false);
-        if (nDepth < nMinDepth)
-            continue;
+        BOOST_FOREACH (const CWalletTx* pwtx, pwalletMain->GetTransactionsPaying(dest)) {
+            const CWalletTx& wtx = *pwtx;
 
-        BOOST_FOREACH (const CTxOut& txout, wtx.vout) {
-            CTxDestination address;
-            if (!ExtractDestination(txout.scriptPubKey, address))
+            if (wtx.IsCoinBase() || !IsFinalTx(wtx))
                 continue;
 
-            isminefilter mine = IsMine(*pwalletMain, address);
-            if (!(mine & filter))
+            int nDepth = wtx.GetDepthInMainChain();
+            int nBCDepth = wtx.GetDepthInMainChain(false);
+            if (nDepth < nMinDepth)
                 continue;
 
-            tallyitem& item = mapTally[address];
-            item.nAmount += txout.nValue;
-            item.nConf = min(item.nConf, nDepth);
-            item.nBCConf = min(item.nBCConf, nBCDepth);
-            item.txids.push_back(wtx.GetHash());
-            if (mine & ISMINE_WATCH_ONLY)
-                item.fIsWatchonly = true;
+            BOOST_FOREACH (const CTxOut& txout, wtx.vout) {
+                CTxDestination address;
+                if (!ExtractDestination(txout.scriptPubKey, address) || !(address == dest))
+                    continue;
+
+                tallyitem& item = mapTally[address];
+                item.nAmount += txout.nValue;
+                item.nConf = min(item.nConf, nDepth);
+                item.nBCConf = min(item.nBCConf, nBCDepth);
+                item.txids.push_back(wtx.GetHash());
+                if (mine & ISMINE_WATCH_ONLY)
+                    item.fIsWatchonly = true;
+            }
         }
     }
 
@@ -1160,14 +1202,18 @@ UniValue listreceivedbyaccount(const UniValue& params, bool fHelp)
     return ListReceived(params, true);
 }
 
-static void MaybePushAddress(UniValue & entry, const CTxDestination &dest)
+static void MaybePushAddress(UniValue & entry, const CTxDestination &dest, CBitcoinAddressCache& addressCache)
 {
-    CBitcoinAddress addr;
-    if (addr.Set(dest))
-        entry.push_back(Pair("address", addr.ToString()));
+    const std::string& strAddress = addressCache.Get(dest);
+    if (!strAddress.empty())
+        entry.push_back(Pair("address", strAddress));
 }
 
-void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDepth, bool fLong, UniValue& ret, const isminefilter& filter)
+/**
+ * Add the entries of wtx for strAccount to ret, except the first nSkip of
+ * them, which are only counted. Returns the number of entries, skipped or not.
+ */
+int ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDepth, bool fLong, UniValue& ret, const isminefilter& filter, CBitcoinAddressCache& addressCache, int nSkip = 0)
 {
     CAmount nFee;
     string strSentAccount;
@@ -1178,15 +1224,18 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
 
     bool fAllAccounts = (strAccount == string("*"));
     bool involvesWatchonly = wtx.IsFromMe(ISMINE_WATCH_ONLY);
+    int nEntries = 0;
 
     // Sent
     if ((!listSent.empty() || nFee != 0) && (fAllAccounts || strAccount == strSentAccount)) {
         BOOST_FOREACH (const COutputEntry& s, listSent) {
+            if (nEntries++ < nSkip)
+                continue;
             UniValue entry(UniValue::VOBJ);
-            if (involvesWatchonly || (::IsMine(*pwalletMain, s.destination) & ISMINE_WATCH_ONLY))
+            if (involvesWatchonly || (pwalletMain->IsMine(s.destination) & ISMINE_WATCH_ONLY))
                 entry.push_back(Pair("involvesWatchonly", true));
             entry.push_back(Pair("account", strSentAccount));
-            MaybePushAddress(entry, s.destination);
+            MaybePushAddress(entry, s.destination, addressCache);
             std::map<std::string, std::string>::const_iterator it = wtx.mapValue.find("DS");
             entry.push_back(Pair("category", (it != wtx.mapValue.end() && it->second == "1") ? "darksent" : "send"));
             entry.push_back(Pair("amount", ValueFromAmount(-s.amount)));
@@ -1205,11 +1254,13 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
             if (pwalletMain->mapAddressBook.count(r.destination))
                 account = pwalletMain->mapAddressBook[r.destination].name;
             if (fAllAccounts || (account == strAccount)) {
+                if (nEntries++ < nSkip)
+                    continue;
                 UniValue entry(UniValue::VOBJ);
-                if (involvesWatchonly || (::IsMine(*pwalletMain, r.destination) & ISMINE_WATCH_ONLY))
+                if (involvesWatchonly || (pwalletMain->IsMine(r.destination) & ISMINE_WATCH_ONLY))
                     entry.push_back(Pair("involvesWatchonly", true));
                 entry.push_back(Pair("account", account));
-                MaybePushAddress(entry, r.destination);
+                MaybePushAddress(entry, r.destination, addressCache);
                 if (wtx.IsCoinBase()) {
                     if (wtx.GetDepthInMainChain() < 1)
                         entry.push_back(Pair("category", "orphan"));
@@ -1228,13 +1279,17 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
             }
         }
     }
+    return nEntries;
 }
 
-void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, UniValue& ret)
+//! As ListTransactions, for an accounting entry
+int AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, UniValue& ret, int nSkip = 0)
 {
     bool fAllAccounts = (strAccount == string("*"));
 
     if (fAllAccounts || acentry.strAccount == strAccount) {
+        if (nSkip > 0)
+            return 1;
         UniValue entry(UniValue::VOBJ);
         entry.push_back(Pair("account", acentry.strAccount));
         entry.push_back(Pair("category", "move"));
@@ -1243,7 +1298,9 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Un
         entry.push_back(Pair("otheraccount", acentry.strOtherAccount));
         entry.push_back(Pair("comment", acentry.strComment));
         ret.push_back(entry);
+        return 1;
     }
+    return 0;
 }
 
 UniValue listtransactions(const UniValue& params, bool fHelp)
@@ -1323,36 +1380,26 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
     UniValue ret(UniValue::VARR);
+    CBitcoinAddressCache addressCache;
 
     const CWallet::TxItems & txOrdered = pwalletMain->wtxOrdered;
 
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it) {
+    // iterate backwards until we have nCount items to return, the first
+    // nFrom entries are only counted:
+    int nSkip = nFrom;
+    for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend() && (int)ret.size() < nCount; ++it) {
         CWalletTx* const pwtx = (*it).second.first;
         if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
+            nSkip -= std::min(nSkip, ListTransactions(*pwtx, strAccount, 0, true, ret, filter, addressCache, nSkip));
         CAccountingEntry* const pacentry = (*it).second.second;
         if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
-
-        if ((int)ret.size() >= (nCount + nFrom)) break;
+            nSkip -= std::min(nSkip, AcentryToJSON(*pacentry, strAccount, ret, nSkip));
     }
     // ret is newest to oldest
 
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
-
     vector<UniValue> arrTmp = ret.getValues();
-
-    vector<UniValue>::iterator first = arrTmp.begin();
-    std::advance(first, nFrom);
-    vector<UniValue>::iterator last = arrTmp.begin();
-    std::advance(last, nFrom+nCount);
-
-    if (last != arrTmp.end()) arrTmp.erase(last, arrTmp.end());
-    if (first != arrTmp.begin()) arrTmp.erase(arrTmp.begin(), first);
+    if ((int)arrTmp.size() > nCount)
+        arrTmp.resize(nCount);
 
     std::reverse(arrTmp.begin(), arrTmp.end()); // Return oldest to newest
 
@@ -1396,7 +1443,7 @@ UniValue listaccounts(const UniValue& params, bool fHelp)
 
     map<string, CAmount> mapAccountBalances;
     BOOST_FOREACH (const PAIRTYPE(CTxDestination, CAddressBookData) & entry, pwalletMain->mapAddressBook) {
-        if (IsMine(*pwalletMain, entry.first) & includeWatchonly) // This address belongs to me
+        if (pwalletMain->IsMine(entry.first) & includeWatchonly) // This address belongs to me
             mapAccountBalances[entry.second.name] = 0;
     }
 
@@ -1498,12 +1545,19 @@ UniValue listsinceblock(const UniValue& params, bool fHelp)
     int depth = pindex ? (1 + chainActive.Height() - pindex->nHeight) : -1;
 
     UniValue transactions(UniValue::VARR);
-
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++) {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain(false) < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+    CBitcoinAddressCache addressCache;
+
+    if (depth == -1) {
+        for (map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions, filter, addressCache);
+    } else {
+        // Only those above pindex can be less deep than it
+        std::vector<const CWalletTx*> vwtx;
+        pwalletMain->GetTransactionsAbove(pindex->nHeight, vwtx);
+        BOOST_FOREACH (const CWalletTx* pwtx, vwtx) {
+            if (pwtx->GetDepthInMainChain(false) < depth)
+                ListTransactions(*pwtx, "*", 0, true, transactions, filter, addressCache);
+        }
     }
 
     CBlockIndex* pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -1579,10 +1633,14 @@ UniValue gettransaction(const UniValue& params, bool fHelp)
     WalletTxToJSON(wtx, entry);
 
     UniValue details(UniValue::VARR);
-    ListTransactions(wtx, "*", 0, false, details, filter);
+    CBitcoinAddressCache addressCache;
+    ListTransactions(wtx, "*", 0, false, details, filter, addressCache);
     entry.push_back(Pair("details", details));
 
-    string strHex = EncodeHexTx(static_cast<CTransaction>(wtx));
+    CTransaction txFull;
+    if (!pwalletMain->GetFullTransaction(wtx, txFull))
+        throw JSONRPCError(RPC_WALLET_ERROR, "Unable to read the transaction from the wallet file");
+    string strHex = EncodeHexTx(txFull);
     entry.push_back(Pair("hex", strHex));
 
     return entry;
@@ -936,6 +936,48 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
 
 namespace {
 
+/** Stream that SHA256 hashes what is serialized into it */
+class CSHA256Writer
+{
+public:
+    CSHA256 sha;
+
+    CSHA256Writer() {}
+    explicit CSHA256Writer(const CSHA256& shaIn) : sha(shaIn) {}
+
+    CSHA256Writer& write(const char* pch, size_t size)
+    {
+        sha.Write((const unsigned char*)pch, size);
+        return *this;
+    }
+
+    //! Double SHA256, as CHashWriter
+    uint256 GetHash()
+    {
+        unsigned char buf[CSHA256::OUTPUT_SIZE];
+        uint256 result;
+        sha.Finalize(buf);
+        CSHA256().Write(buf, CSHA256::OUTPUT_SIZE).Finalize((unsigned char*)&result);
+        return result;
+    }
+};
+
+/** Stream that appends what is serialized into it to a vector */
+class CBytesWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+
+public:
+    explicit CBytesWriter(std::vector<unsigned char>& vchIn) : vch(vchIn) {}
+
+    CBytesWriter& write(const char* pch, size_t size)
+    {
+        vch.insert(vch.end(), (const unsigned char*)pch, (const unsigned char*)pch + size);
+        return *this;
+    }
+};
+
 /**
  * Wrapper that serializes like CTransaction, but with the modifications
  *  required for the signature hash done in-place
@@ -1033,7 +1075,30 @@ public:
 
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+CSignatureHashCache::CSignatureHashCache(const CTransaction& txTo)
+{
+    CSHA256Writer ss;
+    ::Serialize(ss, txTo.nVersion, SER_GETHASH, 0);
+    ::WriteCompactSize(ss, txTo.vin.size());
+
+    CBytesWriter ssInputs(vchInputs);
+    vchInputs.reserve(txTo.vin.size() * BLANK_INPUT_SIZE);
+    vPrefix.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vPrefix.push_back(ss.sha);
+        ::Serialize(ssInputs, txTo.vin[i].prevout, SER_GETHASH, 0);
+        ::Serialize(ssInputs, CScript(), SER_GETHASH, 0);
+        ::Serialize(ssInputs, txTo.vin[i].nSequence, SER_GETHASH, 0);
+        ss.write((const char*)&vchInputs[i * BLANK_INPUT_SIZE], BLANK_INPUT_SIZE);
+    }
+    assert(vchInputs.size() == txTo.vin.size() * BLANK_INPUT_SIZE);
+
+    CBytesWriter ssOutputs(vchOutputs);
+    ::Serialize(ssOutputs, txTo.vout, SER_GETHASH, 0);
+    ::Serialize(ssOutputs, txTo.nLockTime, SER_GETHASH, 0);
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache)
 {
     if (nIn >= txTo.vin.size()) {
         //  nIn out of range
@@ -1051,6 +1116,21 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    // SIGHASH_ALL, or an undefined type that hashes like it: only the input
+    // being signed differs from what the cache has
+    int nBaseType = nHashType & 0x1f;
+    if (pcache && !(nHashType & SIGHASH_ANYONECANPAY) && nBaseType != SIGHASH_SINGLE && nBaseType != SIGHASH_NONE) {
+        assert(pcache->vPrefix.size() == txTo.vin.size());
+        CSHA256Writer ss(pcache->vPrefix[nIn]);
+        txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+        size_t nAfter = (nIn + 1) * CSignatureHashCache::BLANK_INPUT_SIZE;
+        if (nAfter < pcache->vchInputs.size())
+            ss.write((const char*)&pcache->vchInputs[nAfter], pcache->vchInputs.size() - nAfter);
+        ss.write((const char*)&pcache->vchOutputs[0], pcache->vchOutputs.size());
+        ::Serialize(ss, nHashType, SER_GETHASH, 0);
+        return ss.GetHash();
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1075,7 +1155,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, pcache);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
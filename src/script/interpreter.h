@@ -7,6 +7,7 @@
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
 #include "script_error.h"
+#include "crypto/sha256.h"
 #include "primitives/transaction.h"
 
 #include <vector>
@@ -72,7 +73,41 @@ enum
 
 };
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+class CSignatureHashCache;
+
+/** Signature hash of input nIn of txTo, using pcache, built from txTo, if given */
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache = NULL);
+
+/**
+ * The parts of the SIGHASH_ALL signature hashes of a transaction that do
+ * not depend on the input being signed, so checking all inputs does not
+ * serialize the whole transaction again for each of them: the SHA256 state
+ * after the blanked inputs in front of each input, and the serialized
+ * blanked inputs, outputs and nLockTime that follow it.
+ *
+ * What follows the input still has to be hashed for each input, so the
+ * hashing stays quadratic in the number of inputs, as the legacy signature
+ * hash is by design, but at about half the cost and without serializing.
+ * Other hash types are computed as before.
+ */
+class CSignatureHashCache
+{
+private:
+    //! SHA256 state after nVersion, the input count and the blanked inputs before each input
+    std::vector<CSHA256> vPrefix;
+    //! The inputs with empty scripts, BLANK_INPUT_SIZE bytes each
+    std::vector<unsigned char> vchInputs;
+    //! The outputs with their count, and nLockTime
+    std::vector<unsigned char> vchOutputs;
+
+    friend uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache);
+
+public:
+    //! Serialized size of an input with an empty script
+    static const size_t BLANK_INPUT_SIZE = 41;
+
+    explicit CSignatureHashCache(const CTransaction& txTo);
+};
 
 class BaseSignatureChecker
 {
@@ -90,12 +125,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const CSignatureHashCache* pcache;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CSignatureHashCache* pcacheIn = NULL) : txTo(txToIn), nIn(nInIn), pcache(pcacheIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
 };
 
@@ -9,7 +9,9 @@
 #include <assert.h>
 #include <climits>
 #include <limits>
+#include "prevector.h"
 #include "pubkey.h"
+#include "serialize.h"
 #include <stdexcept>
 #include <stdint.h>
 #include <string.h>
@@ -345,8 +347,14 @@ private:
     int64_t m_value;
 };
 
+/**
+ * Storage of a script, inline up to 28 bytes: the usual P2PKH and P2SH
+ * output scripts are copied around without allocating.
+ */
+typedef prevector<28, unsigned char> CScriptBase;
+
 /** Serialized script, used inside transaction inputs and outputs */
-class CScript : public std::vector<unsigned char>
+class CScript : public CScriptBase
 {
 protected:
     CScript& push_int64(int64_t n)
@@ -367,9 +375,9 @@ protected:
     }
 public:
     CScript() { }
-    CScript(const CScript& b) : std::vector<unsigned char>(b.begin(), b.end()) { }
-    CScript(const_iterator pbegin, const_iterator pend) : std::vector<unsigned char>(pbegin, pend) { }
-    CScript(const unsigned char* pbegin, const unsigned char* pend) : std::vector<unsigned char>(pbegin, pend) { }
+    CScript(const CScript& b) : CScriptBase(b) { }
+    CScript(const_iterator pbegin, const_iterator pend) : CScriptBase(pbegin, pend) { }
+    CScript(std::vector<unsigned char>::const_iterator pbegin, std::vector<unsigned char>::const_iterator pend) : CScriptBase(pbegin, pend) { }
 
     CScript& operator+=(const CScript& b)
     {
@@ -610,9 +618,26 @@ public:
     std::string ToString() const;
     void clear()
     {
-        // The default std::vector::clear() does not release memory.
-        std::vector<unsigned char>().swap(*this);
+        // A cleared script keeps no heap memory
+        CScriptBase().swap(*this);
     }
 };
 
+inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion)
+{
+    return GetSerializeSize(static_cast<const CScriptBase&>(v), nType, nVersion);
+}
+
+template <typename Stream>
+void Serialize(Stream& os, const CScript& v, int nType, int nVersion)
+{
+    Serialize(os, static_cast<const CScriptBase&>(v), nType, nVersion);
+}
+
+template <typename Stream>
+void Unserialize(Stream& is, CScript& v, int nType, int nVersion)
+{
+    Unserialize(is, static_cast<CScriptBase&>(v), nType, nVersion);
+}
+
 #endif // BITCOIN_SCRIPT_SCRIPT_H
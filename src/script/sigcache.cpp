@@ -5,13 +5,15 @@
 
 #include "sigcache.h"
 
+#include "crypto/sha256.h"
+#include "largepages.h"
+#include "metrics.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 namespace {
 
@@ -19,67 +21,136 @@ namespace {
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
  * again when accepted into the block chain)
+ *
+ * Entries are salted SHA256 digests of (signature hash, public key, signature)
+ * in a fixed size table, split in shards so the -par script threads rarely
+ * contend for the same lock. Each shard is a set-associative table: a digest
+ * may live in any of SIGCACHE_WAYS slots of its bucket, and when they are all
+ * taken one of them is overwritten at random. An all-zero slot is empty.
  */
 class CSignatureCache
 {
 private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    struct Shard {
+        boost::shared_mutex cs;
+        std::vector<uint256, large_page_allocator<uint256> > vSlots;
+        size_t nEntries;
+        Shard() : nEntries(0) {}
+    };
+
+    //! Salt so nobody can predict which entries collide
+    uint256 nonce;
+    Shard vShards[SIGCACHE_SHARDS];
+    uint64_t nBucketMask;
+
+    void ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+    {
+        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(pubkey.begin(), pubkey.size()).Write(vchSig.empty() ? NULL : &vchSig[0], vchSig.size()).Finalize(entry.begin());
+    }
+
+    Shard& GetShard(uint64_t nBits) { return vShards[nBits % SIGCACHE_SHARDS]; }
+    size_t GetBucket(uint64_t nBits) const { return ((nBits / SIGCACHE_SHARDS) & nBucketMask) * SIGCACHE_WAYS; }
 
 public:
+    CSignatureCache() : nBucketMask(0)
+    {
+        nonce = GetRandHash();
+
+        int64_t nMaxCacheSize = std::min(std::max(GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE), (int64_t)0), MAX_SIG_CACHE_SIZE) * ((size_t)1 << 20);
+        size_t nBuckets = nMaxCacheSize / (sizeof(uint256) * SIGCACHE_WAYS * SIGCACHE_SHARDS);
+        if (nBuckets == 0)
+            return;
+        // round down to a power of two so a mask picks the bucket
+        size_t nPow2 = 1;
+        while (nPow2 * 2 <= nBuckets)
+            nPow2 *= 2;
+        nBucketMask = nPow2 - 1;
+        for (unsigned int i = 0; i < SIGCACHE_SHARDS; i++)
+            vShards[i].vSlots.resize(nPow2 * SIGCACHE_WAYS);
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        uint256 entry;
+        ComputeEntry(entry, hash, vchSig, pubKey);
+        uint64_t nBits = entry.GetLow64();
+        Shard& shard = GetShard(nBits);
+        size_t nBucket = GetBucket(nBits);
+
+        boost::shared_lock<boost::shared_mutex> lock(shard.cs);
+        if (shard.vSlots.empty())
+            return false;
+        for (size_t i = nBucket; i < nBucket + SIGCACHE_WAYS; i++)
+            if (shard.vSlots[i] == entry)
+                return true;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
+        uint256 entry;
+        ComputeEntry(entry, hash, vchSig, pubKey);
+        uint64_t nBits = entry.GetLow64();
+        Shard& shard = GetShard(nBits);
+        size_t nBucket = GetBucket(nBits);
+
+        boost::unique_lock<boost::shared_mutex> lock(shard.cs);
+        if (shard.vSlots.empty())
+            return;
+        size_t nFree = nBucket + SIGCACHE_WAYS;
+        for (size_t i = nBucket; i < nBucket + SIGCACHE_WAYS; i++) {
+            if (shard.vSlots[i] == entry)
+                return;
+            if (nFree == nBucket + SIGCACHE_WAYS && shard.vSlots[i] == 0)
+                nFree = i;
+        }
+        if (nFree == nBucket + SIGCACHE_WAYS) {
             // Evict a random entry. Random because that helps
             // foil would-be DoS attackers who might try to pre-generate
             // and re-use a set of valid signatures just-slightly-greater
             // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            nFree = nBucket + GetInsecureRandInt(SIGCACHE_WAYS);
+        } else {
+            shard.nEntries++;
         }
+        shard.vSlots[nFree] = entry;
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    void GetStats(size_t& nEntries, size_t& nBytes)
+    {
+        nEntries = 0;
+        nBytes = 0;
+        for (unsigned int i = 0; i < SIGCACHE_SHARDS; i++) {
+            boost::shared_lock<boost::shared_mutex> lock(vShards[i].cs);
+            nEntries += vShards[i].nEntries;
+            nBytes += vShards[i].vSlots.size() * sizeof(uint256);
+        }
     }
 };
 
+CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+}
+
+void GetSignatureCacheStats(size_t& nEntries, size_t& nBytes)
+{
+    GetSignatureCache().GetStats(nEntries, nBytes);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    metricSigCacheLookups.Add();
+    if (signatureCache.Get(sighash, vchSig, pubkey)) {
+        metricSigCacheHits.Add();
         return true;
+    }
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
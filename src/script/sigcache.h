@@ -12,15 +12,26 @@
 
 class CPubKey;
 
+/** Default and maximum -sigcachesize, in megabytes, all of which is allocated at the first check */
+static const int64_t DEFAULT_SIG_CACHE_SIZE = 32;
+static const int64_t MAX_SIG_CACHE_SIZE = 1024;
+/** Independently locked parts of the signature cache */
+static const unsigned int SIGCACHE_SHARDS = 16;
+/** Slots a signature cache entry can occupy within its bucket */
+static const unsigned int SIGCACHE_WAYS = 8;
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
     bool store;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true) : TransactionSignatureChecker(txToIn, nInIn), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true, const CSignatureHashCache* pcacheIn=NULL) : TransactionSignatureChecker(txToIn, nInIn, pcacheIn), store(storeIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Number of cached signatures and memory allocated for them */
+void GetSignatureCacheStats(size_t& nEntries, size_t& nBytes);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
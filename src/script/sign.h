@@ -21,6 +21,13 @@ bool Sign1(const CKeyID& address, const CKeyStore& keystore, uint256 hash, int n
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 
+/**
+ * Sign input nIn of txTo into scriptSigRet, leaving txTo alone so that its
+ * inputs can be signed by several threads, with the signature hashes from
+ * pcache, built from txTo, when given.
+ */
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType, CScript& scriptSigRet, const CSignatureHashCache* pcache = NULL);
+
 /**
  * Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
  * combine them intelligently and return the result.
@@ -37,20 +37,44 @@ const char* GetTxnOutputType(txnouttype t)
 /**
  * Return public keys or hashes from scriptPubKey, for 'standard' transaction types.
  */
+static multimap<txnouttype, CScript> MakeTemplates()
+{
+    multimap<txnouttype, CScript> mTemplates;
+
+    // Standard tx, sender provides pubkey, receiver adds signature
+    mTemplates.insert(make_pair(TX_PUBKEY, CScript() << OP_PUBKEY << OP_CHECKSIG));
+
+    // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
+    mTemplates.insert(make_pair(TX_PUBKEYHASH, CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG));
+
+    // Sender provides N pubkeys, receivers provides M signatures
+    mTemplates.insert(make_pair(TX_MULTISIG, CScript() << OP_SMALLINTEGER << OP_PUBKEYS << OP_SMALLINTEGER << OP_CHECKMULTISIG));
+    return mTemplates;
+}
+
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet)
 {
-    // Templates
-    static multimap<txnouttype, CScript> mTemplates;
-    if (mTemplates.empty())
-    {
-        // Standard tx, sender provides pubkey, receiver adds signature
-        mTemplates.insert(make_pair(TX_PUBKEY, CScript() << OP_PUBKEY << OP_CHECKSIG));
+    // Templates, built once even with several threads calling
+    static const multimap<txnouttype, CScript> mTemplates = MakeTemplates();
 
-        // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
-        mTemplates.insert(make_pair(TX_PUBKEYHASH, CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG));
+    // Shortcut for pay-to-pubkey-hash, the form of almost every output:
+    // OP_DUP OP_HASH160 20 [20 byte hash] OP_EQUALVERIFY OP_CHECKSIG
+    if (scriptPubKey.size() == 25 && scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 && scriptPubKey[2] == 20 &&
+        scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG)
+    {
+        typeRet = TX_PUBKEYHASH;
+        vSolutionsRet.push_back(valtype(scriptPubKey.begin() + 3, scriptPubKey.begin() + 23));
+        return true;
+    }
 
-        // Sender provides N pubkeys, receivers provides M signatures
-        mTemplates.insert(make_pair(TX_MULTISIG, CScript() << OP_SMALLINTEGER << OP_PUBKEYS << OP_SMALLINTEGER << OP_CHECKMULTISIG));
+    // Shortcut for pay-to-pubkey, the form of the coinstake outputs:
+    // [33 to 65 byte pubkey, directly pushed] OP_CHECKSIG
+    if (scriptPubKey.size() >= 35 && scriptPubKey.size() <= 67 && scriptPubKey[0] == scriptPubKey.size() - 2 &&
+        scriptPubKey.back() == OP_CHECKSIG)
+    {
+        typeRet = TX_PUBKEY;
+        vSolutionsRet.push_back(valtype(scriptPubKey.begin() + 1, scriptPubKey.end() - 1));
+        return true;
     }
 
     // Shortcut for pay-to-script-hash, which are more constrained than the other types:
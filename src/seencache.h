@@ -0,0 +1,215 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SEENCACHE_H
+#define BITCOIN_SEENCACHE_H
+
+#include "coins.h"
+#include "memusage.h"
+#include "serialize.h"
+#include "streams.h"
+#include "uint256.h"
+#include "version.h"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+/**
+ * The network serialization of a message, for caches that only relay it.
+ * Serialized as the message itself, so a cache file reads the same whether
+ * it holds the messages or their bytes.
+ */
+template <typename T>
+class CRelayBytes
+{
+public:
+    std::vector<char> vch;
+
+    CRelayBytes() {}
+
+    explicit CRelayBytes(const T& obj)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << obj;
+        vch.assign(ss.begin(), ss.end());
+    }
+
+    T Get() const
+    {
+        CDataStream ss(vch, SER_NETWORK, PROTOCOL_VERSION);
+        T obj;
+        ss >> obj;
+        return obj;
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return vch.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        if (!vch.empty())
+            s.write(&vch[0], vch.size());
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        T obj;
+        s >> obj;
+        *this = CRelayBytes(obj);
+    }
+
+    size_t DynamicMemoryUsage() const { return memusage::DynamicUsage(vch); }
+};
+
+/**
+ * Messages seen, by hash, up to nMaxEntries of them. Each entry expires at
+ * the time or height Expiry()(message) gives for it, and an ordered queue of
+ * the expiries lets ExpireBefore() drop the old entries without looking at
+ * the others. When full, the entry to expire first makes room.
+ *
+ * T is the message, V what is kept of it: T itself, or CRelayBytes<T> where
+ * the message is only relayed. Serialized as a std::map<uint256, T>.
+ */
+template <typename T, typename Expiry, typename V = T>
+class CSeenCache
+{
+public:
+    struct CEntry {
+        V value;
+        int64_t nExpiry;
+    };
+
+    typedef boost::unordered_map<uint256, CEntry, CCoinsKeyHasher> EntryMap;
+    typedef typename EntryMap::const_iterator const_iterator;
+
+private:
+    EntryMap mapEntries;
+    std::set<std::pair<int64_t, uint256> > setExpiry;
+    size_t nMaxEntries;
+
+public:
+    explicit CSeenCache(size_t nMaxEntriesIn) : nMaxEntries(nMaxEntriesIn) {}
+
+    size_t size() const { return mapEntries.size(); }
+    bool empty() const { return mapEntries.empty(); }
+    size_t count(const uint256& hash) const { return mapEntries.count(hash); }
+    const_iterator begin() const { return mapEntries.begin(); }
+    const_iterator end() const { return mapEntries.end(); }
+
+    const V* Get(const uint256& hash) const
+    {
+        const_iterator it = mapEntries.find(hash);
+        return it == mapEntries.end() ? NULL : &it->second.value;
+    }
+
+    /** For changes that keep the hash, Refresh() the expiry after */
+    V* Get(const uint256& hash)
+    {
+        typename EntryMap::iterator it = mapEntries.find(hash);
+        return it == mapEntries.end() ? NULL : &it->second.value;
+    }
+
+    /** Add the message unless its hash is there already */
+    bool Insert(const uint256& hash, const T& obj)
+    {
+        if (mapEntries.count(hash) || nMaxEntries == 0)
+            return false;
+        while (mapEntries.size() >= nMaxEntries)
+            Erase(setExpiry.begin()->second);
+
+        CEntry& entry = mapEntries[hash];
+        entry.value = V(obj);
+        entry.nExpiry = Expiry()(obj);
+        setExpiry.insert(std::make_pair(entry.nExpiry, hash));
+        return true;
+    }
+
+    /** Move the entry in the queue after its message changed */
+    void Refresh(const uint256& hash, const T& obj)
+    {
+        typename EntryMap::iterator it = mapEntries.find(hash);
+        if (it == mapEntries.end())
+            return;
+        setExpiry.erase(std::make_pair(it->second.nExpiry, hash));
+        it->second.nExpiry = Expiry()(obj);
+        setExpiry.insert(std::make_pair(it->second.nExpiry, hash));
+    }
+
+    bool Erase(const uint256& hash)
+    {
+        typename EntryMap::iterator it = mapEntries.find(hash);
+        if (it == mapEntries.end())
+            return false;
+        setExpiry.erase(std::make_pair(it->second.nExpiry, hash));
+        mapEntries.erase(it);
+        return true;
+    }
+
+    /** Drop the entries expiring before nLimit, with their expiries and hashes in pvErased if given */
+    size_t ExpireBefore(int64_t nLimit, std::vector<std::pair<int64_t, uint256> >* pvErased = NULL)
+    {
+        size_t nErased = 0;
+        while (!setExpiry.empty() && setExpiry.begin()->first < nLimit) {
+            if (pvErased)
+                pvErased->push_back(*setExpiry.begin());
+            mapEntries.erase(setExpiry.begin()->second);
+            setExpiry.erase(setExpiry.begin());
+            nErased++;
+        }
+        return nErased;
+    }
+
+    void clear()
+    {
+        mapEntries.clear();
+        setExpiry.clear();
+    }
+
+    /** Heap used by the cache itself, without what the kept values point to */
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::DynamicUsage(mapEntries) + memusage::DynamicUsage(setExpiry);
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = GetSizeOfCompactSize(mapEntries.size());
+        for (const_iterator it = mapEntries.begin(); it != mapEntries.end(); ++it)
+            nSize += ::GetSerializeSize(it->first, nType, nVersion) + ::GetSerializeSize(it->second.value, nType, nVersion);
+        return nSize;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, mapEntries.size());
+        for (const_iterator it = mapEntries.begin(); it != mapEntries.end(); ++it) {
+            ::Serialize(s, it->first, nType, nVersion);
+            ::Serialize(s, it->second.value, nType, nVersion);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        clear();
+        uint64_t nSize = ReadCompactSize(s);
+        for (uint64_t i = 0; i < nSize; i++) {
+            uint256 hash;
+            T obj;
+            ::Unserialize(s, hash, nType, nVersion);
+            ::Unserialize(s, obj, nType, nVersion);
+            Insert(hash, obj);
+        }
+    }
+};
+
+#endif // BITCOIN_SEENCACHE_H
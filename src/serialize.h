@@ -16,10 +16,16 @@
 #include <stdint.h>
 #include <string.h>
 #include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "prevector.h"
+
 class CScript;
+class uint160;
+class uint256;
+class uint512;
 
 static const unsigned int MAX_SIZE = 0x02000000;
 
@@ -43,6 +49,28 @@ inline T* NCONST_PTR(const T* val)
     return const_cast<T*>(val);
 }
 
+/**
+ * Types serialized as their memory image, so that a vector of them is
+ * written and read with one write() or read() of all its elements, and its
+ * size known without looking at them. Integers are among them as configure
+ * only supports little-endian platforms.
+ */
+template <typename T>
+struct is_serialized_as_bytes : std::false_type {
+};
+template <> struct is_serialized_as_bytes<char> : std::true_type {};
+template <> struct is_serialized_as_bytes<signed char> : std::true_type {};
+template <> struct is_serialized_as_bytes<unsigned char> : std::true_type {};
+template <> struct is_serialized_as_bytes<int16_t> : std::true_type {};
+template <> struct is_serialized_as_bytes<uint16_t> : std::true_type {};
+template <> struct is_serialized_as_bytes<int32_t> : std::true_type {};
+template <> struct is_serialized_as_bytes<uint32_t> : std::true_type {};
+template <> struct is_serialized_as_bytes<int64_t> : std::true_type {};
+template <> struct is_serialized_as_bytes<uint64_t> : std::true_type {};
+template <> struct is_serialized_as_bytes<uint160> : std::true_type {};
+template <> struct is_serialized_as_bytes<uint256> : std::true_type {};
+template <> struct is_serialized_as_bytes<uint512> : std::true_type {};
+
 /** 
  * Get begin pointer of vector (non-const version).
  * @note These functions avoid the undefined case of indexing into an empty
@@ -431,6 +459,7 @@ I ReadVarInt(Stream& is)
 
 #define FLATDATA(obj) REF(CFlatData((char*)&(obj), (char*)&(obj) + sizeof(obj)))
 #define VARINT(obj) REF(WrapVarInt(REF(obj)))
+#define COMPACTSIZE(obj) REF(CCompactSize(REF(obj)))
 #define LIMITED_STRING(obj, n) REF(LimitedString<n>(REF(obj)))
 
 /** 
@@ -450,6 +479,12 @@ public:
         pbegin = (char*)begin_ptr(v);
         pend = (char*)end_ptr(v);
     }
+    template <unsigned int N, typename T, typename S, typename D>
+    explicit CFlatData(prevector<N, T, S, D>& v)
+    {
+        pbegin = (char*)v.data();
+        pend = (char*)(v.data() + v.size());
+    }
     char* begin() { return pbegin; }
     const char* begin() const { return pbegin; }
     char* end() { return pend; }
@@ -500,6 +535,33 @@ public:
     }
 };
 
+/** Wrapper for serializing a size as a CompactSize */
+class CCompactSize
+{
+protected:
+    uint64_t& n;
+
+public:
+    CCompactSize(uint64_t& nIn) : n(nIn) {}
+
+    unsigned int GetSerializeSize(int, int) const
+    {
+        return GetSizeOfCompactSize(n);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int, int) const
+    {
+        WriteCompactSize<Stream>(s, n);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int, int)
+    {
+        n = ReadCompactSize<Stream>(s);
+    }
+};
+
 template <size_t Limit>
 class LimitedString
 {
@@ -557,31 +619,54 @@ void Unserialize(Stream& is, std::basic_string<C>& str, int, int = 0);
 
 /**
  * vector
- * vectors of unsigned char are a special case and are intended to be serialized as a single opaque blob.
+ * vectors of is_serialized_as_bytes types, unsigned char above all, are serialized as a single opaque blob.
  */
 template <typename T, typename A>
-unsigned int GetSerializeSize_impl(const std::vector<T, A>& v, int nType, int nVersion, const unsigned char&);
-template <typename T, typename A, typename V>
-unsigned int GetSerializeSize_impl(const std::vector<T, A>& v, int nType, int nVersion, const V&);
+unsigned int GetSerializeSize_impl(const std::vector<T, A>& v, int nType, int nVersion, std::true_type);
+template <typename T, typename A>
+unsigned int GetSerializeSize_impl(const std::vector<T, A>& v, int nType, int nVersion, std::false_type);
 template <typename T, typename A>
 inline unsigned int GetSerializeSize(const std::vector<T, A>& v, int nType, int nVersion);
 template <typename Stream, typename T, typename A>
-void Serialize_impl(Stream& os, const std::vector<T, A>& v, int nType, int nVersion, const unsigned char&);
-template <typename Stream, typename T, typename A, typename V>
-void Serialize_impl(Stream& os, const std::vector<T, A>& v, int nType, int nVersion, const V&);
+void Serialize_impl(Stream& os, const std::vector<T, A>& v, int nType, int nVersion, std::true_type);
+template <typename Stream, typename T, typename A>
+void Serialize_impl(Stream& os, const std::vector<T, A>& v, int nType, int nVersion, std::false_type);
 template <typename Stream, typename T, typename A>
 inline void Serialize(Stream& os, const std::vector<T, A>& v, int nType, int nVersion);
 template <typename Stream, typename T, typename A>
-void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, const unsigned char&);
-template <typename Stream, typename T, typename A, typename V>
-void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, const V&);
+void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, std::true_type);
+template <typename Stream, typename T, typename A>
+void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, std::false_type);
 template <typename Stream, typename T, typename A>
 inline void Unserialize(Stream& is, std::vector<T, A>& v, int nType, int nVersion);
 
 /**
- * others derived from vector
+ * prevector
+ * prevectors of is_serialized_as_bytes types, unsigned char above all, are serialized as a single opaque blob.
+ */
+template <unsigned int N, typename T>
+unsigned int GetSerializeSize_impl(const prevector<N, T>& v, int nType, int nVersion, std::true_type);
+template <unsigned int N, typename T>
+unsigned int GetSerializeSize_impl(const prevector<N, T>& v, int nType, int nVersion, std::false_type);
+template <unsigned int N, typename T>
+inline unsigned int GetSerializeSize(const prevector<N, T>& v, int nType, int nVersion);
+template <typename Stream, unsigned int N, typename T>
+void Serialize_impl(Stream& os, const prevector<N, T>& v, int nType, int nVersion, std::true_type);
+template <typename Stream, unsigned int N, typename T>
+void Serialize_impl(Stream& os, const prevector<N, T>& v, int nType, int nVersion, std::false_type);
+template <typename Stream, unsigned int N, typename T>
+inline void Serialize(Stream& os, const prevector<N, T>& v, int nType, int nVersion);
+template <typename Stream, unsigned int N, typename T>
+void Unserialize_impl(Stream& is, prevector<N, T>& v, int nType, int nVersion, std::true_type);
+template <typename Stream, unsigned int N, typename T>
+void Unserialize_impl(Stream& is, prevector<N, T>& v, int nType, int nVersion, std::false_type);
+template <typename Stream, unsigned int N, typename T>
+inline void Unserialize(Stream& is, prevector<N, T>& v, int nType, int nVersion);
+
+/**
+ * CScript, defined with it in script/script.h
  */
-extern inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion);
+inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion);
 template <typename Stream>
 void Serialize(Stream& os, const CScript& v, int nType, int nVersion);
 template <typename Stream>
@@ -674,13 +759,13 @@ void Unserialize(Stream& is, std::basic_string<C>& str, int, int)
  * vector
  */
 template <typename T, typename A>
-unsigned int GetSerializeSize_impl(const std::vector<T, A>& v, int nType, int nVersion, const unsigned char&)
+unsigned int GetSerializeSize_impl(const std::vector<T, A>& v, int nType, int nVersion, std::true_type)
 {
     return (GetSizeOfCompactSize(v.size()) + v.size() * sizeof(T));
 }
 
-template <typename T, typename A, typename V>
-unsigned int GetSerializeSize_impl(const std::vector<T, A>& v, int nType, int nVersion, const V&)
+template <typename T, typename A>
+unsigned int GetSerializeSize_impl(const std::vector<T, A>& v, int nType, int nVersion, std::false_type)
 {
     unsigned int nSize = GetSizeOfCompactSize(v.size());
     for (typename std::vector<T, A>::const_iterator vi = v.begin(); vi != v.end(); ++vi)
@@ -691,20 +776,20 @@ unsigned int GetSerializeSize_impl(const std::vector<T, A>& v, int nType, int nV
 template <typename T, typename A>
 inline unsigned int GetSerializeSize(const std::vector<T, A>& v, int nType, int nVersion)
 {
-    return GetSerializeSize_impl(v, nType, nVersion, T());
+    return GetSerializeSize_impl(v, nType, nVersion, typename is_serialized_as_bytes<T>::type());
 }
 
 
 template <typename Stream, typename T, typename A>
-void Serialize_impl(Stream& os, const std::vector<T, A>& v, int nType, int nVersion, const unsigned char&)
+void Serialize_impl(Stream& os, const std::vector<T, A>& v, int nType, int nVersion, std::true_type)
 {
     WriteCompactSize(os, v.size());
     if (!v.empty())
         os.write((char*)&v[0], v.size() * sizeof(T));
 }
 
-template <typename Stream, typename T, typename A, typename V>
-void Serialize_impl(Stream& os, const std::vector<T, A>& v, int nType, int nVersion, const V&)
+template <typename Stream, typename T, typename A>
+void Serialize_impl(Stream& os, const std::vector<T, A>& v, int nType, int nVersion, std::false_type)
 {
     WriteCompactSize(os, v.size());
     for (typename std::vector<T, A>::const_iterator vi = v.begin(); vi != v.end(); ++vi)
@@ -714,12 +799,12 @@ void Serialize_impl(Stream& os, const std::vector<T, A>& v, int nType, int nVers
 template <typename Stream, typename T, typename A>
 inline void Serialize(Stream& os, const std::vector<T, A>& v, int nType, int nVersion)
 {
-    Serialize_impl(os, v, nType, nVersion, T());
+    Serialize_impl(os, v, nType, nVersion, typename is_serialized_as_bytes<T>::type());
 }
 
 
 template <typename Stream, typename T, typename A>
-void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, const unsigned char&)
+void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, std::true_type)
 {
     // Limit size per read so bogus size value won't cause out of memory
     v.clear();
@@ -733,8 +818,8 @@ void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion,
     }
 }
 
-template <typename Stream, typename T, typename A, typename V>
-void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, const V&)
+template <typename Stream, typename T, typename A>
+void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, std::false_type)
 {
     v.clear();
     unsigned int nSize = ReadCompactSize(is);
@@ -753,28 +838,94 @@ void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion,
 template <typename Stream, typename T, typename A>
 inline void Unserialize(Stream& is, std::vector<T, A>& v, int nType, int nVersion)
 {
-    Unserialize_impl(is, v, nType, nVersion, T());
+    Unserialize_impl(is, v, nType, nVersion, typename is_serialized_as_bytes<T>::type());
 }
 
 
 /**
- * others derived from vector
+ * prevector
  */
-inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion)
+template <unsigned int N, typename T>
+unsigned int GetSerializeSize_impl(const prevector<N, T>& v, int nType, int nVersion, std::true_type)
 {
-    return GetSerializeSize((const std::vector<unsigned char>&)v, nType, nVersion);
+    return (GetSizeOfCompactSize(v.size()) + v.size() * sizeof(T));
 }
 
-template <typename Stream>
-void Serialize(Stream& os, const CScript& v, int nType, int nVersion)
+template <unsigned int N, typename T>
+unsigned int GetSerializeSize_impl(const prevector<N, T>& v, int nType, int nVersion, std::false_type)
 {
-    Serialize(os, (const std::vector<unsigned char>&)v, nType, nVersion);
+    unsigned int nSize = GetSizeOfCompactSize(v.size());
+    for (typename prevector<N, T>::const_iterator vi = v.begin(); vi != v.end(); ++vi)
+        nSize += GetSerializeSize((*vi), nType, nVersion);
+    return nSize;
 }
 
-template <typename Stream>
-void Unserialize(Stream& is, CScript& v, int nType, int nVersion)
+template <unsigned int N, typename T>
+inline unsigned int GetSerializeSize(const prevector<N, T>& v, int nType, int nVersion)
+{
+    return GetSerializeSize_impl(v, nType, nVersion, typename is_serialized_as_bytes<T>::type());
+}
+
+
+template <typename Stream, unsigned int N, typename T>
+void Serialize_impl(Stream& os, const prevector<N, T>& v, int nType, int nVersion, std::true_type)
 {
-    Unserialize(is, (std::vector<unsigned char>&)v, nType, nVersion);
+    WriteCompactSize(os, v.size());
+    if (!v.empty())
+        os.write((char*)&v[0], v.size() * sizeof(T));
+}
+
+template <typename Stream, unsigned int N, typename T>
+void Serialize_impl(Stream& os, const prevector<N, T>& v, int nType, int nVersion, std::false_type)
+{
+    WriteCompactSize(os, v.size());
+    for (typename prevector<N, T>::const_iterator vi = v.begin(); vi != v.end(); ++vi)
+        ::Serialize(os, (*vi), nType, nVersion);
+}
+
+template <typename Stream, unsigned int N, typename T>
+inline void Serialize(Stream& os, const prevector<N, T>& v, int nType, int nVersion)
+{
+    Serialize_impl(os, v, nType, nVersion, typename is_serialized_as_bytes<T>::type());
+}
+
+
+template <typename Stream, unsigned int N, typename T>
+void Unserialize_impl(Stream& is, prevector<N, T>& v, int nType, int nVersion, std::true_type)
+{
+    // Limit size per read so bogus size value won't cause out of memory
+    v.clear();
+    unsigned int nSize = ReadCompactSize(is);
+    unsigned int i = 0;
+    while (i < nSize) {
+        unsigned int blk = std::min(nSize - i, (unsigned int)(1 + 4999999 / sizeof(T)));
+        v.resize(i + blk);
+        is.read((char*)&v[i], blk * sizeof(T));
+        i += blk;
+    }
+}
+
+template <typename Stream, unsigned int N, typename T>
+void Unserialize_impl(Stream& is, prevector<N, T>& v, int nType, int nVersion, std::false_type)
+{
+    v.clear();
+    unsigned int nSize = ReadCompactSize(is);
+    unsigned int i = 0;
+    unsigned int nMid = 0;
+    while (nMid < nSize) {
+        nMid += 5000000 / sizeof(T);
+        if (nMid > nSize)
+            nMid = nSize;
+        v.resize(nMid);
+        for (; i < nMid; i++)
+            Unserialize(is, v[i], nType, nVersion);
+    }
+}
+
+template <typename Stream, unsigned int N, typename T>
+inline void Unserialize(Stream& is, prevector<N, T>& v, int nType, int nVersion)
+{
+    Unserialize_impl(is, v, nType, nVersion, typename is_serialized_as_bytes<T>::type());
 }
 
 
@@ -910,6 +1061,12 @@ public:
         return *this;
     }
 
+    /** Count nSize bytes an object knows it writes, without writing them */
+    void seek(size_t nSize)
+    {
+        this->nSize += nSize;
+    }
+
     template <typename T>
     CSizeComputer& operator<<(const T& obj)
     {
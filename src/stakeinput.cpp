@@ -8,7 +8,7 @@
 #include "wallet.h"
 
 //!PIV Stake
-bool CPivStake::SetInput(CTransaction txPrev, unsigned int n)
+bool CPivStake::SetInput(const CTransaction& txPrev, unsigned int n)
 {
     this->txFrom = txPrev;
     this->nPosition = n;
@@ -91,6 +91,9 @@ CDataStream CPivStake::GetUniqueness()
 //The block that the UTXO was added to the chain
 CBlockIndex* CPivStake::GetIndexFrom()
 {
+    if (pindexFrom && chainActive.Contains(pindexFrom))
+        return pindexFrom;
+
     uint256 hashBlock = 0;
     CTransaction tx;
     if (GetTransaction(txFrom.GetHash(), tx, hashBlock, true)) {
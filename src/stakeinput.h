@@ -36,7 +36,9 @@ public:
         this->pindexFrom = nullptr;
     }
 
-    bool SetInput(CTransaction txPrev, unsigned int n);
+    bool SetInput(const CTransaction& txPrev, unsigned int n);
+    //! Use a block index already known to hold txFrom instead of looking the transaction up
+    void SetIndexFrom(CBlockIndex* pindex) { pindexFrom = pindex; }
 
     CBlockIndex* GetIndexFrom() override;
     bool GetTxFrom(CTransaction& tx) override;
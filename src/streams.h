@@ -289,6 +289,68 @@ public:
 };
 
 
+/** Read-only stream over a buffer owned by someone else.
+ *
+ * Unlike CDataStream it never copies or compacts the underlying bytes, so the
+ * caller can still use the exact range an object was deserialized from.
+ */
+class CMemoryReader
+{
+private:
+    const char* pchBegin;
+    size_t nSize;
+    size_t nReadPos;
+
+    int nType;
+    int nVersion;
+
+public:
+    CMemoryReader(const char* pchBeginIn, size_t nSizeIn, int nTypeIn, int nVersionIn)
+        : pchBegin(pchBeginIn), nSize(nSizeIn), nReadPos(0), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    const char* begin() const { return pchBegin; }
+    size_t size() const { return nSize - nReadPos; }
+    bool empty() const { return nReadPos == nSize; }
+
+    /** Number of bytes consumed so far */
+    size_t GetReadPos() const { return nReadPos; }
+
+    //
+    // Stream subset
+    //
+    void SetType(int n) { nType = n; }
+    int GetType() { return nType; }
+    void SetVersion(int n) { nVersion = n; }
+    int GetVersion() { return nVersion; }
+
+    CMemoryReader& read(char* pch, size_t nRead)
+    {
+        if (nRead > nSize - nReadPos)
+            throw std::ios_base::failure("CMemoryReader::read() : end of data");
+        memcpy(pch, pchBegin + nReadPos, nRead);
+        nReadPos += nRead;
+        return (*this);
+    }
+
+    CMemoryReader& ignore(int nIgnore)
+    {
+        assert(nIgnore >= 0);
+        if ((size_t)nIgnore > nSize - nReadPos)
+            throw std::ios_base::failure("CMemoryReader::ignore() : end of data");
+        nReadPos += nIgnore;
+        return (*this);
+    }
+
+    template <typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+
 /** Non-refcounted RAII wrapper for FILE*
  *
  * Will automatically close the file when it goes out of scope if not null.
@@ -6,10 +6,13 @@
 #include "swifttx.h"
 #include "activemasternode.h"
 #include "base58.h"
+#include "core_memusage.h"
 #include "key.h"
 #include "masternodeman.h"
 #include "masternode-helpers.h"
+#include "masternode-sync.h"
 #include "masternodeconfig.h"
+#include "memusage.h"
 #include "net.h"
 #include "protocol.h"
 #include "sync.h"
@@ -21,13 +24,70 @@
 using namespace std;
 using namespace boost;
 
-std::map<uint256, CTransaction> mapTxLockReq;
-std::map<uint256, CTransaction> mapTxLockReqRejected;
-std::map<uint256, CConsensusVote> mapTxLockVote;
-std::map<uint256, CTransactionLock> mapTxLocks;
-std::map<COutPoint, uint256> mapLockedInputs;
+CCriticalSection cs_swifttx;
+TxLockReqMap mapTxLockReq;
+TxLockReqMap mapTxLockReqRejected;
+TxLockVoteMap mapTxLockVote;
+TxLockMap mapTxLocks;
+LockedInputMap mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
+//! Expiration and transaction of every lock in mapTxLocks, soonest first
+static std::set<std::pair<int, uint256> > setTxLockExpiry;
+
+namespace
+{
+//! The top SWIFTTX_SIGNATURES_TOTAL Masternodes at a lock height, for the block and list they were ranked in
+struct CSwiftTXQuorum {
+    uint256 hashBlock;
+    unsigned int nListVersion;
+    std::set<COutPoint> setMembers;
+};
+
+CCriticalSection cs_quorums;
+std::map<int64_t, CSwiftTXQuorum> mapQuorums;
+
+bool BuildQuorum(int64_t nBlockHeight, CSwiftTXQuorum& quorum)
+{
+    if (!GetBlockHash(quorum.hashBlock, nBlockHeight)) return false;
+    quorum.nListVersion = mnodeman.GetListVersion();
+    quorum.setMembers.clear();
+    for (int nRank = 1; nRank <= SWIFTTX_SIGNATURES_TOTAL; nRank++) {
+        CMasternode* pmn = mnodeman.GetMasternodeByRank(nRank, nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
+        if (pmn == NULL) break;
+        quorum.setMembers.insert(pmn->vin.prevout);
+    }
+    return true;
+}
+} // anon namespace
+
+bool IsSwiftTXQuorumMember(const CTxIn& vin, int64_t nBlockHeight)
+{
+    uint256 hashBlock;
+    if (!GetBlockHash(hashBlock, nBlockHeight)) return false;
+    unsigned int nListVersion = mnodeman.GetListVersion();
+
+    {
+        LOCK(cs_quorums);
+        std::map<int64_t, CSwiftTXQuorum>::const_iterator it = mapQuorums.find(nBlockHeight);
+        if (it != mapQuorums.end() && it->second.hashBlock == hashBlock && it->second.nListVersion == nListVersion)
+            return it->second.setMembers.count(vin.prevout);
+    }
+
+    // ranked without cs_quorums, ranking checks the Masternodes
+    CSwiftTXQuorum quorum;
+    if (!BuildQuorum(nBlockHeight, quorum)) return false;
+    bool fMember = quorum.setMembers.count(vin.prevout);
+
+    // a quorum ranked from a partial list would stay wrong, keep only those of a synced one
+    if (masternodeSync.IsMasternodeListSynced()) {
+        LOCK(cs_quorums);
+        mapQuorums[nBlockHeight] = quorum;
+        while (mapQuorums.size() > SWIFTTX_QUORUM_HEIGHTS)
+            mapQuorums.erase(mapQuorums.begin());
+    }
+    return fMember;
+}
 
 //txlock - Locks transaction
 //
@@ -82,8 +142,10 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
         pfrom->AddInventoryKnown(inv);
         GetMainSignals().Inventory(inv.hash);
 
-        if (mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())) {
-            return;
+        {
+            LOCK(cs_swifttx);
+            if (mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash()))
+                return;
         }
 
         if (!IsIXTXValid(tx)) {
@@ -114,48 +176,56 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            {
+                LOCK(cs_swifttx);
+                mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            }
 
             LogPrintf("ProcessMessageSwiftTX::ix - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
                 tx.GetHash().ToString().c_str());
 
             if (GetTransactionLockSignatures(tx.GetHash()) == SWIFTTX_SIGNATURES_REQUIRED) {
-                GetMainSignals().NotifyTransactionLock(tx);
+                SyncTransactionLock(tx);
             }
 
             return;
 
         } else {
-            mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
+            bool fReprocess = false;
+            {
+                LOCK(cs_swifttx);
+                mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
 
-            // can we get the conflicting transaction as proof?
+                // can we get the conflicting transaction as proof?
 
-            LogPrintf("ProcessMessageSwiftTX::ix - Transaction Lock Request: %s %s : rejected %s\n",
-                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
-                tx.GetHash().ToString().c_str());
+                LogPrintf("ProcessMessageSwiftTX::ix - Transaction Lock Request: %s %s : rejected %s\n",
+                    pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
+                    tx.GetHash().ToString().c_str());
 
-            BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                if (!mapLockedInputs.count(in.prevout)) {
+                BOOST_FOREACH (const CTxIn& in, tx.vin)
                     mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
-                }
-            }
 
-            // resolve conflicts
-            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
-            if (i != mapTxLocks.end()) {
-                //we only care if we have a complete tx lock
-                if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
-                    if (!CheckForConflictingLocks(tx)) {
-                        LogPrintf("ProcessMessageSwiftTX::ix - Found Existing Complete IX Lock\n");
-
-                        //reprocess the last 15 blocks
-                        ReprocessBlocks(15);
-                        mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+                // resolve conflicts
+                TxLockMap::iterator i = mapTxLocks.find(tx.GetHash());
+                if (i != mapTxLocks.end()) {
+                    //we only care if we have a complete tx lock
+                    if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
+                        if (!CheckForConflictingLocks(tx)) {
+                            LogPrintf("ProcessMessageSwiftTX::ix - Found Existing Complete IX Lock\n");
+                            fReprocess = true;
+                        }
                     }
                 }
             }
 
+            if (fReprocess) {
+                //reprocess the last 15 blocks
+                ReprocessBlocks(15);
+                LOCK(cs_swifttx);
+                mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            }
+
             return;
         }
     } else if (strCommand == "txlvote") // SwiftX Lock Consensus Votes
@@ -166,41 +236,11 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
         CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (mapTxLockVote.count(ctx.GetHash())) {
+        // checked and kept in one go, a vote from two peers at once is counted once
+        if (!AddTxLockVote(ctx))
             return;
-        }
-
-        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
-
-        if (ProcessConsensusVote(pfrom, ctx)) {
-            //Spam/Dos protection
-            /*
-                Masternodes will sometimes propagate votes before the transaction is known to the client.
-                This tracks those messages and allows it at the same rate of the rest of the network, if
-                a peer violates it, it will simply be ignored
-            */
-            if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
-                if (!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)) {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
-
-                if (mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60 * 10) {
-                    LogPrintf("ProcessMessageSwiftTX::ix - masternode is spamming transaction votes: %s %s\n",
-                        ctx.vinMasternode.ToString().c_str(),
-                        ctx.txHash.ToString().c_str());
-                    return;
-                } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
-            }
-            RelayInv(inv);
-        }
-
-        if (mapTxLockReq.count(ctx.txHash) && GetTransactionLockSignatures(ctx.txHash) == SWIFTTX_SIGNATURES_REQUIRED) {
-            GetMainSignals().NotifyTransactionLock(mapTxLockReq[ctx.txHash]);
-        }
 
+        CheckConsensusVote(pfrom, ctx);
         return;
     }
 }
@@ -217,16 +257,18 @@ bool IsIXTXValid(const CTransaction& txCollateral)
     BOOST_FOREACH (const CTxOut o, txCollateral.vout)
         nValueOut += o.nValue;
 
-    BOOST_FOREACH (const CTxIn i, txCollateral.vin) {
-        CTransaction tx2;
-        uint256 hash;
-        if (GetTransaction(i.prevout.hash, tx2, hash, true)) {
-            if (tx2.vout.size() > i.prevout.n) {
-                nValueIn += tx2.vout[i.prevout.n].nValue;
-            }
-        } else {
+    // inputs to lock are confirmed and unspent in the chain, whether or not the request is in the mempool
+    // already, so the coins have them even where their blocks are pruned
+    std::vector<COutPoint> vOutPoints;
+    BOOST_FOREACH (const CTxIn& i, txCollateral.vin)
+        vOutPoints.push_back(i.prevout);
+    std::vector<CUnspentOutput> vOutputs;
+    GetUnspentOutputs(vOutPoints, false, vOutputs);
+    BOOST_FOREACH (const CUnspentOutput& output, vOutputs) {
+        if (output.fFound)
+            nValueIn += output.out.nValue;
+        else
             missingTx = true;
-        }
     }
 
     if (nValueOut > (1000 * COIN)) {
@@ -252,8 +294,43 @@ bool IsIXTXValid(const CTransaction& txCollateral)
     return true;
 }
 
-int64_t CreateNewLock(CTransaction tx)
+CTransactionLock& GetTxLock(const uint256& txHash)
 {
+    AssertLockHeld(cs_swifttx);
+    TxLockMap::iterator it = mapTxLocks.find(txHash);
+    if (it != mapTxLocks.end())
+        return it->second;
+
+    CTransactionLock& lock = mapTxLocks[txHash];
+    lock.nBlockHeight = 0;
+    lock.txHash = txHash;
+    lock.nExpiration = 0;
+    lock.SetExpiration(GetTime() + (60 * 60)); //locks expire after 60 minutes (24 confirmations)
+    lock.nTimeout = GetTime() + (60 * 5);
+    return lock;
+}
+
+bool AddTxLockVote(const CConsensusVote& vote)
+{
+    LOCK(cs_swifttx);
+    if (!mapTxLockVote.insert(make_pair(vote.GetHash(), vote)).second)
+        return false;
+    GetTxLock(vote.txHash).vVoteHashes.push_back(vote.GetHash());
+    return true;
+}
+
+int64_t CreateNewLock(const CTransaction& tx)
+{
+    {
+        LOCK(cs_swifttx);
+        // Even a lock that cannot be voted on keeps the request until it expires
+        if (!mapTxLocks.count(tx.GetHash()))
+            LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
+        else
+            LogPrint("swiftx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
+        GetTxLock(tx.GetHash());
+    }
+
     int64_t nTxAge = 0;
     BOOST_REVERSE_FOREACH (CTxIn i, tx.vin) {
         nTxAge = GetInputAge(i);
@@ -271,20 +348,9 @@ int64_t CreateNewLock(CTransaction tx)
     */
     int nBlockHeight = (chainActive.Tip()->nHeight - nTxAge) + 4;
 
-    if (!mapTxLocks.count(tx.GetHash())) {
-        LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
-
-        CTransactionLock newLock;
-        newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime() + (60 * 60); //locks expire after 60 minutes (24 confirmations)
-        newLock.nTimeout = GetTime() + (60 * 5);
-        newLock.txHash = tx.GetHash();
-        mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
-    } else {
-        mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
-        LogPrint("swiftx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
-    }
-
+    // found again, the ages of the inputs were read without cs_swifttx
+    LOCK(cs_swifttx);
+    GetTxLock(tx.GetHash()).nBlockHeight = nBlockHeight;
 
     return nBlockHeight;
 }
@@ -294,22 +360,15 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
 {
     if (!fMasterNode) return;
 
-    int n = mnodeman.GetMasternodeRank(activeMasternode.vin, nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
-
-    if (n == -1) {
-        LogPrint("swiftx", "SwiftX::DoConsensusVote - Unknown Masternode\n");
-        return;
-    }
-
-    if (n > SWIFTTX_SIGNATURES_TOTAL) {
-        LogPrint("swiftx", "SwiftX::DoConsensusVote - Masternode not in the top %d (%d)\n", SWIFTTX_SIGNATURES_TOTAL, n);
+    if (!IsSwiftTXQuorumMember(activeMasternode.vin, nBlockHeight)) {
+        LogPrint("swiftx", "SwiftX::DoConsensusVote - Masternode not in the top %d\n", SWIFTTX_SIGNATURES_TOTAL);
         return;
     }
     /*
         nBlockHeight calculated from the transaction is the authoritive source
     */
 
-    LogPrint("swiftx", "SwiftX::DoConsensusVote - In the top %d (%d)\n", SWIFTTX_SIGNATURES_TOTAL, n);
+    LogPrint("swiftx", "SwiftX::DoConsensusVote - In the top %d\n", SWIFTTX_SIGNATURES_TOTAL);
 
     CConsensusVote ctx;
     ctx.vinMasternode = activeMasternode.vin;
@@ -324,102 +383,148 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
         return;
     }
 
-    mapTxLockVote[ctx.GetHash()] = ctx;
+    AddTxLockVote(ctx);
 
     CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
     RelayInv(inv);
 }
 
-//received a consensus vote
-bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
+/** Finishes a consensus vote from a peer once its signature was checked */
+static void ConsensusVoteChecked(CNode* pnode, CConsensusVote& ctx, bool fValid)
 {
-    int n = mnodeman.GetMasternodeRank(ctx.vinMasternode, ctx.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
-
-    CMasternode* pmn = mnodeman.Find(ctx.vinMasternode);
-    if (pmn != NULL)
-        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Masternode ADDR %s %d\n", pmn->addr.ToString().c_str(), n);
-
-    if (n == -1) {
-        //can be caused by past versions trying to vote with an invalid protocol
-        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Unknown Masternode\n");
-        mnodeman.AskForMN(pnode, ctx.vinMasternode);
-        return false;
-    }
-
-    if (n > SWIFTTX_SIGNATURES_TOTAL) {
-        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Masternode not in the top %d (%d) - %s\n", SWIFTTX_SIGNATURES_TOTAL, n, ctx.GetHash().ToString().c_str());
-        return false;
-    }
-
-    if (!ctx.SignatureValid()) {
+    if (!fValid) {
         LogPrintf("SwiftX::ProcessConsensusVote - Signature invalid\n");
         // don't ban, it could just be a non-synced masternode
         mnodeman.AskForMN(pnode, ctx.vinMasternode);
-        return false;
+    } else if (ProcessConsensusVote(pnode, ctx)) {
+        //Spam/Dos protection
+        /*
+            Masternodes will sometimes propagate votes before the transaction is known to the client.
+            This tracks those messages and allows it at the same rate of the rest of the network, if
+            a peer violates it, it will simply be ignored
+        */
+        {
+            LOCK(cs_swifttx);
+            if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
+                if (!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)) {
+                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
+                }
+
+                if (mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
+                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60 * 10) {
+                    LogPrintf("ProcessMessageSwiftTX::ix - masternode is spamming transaction votes: %s %s\n",
+                        ctx.vinMasternode.ToString().c_str(),
+                        ctx.txHash.ToString().c_str());
+                    return;
+                } else {
+                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
+                }
+            }
+        }
+        CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
+        RelayInv(inv);
     }
 
-    if (!mapTxLocks.count(ctx.txHash)) {
-        LogPrintf("SwiftX::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
+    CTransaction tx;
+    {
+        LOCK(cs_swifttx);
+        TxLockReqMap::iterator itReq = mapTxLockReq.find(ctx.txHash);
+        if (itReq == mapTxLockReq.end())
+            return;
+        tx = itReq->second;
+    }
+    if (GetTransactionLockSignatures(ctx.txHash) == SWIFTTX_SIGNATURES_REQUIRED)
+        SyncTransactionLock(tx);
+}
 
-        CTransactionLock newLock;
-        newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime() + (60 * 60);
-        newLock.nTimeout = GetTime() + (60 * 5);
-        newLock.txHash = ctx.txHash;
-        mapTxLocks.insert(make_pair(ctx.txHash, newLock));
-    } else
-        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
+struct CConsensusVoteChecked {
+    CConsensusVote ctx;
 
-    //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
-    if (i != mapTxLocks.end()) {
-        (*i).second.AddSignature(ctx);
+    explicit CConsensusVoteChecked(const CConsensusVote& ctxIn) : ctx(ctxIn) {}
 
-#ifdef ENABLE_WALLET
-        if (pwalletMain) {
-            //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
-            if (pwalletMain->mapRequestCount.count(ctx.txHash))
-                pwalletMain->mapRequestCount[ctx.txHash]++;
-        }
-#endif
+    void operator()(CNode* pnode, bool fValid)
+    {
+        ConsensusVoteChecked(pnode, ctx, fValid);
+    }
+};
 
-        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", (*i).second.CountSignatures(), ctx.GetHash().ToString().c_str());
+void CheckConsensusVote(CNode* pnode, CConsensusVote& ctx)
+{
+    CMasternode* pmn = mnodeman.Find(ctx.vinMasternode);
+    if (pmn == NULL) {
+        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Unknown Masternode\n");
+        mnodeman.AskForMN(pnode, ctx.vinMasternode);
+        return;
+    }
+    LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Masternode ADDR %s\n", pmn->addr.ToString().c_str());
 
-        if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
-            LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
+    // membership of the quorum kept for the lock height, the signature goes to the batched check
+    if (!IsSwiftTXQuorumMember(ctx.vinMasternode, ctx.nBlockHeight)) {
+        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Masternode not in the top %d - %s\n", SWIFTTX_SIGNATURES_TOTAL, ctx.GetHash().ToString().c_str());
+        return;
+    }
 
-            CTransaction& tx = mapTxLockReq[ctx.txHash];
-            if (!CheckForConflictingLocks(tx)) {
-#ifdef ENABLE_WALLET
-                if (pwalletMain) {
-                    if (pwalletMain->UpdatedTransaction((*i).second.txHash)) {
-                        nCompleteTXLocks++;
-                    }
-                }
-#endif
+    mnsigcheckqueue.Push(pnode, ctx.GetSignatureCheck(pmn->pubKeyMasternode), CConsensusVoteChecked(ctx));
+}
 
-                if (mapTxLockReq.count(ctx.txHash)) {
-                    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                        if (!mapLockedInputs.count(in.prevout)) {
-                            mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
-                        }
-                    }
-                }
+//received a consensus vote
+bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
+{
+    bool fComplete = false;
+    bool fConflicting = false;
+    bool fRejected = false;
+    {
+        LOCK(cs_swifttx);
+        if (!mapTxLocks.count(ctx.txHash))
+            LogPrintf("SwiftX::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
+        else
+            LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
+
+        //compile consessus vote
+        CTransactionLock& lock = GetTxLock(ctx.txHash);
+        lock.AddSignature(ctx);
+        LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", lock.CountSignatures(), ctx.GetHash().ToString().c_str());
+
+        if (lock.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
+            LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", lock.GetHash().ToString().c_str());
+            fComplete = true;
+
+            TxLockReqMap::iterator itReq = mapTxLockReq.find(ctx.txHash);
+            CTransaction txUnknown;
+            CTransaction& tx = itReq != mapTxLockReq.end() ? itReq->second : txUnknown;
+            fConflicting = CheckForConflictingLocks(tx);
+            if (!fConflicting) {
+                BOOST_FOREACH (const CTxIn& in, tx.vin)
+                    mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
 
                 // resolve conflicts
 
                 //if this tx lock was rejected, we need to remove the conflicting blocks
-                if (mapTxLockReqRejected.count((*i).second.txHash)) {
-                    //reprocess the last 15 blocks
-                    ReprocessBlocks(15);
-                }
+                fRejected = mapTxLockReqRejected.count(ctx.txHash);
             }
         }
-        return true;
     }
 
+#ifdef ENABLE_WALLET
+    if (pwalletMain) {
+        {
+            //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
+            LOCK(pwalletMain->cs_wallet);
+            if (pwalletMain->mapRequestCount.count(ctx.txHash))
+                pwalletMain->mapRequestCount[ctx.txHash]++;
+        }
+        if (fComplete && !fConflicting && pwalletMain->UpdatedTransaction(ctx.txHash)) {
+            LOCK(cs_swifttx);
+            nCompleteTXLocks++;
+        }
+    }
+#endif
 
-    return false;
+    if (fRejected) {
+        //reprocess the last 15 blocks
+        ReprocessBlocks(15);
+    }
+    return true;
 }
 
 bool CheckForConflictingLocks(CTransaction& tx)
@@ -431,22 +536,38 @@ bool CheckForConflictingLocks(CTransaction& tx)
         Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
+    AssertLockHeld(cs_swifttx);
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
-            }
+        LockedInputMap::const_iterator it = mapLockedInputs.find(in.prevout);
+        if (it != mapLockedInputs.end() && it->second != tx.GetHash()) {
+            LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), it->second.ToString().c_str());
+            TxLockMap::iterator itLock = mapTxLocks.find(tx.GetHash());
+            if (itLock != mapTxLocks.end()) itLock->second.SetExpiration(GetTime());
+            itLock = mapTxLocks.find(it->second);
+            if (itLock != mapTxLocks.end()) itLock->second.SetExpiration(GetTime());
+            return true;
         }
     }
 
     return false;
 }
 
+bool FindConflictingLock(const CTransaction& tx, uint256& hashLockRet)
+{
+    LOCK(cs_swifttx);
+    BOOST_FOREACH (const CTxIn& in, tx.vin) {
+        LockedInputMap::const_iterator it = mapLockedInputs.find(in.prevout);
+        if (it != mapLockedInputs.end() && it->second != tx.GetHash()) {
+            hashLockRet = it->second;
+            return true;
+        }
+    }
+    return false;
+}
+
 int64_t GetAverageVoteTime()
 {
+    AssertLockHeld(cs_swifttx);
     std::map<uint256, int64_t>::iterator it = mapUnknownVotes.begin();
     int64_t total = 0;
     int64_t count = 0;
@@ -460,33 +581,39 @@ int64_t GetAverageVoteTime()
     return total / count;
 }
 
+static void EraseLockedInputs(const TxLockReqMap& mapReq, const uint256& txHash)
+{
+    TxLockReqMap::const_iterator it = mapReq.find(txHash);
+    if (it == mapReq.end())
+        return;
+    BOOST_FOREACH (const CTxIn& in, it->second.vin) {
+        LockedInputMap::iterator itInput = mapLockedInputs.find(in.prevout);
+        if (itInput != mapLockedInputs.end() && itInput->second == txHash)
+            mapLockedInputs.erase(itInput);
+    }
+}
+
 void CleanTransactionLocksList()
 {
     if (chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
-
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
-
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
-
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
-
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
-
-                BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
-            }
-
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
-        }
+    LOCK(cs_swifttx);
+    int64_t nNow = GetTime();
+    while (!setTxLockExpiry.empty() && nNow > setTxLockExpiry.begin()->first) { //keep them for an hour
+        uint256 txHash = setTxLockExpiry.begin()->second;
+        setTxLockExpiry.erase(setTxLockExpiry.begin());
+        TxLockMap::iterator it = mapTxLocks.find(txHash);
+        if (it == mapTxLocks.end())
+            continue;
+        LogPrintf("Removing old transaction lock %s\n", txHash.ToString().c_str());
+
+        EraseLockedInputs(mapTxLockReq, txHash);
+        EraseLockedInputs(mapTxLockReqRejected, txHash);
+        mapTxLockReq.erase(txHash);
+        mapTxLockReqRejected.erase(txHash);
+        BOOST_FOREACH (const uint256& hashVote, it->second.vVoteHashes)
+            mapTxLockVote.erase(hashVote);
+        mapTxLocks.erase(it);
     }
 }
 
@@ -494,7 +621,8 @@ int GetTransactionLockSignatures(uint256 txHash)
 {
     if(fLargeWorkForkFound || fLargeWorkInvalidChainFound) return -2;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    LOCK(cs_swifttx);
+    TxLockMap::iterator it = mapTxLocks.find(txHash);
     if(it != mapTxLocks.end()) return it->second.CountSignatures();
 
     return -1;
@@ -506,12 +634,14 @@ uint256 CConsensusVote::GetHash() const
 }
 
 
-bool CConsensusVote::SignatureValid()
+CMasternodeSigCheck CConsensusVote::GetSignatureCheck(const CPubKey& pubKeyMasternode) const
 {
-    std::string errorMessage;
     std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
-    //LogPrintf("verify strMessage %s \n", strMessage.c_str());
+    return CMasternodeSigCheck(pubKeyMasternode, vchMasterNodeSignature, strMessage);
+}
 
+bool CConsensusVote::SignatureValid()
+{
     CMasternode* pmn = mnodeman.Find(vinMasternode);
 
     if (pmn == NULL) {
@@ -519,7 +649,7 @@ bool CConsensusVote::SignatureValid()
         return false;
     }
 
-    if (!masternodeSigner.VerifyMessage(pmn->pubKeyMasternode, vchMasterNodeSignature, strMessage, errorMessage)) {
+    if (!GetSignatureCheck(pmn->pubKeyMasternode)()) {
         LogPrintf("SwiftX::CConsensusVote::SignatureValid() - Verify message failed\n");
         return false;
     }
@@ -533,8 +663,6 @@ bool CConsensusVote::Sign()
 
     CKey key2;
     CPubKey pubkey2;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
-    //LogPrintf("signing strMessage %s \n", strMessage.c_str());
     //LogPrintf("signing privkey %s \n", strMasterNodePrivKey.c_str());
 
     if (!masternodeSigner.SetKey(strMasterNodePrivKey, errorMessage, key2, pubkey2)) {
@@ -542,12 +670,21 @@ bool CConsensusVote::Sign()
         return false;
     }
 
-    if (!masternodeSigner.SignMessage(strMessage, errorMessage, vchMasterNodeSignature, key2)) {
+    return Sign(key2, pubkey2);
+}
+
+bool CConsensusVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
+{
+    std::string errorMessage;
+    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    //LogPrintf("signing strMessage %s \n", strMessage.c_str());
+
+    if (!masternodeSigner.SignMessage(strMessage, errorMessage, vchMasterNodeSignature, keyMasternode)) {
         LogPrintf("CConsensusVote::Sign() - Sign message failed");
         return false;
     }
 
-    if (!masternodeSigner.VerifyMessage(pubkey2, vchMasterNodeSignature, strMessage, errorMessage)) {
+    if (!masternodeSigner.VerifyMessage(pubKeyMasternode, vchMasterNodeSignature, strMessage, errorMessage)) {
         LogPrintf("CConsensusVote::Sign() - Verify message failed");
         return false;
     }
@@ -559,14 +696,12 @@ bool CConsensusVote::Sign()
 bool CTransactionLock::SignaturesValid()
 {
     BOOST_FOREACH (CConsensusVote vote, vecConsensusVotes) {
-        int n = mnodeman.GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
-
-        if (n == -1) {
+        if (mnodeman.Find(vote.vinMasternode) == NULL) {
             LogPrintf("CTransactionLock::SignaturesValid() - Unknown Masternode\n");
             return false;
         }
 
-        if (n > SWIFTTX_SIGNATURES_TOTAL) {
+        if (!IsSwiftTXQuorumMember(vote.vinMasternode, vote.nBlockHeight)) {
             LogPrintf("CTransactionLock::SignaturesValid() - Masternode not in the top %s\n", SWIFTTX_SIGNATURES_TOTAL);
             return false;
         }
@@ -580,6 +715,14 @@ bool CTransactionLock::SignaturesValid()
     return true;
 }
 
+void CTransactionLock::SetExpiration(int nExpirationIn)
+{
+    AssertLockHeld(cs_swifttx);
+    setTxLockExpiry.erase(std::make_pair(nExpiration, txHash));
+    nExpiration = nExpirationIn;
+    setTxLockExpiry.insert(std::make_pair(nExpiration, txHash));
+}
+
 void CTransactionLock::AddSignature(CConsensusVote& cv)
 {
     vecConsensusVotes.push_back(cv);
@@ -602,3 +745,42 @@ int CTransactionLock::CountSignatures()
     }
     return n;
 }
+
+static size_t ConsensusVoteDynamicUsage(const CConsensusVote& vote)
+{
+    return RecursiveDynamicUsage(vote.vinMasternode) + memusage::DynamicUsage(vote.vchMasterNodeSignature);
+}
+
+static size_t TxLockReqDynamicUsage(const TxLockReqMap& mapReq)
+{
+    size_t nUsage = memusage::DynamicUsage(mapReq);
+    for (TxLockReqMap::const_iterator it = mapReq.begin(); it != mapReq.end(); ++it)
+        nUsage += RecursiveDynamicUsage(it->second);
+    return nUsage;
+}
+
+void GetSwiftTXMemoryUsage(std::map<std::string, size_t>& mapUsage)
+{
+    AssertLockHeld(cs_main);
+    LOCK(cs_swifttx);
+    mapUsage["mapTxLockReq"] = TxLockReqDynamicUsage(mapTxLockReq);
+    mapUsage["mapTxLockReqRejected"] = TxLockReqDynamicUsage(mapTxLockReqRejected);
+
+    size_t nUsage = memusage::DynamicUsage(mapTxLockVote);
+    for (TxLockVoteMap::const_iterator it = mapTxLockVote.begin(); it != mapTxLockVote.end(); ++it)
+        nUsage += ConsensusVoteDynamicUsage(it->second);
+    mapUsage["mapTxLockVote"] = nUsage;
+
+    nUsage = memusage::DynamicUsage(mapTxLocks);
+    for (TxLockMap::const_iterator it = mapTxLocks.begin(); it != mapTxLocks.end(); ++it) {
+        const CTransactionLock& lock = it->second;
+        nUsage += memusage::DynamicUsage(lock.vecConsensusVotes) + memusage::DynamicUsage(lock.vVoteHashes);
+        BOOST_FOREACH (const CConsensusVote& vote, lock.vecConsensusVotes)
+            nUsage += ConsensusVoteDynamicUsage(vote);
+    }
+    mapUsage["mapTxLocks"] = nUsage;
+
+    mapUsage["mapLockedInputs"] = memusage::DynamicUsage(mapLockedInputs);
+    mapUsage["mapUnknownVotes"] = memusage::DynamicUsage(mapUnknownVotes);
+    mapUsage["setTxLockExpiry"] = memusage::DynamicUsage(setTxLockExpiry);
+}
@@ -9,10 +9,13 @@
 #include "base58.h"
 #include "key.h"
 #include "main.h"
+#include "masternode-sigcheck.h"
 #include "net.h"
 #include "sync.h"
 #include "util.h"
 
+#include <boost/unordered_map.hpp>
+
 /*
     At 15 signatures, 1/2 of the masternode network can be owned by
     one party without comprimising the security of SwiftX
@@ -24,6 +27,8 @@
 */
 #define SWIFTTX_SIGNATURES_REQUIRED 6
 #define SWIFTTX_SIGNATURES_TOTAL 10
+// lock heights whose quorum is kept
+#define SWIFTTX_QUORUM_HEIGHTS 64
 
 using namespace std;
 using namespace boost;
@@ -34,28 +39,72 @@ class CTransactionLock;
 
 static const int MIN_SWIFTTX_PROTO_VERSION = 70103;
 
-extern map<uint256, CTransaction> mapTxLockReq;
-extern map<uint256, CTransaction> mapTxLockReqRejected;
-extern map<uint256, CConsensusVote> mapTxLockVote;
-extern map<uint256, CTransactionLock> mapTxLocks;
-extern std::map<COutPoint, uint256> mapLockedInputs;
+/** Hashes outpoints with the salted hash of their txid, the keys come from the network */
+class CLockedInputHasher
+{
+private:
+    CCoinsKeyHasher hasher;
+
+public:
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return hasher(outpoint.hash) ^ outpoint.n;
+    }
+};
+
+/**
+ * The lock store. Everything it keeps about a transaction belongs to its
+ * CTransactionLock, which GetTxLock creates on first sight, and goes once the
+ * lock expires: CleanTransactionLocksList takes the locks in the order of
+ * nExpiration, so cleaning up never walks the locks that are still valid.
+ */
+typedef boost::unordered_map<uint256, CTransaction, CCoinsKeyHasher> TxLockReqMap;
+typedef boost::unordered_map<uint256, CConsensusVote, CCoinsKeyHasher> TxLockVoteMap;
+typedef boost::unordered_map<uint256, CTransactionLock, CCoinsKeyHasher> TxLockMap;
+typedef boost::unordered_map<COutPoint, uint256, CLockedInputHasher> LockedInputMap;
+
+/**
+ * Guards the lock store, the maps below, and nCompleteTXLocks. Taken after
+ * cs_main and cs_wallet; nothing else is locked while it is held.
+ */
+extern CCriticalSection cs_swifttx;
+extern TxLockReqMap mapTxLockReq;
+extern TxLockReqMap mapTxLockReqRejected;
+extern TxLockVoteMap mapTxLockVote;
+extern TxLockMap mapTxLocks;
+extern LockedInputMap mapLockedInputs;
 extern int nCompleteTXLocks;
 
+//! The lock of a transaction, a new one without signatures that expires in an hour if there is none. Requires cs_swifttx.
+CTransactionLock& GetTxLock(const uint256& txHash);
+
+//! Keep a vote, it goes when the lock of its transaction expires. False if it was kept already.
+bool AddTxLockVote(const CConsensusVote& vote);
+
 void ReprocessBlocks(int nBlocks);
 
-int64_t CreateNewLock(CTransaction tx);
+//! Whether vin is one of the top SWIFTTX_SIGNATURES_TOTAL Masternodes at the lock height, from the quorum kept for it
+bool IsSwiftTXQuorumMember(const CTxIn& vin, int64_t nBlockHeight);
+
+int64_t CreateNewLock(const CTransaction& tx);
 
 bool IsIXTXValid(const CTransaction& txCollateral);
 
-// if two conflicting locks are approved by the network, they will cancel out
+// if two conflicting locks are approved by the network, they will cancel out. Requires cs_swifttx.
 bool CheckForConflictingLocks(CTransaction& tx);
 
+//! Whether an input of tx is locked for another transaction, the one in hashLockRet
+bool FindConflictingLock(const CTransaction& tx, uint256& hashLockRet);
+
 void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
 //check if we need to vote on this transaction
 void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight);
 
-//process consensus vote message
+//check the rank of a consensus vote and queue its signature, ProcessConsensusVote follows
+void CheckConsensusVote(CNode* pnode, CConsensusVote& ctx);
+
+//process consensus vote message, once its signature was checked
 bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx);
 
 // keep transaction locks in memory for an hour
@@ -66,6 +115,9 @@ int GetTransactionLockSignatures(uint256 txHash);
 
 int64_t GetAverageVoteTime();
 
+/** Estimated heap memory of each lock map, by name. Requires cs_main. */
+void GetSwiftTXMemoryUsage(std::map<std::string, size_t>& mapUsage);
+
 class CConsensusVote
 {
 public:
@@ -76,8 +128,11 @@ public:
 
     uint256 GetHash() const;
 
+    CMasternodeSigCheck GetSignatureCheck(const CPubKey& pubKeyMasternode) const;
     bool SignatureValid();
+    //! With the key of -masternodeprivkey
     bool Sign();
+    bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
 
     ADD_SERIALIZE_METHODS;
 
@@ -97,8 +152,12 @@ public:
     int nBlockHeight;
     uint256 txHash;
     std::vector<CConsensusVote> vecConsensusVotes;
-    int nExpiration;
+    int nExpiration; //! only changed through SetExpiration, which keeps the expiry queue in order
     int nTimeout;
+    //! hashes of the votes for the transaction in mapTxLockVote
+    std::vector<uint256> vVoteHashes;
+
+    void SetExpiration(int nExpirationIn);
 
     bool SignaturesValid();
     int CountSignatures();
@@ -7,11 +7,107 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
+#include <algorithm>
+#include <map>
 #include <stdio.h>
 
 #include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 
+bool fLockStats = DEFAULT_LOCKSTATS;
+
+namespace
+{
+// A plain mutex, so that recording never goes through a profiled lock itself
+boost::mutex mutexLockStats;
+//! By the file and line literals of the lock site, which identify it
+std::map<std::pair<const char*, int>, CLockStats> mapLockStats;
+
+CLockStats& GetSiteStats(const char* pszName, const char* pszFile, int nLine)
+{
+    CLockStats& stats = mapLockStats[std::make_pair(pszFile, nLine)];
+    if (stats.nLine == 0) {
+        stats.strName = pszName;
+        stats.strFile = pszFile;
+        stats.nLine = nLine;
+    }
+    return stats;
+}
+
+bool CompareLockStatsByWait(const CLockStats& a, const CLockStats& b)
+{
+    if (a.nWaitTotal != b.nWaitTotal)
+        return a.nWaitTotal > b.nWaitTotal;
+    return a.nHoldTotal > b.nHoldTotal;
+}
+} // anon namespace
+
+void RecordLockStats(const char* pszName, const char* pszFile, int nLine, bool fContended, int64_t nWait, int64_t nHold)
+{
+    boost::unique_lock<boost::mutex> lock(mutexLockStats);
+    CLockStats& stats = GetSiteStats(pszName, pszFile, nLine);
+    stats.nLocks++;
+    if (fContended)
+        stats.nContended++;
+    stats.nWaitTotal += nWait;
+    stats.nWaitMax = std::max(stats.nWaitMax, nWait);
+    stats.nHoldTotal += nHold;
+    stats.nHoldMax = std::max(stats.nHoldMax, nHold);
+}
+
+void RecordLockTryFailed(const char* pszName, const char* pszFile, int nLine)
+{
+    boost::unique_lock<boost::mutex> lock(mutexLockStats);
+    GetSiteStats(pszName, pszFile, nLine).nTryFailed++;
+}
+
+std::vector<CLockStats> GetLockStats()
+{
+    // A site in a header is seen once per file including it
+    std::map<std::pair<std::string, int>, CLockStats> mapMerged;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexLockStats);
+        for (std::map<std::pair<const char*, int>, CLockStats>::const_iterator it = mapLockStats.begin(); it != mapLockStats.end(); ++it) {
+            CLockStats& merged = mapMerged[std::make_pair(it->second.strFile, it->second.nLine)];
+            if (merged.nLine == 0) {
+                merged = it->second;
+                continue;
+            }
+            merged.nLocks += it->second.nLocks;
+            merged.nContended += it->second.nContended;
+            merged.nTryFailed += it->second.nTryFailed;
+            merged.nWaitTotal += it->second.nWaitTotal;
+            merged.nWaitMax = std::max(merged.nWaitMax, it->second.nWaitMax);
+            merged.nHoldTotal += it->second.nHoldTotal;
+            merged.nHoldMax = std::max(merged.nHoldMax, it->second.nHoldMax);
+        }
+    }
+    std::vector<CLockStats> vStats;
+    vStats.reserve(mapMerged.size());
+    for (std::map<std::pair<std::string, int>, CLockStats>::const_iterator it = mapMerged.begin(); it != mapMerged.end(); ++it)
+        vStats.push_back(it->second);
+    std::sort(vStats.begin(), vStats.end(), CompareLockStatsByWait);
+    return vStats;
+}
+
+void ResetLockStats()
+{
+    boost::unique_lock<boost::mutex> lock(mutexLockStats);
+    mapLockStats.clear();
+}
+
+void LogLockStats(size_t nMax)
+{
+    std::vector<CLockStats> vStats = GetLockStats();
+    LogPrintf("Lock stats, %u lock sites, the %u waited on the longest:\n", vStats.size(), std::min(vStats.size(), nMax));
+    for (size_t i = 0; i < vStats.size() && i < nMax; i++) {
+        const CLockStats& stats = vStats[i];
+        LogPrintf("  %s %s:%d: locked %u times, %u contended, %u try failed, wait %.3fs (max %.3fms), hold %.3fs (max %.3fms)\n",
+            stats.strName, stats.strFile, stats.nLine, stats.nLocks, stats.nContended, stats.nTryFailed,
+            stats.nWaitTotal * 0.000001, stats.nWaitMax * 0.001, stats.nHoldTotal * 0.000001, stats.nHoldMax * 0.001);
+    }
+}
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
@@ -7,6 +7,11 @@
 #define BITCOIN_SYNC_H
 
 #include "threadsafety.h"
+#include "utiltime.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
 
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
@@ -104,6 +109,38 @@ void static inline AssertLockHeldInternal(const char* pszName, const char* pszFi
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+//! -lockstats default
+static const bool DEFAULT_LOCKSTATS = false;
+//! -lockstatsinterval default, seconds between two dumps of the busiest lock sites to the log
+static const int DEFAULT_LOCKSTATS_INTERVAL = 600;
+
+/** Whether LOCK and TRY_LOCK record how long they wait and hold, set once at startup with -lockstats */
+extern bool fLockStats;
+
+/** What the lock profiler recorded for a lock site, times in microseconds */
+struct CLockStats {
+    std::string strName;
+    std::string strFile;
+    int nLine;
+    uint64_t nLocks;     //!< Times the lock was taken
+    uint64_t nContended; //!< Times it was held by another thread when taken
+    uint64_t nTryFailed; //!< TRY_LOCKs that did not get it
+    int64_t nWaitTotal;
+    int64_t nWaitMax;
+    int64_t nHoldTotal;
+    int64_t nHoldMax;
+
+    CLockStats() : nLine(0), nLocks(0), nContended(0), nTryFailed(0), nWaitTotal(0), nWaitMax(0), nHoldTotal(0), nHoldMax(0) {}
+};
+
+void RecordLockStats(const char* pszName, const char* pszFile, int nLine, bool fContended, int64_t nWait, int64_t nHold);
+void RecordLockTryFailed(const char* pszName, const char* pszFile, int nLine);
+/** The lock sites seen so far, the longest total wait first */
+std::vector<CLockStats> GetLockStats();
+void ResetLockStats();
+/** Log the nMax lock sites waited on the longest */
+void LogLockStats(size_t nMax = 20);
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template <typename Mutex>
 class CMutexLock
@@ -111,9 +148,37 @@ class CMutexLock
 private:
     boost::unique_lock<Mutex> lock;
 
+    // Only set when the lock is profiled
+    const char* pszLockName;
+    const char* pszLockFile;
+    int nLockLine;
+    bool fContended;
+    int64_t nTimeWait;
+    int64_t nTimeLocked;
+
+    void EnterProfiled(const char* pszName, const char* pszFile, int nLine)
+    {
+        pszLockName = pszName;
+        pszLockFile = pszFile;
+        nLockLine = nLine;
+        if (lock.try_lock()) {
+            nTimeLocked = GetTimeMicros();
+            return;
+        }
+        fContended = true;
+        int64_t nTimeStart = GetTimeMicros();
+        lock.lock();
+        nTimeLocked = GetTimeMicros();
+        nTimeWait = nTimeLocked - nTimeStart;
+    }
+
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
+        if (fLockStats) {
+            EnterProfiled(pszName, pszFile, nLine);
+            return;
+        }
 #ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock()) {
             PrintLockContention(pszName, pszFile, nLine);
@@ -130,11 +195,24 @@ private:
         lock.try_lock();
         if (!lock.owns_lock())
             LeaveCritical();
+        if (fLockStats) {
+            if (!lock.owns_lock()) {
+                RecordLockTryFailed(pszName, pszFile, nLine);
+            } else {
+                pszLockName = pszName;
+                pszLockFile = pszFile;
+                nLockLine = nLine;
+                nTimeLocked = GetTimeMicros();
+            }
+        }
         return lock.owns_lock();
     }
 
 public:
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock),
+                                                                                                          fContended(false),
+                                                                                                          nTimeWait(0),
+                                                                                                          nTimeLocked(0)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -142,7 +220,9 @@ public:
             Enter(pszName, pszFile, nLine);
     }
 
-    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false)
+    CMutexLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : fContended(false),
+                                                                                                          nTimeWait(0),
+                                                                                                          nTimeLocked(0)
     {
         if (!pmutexIn) return;
 
@@ -155,8 +235,15 @@ public:
 
     ~CMutexLock()
     {
-        if (lock.owns_lock())
-            LeaveCritical();
+        if (!lock.owns_lock())
+            return;
+        LeaveCritical();
+        if (nTimeLocked) {
+            // Recorded once the lock is given back, not to hold it any longer
+            int64_t nHold = GetTimeMicros() - nTimeLocked;
+            lock.unlock();
+            RecordLockStats(pszLockName, pszLockFile, nLockLine, fContended, nTimeWait, nHold);
+        }
     }
 
     operator bool()
@@ -30,9 +30,12 @@ extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nSize;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<NodeId, unsigned int> mapOrphanPeerBytes;
 
 CService ip(uint32_t i)
 {
@@ -197,4 +200,50 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
 }
 
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansBudgetAndExpiry)
+{
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+
+    // A single peer fills its budget, and only its own
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1 * CENT;
+    unsigned int nStored = 0;
+    for (int i = 0; i < 5000; i++) {
+        tx.vin[0].prevout.hash = GetRandHash();
+        if (AddOrphanTx(tx, 1))
+            nStored++;
+    }
+    BOOST_CHECK(nStored > 0 && nStored < 5000);
+    BOOST_CHECK(mapOrphanPeerBytes[1] <= MAX_ORPHAN_TX_PEER_BYTES);
+    tx.vin[0].prevout.hash = GetRandHash();
+    BOOST_CHECK(AddOrphanTx(tx, 2));
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), nStored + 1);
+
+    // Orphans are found by the outpoint they spend
+    COutPoint prevout = tx.vin[0].prevout;
+    BOOST_CHECK(mapOrphanTransactionsByPrev.count(prevout));
+    BOOST_CHECK(!mapOrphanTransactionsByPrev.count(COutPoint(prevout.hash, 1)));
+
+    // Erasing the orphans of a peer frees its budget
+    EraseOrphansFor(1);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 1U);
+    BOOST_CHECK(!mapOrphanPeerBytes.count(1));
+
+    // Nothing expires early, everything once the time is over
+    LimitOrphanTxSize(DEFAULT_MAX_ORPHAN_TRANSACTIONS);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 1U);
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL + 60);
+    LimitOrphanTxSize(DEFAULT_MAX_ORPHAN_TRANSACTIONS);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanPeerBytes.empty());
+
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
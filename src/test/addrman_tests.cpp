@@ -0,0 +1,80 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrman.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "version.h"
+
+#include <set>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+static CAddress MakeAddress(const std::string& strIp, unsigned short nPort)
+{
+    CAddress addr(CService(strIp, nPort));
+    addr.nTime = GetAdjustedTime();
+    return addr;
+}
+
+BOOST_AUTO_TEST_CASE(addrman_select)
+{
+    CAddrMan addrman;
+    CNetAddr source("252.2.2.2");
+
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+    BOOST_CHECK(addrman.Select() == CAddress());
+
+    std::set<std::string> setAdded;
+    for (int i = 1; i <= 20; i++) {
+        CAddress addr = MakeAddress(strprintf("250.%d.1.1", i), 51472);
+        BOOST_CHECK(addrman.Add(addr, source));
+        setAdded.insert(addr.ToStringIPPort());
+    }
+    // Known already
+    BOOST_CHECK(!addrman.Add(MakeAddress("250.1.1.1", 51472), source));
+    BOOST_CHECK_EQUAL(addrman.size(), 20);
+
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(setAdded.count(addrman.Select().ToStringIPPort()));
+
+    // With a tried entry both tables are drawn from
+    addrman.Good(MakeAddress("250.3.1.1", 51472));
+    BOOST_CHECK_EQUAL(addrman.size(), 20);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(setAdded.count(addrman.Select().ToStringIPPort()));
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrMan addrman;
+    CNetAddr source("252.2.2.2");
+    for (int i = 1; i <= 50; i++)
+        addrman.Add(MakeAddress(strprintf("250.%d.%d.1", i % 7 + 1, i), 51472), source);
+    addrman.Good(MakeAddress("250.5.4.1", 51472));
+    int nSize = addrman.size();
+    BOOST_CHECK(nSize > 0);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CAddrMan addrman2;
+    ss >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), nSize);
+
+    // Serialized again the same, whatever the order of the ids
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << addrman2;
+    CDataStream ss3(SER_DISK, CLIENT_VERSION);
+    ss3 << addrman;
+    BOOST_CHECK(ss2.str() == ss3.str());
+
+    addrman2.Clear();
+    BOOST_CHECK_EQUAL(addrman2.size(), 0);
+    BOOST_CHECK(addrman2.Select() == CAddress());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,115 +5,188 @@
 #include "util.h"
 
 #include "allocators.h"
+#include "largepages.h"
+#include "poolresource.h"
+
+#include <map>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
 
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(allocator_tests)
 
-// Dummy memory page locker for platform independent tests
-static const void *last_lock_addr, *last_unlock_addr;
-static size_t last_lock_len, last_unlock_len;
-class TestLocker
+// Dummy page allocator for platform independent tests
+static int lock_calls, unlock_calls, live_regions;
+static size_t test_lock_limit;
+class TestPageAllocator
 {
 public:
-    bool Lock(const void *addr, size_t len)
+    void* AllocateLocked(size_t len, bool& fLocked)
     {
-        last_lock_addr = addr;
-        last_lock_len = len;
-        return true;
+        lock_calls++;
+        live_regions++;
+        fLocked = len <= test_lock_limit;
+        return malloc(len);
     }
-    bool Unlock(const void *addr, size_t len)
+    void FreeLocked(void* addr, size_t len, bool fLocked)
     {
-        last_unlock_addr = addr;
-        last_unlock_len = len;
-        return true;
+        if (fLocked)
+            unlock_calls++;
+        live_regions--;
+        free(addr);
     }
+    size_t GetLimit() { return test_lock_limit; }
 };
 
-BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
+BOOST_AUTO_TEST_CASE(test_LockedPoolBase)
 {
+    typedef LockedPoolBase<TestPageAllocator> TestPool;
     const size_t test_page_size = 4096;
-    LockedPageManagerBase<TestLocker> lpm(test_page_size);
-    size_t addr;
-    last_lock_addr = last_unlock_addr = 0;
-    last_lock_len = last_unlock_len = 0;
-
-    /* Try large number of small objects */
-    addr = 0;
-    for(int i=0; i<1000; ++i)
-    {
-        lpm.LockRange(reinterpret_cast<void*>(addr), 33);
-        addr += 33;
-    }
-    /* Try small number of page-sized objects, straddling two pages */
-    addr = test_page_size*100 + 53;
-    for(int i=0; i<100; ++i)
-    {
-        lpm.LockRange(reinterpret_cast<void*>(addr), test_page_size);
-        addr += test_page_size;
-    }
-    /* Try small number of page-sized objects aligned to exactly one page */
-    addr = test_page_size*300;
-    for(int i=0; i<100; ++i)
-    {
-        lpm.LockRange(reinterpret_cast<void*>(addr), test_page_size);
-        addr += test_page_size;
-    }
-    /* one very large object, straddling pages */
-    lpm.LockRange(reinterpret_cast<void*>(test_page_size*600+1), test_page_size*500);
-    BOOST_CHECK(last_lock_addr == reinterpret_cast<void*>(test_page_size*(600+500)));
-    /* one very large object, page aligned */
-    lpm.LockRange(reinterpret_cast<void*>(test_page_size*1200), test_page_size*500-1);
-    BOOST_CHECK(last_lock_addr == reinterpret_cast<void*>(test_page_size*(1200+500-1)));
-
-    BOOST_CHECK(lpm.GetLockedPageCount() == (
-        (1000*33+test_page_size-1)/test_page_size + // small objects
-        101 + 100 +  // page-sized objects
-        501 + 500)); // large objects
-    BOOST_CHECK((last_lock_len & (test_page_size-1)) == 0); // always lock entire pages
-    BOOST_CHECK(last_unlock_len == 0); // nothing unlocked yet
-
-    /* And unlock again */
-    addr = 0;
-    for(int i=0; i<1000; ++i)
+    lock_calls = unlock_calls = live_regions = 0;
+    test_lock_limit = 64 * 1024;
     {
-        lpm.UnlockRange(reinterpret_cast<void*>(addr), 33);
-        addr += 33;
-    }
-    addr = test_page_size*100 + 53;
-    for(int i=0; i<100; ++i)
-    {
-        lpm.UnlockRange(reinterpret_cast<void*>(addr), test_page_size);
-        addr += test_page_size;
+        TestPool pool(test_page_size);
+
+        // many small objects share the first arena, which fits in the lock limit
+        std::vector<void*> vSmall;
+        for (int i = 0; i < 1000; i++)
+            vSmall.push_back(pool.Allocate(33));
+        BOOST_CHECK_EQUAL(lock_calls, 1);
+        TestPool::Stats stats = pool.GetStats();
+        BOOST_CHECK_EQUAL(stats.used, 1000U * 64);
+        BOOST_CHECK_EQUAL(stats.chunks_used, 1000U);
+        BOOST_CHECK_EQUAL(stats.total, 64U * 1024);
+        BOOST_CHECK_EQUAL(stats.locked, 64U * 1024);
+        BOOST_CHECK_EQUAL(((size_t)vSmall[0]) % TestPool::MIN_BLOCK, 0U);
+
+        // the next arenas are full size, locked or not
+        for (int i = 0; i < 100; i++)
+            vSmall.push_back(pool.Allocate(33));
+        BOOST_CHECK_EQUAL(pool.GetArenaCount(), 2U);
+        stats = pool.GetStats();
+        BOOST_CHECK_EQUAL(stats.total, 64U * 1024 + TestPool::ARENA_SIZE);
+        BOOST_CHECK_EQUAL(stats.locked, 64U * 1024);
+
+        // a freed block is wiped and given out again for the same size class
+        memset(vSmall[5], 0xAA, 33);
+        pool.Free(vSmall[5], 33);
+        void* p = pool.Allocate(40);
+        BOOST_CHECK(p == vSmall[5]);
+        for (int i = 0; i < 33; i++)
+            BOOST_CHECK_EQUAL(static_cast<unsigned char*>(p)[i], 0);
+        vSmall[5] = p;
+        stats = pool.GetStats();
+        BOOST_CHECK_EQUAL(stats.chunks_free, 0U);
+
+        // large objects get a region of their own, given back on free
+        void* pLarge = pool.Allocate(TestPool::MAX_BLOCK + 1);
+        BOOST_CHECK_EQUAL(lock_calls, 3);
+        BOOST_CHECK_EQUAL(pool.GetStats().total, 64U * 1024 + TestPool::ARENA_SIZE + TestPool::MAX_BLOCK + test_page_size);
+        pool.Free(pLarge, TestPool::MAX_BLOCK + 1);
+        BOOST_CHECK_EQUAL(live_regions, 2);
+
+        for (unsigned int i = 0; i < vSmall.size(); i++)
+            pool.Free(vSmall[i], i == 5 ? 40 : 33);
+        stats = pool.GetStats();
+        BOOST_CHECK_EQUAL(stats.used, 0U);
+        BOOST_CHECK_EQUAL(stats.chunks_used, 0U);
+        BOOST_CHECK_EQUAL(stats.chunks_free, 1100U);
+        BOOST_CHECK_EQUAL(stats.free, stats.total);
+        // arenas stay until the pool goes
+        BOOST_CHECK_EQUAL(lock_calls, 3);
     }
-    addr = test_page_size*300;
-    for(int i=0; i<100; ++i)
+    BOOST_CHECK_EQUAL(live_regions, 0);
+    BOOST_CHECK_EQUAL(unlock_calls, 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_secure_allocator)
+{
+    // what the secure types hold lives in the locked pool
+    LockedPool::Stats statsBefore = LockedPool::Instance().GetStats();
     {
-        lpm.UnlockRange(reinterpret_cast<void*>(addr), test_page_size);
-        addr += test_page_size;
+        SecureString str(1000, 'x');
+        BOOST_CHECK(LockedPool::Instance().GetStats().used > statsBefore.used);
+        std::vector<unsigned char, secure_allocator<unsigned char> > vch(32, 0x55);
     }
-    lpm.UnlockRange(reinterpret_cast<void*>(test_page_size*600+1), test_page_size*500);
-    lpm.UnlockRange(reinterpret_cast<void*>(test_page_size*1200), test_page_size*500-1);
+    BOOST_CHECK_EQUAL(LockedPool::Instance().GetStats().used, statsBefore.used);
+}
 
-    /* Check that everything is released */
-    BOOST_CHECK(lpm.GetLockedPageCount() == 0);
+BOOST_AUTO_TEST_CASE(pool_resource)
+{
+    CPoolResource pool;
+    void* a = pool.Allocate(40);
+    void* b = pool.Allocate(40);
+    BOOST_CHECK(a != b);
+    BOOST_CHECK_EQUAL(pool.GetChunkCount(), 1U);
+    BOOST_CHECK_EQUAL(pool.GetOutstanding(), 2U);
+    // freed blocks are reused for the same size
+    pool.Deallocate(a, 40);
+    BOOST_CHECK(pool.Allocate(36) == a);
+    pool.Deallocate(a, 36);
+    pool.Deallocate(b, 40);
+    BOOST_CHECK_EQUAL(pool.GetOutstanding(), 0U);
+    pool.Release();
+    BOOST_CHECK_EQUAL(pool.GetChunkCount(), 0U);
 
-    /* A few and unlocks of size zero (should have no effect) */
-    addr = 0;
-    for(int i=0; i<1000; ++i)
+    // a container with a pool allocator keeps its nodes there, and its
+    // allocator follows it through swaps
+    typedef std::map<int, int, std::less<int>, pool_allocator<std::pair<const int, int> > > map_type;
+    CPoolResource poolSwap;
     {
-        lpm.LockRange(reinterpret_cast<void*>(addr), 0);
-        addr += 1;
+        std::less<int> comp;
+        map_type m(comp, map_type::allocator_type(&pool));
+        map_type n(comp, map_type::allocator_type(&poolSwap));
+        for (int i = 0; i < 100000; i++)
+            m[i] = i;
+        BOOST_CHECK_EQUAL(pool.GetOutstanding(), 100000U);
+        BOOST_CHECK(pool.GetChunkCount() > 1);
+        m.swap(n);
+        BOOST_CHECK(n.get_allocator().pool == &pool);
+        n.erase(5);
+        BOOST_CHECK_EQUAL(pool.GetOutstanding(), 99999U);
+        BOOST_CHECK_EQUAL(poolSwap.GetOutstanding(), 0U);
     }
-    BOOST_CHECK(lpm.GetLockedPageCount() == 0);
-    addr = 0;
-    for(int i=0; i<1000; ++i)
+    BOOST_CHECK_EQUAL(pool.GetOutstanding(), 0U);
+    pool.Release();
+}
+
+BOOST_AUTO_TEST_CASE(large_pages)
+{
+    std::string strError;
+    BOOST_CHECK(!InitLargePages("always", strError));
+    BOOST_REQUIRE(InitLargePages("1", strError));
+
+    // small allocations never take huge pages
+    CLargePageStats statsBefore, stats;
+    GetLargePageStats(statsBefore);
+    void* p = LargePageAllocate(100);
+    GetLargePageStats(stats);
+    BOOST_CHECK_EQUAL(stats.nTransparentBytes + stats.nFallbackBytes, statsBefore.nTransparentBytes + statsBefore.nFallbackBytes);
+    LargePageFree(p, 100);
+
+    // a large one is rounded up to whole huge pages, and written to like any memory
+    p = LargePageAllocate(LARGE_PAGE_SIZE + 1);
+    memset(p, 0xAB, LARGE_PAGE_SIZE + 1);
+    GetLargePageStats(stats);
+    if (stats.nFallbackBytes == statsBefore.nFallbackBytes && LargePagesEnabled())
+        BOOST_CHECK_EQUAL(stats.nTransparentBytes - statsBefore.nTransparentBytes, 2 * LARGE_PAGE_SIZE);
+    LargePageFree(p, LARGE_PAGE_SIZE + 1);
+    GetLargePageStats(stats);
+    BOOST_CHECK_EQUAL(stats.nTransparentBytes, statsBefore.nTransparentBytes);
+
+    // a pool for large pages takes a huge page per chunk
     {
-        lpm.UnlockRange(reinterpret_cast<void*>(addr), 0);
-        addr += 1;
+        CPoolResource pool(true);
+        BOOST_CHECK(pool.UsesLargePages());
+        pool.Deallocate(pool.Allocate(40), 40);
+        BOOST_CHECK_EQUAL(pool.GetChunkSize(), LARGE_PAGE_SIZE);
+        pool.Release();
     }
-    BOOST_CHECK(lpm.GetLockedPageCount() == 0);
-    BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
+
+    BOOST_REQUIRE(InitLargePages("0", strError));
+    BOOST_CHECK(!LargePagesEnabled());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
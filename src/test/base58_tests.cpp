@@ -9,6 +9,7 @@
 #include "data/base58_keys_valid.json.h"
 
 #include "key.h"
+#include "random.h"
 #include "script/script.h"
 #include "uint256.h"
 #include "util.h"
@@ -72,6 +73,36 @@ BOOST_AUTO_TEST_CASE(base58_DecodeBase58)
     BOOST_CHECK_EQUAL_COLLECTIONS(result.begin(), result.end(), expected.begin(), expected.end());
 }
 
+// Round trips over the word boundaries of the conversion, with leading zeroes
+BOOST_AUTO_TEST_CASE(base58_roundtrip)
+{
+    for (unsigned int nSize = 0; nSize < 100; nSize++) {
+        std::vector<unsigned char> data(nSize);
+        for (unsigned int i = 0; i < nSize; i++)
+            data[i] = (i < nSize % 4) ? 0 : insecure_rand();
+        std::string str = EncodeBase58(data);
+        std::vector<unsigned char> result;
+        BOOST_CHECK(DecodeBase58(str, result));
+        BOOST_CHECK(result == data);
+    }
+    std::vector<unsigned char> max(64, 0xff);
+    std::vector<unsigned char> result;
+    BOOST_CHECK(DecodeBase58(EncodeBase58(max), result));
+    BOOST_CHECK(result == max);
+    BOOST_CHECK(!DecodeBase58("zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzl", result));
+}
+
+BOOST_AUTO_TEST_CASE(base58_address_cache)
+{
+    CBitcoinAddressCache addressCache;
+    CKeyID keyID(uint160(ParseHex("65a16059864a2fdbc7c99a4723a8395bc6f188eb")));
+    CScriptID scriptID(uint160(ParseHex("74f209f6ea907e2ea48f74fae05782ae8a665257")));
+    BOOST_CHECK_EQUAL(addressCache.Get(keyID), CBitcoinAddress(keyID).ToString());
+    BOOST_CHECK_EQUAL(addressCache.Get(scriptID), CBitcoinAddress(scriptID).ToString());
+    BOOST_CHECK_EQUAL(addressCache.Get(keyID), CBitcoinAddress(keyID).ToString());
+    BOOST_CHECK(addressCache.Get(CNoDestination()).empty());
+}
+
 // Visitor to check address type
 class TestAddrTypeVisitor : public boost::static_visitor<bool>
 {
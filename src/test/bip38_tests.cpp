@@ -0,0 +1,60 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bip38.h"
+#include "crypto/scrypt.h"
+#include "tinyformat.h"
+#include "utilstrencodings.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(bip38_tests)
+
+BOOST_AUTO_TEST_CASE(scrypt_testvectors)
+{
+    // RFC 7914
+    std::vector<unsigned char> out(64);
+    scrypt("password", 8, "NaCl", 4, (char*)&out[0], 1024, 8, 16, 64);
+    BOOST_CHECK_EQUAL(HexStr(out), "fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b3731622eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640");
+    scrypt("pleaseletmein", 13, "SodiumChloride", 14, (char*)&out[0], 16384, 8, 1, 64);
+    BOOST_CHECK_EQUAL(HexStr(out), "7023bdcb3afd7348461c06cd81fd38ebfda8fbba904f8e3ea9b543f6545da1f2d5432955613f0fcf62d49705242a9af9e61e85dc0d651e40dfcf017b45575887");
+}
+
+BOOST_AUTO_TEST_CASE(bip38_decrypt)
+{
+    // Not EC multiplied, from the BIP
+    uint256 privKey;
+    bool fCompressed;
+    BOOST_CHECK(BIP38_Decrypt("TestingOneTwoThree", "6PRVWUbkzzsbcVac2qwfssoUJAN1Xhrg6bNk8J7Nzm5H7kxEbn2Nh2ZoGg", privKey, fCompressed));
+    BOOST_CHECK_EQUAL(HexStr(privKey), "cbf4b9f70470856bb4f40f80b87edb90865997ffee6df315ab166d713af433a5");
+    BOOST_CHECK(!fCompressed);
+    BOOST_CHECK(BIP38_Decrypt("TestingOneTwoThree", "6PYNKZ1EAgYgmQfmNVamxyXVWHzK5s6DGhwP4J5o44cvXdoY7sRzhtpUeo", privKey, fCompressed));
+    BOOST_CHECK_EQUAL(HexStr(privKey), "cbf4b9f70470856bb4f40f80b87edb90865997ffee6df315ab166d713af433a5");
+    BOOST_CHECK(fCompressed);
+}
+
+BOOST_AUTO_TEST_CASE(bip38_decrypt_batch)
+{
+    // The address only goes into the address hash, which is not checked for these keys
+    std::vector<CBIP38DecryptJob> vJobs;
+    std::vector<uint256> vPrivKeys;
+    for (int i = 0; i < 3; i++) {
+        vPrivKeys.push_back(uint256(i + 1));
+        vJobs.push_back(CBIP38DecryptJob(BIP38_Encrypt(strprintf("address%d", i), "passphrase", vPrivKeys[i], i % 2 == 0)));
+    }
+    vJobs.push_back(CBIP38DecryptJob("not a key"));
+
+    BIP38_DecryptBatch("passphrase", vJobs);
+    for (int i = 0; i < 3; i++) {
+        BOOST_CHECK(vJobs[i].fDecrypted);
+        BOOST_CHECK(vJobs[i].privKey == vPrivKeys[i]);
+        BOOST_CHECK_EQUAL(vJobs[i].fCompressed, i % 2 == 0);
+    }
+    BOOST_CHECK(!vJobs[3].fDecrypted);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
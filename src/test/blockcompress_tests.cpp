@@ -0,0 +1,134 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcompress.h"
+#include "random.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockcompress_tests)
+
+static void WriteFile(const boost::filesystem::path& path, const std::vector<char>& vData)
+{
+    FILE* file = fopen(path.string().c_str(), "wb");
+    BOOST_REQUIRE(file);
+    if (!vData.empty())
+        BOOST_REQUIRE_EQUAL(fwrite(&vData[0], 1, vData.size(), file), vData.size());
+    fclose(file);
+}
+
+static std::vector<char> ReadFile(const boost::filesystem::path& path)
+{
+    std::vector<char> vData(boost::filesystem::file_size(path));
+    FILE* file = fopen(path.string().c_str(), "rb");
+    BOOST_REQUIRE(file);
+    if (!vData.empty())
+        BOOST_REQUIRE_EQUAL(fread(&vData[0], 1, vData.size(), file), vData.size());
+    fclose(file);
+    return vData;
+}
+
+BOOST_AUTO_TEST_CASE(blockcompress_roundtrip)
+{
+    if (!IsBlockCompressionAvailable())
+        return;
+
+    boost::filesystem::path pathDir = GetDataDir() / "blockcompress";
+    boost::filesystem::create_directories(pathDir);
+    boost::filesystem::path pathRaw = pathDir / "blk00000.dat";
+    boost::filesystem::path pathCompressed = pathDir / "blz00000.dat";
+    boost::filesystem::path pathRestored = pathDir / "restored.dat";
+
+    // Repeated records with a little noise, not a multiple of the frame size
+    std::vector<char> vData(3 * BLOCKFILE_FRAME_SIZE + 12345);
+    for (size_t i = 0; i < vData.size(); i++)
+        vData[i] = (i % 1000 < 900) ? (char)(i % 251) : (char)insecure_rand();
+    WriteFile(pathRaw, vData);
+
+    BOOST_REQUIRE(CompressBlockFile(pathRaw, pathCompressed, 6));
+    BOOST_CHECK(boost::filesystem::file_size(pathCompressed) < vData.size());
+
+    CCompressedBlockFile file;
+    BOOST_REQUIRE(file.Open(pathCompressed));
+    BOOST_CHECK_EQUAL(file.GetRawSize(), vData.size());
+
+    // Ranges inside one frame, across frame boundaries and up to the end
+    std::vector<char> vRead;
+    for (int i = 0; i < 200; i++) {
+        uint32_t nPos = insecure_rand() % vData.size();
+        uint32_t nSize = insecure_rand() % std::min<size_t>(2 * BLOCKFILE_FRAME_SIZE, vData.size() - nPos + 1);
+        vRead.resize(nSize);
+        BOOST_REQUIRE(file.Read(nPos, nSize ? &vRead[0] : NULL, nSize));
+        BOOST_CHECK(std::equal(vRead.begin(), vRead.end(), vData.begin() + nPos));
+    }
+    char ch;
+    BOOST_CHECK(file.Read(vData.size() - 1, &ch, 1));
+    BOOST_CHECK_EQUAL(ch, vData.back());
+    BOOST_CHECK(!file.Read(vData.size(), &ch, 1));
+    BOOST_CHECK(!file.Read(vData.size() - 1, &ch, 2));
+
+    BOOST_REQUIRE(DecompressBlockFile(pathCompressed, pathRestored));
+    BOOST_CHECK(ReadFile(pathRestored) == vData);
+
+    CBlockDecompressionStats stats = GetBlockDecompressionStats();
+    BOOST_CHECK(stats.nFrames > 0);
+    BOOST_CHECK(stats.nBytes >= stats.nFrames);
+
+    boost::filesystem::remove_all(pathDir);
+}
+
+BOOST_AUTO_TEST_CASE(blockcompress_corrupt)
+{
+    if (!IsBlockCompressionAvailable())
+        return;
+
+    boost::filesystem::path pathDir = GetDataDir() / "blockcompress";
+    boost::filesystem::create_directories(pathDir);
+    boost::filesystem::path pathRaw = pathDir / "blk00000.dat";
+    boost::filesystem::path pathCompressed = pathDir / "blz00000.dat";
+
+    std::vector<char> vData(2 * BLOCKFILE_FRAME_SIZE);
+    for (size_t i = 0; i < vData.size(); i++)
+        vData[i] = (char)(i % 7);
+    WriteFile(pathRaw, vData);
+    BOOST_REQUIRE(CompressBlockFile(pathRaw, pathCompressed, 1));
+    std::vector<char> vCompressed = ReadFile(pathCompressed);
+
+    // A damaged frame fails to read, the other frame still reads
+    std::vector<char> vDamaged(vCompressed);
+    vDamaged[10] ^= 0x55;
+    WriteFile(pathCompressed, vDamaged);
+    {
+        CCompressedBlockFile file;
+        BOOST_REQUIRE(file.Open(pathCompressed));
+        char ch;
+        BOOST_CHECK(!file.Read(0, &ch, 1));
+        BOOST_CHECK(file.Read(BLOCKFILE_FRAME_SIZE, &ch, 1));
+        BOOST_CHECK_EQUAL(ch, vData[BLOCKFILE_FRAME_SIZE]);
+    }
+    BOOST_CHECK(!DecompressBlockFile(pathCompressed, pathDir / "restored.dat"));
+
+    // A truncated file has no trailer
+    std::vector<char> vTruncated(vCompressed.begin(), vCompressed.end() - 1);
+    WriteFile(pathCompressed, vTruncated);
+    {
+        CCompressedBlockFile file;
+        BOOST_CHECK(!file.Open(pathCompressed));
+    }
+
+    // An uncompressed block file is rejected
+    {
+        CCompressedBlockFile file;
+        BOOST_CHECK(!file.Open(pathRaw));
+    }
+
+    boost::filesystem::remove_all(pathDir);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,115 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "main.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlock()
+{
+    CBlock block;
+    block.nBits = 0x207fffff;
+    block.nTime = 1546300800;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 42;
+    block.vtx.push_back(tx);
+    for (int i = 0; i < 3; i++) {
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = i;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_roundtrip)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.prefilledtxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.shorttxids.size(), 3U);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    stream >> cmpctblock2;
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblock2.shorttxids == cmpctblock.shorttxids);
+    for (size_t i = 1; i < block.vtx.size(); i++) {
+        BOOST_CHECK_EQUAL(cmpctblock2.GetShortID(block.vtx[i].GetHash()), cmpctblock.shorttxids[i - 1]);
+        BOOST_CHECK(cmpctblock2.shorttxids[i - 1] <= 0xffffffffffffULL);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(getblocktxn_roundtrip)
+{
+    BlockTransactionsRequest req;
+    req.blockhash = GetRandHash();
+    req.indexes.push_back(0);
+    req.indexes.push_back(1);
+    req.indexes.push_back(3);
+    req.indexes.push_back(4);
+    req.indexes.push_back(65535);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req;
+    BlockTransactionsRequest req2;
+    stream >> req2;
+    BOOST_CHECK(req2.blockhash == req.blockhash);
+    BOOST_CHECK(req2.indexes == req.indexes);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_reconstruct)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    LOCK(cs_main);
+    mempool.clear();
+    mempool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+
+    std::vector<CTransaction> vMissing;
+    vMissing.push_back(block.vtx[1]);
+    vMissing.push_back(block.vtx[3]);
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vMissing) == READ_STATUS_OK);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_CHECK(block2.vtx.size() == block.vtx.size());
+    bool fMutated;
+    BOOST_CHECK(block2.BuildMerkleTree(&fMutated) == block.hashMerkleRoot);
+
+    // The wrong transaction is taken for a short id collision
+    PartiallyDownloadedBlock partialBlock2;
+    BOOST_CHECK(partialBlock2.InitData(cmpctblock) == READ_STATUS_OK);
+    vMissing[1] = block.vtx[2];
+    BOOST_CHECK(partialBlock2.FillBlock(block2, vMissing) == READ_STATUS_FAILED);
+
+    // Too few transactions sent is the peer's fault
+    PartiallyDownloadedBlock partialBlock3;
+    BOOST_CHECK(partialBlock3.InitData(cmpctblock) == READ_STATUS_OK);
+    vMissing.pop_back();
+    BOOST_CHECK(partialBlock3.FillBlock(block2, vMissing) == READ_STATUS_INVALID);
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
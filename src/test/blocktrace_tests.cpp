@@ -0,0 +1,94 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blocktrace.h"
+#include "primitives/block.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blocktrace_tests)
+
+static CBlock MakeBlock(unsigned int nNonce)
+{
+    CBlock block;
+    block.nTime = 1546300800;
+    block.nNonce = nNonce;
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(blocktrace_spans)
+{
+    SetBlockTraceLimit(DEFAULT_BLOCK_TRACES);
+    CBlock block = MakeBlock(1);
+    {
+        CBlockTraceScope scope(block, 7, GetTimeMicros());
+        // Phases of other blocks processed on the way add to this trace
+        CBlockTraceScope nested(MakeBlock(2), 8, GetTimeMicros());
+        SetBlockTraceHeight(block.GetHash(), 42);
+        SetBlockTraceHeight(MakeBlock(2).GetHash(), 43);
+        CBlockTracePhaseTimer phaseCheck(BLOCKTRACE_CHECK_BLOCK);
+        {
+            CBlockTracePhaseTimer phaseConnect(BLOCKTRACE_CONNECT_BLOCK);
+            CBlockTracePhaseTimer phaseValue(BLOCKTRACE_BLOCK_VALUE);
+        }
+        CBlockTracePhaseTimer phaseFlush(BLOCKTRACE_FLUSH_STATE);
+    }
+    // Not traced outside of a scope
+    CBlockTracePhaseTimer phaseUpdate(BLOCKTRACE_UPDATE_TIP);
+
+    std::vector<CBlockTrace> vTraces = GetBlockTraces();
+    BOOST_REQUIRE(!vTraces.empty());
+    const CBlockTrace& trace = vTraces[0];
+    BOOST_CHECK(trace.hash == block.GetHash());
+    BOOST_CHECK_EQUAL(trace.nHeight, 42);
+    BOOST_CHECK_EQUAL(trace.nPeer, 7);
+    BOOST_CHECK(!trace.fTip);
+    BOOST_REQUIRE_EQUAL(trace.vSpans.size(), 4U);
+    BOOST_CHECK_EQUAL(trace.vSpans[0].phase, BLOCKTRACE_CHECK_BLOCK);
+    BOOST_CHECK_EQUAL(trace.vSpans[0].nDepth, 0);
+    BOOST_CHECK_EQUAL(trace.vSpans[1].phase, BLOCKTRACE_CONNECT_BLOCK);
+    BOOST_CHECK_EQUAL(trace.vSpans[1].nDepth, 1);
+    BOOST_CHECK_EQUAL(trace.vSpans[2].phase, BLOCKTRACE_BLOCK_VALUE);
+    BOOST_CHECK_EQUAL(trace.vSpans[2].nDepth, 2);
+    BOOST_CHECK_EQUAL(trace.vSpans[3].phase, BLOCKTRACE_FLUSH_STATE);
+    BOOST_CHECK_EQUAL(trace.vSpans[3].nDepth, 1);
+    for (size_t i = 0; i < trace.vSpans.size(); i++) {
+        BOOST_CHECK(trace.vSpans[i].nStart >= trace.nStart);
+        BOOST_CHECK(trace.vSpans[i].nStart + trace.vSpans[i].nDuration <= trace.nDuration);
+    }
+    BOOST_CHECK(trace.vSpans[2].nStart + trace.vSpans[2].nDuration <= trace.vSpans[1].nStart + trace.vSpans[1].nDuration);
+    BOOST_CHECK_EQUAL(std::string(GetBlockTracePhaseName(BLOCKTRACE_SYNC_WALLETS)), "syncwallets");
+}
+
+BOOST_AUTO_TEST_CASE(blocktrace_limit)
+{
+    SetBlockTraceLimit(3);
+    for (unsigned int i = 0; i < 5; i++) {
+        CBlockTraceScope scope(MakeBlock(i), -1, GetTimeMicros());
+        for (size_t j = 0; j < MAX_BLOCK_TRACE_SPANS + i; j++)
+            CBlockTracePhaseTimer phase(BLOCKTRACE_CONNECT_TIP);
+    }
+    std::vector<CBlockTrace> vTraces = GetBlockTraces();
+    BOOST_REQUIRE_EQUAL(vTraces.size(), 3U);
+    // Newest first
+    for (unsigned int i = 0; i < 3; i++) {
+        BOOST_CHECK(vTraces[i].hash == MakeBlock(4 - i).GetHash());
+        BOOST_CHECK_EQUAL(vTraces[i].vSpans.size(), MAX_BLOCK_TRACE_SPANS);
+        BOOST_CHECK_EQUAL(vTraces[i].nSpansDropped, 4U - i);
+    }
+
+    SetBlockTraceLimit(0);
+    BOOST_CHECK(GetBlockTraces().empty());
+    {
+        CBlockTraceScope scope(MakeBlock(5), -1, GetTimeMicros());
+        CBlockTracePhaseTimer phase(BLOCKTRACE_CONNECT_TIP);
+    }
+    BOOST_CHECK(GetBlockTraces().empty());
+    SetBlockTraceLimit(DEFAULT_BLOCK_TRACES);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,8 @@
 
 
 #include "clientversion.h"
+#include "ecwrapper.h"
+#include "key.h"
 #include "main.h"
 #include "utiltime.h"
 
@@ -16,7 +18,9 @@
 
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 
 BOOST_AUTO_TEST_SUITE(CheckBlock_tests)
@@ -66,4 +70,133 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(CachedHash)
+{
+    CBlock block;
+    block.nTime = 1368576000;
+    block.nBits = 0x1e0ffff0;
+    uint256 hash = block.GetHash();
+    BOOST_CHECK(hash == block.CBlockHeader::GetHash());
+    BOOST_CHECK(block.GetHash() == hash);
+
+    // a header changed in place, as by the miner, is hashed again
+    block.nNonce++;
+    BOOST_CHECK(block.GetHash() != hash);
+    BOOST_CHECK(block.GetHash() == block.CBlockHeader::GetHash());
+    block.nNonce--;
+    BOOST_CHECK(block.GetHash() == hash);
+
+    CBlock blockCopy(block.GetBlockHeader());
+    BOOST_CHECK(blockCopy.GetHash() == hash);
+    block.SetNull();
+    BOOST_CHECK(block.GetHash() == block.CBlockHeader::GetHash());
+}
+
+static void HashSharedBlock(const CBlock* pblock, int nTimes, bool* pfSame)
+{
+    uint256 hash = pblock->CBlockHeader::GetHash();
+    bool fSame = true;
+    for (int i = 0; i < nTimes; i++) {
+        CBlock blockCopy(*pblock);
+        fSame &= (pblock->GetHash() == hash && blockCopy.GetHash() == hash);
+    }
+    *pfSame = fSame;
+}
+
+BOOST_AUTO_TEST_CASE(CachedHashShared)
+{
+    CBlock block;
+    block.nTime = 1368576000;
+    block.nBits = 0x1e0ffff0;
+    const CBlock& blockShared = block;
+
+    // threads hashing and copying the same const block all see its hash
+    bool vfSame[4];
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 4; i++)
+        threadGroup.create_thread(boost::bind(&HashSharedBlock, &blockShared, 200, &vfSame[i]));
+    threadGroup.join_all();
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(vfSame[i]);
+}
+
+static CBlock StakeBlock(const CPubKey& pubkey)
+{
+    CMutableTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+
+    CMutableTransaction txCoinStake;
+    txCoinStake.vin.resize(1);
+    txCoinStake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txCoinStake.vout.resize(2);
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout[1] = CTxOut(COIN, CScript() << ToByteVector(pubkey) << OP_CHECKSIG);
+
+    CBlock block;
+    block.nTime = 1368576000;
+    block.nBits = 0x1e0ffff0;
+    block.vtx.push_back(txCoinBase);
+    block.vtx.push_back(txCoinStake);
+    return block;
+}
+
+static bool VerifyOpenSSL(const CPubKey& pubkey, const uint256& hash, const std::vector<unsigned char>& vchSig)
+{
+    CECKey key;
+    return key.SetPubKey(pubkey.begin(), pubkey.size()) && key.Verify(hash, vchSig);
+}
+
+BOOST_AUTO_TEST_CASE(BlockSignatureEncodings)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    CBlock block = StakeBlock(pubkey);
+    BOOST_CHECK(block.IsProofOfStake());
+
+    // a signature whose R has its high bit set, so DER pads it with a zero
+    std::vector<unsigned char> vchSig;
+    for (block.nNonce = 0; block.nNonce < 1000; block.nNonce++) {
+        BOOST_CHECK(key.Sign(block.GetHash(), vchSig));
+        if (vchSig[3] == 33)
+            break;
+    }
+    BOOST_CHECK_EQUAL((int)vchSig[3], 33);
+    BOOST_CHECK_EQUAL((int)vchSig[4], 0);
+
+    block.vchBlockSig = vchSig;
+    BOOST_CHECK(block.CheckBlockSignature());
+    block.vchBlockSig.clear();
+    BOOST_CHECK(!block.CheckBlockSignature());
+
+    // the outer length in long form, which the libsecp256k1 parser rejects
+    std::vector<unsigned char> vchLongLength;
+    vchLongLength.push_back(0x30);
+    vchLongLength.push_back(0x81);
+    vchLongLength.insert(vchLongLength.end(), vchSig.begin() + 1, vchSig.end());
+    BOOST_CHECK(!pubkey.Verify(block.GetHash(), vchLongLength));
+
+    // R without its padding, which the libsecp256k1 parser reads as unsigned
+    std::vector<unsigned char> vchUnpadded;
+    vchUnpadded.push_back(0x30);
+    vchUnpadded.push_back(vchSig[1] - 1);
+    vchUnpadded.push_back(0x02);
+    vchUnpadded.push_back(32);
+    vchUnpadded.insert(vchUnpadded.end(), vchSig.begin() + 5, vchSig.end());
+    BOOST_CHECK(pubkey.Verify(block.GetHash(), vchUnpadded));
+
+    // either way the block signature is accepted exactly when OpenSSL accepts it, as before libsecp256k1
+    std::vector<std::vector<unsigned char> > vSigs;
+    vSigs.push_back(vchSig);
+    vSigs.push_back(vchLongLength);
+    vSigs.push_back(vchUnpadded);
+    for (unsigned int i = 0; i < vSigs.size(); i++) {
+        block.vchBlockSig = vSigs[i];
+        BOOST_CHECK_EQUAL(block.CheckBlockSignature(), VerifyOpenSSL(pubkey, block.GetHash(), vSigs[i]));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
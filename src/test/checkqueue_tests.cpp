@@ -0,0 +1,126 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+struct FakeCheck {
+    std::atomic<int>* pnCount;
+    bool fOk;
+
+    FakeCheck() : pnCount(NULL), fOk(true) {}
+    FakeCheck(std::atomic<int>* pnCountIn, bool fOkIn) : pnCount(pnCountIn), fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        (*pnCount)++;
+        return fOk;
+    }
+
+    void swap(FakeCheck& check)
+    {
+        std::swap(pnCount, check.pnCount);
+        std::swap(fOk, check.fOk);
+    }
+};
+
+static std::vector<FakeCheck> MakeChecks(std::atomic<int>& nCount, unsigned int nChecks, int nFail = -1)
+{
+    std::vector<FakeCheck> vChecks;
+    for (unsigned int i = 0; i < nChecks; i++)
+        vChecks.push_back(FakeCheck(&nCount, (int)i != nFail));
+    return vChecks;
+}
+
+struct CheckQueueSetup {
+    CCheckQueue<FakeCheck> queue;
+    boost::thread_group threadGroup;
+
+    CheckQueueSetup() : queue(16)
+    {
+        for (int i = 0; i < 4; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<FakeCheck>::Thread, &queue));
+    }
+
+    ~CheckQueueSetup()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+};
+
+BOOST_FIXTURE_TEST_CASE(checkqueue_all_ok, CheckQueueSetup)
+{
+    for (unsigned int nChecks = 0; nChecks < 1000; nChecks += 37) {
+        std::atomic<int> nCount(0);
+        CCheckQueueControl<FakeCheck> control(&queue);
+        std::vector<FakeCheck> vChecks = MakeChecks(nCount, nChecks);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nCount.load(), (int)nChecks);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(checkqueue_failure, CheckQueueSetup)
+{
+    std::atomic<int> nCount(0);
+    CCheckQueueControl<FakeCheck> control(&queue);
+    std::vector<FakeCheck> vChecks = MakeChecks(nCount, 500, 250);
+    control.Add(vChecks);
+    BOOST_CHECK(!control.Wait());
+    BOOST_CHECK(nCount.load() <= 500);
+
+    // The control can be used again after a failure
+    vChecks = MakeChecks(nCount, 100);
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+}
+
+BOOST_FIXTURE_TEST_CASE(checkqueue_sessions_in_flight, CheckQueueSetup)
+{
+    std::atomic<int> nCount1(0), nCount2(0);
+    CCheckQueueControl<FakeCheck> control1(&queue);
+    CCheckQueueControl<FakeCheck> control2(&queue);
+    std::vector<FakeCheck> vChecks1 = MakeChecks(nCount1, 300, 10);
+    std::vector<FakeCheck> vChecks2 = MakeChecks(nCount2, 300);
+    control1.Add(vChecks1);
+    control2.Add(vChecks2);
+
+    // A failure in one session does not affect the other
+    BOOST_CHECK(control2.Wait());
+    BOOST_CHECK_EQUAL(nCount2.load(), 300);
+    BOOST_CHECK(!control1.Wait());
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_master_only)
+{
+    // Without workers the master runs the checks itself
+    CCheckQueue<FakeCheck> queueNoWorkers(16);
+    std::atomic<int> nCount(0);
+    CCheckQueueControl<FakeCheck> control(&queueNoWorkers);
+    std::vector<FakeCheck> vChecks = MakeChecks(nCount, 100);
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+    BOOST_CHECK_EQUAL(nCount.load(), 100);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_no_queue)
+{
+    std::atomic<int> nCount(0);
+    CCheckQueueControl<FakeCheck> control(NULL);
+    std::vector<FakeCheck> vChecks = MakeChecks(nCount, 10);
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+    BOOST_CHECK_EQUAL(nCount.load(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
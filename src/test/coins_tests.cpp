@@ -3,12 +3,18 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "main.h"
 #include "random.h"
+#include "script/script.h"
+#include "streams.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "util.h"
 
 #include <vector>
 #include <map>
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 namespace
@@ -58,6 +64,22 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -83,14 +105,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool flushed_partially = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -138,11 +161,19 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         }
 
         if (insecure_rand() % 100 == 0) {
-            // Every 100 iterations, change the cache stack.
+            // Every 100 iterations, check the memory accounting and change the cache stack.
+            stack.back()->SelfTest();
             if (stack.size() > 0 && insecure_rand() % 2 == 0) {
-                stack.back()->Flush();
-                delete stack.back();
-                stack.pop_back();
+                if (insecure_rand() % 2 == 0) {
+                    // Write the tip through but keep part of it cached.
+                    stack.back()->FlushPartial(insecure_rand() % 65536);
+                    stack.back()->SelfTest();
+                    flushed_partially = true;
+                } else {
+                    stack.back()->Flush();
+                    delete stack.back();
+                    stack.pop_back();
+                }
             }
             if (stack.size() == 0 || (stack.size() < 4 && insecure_rand() % 2)) {
                 CCoinsView* tip = &base;
@@ -151,7 +182,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -173,6 +204,432 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(flushed_partially);
+}
+
+namespace
+{
+//! Gives the test access to the raw chainstate to write old-format records
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+    void WriteLegacyCoins(const uint256& txid, const CCoins& coins) { db.Write(std::make_pair('c', txid), coins); }
+    void EraseTxMarker(const uint256& txid) { db.Erase(std::make_pair('u', txid)); }
+    void FlagMarkerUpgrade() { db.Write('M', true); }
+};
+
+CCoins MakeCoins(unsigned int nOutputs, int nHeight)
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = nHeight;
+    coins.fCoinStake = true;
+    for (unsigned int i = 0; i < nOutputs; i++)
+        coins.vout.push_back(CTxOut((i + 1) * COIN, CScript() << OP_TRUE));
+    return coins;
+}
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_per_output)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    CCoins coins = MakeCoins(4, 100);
+
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txid) = coins;
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoins read;
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK(db.HaveCoins(txid));
+    BOOST_CHECK(!db.HaveCoins(GetRandHash()));
+
+    // spending one output leaves the others alone
+    {
+        CCoinsViewCache cache(&db);
+        BOOST_CHECK(cache.ModifyCoins(txid)->Spend(1));
+        BOOST_CHECK(cache.Flush());
+    }
+    coins.Spend(1);
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+
+    // spending the last output trims, spending everything removes the transaction
+    {
+        CCoinsViewCache cache(&db);
+        BOOST_CHECK(cache.ModifyCoins(txid)->Spend(3));
+        BOOST_CHECK(cache.Flush());
+    }
+    coins.Spend(3);
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK_EQUAL(read.vout.size(), 3U);
+    {
+        CCoinsViewCache cache(&db);
+        {
+            CCoinsModifier modifier = cache.ModifyCoins(txid);
+            BOOST_CHECK(modifier->Spend(0));
+            BOOST_CHECK(modifier->Spend(2));
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.GetCoins(txid, read));
+    BOOST_CHECK(!db.HaveCoins(txid));
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_partial_flush)
+{
+    CCoinsViewDBTest db;
+    CCoinsViewCacheTest cache(&db);
+    uint256 txidKept = GetRandHash(), txidSpent = GetRandHash();
+    CCoins coins = MakeCoins(3, 200);
+    *cache.ModifyCoins(txidKept) = coins;
+    *cache.ModifyCoins(txidSpent) = coins;
+    BOOST_CHECK(cache.Flush());
+
+    {
+        CCoinsModifier modifier = cache.ModifyCoins(txidSpent);
+        for (unsigned int i = 0; i < 3; i++)
+            BOOST_CHECK(modifier->Spend(i));
+    }
+    BOOST_CHECK(cache.ModifyCoins(txidKept)->Spend(0));
+    cache.SelfTest();
+
+    // the unspent entry stays cached, the spent one is dropped, both reach the database
+    BOOST_CHECK(cache.FlushPartial(1 << 20));
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+    coins.Spend(0);
+    CCoins read;
+    BOOST_CHECK(db.GetCoins(txidKept, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK(!db.HaveCoins(txidSpent));
+
+    // the resident entry is now relative to the new database state
+    BOOST_CHECK(cache.ModifyCoins(txidKept)->Spend(1));
+    BOOST_CHECK(cache.FlushPartial(0));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    cache.SelfTest();
+    coins.Spend(1);
+    BOOST_CHECK(db.GetCoins(txidKept, read));
+    BOOST_CHECK(read == coins);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_have_in_cache)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    {
+        CCoinsViewCacheTest cache(&db);
+        *cache.ModifyCoins(txid) = MakeCoins(2, 200);
+        BOOST_CHECK(cache.HaveCoinsInCache(txid));
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // on disk only, it is not seen until something loads it
+    CCoinsViewCacheTest cache(&db);
+    BOOST_CHECK(!cache.HaveCoinsInCache(txid));
+    BOOST_CHECK(cache.HaveCoins(txid));
+    BOOST_CHECK(cache.HaveCoinsInCache(txid));
+    BOOST_CHECK(!cache.HaveCoinsInCache(GetRandHash()));
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_warm_keys)
+{
+    CCoinsViewDBTest db;
+    uint256 txidFlushed = GetRandHash(), txidSpent = GetRandHash();
+    {
+        CCoinsViewCacheTest cache(&db);
+        *cache.ModifyCoins(txidFlushed) = MakeCoins(2, 200);
+        *cache.ModifyCoins(txidSpent) = MakeCoins(1, 100);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsViewCacheTest cache(&db);
+    BOOST_CHECK(cache.AccessCoins(txidFlushed));
+    BOOST_CHECK(cache.AccessCoins(txidFlushed));
+    BOOST_CHECK(!cache.AccessCoins(GetRandHash()));
+    BOOST_CHECK_EQUAL(cache.GetCacheLookups(), 3U);
+    BOOST_CHECK_EQUAL(cache.GetCacheHits(), 1U);
+
+    // what a dump at shutdown records: the modified entries first, no spent ones
+    uint256 txidNew = GetRandHash();
+    *cache.ModifyCoins(txidNew) = MakeCoins(1, 300);
+    cache.ModifyCoins(txidSpent)->Clear();
+    std::vector<uint256> vTxids;
+    cache.GetCachedTxids(vTxids, 10);
+    BOOST_REQUIRE_EQUAL(vTxids.size(), 2U);
+    BOOST_CHECK(vTxids[0] == txidNew);
+    BOOST_CHECK(vTxids[1] == txidFlushed);
+    vTxids.clear();
+    cache.GetCachedTxids(vTxids, 1);
+    BOOST_CHECK_EQUAL(vTxids.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_write_behind)
+{
+    CCoinsViewDBTest db;
+    CCoinsViewWriteBehind writer(&db);
+    CCoinsViewCacheTest cache(&writer);
+    uint256 txid = GetRandHash(), txidSpent = GetRandHash(), hashBlock = GetRandHash();
+    CCoins coins = MakeCoins(3, 300);
+    *cache.ModifyCoins(txid) = coins;
+    *cache.ModifyCoins(txidSpent) = coins;
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+
+    // whether or not the write is done, the layer reads as the database will
+    CCoins read;
+    BOOST_CHECK(writer.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+    BOOST_CHECK(writer.Sync());
+    BOOST_CHECK(!writer.IsWriting());
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+
+    // a spent transaction reads as gone before the database forgets it
+    {
+        CCoinsModifier modifier = cache.ModifyCoins(txidSpent);
+        for (unsigned int i = 0; i < 3; i++)
+            BOOST_CHECK(modifier->Spend(i));
+    }
+    BOOST_CHECK(cache.ModifyCoins(txid)->Spend(2));
+    BOOST_CHECK(cache.FlushPartial(1 << 20));
+    BOOST_CHECK(!writer.HaveCoins(txidSpent));
+    coins.Spend(2);
+    BOOST_CHECK(writer.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+
+    // the second flush waits for the first, the resident entry is relative to both
+    BOOST_CHECK(cache.ModifyCoins(txid)->Spend(0));
+    BOOST_CHECK(cache.FlushPartial(0));
+    BOOST_CHECK(writer.Sync());
+    coins.Spend(0);
+    BOOST_CHECK(db.GetCoins(txid, read));
+    BOOST_CHECK(read == coins);
+    BOOST_CHECK(!db.HaveCoins(txidSpent));
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_batch)
+{
+    CCoinsViewDBTest db;
+    std::vector<uint256> vTxids;
+    {
+        CCoinsViewCache cache(&db);
+        for (unsigned int i = 0; i < 20; i++) {
+            vTxids.push_back(GetRandHash());
+            *cache.ModifyCoins(vTxids.back()) = MakeCoins(1 + i % 4, 100 + i);
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // out of key order, with a repeat and some the database does not have
+    vTxids.push_back(vTxids[3]);
+    vTxids.push_back(GetRandHash());
+    vTxids.insert(vTxids.begin(), GetRandHash());
+    std::vector<CCoins> vCoins;
+    std::vector<bool> vFound;
+    db.GetCoinsBatch(vTxids, vCoins, vFound);
+    BOOST_CHECK_EQUAL(vCoins.size(), vTxids.size());
+    BOOST_CHECK_EQUAL(vFound.size(), vTxids.size());
+    for (unsigned int i = 0; i < vTxids.size(); i++) {
+        CCoins read;
+        BOOST_CHECK_EQUAL(vFound[i], db.GetCoins(vTxids[i], read));
+        if (vFound[i])
+            BOOST_CHECK(vCoins[i] == read);
+    }
+    BOOST_CHECK(!vFound.front() && !vFound.back());
+
+    // the cache answers what it holds and passes on the rest
+    CCoinsViewCacheTest cache(&db);
+    BOOST_CHECK(cache.ModifyCoins(vTxids[2])->Spend(0));
+    std::vector<CCoins> vCached;
+    cache.GetCoinsBatch(vTxids, vCached, vFound);
+    BOOST_CHECK(vFound[2] && vCached[2] == *cache.AccessCoins(vTxids[2]));
+    BOOST_CHECK(!(vCached[2] == vCoins[2]));
+    BOOST_CHECK(vFound[3] && vCached[3] == vCoins[3]);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_stats)
+{
+    CCoinsViewDBTest db;
+    CAmount nTotal = 0;
+    {
+        CCoinsViewCache cache(&db);
+        for (unsigned int i = 1; i <= 300; i++) {
+            CCoins coins = MakeCoins(i % 5 + 1, i);
+            for (unsigned int j = 0; j < coins.vout.size(); j++)
+                nTotal += coins.vout[j].nValue;
+            *cache.ModifyCoins(GetRandHash()) = coins;
+        }
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsStats stats;
+    BOOST_CHECK(db.GetStats(stats));
+    BOOST_CHECK(stats.hashBlock == db.GetBestBlock());
+    BOOST_CHECK_EQUAL(stats.nTransactions, 300U);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, 900U);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, nTotal);
+
+    // the same best block gives the same answer
+    CCoinsStats statsAgain;
+    BOOST_CHECK(db.GetStats(statsAgain));
+    BOOST_CHECK(statsAgain.hashSerialized == stats.hashSerialized);
+
+    // a new best block is counted again
+    uint256 txid = GetRandHash();
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txid) = MakeCoins(2, 1000);
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetStats(statsAgain));
+    BOOST_CHECK_EQUAL(statsAgain.nTransactions, 301U);
+    BOOST_CHECK_EQUAL(statsAgain.nTotalAmount, nTotal + 3 * COIN);
+    BOOST_CHECK(statsAgain.hashSerialized != stats.hashSerialized);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_snapshot)
+{
+    CCoinsViewDBTest db;
+    std::map<uint256, CCoins> mapCoins;
+    {
+        CCoinsViewCache cache(&db);
+        for (unsigned int i = 1; i <= 100; i++) {
+            uint256 txid = GetRandHash();
+            mapCoins[txid] = MakeCoins(i % 3 + 1, i);
+            *cache.ModifyCoins(txid) = mapCoins[txid];
+        }
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    CBlockIndex index;
+    index.nHeight = 100;
+    {
+        LOCK(cs_main);
+        index.phashBlock = &mapBlockIndex.insert(std::make_pair(db.GetBestBlock(), &index)).first->first;
+    }
+
+    boost::filesystem::path path = GetDataDir() / "utxo.dat";
+    CCoinsStats statsWritten;
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(db.WriteSnapshot(fileout, statsWritten));
+    }
+    CCoinsStats stats;
+    BOOST_CHECK(db.GetStats(stats));
+    BOOST_CHECK(statsWritten.hashSerialized == stats.hashSerialized);
+    BOOST_CHECK_EQUAL(statsWritten.nHeight, 100);
+    BOOST_CHECK_EQUAL(statsWritten.nTransactionOutputs, 200U);
+
+    // the loaded set is the same, and a database in use is not overwritten
+    CCoinsViewDBTest dbLoaded;
+    CCoinsStats statsLoaded;
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(dbLoaded.LoadSnapshot(filein, statsLoaded));
+    }
+    BOOST_CHECK(!dbLoaded.IsLoadingSnapshot());
+    BOOST_CHECK(dbLoaded.GetBestBlock() == db.GetBestBlock());
+    BOOST_CHECK(statsLoaded.hashSerialized == stats.hashSerialized);
+    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        CCoins read;
+        BOOST_CHECK(dbLoaded.GetCoins(it->first, read));
+        BOOST_CHECK(read == it->second);
+    }
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(!dbLoaded.LoadSnapshot(filein, statsLoaded));
+    }
+
+    // a changed output does not match the hash of the file
+    CCoinsViewDBTest dbCorrupt;
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        std::vector<char> vch;
+        char c;
+        while (fread(&c, 1, 1, filein.Get()) == 1)
+            vch.push_back(c);
+        vch[vch.size() / 2] ^= 1;
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        fwrite(&vch[0], 1, vch.size(), fileout.Get());
+    }
+    {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(!dbCorrupt.LoadSnapshot(filein, statsLoaded));
+    }
+    BOOST_CHECK(dbCorrupt.IsLoadingSnapshot());
+
+    LOCK(cs_main);
+    mapBlockIndex.erase(db.GetBestBlock());
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade)
+{
+    CCoinsViewDBTest db;
+    std::map<uint256, CCoins> mapCoins;
+    for (unsigned int i = 1; i <= 10; i++) {
+        uint256 txid = GetRandHash();
+        CCoins coins = MakeCoins(i, 1000 + i);
+        if (i > 2)
+            coins.Spend(1);
+        mapCoins[txid] = coins;
+        db.WriteLegacyCoins(txid, coins);
+    }
+
+    BOOST_CHECK(db.Upgrade());
+    for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        CCoins read;
+        BOOST_CHECK(db.GetCoins(it->first, read));
+        BOOST_CHECK(read == it->second);
+    }
+    // a second run finds nothing left to convert
+    BOOST_CHECK(db.Upgrade());
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade_markers)
+{
+    CCoinsViewDBTest db;
+    std::map<uint256, CCoins> mapCoins;
+    {
+        CCoinsViewCache cache(&db);
+        for (unsigned int i = 1; i <= 10; i++) {
+            uint256 txid = GetRandHash();
+            mapCoins[txid] = MakeCoins(i, 1000 + i);
+            *cache.ModifyCoins(txid) = mapCoins[txid];
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // per-output records written before the markers are not found until upgraded
+    for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
+        db.EraseTxMarker(it->first);
+    BOOST_CHECK(!db.HaveCoins(mapCoins.begin()->first));
+    BOOST_CHECK(db.Upgrade());
+    for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        CCoins read;
+        BOOST_CHECK(db.HaveCoins(it->first));
+        BOOST_CHECK(db.GetCoins(it->first, read));
+        BOOST_CHECK(read == it->second);
+    }
+
+    // an upgrade that stopped partway goes on from its flag, whatever it marked already
+    for (std::map<uint256, CCoins>::iterator it = ++mapCoins.begin(); it != mapCoins.end(); ++it)
+        db.EraseTxMarker(it->first);
+    db.FlagMarkerUpgrade();
+    BOOST_CHECK(db.Upgrade());
+    for (std::map<uint256, CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
+        BOOST_CHECK(db.HaveCoins(it->first));
 }
 
 BOOST_AUTO_TEST_SUITE_END()
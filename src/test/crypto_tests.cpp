@@ -2,6 +2,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/chacha20.h"
 #include "crypto/rfc6979_hmac_sha256.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
@@ -9,6 +10,7 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 
@@ -131,6 +133,24 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    // Every count, so the 8-way, 4-way and single block paths all run
+    for (int nBlocks = 0; nBlocks <= 32; nBlocks++) {
+        std::vector<unsigned char> in(64 * nBlocks);
+        for (size_t i = 0; i < in.size(); i++)
+            in[i] = insecure_rand();
+        std::vector<unsigned char> out(32 * nBlocks + 1, 0xaa);
+        SHA256D64(&out[0], in.empty() ? NULL : &in[0], nBlocks);
+        for (int n = 0; n < nBlocks; n++) {
+            uint256 hash = Hash(in.begin() + 64 * n, in.begin() + 64 * (n + 1));
+            BOOST_CHECK(std::equal(hash.begin(), hash.end(), out.begin() + 32 * n));
+        }
+        // Nothing written past the outputs
+        BOOST_CHECK_EQUAL(out.back(), 0xaa);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -282,4 +302,63 @@ BOOST_AUTO_TEST_CASE(rfc6979_hmac_sha256)
             ("7597887cbd76321f32e30440679a22cf7f8d9d2eac390e581fea091ce202ba94"));
 }
 
+void TestChaCha20(const std::string& hexkey, uint64_t nonce, uint64_t seek, const std::string& hexout)
+{
+    std::vector<unsigned char> key = ParseHex(hexkey);
+    ChaCha20 rng(&key[0], key.size());
+    rng.SetIV(nonce);
+    rng.Seek(seek);
+    std::vector<unsigned char> out = ParseHex(hexout);
+    std::vector<unsigned char> outres;
+    outres.resize(out.size());
+    rng.Output(&outres[0], outres.size());
+    BOOST_CHECK(out == outres);
+}
+
+BOOST_AUTO_TEST_CASE(chacha20_testvector)
+{
+    // Test vectors from https://tools.ietf.org/html/draft-agl-tls-chacha20poly1305-04#section-7
+    TestChaCha20("0000000000000000000000000000000000000000000000000000000000000000", 0, 0,
+                 "76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586");
+    TestChaCha20("0000000000000000000000000000000000000000000000000000000000000001", 0, 0,
+                 "4540f05a9f1fb296d7736e7b208e3c96eb4fe1834688d2604f450952ed432d41bbe2a0b6ea7566d2a5d1e7e20d42af2c53d792b1c43fea817e9ad275ae546963");
+    TestChaCha20("0000000000000000000000000000000000000000000000000000000000000000", 0x0100000000000000ULL, 0,
+                 "de9cba7bf3d69ef5e786dc63973f653a0b49e015adbff7134fcb7df137821031e85a050278a7084527214f73efc7fa5b5277062eb7a0433e445f41e31afab757");
+    TestChaCha20("0000000000000000000000000000000000000000000000000000000000000000", 1, 0,
+                 "ef3fdfd6c61578fbf5cf35bd3dd33b8009631634d21e42ac33960bd138e50d32111e4caf237ee53ca8ad6426194a88545ddc497a0b466e7d6bbdb004");
+
+    // Output in pieces and after a seek is the same keystream
+    std::vector<unsigned char> key(32, 0x42);
+    ChaCha20 rng(&key[0], key.size());
+    unsigned char whole[300], pieces[300];
+    rng.Output(whole, sizeof(whole));
+    rng.Seek(0);
+    rng.Output(pieces, 7);
+    rng.Output(pieces + 7, 64);
+    rng.Output(pieces + 71, 229);
+    BOOST_CHECK(memcmp(whole, pieces, sizeof(whole)) == 0);
+    rng.Seek(2);
+    rng.Output(pieces, 64);
+    BOOST_CHECK(memcmp(whole + 128, pieces, 64) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(fastrandom)
+{
+    FastRandomContext ctx1(true);
+    FastRandomContext ctx2(true);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK_EQUAL(ctx1.rand64(), ctx2.rand64());
+    BOOST_CHECK(ctx1.rand256() == ctx2.rand256());
+
+    // Randomly seeded, and the thread context
+    FastRandomContext ctx3;
+    for (int i = 0; i < 1000; i++) {
+        BOOST_CHECK(ctx3.randrange(7) < 7);
+        BOOST_CHECK(GetInsecureRand(1000) < 1000);
+    }
+    BOOST_CHECK_EQUAL(ctx3.randrange(0), 0U);
+    BOOST_CHECK_EQUAL(ctx3.randrange(1), 0U);
+    BOOST_CHECK(&GetFastRandomContext() == &GetFastRandomContext());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
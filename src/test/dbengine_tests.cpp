@@ -0,0 +1,110 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "dbengine.h"
+#include "leveldbwrapper.h"
+
+#include "uint256.h"
+
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(dbengine_tests)
+
+class CBatchRecorder : public CDBWriteBatch::Handler
+{
+public:
+    std::vector<std::pair<std::string, std::string> > vPuts;
+    std::vector<std::string> vDeletes;
+
+    void Put(const CDBSlice& key, const CDBSlice& value) { vPuts.push_back(std::make_pair(key.ToString(), value.ToString())); }
+    void Delete(const CDBSlice& key) { vDeletes.push_back(key.ToString()); }
+};
+
+BOOST_AUTO_TEST_CASE(dbengine_slice_batch)
+{
+    CDBSlice slKey("ab\0c", 4);
+    BOOST_CHECK(slKey.starts_with("ab"));
+    BOOST_CHECK(!slKey.starts_with("abc"));
+    BOOST_CHECK(slKey == CDBSlice(std::string("ab\0c", 4)));
+    BOOST_CHECK(CDBSlice("ab").compare(slKey) < 0);
+    BOOST_CHECK(CDBSlice("b").compare(slKey) > 0);
+
+    CDBWriteBatch batch;
+    batch.Put(slKey, CDBSlice());
+    batch.Delete("x");
+    batch.Put("y", "value");
+    BOOST_CHECK_EQUAL(batch.Count(), 3U);
+
+    CBatchRecorder recorder;
+    batch.Iterate(recorder);
+    BOOST_REQUIRE_EQUAL(recorder.vPuts.size(), 2U);
+    BOOST_CHECK(recorder.vPuts[0].first == std::string("ab\0c", 4));
+    BOOST_CHECK(recorder.vPuts[0].second.empty());
+    BOOST_CHECK(recorder.vPuts[1].second == "value");
+    BOOST_REQUIRE_EQUAL(recorder.vDeletes.size(), 1U);
+    BOOST_CHECK(recorder.vDeletes[0] == "x");
+
+    batch.Clear();
+    BOOST_CHECK_EQUAL(batch.Count(), 0U);
+    BOOST_CHECK_EQUAL(batch.GetSerializedSize(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(dbengine_wrapper)
+{
+    BOOST_CHECK(IsDBEngineAvailable(DEFAULT_DB_ENGINE));
+    BOOST_CHECK(!IsDBEngineAvailable("none"));
+
+    // every engine behaves the same under the wrapper
+    BOOST_FOREACH (const std::string& strEngine, GetDBEngineNames()) {
+        CLevelDBProfile profile;
+        profile.strEngine = strEngine;
+        CLevelDBWrapper db("dbengine_tests", 1 << 20, true, false, profile);
+        BOOST_CHECK(db.GetEngineName() == strEngine);
+
+        CLevelDBBatch batch;
+        for (int i = 0; i < 10; i++)
+            batch.Write(std::make_pair('k', i), uint256(i));
+        batch.Erase(std::make_pair('k', 3));
+        BOOST_CHECK(db.WriteBatch(batch));
+
+        uint256 value;
+        BOOST_CHECK(db.Read(std::make_pair('k', 2), value));
+        BOOST_CHECK(value == uint256(2));
+        BOOST_CHECK(!db.Exists(std::make_pair('k', 3)));
+        BOOST_CHECK(!db.Read(std::make_pair('k', 10), value));
+        BOOST_CHECK_EQUAL(db.GetLookups(), 3U);
+        BOOST_CHECK_EQUAL(db.GetLookupHits(), 1U);
+
+        // a snapshot keeps what was there when it was taken
+        const CDBSnapshot* snapshot = db.GetSnapshot();
+        BOOST_CHECK(db.Erase(std::make_pair('k', 0)));
+        BOOST_CHECK(db.Write('z', uint256(1)));
+        {
+            boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator(snapshot));
+            int nKeys = 0;
+            for (pcursor->Seek("k"); pcursor->Valid(); pcursor->Next()) {
+                BOOST_CHECK(pcursor->key().starts_with("k"));
+                nKeys++;
+            }
+            BOOST_CHECK(pcursor->IsOk());
+            BOOST_CHECK_EQUAL(nKeys, 9);
+        }
+        db.ReleaseSnapshot(snapshot);
+
+        boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+        int nKeys = 0;
+        std::string strLast;
+        for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+            BOOST_CHECK(nKeys == 0 || CDBSlice(strLast).compare(pcursor->key()) < 0);
+            strLast = pcursor->key().ToString();
+            nKeys++;
+        }
+        BOOST_CHECK_EQUAL(nKeys, 9);
+        BOOST_CHECK(strLast[0] == 'z');
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "random.h"
+#include "streams.h"
 #include "utilstrencodings.h"
 
 #include <vector>
@@ -46,4 +48,58 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(murmurhash3_prepared)
+{
+    for (int i = 0; i < 200; i++) {
+        vector<unsigned char> vData(insecure_rand() % 80);
+        for (unsigned int j = 0; j < vData.size(); j++)
+            vData[j] = insecure_rand();
+        CMurmurHash3Prepared prepared(vData);
+        for (unsigned int nHashNum = 0; nHashNum < 4; nHashNum++) {
+            unsigned int nSeed = nHashNum * 0xFBA4C795 + insecure_rand();
+            BOOST_CHECK_EQUAL(prepared.Hash(nSeed), MurmurHash3(nSeed, vData));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference vector of SipHash-2-4, key 00..0f and message 00..1f
+    uint256 val = uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+}
+
+BOOST_AUTO_TEST_CASE(hashquark_lanes)
+{
+    // Enough inputs for several full lane groups plus a partial one
+    const size_t nLen = 80;
+    const size_t nCount = QUARK_LANES * 3 + 5;
+    std::vector<unsigned char> vData(nLen * nCount);
+    GetRandBytes(&vData[0], vData.size());
+
+    std::vector<uint256> vHashes(nCount);
+    HashQuarkLanes(&vData[0], nLen, nLen, nCount, &vHashes[0]);
+    for (size_t i = 0; i < nCount; i++)
+        BOOST_CHECK(vHashes[i] == HashQuark(vData.begin() + i * nLen, vData.begin() + (i + 1) * nLen));
+}
+
+BOOST_AUTO_TEST_CASE(hashverifier)
+{
+    CDataStream ss(SER_DISK, 0);
+    ss << std::string("MasternodeCache") << (uint32_t)12345 << std::vector<unsigned char>(1000, 0x5a);
+    uint256 hash = Hash(ss.begin(), ss.end());
+
+    // Unserializing through the verifier hashes exactly the bytes it read
+    CHashVerifier<CDataStream> verifier(&ss);
+    std::string str;
+    uint32_t n;
+    std::vector<unsigned char> vch;
+    verifier >> str >> n >> vch;
+    BOOST_CHECK_EQUAL(str, "MasternodeCache");
+    BOOST_CHECK_EQUAL(n, 12345U);
+    BOOST_CHECK_EQUAL(vch.size(), 1000U);
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(verifier.GetHash() == hash);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,34 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "httpserver.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(httpserver_tests)
+
+BOOST_AUTO_TEST_CASE(httpserver_accept_encoding)
+{
+    BOOST_CHECK_EQUAL(ChooseContentEncoding(""), HTTP_ENCODING_IDENTITY);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("identity"), HTTP_ENCODING_IDENTITY);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("br, zstd"), HTTP_ENCODING_IDENTITY);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("gzip"), HTTP_ENCODING_GZIP);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("x-gzip"), HTTP_ENCODING_GZIP);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("Deflate"), HTTP_ENCODING_DEFLATE);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("*"), HTTP_ENCODING_GZIP);
+
+    // gzip on a tie, otherwise the highest q-value
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("deflate, gzip"), HTTP_ENCODING_GZIP);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("gzip;q=0.5, deflate"), HTTP_ENCODING_DEFLATE);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("gzip ; q=0.8 , deflate;q=0.9"), HTTP_ENCODING_DEFLATE);
+
+    // q=0 refuses a coding, also one * would allow
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("gzip;q=0"), HTTP_ENCODING_IDENTITY);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("gzip;q=0.000, deflate"), HTTP_ENCODING_DEFLATE);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("*, gzip;q=0"), HTTP_ENCODING_DEFLATE);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("*;q=0, identity"), HTTP_ENCODING_IDENTITY);
+    BOOST_CHECK_EQUAL(ChooseContentEncoding("gzip;q=junk"), HTTP_ENCODING_IDENTITY);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
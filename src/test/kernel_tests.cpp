@@ -0,0 +1,179 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kernel.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(kernel_hasher)
+{
+    for (int i = 0; i < 16; i++) {
+        CDataStream ssUniqueID(SER_GETHASH, 0);
+        ssUniqueID << (uint32_t)i << GetRandHash();
+        // uniqueness long enough to fill whole blocks of the midstate as well
+        if (i % 2)
+            ssUniqueID << std::vector<unsigned char>(i * 17, (unsigned char)i);
+        uint64_t nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+        unsigned int nTimeBlockFrom = 1546300800 + i;
+
+        CStakeKernelHasher hasher(nStakeModifier, nTimeBlockFrom, ssUniqueID);
+        for (unsigned int nTimeTx = nTimeBlockFrom; nTimeTx < nTimeBlockFrom + 30; nTimeTx++) {
+            CDataStream ss(SER_GETHASH, 0);
+            ss << nStakeModifier << nTimeBlockFrom << ssUniqueID << nTimeTx;
+            BOOST_CHECK(hasher.GetHash(nTimeTx) == Hash(ss.begin(), ss.end()));
+        }
+
+        // both forms of CheckStake hash and compare alike
+        uint256 bnTarget = ~uint256(0);
+        unsigned int nTimeTx = nTimeBlockFrom + 60;
+        uint256 hash1, hash2;
+        BOOST_CHECK(CheckStake(ssUniqueID, 100, nStakeModifier, bnTarget, nTimeBlockFrom, nTimeTx, hash1));
+        BOOST_CHECK(CheckStake(hasher, 100, bnTarget, nTimeTx, hash2));
+        BOOST_CHECK(hash1 == hash2);
+        BOOST_CHECK(!CheckStake(hasher, 100, uint256(0), nTimeTx, hash2));
+    }
+}
+
+// The modifier as computed before the candidates were kept between blocks:
+// collected and sorted for every block, each one hashed in every round
+static bool ReferenceStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGenerated)
+{
+    const int64_t nInterval = getIntervalVersion(false);
+    nStakeModifier = 0;
+    fGenerated = false;
+    const CBlockIndex* pindex = pindexPrev;
+    while (pindex->pprev && !pindex->GeneratedStakeModifier())
+        pindex = pindex->pprev;
+    if (!pindex->GeneratedStakeModifier())
+        return false;
+    nStakeModifier = pindex->nStakeModifier;
+    if (pindex->GetBlockTime() / nInterval >= pindexPrev->GetBlockTime() / nInterval)
+        return true;
+
+    std::vector<int64_t> vSections;
+    int64_t nSelectionInterval = 0;
+    for (int nSection = 0; nSection < 64; nSection++) {
+        vSections.push_back(nInterval * 63 / (63 + ((63 - nSection) * (MODIFIER_INTERVAL_RATIO - 1))));
+        nSelectionInterval += vSections.back();
+    }
+    int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nInterval) * nInterval - nSelectionInterval;
+
+    std::vector<std::pair<int64_t, uint256> > vSortedByTimestamp;
+    std::map<uint256, const CBlockIndex*> mapIndex;
+    for (pindex = pindexPrev; pindex && pindex->GetBlockTime() >= nSelectionIntervalStart; pindex = pindex->pprev) {
+        vSortedByTimestamp.push_back(std::make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        mapIndex[pindex->GetBlockHash()] = pindex;
+    }
+    std::sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+    bool fModifierV2 = mapIndex[vSortedByTimestamp[0].second]->nHeight >= Params().ModifierUpgradeBlock();
+
+    uint64_t nStakeModifierNew = 0;
+    int64_t nSelectionIntervalStop = nSelectionIntervalStart;
+    std::set<uint256> setSelected;
+    for (int nRound = 0; nRound < std::min(64, (int)vSortedByTimestamp.size()); nRound++) {
+        nSelectionIntervalStop += vSections[nRound];
+        const CBlockIndex* pindexSelected = NULL;
+        uint256 hashBest = 0;
+        for (size_t i = 0; i < vSortedByTimestamp.size(); i++) {
+            const CBlockIndex* pindexCandidate = mapIndex[vSortedByTimestamp[i].second];
+            if (pindexSelected && pindexCandidate->GetBlockTime() > nSelectionIntervalStop)
+                break;
+            if (setSelected.count(pindexCandidate->GetBlockHash()))
+                continue;
+            uint256 hashProof = (fModifierV2 || !pindexCandidate->IsProofOfStake()) ? pindexCandidate->GetBlockHash() : 0;
+            CDataStream ss(SER_GETHASH, 0);
+            ss << hashProof << nStakeModifier;
+            uint256 hashSelection = Hash(ss.begin(), ss.end());
+            if (pindexCandidate->IsProofOfStake())
+                hashSelection >>= 32;
+            if (!pindexSelected || hashSelection < hashBest) {
+                pindexSelected = pindexCandidate;
+                hashBest = hashSelection;
+            }
+        }
+        if (!pindexSelected)
+            return false;
+        nStakeModifierNew |= ((uint64_t)pindexSelected->GetStakeEntropyBit()) << nRound;
+        setSelected.insert(pindexSelected->GetBlockHash());
+    }
+    nStakeModifier = nStakeModifierNew;
+    fGenerated = true;
+    return true;
+}
+
+// Extend the chain ending at pindexPrev by the blocks of vBlocks, with
+// timestamps out of order at times, computing their stake modifiers as
+// AddToBlockIndex does and checking them against the reference
+static void ExtendChain(CBlockIndex* pindexPrev, std::vector<CBlockIndex>& vBlocks, std::vector<uint256>& vHashes)
+{
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        CBlockIndex& block = vBlocks[i];
+        vHashes[i] = GetRandHash();
+        block.phashBlock = &vHashes[i];
+        block.pprev = pindexPrev;
+        block.nHeight = pindexPrev->nHeight + 1;
+        block.nTime = pindexPrev->nTime + 60 + GetRand(121) - 90;
+        if (GetRand(3))
+            block.SetProofOfStake();
+        block.BuildSkip();
+
+        uint64_t nStakeModifier = 0, nStakeModifierRef = 0;
+        bool fGenerated = false, fGeneratedRef = false;
+        BOOST_CHECK(ComputeNextStakeModifier(pindexPrev, nStakeModifier, fGenerated));
+        BOOST_CHECK(ReferenceStakeModifier(pindexPrev, nStakeModifierRef, fGeneratedRef));
+        BOOST_CHECK_EQUAL(nStakeModifier, nStakeModifierRef);
+        BOOST_CHECK_EQUAL(fGenerated, fGeneratedRef);
+        block.SetStakeModifier(nStakeModifier, fGenerated);
+        pindexPrev = &block;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(stake_modifier_candidates)
+{
+    uint256 hashGenesis = GetRandHash();
+    CBlockIndex genesis;
+    genesis.phashBlock = &hashGenesis;
+    genesis.nHeight = 0;
+    genesis.nTime = 1546300800;
+    genesis.SetStakeModifier(0, true);
+    genesis.BuildSkip();
+
+    std::vector<CBlockIndex> vMainHead(400), vMainTail(200), vFork(80), vLate(40);
+    std::vector<uint256> vMainHeadHashes(400), vMainTailHashes(200), vForkHashes(80), vLateHashes(40);
+    std::vector<CBlockIndex> vFirst(1);
+    std::vector<uint256> vFirstHash(1);
+    // the modifier of the first block is not computed from candidates
+    vFirst[0].phashBlock = &vFirstHash[0];
+    vFirstHash[0] = GetRandHash();
+    vFirst[0].pprev = &genesis;
+    vFirst[0].nHeight = 1;
+    vFirst[0].nTime = genesis.nTime + 60;
+    vFirst[0].SetStakeModifier(GetRand(std::numeric_limits<uint64_t>::max()), true);
+    vFirst[0].BuildSkip();
+
+    ExtendChain(&vFirst[0], vMainHead, vMainHeadHashes);
+    // a fork from below the last computation, then the main chain again
+    ExtendChain(&vMainHead[300], vFork, vForkHashes);
+    ExtendChain(&vMainHead.back(), vMainTail, vMainTailHashes);
+    // and a block from far back
+    ExtendChain(&vMainHead[100], vLate, vLateHashes);
+
+    ClearStakeModifierCandidates();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
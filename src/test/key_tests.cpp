@@ -142,6 +142,12 @@ BOOST_AUTO_TEST_CASE(key_test1)
         BOOST_CHECK(!pubkey2C.Verify(hashMsg, sign1C));
         BOOST_CHECK( pubkey2C.Verify(hashMsg, sign2C));
 
+        // truncated signatures
+
+        BOOST_CHECK(!pubkey1.Verify(hashMsg, vector<unsigned char>()));
+        BOOST_CHECK(!pubkey1.Verify(hashMsg, vector<unsigned char>(sign1.begin(), sign1.begin() + 4)));
+        BOOST_CHECK(!pubkey1.Verify(hashMsg, vector<unsigned char>(sign1.begin(), sign1.end() - 1)));
+
         // compact signatures (with key recovery)
 
         vector<unsigned char> csign1, csign2, csign1C, csign2C;
@@ -48,4 +48,81 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 4109975100000000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(script_check_memo)
+{
+    CScriptCheckMemo memo(2);
+    uint256 txid1 = uint256(1), txid2 = uint256(2), txid3 = uint256(3);
+    memo.Add(txid1, STANDARD_SCRIPT_VERIFY_FLAGS);
+    BOOST_CHECK(memo.IsChecked(txid1, STANDARD_SCRIPT_VERIFY_FLAGS));
+    BOOST_CHECK(memo.IsChecked(txid1, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG));
+    BOOST_CHECK(!memo.IsChecked(txid2, SCRIPT_VERIFY_P2SH));
+
+    // checked under fewer flags does not count for more
+    memo.Add(txid2, SCRIPT_VERIFY_P2SH);
+    BOOST_CHECK(memo.IsChecked(txid2, SCRIPT_VERIFY_P2SH));
+    BOOST_CHECK(!memo.IsChecked(txid2, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG));
+
+    // the oldest goes first
+    memo.Add(txid3, STANDARD_SCRIPT_VERIFY_FLAGS);
+    BOOST_CHECK_EQUAL(memo.size(), 2U);
+    BOOST_CHECK(!memo.IsChecked(txid1, SCRIPT_VERIFY_P2SH));
+    BOOST_CHECK(memo.IsChecked(txid3, SCRIPT_VERIFY_P2SH));
+
+    memo.clear();
+    BOOST_CHECK_EQUAL(memo.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(input_height_cache)
+{
+    CInputHeightCache cache(3);
+    CMutableTransaction txParent, txChild;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(uint256(1), 0);
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(CTransaction(txParent).GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_RETURN;
+
+    uint64_t nGeneration = cache.GetGeneration();
+    cache.Add(uint256(1), 5, nGeneration);
+    cache.Add(uint256(2), 6, nGeneration);
+    int nHeight;
+    BOOST_CHECK(cache.Get(uint256(1), nHeight));
+    BOOST_CHECK_EQUAL(nHeight, 5);
+
+    // a block spends from the first, its own outputs come and go
+    CBlock block;
+    block.vtx.push_back(CTransaction(txParent));
+    block.vtx.push_back(CTransaction(txChild));
+    cache.ConnectBlock(block, 10);
+    BOOST_CHECK(!cache.Get(uint256(1), nHeight));
+    BOOST_CHECK(!cache.Get(block.vtx[0].GetHash(), nHeight));
+    BOOST_CHECK(!cache.Get(block.vtx[1].GetHash(), nHeight));
+    BOOST_CHECK(cache.Get(uint256(2), nHeight));
+
+    // what was read before the block is out of date
+    cache.Add(uint256(1), 5, nGeneration);
+    BOOST_CHECK(!cache.Get(uint256(1), nHeight));
+
+    block.vtx.pop_back();
+    cache.ConnectBlock(block, 11);
+    BOOST_CHECK(cache.Get(block.vtx[0].GetHash(), nHeight));
+    BOOST_CHECK_EQUAL(nHeight, 11);
+    cache.DisconnectBlock(block);
+    BOOST_CHECK(!cache.Get(block.vtx[0].GetHash(), nHeight));
+
+    // full, it starts over
+    nGeneration = cache.GetGeneration();
+    cache.Add(uint256(3), 7, nGeneration);
+    cache.Add(uint256(4), 8, nGeneration);
+    BOOST_CHECK_EQUAL(cache.size(), 3U);
+    cache.Add(uint256(5), 9, nGeneration);
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+
+    cache.clear();
+    BOOST_CHECK(!cache.Get(uint256(5), nHeight));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,186 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode-list.h"
+
+#include "clientversion.h"
+#include "key.h"
+#include "main.h"
+#include "random.h"
+#include "script/standard.h"
+#include "streams.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternode_list_tests)
+
+static CMutableTransaction RegistrationTx(const CKey& keyCollateral, const CService& addr, const CKey& keyOperator)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.push_back(CTxOut(MASTERNODE_COLLATERAL, GetScriptForDestination(keyCollateral.GetPubKey().GetID())));
+    tx.vout.push_back(CTxOut(0, CMasternodeRegistration(addr, keyOperator.GetPubKey()).GetScript()));
+    return tx;
+}
+
+static CBlock MakeBlock(const CScript& payee, const std::vector<CMutableTransaction>& vtx, CAmount nPayment = COIN)
+{
+    CMutableTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << GetRandInt(1000000);
+    txCoinBase.vout.push_back(CTxOut(10 * COIN, CScript() << OP_TRUE));
+    if (!payee.empty())
+        txCoinBase.vout.push_back(CTxOut(nPayment, payee));
+
+    CBlock block;
+    block.vtx.push_back(txCoinBase);
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        block.vtx.push_back(vtx[i]);
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(masternode_registration)
+{
+    CKey keyCollateral, keyOperator;
+    keyCollateral.MakeNewKey(true);
+    keyOperator.MakeNewKey(true);
+    CService addr("1.2.3.4:65444");
+
+    CMutableTransaction tx = RegistrationTx(keyCollateral, addr, keyOperator);
+    BOOST_CHECK(tx.vout[1].scriptPubKey.size() <= MAX_OP_RETURN_RELAY);
+
+    CMasternodeRegistration reg;
+    unsigned int nCollateral = 99;
+    BOOST_CHECK(CMasternodeRegistration::FromTransaction(tx, reg, nCollateral));
+    BOOST_CHECK_EQUAL(nCollateral, 0U);
+    BOOST_CHECK(reg.addr == addr);
+    BOOST_CHECK(reg.pubKeyOperator == keyOperator.GetPubKey());
+
+    // no collateral, or one that is not paid to a key
+    CMutableTransaction txNoCollateral = tx;
+    txNoCollateral.vout[0].nValue = MASTERNODE_COLLATERAL - 1;
+    BOOST_CHECK(!CMasternodeRegistration::FromTransaction(txNoCollateral, reg, nCollateral));
+    CMutableTransaction txScript = tx;
+    txScript.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    BOOST_CHECK(!CMasternodeRegistration::FromTransaction(txScript, reg, nCollateral));
+
+    // other OP_RETURN data
+    CMutableTransaction txOther = tx;
+    txOther.vout[1].scriptPubKey = CScript() << OP_RETURN << std::vector<unsigned char>(40, 'x');
+    BOOST_CHECK(!CMasternodeRegistration::FromTransaction(txOther, reg, nCollateral));
+}
+
+BOOST_AUTO_TEST_CASE(masternode_list_queue)
+{
+    CDeterministicMasternodeList list;
+    CKey keyCollateral[3], keyOperator[3];
+    std::vector<CMutableTransaction> vReg;
+    for (int i = 0; i < 3; i++) {
+        keyCollateral[i].MakeNewKey(true);
+        keyOperator[i].MakeNewKey(true);
+    }
+    vReg.push_back(RegistrationTx(keyCollateral[0], CService("1.2.3.4:65444"), keyOperator[0]));
+    vReg.push_back(RegistrationTx(keyCollateral[1], CService("1.2.3.5:65444"), keyOperator[1]));
+    // the same operator key again is not registered
+    vReg.push_back(RegistrationTx(keyCollateral[2], CService("1.2.3.6:65444"), keyOperator[0]));
+    COutPoint collateral0(CTransaction(vReg[0]).GetHash(), 0);
+    COutPoint collateral1(CTransaction(vReg[1]).GetHash(), 0);
+    CScript payee0 = vReg[0].vout[0].scriptPubKey;
+    CScript payee1 = vReg[1].vout[0].scriptPubKey;
+
+    std::vector<CMasternodeListDiff> vDiffs(4);
+    std::vector<CMutableTransaction> vtx;
+    vtx.push_back(vReg[0]);
+    list.ApplyBlock(MakeBlock(CScript(), vtx), 10, vDiffs[0]);
+    vtx[0] = vReg[1];
+    vtx.push_back(vReg[2]);
+    list.ApplyBlock(MakeBlock(CScript(), vtx), 11, vDiffs[1]);
+    BOOST_CHECK_EQUAL(list.size(), 2U);
+    BOOST_CHECK_EQUAL(vDiffs[1].vChanges.size(), 1U);
+
+    CDeterministicMasternode mn;
+    BOOST_CHECK(list.GetNextPayee(mn));
+    BOOST_CHECK(mn.collateral == collateral0);
+
+    // only the first may be paid, and no less than the payment
+    CAmount nPayment = GetMasternodePayment(11, GetBlockValue(11));
+    std::string strError;
+    BOOST_CHECK(list.CheckPayee(MakeBlock(payee0, std::vector<CMutableTransaction>(), nPayment), 12, strError));
+    BOOST_CHECK(!list.CheckPayee(MakeBlock(payee1, std::vector<CMutableTransaction>(), nPayment), 12, strError));
+    BOOST_CHECK(!list.CheckPayee(MakeBlock(CScript(), std::vector<CMutableTransaction>()), 12, strError));
+    if (nPayment > 0)
+        BOOST_CHECK(!list.CheckPayee(MakeBlock(payee0, std::vector<CMutableTransaction>(), nPayment - 1), 12, strError));
+
+    // paying the first moves it behind the second
+    list.ApplyBlock(MakeBlock(payee0, std::vector<CMutableTransaction>()), 12, vDiffs[2]);
+    BOOST_CHECK(vDiffs[2].paid == collateral0);
+    BOOST_CHECK(list.GetNextPayee(mn));
+    BOOST_CHECK(mn.collateral == collateral1);
+
+    // spending the collateral unregisters the masternode
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = collateral1;
+    txSpend.vout.push_back(CTxOut(MASTERNODE_COLLATERAL, payee1));
+    list.ApplyBlock(MakeBlock(payee1, std::vector<CMutableTransaction>(1, txSpend)), 13, vDiffs[3]);
+    BOOST_CHECK_EQUAL(list.size(), 1U);
+    BOOST_CHECK(!list.Get(collateral1, mn));
+    BOOST_CHECK(list.Get(collateral0, mn));
+    BOOST_CHECK_EQUAL(mn.nLastPaidHeight, 12);
+
+    // ranks are the same for the same block and cover the list
+    uint256 hashBlock = GetRandHash();
+    BOOST_CHECK_EQUAL(list.GetRank(collateral0, hashBlock), 1);
+    BOOST_CHECK_EQUAL(list.GetRank(collateral1, hashBlock), -1);
+
+    // the stored diffs undo the blocks back to the empty list
+    for (int i = 3; i >= 0; i--) {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << vDiffs[i];
+        CMasternodeListDiff diff;
+        ss >> diff;
+        BOOST_CHECK(diff.hashBlock == vDiffs[i].hashBlock);
+        list.UndoBlock(diff);
+        if (i == 3) {
+            BOOST_CHECK(list.GetNextPayee(mn));
+            BOOST_CHECK(mn.collateral == collateral1);
+        }
+        if (i == 2) {
+            BOOST_CHECK(list.GetNextPayee(mn));
+            BOOST_CHECK(mn.collateral == collateral0);
+            BOOST_CHECK_EQUAL(mn.nLastPaidHeight, 0);
+        }
+    }
+    BOOST_CHECK_EQUAL(list.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_list_payee_not_loaded)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CBlock block = MakeBlock(GetScriptForDestination(key.GetPubKey().GetID()), std::vector<CMutableTransaction>());
+
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = Params().DeterministicMasternodeHeight() - 1;
+    CBlockIndex index;
+    index.nHeight = indexPrev.nHeight + 1;
+    index.pprev = &indexPrev;
+
+    // the list is not loaded by the test setup, so it is not at the parent
+    BOOST_CHECK(!deterministicMasternodes.IsAt(&indexPrev));
+
+    // a block it cannot tell the payee of is not accepted, nor marked invalid
+    CValidationState state;
+    BOOST_CHECK(!CheckDeterministicMasternodePayee(block, &index, state));
+    BOOST_CHECK(state.IsError());
+    BOOST_CHECK(!state.IsInvalid());
+
+    // before the list decides the payee any is accepted
+    CValidationState stateBefore;
+    BOOST_CHECK(CheckDeterministicMasternodePayee(block, &indexPrev, stateBefore));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
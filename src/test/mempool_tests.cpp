@@ -99,4 +99,205 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorStateTest)
+{
+    // A chain of three transactions with growing fees and an unrelated one
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10000LL * (i + 1);
+        if (i > 0 && i < 3) {
+            tx[i].vin[0].prevout.hash = tx[i - 1].GetHash();
+            tx[i].vin[0].prevout.n = 0;
+        }
+    }
+    CTxMemPool pool(CFeeRate(0));
+    const CAmount nFees[4] = {1000, 2000, 10000, 2500};
+    for (int i = 0; i < 4; i++)
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], nFees[i], 0, 0.0, 1));
+
+    LOCK(pool.cs);
+    CTxMemPool::txiter it[4];
+    for (int i = 0; i < 4; i++)
+        it[i] = pool.mapTx.find(tx[i].GetHash());
+    size_t nSize = it[0]->GetTxSize();
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it[2]->GetSizeWithAncestors(), it[0]->GetTxSize() + it[1]->GetTxSize() + it[2]->GetTxSize());
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 13000);
+    BOOST_CHECK_EQUAL(it[3]->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it[0]->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it[0]->GetModFeesWithDescendants(), 13000);
+    BOOST_CHECK_EQUAL(it[1]->GetSizeWithDescendants(), 2 * nSize);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(it[0]).size(), 1);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(it[2]).count(it[1]), 1);
+
+    // The ancestor score index ranks the packages: {0,1,2} pays 13000, 3 pays 2500
+    BOOST_CHECK(pool.mapTx.project<0>(pool.mapTx.get<ancestor_score>().begin()) == it[2]);
+    BOOST_CHECK(pool.mapTx.project<0>(pool.mapTx.get<fee_rate>().begin()) == it[2]);
+
+    // A fee delta counts for the transaction and its descendants
+    pool.PrioritiseTransaction(tx[1].GetHash(), tx[1].GetHash().ToString(), 0.0, 5000);
+    BOOST_CHECK_EQUAL(it[1]->GetModifiedFee(), 7000);
+    BOOST_CHECK_EQUAL(it[1]->GetModFeesWithAncestors(), 8000);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 18000);
+
+    // Mining the first transaction leaves its descendants with less ancestor state
+    std::list<CTransaction> removed;
+    pool.remove(tx[0], removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(it[1]->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 17000);
+    BOOST_CHECK(pool.GetMemPoolParents(it[1]).empty());
+
+    // Putting it back, as a reorg does, links the descendants again
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], nFees[0], 0, 0.0, 1));
+    it[0] = pool.mapTx.find(tx[0].GetHash());
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it[2]->GetSizeWithAncestors(), 3 * nSize);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 18000);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(it[0]).size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    // A cheap parent with a child that pays for it, and two independent ones
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_1 << i;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10 * COIN;
+    }
+    tx[1].vin[0].prevout.hash = tx[0].GetHash();
+    const CAmount nFees[4] = {1000, 30000, 5000, 20000};
+    for (int i = 0; i < 4; i++)
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], nFees[i], 100 * (i + 1), 0.0, 1));
+
+    // Trimming to a little less than the current usage evicts the lowest
+    // descendant score: tx[2], not the parent its child pays for
+    size_t nUsage = pool.DynamicMemoryUsage();
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK(!pool.exists(tx[2].GetHash()));
+    BOOST_CHECK(pool.exists(tx[0].GetHash()));
+    BOOST_CHECK(pool.exists(tx[1].GetHash()));
+    BOOST_CHECK(pool.exists(tx[3].GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+
+    // The minimum fee is now above the rate of the evicted transaction
+    size_t nSize = ::GetSerializeSize(tx[2], SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(pool.GetMinFee(1).GetFee(nSize) > nFees[2]);
+
+    // Evicting the parent takes its child along
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(tx[3].GetHash()));
+    pool.TrimToSize(0);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+
+    // Expiry removes old transactions with their descendants
+    for (int i = 0; i < 4; i++)
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], nFees[i], 100 * (i + 1), 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.Expire(101), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK_EQUAL(pool.Expire(1000), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(DisconnectedBlockTransactionsTest)
+{
+    // Three blocks of two transactions, each spending the one before it
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(1);
+    coinbase.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    std::vector<CTransaction> vBlocks[3];
+    uint256 hashPrev = 1;
+    for (int i = 0; i < 3; i++) {
+        coinbase.vin[0].scriptSig = CScript() << i << OP_0;
+        vBlocks[i].push_back(coinbase);
+        for (int j = 0; j < 2; j++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(hashPrev, 0);
+            tx.vin[0].scriptSig = CScript() << OP_11;
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+            tx.vout[0].nValue = 1000;
+            vBlocks[i].push_back(tx);
+            hashPrev = tx.GetHash();
+        }
+    }
+
+    // Disconnected newest first, queued in chain order without the coinbases
+    CDisconnectedBlockTransactions disconnectpool;
+    for (int i = 2; i >= 0; i--)
+        disconnectpool.AddBlock(vBlocks[i]);
+    BOOST_CHECK_EQUAL(disconnectpool.size(), 6U);
+    std::list<CTransaction>::const_iterator it = disconnectpool.GetQueued().begin();
+    for (int i = 0; i < 3; i++) {
+        for (int j = 1; j <= 2; j++, ++it)
+            BOOST_CHECK(it->GetHash() == vBlocks[i][j].GetHash());
+    }
+
+    // A new block confirming some of them again takes them out
+    std::vector<CTransaction> vConnected;
+    vConnected.push_back(vBlocks[0][1]);
+    vConnected.push_back(vBlocks[2][2]);
+    disconnectpool.RemoveForBlock(vConnected);
+    BOOST_CHECK_EQUAL(disconnectpool.size(), 4U);
+    BOOST_CHECK(disconnectpool.GetQueued().front().GetHash() == vBlocks[0][2].GetHash());
+
+    // Trimming drops the oldest first
+    std::list<CTransaction> removed;
+    disconnectpool.TrimToSize(0, removed);
+    BOOST_CHECK(disconnectpool.empty());
+    BOOST_CHECK_EQUAL(removed.size(), 4U);
+    BOOST_CHECK(removed.front().GetHash() == vBlocks[0][2].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolEstimateFeeTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    BOOST_CHECK(pool.estimateFee(1) == CFeeRate(0));
+
+    // ten transactions a block confirm in one block at 20000 per kB, ten in three at 5000
+    int nTx = 0;
+    for (unsigned int nHeight = 10; nHeight < 30; nHeight++) {
+        std::vector<CTransaction> vtx;
+        for (int i = 0; i < 20; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].scriptSig = CScript() << nTx++;
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+            tx.vout[0].nValue = 10000LL;
+            unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            bool fFast = i < 10;
+            CAmount nFee = (fFast ? 20 : 5) * nSize;
+            pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, 0, 0.0, nHeight - (fFast ? 1 : 3)));
+            vtx.push_back(tx);
+        }
+        std::list<CTransaction> conflicts;
+        pool.removeForBlock(vtx, nHeight, conflicts);
+    }
+
+    BOOST_CHECK(pool.estimateFee(1) == CFeeRate(20000));
+    // further out the estimate comes from the slow ones
+    BOOST_CHECK(pool.estimateFee(3) == CFeeRate(5000));
+    BOOST_CHECK(pool.estimateFee(25) == CFeeRate(5000));
+    BOOST_CHECK(pool.estimateFee(26) == CFeeRate(0));
+    BOOST_CHECK_EQUAL(pool.estimatePriority(1), -1);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
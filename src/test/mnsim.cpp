@@ -0,0 +1,457 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "test/mnsim.h"
+
+#include "chainparams.h"
+#include "hash.h"
+#include "main.h"
+#include "masternode-payments.h"
+#include "masternode.h"
+#include "masternodeman.h"
+#include "random.h"
+#include "script/standard.h"
+#include "swifttx.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+std::string CMasternodeSimStats::ToString() const
+{
+    std::string str = strprintf("%s: %u/%u accepted, ", strRound, nAccepted, nItems);
+    if (nConvergence < 0)
+        str += "never converged";
+    else
+        str += strprintf("converged after %.3fs", nConvergence / 1000000.0);
+    str += strprintf(", %u messages delivered, %u suppressed, %u announcements\n", nDelivered, nSuppressed, nAnnounced);
+    for (mapMsgCmdStats::const_iterator it = mapMsgStats.begin(); it != mapMsgStats.end(); ++it) {
+        const CNetMsgStats& cmd = it->second;
+        str += strprintf("  %-12s recv %6u msgs %9u bytes, sent %6u msgs %9u bytes, handled in %.3fms\n",
+            it->first, cmd.nMsgsRecv, cmd.nBytesRecv, cmd.nMsgsSent, cmd.nBytesSent, cmd.nProcessTime / 1000.0);
+    }
+    return str;
+}
+
+CMasternodeNetSim::CMasternodeNetSim(const CMasternodeSimParams& paramsIn) : params(paramsIn), round(ROUND_LIST_SYNC), nListSize(0), hashLockTx(0), nNow(0), pindexTipBefore(NULL)
+{
+    nTimeStart = GetTime();
+    BuildChain();
+
+    // listed a ping interval ago, so that the pings of the rounds are taken
+    SetMockTime(nTimeStart - MASTERNODE_MIN_MNP_SECONDS);
+    AddMasternodes();
+    SetNow(0);
+}
+
+CMasternodeNetSim::~CMasternodeNetSim()
+{
+    RemovePeers();
+
+    if (hashLockTx != 0) {
+        LOCK(cs_swifttx);
+        TxLockMap::iterator it = mapTxLocks.find(hashLockTx);
+        if (it != mapTxLocks.end()) {
+            it->second.SetExpiration(0);
+            CleanTransactionLocksList();
+        }
+    }
+    mnodeman.Clear();
+    masternodePayments.Clear();
+
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(pindexTipBefore);
+        BOOST_FOREACH (CBlockIndex* pindex, vChain) {
+            mapBlockIndex.erase(pindex->GetBlockHash());
+            delete pindex;
+        }
+    }
+    SetMockTime(0);
+}
+
+void CMasternodeNetSim::SetNow(int64_t nNowIn)
+{
+    nNow = nNowIn;
+    SetMockTime(nTimeStart + nNow / 1000000);
+}
+
+void CMasternodeNetSim::BuildChain()
+{
+    LOCK(cs_main);
+    pindexTipBefore = chainActive.Tip();
+    CBlockIndex* pindexPrev = pindexTipBefore;
+    for (int nHeight = pindexPrev->nHeight + 1; nHeight <= MNSIM_CHAIN_HEIGHT; nHeight++) {
+        CBlockIndex* pindex = new CBlockIndex();
+        pindex->nHeight = nHeight;
+        pindex->pprev = pindexPrev;
+        // a block a minute up to now, recent enough for the node to take itself as synced
+        pindex->nTime = nTimeStart - (MNSIM_CHAIN_HEIGHT - nHeight) * 60;
+        BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(GetRandHash(), pindex)).first;
+        pindex->phashBlock = &mi->first;
+        pindex->BuildSkip();
+        vChain.push_back(pindex);
+        pindexPrev = pindex;
+    }
+    chainActive.SetTip(pindexPrev);
+}
+
+void CMasternodeNetSim::AddMasternodes()
+{
+    vMasternodes.resize(params.nMasternodes);
+    for (int i = 0; i < params.nMasternodes; i++) {
+        CSimMasternode& simmn = vMasternodes[i];
+        simmn.keyCollateral.MakeNewKey(true);
+        simmn.keyMasternode.MakeNewKey(true);
+        simmn.pubKeyCollateral = simmn.keyCollateral.GetPubKey();
+        simmn.pubKeyMasternode = simmn.keyMasternode.GetPubKey();
+        simmn.vin = CTxIn(GetRandHash(), 0);
+
+        int n = i + 1;
+        CService addr(strprintf("1.%d.%d.%d", (n >> 16) & 0xff, (n >> 8) & 0xff, n & 0xff), Params().GetDefaultPort());
+        CMasternodeBroadcast mnb(addr, simmn.vin, simmn.pubKeyCollateral, simmn.pubKeyMasternode, PROTOCOL_VERSION);
+        mnb.lastPing = CMasternodePing(simmn.vin);
+        CMasternode mn(mnb);
+        mnodeman.Add(mn);
+        // the collateral outputs do not exist, take them as looked up already
+        mnodeman.SetCollateralChecked(simmn.vin.prevout, false);
+    }
+}
+
+void CMasternodeNetSim::AddPeers()
+{
+    vPeers.resize(params.nPeers);
+    for (int i = 0; i < params.nPeers; i++) {
+        CAddress addr(CService(strprintf("2.0.%d.%d", i / 250, i % 250 + 1), Params().GetDefaultPort()));
+        // connecting for good, so that nothing is written to its socket
+        CNode* pnode = new CNode(INVALID_SOCKET, addr, "", false, true);
+        pnode->nVersion = PROTOCOL_VERSION;
+        pnode->nServices = NODE_NETWORK;
+        pnode->fSuccessfullyConnected = true;
+
+        CSimPeer& peer = vPeers[i];
+        peer.pnode = pnode;
+        peer.nBusyIn = 0;
+        peer.nBusyOut = 0;
+        peer.mapKnownAt.clear();
+        peer.nListAnnounced = 0;
+        peer.nListArrival = -1;
+
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+}
+
+void CMasternodeNetSim::RemovePeers()
+{
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (const CSimPeer& peer, vPeers)
+            vNodes.erase(std::remove(vNodes.begin(), vNodes.end(), peer.pnode), vNodes.end());
+    }
+    BOOST_FOREACH (const CSimPeer& peer, vPeers)
+        delete peer.pnode;
+    vPeers.clear();
+}
+
+void CMasternodeNetSim::BeginRound(Round roundIn, const std::string& strRound)
+{
+    round = roundIn;
+    stats = CMasternodeSimStats();
+    stats.strRound = strRound;
+    vItems.clear();
+    events.clear();
+    AddPeers();
+}
+
+CMasternodeSimStats CMasternodeNetSim::EndRound()
+{
+    Run();
+
+    stats.nItems = vItems.size();
+    BOOST_FOREACH (const CSimPeer& peer, vPeers) {
+        CNodeStats nodestats;
+        peer.pnode->copyStats(nodestats);
+        for (mapMsgCmdStats::const_iterator it = nodestats.mapMsgStats.begin(); it != nodestats.mapMsgStats.end(); ++it) {
+            CNetMsgStats& cmd = stats.mapMsgStats[it->first];
+            cmd.nMsgsSent += it->second.nMsgsSent;
+            cmd.nBytesSent += it->second.nBytesSent;
+            cmd.nMsgsRecv += it->second.nMsgsRecv;
+            cmd.nBytesRecv += it->second.nBytesRecv;
+            cmd.nProcessTime += it->second.nProcessTime;
+        }
+    }
+    RemovePeers();
+    return stats;
+}
+
+size_t CMasternodeNetSim::AddItem(const char* pszCommand, const CDataStream& ssPayload, const uint256& hash, size_t nFrom)
+{
+    CSimItem item;
+    item.hash = hash;
+    item.strCommand = pszCommand;
+    item.strPayload.assign(ssPayload.begin(), ssPayload.end());
+    item.nFrom = nFrom;
+    item.fAccepted = false;
+    item.nAcceptedAt = -1;
+    vItems.push_back(item);
+    return vItems.size() - 1;
+}
+
+void CMasternodeNetSim::Gossip(const char* pszCommand, const CDataStream& ssPayload, const uint256& hash, size_t nMasternode, int64_t nOrigin)
+{
+    size_t nItem = AddItem(pszCommand, ssPayload, hash, nMasternode);
+    for (int nPeer = 0; nPeer < params.nPeers; nPeer++) {
+        CSimEvent event;
+        event.fArrive = false;
+        event.nPeer = nPeer;
+        event.nItem = nItem;
+        int nHops = 1 + GetInsecureRandInt(params.nMaxHops);
+        events.insert(std::make_pair(nNow + nOrigin + nHops * params.nLatency, event));
+    }
+}
+
+int64_t CMasternodeNetSim::SendOver(int64_t& nBusy, size_t nBytes) const
+{
+    nBusy = std::max(nNow, nBusy) + nBytes * 1000000 / params.nBandwidth;
+    return nBusy + params.nLatency;
+}
+
+void CMasternodeNetSim::Run()
+{
+    while (!events.empty()) {
+        std::multimap<int64_t, CSimEvent>::iterator it = events.begin();
+        SetNow(it->first);
+        CSimEvent event = it->second;
+        events.erase(it);
+
+        CSimPeer& peer = vPeers[event.nPeer];
+        CSimItem& item = vItems[event.nItem];
+        if (!event.fArrive) {
+            // a peer the node announced the item to has no reason to send it
+            std::map<uint256, int64_t>::const_iterator itKnown = peer.mapKnownAt.find(item.hash);
+            if (itKnown != peer.mapKnownAt.end() && itKnown->second <= nNow) {
+                stats.nSuppressed++;
+                continue;
+            }
+            event.fArrive = true;
+            events.insert(std::make_pair(SendOver(peer.nBusyIn, CMessageHeader::HEADER_SIZE + item.strPayload.size()), event));
+            continue;
+        }
+
+        Deliver(event.nPeer, event.nItem);
+        stats.nDelivered++;
+        CollectFromNode();
+
+        if (!item.fAccepted && IsAccepted(item)) {
+            item.fAccepted = true;
+            stats.nAccepted++;
+        }
+    }
+
+    if (stats.nAccepted == vItems.size()) {
+        // the list sync is done once the last inv is at the peer, the rest once the node took the last item
+        stats.nConvergence = 0;
+        BOOST_FOREACH (const CSimItem& item, vItems)
+            stats.nConvergence = std::max(stats.nConvergence, item.nAcceptedAt);
+    }
+}
+
+void CMasternodeNetSim::Deliver(int nPeer, size_t nItem)
+{
+    CSimItem& item = vItems[nItem];
+    CNode* pnode = vPeers[nPeer].pnode;
+
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(item.strCommand.c_str(), item.strPayload.size());
+    uint256 hash = Hash(item.strPayload.begin(), item.strPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    ssMsg << hdr;
+    ssMsg.write(item.strPayload.data(), item.strPayload.size());
+
+    LOCK(pnode->cs_vRecvMsg);
+    pnode->ReceiveMsgBytes(&ssMsg[0], ssMsg.size());
+    // one message a call, as the message handler thread takes them
+    while (!pnode->vRecvMsg.empty() && !pnode->fDisconnect) {
+        size_t nQueued = pnode->vRecvMsg.size();
+        ProcessMessages(pnode);
+        if (pnode->vRecvMsg.size() == nQueued)
+            break;
+    }
+}
+
+void CMasternodeNetSim::CollectFromNode()
+{
+    BOOST_FOREACH (CSimPeer& peer, vPeers) {
+        CNode* pnode = peer.pnode;
+        std::vector<CInv> vInv;
+        std::vector<std::pair<uint256, CMasternodePingAnnounce> > vPingAnnounce;
+        {
+            LOCK(pnode->cs_inventory);
+            vInv.swap(pnode->vInventoryToSend);
+            vPingAnnounce.swap(pnode->vPingAnnounceToSend);
+            pnode->fInventoryUrgent = false;
+        }
+
+        size_t nBytes = 0;
+        CSendQueueEntry* pentry = pnode->pSendQueue.exchange(NULL);
+        while (pentry != NULL) {
+            CSendQueueEntry* pnext = pentry->pnext;
+            nBytes += pentry->ssMsg.size();
+            pnode->nSendSize -= pentry->ssMsg.size();
+            delete pentry;
+            pentry = pnext;
+        }
+        if (!vInv.empty())
+            nBytes += CMessageHeader::HEADER_SIZE + ::GetSerializeSize(vInv, SER_NETWORK, PROTOCOL_VERSION);
+        if (!vPingAnnounce.empty())
+            nBytes += CMessageHeader::HEADER_SIZE + vPingAnnounce.size() * ::GetSerializeSize(vPingAnnounce[0].second, SER_NETWORK, PROTOCOL_VERSION);
+        if (nBytes == 0)
+            continue;
+
+        int64_t nArrival = SendOver(peer.nBusyOut, nBytes);
+        stats.nAnnounced += vInv.size() + vPingAnnounce.size();
+        BOOST_FOREACH (const CInv& inv, vInv) {
+            if (inv.type == MSG_MASTERNODE_ANNOUNCE && ++peer.nListAnnounced == nListSize)
+                peer.nListArrival = nArrival;
+            if (!peer.mapKnownAt.count(inv.hash))
+                peer.mapKnownAt[inv.hash] = nArrival;
+        }
+        for (size_t i = 0; i < vPingAnnounce.size(); i++) {
+            if (!peer.mapKnownAt.count(vPingAnnounce[i].first))
+                peer.mapKnownAt[vPingAnnounce[i].first] = nArrival;
+        }
+    }
+}
+
+bool CMasternodeNetSim::IsAccepted(CSimItem& item)
+{
+    switch (round) {
+    case ROUND_LIST_SYNC:
+        if (vPeers[item.nFrom].nListArrival < 0)
+            return false;
+        item.nAcceptedAt = vPeers[item.nFrom].nListArrival;
+        return true;
+    case ROUND_PINGS: {
+        CMasternode mn;
+        if (!mnodeman.Get(vMasternodes[item.nFrom].vin, mn) || mn.lastPing.GetHash() != item.hash)
+            return false;
+        break;
+    }
+    case ROUND_WINNERS: {
+        LOCK(cs_mapMasternodePayeeVotes);
+        if (!masternodePayments.mapMasternodePayeeVotes.count(item.hash))
+            return false;
+        break;
+    }
+    case ROUND_TXLOCK: {
+        LOCK(cs_swifttx);
+        TxLockMap::iterator it = mapTxLocks.find(hashLockTx);
+        if (it == mapTxLocks.end())
+            return false;
+        bool fCounted = false;
+        BOOST_FOREACH (const CConsensusVote& vote, it->second.vecConsensusVotes) {
+            if (vote.GetHash() == item.hash)
+                fCounted = true;
+        }
+        if (!fCounted)
+            return false;
+        break;
+    }
+    }
+    item.nAcceptedAt = nNow;
+    return true;
+}
+
+CMasternodeSimStats CMasternodeNetSim::SimulateListSync()
+{
+    BeginRound(ROUND_LIST_SYNC, "list sync");
+    nListSize = mnodeman.CountEnabled();
+
+    // asked straight from each peer, not gossiped
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << CTxIn();
+    for (int nPeer = 0; nPeer < params.nPeers; nPeer++) {
+        CSimEvent event;
+        event.fArrive = true;
+        event.nPeer = nPeer;
+        event.nItem = AddItem("dseg", ssPayload, GetRandHash(), nPeer);
+        events.insert(std::make_pair(SendOver(vPeers[nPeer].nBusyIn, CMessageHeader::HEADER_SIZE + ssPayload.size()), event));
+    }
+    return EndRound();
+}
+
+CMasternodeSimStats CMasternodeNetSim::SimulatePings()
+{
+    BeginRound(ROUND_PINGS, "pings");
+    int64_t nRoundStart = nNow;
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        CSimMasternode& simmn = vMasternodes[i];
+        int64_t nOrigin = GetInsecureRand(params.nSpread);
+        // signed when it is sent
+        SetNow(nRoundStart + nOrigin);
+        CMasternodePing mnp(simmn.vin);
+        mnp.Sign(simmn.keyMasternode, simmn.pubKeyMasternode);
+        SetNow(nRoundStart);
+
+        CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+        ssPayload << mnp;
+        Gossip("mnp", ssPayload, mnp.GetHash(), i, nOrigin);
+    }
+    return EndRound();
+}
+
+CMasternodeSimStats CMasternodeNetSim::SimulateWinnerVotes()
+{
+    BeginRound(ROUND_WINNERS, "winner votes");
+    int nBlockHeight = chainActive.Height() + 10;
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        CSimMasternode& simmn = vMasternodes[i];
+        int nRank = mnodeman.GetMasternodeRank(simmn.vin, nBlockHeight - 100, ActiveProtocol());
+        if (nRank < 1 || nRank > MNPAYMENTS_SIGNATURES_TOTAL)
+            continue;
+
+        CMasternodePaymentWinner winner(simmn.vin);
+        winner.nBlockHeight = nBlockHeight;
+        winner.AddPayee(GetScriptForDestination(simmn.pubKeyCollateral.GetID()));
+        winner.Sign(simmn.keyMasternode, simmn.pubKeyMasternode);
+
+        CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+        ssPayload << winner;
+        Gossip("mnw", ssPayload, winner.GetHash(), i, GetInsecureRand(params.nSpread));
+    }
+    return EndRound();
+}
+
+CMasternodeSimStats CMasternodeNetSim::SimulateTxLockVotes()
+{
+    BeginRound(ROUND_TXLOCK, "txlock votes");
+    int nBlockHeight = chainActive.Height();
+
+    // the transaction itself cannot be valid here, the lock starts as CreateNewLock leaves it
+    hashLockTx = GetRandHash();
+    {
+        LOCK(cs_swifttx);
+        GetTxLock(hashLockTx).nBlockHeight = nBlockHeight;
+    }
+
+    for (size_t i = 0; i < vMasternodes.size(); i++) {
+        CSimMasternode& simmn = vMasternodes[i];
+        if (!IsSwiftTXQuorumMember(simmn.vin, nBlockHeight))
+            continue;
+
+        CConsensusVote vote;
+        vote.vinMasternode = simmn.vin;
+        vote.txHash = hashLockTx;
+        vote.nBlockHeight = nBlockHeight;
+        vote.Sign(simmn.keyMasternode, simmn.pubKeyMasternode);
+
+        CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+        ssPayload << vote;
+        Gossip("txlvote", ssPayload, vote.GetHash(), i, GetInsecureRand(params.nSpread));
+    }
+    return EndRound();
+}
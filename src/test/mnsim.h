@@ -0,0 +1,171 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TEST_MNSIM_H
+#define BITCOIN_TEST_MNSIM_H
+
+#include "key.h"
+#include "net.h"
+#include "primitives/transaction.h"
+#include "uint256.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class CBlockIndex;
+
+//! Virtual peers the node under test is connected to by default
+static const int DEFAULT_MNSIM_PEERS = 8;
+//! One-way latency of a virtual link by default, in milliseconds
+static const int DEFAULT_MNSIM_LATENCY_MS = 100;
+//! Bytes per second each way of a virtual link by default
+static const int64_t DEFAULT_MNSIM_BANDWIDTH = 1 << 20;
+//! Most hops of the rest of the network a message takes to reach a peer, by default
+static const int DEFAULT_MNSIM_MAX_HOPS = 4;
+//! Seconds over which the masternodes send the messages of a round, by default
+static const int DEFAULT_MNSIM_SPREAD = 10;
+//! Blocks of the chain of headers the simulation runs on, enough for payment votes
+static const int MNSIM_CHAIN_HEIGHT = 200;
+
+struct CMasternodeSimParams {
+    int nMasternodes;
+    int nPeers;
+    int64_t nLatency;   // microseconds
+    int64_t nBandwidth; // bytes per second
+    int nMaxHops;
+    int64_t nSpread;    // microseconds
+
+    explicit CMasternodeSimParams(int nMasternodesIn) : nMasternodes(nMasternodesIn), nPeers(DEFAULT_MNSIM_PEERS), nLatency(DEFAULT_MNSIM_LATENCY_MS * 1000),
+        nBandwidth(DEFAULT_MNSIM_BANDWIDTH), nMaxHops(DEFAULT_MNSIM_MAX_HOPS), nSpread(DEFAULT_MNSIM_SPREAD * 1000000) {}
+};
+
+/** What one round of the simulation cost the node under test */
+struct CMasternodeSimStats {
+    std::string strRound;
+    size_t nItems;
+    size_t nAccepted;
+    //! Virtual microseconds until the node accepted the last item, -1 if it never accepted them all
+    int64_t nConvergence;
+    //! Messages the peers sent, and those they did not because the node had announced the item to them first
+    uint64_t nDelivered;
+    uint64_t nSuppressed;
+    //! Inventory and compact ping entries the node queued for its peers
+    uint64_t nAnnounced;
+    //! Per command over all peers, with the time the handlers took
+    mapMsgCmdStats mapMsgStats;
+
+    CMasternodeSimStats() : nItems(0), nAccepted(0), nConvergence(-1), nDelivered(0), nSuppressed(0), nAnnounced(0) {}
+
+    std::string ToString() const;
+};
+
+/**
+ * Many masternodes gossiping to one node, in one process. The node under
+ * test is this process: its real handlers, from ProcessMessages() down,
+ * take the messages of the rounds from virtual peers. The peers stand for
+ * the rest of the network; every message of a masternode reaches each of
+ * them after a random number of hops and is forwarded to the node unless
+ * the node announced it to that peer first. Each link delays a message by
+ * its latency and by its size over its bandwidth, in virtual time that the
+ * node sees through the mock time.
+ *
+ * The managers are process globals, so one node runs the real code and
+ * the others are modelled. The masternodes are listed straight away with
+ * their collateral taken as unspent, on a chain of headers built for the
+ * simulation. Everything is given back when the simulation is destroyed.
+ */
+class CMasternodeNetSim
+{
+public:
+    enum Round {
+        ROUND_LIST_SYNC,
+        ROUND_PINGS,
+        ROUND_WINNERS,
+        ROUND_TXLOCK
+    };
+
+    explicit CMasternodeNetSim(const CMasternodeSimParams& paramsIn);
+    ~CMasternodeNetSim();
+
+    /** Every peer asks for the list with "dseg", done when each had all of it announced */
+    CMasternodeSimStats SimulateListSync();
+    /** Every masternode pings, done when the node took every ping */
+    CMasternodeSimStats SimulatePings();
+    /** The payment voters of the next block vote, done when the node took every vote */
+    CMasternodeSimStats SimulateWinnerVotes();
+    /** The quorum of a transaction lock votes, done when the lock has all the votes */
+    CMasternodeSimStats SimulateTxLockVotes();
+
+private:
+    struct CSimMasternode {
+        CKey keyCollateral;
+        CKey keyMasternode;
+        CPubKey pubKeyCollateral;
+        CPubKey pubKeyMasternode;
+        CTxIn vin;
+    };
+
+    struct CSimPeer {
+        CNode* pnode;
+        int64_t nBusyIn;  // the link carries messages to the node until then
+        int64_t nBusyOut; // and messages from the node
+        //! When the peer learned of an item from the node
+        std::map<uint256, int64_t> mapKnownAt;
+        //! Masternode entries the node announced, and when the last of the list got there
+        size_t nListAnnounced;
+        int64_t nListArrival;
+    };
+
+    struct CSimItem {
+        uint256 hash;
+        std::string strCommand;
+        std::string strPayload;
+        size_t nFrom; // the peer asking in the list sync, the masternode otherwise
+        bool fAccepted;
+        int64_t nAcceptedAt;
+    };
+
+    struct CSimEvent {
+        bool fArrive; // on the link to the node rather than leaving the peer
+        int nPeer;
+        size_t nItem;
+    };
+
+    CMasternodeSimParams params;
+    std::vector<CSimMasternode> vMasternodes;
+    std::vector<CSimPeer> vPeers;
+    std::vector<CSimItem> vItems;
+    std::multimap<int64_t, CSimEvent> events;
+    Round round;
+    CMasternodeSimStats stats;
+    size_t nListSize;
+    uint256 hashLockTx;
+
+    int64_t nTimeStart; // mock time the simulation starts at, seconds
+    int64_t nNow;       // virtual microseconds since
+    CBlockIndex* pindexTipBefore;
+    std::vector<CBlockIndex*> vChain;
+
+    void SetNow(int64_t nNowIn);
+    void BuildChain();
+    void AddMasternodes();
+    void AddPeers();
+    void RemovePeers();
+
+    void BeginRound(Round roundIn, const std::string& strRound);
+    CMasternodeSimStats EndRound();
+    size_t AddItem(const char* pszCommand, const CDataStream& ssPayload, const uint256& hash, size_t nFrom);
+    //! Queue a message of a masternode, sent nOrigin microseconds into the round
+    void Gossip(const char* pszCommand, const CDataStream& ssPayload, const uint256& hash, size_t nMasternode, int64_t nOrigin);
+    //! When nBytes sent now over a link busy until nBusy get to the other end
+    int64_t SendOver(int64_t& nBusy, size_t nBytes) const;
+    void Run();
+    void Deliver(int nPeer, size_t nItem);
+    //! Take what the node queued for its peers
+    void CollectFromNode();
+    bool IsAccepted(CSimItem& item);
+};
+
+#endif // BITCOIN_TEST_MNSIM_H
@@ -0,0 +1,66 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "test/mnsim.h"
+
+#include "masternode-payments.h"
+#include "swifttx.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(mnsim_tests)
+
+//! Enough to see the handlers scale, quick enough for every test run
+static const int MNSIM_TEST_MASTERNODES = 1000;
+
+BOOST_AUTO_TEST_CASE(mnsim_rounds)
+{
+    CMasternodeSimParams params(MNSIM_TEST_MASTERNODES);
+    CMasternodeNetSim sim(params);
+
+    CMasternodeSimStats stats = sim.SimulateListSync();
+    BOOST_TEST_MESSAGE(stats.ToString());
+    BOOST_CHECK_EQUAL(stats.nAccepted, (size_t)DEFAULT_MNSIM_PEERS);
+    BOOST_CHECK(stats.nConvergence > 0);
+    BOOST_CHECK_EQUAL(stats.nAnnounced, (uint64_t)DEFAULT_MNSIM_PEERS * MNSIM_TEST_MASTERNODES);
+
+    stats = sim.SimulatePings();
+    BOOST_TEST_MESSAGE(stats.ToString());
+    BOOST_CHECK_EQUAL(stats.nItems, (size_t)MNSIM_TEST_MASTERNODES);
+    BOOST_CHECK_EQUAL(stats.nAccepted, stats.nItems);
+    BOOST_CHECK(stats.nConvergence > 0);
+    // the node relays what it took, so the peers that hear of a ping late need not send it
+    BOOST_CHECK(stats.nSuppressed > 0);
+    BOOST_CHECK_EQUAL(stats.nDelivered + stats.nSuppressed, (uint64_t)DEFAULT_MNSIM_PEERS * MNSIM_TEST_MASTERNODES);
+
+    stats = sim.SimulateWinnerVotes();
+    BOOST_TEST_MESSAGE(stats.ToString());
+    BOOST_CHECK_EQUAL(stats.nItems, (size_t)MNPAYMENTS_SIGNATURES_TOTAL);
+    BOOST_CHECK_EQUAL(stats.nAccepted, stats.nItems);
+
+    stats = sim.SimulateTxLockVotes();
+    BOOST_TEST_MESSAGE(stats.ToString());
+    BOOST_CHECK(stats.nItems >= (size_t)SWIFTTX_SIGNATURES_REQUIRED);
+    BOOST_CHECK_EQUAL(stats.nAccepted, stats.nItems);
+    BOOST_CHECK(stats.nConvergence > 0);
+}
+
+BOOST_AUTO_TEST_CASE(mnsim_bandwidth)
+{
+    // the list sync is most of what a joining node downloads, a slow link shows in it
+    CMasternodeSimParams params(MNSIM_TEST_MASTERNODES);
+    int64_t nFast;
+    {
+        CMasternodeNetSim sim(params);
+        nFast = sim.SimulateListSync().nConvergence;
+    }
+    params.nBandwidth = 2000;
+    CMasternodeNetSim sim(params);
+    CMasternodeSimStats stats = sim.SimulateListSync();
+    BOOST_TEST_MESSAGE(stats.ToString());
+    BOOST_CHECK(nFast > 0);
+    BOOST_CHECK(stats.nConvergence > nFast + 10 * 1000000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -277,6 +277,57 @@ BOOST_AUTO_TEST_CASE(multisig_Solver1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(multisig_Solver_shortcuts)
+{
+    // The byte pattern shortcuts give what the template matcher gives
+    CKey key[2];
+    key[0].MakeNewKey(true);
+    key[1].MakeNewKey(false);
+    vector<valtype> solutions;
+    txnouttype whichType;
+
+    for (int i = 0; i < 2; i++) {
+        valtype vchPubKey = ToByteVector(key[i].GetPubKey());
+        CScript s;
+        s << vchPubKey << OP_CHECKSIG;
+        solutions.clear();
+        BOOST_CHECK(Solver(s, whichType, solutions));
+        BOOST_CHECK_EQUAL(whichType, TX_PUBKEY);
+        BOOST_CHECK(solutions.size() == 1 && solutions[0] == vchPubKey);
+
+        // Pushed with OP_PUSHDATA1 it is left to the template matcher
+        CScript sPushData;
+        sPushData << OP_PUSHDATA1;
+        sPushData.push_back((unsigned char)vchPubKey.size());
+        sPushData.insert(sPushData.end(), vchPubKey.begin(), vchPubKey.end());
+        sPushData << OP_CHECKSIG;
+        solutions.clear();
+        BOOST_CHECK(Solver(sPushData, whichType, solutions));
+        BOOST_CHECK_EQUAL(whichType, TX_PUBKEY);
+        BOOST_CHECK(solutions.size() == 1 && solutions[0] == vchPubKey);
+    }
+
+    valtype vchKeyID = ToByteVector(key[0].GetPubKey().GetID());
+    CScript s;
+    s << OP_DUP << OP_HASH160 << vchKeyID << OP_EQUALVERIFY << OP_CHECKSIG;
+    solutions.clear();
+    BOOST_CHECK(Solver(s, whichType, solutions));
+    BOOST_CHECK_EQUAL(whichType, TX_PUBKEYHASH);
+    BOOST_CHECK(solutions.size() == 1 && solutions[0] == vchKeyID);
+
+    // Near misses of the patterns
+    CScript sShort(s.begin(), s.end() - 1);
+    solutions.clear();
+    BOOST_CHECK(!Solver(sShort, whichType, solutions));
+    BOOST_CHECK_EQUAL(whichType, TX_NONSTANDARD);
+    CScript sBadPush;
+    sBadPush << valtype(32, 1) << OP_CHECKSIG;
+    BOOST_CHECK(!Solver(sBadPush, whichType, solutions));
+    CScript sNoCheckSig;
+    sNoCheckSig << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIGVERIFY;
+    BOOST_CHECK(!Solver(sNoCheckSig, whichType, solutions));
+}
+
 BOOST_AUTO_TEST_CASE(multisig_Sign)
 {
     // Test SignSignature() (and therefore the version of Solver() that signs transactions)
@@ -319,5 +370,45 @@ BOOST_AUTO_TEST_CASE(multisig_Sign)
     }
 }
 
+BOOST_AUTO_TEST_CASE(multisig_SignShared)
+{
+    // The inputs of one transaction signed from a shared copy and signature hash cache
+    CBasicKeyStore keystore;
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+    {
+        key[i].MakeNewKey(true);
+        keystore.AddKey(key[i]);
+    }
+
+    CMutableTransaction txFrom;
+    txFrom.vout.resize(5);
+    for (int i = 0; i < 5; i++)
+        txFrom.vout[i].scriptPubKey << OP_2 << ToByteVector(key[0].GetPubKey()) << ToByteVector(key[i % 3].GetPubKey()) << ToByteVector(key[2].GetPubKey()) << OP_3 << OP_CHECKMULTISIG;
+
+    CMutableTransaction txTo;
+    txTo.vin.resize(5);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    for (int i = 0; i < 5; i++)
+    {
+        txTo.vin[i].prevout.n = i;
+        txTo.vin[i].prevout.hash = txFrom.GetHash();
+    }
+
+    const CTransaction txToConst(txTo);
+    CSignatureHashCache cache(txToConst);
+    for (int i = 0; i < 5; i++)
+    {
+        CScript scriptSig;
+        BOOST_CHECK_MESSAGE(SignSignature(keystore, txFrom.vout[i].scriptPubKey, txToConst, i, SIGHASH_ALL, scriptSig, &cache), strprintf("SignSignature %d", i));
+        BOOST_CHECK(VerifyScript(scriptSig, txFrom.vout[i].scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&txToConst, i)));
+
+        // the same signatures as when signing the transaction in place
+        BOOST_CHECK(SignSignature(keystore, txFrom, txTo, i));
+        BOOST_CHECK(scriptSig == txTo.vin[i].scriptSig);
+    }
+}
+
 
 BOOST_AUTO_TEST_SUITE_END()
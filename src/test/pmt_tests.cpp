@@ -104,4 +104,28 @@ BOOST_AUTO_TEST_CASE(pmt_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(merkle_root_inplace)
+{
+    for (unsigned int nTx = 0; nTx < 70; nTx++) {
+        CBlock block;
+        for (unsigned int j=0; j<nTx; j++) {
+            CMutableTransaction tx;
+            tx.nLockTime = j;
+            block.vtx.push_back(CTransaction(tx));
+        }
+        // the last transaction repeated, a mutation when the count is even
+        for (int nMutate = 0; nMutate < 2; nMutate++) {
+            if (nMutate && nTx >= 2)
+                block.vtx.back() = block.vtx[nTx - 2];
+            bool fMutated1, fMutated2;
+            uint256 merkleRoot1 = block.BuildMerkleTree(&fMutated1);
+            BOOST_CHECK(!block.vMerkleTree.empty() || nTx == 0);
+            uint256 merkleRoot2 = block.ComputeMerkleRoot(&fMutated2);
+            BOOST_CHECK(merkleRoot1 == merkleRoot2);
+            BOOST_CHECK_EQUAL(fMutated1, fMutated2);
+            BOOST_CHECK(block.vMerkleTree.empty());
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
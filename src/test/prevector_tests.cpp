@@ -0,0 +1,127 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "prevector.h"
+#include "random.h"
+#include "serialize.h"
+#include "streams.h"
+#include "version.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(prevector_tests)
+
+typedef prevector<8, int> pretype;
+
+static void CheckEqual(const pretype& pre, const std::vector<int>& real)
+{
+    BOOST_REQUIRE_EQUAL(pre.size(), real.size());
+    BOOST_CHECK_EQUAL(pre.empty(), real.empty());
+    for (size_t i = 0; i < real.size(); i++)
+        BOOST_CHECK_EQUAL(pre[i], real[i]);
+    BOOST_CHECK(std::equal(pre.begin(), pre.end(), real.begin()));
+    BOOST_CHECK(pre == pretype(real.begin(), real.end()));
+    BOOST_CHECK(pre.capacity() >= pre.size());
+}
+
+BOOST_AUTO_TEST_CASE(prevector_random_ops)
+{
+    for (int nRun = 0; nRun < 64; nRun++) {
+        pretype pre;
+        std::vector<int> real;
+        for (int i = 0; i < 2048; i++) {
+            int nValue = insecure_rand();
+            switch (insecure_rand() % 9) {
+            case 0:
+                pre.push_back(nValue);
+                real.push_back(nValue);
+                break;
+            case 1:
+                if (!real.empty()) {
+                    pre.pop_back();
+                    real.pop_back();
+                }
+                break;
+            case 2: {
+                size_t nPos = insecure_rand() % (real.size() + 1);
+                pre.insert(pre.begin() + nPos, nValue);
+                real.insert(real.begin() + nPos, nValue);
+                break;
+            }
+            case 3: {
+                size_t nPos = insecure_rand() % (real.size() + 1);
+                size_t nCount = insecure_rand() % 12;
+                pre.insert(pre.begin() + nPos, nCount, nValue);
+                real.insert(real.begin() + nPos, nCount, nValue);
+                break;
+            }
+            case 4:
+                if (!real.empty()) {
+                    size_t nFirst = insecure_rand() % real.size();
+                    size_t nLast = nFirst + insecure_rand() % (real.size() - nFirst + 1);
+                    pre.erase(pre.begin() + nFirst, pre.begin() + nLast);
+                    real.erase(real.begin() + nFirst, real.begin() + nLast);
+                }
+                break;
+            case 5: {
+                size_t nSize = insecure_rand() % 24;
+                pre.resize(nSize);
+                real.resize(nSize);
+                break;
+            }
+            case 6: {
+                std::vector<int> vInsert(insecure_rand() % 12, nValue);
+                size_t nPos = insecure_rand() % (real.size() + 1);
+                pre.insert(pre.begin() + nPos, vInsert.begin(), vInsert.end());
+                real.insert(real.begin() + nPos, vInsert.begin(), vInsert.end());
+                break;
+            }
+            case 7:
+                pre.reserve(insecure_rand() % 32);
+                break;
+            case 8:
+                pre.shrink_to_fit();
+                break;
+            }
+            CheckEqual(pre, real);
+
+            // Copies and swaps keep the contents, on the heap or inline
+            pretype copy(pre);
+            CheckEqual(copy, real);
+            pretype swapped;
+            swapped.swap(copy);
+            CheckEqual(swapped, real);
+            BOOST_CHECK(copy.empty());
+            copy = swapped;
+            CheckEqual(copy, real);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(prevector_serialize)
+{
+    // Inline and on the heap, serialized the same as a vector
+    for (size_t nSize = 0; nSize < 64; nSize += 7) {
+        std::vector<unsigned char> real(nSize);
+        for (size_t i = 0; i < nSize; i++)
+            real[i] = insecure_rand();
+        prevector<28, unsigned char> pre(real.begin(), real.end());
+
+        CDataStream ssReal(SER_NETWORK, PROTOCOL_VERSION);
+        CDataStream ssPre(SER_NETWORK, PROTOCOL_VERSION);
+        ssReal << real;
+        ssPre << pre;
+        BOOST_CHECK(ssReal.str() == ssPre.str());
+        BOOST_CHECK_EQUAL(::GetSerializeSize(pre, SER_NETWORK, PROTOCOL_VERSION), ssPre.size());
+
+        prevector<28, unsigned char> pre2;
+        ssPre >> pre2;
+        BOOST_CHECK(pre2 == pre);
+        BOOST_CHECK_EQUAL(pre2.allocated_memory() == 0, nSize <= 28);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,12 +2,16 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "rpcbinary.h"
 #include "rpcserver.h"
 #include "rpcclient.h"
 
 #include "base58.h"
 #include "netbase.h"
+#include "streams.h"
 #include "util.h"
+#include "utilstrencodings.h"
+#include "version.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/test/unit_test.hpp>
@@ -263,4 +267,67 @@ BOOST_AUTO_TEST_CASE(rpc_ban)
     BOOST_CHECK_EQUAL(adr.get_str(), "2001:4d48:ac57:400:cacf:e9ff:fe1d:9c63/128");
 }
 
+static CBinaryRPCParam JSONParam(const string& strJSON)
+{
+    return CBinaryRPCParam(CBinaryRPCParam::JSON, vector<unsigned char>(strJSON.begin(), strJSON.end()));
+}
+
+BOOST_AUTO_TEST_CASE(rpc_binary)
+{
+    if (RPCIsInWarmup(NULL))
+        SetRPCWarmupFinished();
+
+    string rawtx = "0100000001a15d57094aa7a21a28cb20b59aab8fc7d1149a3bdbcddba9c622e4f5f6a99ece010000006c493046022100f93bb0e7d8db7bd46e40132d1f8242026e045f03a0efe71bbb8e3f475e970d790221009337cd7f1f929f00cc6ff01f03729b069a7c21b59b1736ddfee5db5946c5da8c0121033b9b137ee87d5a812d6f506efdd37f0affa7ffc310711c06c7f3e097c9447c52ffffffff0100e1f505000000001976a9140389035a9225b3839e2bbf32d826a1e222031fd888ac00000000";
+
+    // A raw parameter reaches the method as hex
+    CBinaryRPCRequest req;
+    req.nId = 7;
+    req.strMethod = "decoderawtransaction";
+    req.vParams.push_back(CBinaryRPCParam(CBinaryRPCParam::RAW, ParseHex(rawtx)));
+    CBinaryRPCReply reply = ExecBinaryRPC(req);
+    BOOST_CHECK_EQUAL(reply.nId, 7U);
+    BOOST_CHECK_EQUAL(reply.nStatus, CBinaryRPCReply::STATUS_OK);
+    BOOST_CHECK_EQUAL(reply.nType, CBinaryRPCParam::JSON);
+    UniValue r;
+    BOOST_REQUIRE(r.read(string(reply.vch.begin(), reply.vch.end())));
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "locktime").get_int(), 0);
+
+    // A hex result comes back as bytes when asked for, JSON otherwise
+    req.strMethod = "createrawtransaction";
+    req.vParams.clear();
+    req.vParams.push_back(JSONParam("[]"));
+    req.vParams.push_back(JSONParam("{}"));
+    req.fRawResult = true;
+    reply = ExecBinaryRPC(req);
+    BOOST_CHECK_EQUAL(reply.nStatus, CBinaryRPCReply::STATUS_OK);
+    BOOST_CHECK_EQUAL(reply.nType, CBinaryRPCParam::RAW);
+    BOOST_CHECK_EQUAL(HexStr(reply.vch), CallRPC("createrawtransaction [] {}").get_str());
+    req.fRawResult = false;
+    reply = ExecBinaryRPC(req);
+    BOOST_CHECK_EQUAL(reply.nType, CBinaryRPCParam::JSON);
+    BOOST_CHECK_EQUAL(string(reply.vch.begin(), reply.vch.end()), "\"" + CallRPC("createrawtransaction [] {}").get_str() + "\"");
+
+    // Errors carry the JSON-RPC error object
+    req.strMethod = "nosuchmethod";
+    reply = ExecBinaryRPC(req);
+    BOOST_CHECK_EQUAL(reply.nStatus, CBinaryRPCReply::STATUS_ERROR);
+    BOOST_REQUIRE(r.read(string(reply.vch.begin(), reply.vch.end())));
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "code").get_int(), RPC_METHOD_NOT_FOUND);
+
+    req.strMethod = "decoderawtransaction";
+    req.vParams.clear();
+    req.vParams.push_back(JSONParam("not json"));
+    reply = ExecBinaryRPC(req);
+    BOOST_CHECK_EQUAL(reply.nStatus, CBinaryRPCReply::STATUS_ERROR);
+
+    // Requests survive the framing
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << req;
+    CBinaryRPCRequest req2;
+    ss >> req2;
+    BOOST_CHECK_EQUAL(req2.strMethod, req.strMethod);
+    BOOST_CHECK_EQUAL(req2.vParams.size(), 1U);
+    BOOST_CHECK(req2.vParams[0].vch == req.vParams[0].vch);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -180,4 +180,37 @@ BOOST_AUTO_TEST_CASE(rpc_wallet)
     BOOST_CHECK(CBitcoinAddress(arr[0].get_str()).Get() == demoAddress.Get());
 }
 
+BOOST_AUTO_TEST_CASE(rpc_importmulti)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    CBitcoinAddress watchAddress(CTxDestination(key.GetPubKey().GetID()));
+    CKey key2;
+    key2.MakeNewKey(true);
+    CBitcoinAddress keyAddress(CTxDestination(key2.GetPubKey().GetID()));
+
+    BOOST_CHECK_THROW(CallRPC("importmulti"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("importmulti not_array"), runtime_error);
+
+    // Each request succeeds or fails on its own
+    UniValue r;
+    BOOST_CHECK_NO_THROW(r = CallRPC("importmulti [{\"scriptPubKey\":{\"address\":\"" + watchAddress.ToString() + "\"},\"timestamp\":\"now\",\"watchonly\":true},"
+                                     "{\"scriptPubKey\":{\"address\":\"" + keyAddress.ToString() + "\"},\"timestamp\":\"now\",\"keys\":[\"" + CBitcoinSecret(key2).ToString() + "\"]},"
+                                     "{\"scriptPubKey\":{\"address\":\"D8w12Vu3WVhn543dgrUUf9uYu6HLwnPm5\"},\"timestamp\":\"now\",\"watchonly\":true},"
+                                     "{\"scriptPubKey\":{\"address\":\"" + watchAddress.ToString() + "\"},\"watchonly\":true}] {\"rescan\":false}"));
+    BOOST_REQUIRE_EQUAL(r.size(), 4U);
+    BOOST_CHECK(find_value(r[0], "success").get_bool());
+    BOOST_CHECK(find_value(r[1], "success").get_bool());
+    BOOST_CHECK(!find_value(r[2], "success").get_bool());
+    BOOST_CHECK(!find_value(r[3], "success").get_bool());
+    BOOST_CHECK(pwalletMain->HaveWatchOnly(GetScriptForDestination(watchAddress.Get())));
+    BOOST_CHECK(pwalletMain->HaveKey(key2.GetPubKey().GetID()));
+
+    // A key must match the script
+    BOOST_CHECK_NO_THROW(r = CallRPC("importmulti [{\"scriptPubKey\":{\"address\":\"" + watchAddress.ToString() + "\"},\"timestamp\":\"now\",\"keys\":[\"" + CBitcoinSecret(key2).ToString() + "\"]}] {\"rescan\":false}"));
+    BOOST_CHECK(!find_value(r[0], "success").get_bool());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
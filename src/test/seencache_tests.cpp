@@ -0,0 +1,125 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "seencache.h"
+
+#include "clientversion.h"
+#include "hash.h"
+
+#include <map>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(seencache_tests)
+
+struct CTestMessage {
+    int64_t nTime;
+    std::string strPayload;
+
+    CTestMessage() : nTime(0) {}
+    CTestMessage(int64_t nTimeIn, const std::string& strPayloadIn) : nTime(nTimeIn), strPayload(strPayloadIn) {}
+
+    uint256 GetHash() const { return SerializeHash(*this); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nTime);
+        READWRITE(strPayload);
+    }
+};
+
+struct CTestMessageExpiry {
+    int64_t operator()(const CTestMessage& msg) const { return msg.nTime + 100; }
+};
+
+typedef CSeenCache<CTestMessage, CTestMessageExpiry> TestCache;
+typedef CSeenCache<CTestMessage, CTestMessageExpiry, CRelayBytes<CTestMessage> > TestRelayCache;
+
+BOOST_AUTO_TEST_CASE(seencache_expiry)
+{
+    TestCache cache(100);
+    for (int i = 0; i < 10; i++) {
+        CTestMessage msg(1000 + i * 10, "message");
+        BOOST_CHECK(cache.Insert(msg.GetHash(), msg));
+        BOOST_CHECK(!cache.Insert(msg.GetHash(), msg));
+    }
+    BOOST_CHECK_EQUAL(cache.size(), 10U);
+
+    // expiries are 1100, 1110, ... 1190
+    std::vector<std::pair<int64_t, uint256> > vErased;
+    BOOST_CHECK_EQUAL(cache.ExpireBefore(1130, &vErased), 3U);
+    BOOST_CHECK_EQUAL(vErased.size(), 3U);
+    BOOST_CHECK_EQUAL(vErased[0].first, 1100);
+    BOOST_CHECK(!cache.count(CTestMessage(1000, "message").GetHash()));
+    BOOST_CHECK(cache.count(CTestMessage(1030, "message").GetHash()));
+    BOOST_CHECK_EQUAL(cache.size(), 7U);
+
+    // a message changed in place moves in the queue
+    uint256 hash = CTestMessage(1030, "message").GetHash();
+    CTestMessage* pmsg = cache.Get(hash);
+    BOOST_REQUIRE(pmsg != NULL);
+    pmsg->nTime = 2000;
+    cache.Refresh(hash, *pmsg);
+    BOOST_CHECK_EQUAL(cache.ExpireBefore(2000), 6U);
+    BOOST_CHECK(cache.count(hash));
+
+    BOOST_CHECK(cache.Erase(hash));
+    BOOST_CHECK(!cache.Erase(hash));
+    BOOST_CHECK(cache.empty());
+}
+
+BOOST_AUTO_TEST_CASE(seencache_bounded)
+{
+    TestCache cache(5);
+    for (int i = 9; i >= 0; i--) {
+        CTestMessage msg(1000 + i, "message");
+        cache.Insert(msg.GetHash(), msg);
+    }
+    // the entries to expire first made room
+    BOOST_CHECK_EQUAL(cache.size(), 5U);
+    BOOST_CHECK(cache.count(CTestMessage(1000, "message").GetHash()));
+    BOOST_CHECK(!cache.count(CTestMessage(1005, "message").GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(seencache_serialization)
+{
+    std::map<uint256, CTestMessage> mapMessages;
+    TestCache cache(100);
+    TestRelayCache relayCache(100);
+    for (int i = 0; i < 10; i++) {
+        CTestMessage msg(1000 + i, std::string(i * 10, 'x'));
+        mapMessages[msg.GetHash()] = msg;
+        cache.Insert(msg.GetHash(), msg);
+        relayCache.Insert(msg.GetHash(), msg);
+    }
+
+    // the caches read what a std::map wrote, and the other way around
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << mapMessages;
+    TestRelayCache relayCacheRead(100);
+    ss >> relayCacheRead;
+    BOOST_CHECK_EQUAL(relayCacheRead.size(), 10U);
+
+    ss << relayCache;
+    BOOST_CHECK_EQUAL(ss.size(), relayCache.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    std::map<uint256, CTestMessage> mapRead;
+    ss >> mapRead;
+    BOOST_CHECK(mapRead.size() == mapMessages.size());
+
+    for (std::map<uint256, CTestMessage>::const_iterator it = mapMessages.begin(); it != mapMessages.end(); ++it) {
+        BOOST_CHECK(mapRead[it->first].strPayload == it->second.strPayload);
+        const CRelayBytes<CTestMessage>* pbytes = relayCacheRead.Get(it->first);
+        BOOST_REQUIRE(pbytes != NULL);
+        BOOST_CHECK(pbytes->Get().GetHash() == it->first);
+        const CTestMessage* pmsg = cache.Get(it->first);
+        BOOST_REQUIRE(pmsg != NULL);
+        BOOST_CHECK_EQUAL(pmsg->nTime, it->second.nTime);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
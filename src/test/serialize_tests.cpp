@@ -4,6 +4,7 @@
 
 #include "serialize.h"
 #include "streams.h"
+#include "uint256.h"
 
 #include <stdint.h>
 
@@ -161,4 +162,58 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     BOOST_CHECK_EQUAL(ss.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(memory_reader)
+{
+    CDataStream ss(SER_DISK, 0);
+    std::vector<char> vch(300, 'x');
+    ss << (uint32_t)0x01020304 << vch << (uint8_t)7;
+    const std::string strOrig = ss.str();
+
+    // Reading leaves the buffer untouched and tells how much was consumed
+    CMemoryReader reader(&ss[0], ss.size(), SER_DISK, 0);
+    uint32_t n;
+    std::vector<char> vchRead;
+    reader >> n >> vchRead;
+    BOOST_CHECK_EQUAL(n, 0x01020304U);
+    BOOST_CHECK(vchRead == vch);
+    BOOST_CHECK_EQUAL(reader.GetReadPos(), 4 + GetSerializeSize(vch, SER_DISK, 0));
+    BOOST_CHECK_EQUAL(reader.size(), 1U);
+    BOOST_CHECK(std::string(reader.begin(), reader.begin() + ss.size()) == strOrig);
+
+    uint8_t c;
+    reader >> c;
+    BOOST_CHECK_EQUAL(c, 7);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> c, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(vector_as_bytes)
+{
+    // Vectors written as one blob match their elements written one by one
+    std::vector<uint256> vHash;
+    std::vector<int32_t> vInt;
+    for (int i = 0; i < 300; i++) {
+        vHash.push_back(uint256(i * 0x0101010101ULL));
+        vInt.push_back(-i * 77777);
+    }
+    CDataStream ss(SER_DISK, 0);
+    ss << vHash << vInt;
+    CDataStream ssElements(SER_DISK, 0);
+    WriteCompactSize(ssElements, vHash.size());
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        ssElements << vHash[i];
+    WriteCompactSize(ssElements, vInt.size());
+    for (unsigned int i = 0; i < vInt.size(); i++)
+        ssElements << vInt[i];
+    BOOST_CHECK(ss.str() == ssElements.str());
+    BOOST_CHECK_EQUAL(GetSerializeSize(vHash, SER_DISK, 0) + GetSerializeSize(vInt, SER_DISK, 0), ss.size());
+
+    std::vector<uint256> vHashRead;
+    std::vector<int32_t> vIntRead;
+    ss >> vHashRead >> vIntRead;
+    BOOST_CHECK(vHashRead == vHash);
+    BOOST_CHECK(vIntRead == vInt);
+    BOOST_CHECK(ss.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,53 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "script/sigcache.h"
+
+#include "key.h"
+#include "pubkey.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_store)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+
+    size_t nEntriesBefore, nBytes;
+    GetSignatureCacheStats(nEntriesBefore, nBytes);
+    BOOST_CHECK_EQUAL(nBytes, DEFAULT_SIG_CACHE_SIZE << 20);
+
+    // Checks that don't store leave the cache alone
+    CachingTransactionSignatureChecker checkerNoStore(NULL, 0, false);
+    BOOST_CHECK(checkerNoStore.VerifySignature(vchSig, pubkey, hash));
+    size_t nEntries;
+    GetSignatureCacheStats(nEntries, nBytes);
+    BOOST_CHECK_EQUAL(nEntries, nEntriesBefore);
+
+    CachingTransactionSignatureChecker checker(NULL, 0, true);
+    BOOST_CHECK(checker.VerifySignature(vchSig, pubkey, hash));
+    BOOST_CHECK(checker.VerifySignature(vchSig, pubkey, hash));
+    GetSignatureCacheStats(nEntries, nBytes);
+    BOOST_CHECK_EQUAL(nEntries, nEntriesBefore + 1);
+
+    // A cached signature must not validate a different hash or key
+    BOOST_CHECK(!checker.VerifySignature(vchSig, pubkey, GetRandHash()));
+    CKey key2;
+    key2.MakeNewKey(true);
+    BOOST_CHECK(!checker.VerifySignature(vchSig, key2.GetPubKey(), hash));
+    GetSignatureCacheStats(nEntries, nBytes);
+    BOOST_CHECK_EQUAL(nEntries, nEntriesBefore + 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -154,6 +154,11 @@ BOOST_AUTO_TEST_CASE(sighash_test)
         std::cout << "\n";
         #endif
         BOOST_CHECK(sh == sho);
+
+        // Any hash type gives the same hash with the cache
+        CTransaction tx(txTo);
+        CSignatureHashCache cache(tx);
+        BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType, &cache) == sho);
     }
     #if defined(PRINT_SIGHASH_JSON)
     std::cout << "]\n";
@@ -208,4 +213,33 @@ BOOST_AUTO_TEST_CASE(sighash_from_data)
         BOOST_CHECK_MESSAGE(sh.GetHex() == sigHashHex, strTest);
     }
 }
+BOOST_AUTO_TEST_CASE(sighash_cache_bench)
+{
+    // A dust consolidation: many inputs, each hash covers all of them
+    CMutableTransaction txTo;
+    txTo.vin.resize(500);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        txTo.vin[i].prevout = COutPoint(GetRandHash(), i % 4);
+        txTo.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72) << std::vector<unsigned char>(33);
+    }
+    txTo.vout.resize(1);
+    txTo.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CTransaction tx(txTo);
+    const CScript& scriptCode = tx.vout[0].scriptPubKey;
+
+    std::vector<uint256> vHashes;
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        vHashes.push_back(SignatureHash(scriptCode, tx, i, SIGHASH_ALL));
+    int64_t nUncached = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    CSignatureHashCache cache(tx);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        BOOST_CHECK(SignatureHash(scriptCode, tx, i, SIGHASH_ALL, &cache) == vHashes[i]);
+    int64_t nCached = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("sighash of %u inputs: %dus uncached, %dus cached", tx.vin.size(), nUncached, nCached));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
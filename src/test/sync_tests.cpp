@@ -0,0 +1,80 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sync.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(sync_tests)
+
+static void TryLockHeld(CCriticalSection& cs, bool& fLocked)
+{
+    TRY_LOCK(cs, lockTry);
+    fLocked = lockTry;
+}
+
+static const CLockStats* FindSite(const std::vector<CLockStats>& vStats, const std::string& strName)
+{
+    for (size_t i = 0; i < vStats.size(); i++) {
+        if (vStats[i].strName == strName)
+            return &vStats[i];
+    }
+    return NULL;
+}
+
+BOOST_AUTO_TEST_CASE(lockstats)
+{
+    CCriticalSection csStatsTest;
+    fLockStats = true;
+    ResetLockStats();
+
+    for (int i = 0; i < 3; i++) {
+        LOCK(csStatsTest);
+    }
+    bool fLocked = true;
+    {
+        LOCK(csStatsTest);
+        boost::thread thread(boost::bind(&TryLockHeld, boost::ref(csStatsTest), boost::ref(fLocked)));
+        thread.join();
+    }
+    BOOST_CHECK(!fLocked);
+
+    fLockStats = false;
+    {
+        // Not recorded once off
+        LOCK(csStatsTest);
+    }
+
+    std::vector<CLockStats> vStats = GetLockStats();
+    const CLockStats* pstatsTry = FindSite(vStats, "cs");
+    BOOST_REQUIRE(pstatsTry);
+    BOOST_CHECK_EQUAL(pstatsTry->nTryFailed, 1U);
+    BOOST_CHECK_EQUAL(pstatsTry->nLocks, 0U);
+
+    // The loop, and the block holding the lock for the TRY_LOCK
+    std::vector<uint64_t> vLocks;
+    for (size_t i = 0; i < vStats.size(); i++) {
+        if (vStats[i].strName != "csStatsTest")
+            continue;
+        BOOST_CHECK_EQUAL(vStats[i].strFile, __FILE__);
+        BOOST_CHECK_EQUAL(vStats[i].nContended, 0U);
+        BOOST_CHECK(vStats[i].nHoldMax <= vStats[i].nHoldTotal);
+        vLocks.push_back(vStats[i].nLocks);
+    }
+    std::sort(vLocks.begin(), vLocks.end());
+    BOOST_REQUIRE_EQUAL(vLocks.size(), 2U);
+    BOOST_CHECK_EQUAL(vLocks[0], 1U);
+    BOOST_CHECK_EQUAL(vLocks[1], 3U);
+
+    ResetLockStats();
+    BOOST_CHECK(FindSite(GetLockStats(), "csStatsTest") == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -391,4 +391,59 @@ BOOST_AUTO_TEST_CASE(test_IsStandard)
     BOOST_CHECK(!IsStandardTx(t, reason));
 }
 
+BOOST_AUTO_TEST_CASE(test_move)
+{
+    CBasicKeyStore keystore;
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins(&coinsDummy);
+    std::vector<CMutableTransaction> dummyTransactions = SetupDummyInputs(keystore, coins);
+
+    CMutableTransaction t = dummyTransactions[0];
+    const CTransaction txCopy(t);
+
+    // Moving out of the mutable transaction hashes the same contents
+    CTransaction tx(std::move(t));
+    BOOST_CHECK(tx.GetHash() == txCopy.GetHash());
+    BOOST_CHECK(tx.vout == txCopy.vout);
+
+    // Moved transactions keep their cached hash
+    std::vector<CTransaction> vtx;
+    vtx.push_back(std::move(tx));
+    vtx.resize(100);
+    BOOST_CHECK(vtx[0].GetHash() == txCopy.GetHash());
+    CTransaction tx2;
+    tx2 = std::move(vtx[0]);
+    BOOST_CHECK(tx2.GetHash() == txCopy.GetHash());
+    BOOST_CHECK(tx2.vin == txCopy.vin);
+}
+
+BOOST_AUTO_TEST_CASE(test_serialize_size)
+{
+    CBasicKeyStore keystore;
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins(&coinsDummy);
+    std::vector<CMutableTransaction> dummyTransactions = SetupDummyInputs(keystore, coins);
+
+    // The cached size is what serializing writes, and survives a round trip
+    const CTransaction tx(dummyTransactions[0]);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    BOOST_CHECK_EQUAL(::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION), ss.size());
+    BOOST_CHECK_EQUAL(::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION), ss.size());
+    CTransaction txRead;
+    ss >> txRead;
+    BOOST_CHECK_EQUAL(::GetSerializeSize(txRead, SER_NETWORK, PROTOCOL_VERSION), ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+
+    // A default transaction has the size of its empty fields
+    CDataStream ssEmpty(SER_NETWORK, PROTOCOL_VERSION);
+    ssEmpty << CTransaction();
+    BOOST_CHECK_EQUAL(::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION), ssEmpty.size());
+
+    // Containers of transactions add up the cached sizes
+    std::vector<CTransaction> vtx(2, tx);
+    CDataStream ssVector(SER_NETWORK, PROTOCOL_VERSION);
+    ssVector << vtx;
+    BOOST_CHECK_EQUAL(::GetSerializeSize(vtx, SER_NETWORK, PROTOCOL_VERSION), ssVector.size());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,7 @@
 #include <iomanip>
 #include <limits>
 #include <cmath>
+#include "random.h"
 #include "uint256.h"
 #include <string>
 #include "version.h"
@@ -517,6 +518,14 @@ BOOST_AUTO_TEST_CASE( multiply )
     BOOST_CHECK((R1S * 1) == R1S);
     BOOST_CHECK((R1S * 7).ToString() == "f7a987f3c3bf758d927f202d7e795faeff084244");
     BOOST_CHECK((R2S * 0xFFFFFFFFUL).ToString() == "1c6f6c930353e17f7d6127213bb18d2883e2cd90");
+
+    // MulU64 is the multiplication by a base_uint made from the 64 bit number
+    const uint64_t vMul[] = {0, 1, 3, 0xFFFFFFFFULL, 0x100000000ULL, 0x87654321DEADBEEFULL, std::numeric_limits<uint64_t>::max()};
+    for (unsigned int i = 0; i < sizeof(vMul) / sizeof(vMul[0]); i++) {
+        BOOST_CHECK(uint256(R1L).MulU64(vMul[i]) == R1L * uint256(vMul[i]));
+        BOOST_CHECK(uint256(MaxL).MulU64(vMul[i]) == MaxL * uint256(vMul[i]));
+        BOOST_CHECK(uint160(R2S).MulU64(vMul[i]) == R2S * uint160(vMul[i]));
+    }
 }
 
 BOOST_AUTO_TEST_CASE( divide )
@@ -550,6 +559,21 @@ BOOST_AUTO_TEST_CASE( divide )
     BOOST_CHECK(R2S / MaxS == ZeroS);
     BOOST_CHECK(MaxS / R2S == 1);
     BOOST_CHECK_THROW(R2S / ZeroS, uint_error);
+
+    // Quotient and remainder of divisors of every length, including the
+    // ones whose estimated quotient digit is too high
+    for (int i = 0; i < 1000; i++) {
+        uint256 num = R1L >> (insecure_rand() % 256);
+        uint256 div = (R2L >> (insecure_rand() % 256)) | OneL;
+        if (i % 3 == 0)
+            div = (MaxL >> (insecure_rand() % 256)) ^ uint256(insecure_rand());
+        if (div == 0)
+            continue;
+        uint256 quot = num / div;
+        uint256 rem = num - quot * div;
+        BOOST_CHECK(quot * div <= num);
+        BOOST_CHECK(rem < div);
+    }
 }
 
 
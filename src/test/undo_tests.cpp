@@ -0,0 +1,77 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcompress.h"
+#include "clientversion.h"
+#include "key.h"
+#include "main.h"
+#include "script/standard.h"
+#include "streams.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(undo_tests)
+
+static CTxInUndo MakeUndo(const CScript& script, CAmount nValue, unsigned int nHeight, bool fCoinStake)
+{
+    return CTxInUndo(CTxOut(nValue, script), false, fCoinStake, nHeight, 1);
+}
+
+static std::string Serialized(const CBlockUndo& blockundo)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << blockundo;
+    return ss.str();
+}
+
+BOOST_AUTO_TEST_CASE(undo_compact_record)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptStaker = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptOther = CScript() << OP_TRUE;
+
+    // a coinstake, and a wallet spending many coins of one address
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(2);
+    blockundo.vtxundo[0].vprevout.push_back(MakeUndo(scriptStaker, 250 * COIN, 900, true));
+    for (int i = 0; i < 20; i++)
+        blockundo.vtxundo[1].vprevout.push_back(MakeUndo(scriptStaker, i * COIN + 1, i % 2 ? 0 : 950 + i, false));
+    blockundo.vtxundo[1].vprevout.push_back(MakeUndo(scriptOther, 3, 1000, false));
+
+    std::vector<char> vchLegacy = blockundo.GetDiskRecord(1000, false, 0);
+    BOOST_CHECK(std::string(vchLegacy.begin(), vchLegacy.end()) == Serialized(blockundo));
+    std::vector<char> vchCompact = blockundo.GetDiskRecord(1000, true, 0);
+    BOOST_CHECK_EQUAL((unsigned char)vchCompact[0], UNDO_COMPACT_MARKER);
+    BOOST_CHECK(vchCompact.size() < vchLegacy.size());
+
+    CBlockUndo undoRead;
+    BOOST_CHECK(undoRead.SetDiskRecord(&vchLegacy[0], vchLegacy.size()));
+    BOOST_CHECK(Serialized(undoRead) == Serialized(blockundo));
+    BOOST_CHECK(undoRead.SetDiskRecord(&vchCompact[0], vchCompact.size()));
+    BOOST_CHECK(Serialized(undoRead) == Serialized(blockundo));
+
+    if (IsBlockCompressionAvailable()) {
+        std::vector<char> vchDeflated = blockundo.GetDiskRecord(1000, true, 9);
+        BOOST_CHECK(vchDeflated.size() <= vchCompact.size());
+        BOOST_CHECK(undoRead.SetDiskRecord(&vchDeflated[0], vchDeflated.size()));
+        BOOST_CHECK(Serialized(undoRead) == Serialized(blockundo));
+    }
+
+    // a coin above the block cannot have a depth, the legacy encoding is used
+    std::vector<char> vchAbove = blockundo.GetDiskRecord(950, true, 0);
+    BOOST_CHECK(vchAbove == vchLegacy);
+
+    // nor can a truncated or unknown record be read
+    BOOST_CHECK(!undoRead.SetDiskRecord(&vchCompact[0], vchCompact.size() - 1));
+    vchCompact[1] = UNDO_COMPACT_VERSION + 1;
+    BOOST_CHECK(!undoRead.SetDiskRecord(&vchCompact[0], vchCompact.size()));
+
+    CBlockUndo undoEmpty;
+    std::vector<char> vchEmpty = undoEmpty.GetDiskRecord(0, true, 0);
+    BOOST_CHECK(undoRead.SetDiskRecord(&vchEmpty[0], vchEmpty.size()));
+    BOOST_CHECK(undoRead.vtxundo.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -413,6 +413,47 @@ BOOST_AUTO_TEST_CASE(test_FormatParagraph)
     BOOST_CHECK_EQUAL(FormatParagraph("This is a very long test string. This is a second sentence in the very long test string."), "This is a very long test string. This is a second sentence in the very long\ntest string.");
 }
 
+BOOST_AUTO_TEST_CASE(test_SplitCommandLine)
+{
+    BOOST_CHECK(SplitCommandLine("").empty());
+    BOOST_CHECK(SplitCommandLine(" \t ").empty());
+
+    std::vector<std::string> vArgs = SplitCommandLine("  getblock\thash  1 ");
+    BOOST_REQUIRE_EQUAL(vArgs.size(), 3U);
+    BOOST_CHECK_EQUAL(vArgs[0], "getblock");
+    BOOST_CHECK_EQUAL(vArgs[1], "hash");
+    BOOST_CHECK_EQUAL(vArgs[2], "1");
+
+    // quotes keep blanks and are dropped, an empty pair is an empty argument
+    vArgs = SplitCommandLine("sendmany \"\" '{\"D7\": 1}' \"a b\"c");
+    BOOST_REQUIRE_EQUAL(vArgs.size(), 4U);
+    BOOST_CHECK_EQUAL(vArgs[1], "");
+    BOOST_CHECK_EQUAL(vArgs[2], "{\"D7\": 1}");
+    BOOST_CHECK_EQUAL(vArgs[3], "a bc");
+}
+
+BOOST_AUTO_TEST_CASE(util_ParseCpuList)
+{
+    std::vector<int> vCpus;
+    BOOST_CHECK(ParseCpuList("3", vCpus));
+    BOOST_REQUIRE_EQUAL(vCpus.size(), 1U);
+    BOOST_CHECK_EQUAL(vCpus[0], 3);
+
+    // ranges and single CPUs, sorted without duplicates
+    BOOST_CHECK(ParseCpuList("8,0-3,2", vCpus));
+    BOOST_REQUIRE_EQUAL(vCpus.size(), 5U);
+    BOOST_CHECK_EQUAL(vCpus[0], 0);
+    BOOST_CHECK_EQUAL(vCpus[3], 3);
+    BOOST_CHECK_EQUAL(vCpus[4], 8);
+
+    BOOST_CHECK(!ParseCpuList("", vCpus));
+    BOOST_CHECK(!ParseCpuList("1,", vCpus));
+    BOOST_CHECK(!ParseCpuList("3-1", vCpus));
+    BOOST_CHECK(!ParseCpuList("-1", vCpus));
+    BOOST_CHECK(!ParseCpuList("a-b", vCpus));
+    BOOST_CHECK(!ParseCpuList(strprintf("0-%d", MAX_THREAD_AFFINITY_CPUS), vCpus));
+}
+
 BOOST_AUTO_TEST_CASE(test_FormatSubVersion)
 {
     std::vector<std::string> comments;
@@ -3,6 +3,9 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "wallet.h"
+#include "random.h"
+#include "stakeinput.h"
+#include "utiltime.h"
 
 #include <set>
 #include <stdint.h>
@@ -305,4 +308,359 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_bnb)
+{
+    vector<CAmount> vValue;
+    vector<char> vfSelected;
+    CAmount nEffective;
+
+    // nothing to select from
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 1 * CENT, 0, vfSelected, nEffective));
+
+    for (int i = 1; i <= 5; i++)
+        vValue.push_back(i * CENT); // 1+2+3+4+5 = 15 cents
+
+    // exact matches, with the fewest coins the search meets first
+    BOOST_CHECK(SelectCoinsBnB(vValue, 5 * CENT, 0, vfSelected, nEffective));
+    BOOST_CHECK_EQUAL(nEffective, 5 * CENT);
+    BOOST_CHECK_EQUAL(count(vfSelected.begin(), vfSelected.end(), true), 1);
+    BOOST_CHECK(SelectCoinsBnB(vValue, 10 * CENT, 0, vfSelected, nEffective));
+    BOOST_CHECK_EQUAL(nEffective, 10 * CENT);
+    BOOST_CHECK(SelectCoinsBnB(vValue, 15 * CENT, 0, vfSelected, nEffective));
+    BOOST_CHECK_EQUAL(count(vfSelected.begin(), vfSelected.end(), true), 5);
+
+    // more than there is, or nothing inside the window
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 16 * CENT, 0, vfSelected, nEffective));
+    vValue.assign(3, 10 * CENT);
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 15 * CENT, 4 * CENT, vfSelected, nEffective));
+
+    // the window above the target is the cost of a change output
+    BOOST_CHECK(SelectCoinsBnB(vValue, 15 * CENT, 5 * CENT, vfSelected, nEffective));
+    BOOST_CHECK_EQUAL(nEffective, 20 * CENT);
+
+    // inputs that cost more to spend than they are worth are never selected
+    vValue.assign(1, 0);
+    vValue.push_back(-1 * CENT);
+    vValue.push_back(1 * CENT);
+    BOOST_CHECK(SelectCoinsBnB(vValue, 1 * CENT, 0, vfSelected, nEffective));
+    BOOST_CHECK(!vfSelected[0] && !vfSelected[1] && vfSelected[2]);
+
+    // the search stops after nMaxTries and keeps the best subset found so far
+    vValue.clear();
+    for (int i = 0; i < 1000; i++)
+        vValue.push_back(7 * CENT);
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 10 * CENT, 0, vfSelected, nEffective, 1000));
+    BOOST_CHECK(SelectCoinsBnB(vValue, 70 * CENT, 0, vfSelected, nEffective, 1000));
+    BOOST_CHECK_EQUAL(count(vfSelected.begin(), vfSelected.end(), true), 10);
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_bnb_bench)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+    CFeeRate feeRate(10000);
+    const CAmount nCostOfChange = feeRate.GetFee(BNB_CHANGE_OUTPUT_SIZE + BNB_INPUT_SIZE);
+
+    LOCK(wallet.cs_wallet);
+
+    // a large wallet of random amounts, both engines asked for the same targets
+    empty_wallet();
+    for (int i = 0; i < 2000; i++)
+        add_coin(CENT + insecure_rand() % (10 * COIN));
+
+    int64_t nTimeKnapsack = 0, nTimeBnB = 0;
+    int nKnapsackChange = 0, nBnBFound = 0;
+    for (int i = 0; i < 20; i++) {
+        CAmount nTarget = (1 + insecure_rand() % 100) * COIN;
+
+        int64_t nTimeStart = GetTimeMicros();
+        BOOST_CHECK(wallet.SelectCoinsMinConf(nTarget, 1, 6, vCoins, setCoinsRet, nValueRet));
+        nTimeKnapsack += GetTimeMicros() - nTimeStart;
+        if (nValueRet != nTarget)
+            nKnapsackChange++;
+
+        nTimeStart = GetTimeMicros();
+        if (wallet.SelectCoinsMinConfBnB(nTarget, nCostOfChange, feeRate, 1, 6, vCoins, setCoinsRet, nValueRet)) {
+            nBnBFound++;
+            BOOST_CHECK(nValueRet - (CAmount)setCoinsRet.size() * feeRate.GetFee(BNB_INPUT_SIZE) >= nTarget);
+            BOOST_CHECK(nValueRet - (CAmount)setCoinsRet.size() * feeRate.GetFee(BNB_INPUT_SIZE) <= nTarget + nCostOfChange);
+        }
+        nTimeBnB += GetTimeMicros() - nTimeStart;
+    }
+    BOOST_TEST_MESSAGE("knapsack: " << nTimeKnapsack / 1000 << "ms, " << nKnapsackChange << "/20 with change; "
+                       << "branch and bound: " << nTimeBnB / 1000 << "ms, " << nBnBFound << "/20 without change");
+    empty_wallet();
+}
+
+/** Exposes the encryption of CCryptoKeyStore */
+class CTestCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    bool EncryptKeys(CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::EncryptKeys(vMasterKeyIn); }
+    bool Unlock(const CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::Unlock(vMasterKeyIn); }
+};
+
+BOOST_AUTO_TEST_CASE(crypted_keystore_key_batch)
+{
+    CTestCryptoKeyStore keystore;
+    vector<CKey> vKeys(4);
+    set<CKeyID> setAddress;
+    for (unsigned int i = 0; i < vKeys.size(); i++) {
+        vKeys[i].MakeNewKey(i % 2 == 0);
+        BOOST_CHECK(keystore.AddKey(vKeys[i]));
+        setAddress.insert(vKeys[i].GetPubKey().GetID());
+    }
+
+    CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE);
+    GetRandBytes(&vMasterKey[0], WALLET_CRYPTO_KEY_SIZE);
+    BOOST_CHECK(keystore.EncryptKeys(vMasterKey));
+    BOOST_CHECK(keystore.IsLocked());
+
+    CKey key;
+    BOOST_CHECK(!keystore.GetKey(vKeys[0].GetPubKey().GetID(), key));
+
+    CKeyingMaterial vWrongKey(WALLET_CRYPTO_KEY_SIZE);
+    GetRandBytes(&vWrongKey[0], WALLET_CRYPTO_KEY_SIZE);
+    BOOST_CHECK(!keystore.Unlock(vWrongKey));
+    BOOST_CHECK(keystore.Unlock(vMasterKey));
+    BOOST_FOREACH (const CKey& keyIn, vKeys) {
+        BOOST_CHECK(keystore.GetKey(keyIn.GetPubKey().GetID(), key));
+        BOOST_CHECK(key == keyIn);
+    }
+
+    {
+        CKeyBatch keyBatch(keystore, setAddress);
+        CKeyBatch keyBatch2(keystore, setAddress);
+        BOOST_FOREACH (const CKey& keyIn, vKeys) {
+            BOOST_CHECK(keystore.GetKey(keyIn.GetPubKey().GetID(), key));
+            BOOST_CHECK(key == keyIn);
+        }
+
+        // Locking wipes the decrypted keys of the batch too
+        BOOST_CHECK(keystore.Lock());
+        BOOST_CHECK(!keystore.GetKey(vKeys[1].GetPubKey().GetID(), key));
+        BOOST_CHECK(keystore.Unlock(vMasterKey));
+        BOOST_CHECK(keystore.GetKey(vKeys[1].GetPubKey().GetID(), key));
+        BOOST_CHECK(key == vKeys[1]);
+    }
+    BOOST_CHECK(keystore.GetKey(vKeys[2].GetPubKey().GetID(), key));
+    BOOST_CHECK(key == vKeys[2]);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_ismine_lookup)
+{
+    CWallet keywallet;
+    LOCK(keywallet.cs_wallet);
+    vector<CKey> vKeys(4);
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        vKeys[i].MakeNewKey(i % 2 == 0);
+    BOOST_CHECK(keywallet.AddKey(vKeys[0]));
+    BOOST_CHECK(keywallet.AddKey(vKeys[1]));
+
+    vector<CPubKey> vOurs, vMixed;
+    vOurs.push_back(vKeys[0].GetPubKey());
+    vOurs.push_back(vKeys[1].GetPubKey());
+    vMixed.push_back(vKeys[0].GetPubKey());
+    vMixed.push_back(vKeys[2].GetPubKey());
+    CScript multisigOurs = GetScriptForMultisig(2, vOurs);
+    CScript multisigMixed = GetScriptForMultisig(2, vMixed);
+    CScript scriptHashMixed = GetScriptForDestination(CScriptID(multisigMixed));
+    CScript watchOnly = GetScriptForDestination(vKeys[3].GetPubKey().GetID());
+
+    vector<CScript> vScripts;
+    for (unsigned int i = 0; i < vKeys.size(); i++) {
+        vScripts.push_back(GetScriptForDestination(vKeys[i].GetPubKey().GetID()));
+        vScripts.push_back(CScript() << ToByteVector(vKeys[i].GetPubKey()) << OP_CHECKSIG);
+    }
+    vScripts.push_back(multisigOurs);
+    vScripts.push_back(multisigMixed);
+    vScripts.push_back(scriptHashMixed);
+    vScripts.push_back(CScript() << OP_RETURN);
+    vScripts.push_back(CScript());
+
+    BOOST_CHECK_EQUAL(keywallet.IsMine(vScripts[0]), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(keywallet.IsMine(vScripts[3]), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(keywallet.IsMine(multisigOurs), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(keywallet.IsMine(scriptHashMixed), ISMINE_NO);
+
+    // The redeem script becomes ours with the key added after it
+    BOOST_CHECK(keywallet.AddCScript(multisigMixed));
+    BOOST_CHECK_EQUAL(keywallet.IsMine(scriptHashMixed), ISMINE_NO);
+    BOOST_CHECK(keywallet.AddKey(vKeys[2]));
+    BOOST_CHECK_EQUAL(keywallet.IsMine(scriptHashMixed), ISMINE_SPENDABLE);
+
+    BOOST_CHECK(keywallet.AddWatchOnly(watchOnly));
+    BOOST_CHECK_EQUAL(keywallet.IsMine(watchOnly), ISMINE_WATCH_ONLY);
+    BOOST_FOREACH (const CScript& script, vScripts)
+        BOOST_CHECK_EQUAL(keywallet.IsMine(script), IsMine(keywallet, script));
+
+    BOOST_CHECK(keywallet.RemoveWatchOnly(watchOnly));
+    BOOST_CHECK_EQUAL(keywallet.IsMine(watchOnly), ISMINE_NO);
+    BOOST_FOREACH (const CScript& script, vScripts)
+        BOOST_CHECK_EQUAL(keywallet.IsMine(script), IsMine(keywallet, script));
+}
+
+BOOST_AUTO_TEST_CASE(wallet_transactions_above)
+{
+    CWallet txwallet;
+    LOCK(txwallet.cs_wallet);
+    CKey key;
+    key.MakeNewKey(true);
+    CScript watchOnly = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // Anchored at heights 0..9, and one not in the chain
+    vector<uint256> vHashes;
+    for (int i = 0; i <= 10; i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = i;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1 * COIN;
+        tx.vout[0].scriptPubKey = watchOnly;
+        CWalletTx wtx(&txwallet, tx);
+        if (i < 10) {
+            wtx.hashBlock = GetRandHash();
+            wtx.nIndex = 0;
+            wtx.hashAnchor = wtx.hashBlock;
+            wtx.nAnchorHeight = i;
+        }
+        BOOST_CHECK(txwallet.AddToWallet(wtx, true));
+        vHashes.push_back(wtx.GetHash());
+    }
+
+    vector<const CWalletTx*> vwtx;
+    txwallet.GetTransactionsAbove(6, vwtx);
+    BOOST_REQUIRE_EQUAL(vwtx.size(), 4U);
+    BOOST_CHECK(vwtx[0]->GetHash() == vHashes[10]);
+    BOOST_CHECK(vwtx[1]->GetHash() == vHashes[7]);
+    BOOST_CHECK(vwtx[3]->GetHash() == vHashes[9]);
+    txwallet.GetTransactionsAbove(-1, vwtx);
+    BOOST_CHECK_EQUAL(vwtx.size(), 11U);
+
+    // The cached outputs follow what IsMine returns
+    const CWalletTx& wtx = txwallet.mapWallet[vHashes[0]];
+    CAmount nFee;
+    string strSentAccount;
+    list<COutputEntry> listReceived, listSent;
+    wtx.GetAmounts(listReceived, listSent, nFee, strSentAccount, ISMINE_ALL);
+    BOOST_CHECK(listReceived.empty());
+    BOOST_CHECK(txwallet.AddWatchOnly(watchOnly));
+    wtx.GetAmounts(listReceived, listSent, nFee, strSentAccount, ISMINE_ALL);
+    BOOST_REQUIRE_EQUAL(listReceived.size(), 1U);
+    BOOST_CHECK(listReceived.front().destination == CTxDestination(key.GetPubKey().GetID()));
+    wtx.GetAmounts(listReceived, listSent, nFee, strSentAccount, ISMINE_SPENDABLE);
+    BOOST_CHECK(listReceived.empty());
+}
+
+BOOST_AUTO_TEST_CASE(wallet_destination_index)
+{
+    CWallet txwallet;
+    LOCK(txwallet.cs_wallet);
+    CKey key;
+    key.MakeNewKey(true);
+    CTxDestination dest = key.GetPubKey().GetID();
+
+    // Twice to dest in one transaction, once in another, sent from an account
+    CMutableTransaction tx;
+    tx.vout.resize(3);
+    tx.vout[0].scriptPubKey = GetScriptForDestination(dest);
+    tx.vout[1].scriptPubKey = GetScriptForDestination(dest);
+    tx.vout[2].scriptPubKey = GetScriptForDestination(CKeyID());
+    BOOST_CHECK(txwallet.AddToWallet(CWalletTx(&txwallet, tx), true));
+    tx.vout.resize(1);
+    CWalletTx wtxFrom(&txwallet, tx);
+    wtxFrom.strFromAccount = "tabby";
+    BOOST_CHECK(txwallet.AddToWallet(wtxFrom, true));
+
+    BOOST_CHECK_EQUAL(txwallet.GetTransactionsPaying(dest).size(), 2U);
+    BOOST_CHECK_EQUAL(txwallet.GetTransactionsPaying(CKeyID()).size(), 1U);
+    BOOST_REQUIRE_EQUAL(txwallet.GetTransactionsFromAccount("tabby").size(), 1U);
+    BOOST_CHECK(txwallet.GetTransactionsFromAccount("tabby")[0] == &txwallet.mapWallet[wtxFrom.GetHash()]);
+    BOOST_CHECK(txwallet.GetTransactionsFromAccount("other").empty());
+
+    CAccountingEntry debit, credit;
+    debit.strAccount = "tabby";
+    debit.nCreditDebit = -3 * COIN;
+    credit.strAccount = "tabby";
+    credit.nCreditDebit = 1 * COIN;
+    txwallet.LoadAccountingEntry(debit);
+    txwallet.LoadAccountingEntry(credit);
+    BOOST_CHECK_EQUAL(txwallet.GetAccountCreditDebit("tabby"), -2 * COIN);
+    BOOST_CHECK_EQUAL(txwallet.GetAccountCreditDebit(""), 0);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_stake_candidates_import)
+{
+    CWallet stakewallet;
+    LOCK2(cs_main, stakewallet.cs_wallet);
+    CKey key;
+    key.MakeNewKey(true);
+    CScript script = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // Deep enough blocks on top of the tip, the fifth one pays the script
+    CBlockIndex* pindexTipBefore = chainActive.Tip();
+    vector<CBlockIndex*> vChain;
+    for (int i = 0; i < 20; i++) {
+        CBlockIndex* pindex = new CBlockIndex();
+        pindex->pprev = vChain.empty() ? pindexTipBefore : vChain.back();
+        pindex->nHeight = pindex->pprev ? pindex->pprev->nHeight + 1 : 0;
+        pindex->phashBlock = &mapBlockIndex.insert(make_pair(GetRandHash(), pindex)).first->first;
+        vChain.push_back(pindex);
+    }
+    chainActive.SetTip(vChain.back());
+
+    CMutableTransaction tx;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 5 * COIN;
+    tx.vout[0].scriptPubKey = script;
+    CWalletTx wtx(&stakewallet, tx);
+    wtx.hashBlock = vChain[4]->GetBlockHash();
+    wtx.nIndex = 0;
+    wtx.nTimeReceived = GetTime() - 2 * nStakeMinAge;
+    vChain[4]->hashMerkleRoot = wtx.GetHash();
+
+    // Watched only, the output is in the wallet but cannot stake
+    BOOST_CHECK(stakewallet.AddWatchOnly(script));
+    BOOST_CHECK(stakewallet.AddToWallet(wtx, true));
+    stakewallet.LoadWalletChainState();
+    std::list<std::unique_ptr<CStakeInput> > listInputs;
+    BOOST_CHECK(stakewallet.SelectStakeCoins(listInputs, 10 * COIN));
+    BOOST_CHECK(listInputs.empty());
+
+    // Its key imported, the transaction already in the wallet stakes without a rescan
+    BOOST_CHECK(stakewallet.AddKey(key));
+    BOOST_CHECK(stakewallet.SelectStakeCoins(listInputs, 10 * COIN));
+    BOOST_CHECK_EQUAL(listInputs.size(), 1U);
+
+    chainActive.SetTip(pindexTipBefore);
+    BOOST_FOREACH (CBlockIndex* pindex, vChain) {
+        mapBlockIndex.erase(pindex->GetBlockHash());
+        delete pindex;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(wallet_block_merkle_index)
+{
+    CBlock block;
+    for (int i = 0; i < 13; i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = i;
+        tx.vout.resize(1);
+        block.vtx.push_back(tx);
+    }
+    uint256 hashMerkleRoot = block.BuildMerkleTree();
+
+    CBlockMerkleIndex index(block);
+    BOOST_CHECK(index.GetBlockHash() == block.GetHash());
+    for (int i = 0; i < (int)block.vtx.size(); i++) {
+        BOOST_CHECK_EQUAL(index.Find(block.vtx[i].GetHash()), i);
+        std::vector<uint256> vBranch = index.GetMerkleBranch(i);
+        BOOST_CHECK(vBranch == block.GetMerkleBranch(i));
+        BOOST_CHECK(CBlock::CheckMerkleBranch(block.vtx[i].GetHash(), vBranch, i) == hashMerkleRoot);
+    }
+    BOOST_CHECK_EQUAL(index.Find(GetRandHash()), -1);
+
+    index.SetNull();
+    BOOST_CHECK_EQUAL(index.Find(block.vtx[0].GetHash()), -1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
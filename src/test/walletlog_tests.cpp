@@ -0,0 +1,181 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(walletlog_tests)
+
+static CSerializeData Value(const std::string& str)
+{
+    return CSerializeData(str.begin(), str.end());
+}
+
+static void Put(CWalletLogBatch& batch, const std::string& key, const std::string& value)
+{
+    batch[key].fErase = false;
+    batch[key].value = Value(value);
+}
+
+static void Erase(CWalletLogBatch& batch, const std::string& key)
+{
+    batch[key].fErase = true;
+    batch[key].value.clear();
+}
+
+static std::string Get(CWalletLogFile& file, const std::string& key)
+{
+    CSerializeData value;
+    if (!file.Read(key, value))
+        return "<none>";
+    return std::string(value.begin(), value.end());
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_reopen)
+{
+    boost::filesystem::path pathDir = GetDataDir() / "walletlog";
+    boost::filesystem::create_directories(pathDir);
+    boost::filesystem::path path = pathDir / "wallet.dat";
+
+    {
+        CWalletLogFile file;
+        BOOST_CHECK(!file.Open(path, false));
+        BOOST_REQUIRE(file.Open(path, true));
+        CWalletLogBatch batch;
+        Put(batch, "b", "one");
+        Put(batch, "a", "two");
+        Put(batch, "c", "");
+        BOOST_REQUIRE(file.Commit(batch));
+        batch.clear();
+        Put(batch, "b", "three");
+        Erase(batch, "a");
+        Erase(batch, "missing");
+        BOOST_REQUIRE(file.Commit(batch));
+        BOOST_CHECK_EQUAL(Get(file, "b"), "three");
+        BOOST_CHECK_EQUAL(Get(file, "a"), "<none>");
+    }
+    BOOST_CHECK(CWalletLogFile::IsLogFile(path));
+
+    CWalletLogFile file;
+    BOOST_REQUIRE(file.Open(path, false));
+    BOOST_CHECK_EQUAL(file.GetCount(), 2U);
+    BOOST_CHECK_EQUAL(Get(file, "b"), "three");
+    BOOST_CHECK_EQUAL(Get(file, "c"), "");
+    BOOST_CHECK(file.Exists("c"));
+    BOOST_CHECK(!file.Exists("a"));
+
+    // Keys come in memcmp order, like from a BerkeleyDB cursor
+    std::string key;
+    CSerializeData value;
+    BOOST_REQUIRE(file.Next("", true, key, value));
+    BOOST_CHECK_EQUAL(key, "b");
+    BOOST_REQUIRE(file.Next(key, true, key, value));
+    BOOST_CHECK_EQUAL(key, "b");
+    BOOST_REQUIRE(file.Next(key, false, key, value));
+    BOOST_CHECK_EQUAL(key, "c");
+    BOOST_CHECK(!file.Next(key, false, key, value));
+    file.Close();
+
+    boost::filesystem::remove_all(pathDir);
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_torn_tail)
+{
+    boost::filesystem::path pathDir = GetDataDir() / "walletlog";
+    boost::filesystem::create_directories(pathDir);
+    boost::filesystem::path path = pathDir / "wallet.dat";
+
+    uint64_t nCommitted;
+    {
+        CWalletLogFile file;
+        BOOST_REQUIRE(file.Open(path, true));
+        CWalletLogBatch batch;
+        Put(batch, "key", "committed");
+        BOOST_REQUIRE(file.Commit(batch));
+        nCommitted = boost::filesystem::file_size(path);
+        batch.clear();
+        Put(batch, "key", "torn");
+        Put(batch, "other", "torn");
+        BOOST_REQUIRE(file.Commit(batch));
+    }
+
+    // Cut the last transaction short, as a crash during the write would
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 3);
+    {
+        CWalletLogFile file;
+        BOOST_REQUIRE(file.Open(path, false));
+        BOOST_CHECK_EQUAL(Get(file, "key"), "committed");
+        BOOST_CHECK(!file.Exists("other"));
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nCommitted);
+
+    // A flipped bit fails the checksum of its record
+    {
+        CWalletLogFile file;
+        BOOST_REQUIRE(file.Open(path, false));
+        CWalletLogBatch batch;
+        Put(batch, "key", "corrupted");
+        BOOST_REQUIRE(file.Commit(batch));
+    }
+    FILE* filecorrupt = fopen(path.string().c_str(), "r+b");
+    BOOST_REQUIRE(filecorrupt);
+    fseek(filecorrupt, nCommitted + 6, SEEK_SET);
+    fputc('X', filecorrupt);
+    fclose(filecorrupt);
+    {
+        CWalletLogFile file;
+        BOOST_REQUIRE(file.Open(path, false));
+        BOOST_CHECK_EQUAL(Get(file, "key"), "committed");
+    }
+
+    boost::filesystem::remove_all(pathDir);
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_compact_backup)
+{
+    boost::filesystem::path pathDir = GetDataDir() / "walletlog";
+    boost::filesystem::create_directories(pathDir);
+    boost::filesystem::path path = pathDir / "wallet.dat";
+    boost::filesystem::path pathBackup = pathDir / "backup.dat";
+
+    CWalletLogFile file;
+    BOOST_REQUIRE(file.Open(path, true));
+    std::string strValue(1000, 'v');
+    for (int i = 0; i < 20; i++) {
+        CWalletLogBatch batch;
+        for (int j = 0; j < 500; j++)
+            Put(batch, strprintf("key%04d", j), strValue + strprintf("%d", i));
+        Put(batch, strprintf("\x04pool%d", i), "pool");
+        BOOST_REQUIRE(file.Commit(batch));
+    }
+    uint64_t nSize = boost::filesystem::file_size(path);
+    BOOST_CHECK(file.NeedsCompaction());
+
+    BOOST_REQUIRE(file.Backup(pathBackup));
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathBackup), nSize);
+
+    BOOST_REQUIRE(file.Compact("\x04pool"));
+    BOOST_CHECK(boost::filesystem::file_size(path) < nSize / 10);
+    BOOST_CHECK(!file.NeedsCompaction());
+    BOOST_CHECK_EQUAL(file.GetCount(), 500U);
+    BOOST_CHECK_EQUAL(Get(file, "key0123"), strValue + "19");
+    BOOST_CHECK(!file.Exists("\x04pool3"));
+    file.Close();
+
+    CWalletLogFile backup;
+    BOOST_REQUIRE(backup.Open(pathBackup, false));
+    BOOST_CHECK_EQUAL(backup.GetCount(), 520U);
+    BOOST_CHECK_EQUAL(Get(backup, "key0499"), strValue + "19");
+    backup.Close();
+
+    boost::filesystem::remove_all(pathDir);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,22 +6,145 @@
 
 #include "txdb.h"
 
+#include "checkpoints.h"
 #include "main.h"
+#include "metrics.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
+#include <algorithm>
 #include <stdint.h>
 
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+/**
+ * Chainstate key of one unspent output: 'o', txid, then the index big-endian
+ * so the outputs of a transaction are adjacent and in order.
+ */
+struct CCoinsOutputKey {
+    uint256 txid;
+    uint32_t n;
+
+    CCoinsOutputKey(const uint256& txidIn = uint256(0), uint32_t nIn = 0) : txid(txidIn), n(nIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 1 + 32 + 4;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned char vch[4] = {(unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n};
+        ::Serialize(s, 'o', nType, nVersion);
+        ::Serialize(s, txid, nType, nVersion);
+        s.write((const char*)vch, sizeof(vch));
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char vch[4];
+        char chType;
+        ::Unserialize(s, chType, nType, nVersion);
+        ::Unserialize(s, txid, nType, nVersion);
+        s.read((char*)vch, sizeof(vch));
+        n = ((uint32_t)vch[0] << 24) | ((uint32_t)vch[1] << 16) | ((uint32_t)vch[2] << 8) | vch[3];
+    }
+};
+
+/**
+ * Chainstate key 'u' + txid marks a transaction with unspent outputs. Lookups
+ * get it first, as a point read the bloom filters can turn down, and only
+ * seek over the 'o' records of the transaction when it is there.
+ */
+static std::pair<char, uint256> CoinsTxMarkerKey(const uint256& txid)
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+    return std::make_pair('u', txid);
+}
+
+/** Chainstate value of one unspent output. The per-transaction fields are repeated in every record. */
+struct CCoinsOutputRecord {
+    int nVersion;
+    bool fCoinBase;
+    bool fCoinStake;
+    int nHeight;
+    CTxOut out;
+
+    CCoinsOutputRecord() : nVersion(0), fCoinBase(false), fCoinStake(false), nHeight(0) {}
+    CCoinsOutputRecord(const CCoins& coins, unsigned int n) : nVersion(coins.nVersion), fCoinBase(coins.fCoinBase), fCoinStake(coins.fCoinStake), nHeight(coins.nHeight), out(coins.vout[n]) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nSerVersion)
+    {
+        unsigned int nCode = (fCoinBase ? 1 : 0) | (fCoinStake ? 2 : 0);
+        READWRITE(VARINT(nVersion));
+        READWRITE(VARINT(nCode));
+        fCoinBase = nCode & 1;
+        fCoinStake = (nCode & 2) != 0;
+        READWRITE(VARINT(nHeight));
+        READWRITE(REF(CTxOutCompressor(out)));
+    }
+};
+
+/**
+ * Add an output, in key order, to what GetStats hashes: the per-transaction
+ * layout of the old one-record-per-transaction format. fHaveTx and
+ * txhashPrev carry the transaction being written between calls; a final
+ * SerializeStatsEnd closes the last one.
+ */
+template <typename Stream>
+static void SerializeStatsOutput(Stream& ss, const CCoinsOutputKey& key, const CCoinsOutputRecord& record, bool& fHaveTx, uint256& txhashPrev)
+{
+    if (!fHaveTx || key.txid != txhashPrev) {
+        if (fHaveTx)
+            ss << VARINT(0);
+        ss << key.txid;
+        ss << VARINT(record.nVersion);
+        ss << (record.fCoinBase ? 'c' : 'n');
+        ss << VARINT(record.nHeight);
+        txhashPrev = key.txid;
+        fHaveTx = true;
+    }
+    ss << VARINT(key.n + 1);
+    ss << record.out;
+}
+
+template <typename Stream>
+static void SerializeStatsEnd(Stream& ss, bool fHaveTx)
+{
+    if (fHaveTx)
+        ss << VARINT(0);
+}
+
+void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoinsCacheEntry& entry)
+{
+    // Outputs never change once created, so only those that appeared or were
+    // spent since the entry was read from us need a write.
+    const CCoins& coins = entry.coins;
+    size_t nOutputs = std::max(coins.vout.size(), entry.vBaseUnspent.size());
+    bool fAnyUnspent = false;
+    bool fAnyBaseUnspent = false;
+    for (size_t i = 0; i < nOutputs; i++) {
+        bool fUnspent = i < coins.vout.size() && !coins.vout[i].IsNull();
+        bool fBaseUnspent = i < entry.vBaseUnspent.size() && entry.vBaseUnspent[i];
+        if (fUnspent && !fBaseUnspent)
+            batch.Write(CCoinsOutputKey(hash, i), CCoinsOutputRecord(coins, i));
+        else if (!fUnspent && fBaseUnspent)
+            batch.Erase(CCoinsOutputKey(hash, i));
+        fAnyUnspent |= fUnspent;
+        fAnyBaseUnspent |= fBaseUnspent;
+    }
+    if (fAnyUnspent && !fAnyBaseUnspent)
+        batch.Write(CoinsTxMarkerKey(hash), true);
+    else if (!fAnyUnspent && fAnyBaseUnspent)
+        batch.Erase(CoinsTxMarkerKey(hash));
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
@@ -29,18 +152,114 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, GetLevelDBProfile("chainstate"))
 {
 }
 
+/**
+ * Read the outputs of the transaction whose first output key is ssKeySet
+ * into coins, with pcursor at the first key not below it. pcursor is left
+ * at the first key past them. False if a record cannot be read.
+ */
+static bool ReadCoinsAtCursor(CDBIterator* pcursor, const CDataStream& ssKeySet, CCoins& coins, bool& fFound)
+{
+    const size_t nPrefix = 33; // 'o' + txid
+
+    coins.Clear();
+    fFound = false;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        CDBSlice slKey = pcursor->key();
+        if (slKey.size() != ssKeySet.size() || memcmp(slKey.data(), &ssKeySet[0], nPrefix) != 0)
+            break;
+        try {
+            CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsOutputKey key;
+            ssKey >> key;
+            CDBSlice slValue = pcursor->value();
+            CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsOutputRecord record;
+            ssValue >> record;
+
+            coins.nVersion = record.nVersion;
+            coins.fCoinBase = record.fCoinBase;
+            coins.fCoinStake = record.fCoinStake;
+            coins.nHeight = record.nHeight;
+            if (coins.vout.size() <= key.n)
+                coins.vout.resize(key.n + 1);
+            coins.vout[key.n] = record.out;
+            fFound = true;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    // a point read the bloom filters can answer, and what counts as the lookup
+    if (!db.Exists(CoinsTxMarkerKey(txid)))
+        return false;
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << CCoinsOutputKey(txid, 0);
+
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    pcursor->Seek(CDBSlice(&ssKeySet[0], ssKeySet.size()));
+
+    bool fFound;
+    if (!ReadCoinsAtCursor(pcursor.get(), ssKeySet, coins, fFound))
+        return false;
+    return fFound;
+}
+
+/** Orders positions of a list of txids by the keys of their outputs in the database */
+struct CompareTxidKeys {
+    const std::vector<uint256>& vTxids;
+
+    CompareTxidKeys(const std::vector<uint256>& vTxidsIn) : vTxids(vTxidsIn) {}
+    bool operator()(unsigned int a, unsigned int b) const
+    {
+        return memcmp(vTxids[a].begin(), vTxids[b].begin(), vTxids[a].size()) < 0;
+    }
+};
+
+void CCoinsViewDB::GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const
+{
+    vCoins.assign(vTxids.size(), CCoins());
+    vFound.assign(vTxids.size(), false);
+    std::vector<unsigned int> vOrder(vTxids.size());
+    for (unsigned int i = 0; i < vOrder.size(); i++)
+        vOrder[i] = i;
+    std::sort(vOrder.begin(), vOrder.end(), CompareTxidKeys(vTxids));
+
+    // In key order one iterator mostly moves forward through blocks it read already
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    for (unsigned int j = 0; j < vOrder.size(); j++) {
+        unsigned int i = vOrder[j];
+        if (j > 0 && vTxids[i] == vTxids[vOrder[j - 1]]) {
+            vCoins[i] = vCoins[vOrder[j - 1]];
+            vFound[i] = vFound[vOrder[j - 1]];
+            continue;
+        }
+        if (!db.Exists(CoinsTxMarkerKey(vTxids[i])))
+            continue;
+        CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+        ssKeySet << CCoinsOutputKey(vTxids[i], 0);
+        CDBSlice slKeySet(&ssKeySet[0], ssKeySet.size());
+        // Past the outputs of the previous transaction, the cursor is where a seek would go unless that is below this one
+        if (!pcursor->Valid() || pcursor->key().compare(slKeySet) < 0)
+            pcursor->Seek(slKeySet);
+        bool fFound;
+        if (!ReadCoinsAtCursor(pcursor.get(), ssKeySet, vCoins[i], fFound))
+            continue;
+        vFound[i] = fFound;
+    }
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(make_pair('c', txid));
+    return db.Exists(CoinsTxMarkerKey(txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
@@ -51,6 +270,11 @@ uint256 CCoinsViewDB::GetBestBlock() const
     return hashBestChain;
 }
 
+bool CCoinsViewDB::IsLoadingSnapshot() const
+{
+    return db.Exists('S');
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
 {
     CLevelDBBatch batch;
@@ -58,7 +282,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            BatchWriteCoins(batch, it->first, it->second);
             changed++;
         }
         count++;
@@ -72,7 +296,306 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
+bool CCoinsViewDB::WriteCoins(const CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    CLevelDBBatch batch;
+    size_t changed = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            BatchWriteCoins(batch, it->first, it->second);
+            changed++;
+        }
+    }
+    if (hashBlock != uint256(0))
+        BatchWriteHashBestChain(batch, hashBlock);
+
+    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)mapCoins.size());
+    return db.WriteBatch(batch);
+}
+
+CCoinsViewWriteBehind::CCoinsViewWriteBehind(CCoinsViewDB* pdbIn) : pdb(pdbIn), hashBlockWriting(0), fWriteFailed(false) {}
+
+CCoinsViewWriteBehind::~CCoinsViewWriteBehind()
+{
+    Sync();
+}
+
+boost::shared_ptr<const CCoinsMap> CCoinsViewWriteBehind::GetWriting() const
+{
+    LOCK(cs);
+    return pmapWriting;
+}
+
+bool CCoinsViewWriteBehind::GetCoins(const uint256& txid, CCoins& coins) const
+{
+    boost::shared_ptr<const CCoinsMap> pmap = GetWriting();
+    if (pmap) {
+        CCoinsMap::const_iterator it = pmap->find(txid);
+        if (it != pmap->end()) {
+            // A pruned entry is one the database is about to forget
+            if (it->second.coins.IsPruned())
+                return false;
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return pdb->GetCoins(txid, coins);
+}
+
+void CCoinsViewWriteBehind::GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const
+{
+    boost::shared_ptr<const CCoinsMap> pmap = GetWriting();
+    if (!pmap) {
+        pdb->GetCoinsBatch(vTxids, vCoins, vFound);
+        return;
+    }
+
+    vCoins.assign(vTxids.size(), CCoins());
+    vFound.assign(vTxids.size(), false);
+    std::vector<uint256> vMisses;
+    std::vector<unsigned int> vMissIndex;
+    for (unsigned int i = 0; i < vTxids.size(); i++) {
+        CCoinsMap::const_iterator it = pmap->find(vTxids[i]);
+        if (it == pmap->end()) {
+            vMisses.push_back(vTxids[i]);
+            vMissIndex.push_back(i);
+        } else if (!it->second.coins.IsPruned()) {
+            vCoins[i] = it->second.coins;
+            vFound[i] = true;
+        }
+    }
+    if (vMisses.empty())
+        return;
+
+    std::vector<CCoins> vCoinsDB;
+    std::vector<bool> vFoundDB;
+    pdb->GetCoinsBatch(vMisses, vCoinsDB, vFoundDB);
+    for (unsigned int i = 0; i < vMisses.size(); i++) {
+        if (vFoundDB[i]) {
+            vCoins[vMissIndex[i]].swap(vCoinsDB[i]);
+            vFound[vMissIndex[i]] = true;
+        }
+    }
+}
+
+bool CCoinsViewWriteBehind::HaveCoins(const uint256& txid) const
+{
+    boost::shared_ptr<const CCoinsMap> pmap = GetWriting();
+    if (pmap) {
+        CCoinsMap::const_iterator it = pmap->find(txid);
+        if (it != pmap->end())
+            return !it->second.coins.IsPruned();
+    }
+    return pdb->HaveCoins(txid);
+}
+
+uint256 CCoinsViewWriteBehind::GetBestBlock() const
+{
+    {
+        LOCK(cs);
+        if (pmapWriting && hashBlockWriting != uint256(0))
+            return hashBlockWriting;
+    }
+    return pdb->GetBestBlock();
+}
+
+bool CCoinsViewWriteBehind::GetStats(CCoinsStats& stats) const
+{
+    return pdb->GetStats(stats);
+}
+
+void CCoinsViewWriteBehind::ThreadWrite(boost::shared_ptr<const CCoinsMap> pmap, uint256 hashBlock)
+{
+    RenameThread("dystem-coinswrite");
+    int64_t nTimeStart = GetTimeMicros();
+    bool fOk = false;
+    try {
+        fOk = pdb->WriteCoins(*pmap, hashBlock);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    metricCoinsWriteTime.Add(GetTimeMicros() - nTimeStart);
+    LogPrint("bench", "    - Coins written behind: %.2fms\n", (GetTimeMicros() - nTimeStart) * 0.001);
+
+    LOCK(cs);
+    // After a failure the layer stays, the database is behind it
+    if (fOk)
+        pmapWriting.reset();
+    else
+        fWriteFailed = true;
+}
+
+bool CCoinsViewWriteBehind::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    if (!Sync())
+        return false;
+
+    boost::shared_ptr<CCoinsMap> pmap(new CCoinsMap());
+    if (mapCoins.get_allocator().pool == NULL) {
+        pmap->swap(mapCoins);
+    } else {
+        // The nodes of a pooled map go back to its pool, the dirty entries move out
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            CCoinsCacheEntry& entry = (*pmap)[it->first];
+            entry.coins.swap(it->second.coins);
+            entry.vBaseUnspent.swap(it->second.vBaseUnspent);
+            entry.flags = it->second.flags;
+        }
+        mapCoins.clear();
+    }
+
+    {
+        LOCK(cs);
+        pmapWriting = pmap;
+        hashBlockWriting = hashBlock;
+    }
+    pthreadWrite.reset(new boost::thread(boost::bind(&CCoinsViewWriteBehind::ThreadWrite, this, boost::shared_ptr<const CCoinsMap>(pmap), hashBlock)));
+    return true;
+}
+
+bool CCoinsViewWriteBehind::Sync()
+{
+    if (pthreadWrite) {
+        int64_t nTimeStart = GetTimeMicros();
+        pthreadWrite->join();
+        pthreadWrite.reset();
+        metricCoinsWriteWaitTime.Add(GetTimeMicros() - nTimeStart);
+    }
+    LOCK(cs);
+    return !fWriteFailed;
+}
+
+bool CCoinsViewWriteBehind::IsWriting() const
+{
+    LOCK(cs);
+    return pmapWriting && !fWriteFailed;
+}
+
+/** Convert the one CCoins record per transaction of older versions to per-output records */
+static bool UpgradeToOutputRecords(CLevelDBWrapper& db)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('c', uint256(0));
+    pcursor->Seek(ssKeySet.str());
+    if (!pcursor->Valid() || pcursor->key().size() == 0 || pcursor->key().data()[0] != 'c')
+        return true;
+
+    LogPrintf("Upgrading UTXO database to per-output records...\n");
+    uiInterface.InitMessage(_("Upgrading UTXO database..."));
+    size_t nTransactions = 0;
+    size_t nOutputs = 0;
+    while (pcursor->Valid()) {
+        // every batch converts whole transactions, so an interrupted upgrade resumes cleanly
+        CLevelDBBatch batch;
+        size_t nBatch = 0;
+        for (; pcursor->Valid() && nBatch < UTXO_UPGRADE_BATCH_SIZE; pcursor->Next()) {
+            CDBSlice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey.data()[0] != 'c')
+                break;
+            try {
+                CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                uint256 txid;
+                ssKey >> chType >> txid;
+                CDBSlice slValue = pcursor->value();
+                CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+                CCoins coins;
+                ssValue >> coins;
+                for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                    if (!coins.vout[i].IsNull()) {
+                        batch.Write(CCoinsOutputKey(txid, i), CCoinsOutputRecord(coins, i));
+                        nOutputs++;
+                    }
+                }
+                if (!coins.IsPruned())
+                    batch.Write(CoinsTxMarkerKey(txid), true);
+                batch.Erase(make_pair('c', txid));
+            } catch (std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+            nBatch++;
+        }
+        if (!db.WriteBatch(batch))
+            return error("%s : failed to write upgraded records", __func__);
+        nTransactions += nBatch;
+        if (nBatch < UTXO_UPGRADE_BATCH_SIZE)
+            break;
+    }
+    LogPrintf("Upgraded %u transactions (%u unspent outputs) in the UTXO database\n", (unsigned int)nTransactions, (unsigned int)nOutputs);
+    return true;
+}
+
+/** Add the 'u' markers to per-output records written before there were markers */
+static bool UpgradeToTxMarkers(CLevelDBWrapper& db)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(CDBSlice("o", 1));
+    if (!pcursor->Valid() || pcursor->key().size() == 0 || pcursor->key().data()[0] != 'o')
+        return true;
+
+    // 'M' is kept until the last marker is written, so that an interrupted upgrade resumes
+    if (!db.Exists('M')) {
+        try {
+            CDBSlice slKey = pcursor->key();
+            CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsOutputKey key;
+            ssKey >> key;
+            if (db.Exists(CoinsTxMarkerKey(key.txid)))
+                return true;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+        if (!db.Write('M', true, true))
+            return error("%s : failed to write the upgrade flag", __func__);
+    }
+
+    LogPrintf("Upgrading UTXO database to per-transaction markers...\n");
+    uiInterface.InitMessage(_("Upgrading UTXO database..."));
+    size_t nTransactions = 0;
+    bool fHaveTx = false;
+    uint256 txidPrev = 0;
+    while (pcursor->Valid()) {
+        CLevelDBBatch batch;
+        size_t nBatch = 0;
+        for (; pcursor->Valid() && nBatch < UTXO_UPGRADE_BATCH_SIZE; pcursor->Next()) {
+            CDBSlice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey.data()[0] != 'o')
+                break;
+            CCoinsOutputKey key;
+            try {
+                CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+                ssKey >> key;
+            } catch (std::exception& e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+            if (fHaveTx && key.txid == txidPrev)
+                continue;
+            batch.Write(CoinsTxMarkerKey(key.txid), true);
+            txidPrev = key.txid;
+            fHaveTx = true;
+            nBatch++;
+        }
+        if (!db.WriteBatch(batch))
+            return error("%s : failed to write the markers", __func__);
+        nTransactions += nBatch;
+        if (nBatch < UTXO_UPGRADE_BATCH_SIZE)
+            break;
+    }
+    if (!db.Erase('M', true))
+        return error("%s : failed to erase the upgrade flag", __func__);
+    LogPrintf("Marked %u transactions in the UTXO database\n", (unsigned int)nTransactions);
+    return true;
+}
+
+bool CCoinsViewDB::Upgrade()
+{
+    return UpgradeToOutputRecords(db) && UpgradeToTxMarkers(db);
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, GetLevelDBProfile("blockindex"))
 {
 }
 
@@ -115,57 +638,336 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
+namespace
+{
+/**
+ * GetStats splits the 'o' keyspace by the first byte of the txid. Ranges are
+ * claimed in order by the workers and hashed in order by the caller, so the
+ * result is the same as a single pass, and only a few ranges wait in memory.
+ */
+static const int UTXO_STATS_RANGES = 256;
+
+struct CCoinsStatsRange {
+    CDataStream ss;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nSerializedSize;
+    CAmount nTotalAmount;
+
+    CCoinsStatsRange() : ss(SER_GETHASH, PROTOCOL_VERSION), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+};
+typedef boost::shared_ptr<CCoinsStatsRange> CCoinsStatsRangeRef;
+
+class CCoinsStatsJob
+{
+public:
+    const CLevelDBWrapper& db;
+    const CDBSnapshot* snapshot;
+    std::vector<CCoinsStatsRangeRef> vRanges; // set once a range is done
+    int nNextRange;   // next range for a worker to claim
+    int nHashed;      // ranges the caller has consumed
+    int nMaxAhead;    // how far workers may run ahead of the caller
+    bool fAbort;
+    std::string strError;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+
+    CCoinsStatsJob(const CLevelDBWrapper& dbIn, const CDBSnapshot* snapshotIn, int nThreads) : db(dbIn), snapshot(snapshotIn), vRanges(UTXO_STATS_RANGES), nNextRange(0), nHashed(0), nMaxAhead(2 * nThreads), fAbort(false) {}
+
+    //! Summarise the transactions whose txid starts with byte nRange.
+    bool Scan(int nRange, CCoinsStatsRange& range)
+    {
+        boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator(snapshot));
+        const char pchStart[2] = {'o', (char)nRange};
+        pcursor->Seek(CDBSlice(pchStart, 2));
+        uint256 txhashPrev = 0;
+        bool fHaveTx = false;
+        for (; pcursor->Valid(); pcursor->Next()) {
+            CDBSlice slKey = pcursor->key();
+            if (slKey.size() < 2 || slKey.data()[0] != 'o' || (unsigned char)slKey.data()[1] != nRange)
+                break;
+            CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsOutputKey key;
+            ssKey >> key;
+            CDBSlice slValue = pcursor->value();
+            CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsOutputRecord record;
+            ssValue >> record;
+            if (!fHaveTx || key.txid != txhashPrev)
+                range.nTransactions++;
+            SerializeStatsOutput(range.ss, key, record, fHaveTx, txhashPrev);
+            range.nTransactionOutputs++;
+            range.nTotalAmount += record.out.nValue;
+            range.nSerializedSize += slKey.size() + slValue.size();
+        }
+        SerializeStatsEnd(range.ss, fHaveTx);
+        return pcursor->IsOk();
+    }
+
+    void Worker()
+    {
+        while (true) {
+            int nRange;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fAbort && nNextRange < UTXO_STATS_RANGES && nNextRange >= nHashed + nMaxAhead)
+                    cond.wait(lock);
+                if (fAbort || nNextRange >= UTXO_STATS_RANGES)
+                    return;
+                nRange = nNextRange++;
+            }
+            CCoinsStatsRangeRef range(new CCoinsStatsRange());
+            std::string strRangeError = "I/O error";
+            bool fOk = false;
+            try {
+                fOk = Scan(nRange, *range);
+            } catch (const std::exception& e) {
+                strRangeError = e.what();
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fOk) {
+                if (!fAbort)
+                    strError = strRangeError;
+                fAbort = true;
+            } else {
+                vRanges[nRange] = range;
+            }
+            cond.notify_all();
+        }
+    }
+
+    void Abort()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fAbort = true;
+        cond.notify_all();
+    }
+};
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
 {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    LOCK(cs_stats);
+
+    const CDBSnapshot* snapshot = db.GetSnapshot();
+    uint256 hashBlock = 0;
+    {
+        boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator(snapshot));
+        pcursor->Seek(CDBSlice("B", 1));
+        if (pcursor->Valid() && pcursor->key() == CDBSlice("B", 1)) {
+            CDBSlice slValue = pcursor->value();
+            CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+            try {
+                ssValue >> hashBlock;
+            } catch (const std::exception& e) {
+                db.ReleaseSnapshot(snapshot);
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+        }
+    }
+    if (hashBlock != 0 && hashBlock == statsCached.hashBlock) {
+        db.ReleaseSnapshot(snapshot);
+        stats = statsCached;
+        return true;
+    }
+
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_UTXO_STATS_THREADS));
+    CCoinsStatsJob job(db, snapshot, nThreads);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CCoinsStatsJob::Worker, &job));
 
+    CCoinsStats result;
+    result.hashBlock = hashBlock;
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
+    ss << hashBlock;
+    try {
+        for (int i = 0; i < UTXO_STATS_RANGES; i++) {
+            CCoinsStatsRangeRef range;
+            {
+                boost::unique_lock<boost::mutex> lock(job.mutex);
+                while (!job.vRanges[i] && !job.fAbort)
+                    job.cond.wait(lock);
+                if (!job.vRanges[i])
+                    break;
+                range.swap(job.vRanges[i]);
+                job.nHashed = i + 1;
+                job.cond.notify_all();
+            }
+            if (!range->ss.empty())
+                ss.write(&range->ss[0], range->ss.size());
+            result.nTransactions += range->nTransactions;
+            result.nTransactionOutputs += range->nTransactionOutputs;
+            result.nSerializedSize += range->nSerializedSize;
+            result.nTotalAmount += range->nTotalAmount;
+        }
+    } catch (const boost::thread_interrupted&) {
+        job.Abort();
+        threadGroup.join_all();
+        db.ReleaseSnapshot(snapshot);
+        throw;
+    }
+    job.Abort();
+    threadGroup.join_all();
+    db.ReleaseSnapshot(snapshot);
+    if (!job.strError.empty())
+        return error("%s : Deserialize or I/O error - %s", __func__, job.strError);
+
+    result.hashSerialized = ss.GetHash();
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi != mapBlockIndex.end())
+            result.nHeight = mi->second->nHeight;
+    }
+    statsCached = result;
+    stats = result;
+    return true;
+}
+
+bool CCoinsViewDB::WriteSnapshot(CAutoFile& fileout, CCoinsStats& stats) const
+{
+    const CDBSnapshot* snapshot = db.GetSnapshot();
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator(snapshot));
+    uint256 hashBlock = 0;
+    pcursor->Seek(CDBSlice("B", 1));
+    if (pcursor->Valid() && pcursor->key() == CDBSlice("B", 1)) {
+        CDBSlice slValue = pcursor->value();
+        CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> hashBlock;
+    }
+    stats = CCoinsStats();
+    stats.hashBlock = hashBlock;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end()) {
+            db.ReleaseSnapshot(snapshot);
+            return error("%s : best block %s of the UTXO set is not indexed", __func__, hashBlock.ToString());
+        }
+        stats.nHeight = mi->second->nHeight;
+    }
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashBlock;
+    bool fHaveTx = false;
+    uint256 txhashPrev = 0;
+    try {
+        fileout << std::string(UTXO_SNAPSHOT_MAGIC) << FLATDATA(Params().MessageStart()) << UTXO_SNAPSHOT_VERSION;
+        fileout << hashBlock << stats.nHeight;
+        for (pcursor->Seek(CDBSlice("o", 1)); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            CDBSlice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey.data()[0] != 'o')
+                break;
+            CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsOutputKey key;
+            ssKey >> key;
+            CDBSlice slValue = pcursor->value();
+            CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsOutputRecord record;
+            ssValue >> record;
+
+            if (!fHaveTx || key.txid != txhashPrev)
                 stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+            SerializeStatsOutput(ss, key, record, fHaveTx, txhashPrev);
+            stats.nTransactionOutputs++;
+            stats.nTotalAmount += record.out.nValue;
+            stats.nSerializedSize += slKey.size() + slValue.size();
+            fileout << true << key << record;
+        }
+        SerializeStatsEnd(ss, fHaveTx);
+        stats.hashSerialized = ss.GetHash();
+        fileout << false << stats.nTransactionOutputs << stats.hashSerialized;
+    } catch (const std::exception& e) {
+        db.ReleaseSnapshot(snapshot);
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    bool fOk = pcursor->IsOk();
+    pcursor.reset();
+    db.ReleaseSnapshot(snapshot);
+    if (!fOk)
+        return error("%s : failed to read the UTXO database", __func__);
+    return true;
+}
+
+bool CCoinsViewDB::LoadSnapshot(CAutoFile& filein, CCoinsStats& stats)
+{
+    // a chainstate at the genesis block holds no outputs, its coinbase is unspendable
+    uint256 hashBest = GetBestBlock();
+    if (hashBest != 0 && hashBest != Params().HashGenesisBlock())
+        return error("%s : the UTXO database is not empty", __func__);
+    const MapUTXOSnapshots& mapSnapshots = Params().UTXOSnapshots();
+    // erased with the best block, so that a load which stops halfway is noticed
+    if (!db.Write('S', true, true))
+        return error("%s : failed to write the UTXO snapshot", __func__);
+
+    stats = CCoinsStats();
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    bool fHaveTx = false;
+    uint256 txhashPrev = 0;
+    CCoinsOutputKey keyPrev;
+    try {
+        std::string strMagic;
+        unsigned char pchMsgTmp[4];
+        int nVersion;
+        filein >> strMagic >> FLATDATA(pchMsgTmp) >> nVersion;
+        if (strMagic != UTXO_SNAPSHOT_MAGIC || memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)) != 0)
+            return error("%s : not a UTXO snapshot of this network", __func__);
+        if (nVersion != UTXO_SNAPSHOT_VERSION)
+            return error("%s : unknown UTXO snapshot version %d", __func__, nVersion);
+        filein >> stats.hashBlock >> stats.nHeight;
+        if (!Params().MineBlocksOnDemand() && !mapSnapshots.count(stats.hashBlock))
+            return error("%s : no UTXO snapshot at block %s is known", __func__, stats.hashBlock.ToString());
+        ss << stats.hashBlock;
+
+        bool fMore;
+        filein >> fMore;
+        while (fMore) {
+            boost::this_thread::interruption_point();
+            CLevelDBBatch batch;
+            size_t nBatch = 0;
+            for (; fMore && nBatch < UTXO_SNAPSHOT_BATCH_SIZE; nBatch++) {
+                CCoinsOutputKey key;
+                CCoinsOutputRecord record;
+                filein >> key >> record;
+                // in key order, as written and as hashed by GetStats
+                if (stats.nTransactionOutputs > 0 && !(keyPrev.txid < key.txid || (keyPrev.txid == key.txid && keyPrev.n < key.n)))
+                    return error("%s : outputs out of order", __func__);
+                keyPrev = key;
+
+                if (!fHaveTx || key.txid != txhashPrev) {
+                    stats.nTransactions++;
+                    batch.Write(CoinsTxMarkerKey(key.txid), true);
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                SerializeStatsOutput(ss, key, record, fHaveTx, txhashPrev);
+                stats.nTransactionOutputs++;
+                stats.nTotalAmount += record.out.nValue;
+                batch.Write(key, record);
+                filein >> fMore;
             }
-            pcursor->Next();
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            if (!db.WriteBatch(batch))
+                return error("%s : failed to write the UTXO snapshot", __func__);
         }
+
+        uint64_t nOutputs;
+        uint256 hashSerialized;
+        filein >> nOutputs >> hashSerialized;
+        SerializeStatsEnd(ss, fHaveTx);
+        stats.hashSerialized = ss.GetHash();
+        if (nOutputs != stats.nTransactionOutputs || hashSerialized != stats.hashSerialized)
+            return error("%s : the UTXO snapshot does not match its hash", __func__);
+        if (!Params().MineBlocksOnDemand() && mapSnapshots.find(stats.hashBlock)->second != stats.hashSerialized)
+            return error("%s : the UTXO snapshot at block %s is not the known one", __func__, stats.hashBlock.ToString());
+    } catch (const std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+
+    CLevelDBBatch batch;
+    BatchWriteHashBestChain(batch, stats.hashBlock);
+    batch.Erase('S');
+    if (!db.WriteBatch(batch, true))
+        return error("%s : failed to write the UTXO snapshot", __func__);
     return true;
 }
 
@@ -174,14 +976,211 @@ bool CBlockTreeDB::ReadTxIndex(const uint256& txid, CDiskTxPos& pos)
     return Read(make_pair('t', txid), pos);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& vect)
+bool CBlockTreeDB::WriteIndexUpdate(const CIndexUpdate& update)
 {
     CLevelDBBatch batch;
-    for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = vect.begin(); it != vect.end(); it++)
+    for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = update.vTxIndex.begin(); it != update.vTxIndex.end(); it++)
         batch.Write(make_pair('t', it->first), it->second);
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = update.vAddressIndex.begin(); it != update.vAddressIndex.end(); it++)
+        batch.Write(make_pair('a', it->first), it->second);
+    for (std::vector<CAddressIndexKey>::const_iterator it = update.vAddressIndexErase.begin(); it != update.vAddressIndexErase.end(); it++)
+        batch.Erase(make_pair('a', *it));
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = update.vAddressUnspent.begin(); it != update.vAddressUnspent.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('u', it->first));
+        else
+            batch.Write(make_pair('u', it->first), it->second);
+    }
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it = update.vSpentIndex.begin(); it != update.vSpentIndex.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('p', it->first));
+        else
+            batch.Write(make_pair('p', it->first), it->second);
+    }
+    for (std::vector<CTimestampIndexKey>::const_iterator it = update.vTimestampIndex.begin(); it != update.vTimestampIndex.end(); it++)
+        batch.Write(make_pair('s', *it), '1');
+    for (std::vector<CTimestampIndexKey>::const_iterator it = update.vTimestampIndexErase.begin(); it != update.vTimestampIndexErase.end(); it++)
+        batch.Erase(make_pair('s', *it));
+    for (std::vector<std::pair<int, CPaymentIndexValue> >::const_iterator it = update.vPaymentIndex.begin(); it != update.vPaymentIndex.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('M', CPaymentIndexKey(it->first)));
+        else
+            batch.Write(make_pair('M', CPaymentIndexKey(it->first)), it->second);
+    }
+    for (std::vector<std::pair<int, CMasternodeListDiff> >::const_iterator it = update.vMasternodeListDiff.begin(); it != update.vMasternodeListDiff.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('L', CPaymentIndexKey(it->first)));
+        else
+            batch.Write(make_pair('L', CPaymentIndexKey(it->first)), it->second);
+    }
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadAddressIndex(int type, const uint160& addressHash, std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex, int nStart, int nEnd)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair('a', CAddressIndexIteratorKey(type, addressHash));
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    if (nStart > 0)
+        ssKeySet << make_pair('a', CAddressIndexIteratorKey(type, addressHash, nStart));
+    else
+        ssKeySet << make_pair('a', CAddressIndexIteratorKey(type, addressHash));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        CDBSlice slKey = pcursor->key();
+        if (!slKey.starts_with(CDBSlice(&ssPrefix[0], ssPrefix.size())))
+            break;
+        try {
+            CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType >> key;
+            if (nEnd > 0 && key.nBlockHeight > nEnd)
+                break;
+            CDBSlice slValue = pcursor->value();
+            CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAmount nValue;
+            ssValue >> nValue;
+            vAddressIndex.push_back(make_pair(key, nValue));
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndex(int type, const uint160& addressHash, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair('u', CAddressIndexIteratorKey(type, addressHash));
+    pcursor->Seek(ssPrefix.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        CDBSlice slKey = pcursor->key();
+        if (!slKey.starts_with(CDBSlice(&ssPrefix[0], ssPrefix.size())))
+            break;
+        try {
+            CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType >> key;
+            CDBSlice slValue = pcursor->value();
+            CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vUnspent.push_back(make_pair(key, value));
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    return Read(make_pair('p', key), value);
+}
+
+bool CBlockTreeDB::ReadTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('s', CTimestampIndexKey(nLow, uint256(0)));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        CDBSlice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey.data()[0] != 's')
+            break;
+        try {
+            CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CTimestampIndexKey key;
+            ssKey >> chType >> key;
+            if (key.nTimestamp >= nHigh)
+                break;
+            vHashes.push_back(key.blockHash);
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::ReadPaymentIndex(int nStart, std::vector<std::pair<int, CPaymentIndexValue> >& vPayees)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('M', CPaymentIndexKey(nStart));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        CDBSlice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey.data()[0] != 'M')
+            break;
+        try {
+            CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CPaymentIndexKey key;
+            ssKey >> chType >> key;
+            CDBSlice slValue = pcursor->value();
+            CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+            CPaymentIndexValue value;
+            ssValue >> value;
+            vPayees.push_back(make_pair(key.nHeight, value));
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::ReadMasternodeListDiff(int nHeight, CMasternodeListDiff& diff)
+{
+    return Read(make_pair('L', CPaymentIndexKey(nHeight)), diff);
+}
+
+bool CBlockTreeDB::ReadMasternodeListDiffs(int nStart, std::vector<std::pair<int, CMasternodeListDiff> >& vDiffs)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('L', CPaymentIndexKey(nStart));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        CDBSlice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey.data()[0] != 'L')
+            break;
+        try {
+            CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CPaymentIndexKey key;
+            ssKey >> chType >> key;
+            CDBSlice slValue = pcursor->value();
+            CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+            CMasternodeListDiff diff;
+            ssValue >> diff;
+            vDiffs.push_back(make_pair(key.nHeight, diff));
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string& name, bool fValue)
 {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
@@ -206,70 +1205,181 @@ bool CBlockTreeDB::ReadInt(const std::string& name, int& nValue)
     return Read(std::make_pair('I', name), nValue);
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+namespace
 {
-    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+/**
+ * LoadBlockIndexGuts splits the 'b' keyspace by the first byte of the block
+ * hash, like GetStats. Workers deserialize and check the entries of a range,
+ * the caller links them into mapBlockIndex range by range.
+ */
+static const int BLOCK_INDEX_LOAD_RANGES = 256;
 
-    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair('b', uint256(0));
-    pcursor->Seek(ssKeySet.str());
+typedef std::vector<std::pair<uint256, CDiskBlockIndex> > CBlockIndexRange;
+typedef boost::shared_ptr<CBlockIndexRange> CBlockIndexRangeRef;
 
-    // Load mapBlockIndex
-    uint256 nPreviousCheckpoint;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+class CBlockIndexLoadJob
+{
+public:
+    CLevelDBWrapper& db;
+    int nTrustedHeight;
+    std::vector<CBlockIndexRangeRef> vRanges; // set once a range is done
+    int nNextRange;   // next range for a worker to claim
+    int nLinked;      // ranges the caller has consumed
+    int nMaxAhead;    // how far workers may run ahead of the caller
+    bool fAbort;
+    std::string strError;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+
+    CBlockIndexLoadJob(CLevelDBWrapper& dbIn, int nTrustedHeightIn, int nThreads) : db(dbIn), nTrustedHeight(nTrustedHeightIn), vRanges(BLOCK_INDEX_LOAD_RANGES), nNextRange(0), nLinked(0), nMaxAhead(2 * nThreads), fAbort(false) {}
+
+    //! Read the entries of the blocks whose hash starts with byte nRange.
+    bool Scan(int nRange, CBlockIndexRange& range, std::string& strRangeError)
+    {
+        boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+        const char pchStart[2] = {'b', (char)nRange};
+        pcursor->Seek(CDBSlice(pchStart, 2));
+        for (; pcursor->Valid(); pcursor->Next()) {
+            CDBSlice slKey = pcursor->key();
+            if (slKey.size() < 2 || slKey.data()[0] != 'b' || (unsigned char)slKey.data()[1] != nRange)
+                break;
+            CMemoryReader ssKey(slKey.data(), slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
-                }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            uint256 hashBlock;
+            ssKey >> chType >> hashBlock;
+            CDBSlice slValue = pcursor->value();
+            CMemoryReader ssValue(slValue.data(), slValue.size(), SER_DISK, CLIENT_VERSION);
+            range.push_back(std::make_pair(hashBlock, CDiskBlockIndex()));
+            CDiskBlockIndex& diskindex = range.back().second;
+            ssValue >> diskindex;
+
+            // Entries are keyed by their block hash, so below the last checkpoint the
+            // key is trusted and the (expensive) header hash is not recomputed.
+            if (diskindex.nHeight > nTrustedHeight && diskindex.GetBlockHash() != hashBlock) {
+                strRangeError = strprintf("block index hash mismatch at height %d: %s", diskindex.nHeight, hashBlock.ToString());
+                return false;
+            }
+            if (diskindex.nHeight <= Params().LAST_POW_BLOCK() && !CheckProofOfWork(hashBlock, diskindex.nBits)) {
+                strRangeError = strprintf("CheckProofOfWork failed at height %d: %s", diskindex.nHeight, hashBlock.ToString());
+                return false;
+            }
+        }
+        if (!pcursor->IsOk()) {
+            strRangeError = "I/O error";
+            return false;
+        }
+        return true;
+    }
 
-                pcursor->Next();
+    void Worker()
+    {
+        while (true) {
+            int nRange;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fAbort && nNextRange < BLOCK_INDEX_LOAD_RANGES && nNextRange >= nLinked + nMaxAhead)
+                    cond.wait(lock);
+                if (fAbort || nNextRange >= BLOCK_INDEX_LOAD_RANGES)
+                    return;
+                nRange = nNextRange++;
+            }
+            CBlockIndexRangeRef range(new CBlockIndexRange());
+            std::string strRangeError;
+            bool fOk = false;
+            try {
+                fOk = Scan(nRange, *range, strRangeError);
+            } catch (const std::exception& e) {
+                strRangeError = strprintf("Deserialize or I/O error - %s", e.what());
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fOk) {
+                if (!fAbort)
+                    strError = strRangeError;
+                fAbort = true;
             } else {
-                break; // if shutdown requested or finished loading block index
+                vRanges[nRange] = range;
             }
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            cond.notify_all();
+        }
+    }
+
+    void Abort()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fAbort = true;
+        cond.notify_all();
+    }
+};
+
+void LinkBlockIndex(const uint256& hashBlock, const CDiskBlockIndex& diskindex)
+{
+    // Construct block index object
+    CBlockIndex* pindexNew = InsertBlockIndex(hashBlock);
+    pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
+    pindexNew->nHeight = diskindex.nHeight;
+    pindexNew->nFile = diskindex.nFile;
+    pindexNew->nDataPos = diskindex.nDataPos;
+    pindexNew->nUndoPos = diskindex.nUndoPos;
+    pindexNew->nVersion = diskindex.nVersion;
+    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindexNew->nTime = diskindex.nTime;
+    pindexNew->nBits = diskindex.nBits;
+    pindexNew->nNonce = diskindex.nNonce;
+    pindexNew->nStatus = diskindex.nStatus;
+    pindexNew->nTx = diskindex.nTx;
+
+    //Proof Of Stake
+    pindexNew->nMint = diskindex.nMint;
+    pindexNew->nMoneySupply = diskindex.nMoneySupply;
+    pindexNew->nFlags = diskindex.nFlags;
+    pindexNew->nStakeModifier = diskindex.nStakeModifier;
+    pindexNew->prevoutStake = diskindex.prevoutStake;
+    pindexNew->nStakeTime = diskindex.nStakeTime;
+
+    // ppcoin: build setStakeSeen
+    if (pindexNew->IsProofOfStake())
+        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+}
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    const bool fVerifyAll = GetBoolArg("-checkblockindexhashes", DEFAULT_CHECK_BLOCK_INDEX_HASHES);
+    const int nTrustedHeight = fVerifyAll ? -1 : Checkpoints::GetTotalBlocksEstimate();
+
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_BLOCK_INDEX_LOAD_THREADS));
+    CBlockIndexLoadJob job(*this, nTrustedHeight, nThreads);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CBlockIndexLoadJob::Worker, &job));
+
+    // Load mapBlockIndex
+    try {
+        for (int i = 0; i < BLOCK_INDEX_LOAD_RANGES; i++) {
+            CBlockIndexRangeRef range;
+            {
+                boost::unique_lock<boost::mutex> lock(job.mutex);
+                while (!job.vRanges[i] && !job.fAbort)
+                    job.cond.wait(lock);
+                if (!job.vRanges[i])
+                    break;
+                range.swap(job.vRanges[i]);
+                job.nLinked = i + 1;
+                job.cond.notify_all();
+            }
+            boost::this_thread::interruption_point();
+            for (CBlockIndexRange::const_iterator it = range->begin(); it != range->end(); ++it)
+                LinkBlockIndex(it->first, it->second);
         }
+    } catch (const boost::thread_interrupted&) {
+        job.Abort();
+        threadGroup.join_all();
+        throw;
     }
+    job.Abort();
+    threadGroup.join_all();
+    if (!job.strError.empty())
+        return error("LoadBlockIndex() : %s", job.strError);
 
     return true;
 }
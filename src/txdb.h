@@ -7,14 +7,19 @@
 #ifndef BITCOIN_TXDB_H
 #define BITCOIN_TXDB_H
 
+#include "addressindex.h"
 #include "leveldbwrapper.h"
 #include "main.h"
+#include "masternode-list.h"
 
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
 class CCoins;
 class uint256;
 
@@ -24,21 +29,182 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -checkblockindexhashes default
+static const bool DEFAULT_CHECK_BLOCK_INDEX_HASHES = false;
+//! Transactions converted per write while upgrading the UTXO database
+static const size_t UTXO_UPGRADE_BATCH_SIZE = 100000;
+//! Maximum number of threads summarising the UTXO set for GetStats
+static const int MAX_UTXO_STATS_THREADS = 8;
+//! Maximum number of threads reading the block index at startup
+static const int MAX_BLOCK_INDEX_LOAD_THREADS = 8;
+//! Magic message and format version of the files of dumptxoutset
+static const char* const UTXO_SNAPSHOT_MAGIC = "utxosnapshot";
+static const int UTXO_SNAPSHOT_VERSION = 1;
+//! Unspent outputs written per batch while loading a UTXO snapshot
+static const size_t UTXO_SNAPSHOT_BATCH_SIZE = 100000;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/** CCoinsView backed by the LevelDB coin database (chainstate/), one record per unspent output */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
 
+    //! GetStats result for the best block it was computed at
+    mutable CCriticalSection cs_stats;
+    mutable CCoinsStats statsCached;
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
+    //! Sorted by key, read with a single iterator that only seeks where it has to skip
+    void GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    //! BatchWrite() that leaves mapCoins as it is, so others may read it meanwhile
+    bool WriteCoins(const CCoinsMap& mapCoins, const uint256& hashBlock);
+    //! Summarise a snapshot of the database on several threads; does not need cs_main
     bool GetStats(CCoinsStats& stats) const;
+    //! Convert a database with one CCoins record per transaction to per-output records, and mark the transactions
+    bool Upgrade();
+    /**
+     * Write a snapshot of the database to fileout, with the hash of GetStats
+     * so that it can be checked against gettxoutsetinfo. stats is set to the
+     * summary of what was written. Does not need cs_main.
+     */
+    bool WriteSnapshot(CAutoFile& fileout, CCoinsStats& stats) const;
+    /**
+     * Fill an empty database from a file of WriteSnapshot. Its hash has to be
+     * the one the chain parameters give for its block. Until the best block
+     * is written, last, IsLoadingSnapshot() tells the database is unusable.
+     */
+    bool LoadSnapshot(CAutoFile& filein, CCoinsStats& stats);
+    bool IsLoadingSnapshot() const;
+
+    const CLevelDBWrapper& GetDB() const { return db; }
+};
+
+/**
+ * The coin database behind the coins written to it last, while a thread
+ * writes them. BatchWrite() freezes the dirty coins into an immutable layer
+ * and returns; reads look at the layer before the database until the write
+ * is done, so a flush does not hold up validation for the disk. A second
+ * BatchWrite() waits for the write of the first.
+ *
+ * BatchWrite() and Sync() are called with cs_main held, reads from any thread.
+ */
+class CCoinsViewWriteBehind : public CCoinsView
+{
+private:
+    CCoinsViewDB* pdb;
+
+    mutable CCriticalSection cs;
+    //! The coins being written and their best block, guarded by cs
+    boost::shared_ptr<const CCoinsMap> pmapWriting;
+    uint256 hashBlockWriting;
+    bool fWriteFailed;
+
+    boost::scoped_ptr<boost::thread> pthreadWrite;
+
+    boost::shared_ptr<const CCoinsMap> GetWriting() const;
+    void ThreadWrite(boost::shared_ptr<const CCoinsMap> pmap, uint256 hashBlock);
+
+public:
+    explicit CCoinsViewWriteBehind(CCoinsViewDB* pdbIn);
+    ~CCoinsViewWriteBehind();
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const;
+    bool HaveCoins(const uint256& txid) const;
+    void GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    //! Of the database, which may not have the coins being written yet
+    bool GetStats(CCoinsStats& stats) const;
+
+    //! Wait until the coins being written are in the database, false if the write failed
+    bool Sync();
+    bool IsWriting() const;
+};
+
+/** The chainstate database under pcoinsTip */
+extern CCoinsViewDB* pcoinsdbview;
+/** The write-behind layer over pcoinsdbview, NULL in the tests */
+extern CCoinsViewWriteBehind* pcoinswritebehind;
+
+/** Key of the payment index, big endian so the entries are in height order */
+struct CPaymentIndexKey {
+    int nHeight;
+
+    CPaymentIndexKey() : nHeight(0) {}
+    explicit CPaymentIndexKey(int nHeightIn) : nHeight(nHeightIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 4;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteIndexBE32(s, nHeight);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        nHeight = ReadIndexBE32(s);
+    }
+};
+
+/** The payee of the masternode payment of a connected block, empty if the block pays none */
+struct CPaymentIndexValue {
+    uint256 hashBlock;
+    CScript payee;
+
+    CPaymentIndexValue() : hashBlock(0) {}
+    CPaymentIndexValue(const uint256& hashBlockIn, const CScript& payeeIn) : hashBlock(hashBlockIn), payee(payeeIn) {}
+
+    bool IsNull() const { return hashBlock == 0; }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(hashBlock);
+        READWRITE(payee);
+    }
+};
+
+/**
+ * Entries that connecting or disconnecting one block adds to or removes from
+ * the transaction index and the explorer indexes. They are all written to the
+ * block tree database in one batch.
+ */
+class CIndexUpdate
+{
+public:
+    std::vector<std::pair<uint256, CDiskTxPos> > vTxIndex;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    std::vector<CAddressIndexKey> vAddressIndexErase;
+    //! A null value erases the output
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+    //! A null value erases the spend
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+    std::vector<CTimestampIndexKey> vTimestampIndex;
+    std::vector<CTimestampIndexKey> vTimestampIndexErase;
+    //! A null value erases the height
+    std::vector<std::pair<int, CPaymentIndexValue> > vPaymentIndex;
+    //! A null diff erases the height
+    std::vector<std::pair<int, CMasternodeListDiff> > vMasternodeListDiff;
+
+    bool IsEmpty() const
+    {
+        return vTxIndex.empty() && vAddressIndex.empty() && vAddressIndexErase.empty() && vAddressUnspent.empty() &&
+               vSpentIndex.empty() && vTimestampIndex.empty() && vTimestampIndexErase.empty() && vPaymentIndex.empty() &&
+               vMasternodeListDiff.empty();
+    }
 };
 
 /** Access to the block database (blocks/index/) */
@@ -60,7 +226,16 @@ public:
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool& fReindex);
     bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& list);
+    bool WriteIndexUpdate(const CIndexUpdate& update);
+    bool ReadAddressIndex(int type, const uint160& addressHash, std::vector<std::pair<CAddressIndexKey, CAmount> >& vAddressIndex, int nStart = 0, int nEnd = 0);
+    bool ReadAddressUnspentIndex(int type, const uint160& addressHash, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent);
+    bool ReadSpentIndex(const CSpentIndexKey& key, CSpentIndexValue& value);
+    bool ReadTimestampIndex(unsigned int nHigh, unsigned int nLow, std::vector<uint256>& vHashes);
+    //! Masternode payees of the blocks from nStart on, in height order
+    bool ReadPaymentIndex(int nStart, std::vector<std::pair<int, CPaymentIndexValue> >& vPayees);
+    bool ReadMasternodeListDiff(int nHeight, CMasternodeListDiff& diff);
+    //! What the blocks from nStart on changed in the masternode list, in height order
+    bool ReadMasternodeListDiffs(int nStart, std::vector<std::pair<int, CMasternodeListDiff> >& vDiffs);
     bool WriteFlag(const std::string& name, bool fValue);
     bool ReadFlag(const std::string& name, bool& fValue);
     bool WriteInt(const std::string& name, int nValue);
@@ -7,26 +7,37 @@
 #include "txmempool.h"
 
 #include "clientversion.h"
+#include "core_memusage.h"
 #include "main.h"
+#include "metrics.h"
 #include "streams.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "version.h"
 
-#include <boost/circular_buffer.hpp>
+#include <algorithm>
+#include <limits>
+#include <math.h>
 
 using namespace std;
 
-CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0)
+CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0), nFeeDelta(0), nUsageSize(0),
+                                     nCountWithAncestors(1), nSizeWithAncestors(0), nModFeesWithAncestors(0),
+                                     nCountWithDescendants(1), nSizeWithDescendants(0), nModFeesWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
 
-CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight), nFeeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
     nModSize = tx.CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(tx);
+
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nModFeesWithAncestors = nModFeesWithDescendants = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -43,108 +54,189 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount nNewFeeDelta)
+{
+    nModFeesWithAncestors += nNewFeeDelta - nFeeDelta;
+    nModFeesWithDescendants += nNewFeeDelta - nFeeDelta;
+    nFeeDelta = nNewFeeDelta;
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    nSizeWithAncestors += nModifySize;
+    assert(int64_t(nSizeWithAncestors) > 0);
+    nModFeesWithAncestors += nModifyFee;
+    nCountWithAncestors += nModifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+void CTxMemPoolEntry::SetAncestorState(uint64_t nCount, uint64_t nSize, CAmount nModFees)
+{
+    nCountWithAncestors = nCount;
+    nSizeWithAncestors = nSize;
+    nModFeesWithAncestors = nModFees;
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount)
+{
+    nSizeWithDescendants += nModifySize;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    nModFeesWithDescendants += nModifyFee;
+    nCountWithDescendants += nModifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+void CTxMemPoolEntry::SetDescendantState(uint64_t nCount, uint64_t nSize, CAmount nModFees)
+{
+    nCountWithDescendants = nCount;
+    nSizeWithDescendants = nSize;
+    nModFeesWithDescendants = nModFees;
+}
+
+//! Fee rate buckets of the estimator, in satoshis per kB, each this much above the one below
+static const double FEE_ESTIMATE_MIN_BUCKET = 1000;
+static const double FEE_ESTIMATE_MAX_BUCKET = 1e10;
+static const double FEE_ESTIMATE_BUCKET_SPACING = 1.1;
+//! Priority buckets, from well below AllowFreeThreshold()
+static const double PRIORITY_ESTIMATE_MIN_BUCKET = 1e6;
+static const double PRIORITY_ESTIMATE_MAX_BUCKET = 1e18;
+static const double PRIORITY_ESTIMATE_BUCKET_SPACING = 1.2;
+//! Weight of the samples of a block one block later, halved in about 70 blocks
+static const double FEE_ESTIMATE_DECAY = 0.99;
+//! First version that writes the bucketed estimates, older files of samples are not read
+static const int FEE_ESTIMATES_BUCKETS_VERSION = 1000808;
+
 /**
- * Keep track of fee/priority for transactions confirmed within N blocks
+ * Fee rates or priorities of confirmed transactions, counted in buckets of
+ * logarithmic width by how many blocks the transactions took to confirm.
+ * The counts decay every block, so a sample is added in constant time and
+ * old blocks fade out instead of being evicted sample by sample. The
+ * estimates for every target are worked out once per block from the counts.
  */
-class CBlockAverage
+class CConfirmHistogram
 {
 private:
-    boost::circular_buffer<CFeeRate> feeSamples;
-    boost::circular_buffer<double> prioritySamples;
-
-    template <typename T>
-    std::vector<T> buf2vec(boost::circular_buffer<T> buf) const
-    {
-        std::vector<T> vec(buf.begin(), buf.end());
-        return vec;
-    }
+    //! Upper bound of each bucket, the last one takes everything above
+    std::vector<double> vBucketBounds;
+    //! Decayed samples by blocks to confirm and bucket, and by bucket over all of them
+    std::vector<std::vector<double> > vCounts;
+    std::vector<double> vBucketCounts;
+    //! Decayed sum of the sample values in each bucket, for their average
+    std::vector<double> vBucketSums;
+    //! Per target in blocks, 0 based, -1 with too few samples
+    std::vector<double> vEstimates;
 
 public:
-    CBlockAverage() : feeSamples(100), prioritySamples(100) {}
-
-    void RecordFee(const CFeeRate& feeRate)
+    CConfirmHistogram(double dMin, double dMax, double dSpacing, int nTargets)
     {
-        feeSamples.push_back(feeRate);
+        for (double dBound = dMin; dBound < dMax; dBound *= dSpacing)
+            vBucketBounds.push_back(dBound);
+        vBucketBounds.push_back(std::numeric_limits<double>::infinity());
+        vCounts.assign(nTargets, std::vector<double>(vBucketBounds.size(), 0));
+        vBucketCounts.assign(vBucketBounds.size(), 0);
+        vBucketSums.assign(vBucketBounds.size(), 0);
+        vEstimates.assign(nTargets, -1);
     }
 
-    void RecordPriority(double priority)
+    void Record(double dValue, int nBlocksAgo)
     {
-        prioritySamples.push_back(priority);
+        size_t nBucket = std::lower_bound(vBucketBounds.begin(), vBucketBounds.end(), dValue) - vBucketBounds.begin();
+        vCounts[nBlocksAgo][nBucket]++;
+        vBucketCounts[nBucket]++;
+        vBucketSums[nBucket] += dValue;
     }
 
-    size_t FeeSamples() const { return feeSamples.size(); }
-    size_t GetFeeSamples(std::vector<CFeeRate>& insertInto) const
+    double Samples(int nBlocksAgo) const
     {
-        BOOST_FOREACH (const CFeeRate& f, feeSamples)
-            insertInto.push_back(f);
-        return feeSamples.size();
-    }
-    size_t PrioritySamples() const { return prioritySamples.size(); }
-    size_t GetPrioritySamples(std::vector<double>& insertInto) const
-    {
-        BOOST_FOREACH (double d, prioritySamples)
-            insertInto.push_back(d);
-        return prioritySamples.size();
+        double dSamples = 0;
+        BOOST_FOREACH (double dCount, vCounts[nBlocksAgo])
+            dSamples += dCount;
+        return dSamples;
     }
 
+    double Estimate(int nBlocksAgo) const { return vEstimates[nBlocksAgo]; }
+
     /**
-     * Used as belt-and-suspenders check when reading to detect
-     * file corruption
+     * Fades the counts by dDecay and works out the estimates. Estimates should
+     * not increase as the number of confirmations goes up, but confirmations
+     * happen discretely in blocks. To smooth them out, the estimate for a
+     * target is taken from all samples, highest first, at as many samples as
+     * the lower targets have plus half of those of the target.
      */
-    static bool AreSane(const CFeeRate fee, const CFeeRate& minRelayFee)
-    {
-        if (fee < CFeeRate(0))
-            return false;
-        if (fee.GetFeePerK() > minRelayFee.GetFeePerK() * 10000)
-            return false;
-        return true;
-    }
-    static bool AreSane(const std::vector<CFeeRate>& vecFee, const CFeeRate& minRelayFee)
+    void Update(double dDecay)
     {
-        BOOST_FOREACH (CFeeRate fee, vecFee) {
-            if (!AreSane(fee, minRelayFee))
-                return false;
+        std::vector<double> vTargetCounts(vCounts.size(), 0);
+        double dTotal = 0;
+        for (size_t i = 0; i < vCounts.size(); i++) {
+            BOOST_FOREACH (double& dCount, vCounts[i]) {
+                dCount *= dDecay;
+                vTargetCounts[i] += dCount;
+            }
+            dTotal += vTargetCounts[i];
         }
-        return true;
-    }
-    static bool AreSane(const double priority)
-    {
-        return priority >= 0;
-    }
-    static bool AreSane(const std::vector<double> vecPriority)
-    {
-        BOOST_FOREACH (double priority, vecPriority) {
-            if (!AreSane(priority))
-                return false;
+        for (size_t j = 0; j < vBucketCounts.size(); j++) {
+            vBucketCounts[j] *= dDecay;
+            vBucketSums[j] *= dDecay;
+        }
+
+        vEstimates.assign(vCounts.size(), -1);
+        // Eleven is Gavin's Favorite Number
+        // ... but we also take a maximum of 10 samples per block so eleven means
+        // we're getting samples from at least two different blocks
+        if (dTotal < 11)
+            return;
+
+        // the positions grow with the target, so one walk down the buckets answers all of them
+        double dPrevious = 0;
+        double dAbove = 0; // samples in the buckets above nBucket
+        size_t nBucket = vBucketCounts.size() - 1;
+        for (size_t i = 0; i < vCounts.size(); i++) {
+            double dPosition = std::min(dPrevious + vTargetCounts[i] / 2, dTotal - 1);
+            dPrevious += vTargetCounts[i];
+            while (nBucket > 0 && dAbove + vBucketCounts[nBucket] <= dPosition) {
+                dAbove += vBucketCounts[nBucket];
+                nBucket--;
+            }
+            if (vBucketCounts[nBucket] > 0)
+                vEstimates[i] = vBucketSums[nBucket] / vBucketCounts[nBucket];
         }
-        return true;
     }
 
     void Write(CAutoFile& fileout) const
     {
-        std::vector<CFeeRate> vecFee = buf2vec(feeSamples);
-        fileout << vecFee;
-        std::vector<double> vecPriority = buf2vec(prioritySamples);
-        fileout << vecPriority;
+        fileout << vBucketBounds;
+        fileout << vCounts;
+        fileout << vBucketSums;
     }
 
-    void Read(CAutoFile& filein, const CFeeRate& minRelayFee)
+    void Read(CAutoFile& filein, size_t nTargets)
     {
-        std::vector<CFeeRate> vecFee;
-        filein >> vecFee;
-        if (AreSane(vecFee, minRelayFee))
-            feeSamples.insert(feeSamples.end(), vecFee.begin(), vecFee.end());
-        else
-            throw runtime_error("Corrupt fee value in estimates file.");
-        std::vector<double> vecPriority;
-        filein >> vecPriority;
-        if (AreSane(vecPriority))
-            prioritySamples.insert(prioritySamples.end(), vecPriority.begin(), vecPriority.end());
-        else
-            throw runtime_error("Corrupt priority value in estimates file.");
-        if (feeSamples.size() + prioritySamples.size() > 0)
-            LogPrint("estimatefee", "Read %d fee samples and %d priority samples\n",
-                feeSamples.size(), prioritySamples.size());
+        std::vector<double> vFileBounds;
+        std::vector<std::vector<double> > vFileCounts;
+        std::vector<double> vFileSums;
+        filein >> vFileBounds >> vFileCounts >> vFileSums;
+        if (vFileBounds != vBucketBounds || vFileCounts.size() != nTargets || vFileSums.size() != vBucketBounds.size())
+            throw runtime_error("Estimates file buckets do not match.");
+
+        std::vector<double> vFileBucketCounts(vBucketBounds.size(), 0);
+        BOOST_FOREACH (const std::vector<double>& vTargetCounts, vFileCounts) {
+            if (vTargetCounts.size() != vBucketBounds.size())
+                throw runtime_error("Estimates file buckets do not match.");
+            for (size_t j = 0; j < vTargetCounts.size(); j++) {
+                if (!(vTargetCounts[j] >= 0))
+                    throw runtime_error("Corrupt sample count in estimates file.");
+                vFileBucketCounts[j] += vTargetCounts[j];
+            }
+        }
+        BOOST_FOREACH (double dSum, vFileSums) {
+            if (!(dSum >= 0))
+                throw runtime_error("Corrupt sample value in estimates file.");
+        }
+
+        vCounts = vFileCounts;
+        vBucketCounts = vFileBucketCounts;
+        vBucketSums = vFileSums;
+        Update(1);
     }
 };
 
@@ -152,15 +244,31 @@ class CMinerPolicyEstimator
 {
 private:
     /**
-     * Records observed averages transactions that confirmed within one block, two blocks,
+     * Records transactions that confirmed within one block, two blocks,
      * three blocks etc.
      */
-    std::vector<CBlockAverage> history;
-    std::vector<CFeeRate> sortedFeeSamples;
-    std::vector<double> sortedPrioritySamples;
+    CConfirmHistogram feeStats;
+    CConfirmHistogram priorityStats;
+    int nTargets;
 
     int nBestSeenHeight;
 
+    /**
+     * Used as belt-and-suspenders check to keep insane samples out
+     */
+    static bool AreSane(const CFeeRate fee, const CFeeRate& minRelayFee)
+    {
+        if (fee < CFeeRate(0))
+            return false;
+        if (fee.GetFeePerK() > minRelayFee.GetFeePerK() * 10000)
+            return false;
+        return true;
+    }
+    static bool AreSane(const double priority)
+    {
+        return priority >= 0;
+    }
+
     /**
      * nBlocksAgo is 0 based, i.e. transactions that confirmed in the highest seen block are
      * nBlocksAgo == 0, transactions in the block before that are nBlocksAgo == 1 etc.
@@ -168,7 +276,7 @@ private:
     void seenTxConfirm(const CFeeRate& feeRate, const CFeeRate& minRelayFee, double dPriority, int nBlocksAgo)
     {
         // Last entry records "everything else".
-        int nBlocksTruncated = min(nBlocksAgo, (int)history.size() - 1);
+        int nBlocksTruncated = min(nBlocksAgo, nTargets - 1);
         assert(nBlocksTruncated >= 0);
 
         // We need to guess why the transaction was included in a block-- either
@@ -176,11 +284,11 @@ private:
         bool sufficientFee = (feeRate > minRelayFee);
         bool sufficientPriority = AllowFree(dPriority);
         const char* assignedTo = "unassigned";
-        if (sufficientFee && !sufficientPriority && CBlockAverage::AreSane(feeRate, minRelayFee)) {
-            history[nBlocksTruncated].RecordFee(feeRate);
+        if (sufficientFee && !sufficientPriority && AreSane(feeRate, minRelayFee)) {
+            feeStats.Record(feeRate.GetFeePerK(), nBlocksTruncated);
             assignedTo = "fee";
-        } else if (sufficientPriority && !sufficientFee && CBlockAverage::AreSane(dPriority)) {
-            history[nBlocksTruncated].RecordPriority(dPriority);
+        } else if (sufficientPriority && !sufficientFee && AreSane(dPriority)) {
+            priorityStats.Record(dPriority, nBlocksTruncated);
             assignedTo = "priority";
         } else {
             // Neither or both fee and priority sufficient to get confirmed:
@@ -191,9 +299,10 @@ private:
     }
 
 public:
-    CMinerPolicyEstimator(int nEntries) : nBestSeenHeight(0)
+    CMinerPolicyEstimator(int nEntries) : feeStats(FEE_ESTIMATE_MIN_BUCKET, FEE_ESTIMATE_MAX_BUCKET, FEE_ESTIMATE_BUCKET_SPACING, nEntries),
+                                          priorityStats(PRIORITY_ESTIMATE_MIN_BUCKET, PRIORITY_ESTIMATE_MAX_BUCKET, PRIORITY_ESTIMATE_BUCKET_SPACING, nEntries),
+                                          nTargets(nEntries), nBestSeenHeight(0)
     {
-        history.resize(nEntries);
     }
 
     void seenBlock(const std::vector<CTxMemPoolEntry>& entries, int nBlockHeight, const CFeeRate minRelayFee)
@@ -211,7 +320,7 @@ public:
         // Fill up the history buckets based on how long transactions took
         // to confirm.
         std::vector<std::vector<const CTxMemPoolEntry*> > entriesByConfirmations;
-        entriesByConfirmations.resize(history.size());
+        entriesByConfirmations.resize(nTargets);
         BOOST_FOREACH (const CTxMemPoolEntry& entry, entries) {
             // How many blocks did it take for miners to include this transaction?
             int delta = nBlockHeight - entry.GetHeight();
@@ -220,8 +329,8 @@ public:
                 // to re-org on a difficulty transition point: very rare!
                 continue;
             }
-            if ((delta - 1) >= (int)history.size())
-                delta = history.size(); // Last bucket is catch-all
+            if ((delta - 1) >= nTargets)
+                delta = nTargets; // Last bucket is catch-all
             entriesByConfirmations.at(delta - 1).push_back(&entry);
         }
         for (size_t i = 0; i < entriesByConfirmations.size(); i++) {
@@ -240,16 +349,15 @@ public:
             }
         }
 
-        //After new samples are added, we have to clear the sorted lists,
-        //so they'll be resorted the next time someone asks for an estimate
-        sortedFeeSamples.clear();
-        sortedPrioritySamples.clear();
+        feeStats.Update(FEE_ESTIMATE_DECAY);
+        priorityStats.Update(FEE_ESTIMATE_DECAY);
 
-        for (size_t i = 0; i < history.size(); i++) {
-            if (history[i].FeeSamples() + history[i].PrioritySamples() > 0)
-                LogPrint("estimatefee", "estimates: for confirming within %d blocks based on %d/%d samples, fee=%s, prio=%g\n",
-                    i,
-                    history[i].FeeSamples(), history[i].PrioritySamples(),
+        for (int i = 0; i < nTargets; i++) {
+            double dFeeSamples = feeStats.Samples(i);
+            double dPrioritySamples = priorityStats.Samples(i);
+            if (dFeeSamples + dPrioritySamples > 0)
+                LogPrint("estimatefee", "estimates: for confirming within %d blocks based on %.1f/%.1f samples, fee=%s, prio=%g\n",
+                    i, dFeeSamples, dPrioritySamples,
                     estimateFee(i + 1).ToString(), estimatePriority(i + 1));
         }
     }
@@ -257,106 +365,65 @@ public:
     /**
      * Can return CFeeRate(0) if we don't have any data for that many blocks back. nBlocksToConfirm is 1 based.
      */
-    CFeeRate estimateFee(int nBlocksToConfirm)
+    CFeeRate estimateFee(int nBlocksToConfirm) const
     {
         nBlocksToConfirm--;
 
-        if (nBlocksToConfirm < 0 || nBlocksToConfirm >= (int)history.size())
+        if (nBlocksToConfirm < 0 || nBlocksToConfirm >= nTargets)
             return CFeeRate(0);
 
-        if (sortedFeeSamples.size() == 0) {
-            for (size_t i = 0; i < history.size(); i++)
-                history.at(i).GetFeeSamples(sortedFeeSamples);
-            std::sort(sortedFeeSamples.begin(), sortedFeeSamples.end(),
-                std::greater<CFeeRate>());
-        }
-        if (sortedFeeSamples.size() < 11) {
-            // Eleven is Gavin's Favorite Number
-            // ... but we also take a maximum of 10 samples per block so eleven means
-            // we're getting samples from at least two different blocks
+        double dFeePerK = feeStats.Estimate(nBlocksToConfirm);
+        if (dFeePerK < 0)
             return CFeeRate(0);
-        }
-
-        int nBucketSize = history.at(nBlocksToConfirm).FeeSamples();
-
-        // Estimates should not increase as number of confirmations goes up,
-        // but the estimates are noisy because confirmations happen discretely
-        // in blocks. To smooth out the estimates, use all samples in the history
-        // and use the nth highest where n is (number of samples in previous bucket +
-        // half the samples in nBlocksToConfirm bucket):
-        size_t nPrevSize = 0;
-        for (int i = 0; i < nBlocksToConfirm; i++)
-            nPrevSize += history.at(i).FeeSamples();
-        size_t index = min(nPrevSize + nBucketSize / 2, sortedFeeSamples.size() - 1);
-        return sortedFeeSamples[index];
+        return CFeeRate((CAmount)dFeePerK);
     }
-    double estimatePriority(int nBlocksToConfirm)
+    double estimatePriority(int nBlocksToConfirm) const
     {
         nBlocksToConfirm--;
 
-        if (nBlocksToConfirm < 0 || nBlocksToConfirm >= (int)history.size())
+        if (nBlocksToConfirm < 0 || nBlocksToConfirm >= nTargets)
             return -1;
 
-        if (sortedPrioritySamples.size() == 0) {
-            for (size_t i = 0; i < history.size(); i++)
-                history.at(i).GetPrioritySamples(sortedPrioritySamples);
-            std::sort(sortedPrioritySamples.begin(), sortedPrioritySamples.end(),
-                std::greater<double>());
-        }
-        if (sortedPrioritySamples.size() < 11)
-            return -1.0;
-
-        int nBucketSize = history.at(nBlocksToConfirm).PrioritySamples();
-
-        // Estimates should not increase as number of confirmations needed goes up,
-        // but the estimates are noisy because confirmations happen discretely
-        // in blocks. To smooth out the estimates, use all samples in the history
-        // and use the nth highest where n is (number of samples in previous buckets +
-        // half the samples in nBlocksToConfirm bucket).
-        size_t nPrevSize = 0;
-        for (int i = 0; i < nBlocksToConfirm; i++)
-            nPrevSize += history.at(i).PrioritySamples();
-        size_t index = min(nPrevSize + nBucketSize / 2, sortedPrioritySamples.size() - 1);
-        return sortedPrioritySamples[index];
+        return priorityStats.Estimate(nBlocksToConfirm);
     }
 
     void Write(CAutoFile& fileout) const
     {
         fileout << nBestSeenHeight;
-        fileout << history.size();
-        BOOST_FOREACH (const CBlockAverage& entry, history) {
-            entry.Write(fileout);
-        }
+        fileout << nTargets;
+        feeStats.Write(fileout);
+        priorityStats.Write(fileout);
     }
 
-    void Read(CAutoFile& filein, const CFeeRate& minRelayFee)
+    void Read(CAutoFile& filein)
     {
         int nFileBestSeenHeight;
         filein >> nFileBestSeenHeight;
-        size_t numEntries;
-        filein >> numEntries;
-        if (numEntries <= 0 || numEntries > 10000)
-            throw runtime_error("Corrupt estimates file. Must have between 1 and 10k entries.");
-
-        std::vector<CBlockAverage> fileHistory;
+        int nFileTargets;
+        filein >> nFileTargets;
+        if (nFileTargets != nTargets)
+            throw runtime_error("Estimates file has a different number of targets.");
 
-        for (size_t i = 0; i < numEntries; i++) {
-            CBlockAverage entry;
-            entry.Read(filein, minRelayFee);
-            fileHistory.push_back(entry);
-        }
+        // Read into copies, so that nothing changes unless the whole file is right
+        CConfirmHistogram fileFeeStats = feeStats;
+        CConfirmHistogram filePriorityStats = priorityStats;
+        fileFeeStats.Read(filein, nTargets);
+        filePriorityStats.Read(filein, nTargets);
 
-        // Now that we've processed the entire fee estimate data file and not
-        // thrown any errors, we can copy it to our history
         nBestSeenHeight = nFileBestSeenHeight;
-        history = fileHistory;
-        assert(history.size() > 0);
+        feeStats = fileFeeStats;
+        priorityStats = filePriorityStats;
     }
 };
 
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) : nTransactionsUpdated(0),
-                                                       minRelayFee(_minRelayFee)
+                                                       minRelayFee(_minRelayFee),
+                                                       totalTxSize(0),
+                                                       cachedInnerUsage(0),
+                                                       lastRollingFeeUpdate(GetTime()),
+                                                       blockSinceLastRollingFeeBump(false),
+                                                       rollingMinimumFeeRate(0)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -402,6 +469,97 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter it) const
+{
+    txlinksMap::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter it) const
+{
+    txlinksMap::const_iterator itLinks = mapLinks.find(it);
+    assert(itLinks != mapLinks.end());
+    return itLinks->second.children;
+}
+
+void CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors) const
+{
+    setEntries parents;
+    txiter it = mapTx.find(entry.GetTx().GetHash());
+    if (it != mapTx.end()) {
+        parents = GetMemPoolParents(it);
+    } else {
+        // Not in the mempool yet, so its parents have to be looked up
+        BOOST_FOREACH (const CTxIn& txin, entry.GetTx().vin) {
+            txiter piter = mapTx.find(txin.prevout.hash);
+            if (piter != mapTx.end())
+                parents.insert(piter);
+        }
+    }
+
+    while (!parents.empty()) {
+        txiter stageit = *parents.begin();
+        parents.erase(parents.begin());
+        setAncestors.insert(stageit);
+        BOOST_FOREACH (txiter phash, GetMemPoolParents(stageit)) {
+            if (!setAncestors.count(phash))
+                parents.insert(phash);
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, setEntries& setDescendants) const
+{
+    setEntries stage;
+    if (!setDescendants.count(entryit))
+        stage.insert(entryit);
+    while (!stage.empty()) {
+        txiter it = *stage.begin();
+        stage.erase(stage.begin());
+        setDescendants.insert(it);
+        BOOST_FOREACH (txiter childiter, GetMemPoolChildren(it)) {
+            if (!setDescendants.count(childiter))
+                stage.insert(childiter);
+        }
+    }
+}
+
+void CTxMemPool::UpdateAncestorStateFromScratch(txiter it)
+{
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(*it, setAncestors);
+    uint64_t nSize = it->GetTxSize();
+    CAmount nModFees = it->GetModifiedFee();
+    BOOST_FOREACH (txiter ancestorIt, setAncestors) {
+        nSize += ancestorIt->GetTxSize();
+        nModFees += ancestorIt->GetModifiedFee();
+    }
+    mapTx.modify(it, set_ancestor_state(setAncestors.size() + 1, nSize, nModFees));
+}
+
+void CTxMemPool::UpdateDescendantStateFromScratch(txiter it)
+{
+    setEntries setDescendants;
+    CalculateDescendants(it, setDescendants);
+    uint64_t nSize = 0;
+    CAmount nModFees = 0;
+    BOOST_FOREACH (txiter descendantIt, setDescendants) {
+        nSize += descendantIt->GetTxSize();
+        nModFees += descendantIt->GetModifiedFee();
+    }
+    mapTx.modify(it, set_descendant_state(setDescendants.size(), nSize, nModFees));
+}
+
+void CTxMemPool::UpdateLink(txiter entry, txiter linked, bool fParent, bool fAdd)
+{
+    setEntries& links = fParent ? mapLinks[entry].parents : mapLinks[entry].children;
+    if (fAdd && links.insert(linked).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(links);
+    else if (!fAdd && links.erase(linked))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(links);
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.
@@ -409,25 +567,122 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        std::pair<txiter, bool> ret = mapTx.insert(entry);
+        if (!ret.second)
+            return true;
+        txiter newit = ret.first;
+        mapLinks.insert(make_pair(newit, TxLinks()));
+        cachedInnerUsage += entry.DynamicMemoryUsage();
+
+        // Fee deltas set before the transaction arrived
+        std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+        if (pos != mapDeltas.end() && pos->second.second != 0)
+            mapTx.modify(newit, update_fee_delta(pos->second.second));
+
+        const CTransaction& tx = newit->GetTx();
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            txiter piter = mapTx.find(tx.vin[i].prevout.hash);
+            if (piter != mapTx.end()) {
+                UpdateLink(newit, piter, true, true);
+                UpdateLink(piter, newit, false, true);
+            }
+        }
+
+        // A transaction put back by a reorg can already have children in the
+        // pool; they and their descendants gain it and its ancestors.
+        setEntries setChildren;
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            txiter childit = mapTx.find(it->second.ptx->GetHash());
+            if (childit != mapTx.end() && childit != newit)
+                setChildren.insert(childit);
+        }
+        BOOST_FOREACH (txiter childit, setChildren) {
+            UpdateLink(newit, childit, false, true);
+            UpdateLink(childit, newit, true, true);
+        }
+
+        UpdateAncestorStateFromScratch(newit);
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(*newit, setAncestors);
+        if (setChildren.empty()) {
+            BOOST_FOREACH (txiter ancestorit, setAncestors)
+                mapTx.modify(ancestorit, update_descendant_state(newit->GetTxSize(), newit->GetModifiedFee(), 1));
+        } else {
+            setEntries setDescendants;
+            CalculateDescendants(newit, setDescendants);
+            BOOST_FOREACH (txiter descendantit, setDescendants)
+                UpdateAncestorStateFromScratch(descendantit);
+            UpdateDescendantStateFromScratch(newit);
+            BOOST_FOREACH (txiter ancestorit, setAncestors)
+                UpdateDescendantStateFromScratch(ancestorit);
+        }
+
         nTransactionsUpdated++;
         totalTxSize += entry.GetTxSize();
     }
+    metricMempoolTransactions.Set(mapTx.size());
+    metricMempoolBytes.Set(totalTxSize);
     return true;
 }
 
+void CTxMemPool::RemoveStaged(const setEntries& stage, std::list<CTransaction>& removed, bool fUpdateDescendants)
+{
+    BOOST_FOREACH (txiter removeit, stage) {
+        // Ancestors that stay in the pool lose it from their descendant state
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(*removeit, setAncestors);
+        BOOST_FOREACH (txiter ancestorit, setAncestors) {
+            if (!stage.count(ancestorit))
+                mapTx.modify(ancestorit, update_descendant_state(-(int64_t)removeit->GetTxSize(), -removeit->GetModifiedFee(), -1));
+        }
+        if (fUpdateDescendants) {
+            // and descendants that stay lose it from their ancestor state
+            setEntries setDescendants;
+            CalculateDescendants(removeit, setDescendants);
+            BOOST_FOREACH (txiter descendantit, setDescendants) {
+                if (!stage.count(descendantit))
+                    mapTx.modify(descendantit, update_ancestor_state(-(int64_t)removeit->GetTxSize(), -removeit->GetModifiedFee(), -1));
+            }
+        }
+    }
+    BOOST_FOREACH (txiter removeit, stage) {
+        BOOST_FOREACH (txiter parentit, GetMemPoolParents(removeit))
+            UpdateLink(parentit, removeit, false, false);
+        BOOST_FOREACH (txiter childit, GetMemPoolChildren(removeit))
+            UpdateLink(childit, removeit, true, false);
+    }
+    BOOST_FOREACH (txiter removeit, stage) {
+        const CTransaction& tx = removeit->GetTx();
+        BOOST_FOREACH (const CTxIn& txin, tx.vin)
+            mapNextTx.erase(txin.prevout);
+
+        removed.push_back(tx);
+        totalTxSize -= removeit->GetTxSize();
+        cachedInnerUsage -= removeit->DynamicMemoryUsage();
+        const TxLinks& links = mapLinks[removeit];
+        cachedInnerUsage -= memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+        mapLinks.erase(removeit);
+        mapTx.erase(removeit);
+        nTransactionsUpdated++;
+    }
+    metricMempoolTransactions.Set(mapTx.size());
+    metricMempoolBytes.Set(totalTxSize);
+}
 
 void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
+        setEntries txToRemove;
+        txiter origit = mapTx.find(origTx.GetHash());
+        if (origit != mapTx.end()) {
+            txToRemove.insert(origit);
+        } else if (fRecursive) {
             // If recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
             // happen during chain re-orgs if origTx isn't re-accepted into
@@ -436,31 +691,19 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
                 std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
+                txiter nextit = mapTx.find(it->second.ptx->GetHash());
+                if (nextit != mapTx.end())
+                    txToRemove.insert(nextit);
             }
         }
-        while (!txToRemove.empty()) {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
-                continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
-            }
-            BOOST_FOREACH (const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+        if (!fRecursive) {
+            RemoveStaged(txToRemove, removed, true);
+            return;
         }
+        setEntries setAllRemoves;
+        BOOST_FOREACH (txiter it, txToRemove)
+            CalculateDescendants(it, setAllRemoves);
+        RemoveStaged(setAllRemoves, removed, false);
     }
 }
 
@@ -469,10 +712,10 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned in
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -513,9 +756,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
     BOOST_FOREACH (const CTransaction& tx, vtx) {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        indexed_transaction_set::const_iterator i = mapTx.find(tx.GetHash());
+        if (i != mapTx.end())
+            entries.push_back(*i);
     }
     minerPolicyEstimator->seenBlock(entries, nBlockHeight, minRelayFee);
     BOOST_FOREACH (const CTransaction& tx, vtx) {
@@ -524,15 +767,24 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
+    metricMempoolTransactions.Set(0);
+    metricMempoolBytes.Set(0);
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -544,23 +796,28 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
     LOCK(cs);
+    assert(mapLinks.size() == mapTx.size());
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        checkTotal += it->second.GetTxSize();
-        const CTransaction& tx = it->second.GetTx();
+        checkTotal += it->GetTxSize();
+        innerUsage += it->DynamicMemoryUsage();
+        const CTransaction& tx = it->GetTx();
         bool fDependsWait = false;
+        setEntries setParentCheck;
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
+                setParentCheck.insert(it2);
             } else {
                 const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
                 assert(coins && coins->IsAvailable(txin.prevout.n));
@@ -572,8 +829,39 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        assert(setParentCheck == GetMemPoolParents(it));
+        BOOST_FOREACH (txiter childit, GetMemPoolChildren(it))
+            assert(GetMemPoolParents(childit).count(it));
+        innerUsage += memusage::DynamicUsage(GetMemPoolParents(it)) + memusage::DynamicUsage(GetMemPoolChildren(it));
+
+        // Check the ancestor state against the ancestors
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(*it, setAncestors);
+        uint64_t nSizeCheck = it->GetTxSize();
+        CAmount nFeesCheck = it->GetModifiedFee();
+        BOOST_FOREACH (txiter ancestorit, setAncestors) {
+            nSizeCheck += ancestorit->GetTxSize();
+            nFeesCheck += ancestorit->GetModifiedFee();
+        }
+        assert(it->GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->GetSizeWithAncestors() == nSizeCheck);
+        assert(it->GetModFeesWithAncestors() == nFeesCheck);
+
+        // and the descendant state against the descendants
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        nSizeCheck = 0;
+        nFeesCheck = 0;
+        BOOST_FOREACH (txiter descendantit, setDescendants) {
+            nSizeCheck += descendantit->GetTxSize();
+            nFeesCheck += descendantit->GetModifiedFee();
+        }
+        assert(it->GetCountWithDescendants() == setDescendants.size());
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetModFeesWithDescendants() == nFeesCheck);
+
         if (fDependsWait)
-            waitingOnDependants.push_back(&it->second);
+            waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state;
             CTxUndo undo;
@@ -599,15 +887,16 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     }
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
 
     assert(totalTxSize == checkTotal);
+    assert(innerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -616,19 +905,108 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::const_iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // There is no exact formula for the nodes of a boost::multi_index_container;
+    // estimate them at 16 pointers for the five indexes, plus the allocation.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 16 * sizeof(void*)) * mapTx.size() +
+           memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + cachedInnerUsage;
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(rollingMinimumFeeRate);
+
+    int64_t nTime = GetTime();
+    if (nTime > lastRollingFeeUpdate + 10) {
+        double halflife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < sizelimit / 4)
+            halflife /= 4;
+        else if (nUsage < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (nTime - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = nTime;
+
+        if (rollingMinimumFeeRate < minRelayFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(rollingMinimumFeeRate), minRelayFee);
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit)
+{
+    LOCK(cs);
+
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+
+        // The new minimum is the fee rate of the evicted package plus the
+        // relay fee, so that what was just evicted cannot come straight back
+        // in before a block has been connected.
+        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        removed = CFeeRate(removed.GetFeePerK() + minRelayFee.GetFeePerK());
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        setEntries stage;
+        CalculateDescendants(mapTx.project<0>(it), stage);
+        nTxnRemoved += stage.size();
+        std::list<CTransaction> txn;
+        RemoveStaged(stage, txn, false);
+    }
+
+    if (maxFeeRateRemoved > CFeeRate(0))
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
+
+int CTxMemPool::Expire(int64_t time)
+{
+    LOCK(cs);
+    indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
+    setEntries toremove;
+    while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
+        toremove.insert(mapTx.project<0>(it));
+        it++;
+    }
+    setEntries stage;
+    BOOST_FOREACH (txiter removeit, toremove)
+        CalculateDescendants(removeit, stage);
+    std::list<CTransaction> removed;
+    RemoveStaged(stage, removed, false);
+    return stage.size();
+}
+
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
     LOCK(cs);
@@ -644,8 +1022,8 @@ bool CTxMemPool::WriteFeeEstimates(CAutoFile& fileout) const
 {
     try {
         LOCK(cs);
-        fileout << 120000;         // version required to read: 0.12.00 or later
-        fileout << CLIENT_VERSION; // version that wrote the file
+        fileout << FEE_ESTIMATES_BUCKETS_VERSION; // version required to read
+        fileout << CLIENT_VERSION;                // version that wrote the file
         minerPolicyEstimator->Write(fileout);
     } catch (const std::exception&) {
         LogPrintf("CTxMemPool::WriteFeeEstimates() : unable to write policy estimator data (non-fatal)");
@@ -661,9 +1039,13 @@ bool CTxMemPool::ReadFeeEstimates(CAutoFile& filein)
         filein >> nVersionRequired >> nVersionThatWrote;
         if (nVersionRequired > CLIENT_VERSION)
             return error("CTxMemPool::ReadFeeEstimates() : up-version (%d) fee estimate file", nVersionRequired);
+        if (nVersionRequired < FEE_ESTIMATES_BUCKETS_VERSION) {
+            LogPrintf("CTxMemPool::ReadFeeEstimates() : fee estimate file of samples from version %d, starting over\n", nVersionThatWrote);
+            return true;
+        }
 
         LOCK(cs);
-        minerPolicyEstimator->Read(filein, minRelayFee);
+        minerPolicyEstimator->Read(filein);
     } catch (const std::exception&) {
         LogPrintf("CTxMemPool::ReadFeeEstimates() : unable to read policy estimator data (non-fatal)");
         return false;
@@ -678,6 +1060,23 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount>& deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        // Block templates have to pick the new priority up
+        ++nTransactionsUpdated;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end() && nFeeDelta != 0) {
+            mapTx.modify(it, update_fee_delta(deltas.second));
+            // Descendants count this fee as part of their ancestor state
+            setEntries setDescendants;
+            CalculateDescendants(it, setDescendants);
+            setDescendants.erase(it);
+            BOOST_FOREACH (txiter descendantit, setDescendants)
+                mapTx.modify(descendantit, update_ancestor_state(0, nFeeDelta, 0));
+            // and ancestors as part of their descendant state
+            setEntries setAncestors;
+            CalculateMemPoolAncestors(*it, setAncestors);
+            BOOST_FOREACH (txiter ancestorit, setAncestors)
+                mapTx.modify(ancestorit, update_descendant_state(0, nFeeDelta, 0));
+        }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -719,3 +1118,77 @@ bool CCoinsViewMemPool::HaveCoins(const uint256& txid) const
 {
     return mempool.exists(txid) || base->HaveCoins(txid);
 }
+
+void CCoinsViewMemPool::GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const
+{
+    vCoins.assign(vTxids.size(), CCoins());
+    vFound.assign(vTxids.size(), false);
+    std::vector<uint256> vMisses;
+    std::vector<unsigned int> vMissIndex;
+    for (unsigned int i = 0; i < vTxids.size(); i++) {
+        CTransaction tx;
+        if (mempool.lookup(vTxids[i], tx)) {
+            vCoins[i] = CCoins(tx, MEMPOOL_HEIGHT);
+            vFound[i] = true;
+        } else {
+            vMisses.push_back(vTxids[i]);
+            vMissIndex.push_back(i);
+        }
+    }
+    if (vMisses.empty())
+        return;
+
+    std::vector<CCoins> vCoinsBase;
+    std::vector<bool> vFoundBase;
+    base->GetCoinsBatch(vMisses, vCoinsBase, vFoundBase);
+    for (unsigned int i = 0; i < vMisses.size(); i++) {
+        if (vFoundBase[i] && !vCoinsBase[i].IsPruned()) {
+            vCoins[vMissIndex[i]].swap(vCoinsBase[i]);
+            vFound[vMissIndex[i]] = true;
+        }
+    }
+}
+
+void CDisconnectedBlockTransactions::AddBlock(const std::vector<CTransaction>& vtx)
+{
+    std::list<CTransaction>::iterator itNext = queuedTx.begin();
+    BOOST_FOREACH (const CTransaction& tx, vtx) {
+        if (tx.IsCoinBase() || tx.IsCoinStake())
+            continue;
+        std::list<CTransaction>::iterator it = queuedTx.insert(itNext, tx);
+        mapQueued[tx.GetHash()] = it;
+        nUsage += RecursiveDynamicUsage(tx);
+    }
+}
+
+void CDisconnectedBlockTransactions::RemoveForBlock(const std::vector<CTransaction>& vtx)
+{
+    if (queuedTx.empty())
+        return;
+    BOOST_FOREACH (const CTransaction& tx, vtx) {
+        std::map<uint256, std::list<CTransaction>::iterator>::iterator it = mapQueued.find(tx.GetHash());
+        if (it == mapQueued.end())
+            continue;
+        nUsage -= RecursiveDynamicUsage(*it->second);
+        queuedTx.erase(it->second);
+        mapQueued.erase(it);
+    }
+}
+
+void CDisconnectedBlockTransactions::TrimToSize(size_t nMaxUsage, std::list<CTransaction>& removed)
+{
+    while (!queuedTx.empty() && nUsage > nMaxUsage) {
+        const CTransaction& tx = queuedTx.front();
+        nUsage -= RecursiveDynamicUsage(tx);
+        mapQueued.erase(tx.GetHash());
+        removed.push_back(tx);
+        queuedTx.pop_front();
+    }
+}
+
+void CDisconnectedBlockTransactions::clear()
+{
+    queuedTx.clear();
+    mapQueued.clear();
+    nUsage = 0;
+}
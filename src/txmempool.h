@@ -8,12 +8,20 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <map>
+#include <set>
+#include <vector>
 
 #include "amount.h"
 #include "coins.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index_container.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -34,6 +42,14 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
  * CTxMemPool stores these:
+ *
+ * Besides the transaction itself, each entry tracks the state of its
+ * in-mempool ancestors, this transaction included: how many there are, their
+ * total size and their total modified fee. The mempool keeps it up to date as
+ * transactions enter and leave, so block assembly can rank a transaction by
+ * the fee rate of the package it would bring into the block. The same state
+ * is kept for the descendants, which leave the pool together with the
+ * transaction when it is evicted.
  */
 class CTxMemPoolEntry
 {
@@ -45,6 +61,16 @@ private:
     int64_t nTime;        //! Local time when entering the mempool
     double dPriority;     //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    CAmount nFeeDelta;    //! Fee adjustment from PrioritiseTransaction
+    size_t nUsageSize;    //! ... and total memory usage
+
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight);
@@ -54,11 +80,178 @@ public:
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    void UpdateFeeDelta(CAmount nNewFeeDelta);
+    void UpdateAncestorState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+    void SetAncestorState(uint64_t nCount, uint64_t nSize, CAmount nModFees);
+    void UpdateDescendantState(int64_t nModifySize, CAmount nModifyFee, int64_t nModifyCount);
+    void SetDescendantState(uint64_t nCount, uint64_t nSize, CAmount nModFees);
 };
 
+// Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
+struct update_fee_delta {
+    update_fee_delta(CAmount _nFeeDelta) : nFeeDelta(_nFeeDelta) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateFeeDelta(nFeeDelta); }
+
+private:
+    CAmount nFeeDelta;
+};
+
+struct update_ancestor_state {
+    update_ancestor_state(int64_t _nModifySize, CAmount _nModifyFee, int64_t _nModifyCount) : nModifySize(_nModifySize), nModifyFee(_nModifyFee), nModifyCount(_nModifyCount) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateAncestorState(nModifySize, nModifyFee, nModifyCount); }
+
+private:
+    int64_t nModifySize;
+    CAmount nModifyFee;
+    int64_t nModifyCount;
+};
+
+struct update_descendant_state {
+    update_descendant_state(int64_t _nModifySize, CAmount _nModifyFee, int64_t _nModifyCount) : nModifySize(_nModifySize), nModifyFee(_nModifyFee), nModifyCount(_nModifyCount) {}
+    void operator()(CTxMemPoolEntry& e) { e.UpdateDescendantState(nModifySize, nModifyFee, nModifyCount); }
+
+private:
+    int64_t nModifySize;
+    CAmount nModifyFee;
+    int64_t nModifyCount;
+};
+
+struct set_descendant_state {
+    set_descendant_state(uint64_t _nCount, uint64_t _nSize, CAmount _nModFees) : nCount(_nCount), nSize(_nSize), nModFees(_nModFees) {}
+    void operator()(CTxMemPoolEntry& e) { e.SetDescendantState(nCount, nSize, nModFees); }
+
+private:
+    uint64_t nCount;
+    uint64_t nSize;
+    CAmount nModFees;
+};
+
+struct set_ancestor_state {
+    set_ancestor_state(uint64_t _nCount, uint64_t _nSize, CAmount _nModFees) : nCount(_nCount), nSize(_nSize), nModFees(_nModFees) {}
+    void operator()(CTxMemPoolEntry& e) { e.SetAncestorState(nCount, nSize, nModFees); }
+
+private:
+    uint64_t nCount;
+    uint64_t nSize;
+    CAmount nModFees;
+};
+
+/** Extracts a transaction hash from a CTxMemPoolEntry */
+struct mempoolentry_txid {
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry& entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/** Sort by modified fee rate, highest first */
+class CompareTxMemPoolEntryByFeeRate
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
+        double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/** Sort by the fee rate of the transaction together with its in-mempool ancestors, highest first */
+class CompareTxMemPoolEntryByAncestorScore
+{
+public:
+    template <typename T>
+    bool operator()(const T& a, const T& b) const
+    {
+        double f1 = (double)a.GetModFeesWithAncestors() * b.GetSizeWithAncestors();
+        double f2 = (double)b.GetModFeesWithAncestors() * a.GetSizeWithAncestors();
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/**
+ * Sort by the better of the fee rate of the transaction and the fee rate of
+ * the transaction together with its in-mempool descendants, lowest first.
+ * Eviction takes the first entry, so a parent that is paid for by a child
+ * ranks no lower than the child.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        bool fUseADescendants = UseDescendantScore(a);
+        bool fUseBDescendants = UseDescendantScore(b);
+
+        double aModFee = fUseADescendants ? a.GetModFeesWithDescendants() : a.GetModifiedFee();
+        double aSize = fUseADescendants ? a.GetSizeWithDescendants() : a.GetTxSize();
+        double bModFee = fUseBDescendants ? b.GetModFeesWithDescendants() : b.GetModifiedFee();
+        double bSize = fUseBDescendants ? b.GetSizeWithDescendants() : b.GetTxSize();
+
+        double f1 = aModFee * bSize;
+        double f2 = aSize * bModFee;
+        if (f1 == f2) {
+            // Of two equal packages the newer one goes first
+            if (a.GetTime() != b.GetTime())
+                return a.GetTime() > b.GetTime();
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        }
+        return f1 < f2;
+    }
+
+    // Whether the descendant fee rate is the better one
+    bool UseDescendantScore(const CTxMemPoolEntry& a) const
+    {
+        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
+        double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
+        return f2 > f1;
+    }
+};
+
+/** Sort by the time the transaction entered the mempool, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+// Multi_index tags for the indexes of CTxMemPool::mapTx
+struct fee_rate {
+};
+struct entry_time {
+};
+struct ancestor_score {
+};
+struct descendant_score {
+};
+
+/** Default for -maxmempool, the memory the mempool may use in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, the hours after which a transaction leaves the mempool */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+
 class CMinerPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -101,10 +294,77 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate; //! minimum fee to get into the pool, decreases exponentially
+
+    void trackPackageRemoved(const CFeeRate& rate);
+
+public:
+    //! Halflife of the rolling minimum fee in seconds, while the pool is at least half full
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+    /**
+     * mapTx is indexed by txid, by modified fee rate, by entry time, by
+     * ancestor score and by descendant score. Block assembly walks the
+     * ancestor score, eviction the descendant score; see CTxMemPoolEntry for
+     * the state they are computed from.
+     */
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::hashed_unique<mempoolentry_txid, CCoinsKeyHasher>,
+            // sorted by modified fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<fee_rate>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByFeeRate>,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime>,
+            // sorted by ancestor score
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorScore>,
+            // sorted by descendant score
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore> > >
+        indexed_transaction_set;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
+private:
+    /** The in-mempool parents and children of a mempool transaction */
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateAncestorStateFromScratch(txiter it);
+    void UpdateDescendantStateFromScratch(txiter it);
+    void UpdateLink(txiter entry, txiter linked, bool fParent, bool fAdd);
+    void RemoveStaged(const setEntries& stage, std::list<CTransaction>& removed, bool fUpdateDescendants);
 
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
@@ -121,6 +381,12 @@ public:
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
+    /** The in-mempool transactions that entry spends from, directly or indirectly (cs must be held) */
+    void CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors) const;
+    /** Add it and its in-mempool descendants to setDescendants (cs must be held) */
+    void CalculateDescendants(txiter it, setEntries& setDescendants) const;
+    const setEntries& GetMemPoolParents(txiter it) const;
+    const setEntries& GetMemPoolChildren(txiter it) const;
     void remove(const CTransaction& tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed);
@@ -136,6 +402,21 @@ public:
     void ApplyDeltas(const uint256 hash, double& dPriorityDelta, CAmount& nFeeDelta);
     void ClearPrioritisation(const uint256 hash);
 
+    /**
+     * Evict the packages with the lowest descendant score until the pool
+     * uses no more than sizelimit bytes, and raise the rolling minimum fee
+     * above the fee rate of what was evicted.
+     */
+    void TrimToSize(size_t sizelimit);
+    /** Remove the transactions that entered before time, and their descendants. Returns their number. */
+    int Expire(int64_t time);
+    /**
+     * The fee rate a transaction needs to get into the pool. It is raised
+     * by TrimToSize and decays with ROLLING_FEE_HALFLIFE once a block has
+     * been connected, faster while the pool is far from sizelimit.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
     unsigned long size()
     {
         LOCK(cs);
@@ -155,6 +436,8 @@ public:
 
     bool lookup(uint256 hash, CTransaction& result) const;
 
+    size_t DynamicMemoryUsage() const;
+
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 
@@ -179,6 +462,41 @@ public:
     CCoinsViewMemPool(CCoinsView* baseIn, CTxMemPool& mempoolIn);
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
+    void GetCoinsBatch(const std::vector<uint256>& vTxids, std::vector<CCoins>& vCoins, std::vector<bool>& vFound) const;
+};
+
+//! Memory the transactions of disconnected blocks may take before the oldest are dropped
+static const size_t MAX_DISCONNECTED_TX_POOL_SIZE = 20 * 1000 * 1000;
+
+/**
+ * The transactions of the blocks disconnected during a reorganization,
+ * waiting to go back into the mempool once the new blocks are connected.
+ * Blocks are disconnected newest first, and each one's transactions are
+ * queued ahead of those already there, so the queue is in chain order and
+ * parents come before their children. Transactions that a new block confirms
+ * again are taken out and never validated twice.
+ */
+class CDisconnectedBlockTransactions
+{
+private:
+    std::list<CTransaction> queuedTx;
+    std::map<uint256, std::list<CTransaction>::iterator> mapQueued;
+    size_t nUsage;
+
+public:
+    CDisconnectedBlockTransactions() : nUsage(0) {}
+
+    /** Queue the transactions of a block, but its coinbase and coinstake, ahead of the others */
+    void AddBlock(const std::vector<CTransaction>& vtx);
+    /** Forget the transactions a newly connected block confirms */
+    void RemoveForBlock(const std::vector<CTransaction>& vtx);
+    /** Take out the oldest transactions while above nMaxUsage bytes */
+    void TrimToSize(size_t nMaxUsage, std::list<CTransaction>& removed);
+
+    const std::list<CTransaction>& GetQueued() const { return queuedTx; }
+    size_t size() const { return queuedTx.size(); }
+    bool empty() const { return queuedTx.empty(); }
+    void clear();
 };
 
 #endif // BITCOIN_TXMEMPOOL_H
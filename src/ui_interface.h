@@ -13,6 +13,7 @@
 #include <boost/signals2/signal.hpp>
 
 class CBasicKeyStore;
+class COutPoint;
 class CWallet;
 class uint256;
 
@@ -107,6 +108,9 @@ public:
 
     /** Banlist did change. */
     boost::signals2::signal<void (void)> BannedListChanged;
+
+    /** Masternode added to, updated in (broadcast, ping or state) or removed from the list */
+    boost::signals2::signal<void(const COutPoint& outpoint, ChangeType status)> NotifyMasternodeChanged;
 };
 
 extern CClientUIInterface uiInterface;
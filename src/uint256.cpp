@@ -70,9 +70,40 @@ base_uint<BITS>& base_uint<BITS>::operator*=(uint32_t b32)
     return *this;
 }
 
+#ifdef __SIZEOF_INT128__
+// The limbs two at a time, for the 64x64->128 bit multiplication of the CPU.
+// With an odd nWidth the top 64 bit limb has a zero high half.
+static inline void LoadLimbs64(uint64_t* x, const uint32_t* pn, int nWidth)
+{
+    for (int i = 0; i < nWidth; i += 2)
+        x[i / 2] = pn[i] | (i + 1 < nWidth ? (uint64_t)pn[i + 1] << 32 : 0);
+}
+
+static inline void StoreLimbs64(uint32_t* pn, const uint64_t* x, int nWidth)
+{
+    for (int i = 0; i < nWidth; i++)
+        pn[i] = x[i / 2] >> (32 * (i & 1));
+}
+#endif
+
 template <unsigned int BITS>
 base_uint<BITS>& base_uint<BITS>::operator*=(const base_uint& b)
 {
+#ifdef __SIZEOF_INT128__
+    enum { LIMBS64 = (WIDTH + 1) / 2 };
+    uint64_t x[LIMBS64], y[LIMBS64], r[LIMBS64] = {0};
+    LoadLimbs64(x, pn, WIDTH);
+    LoadLimbs64(y, b.pn, WIDTH);
+    for (int j = 0; j < LIMBS64; j++) {
+        uint64_t carry = 0;
+        for (int i = 0; i + j < LIMBS64; i++) {
+            unsigned __int128 n = (unsigned __int128)x[j] * y[i] + r[i + j] + carry;
+            r[i + j] = (uint64_t)n;
+            carry = n >> 64;
+        }
+    }
+    StoreLimbs64(pn, r, WIDTH);
+#else
     base_uint<BITS> a = *this;
     *this = 0;
     for (int j = 0; j < WIDTH; j++) {
@@ -83,32 +114,114 @@ base_uint<BITS>& base_uint<BITS>::operator*=(const base_uint& b)
             carry = n >> 32;
         }
     }
+#endif
     return *this;
 }
 
+template <unsigned int BITS>
+base_uint<BITS>& base_uint<BITS>::MulU64(uint64_t b64)
+{
+#ifdef __SIZEOF_INT128__
+    enum { LIMBS64 = (WIDTH + 1) / 2 };
+    uint64_t x[LIMBS64];
+    LoadLimbs64(x, pn, WIDTH);
+    uint64_t carry = 0;
+    for (int i = 0; i < LIMBS64; i++) {
+        unsigned __int128 n = (unsigned __int128)x[i] * b64 + carry;
+        x[i] = (uint64_t)n;
+        carry = n >> 64;
+    }
+    StoreLimbs64(pn, x, WIDTH);
+#else
+    base_uint<BITS> high = *this;
+    *this *= (uint32_t)b64;
+    high *= (uint32_t)(b64 >> 32);
+    *this += high << 32;
+#endif
+    return *this;
+}
+
+/**
+ * Long division a 32 bit digit at a time (Knuth, TAOCP vol. 2, 4.3.1,
+ * algorithm D, as in Hacker's Delight divmnu), instead of a bit at a time.
+ */
 template <unsigned int BITS>
 base_uint<BITS>& base_uint<BITS>::operator/=(const base_uint& b)
 {
-    base_uint<BITS> div = b;     // make a copy, so we can shift.
-    base_uint<BITS> num = *this; // make a copy, so we can subtract.
-    *this = 0;                   // the quotient.
-    int num_bits = num.bits();
-    int div_bits = div.bits();
-    if (div_bits == 0)
+    int n = WIDTH;
+    while (n > 0 && b.pn[n - 1] == 0)
+        n--;
+    if (n == 0)
         throw uint_error("Division by zero");
-    if (div_bits > num_bits) // the result is certainly 0.
+    int m = WIDTH;
+    while (m > 0 && pn[m - 1] == 0)
+        m--;
+    if (m < n) { // the result is certainly 0.
+        *this = 0;
         return *this;
-    int shift = num_bits - div_bits;
-    div <<= shift; // shift so that div and nun align.
-    while (shift >= 0) {
-        if (num >= div) {
-            num -= div;
-            pn[shift / 32] |= (1 << (shift & 31)); // set a bit of the result.
+    }
+
+    uint32_t q[WIDTH] = {0};
+    if (n == 1) {
+        uint64_t rem = 0;
+        for (int i = m - 1; i >= 0; i--) {
+            uint64_t cur = (rem << 32) | pn[i];
+            q[i] = cur / b.pn[0];
+            rem = cur % b.pn[0];
+        }
+    } else {
+        // Normalize, so that the top digit of the divisor has its high bit set
+        int s = 0;
+        while (!(b.pn[n - 1] & (0x80000000U >> s)))
+            s++;
+        uint32_t vn[WIDTH], un[WIDTH + 1];
+        for (int i = n - 1; i > 0; i--)
+            vn[i] = (b.pn[i] << s) | (uint32_t)((uint64_t)b.pn[i - 1] >> (32 - s));
+        vn[0] = b.pn[0] << s;
+        un[m] = (uint32_t)((uint64_t)pn[m - 1] >> (32 - s));
+        for (int i = m - 1; i > 0; i--)
+            un[i] = (pn[i] << s) | (uint32_t)((uint64_t)pn[i - 1] >> (32 - s));
+        un[0] = pn[0] << s;
+
+        for (int j = m - n; j >= 0; j--) {
+            // Estimate the quotient digit from the top two digits, it is at most 2 too high
+            uint64_t num = ((uint64_t)un[j + n] << 32) | un[j + n - 1];
+            uint64_t qhat = num / vn[n - 1];
+            uint64_t rhat = num % vn[n - 1];
+            while (qhat >> 32 || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2])) {
+                qhat--;
+                rhat += vn[n - 1];
+                if (rhat >> 32)
+                    break;
+            }
+
+            // Multiply and subtract
+            int64_t k = 0, t;
+            for (int i = 0; i < n; i++) {
+                uint64_t p = qhat * vn[i];
+                t = (int64_t)un[i + j] - k - (int64_t)(p & 0xffffffff);
+                un[i + j] = (uint32_t)t;
+                k = (int64_t)(p >> 32) - (t >> 32);
+            }
+            t = (int64_t)un[j + n] - k;
+            un[j + n] = (uint32_t)t;
+
+            // Subtracted too much: add back
+            if (t < 0) {
+                qhat--;
+                uint64_t carry = 0;
+                for (int i = 0; i < n; i++) {
+                    uint64_t sum = (uint64_t)un[i + j] + vn[i] + carry;
+                    un[i + j] = (uint32_t)sum;
+                    carry = sum >> 32;
+                }
+                un[j + n] += carry;
+            }
+            q[j] = qhat;
         }
-        div >>= 1; // shift back.
-        shift--;
     }
-    // num now contains the remainder of the division.
+    for (int i = 0; i < WIDTH; i++)
+        pn[i] = q[i];
     return *this;
 }
 
@@ -231,6 +344,7 @@ template base_uint<160>& base_uint<160>::operator<<=(unsigned int);
 template base_uint<160>& base_uint<160>::operator>>=(unsigned int);
 template base_uint<160>& base_uint<160>::operator*=(uint32_t b32);
 template base_uint<160>& base_uint<160>::operator*=(const base_uint<160>& b);
+template base_uint<160>& base_uint<160>::MulU64(uint64_t b64);
 template base_uint<160>& base_uint<160>::operator/=(const base_uint<160>& b);
 template int base_uint<160>::CompareTo(const base_uint<160>&) const;
 template bool base_uint<160>::EqualTo(uint64_t) const;
@@ -248,6 +362,7 @@ template base_uint<256>& base_uint<256>::operator<<=(unsigned int);
 template base_uint<256>& base_uint<256>::operator>>=(unsigned int);
 template base_uint<256>& base_uint<256>::operator*=(uint32_t b32);
 template base_uint<256>& base_uint<256>::operator*=(const base_uint<256>& b);
+template base_uint<256>& base_uint<256>::MulU64(uint64_t b64);
 template base_uint<256>& base_uint<256>::operator/=(const base_uint<256>& b);
 template int base_uint<256>::CompareTo(const base_uint<256>&) const;
 template bool base_uint<256>::EqualTo(uint64_t) const;
@@ -184,6 +184,8 @@ public:
 
     base_uint& operator*=(uint32_t b32);
     base_uint& operator*=(const base_uint& b);
+    //! The same as *= base_uint(b64), without the products of its zero limbs
+    base_uint& MulU64(uint64_t b64);
     base_uint& operator/=(const base_uint& b);
 
     base_uint& operator++()
@@ -410,4 +412,7 @@ inline uint512 uint512S(const std::string& str)
     return rv;
 }
 
+// Vectors of these are serialized as their memory image (is_serialized_as_bytes)
+static_assert(sizeof(uint160) == 20 && sizeof(uint256) == 32 && sizeof(uint512) == 64, "unexpected padding in uint160, uint256 or uint512");
+
 #endif // BITCOIN_UINT256_H
@@ -47,7 +47,6 @@ public:
         std::string s(val_);
         setStr(s);
     }
-    ~UniValue() {}
 
     void clear();
 
@@ -133,8 +132,17 @@ public:
     }
     bool pushKVs(const UniValue& obj);
 
+    // Receives the JSON text of a value piece by piece
+    class Sink {
+    public:
+        virtual ~Sink() {}
+        virtual void append(const char *data, size_t len) = 0;
+    };
+
     std::string write(unsigned int prettyIndent = 0,
                       unsigned int indentLevel = 0) const;
+    void write(Sink& sink, unsigned int prettyIndent = 0,
+               unsigned int indentLevel = 0) const;
 
     bool read(const char *raw, size_t len);
     bool read(const char *raw);
@@ -149,8 +157,8 @@ private:
     std::vector<UniValue> values;
 
     bool findKey(const std::string& key, size_t& retIdx) const;
-    void writeArray(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
-    void writeObject(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
+    void writeArray(unsigned int prettyIndent, unsigned int indentLevel, Sink& sink) const;
+    void writeObject(unsigned int prettyIndent, unsigned int indentLevel, Sink& sink) const;
 
 public:
     // Strict type-specific getters, these throw std::runtime_error if the
@@ -114,8 +114,6 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
     case '8':
     case '9': {
         // part 1: int
-        string numStr;
-
         const char *first = raw;
 
         const char *firstDigit = first;
@@ -124,49 +122,38 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
         if ((*firstDigit == '0') && json_isdigit(firstDigit[1]))
             return JTOK_ERR;
 
-        numStr += *raw;                       // copy first char
-        raw++;
+        raw++;                                // skip first char
 
         if ((*first == '-') && (raw < end) && (!json_isdigit(*raw)))
             return JTOK_ERR;
 
-        while (raw < end && json_isdigit(*raw)) {  // copy digits
-            numStr += *raw;
+        while (raw < end && json_isdigit(*raw))  // skip digits
             raw++;
-        }
 
         // part 2: frac
         if (raw < end && *raw == '.') {
-            numStr += *raw;                   // copy .
-            raw++;
+            raw++;                            // skip .
 
             if (raw >= end || !json_isdigit(*raw))
                 return JTOK_ERR;
-            while (raw < end && json_isdigit(*raw)) { // copy digits
-                numStr += *raw;
+            while (raw < end && json_isdigit(*raw)) // skip digits
                 raw++;
-            }
         }
 
         // part 3: exp
         if (raw < end && (*raw == 'e' || *raw == 'E')) {
-            numStr += *raw;                   // copy E
-            raw++;
+            raw++;                            // skip E
 
-            if (raw < end && (*raw == '-' || *raw == '+')) { // copy +/-
-                numStr += *raw;
+            if (raw < end && (*raw == '-' || *raw == '+')) // skip +/-
                 raw++;
-            }
 
             if (raw >= end || !json_isdigit(*raw))
                 return JTOK_ERR;
-            while (raw < end && json_isdigit(*raw)) { // copy digits
-                numStr += *raw;
+            while (raw < end && json_isdigit(*raw)) // skip digits
                 raw++;
-            }
         }
 
-        tokenVal = numStr;
+        tokenVal.assign(first, raw);
         consumed = (raw - rawStart);
         return JTOK_NUMBER;
         }
@@ -174,8 +161,19 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
     case '"': {
         raw++;                                // skip "
 
-        string valStr;
-        JSONUTF8StringFilter writer(valStr);
+        // plain ASCII without escapes, the common case, is copied at once
+        const char *plain = raw;
+        while (plain < end && *plain != '"' && *plain != '\\' &&
+               (unsigned char)*plain >= 0x20 && (unsigned char)*plain < 0x80)
+            plain++;
+        if (plain < end && *plain == '"') {
+            tokenVal.assign(raw, plain);
+            raw = plain + 1;                  // skip "
+            consumed = (raw - rawStart);
+            return JTOK_STRING;
+        }
+
+        JSONUTF8StringFilter writer(tokenVal);
 
         while (true) {
             if (raw >= end || (unsigned char)*raw < 0x20)
@@ -228,7 +226,6 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
 
         if (!writer.finalize())
             return JTOK_ERR;
-        tokenVal = valStr;
         consumed = (raw - rawStart);
         return JTOK_STRING;
         }
@@ -317,9 +314,8 @@ bool UniValue::read(const char *raw, size_t size)
                     setArray();
                 stack.push_back(this);
             } else {
-                UniValue tmpVal(utyp);
                 UniValue *top = stack.back();
-                top->values.push_back(tmpVal);
+                top->values.push_back(UniValue(utyp));
 
                 UniValue *newTop = &(top->values.back());
                 stack.push_back(newTop);
@@ -403,14 +399,15 @@ bool UniValue::read(const char *raw, size_t size)
             }
 
         case JTOK_NUMBER: {
-            UniValue tmpVal(VNUM, tokenVal);
             if (!stack.size()) {
-                *this = tmpVal;
+                typ = VNUM;
+                val.swap(tokenVal);
                 break;
             }
 
             UniValue *top = stack.back();
-            top->values.push_back(tmpVal);
+            top->values.push_back(UniValue(VNUM));
+            top->values.back().val.swap(tokenVal);
 
             setExpect(NOT_VALUE);
             break;
@@ -419,17 +416,19 @@ bool UniValue::read(const char *raw, size_t size)
         case JTOK_STRING: {
             if (expect(OBJ_NAME)) {
                 UniValue *top = stack.back();
-                top->keys.push_back(tokenVal);
+                top->keys.push_back(string());
+                top->keys.back().swap(tokenVal);
                 clearExpect(OBJ_NAME);
                 setExpect(COLON);
             } else {
-                UniValue tmpVal(VSTR, tokenVal);
                 if (!stack.size()) {
-                    *this = tmpVal;
+                    typ = VSTR;
+                    val.swap(tokenVal);
                     break;
                 }
                 UniValue *top = stack.back();
-                top->values.push_back(tmpVal);
+                top->values.push_back(UniValue(VSTR));
+                top->values.back().val.swap(tokenVal);
             }
 
             setExpect(NOT_VALUE);
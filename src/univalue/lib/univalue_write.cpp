@@ -5,27 +5,47 @@
 #include <iomanip>
 #include <sstream>
 #include <stdio.h>
+#include <string.h>
 #include "univalue.h"
 #include "univalue_escapes.h"
 
 using namespace std;
 
-static string json_escape(const string& inS)
+namespace {
+
+class StringSink : public UniValue::Sink {
+public:
+    string& s;
+
+    StringSink(string& s_) : s(s_) {}
+
+    void append(const char *data, size_t len) {
+        s.append(data, len);
+    }
+};
+
+}
+
+static void appendStr(UniValue::Sink& sink, const char *str)
 {
-    string outS;
-    outS.reserve(inS.size() * 2);
+    sink.append(str, strlen(str));
+}
 
-    for (unsigned int i = 0; i < inS.size(); i++) {
+static void appendEscaped(UniValue::Sink& sink, const string& inS)
+{
+    // hand over the runs of characters that need no escaping in one piece
+    size_t start = 0;
+    for (size_t i = 0; i < inS.size(); i++) {
         unsigned char ch = inS[i];
         const char *escStr = escapes[ch];
 
-        if (escStr)
-            outS += escStr;
-        else
-            outS += ch;
+        if (escStr) {
+            sink.append(inS.data() + start, i - start);
+            appendStr(sink, escStr);
+            start = i + 1;
+        }
     }
-
-    return outS;
+    sink.append(inS.data() + start, inS.size() - start);
 }
 
 string UniValue::write(unsigned int prettyIndent,
@@ -34,82 +54,99 @@ string UniValue::write(unsigned int prettyIndent,
     string s;
     s.reserve(1024);
 
+    StringSink sink(s);
+    write(sink, prettyIndent, indentLevel);
+
+    return s;
+}
+
+void UniValue::write(Sink& sink, unsigned int prettyIndent,
+                     unsigned int indentLevel) const
+{
     unsigned int modIndent = indentLevel;
     if (modIndent == 0)
         modIndent = 1;
 
     switch (typ) {
     case VNULL:
-        s += "null";
+        appendStr(sink, "null");
         break;
     case VOBJ:
-        writeObject(prettyIndent, modIndent, s);
+        writeObject(prettyIndent, modIndent, sink);
         break;
     case VARR:
-        writeArray(prettyIndent, modIndent, s);
+        writeArray(prettyIndent, modIndent, sink);
         break;
     case VSTR:
-        s += "\"" + json_escape(val) + "\"";
+        appendStr(sink, "\"");
+        appendEscaped(sink, val);
+        appendStr(sink, "\"");
         break;
     case VNUM:
-        s += val;
+        sink.append(val.data(), val.size());
         break;
     case VBOOL:
-        s += (val == "1" ? "true" : "false");
+        appendStr(sink, val == "1" ? "true" : "false");
         break;
     }
-
-    return s;
 }
 
-static void indentStr(unsigned int prettyIndent, unsigned int indentLevel, string& s)
+static void indentStr(unsigned int prettyIndent, unsigned int indentLevel, UniValue::Sink& sink)
 {
-    s.append(prettyIndent * indentLevel, ' ');
+    static const char spaces[] = "                                ";
+    size_t len = prettyIndent * indentLevel;
+    while (len > 0) {
+        size_t n = len < sizeof(spaces) - 1 ? len : sizeof(spaces) - 1;
+        sink.append(spaces, n);
+        len -= n;
+    }
 }
 
-void UniValue::writeArray(unsigned int prettyIndent, unsigned int indentLevel, string& s) const
+void UniValue::writeArray(unsigned int prettyIndent, unsigned int indentLevel, Sink& sink) const
 {
-    s += "[";
+    appendStr(sink, "[");
     if (prettyIndent)
-        s += "\n";
+        appendStr(sink, "\n");
 
     for (unsigned int i = 0; i < values.size(); i++) {
         if (prettyIndent)
-            indentStr(prettyIndent, indentLevel, s);
-        s += values[i].write(prettyIndent, indentLevel + 1);
+            indentStr(prettyIndent, indentLevel, sink);
+        values[i].write(sink, prettyIndent, indentLevel + 1);
         if (i != (values.size() - 1)) {
-            s += ",";
+            appendStr(sink, ",");
         }
         if (prettyIndent)
-            s += "\n";
+            appendStr(sink, "\n");
     }
 
     if (prettyIndent)
-        indentStr(prettyIndent, indentLevel - 1, s);
-    s += "]";
+        indentStr(prettyIndent, indentLevel - 1, sink);
+    appendStr(sink, "]");
 }
 
-void UniValue::writeObject(unsigned int prettyIndent, unsigned int indentLevel, string& s) const
+void UniValue::writeObject(unsigned int prettyIndent, unsigned int indentLevel, Sink& sink) const
 {
-    s += "{";
+    appendStr(sink, "{");
     if (prettyIndent)
-        s += "\n";
+        appendStr(sink, "\n");
 
     for (unsigned int i = 0; i < keys.size(); i++) {
         if (prettyIndent)
-            indentStr(prettyIndent, indentLevel, s);
-        s += "\"" + json_escape(keys[i]) + "\":";
+            indentStr(prettyIndent, indentLevel, sink);
+        appendStr(sink, "\"");
+        appendEscaped(sink, keys[i]);
+        appendStr(sink, "\":");
         if (prettyIndent)
-            s += " ";
-        s += values.at(i).write(prettyIndent, indentLevel + 1);
+            appendStr(sink, " ");
+        values.at(i).write(sink, prettyIndent, indentLevel + 1);
         if (i != (values.size() - 1))
-            s += ",";
+            appendStr(sink, ",");
         if (prettyIndent)
-            s += "\n";
+            appendStr(sink, "\n");
     }
 
     if (prettyIndent)
-        indentStr(prettyIndent, indentLevel - 1, s);
-    s += "}";
+        indentStr(prettyIndent, indentLevel - 1, sink);
+    appendStr(sink, "}");
 }
 
@@ -334,6 +334,22 @@ BOOST_AUTO_TEST_CASE(univalue_readwrite)
 
     BOOST_CHECK_EQUAL(strJson1, v.write());
 
+    // A sink receives the same text in pieces
+    class PieceSink : public UniValue::Sink {
+    public:
+        std::string s;
+        unsigned int pieces;
+        PieceSink() : pieces(0) {}
+        void append(const char *data, size_t len) { s.append(data, len); pieces++; }
+    };
+    PieceSink sink;
+    v.write(sink);
+    BOOST_CHECK_EQUAL(sink.s, strJson1);
+    BOOST_CHECK(sink.pieces > 1);
+    PieceSink sinkPretty;
+    v.write(sinkPretty, 4);
+    BOOST_CHECK_EQUAL(sinkPretty.s, v.write(4));
+
     /* Check for (correctly reporting) a parsing error if the initial
        JSON construct is followed by more stuff.  Note that whitespace
        is, of course, exempt.  */
@@ -13,6 +13,7 @@
 
 #include "allocators.h"
 #include "chainparamsbase.h"
+#include "profiler.h"
 #include "random.h"
 #include "serialize.h"
 #include "sync.h"
@@ -41,6 +42,7 @@
 #endif // __linux__
 
 #include <algorithm>
+#include <atomic>
 #include <fcntl.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
@@ -77,6 +79,10 @@
 #include <sys/prctl.h>
 #endif
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/predicate.hpp> // for startswith() and endswith()
@@ -85,6 +91,7 @@
 #include <boost/foreach.hpp>
 #include <boost/program_options/detail/config_file.hpp>
 #include <boost/program_options/parsers.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <openssl/conf.h>
 #include <openssl/crypto.h>
@@ -212,72 +219,325 @@ static void DebugPrintInit()
     mutexDebugLog = new boost::mutex();
 }
 
+namespace
+{
+//! Every category LogPrint is called with, sorted, a category's bit is its index
+const char* const LOG_CATEGORIES[] = {
+    "addrman", "alert", "bench", "cmpctblock", "coindb", "db", "debug", "estimatefee", "http",
+    "libevent", "lock", "masternode", "mempool", "mnbudget", "mnpayments", "net", "obfuscation",
+    "proxy", "qt", "rand", "reindex", "rpc", "selectcoins", "swiftx", "tor", "zero", "zmq"};
+const int LOG_CATEGORIES_COUNT = sizeof(LOG_CATEGORIES) / sizeof(LOG_CATEGORIES[0]);
+
+boost::once_flag logCategoriesInitFlag = BOOST_ONCE_INIT;
+//! The bits of the -debug categories, set once and only read afterwards
+uint64_t nLogCategories = 0;
+bool fLogAllCategories = false;
+//! -debug categories not in LOG_CATEGORIES, only looked at for those
+std::vector<std::string>* pvLogCategoriesOther = NULL;
+
+int GetLogCategoryBit(const char* category)
+{
+    int nLow = 0, nHigh = LOG_CATEGORIES_COUNT - 1;
+    while (nLow <= nHigh) {
+        int nMid = (nLow + nHigh) / 2;
+        int nCmp = strcmp(category, LOG_CATEGORIES[nMid]);
+        if (nCmp == 0)
+            return nMid;
+        if (nCmp < 0)
+            nHigh = nMid - 1;
+        else
+            nLow = nMid + 1;
+    }
+    return -1;
+}
+
+void InitLogCategories()
+{
+    // Never deleted, global destructors may still log
+    pvLogCategoriesOther = new std::vector<std::string>();
+    std::map<std::string, std::vector<std::string> >::const_iterator it = mapMultiArgs.find("-debug");
+    if (it == mapMultiArgs.end())
+        return;
+    BOOST_FOREACH (const std::string& strCategory, it->second) {
+        if (strCategory.empty() || strCategory == "1") {
+            fLogAllCategories = true;
+        } else if (strCategory == "dystem") {
+            // Composite category enabling all DYSTEM-related debug output
+            nLogCategories |= 1ULL << GetLogCategoryBit("swiftx");
+            nLogCategories |= 1ULL << GetLogCategoryBit("masternode");
+            nLogCategories |= 1ULL << GetLogCategoryBit("mnpayments");
+            nLogCategories |= 1ULL << GetLogCategoryBit("mnbudget");
+        } else {
+            int nBit = GetLogCategoryBit(strCategory.c_str());
+            if (nBit >= 0)
+                nLogCategories |= 1ULL << nBit;
+            else
+                pvLogCategoriesOther->push_back(strCategory);
+        }
+    }
+}
+
+/** A message on its way to the log writer */
+struct CLogMessage {
+    uint64_t nSequence;
+    int64_t nTime;
+    std::string str;
+};
+
+/**
+ * The messages a thread logged and the writer has not taken yet. Only the
+ * thread pushes and only the writer pops, so neither needs to lock.
+ */
+class CLogRing
+{
+private:
+    std::vector<CLogMessage> vSlots;
+    uint64_t nMask;
+    std::atomic<uint64_t> nHead; //!< Next slot to pop
+    std::atomic<uint64_t> nTail; //!< Next slot to push
+
+public:
+    std::atomic<uint64_t> nDropped;
+
+    CLogRing(size_t nSize) : nHead(0), nTail(0), nDropped(0)
+    {
+        size_t nSlots = 1;
+        while (nSlots < nSize)
+            nSlots <<= 1;
+        vSlots.resize(nSlots);
+        nMask = nSlots - 1;
+    }
+
+    /** Returns the number of messages queued, 0 when msg was dropped for lack of room */
+    size_t Push(CLogMessage& msg)
+    {
+        uint64_t nPos = nTail.load(std::memory_order_relaxed);
+        if (nPos - nHead.load(std::memory_order_acquire) >= vSlots.size()) {
+            nDropped++;
+            return 0;
+        }
+        std::swap(vSlots[nPos & nMask], msg);
+        nTail.store(nPos + 1, std::memory_order_release);
+        return nPos + 1 - nHead.load(std::memory_order_relaxed);
+    }
+
+    void Pop(std::vector<CLogMessage>& vOut)
+    {
+        uint64_t nPos = nHead.load(std::memory_order_relaxed);
+        uint64_t nEnd = nTail.load(std::memory_order_acquire);
+        for (; nPos != nEnd; nPos++) {
+            vOut.push_back(CLogMessage());
+            std::swap(vOut.back(), vSlots[nPos & nMask]);
+        }
+        nHead.store(nPos, std::memory_order_release);
+    }
+
+    bool Empty() const { return nHead.load(std::memory_order_acquire) == nTail.load(std::memory_order_acquire); }
+    size_t Capacity() const { return vSlots.size(); }
+};
+
+typedef boost::shared_ptr<CLogRing> CLogRingRef;
+
+std::atomic<bool> fLogAsync(false);
+std::atomic<uint64_t> nLogSequence(0);
+std::atomic<uint64_t> nLogDroppedTotal(0);
+size_t nLogRingSize = DEFAULT_LOG_BUFFER;
+
+// Allocated once and never deleted, like mutexDebugLog
+boost::mutex* mutexLogRings = NULL;
+std::vector<CLogRingRef>* pvLogRings = NULL;
+boost::condition_variable* pcondLogWriter = NULL;
+boost::thread* pthreadLogWriter = NULL;
+bool fLogWriterStop = false;
+
+//! Each logging thread's ring, also referenced from pvLogRings until drained
+boost::thread_specific_ptr<CLogRingRef> ptrLogRing;
+
+void LogRingsInit()
+{
+    mutexLogRings = new boost::mutex();
+    pvLogRings = new std::vector<CLogRingRef>();
+    pcondLogWriter = new boost::condition_variable();
+}
+boost::once_flag logRingsInitFlag = BOOST_ONCE_INIT;
+
+bool CompareLogMessages(const CLogMessage& a, const CLogMessage& b)
+{
+    return a.nSequence < b.nSequence;
+}
+} // anon namespace
+
 bool LogAcceptCategory(const char* category)
 {
-    if (category != NULL) {
-        if (!fDebug)
-            return false;
+    if (category == NULL)
+        return true;
+    if (!fDebug)
+        return false;
+
+    boost::call_once(&InitLogCategories, logCategoriesInitFlag);
+    if (fLogAllCategories)
+        return true;
+    int nBit = GetLogCategoryBit(category);
+    if (nBit >= 0)
+        return (nLogCategories >> nBit) & 1;
+    return std::find(pvLogCategoriesOther->begin(), pvLogCategoriesOther->end(), category) != pvLogCategoriesOther->end();
+}
+
+/** Write out str, with a timestamp when it starts a line. Requires mutexDebugLog. */
+static int WriteDebugLog(const std::string& str, int64_t nTime)
+{
+    static bool fStartedNewLine = true;
+    int ret = 0;
+
+    // reopen the log file, if requested
+    if (fReopenDebugLog) {
+        fReopenDebugLog = false;
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(), "a", fileout) != NULL)
+            setbuf(fileout, NULL); // unbuffered
+    }
+
+    // Debug print useful for profiling
+    if (fLogTimestamps && fStartedNewLine)
+        ret += fprintf(fileout, "%s ", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nTime).c_str());
+    if (!str.empty() && str[str.size() - 1] == '\n')
+        fStartedNewLine = true;
+    else
+        fStartedNewLine = false;
+
+    ret = fwrite(str.data(), 1, str.size(), fileout);
+    return ret;
+}
 
-        // Give each thread quick access to -debug settings.
-        // This helps prevent issues debugging global destructors,
-        // where mapMultiArgs might be deleted before another
-        // global destructor calls LogPrint()
-        static boost::thread_specific_ptr<set<string> > ptrCategory;
-        if (ptrCategory.get() == NULL) {
-            const vector<string>& categories = mapMultiArgs["-debug"];
-            ptrCategory.reset(new set<string>(categories.begin(), categories.end()));
-            // thread_specific_ptr automatically deletes the set when the thread ends.
-            // "dystem" is a composite category enabling all DYSTEM-related debug output
-            if (ptrCategory->count(string("dystem"))) {
-                ptrCategory->insert(string("swiftx"));
-                ptrCategory->insert(string("masternode"));
-                ptrCategory->insert(string("mnpayments"));
-                ptrCategory->insert(string("mnbudget"));
+/** Write out what the threads logged, in the order they logged it */
+static void DrainLogRings()
+{
+    std::vector<CLogMessage> vMessages;
+    uint64_t nDropped = 0;
+    {
+        boost::unique_lock<boost::mutex> lock(*mutexLogRings);
+        for (size_t i = 0; i < pvLogRings->size();) {
+            const CLogRingRef& ring = (*pvLogRings)[i];
+            ring->Pop(vMessages);
+            nDropped += ring->nDropped.exchange(0);
+            // The ring of a thread that ended is forgotten once empty
+            if (ring.use_count() == 1 && ring->Empty()) {
+                (*pvLogRings)[i] = pvLogRings->back();
+                pvLogRings->pop_back();
+            } else {
+                i++;
             }
         }
-        const set<string>& setCategories = *ptrCategory.get();
+    }
+    if (vMessages.empty() && nDropped == 0)
+        return;
+    std::sort(vMessages.begin(), vMessages.end(), CompareLogMessages);
 
-        // if not debugging everything and not debugging specific category, LogPrint does nothing.
-        if (setCategories.count(string("")) == 0 &&
-            setCategories.count(string(category)) == 0)
-            return false;
+    if (fPrintToConsole) {
+        BOOST_FOREACH (const CLogMessage& msg, vMessages)
+            fwrite(msg.str.data(), 1, msg.str.size(), stdout);
+        if (nDropped)
+            fprintf(stdout, "Log buffer full, %u messages dropped\n", (unsigned int)nDropped);
+        fflush(stdout);
+        return;
     }
-    return true;
+    boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+    BOOST_FOREACH (const CLogMessage& msg, vMessages)
+        WriteDebugLog(msg.str, msg.nTime);
+    if (nDropped)
+        WriteDebugLog(strprintf("Log buffer full, %u messages dropped\n", nDropped), GetTime());
+}
+
+static void ThreadLogWriter()
+{
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(*mutexLogRings);
+            if (fLogWriterStop)
+                break;
+            pcondLogWriter->timed_wait(lock, boost::posix_time::milliseconds(LOG_WRITER_INTERVAL));
+        }
+        DrainLogRings();
+    }
+    DrainLogRings();
+}
+
+void StartLogWriter(size_t nBufferMessages)
+{
+    if (pthreadLogWriter || !(fPrintToConsole || fPrintToDebugLog))
+        return;
+    if (!fPrintToConsole) {
+        boost::call_once(&DebugPrintInit, debugPrintInitFlag);
+        if (fileout == NULL)
+            return;
+    }
+    boost::call_once(&LogRingsInit, logRingsInitFlag);
+    nLogRingSize = std::max(nBufferMessages, (size_t)16);
+    fLogWriterStop = false;
+    pthreadLogWriter = new boost::thread(&ThreadLogWriter);
+    fLogAsync = true;
+}
+
+void StopLogWriter()
+{
+    if (!pthreadLogWriter)
+        return;
+    fLogAsync = false;
+    {
+        boost::unique_lock<boost::mutex> lock(*mutexLogRings);
+        fLogWriterStop = true;
+    }
+    pcondLogWriter->notify_one();
+    pthreadLogWriter->join();
+    delete pthreadLogWriter;
+    pthreadLogWriter = NULL;
+    // What was queued while the writer was stopping
+    DrainLogRings();
+}
+
+uint64_t GetLogMessagesDropped()
+{
+    return nLogDroppedTotal;
 }
 
 int LogPrintStr(const std::string& str)
 {
+    if (fLogAsync) {
+        if (ptrLogRing.get() == NULL) {
+            CLogRingRef ring(new CLogRing(nLogRingSize));
+            ptrLogRing.reset(new CLogRingRef(ring));
+            boost::unique_lock<boost::mutex> lock(*mutexLogRings);
+            pvLogRings->push_back(ring);
+        }
+        CLogRing& ring = **ptrLogRing;
+        CLogMessage msg;
+        msg.nSequence = nLogSequence++;
+        msg.nTime = GetTime();
+        msg.str = str;
+        size_t nQueued = ring.Push(msg);
+        if (nQueued == 0) {
+            nLogDroppedTotal++;
+            return 0;
+        }
+        // Wake the writer early rather than drop what comes next
+        if (nQueued == ring.Capacity() / 2)
+            pcondLogWriter->notify_one();
+        return str.size();
+    }
+
     int ret = 0; // Returns total number of characters written
     if (fPrintToConsole) {
         // print to console
         ret = fwrite(str.data(), 1, str.size(), stdout);
         fflush(stdout);
     } else if (fPrintToDebugLog && AreBaseParamsConfigured()) {
-        static bool fStartedNewLine = true;
         boost::call_once(&DebugPrintInit, debugPrintInitFlag);
 
         if (fileout == NULL)
             return ret;
 
         boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
-
-        // reopen the log file, if requested
-        if (fReopenDebugLog) {
-            fReopenDebugLog = false;
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            if (freopen(pathDebug.string().c_str(), "a", fileout) != NULL)
-                setbuf(fileout, NULL); // unbuffered
-        }
-
-        // Debug print useful for profiling
-        if (fLogTimestamps && fStartedNewLine)
-            ret += fprintf(fileout, "%s ", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
-        if (!str.empty() && str[str.size() - 1] == '\n')
-            fStartedNewLine = true;
-        else
-            fStartedNewLine = false;
-
-        ret = fwrite(str.data(), 1, str.size(), fileout);
+        ret = WriteDebugLog(str, GetTime());
     }
 
     return ret;
@@ -775,6 +1035,8 @@ void RenameThread(const char* name)
     // Prevent warnings for unused parameters...
     (void)name;
 #endif
+    RegisterProfilerThread(name);
+    ApplyThreadPlacement(name);
 }
 
 void SetupEnvironment()
@@ -820,3 +1082,194 @@ void SetThreadPriority(int nPriority)
 #endif // PRIO_THREAD
 #endif // WIN32
 }
+
+bool ParseCpuList(const std::string& str, std::vector<int>& vCpus)
+{
+    vCpus.clear();
+    size_t nStart = 0;
+    while (nStart <= str.size()) {
+        size_t nEnd = str.find(',', nStart);
+        if (nEnd == std::string::npos)
+            nEnd = str.size();
+        std::string strRange = str.substr(nStart, nEnd - nStart);
+        size_t nDash = strRange.find('-');
+        int nFirst, nLast;
+        if (!ParseInt32(strRange.substr(0, nDash), &nFirst))
+            return false;
+        nLast = nFirst;
+        if (nDash != std::string::npos && !ParseInt32(strRange.substr(nDash + 1), &nLast))
+            return false;
+        if (nFirst < 0 || nLast < nFirst || nLast >= MAX_THREAD_AFFINITY_CPUS)
+            return false;
+        for (int nCpu = nFirst; nCpu <= nLast; nCpu++)
+            vCpus.push_back(nCpu);
+        nStart = nEnd + 1;
+    }
+    std::sort(vCpus.begin(), vCpus.end());
+    vCpus.erase(std::unique(vCpus.begin(), vCpus.end()), vCpus.end());
+    return !vCpus.empty();
+}
+
+bool SetThreadAffinity(const std::vector<int>& vCpus)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    BOOST_FOREACH (int nCpu, vCpus)
+        CPU_SET(nCpu, &set);
+    // pid 0 is the calling thread, not the whole process
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(WIN32)
+    DWORD_PTR mask = 0;
+    BOOST_FOREACH (int nCpu, vCpus) {
+        if (nCpu >= (int)(8 * sizeof(mask)))
+            return false;
+        mask |= (DWORD_PTR)1 << nCpu;
+    }
+    return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+    // OS X only takes affinity hints and the BSDs have their own cpusets
+    (void)vCpus;
+    return false;
+#endif
+}
+
+std::map<int, std::vector<int> > GetNumaTopology()
+{
+    std::map<int, std::vector<int> > mapNodes;
+#ifdef __linux__
+    boost::filesystem::path pathNodes("/sys/devices/system/node");
+    try {
+        if (!boost::filesystem::is_directory(pathNodes))
+            return mapNodes;
+        for (boost::filesystem::directory_iterator it(pathNodes); it != boost::filesystem::directory_iterator(); ++it) {
+            std::string strName = it->path().filename().string();
+            int nNode;
+            if (strName.compare(0, 4, "node") != 0 || !ParseInt32(strName.substr(4), &nNode))
+                continue;
+            boost::filesystem::ifstream file(it->path() / "cpulist");
+            std::string strCpus;
+            std::vector<int> vCpus;
+            // a node of memory only has an empty list
+            if (std::getline(file, strCpus) && ParseCpuList(strCpus, vCpus))
+                mapNodes[nNode] = vCpus;
+        }
+    } catch (const boost::filesystem::filesystem_error& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+#endif
+    return mapNodes;
+}
+
+namespace
+{
+struct CThreadPlacement {
+    //! Empty to leave the CPUs to the scheduler
+    std::vector<int> vCpus;
+    bool fPriority;
+    int nPriority;
+
+    CThreadPlacement() : fPriority(false), nPriority(THREAD_PRIORITY_NORMAL) {}
+};
+
+CCriticalSection cs_threadPlacement;
+std::map<std::string, CThreadPlacement> mapThreadPlacement;
+
+std::string FormatCpuList(const std::vector<int>& vCpus)
+{
+    std::string str;
+    for (unsigned int i = 0; i < vCpus.size(); i++) {
+        unsigned int j = i;
+        while (j + 1 < vCpus.size() && vCpus[j + 1] == vCpus[j] + 1)
+            j++;
+        if (!str.empty())
+            str += ",";
+        str += j > i ? strprintf("%d-%d", vCpus[i], vCpus[j]) : strprintf("%d", vCpus[i]);
+        i = j;
+    }
+    return str;
+}
+
+bool ParseThreadPriority(const std::string& str, int& nPriority)
+{
+    if (str == "lowest")
+        nPriority = THREAD_PRIORITY_LOWEST;
+    else if (str == "below")
+        nPriority = THREAD_PRIORITY_BELOW_NORMAL;
+    else if (str == "normal")
+        nPriority = THREAD_PRIORITY_NORMAL;
+    else if (str == "above")
+        nPriority = THREAD_PRIORITY_ABOVE_NORMAL;
+    else
+        return false;
+    return true;
+}
+} // anon namespace
+
+bool InitThreadPlacement(std::string& strError)
+{
+    std::map<int, std::vector<int> > mapNodes = GetNumaTopology();
+    for (std::map<int, std::vector<int> >::const_iterator it = mapNodes.begin(); it != mapNodes.end(); ++it)
+        LogPrintf("NUMA node %d has CPUs %s\n", it->first, FormatCpuList(it->second));
+    if (mapNodes.empty())
+        LogPrintf("No NUMA topology found, %u CPUs\n", boost::thread::hardware_concurrency());
+
+    std::map<std::string, CThreadPlacement> mapPlacement;
+    if (mapMultiArgs.count("-threadaffinity")) {
+        BOOST_FOREACH (const std::string& strArg, mapMultiArgs["-threadaffinity"]) {
+            // <thread>:<cpus>[:<priority>]
+            std::vector<std::string> vParts;
+            size_t nStart = 0, nColon;
+            while ((nColon = strArg.find(':', nStart)) != std::string::npos) {
+                vParts.push_back(strArg.substr(nStart, nColon - nStart));
+                nStart = nColon + 1;
+            }
+            vParts.push_back(strArg.substr(nStart));
+
+            CThreadPlacement placement;
+            bool fValid = (vParts.size() == 2 || vParts.size() == 3) && !vParts[0].empty();
+            if (fValid && vParts[1].compare(0, 4, "node") == 0) {
+                int nNode;
+                fValid = ParseInt32(vParts[1].substr(4), &nNode) && mapNodes.count(nNode);
+                if (fValid)
+                    placement.vCpus = mapNodes[nNode];
+            } else if (fValid && vParts[1] != "*") {
+                fValid = ParseCpuList(vParts[1], placement.vCpus);
+            }
+            if (fValid && vParts.size() == 3)
+                placement.fPriority = fValid = ParseThreadPriority(vParts[2], placement.nPriority);
+            if (!fValid) {
+                strError = strprintf("Invalid -threadaffinity '%s': expected <thread>:<cpus>[:<priority>], the CPUs as a list like 0-3,8, node<n> of an existing NUMA node or *", strArg);
+                return false;
+            }
+            mapPlacement[vParts[0]] = placement;
+            LogPrintf("Placing %s threads on %s%s\n", vParts[0], placement.vCpus.empty() ? std::string("any CPU") : "CPUs " + FormatCpuList(placement.vCpus),
+                placement.fPriority ? " at priority " + vParts[2] : std::string());
+        }
+    }
+
+    LOCK(cs_threadPlacement);
+    mapThreadPlacement.swap(mapPlacement);
+    return true;
+}
+
+void ApplyThreadPlacement(const char* name)
+{
+    std::string strName(name);
+    size_t nDash = strName.find('-');
+    if (nDash != std::string::npos)
+        strName = strName.substr(nDash + 1);
+
+    CThreadPlacement placement;
+    {
+        LOCK(cs_threadPlacement);
+        std::map<std::string, CThreadPlacement>::const_iterator it = mapThreadPlacement.find(strName);
+        if (it == mapThreadPlacement.end())
+            return;
+        placement = it->second;
+    }
+    if (!placement.vCpus.empty() && !SetThreadAffinity(placement.vCpus))
+        LogPrintf("%s: cannot bind a %s thread to CPUs %s\n", __func__, strName, FormatCpuList(placement.vCpus));
+    if (placement.fPriority)
+        SetThreadPriority(placement.nPriority);
+}
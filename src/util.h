@@ -55,10 +55,39 @@ extern volatile bool fReopenDebugLog;
 void SetupEnvironment();
 bool SetupNetworking();
 
+//! -logasync default
+static const bool DEFAULT_LOGASYNC = true;
+//! -logbuffer default, messages each thread can have waiting for the log writer
+static const unsigned int DEFAULT_LOG_BUFFER = 4096;
+//! Milliseconds the log writer sleeps between two writes, unless a buffer fills up
+static const int LOG_WRITER_INTERVAL = 100;
+
 /** Return true if log accepts specified category */
 bool LogAcceptCategory(const char* category);
 /** Send a string to the log output */
 int LogPrintStr(const std::string& str);
+/**
+ * From now on, queue what each thread logs, up to nBufferMessages messages, for
+ * a writer thread to write out in order. What a full buffer cannot take is
+ * dropped and counted.
+ */
+void StartLogWriter(size_t nBufferMessages);
+/** Write out what is queued and log synchronously again */
+void StopLogWriter();
+/** Messages dropped since startup because a buffer was full */
+uint64_t GetLogMessagesDropped();
+
+/**
+ * Print to debug.log if -debug=category switch is given OR category is NULL.
+ * A macro rather than a function, so that the arguments, which are often
+ * hashes or amounts turned into strings, are only evaluated when the message
+ * is going to be written.
+ */
+#define LogPrint(category, ...)                          \
+    do {                                                 \
+        if (LogAcceptCategory(category))                 \
+            LogPrintStr(LogFormat(__VA_ARGS__));         \
+    } while (0)
 
 #define LogPrintf(...) LogPrint(NULL, __VA_ARGS__)
 
@@ -67,12 +96,11 @@ int LogPrintStr(const std::string& str);
  * of this macro-based construction (see tinyformat.h).
  */
 #define MAKE_ERROR_AND_LOG_FUNC(n)                                                              \
-    /**   Print to debug.log if -debug=category switch is given OR category is NULL. */         \
+    /**   Format a log message */                                                               \
     template <TINYFORMAT_ARGTYPES(n)>                                                           \
-    static inline int LogPrint(const char* category, const char* format, TINYFORMAT_VARARGS(n)) \
+    static inline std::string LogFormat(const char* format, TINYFORMAT_VARARGS(n))              \
     {                                                                                           \
-        if (!LogAcceptCategory(category)) return 0;                                             \
-        return LogPrintStr(tfm::format(format, TINYFORMAT_PASSARGS(n)));                        \
+        return tfm::format(format, TINYFORMAT_PASSARGS(n));                                     \
     }                                                                                           \
     /**   Log error and return false */                                                         \
     template <TINYFORMAT_ARGTYPES(n)>                                                           \
@@ -88,10 +116,9 @@ TINYFORMAT_FOREACH_ARGNUM(MAKE_ERROR_AND_LOG_FUNC)
  * Zero-arg versions of logging and error, these are not covered by
  * TINYFORMAT_FOREACH_ARGNUM
  */
-static inline int LogPrint(const char* category, const char* format)
+static inline std::string LogFormat(const char* format)
 {
-    if (!LogAcceptCategory(category)) return 0;
-    return LogPrintStr(format);
+    return format;
 }
 static inline bool error(const char* format)
 {
@@ -199,6 +226,27 @@ std::string HelpMessageOpt(const std::string& option, const std::string& message
 void SetThreadPriority(int nPriority);
 void RenameThread(const char* name);
 
+//! CPUs a CPU list may name, the size of cpu_set_t on Linux
+static const int MAX_THREAD_AFFINITY_CPUS = 1024;
+
+/** Parse a CPU list like "0-3,8" in the format of /sys/devices/system/node, false if malformed */
+bool ParseCpuList(const std::string& str, std::vector<int>& vCpus);
+/** Run the calling thread on the given CPUs only, false where the platform cannot */
+bool SetThreadAffinity(const std::vector<int>& vCpus);
+/** The CPUs of each NUMA node by node number, empty where the platform does not tell */
+std::map<int, std::vector<int> > GetNumaTopology();
+
+/**
+ * Parse -threadaffinity and log the NUMA topology. Call before starting the
+ * threads it places; threads started earlier keep the placement they have.
+ */
+bool InitThreadPlacement(std::string& strError);
+/**
+ * Bind the calling thread to the CPUs and give it the priority -threadaffinity
+ * configures for its name, without the "dystem-" prefix. Called by RenameThread.
+ */
+void ApplyThreadPlacement(const char* name);
+
 /**
  * .. and a wrapper that just calls func once
  */
@@ -552,6 +552,37 @@ std::string FormatParagraph(const std::string in, size_t width, size_t indent)
     return out.str();
 }
 
+std::vector<std::string> SplitCommandLine(const std::string& strLine)
+{
+    std::vector<std::string> vArgs;
+    std::string strArg;
+    bool fArg = false;
+    char chQuote = 0;
+    for (size_t i = 0; i < strLine.size(); i++) {
+        char ch = strLine[i];
+        if (chQuote) {
+            if (ch == chQuote)
+                chQuote = 0;
+            else
+                strArg += ch;
+        } else if (ch == '"' || ch == '\'') {
+            chQuote = ch;
+            fArg = true;
+        } else if (isspace((unsigned char)ch)) {
+            if (fArg)
+                vArgs.push_back(strArg);
+            strArg.clear();
+            fArg = false;
+        } else {
+            strArg += ch;
+            fArg = true;
+        }
+    }
+    if (fArg)
+        vArgs.push_back(strArg);
+    return vArgs;
+}
+
 std::string i64tostr(int64_t n)
 {
     return strprintf("%d", n);
@@ -108,6 +108,12 @@ inline std::string ReverseEndianString(std::string in)
  */
 std::string FormatParagraph(const std::string in, size_t width = 79, size_t indent = 0);
 
+/**
+ * Split a line of commands into its arguments at the blanks, single or double
+ * quotes keep the blanks between them and are dropped, as in a shell.
+ */
+std::vector<std::string> SplitCommandLine(const std::string& strLine);
+
 /**
  * Timing-attack-resistant comparison.
  * Takes time proportional to length
@@ -5,20 +5,148 @@
 
 #include "validationinterface.h"
 
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+#include "util.h"
+
+#include <deque>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/function.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+
 static CMainSignals g_signals;
+//! The notifications of the listeners registered as queued, only fired by the validation queue
+static CMainSignals g_queuedSignals;
+
+namespace
+{
+boost::mutex cs_validationQueue;
+boost::condition_variable condValidationQueued;
+boost::condition_variable condValidationDone;
+std::deque<boost::function<void()> > queueValidationEvents;
+uint64_t nValidationEventsQueued = 0;
+uint64_t nValidationEventsDone = 0;
+bool fValidationQueueThread = false;
+//! Keeps the notifications in order while they run on the notifying threads
+boost::recursive_mutex cs_validationRunInline;
+
+void FinishValidationEvent()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs_validationQueue);
+        nValidationEventsDone++;
+    }
+    condValidationDone.notify_all();
+}
+
+/** Without the queue thread, run what waits on the calling thread */
+void RunValidationEventsInline()
+{
+    boost::lock_guard<boost::recursive_mutex> lockRun(cs_validationRunInline);
+    while (true) {
+        boost::function<void()> event;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_validationQueue);
+            if (fValidationQueueThread || queueValidationEvents.empty())
+                return;
+            event.swap(queueValidationEvents.front());
+            queueValidationEvents.pop_front();
+        }
+        event();
+        FinishValidationEvent();
+    }
+}
+
+void QueueValidationEvent(const boost::function<void()>& event)
+{
+    bool fInline;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_validationQueue);
+        queueValidationEvents.push_back(event);
+        nValidationEventsQueued++;
+        fInline = !fValidationQueueThread;
+    }
+    if (fInline)
+        RunValidationEventsInline();
+    else
+        condValidationQueued.notify_one();
+}
+
+/** Deliver the notifications, and once interrupted what was queued before, then stop */
+void ThreadValidationQueue()
+{
+    while (true) {
+        boost::function<void()> event;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_validationQueue);
+            try {
+                while (queueValidationEvents.empty())
+                    condValidationQueued.wait(lock);
+            } catch (const boost::thread_interrupted&) {
+                fValidationQueueThread = false;
+                condValidationDone.notify_all();
+                throw;
+            }
+            event.swap(queueValidationEvents.front());
+            queueValidationEvents.pop_front();
+        }
+        {
+            boost::this_thread::disable_interruption di;
+            event();
+        }
+        FinishValidationEvent();
+    }
+}
+
+void QueuedSyncTransaction(const CTransaction& tx, const boost::shared_ptr<const CBlock>& pblock)
+{
+    g_queuedSignals.SyncTransaction(tx, pblock.get());
+}
+
+void QueuedSyncTransactions(const boost::shared_ptr<const std::vector<CTransaction> >& pvtx, const boost::shared_ptr<const CBlock>& pblock)
+{
+    g_queuedSignals.SyncTransactions(*pvtx, pblock.get());
+}
+
+void QueuedUpdatedBlockTip(const CBlockIndex* pindex)
+{
+    g_queuedSignals.UpdatedBlockTip(pindex);
+}
+
+void QueuedNotifyTransactionLock(const CTransaction& tx)
+{
+    g_queuedSignals.NotifyTransactionLock(tx);
+}
+
+void QueuedSetBestChain(const CBlockLocator& locator)
+{
+    g_queuedSignals.SetBestChain(locator);
+}
+
+boost::shared_ptr<const CBlock> CopyBlock(const CBlock* pblock)
+{
+    return pblock ? boost::make_shared<const CBlock>(*pblock) : boost::shared_ptr<const CBlock>();
+}
+} // anon namespace
 
 CMainSignals& GetMainSignals()
 {
     return g_signals;
 }
 
-void RegisterValidationInterface(CValidationInterface* pwalletIn) {
+void RegisterValidationInterface(CValidationInterface* pwalletIn, bool fQueued) {
+    CMainSignals& signals = fQueued ? g_queuedSignals : g_signals;
 // XX42 g_signals.EraseTransaction.connect(boost::bind(&CValidationInterface::EraseFromWallet, pwalletIn, _1));
-    g_signals.UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
-    g_signals.SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
-    g_signals.NotifyTransactionLock.connect(boost::bind(&CValidationInterface::NotifyTransactionLock, pwalletIn, _1));
+    signals.UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
+    signals.SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
+    signals.SyncTransactions.connect(boost::bind(&CValidationInterface::SyncTransactions, pwalletIn, _1, _2));
+    signals.NotifyTransactionLock.connect(boost::bind(&CValidationInterface::NotifyTransactionLock, pwalletIn, _1));
+    g_signals.NotifyMasternodeMessage.connect(boost::bind(&CValidationInterface::NotifyMasternodeMessage, pwalletIn, _1, _2, _3));
     g_signals.UpdatedTransaction.connect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
-    g_signals.SetBestChain.connect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
+    signals.SetBestChain.connect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
     g_signals.Inventory.connect(boost::bind(&CValidationInterface::Inventory, pwalletIn, _1));
     g_signals.Broadcast.connect(boost::bind(&CValidationInterface::ResendWalletTransactions, pwalletIn));
     g_signals.BlockChecked.connect(boost::bind(&CValidationInterface::BlockChecked, pwalletIn, _1, _2));
@@ -33,10 +161,17 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
     g_signals.Broadcast.disconnect(boost::bind(&CValidationInterface::ResendWalletTransactions, pwalletIn));
     g_signals.Inventory.disconnect(boost::bind(&CValidationInterface::Inventory, pwalletIn, _1));
     g_signals.SetBestChain.disconnect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
+    g_queuedSignals.SetBestChain.disconnect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
     g_signals.UpdatedTransaction.disconnect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
+    g_signals.NotifyMasternodeMessage.disconnect(boost::bind(&CValidationInterface::NotifyMasternodeMessage, pwalletIn, _1, _2, _3));
     g_signals.NotifyTransactionLock.disconnect(boost::bind(&CValidationInterface::NotifyTransactionLock, pwalletIn, _1));
+    g_queuedSignals.NotifyTransactionLock.disconnect(boost::bind(&CValidationInterface::NotifyTransactionLock, pwalletIn, _1));
+    g_signals.SyncTransactions.disconnect(boost::bind(&CValidationInterface::SyncTransactions, pwalletIn, _1, _2));
+    g_queuedSignals.SyncTransactions.disconnect(boost::bind(&CValidationInterface::SyncTransactions, pwalletIn, _1, _2));
     g_signals.SyncTransaction.disconnect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
+    g_queuedSignals.SyncTransaction.disconnect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
     g_signals.UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
+    g_queuedSignals.UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
 // XX42    g_signals.EraseTransaction.disconnect(boost::bind(&CValidationInterface::EraseFromWallet, pwalletIn, _1));
 }
 
@@ -47,13 +182,89 @@ void UnregisterAllValidationInterfaces() {
     g_signals.Broadcast.disconnect_all_slots();
     g_signals.Inventory.disconnect_all_slots();
     g_signals.SetBestChain.disconnect_all_slots();
+    g_queuedSignals.SetBestChain.disconnect_all_slots();
     g_signals.UpdatedTransaction.disconnect_all_slots();
+    g_signals.NotifyMasternodeMessage.disconnect_all_slots();
     g_signals.NotifyTransactionLock.disconnect_all_slots();
+    g_queuedSignals.NotifyTransactionLock.disconnect_all_slots();
+    g_signals.SyncTransactions.disconnect_all_slots();
+    g_queuedSignals.SyncTransactions.disconnect_all_slots();
     g_signals.SyncTransaction.disconnect_all_slots();
+    g_queuedSignals.SyncTransaction.disconnect_all_slots();
     g_signals.UpdatedBlockTip.disconnect_all_slots();
+    g_queuedSignals.UpdatedBlockTip.disconnect_all_slots();
 // XX42    g_signals.EraseTransaction.disconnect_all_slots();
 }
 
 void SyncWithWallets(const CTransaction &tx, const CBlock *pblock = NULL) {
     g_signals.SyncTransaction(tx, pblock);
+    if (!g_queuedSignals.SyncTransaction.empty())
+        QueueValidationEvent(boost::bind(&QueuedSyncTransaction, tx, CopyBlock(pblock)));
+}
+
+void SyncWithWallets(const std::vector<CTransaction> &vtx, const CBlock *pblock) {
+    g_signals.SyncTransactions(vtx, pblock);
+    if (g_queuedSignals.SyncTransactions.empty())
+        return;
+    boost::shared_ptr<const CBlock> pblockCopy = CopyBlock(pblock);
+    // The transactions of the block itself are kept by its copy
+    boost::shared_ptr<const std::vector<CTransaction> > pvtx;
+    if (pblock && &vtx == &pblock->vtx)
+        pvtx = boost::shared_ptr<const std::vector<CTransaction> >(pblockCopy, &pblockCopy->vtx);
+    else
+        pvtx = boost::make_shared<const std::vector<CTransaction> >(vtx);
+    QueueValidationEvent(boost::bind(&QueuedSyncTransactions, pvtx, pblockCopy));
+}
+
+void SyncUpdatedBlockTip(const CBlockIndex *pindex) {
+    g_signals.UpdatedBlockTip(pindex);
+    if (!g_queuedSignals.UpdatedBlockTip.empty())
+        QueueValidationEvent(boost::bind(&QueuedUpdatedBlockTip, pindex));
+}
+
+void SyncTransactionLock(const CTransaction &tx) {
+    g_signals.NotifyTransactionLock(tx);
+    if (!g_queuedSignals.NotifyTransactionLock.empty())
+        QueueValidationEvent(boost::bind(&QueuedNotifyTransactionLock, tx));
+}
+
+void SyncBestChain(const CBlockLocator &locator) {
+    g_signals.SetBestChain(locator);
+    if (!g_queuedSignals.SetBestChain.empty())
+        QueueValidationEvent(boost::bind(&QueuedSetBestChain, locator));
+}
+
+void StartValidationInterfaceQueue(boost::thread_group& threadGroup) {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_validationQueue);
+        fValidationQueueThread = true;
+    }
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "validation", &ThreadValidationQueue));
+}
+
+void SyncWithValidationInterfaceQueue() {
+    {
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(cs_validationQueue);
+        uint64_t nTarget = nValidationEventsQueued;
+        while (fValidationQueueThread && nValidationEventsDone < nTarget)
+            condValidationDone.wait(lock);
+        if (nValidationEventsDone >= nTarget)
+            return;
+    }
+    RunValidationEventsInline();
+}
+
+void LimitValidationInterfaceQueue() {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_validationQueue);
+        if (queueValidationEvents.size() <= MAX_VALIDATION_QUEUE_SIZE)
+            return;
+    }
+    SyncWithValidationInterfaceQueue();
+}
+
+void CValidationInterface::SyncTransactions(const std::vector<CTransaction> &vtx, const CBlock *pblock) {
+    BOOST_FOREACH(const CTransaction &tx, vtx)
+        SyncTransaction(tx, pblock);
 }
@@ -6,6 +6,9 @@
 #ifndef BITCOIN_VALIDATIONINTERFACE_H
 #define BITCOIN_VALIDATIONINTERFACE_H
 
+#include <string>
+#include <vector>
+
 #include <boost/signals2/signal.hpp>
 #include <boost/shared_ptr.hpp>
 
@@ -18,23 +21,57 @@ class CValidationInterface;
 class CValidationState;
 class uint256;
 
+namespace boost
+{
+class thread_group;
+} // namespace boost
+
+//! Queued notifications past which block and transaction processing waits for the listeners
+static const size_t MAX_VALIDATION_QUEUE_SIZE = 10;
+
 // These functions dispatch to one or all registered wallets
 
-/** Register a wallet to receive updates from core */
-void RegisterValidationInterface(CValidationInterface* pwalletIn);
+/**
+ * Register a wallet to receive updates from core. With fQueued the tip,
+ * transaction, transaction lock and best chain notifications reach it in
+ * order from the validation queue thread, after the caller released
+ * cs_main; without it they are delivered on the notifying thread.
+ */
+void RegisterValidationInterface(CValidationInterface* pwalletIn, bool fQueued = true);
 /** Unregister a wallet from core */
 void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 /** Unregister all wallets from core */
 void UnregisterAllValidationInterfaces();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock);
+/** Push the updated transactions of a block (or the conflicts it caused) to all registered wallets at once */
+void SyncWithWallets(const std::vector<CTransaction>& vtx, const CBlock* pblock);
+/** Push a new chain tip to all registered wallets */
+void SyncUpdatedBlockTip(const CBlockIndex* pindex);
+/** Push a transaction that got its lock to all registered wallets */
+void SyncTransactionLock(const CTransaction& tx);
+/** Push the active chain, as written to disk, to all registered wallets */
+void SyncBestChain(const CBlockLocator& locator);
+
+/** Deliver the queued notifications from a thread of threadGroup, instead of on the notifying thread */
+void StartValidationInterfaceQueue(boost::thread_group& threadGroup);
+/**
+ * Wait until the listeners saw every notification queued before the call,
+ * running them on this thread once the queue thread is gone. Never call it
+ * with cs_main held, the wallet takes cs_main for its notifications.
+ */
+void SyncWithValidationInterfaceQueue();
+/** SyncWithValidationInterfaceQueue() if more than MAX_VALIDATION_QUEUE_SIZE notifications wait */
+void LimitValidationInterfaceQueue();
 
 class CValidationInterface {
 protected:
 // XX42    virtual void EraseFromWallet(const uint256& hash){};
     virtual void UpdatedBlockTip(const CBlockIndex *pindex) {}
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock) {}
+    virtual void SyncTransactions(const std::vector<CTransaction> &vtx, const CBlock *pblock);
     virtual void NotifyTransactionLock(const CTransaction &tx) {}
+    virtual void NotifyMasternodeMessage(const std::string &strTopic, const char *pch, size_t nSize) {}
     virtual void SetBestChain(const CBlockLocator &locator) {}
     virtual bool UpdatedTransaction(const uint256 &hash) { return false;}
     virtual void Inventory(const uint256 &hash) {}
@@ -43,7 +80,7 @@ protected:
     virtual void BlockChecked(const CBlock&, const CValidationState&) {}
 // XX42    virtual void GetScriptForMining(boost::shared_ptr<CReserveScript>&) {};
     virtual void ResetRequestCount(const uint256 &hash) {};
-    friend void ::RegisterValidationInterface(CValidationInterface*);
+    friend void ::RegisterValidationInterface(CValidationInterface*, bool);
     friend void ::UnregisterValidationInterface(CValidationInterface*);
     friend void ::UnregisterAllValidationInterfaces();
 };
@@ -54,8 +91,12 @@ struct CMainSignals {
     boost::signals2::signal<void (const CBlockIndex *)> UpdatedBlockTip;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void (const CTransaction &, const CBlock *)> SyncTransaction;
+    /** Notifies listeners of several updated transactions at once, by default one SyncTransaction each. */
+    boost::signals2::signal<void (const std::vector<CTransaction> &, const CBlock *)> SyncTransactions;
     /** Notifies listeners of an updated transaction lock without new data. */
     boost::signals2::signal<void (const CTransaction &)> NotifyTransactionLock;
+    /** Notifies listeners of a new masternode, payment winner or budget object, in its network serialization. */
+    boost::signals2::signal<void (const std::string &, const char *, size_t)> NotifyMasternodeMessage;
     /** Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible). */
     boost::signals2::signal<bool (const uint256 &)> UpdatedTransaction;
     /** Notifies listeners of a new active block chain. */
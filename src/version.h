@@ -11,7 +11,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70912;
+static const int PROTOCOL_VERSION = 70916;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -36,5 +36,17 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! "mnvsd" and "mngetd" sync requests with a CSyncDigest are understood starting with this version
+static const int SYNC_DIGEST_VERSION = 70913;
+
+//! "getheaders" is answered with "headers" and blocks are downloaded headers first starting with this version
+static const int HEADERS_FIRST_VERSION = 70914;
+
+//! "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" are understood starting with this version
+static const int COMPACT_BLOCKS_VERSION = 70915;
+
+//! "mnpann", "getmnpc" and "mnpc" relay masternode pings by the short ids of their masternodes starting with this version
+static const int COMPACT_MNP_VERSION = 70916;
+
 
 #endif // BITCOIN_VERSION_H
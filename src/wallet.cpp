@@ -93,6 +93,13 @@ CPubKey CWallet::GenerateNewKey()
 
     CPubKey pubkey = secret.GetPubKey();
     assert(secret.VerifyPubKey(pubkey));
+    AddGeneratedKey(secret, pubkey);
+    return pubkey;
+}
+
+void CWallet::AddGeneratedKey(const CKey& secret, const CPubKey& pubkey)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
 
     // Create new metadata
     int64_t nCreationTime = GetTime();
@@ -102,7 +109,68 @@ CPubKey CWallet::GenerateNewKey()
 
     if (!AddKeyPubKey(secret, pubkey))
         throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
-    return pubkey;
+}
+
+namespace
+{
+/** Makes the keys of CWallet::AddKeysToPool */
+struct CMakeKeyJob {
+    std::vector<CKey>& vKeys;
+    std::vector<CPubKey>& vPubKeys;
+    bool fCompressed;
+
+    CMakeKeyJob(std::vector<CKey>& vKeysIn, std::vector<CPubKey>& vPubKeysIn, bool fCompressedIn) : vKeys(vKeysIn), vPubKeys(vPubKeysIn), fCompressed(fCompressedIn) {}
+
+    void operator()(size_t i)
+    {
+        vKeys[i].MakeNewKey(fCompressed);
+        vPubKeys[i] = vKeys[i].GetPubKey();
+        assert(vKeys[i].VerifyPubKey(vPubKeys[i]));
+    }
+};
+} // anon namespace
+
+void CWallet::AddKeysToPool(unsigned int nKeys, bool fInitMessage)
+{
+    AssertLockHeld(cs_wallet);
+    if (nKeys == 0)
+        return;
+
+    bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    if (fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+    RandAddSeedPerfmon();
+
+    int64_t nStart = GetTimeMillis();
+    bool fShowProgress = nKeys > KEYPOOL_GENERATE_BATCH;
+    if (fShowProgress)
+        ShowProgress(_("Generating keys..."), 0);
+    CWalletBatch batch(this);
+    CWalletDBHandle walletdb(this);
+    for (unsigned int nDone = 0; nDone < nKeys;) {
+        unsigned int nGenerate = std::min(nKeys - nDone, KEYPOOL_GENERATE_BATCH);
+        std::vector<CKey> vKeys(nGenerate);
+        std::vector<CPubKey> vPubKeys(nGenerate);
+        ParallelKeyJobs(nGenerate, CMakeKeyJob(vKeys, vPubKeys, fCompressed));
+
+        for (unsigned int i = 0; i < nGenerate; i++) {
+            AddGeneratedKey(vKeys[i], vPubKeys[i]);
+            int64_t nEnd = setKeyPool.empty() ? 1 : *setKeyPool.rbegin() + 1;
+            if (!walletdb->WritePool(nEnd, CKeyPool(vPubKeys[i])))
+                throw runtime_error("TopUpKeyPool() : writing generated key failed");
+            setKeyPool.insert(nEnd);
+        }
+        nDone += nGenerate;
+
+        double dProgress = 100.f * nDone / nKeys;
+        if (fShowProgress)
+            ShowProgress(_("Generating keys..."), std::min(99, (int)dProgress));
+        if (fInitMessage)
+            uiInterface.InitMessage(strprintf(_("Loading wallet... (%3.2f %%)"), dProgress));
+    }
+    if (fShowProgress)
+        ShowProgress(_("Generating keys..."), 100);
+    LogPrint("net", "keypool added %u keys, size=%u, %dms\n", nKeys, setKeyPool.size(), GetTimeMillis() - nStart);
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
@@ -116,20 +184,31 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
     script = GetScriptForDestination(pubkey.GetID());
     if (HaveWatchOnly(script))
         RemoveWatchOnly(script);
+    UpdateKeyOwnership(pubkey);
+    fStakeCandidatesStale = true;
 
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
-        return CWalletDB(strWalletFile).WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
+        return CWalletDBHandle(this)->WriteKey(pubkey, secret.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
 }
 
+bool CWallet::LoadKey(const CKey& key, const CPubKey& pubkey)
+{
+    if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey))
+        return false;
+    UpdateKeyOwnership(pubkey);
+    return true;
+}
+
 bool CWallet::AddCryptedKey(const CPubKey& vchPubKey,
     const vector<unsigned char>& vchCryptedSecret)
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    UpdateKeyOwnership(vchPubKey);
     if (!fFileBacked)
         return true;
     {
@@ -139,7 +218,7 @@ bool CWallet::AddCryptedKey(const CPubKey& vchPubKey,
                 vchCryptedSecret,
                 mapKeyMetadata[vchPubKey.GetID()]);
         else
-            return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
+            return CWalletDBHandle(this)->WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
     }
     return false;
 }
@@ -156,16 +235,26 @@ bool CWallet::LoadKeyMetadata(const CPubKey& pubkey, const CKeyMetadata& meta)
 
 bool CWallet::LoadCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret)
 {
-    return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    UpdateKeyOwnership(vchPubKey);
+    return true;
 }
 
 bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_KeyStore);
+        setScriptHashOwnership.insert(GetScriptForDestination(CScriptID(redeemScript)));
+    }
+    UpdateScriptHashOwnership();
+    InvalidateBalances();
+    fStakeCandidatesStale = true;
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
+    return CWalletDBHandle(this)->WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
 bool CWallet::LoadCScript(const CScript& redeemScript)
@@ -180,18 +269,29 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
         return true;
     }
 
-    return CCryptoKeyStore::AddCScript(redeemScript);
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    {
+        LOCK(cs_KeyStore);
+        setScriptHashOwnership.insert(GetScriptForDestination(CScriptID(redeemScript)));
+    }
+    UpdateScriptHashOwnership();
+    return true;
 }
 
 bool CWallet::AddWatchOnly(const CScript& dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    UpdateScriptOwnership(dest);
+    UpdateScriptHashOwnership();
+    InvalidateBalances();
+    fStakeCandidatesStale = true;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteWatchOnly(dest);
+    return CWalletDBHandle(this)->WriteWatchOnly(dest);
 }
 
 bool CWallet::RemoveWatchOnly(const CScript& dest)
@@ -199,10 +299,13 @@ bool CWallet::RemoveWatchOnly(const CScript& dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    UpdateScriptOwnership(dest);
+    UpdateScriptHashOwnership();
+    InvalidateBalances();
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
-        if (!CWalletDB(strWalletFile).EraseWatchOnly(dest))
+        if (!CWalletDBHandle(this)->EraseWatchOnly(dest))
             return false;
 
     return true;
@@ -210,18 +313,24 @@ bool CWallet::RemoveWatchOnly(const CScript& dest)
 
 bool CWallet::LoadWatchOnly(const CScript& dest)
 {
-    return CCryptoKeyStore::AddWatchOnly(dest);
+    if (!CCryptoKeyStore::AddWatchOnly(dest))
+        return false;
+    UpdateScriptOwnership(dest);
+    UpdateScriptHashOwnership();
+    return true;
 }
 
 bool CWallet::AddMultiSig(const CScript& dest)
 {
     if (!CCryptoKeyStore::AddMultiSig(dest))
         return false;
+    UpdateScriptOwnership(dest);
+    UpdateScriptHashOwnership();
     nTimeFirstKey = 1; // No birthday information
     NotifyMultiSigChanged(true);
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteMultiSig(dest);
+    return CWalletDBHandle(this)->WriteMultiSig(dest);
 }
 
 bool CWallet::RemoveMultiSig(const CScript& dest)
@@ -229,10 +338,12 @@ bool CWallet::RemoveMultiSig(const CScript& dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveMultiSig(dest))
         return false;
+    UpdateScriptOwnership(dest);
+    UpdateScriptHashOwnership();
     if (!HaveMultiSig())
         NotifyMultiSigChanged(false);
     if (fFileBacked)
-        if (!CWalletDB(strWalletFile).EraseMultiSig(dest))
+        if (!CWalletDBHandle(this)->EraseMultiSig(dest))
             return false;
 
     return true;
@@ -240,7 +351,61 @@ bool CWallet::RemoveMultiSig(const CScript& dest)
 
 bool CWallet::LoadMultiSig(const CScript& dest)
 {
-    return CCryptoKeyStore::AddMultiSig(dest);
+    if (!CCryptoKeyStore::AddMultiSig(dest))
+        return false;
+    UpdateScriptOwnership(dest);
+    UpdateScriptHashOwnership();
+    return true;
+}
+
+void CWallet::UpdateScriptOwnership(const CScript& script)
+{
+    LOCK(cs_KeyStore);
+    isminetype mine = ::IsMine(*this, script);
+    if (mine == ISMINE_NO)
+        mapScriptOwnership.erase(script);
+    else
+        mapScriptOwnership[script] = mine;
+}
+
+void CWallet::UpdateKeyOwnership(const CPubKey& pubkey)
+{
+    UpdateScriptOwnership(GetScriptForDestination(pubkey.GetID()));
+    UpdateScriptOwnership(CScript() << ToByteVector(pubkey) << OP_CHECKSIG);
+    UpdateScriptHashOwnership();
+}
+
+void CWallet::UpdateScriptHashOwnership()
+{
+    LOCK(cs_KeyStore);
+    BOOST_FOREACH (const CScript& script, setScriptHashOwnership)
+        UpdateScriptOwnership(script);
+}
+
+/** The scripts ::IsMine only finds ours if they have an entry in mapScriptOwnership */
+static bool IsOwnershipMapped(const CScript& script)
+{
+    if (script.empty() || script[0] == OP_RETURN || script.IsPayToScriptHash())
+        return true;
+    // pay to pubkey hash
+    if (script.size() == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 0x14 && script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG)
+        return true;
+    // pay to a compressed or uncompressed pubkey
+    return ((script.size() == 35 && script[0] == 33) || (script.size() == 67 && script[0] == 65)) && script.back() == OP_CHECKSIG;
+}
+
+isminetype CWallet::IsMine(const CScript& scriptPubKey) const
+{
+    {
+        LOCK(cs_KeyStore);
+        ScriptOwnershipMap::const_iterator it = mapScriptOwnership.find(scriptPubKey);
+        if (it != mapScriptOwnership.end())
+            return it->second;
+    }
+    if (IsOwnershipMapped(scriptPubKey))
+        return ISMINE_NO;
+    // Bare multisig and nonstandard scripts
+    return ::IsMine(*this, scriptPubKey);
 }
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase, bool stakeOnly)
@@ -267,6 +432,7 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase, bool stakeOnly)
                 continue; // try another master key
             if (CCryptoKeyStore::Unlock(vMasterKey)) {
                 fWalletUnlockStakingOnly = stakeOnly;
+                WakeStakeMinter();
                 return true;
             }
         }
@@ -308,7 +474,7 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
                     return false;
                 if (!crypter.Encrypt(vMasterKey, pMasterKey.second.vchCryptedKey))
                     return false;
-                CWalletDB(strWalletFile).WriteMasterKey(pMasterKey.first, pMasterKey.second);
+                CWalletDBHandle(this)->WriteMasterKey(pMasterKey.first, pMasterKey.second);
                 if (fWasLocked)
                     Lock();
 
@@ -322,8 +488,8 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
-    CWalletDB walletdb(strWalletFile);
-    walletdb.WriteBestBlock(loc);
+    CWalletDBHandle walletdb(this);
+    walletdb->WriteBestBlock(loc);
 }
 
 bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn, bool fExplicit)
@@ -341,12 +507,11 @@ bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn,
     if (nVersion > nWalletMaxVersion)
         nWalletMaxVersion = nVersion;
 
-    if (fFileBacked) {
-        CWalletDB* pwalletdb = pwalletdbIn ? pwalletdbIn : new CWalletDB(strWalletFile);
-        if (nWalletVersion > 40000)
-            pwalletdb->WriteMinVersion(nWalletVersion);
-        if (!pwalletdbIn)
-            delete pwalletdb;
+    if (fFileBacked && nWalletVersion > 40000) {
+        if (pwalletdbIn)
+            pwalletdbIn->WriteMinVersion(nWalletVersion);
+        else
+            CWalletDBHandle(this)->WriteMinVersion(nWalletVersion);
     }
 
     return true;
@@ -423,7 +588,7 @@ void CWallet::SyncMetaData(pair<TxSpends::iterator, TxSpends::iterator> range)
  * Outpoint is spent if any non-conflicted transaction
  * spends it:
  */
-bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
+bool CWallet::IsSpent(const uint256& hash, unsigned int n, bool fCachedDepth) const
 {
     const COutPoint outpoint(hash, n);
     pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
@@ -431,7 +596,7 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
     for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
         const uint256& wtxid = it->second;
         std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
-        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() >= 0)
+        if (mit != mapWallet.end() && (fCachedDepth ? mit->second.GetCachedDepth() : mit->second.GetDepthInMainChain()) >= 0)
             return true; // Spent
     }
     return false;
@@ -440,6 +605,10 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
+    // What is available of the spent transaction changes
+    map<uint256, CWalletTx>::iterator it = mapWallet.find(outpoint.hash);
+    if (it != mapWallet.end())
+        it->second.MarkDirty();
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
     SyncMetaData(range);
@@ -492,6 +661,37 @@ bool CWallet::GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey&
     return false;
 }
 
+void CWallet::GetMasternodeCollaterals(MasternodeCollateralMap& mapCollaterals)
+{
+    mapCollaterals.clear();
+    std::vector<COutput> vPossibleCoins;
+    AvailableCoins(vPossibleCoins, true, NULL, false, ONLY_10000);
+    BOOST_FOREACH (const COutput& out, vPossibleCoins)
+        mapCollaterals.insert(std::make_pair(COutPoint(out.tx->GetHash(), out.i), out));
+}
+
+bool CWallet::GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, const MasternodeCollateralMap& mapCollaterals, std::string strTxHash, std::string strOutputIndex)
+{
+    AssertLockHeld(cs_wallet);
+    // wait for reindex and/or import to finish
+    if (fImporting || fReindex) return false;
+
+    int nOutputIndex;
+    try {
+        nOutputIndex = std::stoi(strOutputIndex.c_str());
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s on strOutputIndex\n", __func__, e.what());
+        return false;
+    }
+
+    MasternodeCollateralMap::const_iterator it = mapCollaterals.find(COutPoint(uint256S(strTxHash), nOutputIndex));
+    if (it == mapCollaterals.end()) {
+        LogPrintf("CWallet::GetMasternodeVinAndKeys -- Could not locate specified masternode vin\n");
+        return false;
+    }
+    return GetVinAndKeysFromOutput(it->second, txinRet, pubKeyRet, keyRet);
+}
+
 bool CWallet::GetVinAndKeysFromOutput(COutput out, CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet)
 {
     // wait for reindex and/or import to finish
@@ -610,6 +810,43 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
     return true;
 }
 
+void CWallet::BeginWalletBatch()
+{
+    AssertLockHeld(cs_wallet);
+    if (nWalletBatchDepth++ > 0 || !fFileBacked)
+        return;
+    pwalletdbBatch = new CWalletDB(strWalletFile);
+    if (!pwalletdbBatch->TxnBegin()) {
+        LogPrintf("%s : unable to begin a database transaction, writing unbatched\n", __func__);
+        delete pwalletdbBatch;
+        pwalletdbBatch = NULL;
+    }
+}
+
+void CWallet::EndWalletBatch()
+{
+    AssertLockHeld(cs_wallet);
+    assert(nWalletBatchDepth > 0);
+    if (--nWalletBatchDepth > 0 || !pwalletdbBatch)
+        return;
+    if (!pwalletdbBatch->TxnCommit())
+        LogPrintf("%s : failed to commit the wallet database transaction\n", __func__);
+    delete pwalletdbBatch;
+    pwalletdbBatch = NULL;
+}
+
+CWalletDBHandle::CWalletDBHandle(const CWallet* pwallet) : pwalletdb(NULL), fOwned(false)
+{
+    // A batch is only open while its thread holds cs_wallet, so no other thread can join it
+    TRY_LOCK(pwallet->cs_wallet, fLocked);
+    if (fLocked && pwallet->pwalletdbBatch) {
+        pwalletdb = pwallet->pwalletdbBatch;
+    } else {
+        pwalletdb = new CWalletDB(pwallet->strWalletFile);
+        fOwned = true;
+    }
+}
+
 int64_t CWallet::IncOrderPosNext(CWalletDB* pwalletdb)
 {
     AssertLockHeld(cs_wallet); // nOrderPosNext
@@ -617,7 +854,7 @@ int64_t CWallet::IncOrderPosNext(CWalletDB* pwalletdb)
     if (pwalletdb) {
         pwalletdb->WriteOrderPosNext(nOrderPosNext);
     } else {
-        CWalletDB(strWalletFile).WriteOrderPosNext(nOrderPosNext);
+        CWalletDBHandle(this)->WriteOrderPosNext(nOrderPosNext);
     }
     return nRet;
 }
@@ -626,6 +863,8 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        fBalancesValid = false;
+        nOwnershipVersion++;
         BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
             item.second.MarkDirty();
     }
@@ -636,10 +875,15 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
     uint256 hash = wtxIn.GetHash();
 
     if (fFromLoadWallet) {
+        bool fInsertedNew = !mapWallet.count(hash);
         mapWallet[hash] = wtxIn;
         CWalletTx& wtx = mapWallet[hash];
         wtx.BindWallet(this);
+        // The stake candidates wait for the block index, see LoadWalletChainState
         AddToSpends(hash);
+        UpdateTxHeightIndex(wtx);
+        if (fInsertedNew)
+            AddTxDestinationIndex(wtx);
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -653,6 +897,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
             wtx.nTimeSmart = wtx.nTimeReceived;
             AddToSpends(hash);
+            AddTxDestinationIndex(wtx);
         }
 
         bool fUpdated = false;
@@ -662,6 +907,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                 wtx.hashBlock = wtxIn.hashBlock;
                 fUpdated = true;
             }
+            // The block may be connected again after a reorg with the same hashBlock
+            if (wtxIn.hashBlock != 0 && wtxIn.hashAnchor == wtxIn.hashBlock) {
+                wtx.hashAnchor = wtxIn.hashAnchor;
+                wtx.nAnchorHeight = wtxIn.nAnchorHeight;
+            }
             if (wtxIn.nIndex != -1 && (wtxIn.vMerkleBranch != wtx.vMerkleBranch || wtxIn.nIndex != wtx.nIndex)) {
                 wtx.vMerkleBranch = wtxIn.vMerkleBranch;
                 wtx.nIndex = wtxIn.nIndex;
@@ -676,6 +926,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         //// debug print
         LogPrint("net","AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
+        if (fInsertedNew || fUpdated)
+            UpdateStakeCandidates(wtx);
+        UpdateTxHeightIndex(wtx);
+
         // Write to disk
         if (fInsertedNew || fUpdated)
             if (!wtx.WriteToDisk())
@@ -713,13 +967,27 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
             CWalletTx wtx(this, tx);
             // Get merkle branch if transaction was found in a block
             if (pblock)
-                wtx.SetMerkleBranch(*pblock);
+                wtx.SetMerkleBranch(GetMerkleIndex(*pblock));
             return AddToWallet(wtx);
         }
     }
     return false;
 }
 
+const CBlockMerkleIndex& CWallet::GetMerkleIndex(const CBlock& block)
+{
+    AssertLockHeld(cs_wallet);
+    if (merkleIndexLast.GetBlockHash() != block.GetHash())
+        merkleIndexLast.Build(block);
+    return merkleIndexLast;
+}
+
+void CWallet::UpdatedBlockTip(const CBlockIndex* pindex)
+{
+    // Any kernel still being searched was built on the old tip
+    InterruptKernelSearch();
+}
+
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
@@ -733,6 +1001,165 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
         if (mapWallet.count(txin.prevout.hash))
             mapWallet[txin.prevout.hash].MarkDirty();
     }
+
+    // The transactions of a block are followed by SyncTransactions' update
+    if (!pblock)
+        UpdateBalancesIfNotified();
+}
+
+void CWallet::SyncTransactions(const std::vector<CTransaction>& vtx, const CBlock* pblock)
+{
+    LOCK2(cs_main, cs_wallet);
+    CWalletBatch batch(this);
+    BOOST_FOREACH (const CTransaction& tx, vtx)
+        SyncTransaction(tx, pblock);
+    // Blocks are connected and disconnected with one SyncTransactions each
+    UpdateChainView();
+    UpdateBalancesIfNotified();
+}
+
+void CWallet::UpdateChainView()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == pindexChainView)
+        return;
+
+    // Extending the view only adds blocks, whose transactions got their
+    // anchors from SetMerkleBranch. Otherwise the anchors above the fork may
+    // point at disconnected blocks, and transactions not in the old view may
+    // be in the new one.
+    if (!pindexChainView || !chainActive.Contains(pindexChainView)) {
+        const CBlockIndex* pindexFork = pindexChainView ? chainActive.FindFork(pindexChainView) : NULL;
+        int nForkHeight = pindexFork ? pindexFork->nHeight : -1;
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+            CWalletTx& wtx = it->second;
+            if (wtx.hashBlock == 0) {
+                wtx.hashAnchor = 0;
+                wtx.nAnchorHeight = -1;
+            } else if (wtx.hashAnchor != wtx.hashBlock || wtx.nAnchorHeight < 0 || wtx.nAnchorHeight > nForkHeight) {
+                wtx.UpdateAnchor();
+            }
+            UpdateTxHeightIndex(wtx);
+        }
+    }
+
+    pindexChainView = pindexTip;
+    nChainViewHeight = pindexTip ? pindexTip->nHeight : -1;
+}
+
+void CWallet::RemoveTxHeightIndex(const uint256& hash)
+{
+    std::map<uint256, int>::iterator it = mapTxIndexedHeight.find(hash);
+    if (it == mapTxIndexedHeight.end())
+        return;
+    setTxByHeight.erase(make_pair(it->second, hash));
+    mapTxIndexedHeight.erase(it);
+}
+
+void CWallet::UpdateTxHeightIndex(const CWalletTx& wtx)
+{
+    // An anchor not resolved for the current hashBlock counts as not in the chain
+    const uint256 hash = wtx.GetHash();
+    int nHeight = (wtx.hashBlock != 0 && wtx.nIndex != -1 && wtx.hashAnchor == wtx.hashBlock) ? wtx.nAnchorHeight : -1;
+    std::map<uint256, int>::iterator it = mapTxIndexedHeight.find(hash);
+    if (it != mapTxIndexedHeight.end()) {
+        if (it->second == nHeight)
+            return;
+        setTxByHeight.erase(make_pair(it->second, hash));
+        it->second = nHeight;
+    } else {
+        mapTxIndexedHeight.insert(make_pair(hash, nHeight));
+    }
+    setTxByHeight.insert(make_pair(nHeight, hash));
+}
+
+void CWallet::GetTransactionsAbove(int nHeight, std::vector<const CWalletTx*>& vRet) const
+{
+    AssertLockHeld(cs_wallet);
+    vRet.clear();
+    TxHeightIndex::const_iterator it = setTxByHeight.begin();
+    while (it != setTxByHeight.end()) {
+        if (it->first >= 0 && it->first <= nHeight) {
+            it = setTxByHeight.lower_bound(make_pair(nHeight + 1, uint256(0)));
+            continue;
+        }
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(it->second);
+        if (mi != mapWallet.end())
+            vRet.push_back(&mi->second);
+        ++it;
+    }
+}
+
+void CWallet::AddTxDestinationIndex(const CWalletTx& wtx)
+{
+    BOOST_FOREACH (const CTxOut& txout, wtx.vout) {
+        CTxDestination dest;
+        if (!ExtractDestination(txout.scriptPubKey, dest))
+            continue;
+        std::vector<const CWalletTx*>& vwtx = mapTxByDestination[dest];
+        // Outputs of a transaction paying the same destination twice come one after the other
+        if (vwtx.empty() || vwtx.back() != &wtx)
+            vwtx.push_back(&wtx);
+    }
+    if (!wtx.strFromAccount.empty())
+        mapTxByFromAccount[wtx.strFromAccount].push_back(&wtx);
+}
+
+static void EraseFromTxList(std::vector<const CWalletTx*>& vwtx, const CWalletTx* pwtx)
+{
+    vwtx.erase(std::remove(vwtx.begin(), vwtx.end(), pwtx), vwtx.end());
+}
+
+void CWallet::RemoveTxDestinationIndex(const CWalletTx& wtx)
+{
+    BOOST_FOREACH (const CTxOut& txout, wtx.vout) {
+        CTxDestination dest;
+        if (!ExtractDestination(txout.scriptPubKey, dest))
+            continue;
+        std::map<CTxDestination, std::vector<const CWalletTx*> >::iterator it = mapTxByDestination.find(dest);
+        if (it == mapTxByDestination.end())
+            continue;
+        EraseFromTxList(it->second, &wtx);
+        if (it->second.empty())
+            mapTxByDestination.erase(it);
+    }
+    std::map<std::string, std::vector<const CWalletTx*> >::iterator it = mapTxByFromAccount.find(wtx.strFromAccount);
+    if (it != mapTxByFromAccount.end()) {
+        EraseFromTxList(it->second, &wtx);
+        if (it->second.empty())
+            mapTxByFromAccount.erase(it);
+    }
+}
+
+const CWallet::TxList& CWallet::GetTransactionsPaying(const CTxDestination& dest) const
+{
+    static const TxList vEmpty;
+    AssertLockHeld(cs_wallet);
+    std::map<CTxDestination, std::vector<const CWalletTx*> >::const_iterator it = mapTxByDestination.find(dest);
+    return it == mapTxByDestination.end() ? vEmpty : it->second;
+}
+
+const CWallet::TxList& CWallet::GetTransactionsFromAccount(const std::string& strAccount) const
+{
+    static const TxList vEmpty;
+    AssertLockHeld(cs_wallet);
+    assert(!strAccount.empty());
+    std::map<std::string, std::vector<const CWalletTx*> >::const_iterator it = mapTxByFromAccount.find(strAccount);
+    return it == mapTxByFromAccount.end() ? vEmpty : it->second;
+}
+
+CAmount CWallet::GetAccountCreditDebit(const std::string& strAccount) const
+{
+    AssertLockHeld(cs_wallet);
+    std::map<std::string, CAmount>::const_iterator it = mapAccountCreditDebit.find(strAccount);
+    return it == mapAccountCreditDebit.end() ? 0 : it->second;
+}
+
+void CWallet::LoadAccountingEntry(const CAccountingEntry& acentry)
+{
+    mapAccountCreditDebit[acentry.strAccount] += acentry.nCreditDebit;
 }
 
 void CWallet::EraseFromWallet(const uint256& hash)
@@ -741,8 +1168,15 @@ void CWallet::EraseFromWallet(const uint256& hash)
         return;
     {
         LOCK(cs_wallet);
+        RemoveStakeCandidates(hash);
+        RemoveTxHeightIndex(hash);
+        std::map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end())
+            RemoveTxDestinationIndex(it->second);
         if (mapWallet.erase(hash))
-            CWalletDB(strWalletFile).EraseTx(hash);
+            CWalletDBHandle(this)->EraseTx(hash);
+        // The outputs it spent are not spent anymore
+        fBalancesValid = false;
     }
     return;
 }
@@ -786,7 +1220,7 @@ bool CWallet::IsChange(const CTxOut& txout) const
     // a better way of identifying which outputs are 'the send' and which are
     // 'the change' will need to be implemented (maybe extend CWalletTx to remember
     // which output, if any, was change).
-    if (::IsMine(*this, txout.scriptPubKey)) {
+    if (IsMine(txout)) {
         CTxDestination address;
         if (!ExtractDestination(txout.scriptPubKey, address))
             return true;
@@ -980,6 +1414,25 @@ CAmount CWalletTx::GetAvailableWatchOnlyCredit(const bool& fUseCache) const
     return nCredit;
 }
 
+const std::vector<CWalletTx::CCachedOutput>& CWalletTx::GetCachedOutputs() const
+{
+    AssertLockHeld(pwallet->cs_wallet);
+    if (fOutputsCached && nOutputsCacheVersion == pwallet->GetOwnershipVersion())
+        return vOutputsCached;
+
+    vOutputsCached.resize(vout.size());
+    for (unsigned int i = 0; i < vout.size(); ++i) {
+        CCachedOutput& cached = vOutputsCached[i];
+        cached.fIsMine = pwallet->IsMine(vout[i]);
+        cached.fExtracted = ExtractDestination(vout[i].scriptPubKey, cached.destination);
+        if (!cached.fExtracted)
+            cached.destination = CNoDestination();
+    }
+    fOutputsCached = true;
+    nOutputsCacheVersion = pwallet->GetOwnershipVersion();
+    return vOutputsCached;
+}
+
 void CWalletTx::GetAmounts(list<COutputEntry>& listReceived,
     list<COutputEntry>& listSent,
     CAmount& nFee,
@@ -991,6 +1444,9 @@ void CWalletTx::GetAmounts(list<COutputEntry>& listReceived,
     listSent.clear();
     strSentAccount = strFromAccount;
 
+    LOCK(pwallet->cs_wallet);
+    const std::vector<CCachedOutput>& vOutputs = GetCachedOutputs();
+
     // Compute fee:
     CAmount nDebit = GetDebit(filter);
     if (nDebit > 0) // debit>0 means we signed/sent this transaction
@@ -1001,27 +1457,23 @@ void CWalletTx::GetAmounts(list<COutputEntry>& listReceived,
 
     // Sent/received.
     for (unsigned int i = 0; i < vout.size(); ++i) {
-        const CTxOut& txout = vout[i];
-        isminetype fIsMine = pwallet->IsMine(txout);
+        const CCachedOutput& cached = vOutputs[i];
+        isminetype fIsMine = cached.fIsMine;
         // Only need to handle txouts if AT LEAST one of these is true:
         //   1) they debit from us (sent)
         //   2) the output is to us (received)
         if (nDebit > 0) {
-            // Don't report 'change' txouts
-            if (pwallet->IsChange(txout))
+            // Don't report 'change' txouts, as IsChange tells them apart
+            if (fIsMine != ISMINE_NO && (!cached.fExtracted || !pwallet->mapAddressBook.count(cached.destination)))
                 continue;
         } else if (!(fIsMine & filter) )
             continue;
 
-        // In either case, we need to get the destination address
-        CTxDestination address;
-        if (!ExtractDestination(txout.scriptPubKey, address)) {
+        if (!cached.fExtracted)
             LogPrintf("CWalletTx::GetAmounts: Unknown transaction type found, txid %s\n",
                 this->GetHash().ToString());
-            address = CNoDestination();
-        }
 
-        COutputEntry output = {address, txout.nValue, (int)i};
+        COutputEntry output = {cached.destination, vout[i].nValue, (int)i};
 
         // If we are debited by the transaction, add the output as a "sent" entry
         if (nDebit > 0)
@@ -1065,7 +1517,34 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
 
 bool CWalletTx::WriteToDisk()
 {
-    return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
+    // Never write a transaction without its input scripts over the full one
+    if (!PageIn())
+        return false;
+    return CWalletDBHandle(pwallet)->WriteTx(GetHash(), *this);
+}
+
+void CWalletTx::PageOut()
+{
+    BOOST_FOREACH (CTxIn& txin, vin)
+        CScript().swap(txin.scriptSig);
+    std::vector<uint256>().swap(vMerkleBranch);
+    fPagedOut = true;
+}
+
+bool CWalletTx::PageIn()
+{
+    if (!fPagedOut)
+        return true;
+    CWalletTx wtxDisk;
+    if (!pwallet || !CWalletDBHandle(pwallet)->ReadTx(GetHash(), wtxDisk) || wtxDisk.vin.size() != vin.size())
+        return error("CWalletTx::PageIn : unable to read transaction %s from the wallet file", GetHash().ToString());
+    for (unsigned int i = 0; i < vin.size(); i++)
+        vin[i].scriptSig = wtxDisk.vin[i].scriptSig;
+    // A branch set since the transaction was paged out is newer than the one on disk
+    if (vMerkleBranch.empty() && wtxDisk.hashBlock == hashBlock && wtxDisk.nIndex == nIndex)
+        vMerkleBranch = wtxDisk.vMerkleBranch;
+    fPagedOut = false;
+    return true;
 }
 
 /**
@@ -1073,44 +1552,267 @@ bool CWalletTx::WriteToDisk()
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  */
+namespace
+{
+/** A block of a wallet rescan and which of its transactions pay to the wallet */
+struct CRescanJob {
+    CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    uint256 hash;
+    CBlock block;
+    //! Per transaction of block: whether one of its outputs is ours
+    std::vector<bool> vfMine;
+    bool fDone;
+
+    CRescanJob(CBlockIndex* pindexIn) : pindex(pindexIn), pos(pindexIn->GetBlockPos()), hash(pindexIn->GetBlockHash()), fDone(false) {}
+};
+
+/**
+ * Reads the blocks of a wallet rescan ahead on a few threads and matches
+ * their outputs against the keystore, which has a lock of its own. Whether
+ * an input spends one of our outputs depends on the wallet transactions the
+ * earlier blocks add, so that is left to the caller, which takes the blocks
+ * in chain order through Next(). Neither cs_main nor cs_wallet is taken here.
+ */
+class CWalletRescanner
+{
+private:
+    const CWallet* pwallet;
+    std::vector<CRescanJob> vJobs;
+    boost::mutex mutex;
+    boost::condition_variable condWorker; // room to read ahead, or stopping
+    boost::condition_variable condDone;   // a block was matched
+    size_t nNextTodo;
+    size_t nNextCommit;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void Worker()
+    {
+        while (true) {
+            CRescanJob* job;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNextTodo < vJobs.size() && nNextTodo >= nNextCommit + MAX_RESCAN_QUEUE)
+                    condWorker.wait(lock);
+                if (fStop || nNextTodo >= vJobs.size())
+                    return;
+                job = &vJobs[nNextTodo++];
+            }
+            // A block that cannot be read is skipped, as it always was
+            if (ReadBlockFromDisk(job->block, job->pos) && job->block.GetHash() == job->hash) {
+                job->vfMine.resize(job->block.vtx.size());
+                for (unsigned int i = 0; i < job->block.vtx.size(); i++) {
+                    BOOST_FOREACH (const CTxOut& txout, job->block.vtx[i].vout) {
+                        if (pwallet->IsMine(txout) != ISMINE_NO) {
+                            job->vfMine[i] = true;
+                            break;
+                        }
+                    }
+                }
+            } else {
+                job->block.SetNull();
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            job->fDone = true;
+            condDone.notify_all();
+        }
+    }
+
+public:
+    CWalletRescanner(const CWallet* pwalletIn, std::vector<CRescanJob>& vJobsIn) : pwallet(pwalletIn), nNextTodo(0), nNextCommit(0), fStop(false)
+    {
+        vJobs.swap(vJobsIn);
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency() - 1, MAX_RESCAN_THREADS));
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CWalletRescanner::Worker, this));
+    }
+
+    ~CWalletRescanner()
+    {
+        boost::this_thread::disable_interruption di;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            condWorker.notify_all();
+        }
+        threadGroup.join_all();
+    }
+
+    //! Wait for the next block in chain order; false once all blocks were returned.
+    bool Next(CRescanJob*& job)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nNextCommit >= vJobs.size())
+            return false;
+        while (!vJobs[nNextCommit].fDone)
+            condDone.wait(lock);
+        job = &vJobs[nNextCommit++];
+        condWorker.notify_all();
+        return true;
+    }
+};
+} // anon namespace
+
+/**
+ * Scan the active chain from pindexStart for transactions involving the
+ * wallet. Blocks are read and their outputs matched on CWalletRescanner
+ * threads; they are added to the wallet in order, holding cs_main and
+ * cs_wallet for RESCAN_COMMIT_BATCH blocks at a time, so that a caller that
+ * does not hold them does not lock the node for the whole rescan.
+ * AbortRescan() and shutdown stop it between batches.
+ */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
+    if (fScanningWallet.exchange(true)) {
+        LogPrintf("%s : another rescan is running already\n", __func__);
+        return 0;
+    }
+    fAbortRescan = false;
+
     int ret = 0;
     int64_t nNow = GetTime();
+    int64_t nStart = GetTimeMillis();
+    try {
+        std::vector<CRescanJob> vJobs;
+        double dProgressStart, dProgressTip;
+        {
+            LOCK2(cs_main, cs_wallet);
+
+            // no need to read and scan block, if block was created before
+            // our wallet birthday (as adjusted for block time variability)
+            CBlockIndex* pindex = pindexStart;
+            while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
+                pindex = chainActive.Next(pindex);
+
+            dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+            dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+            if (pindex)
+                vJobs.reserve(chainActive.Height() - pindex->nHeight + 1);
+            for (; pindex; pindex = chainActive.Next(pindex))
+                vJobs.push_back(CRescanJob(pindex));
+        }
 
-    CBlockIndex* pindex = pindexStart;
-    {
-        LOCK2(cs_main, cs_wallet);
+        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+        int nLastProgress = 0;
+        CWalletRescanner rescanner(this, vJobs);
+        std::vector<CRescanJob*> vBatch;
+        CRescanJob* job;
+        bool fMore = true;
+        while (fMore) {
+            vBatch.clear();
+            while (vBatch.size() < RESCAN_COMMIT_BATCH && (fMore = rescanner.Next(job)))
+                vBatch.push_back(job);
+            if (vBatch.empty())
+                break;
 
-        // no need to read and scan block, if block was created before
-        // our wallet birthday (as adjusted for block time variability)
-        while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
-            pindex = chainActive.Next(pindex);
+            {
+                LOCK2(cs_main, cs_wallet);
+                CWalletBatch batch(this);
+                BOOST_FOREACH (CRescanJob* pjob, vBatch) {
+                    for (unsigned int i = 0; i < pjob->block.vtx.size(); i++) {
+                        const CTransaction& tx = pjob->block.vtx[i];
+                        // Only transactions paying to us, spending from a
+                        // wallet transaction or already known can be ours
+                        bool fCandidate = pjob->vfMine[i] || mapWallet.count(tx.GetHash());
+                        for (unsigned int j = 0; j < tx.vin.size() && !fCandidate; j++)
+                            fCandidate = mapWallet.count(tx.vin[j].prevout.hash) != 0;
+                        if (fCandidate && AddToWalletIfInvolvingMe(tx, &pjob->block, fUpdate))
+                            ret++;
+                    }
+                }
+            }
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex) {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
-
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH (CTransaction& tx, block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+            CBlockIndex* pindexLast = vBatch.back()->pindex;
+            BOOST_FOREACH (CRescanJob* pjob, vBatch) {
+                pjob->block.SetNull();
+                std::vector<bool>().swap(pjob->vfMine);
+            }
+
+            int nProgress = 99;
+            if (dProgressTip - dProgressStart > 0.0)
+                nProgress = std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindexLast, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100)));
+            if (nProgress != nLastProgress) {
+                ShowProgress(_("Rescanning..."), nProgress);
+                nLastProgress = nProgress;
             }
-            pindex = chainActive.Next(pindex);
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindexLast->nHeight, Checkpoints::GuessVerificationProgress(pindexLast));
             }
+            if (fAbortRescan || ShutdownRequested()) {
+                LogPrintf("Rescan aborted at block %d\n", pindexLast->nHeight);
+                break;
+            }
+        }
+        {
+            // The rescan may have left the tree of an old block behind
+            LOCK(cs_wallet);
+            merkleIndexLast.SetNull();
         }
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    } catch (...) {
+        fScanningWallet = false;
+        throw;
     }
+    LogPrint("bench", "%s : found %d transactions in %dms\n", __func__, ret, GetTimeMillis() - nStart);
+    fScanningWallet = false;
     return ret;
 }
 
+void CWallet::PageOutTransactions()
+{
+    LOCK2(cs_main, cs_wallet);
+    int64_t nStart = GetTimeMillis();
+    unsigned int nPagedOut = 0;
+    size_t nBytes = 0;
+    BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet) {
+        CWalletTx& wtx = item.second;
+        // The depth check verifies the merkle branch once, after that it is not needed
+        if (wtx.fPagedOut || wtx.GetDepthInMainChain(false) < WALLET_LAZY_LOAD_DEPTH || !wtx.fMerkleVerified)
+            continue;
+        // Zerocoin spends are told apart by their input scripts
+        bool fZerocoinSpend = false;
+        BOOST_FOREACH (const CTxIn& txin, wtx.vin)
+            fZerocoinSpend |= txin.scriptSig.IsZerocoinSpend();
+        if (fZerocoinSpend)
+            continue;
+        BOOST_FOREACH (const CTxIn& txin, wtx.vin)
+            nBytes += txin.scriptSig.capacity();
+        nBytes += wtx.vMerkleBranch.capacity() * sizeof(uint256);
+        wtx.PageOut();
+        nPagedOut++;
+    }
+    LogPrintf("PageOutTransactions : paged out %u of %u transactions, %u bytes, %dms\n", nPagedOut, mapWallet.size(), nBytes, GetTimeMillis() - nStart);
+}
+
+bool CWallet::GetFullTransaction(const CWalletTx& wtx, CTransaction& txRet) const
+{
+    if (!wtx.fPagedOut) {
+        txRet = wtx;
+        return true;
+    }
+
+    LOCK(cs_wallet);
+    std::map<uint256, CTransaction>::const_iterator it = mapFullTxCache.find(wtx.GetHash());
+    if (it != mapFullTxCache.end()) {
+        txRet = it->second;
+        return true;
+    }
+    CWalletTx wtxDisk;
+    if (!CWalletDBHandle(this)->ReadTx(wtx.GetHash(), wtxDisk))
+        return error("CWallet::GetFullTransaction : unable to read transaction %s from the wallet file", wtx.GetHash().ToString());
+    txRet = wtxDisk;
+
+    while (vFullTxCacheOrder.size() >= WALLET_FULL_TX_CACHE_SIZE) {
+        mapFullTxCache.erase(vFullTxCacheOrder.front());
+        vFullTxCacheOrder.pop_front();
+    }
+    mapFullTxCache.insert(std::make_pair(wtx.GetHash(), txRet));
+    vFullTxCacheOrder.push_back(wtx.GetHash());
+    return true;
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     LOCK2(cs_main, cs_wallet);
@@ -1121,7 +1823,7 @@ void CWallet::ReacceptWalletTransactions()
 
         int nDepth = wtx.GetDepthInMainChain();
 
-        if (!wtx.IsCoinBase() && nDepth < 0) {
+        if (!wtx.IsCoinBase() && nDepth < 0 && wtx.PageIn()) {
             // Try to add to memory pool
             LOCK(mempool.cs);
             wtx.AcceptToMemoryPool(false);
@@ -1141,12 +1843,15 @@ bool CWalletTx::InMempool() const
 void CWalletTx::RelayWalletTransaction(std::string strCommand)
 {
     if (!IsCoinBase()) {
-        if (GetDepthInMainChain() == 0) {
+        if (GetDepthInMainChain() == 0 && PageIn()) {
             uint256 hash = GetHash();
             LogPrintf("Relaying wtx %s\n", hash.ToString());
 
             if (strCommand == "ix") {
-                mapTxLockReq.insert(make_pair(hash, (CTransaction) * this));
+                {
+                    LOCK(cs_swifttx);
+                    mapTxLockReq.insert(make_pair(hash, (CTransaction) * this));
+                }
                 CreateNewLock(((CTransaction) * this));
                 RelayTransactionLockReq((CTransaction) * this, true);
             } else {
@@ -1211,88 +1916,180 @@ void CWallet::ResendWalletTransactions()
  * @{
  */
 
-CAmount CWallet::GetBalance() const
+void CWallet::InvalidateBalances()
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+    LOCK(cs_wallet);
+    fBalancesValid = false;
+    nOwnershipVersion++;
+}
+
+void CWallet::MarkBalanceDirty(const uint256& hashTx) const
+{
+    LOCK(cs_wallet);
+    // Everything is computed again anyway
+    if (!fBalancesValid)
+        return;
+    setBalanceDirty.insert(hashTx);
+}
+
+void CWallet::UpdateBalance(const uint256& hash) const
+{
+    std::map<uint256, CWalletBalanceShare>::iterator itShare = mapBalanceShares.find(hash);
+    if (itShare != mapBalanceShares.end()) {
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            balanceTotals.n[i] -= itShare->second.n[i];
+        mapBalanceShares.erase(itShare);
+    }
+
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end()) {
+        mapBalanceVolatile.erase(hash);
+        setUnspentOwned.erase(hash);
+        return;
+    }
+    const CWalletTx& wtx = mi->second;
+
+    bool fUnspentOwned = false;
+    for (unsigned int i = 0; i < wtx.vout.size() && !fUnspentOwned; i++)
+        fUnspentOwned = !IsSpent(hash, i) && IsMine(wtx.vout[i]) != ISMINE_NO;
+    if (fUnspentOwned)
+        setUnspentOwned.insert(hash);
+    else
+        setUnspentOwned.erase(hash);
+
+    CWalletBalanceShare share;
+    bool fFinal = IsFinalTx(wtx);
+    bool fTrusted = wtx.IsTrusted();
+    int nDepth = wtx.GetDepthInMainChain();
+    if (fTrusted) {
+        share.n[BALANCE_TRUSTED] = wtx.GetAvailableCredit();
+        share.n[BALANCE_WATCH_TRUSTED] = wtx.GetAvailableWatchOnlyCredit();
+    }
+    if (!fFinal || (!fTrusted && nDepth == 0)) {
+        share.n[BALANCE_UNCONFIRMED] = wtx.GetAvailableCredit();
+        share.n[BALANCE_WATCH_UNCONFIRMED] = wtx.GetAvailableWatchOnlyCredit();
+    }
+    share.n[BALANCE_IMMATURE] = wtx.GetImmatureCredit();
+    share.n[BALANCE_WATCH_IMMATURE] = wtx.GetImmatureWatchOnlyCredit();
+    if (!share.IsNull()) {
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            balanceTotals.n[i] += share.n[i];
+        mapBalanceShares.insert(std::make_pair(hash, share));
+    }
+
+    // A spend that gets conflicted, or stops being so, changes what is
+    // available of the outputs it spends
+    std::map<uint256, int>::iterator itVolatile = mapBalanceVolatile.find(hash);
+    if (itVolatile != mapBalanceVolatile.end() && (itVolatile->second < 0) != (nDepth < 0)) {
+        BOOST_FOREACH (const CTxIn& txin, wtx.vin) {
+            std::map<uint256, CWalletTx>::const_iterator mip = mapWallet.find(txin.prevout.hash);
+            if (mip != mapWallet.end())
+                mip->second.MarkDirty();
         }
     }
 
-    return nTotal;
+    bool fVolatile = !fFinal || nDepth < 1 || ((wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0);
+    if (fVolatile)
+        mapBalanceVolatile[hash] = nDepth;
+    else if (itVolatile != mapBalanceVolatile.end())
+        mapBalanceVolatile.erase(itVolatile);
+}
+
+void CWallet::UpdateBalances() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // A confirmed transaction only loses its depth if its block leaves the chain
+    if (fBalancesValid && pindexBalances != chainActive.Tip() && !(pindexBalances && chainActive.Contains(pindexBalances)))
+        fBalancesValid = false;
+
+    if (!fBalancesValid) {
+        int64_t nStart = GetTimeMicros();
+        balanceTotals = CWalletBalanceShare();
+        mapBalanceShares.clear();
+        mapBalanceVolatile.clear();
+        setBalanceDirty.clear();
+        setUnspentOwned.clear();
+        fBalancesValid = true;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            UpdateBalance(it->first);
+        LogPrint("bench", "%s : computed the balances of %u transactions in %.2fms\n", __func__, mapWallet.size(), (GetTimeMicros() - nStart) * 0.001);
+    } else {
+        std::vector<uint256> vVolatile;
+        vVolatile.reserve(mapBalanceVolatile.size());
+        for (std::map<uint256, int>::const_iterator it = mapBalanceVolatile.begin(); it != mapBalanceVolatile.end(); ++it)
+            vVolatile.push_back(it->first);
+        BOOST_FOREACH (const uint256& hash, vVolatile)
+            UpdateBalance(hash);
+    }
+    // Updating a share can mark the transactions it spends from dirty
+    while (!setBalanceDirty.empty()) {
+        uint256 hash = *setBalanceDirty.begin();
+        setBalanceDirty.erase(setBalanceDirty.begin());
+        UpdateBalance(hash);
+    }
+    pindexBalances = chainActive.Tip();
+
+    if (balanceTotals != balanceNotified) {
+        balanceNotified = balanceTotals;
+        NotifyBalanceChanged(balanceTotals);
+    }
+}
+
+void CWallet::UpdateBalancesIfNotified() const
+{
+    if (!NotifyBalanceChanged.empty())
+        UpdateBalances();
+}
+
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balanceTotals.n[BALANCE_TRUSTED];
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balanceTotals.n[BALANCE_UNCONFIRMED];
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balanceTotals.n[BALANCE_IMMATURE];
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balanceTotals.n[BALANCE_WATCH_TRUSTED];
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balanceTotals.n[BALANCE_WATCH_UNCONFIRMED];
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balanceTotals.n[BALANCE_WATCH_IMMATURE];
+}
+
+CWalletBalanceShare CWallet::GetBalances() const
+{
+    LOCK2(cs_main, cs_wallet);
+    UpdateBalances();
+    return balanceTotals;
 }
 
 /**
@@ -1304,7 +2101,11 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        UpdateBalances();
+        BOOST_FOREACH (const uint256& hashUnspent, setUnspentOwned) {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hashUnspent);
+            if (it == mapWallet.end())
+                continue;
             const uint256& wtxid = it->first;
             const CWalletTx* pcoin = &(*it).second;
 
@@ -1391,14 +2192,64 @@ map<CBitcoinAddress, vector<COutput> > CWallet::AvailableCoinsByAddress(bool fCo
     return mapCoins;
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
+//! Add the keys that sign for scriptPubKey to setAddress, to decrypt them with a CKeyBatch
+static void GetSigningKeyIDs(const CScript& scriptPubKey, std::set<CKeyID>& setAddress)
+{
+    txnouttype type;
+    std::vector<CTxDestination> vDest;
+    int nRequired;
+    if (!ExtractDestinations(scriptPubKey, type, vDest, nRequired))
+        return;
+    BOOST_FOREACH (const CTxDestination& dest, vDest) {
+        const CKeyID* keyID = boost::get<CKeyID>(&dest);
+        if (keyID)
+            setAddress.insert(*keyID);
+    }
+}
+
+/**
+ * A scriptSig at least as large as the one signing scriptPubKey gives, with
+ * placeholder signatures, so the fee is known before signing. False when
+ * the size can only be told by signing.
+ */
+static bool DummySignature(const CKeyStore& keystore, const CScript& scriptPubKey, CScript& scriptSigRet)
+{
+    txnouttype whichType;
+    vector<vector<unsigned char> > vSolutions;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return false;
+
+    const vector<unsigned char> vchDummySig(DUMMY_SIGNATURE_SIZE, 0);
+    scriptSigRet.clear();
+    switch (whichType) {
+    case TX_PUBKEY:
+        scriptSigRet << vchDummySig;
+        return true;
+    case TX_PUBKEYHASH: {
+        CPubKey vchPubKey;
+        if (!keystore.GetPubKey(CKeyID(uint160(vSolutions[0])), vchPubKey))
+            return false;
+        scriptSigRet << vchDummySig << ToByteVector(vchPubKey);
+        return true;
+    }
+    case TX_MULTISIG:
+        scriptSigRet << OP_0; // workaround CHECKMULTISIG bug
+        for (int i = 0; i < vSolutions.front()[0]; i++)
+            scriptSigRet << vchDummySig;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
 
     vfBest.assign(vValue.size(), true);
     nBest = nTotalLower;
 
-    seed_insecure_rand();
+    FastRandomContext& rng = GetFastRandomContext();
 
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++) {
         vfIncluded.assign(vValue.size(), false);
@@ -1412,7 +2263,7 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
                 //that the rng is fast. We do not use a constant random sequence,
                 //because there may be some privacy improvement by making
                 //the selection random.
-                if (nPass == 0 ? insecure_rand() & 1 : !vfIncluded[i]) {
+                if (nPass == 0 ? rng.randbool() : !vfIncluded[i]) {
                     nTotal += vValue[i].first;
                     vfIncluded[i] = true;
                     if (nTotal >= nTargetValue) {
@@ -1430,37 +2281,209 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
     }
 }
 
+struct CompareEffectiveValue {
+    const std::vector<CAmount>& vValue;
+    CompareEffectiveValue(const std::vector<CAmount>& vValueIn) : vValue(vValueIn) {}
+    bool operator()(size_t a, size_t b) const { return vValue[a] > vValue[b]; }
+};
+
+bool SelectCoinsBnB(const std::vector<CAmount>& vEffectiveValue, const CAmount& nTargetValue, const CAmount& nCostOfChange, std::vector<char>& vfSelected, CAmount& nEffectiveRet, size_t nMaxTries)
+{
+    vfSelected.assign(vEffectiveValue.size(), false);
+    nEffectiveRet = 0;
+
+    // Largest first, so that the branches that overshoot are cut early
+    std::vector<size_t> vOrder;
+    CAmount nAvailable = 0;
+    for (size_t i = 0; i < vEffectiveValue.size(); i++) {
+        if (vEffectiveValue[i] <= 0)
+            continue;
+        vOrder.push_back(i);
+        nAvailable += vEffectiveValue[i];
+    }
+    if (nAvailable < nTargetValue)
+        return false;
+    std::sort(vOrder.begin(), vOrder.end(), CompareEffectiveValue(vEffectiveValue));
+
+    // Depth first over include/exclude decisions for vOrder[0], vOrder[1], ...
+    std::vector<char> vfCurrent;
+    std::vector<char> vfBest;
+    CAmount nCurrent = 0;
+    CAmount nBestExcess = std::numeric_limits<CAmount>::max();
+    for (size_t nTries = 0; nTries < nMaxTries; nTries++) {
+        bool fBacktrack = false;
+        if (nCurrent + nAvailable < nTargetValue || nCurrent > nTargetValue + nCostOfChange) {
+            // Cannot reach the target anymore, or already past the window
+            fBacktrack = true;
+        } else if (nCurrent >= nTargetValue) {
+            // Adding more inputs only makes the excess bigger
+            if (nCurrent - nTargetValue < nBestExcess) {
+                nBestExcess = nCurrent - nTargetValue;
+                vfBest = vfCurrent;
+                if (nBestExcess == 0)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack) {
+            // Undo the trailing exclusions, then exclude the last included input
+            while (!vfCurrent.empty() && !vfCurrent.back()) {
+                nAvailable += vEffectiveValue[vOrder[vfCurrent.size() - 1]];
+                vfCurrent.pop_back();
+            }
+            if (vfCurrent.empty())
+                break;
+            vfCurrent.back() = false;
+            nCurrent -= vEffectiveValue[vOrder[vfCurrent.size() - 1]];
+        } else {
+            size_t n = vfCurrent.size();
+            CAmount nValue = vEffectiveValue[vOrder[n]];
+            nAvailable -= nValue;
+            // Including an input of the same value as the one just excluded gives the same subsets again
+            if (!vfCurrent.empty() && !vfCurrent.back() && nValue == vEffectiveValue[vOrder[n - 1]]) {
+                vfCurrent.push_back(false);
+            } else {
+                vfCurrent.push_back(true);
+                nCurrent += nValue;
+            }
+        }
+    }
+
+    if (nBestExcess == std::numeric_limits<CAmount>::max())
+        return false;
+    for (size_t i = 0; i < vfBest.size(); i++) {
+        if (vfBest[i]) {
+            vfSelected[vOrder[i]] = true;
+            nEffectiveRet += vEffectiveValue[vOrder[i]];
+        }
+    }
+    return true;
+}
+
+void CWallet::RemoveStakeCandidates(const uint256& hash)
+{
+    std::map<uint256, int>::iterator it = mapStakeCandidateHeight.find(hash);
+    if (it == mapStakeCandidateHeight.end())
+        return;
+    StakeCandidates::iterator itCandidate = setStakeCandidates.lower_bound(make_pair(it->second, COutPoint(hash, 0)));
+    while (itCandidate != setStakeCandidates.end() && itCandidate->first == it->second && itCandidate->second.hash == hash)
+        setStakeCandidates.erase(itCandidate++);
+    mapStakeCandidateHeight.erase(it);
+}
+
+void CWallet::UpdateStakeCandidates(const CWalletTx& wtx)
+{
+    const uint256 hash = wtx.GetHash();
+    RemoveStakeCandidates(hash);
+
+    // Only outputs confirmed in a known block can ever be staked
+    if (wtx.hashBlock == 0)
+        return;
+    BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (mi == mapBlockIndex.end() || !mi->second)
+        return;
+
+    // Depth at which SelectStakeCoins accepts the output (generated coins also need GetBlocksToMaturity() == 0)
+    const int nMinDepth = (wtx.IsCoinBase() || wtx.IsCoinStake()) ? std::max(10, Params().COINBASE_MATURITY() + 1) : 10;
+    const int nMatureHeight = mi->second->nHeight + nMinDepth - 1;
+    bool fAny = false;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (wtx.vout[i].nValue <= 0)
+            continue;
+        isminetype mine = IsMine(wtx.vout[i]);
+        if (mine == ISMINE_NO || mine == ISMINE_WATCH_ONLY)
+            continue;
+        setStakeCandidates.insert(make_pair(nMatureHeight, COutPoint(hash, i)));
+        fAny = true;
+    }
+    if (fAny)
+        mapStakeCandidateHeight[hash] = nMatureHeight;
+}
+
+void CWallet::RefreshStakeCandidates()
+{
+    AssertLockHeld(cs_wallet);
+    if (!fStakeCandidatesStale)
+        return;
+    fStakeCandidatesStale = false;
+    setStakeCandidates.clear();
+    mapStakeCandidateHeight.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateStakeCandidates(it->second);
+}
+
 bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount)
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, NULL, false, STAKABLE_COINS);
+    LOCK2(cs_main, cs_wallet);
+    RefreshStakeCandidates();
     CAmount nAmountSelected = 0;
+    const int nHeight = chainActive.Height();
+
+    // Entries past the current height are not deep enough yet and sort last
+    for (StakeCandidates::const_iterator it = setStakeCandidates.begin(); it != setStakeCandidates.end() && it->first <= nHeight; ++it) {
+        const COutPoint& outpoint = it->second;
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx& wtx = mi->second;
+        const CAmount nValue = wtx.vout[outpoint.n].nValue;
 
-    for (const COutput &out : vCoins) {
         //make sure not to outrun target amount
-        if (nAmountSelected + out.tx->vout[out.i].nValue > nTargetAmount)
+        if (nAmountSelected + nValue > nTargetAmount)
             continue;
 
-        int64_t nTxTime = out.tx->GetTxTime();
+        if (IsSpent(outpoint.hash, outpoint.n) || IsLockedCoin(outpoint.hash, outpoint.n))
+            continue;
 
         //check for min age
-        if (GetAdjustedTime() - nTxTime < nStakeMinAge)
+        if (GetAdjustedTime() - wtx.GetTxTime() < nStakeMinAge)
+            continue;
+
+        //check that it is matured (and still in the main chain after a reorg)
+        if (wtx.GetBlocksToMaturity() > 0 || wtx.GetDepthInMainChain(false) < (wtx.IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
             continue;
 
-        //check that it is matured
-        if (out.nDepth < (out.tx->IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
+        if (!CheckFinalTx(wtx))
             continue;
 
         //add to our stake set
-        nAmountSelected += out.tx->vout[out.i].nValue;
+        nAmountSelected += nValue;
 
         std::unique_ptr<CPivStake> input(new CPivStake());
-        input->SetInput((CTransaction) *out.tx, out.i);
+        input->SetInput(wtx, outpoint.n);
+        input->SetIndexFrom(mapBlockIndex[wtx.hashBlock]);
         listInputs.emplace_back(std::move(input));
     }
     return true;
 }
 
+int64_t CWallet::GetNextStakeMaturityTime()
+{
+    LOCK2(cs_main, cs_wallet);
+    RefreshStakeCandidates();
+    const int nHeight = chainActive.Height();
+    const int64_t nNow = GetAdjustedTime();
+    int64_t nNext = 0;
+    // The outputs not deep enough yet mature with a new tip, which wakes the minter anyway
+    for (StakeCandidates::const_iterator it = setStakeCandidates.begin(); it != setStakeCandidates.end() && it->first <= nHeight; ++it) {
+        const COutPoint& outpoint = it->second;
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi == mapWallet.end() || IsSpent(outpoint.hash, outpoint.n) || IsLockedCoin(outpoint.hash, outpoint.n))
+            continue;
+        const CWalletTx& wtx = mi->second;
+
+        // SelectStakeCoins checks the age of the transaction, CreateCoinStake the one of its block
+        int64_t nMature = wtx.GetTxTime() + nStakeMinAge;
+        BlockMap::const_iterator mbi = mapBlockIndex.find(wtx.hashBlock);
+        if (mbi != mapBlockIndex.end() && mbi->second)
+            nMature = std::max(nMature, mbi->second->GetBlockTime() + nStakeMinAge);
+        if (nMature > nNow && (nNext == 0 || nMature < nNext))
+            nNext = nMature;
+    }
+    return nNext;
+}
+
 bool CWallet::MintableCoins()
 {
     CAmount nBalance = GetBalance();
@@ -1493,7 +2516,7 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    random_shuffle(vCoins.begin(), vCoins.end(), GetInsecureRandInt);
 
     // try to find nondenom first to prevent unneeded spending of mixed coins
     for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++) {
@@ -1583,6 +2606,41 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     return true;
 }
 
+bool CWallet::SelectCoinsMinConfBnB(const CAmount& nTargetValue, const CAmount& nCostOfChange, const CFeeRate& feeRate, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+
+    const CAmount nInputFee = feeRate.GetFee(BNB_INPUT_SIZE);
+    vector<CAmount> vEffectiveValue;
+    vector<const COutput*> vCandidates;
+    BOOST_FOREACH (const COutput& output, vCoins) {
+        if (!output.fSpendable)
+            continue;
+        if (output.nDepth < (output.tx->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
+            continue;
+        // Inputs that cost more to spend than they are worth never help
+        CAmount nEffective = output.tx->vout[output.i].nValue - nInputFee;
+        if (nEffective <= 0)
+            continue;
+        vEffectiveValue.push_back(nEffective);
+        vCandidates.push_back(&output);
+    }
+
+    vector<char> vfSelected;
+    CAmount nEffective;
+    if (!SelectCoinsBnB(vEffectiveValue, nTargetValue, nCostOfChange, vfSelected, nEffective))
+        return false;
+    for (unsigned int i = 0; i < vCandidates.size(); i++) {
+        if (vfSelected[i]) {
+            setCoinsRet.insert(make_pair(vCandidates[i]->tx, vCandidates[i]->i));
+            nValueRet += vCandidates[i]->tx->vout[vCandidates[i]->i].nValue;
+        }
+    }
+    LogPrint("selectcoins", "%s: %d inputs of %d for %s, %s over the target\n", __func__, setCoinsRet.size(), vCandidates.size(), FormatMoney(nTargetValue), FormatMoney(nEffective - nTargetValue));
+    return true;
+}
+
 bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX) const
 {
     vector<COutput> vCoins;
@@ -1696,7 +2754,9 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
     const CCoinControl* coinControl,
     AvailableCoinsType coin_type,
     bool useIX,
-    CAmount nFeePay)
+    CAmount nFeePay,
+    CoinSelectionType nCoinSelection,
+    bool fSign)
 {
     if (useIX && nFeePay < CENT) nFeePay = CENT;
 
@@ -1723,6 +2783,9 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
         {
             nFeeRet = 0;
             if (nFeePay > 0) nFeeRet = nFeePay;
+            // A fixed fee or hand picked inputs leave nothing to search for
+            bool fTryBnB = nCoinSelection == COIN_SELECTION_BNB && nFeePay == 0 && !(coinControl && coinControl->HasSelected());
+            set<pair<const CWalletTx*, unsigned int> > setCoins;
             while (true) {
                 txNew.vin.clear();
                 txNew.vout.clear();
@@ -1762,10 +2825,25 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
                 }
 
                 // Choose coins to use
-                set<pair<const CWalletTx*, unsigned int> > setCoins;
+                setCoins.clear();
                 CAmount nValueIn = 0;
 
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl, coin_type, useIX)) {
+                if (fTryBnB) {
+                    // First round only: inputs that cover the payees and their own fee without change,
+                    // the little they go over becomes fee. If the fee turns out short the knapsack takes over.
+                    fTryBnB = false;
+                    vector<COutput> vCoins;
+                    AvailableCoins(vCoins, true, coinControl, false, coin_type, useIX);
+                    CFeeRate feeRate(GetMinimumFee(1000, nTxConfirmTarget, mempool));
+                    CAmount nTargetBnB = nValue + feeRate.GetFee(::GetSerializeSize(CTransaction(txNew), SER_NETWORK, PROTOCOL_VERSION));
+                    CAmount nCostOfChange = feeRate.GetFee(BNB_CHANGE_OUTPUT_SIZE + BNB_INPUT_SIZE);
+                    if (SelectCoinsMinConfBnB(nTargetBnB, nCostOfChange, feeRate, 1, 6, vCoins, setCoins, nValueIn) ||
+                        SelectCoinsMinConfBnB(nTargetBnB, nCostOfChange, feeRate, 1, 1, vCoins, setCoins, nValueIn) ||
+                        SelectCoinsMinConfBnB(nTargetBnB, nCostOfChange, feeRate, 0, 1, vCoins, setCoins, nValueIn))
+                        nFeeRet = nValueIn - nValue;
+                }
+
+                if (setCoins.empty() && !SelectCoins(nTotalValue, setCoins, nValueIn, coinControl, coin_type, useIX)) {
                     if (coin_type == ALL_COINS) {
                         strFailReason = _("Insufficient funds.");
                     } else if (coin_type == ONLY_NOT10000IFMN) {
@@ -1858,13 +2936,18 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
                 BOOST_FOREACH (const PAIRTYPE(const CWalletTx*, unsigned int) & coin, setCoins)
                     txNew.vin.push_back(CTxIn(coin.first->GetHash(), coin.second));
 
-                // Sign
+                // Size the inputs with placeholder signatures, the inputs are
+                // signed once the fee is settled. Only scripts of no known
+                // form are signed for their size.
                 int nIn = 0;
-                BOOST_FOREACH (const PAIRTYPE(const CWalletTx*, unsigned int) & coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, txNew, nIn++)) {
+                BOOST_FOREACH (const PAIRTYPE(const CWalletTx*, unsigned int) & coin, setCoins) {
+                    if (!DummySignature(*this, coin.first->vout[coin.second].scriptPubKey, txNew.vin[nIn].scriptSig) &&
+                        !SignSignature(*this, *coin.first, txNew, nIn)) {
                         strFailReason = _("Signing transaction failed");
                         return false;
                     }
+                    nIn++;
+                }
 
                 // Embed the constructed transaction data in wtxNew.
                 *static_cast<CTransaction*>(&wtxNew) = CTransaction(txNew);
@@ -1906,16 +2989,32 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
                 nFeeRet = nFeeNeeded;
                 continue;
             }
+
+            if (fSign) {
+                // Sign, with each key decrypted once for all the inputs it signs
+                std::set<CKeyID> setSigningKeys;
+                BOOST_FOREACH (const PAIRTYPE(const CWalletTx*, unsigned int) & coin, setCoins)
+                    GetSigningKeyIDs(coin.first->vout[coin.second].scriptPubKey, setSigningKeys);
+                CKeyBatch keyBatch(*this, setSigningKeys);
+                int nIn = 0;
+                BOOST_FOREACH (const PAIRTYPE(const CWalletTx*, unsigned int) & coin, setCoins)
+                    if (!SignSignature(*this, *coin.first, txNew, nIn++)) {
+                        strFailReason = _("Signing transaction failed");
+                        return false;
+                    }
+
+                *static_cast<CTransaction*>(&wtxNew) = CTransaction(txNew);
+            }
         }
     }
     return true;
 }
 
-bool CWallet::CreateTransaction(CScript scriptPubKey, const CAmount& nValue, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX, CAmount nFeePay)
+bool CWallet::CreateTransaction(CScript scriptPubKey, const CAmount& nValue, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX, CAmount nFeePay, CoinSelectionType nCoinSelection, bool fSign)
 {
     vector<pair<CScript, CAmount> > vecSend;
     vecSend.push_back(make_pair(scriptPubKey, nValue));
-    return CreateTransaction(vecSend, wtxNew, reservekey, nFeeRet, strFailReason, coinControl, coin_type, useIX, nFeePay);
+    return CreateTransaction(vecSend, wtxNew, reservekey, nFeeRet, strFailReason, coinControl, coin_type, useIX, nFeePay, nCoinSelection, fSign);
 }
 
 // ppcoin: create coin stake transaction
@@ -1950,89 +3049,104 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
         return false;
 
     LogPrintf("%s: listInputs size=%d\n", __func__, listInputs.size());
-    if (GetAdjustedTime() - chainActive.Tip()->GetBlockTime() < 60)
-        MilliSleep(10000);
+
+    // Resolve the kernel inputs of every candidate before hashing
+    std::vector<CStakeKernelCandidate> vCandidates;
+    vCandidates.reserve(listInputs.size());
+    {
+        LOCK(cs_main);
+        unsigned int nTimeNow = GetAdjustedTime();
+        for (std::unique_ptr<CStakeInput>& stakeInput : listInputs) {
+            CBlockIndex* pindex = stakeInput->GetIndexFrom();
+            if (!pindex || pindex->nHeight < 1) {
+                LogPrintf("*** no pindexfrom\n");
+                continue;
+            }
+
+            unsigned int nTimeBlockFrom = pindex->GetBlockTime();
+            if (nTimeBlockFrom > nTimeNow || nTimeBlockFrom + nStakeMinAge > nTimeNow)
+                continue;
+
+            uint64_t nStakeModifier = 0;
+            if (!stakeInput->GetModifier(nStakeModifier))
+                continue;
+
+            vCandidates.push_back(CStakeKernelCandidate(stakeInput.get(), nStakeModifier, nTimeBlockFrom, stakeInput->GetValue(), stakeInput->GetUniqueness()));
+        }
+    }
 
     CAmount nCredit = 0;
-    CScript scriptPubKeyKernel;
-    int nAttempts = 0;
+    int nAttempts = vCandidates.size();
     bool fKernelFound = false;
-    for (std::unique_ptr<CStakeInput>& stakeInput : listInputs) {
+    int nStakeThreads = GetArg("-stakethreads", DEFAULT_STAKE_THREADS);
+    while (!vCandidates.empty()) {
         // Make sure the wallet is unlocked and shutdown hasn't been requested
         if (IsLocked() || ShutdownRequested())
             return false;
 
-        //make sure that enough time has elapsed between
-        CBlockIndex* pindex = stakeInput->GetIndexFrom();
-        if (!pindex || pindex->nHeight < 1) {
-            LogPrintf("*** no pindexfrom\n");
-            continue;
-        }
-
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
         uint256 hashProofOfStake = 0;
         nTxNewTime = GetAdjustedTime();
+        int nFound = FindStakeKernel(vCandidates, nBits, nTxNewTime, hashProofOfStake, nStakeThreads);
+        if (nFound < 0)
+            break;
 
-        //iterates each utxo inside of CheckStakeKernelHash()
-        nAttempts++;
-        if (Stake(stakeInput.get(), nBits, block.GetBlockTime(), nTxNewTime, hashProofOfStake)) {
-            LOCK(cs_main);
-            //Double check that this will pass time requirements
-            if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
-                LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
-                continue;
-            }
+        CStakeInput* stakeInput = vCandidates[nFound].pinput;
+        vCandidates.erase(vCandidates.begin() + nFound);
 
-            // Found a kernel
-            LogPrintf("CreateCoinStake : kernel found\n");
-            nCredit += stakeInput->GetValue();
+        LOCK(cs_main);
+        //Double check that this will pass time requirements
+        if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
+            LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
+            continue;
+        }
 
-            // Calculate reward
-            CAmount nReward;
-            nReward = GetBlockValue(chainActive.Height() + 1);
-            nCredit += nReward;
+        // Found a kernel
+        LogPrintf("CreateCoinStake : kernel found\n");
+        nCredit += stakeInput->GetValue();
 
-            // Create the output transaction(s)
-            vector<CTxOut> vout;
-            if (!stakeInput->CreateTxOuts(this, vout, nCredit)) {
-                LogPrintf("%s : failed to get scriptPubKey\n", __func__);
-                continue;
-            }
-            txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
-
-            CAmount nMinFee = 0;
-            // Set output amount
-            if (txNew.vout.size() == 3) {
-                txNew.vout[1].nValue = ((nCredit - nMinFee) / 2 / CENT) * CENT;
-                txNew.vout[2].nValue = nCredit - nMinFee - txNew.vout[1].nValue;
-            } else
-                txNew.vout[1].nValue = nCredit - nMinFee;
-
-            // Limit size
-            unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
-                return error("CreateCoinStake : exceeded coinstake size limit");
-
-            //Masternode payment
-            FillBlockPayee(txNew, nMinFee, true);
-
-            uint256 hashTxOut = txNew.GetHash();
-            CTxIn in;
-            if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
-                LogPrintf("%s : failed to create TxIn\n", __func__);
-                txNew.vin.clear();
-                txNew.vout.clear();
-                nCredit = 0;
-                continue;
-            }
-            txNew.vin.emplace_back(in);
+        // Calculate reward
+        CAmount nReward;
+        nReward = GetBlockValue(chainActive.Height() + 1);
+        nCredit += nReward;
 
-            fKernelFound = true;
-            break;
+        // Create the output transaction(s)
+        vector<CTxOut> vout;
+        if (!stakeInput->CreateTxOuts(this, vout, nCredit)) {
+            LogPrintf("%s : failed to get scriptPubKey\n", __func__);
+            nCredit = 0;
+            continue;
+        }
+        txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
+
+        CAmount nMinFee = 0;
+        // Set output amount
+        if (txNew.vout.size() == 3) {
+            txNew.vout[1].nValue = ((nCredit - nMinFee) / 2 / CENT) * CENT;
+            txNew.vout[2].nValue = nCredit - nMinFee - txNew.vout[1].nValue;
+        } else
+            txNew.vout[1].nValue = nCredit - nMinFee;
+
+        // Limit size
+        unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
+        if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
+            return error("CreateCoinStake : exceeded coinstake size limit");
+
+        //Masternode payment
+        FillBlockPayee(txNew, nMinFee, true);
+
+        uint256 hashTxOut = txNew.GetHash();
+        CTxIn in;
+        if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
+            LogPrintf("%s : failed to create TxIn\n", __func__);
+            txNew.vin.clear();
+            txNew.vout.clear();
+            nCredit = 0;
+            continue;
         }
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.vin.emplace_back(in);
+
+        fKernelFound = true;
+        break;
     }
     if (!fKernelFound) {
         LogPrintf("*** attempted to stake %d coins\n", nAttempts);
@@ -2042,6 +3156,13 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     // Sign for PIV
     int nIn = 0;
     if (!txNew.vin[0].scriptSig.IsZerocoinSpend()) {
+        std::set<CKeyID> setSigningKeys;
+        for (CTxIn txIn : txNew.vin) {
+            const CWalletTx *wtx = GetWalletTx(txIn.prevout.hash);
+            if (wtx && txIn.prevout.n < wtx->vout.size())
+                GetSigningKeyIDs(wtx->vout[txIn.prevout.n].scriptPubKey, setSigningKeys);
+        }
+        CKeyBatch keyBatch(*this, setSigningKeys);
         for (CTxIn txIn : txNew.vin) {
             const CWalletTx *wtx = GetWalletTx(txIn.prevout.hash);
             if (!SignSignature(*this, *wtx, txNew, nIn++))
@@ -2062,10 +3183,8 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
         LOCK2(cs_main, cs_wallet);
         LogPrintf("CommitTransaction:\n%s", wtxNew.ToString());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile, "r") : NULL;
+            // The key pool entry, the new transaction and its order position in one database transaction
+            CWalletBatch batch(this);
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
@@ -2086,9 +3205,6 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
                 NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 updated_hahes.insert(txin.prevout.hash);
             }
-
-            if (fFileBacked)
-                delete pwalletdb;
         }
 
         // Track how many getdata requests our transaction gets
@@ -2113,6 +3229,7 @@ bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB & pw
     laccentries.push_back(acentry);
     CAccountingEntry & entry = laccentries.back();
     wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    LoadAccountingEntry(entry);
 
     return true;
 }
@@ -2158,11 +3275,19 @@ CAmount CWallet::GetTotalValue(std::vector<CTxIn> vCoins)
 }
 
 DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
+{
+    DBErrors nLoadWalletRet = LoadWalletFile(fFirstRunRet);
+    if (nLoadWalletRet == DB_LOAD_OK && fFileBacked)
+        LoadWalletChainState();
+    return nLoadWalletRet;
+}
+
+DBErrors CWallet::LoadWalletFile(bool& fFirstRunRet, bool* pfRescan)
 {
     if (!fFileBacked)
         return DB_LOAD_OK;
     fFirstRunRet = false;
-    DBErrors nLoadWalletRet = CWalletDB(strWalletFile, "cr+").LoadWallet(this);
+    DBErrors nLoadWalletRet = CWalletDB(strWalletFile, "cr+").LoadWallet(this, pfRescan);
     if (nLoadWalletRet == DB_NEED_REWRITE) {
         if (CDB::Rewrite(strWalletFile, "\x04pool")) {
             LOCK(cs_wallet);
@@ -2176,10 +3301,21 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
     if (nLoadWalletRet != DB_LOAD_OK)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
+    return DB_LOAD_OK;
+}
 
-    uiInterface.LoadWallet(this);
+void CWallet::LoadWalletChainState()
+{
+    {
+        LOCK2(cs_main, cs_wallet);
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            UpdateStakeCandidates(it->second);
+    }
 
-    return DB_LOAD_OK;
+    if (GetBoolArg("-walletlazyload", DEFAULT_WALLET_LAZY_LOAD))
+        PageOutTransactions();
+
+    uiInterface.LoadWallet(this);
 }
 
 
@@ -2215,13 +3351,13 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
         if (!strPurpose.empty()) /* update purpose only if requested */
             mapAddressBook[address].purpose = strPurpose;
     }
-    NotifyAddressBookChanged(this, address, strName, ::IsMine(*this, address) != ISMINE_NO,
+    NotifyAddressBookChanged(this, address, strName, IsMine(address) != ISMINE_NO,
         strPurpose, (fUpdated ? CT_UPDATED : CT_NEW));
     if (!fFileBacked)
         return false;
-    if (!strPurpose.empty() && !CWalletDB(strWalletFile).WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
+    if (!strPurpose.empty() && !CWalletDBHandle(this)->WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
         return false;
-    return CWalletDB(strWalletFile).WriteName(CBitcoinAddress(address).ToString(), strName);
+    return CWalletDBHandle(this)->WriteName(CBitcoinAddress(address).ToString(), strName);
 }
 
 bool CWallet::DelAddressBook(const CTxDestination& address)
@@ -2233,24 +3369,24 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
             // Delete destdata tuples associated with address
             std::string strAddress = CBitcoinAddress(address).ToString();
             BOOST_FOREACH (const PAIRTYPE(string, string) & item, mapAddressBook[address].destdata) {
-                CWalletDB(strWalletFile).EraseDestData(strAddress, item.first);
+                CWalletDBHandle(this)->EraseDestData(strAddress, item.first);
             }
         }
         mapAddressBook.erase(address);
     }
 
-    NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address) != ISMINE_NO, "", CT_DELETED);
+    NotifyAddressBookChanged(this, address, "", IsMine(address) != ISMINE_NO, "", CT_DELETED);
 
     if (!fFileBacked)
         return false;
-    CWalletDB(strWalletFile).ErasePurpose(CBitcoinAddress(address).ToString());
-    return CWalletDB(strWalletFile).EraseName(CBitcoinAddress(address).ToString());
+    CWalletDBHandle(this)->ErasePurpose(CBitcoinAddress(address).ToString());
+    return CWalletDBHandle(this)->EraseName(CBitcoinAddress(address).ToString());
 }
 
 bool CWallet::SetDefaultKey(const CPubKey& vchPubKey)
 {
     if (fFileBacked) {
-        if (!CWalletDB(strWalletFile).WriteDefaultKey(vchPubKey))
+        if (!CWalletDBHandle(this)->WriteDefaultKey(vchPubKey))
             return false;
     }
     vchDefaultKey = vchPubKey;
@@ -2265,20 +3401,17 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
+        CWalletBatch batch(this);
+        CWalletDBHandle walletdb(this);
         BOOST_FOREACH (int64_t nIndex, setKeyPool)
-            walletdb.ErasePool(nIndex);
+            walletdb->ErasePool(nIndex);
         setKeyPool.clear();
 
         if (IsLocked())
             return false;
 
         int64_t nKeys = max(GetArg("-keypool", 1000), (int64_t)0);
-        for (int i = 0; i < nKeys; i++) {
-            int64_t nIndex = i + 1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        AddKeysToPool(nKeys, false);
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
     return true;
@@ -2292,8 +3425,6 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
-
         // Top up key pool
         unsigned int nTargetSize;
         if (kpSize > 0)
@@ -2301,18 +3432,8 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         else
             nTargetSize = max(GetArg("-keypool", 1000), (int64_t)0);
 
-        while (setKeyPool.size() < (nTargetSize + 1)) {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrint("net","keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
-            std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
-            uiInterface.InitMessage(strMsg);
-        }
+        if (setKeyPool.size() < (nTargetSize + 1))
+            AddKeysToPool(nTargetSize + 1 - setKeyPool.size(), true);
     }
     return true;
 }
@@ -2331,11 +3452,11 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
         if (setKeyPool.empty())
             return;
 
-        CWalletDB walletdb(strWalletFile);
+        CWalletDBHandle walletdb(this);
 
         nIndex = *(setKeyPool.begin());
         setKeyPool.erase(setKeyPool.begin());
-        if (!walletdb.ReadPool(nIndex, keypool))
+        if (!walletdb->ReadPool(nIndex, keypool))
             throw runtime_error("ReserveKeyFromKeyPool() : read failed");
         if (!HaveKey(keypool.vchPubKey.GetID()))
             throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
@@ -2348,8 +3469,8 @@ void CWallet::KeepKey(int64_t nIndex)
 {
     // Remove from key pool
     if (fFileBacked) {
-        CWalletDB walletdb(strWalletFile);
-        walletdb.ErasePool(nIndex);
+        CWalletDBHandle walletdb(this);
+        walletdb->ErasePool(nIndex);
     }
     LogPrint("net","keypool keep %d\n", nIndex);
 }
@@ -2398,17 +3519,18 @@ std::map<CTxDestination, CAmount> CWallet::GetAddressBalances()
     map<CTxDestination, CAmount> balances;
 
     {
+        // Against the chain view, so only cs_wallet is needed
         LOCK(cs_wallet);
-        BOOST_FOREACH (PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet) {
-            CWalletTx* pcoin = &walletEntry.second;
+        BOOST_FOREACH (const PAIRTYPE(const uint256, CWalletTx) & walletEntry, mapWallet) {
+            const CWalletTx* pcoin = &walletEntry.second;
 
-            if (!IsFinalTx(*pcoin) || !pcoin->IsTrusted())
+            if (!pcoin->IsTrustedCached())
                 continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+            int nDepth = pcoin->GetCachedDepth();
+            if (pcoin->IsCoinBase() && Params().COINBASE_MATURITY() + 1 - nDepth > 0)
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
             if (nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? 0 : 1))
                 continue;
 
@@ -2419,7 +3541,7 @@ std::map<CTxDestination, CAmount> CWallet::GetAddressBalances()
                 if (!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
                     continue;
 
-                CAmount n = IsSpent(walletEntry.first, i) ? 0 : pcoin->vout[i].nValue;
+                CAmount n = IsSpent(walletEntry.first, i, true) ? 0 : pcoin->vout[i].nValue;
 
                 if (!balances.count(addr))
                     balances[addr] = 0;
@@ -2437,17 +3559,18 @@ set<set<CTxDestination> > CWallet::GetAddressGroupings()
     set<set<CTxDestination> > groupings;
     set<CTxDestination> grouping;
 
-    BOOST_FOREACH (PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet) {
-        CWalletTx* pcoin = &walletEntry.second;
+    BOOST_FOREACH (const PAIRTYPE(const uint256, CWalletTx) & walletEntry, mapWallet) {
+        const CWalletTx* pcoin = &walletEntry.second;
 
         if (pcoin->vin.size() > 0) {
             bool any_mine = false;
             // group all input addresses with each other
-            BOOST_FOREACH (CTxIn txin, pcoin->vin) {
+            BOOST_FOREACH (const CTxIn& txin, pcoin->vin) {
                 CTxDestination address;
                 if (!IsMine(txin)) /* If this input isn't mine, ignore it */
                     continue;
-                if (!ExtractDestination(mapWallet[txin.prevout.hash].vout[txin.prevout.n].scriptPubKey, address))
+                const CWalletTx* prev = GetWalletTx(txin.prevout.hash);
+                if (!prev || !ExtractDestination(prev->vout[txin.prevout.n].scriptPubKey, address))
                     continue;
                 grouping.insert(address);
                 any_mine = true;
@@ -2455,7 +3578,7 @@ set<set<CTxDestination> > CWallet::GetAddressGroupings()
 
             // group change with input addresses
             if (any_mine) {
-                BOOST_FOREACH (CTxOut txout, pcoin->vout)
+                BOOST_FOREACH (const CTxOut& txout, pcoin->vout)
                     if (IsChange(txout)) {
                         CTxDestination txoutAddr;
                         if (!ExtractDestination(txout.scriptPubKey, txoutAddr))
@@ -2563,12 +3686,12 @@ void CWallet::GetAllReserveKeys(set<CKeyID>& setAddress) const
 {
     setAddress.clear();
 
-    CWalletDB walletdb(strWalletFile);
+    CWalletDBHandle walletdb(this);
 
     LOCK2(cs_main, cs_wallet);
     BOOST_FOREACH (const int64_t& id, setKeyPool) {
         CKeyPool keypool;
-        if (!walletdb.ReadPool(id, keypool))
+        if (!walletdb->ReadPool(id, keypool))
             throw runtime_error("GetAllReserveKeyHashes() : read failed");
         assert(keypool.vchPubKey.IsValid());
         CKeyID keyID = keypool.vchPubKey.GetID();
@@ -2585,6 +3708,7 @@ bool CWallet::UpdatedTransaction(const uint256& hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()) {
+            MarkBalanceDirty(hashTx);
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -2727,7 +3851,7 @@ bool CWallet::AddDestData(const CTxDestination& dest, const std::string& key, co
     mapAddressBook[dest].destdata.insert(std::make_pair(key, value));
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteDestData(CBitcoinAddress(dest).ToString(), key, value);
+    return CWalletDBHandle(this)->WriteDestData(CBitcoinAddress(dest).ToString(), key, value);
 }
 
 bool CWallet::EraseDestData(const CTxDestination& dest, const std::string& key)
@@ -2736,7 +3860,7 @@ bool CWallet::EraseDestData(const CTxDestination& dest, const std::string& key)
         return false;
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).EraseDestData(CBitcoinAddress(dest).ToString(), key);
+    return CWalletDBHandle(this)->EraseDestData(CBitcoinAddress(dest).ToString(), key);
 }
 
 bool CWallet::LoadDestData(const CTxDestination& dest, const std::string& key, const std::string& value)
@@ -2921,7 +4045,7 @@ bool CWallet::MultiSend()
         //get the fee amount
         CWalletTx wtxdummy;
         string strErr;
-        CreateTransaction(vecSend, wtxdummy, keyChange, nFeeRet, strErr, &cControl, ALL_COINS, false, CAmount(0));
+        CreateTransaction(vecSend, wtxdummy, keyChange, nFeeRet, strErr, &cControl, ALL_COINS, false, CAmount(0), COIN_SELECTION_BNB, false);
         CAmount nLastSendAmount = vecSend[vecSend.size() - 1].second;
         if (nLastSendAmount < nFeeRet + 500) {
             LogPrintf("%s: fee of %d is too large to insert into last output\n", __func__, nFeeRet + 500);
@@ -2942,9 +4066,9 @@ bool CWallet::MultiSend()
             fMultiSendNotify = true;
 
         //write nLastMultiSendHeight to DB
-        CWalletDB walletdb(strWalletFile);
+        CWalletDBHandle walletdb(this);
         nLastMultiSendHeight = chainActive.Tip()->nHeight;
-        if (!walletdb.WriteMSettings(fMultiSendStake, fMultiSendMasternodeReward, nLastMultiSendHeight))
+        if (!walletdb->WriteMSettings(fMultiSendStake, fMultiSendMasternodeReward, nLastMultiSendHeight))
             LogPrintf("Failed to write MultiSend setting to DB\n");
 
         LogPrintf("MultiSend successfully sent\n");
@@ -2980,39 +4104,81 @@ CWalletKey::CWalletKey(int64_t nExpires)
     nTimeExpires = nExpires;
 }
 
+void CBlockMerkleIndex::Build(const CBlock& block)
+{
+    hashBlock = block.GetHash();
+    nTx = block.vtx.size();
+    if (block.vMerkleTree.empty())
+        block.BuildMerkleTree();
+    vMerkleTree = block.vMerkleTree;
+    mapTxIndex.clear();
+    mapTxIndex.rehash(nTx);
+    // The leaves are the txids; a repeated one is found where it comes first
+    for (int i = 0; i < nTx; i++)
+        mapTxIndex.insert(std::make_pair(vMerkleTree[i], i));
+}
+
+void CBlockMerkleIndex::SetNull()
+{
+    hashBlock = 0;
+    nTx = 0;
+    std::vector<uint256>().swap(vMerkleTree);
+    mapTxIndex.clear();
+}
+
+int CBlockMerkleIndex::Find(const uint256& txid) const
+{
+    boost::unordered_map<uint256, int, BlockHasher>::const_iterator it = mapTxIndex.find(txid);
+    return it == mapTxIndex.end() ? -1 : it->second;
+}
+
 int CMerkleTx::SetMerkleBranch(const CBlock& block)
+{
+    return SetMerkleBranch(CBlockMerkleIndex(block));
+}
+
+int CMerkleTx::SetMerkleBranch(const CBlockMerkleIndex& index)
 {
     AssertLockHeld(cs_main);
-    CBlock blockTmp;
 
     // Update the tx's hashBlock
-    hashBlock = block.GetHash();
+    hashBlock = index.GetBlockHash();
 
     // Locate the transaction
-    for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
-        if (block.vtx[nIndex] == *(CTransaction*)this)
-            break;
-    if (nIndex == (int)block.vtx.size()) {
+    nIndex = index.Find(GetHash());
+    if (nIndex == -1) {
         vMerkleBranch.clear();
         nIndex = -1;
+        UpdateAnchor();
         LogPrintf("ERROR: SetMerkleBranch() : couldn't find tx in block\n");
         return 0;
     }
 
     // Fill in merkle branch
-    vMerkleBranch = block.GetMerkleBranch(nIndex);
+    vMerkleBranch = index.GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
     BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+    hashAnchor = hashBlock;
+    nAnchorHeight = -1;
     if (mi == mapBlockIndex.end())
         return 0;
     const CBlockIndex* pindex = (*mi).second;
     if (!pindex || !chainActive.Contains(pindex))
         return 0;
 
+    nAnchorHeight = pindex->nHeight;
     return chainActive.Height() - pindex->nHeight + 1;
 }
 
+void CMerkleTx::UpdateAnchor()
+{
+    AssertLockHeld(cs_main);
+    const CBlockIndex* pindex = NULL;
+    nAnchorHeight = GetDepthInMainChainINTERNAL(pindex) > 0 ? pindex->nHeight : -1;
+    hashAnchor = hashBlock;
+}
+
 int CMerkleTx::GetDepthInMainChainINTERNAL(const CBlockIndex*& pindexRet) const
 {
     if (hashBlock == 0 || nIndex == -1)
@@ -3057,6 +4223,34 @@ int CMerkleTx::GetDepthInMainChain(const CBlockIndex*& pindexRet, bool enableIX)
     return nResult;
 }
 
+int CWalletTx::GetCachedDepth(bool enableIX) const
+{
+    AssertLockHeld(pwallet->cs_wallet);
+    int nResult = 0;
+    int nChainHeight = pwallet->GetChainViewHeight();
+    if (hashBlock != 0 && nIndex != -1 && hashAnchor == hashBlock && nAnchorHeight >= 0 && nAnchorHeight <= nChainHeight)
+        nResult = nChainHeight - nAnchorHeight + 1;
+    if (nResult == 0 && !mempool.exists(GetHash()))
+        return -1; // Not in chain, not in mempool
+
+    if (enableIX) {
+        if (nResult < 6) {
+            int signatures = GetTransactionLockSignatures();
+            if (signatures >= SWIFTTX_SIGNATURES_REQUIRED) {
+                return nSwiftTXDepth + nResult;
+            }
+        }
+    }
+
+    return nResult;
+}
+
+bool CWalletTx::IsFinalCached() const
+{
+    // Same as IsFinalTx(*this), which reads chainActive for the height
+    return IsFinalTx(*this, std::max(1, pwallet->GetChainViewHeight()), GetAdjustedTime());
+}
+
 int CMerkleTx::GetBlocksToMaturity() const
 {
     if (!(IsCoinBase() || IsCoinStake()))
@@ -3080,7 +4274,8 @@ int CMerkleTx::GetTransactionLockSignatures() const
     if (!fEnableSwiftTX) return -1;
 
     //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
+    LOCK(cs_swifttx);
+    TxLockMap::iterator i = mapTxLocks.find(GetHash());
     if (i != mapTxLocks.end()) {
         return (*i).second.CountSignatures();
     }
@@ -3093,7 +4288,8 @@ bool CMerkleTx::IsTransactionLockTimedOut() const
     if (!fEnableSwiftTX) return 0;
 
     //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
+    LOCK(cs_swifttx);
+    TxLockMap::iterator i = mapTxLocks.find(GetHash());
     if (i != mapTxLocks.end()) {
         return GetTime() > (*i).second.nTimeout;
     }
@@ -24,6 +24,8 @@
 #include "walletdb.h"
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -32,6 +34,10 @@
 #include <utility>
 #include <vector>
 
+#include <boost/functional/hash.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+
 /**
  * Settings
  */
@@ -53,6 +59,28 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! Maximum number of threads reading and matching blocks for a wallet rescan
+static const int MAX_RESCAN_THREADS = 4;
+//! Blocks a wallet rescan reads ahead of the one it adds to the wallet
+static const unsigned int MAX_RESCAN_QUEUE = 64;
+//! Blocks a wallet rescan adds to the wallet per cs_main/cs_wallet lock
+static const unsigned int RESCAN_COMMIT_BATCH = 32;
+//! Branches a branch and bound coin selection explores before it gives up
+static const size_t BNB_MAX_TRIES = 100000;
+//! Bytes a P2PKH input with a compressed key and the largest signature adds to a transaction
+static const unsigned int BNB_INPUT_SIZE = 149;
+//! Bytes a P2PKH change output adds to a transaction
+static const unsigned int BNB_CHANGE_OUTPUT_SIZE = 34;
+//! Bytes of the placeholder signatures that size a transaction before it is signed: the largest DER signature and the hash type
+static const unsigned int DUMMY_SIGNATURE_SIZE = 73;
+//! -walletlazyload default
+static const bool DEFAULT_WALLET_LAZY_LOAD = false;
+//! Depth from which -walletlazyload drops the input scripts of a transaction from memory
+static const int WALLET_LAZY_LOAD_DEPTH = 100;
+//! Full transactions read back for paged out wallet transactions that are kept in memory
+static const unsigned int WALLET_FULL_TX_CACHE_SIZE = 100;
+//! Keys a key pool top up generates in parallel before it adds them to the wallet
+static const unsigned int KEYPOOL_GENERATE_BATCH = 1000;
 
 class CAccountingEntry;
 class CCoinControl;
@@ -80,6 +108,21 @@ enum AvailableCoinsType {
     STAKABLE_COINS = 6                          // UTXO's that are valid for staking
 };
 
+/** Coin selection CreateTransaction uses */
+enum CoinSelectionType {
+    COIN_SELECTION_KNAPSACK = 0, // stochastic subset sum, adds change when there is no exact match
+    COIN_SELECTION_BNB = 1,      // branch and bound for inputs that need no change, then knapsack
+};
+
+/**
+ * Branch and bound search for a subset of vEffectiveValue (the values of the
+ * inputs minus the fee to spend them) that adds up to at least nTargetValue
+ * and at most nTargetValue + nCostOfChange, so that no change output is
+ * needed. The subset with the least excess found within nMaxTries branches
+ * is returned in vfSelected.
+ */
+bool SelectCoinsBnB(const std::vector<CAmount>& vEffectiveValue, const CAmount& nTargetValue, const CAmount& nCostOfChange, std::vector<char>& vfSelected, CAmount& nEffectiveRet, size_t nMaxTries = BNB_MAX_TRIES);
+
 struct CompactTallyItem {
     CBitcoinAddress address;
     CAmount nAmount;
@@ -112,6 +155,49 @@ public:
     }
 };
 
+/** The balances CWallet keeps totals of, see CWallet::UpdateBalances */
+enum WalletBalanceType {
+    BALANCE_TRUSTED,
+    BALANCE_UNCONFIRMED,
+    BALANCE_IMMATURE,
+    BALANCE_WATCH_TRUSTED,
+    BALANCE_WATCH_UNCONFIRMED,
+    BALANCE_WATCH_IMMATURE,
+    BALANCE_TYPES
+};
+
+/** What a wallet transaction adds to each balance */
+struct CWalletBalanceShare {
+    CAmount n[BALANCE_TYPES];
+
+    CWalletBalanceShare()
+    {
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            n[i] = 0;
+    }
+
+    bool IsNull() const
+    {
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            if (n[i] != 0)
+                return false;
+        return true;
+    }
+
+    friend bool operator==(const CWalletBalanceShare& a, const CWalletBalanceShare& b)
+    {
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            if (a.n[i] != b.n[i])
+                return false;
+        return true;
+    }
+
+    friend bool operator!=(const CWalletBalanceShare& a, const CWalletBalanceShare& b)
+    {
+        return !(a == b);
+    }
+};
+
 /** Address book data */
 class CAddressBookData
 {
@@ -128,6 +214,45 @@ public:
     StringMap destdata;
 };
 
+/** Hashes the bytes of a script, for the scripts of the wallet itself */
+class CScriptHasher
+{
+public:
+    size_t operator()(const CScript& script) const
+    {
+        return boost::hash_range(script.begin(), script.end());
+    }
+};
+
+/**
+ * The merkle tree of a block and the position of each of its transactions,
+ * built when a wallet transaction is first found in the block so that the
+ * branches of all of them come from it, instead of a search of the block
+ * for each.
+ */
+class CBlockMerkleIndex
+{
+private:
+    uint256 hashBlock;
+    int nTx;
+    std::vector<uint256> vMerkleTree;
+    boost::unordered_map<uint256, int, BlockHasher> mapTxIndex;
+
+public:
+    CBlockMerkleIndex() : nTx(0) {}
+    explicit CBlockMerkleIndex(const CBlock& block) { Build(block); }
+
+    void Build(const CBlock& block);
+    void SetNull();
+    const uint256& GetBlockHash() const { return hashBlock; }
+    //! Position of the transaction in the block, -1 if it is not there
+    int Find(const uint256& txid) const;
+    std::vector<uint256> GetMerkleBranch(int nIndex) const { return CBlock::GetMerkleBranch(vMerkleTree, nTx, nIndex); }
+};
+
+/** Possible masternode collaterals of a wallet by outpoint, valid under cs_wallet */
+typedef std::map<COutPoint, COutput> MasternodeCollateralMap;
+
 /**
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -140,6 +265,15 @@ private:
 
     CWalletDB* pwalletdbEncryption;
 
+    //! Database handle with the transaction of the open CWalletBatch, if any
+    CWalletDB* pwalletdbBatch;
+    int nWalletBatchDepth;
+
+    friend class CWalletBatch;
+    friend class CWalletDBHandle;
+    void BeginWalletBatch();
+    void EndWalletBatch();
+
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -161,8 +295,116 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Confirmed outputs of ours that may be staked, ordered by the first tip
+     * height at which they are deep enough to stake. Maintained by
+     * AddToWallet so SelectStakeCoins doesn't have to walk mapWallet.
+     * Added keys and scripts can make outputs already in the wallet ours,
+     * so they mark the index stale and it is rebuilt before the next use.
+     */
+    typedef std::set<std::pair<int, COutPoint> > StakeCandidates;
+    StakeCandidates setStakeCandidates;
+    std::map<uint256, int> mapStakeCandidateHeight;
+    bool fStakeCandidatesStale;
+    void UpdateStakeCandidates(const CWalletTx& wtx);
+    void RemoveStakeCandidates(const uint256& hash);
+    void RefreshStakeCandidates();
+
+    /**
+     * The last tip the wallet synced to, so transaction depths can be read
+     * under cs_wallet alone from the anchor heights of the transactions.
+     * Updated with cs_main held after each block is synced.
+     */
+    const CBlockIndex* pindexChainView;
+    int nChainViewHeight;
+
+    /**
+     * The transactions by the anchor height they were last seen at, -1 for
+     * those not in the active chain, so listsinceblock only looks at the
+     * transactions above the block it lists since. Maintained by AddToWallet
+     * and UpdateChainView, under cs_wallet.
+     */
+    typedef std::set<std::pair<int, uint256> > TxHeightIndex;
+    TxHeightIndex setTxByHeight;
+    std::map<uint256, int> mapTxIndexedHeight;
+    void UpdateTxHeightIndex(const CWalletTx& wtx);
+    void RemoveTxHeightIndex(const uint256& hash);
+
+    //! The block the last wallet transaction was found in, under cs_wallet
+    CBlockMerkleIndex merkleIndexLast;
+    const CBlockMerkleIndex& GetMerkleIndex(const CBlock& block);
+
+    //! Changed whenever what IsMine returns for the outputs of the transactions may have changed
+    unsigned int nOwnershipVersion;
+
+    /**
+     * The transactions by the destinations their outputs pay to, ours or
+     * not, and by the account they were sent from unless the default one,
+     * in the order they were added. The received and account balance RPCs
+     * look only at these instead of walking mapWallet. Maintained by
+     * AddToWallet and EraseFromWallet, under cs_wallet.
+     */
+    std::map<CTxDestination, std::vector<const CWalletTx*> > mapTxByDestination;
+    std::map<std::string, std::vector<const CWalletTx*> > mapTxByFromAccount;
+    //! Sum of the accounting entries of each account
+    std::map<std::string, CAmount> mapAccountCreditDebit;
+    void AddTxDestinationIndex(const CWalletTx& wtx);
+    void RemoveTxDestinationIndex(const CWalletTx& wtx);
+
+    /**
+     * What IsMine gives for the scripts paying to our keys, redeem scripts,
+     * watch-only and multisig entries, kept under cs_KeyStore as they are
+     * added. The pay-to-script-hash entries are computed again on every
+     * change, as their redeem scripts may depend on any other entry.
+     */
+    typedef boost::unordered_map<CScript, isminetype, CScriptHasher> ScriptOwnershipMap;
+    ScriptOwnershipMap mapScriptOwnership;
+    std::set<CScript> setScriptHashOwnership;
+    void UpdateScriptOwnership(const CScript& script);
+    void UpdateKeyOwnership(const CPubKey& pubkey);
+    void UpdateScriptHashOwnership();
+
+    void AddGeneratedKey(const CKey& secret, const CPubKey& pubkey);
+    //! Generate nKeys keys on several threads and add them to the end of the key pool in one database transaction
+    void AddKeysToPool(unsigned int nKeys, bool fInitMessage);
+
+    /**
+     * Balance totals, kept per transaction instead of summed over mapWallet
+     * on every call. The share of a transaction that can change with the tip
+     * or the time alone (unconfirmed, immature or not final) is computed
+     * again on every update, any other share only once the transaction has
+     * been marked dirty. A new tip that does not extend the last one makes
+     * them all be computed again. Protected by cs_wallet.
+     */
+    mutable bool fBalancesValid;
+    mutable const CBlockIndex* pindexBalances;
+    mutable CWalletBalanceShare balanceTotals;
+    //! Totals at the last NotifyBalanceChanged
+    mutable CWalletBalanceShare balanceNotified;
+    //! Shares that are not null
+    mutable std::map<uint256, CWalletBalanceShare> mapBalanceShares;
+    //! Transactions whose share depends on the tip or the time, with their depth at the last update
+    mutable std::map<uint256, int> mapBalanceVolatile;
+    mutable std::set<uint256> setBalanceDirty;
+    //! Transactions with an output of ours that is not spent, the only ones AvailableCoins has to look at
+    mutable std::set<uint256> setUnspentOwned;
+    void UpdateBalance(const uint256& hash) const;
+    void UpdateBalances() const;
+    //! Bring the totals up to date for NotifyBalanceChanged, if anything listens to it
+    void UpdateBalancesIfNotified() const;
+
+    //! Full transactions of paged out wallet transactions, oldest first in vFullTxCacheOrder
+    mutable std::map<uint256, CTransaction> mapFullTxCache;
+    mutable std::deque<uint256> vFullTxCacheOrder;
+
+    //! Set while ScanForWalletTransactions runs, only one rescan runs at a time
+    std::atomic<bool> fScanningWallet;
+    std::atomic<bool> fAbortRescan;
+
 public:
     bool MintableCoins();
+    //! The adjusted time at which the next output deep enough to stake gets old enough for it, 0 if none will
+    int64_t GetNextStakeMaturityTime();
     bool SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount);
     int CountInputsWithAmount(CAmount nInputAmount);
     bool AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB & pwalletdb);
@@ -231,11 +473,21 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
+        nWalletBatchDepth = 0;
+        pindexChainView = NULL;
+        nChainViewHeight = -1;
+        nOwnershipVersion = 0;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        fScanningWallet = false;
+        fAbortRescan = false;
+        fBalancesValid = false;
+        pindexBalances = NULL;
         fWalletUnlockStakingOnly = false;
+        fStakeCandidatesStale = false;
 
         // Stake Settings
         nHashDrift = 45;
@@ -273,6 +525,7 @@ public:
 
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64_t, TxPair > TxItems;
+    typedef std::vector<const CWalletTx*> TxList;
     TxItems wtxOrdered;
 
     int64_t nOrderPosNext;
@@ -298,13 +551,20 @@ public:
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed = true, const CCoinControl* coinControl = NULL, bool fIncludeZeroValue = false, AvailableCoinsType nCoinType = ALL_COINS, bool fUseIX = false, int nWatchonlyConfig = 1) const;
     std::map<CBitcoinAddress, std::vector<COutput> > AvailableCoinsByAddress(bool fConfirmed = true, CAmount maxCoinValue = 0);
     bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    //! Inputs whose value minus the fee at feeRate to spend them covers nTargetValue without change, see SelectCoinsBnB()
+    bool SelectCoinsMinConfBnB(const CAmount& nTargetValue, const CAmount& nCostOfChange, const CFeeRate& feeRate, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     /// Get 1000DASH output and keys which can be used for the Masternode
     bool GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash = "", std::string strOutputIndex = "");
+    /// The same for the given output, looked up among collaterals from GetMasternodeCollaterals
+    bool GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, const MasternodeCollateralMap& mapCollaterals, std::string strTxHash, std::string strOutputIndex);
+    /// Every output that can be a masternode collateral, found with one pass over the coins for all the masternode.conf entries
+    void GetMasternodeCollaterals(MasternodeCollateralMap& mapCollaterals);
     /// Extract txin information and keys from output
     bool GetVinAndKeysFromOutput(COutput out, CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet);
 
-    bool IsSpent(const uint256& hash, unsigned int n) const;
+    //! With fCachedDepth the spenders are checked against the chain view, see CWalletTx::GetCachedDepth
+    bool IsSpent(const uint256& hash, unsigned int n, bool fCachedDepth = false) const;
 
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
@@ -320,7 +580,7 @@ public:
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey& pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey& pubkey);
     //! Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey& pubkey, const CKeyMetadata& metadata);
 
@@ -373,20 +633,59 @@ public:
     int64_t IncOrderPosNext(CWalletDB* pwalletdb = NULL);
 
     void MarkDirty();
+    //! The balance share of hashTx has to be computed again
+    void MarkBalanceDirty(const uint256& hashTx) const;
+    //! Every balance share has to be computed again, e.g. because what IsMine returns changed
+    void InvalidateBalances();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet = false);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void SyncTransactions(const std::vector<CTransaction>& vtx, const CBlock* pblock);
+    void UpdatedBlockTip(const CBlockIndex* pindex);
+    /** Move the chain view to the active tip, re-resolving the anchors a reorg may have invalidated */
+    void UpdateChainView();
+    int GetChainViewHeight() const
+    {
+        AssertLockHeld(cs_wallet);
+        return nChainViewHeight;
+    }
+    unsigned int GetOwnershipVersion() const
+    {
+        AssertLockHeld(cs_wallet);
+        return nOwnershipVersion;
+    }
+    /**
+     * The transactions that are not in the active chain or are in a block
+     * above nHeight, oldest anchor first. The depth of the others is at least
+     * that of the block at nHeight.
+     */
+    void GetTransactionsAbove(int nHeight, std::vector<const CWalletTx*>& vRet) const;
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256& hash);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    //! Ask a running ScanForWalletTransactions to stop after its current batch of blocks
+    void AbortRescan() { fAbortRescan = true; }
+    bool IsAbortingRescan() const { return fAbortRescan; }
+    bool IsScanning() const { return fScanningWallet; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
+    //! Drop the input scripts and merkle branches of deeply confirmed transactions from memory (-walletlazyload)
+    void PageOutTransactions();
+    //! The transaction with its input scripts, read back from the wallet file if wtx is paged out
+    bool GetFullTransaction(const CWalletTx& wtx, CTransaction& txRet) const;
     CAmount GetBalance() const;
     CAmount GetUnconfirmedBalance() const;
     CAmount GetImmatureBalance() const;
     CAmount GetWatchOnlyBalance() const;
     CAmount GetUnconfirmedWatchOnlyBalance() const;
     CAmount GetImmatureWatchOnlyBalance() const;
+    //! All the balance totals at once
+    CWalletBalanceShare GetBalances() const;
     bool CreateTransaction(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl);
+    /**
+     * The fee is settled on placeholder signatures as large as the real ones
+     * and the inputs are signed once after. Without fSign they keep the
+     * placeholders, for what the transaction would cost.
+     */
     bool CreateTransaction(const std::vector<std::pair<CScript, CAmount> >& vecSend,
         CWalletTx& wtxNew,
         CReserveKey& reservekey,
@@ -395,8 +694,10 @@ public:
         const CCoinControl* coinControl = NULL,
         AvailableCoinsType coin_type = ALL_COINS,
         bool useIX = false,
-        CAmount nFeePay = 0);
-    bool CreateTransaction(CScript scriptPubKey, const CAmount& nValue, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS, bool useIX = false, CAmount nFeePay = 0);
+        CAmount nFeePay = 0,
+        CoinSelectionType nCoinSelection = COIN_SELECTION_BNB,
+        bool fSign = true);
+    bool CreateTransaction(CScript scriptPubKey, const CAmount& nValue, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS, bool useIX = false, CAmount nFeePay = 0, CoinSelectionType nCoinSelection = COIN_SELECTION_BNB, bool fSign = true);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std::string strCommand = "tx");
     bool ConvertList(std::vector<CTxIn> vCoins, std::vector<int64_t>& vecAmounts);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction& txNew, unsigned int& nTxNewTime);
@@ -419,15 +720,29 @@ public:
     std::map<CTxDestination, CAmount> GetAddressBalances();
 
     std::set<CTxDestination> GetAccountAddresses(std::string strAccount) const;
+    //! The transactions with an output paying to dest
+    const TxList& GetTransactionsPaying(const CTxDestination& dest) const;
+    //! The transactions sent from strAccount, which must not be the default account
+    const TxList& GetTransactionsFromAccount(const std::string& strAccount) const;
+    //! What the accounting entries move into strAccount, less what they move out of it
+    CAmount GetAccountCreditDebit(const std::string& strAccount) const;
+    //! Count acentry in the account totals, used by LoadWallet and AddAccountingEntry
+    void LoadAccountingEntry(const CAccountingEntry& acentry);
 
     bool GetBudgetSystemCollateralTX(CTransaction& tx, uint256 hash, bool useIX);
     bool GetBudgetSystemCollateralTX(CWalletTx& tx, uint256 hash, bool useIX);
 
     isminetype IsMine(const CTxIn& txin) const;
     CAmount GetDebit(const CTxIn& txin, const isminefilter& filter) const;
+    /** ::IsMine through a single lookup for the standard scripts */
+    isminetype IsMine(const CScript& scriptPubKey) const;
+    isminetype IsMine(const CTxDestination& dest) const
+    {
+        return IsMine(GetScriptForDestination(dest));
+    }
     isminetype IsMine(const CTxOut& txout) const
     {
-        return ::IsMine(*this, txout.scriptPubKey);
+        return IsMine(txout.scriptPubKey);
     }
     CAmount GetCredit(const CTxOut& txout, const isminefilter& filter) const
     {
@@ -487,6 +802,10 @@ public:
     void SetBestChain(const CBlockLocator& loc);
 
     DBErrors LoadWallet(bool& fFirstRunRet);
+    //! The part of LoadWallet reading wallet.dat, which does not look at the block index
+    DBErrors LoadWalletFile(bool& fFirstRunRet, bool* pfRescan = NULL);
+    //! The rest of LoadWallet, once the block index is loaded
+    void LoadWalletChainState();
     DBErrors ZapWalletTx(std::vector<CWalletTx>& vWtx);
 
     bool SetAddressBook(const CTxDestination& address, const std::string& strName, const std::string& purpose);
@@ -541,6 +860,12 @@ public:
      */
     boost::signals2::signal<void(CWallet* wallet, const uint256& hashTx, ChangeType status)> NotifyTransactionChanged;
 
+    /**
+     * Balance totals changed, after a transaction of the wallet or a block.
+     * @note called with locks cs_main and cs_wallet held.
+     */
+    boost::signals2::signal<void(const CWalletBalanceShare& balances)> NotifyBalanceChanged;
+
     /** Show progress e.g. for rescan */
     boost::signals2::signal<void(const std::string& title, int nProgress)> ShowProgress;
 
@@ -551,6 +876,41 @@ public:
     boost::signals2::signal<void(bool fHaveMultiSig)> NotifyMultiSigChanged;
 };
 
+/**
+ * Groups the wallet database writes made while it is in scope into one
+ * database transaction, committed when the outermost batch ends, instead of
+ * one transaction and log checkpoint per write. Must be held under cs_wallet;
+ * writes of other threads do not join the batch.
+ */
+class CWalletBatch : private boost::noncopyable
+{
+private:
+    CWallet* pwallet;
+
+public:
+    explicit CWalletBatch(CWallet* pwalletIn) : pwallet(pwalletIn) { pwallet->BeginWalletBatch(); }
+    ~CWalletBatch() { pwallet->EndWalletBatch(); }
+};
+
+/** Database handle for a wallet write: the open CWalletBatch of this thread, or a handle of its own */
+class CWalletDBHandle : private boost::noncopyable
+{
+private:
+    CWalletDB* pwalletdb;
+    bool fOwned;
+
+public:
+    explicit CWalletDBHandle(const CWallet* pwallet);
+    ~CWalletDBHandle()
+    {
+        if (fOwned)
+            delete pwalletdb;
+    }
+
+    CWalletDB* get() const { return pwalletdb; }
+    CWalletDB* operator->() const { return pwalletdb; }
+};
+
 
 /** A key allocated from the key pool. */
 class CReserveKey
@@ -617,6 +977,10 @@ public:
 
     // memory only
     mutable bool fMerkleVerified;
+    //! Height of hashBlock in the chain the wallet last saw, -1 if it is not in it
+    int nAnchorHeight;
+    //! The hashBlock nAnchorHeight was resolved for
+    uint256 hashAnchor;
 
 
     CMerkleTx()
@@ -634,6 +998,8 @@ public:
         hashBlock = 0;
         nIndex = -1;
         fMerkleVerified = false;
+        nAnchorHeight = -1;
+        hashAnchor = 0;
     }
 
     ADD_SERIALIZE_METHODS;
@@ -649,7 +1015,9 @@ public:
     }
 
     int SetMerkleBranch(const CBlock& block);
-
+    int SetMerkleBranch(const CBlockMerkleIndex& index);
+    /** Resolve the height of hashBlock in the active chain for depth queries that don't take cs_main */
+    void UpdateAnchor();
 
     /**
      * Return depth of transaction in blockchain:
@@ -694,6 +1062,7 @@ public:
     int64_t nOrderPos; //! position in ordered transaction list
 
     // memory only
+    bool fPagedOut; //! input scripts and merkle branch dropped, see CWallet::PageOutTransactions
     mutable bool fDebitCached;
     mutable bool fCreditCached;
     mutable bool fImmatureCreditCached;
@@ -712,6 +1081,15 @@ public:
     mutable CAmount nImmatureWatchCreditCached;
     mutable CAmount nAvailableWatchCreditCached;
     mutable CAmount nChangeCached;
+    //! What IsMine and ExtractDestination give for each output, at nOutputsCacheVersion of the wallet
+    struct CCachedOutput {
+        CTxDestination destination;
+        isminetype fIsMine;
+        bool fExtracted;
+    };
+    mutable bool fOutputsCached;
+    mutable unsigned int nOutputsCacheVersion;
+    mutable std::vector<CCachedOutput> vOutputsCached;
 
     CWalletTx()
     {
@@ -743,6 +1121,7 @@ public:
         nTimeSmart = 0;
         fFromMe = false;
         strFromAccount.clear();
+        fPagedOut = false;
         fDebitCached = false;
         fCreditCached = false;
         fImmatureCreditCached = false;
@@ -761,6 +1140,9 @@ public:
         nAvailableWatchCreditCached = 0;
         nImmatureWatchCreditCached = 0;
         nChangeCached = 0;
+        fOutputsCached = false;
+        nOutputsCacheVersion = 0;
+        vOutputsCached.clear();
         nOrderPos = -1;
     }
 
@@ -808,7 +1190,7 @@ public:
     }
 
     //! make sure balances are recalculated
-    void MarkDirty()
+    void MarkDirty() const
     {
         fCreditCached = false;
         fAvailableCreditCached = false;
@@ -818,6 +1200,9 @@ public:
         fImmatureWatchCreditCached = false;
         fDebitCached = false;
         fChangeCached = false;
+        fOutputsCached = false;
+        if (pwallet)
+            pwallet->MarkBalanceDirty(GetHash());
     }
 
     void BindWallet(CWallet* pwalletIn)
@@ -847,6 +1232,9 @@ public:
         return nChangeCached;
     }
 
+    //! The outputs as GetAmounts decomposes them, computed once per change of the wallet keys
+    const std::vector<CCachedOutput>& GetCachedOutputs() const;
+
     void GetAmounts(std::list<COutputEntry>& listReceived,
         std::list<COutputEntry>& listSent,
         CAmount& nFee,
@@ -862,12 +1250,32 @@ public:
 
     bool InMempool() const;
 
+    /**
+     * Depth like GetDepthInMainChain(), from the anchor of the transaction and
+     * the chain view of the wallet, so wallet reads need cs_wallet only.
+     */
+    int GetCachedDepth(bool enableIX = true) const;
+    /** IsFinalTx() at the height of the chain view of the wallet */
+    bool IsFinalCached() const;
+
     bool IsTrusted() const
     {
         // Quick answer in most cases
         if (!IsFinalTx(*this))
             return false;
-        int nDepth = GetDepthInMainChain();
+        return IsTrustedAtDepth(GetDepthInMainChain());
+    }
+
+    /** IsTrusted() against the chain view of the wallet, needs cs_wallet only */
+    bool IsTrustedCached() const
+    {
+        if (!IsFinalCached())
+            return false;
+        return IsTrustedAtDepth(GetCachedDepth());
+    }
+
+    bool IsTrustedAtDepth(int nDepth) const
+    {
         if (nDepth >= 1)
             return true;
         if (nDepth < 0)
@@ -889,6 +1297,9 @@ public:
     }
 
     bool WriteToDisk();
+    void PageOut();
+    //! Read the input scripts of a paged out transaction back from the wallet file
+    bool PageIn();
 
     int64_t GetTxTime() const;
     int64_t GetComputedTxTime() const;
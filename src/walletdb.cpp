@@ -62,6 +62,11 @@ bool CWalletDB::WriteTx(uint256 hash, const CWalletTx& wtx)
     return Write(std::make_pair(std::string("tx"), hash), wtx);
 }
 
+bool CWalletDB::ReadTx(uint256 hash, CWalletTx& wtx)
+{
+    return Read(std::make_pair(std::string("tx"), hash), wtx);
+}
+
 bool CWalletDB::EraseTx(uint256 hash)
 {
     nWalletDBUpdated++;
@@ -296,7 +301,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -670,7 +675,7 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
-DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
+DBErrors CWalletDB::LoadWallet(CWallet* pwallet, bool* pfRescan)
 {
     pwallet->vchDefaultKey = CPubKey();
     CWalletScanState wss;
@@ -687,7 +692,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor) {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
@@ -715,9 +720,13 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 else {
                     // Leave other errors alone, if we try to fix them we might make things worse.
                     fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
+                    if (strType == "tx") {
                         // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+                        if (pfRescan)
+                            *pfRescan = true;
+                        else
+                            SoftSetBoolArg("-rescan", true);
+                    }
                 }
             }
             if (!strErr.empty())
@@ -764,6 +773,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     ListAccountCreditDebit("*", pwallet->laccentries);
     BOOST_FOREACH(CAccountingEntry& entry, pwallet->laccentries) {
         pwallet->wtxOrdered.insert(make_pair(entry.nOrderPos, CWallet::TxPair((CWalletTx*)0, &entry)));
+        pwallet->LoadAccountingEntry(entry);
     }
 
     return result;
@@ -785,7 +795,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor) {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
@@ -908,6 +918,16 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
     while (true) {
         {
             LOCK(bitdb.cs_db);
+            if (bitdb.IsLogFile(wallet.strWalletFile)) {
+                // Committed records never move, so the file is copied while in use
+                filesystem::path pathDest(strDest);
+                if (filesystem::is_directory(pathDest))
+                    pathDest /= wallet.strWalletFile;
+                if (!bitdb.mapLogFile[wallet.strWalletFile]->Backup(pathDest))
+                    return false;
+                LogPrintf("copied wallet.dat to %s\n", pathDest.string());
+                return true;
+            }
             if (!bitdb.mapFileUseCount.count(wallet.strWalletFile) || bitdb.mapFileUseCount[wallet.strWalletFile] == 0) {
                 // Flush log data to the dat file
                 bitdb.CloseDb(wallet.strWalletFile);
@@ -953,6 +973,11 @@ bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename, bool fOnlyKeys)
     // Rewrite salvaged data to wallet.dat
     // Set -rescan so any missing transactions will be
     // found.
+    if (CWalletLogFile::IsLogFile(GetDataDir() / filename)) {
+        LogPrintf("%s is a log structured file, its last complete transaction is kept when it is opened\n", filename);
+        return true;
+    }
+
     int64_t now = GetTime();
     std::string newFilename = strprintf("wallet.%d.bak", now);
 
@@ -0,0 +1,420 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+
+#include "clientversion.h"
+#include "hash.h"
+#include "serialize.h"
+#include "streams.h"
+#include "util.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+const char WALLETLOG_MAGIC[8] = {'d', 't', 'm', 'w', 'l', 'o', 'g', '1'};
+const unsigned int WALLETLOG_CHECKSUM_SIZE = 4;
+
+bool ReadLength(const char* pch, uint64_t nEnd, uint64_t& nPos, uint64_t& nLength)
+{
+    if (nPos >= nEnd)
+        return false;
+    unsigned char chSize = pch[nPos++];
+    if (chSize < 253) {
+        nLength = chSize;
+    } else {
+        unsigned int nBytes = chSize == 253 ? 2 : (chSize == 254 ? 4 : 8);
+        if (nEnd - nPos < nBytes)
+            return false;
+        nLength = 0;
+        for (unsigned int i = 0; i < nBytes; i++)
+            nLength |= (uint64_t)(unsigned char)pch[nPos + i] << (8 * i);
+        nPos += nBytes;
+    }
+    return nLength <= MAX_SIZE && nLength <= nEnd - nPos;
+}
+
+/** A record found while loading, applied once its transaction is complete */
+struct CLoadedRecord {
+    std::string key;
+    bool fErase;
+    uint64_t nValuePos;
+    uint32_t nValueSize;
+    uint32_t nRecordSize;
+};
+} // anon namespace
+
+CWalletLogFile::CWalletLogFile() : file(NULL), nFileSize(0), nLiveBytes(0), pchMap(NULL), nMapSize(0)
+{
+}
+
+CWalletLogFile::~CWalletLogFile()
+{
+    Close();
+}
+
+bool CWalletLogFile::IsLogFile(const boost::filesystem::path& path)
+{
+    FILE* filein = fopen(path.string().c_str(), "rb");
+    if (!filein)
+        return false;
+    char pchMagic[sizeof(WALLETLOG_MAGIC)];
+    bool fLog = fread(pchMagic, 1, sizeof(pchMagic), filein) == sizeof(pchMagic) && memcmp(pchMagic, WALLETLOG_MAGIC, sizeof(pchMagic)) == 0;
+    fclose(filein);
+    return fLog;
+}
+
+bool CWalletLogFile::Map()
+{
+    Unmap();
+#ifndef WIN32
+    if (nFileSize == 0)
+        return false;
+    void* pMap = mmap(NULL, nFileSize, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if (pMap == MAP_FAILED) {
+        LogPrint("db", "%s : unable to map %s, reading it instead: %s\n", __func__, path.string(), strerror(errno));
+        return false;
+    }
+    pchMap = (const char*)pMap;
+    nMapSize = nFileSize;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void CWalletLogFile::Unmap()
+{
+#ifndef WIN32
+    if (pchMap)
+        munmap((void*)pchMap, nMapSize);
+#endif
+    pchMap = NULL;
+    nMapSize = 0;
+}
+
+bool CWalletLogFile::ReadAt(uint64_t nPos, uint32_t nSize, CSerializeData& data)
+{
+    data.resize(nSize);
+    if (nSize == 0)
+        return true;
+    // Records committed after the file was mapped need a new mapping
+    if (nPos + nSize > nMapSize)
+        Map();
+    if (nPos + nSize <= nMapSize) {
+        memcpy(&data[0], pchMap + nPos, nSize);
+        return true;
+    }
+    if (fseek(file, nPos, SEEK_SET) != 0 || fread(&data[0], 1, nSize, file) != nSize)
+        return error("%s : unable to read %u bytes at position %u of %s", __func__, nSize, nPos, path.string());
+    return true;
+}
+
+bool CWalletLogFile::Load()
+{
+    nFileSize = boost::filesystem::file_size(path);
+    if (nFileSize < sizeof(WALLETLOG_MAGIC))
+        return error("%s : %s is too short", __func__, path.string());
+
+    std::vector<char> vRead;
+    const char* pch;
+    if (Map()) {
+        pch = pchMap;
+    } else {
+        vRead.resize(nFileSize);
+        if (fseek(file, 0, SEEK_SET) != 0 || fread(&vRead[0], 1, vRead.size(), file) != vRead.size())
+            return error("%s : unable to read %s", __func__, path.string());
+        pch = &vRead[0];
+    }
+    if (memcmp(pch, WALLETLOG_MAGIC, sizeof(WALLETLOG_MAGIC)) != 0)
+        return error("%s : %s is not a log structured wallet file", __func__, path.string());
+
+    std::vector<CLoadedRecord> vPending;
+    uint64_t nPos = sizeof(WALLETLOG_MAGIC);
+    uint64_t nCommitted = nPos;
+    while (nPos < nFileSize) {
+        uint64_t nStart = nPos;
+        unsigned char chType = pch[nPos++];
+        CLoadedRecord record;
+        record.fErase = (chType & ~WALLETLOG_COMMIT) == WALLETLOG_ERASE;
+        if (!record.fErase && (chType & ~WALLETLOG_COMMIT) != WALLETLOG_PUT)
+            break;
+        uint64_t nKeySize, nValueSize = 0;
+        if (!ReadLength(pch, nFileSize, nPos, nKeySize))
+            break;
+        record.key.assign(pch + nPos, nKeySize);
+        nPos += nKeySize;
+        if (!record.fErase) {
+            if (!ReadLength(pch, nFileSize, nPos, nValueSize))
+                break;
+            record.nValuePos = nPos;
+            nPos += nValueSize;
+        }
+        if (nFileSize - nPos < WALLETLOG_CHECKSUM_SIZE)
+            break;
+        uint256 hash = Hash(pch + nStart, pch + nPos);
+        if (memcmp(hash.begin(), pch + nPos, WALLETLOG_CHECKSUM_SIZE) != 0)
+            break;
+        nPos += WALLETLOG_CHECKSUM_SIZE;
+        record.nValueSize = nValueSize;
+        record.nRecordSize = nPos - nStart;
+        vPending.push_back(record);
+
+        if (chType & WALLETLOG_COMMIT) {
+            BOOST_FOREACH (const CLoadedRecord& loaded, vPending) {
+                std::map<std::string, CValuePos>::iterator it = mapIndex.find(loaded.key);
+                if (it != mapIndex.end()) {
+                    nLiveBytes -= it->second.nRecordSize;
+                    if (loaded.fErase)
+                        mapIndex.erase(it);
+                } else if (!loaded.fErase) {
+                    it = mapIndex.insert(std::make_pair(loaded.key, CValuePos())).first;
+                }
+                if (!loaded.fErase) {
+                    it->second.nPos = loaded.nValuePos;
+                    it->second.nSize = loaded.nValueSize;
+                    it->second.nRecordSize = loaded.nRecordSize;
+                    nLiveBytes += loaded.nRecordSize;
+                }
+            }
+            vPending.clear();
+            nCommitted = nPos;
+        }
+    }
+
+    if (nCommitted < nFileSize) {
+        LogPrintf("%s : dropping %u bytes after the last complete transaction of %s\n", __func__, nFileSize - nCommitted, path.string());
+        nFileSize = nCommitted;
+        Unmap();
+        if (!TruncateFile(file, nFileSize))
+            return error("%s : unable to truncate %s", __func__, path.string());
+        FileCommit(file);
+        Map();
+    }
+    return true;
+}
+
+bool CWalletLogFile::Open(const boost::filesystem::path& pathIn, bool fCreate)
+{
+    LOCK(cs);
+    assert(!file);
+    path = pathIn;
+    bool fExists = boost::filesystem::exists(path);
+    if (!fExists && !fCreate)
+        return error("%s : %s does not exist", __func__, path.string());
+    file = fopen(path.string().c_str(), fExists ? "r+b" : "w+b");
+    if (!file)
+        return error("%s : unable to open %s", __func__, path.string());
+    if (!fExists) {
+        if (fwrite(WALLETLOG_MAGIC, 1, sizeof(WALLETLOG_MAGIC), file) != sizeof(WALLETLOG_MAGIC)) {
+            Close();
+            return error("%s : unable to write %s", __func__, path.string());
+        }
+        FileCommit(file);
+    }
+
+    int64_t nStart = GetTimeMillis();
+    if (!Load()) {
+        Close();
+        return false;
+    }
+    LogPrintf("%s : %u records in %s, %u of %u bytes live, %dms\n", __func__, mapIndex.size(), path.string(), nLiveBytes, nFileSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+void CWalletLogFile::Close()
+{
+    LOCK(cs);
+    Unmap();
+    if (file)
+        fclose(file);
+    file = NULL;
+    mapIndex.clear();
+    nFileSize = 0;
+    nLiveBytes = 0;
+}
+
+bool CWalletLogFile::Read(const std::string& key, CSerializeData& value)
+{
+    LOCK(cs);
+    std::map<std::string, CValuePos>::const_iterator it = mapIndex.find(key);
+    if (it == mapIndex.end())
+        return false;
+    return ReadAt(it->second.nPos, it->second.nSize, value);
+}
+
+bool CWalletLogFile::Exists(const std::string& key)
+{
+    LOCK(cs);
+    return mapIndex.count(key) > 0;
+}
+
+bool CWalletLogFile::Next(const std::string& key, bool fInclusive, std::string& keyRet, CSerializeData& valueRet)
+{
+    LOCK(cs);
+    // std::string compares like memcmp, which is the order of BerkeleyDB's btree
+    std::map<std::string, CValuePos>::const_iterator it = fInclusive ? mapIndex.lower_bound(key) : mapIndex.upper_bound(key);
+    if (it == mapIndex.end())
+        return false;
+    keyRet = it->first;
+    return ReadAt(it->second.nPos, it->second.nSize, valueRet);
+}
+
+bool CWalletLogFile::Commit(const CWalletLogBatch& batch)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+
+    // Erasing a key that is not there writes nothing
+    std::vector<CWalletLogBatch::const_iterator> vWrites;
+    for (CWalletLogBatch::const_iterator it = batch.begin(); it != batch.end(); ++it) {
+        if (!it->second.fErase || mapIndex.count(it->first))
+            vWrites.push_back(it);
+    }
+    if (vWrites.empty())
+        return true;
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    std::vector<CValuePos> vPos(vWrites.size());
+    for (unsigned int i = 0; i < vWrites.size(); i++) {
+        const std::string& key = vWrites[i]->first;
+        const CWalletLogWrite& write = vWrites[i]->second;
+        size_t nStart = ss.size();
+        unsigned char chType = (write.fErase ? WALLETLOG_ERASE : WALLETLOG_PUT) | (i + 1 == vWrites.size() ? WALLETLOG_COMMIT : 0);
+        ss << chType;
+        WriteCompactSize(ss, key.size());
+        ss.write(key.data(), key.size());
+        if (!write.fErase) {
+            WriteCompactSize(ss, write.value.size());
+            vPos[i].nPos = nFileSize + ss.size();
+            vPos[i].nSize = write.value.size();
+            if (!write.value.empty())
+                ss.write(&write.value[0], write.value.size());
+        }
+        uint256 hash = Hash(&ss[nStart], &ss[0] + ss.size());
+        ss.write((const char*)hash.begin(), WALLETLOG_CHECKSUM_SIZE);
+        vPos[i].nRecordSize = ss.size() - nStart;
+    }
+
+    if (fseek(file, nFileSize, SEEK_SET) != 0 || fwrite(&ss[0], 1, ss.size(), file) != ss.size() || fflush(file) != 0) {
+        // Whatever made it to the file has no commit flag and is cut off on the next open
+        TruncateFile(file, nFileSize);
+        return error("%s : unable to write to %s", __func__, path.string());
+    }
+    nFileSize += ss.size();
+
+    for (unsigned int i = 0; i < vWrites.size(); i++) {
+        std::map<std::string, CValuePos>::iterator it = mapIndex.find(vWrites[i]->first);
+        if (it != mapIndex.end()) {
+            nLiveBytes -= it->second.nRecordSize;
+            if (vWrites[i]->second.fErase) {
+                mapIndex.erase(it);
+                continue;
+            }
+            it->second = vPos[i];
+        } else {
+            mapIndex.insert(std::make_pair(vWrites[i]->first, vPos[i]));
+        }
+        nLiveBytes += vPos[i].nRecordSize;
+    }
+    return true;
+}
+
+bool CWalletLogFile::Flush()
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    FileCommit(file);
+    return true;
+}
+
+bool CWalletLogFile::NeedsCompaction()
+{
+    LOCK(cs);
+    return file && nFileSize >= WALLETLOG_COMPACT_MIN_SIZE && nFileSize - nLiveBytes > nLiveBytes;
+}
+
+bool CWalletLogFile::Compact(const char* pszSkip)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    uint64_t nOldSize = nFileSize;
+    boost::filesystem::path pathCompact = path;
+    pathCompact += ".compact";
+    boost::filesystem::remove(pathCompact);
+    {
+        // The copy only replaces the file once it is complete, so it is
+        // committed in pieces to keep the batches small
+        CWalletLogFile fileCompact;
+        if (!fileCompact.Open(pathCompact, true))
+            return false;
+        CWalletLogBatch batch;
+        for (std::map<std::string, CValuePos>::const_iterator it = mapIndex.begin(); it != mapIndex.end(); ++it) {
+            if (pszSkip && it->first.compare(0, std::min(it->first.size(), strlen(pszSkip)), pszSkip, std::min(it->first.size(), strlen(pszSkip))) == 0)
+                continue;
+            if (!ReadAt(it->second.nPos, it->second.nSize, batch[it->first].value))
+                return false;
+            if (batch.size() >= WALLETLOG_COMPACT_BATCH) {
+                if (!fileCompact.Commit(batch))
+                    return false;
+                batch.clear();
+            }
+        }
+        if (!fileCompact.Commit(batch) || !fileCompact.Flush())
+            return false;
+    }
+
+    boost::filesystem::path pathOpen = path;
+    Close();
+    if (!RenameOver(pathCompact, pathOpen)) {
+        LogPrintf("%s : unable to replace %s with its compacted copy\n", __func__, pathOpen.string());
+        Open(pathOpen, false);
+        return false;
+    }
+    if (!Open(pathOpen, false))
+        return false;
+    LogPrintf("%s : compacted %s from %u to %u bytes in %dms\n", __func__, path.string(), nOldSize, nFileSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CWalletLogFile::Backup(const boost::filesystem::path& pathDest)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    FILE* fileout = fopen(pathDest.string().c_str(), "wb");
+    if (!fileout)
+        return error("%s : unable to create %s", __func__, pathDest.string());
+    CSerializeData vChunk;
+    for (uint64_t nPos = 0; nPos < nFileSize; nPos += vChunk.size()) {
+        if (!ReadAt(nPos, std::min<uint64_t>(1024 * 1024, nFileSize - nPos), vChunk) ||
+            fwrite(&vChunk[0], 1, vChunk.size(), fileout) != vChunk.size()) {
+            fclose(fileout);
+            return error("%s : unable to copy %s to %s", __func__, path.string(), pathDest.string());
+        }
+    }
+    FileCommit(fileout);
+    fclose(fileout);
+    return true;
+}
+
+size_t CWalletLogFile::GetCount()
+{
+    LOCK(cs);
+    return mapIndex.size();
+}
@@ -0,0 +1,109 @@
+// Copyright (c) 2019 The Dystem developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLETLOG_H
+#define BITCOIN_WALLETLOG_H
+
+#include "allocators.h"
+#include "sync.h"
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/noncopyable.hpp>
+
+/**
+ * Log structured wallet files.
+ *
+ * An alternative to the BerkeleyDB format for wallet.dat: new wallets use it
+ * with -walletbackend=log, existing files are recognized by their magic. The
+ * file is WALLETLOG_MAGIC followed by records appended in commit order: a
+ * type byte (WALLETLOG_PUT or WALLETLOG_ERASE, with WALLETLOG_COMMIT set on
+ * the last record of a transaction), the key and, for a put, the value, each
+ * after its compact size, and the first four bytes of the double SHA256 of
+ * the record. The last record of a key decides its value.
+ *
+ * Opening a file scans it once into an in memory index from key to the
+ * position of its value; values are then read from a read-only mapping of
+ * the file. A torn or corrupt tail after the last complete transaction is
+ * cut off. Committed records never move, so a hot backup is a copy of the
+ * committed part of the file, and compaction rewrites the live records only
+ * once the overwritten and erased ones outweigh them.
+ */
+
+static const unsigned char WALLETLOG_PUT = 1;
+static const unsigned char WALLETLOG_ERASE = 2;
+static const unsigned char WALLETLOG_COMMIT = 0x80;
+//! Files smaller than this are never compacted
+static const uint64_t WALLETLOG_COMPACT_MIN_SIZE = 4 * 1024 * 1024;
+//! Records a compaction commits to the new file at a time
+static const unsigned int WALLETLOG_COMPACT_BATCH = 1000;
+
+/** A write of a transaction on a log structured wallet file; fErase drops the key */
+struct CWalletLogWrite {
+    bool fErase;
+    CSerializeData value;
+
+    CWalletLogWrite() : fErase(false) {}
+};
+
+/** The writes of one transaction by key, the last write of a key wins */
+typedef std::map<std::string, CWalletLogWrite> CWalletLogBatch;
+
+class CWalletLogFile : private boost::noncopyable
+{
+private:
+    struct CValuePos {
+        uint64_t nPos;
+        uint32_t nSize;
+        uint32_t nRecordSize;
+    };
+
+    CCriticalSection cs;
+    boost::filesystem::path path;
+    FILE* file;
+    //! End of the last complete transaction, where the next one is appended
+    uint64_t nFileSize;
+    //! Bytes of the records that still hold the value of their key
+    uint64_t nLiveBytes;
+    std::map<std::string, CValuePos> mapIndex;
+    const char* pchMap;
+    size_t nMapSize;
+
+    bool Map();
+    void Unmap();
+    bool ReadAt(uint64_t nPos, uint32_t nSize, CSerializeData& data);
+    bool Load();
+
+public:
+    CWalletLogFile();
+    ~CWalletLogFile();
+
+    static bool IsLogFile(const boost::filesystem::path& path);
+
+    bool Open(const boost::filesystem::path& pathIn, bool fCreate);
+    void Close();
+
+    bool Read(const std::string& key, CSerializeData& value);
+    bool Exists(const std::string& key);
+    /** The first key after key, or at it if fInclusive, in the order of BerkeleyDB's btree */
+    bool Next(const std::string& key, bool fInclusive, std::string& keyRet, CSerializeData& valueRet);
+    /** Append the writes as one transaction */
+    bool Commit(const CWalletLogBatch& batch);
+
+    /** Make the committed transactions durable */
+    bool Flush();
+    bool NeedsCompaction();
+    /** Rewrite the file with only its live records, leaving out the keys starting with pszSkip */
+    bool Compact(const char* pszSkip = NULL);
+    /** Copy the committed part of the file to pathDest while it stays in use */
+    bool Backup(const boost::filesystem::path& pathDest);
+
+    size_t GetCount();
+};
+
+#endif // BITCOIN_WALLETLOG_H
@@ -35,6 +35,15 @@ public:
     virtual bool NotifyBlock(const CBlockIndex *pindex);
     virtual bool NotifyTransaction(const CTransaction &transaction);
     virtual bool NotifyTransactionLock(const CTransaction &transaction);
+    virtual bool NotifyMasternodeMessage(const std::string &strTopic, const char *pch, size_t nSize) { return true; }
+
+    /** Account for events dropped before they reached the notifier */
+    virtual void SkipBlocks(unsigned int nCount) {}
+    virtual void SkipTransactions(unsigned int nCount) {}
+    virtual void SkipTransactionLocks(unsigned int nCount) {}
+    virtual void SkipMasternodeMessages(const std::string &strTopic, unsigned int nCount) {}
+    /** Send what the notifier holds back to batch it */
+    virtual bool Flush() { return true; }
 
 protected:
     void *psocket;
@@ -10,12 +10,25 @@
 #include "streams.h"
 #include "util.h"
 
+#include <boost/bind.hpp>
+
+//! Topics of the masternode kinds of notifications, in the order of CZMQNotification::Kind
+static const struct {
+    CZMQNotification::Kind kind;
+    const char* topic;
+} masternodeTopics[] = {
+    {CZMQNotification::MASTERNODEBROADCAST, "rawmnb"},
+    {CZMQNotification::MASTERNODEWINNER, "rawmnw"},
+    {CZMQNotification::BUDGETVOTE, "rawbudgetvote"},
+    {CZMQNotification::FINALIZEDBUDGET, "rawfinalbudget"},
+};
+
 void zmqError(const char *str)
 {
     LogPrint("zmq", "zmq: Error: %s, errno=%s\n", str, zmq_strerror(errno));
 }
 
-CZMQNotificationInterface::CZMQNotificationInterface() : pcontext(NULL)
+CZMQNotificationInterface::CZMQNotificationInterface() : pcontext(NULL), nMaxQueue(DEFAULT_ZMQ_QUEUE_SIZE), fStop(false)
 {
 }
 
@@ -41,6 +54,9 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
     factories["pubrawblock"] = CZMQAbstractNotifier::Create<CZMQPublishRawBlockNotifier>;
     factories["pubrawtx"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionNotifier>;
     factories["pubrawtxlock"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionLockNotifier>;
+    factories["pubhashtxbatch"] = CZMQAbstractNotifier::Create<CZMQPublishHashTransactionBatchNotifier>;
+    for (unsigned int i = 0; i < ARRAYLEN(masternodeTopics); i++)
+        factories[std::string("pub") + masternodeTopics[i].topic] = CZMQAbstractNotifier::Create<CZMQPublishRawMasternodeNotifier>;
 
     for (std::map<std::string, CZMQNotifierFactory>::const_iterator i=factories.begin(); i!=factories.end(); ++i)
     {
@@ -105,6 +121,10 @@ bool CZMQNotificationInterface::Initialize()
         return false;
     }
 
+    nMaxQueue = std::max((int64_t)GetArg("-zmqqueuesize", DEFAULT_ZMQ_QUEUE_SIZE), (int64_t)1);
+    fStop = false;
+    threadPublish = boost::thread(boost::bind(&CZMQNotificationInterface::ThreadPublish, this));
+
     return true;
 }
 
@@ -112,6 +132,15 @@ bool CZMQNotificationInterface::Initialize()
 void CZMQNotificationInterface::Shutdown()
 {
     LogPrint("zmq", "zmq: Shutdown notification interface\n");
+    if (threadPublish.joinable())
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        cond.notify_all();
+        threadPublish.join();
+    }
     if (pcontext)
     {
         for (std::list<CZMQAbstractNotifier*>::iterator i=notifiers.begin(); i!=notifiers.end(); ++i)
@@ -126,30 +155,65 @@ void CZMQNotificationInterface::Shutdown()
     }
 }
 
-void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex)
+void CZMQNotificationInterface::Enqueue(CZMQNotification::Kind kind, const CBlockIndex* pindex, const CTransaction* ptx, const char* pch, size_t nSize)
 {
-    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
     {
-        CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyBlock(pindex))
-        {
-            i++;
-        }
-        else
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (queue.size() >= nMaxQueue)
         {
-            notifier->Shutdown();
-            i = notifiers.erase(i);
+            // Leave the gap after the last event that will be published
+            queue.back().nDroppedAfter[kind]++;
+            LogPrint("zmq", "zmq: Queue full, dropped a notification\n");
+            return;
         }
+        queue.push_back(CZMQNotification());
+        CZMQNotification& notification = queue.back();
+        notification.kind = kind;
+        notification.pindex = pindex;
+        if (ptx)
+            notification.tx = *ptx;
+        if (pch)
+            notification.vchData.assign(pch, pch + nSize);
+        for (int k = 0; k < CZMQNotification::KINDS; k++)
+            notification.nDroppedAfter[k] = 0;
     }
+    cond.notify_one();
 }
 
-void CZMQNotificationInterface::SyncTransaction(const CTransaction &tx, const CBlock *pblock)
+void CZMQNotificationInterface::Publish(const CZMQNotification& notification)
 {
     for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
     {
         CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyTransaction(tx))
+        bool fOk = true;
+        switch (notification.kind)
+        {
+        case CZMQNotification::BLOCK:
+            // Transactions notified before the block go out before it
+            fOk = notifier->Flush() && notifier->NotifyBlock(notification.pindex);
+            break;
+        case CZMQNotification::TRANSACTION:
+            fOk = notifier->NotifyTransaction(notification.tx);
+            break;
+        case CZMQNotification::TRANSACTIONLOCK:
+            fOk = notifier->NotifyTransactionLock(notification.tx);
+            break;
+        default:
+            fOk = notifier->NotifyMasternodeMessage(masternodeTopics[notification.kind - CZMQNotification::MASTERNODEBROADCAST].topic,
+                &notification.vchData[0], notification.vchData.size());
+            break;
+        }
+        if (fOk)
         {
+            if (notification.nDroppedAfter[CZMQNotification::BLOCK])
+                notifier->SkipBlocks(notification.nDroppedAfter[CZMQNotification::BLOCK]);
+            if (notification.nDroppedAfter[CZMQNotification::TRANSACTION])
+                notifier->SkipTransactions(notification.nDroppedAfter[CZMQNotification::TRANSACTION]);
+            if (notification.nDroppedAfter[CZMQNotification::TRANSACTIONLOCK])
+                notifier->SkipTransactionLocks(notification.nDroppedAfter[CZMQNotification::TRANSACTIONLOCK]);
+            for (unsigned int t = 0; t < ARRAYLEN(masternodeTopics); t++)
+                if (notification.nDroppedAfter[masternodeTopics[t].kind])
+                    notifier->SkipMasternodeMessages(masternodeTopics[t].topic, notification.nDroppedAfter[masternodeTopics[t].kind]);
             i++;
         }
         else
@@ -160,19 +224,56 @@ void CZMQNotificationInterface::SyncTransaction(const CTransaction &tx, const CB
     }
 }
 
-void CZMQNotificationInterface::NotifyTransactionLock(const CTransaction &tx)
+void CZMQNotificationInterface::ThreadPublish()
 {
-    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    RenameThread("dystem-zmqpub");
+    while (true)
     {
-        CZMQAbstractNotifier *notifier = *i;
-        if (notifier->NotifyTransactionLock(tx))
+        CZMQNotification notification;
         {
-            i++;
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (queue.empty())
+            {
+                // Batches go out whenever the publisher catches up
+                lock.unlock();
+                for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); ++i)
+                    (*i)->Flush();
+                lock.lock();
+                while (queue.empty() && !fStop)
+                    cond.wait(lock);
+                if (queue.empty())
+                    break;
+            }
+            notification = queue.front();
+            queue.pop_front();
         }
-        else
+        Publish(notification);
+    }
+}
+
+void CZMQNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindex)
+{
+    Enqueue(CZMQNotification::BLOCK, pindex, NULL);
+}
+
+void CZMQNotificationInterface::SyncTransaction(const CTransaction &tx, const CBlock *pblock)
+{
+    Enqueue(CZMQNotification::TRANSACTION, NULL, &tx);
+}
+
+void CZMQNotificationInterface::NotifyTransactionLock(const CTransaction &tx)
+{
+    Enqueue(CZMQNotification::TRANSACTIONLOCK, NULL, &tx);
+}
+
+void CZMQNotificationInterface::NotifyMasternodeMessage(const std::string &strTopic, const char *pch, size_t nSize)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(masternodeTopics); i++)
+    {
+        if (strTopic == masternodeTopics[i].topic)
         {
-            notifier->Shutdown();
-            i = notifiers.erase(i);
+            Enqueue(masternodeTopics[i].kind, NULL, NULL, pch, nSize);
+            return;
         }
     }
 }
@@ -5,13 +5,57 @@
 #ifndef BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 #define BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 
+#include "primitives/transaction.h"
 #include "validationinterface.h"
+#include <deque>
+#include <list>
 #include <string>
 #include <map>
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
 class CBlockIndex;
 class CZMQAbstractNotifier;
 
+//! Default for -zmqqueuesize, notifications waiting for the publisher thread
+static const int DEFAULT_ZMQ_QUEUE_SIZE = 10000;
+//! Default for -zmqpubhwm, messages a socket holds for a slow subscriber before dropping
+static const int DEFAULT_ZMQ_SNDHWM = 1000;
+//! Default for -zmqtxbatchsize, transaction hashes in one hashtxbatch message
+static const int DEFAULT_ZMQ_TX_BATCH_SIZE = 100;
+
+/** A validation event waiting to be published */
+struct CZMQNotification {
+    enum Kind {
+        BLOCK,
+        TRANSACTION,
+        TRANSACTIONLOCK,
+        MASTERNODEBROADCAST,
+        MASTERNODEWINNER,
+        BUDGETVOTE,
+        FINALIZEDBUDGET,
+        KINDS
+    };
+
+    Kind kind;
+    const CBlockIndex* pindex;
+    CTransaction tx;
+    //! Network serialization of a masternode or budget object
+    std::vector<char> vchData;
+    //! Events of each kind dropped after this one because the queue was full
+    unsigned int nDroppedAfter[KINDS];
+};
+
+/**
+ * Publishes validation events on ZMQ sockets from a thread of its own.
+ *
+ * The validation signals only queue the event, so reading a block from disk,
+ * serializing and sending never delay ConnectTip. Once -zmqqueuesize events
+ * wait, new ones are dropped; the notifiers still step their sequence
+ * numbers for them, so subscribers can see the gap.
+ */
 class CZMQNotificationInterface : public CValidationInterface
 {
 public:
@@ -27,12 +71,25 @@ protected:
     void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
     void UpdatedBlockTip(const CBlockIndex *pindex);
     void NotifyTransactionLock(const CTransaction &tx);
+    void NotifyMasternodeMessage(const std::string &strTopic, const char *pch, size_t nSize);
 
 private:
     CZMQNotificationInterface();
 
+    void Enqueue(CZMQNotification::Kind kind, const CBlockIndex* pindex, const CTransaction* ptx, const char* pch = NULL, size_t nSize = 0);
+    void Publish(const CZMQNotification& notification);
+    void ThreadPublish();
+
     void *pcontext;
+    //! Only used by the publisher thread once it runs
     std::list<CZMQAbstractNotifier*> notifiers;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<CZMQNotification> queue;
+    size_t nMaxQueue;
+    bool fStop;
+    boost::thread threadPublish;
 };
 
 #endif // BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
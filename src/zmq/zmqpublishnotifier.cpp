@@ -7,6 +7,7 @@
 #include "main.h"
 #include "util.h"
 #include "crypto/common.h"
+#include "zmqnotificationinterface.h"
 
 static std::multimap<std::string, CZMQAbstractPublishNotifier*> mapPublishNotifiers;
 
@@ -16,6 +17,7 @@ static const char *MSG_HASHTXLOCK = "hashtxlock";
 static const char *MSG_RAWBLOCK   = "rawblock";
 static const char *MSG_RAWTX      = "rawtx";
 static const char *MSG_RAWTXLOCK = "rawtxlock";
+static const char *MSG_HASHTXBATCH = "hashtxbatch";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -73,7 +75,17 @@ bool CZMQAbstractPublishNotifier::Initialize(void *pcontext)
             return false;
         }
 
-        int rc = zmq_bind(psocket, address.c_str());
+        // A subscriber that falls behind loses messages rather than growing our memory
+        int hwm = std::max((int)GetArg("-zmqpubhwm", DEFAULT_ZMQ_SNDHWM), 0);
+        int rc = zmq_setsockopt(psocket, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+        if (rc!=0)
+        {
+            zmqError("Failed to set outbound message high water mark");
+            zmq_close(psocket);
+            return false;
+        }
+
+        rc = zmq_bind(psocket, address.c_str());
         if (rc!=0)
         {
             zmqError("Failed to bind address");
@@ -177,22 +189,21 @@ bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
 {
     LogPrint("zmq", "zmq: Publish rawblock %s\n", pindex->GetBlockHash().GetHex());
 
-// XX42    const Consensus::Params& consensusParams = Params().GetConsensus();
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    CDiskBlockPos pos;
     {
         LOCK(cs_main);
-        CBlock block;
-// XX42        if(!ReadBlockFromDisk(block, pindex, consensusParams))
-        if(!ReadBlockFromDisk(block, pindex))
-        {
-            zmqError("Can't read block from disk");
-            return false;
-        }
+        pos = pindex->GetBlockPos();
+    }
 
-        ss << block;
+    // The block is stored in its network serialization, send it as it is
+    std::vector<char> vchBlock;
+    if(!ReadRawBlockFromDisk(vchBlock, pos))
+    {
+        zmqError("Can't read block from disk");
+        return false;
     }
 
-    return SendMessage(MSG_RAWBLOCK, &(*ss.begin()), ss.size());
+    return SendMessage(MSG_RAWBLOCK, &vchBlock[0], vchBlock.size());
 }
 
 bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &transaction)
@@ -212,3 +223,50 @@ bool CZMQPublishRawTransactionLockNotifier::NotifyTransactionLock(const CTransac
     ss << transaction;
     return SendMessage(MSG_RAWTXLOCK, &(*ss.begin()), ss.size());
 }
+
+bool CZMQPublishRawMasternodeNotifier::NotifyMasternodeMessage(const std::string &strTopic, const char *pch, size_t nSize)
+{
+    if (type.compare(3, std::string::npos, strTopic) != 0)
+        return true;
+    LogPrint("zmq", "zmq: Publish %s of %u bytes\n", strTopic, nSize);
+    return SendMessage(strTopic.c_str(), pch, nSize);
+}
+
+void CZMQPublishRawMasternodeNotifier::SkipMasternodeMessages(const std::string &strTopic, unsigned int nCount)
+{
+    if (type.compare(3, std::string::npos, strTopic) == 0)
+        SkipMessages(nCount);
+}
+
+CZMQPublishHashTransactionBatchNotifier::CZMQPublishHashTransactionBatchNotifier()
+{
+    nBatchSize = std::max((int)GetArg("-zmqtxbatchsize", DEFAULT_ZMQ_TX_BATCH_SIZE), 1);
+    vchBatch.reserve(nBatchSize * 32);
+}
+
+bool CZMQPublishHashTransactionBatchNotifier::NotifyTransaction(const CTransaction &transaction)
+{
+    uint256 hash = transaction.GetHash();
+    for (unsigned int i = 0; i < 32; i++)
+        vchBatch.push_back(hash.begin()[31 - i]);
+    if (vchBatch.size() >= nBatchSize * 32)
+        return Flush();
+    return true;
+}
+
+void CZMQPublishHashTransactionBatchNotifier::SkipTransactions(unsigned int nCount)
+{
+    // The batch before the gap goes out on its own, then one number stands for the dropped ones
+    Flush();
+    SkipMessages(1);
+}
+
+bool CZMQPublishHashTransactionBatchNotifier::Flush()
+{
+    if (vchBatch.empty())
+        return true;
+    LogPrint("zmq", "zmq: Publish hashtxbatch of %u\n", vchBatch.size() / 32);
+    bool ret = SendMessage(MSG_HASHTXBATCH, &vchBatch[0], vchBatch.size());
+    vchBatch.clear();
+    return ret;
+}
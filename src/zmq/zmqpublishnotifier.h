@@ -7,6 +7,8 @@
 
 #include "zmqabstractnotifier.h"
 
+#include <vector>
+
 class CBlockIndex;
 
 class CZMQAbstractPublishNotifier : public CZMQAbstractNotifier
@@ -15,6 +17,7 @@ private:
     uint32_t nSequence; // upcounting per message sequence number
 
 public:
+    CZMQAbstractPublishNotifier() : nSequence(0) {}
 
     /* send zmq multipart message
        parts:
@@ -23,6 +26,8 @@ public:
           * message sequence number
     */
     bool SendMessage(const char *command, const void* data, size_t size);
+    /* step the sequence number over messages that were never sent */
+    void SkipMessages(unsigned int nCount) { nSequence += nCount; }
 
     bool Initialize(void *pcontext);
     void Shutdown();
@@ -32,36 +37,65 @@ class CZMQPublishHashBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
     bool NotifyBlock(const CBlockIndex *pindex);
+    void SkipBlocks(unsigned int nCount) { SkipMessages(nCount); }
 };
 
 class CZMQPublishHashTransactionNotifier : public CZMQAbstractPublishNotifier
 {
 public:
     bool NotifyTransaction(const CTransaction &transaction);
+    void SkipTransactions(unsigned int nCount) { SkipMessages(nCount); }
 };
 
 class CZMQPublishHashTransactionLockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
     bool NotifyTransactionLock(const CTransaction &transaction);
+    void SkipTransactionLocks(unsigned int nCount) { SkipMessages(nCount); }
 };
 
 class CZMQPublishRawBlockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
     bool NotifyBlock(const CBlockIndex *pindex);
+    void SkipBlocks(unsigned int nCount) { SkipMessages(nCount); }
 };
 
 class CZMQPublishRawTransactionNotifier : public CZMQAbstractPublishNotifier
 {
 public:
     bool NotifyTransaction(const CTransaction &transaction);
+    void SkipTransactions(unsigned int nCount) { SkipMessages(nCount); }
 };
 
 class CZMQPublishRawTransactionLockNotifier : public CZMQAbstractPublishNotifier
 {
 public:
     bool NotifyTransactionLock(const CTransaction &transaction);
+    void SkipTransactionLocks(unsigned int nCount) { SkipMessages(nCount); }
+};
+
+/** Masternode and budget objects of the topic named by the type, pubrawmnb publishing rawmnb and so on */
+class CZMQPublishRawMasternodeNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyMasternodeMessage(const std::string &strTopic, const char *pch, size_t nSize);
+    void SkipMasternodeMessages(const std::string &strTopic, unsigned int nCount);
+};
+
+/** Hashes of up to -zmqtxbatchsize transactions in one message, concatenated */
+class CZMQPublishHashTransactionBatchNotifier : public CZMQAbstractPublishNotifier
+{
+private:
+    std::vector<char> vchBatch;
+    size_t nBatchSize;
+
+public:
+    CZMQPublishHashTransactionBatchNotifier();
+
+    bool NotifyTransaction(const CTransaction &transaction);
+    void SkipTransactions(unsigned int nCount);
+    bool Flush();
 };
 
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H